@@ -38,10 +38,16 @@ else
     LDD=ldd
 fi
 
-TEMP=`getopt -o v: --long headers:,libs:,cc:,cxx:,with-glog,with-thrift,with-mesalink,nodebugsymbols -n 'config_brpc' -- "$@"`
+TEMP=`getopt -o v: --long headers:,libs:,cc:,cxx:,with-glog,with-thrift,with-mesalink,with-lz4,with-zstd,with-brotli,with-usdt,with-rdma,protocols:,nodebugsymbols -n 'config_brpc' -- "$@"`
 WITH_GLOG=0
 WITH_THRIFT=0
 WITH_MESALINK=0
+WITH_LZ4=0
+WITH_ZSTD=0
+WITH_BROTLI=0
+WITH_USDT=0
+WITH_RDMA=0
+PROTOCOLS=
 DEBUGSYMBOLS=-g
 
 if [ $? != 0 ] ; then >&2 $ECHO "Terminating..."; exit 1 ; fi
@@ -65,6 +71,12 @@ while true; do
         --with-glog ) WITH_GLOG=1; shift 1 ;;
         --with-thrift) WITH_THRIFT=1; shift 1 ;;
         --with-mesalink) WITH_MESALINK=1; shift 1 ;;
+        --with-lz4) WITH_LZ4=1; shift 1 ;;
+        --with-zstd) WITH_ZSTD=1; shift 1 ;;
+        --with-brotli) WITH_BROTLI=1; shift 1 ;;
+        --with-usdt) WITH_USDT=1; shift 1 ;;
+        --with-rdma) WITH_RDMA=1; shift 1 ;;
+        --protocols ) PROTOCOLS=$2; shift 2 ;;
         --nodebugsymbols ) DEBUGSYMBOLS=; shift 1 ;;
         -- ) shift; break ;;
         * ) break ;;
@@ -345,6 +357,73 @@ if [ $WITH_MESALINK != 0 ]; then
     CPPFLAGS="${CPPFLAGS} -DUSE_MESALINK"
 fi
 
+if [ $WITH_LZ4 != 0 ]; then
+    LZ4_LIB=$(find_dir_of_lib_or_die lz4)
+    LZ4_HDR=$(find_dir_of_header_or_die lz4frame.h)
+    append_to_output_libs "$LZ4_LIB"
+    append_to_output_headers "$LZ4_HDR"
+    CPPFLAGS="${CPPFLAGS} -DBRPC_WITH_LZ4"
+    if [ -f "$LZ4_LIB/liblz4.$SO" ]; then
+        append_to_output "DYNAMIC_LINKINGS+=-llz4"
+    else
+        append_to_output "STATIC_LINKINGS+=-llz4"
+    fi
+fi
+
+if [ $WITH_ZSTD != 0 ]; then
+    ZSTD_LIB=$(find_dir_of_lib_or_die zstd)
+    ZSTD_HDR=$(find_dir_of_header_or_die zstd.h)
+    append_to_output_libs "$ZSTD_LIB"
+    append_to_output_headers "$ZSTD_HDR"
+    CPPFLAGS="${CPPFLAGS} -DBRPC_WITH_ZSTD"
+    if [ -f "$ZSTD_LIB/libzstd.$SO" ]; then
+        append_to_output "DYNAMIC_LINKINGS+=-lzstd"
+    else
+        append_to_output "STATIC_LINKINGS+=-lzstd"
+    fi
+fi
+
+if [ $WITH_BROTLI != 0 ]; then
+    BROTLI_LIB=$(find_dir_of_lib_or_die brotlienc)
+    BROTLI_HDR=$(find_dir_of_header_or_die brotli/encode.h)
+    append_to_output_libs "$BROTLI_LIB"
+    append_to_output_headers "$BROTLI_HDR"
+    CPPFLAGS="${CPPFLAGS} -DBRPC_WITH_BROTLI"
+    if [ -f "$BROTLI_LIB/libbrotlienc.$SO" ]; then
+        append_to_output "DYNAMIC_LINKINGS+=-lbrotlienc -lbrotlidec"
+    else
+        append_to_output "STATIC_LINKINGS+=-lbrotlienc -lbrotlidec"
+    fi
+fi
+
+if [ $WITH_USDT != 0 ]; then
+    SDT_HDR=$(find_dir_of_header_or_die sys/sdt.h)
+    append_to_output_headers "$SDT_HDR"
+    CPPFLAGS="${CPPFLAGS} -DBRPC_WITH_USDT"
+fi
+
+# libibverbs is loaded by dlopen() at runtime, only the header is needed.
+if [ $WITH_RDMA != 0 ]; then
+    IBVERBS_HDR=$(find_dir_of_header_or_die infiniband/verbs.h)
+    append_to_output_headers "$IBVERBS_HDR"
+    CPPFLAGS="${CPPFLAGS} -DBRPC_WITH_RDMA"
+fi
+
+# --protocols=baidu_std,http,... registers only the listed protocols.
+if [ ! -z "$PROTOCOLS" ]; then
+    SELECTED=",$(echo $PROTOCOLS | tr 'A-Z' 'a-z' | tr -d ' '),"
+    for P in baidu_std streaming_rpc http h2 hulu_pbrpc nova_pbrpc public_pbrpc sofa_pbrpc nshead memcache redis mongo ubrpc_compack ubrpc_mcpack2 nshead_mcpack rtmp esp; do
+        case "$SELECTED" in
+            *,$P,*) ;;
+            *) CPPFLAGS="${CPPFLAGS} -DBRPC_WITHOUT_PROTOCOL_$(echo $P | tr 'a-z' 'A-Z')" ;;
+        esac
+    done
+    # Functions of baidu_std are called directly when it's the only one.
+    case "$(echo $SELECTED | sed 's/,streaming_rpc,/,/g')" in
+        ,baidu_std,) CPPFLAGS="${CPPFLAGS} -DBRPC_INLINE_BAIDU_STD" ;;
+    esac
+fi
+
 append_to_output "CPPFLAGS=${CPPFLAGS}"
 
 append_to_output "ifeq (\$(NEED_LIBPROTOC), 1)"
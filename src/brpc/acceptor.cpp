@@ -17,6 +17,9 @@
 
 
 #include <inttypes.h>
+#include <unistd.h>                         // close
+#include <sys/socket.h>                     // accept4
+#include <algorithm>                        // std::find
 #include <gflags/gflags.h>
 #include "butil/fd_guard.h"                 // fd_guard 
 #include "butil/fd_utility.h"               // make_close_on_exec
@@ -28,14 +31,18 @@ namespace brpc {
 
 static const int INITIAL_CONNECTION_CAP = 65536;
 
-Acceptor::Acceptor(bthread_keytable_pool_t* pool)
+Acceptor::Acceptor(bthread_keytable_pool_t* pool, bthread_tag_t bthread_tag)
     : InputMessenger()
     , _keytable_pool(pool)
+    , _bthread_tag(bthread_tag)
+    , _nshard(0)
+    , _shm_transport(false)
+    , _use_rdma(false)
     , _status(UNINITIALIZED)
     , _idle_timeout_sec(-1)
     , _close_idle_tid(INVALID_BTHREAD)
     , _listened_fd(-1)
-    , _acception_id(0)
+    , _nacception(0)
     , _empty_cond(&_map_mutex)
     , _ssl_ctx(NULL) {
 }
@@ -45,14 +52,8 @@ Acceptor::~Acceptor() {
     Join();
 }
 
-int Acceptor::StartAccept(int listened_fd, int idle_timeout_sec,
-                          const std::shared_ptr<SocketSSLContext>& ssl_ctx) {
-    if (listened_fd < 0) {
-        LOG(FATAL) << "Invalid listened_fd=" << listened_fd;
-        return -1;
-    }
-    
-    BAIDU_SCOPED_LOCK(_map_mutex);
+int Acceptor::BeforeStartAcceptLocked(
+    int idle_timeout_sec, const std::shared_ptr<SocketSSLContext>& ssl_ctx) {
     if (_status == UNINITIALIZED) {
         if (Initialize() != 0) {
             LOG(FATAL) << "Fail to initialize Acceptor";
@@ -73,24 +74,93 @@ int Acceptor::StartAccept(int listened_fd, int idle_timeout_sec,
     }
     _idle_timeout_sec = idle_timeout_sec;
     _ssl_ctx = ssl_ctx;
-    
-    // Creation of _acception_id is inside lock so that OnNewConnections
-    // (which may run immediately) should see sane fields set below.
+    _acception_ids.clear();
+    _nacception = 0;
+    return 0;
+}
+
+int Acceptor::AddAcceptionLocked(int listened_fd, int event_dispatcher_index) {
+    // Creation of acceptions is inside lock so that OnNewConnections
+    // (which may run immediately) should see sane fields set before.
     SocketOptions options;
     options.fd = listened_fd;
     options.user = this;
     options.on_edge_triggered_events = OnNewConnections;
-    if (Socket::Create(options, &_acception_id) != 0) {
+    options.event_dispatcher_index = event_dispatcher_index;
+    options.bthread_tag = _bthread_tag;
+    if (_nshard > 0 && event_dispatcher_index >= 0) {
+        options.bthread_tag += event_dispatcher_index % _nshard;
+    }
+    SocketId acception_id;
+    if (Socket::Create(options, &acception_id) != 0) {
         // Close-idle-socket thread will be stopped inside destructor
-        LOG(FATAL) << "Fail to create _acception_id";
+        LOG(FATAL) << "Fail to create acception of fd=" << listened_fd;
+        return -1;
+    }
+    _acception_ids.push_back(acception_id);
+    ++_nacception;
+    return 0;
+}
+
+int Acceptor::StartAccept(int listened_fd, int idle_timeout_sec,
+                          const std::shared_ptr<SocketSSLContext>& ssl_ctx) {
+    if (listened_fd < 0) {
+        LOG(FATAL) << "Invalid listened_fd=" << listened_fd;
         return -1;
     }
     
+    BAIDU_SCOPED_LOCK(_map_mutex);
+    if (BeforeStartAcceptLocked(idle_timeout_sec, ssl_ctx) != 0) {
+        return -1;
+    }
+    if (AddAcceptionLocked(listened_fd, -1) != 0) {
+        return -1;
+    }
     _listened_fd = listened_fd;
     _status = RUNNING;
     return 0;
 }
 
+int Acceptor::StartAccept(const std::vector<int>& listened_fds,
+                          int idle_timeout_sec,
+                          const std::shared_ptr<SocketSSLContext>& ssl_ctx) {
+    size_t ntaken = 0;
+    int rc = -1;
+    {
+        BAIDU_SCOPED_LOCK(_map_mutex);
+        if (listened_fds.empty() || listened_fds[0] < 0) {
+            LOG(FATAL) << "Invalid listened_fds";
+        } else if (BeforeStartAcceptLocked(idle_timeout_sec, ssl_ctx) == 0) {
+            for (; ntaken < listened_fds.size(); ++ntaken) {
+                if (listened_fds[ntaken] < 0 ||
+                    AddAcceptionLocked(listened_fds[ntaken], ntaken) != 0) {
+                    break;
+                }
+            }
+            if (ntaken > 0) {
+                // Set RUNNING even if some fds failed so that StopAccept()
+                // and Join() wait for the acceptions being recycled.
+                _listened_fd = listened_fds[0];
+                _status = RUNNING;
+            }
+            if (ntaken == listened_fds.size()) {
+                rc = 0;
+            }
+        }
+    }
+    if (rc != 0) {
+        for (size_t i = ntaken; i < listened_fds.size(); ++i) {
+            if (listened_fds[i] >= 0) {
+                close(listened_fds[i]);
+            }
+        }
+        if (ntaken > 0) {
+            StopAccept(0);
+        }
+    }
+    return rc;
+}
+
 void* Acceptor::CloseIdleConnections(void* arg) {
     Acceptor* am = static_cast<Acceptor*>(arg);
     std::vector<SocketId> checking_fds;
@@ -121,8 +191,10 @@ void Acceptor::StopAccept(int /*closewait_ms*/) {
         _status = STOPPING;
     }
 
-    // Don't set _acception_id to 0 because BeforeRecycle needs it.
-    Socket::SetFailed(_acception_id);
+    // Don't clear _acception_ids because BeforeRecycle needs it.
+    for (size_t i = 0; i < _acception_ids.size(); ++i) {
+        Socket::SetFailed(_acception_ids[i]);
+    }
 
     // SetFailed all existing connections. Connections added after this piece
     // of code will be SetFailed directly in OnNewConnectionsUntilEAGAIN
@@ -149,6 +221,20 @@ void Acceptor::StopAccept(int /*closewait_ms*/) {
     }
 }
 
+void Acceptor::ListListenedFds(std::vector<int>* fds) {
+    fds->clear();
+    BAIDU_SCOPED_LOCK(_map_mutex);
+    if (_status != RUNNING) {
+        return;
+    }
+    for (size_t i = 0; i < _acception_ids.size(); ++i) {
+        SocketUniquePtr sock;
+        if (Socket::Address(_acception_ids[i], &sock) == 0) {
+            fds->push_back(sock->fd());
+        }
+    }
+}
+
 int Acceptor::Initialize() {
     if (_socket_map.init(INITIAL_CONNECTION_CAP) != 0) {
         LOG(FATAL) << "Fail to initialize FlatMap, size="
@@ -239,10 +325,25 @@ void Acceptor::ListConnections(std::vector<SocketId>* conn_list) {
 }
 
 void Acceptor::OnNewConnectionsUntilEAGAIN(Socket* acception) {
+    Acceptor* am = dynamic_cast<Acceptor*>(acception->user());
+    if (NULL == am) {
+        LOG(FATAL) << "Impossible! acception->user() MUST be Acceptor";
+        acception->SetFailed(EINVAL, "Impossible! acception->user() MUST be Acceptor");
+        return;
+    }
     while (1) {
-        struct sockaddr in_addr;
+        struct sockaddr_storage in_addr;
         socklen_t in_len = sizeof(in_addr);
-        butil::fd_guard in_fd(accept(acception->fd(), &in_addr, &in_len));
+#if defined(OS_LINUX)
+        // Create the fd non-blocking and close-on-exec in one syscall
+        // rather than three fcntl() after accept().
+        butil::fd_guard in_fd(accept4(acception->fd(), (sockaddr*)&in_addr,
+                                      &in_len, SOCK_NONBLOCK | SOCK_CLOEXEC));
+        const bool nonblocking_cloexec = true;
+#else
+        butil::fd_guard in_fd(accept(acception->fd(), (sockaddr*)&in_addr, &in_len));
+        const bool nonblocking_cloexec = false;
+#endif
         if (in_fd < 0) {
             // no EINTR because listened fd is non-blocking.
             if (errno == EAGAIN) {
@@ -258,21 +359,26 @@ void Acceptor::OnNewConnectionsUntilEAGAIN(Socket* acception) {
             continue;
         }
 
-        Acceptor* am = dynamic_cast<Acceptor*>(acception->user());
-        if (NULL == am) {
-            LOG(FATAL) << "Impossible! acception->user() MUST be Acceptor";
-            acception->SetFailed(EINVAL, "Impossible! acception->user() MUST be Acceptor");
-            return;
-        }
-        
         SocketId socket_id;
         SocketOptions options;
         options.keytable_pool = am->_keytable_pool;
+        // Process the connection with workers of the acception, which
+        // may be specific to its dispatcher.
+        options.bthread_tag = acception->bthread_tag();
         options.fd = in_fd;
-        options.remote_side = butil::EndPoint(*(sockaddr_in*)&in_addr);
+        options.fd_nonblocking_cloexec = nonblocking_cloexec;
+        if (butil::sockaddr2endpoint(&in_addr, in_len, &options.remote_side) != 0) {
+            LOG(ERROR) << "Fail to get remote side of fd=" << in_fd;
+            continue;
+        }
         options.user = acception->user();
         options.on_edge_triggered_events = InputMessenger::OnNewMessages;
         options.initial_ssl_ctx = am->_ssl_ctx;
+        options.tuning_options = am->_tuning_options;
+        options.shm_transport = am->_shm_transport;
+        options.use_rdma = am->_use_rdma;
+        // Keep the connection in the dispatcher that accepted it.
+        options.event_dispatcher_index = acception->event_dispatcher_index();
         if (Socket::Create(options, &socket_id) != 0) {
             LOG(ERROR) << "Fail to create Socket";
             continue;
@@ -324,12 +430,15 @@ void Acceptor::OnNewConnections(Socket* acception) {
 
 void Acceptor::BeforeRecycle(Socket* sock) {
     BAIDU_SCOPED_LOCK(_map_mutex);
-    if (sock->id() == _acception_id) {
-        // Set _listened_fd to -1 when acception socket has been recycled
-        // so that we are ensured no more events will arrive (and `Join'
-        // will return to its caller)
-        _listened_fd = -1;
-        _empty_cond.Broadcast();
+    if (std::find(_acception_ids.begin(), _acception_ids.end(), sock->id())
+        != _acception_ids.end()) {
+        // Set _listened_fd to -1 when all acception sockets have been
+        // recycled so that we are ensured no more events will arrive (and
+        // `Join' will return to its caller)
+        if (--_nacception == 0) {
+            _listened_fd = -1;
+            _empty_cond.Broadcast();
+        }
         return;
     }
     // If a Socket could not be addressed shortly after its creation, it
@@ -43,7 +43,8 @@ public:
     };
 
 public:
-    explicit Acceptor(bthread_keytable_pool_t* pool = NULL);
+    explicit Acceptor(bthread_keytable_pool_t* pool = NULL,
+                      bthread_tag_t bthread_tag = BTHREAD_TAG_INVALID);
     ~Acceptor();
 
     // [thread-safe] Accept connections from `listened_fd'. Ownership of
@@ -56,6 +57,15 @@ public:
     int StartAccept(int listened_fd, int idle_timeout_sec,
                     const std::shared_ptr<SocketSSLContext>& ssl_ctx);
 
+    // [thread-safe] Accept connections from multiple fds listening to the
+    // same address (with SO_REUSEPORT). The i-th fd is watched by the i-th
+    // EventDispatcher and so are connections accepted from it.
+    // Ownership of all `listened_fds' is transferred to `Acceptor' even if
+    // this function fails.
+    // Return 0 on success, -1 otherwise.
+    int StartAccept(const std::vector<int>& listened_fds, int idle_timeout_sec,
+                    const std::shared_ptr<SocketSSLContext>& ssl_ctx);
+
     // [thread-safe] Stop accepting connections.
     // `closewait_ms' is not used anymore.
     void StopAccept(int /*closewait_ms*/);
@@ -63,9 +73,37 @@ public:
     // Wait until all existing Sockets(defined in socket.h) are recycled.
     void Join();
 
-    // The parameter to StartAccept. Negative when acceptor is stopped.
+    // Accepted connections are tuned with `tuning_options', NULL means
+    // system defaults. Must be called before StartAccept().
+    void set_tuning_options(
+        const std::shared_ptr<const SocketTuningOptions>& tuning_options) {
+        _tuning_options = tuning_options;
+    }
+
+    // If `nshard' is positive, connections accepted from the i-th fd given
+    // to StartAccept() are processed by workers with tag
+    // `bthread_tag + i % nshard' instead of `bthread_tag', so that each
+    // EventDispatcher serves its connections with its own workers.
+    // Must be called before StartAccept().
+    void set_shard_count(int nshard) { _nshard = nshard; }
+
+    // Accept the shared-memory transport on unix domain sockets, see
+    // ServerOptions.shm_transport. Must be called before StartAccept().
+    void set_shm_transport(bool shm_transport) {
+        _shm_transport = shm_transport;
+    }
+
+    // Accept RDMA on TCP connections, see ServerOptions.use_rdma.
+    // Must be called before StartAccept().
+    void set_use_rdma(bool use_rdma) { _use_rdma = use_rdma; }
+
+    // The parameter to StartAccept (the first one if there're multiple
+    // fds). Negative when acceptor is stopped.
     int listened_fd() const { return _listened_fd; }
 
+    // Get all fds accepting connections, which are still owned by Acceptor.
+    void ListListenedFds(std::vector<int>* fds);
+
     // Get number of existing connections.
     size_t ConnectionCount() const;
 
@@ -87,17 +125,32 @@ private:
     // Initialize internal structure. 
     int Initialize();
 
+    // Check status and start the close-idle thread. _map_mutex is locked.
+    int BeforeStartAcceptLocked(int idle_timeout_sec,
+                                const std::shared_ptr<SocketSSLContext>& ssl_ctx);
+
+    // Create the Socket accepting connections from `listened_fd'.
+    // _map_mutex is locked.
+    int AddAcceptionLocked(int listened_fd, int event_dispatcher_index);
+
     // Remove the accepted socket `sock' from inside
     void BeforeRecycle(Socket* sock) override;
 
     bthread_keytable_pool_t* _keytable_pool; // owned by Server
+    // Connections are accepted and processed by workers with this tag.
+    bthread_tag_t _bthread_tag;
+    int _nshard;
+    bool _shm_transport;
+    bool _use_rdma;
     Status _status;
     int _idle_timeout_sec;
     bthread_t _close_idle_tid;
 
     int _listened_fd;
-    // The Socket tso accept connections.
-    SocketId _acception_id;
+    // The Sockets to accept connections.
+    std::vector<SocketId> _acception_ids;
+    // Number of sockets in _acception_ids that are not recycled yet.
+    size_t _nacception;
 
     butil::Mutex _map_mutex;
     butil::ConditionVariable _empty_cond;
@@ -106,6 +159,7 @@ private:
     SocketMap _socket_map;
 
     std::shared_ptr<SocketSSLContext> _ssl_ctx;
+    std::shared_ptr<const SocketTuningOptions> _tuning_options;
 };
 
 } // namespace brpc
@@ -55,22 +55,35 @@ AdaptiveMaxConcurrency::AdaptiveMaxConcurrency(const butil::StringPiece& value)
     if (butil::StringToInt(value, &max_concurrency)) {
         operator=(max_concurrency);
     } else {
-        value.CopyToString(&_value);
-        _max_concurrency = -1;
+        SetUserDefined(value);
     }
 }
 
+void AdaptiveMaxConcurrency::SetUserDefined(const butil::StringPiece& value) {
+    value.CopyToString(&_value);
+    const size_t pos = value.find(':');
+    if (pos == butil::StringPiece::npos) {
+        _type = _value;
+        _params.clear();
+    } else {
+        value.substr(0, pos).CopyToString(&_type);
+        value.substr(pos + 1).CopyToString(&_params);
+    }
+    _max_concurrency = -1;
+}
+
 void AdaptiveMaxConcurrency::operator=(const butil::StringPiece& value) {
     int max_concurrency = 0;
     if (butil::StringToInt(value, &max_concurrency)) {
         return operator=(max_concurrency);
     } else {
-        value.CopyToString(&_value);
-        _max_concurrency = -1;
+        SetUserDefined(value);
     }
 }
 
 void AdaptiveMaxConcurrency::operator=(int max_concurrency) {
+    _type.clear();
+    _params.clear();
     if (max_concurrency <= 0) {
         _value = UNLIMITED();
         _max_concurrency = 0;
@@ -86,7 +99,7 @@ const std::string& AdaptiveMaxConcurrency::type() const {
     } else if (_max_concurrency == 0) {
         return UNLIMITED();
     } else {
-        return _value;
+        return _type;
     }
 }
 
@@ -53,14 +53,24 @@ public:
     const std::string& value() const { return _value; }
 
     // "unlimited", "constant" or "user-defined"
+    // Parameters after the first ':' are not included in the user-defined
+    // type, e.g. type of "gradient:20" is "gradient".
     const std::string& type() const;
 
+    // Parameters after the first ':' of the user-defined value, e.g. "20"
+    // for "gradient:20". Empty for other types.
+    const std::string& params() const { return _params; }
+
     // Get strings filled with "unlimited" and "constant"
     static const std::string& UNLIMITED();
     static const std::string& CONSTANT();
 
 private:
+    void SetUserDefined(const butil::StringPiece& value);
+
     std::string _value;
+    std::string _type;
+    std::string _params;
     int _max_concurrency;
 };
 
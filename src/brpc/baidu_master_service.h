@@ -0,0 +1,103 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_BAIDU_MASTER_SERVICE_H
+#define BRPC_BAIDU_MASTER_SERVICE_H
+
+#include "brpc/controller.h"                 // Controller
+#include "brpc/describable.h"
+#include "brpc/serialized_request.h"         // SerializedRequest
+#include "brpc/serialized_response.h"        // SerializedResponse
+
+
+namespace brpc {
+
+class MethodStatus;
+class StatusService;
+namespace policy {
+void ProcessRpcRequest(InputMessageBase* msg_base);
+}
+
+// Inherit this class and set it to ServerOptions.baidu_master_service to
+// handle baidu_std requests to methods not added into the server, without
+// parsing or serializing the messages. A typical user is a proxy relaying
+// requests to backends:
+//
+//   void ProcessRpcRequest(brpc::Controller* cntl,
+//                          const std::string& service_name,
+//                          const std::string& method_name,
+//                          const brpc::SerializedRequest* request,
+//                          brpc::SerializedResponse* response,
+//                          google::protobuf::Closure* done) {
+//       brpc::Controller* backend_cntl = new brpc::Controller;
+//       brpc::SetRawBaiduStdMethod(backend_cntl, service_name, method_name,
+//                                  cntl->request_compress_type());
+//       backend_cntl->request_attachment().swap(cntl->request_attachment());
+//       // OnBackendDone() moves the response and attachment of
+//       // backend_cntl into `response' and `cntl', then runs `done'.
+//       _channel.CallMethod(NULL, backend_cntl, request, response,
+//                           brpc::NewCallback(OnBackendDone, cntl, backend_cntl, done));
+//   }
+class BaiduMasterService : public Describable {
+public:
+    BaiduMasterService();
+    virtual ~BaiduMasterService();
+
+    // Process the request to `service_name'/`method_name'. Bytes of the
+    // request are in `request' compressed with cntl->request_compress_type()
+    // and the attachment is cntl->request_attachment(). Put bytes of the
+    // response into `response', which are sent as they are and tagged with
+    // cntl->response_compress_type(). The names are not valid after this
+    // method returns, copy them if they're used asynchronously.
+    // You must call done->Run() to send the response.
+    virtual void ProcessRpcRequest(Controller* cntl,
+                                   const std::string& service_name,
+                                   const std::string& method_name,
+                                   const SerializedRequest* request,
+                                   SerializedResponse* response,
+                                   google::protobuf::Closure* done) = 0;
+
+    // Put descriptions into the stream.
+    void Describe(std::ostream& os, const DescribeOptions&) const;
+
+private:
+DISALLOW_COPY_AND_ASSIGN(BaiduMasterService);
+friend void policy::ProcessRpcRequest(InputMessageBase* msg_base);
+friend class StatusService;
+friend class Server;
+
+    void Expose(const butil::StringPiece& prefix);
+
+    MethodStatus* _status;
+};
+
+// Let `cntl' call `service_name'/`method_name' over baidu_std with a
+// SerializedRequest whose bytes are already compressed with `compress_type',
+// e.g. to forward a request received by BaiduMasterService. Pass NULL as the
+// MethodDescriptor to Channel::CallMethod(). A SerializedResponse receives
+// the decompressed bytes of the response, or the very bytes in the
+// response without being copied if it's not compressed.
+void SetRawBaiduStdMethod(Controller* cntl,
+                          const std::string& service_name,
+                          const std::string& method_name,
+                          CompressType compress_type);
+
+} // namespace brpc
+
+
+#endif // BRPC_BAIDU_MASTER_SERVICE_H
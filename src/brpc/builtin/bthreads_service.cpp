@@ -24,6 +24,8 @@
 
 namespace bthread {
 void print_task(std::ostream& os, bthread_t tid);
+void print_stack_stats(std::ostream& os);
+void print_stuck_workers(std::ostream& os);
 }
 
 
@@ -40,7 +42,9 @@ void BthreadsService::default_method(::google::protobuf::RpcController* cntl_bas
     const std::string& constraint = cntl->http_request().unresolved_path();
     
     if (constraint.empty()) {
-        os << "Use /bthreads/<bthread_id>";
+        os << "Use /bthreads/<bthread_id>\n\n";
+        ::bthread::print_stack_stats(os);
+        ::bthread::print_stuck_workers(os);
     } else {
         char* endptr = NULL;
         bthread_t tid = strtoull(constraint.c_str(), &endptr, 10);
@@ -34,6 +34,8 @@ namespace brpc {
 
 int64_t GetChannelConnectionCount();
 
+DECLARE_bool(socket_sample_tcp_info);
+
 DEFINE_bool(show_hostname_instead_of_ip, false,
             "/connections shows hostname instead of ip");
 BRPC_VALIDATE_GFLAG(show_hostname_instead_of_ip, PassValidate);
@@ -135,6 +137,10 @@ void ConnectionsService::PrintConnections(
             "<th>OutBytes/m</th>"
             "<th>Out/m</th>"
             "<th>Rtt/Var(ms)</th>"
+            "<th>Retrans/s</th>"
+            "<th>Cwnd</th>"
+            "<th>Unacked</th>"
+            "<th>DeliveryRate(B/s)</th>"
             "<th>SocketId</th>"
             "</tr>\n";
     } else {
@@ -145,7 +151,8 @@ void ConnectionsService::PrintConnections(
         os << "SSL|Protocol    |fd   |"
             "InBytes/s|In/s  |InBytes/m |In/m    |"
             "OutBytes/s|Out/s |OutBytes/m|Out/m   |"
-            "Rtt/Var(ms)|SocketId\n";
+            "Rtt/Var(ms)|Retrans/s|Cwnd  |Unacked|DeliveryRate(B/s)|"
+            "SocketId\n";
     }
 
     const char* const bar = (use_html ? "</td><td>" : "|");
@@ -191,7 +198,11 @@ void ConnectionsService::PrintConnections(
                << min_width("-", 6) << bar
                << min_width("-", 10) << bar
                << min_width("-", 8) << bar
-               << min_width("-", 11) << bar;
+               << min_width("-", 11) << bar
+               << min_width("-", 9) << bar
+               << min_width("-", 6) << bar
+               << min_width("-", 7) << bar
+               << min_width("-", 17) << bar;
         } else {
             {
                 SocketUniquePtr agent_sock;
@@ -309,6 +320,18 @@ void ConnectionsService::PrintConnections(
                << min_width(stat.out_size_m, 10) << bar
                << min_width(stat.out_num_messages_m, 8) << bar
                << min_width(rtt_display, 11) << bar;
+            // Sampled by Socket::UpdateStatsEverySecond
+            if (FLAGS_socket_sample_tcp_info) {
+                os << min_width(stat.tcp_retrans_s, 9) << bar
+                   << min_width(stat.tcp_snd_cwnd, 6) << bar
+                   << min_width(stat.tcp_unacked, 7) << bar
+                   << min_width(stat.tcp_delivery_rate, 17) << bar;
+            } else {
+                os << min_width("-", 9) << bar
+                   << min_width("-", 6) << bar
+                   << min_width("-", 7) << bar
+                   << min_width("-", 17) << bar;
+            }
         }
 
         if (use_html) {
@@ -17,12 +17,20 @@
 
 
 #include <stdio.h>
+#include <inttypes.h>
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <set>
 #include <thread>
 #include <gflags/gflags.h>
 #include "butil/files/file_enumerator.h"
 #include "butil/file_util.h"                     // butil::FilePath
 #include "butil/popen.h"                         // butil::read_command_output
 #include "butil/fd_guard.h"                      // butil::fd_guard
+#if defined(USE_SYMBOLIZE)
+#include "butil/third_party/symbolize/symbolize.h"
+#endif
 #include "brpc/log.h"
 #include "brpc/controller.h"
 #include "brpc/server.h"
@@ -30,6 +38,7 @@
 #include "brpc/builtin/pprof_perl.h"
 #include "brpc/builtin/hotspots_service.h"
 #include "brpc/details/tcmalloc_extension.h"
+#include "brpc/details/continuous_profiler.h"
 
 extern "C" {
 int __attribute__((weak)) ProfilerStart(const char* fname);
@@ -39,9 +48,16 @@ void __attribute__((weak)) ProfilerStop();
 namespace bthread {
 bool ContentionProfilerStart(const char* filename);
 void ContentionProfilerStop();
+bool OffCpuProfilerStart(const char* filename);
+void OffCpuProfilerStop();
 }
 
 namespace brpc {
+
+DECLARE_bool(continuous_cpu_profiling);
+DECLARE_int32(continuous_cpu_profiling_hz);
+DECLARE_int32(continuous_cpu_profiling_minutes);
+
 enum class DisplayType{
     kUnknown,
     kDot,
@@ -110,7 +126,7 @@ DEFINE_int32(max_profiling_seconds, 300, "upper limit of running time of profile
 BRPC_VALIDATE_GFLAG(max_profiling_seconds, NonNegativeInteger);
 
 DEFINE_int32(max_profiles_kept, 32,
-             "max profiles kept for cpu/heap/growth/contention respectively");
+             "max profiles kept for cpu/heap/growth/contention/offcpu respectively");
 BRPC_VALIDATE_GFLAG(max_profiles_kept, PassValidate);
 
 static const char* const PPROF_FILENAME = "pprof.pl";
@@ -151,13 +167,25 @@ struct ProfilingEnvironment {
 };
 
 // Different ProfilingType have different env.
-static ProfilingEnvironment g_env[4] = {
+static ProfilingEnvironment g_env[5] = {
+    { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL },
     { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, NULL }
 };
 
+// Profilers sampling for `seconds' after being started.
+static bool IsTimedProfiling(ProfilingType type) {
+    return type == PROFILING_CPU || type == PROFILING_CONTENTION ||
+        type == PROFILING_OFFCPU;
+}
+
+// Profiles in the format of contention, whose counts are meaningful.
+static bool IsWaitProfiling(ProfilingType type) {
+    return type == PROFILING_CONTENTION || type == PROFILING_OFFCPU;
+}
+
 // The `content' should be small so that it can be written into file in one
 // fwrite (at most time).
 static bool WriteSmallFile(const char* filepath_in,
@@ -637,7 +665,7 @@ static void DoProfiling(ProfilingType type,
     }
 
     const int seconds = ReadSeconds(cntl);
-    if ((type == PROFILING_CPU || type == PROFILING_CONTENTION)) {
+    if (IsTimedProfiling(type)) {
         if (seconds < 0) {
             os << "Invalid seconds" << (use_html ? "</body></html>" : "\n");
             os.move_to(cntl->response_attachment());
@@ -655,7 +683,7 @@ static void DoProfiling(ProfilingType type,
         client_info << "(no auth)";
     }
     client_info << " requests for profiling " << ProfilingType2String(type);
-    if (type == PROFILING_CPU || type == PROFILING_CONTENTION) {
+    if (IsTimedProfiling(type)) {
         LOG(INFO) << client_info.str() << " for " << seconds << " seconds";
     } else {
         LOG(INFO) << client_info.str();
@@ -769,6 +797,18 @@ static void DoProfiling(ProfilingType type,
             PLOG(WARNING) << "Profiling has been interrupted";
         }
         bthread::ContentionProfilerStop();
+    } else if (type == PROFILING_OFFCPU) {
+        if (!bthread::OffCpuProfilerStart(prof_name)) {
+            os << "Another profiler (not via /hotspots/offcpu) is running, "
+                "try again later" << (use_html ? "</body></html>" : "\n");
+            os.move_to(resp);
+            cntl->http_response().set_status_code(HTTP_STATUS_SERVICE_UNAVAILABLE);
+            return NotifyWaiters(type, cntl, view);
+        }
+        if (bthread_usleep(seconds * 1000000L) != 0) {
+            PLOG(WARNING) << "Profiling has been interrupted";
+        }
+        bthread::OffCpuProfilerStop();
     } else if (type == PROFILING_HEAP) {
         MallocExtension* malloc_ext = MallocExtension::instance();
         if (malloc_ext == NULL || !has_TCMALLOC_SAMPLE_PARAMETER()) {
@@ -842,7 +882,7 @@ static void StartProfiling(ProfilingType type,
     const char* extra_desc = "";
     if (type == PROFILING_CPU) {
         enabled = cpu_profiler_enabled;
-    } else if (type == PROFILING_CONTENTION) {
+    } else if (IsWaitProfiling(type)) {
         enabled = true;
     } else if (type == PROFILING_HEAP) {
         enabled = IsHeapProfilerEnabled();
@@ -921,7 +961,7 @@ static void StartProfiling(ProfilingType type,
         "  var past_prof = document.getElementById('view_prof').value;\n"
         "  var base_prof = document.getElementById('base_prof').value;\n"
         "  var display_type = document.getElementById('display_type').value;\n";
-    if (type == PROFILING_CONTENTION) {
+    if (IsWaitProfiling(type)) {
         os << "  var show_ccount = document.getElementById('ccount_cb').checked;\n";
     }
     os << "  var targetURL = '/hotspots/" << type_str << "';\n"
@@ -932,7 +972,7 @@ static void StartProfiling(ProfilingType type,
         "  if (base_prof != '') {\n"
         "    targetURL += '&base=' + base_prof;\n"
         "  }\n";
-    if (type == PROFILING_CONTENTION) {
+    if (IsWaitProfiling(type)) {
         os <<
         "  if (show_ccount) {\n"
         "    targetURL += '&ccount';\n"
@@ -985,7 +1025,7 @@ static void StartProfiling(ProfilingType type,
         "  }\n"
         "  $.ajax({\n"
         "    url: \"/hotspots/" << type_str << "_non_responsive?console=1";
-    if (type == PROFILING_CPU || type == PROFILING_CONTENTION) {
+    if (IsTimedProfiling(type)) {
         os << "&seconds=" << seconds;
     }
     if (profiling_client.id != 0) {
@@ -1080,7 +1120,7 @@ static void StartProfiling(ProfilingType type,
         "<option value=flame" << (display_type == DisplayType::kFlameGraph ? " selected" : "") << ">flame</option>"
 #endif
         "<option value=text" << (display_type == DisplayType::kText ? " selected" : "") << ">text</option></select>";
-    if (type == PROFILING_CONTENTION) {
+    if (IsWaitProfiling(type)) {
         os << "&nbsp;&nbsp;&nbsp;<label for='ccount_cb'>"
             "<input id='ccount_cb' type='checkbox'"
            << (show_ccount ? " checked=''" : "") <<
@@ -1110,7 +1150,7 @@ static void StartProfiling(ProfilingType type,
         return;
     }
 
-    if ((type == PROFILING_CPU || type == PROFILING_CONTENTION) && view == NULL) {
+    if (IsTimedProfiling(type) && view == NULL) {
         if (seconds < 0) {
             os << "Invalid seconds</body></html>";
             os.move_to(cntl->response_attachment());
@@ -1134,11 +1174,11 @@ static void StartProfiling(ProfilingType type,
                       / 1000000.0);
         os << "Your request is merged with the request from "
            << profiling_client.point;
-        if (type == PROFILING_CPU || type == PROFILING_CONTENTION) {
+        if (IsTimedProfiling(type)) {
             os << ", showing in about " << wait_seconds << " seconds ...";
         }
     } else {
-        if ((type == PROFILING_CPU || type == PROFILING_CONTENTION) && view == NULL) {
+        if (IsTimedProfiling(type) && view == NULL) {
             os << "Profiling " << ProfilingType2String(type) << " for "
                << seconds << " seconds ...";
         } else {
@@ -1188,6 +1228,14 @@ void HotspotsService::contention(
     return StartProfiling(PROFILING_CONTENTION, cntl_base, done);
 }
 
+void HotspotsService::offcpu(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::HotspotsRequest*,
+    ::brpc::HotspotsResponse*,
+    ::google::protobuf::Closure* done) {
+    return StartProfiling(PROFILING_OFFCPU, cntl_base, done);
+}
+
 void HotspotsService::cpu_non_responsive(
     ::google::protobuf::RpcController* cntl_base,
     const ::brpc::HotspotsRequest*,
@@ -1220,6 +1268,320 @@ void HotspotsService::contention_non_responsive(
     return DoProfiling(PROFILING_CONTENTION, cntl_base, done);
 }
 
+void HotspotsService::offcpu_non_responsive(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::HotspotsRequest*,
+    ::brpc::HotspotsResponse*,
+    ::google::protobuf::Closure* done) {
+    return DoProfiling(PROFILING_OFFCPU, cntl_base, done);
+}
+
+// Continuous cpu profile. The profile is always in memory, so it's
+// rendered as plain text directly without pprof.
+
+// Read a non-negative number of minutes, -1 on error.
+static int ReadMinutesAgo(const Controller* cntl, const char* key,
+                          int default_value) {
+    const std::string* param = cntl->http_request().uri().GetQuery(key);
+    if (param == NULL) {
+        return default_value;
+    }
+    char* endptr = NULL;
+    const long minutes = strtol(param->c_str(), &endptr, 10);
+    if (param->empty() || endptr != param->c_str() + param->length() ||
+        minutes < 0) {
+        return -1;
+    }
+    return std::min(minutes, (long)FLAGS_continuous_cpu_profiling_minutes);
+}
+
+static const std::string& SymbolizeProfiledPC(
+    void* pc, std::map<void*, std::string>* cache) {
+    std::map<void*, std::string>::iterator it = cache->find(pc);
+    if (it != cache->end()) {
+        return it->second;
+    }
+    std::string& name = (*cache)[pc];
+#if defined(USE_SYMBOLIZE) && defined(OS_LINUX)
+    char buf[1024];
+    if (google::Symbolize(pc, buf, sizeof(buf))) {
+        name = buf;
+        return name;
+    }
+#endif
+    char addr[32];
+    snprintf(addr, sizeof(addr), "%p", pc);
+    name = addr;
+    return name;
+}
+
+// Frames other than the innermost one are return addresses which point to
+// the instruction after the call, which may belong to the next function.
+static void* ProfiledPC(const ProfiledStack& s, size_t i) {
+    return i == 0 ? s.frames[0] : (char*)s.frames[i] - 1;
+}
+
+static const char* ProfiledMethodName(const ProfiledStack& s) {
+    return s.method ? s.method->full_name().c_str() : "[no method]";
+}
+
+// Counts of current range (index 0) and base range (index 1).
+struct ProfileCounters {
+    int64_t self[2];
+    int64_t total[2];
+    ProfileCounters() { self[0] = self[1] = total[0] = total[1] = 0; }
+};
+
+typedef std::map<std::string, ProfileCounters> ProfileCounterMap;
+
+static void CountProfiledStacks(const std::vector<ProfiledStack>& stacks,
+                                int index,
+                                const std::string* method_filter,
+                                std::map<void*, std::string>* symbols,
+                                ProfileCounterMap* methods,
+                                ProfileCounterMap* functions,
+                                int64_t* nsamples) {
+    std::set<const std::string*> seen;
+    for (size_t i = 0; i < stacks.size(); ++i) {
+        const ProfiledStack& s = stacks[i];
+        const char* method_name = ProfiledMethodName(s);
+        if (method_filter && *method_filter != method_name) {
+            continue;
+        }
+        *nsamples += s.count;
+        (*methods)[method_name].total[index] += s.count;
+        seen.clear();
+        for (size_t j = 0; j < s.frames.size(); ++j) {
+            const std::string& fn =
+                SymbolizeProfiledPC(ProfiledPC(s, j), symbols);
+            ProfileCounters& c = (*functions)[fn];
+            if (j == 0) {
+                c.self[index] += s.count;
+            }
+            // Count recursive functions once.
+            if (seen.insert(&fn).second) {
+                c.total[index] += s.count;
+            }
+        }
+    }
+}
+
+static double PerMinute(int64_t count, int nminutes) {
+    return nminutes > 0 ? (double)count / nminutes : 0;
+}
+
+struct ProfileRow {
+    double sort_key;
+    ProfileCounterMap::const_iterator it;
+    bool operator<(const ProfileRow& rhs) const {
+        return sort_key > rhs.sort_key;
+    }
+};
+
+static void SortProfileRows(const ProfileCounterMap& m, bool by_self,
+                            bool diff, int nminutes, int base_nminutes,
+                            std::vector<ProfileRow>* rows) {
+    rows->clear();
+    for (ProfileCounterMap::const_iterator it = m.begin(); it != m.end(); ++it) {
+        const int64_t* c = by_self ? it->second.self : it->second.total;
+        ProfileRow row;
+        row.it = it;
+        if (diff) {
+            row.sort_key = fabs(PerMinute(c[0], nminutes) -
+                                PerMinute(c[1], base_nminutes));
+        } else {
+            row.sort_key = c[0];
+        }
+        if (row.sort_key > 0) {
+            rows->push_back(row);
+        }
+    }
+    std::sort(rows->begin(), rows->end());
+}
+
+static void PrintContinuousTop(std::ostream& os,
+                               const std::vector<ProfiledStack>& stacks,
+                               int nminutes,
+                               const std::vector<ProfiledStack>* base_stacks,
+                               int base_nminutes,
+                               const std::string* method_filter,
+                               size_t limit) {
+    std::map<void*, std::string> symbols;
+    ProfileCounterMap methods;
+    ProfileCounterMap functions;
+    int64_t nsamples = 0;
+    int64_t base_nsamples = 0;
+    CountProfiledStacks(stacks, 0, method_filter, &symbols,
+                        &methods, &functions, &nsamples);
+    const bool diff = (base_stacks != NULL);
+    if (diff) {
+        CountProfiledStacks(*base_stacks, 1, method_filter, &symbols,
+                            &methods, &functions, &base_nsamples);
+    }
+    char buf[256];
+    std::vector<ProfileRow> rows;
+    os << "Total: " << nsamples << " samples in " << nminutes << " minutes";
+    if (diff) {
+        os << ", base: " << base_nsamples << " samples in "
+           << base_nminutes << " minutes";
+    }
+    os << "\n\n";
+
+    const char* const sections[] = { "Methods", "Functions by self",
+                                     "Functions by total" };
+    for (int k = 0; k < 3; ++k) {
+        const bool by_self = (k == 1);
+        const ProfileCounterMap& m = (k == 0 ? methods : functions);
+        SortProfileRows(m, by_self, diff, nminutes, base_nminutes, &rows);
+        os << sections[k] << ":\n";
+        if (diff) {
+            os << "  cur/min  base/min     delta  name\n";
+        } else {
+            os << "  samples  samples/min      %  name\n";
+        }
+        for (size_t i = 0; i < rows.size() && i < limit; ++i) {
+            const ProfileCounters& pc = rows[i].it->second;
+            const int64_t* c = by_self ? pc.self : pc.total;
+            if (diff) {
+                const double cur = PerMinute(c[0], nminutes);
+                const double base = PerMinute(c[1], base_nminutes);
+                snprintf(buf, sizeof(buf), "%9.1f %9.1f %+9.1f  ",
+                         cur, base, cur - base);
+            } else {
+                snprintf(buf, sizeof(buf), "%9" PRId64 " %12.1f %6.2f  ",
+                         c[0], PerMinute(c[0], nminutes),
+                         nsamples ? c[0] * 100.0 / nsamples : 0.0);
+            }
+            os << buf << rows[i].it->first << '\n';
+        }
+        os << '\n';
+    }
+}
+
+// One line per stack: "method;outermost;...;innermost count", or
+// "stack base_count count" when comparing, which are inputs of
+// flamegraph.pl (differential flame graphs for the latter).
+static void PrintContinuousCollapsed(
+    std::ostream& os, const std::vector<ProfiledStack>& stacks,
+    const std::vector<ProfiledStack>* base_stacks,
+    const std::string* method_filter) {
+    std::map<void*, std::string> symbols;
+    std::map<std::string, ProfileCounters> folded;
+    std::string line;
+    for (int index = 0; index < 2; ++index) {
+        const std::vector<ProfiledStack>* v =
+            (index == 0 ? &stacks : base_stacks);
+        if (v == NULL) {
+            continue;
+        }
+        for (size_t i = 0; i < v->size(); ++i) {
+            const ProfiledStack& s = (*v)[i];
+            const char* method_name = ProfiledMethodName(s);
+            if (method_filter && *method_filter != method_name) {
+                continue;
+            }
+            line = method_name;
+            for (size_t j = s.frames.size(); j > 0; --j) {
+                line.push_back(';');
+                line.append(SymbolizeProfiledPC(ProfiledPC(s, j - 1),
+                                                &symbols));
+            }
+            folded[line].self[index] += s.count;
+        }
+    }
+    for (std::map<std::string, ProfileCounters>::const_iterator
+             it = folded.begin(); it != folded.end(); ++it) {
+        os << it->first << ' ';
+        if (base_stacks) {
+            os << it->second.self[1] << ' ';
+        }
+        os << it->second.self[0] << '\n';
+    }
+}
+
+void HotspotsService::cpu_continuous(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::HotspotsRequest*,
+    ::brpc::HotspotsResponse*,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller* cntl = static_cast<Controller*>(cntl_base);
+    cntl->http_response().set_content_type("text/plain");
+    if (!IsContinuousCpuProfilerRunning() &&
+        !FLAGS_continuous_cpu_profiling) {
+        cntl->response_attachment().append(
+            "Continuous cpu profiling is not enabled, turn on "
+            "-continuous_cpu_profiling\n");
+        return;
+    }
+    // Ranges are [end, start) minutes ago.
+    const int start = ReadMinutesAgo(cntl, "start", 5);
+    const int end = ReadMinutesAgo(cntl, "end", 0);
+    if (start < 0 || end < 0 || start <= end) {
+        cntl->SetFailed(EINVAL, "Invalid range of minutes, start must be "
+                        "greater than end");
+        return;
+    }
+    const std::string* base_start_str =
+        cntl->http_request().uri().GetQuery("base_start");
+    int base_start = -1;
+    int base_end = -1;
+    if (base_start_str) {
+        base_start = ReadMinutesAgo(cntl, "base_start", -1);
+        base_end = ReadMinutesAgo(cntl, "base_end", 0);
+        if (base_start < 0 || base_end < 0 || base_start <= base_end) {
+            cntl->SetFailed(EINVAL, "Invalid range of base minutes, "
+                            "base_start must be greater than base_end");
+            return;
+        }
+    }
+    const std::string* method_filter =
+        cntl->http_request().uri().GetQuery("method");
+    size_t limit = 50;
+    const std::string* limit_str =
+        cntl->http_request().uri().GetQuery("limit");
+    if (limit_str) {
+        limit = strtoul(limit_str->c_str(), NULL, 10);
+    }
+
+    std::vector<ProfiledStack> stacks;
+    int nminutes = 0;
+    GetContinuousCpuProfile(start, end, &stacks, &nminutes);
+    std::vector<ProfiledStack> base_stacks;
+    int base_nminutes = 0;
+    if (base_start_str) {
+        GetContinuousCpuProfile(base_start, base_end,
+                                &base_stacks, &base_nminutes);
+    }
+    const std::vector<ProfiledStack>* base =
+        (base_start_str ? &base_stacks : NULL);
+
+    butil::IOBufBuilder os;
+    const std::string* view = cntl->http_request().uri().GetQuery("view");
+    if (view && *view == "collapsed") {
+        PrintContinuousCollapsed(os, stacks, base, method_filter);
+    } else if (view == NULL || *view == "top") {
+        os << "Samples of " << start - end << " minutes until "
+           << end << " minutes ago";
+        if (base) {
+            os << " compared with " << base_start - base_end
+               << " minutes until " << base_end << " minutes ago";
+        }
+        os << " at " << FLAGS_continuous_cpu_profiling_hz
+           << " samples per cpu second";
+        if (method_filter) {
+            os << ", method=" << *method_filter;
+        }
+        os << '\n';
+        PrintContinuousTop(os, stacks, nminutes, base, base_nminutes,
+                           method_filter, limit);
+    } else {
+        cntl->SetFailed(EINVAL, "Unknown view=%s", view->c_str());
+        return;
+    }
+    os.move_to(cntl->response_attachment());
+}
+
 void HotspotsService::GetTabInfo(TabInfoList* info_list) const {
     TabInfo* info = info_list->add();
     info->path = "/hotspots/cpu";
@@ -1233,6 +1595,12 @@ void HotspotsService::GetTabInfo(TabInfoList* info_list) const {
     info = info_list->add();
     info->path = "/hotspots/contention";
     info->tab_name = "contention";
+    info = info_list->add();
+    info->path = "/hotspots/offcpu";
+    info->tab_name = "offcpu";
+    info = info_list->add();
+    info->path = "/hotspots/cpu_continuous";
+    info->tab_name = "cpu_continuous";
 }
 
 } // namespace brpc
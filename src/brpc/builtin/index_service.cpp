@@ -154,6 +154,12 @@ void IndexService::default_method(::google::protobuf::RpcController* controller,
        << Path("/sockets", html_addr) << " : Check status of a Socket" << NL
        << Path("/bthreads", html_addr) << " : Check status of a bthread" << NL
        << Path("/ids", html_addr) << " : Check status of a bthread_id" << NL
+       << Path("/zstd_dict", html_addr)
+       << " : Sample messages and train zstd dictionaries" << NL
+       << Path("/iobuf", html_addr)
+       << " : Memory of IOBuf blocks charged to owners" << NL
+       << Path("/pools", html_addr)
+       << " : Blocks and free items of ObjectPool and ResourcePool" << NL
        << Path("/protobufs", html_addr) << " : List all protobuf services and messages" << NL
        << Path("/list", html_addr) << " : json signature of methods" << NL
        << Path("/threads", html_addr) << " : Check pstack"
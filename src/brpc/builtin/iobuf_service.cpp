@@ -0,0 +1,69 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>                   // std::sort
+#include <gflags/gflags.h>
+#include "butil/iobuf.h"
+#include "brpc/closure_guard.h"        // ClosureGuard
+#include "brpc/controller.h"           // Controller
+#include "brpc/builtin/common.h"
+#include "brpc/builtin/iobuf_service.h"
+
+DECLARE_bool(iobuf_track_block_owners);
+
+namespace brpc {
+
+static bool CompareByBytes(const butil::iobuf::BlockOwnerStat& s1,
+                           const butil::iobuf::BlockOwnerStat& s2) {
+    return s1.nbytes > s2.nbytes;
+}
+
+void IOBufService::default_method(::google::protobuf::RpcController* cntl_base,
+                                  const ::brpc::IOBufRequest*,
+                                  ::brpc::IOBufResponse*,
+                                  ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    cntl->http_response().set_content_type("text/plain");
+    butil::IOBufBuilder os;
+    const int64_t total_nblock = butil::IOBuf::block_count();
+    const int64_t total_nbytes = butil::IOBuf::block_memory();
+    os << "block_count: " << total_nblock << '\n'
+       << "block_memory: " << total_nbytes << '\n';
+    if (!FLAGS_iobuf_track_block_owners) {
+        os << "# Set -iobuf_track_block_owners to charge blocks to owners\n";
+    }
+    std::vector<butil::iobuf::BlockOwnerStat> stats;
+    butil::iobuf::list_block_owners(&stats);
+    std::sort(stats.begin(), stats.end(), CompareByBytes);
+    int64_t tagged_nblock = 0;
+    int64_t tagged_nbytes = 0;
+    os << "\nowner nblock nbytes\n";
+    for (size_t i = 0; i < stats.size(); ++i) {
+        os << stats[i].name << ' ' << stats[i].nblock << ' '
+           << stats[i].nbytes << '\n';
+        tagged_nblock += stats[i].nblock;
+        tagged_nbytes += stats[i].nbytes;
+    }
+    // Blocks created before tracking was on or out of any owner scope.
+    os << "(untagged) " << std::max(total_nblock - tagged_nblock, (int64_t)0)
+       << ' ' << std::max(total_nbytes - tagged_nbytes, (int64_t)0) << '\n';
+    os.move_to(cntl->response_attachment());
+}
+
+} // namespace brpc
@@ -0,0 +1,68 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+#include <algorithm>                   // std::sort
+#include <gflags/gflags.h>
+#include "butil/iobuf.h"
+#include "butil/pool_registry.h"
+#include "brpc/closure_guard.h"        // ClosureGuard
+#include "brpc/controller.h"           // Controller
+#include "brpc/builtin/common.h"
+#include "brpc/builtin/pools_service.h"
+
+namespace brpc {
+
+DECLARE_int32(object_pool_trim_interval);
+
+static bool CompareBySize(const butil::PoolStat& s1,
+                          const butil::PoolStat& s2) {
+    return s1.total_size > s2.total_size;
+}
+
+void PoolsService::default_method(::google::protobuf::RpcController* cntl_base,
+                                  const ::brpc::PoolsRequest*,
+                                  ::brpc::PoolsResponse*,
+                                  ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    cntl->http_response().set_content_type("text/plain");
+    butil::IOBufBuilder os;
+    if (FLAGS_object_pool_trim_interval <= 0) {
+        os << "# Set -object_pool_trim_interval to release free blocks of"
+            " trimmable object pools\n";
+    }
+    std::vector<butil::PoolStat> stats;
+    butil::list_pools(&stats);
+    std::sort(stats.begin(), stats.end(), CompareBySize);
+    size_t total_size = 0;
+    os << "type kind item_size block_num released_block_num item_num"
+        " free_item_num total_size trimmable\n";
+    for (size_t i = 0; i < stats.size(); ++i) {
+        const butil::PoolStat& s = stats[i];
+        os << s.name << ' ' << s.kind << ' ' << s.item_size << ' '
+           << s.block_num << ' ' << s.released_block_num << ' '
+           << s.item_num << ' ' << s.free_item_num << ' '
+           << s.total_size << ' ' << (s.trimmable ? "yes" : "no") << '\n';
+        total_size += s.total_size;
+    }
+    os << "total_size: " << total_size << '\n';
+    os.move_to(cntl->response_attachment());
+}
+
+} // namespace brpc
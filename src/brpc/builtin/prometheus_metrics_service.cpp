@@ -19,7 +19,12 @@
 #include <vector>
 #include <iomanip>
 #include <map>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
 #include "brpc/controller.h"                // Controller
+#include "brpc/reloadable_flags.h"
 #include "brpc/server.h"                    // Server
 #include "brpc/closure_guard.h"             // ClosureGuard
 #include "brpc/builtin/prometheus_metrics_service.h"
@@ -34,16 +39,21 @@ DECLARE_int32(bvar_latency_p3);
 
 namespace brpc {
 
+DEFINE_int32(prometheus_metrics_cache_ms, 0,
+             "Scrapes of /brpc_metrics with same filters within so many "
+             "milliseconds share one output, <= 0 means no sharing");
+BRPC_VALIDATE_GFLAG(prometheus_metrics_cache_ms, PassValidate);
+
 // Defined in server.cpp
 extern const char* const g_server_info_prefix;
 
 // This is a class that convert bvar result to prometheus output.
-// Currently the output only includes gauge and summary for two
-// reasons:
+// Currently the output only includes gauge, summary and histogram:
 // 1) We cannot tell gauge and counter just from name and what's
 // more counter is just another gauge.
-// 2) Histogram and summary is equivalent except that histogram
-// calculates quantiles in the server side.
+// 2) Summaries are made of bvars exposed by LatencyRecorder.
+// 3) Histograms are made of buckets of bvar::LatencyHistogram.
+// Stats of bvar::MultiDimension are output as gauges with labels.
 class PrometheusMetricsDumper : public bvar::Dumper {
 public:
     explicit PrometheusMetricsDumper(butil::IOBufBuilder* os,
@@ -53,10 +63,16 @@ public:
     }
 
     bool dump(const std::string& name, const butil::StringPiece& desc) override;
+    bool dump_mvar(const std::string& name,
+                   const butil::StringPiece& desc) override;
 
 private:
     DISALLOW_COPY_AND_ASSIGN(PrometheusMetricsDumper);
 
+    // Return true iff desc is buckets output by bvar::LatencyHistogram.
+    bool DumpLatencyHistogram(const butil::StringPiece& name,
+                              const butil::StringPiece& desc);
+
     // Return true iff name ends with suffix output by LatencyRecorder.
     bool DumpLatencyRecorderSuffix(const butil::StringPiece& name,
                                    const butil::StringPiece& desc);
@@ -79,6 +95,8 @@ private:
     butil::IOBufBuilder* _os;
     const std::string _server_prefix;
     std::map<std::string, SummaryItems> _m;
+    // Name of the last dumped multi-dimensional variable.
+    std::string _last_mvar_name;
 };
 
 bool PrometheusMetricsDumper::dump(const std::string& name,
@@ -87,6 +105,9 @@ bool PrometheusMetricsDumper::dump(const std::string& name,
         // there is no necessary to monitor string in prometheus
         return true;
     }
+    if (DumpLatencyHistogram(name, desc)) {
+        return true;
+    }
     if (DumpLatencyRecorderSuffix(name, desc)) {
         // Has encountered name with suffix exposed by LatencyRecorder,
         // Leave it to DumpLatencyRecorderSuffix to output Summary.
@@ -98,6 +119,24 @@ bool PrometheusMetricsDumper::dump(const std::string& name,
     return true;
 }
 
+bool PrometheusMetricsDumper::dump_mvar(const std::string& name,
+                                        const butil::StringPiece& desc) {
+    if (!desc.empty() && desc[0] == '"') {
+        return true;
+    }
+    // name is like `foo{label1="v1",label2="v2"}'
+    const size_t pos = name.find('{');
+    const butil::StringPiece metric_name(name.data(),
+                                         pos == std::string::npos ? name.size() : pos);
+    if (metric_name != _last_mvar_name) {
+        _last_mvar_name.assign(metric_name.data(), metric_name.size());
+        *_os << "# HELP " << metric_name << '\n'
+             << "# TYPE " << metric_name << " gauge" << '\n';
+    }
+    *_os << name << " " << desc << '\n';
+    return true;
+}
+
 const PrometheusMetricsDumper::SummaryItems*
 PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece& name,
                                                       const butil::StringPiece& desc) {
@@ -108,7 +147,6 @@ PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece&
         "_latency_999", "_latency_9999", "_max_latency"
     };
     CHECK(NPERCENTILES == arraysize(latency_names));
-    const std::string desc_str = desc.as_string();
     butil::StringPiece metric_name(name);
     for (int i = 0; i < NPERCENTILES; ++i) {
         if (!metric_name.ends_with(latency_names[i])) {
@@ -116,7 +154,7 @@ PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece&
         }
         metric_name.remove_suffix(latency_names[i].size());
         SummaryItems* si = &_m[metric_name.as_string()];
-        si->latency_percentiles[i] = desc_str;
+        si->latency_percentiles[i] = desc.as_string();
         if (i == NPERCENTILES - 1) {
             // '_max_latency' is the last suffix name that appear in the sorted bvar
             // list, which means all related percentiles have been gathered and we are
@@ -129,18 +167,63 @@ PrometheusMetricsDumper::ProcessLatencyRecorderSuffix(const butil::StringPiece&
     if (metric_name.ends_with("_latency")) {
         metric_name.remove_suffix(8);
         SummaryItems* si = &_m[metric_name.as_string()];
-        si->latency_avg = strtoll(desc_str.data(), NULL, 10);
+        si->latency_avg = strtoll(desc.as_string().c_str(), NULL, 10);
         return si;
     }
     if (metric_name.ends_with("_count")) {
         metric_name.remove_suffix(6);
         SummaryItems* si = &_m[metric_name.as_string()];
-        si->count = strtoll(desc_str.data(), NULL, 10);
+        si->count = strtoll(desc.as_string().c_str(), NULL, 10);
         return si;
     }
     return NULL;
 }
 
+bool PrometheusMetricsDumper::DumpLatencyHistogram(
+    const butil::StringPiece& name,
+    const butil::StringPiece& desc) {
+    // {"count":N,"sum":S,"buckets":[[LE,COUNT],...]}
+    if (!desc.starts_with("{\"count\":")) {
+        return false;
+    }
+    const std::string desc_str = desc.as_string();
+    char* p = NULL;
+    const int64_t count = strtoll(desc_str.c_str() + 9, &p, 10);
+    if (strncmp(p, ",\"sum\":", 7) != 0) {
+        return false;
+    }
+    const int64_t sum = strtoll(p + 7, &p, 10);
+    if (strncmp(p, ",\"buckets\":[", 12) != 0) {
+        return false;
+    }
+    p += 12;
+    std::vector<std::pair<int64_t, int64_t> > buckets;
+    while (*p == '[') {
+        const int64_t le = strtoll(p + 1, &p, 10);
+        if (*p != ',') {
+            return false;
+        }
+        const int64_t n = strtoll(p + 1, &p, 10);
+        if (*p != ']') {
+            return false;
+        }
+        buckets.push_back(std::make_pair(le, n));
+        if (*++p == ',') {
+            ++p;
+        }
+    }
+    *_os << "# HELP " << name << '\n'
+         << "# TYPE " << name << " histogram\n";
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        *_os << name << "_bucket{le=\"" << buckets[i].first << "\"} "
+             << buckets[i].second << '\n';
+    }
+    *_os << name << "_bucket{le=\"+Inf\"} " << count << '\n'
+         << name << "_sum " << sum << '\n'
+         << name << "_count " << count << '\n';
+    return true;
+}
+
 bool PrometheusMetricsDumper::DumpLatencyRecorderSuffix(
     const butil::StringPiece& name,
     const butil::StringPiece& desc) {
@@ -186,21 +269,87 @@ void PrometheusMetricsService::default_method(::google::protobuf::RpcController*
     ClosureGuard done_guard(done);
     Controller *cntl = static_cast<Controller*>(cntl_base);
     cntl->http_response().set_content_type("text/plain");
-    if (DumpPrometheusMetricsToIOBuf(&cntl->response_attachment()) != 0) {
+    // Names matching `include' and not matching `exclude' are dumped, both
+    // are wildcards separated by comma or semicolon, e.g.
+    // /brpc_metrics?include=rpc_server*&exclude=*_cdf
+    // `$' instead of `?' matches any character since `?' is reserved in URL.
+    bvar::DumpOptions options;
+    options.question_mark = '$';
+    const std::string* include = cntl->http_request().uri().GetQuery("include");
+    if (include) {
+        options.white_wildcards = *include;
+    }
+    const std::string* exclude = cntl->http_request().uri().GetQuery("exclude");
+    if (exclude) {
+        options.black_wildcards = *exclude;
+    }
+    if (DumpPrometheusMetricsToIOBuf(&cntl->response_attachment(),
+                                     &options) != 0) {
         cntl->SetFailed("Fail to dump metrics");
         return;
     }
 }
 
-int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output) {
+static int DumpPrometheusMetricsToIOBufNoCache(
+    butil::IOBuf* output, const bvar::DumpOptions* options) {
     butil::IOBufBuilder os;
     PrometheusMetricsDumper dumper(&os, g_server_info_prefix);
-    const int ndump = bvar::Variable::dump_exposed(&dumper, NULL);
+    const int ndump = bvar::Variable::dump_exposed(&dumper, options);
     if (ndump < 0) {
         return -1;
     }
+    if (bvar::MVariable::dump_exposed(&dumper, options) < 0) {
+        return -1;
+    }
     os.move_to(*output);
     return 0;
 }
 
+// Output of last scrape. Prometheus servers deployed in HA pairs or
+// multiple dashboards scrape at nearly the same time, rendering once saves
+// most CPU when there're many variables.
+struct CachedPrometheusMetrics {
+    CachedPrometheusMetrics() : expire_us(0) {}
+    butil::Mutex mutex;
+    std::string filters;
+    int64_t expire_us;
+    butil::IOBuf output;
+};
+
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output,
+                                 const bvar::DumpOptions* options) {
+    const int cache_ms = FLAGS_prometheus_metrics_cache_ms;
+    if (cache_ms <= 0) {
+        return DumpPrometheusMetricsToIOBufNoCache(output, options);
+    }
+    static CachedPrometheusMetrics* s_cache = new CachedPrometheusMetrics;
+    std::string filters;
+    if (options) {
+        filters.append(options->white_wildcards);
+        filters.push_back('\n');
+        filters.append(options->black_wildcards);
+    }
+    // Render inside the lock so that concurrent scrapes wait for one
+    // rendering instead of rendering simultaneously.
+    BAIDU_SCOPED_LOCK(s_cache->mutex);
+    const int64_t now_us = butil::monotonic_time_us();
+    if (now_us < s_cache->expire_us && filters == s_cache->filters) {
+        output->append(s_cache->output);
+        return 0;
+    }
+    butil::IOBuf buf;
+    if (DumpPrometheusMetricsToIOBufNoCache(&buf, options) != 0) {
+        return -1;
+    }
+    s_cache->filters.swap(filters);
+    s_cache->expire_us = now_us + cache_ms * 1000L;
+    s_cache->output = buf;
+    output->append(buf);
+    return 0;
+}
+
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output) {
+    return DumpPrometheusMetricsToIOBuf(output, NULL);
+}
+
 } // namespace brpc
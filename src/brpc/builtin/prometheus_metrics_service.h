@@ -19,6 +19,7 @@
 #ifndef BRPC_PROMETHEUS_METRICS_SERVICE_H
 #define BRPC_PROMETHEUS_METRICS_SERVICE_H
 
+#include "bvar/variable.h"                    // bvar::DumpOptions
 #include "brpc/builtin_service.pb.h"
 
 namespace brpc {
@@ -32,6 +33,10 @@ public:
 };
 
 int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output);
+// Dump variables filtered by wildcards in `options'. Outputs within
+// -prometheus_metrics_cache_ms are reused for same filters.
+int DumpPrometheusMetricsToIOBuf(butil::IOBuf* output,
+                                 const bvar::DumpOptions* options);
 
 } // namepace brpc
 
@@ -24,6 +24,7 @@
 #include "brpc/details/method_status.h"        // MethodStatus
 #include "brpc/builtin/status_service.h"
 #include "brpc/nshead_service.h"       // NsheadService
+#include "brpc/baidu_master_service.h" // BaiduMasterService
 #ifdef ENABLE_THRIFT_FRAMED_PROTOCOL
 #include "brpc/thrift_service.h"       // ThriftService
 #endif
@@ -193,6 +194,18 @@ void StatusService::default_method(::google::protobuf::RpcController* cntl_base,
         nshead_svc->_status->Describe(os, desc_options);
         os << '\n';
     }
+    const BaiduMasterService* master_svc =
+        server->options().baidu_master_service;
+    if (master_svc && master_svc->_status) {
+        DescribeOptions options;
+        options.verbose = false;
+        options.use_html = use_html;
+        os << (use_html ? "<h3>" : "[");
+        master_svc->Describe(os, options);
+        os << (use_html ? "</h3>\n" : "]\n");
+        master_svc->_status->Describe(os, desc_options);
+        os << '\n';
+    }
 #ifdef ENABLE_THRIFT_FRAMED_PROTOCOL
     const ThriftService* thrift_svc = server->options().thrift_service;
     if (thrift_svc && thrift_svc->_status) {
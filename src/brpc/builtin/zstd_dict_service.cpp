@@ -0,0 +1,70 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdlib.h>
+#include "brpc/closure_guard.h"        // ClosureGuard
+#include "brpc/controller.h"           // Controller
+#include "brpc/builtin/common.h"
+#include "brpc/builtin/zstd_dict_service.h"
+#include "brpc/policy/zstd_compress.h"
+
+
+namespace brpc {
+
+// Default size of trained dictionaries, same as zstd --train.
+static const size_t DEFAULT_DICT_SIZE = 112640;
+
+void ZstdDictService::default_method(::google::protobuf::RpcController* cntl_base,
+                                     const ::brpc::ZstdDictRequest*,
+                                     ::brpc::ZstdDictResponse*,
+                                     ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    const std::string& method_name = cntl->http_request().unresolved_path();
+    if (method_name.empty()) {
+        cntl->http_response().set_content_type("text/plain");
+        butil::IOBufBuilder os;
+        os << "# Set -zstd_dict_max_samples to sample messages of baidu_std\n"
+              "# Use /zstd_dict/<method_full_name>?size=<bytes> to train a "
+              "dictionary\n";
+        policy::DescribeZstdDictionaries(os);
+        os.move_to(cntl->response_attachment());
+        return;
+    }
+    size_t dict_size = DEFAULT_DICT_SIZE;
+    const std::string* size_str = cntl->http_request().uri().GetQuery("size");
+    if (size_str != NULL) {
+        char* endptr = NULL;
+        const long size = strtol(size_str->c_str(), &endptr, 10);
+        if (*endptr != '\0' || size <= 0) {
+            cntl->SetFailed(EREQUEST, "Invalid size=%s", size_str->c_str());
+            return;
+        }
+        dict_size = size;
+    }
+    butil::IOBuf dict;
+    std::string error;
+    if (!policy::TrainZstdDictionary(method_name, dict_size, &dict, &error)) {
+        cntl->SetFailed(EREQUEST, "%s", error.c_str());
+        return;
+    }
+    cntl->http_response().set_content_type("application/octet-stream");
+    cntl->response_attachment().swap(dict);
+}
+
+} // namespace brpc
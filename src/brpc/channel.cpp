@@ -32,26 +32,56 @@
 #include "brpc/controller.h"
 #include "brpc/channel.h"
 #include "brpc/details/usercode_backup_pool.h"       // TooManyUserCode
+#include "brpc/details/call_coalescer.h"             // CallCoalescer
+#include "brpc/details/adaptive_backup_request.h"    // AdaptiveBackupRequest
+#include "brpc/details/retry_budget.h"               // RetryBudget
+#include "brpc/details/shared_request_buf.h"         // SharedRequestBuf
+#include "brpc/details/client_concurrency_limiter.h" // ClientConcurrencyLimiter
+#include "brpc/details/response_cache.h"             // ResponseCache
+#include "brpc/details/rpc_deadline.h"               // TlsRpcDeadline
+#include "brpc/details/protocol_dispatch.h"          // DispatchSerializeRequest
+#include "brpc/rdma/rdma_helper.h"                   // InitRdma
 #include "brpc/policy/esp_authenticator.h"
 
 namespace brpc {
 
+DEFINE_bool(rpc_inherit_deadline, true, "RPCs issued by server-side user code"
+            " time out no later than the deadline of the request being"
+            " processed");
+DEFINE_bool(rpc_deadline_scheduling, false, "bthreads running server-side"
+            " user code are scheduled earliest-deadline-first by deadlines of"
+            " the requests being processed, so that requests still able to"
+            " meet deadlines are served first under overload");
+
 DECLARE_bool(enable_rpcz);
 DECLARE_bool(usercode_in_pthread);
+DECLARE_int32(min_connection_pool_size);
+namespace policy {
+DECLARE_bool(http_client_pipelining);
+}
 
 ChannelOptions::ChannelOptions()
     : connect_timeout_ms(200)
     , timeout_ms(500)
     , backup_request_ms(-1)
+    , backup_request_percentile(0)
     , max_retry(3)
+    , retry_budget_ratio(0)
+    , retry_budget_min_per_second(10)
+    , max_concurrency_wait_ms(0)
     , enable_circuit_breaker(false)
     , protocol(PROTOCOL_BAIDU_STD)
     , connection_type(CONNECTION_TYPE_UNKNOWN)
+    , connections_per_server(1)
     , succeed_without_server(true)
     , log_succeed_without_server(true)
+    , async_init(false)
     , auth(NULL)
     , retry_policy(NULL)
     , ns_filter(NULL)
+    , subset_size(0)
+    , use_rdma(false)
+    , coalesce_identical_calls(false)
 {}
 
 ChannelSSLOptions* ChannelOptions::mutable_ssl_options() {
@@ -61,10 +91,20 @@ ChannelSSLOptions* ChannelOptions::mutable_ssl_options() {
     return _ssl_options.get();
 }
 
+ResponseCacheOptions* ChannelOptions::mutable_response_cache_options() {
+    if (!_response_cache_options) {
+        _response_cache_options.reset(new ResponseCacheOptions);
+    }
+    return _response_cache_options.get();
+}
+
 static ChannelSignature ComputeChannelSignature(const ChannelOptions& opt) {
     if (opt.auth == NULL &&
         !opt.has_ssl_options() &&
-        opt.connection_group.empty()) {
+        opt.connection_group.empty() &&
+        opt.connections_per_server <= 1 &&
+        opt.socket_tuning_options.empty() &&
+        !opt.use_rdma) {
         // Returning zeroized result by default is more intuitive for users.
         return ChannelSignature();
     }
@@ -80,6 +120,24 @@ static ChannelSignature ComputeChannelSignature(const ChannelOptions& opt) {
             buf.append("|conng=");
             buf.append(opt.connection_group);
         }
+        if (opt.connections_per_server > 1) {
+            buf.append("|nconn=");
+            buf.append(std::to_string(opt.connections_per_server));
+        }
+        const SocketTuningOptions& tuning = opt.socket_tuning_options;
+        if (!tuning.empty()) {
+            buf.append("|tuning=");
+            buf.append(tuning.congestion_control);
+            buf.push_back('|');
+            buf.append((char*)&tuning.max_pacing_rate, sizeof(tuning.max_pacing_rate));
+            buf.append((char*)&tuning.tos, sizeof(tuning.tos));
+            buf.append((char*)&tuning.send_buffer_size, sizeof(tuning.send_buffer_size));
+            buf.append((char*)&tuning.recv_buffer_size, sizeof(tuning.recv_buffer_size));
+            buf.push_back(tuning.tcp_fastopen ? 'F' : '-');
+        }
+        if (opt.use_rdma) {
+            buf.append("|rdma");
+        }
         if (opt.auth) {
             buf.append("|auth=");
             buf.append((char*)&opt.auth, sizeof(opt.auth));
@@ -152,6 +210,35 @@ int Channel::InitChannelOptions(const ChannelOptions* options) {
     _serialize_request = protocol->serialize_request;
     _pack_request = protocol->pack_request;
     _get_method_name = protocol->get_method_name;
+    if (_options.coalesce_identical_calls) {
+        _coalescer.reset(new CallCoalescer);
+    }
+    if (_options.has_response_cache_options()) {
+        _response_cache.reset(
+            new ResponseCache(_options.response_cache_options()));
+    }
+    if (_options.backup_request_percentile > 0) {
+        if (_options.backup_request_percentile >= 100) {
+            LOG(ERROR) << "backup_request_percentile must be less than 100";
+            return -1;
+        }
+        _adaptive_backup_request.reset(
+            new AdaptiveBackupRequest(_options.backup_request_percentile));
+    }
+    if (_options.use_rdma) {
+        // Install the registered block pool before sending anything, falls
+        // back to TCP if RDMA is not available.
+        rdma::InitRdma();
+    }
+    if (_options.retry_budget_ratio > 0) {
+        _retry_budget.reset(new RetryBudget(
+            _options.retry_budget_ratio, _options.retry_budget_min_per_second));
+    }
+    if (ClientConcurrencyLimiter::Create(_options.max_concurrency_per_server,
+                                         _options.max_concurrency_wait_ms,
+                                         &_concurrency_limiter) != 0) {
+        return -1;
+    }
 
     // Check connection_type
     if (_options.connection_type == CONNECTION_TYPE_UNKNOWN) {
@@ -172,7 +259,13 @@ int Channel::InitChannelOptions(const ChannelOptions* options) {
                        << _options.protocol.name();
         }
     } else {
-        if (!(_options.connection_type & protocol->supported_connection_type)) {
+        // http supports "single" by pipelining requests optionally.
+        const bool pipelined_http =
+            (_options.protocol == PROTOCOL_HTTP &&
+             _options.connection_type == CONNECTION_TYPE_SINGLE &&
+             policy::FLAGS_http_client_pipelining);
+        if (!(_options.connection_type & protocol->supported_connection_type) &&
+            !pipelined_http) {
             LOG(ERROR) << protocol->name << " does not support connection_type="
                        << ConnectionTypeToString(_options.connection_type);
             return -1;
@@ -200,6 +293,14 @@ int Channel::InitChannelOptions(const ChannelOptions* options) {
     return 0;
 }
 
+static std::shared_ptr<const SocketTuningOptions>
+CreateSocketTuningOptions(const ChannelOptions& options) {
+    if (options.socket_tuning_options.empty()) {
+        return NULL;
+    }
+    return std::make_shared<SocketTuningOptions>(options.socket_tuning_options);
+}
+
 int Channel::Init(const char* server_addr_and_port,
                   const ChannelOptions* options) {
     GlobalInitializeOrDie();
@@ -307,10 +408,19 @@ int Channel::InitSingle(const butil::EndPoint& server_addr_and_port,
         return -1;
     }
     if (SocketMapInsert(SocketMapKey(server_addr_and_port, sig),
-                        &_server_id, ssl_ctx) != 0) {
+                        &_server_id, ssl_ctx,
+                        CreateSocketTuningOptions(_options),
+                        _options.use_rdma) != 0) {
         LOG(ERROR) << "Fail to insert into SocketMap";
         return -1;
     }
+    if (_options.connection_type == CONNECTION_TYPE_POOLED &&
+        FLAGS_min_connection_pool_size > 0) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(_server_id, &ptr) == 0) {
+            ptr->WarmUpSocketPool(FLAGS_min_connection_pool_size);
+        }
+    }
     return 0;
 }
 
@@ -340,10 +450,19 @@ int Channel::Init(const char* ns_url,
     GetNamingServiceThreadOptions ns_opt;
     ns_opt.succeed_without_server = _options.succeed_without_server;
     ns_opt.log_succeed_without_server = _options.log_succeed_without_server;
+    ns_opt.wait_for_first_batch = !_options.async_init;
     ns_opt.channel_signature = ComputeChannelSignature(_options);
     if (CreateSocketSSLContext(_options, &ns_opt.ssl_ctx) != 0) {
         return -1;
     }
+    ns_opt.tuning_options = CreateSocketTuningOptions(_options);
+    ns_opt.use_rdma = _options.use_rdma;
+    if (_options.connection_type == CONNECTION_TYPE_POOLED) {
+        lb->set_warm_up_pooled_sockets(FLAGS_min_connection_pool_size);
+    }
+    if (_options.subset_size > 0) {
+        lb->set_subset(_options.subset_size, _options.subset_key);
+    }
     if (lb->Init(ns_url, lb_name, _options.ns_filter, &ns_opt) != 0) {
         LOG(ERROR) << "Fail to initialize LoadBalancerWithNaming";
         delete lb;
@@ -363,6 +482,45 @@ static void HandleBackupRequest(void* arg) {
     bthread_id_error(correlation_id, EBACKUPREQUEST);
 }
 
+// A call sent in background to refresh a stale cached response.
+class ResponseCacheRefresher : public google::protobuf::Closure {
+public:
+    ResponseCacheRefresher(const google::protobuf::Message* request,
+                           const google::protobuf::Message* response)
+        : _request(request->New()), _response(response->New()) {
+        _request->CopyFrom(*request);
+    }
+
+    void Run() override {
+        if (_cntl.Failed()) {
+            LOG(WARNING) << "Fail to refresh cached response: "
+                         << _cntl.ErrorText();
+        }
+        delete this;
+    }
+
+    Controller _cntl;
+    std::unique_ptr<google::protobuf::Message> _request;
+    std::unique_ptr<google::protobuf::Message> _response;
+};
+
+static void RefreshResponseCache(
+    Channel* channel, const google::protobuf::MethodDescriptor* method,
+    const Controller* cntl, const google::protobuf::Message* request,
+    const google::protobuf::Message* response) {
+    ResponseCacheRefresher* r = new ResponseCacheRefresher(request, response);
+    r->_cntl.set_refresh_response_cache(true);
+    r->_cntl.set_timeout_ms(cntl->timeout_ms());
+    if (cntl->has_log_id()) {
+        r->_cntl.set_log_id(cntl->log_id());
+    }
+    if (cntl->has_request_code()) {
+        r->_cntl.set_request_code(cntl->request_code());
+    }
+    channel->CallMethod(method, &r->_cntl, r->_request.get(),
+                        r->_response.get(), r);
+}
+
 void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
                          google::protobuf::RpcController* controller_base,
                          const google::protobuf::Message* request,
@@ -387,6 +545,7 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
         cntl->protocol_param() = _options.protocol.param();
     }
     cntl->_preferred_index = _preferred_index;
+    cntl->_connections_per_server = _options.connections_per_server;
     cntl->_retry_policy = _options.retry_policy;
     if (_options.enable_circuit_breaker) {
         cntl->add_flag(Controller::FLAGS_ENABLED_CIRCUIT_BREAKER);
@@ -440,13 +599,39 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     if (cntl->timeout_ms() == UNSET_MAGIC_NUM) {
         cntl->set_timeout_ms(_options.timeout_ms);
     }
+    const int64_t inherited_deadline_us = TlsRpcDeadline::get();
+    if (inherited_deadline_us >= 0 && FLAGS_rpc_inherit_deadline) {
+        // Results after the deadline of the server-side RPC are useless.
+        const int64_t left_ms = std::max(
+            (inherited_deadline_us - start_send_real_us) / 1000, (int64_t)0);
+        if (cntl->timeout_ms() < 0 || cntl->timeout_ms() > left_ms) {
+            cntl->set_timeout_ms(left_ms);
+        }
+    }
     // Since connection is shared extensively amongst channels and RPC,
     // overriding connect_timeout_ms does not make sense, just use the
     // one in ChannelOptions
     cntl->_connect_timeout_ms = _options.connect_timeout_ms;
     if (cntl->backup_request_ms() == UNSET_MAGIC_NUM) {
-        cntl->set_backup_request_ms(_options.backup_request_ms);
+        int64_t backup_request_ms = _options.backup_request_ms;
+        if (_adaptive_backup_request != NULL && method != NULL) {
+            cntl->_method_latency =
+                _adaptive_backup_request->GetMethodLatency(method);
+            if (cntl->_method_latency != NULL) {
+                const int64_t ms = cntl->_method_latency->backup_request_ms();
+                if (ms >= 0) {
+                    backup_request_ms = ms;
+                }
+            }
+        }
+        cntl->set_backup_request_ms(backup_request_ms);
     }
+    AddBackupRequestBudget();
+    if (_retry_budget != NULL) {
+        _retry_budget->OnCall();
+        cntl->_retry_budget = _retry_budget;
+    }
+    cntl->_concurrency_limiter = _concurrency_limiter;
     if (cntl->connection_type() == CONNECTION_TYPE_UNKNOWN) {
         cntl->set_connection_type(_options.connection_type);
     }
@@ -467,7 +652,30 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     // Ensure that serialize_request is done before pack_request in all
     // possible executions, including:
     //   HandleSendFailed => OnVersionedRPCReturned => IssueRPC(pack_request)
-    _serialize_request(&cntl->_request_buf, cntl, request);
+    {
+        static const int s_owner =
+            butil::iobuf::register_block_owner("rpc_request");
+        butil::iobuf::ScopedBlockOwner scoped_owner(s_owner);
+        SharedRequestBuf* shared = cntl->_shared_request_buf.get();
+        if (shared == NULL || cntl->has_request_iobuf_fields()) {
+            DispatchSerializeRequest(_serialize_request, &cntl->_request_buf,
+                                     cntl, request);
+        } else if (!shared->Get(request, _serialize_request,
+                                cntl->request_compress_type(),
+                                &cntl->_request_buf)) {
+            const size_t attachment_size = cntl->request_attachment().size();
+            DispatchSerializeRequest(_serialize_request, &cntl->_request_buf,
+                                     cntl, request);
+            // Protocols putting the request into the attachment (e.g. http)
+            // rely on being serialized in each call. Combo channels don't
+            // serialize at all.
+            if (!cntl->FailedInline() && !cntl->_request_buf.empty() &&
+                cntl->request_attachment().size() == attachment_size) {
+                shared->Set(request, _serialize_request,
+                            cntl->request_compress_type(), cntl->_request_buf);
+            }
+        }
+    }
     if (cntl->FailedInline()) {
         // Handle failures caused by serialize_request, and these error_codes
         // should be excluded from the retry_policy.
@@ -487,6 +695,45 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
         cntl->set_backup_request_ms(-1);
     }
 
+    std::string cache_key;
+    const ResponseCachePolicy* cache_policy = NULL;
+    if (_response_cache != NULL &&
+        (cache_policy = _response_cache->GetPolicy(method)) != NULL &&
+        CallCoalescer::MakeKey(method, cntl, &cache_key)) {
+        ResponseCache::Response cached;
+        const ResponseCache::LookupResult rc =
+            (cntl->has_refresh_response_cache() ? ResponseCache::CACHE_MISS :
+             _response_cache->Lookup(cache_key, &cached));
+        if (rc != ResponseCache::CACHE_MISS) {
+            if (ParsePbFromIOBuf(response, cached.body)) {
+                cntl->response_attachment().swap(cached.attachment);
+                if (rc == ResponseCache::CACHE_HIT_AND_REFRESH) {
+                    // Copy the call before ending it, the request may be
+                    // destroyed by done.
+                    RefreshResponseCache(this, method, cntl, request, response);
+                }
+                const Controller::CompletionInfo info =
+                    { cntl->current_id(), true };
+                const bool new_bthread =
+                    (done != NULL && !cntl->is_done_allowed_to_run_in_place());
+                cntl->OnVersionedRPCReturned(info, new_bthread, 0);
+                if (done == NULL) {
+                    if (cntl->_span) {
+                        cntl->SubmitSpan();
+                    }
+                    cntl->OnRPCEnd(butil::gettimeofday_us());
+                }
+                return;
+            }
+            LOG(WARNING) << "Fail to parse cached response of "
+                         << method->full_name();
+        }
+        if (done) {
+            cntl->_done = _response_cache->WrapDone(
+                cache_key, *cache_policy, cntl, done);
+        }
+    }
+
     if (cntl->backup_request_ms() >= 0 &&
         (cntl->backup_request_ms() < cntl->timeout_ms() ||
          cntl->timeout_ms() < 0)) {
@@ -526,12 +773,40 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
         cntl->_deadline_us = -1;
     }
 
-    cntl->IssueRPC(start_send_real_us);
+    if (_options.async_init && _lb != NULL) {
+        // Wait for servers of the asynchronously initialized channel. The
+        // RPC fails with no servers if they do not arrive before deadline.
+        static_cast<LoadBalancerWithNaming*>(_lb.get())->WaitForServers(
+            cntl->_deadline_us);
+    }
+
+    std::string coalescing_key;
+    if (_coalescer != NULL &&
+        CallCoalescer::MakeKey(method, cntl, &coalescing_key)) {
+        if (_coalescer->Join(coalescing_key, cntl)) {
+            // Ended by the leader with the same key.
+            coalescing_key.clear();
+        } else {
+            if (done) {
+                cntl->_done = _coalescer->WrapDone(
+                    coalescing_key, cntl, cntl->_done);
+            }
+            cntl->IssueRPC(start_send_real_us);
+        }
+    } else {
+        cntl->IssueRPC(start_send_real_us);
+    }
     if (done == NULL) {
         // MUST wait for response when sending synchronous RPC. It will
         // be woken up by callback when RPC finishes (succeeds or still
         // fails after retry)
         Join(correlation_id);
+        if (!coalescing_key.empty()) {
+            _coalescer->Finish(coalescing_key, cntl);
+        }
+        if (!cache_key.empty()) {
+            _response_cache->Fill(cache_key, *cache_policy, cntl);
+        }
         if (cntl->_span) {
             cntl->SubmitSpan();
         }
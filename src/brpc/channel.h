@@ -27,9 +27,12 @@
 #include "butil/intrusive_ptr.hpp"          // butil::intrusive_ptr
 #include "butil/ptr_container.h"
 #include "brpc/ssl_options.h"               // ChannelSSLOptions
+#include "brpc/response_cache_options.h"    // ResponseCacheOptions
+#include "brpc/socket_tuning_options.h"     // SocketTuningOptions
 #include "brpc/channel_base.h"              // ChannelBase
 #include "brpc/adaptive_protocol_type.h"    // AdaptiveProtocolType
 #include "brpc/adaptive_connection_type.h"  // AdaptiveConnectionType
+#include "brpc/adaptive_max_concurrency.h"  // AdaptiveMaxConcurrency
 #include "brpc/socket_id.h"                 // SocketId
 #include "brpc/controller.h"                // brpc::Controller
 #include "brpc/details/profiler_linker.h"
@@ -64,11 +67,45 @@ struct ChannelOptions {
     // Maximum: 0x7fffffff (roughly 30 days)
     int32_t backup_request_ms;
 
+    // If positive, send backup requests of a method after this percentile
+    // (e.g. 95) of recent latencies of the method over this Channel, instead
+    // of backup_request_ms, which is still used before enough latencies are
+    // recorded. Not used if Controller.set_backup_request_ms() is called.
+    // Backup requests of all channels are capped by -backup_request_max_ratio
+    // of calls.
+    // Default: 0 (disabled)
+    double backup_request_percentile;
+
     // Retry limit for RPC over this Channel. <=0 means no retry.
     // Overridable by Controller.set_max_retry().
     // Default: 3
     // Maximum: INT_MAX
     int max_retry;
+
+    // If positive, retries over this Channel are limited by a token bucket:
+    // each call adds this ratio of a token and each retry takes one, so that
+    // retries are no more than this ratio (e.g. 0.1) of calls when servers
+    // are failing. Backup requests are not limited.
+    // Default: 0 (unlimited)
+    double retry_budget_ratio;
+
+    // With retry_budget_ratio, retries are always allowed at this rate
+    // regardless of number of calls.
+    // Default: 10
+    int32_t retry_budget_min_per_second;
+
+    // Limit concurrency of calls from this Channel to each server, e.g. a
+    // number or "auto" to adjust the limit with latencies of the server, as
+    // ServerOptions.max_concurrency does. When the server selected by the
+    // load balancer reaches its limit, other servers are tried.
+    // Default: "unlimited"
+    AdaptiveMaxConcurrency max_concurrency_per_server;
+
+    // When all servers tried reach limits of max_concurrency_per_server,
+    // wait at most so many milliseconds for calls to end before failing the
+    // call with ELIMIT.
+    // Default: 0 (fail immediately)
+    int32_t max_concurrency_wait_ms;
     
     // When the error rate of a server node is too high, isolate the node. 
     // Note that this isolation is GLOBAL, the node will become unavailable 
@@ -88,6 +125,13 @@ struct ChannelOptions {
     // Possible values: "single", "pooled", "short".
     AdaptiveConnectionType connection_type;
 
+    // With "single" connection_type, calls to a server are spread over so
+    // many multiplexed connections, preferring the one with least unwritten
+    // bytes, so that a busy server is not bottlenecked by one connection.
+    // Channels with different values do not share connections.
+    // Default: 1
+    int connections_per_server;
+
     // Channel.Init() succeeds even if there's no server in the NamingService. 
     // E.g. the BNS directory is empty. All RPC over the channel will fail before
     // new nodes being added to the NamingService.
@@ -97,6 +141,14 @@ struct ChannelOptions {
     // Default: true.
     bool log_succeed_without_server;
 
+    // Channel.Init() with a NamingService returns without waiting for the
+    // NamingService to return servers, RPC over the channel waits for the
+    // servers within its timeout instead. Useful for creating lots of
+    // channels quickly, e.g. at startup. Channels with the same NamingService
+    // url share one resolution regardless of this option.
+    // Default: false
+    bool async_init;
+
     // SSL related options. Refer to `ChannelSSLOptions' for details
     bool has_ssl_options() const { return _ssl_options != NULL; }
     const ChannelSSLOptions& ssl_options() const { return *_ssl_options.get(); }
@@ -123,16 +175,62 @@ struct ChannelOptions {
     // Default: NULL
     const NamingServiceFilter* ns_filter;
 
+    // Only connect to a stable subset of at most so many servers from the
+    // naming service instead of all of them, to bound the number of
+    // connections when there're many clients and servers. Subsets are
+    // chosen by rendezvous hashing with `subset_key', so that servers are
+    // shared by clients evenly and adding or removing a server changes at
+    // most one server in the subset. Non-positive values mean all servers.
+    // Default: 0
+    int subset_size;
+
+    // Clients with the same key choose the same subset.
+    // Default: "" (ip and pid of this process)
+    std::string subset_key;
+
     // Channels with same connection_group share connections.
     // In other words, set to a different value to stop sharing connections.
     // Case-sensitive, leading and trailing spaces are ignored.
     // Default: ""
     std::string connection_group;
 
+    // Set TCP congestion control, pacing rate, TOS and buffer sizes of
+    // connections of this channel, e.g. to let bulk transfers coexist with
+    // latency-sensitive RPCs. Channels with different options don't share
+    // connections.
+    // Default: all options are system defaults
+    SocketTuningOptions socket_tuning_options;
+
+    // [Linux] Carry TCP connections of this channel by RDMA (RoCE or
+    // InfiniBand), data is sent from and received into registered IOBuf
+    // blocks without copying. Needs brpc built with WITH_RDMA and servers
+    // with ServerOptions.use_rdma, connections fall back to TCP otherwise.
+    // Channels with different values don't share connections.
+    // Default: false
+    bool use_rdma;
+
+    // Send only one of identical calls (same method and serialized request)
+    // in flight at the same time, other calls wait for that one and end
+    // with copies of its response or error, even if they've longer timeouts.
+    // Calls with attachments, streams, http requests or backup requests are
+    // never coalesced. Check rpc_channel_coalesced_call_ratio for effects.
+    // Default: false
+    bool coalesce_identical_calls;
+
+    // Cache responses of methods in memory of this channel, calls with
+    // cached responses are ended without being sent. Calls with
+    // attachments, streams, http requests or backup requests are never
+    // cached. Refer to `ResponseCacheOptions' for details.
+    bool has_response_cache_options() const { return _response_cache_options != NULL; }
+    const ResponseCacheOptions& response_cache_options() const
+    { return *_response_cache_options.get(); }
+    ResponseCacheOptions* mutable_response_cache_options();
+
 private:
     // SSLOptions is large and not often used, allocate it on heap to
     // prevent ChannelOptions from being bloated in most cases.
     butil::PtrContainer<ChannelSSLOptions> _ssl_options;
+    butil::PtrContainer<ResponseCacheOptions> _response_cache_options;
 };
 
 // A Channel represents a communication line to one server or multiple servers
@@ -144,9 +242,16 @@ private:
 //   channel.Init("bns://rdev.matrix.all", "rr", NULL/*default options*/);
 //   MyService_Stub stub(&channel);
 //   stub.MyMethod(&controller, &request, &response, NULL);
+class CallCoalescer;
+class ResponseCache;
+class AdaptiveBackupRequest;
+class RetryBudget;
+class ClientConcurrencyLimiter;
+
 class Channel : public ChannelBase {
 friend class Controller;
 friend class SelectiveChannel;
+friend class ChannelPrivateAccessor;
 public:
     Channel(ProfilerLinker = ProfilerLinker());
     ~Channel();
@@ -225,6 +330,12 @@ protected:
     // It will be destroyed after channel's destruction and all
     // the RPC above has finished
     butil::intrusive_ptr<SharedLoadBalancer> _lb;
+    // Shared with leaders of coalesced calls for the same reason as _lb.
+    butil::intrusive_ptr<CallCoalescer> _coalescer;
+    butil::intrusive_ptr<ResponseCache> _response_cache;
+    butil::intrusive_ptr<AdaptiveBackupRequest> _adaptive_backup_request;
+    butil::intrusive_ptr<RetryBudget> _retry_budget;
+    butil::intrusive_ptr<ClientConcurrencyLimiter> _concurrency_limiter;
     ChannelOptions _options;
     int _preferred_index;
 };
@@ -89,11 +89,39 @@ bool ParseFromCompressedData(const butil::IOBuf& data,
     return false;
 }
 
+// Size of `msg' is computed before serializing anyway, serializing into
+// a contiguous region reserved at once is much faster than going through
+// the stream which is called back block by block.
+static bool SerializeToIOBuf(const google::protobuf::Message& msg,
+                             butil::IOBuf* buf) {
+#if GOOGLE_PROTOBUF_VERSION >= 3001000
+    const size_t size = msg.ByteSizeLong();
+#else
+    const size_t size = msg.ByteSize();
+#endif
+    if (size == 0) {
+        return true;
+    }
+    google::protobuf::uint8* const data =
+        (google::protobuf::uint8*)buf->reserve_contiguous(size);
+    if (data == NULL) {
+        // Larger than the largest block, serialize it block by block.
+        butil::IOBufAsZeroCopyOutputStream wrapper(buf);
+        return msg.SerializeToZeroCopyStream(&wrapper);
+    }
+    if (msg.SerializeWithCachedSizesToArray(data) != data + size) {
+        LOG(ERROR) << "Size of " << msg.GetDescriptor()->full_name()
+                   << " was changed during serialization";
+        buf->pop_back(size);
+        return false;
+    }
+    return true;
+}
+
 bool SerializeAsCompressedData(const google::protobuf::Message& msg,
                                butil::IOBuf* buf, CompressType compress_type) {
     if (compress_type == COMPRESS_TYPE_NONE) {
-        butil::IOBufAsZeroCopyOutputStream wrapper(buf);
-        return msg.SerializeToZeroCopyStream(&wrapper);
+        return SerializeToIOBuf(msg, buf);
     }
     const CompressHandler* handler = FindCompressHandler(compress_type);
     if (NULL != handler) {
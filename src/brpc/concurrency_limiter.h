@@ -22,6 +22,7 @@
 #include "brpc/destroyable.h"
 #include "brpc/extension.h"                       // Extension<T>
 #include "brpc/adaptive_max_concurrency.h"        // AdaptiveMaxConcurrency
+#include "brpc/options.pb.h"                      // RequestPriority
 
 namespace brpc {
 
@@ -35,6 +36,15 @@ public:
     // return an ELIMIT error directly.
     virtual bool OnRequested(int current_concurrency) = 0;
 
+    // Same as above, for a request with `priority'. Limiters aware of
+    // priorities should reject requests with lower priorities first when
+    // the concurrency is close to the upper limit.
+    // The default implementation ignores `priority'.
+    virtual bool OnRequested(int current_concurrency, RequestPriority priority) {
+        (void)priority;
+        return OnRequested(current_concurrency);
+    }
+
     // Each request should call this method before responding.
     // `error_code' : Error code obtained from the controller, 0 means success.
     // `latency' : Microseconds taken by RPC.
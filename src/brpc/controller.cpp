@@ -25,6 +25,9 @@
 #include "butil/string_printf.h"
 #include "butil/logging.h"
 #include "butil/time.h"
+#include "butil/thread_local.h"
+#include "butil/arena.h"                // butil::Arena
+#include "butil/object_pool.h"          // butil::get_object
 #include "bthread/bthread.h"
 #include "bthread/unstable.h"
 #include "bvar/bvar.h"
@@ -43,6 +46,13 @@
 #include "brpc/policy/streaming_rpc_protocol.h" // FIXME
 #include "brpc/rpc_dump.h"
 #include "brpc/details/usercode_backup_pool.h"  // RunUserCode
+#include "brpc/details/pb_arena_pool.h"         // ReturnPooledArena
+#include "brpc/details/adaptive_backup_request.h" // ConsumeBackupRequestBudget
+#include "brpc/details/retry_budget.h"          // RetryBudget
+#include "brpc/details/shared_request_buf.h"    // SharedRequestBuf
+#include "brpc/details/client_concurrency_limiter.h"
+#include "brpc/details/protocol_dispatch.h"     // DispatchPackRequest
+#include "brpc/iobuf_fields.h"                   // IOBufFields
 #include "brpc/mongo_service_adaptor.h"
 
 // Force linking the .o in UT (which analysis deps by inclusions)
@@ -105,6 +115,9 @@ static bvar::PassiveStatus<std::string> s_rpc_revision(
     "rpc_revision", PrintRevision, NULL);
 
 static const int RETRY_AVOIDANCE = 8;
+// Servers selected at most so many times when they reach limits of
+// ChannelOptions.max_concurrency_per_server.
+static const int MAX_LIMITED_SELECTIONS = 3;
 
 // Defined in parallel_channel.cpp
 void DestroyParallelChannelDone(google::protobuf::Closure* c);
@@ -169,6 +182,54 @@ static void CreateIgnoreAllRead() { s_ignore_all_read = new IgnoreAllRead; }
 // directly and indirectly referenced), do them in this method. Notice that
 // you don't have to set the fields to initial state after deletion since
 // they'll be set uniformly after this method is called.
+// Http headers of finished RPCs are reused by later RPCs in the same
+// thread, most http clients and servers create 1 or 2 headers per RPC.
+struct HttpHeaderCache {
+    int size;
+    HttpHeader* headers[16];
+};
+static __thread HttpHeaderCache* tls_http_header_cache = NULL;
+
+static void DestroyHttpHeaderCache(void* arg) {
+    HttpHeaderCache* cache = static_cast<HttpHeaderCache*>(arg);
+    for (int i = 0; i < cache->size; ++i) {
+        delete cache->headers[i];
+    }
+    delete cache;
+    tls_http_header_cache = NULL;
+}
+
+HttpHeader* Controller::NewHttpHeader() {
+    HttpHeaderCache* cache = tls_http_header_cache;
+    if (cache != NULL && cache->size > 0) {
+        return cache->headers[--cache->size];
+    }
+    return new HttpHeader;
+}
+
+void Controller::RecycleHttpHeader(HttpHeader* h) {
+    if (h == NULL) {
+        return;
+    }
+    HttpHeaderCache* cache = tls_http_header_cache;
+    if (cache == NULL) {
+        cache = new (std::nothrow) HttpHeaderCache;
+        if (cache == NULL) {
+            delete h;
+            return;
+        }
+        cache->size = 0;
+        tls_http_header_cache = cache;
+        butil::thread_atexit(DestroyHttpHeaderCache, cache);
+    }
+    if (cache->size >= (int)arraysize(cache->headers)) {
+        delete h;
+        return;
+    }
+    h->Clear();
+    cache->headers[cache->size++] = h;
+}
+
 void Controller::ResetNonPods() {
     if (_span) {
         Span::Submit(_span, butil::cpuwide_time_us());
@@ -181,6 +242,13 @@ void Controller::ResetNonPods() {
     }
     _mongo_session_data.reset();
     delete _sampled_request;
+    if (_arena) {
+        ReturnPooledArena(_arena);
+    }
+    if (_scratch_arena) {
+        _scratch_arena->reset();
+        butil::return_object(_scratch_arena);
+    }
 
     if (!is_used_by_rpc() && _correlation_id != INVALID_BTHREAD_ID) {
         CHECK_NE(EPERM, bthread_id_cancel(_correlation_id));
@@ -193,11 +261,17 @@ void Controller::ResetNonPods() {
     }
     delete _sender;
     _lb.reset(NULL);
+    _method_latency.reset(NULL);
+    _retry_budget.reset(NULL);
+    _concurrency_limiter.reset(NULL);
     _current_call.Reset();
     ExcludedServers::Destroy(_accessed);
     _request_buf.clear();
-    delete _http_request;
-    delete _http_response;
+    _shared_request_buf.reset(NULL);
+    RecycleHttpHeader(_http_request);
+    RecycleHttpHeader(_http_response);
+    delete _request_iobuf_fields;
+    delete _response_iobuf_fields;
     _request_attachment.clear();
     _response_attachment.clear();
     if (_wpa) {
@@ -231,6 +305,8 @@ void Controller::ResetPods() {
 #endif
     _error_code = 0;
     _session_local_data = NULL;
+    _arena = NULL;
+    _scratch_arena = NULL;
     _server = NULL;
     _oncancel_id = INVALID_BTHREAD_ID;
     _auth_context = NULL;
@@ -244,11 +320,15 @@ void Controller::ResetPods() {
     _backup_request_ms = UNSET_MAGIC_NUM;
     _connect_timeout_ms = UNSET_MAGIC_NUM;
     _deadline_us = -1;
+    _inflight_request_bytes = 0;
     _timeout_id = 0;
     _begin_time_us = 0;
     _end_time_us = 0;
+    memset(_phase_begin_us, 0, sizeof(_phase_begin_us));
+    _server_load = ServerLoad();
     _tos = 0;
     _preferred_index = -1;
+    _connections_per_server = 1;
     _request_compress_type = COMPRESS_TYPE_NONE;
     _response_compress_type = COMPRESS_TYPE_NONE;
     _fail_limit = UNSET_MAGIC_NUM;
@@ -270,6 +350,8 @@ void Controller::ResetPods() {
     _idl_result = IDL_VOID_RESULT;
     _http_request = NULL;
     _http_response = NULL;
+    _request_iobuf_fields = NULL;
+    _response_iobuf_fields = NULL;
     _request_stream = INVALID_STREAM_ID;
     _response_stream = INVALID_STREAM_ID;
     _remote_stream_settings = NULL;
@@ -278,6 +360,7 @@ void Controller::ResetPods() {
 Controller::Call::Call(Controller::Call* rhs)
     : nretry(rhs->nretry)
     , need_feedback(rhs->need_feedback)
+    , limited(rhs->limited)
     , enable_circuit_breaker(rhs->enable_circuit_breaker)
     , peer_id(rhs->peer_id)
     , begin_time_us(rhs->begin_time_us)
@@ -287,6 +370,7 @@ Controller::Call::Call(Controller::Call* rhs)
     // setting all the fields to next call and _current_call.OnComplete
     // will behave incorrectly.
     rhs->need_feedback = false;
+    rhs->limited = false;
     rhs->peer_id = INVALID_SOCKET_ID;
     rhs->stream_user_data = NULL;
 }
@@ -298,6 +382,7 @@ Controller::Call::~Call() {
 void Controller::Call::Reset() {
     nretry = 0;
     need_feedback = false;
+    limited = false;
     enable_circuit_breaker = false;
     peer_id = INVALID_SOCKET_ID;
     begin_time_us = 0;
@@ -597,6 +682,12 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
             SetFailed(rc, "Fail to add timer");
             goto END_OF_RPC;
         }
+        if (!ConsumeBackupRequestBudget()) {
+            // Too many backup requests, wait for the current call.
+            _error_code = saved_error;
+            CHECK_EQ(0, bthread_id_unlock(info.id));
+            return;
+        }
         if (!SingleServer()) {
             if (_accessed == NULL) {
                 _accessed = ExcludedServers::Create(
@@ -624,6 +715,10 @@ void Controller::OnVersionedRPCReturned(const CompletionInfo& info,
         //  * we intercepted error from _unfinished_call in OnVersionedRPCReturned
         //  * ERPCTIMEDOUT/ECANCELED are not retrying error by default.
         CHECK_EQ(current_id(), info.id) << "error_code=" << _error_code;
+        if (_retry_budget != NULL && !_retry_budget->TryRetry()) {
+            // Retries of the channel exceed the budget, end with the error.
+            goto END_OF_RPC;
+        }
         if (!SingleServer()) {
             if (_accessed == NULL) {
                 _accessed = ExcludedServers::Create(
@@ -740,10 +835,11 @@ void Controller::Call::OnComplete(
     case CONNECTION_TYPE_SINGLE:
         // Set main socket to be failed for connection refusal of streams.
         // "single" streams are often maintained in a separate SocketMap and
-        // different from the main socket as well.
-        if (c->_stream_creator != NULL &&
-            does_error_affect_main_socket(error_code) &&
-            (sending_sock == NULL || sending_sock->id() != peer_id)) {
+        // different from the main socket as well. So are multiplexed
+        // connections which are not health-checked.
+        if (does_error_affect_main_socket(error_code) &&
+            ((c->_stream_creator != NULL && sending_sock == NULL) ||
+             (sending_sock != NULL && sending_sock->id() != peer_id))) {
             Socket::SetFailed(peer_id);
         }
         break;
@@ -806,6 +902,12 @@ void Controller::Call::OnComplete(
         c->_lb->Feedback(info);
     }
 
+    if (limited) {
+        limited = false;
+        c->_concurrency_limiter->OnResponded(
+            peer_id, error_code, butil::gettimeofday_us() - begin_time_us);
+    }
+
     // Release the `Socket' we used to send/receive data
     sending_sock.reset(NULL);
 }
@@ -882,6 +984,14 @@ void Controller::EndRPC(const CompletionInfo& info) {
     }
     // RPC finished, now it's safe to release `LoadBalancerWithNaming'
     _lb.reset();
+    if (_method_latency) {
+        if (!_error_code) {
+            _method_latency->Record(butil::gettimeofday_us() - _begin_time_us);
+        }
+        _method_latency.reset();
+    }
+    _retry_budget.reset();
+    _concurrency_limiter.reset();
     if (_span) {
         _span->set_ending_cid(info.id);
         _span->set_async(_done);
@@ -1001,9 +1111,15 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
     }
 
     // Pick a target server for sending RPC
+    memset(_phase_begin_us, 0, sizeof(_phase_begin_us));
+    _phase_begin_us[RPC_PHASE_CLIENT_ISSUE] = butil::cpuwide_time_us();
+    _server_load = ServerLoad();
     _current_call.need_feedback = false;
     _current_call.enable_circuit_breaker = has_enabled_circuit_breaker();
     SocketUniquePtr tmp_sock;
+    int nlimited = 0;
+    int64_t limit_wait_until_us = -1;
+SELECT_SERVER:
     if (SingleServer()) {
         // Don't use _current_call.peer_id which is set to -1 after construction
         // of the backup call.
@@ -1037,6 +1153,51 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
         // here.
         _remote_side = tmp_sock->remote_side();
     }
+    if (_concurrency_limiter != NULL) {
+        const int64_t nresponded = _concurrency_limiter->nresponded();
+        if (_concurrency_limiter->OnRequested(_current_call.peer_id)) {
+            _current_call.limited = true;
+        } else {
+            tmp_sock.reset();
+            if (_current_call.need_feedback) {
+                // Not sent. Latency-aware load balancers prefer other
+                // servers after the ELIMIT.
+                const LoadBalancer::CallInfo info =
+                    { start_realtime_us, _current_call.peer_id, ELIMIT, this };
+                _lb->Feedback(info);
+                _current_call.need_feedback = false;
+            }
+            // Let the load balancer select another server.
+            if (!SingleServer() && ++nlimited < MAX_LIMITED_SELECTIONS) {
+                if (_accessed == NULL) {
+                    _accessed = ExcludedServers::Create(RETRY_AVOIDANCE);
+                }
+                if (_accessed != NULL) {
+                    _accessed->Add(_current_call.peer_id);
+                    goto SELECT_SERVER;
+                }
+            }
+            // Wait for calls to end once, no longer than the deadline.
+            if (limit_wait_until_us < 0 &&
+                _concurrency_limiter->wait_ms() > 0) {
+                limit_wait_until_us = butil::gettimeofday_us() +
+                    _concurrency_limiter->wait_ms() * 1000L;
+                if (timeout_ms() >= 0) {
+                    limit_wait_until_us =
+                        std::min(limit_wait_until_us, _deadline_us);
+                }
+            }
+            if (limit_wait_until_us > 0 &&
+                _concurrency_limiter->WaitForResponded(
+                    nresponded, limit_wait_until_us)) {
+                nlimited = 0;
+                goto SELECT_SERVER;
+            }
+            SetFailed(ELIMIT, "Reached max_concurrency_per_server of %s",
+                      endpoint2str(_remote_side).c_str());
+            return HandleSendFailed();
+        }
+    }
     if (_stream_creator) {
         _current_call.stream_user_data =
             _stream_creator->OnCreatingStream(&tmp_sock, this);
@@ -1056,11 +1217,28 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
                            endpoint2str(_remote_side).c_str());
         }
     }
+    _phase_begin_us[RPC_PHASE_CLIENT_CONNECT] = butil::cpuwide_time_us();
     // Handle connection type
+    if (_connection_type == CONNECTION_TYPE_SINGLE && _stream_creator == NULL &&
+        tmp_sock->is_single_connection_disabled()) {
+        // The server can't handle requests pipelined over one connection,
+        // namely HTTP/1.1 servers closing connections early.
+        _connection_type = CONNECTION_TYPE_POOLED;
+    }
     if (_connection_type == CONNECTION_TYPE_SINGLE ||
         _stream_creator != NULL) { // let user decides the sending_sock
         // in the callback(according to connection_type) directly
-        _current_call.sending_sock.reset(tmp_sock.release());
+        if (_stream_creator == NULL && _connections_per_server > 1) {
+            if (tmp_sock->GetMultiplexedSocket(
+                    _connections_per_server, &_current_call.sending_sock) != 0) {
+                tmp_sock.reset();
+                SetFailed(EHOSTDOWN, "Fail to get multiplexed connection");
+                return HandleSendFailed();
+            }
+            tmp_sock.reset();
+        } else {
+            _current_call.sending_sock.reset(tmp_sock.release());
+        }
         // TODO(gejun): Setting preferred index of single-connected socket
         // has two issues:
         //   1. race conditions. If a set perferred_index is overwritten by
@@ -1106,6 +1284,7 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
         _current_call.sending_sock->read_will_be_progressive(_connection_type);
     }
 
+    _phase_begin_us[RPC_PHASE_CLIENT_WRITE] = butil::cpuwide_time_us();
     // Handle authentication
     const Authenticator* using_auth = NULL;
     if (_auth != NULL) {
@@ -1124,8 +1303,13 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
     // Make request
     butil::IOBuf packet;
     SocketMessage* user_packet = NULL;
-    _pack_request(&packet, &user_packet, cid.value, _method, this,
-                  _request_buf, using_auth);
+    {
+        static const int s_owner =
+            butil::iobuf::register_block_owner("rpc_request");
+        butil::iobuf::ScopedBlockOwner scoped_owner(s_owner);
+        DispatchPackRequest(_pack_request, &packet, &user_packet, cid.value,
+                            _method, this, _request_buf, using_auth);
+    }
     // TODO: PackRequest may accept SocketMessagePtr<>?
     SocketMessagePtr<> user_packet_guard(user_packet);
     if (FailedInline()) {
@@ -1167,6 +1351,7 @@ void Controller::IssueRPC(int64_t start_realtime_us) {
         packet_size = packet.size();
         rc = _current_call.sending_sock->Write(&packet, &wopt);
     }
+    _phase_begin_us[RPC_PHASE_CLIENT_WAIT] = butil::cpuwide_time_us();
     if (span) {
         if (_current_call.nretry == 0) {
             span->set_sent_us(butil::cpuwide_time_us());
@@ -1307,6 +1492,31 @@ void* Controller::session_local_data() {
     return NULL;
 }
 
+IOBufFields& Controller::request_iobuf_fields() {
+    if (_request_iobuf_fields == NULL) {
+        _request_iobuf_fields = new IOBufFields;
+    }
+    return *_request_iobuf_fields;
+}
+
+IOBufFields& Controller::response_iobuf_fields() {
+    if (_response_iobuf_fields == NULL) {
+        _response_iobuf_fields = new IOBufFields;
+    }
+    return *_response_iobuf_fields;
+}
+
+google::protobuf::Arena* Controller::arena() const {
+    return _arena ? ArenaOf(_arena) : NULL;
+}
+
+butil::Arena* Controller::scratch_arena() {
+    if (_scratch_arena == NULL) {
+        _scratch_arena = butil::get_object<butil::Arena>();
+    }
+    return _scratch_arena;
+}
+
 void Controller::HandleStreamConnection(Socket *host_socket) {
     if (_request_stream == INVALID_STREAM_ID) {
         CHECK(!has_remote_stream());
@@ -1315,6 +1525,11 @@ void Controller::HandleStreamConnection(Socket *host_socket) {
     SocketUniquePtr ptr;
     if (!FailedInline()) {
         if (Socket::Address(_request_stream, &ptr) != 0) {
+            if (_request_protocol == PROTOCOL_H2 && has_remote_stream()) {
+                // Streams over http2 are connected before the RPC ends and
+                // may be closed to half-close the call.
+                return;
+            }
             if (!FailedInline()) {
                 SetFailed(EREQUEST, "Request stream=%" PRIu64 " was closed before responded",
                                      _request_stream);
@@ -1327,7 +1542,9 @@ void Controller::HandleStreamConnection(Socket *host_socket) {
     }
     if (FailedInline()) {
         Stream::SetFailed(_request_stream);
-        if (_remote_stream_settings != NULL) {
+        // Streams over http2 are reset by the http2 layer when being closed.
+        if (_remote_stream_settings != NULL &&
+            _request_protocol != PROTOCOL_H2) {
             policy::SendStreamRst(host_socket,
                                   _remote_stream_settings->stream_id());
         }
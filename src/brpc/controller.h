@@ -23,6 +23,7 @@
 // on internal structures, use opaque pointers instead.
 
 #include <gflags/gflags.h>                     // Users often need gflags
+#include <algorithm>                     // std::max
 #include <string>
 #include "butil/intrusive_ptr.hpp"             // butil::intrusive_ptr
 #include "bthread/errno.h"                     // Redefine errno
@@ -60,10 +61,24 @@ struct x509_st;
 #endif
 }
 
+namespace google {
+namespace protobuf {
+class Arena;
+}  // namespace protobuf
+}  // namespace google
+
+namespace butil {
+class Arena;
+}  // namespace butil
+
 namespace brpc {
 class Span;
 class Server;
 class SharedLoadBalancer;
+class MethodLatency;
+class RetryBudget;
+class SharedRequestBuf;
+class ClientConcurrencyLimiter;
 class ExcludedServers;
 class RPCSender;
 class StreamSettings;
@@ -72,6 +87,8 @@ class MongoContext;
 class RetryPolicy;
 class InputMessageBase;
 class ThriftStub;
+struct PooledArena;
+class IOBufFields;
 namespace policy {
 class OnServerStreamCreated;
 void ProcessMongoRequest(InputMessageBase*);
@@ -102,6 +119,51 @@ enum StopStyle {
     WAIT_FOR_STOP,
 };
 
+// Phases of a RPC whose beginning times are recorded in Controller, see
+// Controller::phase_begin_us(). A phase ends when the next phase of the same
+// side begins, the last phase of client ends at the end of the RPC.
+enum RpcPhase {
+    // Server side.
+    RPC_PHASE_SERVER_READ = 0,    // The request was read from the socket.
+    RPC_PHASE_SERVER_PARSE,       // Start parsing the request.
+    RPC_PHASE_SERVER_QUEUE,       // The request was parsed and dispatched.
+    RPC_PHASE_SERVER_USERCODE,    // Start running the method.
+    RPC_PHASE_SERVER_SERIALIZE,   // done->Run() was called.
+    RPC_PHASE_SERVER_WRITE,       // Start writing the serialized response.
+    RPC_PHASE_SERVER_WRITTEN,     // The response was queued into the socket.
+    // Client side, recorded for the last try.
+    RPC_PHASE_CLIENT_ISSUE,       // Start selecting a server.
+    RPC_PHASE_CLIENT_CONNECT,     // Start getting a connection to the server.
+    RPC_PHASE_CLIENT_WRITE,       // Start serializing and writing the request.
+    RPC_PHASE_CLIENT_WAIT,        // The request was queued into the socket.
+    RPC_PHASE_CLIENT_PARSE,       // Start parsing the response.
+    RPC_PHASE_COUNT
+};
+
+// Load of a server reported in the response, see Controller::server_load().
+struct ServerLoad {
+    ServerLoad() : cpu_permille(-1), concurrency(-1), max_concurrency(-1) {}
+
+    bool reported() const { return cpu_permille >= 0; }
+
+    // Larger of cpu usage and concurrency / max_concurrency, in per mille.
+    int utilization_permille() const {
+        int u = cpu_permille;
+        if (max_concurrency > 0 && concurrency >= 0) {
+            const int64_t c = (int64_t)concurrency * 1000 / max_concurrency;
+            u = std::max(u, (int)std::min(c, (int64_t)1000));
+        }
+        return u;
+    }
+
+    // Cpu usage of the server process in per mille of all cores.
+    int cpu_permille;
+    // Requests of the method being processed by the server.
+    int concurrency;
+    // Max concurrency of the method, 0 means unlimited.
+    int max_concurrency;
+};
+
 const int32_t UNSET_MAGIC_NUM = -123456789;
 
 // A Controller mediates a single method call. The primary purpose of
@@ -117,6 +179,7 @@ friend class SelectiveChannel;
 friend class ThriftStub;
 friend class schan::Sender;
 friend class schan::SubDone;
+friend class CallCoalescer;
 friend class policy::OnServerStreamCreated;
 friend int StreamCreate(StreamId*, Controller&, const StreamOptions*);
 friend int StreamAccept(StreamId*, Controller&, const StreamOptions*);
@@ -143,17 +206,25 @@ friend void policy::ProcessThriftRequest(InputMessageBase*);
     static const uint32_t FLAGS_ENABLED_CIRCUIT_BREAKER = (1 << 17);
     static const uint32_t FLAGS_ALWAYS_PRINT_PRIMITIVE_FIELDS = (1 << 18);
     static const uint32_t FLAGS_HEALTH_CHECK_CALL = (1 << 19);
+    // Messages of the streaming gRPC call are carried by the stream.
+    static const uint32_t FLAGS_GRPC_STREAM = (1 << 20);
+    static const uint32_t FLAGS_REFRESH_RESPONSE_CACHE = (1 << 21);
+    // The baidu_std request was sent with compact meta.
+    static const uint32_t FLAGS_COMPACT_RPC_META = (1 << 22);
+    static const uint32_t FLAGS_CACHE_COMPRESSED_RESPONSE = (1 << 23);
 
 public:
     struct Inheritable {
-        Inheritable() : log_id(0) {}
+        Inheritable() : log_id(0), request_priority(REQUEST_PRIORITY_NORMAL) {}
         void Reset() {
             log_id = 0;
             request_id.clear();
+            request_priority = REQUEST_PRIORITY_NORMAL;
         }
 
         uint64_t log_id;
         std::string request_id;
+        RequestPriority request_priority;
     };
 
 public:
@@ -206,6 +277,19 @@ public:
         return _end_time_us - _begin_time_us;
     }
 
+    // butil::cpuwide_time_us() when `phase' of this RPC began, 0 if the
+    // phase was not reached or not recorded by the protocol. E.g. time spent
+    // in the method of server is phase_begin_us(RPC_PHASE_SERVER_SERIALIZE)
+    // - phase_begin_us(RPC_PHASE_SERVER_USERCODE).
+    int64_t phase_begin_us(RpcPhase phase) const {
+        return _phase_begin_us[phase];
+    }
+
+    // [Client-side] Load reported by the server in the response of the
+    // last try, reported() is false if the server does not report load
+    // (only baidu_std servers with -baidu_protocol_load_report on do).
+    const ServerLoad& server_load() const { return _server_load; }
+
     // Response of the RPC call (passed to CallMethod)
     google::protobuf::Message* response() const { return _response; }
 
@@ -216,11 +300,19 @@ public:
 
     void set_request_id(std::string request_id) { _inheritable.request_id = request_id; }
 
+    // Priority to send to server along with request(baidu_std and http).
+    // When the server is overloaded, requests with lower priorities are
+    // rejected first by ConcurrencyLimiters aware of priorities.
+    // Default: REQUEST_PRIORITY_NORMAL
+    void set_request_priority(RequestPriority priority)
+    { _inheritable.request_priority = priority; }
+
     // Set type of service: http://en.wikipedia.org/wiki/Type_of_service
     // Current implementation has limits: If the connection is already
     // established, this setting has no effect until the connection is broken
     // and re-connected. And because of connection sharing, setting different
-    // tos to a single connection is undefined.
+    // tos to a single connection is undefined. Set tos of a channel with
+    // ChannelOptions.socket_tuning_options instead.
     void set_type_of_service(short tos) { _tos = tos; }
 
     // Set type of connections for sending RPC.
@@ -241,7 +333,7 @@ public:
     // Mutable header of http request.
     HttpHeader& http_request() {
         if (_http_request == NULL) {
-            _http_request = new HttpHeader;
+            _http_request = NewHttpHeader();
         }
         return *_http_request;
     }
@@ -256,6 +348,14 @@ public:
     // directly instead of being serialized into protobuf messages.
     butil::IOBuf& request_attachment() { return _request_attachment; }
 
+    // [baidu_std only] Payloads of bytes fields marked with (iobuf_field) in
+    // the request, which are sent without being copied at client-side and
+    // reference the received blocks at server-side. When the request is
+    // compressed, marked fields are parsed into the message as usual.
+    // See brpc/iobuf_fields.h
+    IOBufFields& request_iobuf_fields();
+    bool has_request_iobuf_fields() const { return _request_iobuf_fields; }
+
     ConnectionType connection_type() const { return _connection_type; }
     // Get the called method. May-be NULL for non-pb services.
     const google::protobuf::MethodDescriptor* method() const { return _method; }
@@ -289,6 +389,8 @@ public:
 
     // Make the RPC end when the HTTP response has complete headers and let
     // user read the remaining body by using ReadProgressiveAttachmentBy().
+    // Baidu_std responses end before the attachment, which is read in the
+    // same way. Not supported over single connections.
     void response_will_be_read_progressively() { add_flag(FLAGS_READ_PROGRESSIVELY); }
     // True if response_will_be_read_progressively() was called.
     bool is_response_read_progressively() const { return has_flag(FLAGS_READ_PROGRESSIVELY); }
@@ -302,6 +404,8 @@ public:
     //   ReadProgressiveAttachmentBy(), the reader is Destroyed() immediately.
     // - Any error occurred will destroy the reader by calling r->Destroy().
     // - r->Destroy() is guaranteed to be called once and only once.
+    // Server-side, methods with ServiceOptions.enable_progressive_read read
+    // attachments of baidu_std requests by this function as well.
     void ReadProgressiveAttachmentBy(ProgressiveReader* r);
     
     // True if ReadProgressiveAttachmentBy() was ever called successfully.
@@ -329,6 +433,12 @@ public:
     // the default behavior and print primitive fields regardless of their values.
     void set_always_print_primitive_fields(bool f) { set_flag(FLAGS_ALWAYS_PRINT_PRIMITIVE_FIELDS, f); }
     bool has_always_print_primitive_fields() const { return has_flag(FLAGS_ALWAYS_PRINT_PRIMITIVE_FIELDS); }
+
+    // Set if the call should be sent even if its response is cached by the
+    // channel (ChannelOptions.response_cache_options), the cache is updated
+    // with the new response.
+    void set_refresh_response_cache(bool f) { set_flag(FLAGS_REFRESH_RESPONSE_CACHE, f); }
+    bool has_refresh_response_cache() const { return has_flag(FLAGS_REFRESH_RESPONSE_CACHE); }
     
 
     // Tell RPC that done of the RPC can be run in the same thread where
@@ -378,7 +488,7 @@ public:
     // Mutable header of http response.
     HttpHeader& http_response() {
         if (_http_response == NULL) {
-            _http_response = new HttpHeader;
+            _http_response = NewHttpHeader();
         }
         return *_http_response;
     }
@@ -393,6 +503,11 @@ public:
     // directly instead of being serialized into protobuf messages.
     butil::IOBuf& response_attachment() { return _response_attachment; }
 
+    // [baidu_std only] Payloads of bytes fields marked with (iobuf_field) in
+    // the response, see request_iobuf_fields().
+    IOBufFields& response_iobuf_fields();
+    bool has_response_iobuf_fields() const { return _response_iobuf_fields; }
+
     // Create a ProgressiveAttachment to write (often after RPC).
     // If `stop_style' is FORCE_STOP, the underlying socket will be failed
     // immediately when the socket becomes idle or server is stopped.
@@ -404,6 +519,13 @@ public:
 
     // Set compression method for response.
     void set_response_compress_type(CompressType t) { _response_compress_type = t; }
+
+    // [http only] Set if the response body is likely to be sent again (e.g.
+    // static files), the compressed body is cached by the hash of the body
+    // so that identical bodies are compressed only once.
+    // Pages of builtin services are always cached.
+    void set_cache_compressed_response(bool f) { set_flag(FLAGS_CACHE_COMPRESSED_RESPONSE, f); }
+    bool has_cache_compressed_response() const { return has_flag(FLAGS_CACHE_COMPRESSED_RESPONSE); }
     
     // Non-zero when this RPC call is traced (by rpcz or rig).
     // NOTE: Only valid at server-side, always zero at client-side.
@@ -432,6 +554,22 @@ public:
     // RPC. If factory is NULL, this method returns NULL.
     void* session_local_data();
 
+    // The arena of protobuf where request and response of this RPC session
+    // are allocated when ServerOptions.use_pb_arena is true, NULL otherwise.
+    // Messages created on the arena are destroyed after the response is
+    // sent, so don't reference them in other RPC sessions.
+    google::protobuf::Arena* arena() const;
+
+    // Arena for scratch allocations of this RPC session, e.g. temporary
+    // structures of the handler (use butil::ArenaAllocator for STL
+    // containers). Memory is freed in bulk when the session ends and the
+    // arena is returned to a pool reused by the same worker mostly, so
+    // that such allocations rarely touch malloc. Objects with destructors
+    // should be registered with butil::Arena::add_cleanup(). Not
+    // thread-safe. Put protobuf messages on arena() instead. Returns NULL
+    // if memory is exhausted.
+    butil::Arena* scratch_arena();
+
     // Get the data attached to a mongo session(practically a socket).
     MongoContext* mongo_session_data() { return _mongo_session_data.get(); }
     
@@ -457,6 +595,9 @@ public:
 
     // Resets the Controller to its initial state so that it may be reused in
     // a new call.  Must NOT be called while an RPC is in progress.
+    // Attachments and error text keep their capacities and http headers are
+    // cached per thread, so reusing a Controller(see brpc/pooled_call.h)
+    // is cheaper than destroying it and creating a new one.
     void Reset() override {
         ResetNonPods();
         ResetPods();
@@ -490,6 +631,8 @@ public:
     bool has_log_id() const { return has_flag(FLAGS_LOG_ID); }
     uint64_t log_id() const { return _inheritable.log_id; }
     const std::string& request_id() const { return _inheritable.request_id; }
+    RequestPriority request_priority() const
+    { return _inheritable.request_priority; }
     CompressType request_compress_type() const { return _request_compress_type; }
     CompressType response_compress_type() const { return _response_compress_type; }
     const HttpHeader& http_request() const 
@@ -597,6 +740,12 @@ private:
     void ResetPods();
     void ResetNonPods();
 
+    // Get a cleared HttpHeader from the per-thread cache or create one.
+    static HttpHeader* NewHttpHeader();
+    // Clear `h' and put it into the per-thread cache, or delete it when
+    // the cache is full.
+    static void RecycleHttpHeader(HttpHeader* h);
+
     void StartCancel() override;
 
     // Using fixed start_realtime_us (microseconds since the Epoch) gives
@@ -649,6 +798,7 @@ private:
 
         int nretry;                     // sent in nretry-th retry.
         bool need_feedback;             // The LB needs feedback.
+        bool limited;                   // Counted by _concurrency_limiter.
         bool enable_circuit_breaker;    // The channel enabled circuit_breaker
         bool touched_by_stream_creator; 
         SocketId peer_id;               // main server id
@@ -710,6 +860,8 @@ private:
     butil::EndPoint _local_side;
     
     void* _session_local_data;
+    PooledArena* _arena;
+    butil::Arena* _scratch_arena;
     const Server* _server;
     bthread_id_t _oncancel_id;
     const AuthContext* _auth_context;        // Authentication result
@@ -738,15 +890,22 @@ private:
     int32_t _backup_request_ms;
     // Deadline of this RPC (since the Epoch in microseconds).
     int64_t _deadline_us;
+    // [Server-side] Bytes of the request charged to max_inflight_request_bytes
+    int64_t _inflight_request_bytes;
     // Timer registered to trigger RPC timeout event
     bthread_timer_t _timeout_id;
 
     // Begin/End time of a single RPC call (since Epoch in microseconds)
     int64_t _begin_time_us;
     int64_t _end_time_us;
+    int64_t _phase_begin_us[RPC_PHASE_COUNT];
+    ServerLoad _server_load;
     short _tos;    // Type of service.
     // The index of parse function which `InputMessenger' will use
     int _preferred_index;
+    // Number of multiplexed connections to a server with
+    // CONNECTION_TYPE_SINGLE.
+    int _connections_per_server;
     CompressType _request_compress_type;
     CompressType _response_compress_type;
     Inheritable _inheritable;
@@ -757,6 +916,12 @@ private:
     uint64_t _request_code;
     SocketId _single_server_id;
     butil::intrusive_ptr<SharedLoadBalancer> _lb;
+    // Latencies of the method for adaptive backup requests, NULL if disabled.
+    butil::intrusive_ptr<MethodLatency> _method_latency;
+    // Limits retries of the channel, NULL if unlimited.
+    butil::intrusive_ptr<RetryBudget> _retry_budget;
+    // Limits concurrency of the channel to each server, NULL if unlimited.
+    butil::intrusive_ptr<ClientConcurrencyLimiter> _concurrency_limiter;
 
     // for passing parameters to created bthread, don't modify it otherwhere.
     CompletionInfo _tmp_completion_info;
@@ -772,11 +937,16 @@ private:
     const google::protobuf::MethodDescriptor* _method;
     const Authenticator* _auth;
     butil::IOBuf _request_buf;
+    // Set by ParallelChannel/SelectiveChannel to share the serialized request
+    // between sub calls, NULL otherwise.
+    butil::intrusive_ptr<SharedRequestBuf> _shared_request_buf;
     IdlNames _idl_names;
     int64_t _idl_result;
 
     HttpHeader* _http_request;
     HttpHeader* _http_response;
+    IOBufFields* _request_iobuf_fields;
+    IOBufFields* _response_iobuf_fields;
 
     std::unique_ptr<KVMap> _session_kv;
 
@@ -0,0 +1,107 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_COROUTINE_H
+#define BRPC_COROUTINE_H
+
+// [C++20 only] co_await RPCs inside bthread::Awaitable coroutines, see
+// bthread/coroutine.h for running coroutines.
+//
+//   bthread::Awaitable<void> Aggregate(brpc::Channel* channel) {
+//       example::EchoService_Stub stub(channel);
+//       brpc::Controller cntl;
+//       example::EchoRequest request;
+//       example::EchoResponse response;
+//       co_await brpc::co_call([&](google::protobuf::Closure* done) {
+//           stub.Echo(&cntl, &request, &response, done);
+//       });
+//       if (cntl.Failed()) { ... }
+//   }
+//
+// Unlike synchronous RPCs, no bthread (and its stack) is blocked while
+// the RPC is in flight, the coroutine is resumed on a bthread worker when
+// the RPC is done.
+
+#include "bthread/coroutine.h"
+
+#ifdef BTHREAD_HAS_COROUTINE
+
+#include <utility>                                  // std::move
+#include <google/protobuf/service.h>                // Closure, RpcChannel
+#include "butil/atomicops.h"
+#include "brpc/controller.h"
+
+namespace brpc {
+
+// co_await brpc::co_call(fn) calls `fn(done)' which should start an
+// asynchronous operation (namely an RPC) and call done->Run() when the
+// operation completes. The coroutine is suspended until then.
+template <typename F>
+class DoneAwaiter : public google::protobuf::Closure {
+public:
+    explicit DoneAwaiter(F fn) : _fn(std::move(fn)), _state(INIT) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        _handle = h;
+        _fn(this);
+        // Run() may be called inside _fn, don't suspend in which case.
+        return _state.exchange(SUSPENDED, butil::memory_order_acq_rel) != DONE;
+    }
+    void await_resume() const noexcept {}
+
+    void Run() override {
+        const std::coroutine_handle<> h = _handle;
+        // DON'T touch *this after this exchange which may let the coroutine
+        // go on and destroy the awaiter.
+        if (_state.exchange(DONE, butil::memory_order_acq_rel) == SUSPENDED) {
+            bthread::internal::resume_on_worker(h);
+        }
+    }
+
+private:
+    enum State { INIT, SUSPENDED, DONE };
+
+    F _fn;
+    std::coroutine_handle<> _handle;
+    butil::atomic<int> _state;
+};
+
+template <typename F>
+DoneAwaiter<F> co_call(F fn) {
+    return DoneAwaiter<F>(std::move(fn));
+}
+
+// co_await brpc::co_call_method(...) is the coroutine version of
+// channel->CallMethod(method, cntl, request, response, done). Check
+// cntl->Failed() after the co_await expression.
+inline auto co_call_method(google::protobuf::RpcChannel* channel,
+                           const google::protobuf::MethodDescriptor* method,
+                           Controller* cntl,
+                           const google::protobuf::Message* request,
+                           google::protobuf::Message* response) {
+    return co_call([=](google::protobuf::Closure* done) {
+        channel->CallMethod(method, cntl, request, response, done);
+    });
+}
+
+} // namespace brpc
+
+#endif  // BTHREAD_HAS_COROUTINE
+
+#endif  // BRPC_COROUTINE_H
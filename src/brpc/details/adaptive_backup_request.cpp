@@ -0,0 +1,137 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "bvar/bvar.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/adaptive_backup_request.h"
+
+
+namespace brpc {
+
+static bool validate_backup_request_max_ratio(const char*, double val) {
+    return val >= 0 && val <= 1;
+}
+DEFINE_double(backup_request_max_ratio, 0, "Backup requests of all channels "
+              "in recent 10 seconds are no more than this ratio of calls, "
+              "0 means unlimited");
+BRPC_VALIDATE_GFLAG(backup_request_max_ratio, validate_backup_request_max_ratio);
+
+// Percentiles are not used until a method has so many samples.
+static const int64_t MIN_SAMPLES = 100;
+// Percentiles are recomputed at most once in this interval.
+static const int64_t UPDATE_INTERVAL_US = 100000;
+static const time_t BUDGET_WINDOW_S = 10;
+
+struct BackupRequestBudget {
+    bvar::Adder<int64_t> ncall;
+    bvar::Window<bvar::Adder<int64_t> > ncall_window;
+    bvar::Adder<int64_t> nbackup;
+    bvar::Window<bvar::Adder<int64_t> > nbackup_window;
+    bvar::Adder<int64_t> nthrottled;
+
+    BackupRequestBudget()
+        : ncall_window(&ncall, BUDGET_WINDOW_S)
+        , nbackup("rpc_backup_request_count")
+        , nbackup_window(&nbackup, BUDGET_WINDOW_S)
+        , nthrottled("rpc_backup_request_throttled_count") {}
+};
+
+inline BackupRequestBudget* get_backup_request_budget() {
+    return butil::get_leaky_singleton<BackupRequestBudget>();
+}
+
+void AddBackupRequestBudget() {
+    get_backup_request_budget()->ncall << 1;
+}
+
+bool ConsumeBackupRequestBudget() {
+    BackupRequestBudget* b = get_backup_request_budget();
+    const double max_ratio = FLAGS_backup_request_max_ratio;
+    if (max_ratio > 0) {
+        // Values of windows are updated every second, calls in the latest
+        // second are not counted.
+        const int64_t ncall = b->ncall_window.get_value();
+        if (b->nbackup_window.get_value() >= ncall * max_ratio) {
+            b->nthrottled << 1;
+            return false;
+        }
+    }
+    b->nbackup << 1;
+    return true;
+}
+
+MethodLatency::MethodLatency(double percentile)
+    : _ratio(percentile / 100)
+    , _backup_request_ms(-1)
+    , _last_update_us(0) {
+}
+
+int64_t MethodLatency::backup_request_ms() {
+    const int64_t now_us = butil::gettimeofday_us();
+    int64_t last_us = _last_update_us.load(butil::memory_order_relaxed);
+    if (now_us >= last_us + UPDATE_INTERVAL_US &&
+        _last_update_us.compare_exchange_strong(
+            last_us, now_us, butil::memory_order_relaxed)) {
+        int64_t ms = -1;
+        if (_latency.count() >= MIN_SAMPLES) {
+            const int64_t us = _latency.latency_percentile(_ratio);
+            if (us > 0) {
+                ms = (us + 999) / 1000;
+            }
+        }
+        _backup_request_ms.store(ms, butil::memory_order_relaxed);
+    }
+    return _backup_request_ms.load(butil::memory_order_relaxed);
+}
+
+AdaptiveBackupRequest::AdaptiveBackupRequest(double percentile)
+    : _percentile(percentile) {
+}
+
+bool AdaptiveBackupRequest::AddMethod(
+    MethodMap& bg, const google::protobuf::MethodDescriptor* method,
+    const butil::intrusive_ptr<MethodLatency>& latency) {
+    return bg.insert(std::make_pair(method, latency)).second;
+}
+
+butil::intrusive_ptr<MethodLatency> AdaptiveBackupRequest::GetMethodLatency(
+    const google::protobuf::MethodDescriptor* method) {
+    {
+        butil::DoublyBufferedData<MethodMap>::ScopedPtr s;
+        if (_methods.Read(&s) != 0) {
+            return NULL;
+        }
+        MethodMap::const_iterator it = s->find(method);
+        if (it != s->end()) {
+            return it->second;
+        }
+    }
+    butil::intrusive_ptr<MethodLatency> latency(new MethodLatency(_percentile));
+    _methods.Modify(AddMethod, method, latency);
+    // Another thread may add the method just now.
+    butil::DoublyBufferedData<MethodMap>::ScopedPtr s;
+    if (_methods.Read(&s) != 0) {
+        return NULL;
+    }
+    return s->find(method)->second;
+}
+
+} // namespace brpc
@@ -0,0 +1,87 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_ADAPTIVE_BACKUP_REQUEST_H
+#define BRPC_ADAPTIVE_BACKUP_REQUEST_H
+
+#include <map>
+#include "butil/atomicops.h"                   // butil::atomic
+#include "butil/containers/doubly_buffered_data.h"
+#include "bvar/latency_recorder.h"             // bvar::LatencyRecorder
+#include "brpc/shared_object.h"                // SharedObject
+
+namespace google {
+namespace protobuf {
+class MethodDescriptor;
+}  // namespace protobuf
+}  // namespace google
+
+
+namespace brpc {
+
+// Recent latencies of a method over a Channel.
+class MethodLatency : public SharedObject {
+public:
+    explicit MethodLatency(double percentile);
+
+    // Record latency of a successful call.
+    void Record(int64_t latency_us) { _latency << latency_us; }
+
+    // Returns the percentile of recent latencies in milliseconds, or -1
+    // if there're not enough samples yet.
+    int64_t backup_request_ms();
+
+private:
+    double _ratio;
+    bvar::LatencyRecorder _latency;
+    butil::atomic<int64_t> _backup_request_ms;
+    butil::atomic<int64_t> _last_update_us;
+};
+
+// Delay backup requests of each method over a Channel by a percentile of
+// recent latencies of the method.
+class AdaptiveBackupRequest : public SharedObject {
+public:
+    explicit AdaptiveBackupRequest(double percentile);
+
+    // Returns latencies of `method', created on first call.
+    butil::intrusive_ptr<MethodLatency> GetMethodLatency(
+        const google::protobuf::MethodDescriptor* method);
+
+private:
+    typedef std::map<const google::protobuf::MethodDescriptor*,
+                     butil::intrusive_ptr<MethodLatency> > MethodMap;
+    static bool AddMethod(MethodMap& bg,
+                          const google::protobuf::MethodDescriptor* method,
+                          const butil::intrusive_ptr<MethodLatency>& latency);
+
+    double _percentile;
+    butil::DoublyBufferedData<MethodMap> _methods;
+};
+
+// Count a call for the budget of backup requests.
+void AddBackupRequestBudget();
+
+// Returns true if a backup request can be sent within the budget set by
+// -backup_request_max_ratio, and counts it.
+bool ConsumeBackupRequestBudget();
+
+} // namespace brpc
+
+
+#endif  // BRPC_ADAPTIVE_BACKUP_REQUEST_H
@@ -0,0 +1,155 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include "bvar/bvar.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/scoped_lock.h"
+#include "bthread/bthread.h"                 // bthread_id_lock
+#include "brpc/details/call_coalescer.h"
+
+
+namespace brpc {
+
+static double GetCoalescedCallRatio(void*);
+
+struct CallCoalescerBvars {
+    bvar::Adder<int64_t> leader_count;
+    bvar::Adder<int64_t> coalesced_count;
+    bvar::PassiveStatus<double> coalesced_ratio;
+
+    CallCoalescerBvars()
+        : leader_count("rpc_channel_coalescing_leader_count")
+        , coalesced_count("rpc_channel_coalesced_call_count")
+        , coalesced_ratio("rpc_channel_coalesced_call_ratio",
+                          GetCoalescedCallRatio, this) {
+    }
+};
+
+inline CallCoalescerBvars* get_call_coalescer_bvars() {
+    return butil::get_leaky_singleton<CallCoalescerBvars>();
+}
+
+// Ratio of calls that were not sent because of coalescing.
+static double GetCoalescedCallRatio(void* arg) {
+    CallCoalescerBvars* bvars = static_cast<CallCoalescerBvars*>(arg);
+    const int64_t ncoalesced = bvars->coalesced_count.get_value();
+    const int64_t ntotal = ncoalesced + bvars->leader_count.get_value();
+    return ntotal > 0 ? (double)ncoalesced / ntotal : 0;
+}
+
+class CoalescedLeaderDone : public google::protobuf::Closure {
+public:
+    CoalescedLeaderDone(CallCoalescer* coalescer, const std::string& key,
+                        const Controller* leader,
+                        google::protobuf::Closure* done)
+        : _coalescer(coalescer), _key(key), _leader(leader), _done(done) {}
+
+    void Run() override {
+        _coalescer->Finish(_key, _leader);
+        google::protobuf::Closure* done = _done;
+        delete this;
+        done->Run();
+    }
+
+private:
+    // Referenced since the channel may be destroyed before the call ends.
+    butil::intrusive_ptr<CallCoalescer> _coalescer;
+    std::string _key;
+    const Controller* _leader;
+    google::protobuf::Closure* _done;
+};
+
+bool CallCoalescer::MakeKey(const google::protobuf::MethodDescriptor* method,
+                            const Controller* cntl, std::string* key) {
+    if (method == NULL ||
+        cntl->_response == NULL ||
+        !cntl->request_attachment().empty() ||
+        cntl->has_http_request() ||
+        cntl->_request_stream != INVALID_STREAM_ID ||
+        cntl->backup_request_ms() >= 0) {
+        return false;
+    }
+    key->reserve(method->full_name().size() + 1 + cntl->_request_buf.size());
+    key->append(method->full_name());
+    key->push_back('\0');
+    cntl->_request_buf.append_to(key);
+    return true;
+}
+
+bool CallCoalescer::Join(const std::string& key, Controller* cntl) {
+    const CallId cid = cntl->current_id();
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::unordered_map<std::string, std::vector<CallId> >::iterator it =
+            _waiters.find(key);
+        if (it == _waiters.end()) {
+            _waiters[key];
+            get_call_coalescer_bvars()->leader_count << 1;
+            return false;
+        }
+        it->second.push_back(cid);
+    }
+    get_call_coalescer_bvars()->coalesced_count << 1;
+    // The result comes from the leader, don't retry by itself.
+    cntl->set_max_retry(0);
+    // Let the leader lock the id and end the call.
+    CHECK_EQ(0, bthread_id_unlock(cid));
+    return true;
+}
+
+void CallCoalescer::Finish(const std::string& key, const Controller* leader) {
+    std::vector<CallId> ids;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::unordered_map<std::string, std::vector<CallId> >::iterator it =
+            _waiters.find(key);
+        if (it == _waiters.end()) {
+            return;
+        }
+        ids.swap(it->second);
+        _waiters.erase(it);
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        Controller* cntl = NULL;
+        if (bthread_id_lock(ids[i], (void**)&cntl) != 0) {
+            // The call was ended already, namely timedout or canceled.
+            continue;
+        }
+        const int saved_error = cntl->ErrorCode();
+        if (leader->Failed()) {
+            cntl->SetFailed(leader->_error_text);
+            cntl->_error_code = leader->_error_code;
+        } else {
+            cntl->_response->CopyFrom(*leader->_response);
+            cntl->response_attachment() = leader->response_attachment();
+        }
+        cntl->_remote_side = leader->_remote_side;
+        const Controller::CompletionInfo info = { ids[i], true };
+        // Run done of asynchronous calls in new bthreads so that they're
+        // not delayed by each other.
+        cntl->OnVersionedRPCReturned(info, cntl->_done != NULL, saved_error);
+    }
+}
+
+google::protobuf::Closure* CallCoalescer::WrapDone(
+    const std::string& key, const Controller* leader,
+    google::protobuf::Closure* done) {
+    return new CoalescedLeaderDone(this, key, leader, done);
+}
+
+} // namespace brpc
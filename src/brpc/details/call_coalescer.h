@@ -0,0 +1,70 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_CALL_COALESCER_H
+#define BRPC_CALL_COALESCER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <google/protobuf/stubs/callback.h>   // google::protobuf::Closure
+#include "butil/synchronization/lock.h"       // butil::Mutex
+#include "brpc/shared_object.h"               // SharedObject
+#include "brpc/controller.h"                  // Controller, CallId
+
+
+namespace brpc {
+
+// Coalesce identical calls over a Channel that are in flight at the same
+// time: only the first call (the leader) is sent, others wait for the
+// leader and end with copies of its response or error.
+// Calls are identical if they have same method and serialized request.
+class CallCoalescer : public SharedObject {
+public:
+    // Make the key of the call in `cntl' whose request is serialized.
+    // Returns false if the call should not be coalesced, namely it has an
+    // attachment, a stream, http headers or backup requests, which are not
+    // covered by the key.
+    static bool MakeKey(const google::protobuf::MethodDescriptor* method,
+                        const Controller* cntl, std::string* key);
+
+    // Returns true if `cntl' joined a leader with the same key and will be
+    // ended by the leader, in which case the call id of `cntl' is unlocked.
+    // Otherwise `cntl' becomes the leader and Finish() must be called with
+    // the result before the call ends.
+    bool Join(const std::string& key, Controller* cntl);
+
+    // End all calls joined the leader of `key' with the result of `leader'.
+    void Finish(const std::string& key, const Controller* leader);
+
+    // Returns a closure calling Finish(key, leader) and then `done', for
+    // asynchronous leaders.
+    google::protobuf::Closure* WrapDone(const std::string& key,
+                                        const Controller* leader,
+                                        google::protobuf::Closure* done);
+
+private:
+    butil::Mutex _mutex;
+    // Ids of calls waiting for the leader of each key.
+    std::unordered_map<std::string, std::vector<CallId> > _waiters;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_CALL_COALESCER_H
@@ -0,0 +1,57 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BRPC_CHANNEL_PRIVATE_ACCESSOR_H
+#define BRPC_CHANNEL_PRIVATE_ACCESSOR_H
+
+#include "brpc/channel.h"
+#include "brpc/load_balancer.h"
+#include "brpc/socket.h"
+
+namespace brpc {
+
+// A wrapper to access some private methods/fields of `Channel'
+// This is supposed to be used by internal RPC protocols ONLY
+class ChannelPrivateAccessor {
+public:
+    explicit ChannelPrivateAccessor(const Channel* channel) {
+        CHECK(channel);
+        _channel = channel;
+    }
+
+    // Returns the server that a request with `request_code' would be sent
+    // to at this moment, INVALID_SOCKET_ID if no server is available.
+    SocketId SelectServer(uint64_t request_code) const {
+        if (_channel->SingleServer()) {
+            return _channel->_server_id;
+        }
+        SocketUniquePtr ptr;
+        LoadBalancer::SelectIn sel_in = { 0, false, true, request_code, NULL };
+        LoadBalancer::SelectOut sel_out(&ptr);
+        if (_channel->_lb->SelectServer(sel_in, &sel_out) != 0) {
+            return INVALID_SOCKET_ID;
+        }
+        return ptr->id();
+    }
+
+private:
+    const Channel* _channel;
+};
+
+} // namespace brpc
+
+#endif // BRPC_CHANNEL_PRIVATE_ACCESSOR_H
@@ -0,0 +1,169 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include "butil/time.h"
+#include "brpc/socket.h"                           // Socket::Address
+#include "brpc/details/client_concurrency_limiter.h"
+
+
+namespace brpc {
+
+int ClientConcurrencyLimiter::Create(
+    const AdaptiveMaxConcurrency& amc, int32_t wait_ms,
+    butil::intrusive_ptr<ClientConcurrencyLimiter>* out) {
+    if (amc.type() == AdaptiveMaxConcurrency::UNLIMITED()) {
+        out->reset();
+        return 0;
+    }
+    const ConcurrencyLimiter* cl =
+        ConcurrencyLimiterExtension()->Find(amc.type().c_str());
+    if (cl == NULL) {
+        LOG(ERROR) << "Fail to find ConcurrencyLimiter by `" << amc.value() << "'";
+        return -1;
+    }
+    // Check if the limiter can be created from `amc'.
+    std::unique_ptr<ConcurrencyLimiter> test(cl->New(amc));
+    if (test == NULL) {
+        LOG(ERROR) << "Fail to new ConcurrencyLimiter by `" << amc.value() << "'";
+        return -1;
+    }
+    out->reset(new ClientConcurrencyLimiter(cl, amc, wait_ms));
+    return 0;
+}
+
+ClientConcurrencyLimiter::ClientConcurrencyLimiter(
+    const ConcurrencyLimiter* prototype, const AdaptiveMaxConcurrency& amc,
+    int32_t wait_ms)
+    : _prototype(prototype)
+    , _amc(amc)
+    , _wait_ms(wait_ms)
+    , _nresponded(0)
+    , _nwaiters(0) {
+}
+
+ClientConcurrencyLimiter::~ClientConcurrencyLimiter() {
+}
+
+size_t ClientConcurrencyLimiter::AddServer(
+    ServerMap& bg, const ServerMap& fg,
+    const std::shared_ptr<Server>& server,
+    const std::vector<SocketId>& removed) {
+    if (!bg.initialized()) {
+        CHECK_EQ(0, bg.init(64, 70));
+    }
+    for (size_t i = 0; i < removed.size(); ++i) {
+        bg.erase(removed[i]);
+    }
+    // Share the server created by another thread with the foreground.
+    const std::shared_ptr<Server>* p = fg.initialized() ? fg.seek(server->id) : NULL;
+    bg[server->id] = (p != NULL ? *p : server);
+    return 1;
+}
+
+std::shared_ptr<ClientConcurrencyLimiter::Server>
+ClientConcurrencyLimiter::GetServer(SocketId id, bool create) {
+    std::vector<SocketId> removed;
+    {
+        butil::DoublyBufferedData<ServerMap>::ScopedPtr s;
+        if (_servers.Read(&s) != 0) {
+            return NULL;
+        }
+        if (s->initialized()) {
+            const std::shared_ptr<Server>* p = s->seek(id);
+            if (p != NULL) {
+                return *p;
+            }
+        }
+        if (!create) {
+            return NULL;
+        }
+        // Drop idle servers removed from the channel, which is rare and
+        // O(N) as adding servers to load balancers.
+        if (s->initialized()) {
+            for (ServerMap::const_iterator it = s->begin(); it != s->end(); ++it) {
+                SocketUniquePtr ptr;
+                if (Socket::Address(it->first, &ptr) != 0 &&
+                    it->second->concurrency.load(butil::memory_order_relaxed) == 0) {
+                    removed.push_back(it->first);
+                }
+            }
+        }
+    }
+    std::shared_ptr<Server> server(new Server(id));
+    server->limiter.reset(_prototype->New(_amc));
+    if (server->limiter == NULL) {
+        return NULL;
+    }
+    _servers.ModifyWithForeground(AddServer, server, removed);
+    return GetServer(id, false);
+}
+
+bool ClientConcurrencyLimiter::OnRequested(SocketId id) {
+    std::shared_ptr<Server> server = GetServer(id, true);
+    if (server == NULL) {
+        // Not limited.
+        return true;
+    }
+    const int c = server->concurrency.fetch_add(1, butil::memory_order_relaxed) + 1;
+    if (!server->limiter->OnRequested(c)) {
+        server->concurrency.fetch_sub(1, butil::memory_order_relaxed);
+        server->limiter->OnResponded(ELIMIT, 0);
+        return false;
+    }
+    return true;
+}
+
+void ClientConcurrencyLimiter::OnResponded(
+    SocketId id, int error_code, int64_t latency_us) {
+    std::shared_ptr<Server> server = GetServer(id, false);
+    if (server != NULL) {
+        server->concurrency.fetch_sub(1, butil::memory_order_relaxed);
+        server->limiter->OnResponded(error_code, latency_us);
+    }
+    _nresponded.fetch_add(1, butil::memory_order_seq_cst);
+    if (_nwaiters.load(butil::memory_order_seq_cst) > 0) {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        _cond.notify_all();
+    }
+}
+
+bool ClientConcurrencyLimiter::WaitForResponded(int64_t nresponded,
+                                                int64_t abstime_us) {
+    const timespec abstime = butil::microseconds_to_timespec(abstime_us);
+    bool responded = true;
+    _nwaiters.fetch_add(1, butil::memory_order_seq_cst);
+    {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        while (_nresponded.load(butil::memory_order_seq_cst) == nresponded) {
+            if (_cond.wait_until(mu, abstime) == ETIMEDOUT) {
+                responded = (_nresponded.load(butil::memory_order_seq_cst)
+                             != nresponded);
+                break;
+            }
+        }
+    }
+    _nwaiters.fetch_sub(1, butil::memory_order_relaxed);
+    return responded;
+}
+
+int ClientConcurrencyLimiter::MaxConcurrencyOf(SocketId id) {
+    std::shared_ptr<Server> server = GetServer(id, false);
+    return server != NULL ? server->limiter->MaxConcurrency() : 0;
+}
+
+} // namespace brpc
@@ -0,0 +1,103 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_CLIENT_CONCURRENCY_LIMITER_H
+#define BRPC_CLIENT_CONCURRENCY_LIMITER_H
+
+#include <memory>                                  // std::shared_ptr
+#include <vector>
+#include "butil/macros.h"
+#include "butil/atomicops.h"                       // butil::atomic
+#include "butil/containers/flat_map.h"             // butil::FlatMap
+#include "butil/containers/doubly_buffered_data.h"
+#include "bthread/condition_variable.h"
+#include "brpc/socket_id.h"                        // SocketId
+#include "brpc/shared_object.h"                    // SharedObject
+#include "brpc/concurrency_limiter.h"              // ConcurrencyLimiter
+
+
+namespace brpc {
+
+// Limits concurrency of calls from a Channel to each server with a separate
+// ConcurrencyLimiter ("constant", "auto", "timeout" ...) of the server, so
+// that clients stop flooding a slow server before the server rejects.
+class ClientConcurrencyLimiter : public SharedObject {
+public:
+    ~ClientConcurrencyLimiter();
+
+    // Set `out' to NULL if `amc' is unlimited. Calls wait at most `wait_ms'
+    // when all servers tried reach the limits.
+    // Returns 0 on success, -1 if `amc' is invalid.
+    static int Create(const AdaptiveMaxConcurrency& amc, int32_t wait_ms,
+                      butil::intrusive_ptr<ClientConcurrencyLimiter>* out);
+
+    int32_t wait_ms() const { return _wait_ms; }
+
+    // Count a call to `server'. Returns false if concurrency of the server
+    // reached the limit and the call is not counted.
+    bool OnRequested(SocketId server);
+
+    // Called when a call counted by OnRequested() ends.
+    void OnResponded(SocketId server, int error_code, int64_t latency_us);
+
+    // Number of ended calls, which is passed to WaitForResponded().
+    int64_t nresponded() const
+    { return _nresponded.load(butil::memory_order_seq_cst); }
+
+    // Wait until more calls than `nresponded' end, or until `abstime_us'
+    // (in gettimeofday_us()). Returns false on timeout.
+    bool WaitForResponded(int64_t nresponded, int64_t abstime_us);
+
+    // Returns the current limit of `server', 0 if the server is unknown.
+    int MaxConcurrencyOf(SocketId server);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ClientConcurrencyLimiter);
+
+    struct Server {
+        explicit Server(SocketId id2) : id(id2), concurrency(0) {}
+        SocketId id;
+        butil::atomic<int> concurrency;
+        std::unique_ptr<ConcurrencyLimiter> limiter;
+    };
+    typedef butil::FlatMap<SocketId, std::shared_ptr<Server> > ServerMap;
+
+    ClientConcurrencyLimiter(const ConcurrencyLimiter* prototype,
+                             const AdaptiveMaxConcurrency& amc,
+                             int32_t wait_ms);
+
+    std::shared_ptr<Server> GetServer(SocketId id, bool create);
+    static size_t AddServer(ServerMap& bg, const ServerMap& fg,
+                            const std::shared_ptr<Server>& server,
+                            const std::vector<SocketId>& removed);
+
+    const ConcurrencyLimiter* _prototype;
+    AdaptiveMaxConcurrency _amc;
+    int32_t _wait_ms;
+    butil::DoublyBufferedData<ServerMap> _servers;
+
+    butil::atomic<int64_t> _nresponded;
+    butil::atomic<int> _nwaiters;
+    bthread::Mutex _mutex;
+    bthread::ConditionVariable _cond;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_CLIENT_CONCURRENCY_LIMITER_H
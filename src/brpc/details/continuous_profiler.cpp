@@ -0,0 +1,428 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <gflags/gflags.h>
+#include "butil/build_config.h"
+#if defined(OS_LINUX)
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+#include <pthread.h>
+#include <algorithm>
+#include <deque>
+#include "butil/atomicops.h"
+#include "butil/containers/flat_map.h"
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/time.h"
+#include "bvar/reducer.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/running_method.h"
+#include "brpc/details/continuous_profiler.h"
+
+
+namespace brpc {
+
+static bool SetContinuousCpuProfiling(const char*, bool enabled);
+
+DEFINE_bool(continuous_cpu_profiling, false,
+            "Sample stacks of the process at a low frequency all the time, "
+            "view them at /hotspots/cpu_continuous");
+BRPC_VALIDATE_GFLAG(continuous_cpu_profiling, SetContinuousCpuProfiling);
+
+DEFINE_int32(continuous_cpu_profiling_hz, 19,
+             "Samples taken per second of cpu time consumed by the process");
+
+DEFINE_int32(continuous_cpu_profiling_minutes, 60,
+             "Number of recent minutes whose samples are kept in memory");
+BRPC_VALIDATE_GFLAG(continuous_cpu_profiling_minutes, PositiveInteger);
+
+DEFINE_int32(continuous_cpu_profiling_max_stacks, 4096,
+             "Max number of distinct stacks kept for each minute, samples "
+             "of more stacks are dropped");
+BRPC_VALIDATE_GFLAG(continuous_cpu_profiling_max_stacks, PositiveInteger);
+
+DEFINE_int32(continuous_cpu_profiling_signal, 0,
+             "Signal delivered to sampled threads, 0 means SIGRTMIN+3");
+
+#if defined(OS_LINUX)
+
+// Frames deeper than this are truncated.
+static const int MAX_FRAMES = 48;
+// Same limit as gperftools, larger distances between frame pointers are
+// more likely to be garbage than real frames.
+static const uintptr_t MAX_FRAME_SIZE = 100000;
+// Must be power of 2.
+static const size_t SAMPLE_RING_SIZE = 4096;
+
+enum RawSampleState {
+    SAMPLE_EMPTY = 0,
+    SAMPLE_WRITING = 1,
+    SAMPLE_READY = 2,
+};
+
+// Written by signal handlers, read by the collecting thread.
+struct RawSample {
+    butil::atomic<int> state;
+    int nframes;
+    const google::protobuf::MethodDescriptor* method;
+    void* frames[MAX_FRAMES];
+};
+
+struct MinuteBucket {
+    int64_t minute;
+    // Key is the method followed by frames, see MakeStackKey().
+    butil::FlatMap<std::string, int64_t> stacks;
+};
+
+static pthread_mutex_t g_control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool g_enabled_by_server = false;
+static bool g_initialized = false;
+static butil::atomic<bool> g_running(false);
+static timer_t g_timer;
+
+static RawSample* g_samples = NULL;
+static butil::atomic<uint64_t> g_sample_index(0);
+static butil::atomic<int64_t> g_ndropped_in_handler(0);
+
+static pthread_mutex_t g_bucket_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::deque<MinuteBucket*>* g_buckets = NULL;
+
+static bvar::Adder<int64_t>* g_nsamples_var = NULL;
+static bvar::Adder<int64_t>* g_ndropped_var = NULL;
+
+// Walk the chain of frame pointers starting from the interrupted context.
+// Must be async-signal-safe.
+static int GetStackFromContext(void* context, void** frames, int max_frames) {
+    const ucontext_t* uc = static_cast<const ucontext_t*>(context);
+#if defined(__x86_64__)
+    const uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+    const uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+    uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    const uintptr_t pc = uc->uc_mcontext.pc;
+    const uintptr_t sp = uc->uc_mcontext.sp;
+    uintptr_t fp = uc->uc_mcontext.regs[29];
+#else
+    (void)uc;
+    (void)frames;
+    (void)max_frames;
+    return 0;
+#endif
+#if defined(__x86_64__) || defined(__aarch64__)
+    int n = 0;
+    frames[n++] = (void*)pc;
+    // The frame pointer is not trustable when the thread is interrupted in
+    // code compiled without frame pointers or in the middle of switching
+    // stacks (e.g. jumping between bthreads), in which case it does not
+    // point to the stack being used.
+    if (fp < sp || fp - sp > MAX_FRAME_SIZE) {
+        return n;
+    }
+    while (n < max_frames) {
+        if (fp & (sizeof(void*) - 1)) {
+            break;
+        }
+        const uintptr_t* frame = (const uintptr_t*)fp;
+        const uintptr_t next_fp = frame[0];
+        const uintptr_t ret = frame[1];
+        if (ret == 0) {
+            break;
+        }
+        frames[n++] = (void*)ret;
+        // Stacks grow downwards, frames of callers are at higher addresses.
+        if (next_fp <= fp || next_fp - fp > MAX_FRAME_SIZE) {
+            break;
+        }
+        fp = next_fp;
+    }
+    return n;
+#endif
+}
+
+static void HandleProfilingSignal(int, siginfo_t*, void* context) {
+    const int saved_errno = errno;
+    const uint64_t index =
+        g_sample_index.fetch_add(1, butil::memory_order_relaxed);
+    RawSample* s = &g_samples[index & (SAMPLE_RING_SIZE - 1)];
+    int expected = SAMPLE_EMPTY;
+    if (s->state.compare_exchange_strong(
+            expected, SAMPLE_WRITING, butil::memory_order_acquire)) {
+        s->method = TlsRunningMethod::get();
+        s->nframes = GetStackFromContext(context, s->frames, MAX_FRAMES);
+        s->state.store(SAMPLE_READY, butil::memory_order_release);
+    } else {
+        // The collecting thread falls behind.
+        g_ndropped_in_handler.fetch_add(1, butil::memory_order_relaxed);
+    }
+    errno = saved_errno;
+}
+
+static void MakeStackKey(const google::protobuf::MethodDescriptor* method,
+                         void* const* frames, int nframes, std::string* key) {
+    key->assign((const char*)&method, sizeof(method));
+    key->append((const char*)frames, nframes * sizeof(void*));
+}
+
+// Move ready samples in the ring into the bucket of current minute.
+static void CollectSamples() {
+    const int64_t minute = butil::gettimeofday_s() / 60;
+    std::string key;
+    int64_t nsamples = 0;
+    int64_t ndropped =
+        g_ndropped_in_handler.exchange(0, butil::memory_order_relaxed);
+    {
+        BAIDU_SCOPED_LOCK(g_bucket_mutex);
+        if (g_buckets->empty() || g_buckets->back()->minute != minute) {
+            MinuteBucket* b = new MinuteBucket;
+            b->minute = minute;
+            b->stacks.init(256);
+            g_buckets->push_back(b);
+        }
+        while (!g_buckets->empty() &&
+               g_buckets->front()->minute <=
+               minute - FLAGS_continuous_cpu_profiling_minutes) {
+            delete g_buckets->front();
+            g_buckets->pop_front();
+        }
+        MinuteBucket* b = g_buckets->back();
+        const size_t max_stacks = FLAGS_continuous_cpu_profiling_max_stacks;
+        for (size_t i = 0; i < SAMPLE_RING_SIZE; ++i) {
+            RawSample* s = &g_samples[i];
+            if (s->state.load(butil::memory_order_acquire) != SAMPLE_READY) {
+                continue;
+            }
+            MakeStackKey(s->method, s->frames, s->nframes, &key);
+            s->state.store(SAMPLE_EMPTY, butil::memory_order_release);
+            int64_t* count = b->stacks.seek(key);
+            if (count != NULL) {
+                ++*count;
+                ++nsamples;
+            } else if (b->stacks.size() < max_stacks) {
+                b->stacks.insert(key, 1);
+                ++nsamples;
+            } else {
+                ++ndropped;
+            }
+        }
+    }
+    *g_nsamples_var << nsamples;
+    *g_ndropped_var << ndropped;
+}
+
+static void* RunCollector(void*) {
+    while (true) {
+        usleep(200000);
+        CollectSamples();
+    }
+    return NULL;
+}
+
+static bool InitializeProfilerLocked() {
+    int signo = FLAGS_continuous_cpu_profiling_signal;
+    if (signo <= 0) {
+        signo = SIGRTMIN + 3;
+    }
+    g_samples = new RawSample[SAMPLE_RING_SIZE];
+    for (size_t i = 0; i < SAMPLE_RING_SIZE; ++i) {
+        g_samples[i].state.store(SAMPLE_EMPTY, butil::memory_order_relaxed);
+    }
+    g_buckets = new std::deque<MinuteBucket*>;
+    g_nsamples_var = new bvar::Adder<int64_t>(
+        "rpc_continuous_cpu_profiling_samples");
+    g_ndropped_var = new bvar::Adder<int64_t>(
+        "rpc_continuous_cpu_profiling_dropped");
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = HandleProfilingSignal;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signo, &sa, NULL) != 0) {
+        PLOG(ERROR) << "Fail to set handler of signal=" << signo;
+        return false;
+    }
+    // Expiration of a process-wide cpu timer is signaled to the thread
+    // consuming cpu at the moment in most cases, which is the thread to
+    // be sampled. A realtime signal is used rather than SIGPROF so that
+    // /hotspots/cpu (gperftools) is not interfered.
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = signo;
+    if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &g_timer) != 0) {
+        PLOG(ERROR) << "Fail to create cpu timer";
+        return false;
+    }
+    pthread_t th;
+    if (pthread_create(&th, NULL, RunCollector, NULL) != 0) {
+        LOG(ERROR) << "Fail to create thread to collect cpu samples";
+        timer_delete(g_timer);
+        return false;
+    }
+    pthread_detach(th);
+    g_initialized = true;
+    return true;
+}
+
+static bool SetTimerLocked(int hz) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (hz > 0) {
+        const int64_t interval_ns = 1000000000L / hz;
+        its.it_interval.tv_sec = interval_ns / 1000000000L;
+        its.it_interval.tv_nsec = interval_ns % 1000000000L;
+        its.it_value = its.it_interval;
+    }
+    if (timer_settime(g_timer, 0, &its, NULL) != 0) {
+        PLOG(ERROR) << "Fail to set cpu timer";
+        return false;
+    }
+    return true;
+}
+
+static bool StartProfilerLocked() {
+    if (g_running.load(butil::memory_order_relaxed)) {
+        return true;
+    }
+    if (!g_initialized && !InitializeProfilerLocked()) {
+        return false;
+    }
+    const int hz = std::max(FLAGS_continuous_cpu_profiling_hz, 1);
+    if (!SetTimerLocked(hz)) {
+        return false;
+    }
+    g_running.store(true, butil::memory_order_relaxed);
+    LOG(INFO) << "Started continuous cpu profiling at " << hz << "Hz";
+    return true;
+}
+
+static void StopProfilerLocked() {
+    if (!g_running.load(butil::memory_order_relaxed)) {
+        return;
+    }
+    // Samples collected so far are still viewable.
+    SetTimerLocked(0);
+    g_running.store(false, butil::memory_order_relaxed);
+    LOG(INFO) << "Stopped continuous cpu profiling";
+}
+
+static bool SetContinuousCpuProfiling(const char*, bool enabled) {
+    BAIDU_SCOPED_LOCK(g_control_mutex);
+    if (!g_enabled_by_server) {
+        // Applied when the first server starts.
+        return true;
+    }
+    if (enabled) {
+        return StartProfilerLocked();
+    }
+    StopProfilerLocked();
+    return true;
+}
+
+void EnableContinuousCpuProfiler() {
+    BAIDU_SCOPED_LOCK(g_control_mutex);
+    if (g_enabled_by_server) {
+        return;
+    }
+    g_enabled_by_server = true;
+    if (FLAGS_continuous_cpu_profiling) {
+        StartProfilerLocked();
+    }
+}
+
+bool IsContinuousCpuProfilerRunning() {
+    return g_running.load(butil::memory_order_relaxed);
+}
+
+void GetContinuousCpuProfile(int begin_minutes_ago, int end_minutes_ago,
+                             std::vector<ProfiledStack>* stacks,
+                             int* nminutes) {
+    stacks->clear();
+    *nminutes = 0;
+    {
+        BAIDU_SCOPED_LOCK(g_control_mutex);
+        if (!g_initialized) {
+            return;
+        }
+    }
+    const int64_t now_minute = butil::gettimeofday_s() / 60;
+    butil::FlatMap<std::string, int64_t> merged;
+    merged.init(1024);
+    {
+        BAIDU_SCOPED_LOCK(g_bucket_mutex);
+        for (std::deque<MinuteBucket*>::const_iterator
+                 it = g_buckets->begin(); it != g_buckets->end(); ++it) {
+            const MinuteBucket* b = *it;
+            if (b->minute <= now_minute - begin_minutes_ago ||
+                b->minute > now_minute - end_minutes_ago) {
+                continue;
+            }
+            ++*nminutes;
+            for (butil::FlatMap<std::string, int64_t>::const_iterator
+                     it2 = b->stacks.begin(); it2 != b->stacks.end(); ++it2) {
+                merged[it2->first] += it2->second;
+            }
+        }
+    }
+    stacks->reserve(merged.size());
+    for (butil::FlatMap<std::string, int64_t>::const_iterator
+             it = merged.begin(); it != merged.end(); ++it) {
+        const std::string& key = it->first;
+        stacks->push_back(ProfiledStack());
+        ProfiledStack& s = stacks->back();
+        memcpy(&s.method, key.data(), sizeof(s.method));
+        const size_t nframes = (key.size() - sizeof(s.method)) / sizeof(void*);
+        s.frames.resize(nframes);
+        if (nframes) {
+            memcpy(&s.frames[0], key.data() + sizeof(s.method),
+                   nframes * sizeof(void*));
+        }
+        s.count = it->second;
+    }
+}
+
+#else  // OS_LINUX
+
+static bool SetContinuousCpuProfiling(const char*, bool) {
+    return true;
+}
+
+void EnableContinuousCpuProfiler() {
+    if (FLAGS_continuous_cpu_profiling) {
+        LOG(WARNING) << "Continuous cpu profiling is only supported on linux";
+    }
+}
+
+bool IsContinuousCpuProfilerRunning() {
+    return false;
+}
+
+void GetContinuousCpuProfile(int, int, std::vector<ProfiledStack>* stacks,
+                             int* nminutes) {
+    stacks->clear();
+    *nminutes = 0;
+}
+
+#endif  // OS_LINUX
+
+} // namespace brpc
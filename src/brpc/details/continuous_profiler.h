@@ -0,0 +1,63 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_CONTINUOUS_PROFILER_H
+#define BRPC_CONTINUOUS_PROFILER_H
+
+#include <stdint.h>
+#include <vector>
+#include <google/protobuf/descriptor.h>
+
+
+namespace brpc {
+
+// An always-on cpu profiler sampling all threads of the process at a low
+// frequency (-continuous_cpu_profiling_hz). Stacks are unwound with frame
+// pointers inside the signal handler and aggregated into per-minute
+// buckets in memory, the most recent -continuous_cpu_profiling_minutes
+// minutes are kept. Samples taken inside user code of a server method are
+// tagged with the method, see details/running_method.h.
+// Unlike /hotspots/cpu, gperftools is not needed and both can run together.
+
+// Called by servers when they start. The profiler runs from then on if
+// -continuous_cpu_profiling is true, and follows the flag afterwards.
+void EnableContinuousCpuProfiler();
+
+// True if the profiler is sampling.
+bool IsContinuousCpuProfilerRunning();
+
+struct ProfiledStack {
+    // Method running when the samples were taken, NULL if none.
+    const google::protobuf::MethodDescriptor* method;
+    // Program counters, the innermost frame first.
+    std::vector<void*> frames;
+    int64_t count;
+};
+
+// Get stacks sampled in minutes which are [end_minutes_ago,
+// begin_minutes_ago) minutes ago, the current (incomplete) minute is 0
+// minutes ago. `nminutes' is set to number of minutes having samples in
+// the range.
+void GetContinuousCpuProfile(int begin_minutes_ago, int end_minutes_ago,
+                             std::vector<ProfiledStack>* stacks,
+                             int* nminutes);
+
+} // namespace brpc
+
+
+#endif  // BRPC_CONTINUOUS_PROFILER_H
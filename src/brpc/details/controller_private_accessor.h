@@ -20,6 +20,7 @@
 
 // This is an rpc-internal file.
 
+#include "butil/usdt.h"                // BUTIL_USDT2
 #include "brpc/socket.h"
 #include "brpc/controller.h"
 #include "brpc/stream.h"
@@ -90,6 +91,16 @@ public:
         _cntl->_span = span;
         return *this;
     }
+
+    // Server-side: the sampled request waiting for its response.
+    void set_sampled_request(SampledRequest* sample) {
+        _cntl->reset_sampled_request(sample);
+    }
+    SampledRequest* release_sampled_request() {
+        SampledRequest* sample = _cntl->_sampled_request;
+        _cntl->_sampled_request = NULL;
+        return sample;
+    }
     
     ControllerPrivateAccessor &set_request_protocol(ProtocolType protocol) {
         _cntl->_request_protocol = protocol;
@@ -115,6 +126,12 @@ public:
         return _cntl->_remote_stream_settings;
     }
 
+    // Pass the ownership of `arena' to _cntl, which is returned to the pool
+    // in Controller::Reset()
+    void set_arena(PooledArena* arena) {
+        _cntl->_arena = arena;
+    }
+
     StreamId request_stream() { return _cntl->_request_stream; }
     StreamId response_stream() { return _cntl->_response_stream; }
 
@@ -124,6 +141,11 @@ public:
     void set_readable_progressive_attachment(ReadableProgressiveAttachment* s)
     { _cntl->_rpa.reset(s); }
 
+    // Let the method read the attachment of the request by
+    // Controller::ReadProgressiveAttachmentBy().
+    void set_read_progressively()
+    { _cntl->add_flag(Controller::FLAGS_READ_PROGRESSIVELY); }
+
     void add_with_auth() {
         _cntl->add_flag(Controller::FLAGS_REQUEST_WITH_AUTH);
     }
@@ -139,17 +161,51 @@ public:
     // side is properly set in the RPC sending path.
     void set_deadline_us(int64_t deadline_us) { _cntl->_deadline_us = deadline_us; }
 
+    int64_t inflight_request_bytes() const { return _cntl->_inflight_request_bytes; }
+    void set_inflight_request_bytes(int64_t nbytes) {
+        _cntl->_inflight_request_bytes = nbytes;
+    }
+
     ControllerPrivateAccessor& set_begin_time_us(int64_t begin_time_us) {
         _cntl->_begin_time_us = begin_time_us;
         _cntl->_end_time_us = UNSET_MAGIC_NUM;
         return *this;
     }
 
+    ControllerPrivateAccessor& set_server_load(const ServerLoad& load) {
+        _cntl->_server_load = load;
+        return *this;
+    }
+
+    ControllerPrivateAccessor& set_phase_begin_us(RpcPhase phase,
+                                                  int64_t begin_us) {
+        _cntl->_phase_begin_us[phase] = begin_us;
+        // USERCODE may be set again when the method is run by an executor.
+        if (phase == RPC_PHASE_SERVER_USERCODE) {
+            BUTIL_USDT2(brpc, usercode_begin, _cntl, begin_us);
+        } else if (phase == RPC_PHASE_SERVER_SERIALIZE) {
+            BUTIL_USDT2(brpc, usercode_end, _cntl, begin_us);
+        }
+        return *this;
+    }
+
     ControllerPrivateAccessor& set_health_check_call() {
         _cntl->add_flag(Controller::FLAGS_HEALTH_CHECK_CALL);
         return *this;
     }
 
+    void set_grpc_stream() { _cntl->add_flag(Controller::FLAGS_GRPC_STREAM); }
+    bool is_grpc_stream() const {
+        return _cntl->has_flag(Controller::FLAGS_GRPC_STREAM);
+    }
+
+    void set_compact_rpc_meta() {
+        _cntl->add_flag(Controller::FLAGS_COMPACT_RPC_META);
+    }
+    bool is_compact_rpc_meta() const {
+        return _cntl->has_flag(Controller::FLAGS_COMPACT_RPC_META);
+    }
+
 private:
     Controller* _cntl;
 };
@@ -16,7 +16,12 @@
 // under the License.
 
 
+#include <map>
+#include "butil/fast_rand.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/synchronization/lock.h"
 #include "brpc/details/health_check.h"
+#include "brpc/reloadable_flags.h"
 #include "brpc/socket.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
@@ -38,6 +43,99 @@ DEFINE_string(health_check_path, "", "Http path of health check call."
         "sure the server functions well).");
 DEFINE_int32(health_check_timeout_ms, 500, "The timeout for both establishing "
         "the connection and the http call to -health_check_path over the connection");
+DEFINE_int32(health_check_max_interval_s, 0, "If this flag is larger than "
+        "the health check interval of a socket, the interval is doubled after "
+        "each failed check until reaching this value");
+BRPC_VALIDATE_GFLAG(health_check_max_interval_s, NonNegativeInteger);
+DEFINE_double(health_check_jitter_ratio, 0.2, "Shorten intervals of health "
+        "checks by a random ratio in [0, this flag) so that clients isolating "
+        "the same server do not reconnect at the same time");
+DEFINE_bool(health_check_share_by_endpoint, true, "Sockets connecting to the "
+        "same endpoint in this process are checked by one of them at a time, "
+        "others follow its result rather than connecting by themselves");
+
+static bool ValidateJitterRatio(const char*, double val) {
+    return val >= 0 && val < 1;
+}
+BRPC_VALIDATE_GFLAG(health_check_jitter_ratio, ValidateJitterRatio);
+
+// Interval before the next check of a socket which failed `hc_count'
+// consecutive checks.
+static int64_t NextCheckIntervalMs(int64_t base_interval_s, int hc_count) {
+    int64_t interval_ms = base_interval_s * 1000;
+    const int64_t max_interval_ms =
+        (int64_t)FLAGS_health_check_max_interval_s * 1000;
+    for (int i = 1; i < hc_count && interval_ms < max_interval_ms; ++i) {
+        interval_ms = std::min(interval_ms * 2, max_interval_ms);
+    }
+    const double jitter = FLAGS_health_check_jitter_ratio;
+    if (jitter > 0 && jitter < 1) {
+        interval_ms -= (int64_t)(interval_ms * jitter * butil::fast_rand_double());
+    }
+    return std::max(interval_ms, (int64_t)1);
+}
+
+// States of endpoints being checked, shared by all health-checked sockets
+// connecting to the same endpoint, so that only one of them connects to
+// the endpoint at a time.
+class EndPointCheckStates {
+public:
+    // Register a socket checking `pt'.
+    void Add(const butil::EndPoint& pt) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        ++_states[pt].nchecking;
+    }
+
+    void Remove(const butil::EndPoint& pt) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<butil::EndPoint, State>::iterator it = _states.find(pt);
+        if (it != _states.end() && --it->second.nchecking <= 0) {
+            _states.erase(it);
+        }
+    }
+
+    // Returns true if the caller should check `pt' now, false otherwise
+    // and *next_check_us is set to when the caller should try again.
+    bool StartCheck(const butil::EndPoint& pt, int64_t* next_check_us) {
+        const int64_t now_us = butil::gettimeofday_us();
+        BAIDU_SCOPED_LOCK(_mutex);
+        State& st = _states[pt];
+        if (st.checking) {
+            // Look at the result after the check in progress is done.
+            *next_check_us = now_us + FLAGS_health_check_timeout_ms * 1000L;
+            return false;
+        }
+        if (st.next_check_us > now_us) {
+            *next_check_us = st.next_check_us;
+            return false;
+        }
+        st.checking = true;
+        return true;
+    }
+
+    // Finish the check started by StartCheck(). `next_check_us' is 0 if
+    // the endpoint is healthy.
+    void EndCheck(const butil::EndPoint& pt, int64_t next_check_us) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        State& st = _states[pt];
+        st.checking = false;
+        st.next_check_us = next_check_us;
+    }
+
+private:
+    struct State {
+        State() : nchecking(0), checking(false), next_check_us(0) {}
+        int nchecking;
+        bool checking;
+        int64_t next_check_us;
+    };
+    butil::Mutex _mutex;
+    std::map<butil::EndPoint, State> _states;
+};
+
+static EndPointCheckStates* GetEndPointCheckStates() {
+    return butil::get_leaky_singleton<EndPointCheckStates>();
+}
 
 class HealthCheckChannel : public brpc::Channel {
 public:
@@ -152,11 +250,15 @@ public:
 private:
     SocketId _id;
     bool _first_time;
+    // Registered in EndPointCheckStates with _remote_side.
+    bool _shared;
+    butil::EndPoint _remote_side;
 };
 
 HealthCheckTask::HealthCheckTask(SocketId id)
     : _id(id)
-    , _first_time(true) {}
+    , _first_time(true)
+    , _shared(false) {}
 
 bool HealthCheckTask::OnTriggeringTask(timespec* next_abstime) {
     SocketUniquePtr ptr;
@@ -190,6 +292,19 @@ bool HealthCheckTask::OnTriggeringTask(timespec* next_abstime) {
             LOG(INFO) << "Cancel checking " << *ptr;
             return false;
         }
+        // Sockets with users may check health in their own ways.
+        if (FLAGS_health_check_share_by_endpoint && ptr->_user == NULL) {
+            _shared = true;
+            _remote_side = ptr->remote_side();
+            GetEndPointCheckStates()->Add(_remote_side);
+        }
+    }
+    if (_shared) {
+        int64_t next_check_us = 0;
+        if (!GetEndPointCheckStates()->StartCheck(_remote_side, &next_check_us)) {
+            *next_abstime = butil::microseconds_to_timespec(next_check_us);
+            return true;
+        }
     }
 
     // g_vars must not be NULL because it is newed at the creation of
@@ -204,6 +319,9 @@ bool HealthCheckTask::OnTriggeringTask(timespec* next_abstime) {
         hc = ptr->CheckHealth();
     }
     if (hc == 0) {
+        if (_shared) {
+            GetEndPointCheckStates()->EndCheck(_remote_side, 0);
+        }
         if (ptr->CreatedByConnect()) {
             g_vars->channel_conn << -1;
         }
@@ -218,19 +336,34 @@ bool HealthCheckTask::OnTriggeringTask(timespec* next_abstime) {
         }
         return false;
     } else if (hc == ESTOP) {
+        if (_shared) {
+            GetEndPointCheckStates()->EndCheck(_remote_side, 0);
+        }
         LOG(INFO) << "Cancel checking " << *ptr;
         return false;
     }
     ++ ptr->_hc_count;
-    *next_abstime = butil::seconds_from_now(ptr->_health_check_interval_s);
+    const int64_t next_check_us = butil::gettimeofday_us() + 1000L *
+        NextCheckIntervalMs(ptr->_health_check_interval_s, ptr->_hc_count);
+    if (_shared) {
+        GetEndPointCheckStates()->EndCheck(_remote_side, next_check_us);
+    }
+    *next_abstime = butil::microseconds_to_timespec(next_check_us);
     return true;
 }
 
 void HealthCheckTask::OnDestroyingTask() {
+    if (_shared) {
+        GetEndPointCheckStates()->Remove(_remote_side);
+    }
     delete this;
 }
 
 void StartHealthCheck(SocketId id, int64_t delay_ms) {
+    const double jitter = FLAGS_health_check_jitter_ratio;
+    if (delay_ms > 0 && jitter > 0 && jitter < 1) {
+        delay_ms -= (int64_t)(delay_ms * jitter * butil::fast_rand_double());
+    }
     PeriodicTaskManager::StartTaskAt(new HealthCheckTask(id),
             butil::milliseconds_from_now(delay_ms));
 }
@@ -18,6 +18,7 @@
 
 #include "brpc/details/hpack.h"
 
+#include <strings.h>                                     // strcasecmp
 #include <limits>                                       // std::numeric_limits
 #include <vector>
 #include "butil/containers/bounded_queue.h"              // butil::BoundedQueue
@@ -402,79 +403,143 @@ private:
     uint32_t _out_bytes;
 };
 
+// Huffman codes are decoded 4 bits each time by a state machine whose states
+// are internal nodes of the HuffmanTree, which is much faster than walking
+// the tree bit by bit.
+struct HuffmanDecodeEntry {
+    // State after consuming the 4 bits.
+    uint8_t next_state;
+    // Combination of HuffmanDecodeFlags.
+    uint8_t flags;
+    // The decoded symbol if flags has HUFFMAN_DECODE_SYMBOL.
+    uint8_t symbol;
+};
+
+enum HuffmanDecodeFlags {
+    // A symbol is decoded.
+    HUFFMAN_DECODE_SYMBOL = 1,
+    // The stream can end at next_state, namely the bits after the last
+    // symbol are no more than 7 `1's, which is the padding.
+    // https://tools.ietf.org/html/rfc7541#section-5.2
+    HUFFMAN_DECODE_ACCEPTED = 2,
+    // The bits are invalid, namely containing EOS.
+    HUFFMAN_DECODE_FAILURE = 4
+};
+
+// A complete binary tree with 257 leaves has 256 internal nodes.
+static const size_t HUFFMAN_DECODE_STATES = 256;
+
 class HuffmanDecoder {
 DISALLOW_COPY_AND_ASSIGN(HuffmanDecoder);
 public:
-    HuffmanDecoder(std::string* out, const HuffmanTree* tree)
-        // FIXME: resizing of out is costly
+    typedef HuffmanDecodeEntry Table[HUFFMAN_DECODE_STATES][16];
+
+    HuffmanDecoder(std::string* out, const Table& table)
         : _out(out)
-        , _tree(tree)
-        , _cur_node(tree->node(HuffmanTree::ROOT_NODE))
-        , _cur_depth(0)  // Depth of root node is 0
-        , _padding(true)
+        , _table(table)
+        , _state(0)  // The root node
+        , _accepted(true)
     {}
+
     int Decode(uint8_t byte) {
-        for (int i = 7; i >= 0; --i) {
-            if (byte & (1u << i)) {
-                _cur_node = _tree->node(_cur_node->right_child);
-                if (BAIDU_UNLIKELY(!_cur_node)) {
-                    LOG(ERROR) << "Decoder stream reaches NULL_NODE";
-                    return -1;
-                }
-                if (_cur_node->value != HuffmanTree::INVALID_VALUE) {
-                    if (BAIDU_UNLIKELY(_cur_node->value == HPACK_HUFFMAN_EOS)) {
-                        LOG(ERROR) << "Decoder stream reaches EOS";
-                        return -1;
-                    }
-                    _out->push_back(static_cast<uint8_t>(_cur_node->value));
-                    _cur_node = _tree->node(HuffmanTree::ROOT_NODE);
-                    _cur_depth = 0;
-                    _padding = true;
-                    continue;
-                }
-                _padding &= 1;
-            } else {
-                _cur_node = _tree->node(_cur_node->left_child);
-                if (BAIDU_UNLIKELY(!_cur_node)) {
-                    LOG(ERROR) << "Decoder stream reaches NULL_NODE";
-                    return -1;
-                }
-                if (_cur_node->value != HuffmanTree::INVALID_VALUE) {
-                    if (BAIDU_UNLIKELY(_cur_node->value == HPACK_HUFFMAN_EOS)) {
-                        LOG(ERROR) << "Decoder stream reaches EOS";
-                        return -1;
-                    }
-                    _out->push_back(static_cast<uint8_t>(_cur_node->value));
-                    _cur_node = _tree->node(HuffmanTree::ROOT_NODE);
-                    _cur_depth = 0;
-                    _padding = true;
-                    continue;
-                }
-                _padding &= 0;
-            }
-            ++_cur_depth;
+        if (DecodeBits(byte >> 4) != 0) {
+            return -1;
         }
-        return 0;
+        return DecodeBits(byte & 0xF);
     }
+
     int EndStream() {
-        if (_cur_depth == 0) {
-            return 0;
-        }
-        if (_cur_depth <= 7 && _padding) {
-            return 0;
-        }
-        // Invalid stream, the padding is not corresponding to MSB of EOS
+        // Invalid stream if the padding is not corresponding to MSB of EOS
         // https://tools.ietf.org/html/rfc7541#section-5.2
-        return -1;
+        return _accepted ? 0 : -1;
     }
+
 private:
+    int DecodeBits(uint8_t bits) {
+        const HuffmanDecodeEntry& e = _table[_state][bits];
+        if (BAIDU_UNLIKELY(e.flags & HUFFMAN_DECODE_FAILURE)) {
+            LOG(ERROR) << "Decoder stream reaches EOS";
+            return -1;
+        }
+        if (e.flags & HUFFMAN_DECODE_SYMBOL) {
+            _out->push_back(e.symbol);
+        }
+        _state = e.next_state;
+        _accepted = (e.flags & HUFFMAN_DECODE_ACCEPTED);
+        return 0;
+    }
+
     std::string* _out;
-    const HuffmanTree* _tree;
-    const HuffmanNode* _cur_node;
-    uint16_t _cur_depth;
-    bool _padding;
+    const Table& _table;
+    uint8_t _state;
+    bool _accepted;
 };
 
+// Build the state machine of HuffmanDecoder from `tree'.
+static void BuildHuffmanDecodeTable(const HuffmanTree& tree,
+                                    HuffmanDecoder::Table& table) {
+    // Map internal nodes to states in BFS order, the root is state 0.
+    // accepted[s] is true if the path from root to state s has no more
+    // than 7 bits which are all `1's.
+    std::vector<HuffmanTree::NodeId> nodes;
+    std::vector<int> state_of_node;
+    std::vector<bool> accepted;
+    nodes.push_back(HuffmanTree::ROOT_NODE);
+    accepted.push_back(true);
+    std::vector<int> depth(1, 0);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const HuffmanNode* n = tree.node(nodes[i]);
+        const HuffmanTree::NodeId children[2] = { n->left_child, n->right_child };
+        for (int bit = 0; bit < 2; ++bit) {
+            const HuffmanNode* child = tree.node(children[bit]);
+            if (child != NULL && child->value == HuffmanTree::INVALID_VALUE) {
+                nodes.push_back(children[bit]);
+                depth.push_back(depth[i] + 1);
+                accepted.push_back(accepted[i] && bit == 1 && depth[i] < 7);
+            }
+        }
+    }
+    CHECK_EQ(HUFFMAN_DECODE_STATES, nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (state_of_node.size() <= nodes[i]) {
+            state_of_node.resize(nodes[i] + 1, -1);
+        }
+        state_of_node[nodes[i]] = i;
+    }
+    for (size_t s = 0; s < nodes.size(); ++s) {
+        for (int bits = 0; bits < 16; ++bits) {
+            HuffmanDecodeEntry& e = table[s][bits];
+            e.next_state = 0;
+            e.flags = 0;
+            e.symbol = 0;
+            HuffmanTree::NodeId cur = nodes[s];
+            for (int i = 3; i >= 0; --i) {
+                const HuffmanNode* n = tree.node(cur);
+                cur = ((bits & (1 << i)) ? n->right_child : n->left_child);
+                const HuffmanNode* child = tree.node(cur);
+                if (child == NULL || child->value == HPACK_HUFFMAN_EOS) {
+                    e.flags = HUFFMAN_DECODE_FAILURE;
+                    break;
+                }
+                if (child->value != HuffmanTree::INVALID_VALUE) {
+                    // Codes have at least 5 bits, at most one symbol is
+                    // decoded from 4 bits.
+                    e.flags |= HUFFMAN_DECODE_SYMBOL;
+                    e.symbol = static_cast<uint8_t>(child->value);
+                    cur = HuffmanTree::ROOT_NODE;
+                }
+            }
+            if (e.flags & HUFFMAN_DECODE_FAILURE) {
+                continue;
+            }
+            e.next_state = state_of_node[cur];
+            if (accepted[e.next_state]) {
+                e.flags |= HUFFMAN_DECODE_ACCEPTED;
+            }
+        }
+    }
+}
+
 // Primitive Type Representations
 
 // Encode variant intger and return the size
@@ -499,15 +564,16 @@ inline void EncodeInteger(butil::IOBufAppender* out, uint8_t msb,
 }
 
 // Static variables
-static HuffmanTree* s_huffman_tree = NULL;
+static HuffmanDecoder::Table s_huffman_decode_table;
 static IndexTable* s_static_table = NULL;
 static pthread_once_t s_create_once = PTHREAD_ONCE_INIT;
 
 static void CreateStaticTableOrDie() {
-    s_huffman_tree = new HuffmanTree;
+    HuffmanTree huffman_tree;
     for (size_t i = 0; i < ARRAY_SIZE(s_huffman_table); ++i) {
-        s_huffman_tree->AddLeafNode(i, s_huffman_table[i]);
+        huffman_tree.AddLeafNode(i, s_huffman_table[i]);
     }
+    BuildHuffmanDecodeTable(huffman_tree, s_huffman_decode_table);
     IndexTableOptions options;
     options.max_size = UINT_MAX;
     options.static_table = s_static_headers;
@@ -625,7 +691,9 @@ inline ssize_t DecodeString(butil::IOBufBytesIterator& iter, std::string* out) {
         iter.copy_and_forward(out, length);
         return in_bytes;
     }
-    HuffmanDecoder d(out, s_huffman_tree);
+    // Codes have at least 5 bits.
+    out->reserve(length * 8 / 5);
+    HuffmanDecoder d(out, s_huffman_decode_table);
     for (; iter != NULL && length; ++iter, --length) {
         if (d.Decode(*iter) != 0) {
             return -1;
@@ -637,9 +705,117 @@ inline ssize_t DecodeString(butil::IOBufBytesIterator& iter, std::string* out) {
     return in_bytes;
 }
 
+// Memoized lookups of a header name in the static table and statistics of
+// indexing headers with the name. Used by encoders only.
+struct HeaderNameInfo {
+    // Entries with the name are at [static_name_index, static_name_end) in
+    // the static table, static_name_index is 0 if there's no such entry.
+    int static_name_index;
+    int static_name_end;
+    // Headers with the name are never indexed if their values are shorter.
+    uint32_t never_index_below;
+    // Times that headers with the name were added into the dynamic table
+    // and were found in the dynamic table.
+    uint64_t added_count;
+    uint64_t hit_count;
+};
+
+// Minimum times that headers with a name are added into the dynamic table
+// before HPACK_AUTO_INDEX_HEADER judges whether the name is worth indexing.
+static const uint64_t MIN_ADDED_COUNT_TO_SKIP_INDEX = 16;
+
+// Names of headers sent by one connection are few, the limit just prevents
+// memory from being exhausted by bad peers.
+static const size_t MAX_CACHED_HEADER_NAMES = 256;
+
+static uint32_t NeverIndexBelow(const std::string& name) {
+    // https://tools.ietf.org/html/rfc7541#section-7.1.3
+    if (strcasecmp(name.c_str(), "authorization") == 0 ||
+        strcasecmp(name.c_str(), "proxy-authorization") == 0) {
+        return std::numeric_limits<uint32_t>::max();
+    }
+    // Short cookies are easy to be guessed by probing the dynamic table.
+    if (strcasecmp(name.c_str(), "cookie") == 0) {
+        return 20;
+    }
+    return 0;
+}
+
+static void InitHeaderNameInfo(const std::string& name, HeaderNameInfo* info) {
+    info->static_name_index = s_static_table->GetIndexOfName(name);
+    info->static_name_end = info->static_name_index;
+    if (info->static_name_index > 0) {
+        // Entries with the same name are adjacent in the static table.
+        while (info->static_name_end <= (int)ARRAY_SIZE(s_static_headers) &&
+               strcasecmp(s_static_headers[info->static_name_end - 1].name,
+                          name.c_str()) == 0) {
+            ++info->static_name_end;
+        }
+    }
+    info->never_index_below = NeverIndexBelow(name);
+    info->added_count = 0;
+    info->hit_count = 0;
+}
+
+class HeaderNameCache {
+DISALLOW_COPY_AND_ASSIGN(HeaderNameCache);
+public:
+    HeaderNameCache() {}
+
+    int Init() { return _infos.init(MAX_CACHED_HEADER_NAMES * 2); }
+
+    // Returns info of `name', NULL if the cache is full.
+    HeaderNameInfo* Get(const std::string& name) {
+        HeaderNameInfo* info = _infos.seek(name);
+        if (info != NULL) {
+            return info;
+        }
+        if (_infos.size() >= MAX_CACHED_HEADER_NAMES) {
+            return NULL;
+        }
+        info = &_infos[name];
+        InitHeaderNameInfo(name, info);
+        return info;
+    }
+
+private:
+    butil::CaseIgnoredFlatMap<HeaderNameInfo> _infos;
+};
+
+// Returns index of h in the static table, 0 if absent.
+inline int FindHeaderInStaticTable(const HeaderNameInfo& info,
+                                   const HPacker::Header& h) {
+    if (h.value.empty()) {
+        // Same with IndexTable, headers with empty values are not indexed.
+        return 0;
+    }
+    for (int i = info.static_name_index; i < info.static_name_end; ++i) {
+        if (h.value == s_static_headers[i - 1].value) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+inline HeaderIndexPolicy ChooseIndexPolicy(const HeaderNameInfo& info,
+                                           const HPacker::Header& h) {
+    if (h.value.size() < info.never_index_below) {
+        return HPACK_NEVER_INDEX_HEADER;
+    }
+    // Less than 1/4 of the added headers were reused, values of the name
+    // are likely to be different each time, indexing them just evicts
+    // headers from the dynamic table.
+    if (info.added_count >= MIN_ADDED_COUNT_TO_SKIP_INDEX &&
+        info.hit_count * 4 < info.added_count) {
+        return HPACK_NOT_INDEX_HEADER;
+    }
+    return HPACK_INDEX_HEADER;
+}
+
 HPacker::HPacker()
     : _encode_table(NULL)
-    , _decode_table(NULL) {
+    , _decode_table(NULL)
+    , _name_cache(NULL) {
     CreateStaticTableOnceOrDie();
 }
 
@@ -652,6 +828,10 @@ HPacker::~HPacker() {
         delete _decode_table;
         _decode_table = NULL;
     }
+    if (_name_cache) {
+        delete _name_cache;
+        _name_cache = NULL;
+    }
 }
 
 int HPacker::Init(size_t max_table_size) {
@@ -675,43 +855,55 @@ int HPacker::Init(size_t max_table_size) {
         LOG(ERROR) << "Fail to init decode table";
         return -1;
     }
-    return 0;
-}
-
-inline int HPacker::FindHeaderFromIndexTable(const Header& h) const {
-    // saves a hash (which is a hotspot) for ones missing s_static_table
-    const HeaderAndHashCode hhc = { HeaderHasher()(h), &h };
-    int index = s_static_table->GetIndexOfHeader(hhc);
-    if (index > 0) {
-        return index;
-    }
-    return _encode_table->GetIndexOfHeader(hhc);
-}
-
-inline int HPacker::FindNameFromIndexTable(const std::string& name) const {
-    int index = s_static_table->GetIndexOfName(name);
-    if (index > 0) {
-        return index;
+    _name_cache = new HeaderNameCache;
+    if (_name_cache->Init() != 0) {
+        LOG(ERROR) << "Fail to init name cache";
+        return -1;
     }
-    return _encode_table->GetIndexOfName(name);
+    return 0;
 }
 
 void HPacker::Encode(butil::IOBufAppender* out, const Header& header,
                      const HPackOptions& options) {
-    if (options.index_policy != HPACK_NEVER_INDEX_HEADER) {
-        const int index = FindHeaderFromIndexTable(header);
+    ++_stats.encoded_count;
+    HeaderNameInfo tmp_info;
+    HeaderNameInfo* info = _name_cache->Get(header.name);
+    if (info == NULL) {
+        InitHeaderNameInfo(header.name, &tmp_info);
+        info = &tmp_info;
+    }
+    HeaderIndexPolicy index_policy = options.index_policy;
+    if (index_policy == HPACK_AUTO_INDEX_HEADER) {
+        index_policy = ChooseIndexPolicy(*info, header);
+    }
+    if (index_policy != HPACK_NEVER_INDEX_HEADER) {
+        int index = FindHeaderInStaticTable(*info, header);
+        if (index > 0) {
+            ++_stats.encoded_static_hit_count;
+            return EncodeInteger(out, 0x80, 7, index);
+        }
+        const HeaderAndHashCode hhc = { HeaderHasher()(header), &header };
+        index = _encode_table->GetIndexOfHeader(hhc);
         if (index > 0) {
             // This header is already in the index table
+            ++_stats.encoded_dynamic_hit_count;
+            ++info->hit_count;
             return EncodeInteger(out, 0x80, 7, index);
         }
     } // The header can't be indexed or the header wasn't in the index table
     
-    const int name_index = FindNameFromIndexTable(header.name);
-    if (options.index_policy == HPACK_INDEX_HEADER) {
+    const int name_index = (info->static_name_index > 0 ?
+                            info->static_name_index :
+                            _encode_table->GetIndexOfName(header.name));
+    if (index_policy == HPACK_INDEX_HEADER) {
         // TODO: Add Options that indexes name independently
         _encode_table->AddHeader(header);
+        ++info->added_count;
+    } else if (options.index_policy == HPACK_AUTO_INDEX_HEADER &&
+               index_policy == HPACK_NOT_INDEX_HEADER) {
+        ++_stats.encoded_skip_index_count;
     }
-    switch (options.index_policy) {
+    switch (index_policy) {
     case HPACK_INDEX_HEADER:
         EncodeInteger(out, 0x40, 6, name_index);
         break;
@@ -719,6 +911,7 @@ void HPacker::Encode(butil::IOBufAppender* out, const Header& header,
         EncodeInteger(out, 0x00, 4, name_index);
         break;
     case HPACK_NEVER_INDEX_HEADER:
+    default:
         EncodeInteger(out, 0x10, 4, name_index);
         break;
     }
@@ -794,6 +987,8 @@ ssize_t HPacker::Decode(butil::IOBufBytesIterator& iter, Header* h) {
                 return -1;
             }
             *h = *indexed_header;
+            ++_stats.decoded_count;
+            ++_stats.decoded_hit_count;
             return index_bytes;
         }
         break;
@@ -809,6 +1004,7 @@ ssize_t HPacker::Decode(butil::IOBufBytesIterator& iter, Header* h) {
                 return -1;
             }
             _decode_table->AddHeader(*h);
+            ++_stats.decoded_count;
             return bytes_consumed;
         }
         break;
@@ -832,13 +1028,17 @@ ssize_t HPacker::Decode(butil::IOBufBytesIterator& iter, Header* h) {
     case 1:
         // (0001) Literal Header Field Never Indexed
         // https://tools.ietf.org/html/rfc7541#section-6.2.3
-        return DecodeWithKnownPrefix(iter, h, 4);
         // TODO: Expose NeverIndex to the caller.
     case 0:
         // (0000) Literal Header Field without Indexing
         // https://tools.ietf.org/html/rfc7541#section-6.2.1
-        return DecodeWithKnownPrefix(iter, h, 4);
-        // TODO: Expose NeverIndex to the caller.
+        {
+            const ssize_t bytes_consumed = DecodeWithKnownPrefix(iter, h, 4);
+            if (bytes_consumed > 0) {
+                ++_stats.decoded_count;
+            }
+            return bytes_consumed;
+        }
     default:
         CHECK(false) << "Can't reach here";
         return -1;
@@ -862,6 +1062,18 @@ void HPacker::Describe(std::ostream& os, const DescribeOptions& opt) const {
     } else {
         os << "null";
     }
+    const HPackStats& st = _stats;
+    os << sep << "encoded=" << st.encoded_count
+       << " encoded_static_hit=" << st.encoded_static_hit_count
+       << " encoded_dynamic_hit=" << st.encoded_dynamic_hit_count
+       << " encoded_skip_index=" << st.encoded_skip_index_count
+       << " encode_hit_ratio=" << (st.encoded_count == 0 ? 0 :
+            (st.encoded_static_hit_count + st.encoded_dynamic_hit_count)
+            * 100 / st.encoded_count) << '%'
+       << sep << "decoded=" << st.decoded_count
+       << " decoded_hit=" << st.decoded_hit_count
+       << " decode_hit_ratio=" << (st.decoded_count == 0 ? 0 :
+            st.decoded_hit_count * 100 / st.decoded_count) << '%';
     if (opt.verbose) {
         os << '\n';
     }
@@ -42,6 +42,15 @@ enum HeaderIndexPolicy {
 
     // Append this header which will never replaced by a index
     HPACK_NEVER_INDEX_HEADER = 2,
+
+    // Let the encoder choose one of the policies above for this header:
+    //  - Sensitive headers(namely authorization and short cookies) are
+    //    never indexed.
+    //  - Headers whose name is indexed again and again but rarely hits the
+    //    dynamic table(namely date and grpc-timeout) are not indexed any
+    //    more, so that they don't evict headers being reused.
+    //  - Other headers are indexed.
+    HPACK_AUTO_INDEX_HEADER = 3,
 };
 
 // Options to encode a header
@@ -70,6 +79,34 @@ inline HPackOptions::HPackOptions()
 {}
 
 class IndexTable;
+class HeaderNameCache;
+
+// Statistics of a HPacker, the ratio of headers hitting index tables shows
+// how well the headers are compressed.
+struct HPackStats {
+    // Number of encoded headers and the ones replaced by indexes in static
+    // table or dynamic table.
+    uint64_t encoded_count;
+    uint64_t encoded_static_hit_count;
+    uint64_t encoded_dynamic_hit_count;
+    // Number of encoded headers that were not added into the dynamic table
+    // because of HPACK_AUTO_INDEX_HEADER.
+    uint64_t encoded_skip_index_count;
+    // Number of decoded headers and the ones represented by indexes.
+    uint64_t decoded_count;
+    uint64_t decoded_hit_count;
+
+    HPackStats();
+};
+
+inline HPackStats::HPackStats()
+    : encoded_count(0)
+    , encoded_static_hit_count(0)
+    , encoded_dynamic_hit_count(0)
+    , encoded_skip_index_count(0)
+    , decoded_count(0)
+    , decoded_hit_count(0)
+{}
 
 // HPACK - Header compression algorithm for http2 (rfc7541)
 // http://httpwg.org/specs/rfc7541.html
@@ -121,17 +158,19 @@ public:
     ssize_t Decode(butil::IOBufBytesIterator& source, Header* h);
 
     void Describe(std::ostream& os, const DescribeOptions&) const;
+
+    const HPackStats& stats() const { return _stats; }
     
 private:
     DISALLOW_COPY_AND_ASSIGN(HPacker);
-    int FindHeaderFromIndexTable(const Header& h) const;
-    int FindNameFromIndexTable(const std::string& name) const;
     const Header* HeaderAt(int index) const;
     ssize_t DecodeWithKnownPrefix(
             butil::IOBufBytesIterator& iter, Header* h, uint8_t prefix_size) const;
 
     IndexTable* _encode_table;
     IndexTable* _decode_table;
+    HeaderNameCache* _name_cache;
+    HPackStats _stats;
 };
 
 // Lowercase the input string, a fast implementation.
@@ -28,6 +28,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>  /* _mm_cmpestri */
+#endif
 
 #ifndef ULLONG_MAX
 # define ULLONG_MAX ((uint64_t) -1) /* 2^64-1 */
@@ -499,6 +502,61 @@ bool is_url_char(char c) { return IS_URL_CHAR(c); }
 
 #define start_state (parser->type == HTTP_REQUEST ? s_start_req : s_start_res)
 
+/* NOTE: Fast paths of header fields and values. Most headers are neither
+ * interesting to the state machine nor split across buffers, so bytes which
+ * can't end the field(value) are skipped in bulk instead of going through
+ * the switch one by one. The returned byte and the following ones are still
+ * handled by the state machine.
+ */
+
+/* Returns the first byte in [p, end) which is not a token (as TOKEN()). */
+static const char* find_header_field_end(const char* p, const char* end) {
+  while (p != end && TOKEN(*p)) {
+    ++p;
+  }
+  return p;
+}
+
+/* Returns the first byte in [p, end) which is a CTL except HT, including CR
+ * and LF that end the value. */
+static const char* find_header_value_end(const char* p, const char* end) {
+#if defined(__SSE4_2__)
+  /* Same ranges as picohttpparser: [\0, \b], [\n, \x1f] and \x7f */
+  static const char ranges[16] = "\000\010\012\037\177\177";
+  const __m128i ranges16 = _mm_loadu_si128((const __m128i*)ranges);
+  for (; end - p >= 16; p += 16) {
+    const __m128i b16 = _mm_loadu_si128((const __m128i*)p);
+    const int r = _mm_cmpestri(ranges16, 6, b16, 16,
+                               _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                               _SIDD_LEAST_SIGNIFICANT);
+    if (r != 16) {
+      return p + r;
+    }
+  }
+#endif
+  for (; p != end; ++p) {
+    const unsigned char c = (unsigned char)*p;
+    if ((c < ' ' && c != '\t') || c == 0x7f) {
+      break;
+    }
+  }
+  return p;
+}
+
+/* Skip bytes in [p, q) which were checked by find_header_XXX_end() and
+ * don't change anything but the header size. `p' is the current byte which
+ * was counted into nread already. Must be called in the main loop of
+ * http_parser_execute() */
+#define SKIP_HEADER_BYTES_TO(q)                                      \
+do {                                                                 \
+  parser->nread += (q) - p - 1;                                      \
+  if (parser->nread > (BRPC_HTTP_MAX_HEADER_SIZE)) {                 \
+    SET_ERRNO(HPE_HEADER_OVERFLOW);                                  \
+    goto error;                                                      \
+  }                                                                  \
+  p = (q) - 1;                                                       \
+} while (0)
+
 
 #if BRPC_HTTP_PARSER_STRICT
 # define STRICT_CHECK(cond)                                          \
@@ -1393,6 +1451,14 @@ size_t http_parser_execute (http_parser *parser,
 
       case s_header_field:
       {
+        if (parser->header_state == h_general) {
+          const char* q = find_header_field_end(p, data + len);
+          if (q != p) {
+            SKIP_HEADER_BYTES_TO(q);
+            break;
+          }
+        }
+
         c = TOKEN(ch);
 
         if (c) {
@@ -1578,6 +1644,13 @@ size_t http_parser_execute (http_parser *parser,
 
       case s_header_value:
       {
+        if (parser->header_state == h_general) {
+          const char* q = find_header_value_end(p, data + len);
+          if (q != p) {
+            SKIP_HEADER_BYTES_TO(q);
+            break;
+          }
+        }
 
         if (ch == CR) {
           parser->state = s_header_almost_done;
@@ -0,0 +1,351 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include "butil/build_config.h"
+#include "butil/logging.h"
+#include "butil/errno.h"
+#include "brpc/details/io_uring_poller.h"
+
+#if defined(OS_LINUX)
+
+#include <linux/io_uring.h>                       // io_uring_params
+#include <sys/mman.h>                             // mmap
+#include <sys/syscall.h>                          // syscall
+#include <sys/epoll.h>                            // EPOLLERR
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef IORING_POLL_ADD_MULTI
+#define IORING_POLL_ADD_MULTI (1U << 0)
+#endif
+#ifndef IORING_POLL_UPDATE_EVENTS
+#define IORING_POLL_UPDATE_EVENTS (1U << 1)
+#endif
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+// Multishot polls and updating polls are supported since 5.13, which is
+// also the version adding IORING_FEAT_RSRC_TAGS.
+#ifndef IORING_FEAT_RSRC_TAGS
+#define IORING_FEAT_RSRC_TAGS (1U << 10)
+#endif
+
+namespace brpc {
+
+// user_data of requests whose completions are not reported to users.
+static const uint64_t CONTROL_USER_DATA = (uint64_t)-1;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+                              unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+struct IoUringPoller::SQRing {
+    unsigned* head;
+    unsigned* tail;
+    unsigned* ring_mask;
+    unsigned* ring_entries;
+    unsigned* flags;
+    unsigned* array;
+};
+
+struct IoUringPoller::CQRing {
+    unsigned* head;
+    unsigned* tail;
+    unsigned* ring_mask;
+    struct io_uring_cqe* cqes;
+};
+
+IoUringPoller::IoUringPoller()
+    : _ring_fd(-1)
+    , _sqpoll(false)
+    , _sq(NULL)
+    , _cq(NULL)
+    , _sq_ptr(MAP_FAILED)
+    , _sq_ptr_size(0)
+    , _cq_ptr(MAP_FAILED)
+    , _cq_ptr_size(0)
+    , _sqes(MAP_FAILED)
+    , _sqes_size(0) {
+}
+
+IoUringPoller::~IoUringPoller() {
+    Destroy();
+}
+
+void IoUringPoller::Destroy() {
+    if (_sqes != MAP_FAILED) {
+        munmap(_sqes, _sqes_size);
+        _sqes = MAP_FAILED;
+    }
+    if (_cq_ptr != MAP_FAILED) {
+        munmap(_cq_ptr, _cq_ptr_size);
+        _cq_ptr = MAP_FAILED;
+    }
+    if (_sq_ptr != MAP_FAILED) {
+        munmap(_sq_ptr, _sq_ptr_size);
+        _sq_ptr = MAP_FAILED;
+    }
+    delete _sq;
+    _sq = NULL;
+    delete _cq;
+    _cq = NULL;
+    if (_ring_fd >= 0) {
+        close(_ring_fd);
+        _ring_fd = -1;
+    }
+}
+
+int IoUringPoller::Init(unsigned entries, bool sqpoll) {
+    if (_ring_fd >= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000/*ms*/;
+    }
+    _ring_fd = sys_io_uring_setup(entries, &p);
+    if (_ring_fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_RSRC_TAGS)) {
+        Destroy();
+        errno = ENOSYS;
+        return -1;
+    }
+    if (_interests.init(1024) != 0) {
+        Destroy();
+        errno = ENOMEM;
+        return -1;
+    }
+    _sqpoll = sqpoll;
+    _sq_ptr_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cq_ptr_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    _sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    _sq_ptr = mmap(NULL, _sq_ptr_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+    _cq_ptr = mmap(NULL, _cq_ptr_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+    _sqes = mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+    if (_sq_ptr == MAP_FAILED || _cq_ptr == MAP_FAILED ||
+        _sqes == MAP_FAILED) {
+        const int saved_errno = errno;
+        Destroy();
+        errno = saved_errno;
+        return -1;
+    }
+    char* sq = static_cast<char*>(_sq_ptr);
+    _sq = new SQRing;
+    _sq->head = (unsigned*)(sq + p.sq_off.head);
+    _sq->tail = (unsigned*)(sq + p.sq_off.tail);
+    _sq->ring_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    _sq->ring_entries = (unsigned*)(sq + p.sq_off.ring_entries);
+    _sq->flags = (unsigned*)(sq + p.sq_off.flags);
+    _sq->array = (unsigned*)(sq + p.sq_off.array);
+    char* cq = static_cast<char*>(_cq_ptr);
+    _cq = new CQRing;
+    _cq->head = (unsigned*)(cq + p.cq_off.head);
+    _cq->tail = (unsigned*)(cq + p.cq_off.tail);
+    _cq->ring_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    _cq->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+int IoUringPoller::SubmitLocked(uint8_t opcode, int fd, uint64_t addr,
+                                uint32_t len, uint32_t poll_events,
+                                uint64_t user_data) {
+    if (_ring_fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    const unsigned tail = *_sq->tail;
+    unsigned head = __atomic_load_n(_sq->head, __ATOMIC_ACQUIRE);
+    if (tail - head >= *_sq->ring_entries) {
+        if (!_sqpoll) {
+            errno = EBUSY;
+            return -1;
+        }
+        // The kernel thread is lagging behind, wait for free slots.
+        if (sys_io_uring_enter(_ring_fd, 0, 0, IORING_ENTER_SQ_WAIT) < 0) {
+            return -1;
+        }
+        head = __atomic_load_n(_sq->head, __ATOMIC_ACQUIRE);
+    }
+    const unsigned index = tail & *_sq->ring_mask;
+    struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(_sqes) + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    sqe->len = len;
+    sqe->poll32_events = poll_events;
+    sqe->user_data = user_data;
+    _sq->array[index] = index;
+    __atomic_store_n(_sq->tail, tail + 1, __ATOMIC_RELEASE);
+    if (_sqpoll) {
+        // Pairs with the barrier in kernel setting IORING_SQ_NEED_WAKEUP.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(_sq->flags, __ATOMIC_RELAXED) &
+            IORING_SQ_NEED_WAKEUP) {
+            sys_io_uring_enter(_ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        return 0;
+    }
+    // Also submit SQEs left by former failed submissions.
+    const unsigned to_submit = tail + 1 - head;
+    int rc;
+    do {
+        rc = sys_io_uring_enter(_ring_fd, to_submit, 0, 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc < 0 ? -1 : 0;
+}
+
+int IoUringPoller::AddPoll(int fd, uint32_t events, uint64_t data) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (SubmitLocked(IORING_OP_POLL_ADD, fd, 0, IORING_POLL_ADD_MULTI,
+                     events, data) != 0) {
+        return -1;
+    }
+    Interest& interest = _interests[data];
+    interest.fd = fd;
+    interest.events = events;
+    return 0;
+}
+
+int IoUringPoller::AddOneShotPoll(int fd, uint32_t events, uint64_t data) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return SubmitLocked(IORING_OP_POLL_ADD, fd, 0, 0, events, data);
+}
+
+int IoUringPoller::UpdatePoll(uint64_t data, uint32_t events) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    // Recorded even if the poll is stopped now (the update fails with
+    // ENOENT), so that RearmPoll() watches the new events.
+    Interest* interest = _interests.seek(data);
+    if (interest != NULL) {
+        interest->events = events;
+    }
+    return SubmitLocked(IORING_OP_POLL_REMOVE, -1, data,
+                        IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI,
+                        events, CONTROL_USER_DATA);
+}
+
+int IoUringPoller::RemovePoll(uint64_t data) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _interests.erase(data);
+    return SubmitLocked(IORING_OP_POLL_REMOVE, -1, data, 0, 0,
+                        CONTROL_USER_DATA);
+}
+
+int IoUringPoller::RearmPoll(uint64_t data) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    const Interest* interest = _interests.seek(data);
+    if (interest == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    return SubmitLocked(IORING_OP_POLL_ADD, interest->fd, 0,
+                        IORING_POLL_ADD_MULTI, interest->events, data);
+}
+
+int IoUringPoller::Wait(Event* e, int max) {
+    if (_ring_fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (true) {
+        unsigned head = *_cq->head;
+        const unsigned tail = __atomic_load_n(_cq->tail, __ATOMIC_ACQUIRE);
+        if (head != tail) {
+            int n = 0;
+            for (; head != tail && n < max; ++head) {
+                const struct io_uring_cqe* cqe =
+                    &_cq->cqes[head & *_cq->ring_mask];
+                if (cqe->user_data == CONTROL_USER_DATA) {
+                    // ENOENT: the poll was already stopped.
+                    if (cqe->res < 0 && cqe->res != -ENOENT) {
+                        LOG(WARNING) << "Fail to update poll: "
+                                     << berror(-cqe->res);
+                    }
+                    continue;
+                }
+                if (cqe->res == -ECANCELED) {
+                    // Removed by RemovePoll().
+                    continue;
+                }
+                Event& ev = e[n++];
+                ev.data = cqe->user_data;
+                if (cqe->res < 0) {
+                    // The poll failed and stopped, let the user see the
+                    // error when it touches the fd.
+                    ev.events = EPOLLERR;
+                    ev.stopped = false;
+                } else {
+                    ev.events = (uint32_t)cqe->res;
+                    ev.stopped = !(cqe->flags & IORING_CQE_F_MORE);
+                }
+            }
+            __atomic_store_n(_cq->head, head, __ATOMIC_RELEASE);
+            return n;
+        }
+        if (sys_io_uring_enter(_ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            return -1;
+        }
+    }
+}
+
+} // namespace brpc
+
+#else
+
+#include <errno.h>
+
+namespace brpc {
+
+IoUringPoller::IoUringPoller()
+    : _ring_fd(-1), _sqpoll(false), _sq(NULL), _cq(NULL)
+    , _sq_ptr(NULL), _sq_ptr_size(0), _cq_ptr(NULL), _cq_ptr_size(0)
+    , _sqes(NULL), _sqes_size(0) {}
+IoUringPoller::~IoUringPoller() {}
+void IoUringPoller::Destroy() {}
+int IoUringPoller::Init(unsigned, bool) { errno = ENOSYS; return -1; }
+int IoUringPoller::SubmitLocked(uint8_t, int, uint64_t, uint32_t, uint32_t,
+                                uint64_t) { errno = ENOSYS; return -1; }
+int IoUringPoller::AddPoll(int, uint32_t, uint64_t) { errno = ENOSYS; return -1; }
+int IoUringPoller::AddOneShotPoll(int, uint32_t, uint64_t) {
+    errno = ENOSYS;
+    return -1;
+}
+int IoUringPoller::UpdatePoll(uint64_t, uint32_t) { errno = ENOSYS; return -1; }
+int IoUringPoller::RemovePoll(uint64_t) { errno = ENOSYS; return -1; }
+int IoUringPoller::RearmPoll(uint64_t) { errno = ENOSYS; return -1; }
+int IoUringPoller::Wait(Event*, int) { errno = ENOSYS; return -1; }
+
+} // namespace brpc
+
+#endif // defined(OS_LINUX)
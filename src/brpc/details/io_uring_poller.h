@@ -0,0 +1,116 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_DETAILS_IO_URING_POLLER_H
+#define BRPC_DETAILS_IO_URING_POLLER_H
+
+#include <stdint.h>
+#include "butil/macros.h"                      // DISALLOW_COPY_AND_ASSIGN
+#include "butil/scoped_lock.h"                  // butil::Mutex
+#include "butil/containers/flat_map.h"
+
+namespace brpc {
+
+// [Linux >= 5.13 only] Watch readiness of file descriptors with io_uring
+// instead of epoll. Polls are multishot and edge-triggered which behave
+// like EPOLLET, but adding, changing and removing them are submitted as
+// SQEs through the ring rather than being separate epoll_ctl calls. With
+// `sqpoll' on, submissions are consumed by a kernel thread and do not
+// need syscalls at all.
+// Thread-safe except Wait() which should be called by one thread.
+class IoUringPoller {
+public:
+    struct Event {
+        uint64_t data;
+        // EPOLLIN/EPOLLOUT/EPOLLERR/EPOLLHUP/EPOLLRDHUP
+        uint32_t events;
+        // The multishot poll was stopped by the kernel (namely CQ overflow),
+        // call RearmPoll() to keep watching the fd.
+        bool stopped;
+    };
+
+    IoUringPoller();
+    ~IoUringPoller();
+
+    // Create the ring with at least `entries' SQEs.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int Init(unsigned entries, bool sqpoll);
+
+    // Watch `events' on `fd', events are returned along with `data' which
+    // also identifies the poll in UpdatePoll() and RemovePoll(), thus must
+    // be unique among polls of this instance.
+    // Errors of polls are reported asynchronously as EPOLLERR events.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int AddPoll(int fd, uint32_t events, uint64_t data);
+
+    // Same as AddPoll() but the poll stops after reporting events once.
+    int AddOneShotPoll(int fd, uint32_t events, uint64_t data);
+
+    // Change watched events of the poll identified by `data'.
+    int UpdatePoll(uint64_t data, uint32_t events);
+
+    // Stop the poll identified by `data'. The poll holds a reference to the
+    // file, it must be removed before closing the fd, otherwise the file is
+    // never released.
+    int RemovePoll(uint64_t data);
+
+    // Add the multishot poll identified by `data' again with the fd and
+    // events of the last AddPoll()/UpdatePoll(), after it was stopped by
+    // the kernel. Returns -1 with errno=ENOENT if the poll was removed.
+    int RearmPoll(uint64_t data);
+
+    // Block until at least one completion arrives and fill at most `max'
+    // events into `e'. Returns number of events filled, which may be 0 when
+    // the wakeup is caused by completions of control requests, -1 otherwise
+    // and errno is set.
+    int Wait(Event* e, int max);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(IoUringPoller);
+
+    struct SQRing;
+    struct CQRing;
+    struct Interest {
+        int fd;
+        uint32_t events;
+    };
+
+    // Queue a SQE and submit. _mutex must be locked.
+    int SubmitLocked(uint8_t opcode, int fd, uint64_t addr, uint32_t len,
+                     uint32_t poll_events, uint64_t user_data);
+    void Destroy();
+
+    int _ring_fd;
+    bool _sqpoll;
+    butil::Mutex _mutex;
+    SQRing* _sq;
+    CQRing* _cq;
+    void* _sq_ptr;
+    size_t _sq_ptr_size;
+    void* _cq_ptr;
+    size_t _cq_ptr_size;
+    void* _sqes;
+    size_t _sqes_size;
+    // Multishot polls not removed yet, protected by _mutex.
+    butil::FlatMap<uint64_t, Interest> _interests;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_DETAILS_IO_URING_POLLER_H
@@ -0,0 +1,292 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <gflags/gflags.h>
+#include "butil/endpoint.h"
+#include "butil/fd_guard.h"
+#include "butil/fd_utility.h"
+#include "butil/logging.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"
+#include "brpc/acceptor.h"
+#include "brpc/server.h"
+#include "brpc/details/listen_fd_handover.h"
+
+
+namespace brpc {
+
+DEFINE_int32(listen_fd_handover_timeout_ms, 10000,
+             "Milliseconds to wait for the peer in each step of handing over"
+             " listening fds between processes");
+
+// Enough for listening fds of all event dispatchers.
+static const size_t MAX_HANDOVER_FDS = 256;
+static const char HANDOVER_FDS_MSG = 'F';
+static const char HANDOVER_ACK_MSG = 'A';
+
+static int WaitFd(int fd, unsigned events) {
+    const timespec abstime = butil::milliseconds_from_now(
+        FLAGS_listen_fd_handover_timeout_ms);
+    return bthread_fd_timedwait(fd, events, &abstime);
+}
+
+// Read one byte from non-blocking `fd'.
+static int ReadByte(int fd, char* c) {
+    while (true) {
+        const ssize_t nr = read(fd, c, 1);
+        if (nr == 1) {
+            return 0;
+        }
+        if (nr < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nr < 0 && errno == EAGAIN && WaitFd(fd, EPOLLIN) == 0) {
+            continue;
+        }
+        return -1;
+    }
+}
+
+static int SendFds(int fd, const std::vector<int>& fds) {
+    char buf[CMSG_SPACE(sizeof(int) * MAX_HANDOVER_FDS)];
+    memset(buf, 0, sizeof(buf));
+    char c = HANDOVER_FDS_MSG;
+    struct iovec iov = { &c, 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+    while (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN && WaitFd(fd, EPOLLOUT) == 0) {
+            continue;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int RecvFds(int fd, std::vector<int>* fds) {
+    char buf[CMSG_SPACE(sizeof(int) * MAX_HANDOVER_FDS)];
+    char c = 0;
+    struct iovec iov = { &c, 1 };
+    struct msghdr msg;
+    ssize_t nr = 0;
+    while (true) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = buf;
+        msg.msg_controllen = sizeof(buf);
+        nr = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (nr >= 0) {
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN && WaitFd(fd, EPOLLIN) == 0) {
+            continue;
+        }
+        return -1;
+    }
+    fds->clear();
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            const size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* p = (const int*)CMSG_DATA(cmsg);
+            fds->insert(fds->end(), p, p + n);
+        }
+    }
+    if (nr != 1 || c != HANDOVER_FDS_MSG || fds->empty() ||
+        (msg.msg_flags & MSG_CTRUNC)) {
+        for (size_t i = 0; i < fds->size(); ++i) {
+            close((*fds)[i]);
+        }
+        fds->clear();
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+int ReceiveListenFds(const std::string& path, std::vector<int>* fds,
+                     int* ack_fd) {
+    butil::EndPoint ep;
+    if (butil::str2endpoint(("unix:" + path).c_str(), &ep) != 0) {
+        LOG(ERROR) << "Invalid listen_fd_handover_path=" << path;
+        return -1;
+    }
+    butil::fd_guard fd(butil::tcp_connect(ep, NULL));
+    if (fd < 0) {
+        // No process to take over, which is normal at the first start.
+        return -1;
+    }
+    butil::make_non_blocking(fd);
+    if (RecvFds(fd, fds) != 0) {
+        PLOG(WARNING) << "Fail to receive listening fds from " << path;
+        return -1;
+    }
+    LOG(INFO) << "Received " << fds->size() << " listening fds from " << path;
+    *ack_fd = fd.release();
+    return 0;
+}
+
+int AckListenFds(int ack_fd) {
+    butil::fd_guard fd(ack_fd);
+    const char c = HANDOVER_ACK_MSG;
+    while (write(fd, &c, 1) != 1) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN && WaitFd(fd, EPOLLOUT) == 0) {
+            continue;
+        }
+        PLOG(WARNING) << "Fail to acknowledge handover of listening fds";
+        return -1;
+    }
+    return 0;
+}
+
+ListenFdHandover::ListenFdHandover()
+    : _server(NULL)
+    , _listen_fd(-1)
+    , _tid(INVALID_BTHREAD) {
+}
+
+ListenFdHandover::~ListenFdHandover() {
+    Stop();
+}
+
+int ListenFdHandover::Start(const std::string& path, Server* server) {
+    butil::EndPoint ep;
+    if (butil::str2endpoint(("unix:" + path).c_str(), &ep) != 0) {
+        LOG(ERROR) << "Invalid listen_fd_handover_path=" << path;
+        return -1;
+    }
+    // The path may be left by the old process which handed over fds to us
+    // or crashed.
+    unlink(path.c_str());
+    butil::fd_guard fd(butil::tcp_listen(ep));
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to listen " << ep;
+        return -1;
+    }
+    butil::make_non_blocking(fd);
+    _server = server;
+    _listen_fd = fd.release();
+    if (bthread_start_background(&_tid, NULL, RunThis, this) != 0) {
+        LOG(ERROR) << "Fail to start bthread";
+        close(_listen_fd);
+        _listen_fd = -1;
+        _tid = INVALID_BTHREAD;
+        return -1;
+    }
+    return 0;
+}
+
+void ListenFdHandover::Stop() {
+    if (_tid != INVALID_BTHREAD) {
+        bthread_stop(_tid);
+        bthread_join(_tid, NULL);
+        _tid = INVALID_BTHREAD;
+    }
+    if (_listen_fd >= 0) {
+        bthread_close(_listen_fd);
+        _listen_fd = -1;
+    }
+}
+
+void* ListenFdHandover::RunThis(void* arg) {
+    static_cast<ListenFdHandover*>(arg)->Run();
+    return NULL;
+}
+
+void* ListenFdHandover::StopServer(void* arg) {
+    static_cast<Server*>(arg)->Stop(0);
+    return NULL;
+}
+
+void ListenFdHandover::Run() {
+    while (!bthread_stopped(bthread_self())) {
+        const int conn_fd = accept(_listen_fd, NULL, NULL);
+        if (conn_fd < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                if (bthread_fd_wait(_listen_fd, EPOLLIN) != 0 &&
+                    errno != EINTR) {
+                    return;
+                }
+                continue;
+            }
+            PLOG(ERROR) << "Fail to accept";
+            return;
+        }
+        butil::make_non_blocking(conn_fd);
+        const bool handed_over = HandOver(conn_fd);
+        bthread_close(conn_fd);
+        if (handed_over) {
+            LOG(INFO) << "Listening fds were handed over, stop the server";
+            // Stop() of the server joins this bthread.
+            bthread_t th;
+            if (bthread_start_background(&th, NULL, StopServer, _server) != 0) {
+                LOG(ERROR) << "Fail to start bthread to stop the server";
+            }
+            return;
+        }
+    }
+}
+
+bool ListenFdHandover::HandOver(int conn_fd) {
+    std::vector<int> fds;
+    _server->_am->ListListenedFds(&fds);
+    if (fds.empty() || fds.size() > MAX_HANDOVER_FDS) {
+        LOG(WARNING) << "Can't hand over " << fds.size() << " listening fds";
+        return false;
+    }
+    if (SendFds(conn_fd, fds) != 0) {
+        PLOG(WARNING) << "Fail to send listening fds";
+        return false;
+    }
+    // The new process may fail to start after receiving the fds, keep
+    // serving until it acknowledges.
+    char c = 0;
+    if (ReadByte(conn_fd, &c) != 0 || c != HANDOVER_ACK_MSG) {
+        LOG(WARNING) << "The new process did not acknowledge handover of"
+            " listening fds, keep serving";
+        return false;
+    }
+    return true;
+}
+
+} // namespace brpc
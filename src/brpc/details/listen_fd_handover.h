@@ -0,0 +1,86 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_LISTEN_FD_HANDOVER_H
+#define BRPC_LISTEN_FD_HANDOVER_H
+
+#include <string>
+#include <vector>
+#include "butil/macros.h"
+#include "bthread/types.h"
+
+
+namespace brpc {
+
+class Server;
+
+// Hand listening fds of a server over to a new process through a unix
+// domain socket at ServerOptions.listen_fd_handover_path:
+//   1. The new process connects to the path and receives the fds with
+//      SCM_RIGHTS, see ReceiveListenFds().
+//   2. The new process accepts connections from the fds immediately, then
+//      acknowledges with AckListenFds().
+//   3. The old process stops the server on the acknowledgement, existing
+//      requests are processed before Join() of the server returns.
+// Connections are never refused during the handover, since the listening
+// sockets are open all the time.
+
+// Receive listening fds from the process listening at `path'. Ownership of
+// `fds' and `ack_fd' is transferred to the caller.
+// Returns 0 on success, -1 if there's no such process or error occurs.
+int ReceiveListenFds(const std::string& path, std::vector<int>* fds,
+                     int* ack_fd);
+
+// Tell the old process that the new process is accepting connections.
+// `ack_fd' is closed.
+// Returns 0 on success, -1 otherwise.
+int AckListenFds(int ack_fd);
+
+// Listen at the path and hand over listening fds of a server.
+class ListenFdHandover {
+public:
+    ListenFdHandover();
+    ~ListenFdHandover();
+
+    // Listen at `path' and hand fds of `server' to the first process
+    // connecting to the path, after which `server' is stopped.
+    // Returns 0 on success, -1 otherwise.
+    int Start(const std::string& path, Server* server);
+
+    // Stop listening. The path is not removed since it may have been taken
+    // by the new process.
+    void Stop();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ListenFdHandover);
+
+    static void* RunThis(void* arg);
+    static void* StopServer(void* arg);
+    void Run();
+    // Returns true if the fds were received by the peer.
+    bool HandOver(int conn_fd);
+
+    Server* _server;
+    int _listen_fd;
+    bthread_t _tid;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_LISTEN_FD_HANDOVER_H
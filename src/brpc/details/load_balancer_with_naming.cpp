@@ -16,6 +16,15 @@
 // under the License.
 
 
+#include <inttypes.h>                                 // PRIu64
+#include <unistd.h>                                   // getpid
+#include <algorithm>                                  // std::partial_sort
+#include <functional>                                 // std::greater
+#include <iterator>                                   // std::back_inserter
+#include "butil/endpoint.h"                           // my_ip
+#include "butil/strings/stringprintf.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "brpc/socket.h"                              // Socket
 #include "brpc/details/load_balancer_with_naming.h"
 
 
@@ -44,14 +53,103 @@ int LoadBalancerWithNaming::Init(const char* ns_url, const char* lb_name,
     return 0;
 }
 
-void LoadBalancerWithNaming::OnAddedServers(
+void LoadBalancerWithNaming::set_subset(int size, const std::string& key) {
+    _subset_size = size;
+    std::string k = key;
+    if (k.empty()) {
+        k = butil::string_printf("%s:%d", butil::my_ip_cstr(), (int)getpid());
+    }
+    uint64_t h[2];
+    butil::MurmurHash3_x64_128(k.data(), k.size(), 0, h);
+    _subset_seed = h[0];
+}
+
+void LoadBalancerWithNaming::AddServersToLB(
     const std::vector<ServerId>& servers) {
+    if (_nwarmup > 0) {
+        for (size_t i = 0; i < servers.size(); ++i) {
+            SocketUniquePtr ptr;
+            if (Socket::Address(servers[i].id, &ptr) == 0) {
+                ptr->WarmUpSocketPool(_nwarmup);
+            }
+        }
+    }
     AddServersInBatch(servers);
 }
 
+uint64_t LoadBalancerWithNaming::SubsetScore(const ServerId& server) const {
+    // Hash the address rather than the SocketId which differs between
+    // processes, so that the score of a server is same in all clients
+    // with the same key.
+    std::string buf;
+    SocketUniquePtr ptr;
+    if (Socket::Address(server.id, &ptr) == 0) {
+        buf = butil::endpoint2str(ptr->remote_side()).c_str();
+    } else {
+        buf = butil::string_printf("%" PRIu64, server.id);
+    }
+    buf.push_back('|');
+    buf.append(server.tag);
+    uint64_t h[2];
+    butil::MurmurHash3_x64_128(buf.data(), buf.size(), 0, h);
+    return butil::fmix64(h[0] ^ _subset_seed);
+}
+
+void LoadBalancerWithNaming::UpdateSubset() {
+    std::vector<std::pair<uint64_t, ServerId> > ranked;
+    ranked.reserve(_all_servers.size());
+    for (std::map<ServerId, uint64_t>::const_iterator
+             it = _all_servers.begin(); it != _all_servers.end(); ++it) {
+        ranked.push_back(std::make_pair(it->second, it->first));
+    }
+    const size_t n = std::min(ranked.size(), (size_t)_subset_size);
+    std::partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(),
+                      std::greater<std::pair<uint64_t, ServerId> >());
+    std::set<ServerId> subset;
+    for (size_t i = 0; i < n; ++i) {
+        subset.insert(ranked[i].second);
+    }
+    std::vector<ServerId> added;
+    std::vector<ServerId> removed;
+    std::set_difference(subset.begin(), subset.end(),
+                        _subset.begin(), _subset.end(),
+                        std::back_inserter(added));
+    std::set_difference(_subset.begin(), _subset.end(),
+                        subset.begin(), subset.end(),
+                        std::back_inserter(removed));
+    _subset.swap(subset);
+    // Add before removing so that the load balancer is never emptied by
+    // replacing servers.
+    if (!added.empty()) {
+        AddServersToLB(added);
+    }
+    if (!removed.empty()) {
+        RemoveServersInBatch(removed);
+    }
+}
+
+void LoadBalancerWithNaming::OnAddedServers(
+    const std::vector<ServerId>& servers) {
+    if (_subset_size <= 0) {
+        AddServersToLB(servers);
+        return;
+    }
+    for (size_t i = 0; i < servers.size(); ++i) {
+        _all_servers[servers[i]] = SubsetScore(servers[i]);
+    }
+    UpdateSubset();
+}
+
 void LoadBalancerWithNaming::OnRemovedServers(
     const std::vector<ServerId>& servers) {
-    RemoveServersInBatch(servers);
+    if (_subset_size <= 0) {
+        RemoveServersInBatch(servers);
+        return;
+    }
+    for (size_t i = 0; i < servers.size(); ++i) {
+        _all_servers.erase(servers[i]);
+    }
+    UpdateSubset();
 }
 
 void LoadBalancerWithNaming::Describe(std::ostream& os,
@@ -61,6 +159,9 @@ void LoadBalancerWithNaming::Describe(std::ostream& os,
     } else {
         os << "NULL";
     }
+    if (_subset_size > 0) {
+        os << " subset=" << _subset.size() << '/' << _all_servers.size();
+    }
     os << " lb=";
     SharedLoadBalancer::Describe(os, options);
 }
@@ -19,6 +19,8 @@
 #ifndef BRPC_LOAD_BALANCER_WITH_NAMING_H
 #define BRPC_LOAD_BALANCER_WITH_NAMING_H
 
+#include <map>
+#include <set>
 #include "butil/intrusive_ptr.hpp"
 #include "brpc/load_balancer.h"
 #include "brpc/details/naming_service_thread.h"         // NamingServiceWatcher
@@ -29,7 +31,7 @@ namespace brpc {
 class LoadBalancerWithNaming : public SharedLoadBalancer,
                                public NamingServiceWatcher {
 public:
-    LoadBalancerWithNaming() {}
+    LoadBalancerWithNaming() : _nwarmup(0), _subset_size(0), _subset_seed(0) {}
     ~LoadBalancerWithNaming();
 
     int Init(const char* ns_url, const char* lb_name,
@@ -41,8 +43,38 @@ public:
 
     void Describe(std::ostream& os, const DescribeOptions& options);
 
+    // Connect so many pooled sockets of each added server in advance.
+    // Must be called before Init().
+    void set_warm_up_pooled_sockets(int n) { _nwarmup = n; }
+
+    // Only put at most `size' servers from the naming service into the load
+    // balancer. The subset is chosen by rendezvous hashing with `key', so
+    // that clients with different keys spread over all servers evenly and
+    // a membership change replaces at most one server in the subset.
+    // Non-positive `size' means all servers. Must be called before Init().
+    void set_subset(int size, const std::string& key);
+
+    // Wait until the naming service returns servers for the first time or
+    // `deadline_us' is reached. Returns 0 on the former.
+    int WaitForServers(int64_t deadline_us) {
+        return _nsthread_ptr->TimedWaitForFirstBatchOfServers(deadline_us);
+    }
+
 private:
+    void AddServersToLB(const std::vector<ServerId>& servers);
+    uint64_t SubsetScore(const ServerId& server) const;
+    // Recompute the subset from _all_servers and apply the difference
+    // to the load balancer.
+    void UpdateSubset();
+
     butil::intrusive_ptr<NamingServiceThread> _nsthread_ptr;
+    int _nwarmup;
+    int _subset_size;
+    uint64_t _subset_seed;
+    // Modified in callbacks of NamingServiceWatcher only, which are
+    // serialized by NamingServiceThread.
+    std::map<ServerId, uint64_t> _all_servers;  // server -> score
+    std::set<ServerId> _subset;
 };
 
 } // namespace brpc
@@ -392,6 +392,13 @@ int SSLDHInit() {
     return 0;
 }
 
+bool ResumeClientSSLSession(SSL*, const butil::EndPoint&, const std::string&) {
+    return false;
+}
+
+void RemoveClientSSLSessions(SSL_CTX*) {
+}
+
 void Print(std::ostream& os, SSL* ssl, const char* sep) {
     os << "cipher=" << SSL_get_cipher_name(ssl) << sep
        << "protocol=" << SSL_get_version(ssl) << sep;
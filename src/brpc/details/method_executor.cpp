@@ -0,0 +1,186 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "brpc/controller.h"
+#include "brpc/errno.pb.h"
+#include "brpc/details/rpc_deadline.h"
+#include "brpc/details/running_method.h"
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/method_executor.h"
+
+namespace bthread {
+// Defined in bthread/task_control.cpp
+void run_worker_startfn();
+}
+
+
+namespace brpc {
+
+static int64_t GetExecutorQueueSize(void* arg) {
+    return static_cast<MethodExecutor*>(arg)->queue_size();
+}
+
+MethodExecutor::MethodExecutor()
+    : _nwaiting(0)
+    , _stop(false)
+    , _queue_size_var(GetExecutorQueueSize, this) {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+MethodExecutor::~MethodExecutor() {
+    pthread_mutex_lock(&_mutex);
+    _stop = true;
+    pthread_mutex_unlock(&_mutex);
+    pthread_cond_broadcast(&_cond);
+    for (size_t i = 0; i < _threads.size(); ++i) {
+        pthread_join(_threads[i], NULL);
+    }
+    _threads.clear();
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+int MethodExecutor::Init(const std::string& name,
+                         const MethodExecutorOptions& options) {
+    if (name.empty()) {
+        LOG(ERROR) << "Name of the executor is empty";
+        return -1;
+    }
+    if (options.num_pthreads <= 0 &&
+        options.bthread_tag != BTHREAD_TAG_INVALID &&
+        bthread_getconcurrency_by_tag(options.bthread_tag) < 0) {
+        LOG(ERROR) << "Invalid bthread_tag=" << options.bthread_tag
+                   << " of executor=" << name;
+        return -1;
+    }
+    _name = name;
+    _options = options;
+    for (int i = 0; i < _options.num_pthreads; ++i) {
+        pthread_t th;
+        const int rc = pthread_create(&th, NULL, RunPthread, this);
+        if (rc != 0) {
+            LOG(ERROR) << "Fail to create pthread of executor=" << name
+                       << ": " << berror(rc);
+            return -1;
+        }
+        _threads.push_back(th);
+    }
+    const std::string prefix = "rpc_executor_" + name;
+    _queue_latency.expose(prefix + "_queue");
+    _queue_size_var.expose(prefix + "_queue_size");
+    return 0;
+}
+
+void MethodExecutor::CallMethod(
+    google::protobuf::Service* service,
+    const google::protobuf::MethodDescriptor* method,
+    Controller* cntl,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response,
+    google::protobuf::Closure* done) {
+    const int64_t nwaiting = _nwaiting.fetch_add(1, butil::memory_order_relaxed);
+    if (_options.max_queue_size > 0 && nwaiting >= _options.max_queue_size) {
+        _nwaiting.fetch_sub(1, butil::memory_order_relaxed);
+        cntl->SetFailed(ELIMIT, "Too many calls waiting in executor=%s",
+                        _name.c_str());
+        return done->Run();
+    }
+    Call* call = new Call;
+    call->service = service;
+    call->method = method;
+    call->cntl = cntl;
+    call->request = request;
+    call->response = response;
+    call->done = done;
+    call->enqueue_us = butil::cpuwide_time_us();
+    call->executor = this;
+    if (_options.num_pthreads > 0) {
+        pthread_mutex_lock(&_mutex);
+        _queue.push_back(call);
+        pthread_mutex_unlock(&_mutex);
+        pthread_cond_signal(&_cond);
+        return;
+    }
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = _options.bthread_tag;
+    if (FLAGS_rpc_deadline_scheduling && cntl->deadline_us() > 0) {
+        attr.deadline_us = cntl->deadline_us();
+    }
+    bthread_t th;
+    if (bthread_start_background(&th, &attr, RunCallInBthread, call) != 0) {
+        LOG(FATAL) << "Fail to start bthread, run the call in-place";
+        RunCall(call);
+    }
+}
+
+void* MethodExecutor::RunCallInBthread(void* arg) {
+    Call* call = static_cast<Call*>(arg);
+    call->executor->RunCall(call);
+    return NULL;
+}
+
+void* MethodExecutor::RunPthread(void* arg) {
+    static_cast<MethodExecutor*>(arg)->PthreadLoop();
+    return NULL;
+}
+
+void MethodExecutor::PthreadLoop() {
+    bthread::run_worker_startfn();
+    while (true) {
+        Call* call = NULL;
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            while (_queue.empty() && !_stop) {
+                pthread_cond_wait(&_cond, &_mutex);
+            }
+            if (_queue.empty()) {
+                return;
+            }
+            call = _queue.front();
+            _queue.pop_front();
+        }
+        RunCall(call);
+    }
+}
+
+void MethodExecutor::RunCall(Call* call) {
+    _nwaiting.fetch_sub(1, butil::memory_order_relaxed);
+    _queue_latency << (butil::cpuwide_time_us() - call->enqueue_us);
+    Controller* cntl = call->cntl;
+    // The call may wait in the queue for long.
+    if (IsRpcDeadlineExpired(cntl->deadline_us())) {
+        cntl->SetFailed(ERPCTIMEDOUT, "Deadline of the request expired"
+                        " before running");
+        call->done->Run();
+    } else {
+        ControllerPrivateAccessor(cntl).set_phase_begin_us(
+            RPC_PHASE_SERVER_USERCODE, butil::cpuwide_time_us());
+        ScopedRpcDeadline deadline_guard(cntl->deadline_us());
+        ScopedRunningMethod method_guard(call->method);
+        call->service->CallMethod(call->method, cntl, call->request,
+                                  call->response, call->done);
+    }
+    delete call;
+}
+
+} // namespace brpc
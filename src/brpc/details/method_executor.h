@@ -0,0 +1,102 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_METHOD_EXECUTOR_H
+#define BRPC_METHOD_EXECUTOR_H
+
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <google/protobuf/service.h>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "bvar/bvar.h"
+#include "brpc/method_executor_options.h"     // MethodExecutorOptions
+
+
+namespace brpc {
+
+class Controller;
+
+// Run methods of a server in separate bthreads or pthreads so that they're
+// isolated from other methods, e.g. slow methods don't occupy workers of
+// latency-sensitive ones. Created by Server::AddMethodExecutor().
+class MethodExecutor {
+public:
+    MethodExecutor();
+    // Pthreads are joined. All calls should be done.
+    ~MethodExecutor();
+
+    // Returns 0 on success, -1 otherwise.
+    int Init(const std::string& name, const MethodExecutorOptions& options);
+
+    // Call the method in the executor, or fail `cntl' with ELIMIT and run
+    // `done' in-place if too many calls are waiting.
+    void CallMethod(google::protobuf::Service* service,
+                    const google::protobuf::MethodDescriptor* method,
+                    Controller* cntl,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done);
+
+    const std::string& name() const { return _name; }
+
+    // Number of calls waiting to run.
+    int64_t queue_size() const {
+        return _nwaiting.load(butil::memory_order_relaxed);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MethodExecutor);
+
+    struct Call {
+        google::protobuf::Service* service;
+        const google::protobuf::MethodDescriptor* method;
+        Controller* cntl;
+        const google::protobuf::Message* request;
+        google::protobuf::Message* response;
+        google::protobuf::Closure* done;
+        int64_t enqueue_us;
+        MethodExecutor* executor;
+    };
+    static void* RunCallInBthread(void* arg);
+    static void* RunPthread(void* arg);
+    void PthreadLoop();
+    void RunCall(Call* call);
+
+    std::string _name;
+    MethodExecutorOptions _options;
+    butil::atomic<int64_t> _nwaiting;
+
+    // Used when _options.num_pthreads is positive.
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    std::deque<Call*> _queue;
+    bool _stop;
+    std::vector<pthread_t> _threads;
+
+    // Time that calls wait before running.
+    bvar::LatencyRecorder _queue_latency;
+    bvar::PassiveStatus<int64_t> _queue_size_var;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_METHOD_EXECUTOR_H
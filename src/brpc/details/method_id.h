@@ -0,0 +1,42 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_METHOD_ID_H
+#define BRPC_METHOD_ID_H
+
+#include <stdint.h>
+#include "butil/strings/string_piece.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+
+
+namespace brpc {
+
+// Integer id of a method computed from MethodDescriptor::full_name(), which
+// is the same in all processes. Protocols send this id instead of the names
+// of the service and method. Ids are never 0.
+inline uint64_t MethodIdOf(const butil::StringPiece& method_full_name) {
+    uint64_t h[2];
+    butil::MurmurHash3_x64_128(method_full_name.data(), method_full_name.size(),
+                               0x62727063/*brpc*/, h);
+    return h[0] ? h[0] : 1;
+}
+
+} // namespace brpc
+
+
+#endif // BRPC_METHOD_ID_H
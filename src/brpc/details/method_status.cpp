@@ -17,13 +17,64 @@
 
 
 #include <limits>
+#include <gflags/gflags.h>
 #include "butil/macros.h"
+#include "butil/memory/singleton_on_pthread_once.h"
 #include "brpc/controller.h"
 #include "brpc/details/server_private_accessor.h"
 #include "brpc/details/method_status.h"
 
 namespace brpc {
 
+DEFINE_bool(rpc_server_phase_latency, false,
+            "Expose latencies of phases of server-side calls as "
+            "<method>_phase_{read,parse,queue,usercode,serialize,write}, "
+            "checked when methods are called for the first time");
+
+// Phases beginning the intervals recorded by TrafficStats::phase_rec,
+// the interval of phase i ends at s_phase_begins[i + 1].
+static const RpcPhase s_phase_begins[] = {
+    RPC_PHASE_SERVER_READ,
+    RPC_PHASE_SERVER_PARSE,
+    RPC_PHASE_SERVER_QUEUE,
+    RPC_PHASE_SERVER_USERCODE,
+    RPC_PHASE_SERVER_SERIALIZE,
+    RPC_PHASE_SERVER_WRITE,
+    RPC_PHASE_SERVER_WRITTEN
+};
+static const char* const s_phase_names[] = {
+    "phase_read", "phase_parse", "phase_queue",
+    "phase_usercode", "phase_serialize", "phase_write"
+};
+
+struct PriorityRequestBvars {
+    bvar::Adder<int64_t> accepted_count[REQUEST_PRIORITY_HIGH + 1];
+    bvar::Adder<int64_t> rejected_count[REQUEST_PRIORITY_HIGH + 1];
+
+    PriorityRequestBvars() {
+        const char* const names[] = { "low", "normal", "high" };
+        BAIDU_CASSERT(arraysize(names) == REQUEST_PRIORITY_HIGH + 1,
+                      names_must_match_priorities);
+        for (int i = 0; i <= REQUEST_PRIORITY_HIGH; ++i) {
+            // e.g. rpc_server_low_priority_accepted_count
+            const std::string prefix =
+                std::string("rpc_server_") + names[i] + "_priority";
+            accepted_count[i].expose_as(prefix, "accepted_count");
+            rejected_count[i].expose_as(prefix, "rejected_count");
+        }
+    }
+};
+
+void CountPriorityRequest(RequestPriority priority, bool accepted) {
+    PriorityRequestBvars* bvars =
+        butil::get_leaky_singleton<PriorityRequestBvars>();
+    if (accepted) {
+        bvars->accepted_count[priority] << 1;
+    } else {
+        bvars->rejected_count[priority] << 1;
+    }
+}
+
 static int cast_int(void* arg) {
     return *(int*)arg;
 }
@@ -39,25 +90,60 @@ static int cast_cl(void* arg) {
 MethodStatus::MethodStatus()
     : _nconcurrency(0)
     , _nconcurrency_bvar(cast_int, &_nconcurrency)
-    , _eps_bvar(&_nerror_bvar)
     , _max_concurrency_bvar(cast_cl, &_cl)
+    , _max_inflight_bytes(0)
+    , _ninflight_bytes(0)
+    , _traffic_stats(NULL)
 {
 }
 
 MethodStatus::~MethodStatus() {
+    delete _traffic_stats.load(butil::memory_order_relaxed);
 }
 
-int MethodStatus::Expose(const butil::StringPiece& prefix) {
-    if (_nconcurrency_bvar.expose_as(prefix, "concurrency") != 0) {
+int MethodStatus::TrafficStats::Expose(const std::string& prefix) {
+    if (nerror.expose_as(prefix, "error") != 0) {
         return -1;
     }
-    if (_nerror_bvar.expose_as(prefix, "error") != 0) {
+    if (eps.expose_as(prefix, "eps") != 0) {
         return -1;
     }
-    if (_eps_bvar.expose_as(prefix, "eps") != 0) {
+    if (latency_rec.expose(prefix) != 0) {
         return -1;
     }
-    if (_latency_rec.expose(prefix) != 0) {
+    BAIDU_CASSERT(arraysize(s_phase_names) == NPHASE_LATENCY &&
+                  arraysize(s_phase_begins) == NPHASE_LATENCY + 1,
+                  phase_names_must_match_recorders);
+    for (int i = 0; i < NPHASE_LATENCY; ++i) {
+        if (phase_rec[i] != NULL &&
+            phase_rec[i]->expose(prefix + "_" + s_phase_names[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+MethodStatus::TrafficStats* MethodStatus::CreateTrafficStats() {
+    BAIDU_SCOPED_LOCK(_traffic_stats_mutex);
+    TrafficStats* s = _traffic_stats.load(butil::memory_order_relaxed);
+    if (s != NULL) {
+        return s;
+    }
+    s = new TrafficStats;
+    if (FLAGS_rpc_server_phase_latency) {
+        for (int i = 0; i < NPHASE_LATENCY; ++i) {
+            s->phase_rec[i].reset(new bvar::LatencyRecorder);
+        }
+    }
+    if (!_prefix.empty() && s->Expose(_prefix) != 0) {
+        LOG(WARNING) << "Fail to expose vars of " << _prefix;
+    }
+    _traffic_stats.store(s, butil::memory_order_release);
+    return s;
+}
+
+int MethodStatus::Expose(const butil::StringPiece& prefix) {
+    if (_nconcurrency_bvar.expose_as(prefix, "concurrency") != 0) {
         return -1;
     }
     if (_cl) {
@@ -65,6 +151,14 @@ int MethodStatus::Expose(const butil::StringPiece& prefix) {
             return -1;
         }
     }
+    // Expose() runs in a bthread of the started server, concurrently with
+    // CreateTrafficStats() called by the first response.
+    BAIDU_SCOPED_LOCK(_traffic_stats_mutex);
+    _prefix = prefix.as_string();
+    TrafficStats* s = _traffic_stats.load(butil::memory_order_relaxed);
+    if (s != NULL && s->Expose(_prefix) != 0) {
+        return -1;
+    }
     return 0;
 }
 
@@ -96,45 +190,69 @@ void OutputValue(std::ostream& os,
     }
 }
 
-void MethodStatus::Describe(
+void MethodStatus::TrafficStats::Describe(
     std::ostream &os, const DescribeOptions& options) const {
     // success requests
-    OutputValue(os, "count: ", _latency_rec.count_name(), _latency_rec.count(),
+    OutputValue(os, "count: ", latency_rec.count_name(), latency_rec.count(),
                 options, false);
-    const int64_t qps = _latency_rec.qps();
+    const int64_t qps = latency_rec.qps();
     const bool expand = (qps != 0);
-    OutputValue(os, "qps: ", _latency_rec.qps_name(), _latency_rec.qps(),
+    OutputValue(os, "qps: ", latency_rec.qps_name(), latency_rec.qps(),
                 options, expand);
 
     // errorous requests
-    OutputValue(os, "error: ", _nerror_bvar.name(), _nerror_bvar.get_value(),
+    OutputValue(os, "error: ", nerror.name(), nerror.get_value(),
                 options, false);
-    OutputValue(os, "eps: ", _eps_bvar.name(),
-                _eps_bvar.get_value(1), options, false);
+    OutputValue(os, "eps: ", eps.name(),
+                eps.get_value(1), options, false);
 
     // latencies
-    OutputValue(os, "latency: ", _latency_rec.latency_name(),
-                _latency_rec.latency(), options, false);
+    OutputValue(os, "latency: ", latency_rec.latency_name(),
+                latency_rec.latency(), options, false);
     if (options.use_html) {
         OutputValue(os, "latency_percentiles: ",
-                    _latency_rec.latency_percentiles_name(),
-                    _latency_rec.latency_percentiles(), options, false);
-        OutputValue(os, "latency_cdf: ", _latency_rec.latency_cdf_name(),
+                    latency_rec.latency_percentiles_name(),
+                    latency_rec.latency_percentiles(), options, false);
+        OutputValue(os, "latency_cdf: ", latency_rec.latency_cdf_name(),
                     "click to view", options, expand);
     } else {
         OutputTextValue(os, "latency_50: ",
-                        _latency_rec.latency_percentile(0.5));
+                        latency_rec.latency_percentile(0.5));
         OutputTextValue(os, "latency_90: ",
-                        _latency_rec.latency_percentile(0.9));
+                        latency_rec.latency_percentile(0.9));
         OutputTextValue(os, "latency_99: ",
-                        _latency_rec.latency_percentile(0.99));
+                        latency_rec.latency_percentile(0.99));
         OutputTextValue(os, "latency_999: ",
-                        _latency_rec.latency_percentile(0.999));
+                        latency_rec.latency_percentile(0.999));
         OutputTextValue(os, "latency_9999: ",
-                        _latency_rec.latency_percentile(0.9999));
+                        latency_rec.latency_percentile(0.9999));
+    }
+    OutputValue(os, "max_latency: ", latency_rec.max_latency_name(),
+                latency_rec.max_latency(), options, false);
+
+    // Phases
+    for (int i = 0; i < NPHASE_LATENCY; ++i) {
+        if (phase_rec[i] != NULL) {
+            const std::string prefix = std::string(s_phase_names[i]) + ": ";
+            OutputValue(os, prefix.c_str(), phase_rec[i]->latency_name(),
+                        phase_rec[i]->latency(), options, false);
+        }
+    }
+}
+
+void MethodStatus::Describe(
+    std::ostream &os, const DescribeOptions& options) const {
+    const TrafficStats* stats = _traffic_stats.load(butil::memory_order_acquire);
+    if (stats == NULL) {
+        // Never responded, vars are not created yet.
+        if (options.use_html) {
+            os << "<p>count: 0</p>\n";
+        } else {
+            OutputTextValue(os, "count: ", 0);
+        }
+    } else {
+        stats->Describe(os, options);
     }
-    OutputValue(os, "max_latency: ", _latency_rec.max_latency_name(),
-                _latency_rec.max_latency(), options, false);
 
     // Concurrency
     OutputValue(os, "concurrency: ", _nconcurrency_bvar.name(),
@@ -145,6 +263,21 @@ void MethodStatus::Describe(
     }
 }
 
+void MethodStatus::OnPhases(const Controller* cntl) {
+    // Always called after OnResponded().
+    TrafficStats* stats = _traffic_stats.load(butil::memory_order_acquire);
+    if (stats == NULL || stats->phase_rec[0] == NULL) {
+        return;
+    }
+    for (int i = 0; i < NPHASE_LATENCY; ++i) {
+        const int64_t begin_us = cntl->phase_begin_us(s_phase_begins[i]);
+        const int64_t end_us = cntl->phase_begin_us(s_phase_begins[i + 1]);
+        if (begin_us != 0 && end_us >= begin_us) {
+            *stats->phase_rec[i] << (end_us - begin_us);
+        }
+    }
+}
+
 void MethodStatus::SetConcurrencyLimiter(ConcurrencyLimiter* cl) {
     _cl.reset(cl);
 }
@@ -152,9 +285,12 @@ void MethodStatus::SetConcurrencyLimiter(ConcurrencyLimiter* cl) {
 ConcurrencyRemover::~ConcurrencyRemover() {
     if (_status) {
         _status->OnResponded(_c->ErrorCode(), butil::cpuwide_time_us() - _received_us);
-        _status = NULL;
+        _status->OnPhases(_c);
     }
-    ServerPrivateAccessor(_c->server()).RemoveConcurrency(_c);
+    ServerPrivateAccessor accessor(_c->server());
+    accessor.RemoveInflightBytes(_c, _status);
+    _status = NULL;
+    accessor.RemoveConcurrency(_c);
 }
 
 }  // namespace brpc
@@ -20,6 +20,7 @@
 #define  BRPC_METHOD_STATUS_H
 
 #include "butil/macros.h"                  // DISALLOW_COPY_AND_ASSIGN
+#include "butil/synchronization/lock.h"
 #include "bvar/bvar.h"                    // vars
 #include "brpc/describable.h"
 #include "brpc/concurrency_limiter.h"
@@ -38,7 +39,10 @@ public:
     // Call this function when the method is about to be called.
     // Returns false when the method is overloaded. If rejected_cc is not
     // NULL, it's set with the rejected concurrency.
-    bool OnRequested(int* rejected_cc = NULL);
+    // Accepted and rejected requests are counted by `priority' in
+    // rpc_server_<priority>_priority_{accepted,rejected}_count.
+    bool OnRequested(int* rejected_cc = NULL,
+                     RequestPriority priority = REQUEST_PRIORITY_NORMAL);
 
     // Call this when the method just finished.
     // `error_code' : The error code obtained from the controller. Equal to 
@@ -48,6 +52,11 @@ public:
     // did the time keeping and the cost is better saved. 
     void OnResponded(int error_code, int64_t latency_us);
 
+    // Record latencies between phases of the server-side call in `cntl',
+    // see RpcPhase in controller.h. No-op unless -rpc_server_phase_latency
+    // is on when the method is called for the first time.
+    void OnPhases(const Controller* cntl);
+
     // Expose internal vars.
     // Return 0 on success, -1 otherwise.
     int Expose(const butil::StringPiece& prefix);
@@ -58,6 +67,21 @@ public:
     // Current max_concurrency of the method.
     int MaxConcurrency() const { return _cl ? _cl->MaxConcurrency() : 0; }
 
+    // Number of requests of the method being processed.
+    int concurrency() const {
+        return _nconcurrency.load(butil::memory_order_relaxed);
+    }
+
+    // Max bytes of in-flight requests of the method, 0 means unlimited.
+    int64_t max_inflight_bytes() const { return _max_inflight_bytes; }
+
+    // Charge `nbytes' of a request to the method. Returns false (and
+    // charges nothing) when max_inflight_bytes() would be exceeded.
+    bool AddInflightBytes(int64_t nbytes);
+    void RemoveInflightBytes(int64_t nbytes) {
+        _ninflight_bytes.fetch_sub(nbytes, butil::memory_order_relaxed);
+    }
+
 private:
 friend class Server;
     DISALLOW_COPY_AND_ASSIGN(MethodStatus);
@@ -65,14 +89,45 @@ friend class Server;
     // Note: SetConcurrencyLimiter() is not thread safe and can only be called 
     // before the server is started. 
     void SetConcurrencyLimiter(ConcurrencyLimiter* cl);
+    void SetMaxInflightBytes(int64_t max_bytes) { _max_inflight_bytes = max_bytes; }
+
+    // Latencies of phases: read, parse, queue, usercode, serialize and write.
+    static const int NPHASE_LATENCY = 6;
+
+    // Vars fed by responses. A LatencyRecorder is dozens of combiners and
+    // windows sampled every second, which adds up in servers with thousands
+    // of methods mostly never called, so these vars are created and exposed
+    // when the method responds for the first time.
+    struct TrafficStats {
+        bvar::Adder<int64_t> nerror;
+        bvar::PerSecond<bvar::Adder<int64_t>> eps;
+        bvar::LatencyRecorder latency_rec;
+        // NULL unless -rpc_server_phase_latency is on at creation.
+        std::unique_ptr<bvar::LatencyRecorder> phase_rec[NPHASE_LATENCY];
+
+        TrafficStats() : eps(&nerror) {}
+        int Expose(const std::string& prefix);
+        void Describe(std::ostream& os, const DescribeOptions&) const;
+    };
+
+    TrafficStats* traffic_stats() {
+        TrafficStats* s = _traffic_stats.load(butil::memory_order_acquire);
+        return s ? s : CreateTrafficStats();
+    }
+    TrafficStats* CreateTrafficStats();
 
     std::unique_ptr<ConcurrencyLimiter> _cl;
     butil::atomic<int> _nconcurrency;
-    bvar::Adder<int64_t>  _nerror_bvar;
-    bvar::LatencyRecorder _latency_rec;
     bvar::PassiveStatus<int>  _nconcurrency_bvar;
-    bvar::PerSecond<bvar::Adder<int64_t>> _eps_bvar;
     bvar::PassiveStatus<int32_t> _max_concurrency_bvar;
+    int64_t _max_inflight_bytes;
+    butil::atomic<int64_t> _ninflight_bytes;
+    // Created once and never destroyed before this object.
+    butil::atomic<TrafficStats*> _traffic_stats;
+    // Protecting creation of _traffic_stats and _prefix.
+    mutable butil::Mutex _traffic_stats_mutex;
+    // Set by Expose(), empty if the method is not exposed yet.
+    std::string _prefix;
 };
 
 class ConcurrencyRemover {
@@ -89,23 +144,42 @@ private:
     uint64_t _received_us;
 };
 
-inline bool MethodStatus::OnRequested(int* rejected_cc) {
+// Count a request with `priority' which is accepted or not.
+void CountPriorityRequest(RequestPriority priority, bool accepted);
+
+inline bool MethodStatus::OnRequested(int* rejected_cc,
+                                      RequestPriority priority) {
     const int cc = _nconcurrency.fetch_add(1, butil::memory_order_relaxed) + 1;
-    if (NULL == _cl || _cl->OnRequested(cc)) {
+    if (NULL == _cl || _cl->OnRequested(cc, priority)) {
+        CountPriorityRequest(priority, true);
         return true;
     } 
+    CountPriorityRequest(priority, false);
     if (rejected_cc) {
         *rejected_cc = cc;
     }
     return false;
 }
 
+inline bool MethodStatus::AddInflightBytes(int64_t nbytes) {
+    const int64_t n =
+        _ninflight_bytes.fetch_add(nbytes, butil::memory_order_relaxed) + nbytes;
+    // A single request larger than the limit is still accepted when no
+    // other requests are in flight, otherwise it would never be served.
+    if (n <= _max_inflight_bytes || n == nbytes) {
+        return true;
+    }
+    _ninflight_bytes.fetch_sub(nbytes, butil::memory_order_relaxed);
+    return false;
+}
+
 inline void MethodStatus::OnResponded(int error_code, int64_t latency) {
     _nconcurrency.fetch_sub(1, butil::memory_order_relaxed);
+    TrafficStats* stats = traffic_stats();
     if (0 == error_code) {
-        _latency_rec << latency;
+        stats->latency_rec << latency;
     } else {
-        _nerror_bvar << 1;
+        stats->nerror << 1;
     }
     if (NULL != _cl) {
         _cl->OnResponded(error_code, latency);
@@ -21,6 +21,7 @@
 #include <gflags/gflags.h>
 #include "bthread/butex.h"
 #include "butil/scoped_lock.h"
+#include "butil/time.h"
 #include "butil/logging.h"
 #include "brpc/log.h"
 #include "brpc/socket_map.h"
@@ -63,7 +64,8 @@ NamingServiceThread::Actions::Actions(NamingServiceThread* owner)
     : _owner(owner)
     , _wait_id(INVALID_BTHREAD_ID)
     , _has_wait_error(false)
-    , _wait_error(0) {
+    , _wait_error(0)
+    , _first_batch_event(1) {
     CHECK_EQ(0, bthread_id_create(&_wait_id, NULL, NULL));
 }
 
@@ -77,16 +79,52 @@ NamingServiceThread::Actions::~Actions() {
     EndWait(0);
 }
 
+// Sort and remove duplicated servers.
+static void SortAndDedup(std::vector<ServerNode>* servers) {
+    std::sort(servers->begin(), servers->end());
+    const size_t dedup_size = std::unique(servers->begin(), servers->end())
+        - servers->begin();
+    if (dedup_size != servers->size()) {
+        LOG(WARNING) << "Removed " << servers->size() - dedup_size
+                     << " duplicated servers";
+        servers->resize(dedup_size);
+    }
+}
+
 void NamingServiceThread::Actions::AddServers(
-    const std::vector<ServerNode>&) {
-    // FIXME(gejun)
-    abort();
+    const std::vector<ServerNode>& servers) {
+    // Only added servers are sorted, which is cheaper than ResetServers()
+    // with the full list when servers change by event notifications.
+    _servers.assign(servers.begin(), servers.end());
+    SortAndDedup(&_servers);
+    _added.resize(_servers.size());
+    _added.resize(std::set_difference(_servers.begin(), _servers.end(),
+                                      _last_servers.begin(), _last_servers.end(),
+                                      _added.begin()) - _added.begin());
+    _removed.clear();
+    _servers.resize(_last_servers.size() + _added.size());
+    std::merge(_last_servers.begin(), _last_servers.end(),
+               _added.begin(), _added.end(), _servers.begin());
+    ApplyChanges();
 }
 
 void NamingServiceThread::Actions::RemoveServers(
-    const std::vector<ServerNode>&) {
-    // FIXME(gejun)
-    abort();
+    const std::vector<ServerNode>& servers) {
+    _servers.assign(servers.begin(), servers.end());
+    SortAndDedup(&_servers);
+    // Ignore servers not added.
+    _removed.resize(_servers.size());
+    _removed.resize(std::set_intersection(
+                        _servers.begin(), _servers.end(),
+                        _last_servers.begin(), _last_servers.end(),
+                        _removed.begin()) - _removed.begin());
+    _added.clear();
+    _servers.resize(_last_servers.size());
+    _servers.resize(std::set_difference(
+                        _last_servers.begin(), _last_servers.end(),
+                        _removed.begin(), _removed.end(),
+                        _servers.begin()) - _servers.begin());
+    ApplyChanges();
 }
 
 void NamingServiceThread::Actions::ResetServers(
@@ -95,14 +133,7 @@ void NamingServiceThread::Actions::ResetServers(
     
     // Diff servers with _last_servers by comparing sorted vectors.
     // Notice that _last_servers is always sorted.
-    std::sort(_servers.begin(), _servers.end());
-    const size_t dedup_size = std::unique(_servers.begin(), _servers.end())
-        - _servers.begin();
-    if (dedup_size != _servers.size()) {
-        LOG(WARNING) << "Removed " << _servers.size() - dedup_size
-                     << " duplicated servers";
-        _servers.resize(dedup_size);
-    }
+    SortAndDedup(&_servers);
     _added.resize(_servers.size());
     std::vector<ServerNode>::iterator _added_end = 
         std::set_difference(_servers.begin(), _servers.end(),
@@ -116,6 +147,18 @@ void NamingServiceThread::Actions::ResetServers(
                             _servers.begin(), _servers.end(),
                             _removed.begin());
     _removed.resize(_removed_end - _removed.begin());
+    ApplyChanges();
+}
+
+// Notify watchers with _added and _removed, and replace _last_servers
+// with _servers.
+void NamingServiceThread::Actions::ApplyChanges() {
+    if (_added.empty() && _removed.empty()) {
+        // Nothing changed, which is the most common case. Skip rebuilding
+        // sockets which is O(N) and watchers are not notified either.
+        EndWait(_servers.empty() ? ENODATA : 0);
+        return;
+    }
 
     _added_sockets.clear();
     for (size_t i = 0; i < _added.size(); ++i) {
@@ -125,7 +168,9 @@ void NamingServiceThread::Actions::ResetServers(
         //       Socket. SocketMapKey may be passed through AddWatcher. Make sure
         //       to pick those Sockets with the right settings during OnAddedServers
         const SocketMapKey key(_added[i], _owner->_options.channel_signature);
-        CHECK_EQ(0, SocketMapInsert(key, &tagged_id.id, _owner->_options.ssl_ctx));
+        CHECK_EQ(0, SocketMapInsert(key, &tagged_id.id, _owner->_options.ssl_ctx,
+                                    _owner->_options.tuning_options,
+                                    _owner->_options.use_rdma));
         _added_sockets.push_back(tagged_id);
     }
 
@@ -202,7 +247,7 @@ void NamingServiceThread::Actions::ResetServers(
         LOG(INFO) << info.str();
     }
 
-    EndWait(servers.empty() ? ENODATA : 0);
+    EndWait(_last_servers.empty() ? ENODATA : 0);
 }
 
 void NamingServiceThread::Actions::EndWait(int error_code) {
@@ -210,6 +255,7 @@ void NamingServiceThread::Actions::EndWait(int error_code) {
         _wait_error = error_code;
         _has_wait_error.store(true, butil::memory_order_release);
         bthread_id_unlock_and_destroy(_wait_id);
+        _first_batch_event.signal();
     }
 }
 
@@ -222,6 +268,14 @@ int NamingServiceThread::Actions::WaitForFirstBatchOfServers() {
     return _wait_error;
 }
 
+int NamingServiceThread::Actions::TimedWaitForFirstBatchOfServers(
+    const timespec& abstime) {
+    if (_has_wait_error.load(butil::memory_order_acquire)) {
+        return 0;
+    }
+    return _first_batch_event.timed_wait(abstime);
+}
+
 NamingServiceThread::NamingServiceThread()
     : _tid(0)
     , _ns(NULL)
@@ -295,6 +349,9 @@ int NamingServiceThread::Start(NamingService* naming_service,
             return -1;
         }
     }
+    if (!_options.wait_for_first_batch) {
+        return 0;
+    }
     return WaitForFirstBatchOfServers();
 }
 
@@ -314,6 +371,15 @@ int NamingServiceThread::WaitForFirstBatchOfServers() {
     return 0;
 }
 
+int NamingServiceThread::TimedWaitForFirstBatchOfServers(int64_t deadline_us) {
+    if (deadline_us < 0) {
+        _actions.WaitForFirstBatchOfServers();
+        return 0;
+    }
+    return _actions.TimedWaitForFirstBatchOfServers(
+        butil::microseconds_to_timespec(deadline_us)) == 0 ? 0 : -1;
+}
+
 void NamingServiceThread::ServerNodeWithId2ServerId(
     const std::vector<ServerNodeWithId>& src,
     std::vector<ServerId>* dst, const NamingServiceFilter* filter) {
@@ -474,7 +540,7 @@ int GetNamingServiceThread(
             g_nsthread_map->erase(key);
             return -1;
         }
-    } else {
+    } else if (options == NULL || options->wait_for_first_batch) {
         if (nsthread->WaitForFirstBatchOfServers() != 0) {
             return -1;
         }
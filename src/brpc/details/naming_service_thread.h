@@ -22,6 +22,7 @@
 #include <string>
 #include "butil/intrusive_ptr.hpp"               // butil::intrusive_ptr
 #include "bthread/bthread.h"                    // bthread_t
+#include "bthread/countdown_event.h"            // bthread::CountdownEvent
 #include "brpc/server_id.h"                     // ServerId
 #include "brpc/shared_object.h"                 // SharedObject
 #include "brpc/naming_service.h"                // NamingService
@@ -44,12 +45,19 @@ public:
 struct GetNamingServiceThreadOptions {
     GetNamingServiceThreadOptions()
         : succeed_without_server(false)
-        , log_succeed_without_server(true) {}
+        , log_succeed_without_server(true)
+        , wait_for_first_batch(true)
+        , use_rdma(false) {}
     
     bool succeed_without_server;
     bool log_succeed_without_server;
+    // If false, GetNamingServiceThread() returns without waiting for the
+    // first batch of servers, call TimedWaitForFirstBatchOfServers() later.
+    bool wait_for_first_batch;
     ChannelSignature channel_signature;
     std::shared_ptr<SocketSSLContext> ssl_ctx;
+    std::shared_ptr<const SocketTuningOptions> tuning_options;
+    bool use_rdma;
 };
 
 // A dedicated thread to map a name to ServerIds
@@ -70,13 +78,18 @@ class NamingServiceThread : public SharedObject, public Describable {
         void RemoveServers(const std::vector<ServerNode>& servers);
         void ResetServers(const std::vector<ServerNode>& servers);
         int WaitForFirstBatchOfServers();
+        // Returns 0 if the first batch of servers arrived before `abstime'.
+        int TimedWaitForFirstBatchOfServers(const timespec& abstime);
         void EndWait(int error_code);
 
     private:
+        void ApplyChanges();
+
         NamingServiceThread* _owner;
         bthread_id_t _wait_id;
         butil::atomic<bool> _has_wait_error;
         int _wait_error;
+        bthread::CountdownEvent _first_batch_event;
         std::vector<ServerNode> _last_servers;
         std::vector<ServerNode> _servers;
         std::vector<ServerNode> _added;
@@ -95,6 +108,10 @@ public:
               const std::string& service_name,
               const GetNamingServiceThreadOptions* options);
     int WaitForFirstBatchOfServers();
+    // Wait for the first batch of servers until `deadline_us' (since the
+    // Epoch, negative for waiting indefinitely). Returns 0 if the batch
+    // arrived (even if it's empty), -1 on timeout.
+    int TimedWaitForFirstBatchOfServers(int64_t deadline_us);
 
     int AddWatcher(NamingServiceWatcher* w, const NamingServiceFilter* f);
     int AddWatcher(NamingServiceWatcher* w) { return AddWatcher(w, NULL); }
@@ -128,7 +145,8 @@ std::ostream& operator<<(std::ostream& os, const NamingServiceThread&);
 // If the url is not accessed before, this function blocks until the
 // NamingService returns the first batch of servers. If no servers are
 // available, unless `options->succeed_without_server' is on, this function
-// returns -1.
+// returns -1. The waiting is skipped if `options->wait_for_first_batch' is
+// false.
 // Returns 0 on success, -1 otherwise.
 int GetNamingServiceThread(butil::intrusive_ptr<NamingServiceThread>* ns_thread,
                            const char* url,
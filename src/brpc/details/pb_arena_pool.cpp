@@ -0,0 +1,111 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdlib.h>                         // malloc
+#include <gflags/gflags.h>
+#include <google/protobuf/stubs/common.h>   // GOOGLE_PROTOBUF_VERSION
+#include <google/protobuf/message.h>        // Message
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+#include <google/protobuf/arena.h>
+#endif
+#include "butil/object_pool.h"
+#include "brpc/details/pb_arena_pool.h"
+
+namespace brpc {
+
+DEFINE_int32(pb_arena_initial_block_size, 8192,
+             "Bytes of the initial block of each pooled protobuf arena, "
+             "which is kept when the arena is reused");
+
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+struct PooledArena {
+    char* initial_block;
+    google::protobuf::Arena* arena;
+
+    PooledArena() : initial_block(NULL), arena(NULL) {
+        google::protobuf::ArenaOptions opt;
+        if (FLAGS_pb_arena_initial_block_size > 0) {
+            initial_block = (char*)malloc(FLAGS_pb_arena_initial_block_size);
+        }
+        if (initial_block) {
+            opt.initial_block = initial_block;
+            opt.initial_block_size = FLAGS_pb_arena_initial_block_size;
+        }
+        arena = new (std::nothrow) google::protobuf::Arena(opt);
+    }
+
+    ~PooledArena() {
+        // The arena may still use the initial block while being destroyed.
+        delete arena;
+        free(initial_block);
+    }
+};
+#else
+struct PooledArena {
+    google::protobuf::Arena* arena;
+};
+#endif
+
+} // namespace brpc
+
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+namespace butil {
+template <> struct ObjectPoolValidator<brpc::PooledArena> {
+    static bool validate(const brpc::PooledArena* a) {
+        return a->arena != NULL;
+    }
+};
+// Arenas are not touched after being returned.
+template <> struct ObjectPoolAllowTrim<brpc::PooledArena> {
+    static const bool value = true;
+};
+}  // namespace butil
+#endif
+
+namespace brpc {
+
+PooledArena* GetPooledArena() {
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+    return butil::get_object<PooledArena>();
+#else
+    return NULL;
+#endif
+}
+
+void ReturnPooledArena(PooledArena* a) {
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+    a->arena->Reset();
+    butil::return_object(a);
+#endif
+}
+
+google::protobuf::Arena* ArenaOf(PooledArena* a) {
+    return a->arena;
+}
+
+google::protobuf::Message* NewMessage(const google::protobuf::Message& prototype,
+                                      google::protobuf::Arena* arena) {
+#if GOOGLE_PROTOBUF_VERSION >= 3000000
+    if (arena) {
+        return prototype.New(arena);
+    }
+#endif
+    return prototype.New();
+}
+
+} // namespace brpc
@@ -0,0 +1,55 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_DETAILS_PB_ARENA_POOL_H
+#define BRPC_DETAILS_PB_ARENA_POOL_H
+
+namespace google {
+namespace protobuf {
+class Arena;
+class Message;
+}  // namespace protobuf
+}  // namespace google
+
+namespace brpc {
+
+// Arenas of protobuf are recycled through butil::ObjectPool so that each
+// worker reuses arenas returned recently, along with their initial blocks
+// (sized by -pb_arena_initial_block_size), instead of allocating memory
+// for every message of every request.
+struct PooledArena;
+
+// Returns NULL if arenas are not supported by protobuf of this build
+// (older than 3.0) or memory is exhausted.
+PooledArena* GetPooledArena();
+
+// Destroy messages allocated on `a', free blocks other than the initial
+// one and return `a' to the pool.
+void ReturnPooledArena(PooledArena* a);
+
+google::protobuf::Arena* ArenaOf(PooledArena* a);
+
+// Create a message of the type of `prototype' on `arena', or on heap when
+// `arena' is NULL.
+google::protobuf::Message* NewMessage(const google::protobuf::Message& prototype,
+                                      google::protobuf::Arena* arena);
+
+} // namespace brpc
+
+
+#endif // BRPC_DETAILS_PB_ARENA_POOL_H
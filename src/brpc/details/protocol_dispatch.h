@@ -0,0 +1,92 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_DETAILS_PROTOCOL_DISPATCH_H
+#define BRPC_DETAILS_PROTOCOL_DISPATCH_H
+
+#include "brpc/protocol.h"
+#ifdef BRPC_INLINE_BAIDU_STD
+#include "brpc/policy/baidu_rpc_protocol.h"
+#endif
+
+namespace brpc {
+
+// Call functions of protocols on the per-message path.
+// BRPC_INLINE_BAIDU_STD is defined by the build when baidu_std is the only
+// selected protocol(besides streaming_rpc riding on it). Then functions
+// of baidu_std are called directly after comparing the pointers, so that
+// they can be inlined with LTO and other functions are still called
+// through the pointers. Otherwise these are just indirect calls.
+
+inline ParseResult DispatchParse(Protocol::Parse parse, butil::IOBuf* source,
+                                 Socket* socket, bool read_eof,
+                                 const void* arg) {
+#ifdef BRPC_INLINE_BAIDU_STD
+    if (parse == policy::ParseRpcMessage) {
+        return policy::ParseRpcMessage(source, socket, read_eof, arg);
+    }
+#endif
+    return parse(source, socket, read_eof, arg);
+}
+
+inline void DispatchProcess(void (*process)(InputMessageBase*),
+                            InputMessageBase* msg) {
+#ifdef BRPC_INLINE_BAIDU_STD
+    if (process == policy::ProcessRpcRequest) {
+        return policy::ProcessRpcRequest(msg);
+    } else if (process == policy::ProcessRpcResponse) {
+        return policy::ProcessRpcResponse(msg);
+    }
+#endif
+    process(msg);
+}
+
+inline void DispatchSerializeRequest(Protocol::SerializeRequest serialize,
+                                     butil::IOBuf* request_buf,
+                                     Controller* cntl,
+                                     const google::protobuf::Message* request) {
+#ifdef BRPC_INLINE_BAIDU_STD
+    if (serialize == policy::SerializeRpcRequest) {
+        return policy::SerializeRpcRequest(request_buf, cntl, request);
+    }
+#endif
+    serialize(request_buf, cntl, request);
+}
+
+inline void DispatchPackRequest(Protocol::PackRequest pack,
+                                butil::IOBuf* iobuf_out,
+                                SocketMessage** user_message_out,
+                                uint64_t correlation_id,
+                                const google::protobuf::MethodDescriptor* method,
+                                Controller* controller,
+                                const butil::IOBuf& request_buf,
+                                const Authenticator* auth) {
+#ifdef BRPC_INLINE_BAIDU_STD
+    if (pack == policy::PackRpcRequest) {
+        return policy::PackRpcRequest(iobuf_out, user_message_out,
+                                      correlation_id, method, controller,
+                                      request_buf, auth);
+    }
+#endif
+    pack(iobuf_out, user_message_out, correlation_id, method, controller,
+         request_buf, auth);
+}
+
+} // namespace brpc
+
+#endif // BRPC_DETAILS_PROTOCOL_DISPATCH_H
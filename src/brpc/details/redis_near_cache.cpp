@@ -0,0 +1,220 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdio.h>
+#include <functional>                          // std::hash
+#include <set>
+#include "bvar/bvar.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/socket.h"
+#include "brpc/redis_reply.h"
+#include "brpc/details/redis_near_cache.h"
+
+
+namespace brpc {
+
+static double GetRedisNearCacheHitRatio(void*);
+
+struct RedisNearCacheBvars {
+    bvar::Adder<int64_t> hit_count;
+    bvar::Adder<int64_t> miss_count;
+    bvar::Adder<int64_t> invalidation_count;
+    bvar::PassiveStatus<double> hit_ratio;
+
+    RedisNearCacheBvars()
+        : hit_count("rpc_redis_near_cache_hit_count")
+        , miss_count("rpc_redis_near_cache_miss_count")
+        , invalidation_count("rpc_redis_near_cache_invalidation_count")
+        , hit_ratio("rpc_redis_near_cache_hit_ratio",
+                    GetRedisNearCacheHitRatio, this) {
+    }
+};
+
+inline RedisNearCacheBvars* get_redis_near_cache_bvars() {
+    return butil::get_leaky_singleton<RedisNearCacheBvars>();
+}
+
+static double GetRedisNearCacheHitRatio(void* arg) {
+    RedisNearCacheBvars* bvars = static_cast<RedisNearCacheBvars*>(arg);
+    const int64_t nhit = bvars->hit_count.get_value();
+    const int64_t ntotal = nhit + bvars->miss_count.get_value();
+    return ntotal > 0 ? (double)nhit / ntotal : 0;
+}
+
+// Invalidations are read by the parsing code of redis without knowing
+// which cache the connection belongs to, they're applied to all caches.
+// Invalidating a key not read through the connection is just a miss later.
+struct RedisNearCacheRegistry {
+    butil::Mutex mutex;
+    std::set<RedisNearCache*> caches;
+};
+
+inline RedisNearCacheRegistry* get_redis_near_cache_registry() {
+    return butil::get_leaky_singleton<RedisNearCacheRegistry>();
+}
+
+static butil::ShardedCacheOptions MakeCacheOptions(size_t max_bytes,
+                                                   size_t nshard) {
+    butil::ShardedCacheOptions options;
+    options.max_bytes = max_bytes;
+    options.nshard = nshard;
+    return options;
+}
+
+RedisNearCache::RedisNearCache(size_t max_bytes, size_t nshard)
+    : _cache(MakeCacheOptions(max_bytes, nshard))
+    , _conn_stamp(-1)
+    , _flush_version(0) {
+    for (size_t i = 0; i < NVERSION; ++i) {
+        _key_versions[i].store(0, butil::memory_order_relaxed);
+    }
+    // Create bvars before any call.
+    get_redis_near_cache_bvars();
+    RedisNearCacheRegistry* r = get_redis_near_cache_registry();
+    BAIDU_SCOPED_LOCK(r->mutex);
+    r->caches.insert(this);
+}
+
+RedisNearCache::~RedisNearCache() {
+    RedisNearCacheRegistry* r = get_redis_near_cache_registry();
+    BAIDU_SCOPED_LOCK(r->mutex);
+    r->caches.erase(this);
+}
+
+int64_t RedisNearCache::GetConnStamp(SocketId server_id) {
+    SocketUniquePtr ptr;
+    if (server_id == INVALID_SOCKET_ID ||
+        Socket::Address(server_id, &ptr) != 0 || ptr->fd() < 0) {
+        return -1;
+    }
+    return ptr->reset_fd_real_us();
+}
+
+butil::atomic<uint64_t>& RedisNearCache::key_version(const std::string& key) {
+    return _key_versions[std::hash<std::string>()(key) % NVERSION];
+}
+
+bool RedisNearCache::CheckConnStamp(int64_t stamp) {
+    int64_t cur = _conn_stamp.load(butil::memory_order_acquire);
+    if (cur == stamp) {
+        return stamp >= 0;
+    }
+    if (_conn_stamp.compare_exchange_strong(cur, stamp)) {
+        // Invalidations of the former connection might be lost.
+        InvalidateAll();
+    }
+    return false;
+}
+
+bool RedisNearCache::Lookup(SocketId server_id, const std::string& key,
+                            butil::IOBuf* reply) {
+    if (CheckConnStamp(GetConnStamp(server_id)) && _cache.Get(key, reply)) {
+        get_redis_near_cache_bvars()->hit_count << 1;
+        return true;
+    }
+    get_redis_near_cache_bvars()->miss_count << 1;
+    return false;
+}
+
+void RedisNearCache::TakeSnapshot(SocketId server_id, const std::string& key,
+                                  Snapshot* snapshot) {
+    snapshot->conn_stamp = GetConnStamp(server_id);
+    snapshot->key_version = key_version(key).load(butil::memory_order_acquire);
+    snapshot->flush_version = _flush_version.load(butil::memory_order_acquire);
+}
+
+void RedisNearCache::Insert(SocketId server_id, const std::string& key,
+                            const Snapshot& snapshot, const RedisReply& reply) {
+    butil::IOBuf buf;
+    if (reply.is_nil()) {
+        buf.append("$-1\r\n");
+    } else if (reply.is_string()) {
+        const butil::StringPiece data = reply.data();
+        char header[32];
+        const int len = snprintf(header, sizeof(header), "$%lu\r\n",
+                                 (unsigned long)data.size());
+        buf.append(header, len);
+        buf.append(data.data(), data.size());
+        buf.append("\r\n", 2);
+    } else {
+        return;
+    }
+    if (snapshot.conn_stamp < 0 ||
+        GetConnStamp(server_id) != snapshot.conn_stamp ||
+        !CheckConnStamp(snapshot.conn_stamp)) {
+        return;
+    }
+    butil::atomic<uint64_t>& version = key_version(key);
+    if (version.load(butil::memory_order_acquire) != snapshot.key_version ||
+        _flush_version.load(butil::memory_order_acquire) !=
+        snapshot.flush_version) {
+        return;
+    }
+    _cache.Put(key, buf);
+    // An invalidation bumps the version before erasing the key. If it was
+    // not seen here, its erasure happens after the put.
+    if (version.load(butil::memory_order_seq_cst) != snapshot.key_version ||
+        _flush_version.load(butil::memory_order_seq_cst) !=
+        snapshot.flush_version) {
+        _cache.Erase(key);
+    }
+}
+
+void RedisNearCache::Invalidate(const std::string& key) {
+    key_version(key).fetch_add(1, butil::memory_order_seq_cst);
+    _cache.Erase(key);
+}
+
+void RedisNearCache::InvalidateAll() {
+    _flush_version.fetch_add(1, butil::memory_order_seq_cst);
+    _cache.Clear();
+}
+
+void InvalidateRedisNearCaches(const RedisReply& push) {
+    if (push.size() < 2 || !push[0].is_string() ||
+        push[0].data() != "invalidate") {
+        return;
+    }
+    const RedisReply& keys = push[1];
+    RedisNearCacheRegistry* r = get_redis_near_cache_registry();
+    BAIDU_SCOPED_LOCK(r->mutex);
+    if (r->caches.empty()) {
+        return;
+    }
+    get_redis_near_cache_bvars()->invalidation_count << 1;
+    std::set<RedisNearCache*>::iterator it;
+    if (keys.is_nil()) {
+        // Sent on FLUSHALL/FLUSHDB or when the server evicts tracked keys.
+        for (it = r->caches.begin(); it != r->caches.end(); ++it) {
+            (*it)->InvalidateAll();
+        }
+        return;
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (!keys[i].is_string()) {
+            continue;
+        }
+        const std::string key = keys[i].data().as_string();
+        for (it = r->caches.begin(); it != r->caches.end(); ++it) {
+            (*it)->Invalidate(key);
+        }
+    }
+}
+
+} // namespace brpc
@@ -0,0 +1,96 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_DETAILS_REDIS_NEAR_CACHE_H
+#define BRPC_DETAILS_REDIS_NEAR_CACHE_H
+
+#include <string>
+#include "butil/atomicops.h"
+#include "butil/iobuf.h"
+#include "butil/containers/sharded_cache.h"   // butil::ShardedCache
+#include "brpc/socket_id.h"                   // SocketId
+
+namespace brpc {
+
+class RedisReply;
+
+// Values of keys read from one redis-server, kept valid by invalidations
+// pushed by the server(CLIENT TRACKING of RESP3) on the connection which
+// read the keys. Values are serialized replies.
+// Invalidations racing with reads are handled by versions: a reader takes
+// a Snapshot() before sending GET and the value is inserted only if no
+// invalidation of the key(or flush) happened since then. Since the server
+// forgets what a connection tracked when the connection breaks, values are
+// also stamped with the time when the fd of the connection was reset, and
+// all values are dropped once the stamp changes.
+class RedisNearCache {
+public:
+    struct Snapshot {
+        int64_t conn_stamp;
+        uint64_t key_version;
+        uint64_t flush_version;
+    };
+
+    RedisNearCache(size_t max_bytes, size_t nshard);
+    ~RedisNearCache();
+
+    // Copy the cached reply of `key' into `reply' if the connection
+    // identified by `server_id' was not reset since the reply was cached.
+    bool Lookup(SocketId server_id, const std::string& key,
+                butil::IOBuf* reply);
+
+    // Versions of `key' before reading it through `server_id'.
+    void TakeSnapshot(SocketId server_id, const std::string& key,
+                      Snapshot* snapshot);
+
+    // Cache `reply' of `key' read after `snapshot' was taken, if neither
+    // the key nor the connection changed in between. Only strings and nils
+    // are cached.
+    void Insert(SocketId server_id, const std::string& key,
+                const Snapshot& snapshot, const RedisReply& reply);
+
+    void Invalidate(const std::string& key);
+    void InvalidateAll();
+
+    size_t bytes() const { return _cache.bytes(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RedisNearCache);
+
+    static const size_t NVERSION = 1024;
+
+    // Time when the fd of the connection was reset, -1 if it's not usable.
+    static int64_t GetConnStamp(SocketId server_id);
+    butil::atomic<uint64_t>& key_version(const std::string& key);
+    // Drop all values if `stamp' differs from the stamp of cached values.
+    // Returns true if values stamped with `stamp' are usable.
+    bool CheckConnStamp(int64_t stamp);
+
+    butil::ShardedCache<std::string, butil::IOBuf> _cache;
+    butil::atomic<int64_t> _conn_stamp;
+    butil::atomic<uint64_t> _flush_version;
+    butil::atomic<uint64_t> _key_versions[NVERSION];
+};
+
+// Apply the invalidation message `push'(["invalidate", [keys] or nil]) to
+// all near caches. Other push messages are ignored.
+void InvalidateRedisNearCaches(const RedisReply& push);
+
+} // namespace brpc
+
+#endif // BRPC_DETAILS_REDIS_NEAR_CACHE_H
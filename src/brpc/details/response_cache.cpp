@@ -0,0 +1,201 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>                         // std::max
+#include <google/protobuf/descriptor.h>      // MethodDescriptor
+#include "bvar/bvar.h"
+#include "butil/time.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "brpc/details/response_cache.h"
+
+
+namespace brpc {
+
+static double GetResponseCacheHitRatio(void*);
+
+struct ResponseCacheBvars {
+    bvar::Adder<int64_t> hit_count;
+    bvar::Adder<int64_t> stale_hit_count;
+    bvar::Adder<int64_t> miss_count;
+    bvar::PassiveStatus<double> hit_ratio;
+
+    ResponseCacheBvars()
+        : hit_count("rpc_channel_response_cache_hit_count")
+        , stale_hit_count("rpc_channel_response_cache_stale_hit_count")
+        , miss_count("rpc_channel_response_cache_miss_count")
+        , hit_ratio("rpc_channel_response_cache_hit_ratio",
+                    GetResponseCacheHitRatio, this) {
+    }
+};
+
+inline ResponseCacheBvars* get_response_cache_bvars() {
+    return butil::get_leaky_singleton<ResponseCacheBvars>();
+}
+
+// Stale hits are counted in hits as well.
+static double GetResponseCacheHitRatio(void* arg) {
+    ResponseCacheBvars* bvars = static_cast<ResponseCacheBvars*>(arg);
+    const int64_t nhit = bvars->hit_count.get_value();
+    const int64_t ntotal = nhit + bvars->miss_count.get_value();
+    return ntotal > 0 ? (double)nhit / ntotal : 0;
+}
+
+class CachedResponseDone : public google::protobuf::Closure {
+public:
+    CachedResponseDone(ResponseCache* cache, const std::string& key,
+                       const ResponseCachePolicy& policy,
+                       const Controller* cntl,
+                       google::protobuf::Closure* done)
+        : _cache(cache), _key(key), _policy(policy)
+        , _cntl(cntl), _done(done) {}
+
+    void Run() override {
+        _cache->Fill(_key, _policy, _cntl);
+        google::protobuf::Closure* done = _done;
+        delete this;
+        done->Run();
+    }
+
+private:
+    // Referenced since the channel may be destroyed before the call ends.
+    butil::intrusive_ptr<ResponseCache> _cache;
+    std::string _key;
+    ResponseCachePolicy _policy;
+    const Controller* _cntl;
+    google::protobuf::Closure* _done;
+};
+
+static butil::ShardedCacheOptions ToShardedCacheOptions(
+    const ResponseCacheOptions& options) {
+    butil::ShardedCacheOptions sharded_options;
+    sharded_options.nshard = std::max(options.nshard, 1);
+    sharded_options.max_bytes = options.max_bytes;
+    return sharded_options;
+}
+
+ResponseCache::ResponseCache(const ResponseCacheOptions& options)
+    : _options(options)
+    , _entries(ToShardedCacheOptions(options)) {
+}
+
+ResponseCache::~ResponseCache() {
+}
+
+const ResponseCachePolicy* ResponseCache::GetPolicy(
+    const google::protobuf::MethodDescriptor* method) const {
+    if (method == NULL) {
+        return NULL;
+    }
+    const ResponseCachePolicy* policy = &_options.default_policy;
+    std::map<std::string, ResponseCachePolicy>::const_iterator it =
+        _options.method_policies.find(method->full_name());
+    if (it != _options.method_policies.end()) {
+        policy = &it->second;
+    }
+    return policy->ttl_ms > 0 ? policy : NULL;
+}
+
+struct ResponseCache::LookupVisitor {
+    LookupVisitor(Response* response, int64_t now)
+        : response(response), now(now), refresh(false) {}
+    void operator()(Entry* e) {
+        *response = e->response;
+        if (now >= e->fresh_until_us && !e->refreshing) {
+            e->refreshing = true;
+            refresh = true;
+        }
+    }
+    Response* response;
+    int64_t now;
+    bool refresh;
+};
+
+struct ResponseCache::UnrefreshVisitor {
+    void operator()(Entry* e) const { e->refreshing = false; }
+};
+
+ResponseCache::LookupResult ResponseCache::Lookup(
+    const std::string& key, Response* response) {
+    LookupVisitor visitor(response, butil::monotonic_time_us());
+    LookupResult result = CACHE_MISS;
+    if (_entries.Visit(key, visitor)) {
+        result = (visitor.refresh ? CACHE_HIT_AND_REFRESH : CACHE_HIT);
+    }
+    ResponseCacheBvars* bvars = get_response_cache_bvars();
+    if (result == CACHE_MISS) {
+        bvars->miss_count << 1;
+    } else {
+        bvars->hit_count << 1;
+        if (result == CACHE_HIT_AND_REFRESH) {
+            bvars->stale_hit_count << 1;
+        }
+    }
+    return result;
+}
+
+void ResponseCache::Insert(const std::string& key,
+                           const ResponseCachePolicy& policy,
+                           const Response& response) {
+    if (_options.max_bytes == 0) {
+        // Nothing fits.
+        return;
+    }
+    Entry e;
+    e.response = response;
+    e.fresh_until_us = butil::monotonic_time_us() + policy.ttl_ms * 1000L;
+    e.refreshing = false;
+    // Stale entries are still returned until they expire.
+    _entries.Put(key, e, policy.ttl_ms +
+                 std::max(policy.stale_while_revalidate_ms, 0));
+}
+
+void ResponseCache::Unrefresh(const std::string& key) {
+    UnrefreshVisitor visitor;
+    _entries.Visit(key, visitor);
+}
+
+void ResponseCache::Fill(const std::string& key,
+                         const ResponseCachePolicy& policy,
+                         const Controller* cntl) {
+    if (cntl->Failed()) {
+        return Unrefresh(key);
+    }
+    Response response;
+    {
+        butil::IOBufAsZeroCopyOutputStream wrapper(&response.body);
+        if (!cntl->response()->SerializeToZeroCopyStream(&wrapper)) {
+            LOG(WARNING) << "Fail to serialize response of "
+                         << cntl->response()->GetDescriptor()->full_name();
+            return Unrefresh(key);
+        }
+    }
+    response.attachment = cntl->response_attachment();
+    Insert(key, policy, response);
+}
+
+google::protobuf::Closure* ResponseCache::WrapDone(
+    const std::string& key, const ResponseCachePolicy& policy,
+    const Controller* cntl, google::protobuf::Closure* done) {
+    return new CachedResponseDone(this, key, policy, cntl, done);
+}
+
+size_t ResponseCache::cached_bytes() const {
+    return _entries.bytes();
+}
+
+} // namespace brpc
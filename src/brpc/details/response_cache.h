@@ -0,0 +1,120 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RESPONSE_CACHE_H
+#define BRPC_RESPONSE_CACHE_H
+
+#include <string>
+#include <google/protobuf/stubs/callback.h>   // google::protobuf::Closure
+#include "butil/iobuf.h"
+#include "butil/containers/sharded_cache.h"   // butil::ShardedCache
+#include "brpc/shared_object.h"               // SharedObject
+#include "brpc/response_cache_options.h"      // ResponseCacheOptions
+#include "brpc/controller.h"                  // Controller
+
+
+namespace brpc {
+
+// Serialized responses cached in memory, keyed by method and serialized
+// request. Used by Channel (same keys as CallCoalescer) and Server.
+class ResponseCache : public SharedObject {
+public:
+    enum LookupResult {
+        CACHE_MISS,
+        CACHE_HIT,
+        // The response is stale and caller should refresh the cache.
+        CACHE_HIT_AND_REFRESH,
+    };
+
+    struct Response {
+        Response() : compress_type(0) {}
+        butil::IOBuf body;
+        butil::IOBuf attachment;
+        // How `body' was serialized, set by servers only.
+        int compress_type;
+        std::string content_type;
+    };
+
+    explicit ResponseCache(const ResponseCacheOptions& options);
+    ~ResponseCache();
+
+    // Returns policy of `method', NULL if responses of the method are not
+    // cached.
+    const ResponseCachePolicy* GetPolicy(
+        const google::protobuf::MethodDescriptor* method) const;
+
+    // Copy the cached response of `key' into `response'.
+    // Only one of the callers seeing a stale response gets
+    // CACHE_HIT_AND_REFRESH until the cache is filled or Unrefresh()-ed.
+    LookupResult Lookup(const std::string& key, Response* response);
+
+    // Cache `response' of `key' according to `policy'.
+    void Insert(const std::string& key, const ResponseCachePolicy& policy,
+                const Response& response);
+
+    // Let a later caller seeing the stale response of `key' refresh again.
+    void Unrefresh(const std::string& key);
+
+    // Cache the response of `cntl' if it succeeded, which is called when
+    // the call sent for `key' ends.
+    void Fill(const std::string& key, const ResponseCachePolicy& policy,
+              const Controller* cntl);
+
+    // Returns a closure calling Fill(key, policy, cntl) and then `done',
+    // for asynchronous calls.
+    google::protobuf::Closure* WrapDone(const std::string& key,
+                                        const ResponseCachePolicy& policy,
+                                        const Controller* cntl,
+                                        google::protobuf::Closure* done);
+
+    // Bytes of all cached entries.
+    size_t cached_bytes() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ResponseCache);
+
+    // Entries expire after stale_while_revalidate_ms since being stale.
+    struct Entry {
+        Entry() : fresh_until_us(0), refreshing(false) {}
+        Response response;
+        int64_t fresh_until_us;
+        bool refreshing;
+    };
+
+    struct EntrySizeOf {
+        size_t operator()(const std::string& key) const { return key.size(); }
+        size_t operator()(const Entry& e) const {
+            return e.response.body.size() + e.response.attachment.size() +
+                e.response.content_type.size();
+        }
+    };
+
+    typedef butil::ShardedCache<std::string, Entry,
+                                std::hash<std::string>, EntrySizeOf> EntryCache;
+
+    struct LookupVisitor;
+    struct UnrefreshVisitor;
+
+    ResponseCacheOptions _options;
+    EntryCache _entries;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_RESPONSE_CACHE_H
@@ -0,0 +1,104 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>                              // std::max
+#include "butil/time.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "bvar/bvar.h"
+#include "brpc/details/retry_budget.h"
+
+
+namespace brpc {
+
+static const int64_t MILLI_TOKENS_PER_TOKEN = 1000;
+// Tokens accumulated in this many seconds of the minimum rate can be used
+// in a burst, but no less than MIN_BURST_TOKENS.
+static const int64_t BURST_SECONDS = 10;
+static const int64_t MIN_BURST_TOKENS = 100;
+
+struct RetryBudgetBvars {
+    bvar::Adder<int64_t> retry_count;
+    bvar::Adder<int64_t> denied_count;
+
+    RetryBudgetBvars()
+        : retry_count("rpc_retry_budget_retry_count")
+        , denied_count("rpc_retry_budget_denied_count") {}
+};
+
+inline RetryBudgetBvars* get_retry_budget_bvars() {
+    return butil::get_leaky_singleton<RetryBudgetBvars>();
+}
+
+RetryBudget::RetryBudget(double ratio, int32_t min_retries_per_second)
+    : _deposit_milli_tokens(std::max<int64_t>(
+            0, (int64_t)(ratio * MILLI_TOKENS_PER_TOKEN)))
+    , _refill_milli_tokens_per_second(std::max<int64_t>(
+            0, (int64_t)min_retries_per_second * MILLI_TOKENS_PER_TOKEN))
+    , _max_milli_tokens(std::max(
+            _refill_milli_tokens_per_second * BURST_SECONDS,
+            MIN_BURST_TOKENS * MILLI_TOKENS_PER_TOKEN))
+    , _milli_tokens(_max_milli_tokens)
+    , _last_refill_us(butil::cpuwide_time_us()) {
+}
+
+void RetryBudget::AddTokens(int64_t milli_tokens) {
+    int64_t tokens = _milli_tokens.load(butil::memory_order_relaxed);
+    while (tokens < _max_milli_tokens) {
+        const int64_t new_tokens =
+            std::min(tokens + milli_tokens, _max_milli_tokens);
+        if (_milli_tokens.compare_exchange_weak(
+                tokens, new_tokens, butil::memory_order_relaxed)) {
+            return;
+        }
+    }
+}
+
+void RetryBudget::OnCall() {
+    if (_deposit_milli_tokens > 0) {
+        AddTokens(_deposit_milli_tokens);
+    }
+}
+
+void RetryBudget::Refill(int64_t now_us) {
+    int64_t last_us = _last_refill_us.load(butil::memory_order_relaxed);
+    const int64_t milli_tokens =
+        (now_us - last_us) * _refill_milli_tokens_per_second / 1000000L;
+    // Only one thread adds tokens of the elapsed time.
+    if (milli_tokens > 0 &&
+        _last_refill_us.compare_exchange_strong(
+            last_us, now_us, butil::memory_order_relaxed)) {
+        AddTokens(milli_tokens);
+    }
+}
+
+bool RetryBudget::TryRetry() {
+    Refill(butil::cpuwide_time_us());
+    int64_t tokens = _milli_tokens.load(butil::memory_order_relaxed);
+    while (tokens >= MILLI_TOKENS_PER_TOKEN) {
+        if (_milli_tokens.compare_exchange_weak(
+                tokens, tokens - MILLI_TOKENS_PER_TOKEN,
+                butil::memory_order_relaxed)) {
+            get_retry_budget_bvars()->retry_count << 1;
+            return true;
+        }
+    }
+    get_retry_budget_bvars()->denied_count << 1;
+    return false;
+}
+
+} // namespace brpc
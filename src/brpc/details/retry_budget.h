@@ -0,0 +1,62 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RETRY_BUDGET_H
+#define BRPC_RETRY_BUDGET_H
+
+#include <stdint.h>
+#include "butil/macros.h"                     // DISALLOW_COPY_AND_ASSIGN
+#include "butil/atomicops.h"                   // butil::atomic
+#include "brpc/shared_object.h"                // SharedObject
+
+
+namespace brpc {
+
+// A token bucket limiting retries of a Channel. Each call deposits `ratio'
+// of a token and the bucket is refilled with `min_retries_per_second' tokens
+// per second, each retry takes one token. So that retries are no more than
+// `ratio' of calls plus the minimum rate when servers are failing, instead
+// of multiplying calls by max_retry.
+class RetryBudget : public SharedObject {
+public:
+    RetryBudget(double ratio, int32_t min_retries_per_second);
+
+    // Called for each call.
+    void OnCall();
+
+    // Returns true and takes a token if a retry is allowed.
+    bool TryRetry();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RetryBudget);
+
+    void Refill(int64_t now_us);
+    void AddTokens(int64_t milli_tokens);
+
+    // Tokens are counted in 1/1000.
+    int64_t _deposit_milli_tokens;
+    int64_t _refill_milli_tokens_per_second;
+    int64_t _max_milli_tokens;
+    butil::atomic<int64_t> _milli_tokens;
+    butil::atomic<int64_t> _last_refill_us;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_RETRY_BUDGET_H
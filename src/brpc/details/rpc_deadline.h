@@ -0,0 +1,86 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RPC_DEADLINE_H
+#define BRPC_RPC_DEADLINE_H
+
+#include <stdint.h>
+#include <gflags/gflags_declare.h>
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "bthread/inline_local.h"
+#include "bthread/unstable.h"        // bthread_set_self_deadline
+
+
+namespace brpc {
+
+DECLARE_bool(rpc_deadline_scheduling);
+
+// Deadline (since the Epoch in microseconds) of the server-side RPC whose
+// user code is running in current bthread, -1 if there's none. RPCs issued
+// by the user code end before the deadline.
+class TlsRpcDeadline {
+public:
+    static int64_t get() {
+        void* v = Slot::get();
+        return v ? (int64_t)(intptr_t)v : -1;
+    }
+    static void set(int64_t deadline_us) {
+        Slot::set(deadline_us > 0 ? (void*)(intptr_t)deadline_us : NULL);
+    }
+
+private:
+    typedef bthread::InlineLocal<
+        void, bthread::INLINE_LOCAL_SLOT_RPC_DEADLINE> Slot;
+};
+
+// Set the deadline of current bthread during the scope of user code.
+// With -rpc_deadline_scheduling, the bthread is scheduled by the deadline
+// as well.
+class ScopedRpcDeadline {
+public:
+    explicit ScopedRpcDeadline(int64_t deadline_us)
+        : _saved_deadline_us(TlsRpcDeadline::get())
+        , _scheduling(FLAGS_rpc_deadline_scheduling) {
+        TlsRpcDeadline::set(deadline_us);
+        if (_scheduling) {
+            bthread_set_self_deadline(deadline_us);
+        }
+    }
+    ~ScopedRpcDeadline() {
+        TlsRpcDeadline::set(_saved_deadline_us);
+        if (_scheduling) {
+            bthread_set_self_deadline(_saved_deadline_us);
+        }
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedRpcDeadline);
+    int64_t _saved_deadline_us;
+    bool _scheduling;
+};
+
+// True if `deadline_us' is set and already reached.
+inline bool IsRpcDeadlineExpired(int64_t deadline_us) {
+    return deadline_us >= 0 && butil::gettimeofday_us() >= deadline_us;
+}
+
+} // namespace brpc
+
+
+#endif  // BRPC_RPC_DEADLINE_H
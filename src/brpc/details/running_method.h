@@ -0,0 +1,52 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RUNNING_METHOD_H
+#define BRPC_RUNNING_METHOD_H
+
+#include <google/protobuf/descriptor.h>
+#include "butil/macros.h"
+#include "bthread/inline_local.h"
+
+
+namespace brpc {
+
+// The method whose user code is running in current bthread, NULL if
+// there's none. Read by the continuous cpu profiler inside signal handlers.
+typedef bthread::InlineLocal<
+    const google::protobuf::MethodDescriptor,
+    bthread::INLINE_LOCAL_SLOT_RUNNING_METHOD> TlsRunningMethod;
+
+// Set the running method of current bthread during the scope of user code.
+class ScopedRunningMethod {
+public:
+    explicit ScopedRunningMethod(const google::protobuf::MethodDescriptor* m)
+        : _saved_method(TlsRunningMethod::get()) {
+        TlsRunningMethod::set(m);
+    }
+    ~ScopedRunningMethod() { TlsRunningMethod::set(_saved_method); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedRunningMethod);
+    const google::protobuf::MethodDescriptor* _saved_method;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_RUNNING_METHOD_H
@@ -22,6 +22,7 @@
 #include "brpc/server.h"
 #include "brpc/acceptor.h"
 #include "brpc/details/method_status.h"
+#include "brpc/details/controller_private_accessor.h"
 #include "brpc/builtin/bad_method_service.h"
 #include "brpc/restful.h"
 
@@ -56,6 +57,39 @@ public:
         }
     }
 
+    // Charge `nbytes' of the request in `c' to `status' and the server.
+    // Returns false if the method-level limit is reached. Reaching the
+    // server-level limit does not fail the request but makes the server
+    // stop reading sockets, see InputMessenger::LimitInflightBytes().
+    bool AddInflightBytes(Controller* c, MethodStatus* status, int64_t nbytes) {
+        if (status != NULL && status->max_inflight_bytes() > 0 &&
+            !status->AddInflightBytes(nbytes)) {
+            return false;
+        }
+        if (_server->options().max_inflight_request_bytes > 0) {
+            _server->_inflight_request_bytes.fetch_add(
+                nbytes, butil::memory_order_relaxed);
+        }
+        ControllerPrivateAccessor(c).set_inflight_request_bytes(nbytes);
+        return true;
+    }
+
+    void RemoveInflightBytes(Controller* c, MethodStatus* status) {
+        ControllerPrivateAccessor accessor(c);
+        const int64_t nbytes = accessor.inflight_request_bytes();
+        if (nbytes == 0) {
+            return;
+        }
+        if (status != NULL && status->max_inflight_bytes() > 0) {
+            status->RemoveInflightBytes(nbytes);
+        }
+        if (_server->options().max_inflight_request_bytes > 0) {
+            _server->_inflight_request_bytes.fetch_sub(
+                nbytes, butil::memory_order_relaxed);
+        }
+        accessor.set_inflight_request_bytes(0);
+    }
+
     // Find by MethodDescriptor::full_name
     const Server::MethodProperty*
     FindMethodPropertyByFullName(const butil::StringPiece &fullname) {
@@ -76,6 +110,15 @@ public:
         return _server->FindMethodPropertyByNameAndIndex(service_name, method_index);
     }
 
+    const Server::MethodProperty* FindMethodPropertyById(uint64_t method_id) const {
+        return _server->FindMethodPropertyById(method_id);
+    }
+    bool has_method_ids() const { return _server->has_method_ids(); }
+    bool has_progressive_read_methods() const
+    { return _server->has_progressive_read_methods(); }
+    bool has_nonblocking_methods() const
+    { return _server->has_nonblocking_methods(); }
+
     const Server::ServiceProperty*
     FindServicePropertyByFullName(const butil::StringPiece& fullname) const {
         return _server->FindServicePropertyByFullName(fullname);
@@ -100,6 +143,9 @@ public:
     RestfulMap* global_restful_map() const
     { return _server->_global_restful_map; }
 
+    // NULL if responses are not cached.
+    ResponseCache* response_cache() const { return _server->_response_cache; }
+
 private:
     const Server* _server;
 };
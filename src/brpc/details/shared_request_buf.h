@@ -0,0 +1,82 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_SHARED_REQUEST_BUF_H
+#define BRPC_SHARED_REQUEST_BUF_H
+
+#include "butil/iobuf.h"                       // butil::IOBuf
+#include "butil/macros.h"                      // DISALLOW_COPY_AND_ASSIGN
+#include "butil/synchronization/lock.h"        // butil::Mutex
+#include "brpc/shared_object.h"                // SharedObject
+#include "brpc/protocol.h"                     // Protocol::SerializeRequest
+
+
+namespace brpc {
+
+// The request serialized by one sub call of ParallelChannel/SelectiveChannel,
+// reused by other sub calls (including retries and backup requests of
+// SelectiveChannel) sending the same request with the same protocol and
+// compression. Copying IOBuf only references the blocks, so a large request
+// fanned out to N servers is serialized once instead of N times.
+class SharedRequestBuf : public SharedObject {
+public:
+    SharedRequestBuf()
+        : _request(NULL), _serialize(NULL), _compress_type(COMPRESS_TYPE_NONE) {}
+
+    // Put the serialized `request' into `buf' and return true if it was
+    // serialized by `serialize' with `compress_type'.
+    bool Get(const google::protobuf::Message* request,
+             Protocol::SerializeRequest serialize,
+             CompressType compress_type, butil::IOBuf* buf) const {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_serialize == NULL || _request != request ||
+            _serialize != serialize || _compress_type != compress_type) {
+            return false;
+        }
+        *buf = _buf;
+        return true;
+    }
+
+    // Remember the serialized `request'. Only the first one is kept since
+    // sub calls generally share the same protocol.
+    void Set(const google::protobuf::Message* request,
+             Protocol::SerializeRequest serialize,
+             CompressType compress_type, const butil::IOBuf& buf) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_serialize == NULL) {
+            _request = request;
+            _serialize = serialize;
+            _compress_type = compress_type;
+            _buf = buf;
+        }
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SharedRequestBuf);
+
+    mutable butil::Mutex _mutex;
+    const google::protobuf::Message* _request;
+    Protocol::SerializeRequest _serialize;
+    CompressType _compress_type;
+    butil::IOBuf _buf;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_SHARED_REQUEST_BUF_H
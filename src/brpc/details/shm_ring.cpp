@@ -0,0 +1,375 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <errno.h>
+#include <new>                                  // placement new
+#include <algorithm>                            // std::min
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "butil/build_config.h"
+#if defined(OS_LINUX)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+// Not defined by old glibc.
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_GET_SEALS (1024 + 10)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+#elif defined(OS_MACOSX)
+#include <sys/event.h>
+#endif
+#include "butil/atomicops.h"
+#include "butil/logging.h"
+#include "bthread/unstable.h"                   // bthread_fd_timedwait
+#include "brpc/details/shm_ring.h"
+
+namespace brpc {
+
+static const uint32_t SHM_RING_MAGIC = 0x53524e47;  // "SRNG"
+static const size_t SHM_RING_MIN_CAPACITY = 4096;
+#if defined(OS_LINUX)
+// The peer can't resize the memory under our mapping, which raises SIGBUS.
+static const int SHM_RING_SEALS = F_SEAL_SHRINK | F_SEAL_GROW;
+#endif
+
+// Layout of the head of the shared memory, followed by data of the ring.
+// Positions increase monotonically and are masked when indexing data.
+struct BAIDU_CACHELINE_ALIGNMENT ShmRingHeader {
+    uint32_t magic;
+    uint32_t capacity;
+    // Written by the producer.
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<uint64_t> write_pos;
+    butil::atomic<int> writer_waiting;
+    // Written by the consumer.
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<uint64_t> read_pos;
+    butil::atomic<int> reader_waiting;
+};
+
+static void Notify(int efd) {
+    const uint64_t one = 1;
+    // Fails with EAGAIN only when the counter is saturated, in which case
+    // the fd is readable anyway.
+    ssize_t rc = write(efd, &one, sizeof(one));
+    (void)rc;
+}
+
+// Returns true if the eventfd was signaled.
+static bool ClearNotification(int efd) {
+    uint64_t value = 0;
+    return read(efd, &value, sizeof(value)) == (ssize_t)sizeof(value);
+}
+
+ShmRing::ShmRing()
+    : _header(NULL)
+    , _data(NULL)
+    , _capacity(0)
+    , _map_size(0)
+    , _write_pos(0)
+    , _read_pos(0)
+    , _shm_fd(-1)
+    , _readable_fd(-1)
+    , _writable_fd(-1) {
+}
+
+ShmRing::~ShmRing() {
+    Destroy();
+}
+
+void ShmRing::Destroy() {
+    if (_header) {
+        munmap(_header, _map_size);
+        _header = NULL;
+        _data = NULL;
+    }
+    if (_shm_fd >= 0) {
+        close(_shm_fd);
+        _shm_fd = -1;
+    }
+    if (_readable_fd >= 0) {
+        bthread_close(_readable_fd);
+        _readable_fd = -1;
+    }
+    if (_writable_fd >= 0) {
+        bthread_close(_writable_fd);
+        _writable_fd = -1;
+    }
+    _capacity = 0;
+    _map_size = 0;
+}
+
+int ShmRing::Map(size_t map_size) {
+    void* p = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, _shm_fd, 0);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    _header = static_cast<ShmRingHeader*>(p);
+    _data = static_cast<char*>(p) + sizeof(ShmRingHeader);
+    _map_size = map_size;
+    return 0;
+}
+
+int ShmRing::Init(size_t capacity) {
+#if defined(OS_LINUX)
+    if (_header) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t cap = SHM_RING_MIN_CAPACITY;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+    if (cap > (1u << 31)) {
+        errno = EINVAL;
+        return -1;
+    }
+    _shm_fd = syscall(__NR_memfd_create, "brpc_shm_ring",
+                      MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    _readable_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    _writable_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    const size_t map_size = sizeof(ShmRingHeader) + cap;
+    if (_shm_fd < 0 || _readable_fd < 0 || _writable_fd < 0 ||
+        ftruncate(_shm_fd, map_size) != 0 ||
+        fcntl(_shm_fd, F_ADD_SEALS, SHM_RING_SEALS | F_SEAL_SEAL) != 0 ||
+        Map(map_size) != 0) {
+        const int saved_errno = errno;
+        PLOG(WARNING) << "Fail to create shm ring";
+        Destroy();
+        errno = saved_errno;
+        return -1;
+    }
+    new (_header) ShmRingHeader;
+    _header->capacity = cap;
+    _header->write_pos.store(0, butil::memory_order_relaxed);
+    _header->writer_waiting.store(0, butil::memory_order_relaxed);
+    _header->read_pos.store(0, butil::memory_order_relaxed);
+    _header->reader_waiting.store(0, butil::memory_order_relaxed);
+    _header->magic = SHM_RING_MAGIC;
+    _capacity = cap;
+    _write_pos = 0;
+    _read_pos = 0;
+    return 0;
+#else
+    (void)capacity;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int ShmRing::Attach(int shm_fd, int readable_fd, int writable_fd) {
+#if defined(OS_LINUX)
+    if (_header) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Checked before the size which can't change after sealing.
+    const int seals = fcntl(shm_fd, F_GET_SEALS);
+    if (seals < 0) {
+        return -1;
+    }
+    if ((seals & SHM_RING_SEALS) != SHM_RING_SEALS) {
+        LOG(WARNING) << "Shm ring of fd=" << shm_fd << " is not sealed";
+        errno = EPERM;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(shm_fd, &st) != 0) {
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(ShmRingHeader) + SHM_RING_MIN_CAPACITY) {
+        errno = EINVAL;
+        return -1;
+    }
+    _shm_fd = dup(shm_fd);
+    _readable_fd = dup(readable_fd);
+    _writable_fd = dup(writable_fd);
+    if (_shm_fd < 0 || _readable_fd < 0 || _writable_fd < 0 ||
+        Map(st.st_size) != 0) {
+        const int saved_errno = errno;
+        Destroy();
+        errno = saved_errno;
+        return -1;
+    }
+    const uint32_t cap = _header->capacity;
+    if (_header->magic != SHM_RING_MAGIC || (cap & (cap - 1)) != 0 ||
+        sizeof(ShmRingHeader) + cap != _map_size) {
+        LOG(WARNING) << "Invalid shm ring";
+        Destroy();
+        errno = EINVAL;
+        return -1;
+    }
+    _capacity = cap;
+    _write_pos = _header->write_pos.load(butil::memory_order_relaxed);
+    _read_pos = _header->read_pos.load(butil::memory_order_relaxed);
+    return 0;
+#else
+    (void)shm_fd;
+    (void)readable_fd;
+    (void)writable_fd;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+// Positions in the shared memory are written by the peer as well, only the
+// position loaded from the peer side is trusted after checking and our own
+// position is kept in the process.
+static int CheckPositions(uint64_t wpos, uint64_t rpos, size_t capacity) {
+    if (wpos - rpos > capacity) {
+        LOG_EVERY_SECOND(WARNING) << "Corrupted positions of shm ring, write="
+                                  << wpos << " read=" << rpos;
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t ShmRing::Write(butil::IOBuf* data) {
+    const uint64_t wpos = _write_pos;
+    const uint64_t rpos = _header->read_pos.load(butil::memory_order_acquire);
+    if (CheckPositions(wpos, rpos, _capacity) != 0) {
+        return -1;
+    }
+    const size_t nw = std::min(data->size(), (size_t)(_capacity - (wpos - rpos)));
+    if (nw == 0) {
+        if (data->empty()) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    const size_t off = wpos & (_capacity - 1);
+    const size_t n1 = std::min(nw, _capacity - off);
+    data->cutn(_data + off, n1);
+    if (n1 < nw) {
+        data->cutn(_data, nw - n1);
+    }
+    _write_pos = wpos + nw;
+    _header->write_pos.store(_write_pos, butil::memory_order_release);
+    // Pairs with the fence in Wait(): either the consumer sees the new
+    // position or we see its flag.
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (_header->reader_waiting.load(butil::memory_order_relaxed)) {
+        Notify(_readable_fd);
+    }
+    return nw;
+}
+
+ssize_t ShmRing::Read(butil::IOBuf* buf, size_t max_count) {
+    const uint64_t rpos = _read_pos;
+    const uint64_t wpos = _header->write_pos.load(butil::memory_order_acquire);
+    if (CheckPositions(wpos, rpos, _capacity) != 0) {
+        return -1;
+    }
+    const size_t nr = std::min(max_count, (size_t)(wpos - rpos));
+    if (nr == 0) {
+        if (max_count == 0) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    const size_t off = rpos & (_capacity - 1);
+    const size_t n1 = std::min(nr, _capacity - off);
+    buf->append(_data + off, n1);
+    if (n1 < nr) {
+        buf->append(_data, nr - n1);
+    }
+    if (_header->reader_waiting.load(butil::memory_order_relaxed)) {
+        // Set by PrepareWaitReadable(), the consumer is not waiting anymore.
+        _header->reader_waiting.store(0, butil::memory_order_relaxed);
+    }
+    _read_pos = rpos + nr;
+    _header->read_pos.store(_read_pos, butil::memory_order_release);
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (_header->writer_waiting.load(butil::memory_order_relaxed)) {
+        Notify(_writable_fd);
+    }
+    return nr;
+}
+
+int ShmRing::Wait(bool readable, const timespec* abstime) {
+    butil::atomic<int>& waiting =
+        (readable ? _header->reader_waiting : _header->writer_waiting);
+    const int efd = (readable ? _readable_fd : _writable_fd);
+    while (true) {
+        // A peer corrupting positions is found by next Read()/Write().
+        const uint64_t wpos = (readable ?
+            _header->write_pos.load(butil::memory_order_acquire) : _write_pos);
+        const uint64_t rpos = (readable ? _read_pos :
+            _header->read_pos.load(butil::memory_order_acquire));
+        if (readable ? (wpos != rpos) : (wpos - rpos != _capacity)) {
+            waiting.store(0, butil::memory_order_relaxed);
+            return 0;
+        }
+        if (!waiting.load(butil::memory_order_relaxed)) {
+            waiting.store(1, butil::memory_order_relaxed);
+            // Check the positions again after announcing the sleep.
+            butil::atomic_thread_fence(butil::memory_order_seq_cst);
+            continue;
+        }
+        if (ClearNotification(efd)) {
+            continue;
+        }
+#if defined(OS_LINUX)
+        const unsigned events = EPOLLIN;
+#elif defined(OS_MACOSX)
+        const unsigned events = EVFILT_READ;
+#endif
+        if (bthread_fd_timedwait(efd, events, abstime) != 0) {
+            const int saved_errno = errno;
+            waiting.store(0, butil::memory_order_relaxed);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+}
+
+bool ShmRing::PrepareWaitReadable() {
+    ClearNotification(_readable_fd);
+    _header->reader_waiting.store(1, butil::memory_order_relaxed);
+    // Pairs with the fence in Write().
+    butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    if (_header->write_pos.load(butil::memory_order_acquire) != _read_pos) {
+        _header->reader_waiting.store(0, butil::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+int ShmRing::WaitReadable(const timespec* abstime) {
+    return Wait(true, abstime);
+}
+
+int ShmRing::WaitWritable(const timespec* abstime) {
+    return Wait(false, abstime);
+}
+
+} // namespace brpc
@@ -0,0 +1,116 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_DETAILS_SHM_RING_H
+#define BRPC_DETAILS_SHM_RING_H
+
+#include <stdint.h>
+#include <time.h>                               // timespec
+#include <sys/types.h>                          // ssize_t
+#include "butil/macros.h"                       // DISALLOW_COPY_AND_ASSIGN
+#include "butil/iobuf.h"
+
+namespace brpc {
+
+struct ShmRingHeader;
+
+// [Linux only] Single-producer-single-consumer byte ring in shared memory,
+// one ring carries bytes of one direction between two processes on the
+// same host. The memory is a memfd and wakeups are eventfds, all of them
+// can be passed to the peer over a unix domain socket(SCM_RIGHTS) and
+// attached there.
+//
+// Positions of the ring are lock-free atomics in the shared memory, an
+// eventfd is only written when the other side announced that it's going to
+// sleep, so the steady state of a busy ring is free of syscalls. Waiting
+// is done by bthread_fd_timedwait() on the eventfd, which suspends bthreads
+// instead of blocking workers.
+//
+// Write()/WaitWritable() must be called by one producer and Read()
+// /WaitReadable() by one consumer, which may live in different processes.
+// The memory is sealed against resizing and positions written by the peer
+// are checked, Read()/Write() fail with EPROTO if the peer corrupted them.
+class ShmRing {
+public:
+    ShmRing();
+    ~ShmRing();
+
+    // Create a ring with capacity of `capacity' bytes which is rounded up
+    // to power of 2. Returns 0 on success, -1 otherwise and errno is set.
+    int Init(size_t capacity);
+
+    // Attach to the ring created by Init() of another instance, probably
+    // in another process. The fds are dup-ed and owned by this instance.
+    // Memory not sealed by Init() is rejected.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int Attach(int shm_fd, int readable_fd, int writable_fd);
+
+    // Move as many bytes from the front of `data' as the ring can hold.
+    // Returns bytes written, -1 with errno=EAGAIN when the ring is full or
+    // EPROTO when the ring is corrupted.
+    ssize_t Write(butil::IOBuf* data);
+
+    // Append at most `max_count' bytes from the ring into `buf'.
+    // Returns bytes read, -1 with errno=EAGAIN when the ring is empty or
+    // EPROTO when the ring is corrupted.
+    ssize_t Read(butil::IOBuf* buf, size_t max_count);
+
+    // Suspend until the ring is non-empty/non-full or CLOCK_REALTIME reached
+    // `abstime' if abstime is not NULL.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int WaitReadable(const timespec* abstime);
+    int WaitWritable(const timespec* abstime);
+
+    // For the consumer woken up by polling readable_fd()(e.g. in epoll)
+    // rather than WaitReadable(): announce that it's going to wait.
+    // Returns true if the ring is still empty after the announcement, in
+    // which case the producer signals readable_fd() on next Write(), false
+    // if the consumer should read again instead of waiting.
+    bool PrepareWaitReadable();
+
+    size_t capacity() const { return _capacity; }
+    int shm_fd() const { return _shm_fd; }
+    // Signaled by the producer when data is available.
+    int readable_fd() const { return _readable_fd; }
+    // Signaled by the consumer when space is available.
+    int writable_fd() const { return _writable_fd; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ShmRing);
+
+    int Map(size_t map_size);
+    int Wait(bool readable, const timespec* abstime);
+    void Destroy();
+
+    ShmRingHeader* _header;
+    char* _data;
+    size_t _capacity;
+    size_t _map_size;
+    // Own positions of the producer and the consumer respectively, the
+    // copies in shared memory are only for the peer.
+    uint64_t _write_pos;
+    uint64_t _read_pos;
+    int _shm_fd;
+    int _readable_fd;
+    int _writable_fd;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_DETAILS_SHM_RING_H
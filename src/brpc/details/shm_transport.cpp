@@ -0,0 +1,398 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"                   // bthread_timer_add
+#include "bvar/bvar.h"                          // bvar::Adder
+#include "brpc/errno.pb.h"
+#include "brpc/event_dispatcher.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/shm_transport.h"
+
+namespace brpc {
+
+DEFINE_bool(shm_transport, false,
+            "Carry connections to unix domain sockets(unix:path) by shared"
+            " memory. Servers of the sockets must be new enough to reply the"
+            " handshake, otherwise connections fail");
+BRPC_VALIDATE_GFLAG(shm_transport, PassValidate);
+
+DEFINE_int32(shm_transport_ring_size, 1024 * 1024,
+             "Bytes of the ring of each direction of a connection carried by"
+             " -shm_transport");
+BRPC_VALIDATE_GFLAG(shm_transport_ring_size, PositiveInteger);
+
+static const char SHM_HELLO[] = "BRPCSHMH";
+static const char SHM_ACCEPTED[] = "BRPCSHMA";
+static const char SHM_DECLINED[] = "BRPCSHMD";
+static const size_t SHM_MAGIC_LEN = sizeof(SHM_HELLO) - 1;
+// shm_fd, readable_fd and writable_fd of both rings.
+static const int SHM_HELLO_NFD = 6;
+static const int64_t SHM_HANDSHAKE_TIMEOUT_MS = 3000;
+
+#if defined(MSG_NOSIGNAL)
+static const int SHM_SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SHM_SEND_FLAGS = 0;
+#endif
+
+static bvar::Adder<int64_t>* g_shm_conn_count = NULL;
+static pthread_once_t g_shm_conn_count_once = PTHREAD_ONCE_INIT;
+static void InitShmConnectionCount() {
+    g_shm_conn_count =
+        new bvar::Adder<int64_t>("rpc_shm_transport_connection_count");
+}
+
+// Send the magic with `fds' attached.
+static int SendMagic(int fd, const char* magic, const int* fds, int nfd) {
+    iovec iov;
+    iov.iov_base = const_cast<char*>(magic);
+    iov.iov_len = SHM_MAGIC_LEN;
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * SHM_HELLO_NFD)];
+    } control;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfd > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfd);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfd);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfd);
+    }
+    ssize_t nw = 0;
+    do {
+        nw = sendmsg(fd, &msg, SHM_SEND_FLAGS);
+    } while (nw < 0 && errno == EINTR);
+    if (nw != (ssize_t)SHM_MAGIC_LEN) {
+        if (nw >= 0) {
+            // Nothing was written before on the connection.
+            errno = ENOBUFS;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+ShmTransport::ShmTransport()
+    : _state(HANDSHAKING)
+    , _nreply(0)
+    , _done_taken(false)
+    , _done(NULL)
+    , _done_data(NULL)
+    , _timer(0) {
+}
+
+ShmTransport::~ShmTransport() {
+    if (active()) {
+        *g_shm_conn_count << -1;
+    }
+}
+
+ShmTransport* ShmTransport::CreateClientSide(size_t ring_capacity) {
+    ShmTransport* t = new ShmTransport;
+    if (t->_in.Init(ring_capacity) != 0 || t->_out.Init(ring_capacity) != 0) {
+        delete t;
+        return NULL;
+    }
+    return t;
+}
+
+void ShmTransport::set_active() {
+    pthread_once(&g_shm_conn_count_once, InitShmConnectionCount);
+    *g_shm_conn_count << 1;
+    _state.store(ACTIVE, butil::memory_order_release);
+}
+
+int ShmTransport::SendHello(int fd) {
+    // The server reads the ring from client first.
+    const int fds[SHM_HELLO_NFD] = {
+        _out.shm_fd(), _out.readable_fd(), _out.writable_fd(),
+        _in.shm_fd(), _in.readable_fd(), _in.writable_fd() };
+    return SendMagic(fd, SHM_HELLO, fds, SHM_HELLO_NFD);
+}
+
+int ShmTransport::ReadReply(int fd) {
+    while (_nreply < sizeof(_reply)) {
+        const ssize_t nr = read(fd, _reply + _nreply, sizeof(_reply) - _nreply);
+        if (nr <= 0) {
+            if (nr == 0) {
+                // Probably closed by a server not knowing the hello.
+                errno = ECONNRESET;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        _nreply += nr;
+    }
+    if (memcmp(_reply, SHM_ACCEPTED, SHM_MAGIC_LEN) == 0) {
+        return 1;
+    }
+    if (memcmp(_reply, SHM_DECLINED, SHM_MAGIC_LEN) == 0) {
+        return 0;
+    }
+    errno = EPROTO;
+    return -1;
+}
+
+ssize_t ShmTransport::ReadHello(int fd, butil::IOBuf* buf, bool attach,
+                                bool* is_hello, ShmTransport** transport) {
+    *is_hello = false;
+    *transport = NULL;
+    char data[SHM_MAGIC_LEN];
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * SHM_HELLO_NFD)];
+    } control;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+#if defined(MSG_CMSG_CLOEXEC)
+    const int flags = MSG_CMSG_CLOEXEC;
+#else
+    const int flags = 0;
+#endif
+    const ssize_t nr = recvmsg(fd, &msg, flags);
+    if (nr <= 0) {
+        return nr;
+    }
+    int fds[SHM_HELLO_NFD];
+    int nfd = 0;
+    bool extra_fds = false;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int* p = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+        for (int i = 0; i < n; ++i) {
+            if (nfd < SHM_HELLO_NFD) {
+                fds[nfd++] = p[i];
+            } else {
+                close(p[i]);
+                extra_fds = true;
+            }
+        }
+    }
+    if ((size_t)nr == SHM_MAGIC_LEN &&
+        memcmp(data, SHM_HELLO, SHM_MAGIC_LEN) == 0) {
+        *is_hello = true;
+        if (!attach) {
+            // Not trusted by the server, nothing from the peer is mapped.
+        } else if (nfd == SHM_HELLO_NFD && !extra_fds &&
+            !(msg.msg_flags & MSG_CTRUNC)) {
+            ShmTransport* t = new ShmTransport;
+            if (t->_in.Attach(fds[0], fds[1], fds[2]) == 0 &&
+                t->_out.Attach(fds[3], fds[4], fds[5]) == 0) {
+                *transport = t;
+            } else {
+                PLOG(WARNING) << "Fail to attach shm rings from fd=" << fd;
+                delete t;
+            }
+        } else {
+            LOG(WARNING) << "Invalid shm hello from fd=" << fd;
+        }
+    } else {
+        buf->append(data, nr);
+    }
+    // Attach() dups the fds.
+    for (int i = 0; i < nfd; ++i) {
+        close(fds[i]);
+    }
+    return nr;
+}
+
+int ShmTransport::SendReply(int fd, bool accepted) {
+    return SendMagic(fd, (accepted ? SHM_ACCEPTED : SHM_DECLINED), NULL, 0);
+}
+
+ssize_t ShmTransport::Read(int fd, butil::IOBuf* buf, size_t size_hint) {
+    ssize_t nr = _in.Read(buf, size_hint);
+    if (nr < 0 && errno == EAGAIN && !_in.PrepareWaitReadable()) {
+        // Written before the peer saw our announcement.
+        nr = _in.Read(buf, size_hint);
+    }
+    if (nr >= 0) {
+        return nr;
+    }
+    if (errno != EAGAIN) {
+        // Corrupted by the peer, fail the connection.
+        return -1;
+    }
+    // The ring is empty and readable_fd() will be signaled on next write.
+    // The connection itself carries nothing but EOF now.
+    char c;
+    const ssize_t n = read(fd, &c, 1);
+    if (n == 0) {
+        // Bytes written before closing are still in the ring.
+        nr = _in.Read(buf, size_hint);
+        if (nr < 0 && errno != EAGAIN) {
+            return -1;
+        }
+        return nr > 0 ? nr : 0;
+    }
+    if (n > 0) {
+        errno = EPROTO;
+    }
+    return -1;
+}
+
+ssize_t ShmTransport::Write(butil::IOBuf* const* data_list, size_t ndata) {
+    size_t nw = 0;
+    for (size_t i = 0; i < ndata; ++i) {
+        const ssize_t rc = _out.Write(data_list[i]);
+        if (rc < 0) {
+            if (errno != EAGAIN) {
+                return -1;
+            }
+            break;
+        }
+        nw += rc;
+        if (!data_list[i]->empty()) {
+            break;
+        }
+    }
+    if (nw == 0) {
+        for (size_t i = 0; i < ndata; ++i) {
+            if (!data_list[i]->empty()) {
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+    }
+    return nw;
+}
+
+int ShmTransport::WaitWritable(const timespec* abstime) {
+    return _out.WaitWritable(abstime);
+}
+
+void ShmTransport::set_connect_done(void (*done)(int err, void* data),
+                                    void* data) {
+    _done = done;
+    _done_data = data;
+}
+
+bool ShmTransport::RunConnectDone(int err) {
+    if (_done == NULL || _done_taken.exchange(true, butil::memory_order_acquire)) {
+        return false;
+    }
+    if (_timer) {
+        bthread_timer_del(_timer);
+    }
+    _done(err, _done_data);
+    return true;
+}
+
+static void* RunShmHandshakeTimeout(void* arg) {
+    SocketUniquePtr s;
+    if (Socket::AddressFailedAsWell((SocketId)(uintptr_t)arg, &s) >= 0) {
+        ShmConnect::OnHandshakeTimeout(s.get());
+    }
+    return NULL;
+}
+
+static void HandleShmHandshakeTimeout(void* arg) {
+    // Don't run the callback in the timer thread.
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, RunShmHandshakeTimeout, arg) != 0) {
+        PLOG(WARNING) << "Fail to start bthread";
+        RunShmHandshakeTimeout(arg);
+    }
+}
+
+void ShmConnect::StartConnect(const Socket* socket,
+                              void (*done)(int err, void* data),
+                              void* data) {
+    Socket* s = const_cast<Socket*>(socket);
+    ShmTransport* t = NULL;
+    // Consumers of io_uring are removed by SocketId, which can't tell the
+    // connection from the ring.
+    if (s->_conn == NULL && !s->GetEventDispatcher(s->fd()).UsingIoUring()) {
+        t = ShmTransport::CreateClientSide(FLAGS_shm_transport_ring_size);
+    }
+    if (t == NULL) {
+        // Carry on as an ordinary unix domain socket.
+        return done(0, data);
+    }
+    t->set_connect_done(done, data);
+    // Published before the hello so that the reply is read by DoShmRead().
+    s->_shm_transport.store(t, butil::memory_order_release);
+    bthread_timer_t timer;
+    if (bthread_timer_add(&timer,
+                          butil::milliseconds_from_now(SHM_HANDSHAKE_TIMEOUT_MS),
+                          HandleShmHandshakeTimeout,
+                          (void*)(uintptr_t)s->id()) == 0) {
+        t->set_connect_timer(timer);
+    }
+    if (t->SendHello(s->fd()) != 0) {
+        const int saved_errno = errno;
+        PLOG(WARNING) << "Fail to send shm hello to " << *s;
+        t->RunConnectDone(saved_errno);
+    }
+}
+
+void ShmConnect::StopConnect(Socket* s) {
+    ShmTransport* t = s->_shm_transport.load(butil::memory_order_acquire);
+    if (t) {
+        t->RunConnectDone(EFAILEDSOCKET);
+    }
+}
+
+void ShmConnect::OnHandshakeTimeout(Socket* s) {
+    ShmTransport* t = s->_shm_transport.load(butil::memory_order_acquire);
+    if (t) {
+        t->RunConnectDone(ETIMEDOUT);
+    }
+}
+
+static std::shared_ptr<AppConnect>* g_shm_connect = NULL;
+static pthread_once_t g_shm_connect_once = PTHREAD_ONCE_INIT;
+static void InitShmConnect() {
+    g_shm_connect = new std::shared_ptr<AppConnect>(
+        std::make_shared<ShmConnect>());
+}
+
+const std::shared_ptr<AppConnect>& GetShmConnect() {
+    pthread_once(&g_shm_connect_once, InitShmConnect);
+    return *g_shm_connect;
+}
+
+} // namespace brpc
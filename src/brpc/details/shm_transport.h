@@ -0,0 +1,143 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_DETAILS_SHM_TRANSPORT_H
+#define BRPC_DETAILS_SHM_TRANSPORT_H
+
+#include <time.h>                               // timespec
+#include <sys/types.h>                          // ssize_t
+#include <memory>                               // std::shared_ptr
+#include "butil/atomicops.h"
+#include "butil/iobuf.h"
+#include "bthread/types.h"                      // bthread_timer_t
+#include "brpc/socket.h"                        // AppConnect
+#include "brpc/details/shm_ring.h"
+
+namespace brpc {
+
+// Bytes of a unix domain socket connection carried by two ShmRing, one for
+// each direction, after a handshake over the connection:
+//
+//   client                                          server
+//     "BRPCSHMH" + fds of both rings(SCM_RIGHTS) ---->
+//     <---- "BRPCSHMA"(accepted) or "BRPCSHMD"(declined)
+//
+// The client does not write anything else before the reply. After
+// acceptance, both sides read and write the rings and the connection
+// itself only carries EOF, which closes the transport as usual. After
+// declination, the connection is used as if the handshake did not happen.
+class ShmTransport {
+public:
+    enum State {
+        HANDSHAKING,
+        ACTIVE,
+        DECLINED,
+    };
+
+    ~ShmTransport();
+
+    // Create rings of the client side, NULL on error.
+    static ShmTransport* CreateClientSide(size_t ring_capacity);
+
+    // [Client] Send the hello to `fd'.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int SendHello(int fd);
+
+    // [Client] Read the reply from `fd'. Returns 1 if the server accepted,
+    // 0 if it declined, -1 otherwise and errno is set (EAGAIN when the
+    // reply is not complete yet).
+    int ReadReply(int fd);
+
+    // [Server] Read the first bytes of a connection. If they're a hello,
+    // `*is_hello' is set to true and `*transport' to the attached transport
+    // or NULL if `attach' is false or the rings can't be attached, the
+    // hello must be replied in all cases. Otherwise the bytes are appended
+    // into `buf'.
+    // Returns bytes read, 0 on EOF, -1 otherwise and errno is set.
+    static ssize_t ReadHello(int fd, butil::IOBuf* buf, bool attach,
+                             bool* is_hello, ShmTransport** transport);
+
+    // [Server] Send the reply to `fd'.
+    static int SendReply(int fd, bool accepted);
+
+    // Read at most `size_hint' bytes into `buf'. `fd' is the connection
+    // which is checked for EOF when the ring is empty.
+    // Returns bytes read, 0 on EOF, -1 otherwise and errno is set.
+    ssize_t Read(int fd, butil::IOBuf* buf, size_t size_hint);
+
+    // Write as many bytes of `data_list' as the ring can hold.
+    // Returns bytes written, -1 with errno=EAGAIN when the ring is full or
+    // EPROTO when the peer corrupted the ring.
+    ssize_t Write(butil::IOBuf* const* data_list, size_t ndata);
+
+    // Suspend until the ring to peer is writable or `abstime' is reached.
+    int WaitWritable(const timespec* abstime);
+
+    // Signaled when the ring from peer is readable, to be polled by the
+    // EventDispatcher after activation.
+    int readable_fd() const { return _in.readable_fd(); }
+
+    State state() const { return _state.load(butil::memory_order_acquire); }
+    bool active() const { return state() == ACTIVE; }
+    // Counted in rpc_shm_transport_connection_count until destruction.
+    void set_active();
+    void set_declined() { _state.store(DECLINED, butil::memory_order_release); }
+
+    // [Client] The connect callback of AppConnect which is called once by
+    // RunConnectDone() with the result of the handshake, or the timeout.
+    void set_connect_done(void (*done)(int err, void* data), void* data);
+    // Removed when the callback is run.
+    void set_connect_timer(bthread_timer_t timer) { _timer = timer; }
+    // Returns false if the callback was already run.
+    bool RunConnectDone(int err);
+
+private:
+    ShmTransport();
+    DISALLOW_COPY_AND_ASSIGN(ShmTransport);
+
+    ShmRing _in;
+    ShmRing _out;
+    butil::atomic<State> _state;
+    char _reply[8];
+    size_t _nreply;
+    butil::atomic<bool> _done_taken;
+    void (*_done)(int err, void* data);
+    void* _done_data;
+    bthread_timer_t _timer;
+};
+
+// Handshake of ShmTransport as the AppConnect of client sockets, enabled
+// by -shm_transport on connections to unix domain sockets.
+class ShmConnect : public AppConnect {
+public:
+    void StartConnect(const Socket* socket,
+                      void (*done)(int err, void* data),
+                      void* data) override;
+    void StopConnect(Socket* socket) override;
+
+    // Fail the handshake of `socket' which is not replied in time.
+    static void OnHandshakeTimeout(Socket* socket);
+};
+
+// Shared by all sockets.
+const std::shared_ptr<AppConnect>& GetShmConnect();
+
+} // namespace brpc
+
+
+#endif  // BRPC_DETAILS_SHM_TRANSPORT_H
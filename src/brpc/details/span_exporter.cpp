@@ -0,0 +1,374 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <pthread.h>
+#include <algorithm>
+#include <limits>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_printf.h"
+#include "butil/endpoint.h"
+#include "bthread/bthread.h"
+#include "bvar/bvar.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/span.h"
+#include "brpc/details/span_exporter.h"
+
+namespace brpc {
+
+DEFINE_string(rpcz_export_url, "",
+              "Send collected spans to this url by HTTP POST, e.g. "
+              "http://127.0.0.1:4318/v1/traces. Empty means no exporting");
+DEFINE_string(rpcz_export_format, "otlp",
+              "Body format of exported spans: otlp(OTLP/HTTP JSON) or "
+              "zipkin(Zipkin v2 JSON)");
+DEFINE_string(rpcz_export_service_name, "",
+              "service.name of exported spans, program name if empty");
+DEFINE_int32(rpcz_export_batch_size, 512, "Send at most so many spans per request");
+BRPC_VALIDATE_GFLAG(rpcz_export_batch_size, PositiveInteger);
+DEFINE_int32(rpcz_export_interval_ms, 1000, "Send spans every so many milliseconds");
+BRPC_VALIDATE_GFLAG(rpcz_export_interval_ms, PositiveInteger);
+DEFINE_int32(rpcz_export_max_pending, 8192,
+             "Drop spans when so many spans are waiting to be sent");
+BRPC_VALIDATE_GFLAG(rpcz_export_max_pending, PositiveInteger);
+DEFINE_int32(rpcz_export_timeout_ms, 3000, "Timeout of sending a batch of spans");
+BRPC_VALIDATE_GFLAG(rpcz_export_timeout_ms, PositiveInteger);
+
+struct SpanExporter {
+    pthread_mutex_t mutex;
+    std::vector<RpczSpan> pending;
+    bvar::Adder<int64_t> sent;
+    bvar::Adder<int64_t> dropped;
+    bvar::Adder<int64_t> failed;
+    // Accessed by the exporting bthread only.
+    std::string url;
+    Channel* channel;
+
+    SpanExporter()
+        : sent("rpcz_export_sent")
+        , dropped("rpcz_export_dropped")
+        , failed("rpcz_export_failed")
+        , channel(NULL) {
+        pthread_mutex_init(&mutex, NULL);
+    }
+};
+
+static pthread_once_t g_span_exporter_once = PTHREAD_ONCE_INIT;
+static SpanExporter* g_span_exporter = NULL;
+
+static void SendSpans(SpanExporter* e, const std::vector<RpczSpan>& spans) {
+    const std::string url = FLAGS_rpcz_export_url;
+    if (url.empty()) {
+        return;
+    }
+    if (e->channel == NULL || e->url != url) {
+        delete e->channel;
+        e->channel = new Channel;
+        e->url = url;
+        ChannelOptions opt;
+        opt.protocol = PROTOCOL_HTTP;
+        opt.timeout_ms = FLAGS_rpcz_export_timeout_ms;
+        opt.max_retry = 0;
+        if (e->channel->Init(url.c_str(), "", &opt) != 0) {
+            LOG(ERROR) << "Fail to init channel to " << url;
+            delete e->channel;
+            e->channel = NULL;
+            e->failed << spans.size();
+            return;
+        }
+    }
+    std::string service_name = FLAGS_rpcz_export_service_name;
+    if (service_name.empty()) {
+        service_name = GFLAGS_NS::ProgramInvocationShortName();
+    }
+    std::string body;
+    if (!SerializeSpansForExport(spans, FLAGS_rpcz_export_format,
+                                 service_name, &body)) {
+        LOG_EVERY_SECOND(ERROR) << "Unknown -rpcz_export_format="
+                                << FLAGS_rpcz_export_format;
+        e->failed << spans.size();
+        return;
+    }
+    Controller cntl;
+    cntl.http_request().uri() = url;
+    cntl.http_request().set_method(HTTP_METHOD_POST);
+    cntl.http_request().set_content_type("application/json");
+    cntl.request_attachment().append(body);
+    e->channel->CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+        LOG_EVERY_SECOND(WARNING) << "Fail to export " << spans.size()
+                                  << " spans to " << url << ": "
+                                  << cntl.ErrorText();
+        e->failed << spans.size();
+        return;
+    }
+    e->sent << spans.size();
+}
+
+static void* RunSpanExporter(void* arg) {
+    SpanExporter* e = static_cast<SpanExporter*>(arg);
+    std::vector<RpczSpan> spans;
+    std::vector<RpczSpan> batch;
+    while (true) {
+        bthread_usleep(FLAGS_rpcz_export_interval_ms * 1000L);
+        {
+            BAIDU_SCOPED_LOCK(e->mutex);
+            spans.swap(e->pending);
+        }
+        const size_t batch_size = FLAGS_rpcz_export_batch_size;
+        for (size_t i = 0; i < spans.size(); i += batch_size) {
+            const size_t end = std::min(spans.size(), i + batch_size);
+            batch.clear();
+            for (size_t j = i; j < end; ++j) {
+                batch.push_back(RpczSpan());
+                batch.back().Swap(&spans[j]);
+            }
+            SendSpans(e, batch);
+        }
+        spans.clear();
+    }
+    return NULL;
+}
+
+static void StartSpanExporter() {
+    g_span_exporter = new SpanExporter;
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, RunSpanExporter,
+                                 g_span_exporter) != 0) {
+        LOG(ERROR) << "Fail to start span exporter";
+        delete g_span_exporter;
+        g_span_exporter = NULL;
+    }
+}
+
+bool IsSpanExportEnabled() {
+    return !FLAGS_rpcz_export_url.empty();
+}
+
+void ExportSpan(const RpczSpan& span) {
+    pthread_once(&g_span_exporter_once, StartSpanExporter);
+    SpanExporter* e = g_span_exporter;
+    if (e == NULL) {
+        return;
+    }
+    {
+        BAIDU_SCOPED_LOCK(e->mutex);
+        if (e->pending.size() < (size_t)FLAGS_rpcz_export_max_pending) {
+            e->pending.push_back(span);
+            return;
+        }
+    }
+    e->dropped << 1;
+}
+
+static void AppendJsonString(std::string* out, const std::string& s) {
+    out->push_back('"');
+    for (size_t i = 0; i < s.size(); ++i) {
+        const unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            out->push_back('\\');
+            out->push_back(c);
+        } else if (c < 0x20) {
+            butil::string_appendf(out, "\\u%04x", c);
+        } else {
+            out->push_back(c);
+        }
+    }
+    out->push_back('"');
+}
+
+static int64_t StartRealUs(const RpczSpan& span) {
+    return span.type() == SPAN_TYPE_SERVER ?
+        span.received_real_us() : span.start_send_real_us();
+}
+
+static int64_t EndRealUs(const RpczSpan& span) {
+    int64_t result = span.received_real_us();
+    result = std::max(result, span.start_parse_real_us());
+    result = std::max(result, span.start_callback_real_us());
+    result = std::max(result, span.start_send_real_us());
+    result = std::max(result, span.sent_real_us());
+    return result;
+}
+
+static void FlattenSpans(const std::vector<RpczSpan>& spans,
+                         std::vector<const RpczSpan*>* out) {
+    for (size_t i = 0; i < spans.size(); ++i) {
+        out->push_back(&spans[i]);
+        for (int j = 0; j < spans[i].client_spans_size(); ++j) {
+            out->push_back(&spans[i].client_spans(j));
+        }
+    }
+}
+
+static void AppendOTLPAttribute(std::string* out, const char* key,
+                                const std::string& value, bool* first) {
+    if (!*first) {
+        out->push_back(',');
+    }
+    *first = false;
+    butil::string_appendf(out, "{\"key\":\"%s\",\"value\":{\"stringValue\":", key);
+    AppendJsonString(out, value);
+    out->append("}}");
+}
+
+static void AppendOTLPAttribute(std::string* out, const char* key,
+                                int64_t value, bool* first) {
+    if (!*first) {
+        out->push_back(',');
+    }
+    *first = false;
+    butil::string_appendf(out, "{\"key\":\"%s\",\"value\":{\"intValue\":\"%lld\"}}",
+                          key, (long long)value);
+}
+
+static void AppendOTLPSpan(std::string* out, const RpczSpan& span) {
+    butil::string_appendf(
+        out, "{\"traceId\":\"0000000000000000%016llx\",\"spanId\":\"%016llx\"",
+        (unsigned long long)span.trace_id(), (unsigned long long)span.span_id());
+    if (span.parent_span_id() != 0) {
+        butil::string_appendf(out, ",\"parentSpanId\":\"%016llx\"",
+                              (unsigned long long)span.parent_span_id());
+    }
+    out->append(",\"name\":");
+    AppendJsonString(out, span.full_method_name());
+    butil::string_appendf(
+        out, ",\"kind\":%d,\"startTimeUnixNano\":\"%lld000\","
+        "\"endTimeUnixNano\":\"%lld000\",\"attributes\":[",
+        (span.type() == SPAN_TYPE_SERVER ? 2 : 3),
+        (long long)StartRealUs(span), (long long)EndRealUs(span));
+    bool first = true;
+    AppendOTLPAttribute(out, "rpc.system", std::string("brpc"), &first);
+    AppendOTLPAttribute(out, "net.peer.ip",
+                        std::string(butil::ip2str(butil::int2ip(
+                                    span.remote_ip())).c_str()), &first);
+    AppendOTLPAttribute(out, "net.peer.port", (int64_t)span.remote_port(), &first);
+    AppendOTLPAttribute(out, "brpc.request_size", (int64_t)span.request_size(), &first);
+    AppendOTLPAttribute(out, "brpc.response_size", (int64_t)span.response_size(), &first);
+    if (span.log_id() != 0) {
+        AppendOTLPAttribute(out, "brpc.log_id", (int64_t)span.log_id(), &first);
+    }
+    out->append("],\"events\":[");
+    SpanInfoExtractor extr(span.info().c_str());
+    int64_t anno_time;
+    std::string anno;
+    first = true;
+    while (extr.PopAnnotation(std::numeric_limits<int64_t>::max(),
+                              &anno_time, &anno)) {
+        if (!first) {
+            out->push_back(',');
+        }
+        first = false;
+        butil::string_appendf(out, "{\"timeUnixNano\":\"%lld000\",\"name\":",
+                              (long long)anno_time);
+        AppendJsonString(out, anno);
+        out->push_back('}');
+    }
+    out->push_back(']');
+    if (span.error_code() != 0) {
+        butil::string_appendf(out, ",\"status\":{\"code\":2,\"message\":\"%d\"}",
+                              span.error_code());
+    }
+    out->push_back('}');
+}
+
+static void AppendZipkinSpan(std::string* out, const RpczSpan& span,
+                             const std::string& service_name) {
+    const int64_t start_us = StartRealUs(span);
+    butil::string_appendf(
+        out, "{\"traceId\":\"%016llx\",\"id\":\"%016llx\"",
+        (unsigned long long)span.trace_id(), (unsigned long long)span.span_id());
+    if (span.parent_span_id() != 0) {
+        butil::string_appendf(out, ",\"parentId\":\"%016llx\"",
+                              (unsigned long long)span.parent_span_id());
+    }
+    out->append(",\"name\":");
+    AppendJsonString(out, span.full_method_name());
+    butil::string_appendf(
+        out, ",\"kind\":\"%s\",\"timestamp\":%lld,\"duration\":%lld",
+        (span.type() == SPAN_TYPE_SERVER ? "SERVER" : "CLIENT"),
+        (long long)start_us, (long long)(EndRealUs(span) - start_us));
+    out->append(",\"localEndpoint\":{\"serviceName\":");
+    AppendJsonString(out, service_name);
+    butil::string_appendf(
+        out, "},\"remoteEndpoint\":{\"ipv4\":\"%s\",\"port\":%u}",
+        butil::ip2str(butil::int2ip(span.remote_ip())).c_str(),
+        span.remote_port());
+    out->append(",\"annotations\":[");
+    SpanInfoExtractor extr(span.info().c_str());
+    int64_t anno_time;
+    std::string anno;
+    bool first = true;
+    while (extr.PopAnnotation(std::numeric_limits<int64_t>::max(),
+                              &anno_time, &anno)) {
+        if (!first) {
+            out->push_back(',');
+        }
+        first = false;
+        butil::string_appendf(out, "{\"timestamp\":%lld,\"value\":",
+                              (long long)anno_time);
+        AppendJsonString(out, anno);
+        out->push_back('}');
+    }
+    out->push_back(']');
+    if (span.error_code() != 0) {
+        butil::string_appendf(out, ",\"tags\":{\"error\":\"%d\"}",
+                              span.error_code());
+    }
+    out->push_back('}');
+}
+
+bool SerializeSpansForExport(const std::vector<RpczSpan>& spans,
+                             const std::string& format,
+                             const std::string& service_name,
+                             std::string* out) {
+    std::vector<const RpczSpan*> flat;
+    FlattenSpans(spans, &flat);
+    out->clear();
+    if (format == "otlp") {
+        out->append("{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+                    "{\"key\":\"service.name\",\"value\":{\"stringValue\":");
+        AppendJsonString(out, service_name);
+        out->append("}}]},\"scopeSpans\":[{\"scope\":{\"name\":\"brpc\"},"
+                    "\"spans\":[");
+        for (size_t i = 0; i < flat.size(); ++i) {
+            if (i) {
+                out->push_back(',');
+            }
+            AppendOTLPSpan(out, *flat[i]);
+        }
+        out->append("]}]}]}");
+        return true;
+    } else if (format == "zipkin") {
+        out->push_back('[');
+        for (size_t i = 0; i < flat.size(); ++i) {
+            if (i) {
+                out->push_back(',');
+            }
+            AppendZipkinSpan(out, *flat[i], service_name);
+        }
+        out->push_back(']');
+        return true;
+    }
+    return false;
+}
+
+} // namespace brpc
@@ -0,0 +1,49 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_SPAN_EXPORTER_H
+#define BRPC_SPAN_EXPORTER_H
+
+#include <string>
+#include <vector>
+#include "brpc/span.pb.h"
+
+
+namespace brpc {
+
+// True if -rpcz_export_url is set.
+bool IsSpanExportEnabled();
+
+// Queue `span' (and its client spans) for exporting. Spans are sent in
+// batches by a background bthread, spans exceeding -rpcz_export_max_pending
+// are dropped and counted in bvar "rpcz_export_dropped".
+// Called by the rpcz collecting thread only.
+void ExportSpan(const RpczSpan& span);
+
+// Serialize `spans' into the request body of OTLP/HTTP JSON (format="otlp")
+// or Zipkin v2 JSON (format="zipkin"). Client spans are flattened.
+// Returns false if the format is unknown.
+bool SerializeSpansForExport(const std::vector<RpczSpan>& spans,
+                             const std::string& format,
+                             const std::string& service_name,
+                             std::string* out);
+
+} // namespace brpc
+
+
+#endif // BRPC_SPAN_EXPORTER_H
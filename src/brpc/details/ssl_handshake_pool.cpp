@@ -0,0 +1,188 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#include <gflags/gflags.h>
+#ifndef USE_MESALINK
+#include <openssl/err.h>
+#endif
+#include "butil/atomicops.h"
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/time.h"
+#include "bthread/butex.h"
+#include "bvar/bvar.h"
+#include "brpc/errno.pb.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/ssl_handshake_pool.h"
+
+
+namespace brpc {
+
+DEFINE_int32(ssl_handshake_threads, 0,
+             "Run SSL handshakes in so many pthreads dedicated to handshakes "
+             "instead of bthread workers, to cap CPU of handshakes. Read "
+             "when the first handshake runs with a positive value. "
+             "Non-positive values mean running in bthread workers");
+DEFINE_int32(ssl_handshake_max_queue, 1024,
+             "Fail SSL handshakes when so many of them are waiting for "
+             "-ssl_handshake_threads, non-positive values mean unlimited");
+BRPC_VALIDATE_GFLAG(ssl_handshake_max_queue, PassValidate);
+
+static void RunStep(SSL* ssl, SSLHandshakeStep* step) {
+    ERR_clear_error();
+    step->rc = SSL_do_handshake(ssl);
+    if (step->rc == 1) {
+        step->ssl_error = SSL_ERROR_NONE;
+        step->error = 0;
+    } else {
+        step->ssl_error = SSL_get_error(ssl, step->rc);
+        step->error = ERR_get_error();
+    }
+    step->saved_errno = errno;
+}
+
+static int64_t GetHandshakeQueueSize(void* arg);
+
+class SSLHandshakePool {
+public:
+    explicit SSLHandshakePool(int nthreads)
+        : _nwaiting(0)
+        , _queue_size_var("rpc_ssl_handshake_queue_size",
+                          GetHandshakeQueueSize, this) {
+        pthread_mutex_init(&_mutex, NULL);
+        pthread_cond_init(&_cond, NULL);
+        _queue_latency.expose("rpc_ssl_handshake_queue");
+        for (int i = 0; i < nthreads; ++i) {
+            pthread_t th;
+            const int rc = pthread_create(&th, NULL, RunPthread, this);
+            if (rc != 0) {
+                LOG(ERROR) << "Fail to create pthread of SSL handshakes: "
+                           << berror(rc);
+                continue;
+            }
+            _threads.push_back(th);
+        }
+        LOG(INFO) << "Run SSL handshakes in " << _threads.size()
+                  << " pthreads";
+    }
+
+    int Run(SSL* ssl, SSLHandshakeStep* step) {
+        const int64_t max_queue = FLAGS_ssl_handshake_max_queue;
+        const int64_t nwaiting =
+            _nwaiting.fetch_add(1, butil::memory_order_relaxed);
+        if (_threads.empty() || (max_queue > 0 && nwaiting >= max_queue)) {
+            _nwaiting.fetch_sub(1, butil::memory_order_relaxed);
+            errno = ELIMIT;
+            return -1;
+        }
+        Task task;
+        task.ssl = ssl;
+        task.step = step;
+        task.enqueue_us = butil::cpuwide_time_us();
+        task.done = bthread::butex_create_checked<butil::atomic<int> >();
+        task.done->store(0, butil::memory_order_relaxed);
+        pthread_mutex_lock(&_mutex);
+        _queue.push_back(&task);
+        pthread_mutex_unlock(&_mutex);
+        pthread_cond_signal(&_cond);
+        // Only the bthread is blocked, the worker runs other bthreads.
+        while (task.done->load(butil::memory_order_acquire) == 0) {
+            bthread::butex_wait(task.done, 0, NULL);
+        }
+        bthread::butex_destroy(task.done);
+        return 0;
+    }
+
+    int64_t queue_size() const {
+        return _nwaiting.load(butil::memory_order_relaxed);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SSLHandshakePool);
+
+    struct Task {
+        SSL* ssl;
+        SSLHandshakeStep* step;
+        int64_t enqueue_us;
+        butil::atomic<int>* done;
+    };
+
+    static void* RunPthread(void* arg) {
+        static_cast<SSLHandshakePool*>(arg)->PthreadLoop();
+        return NULL;
+    }
+
+    void PthreadLoop() {
+        while (true) {
+            Task* task = NULL;
+            {
+                BAIDU_SCOPED_LOCK(_mutex);
+                while (_queue.empty()) {
+                    pthread_cond_wait(&_cond, &_mutex);
+                }
+                task = _queue.front();
+                _queue.pop_front();
+            }
+            _nwaiting.fetch_sub(1, butil::memory_order_relaxed);
+            _queue_latency << (butil::cpuwide_time_us() - task->enqueue_us);
+            RunStep(task->ssl, task->step);
+            // `task' is on the stack of the waiting bthread, which may
+            // return once `done' is set. The butex is never returned to
+            // the OS, waking it after being destroyed is harmless.
+            butil::atomic<int>* done = task->done;
+            done->store(1, butil::memory_order_release);
+            bthread::butex_wake(done);
+        }
+    }
+
+    butil::atomic<int64_t> _nwaiting;
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    std::deque<Task*> _queue;
+    std::vector<pthread_t> _threads;
+    // Time that handshakes wait for the pool.
+    bvar::LatencyRecorder _queue_latency;
+    bvar::PassiveStatus<int64_t> _queue_size_var;
+};
+
+static int64_t GetHandshakeQueueSize(void* arg) {
+    return static_cast<SSLHandshakePool*>(arg)->queue_size();
+}
+
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+static SSLHandshakePool* g_pool = NULL;
+
+static void CreateSSLHandshakePool() {
+    // Never destroyed, threads of the pool run until the process exits.
+    g_pool = new SSLHandshakePool(FLAGS_ssl_handshake_threads);
+}
+
+int DoSSLHandshakeStep(SSL* ssl, SSLHandshakeStep* step) {
+    if (FLAGS_ssl_handshake_threads <= 0) {
+        RunStep(ssl, step);
+        return 0;
+    }
+    pthread_once(&g_pool_once, CreateSSLHandshakePool);
+    return g_pool->Run(ssl, step);
+}
+
+} // namespace brpc
@@ -0,0 +1,50 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_SSL_HANDSHAKE_POOL_H
+#define BRPC_SSL_HANDSHAKE_POOL_H
+
+#include "brpc/details/ssl_helper.h"          // SSL
+
+
+namespace brpc {
+
+// Result of one SSL_do_handshake().
+struct SSLHandshakeStep {
+    int rc;                 // Returned by SSL_do_handshake
+    int ssl_error;          // SSL_get_error() of `rc'
+    // ERR_get_error() after a failure, which has to be read in the thread
+    // running SSL_do_handshake because the error queue is thread-local.
+    unsigned long error;
+    int saved_errno;
+};
+
+// Run SSL_do_handshake(ssl) in pthreads dedicated to handshakes when
+// -ssl_handshake_threads is positive, blocking the calling bthread (not
+// the worker), or in the calling thread otherwise. Handshakes are
+// CPU-heavy(RSA/ECDHE), a storm of reconnections occupying all workers
+// starves other RPC traffic, while handshakes running in the pool are
+// capped by the number of threads in the pool.
+// Returns 0 with `step' filled, -1 with errno=ELIMIT when more than
+// -ssl_handshake_max_queue handshakes are waiting for the pool.
+int DoSSLHandshakeStep(SSL* ssl, SSLHandshakeStep* step);
+
+} // namespace brpc
+
+
+#endif  // BRPC_SSL_HANDSHAKE_POOL_H
@@ -20,6 +20,8 @@
 #ifndef USE_MESALINK
 
 #include <sys/socket.h>                // recv
+#include <map>
+#include <gflags/gflags.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/x509.h>
@@ -28,11 +30,16 @@
 #include "butil/logging.h"
 #include "butil/ssl_compat.h"
 #include "butil/string_splitter.h"
+#include "butil/scoped_lock.h"
 #include "brpc/socket.h"
 #include "brpc/details/ssl_helper.h"
 
 namespace brpc {
 
+DEFINE_int32(ssl_client_session_cache_size, 4096,
+             "Max number of client SSL sessions cached for resumption, "
+             "one for each server and SNI");
+
 #ifndef OPENSSL_NO_DH
 static DH* g_dh_1024 = NULL;
 static DH* g_dh_2048 = NULL;
@@ -441,6 +448,124 @@ static int SetSSLOptions(SSL_CTX* ctx, const std::string& ciphers,
     return 0;
 }
 
+// Sessions are keyed by SSL_CTX so that connections with different
+// configurations(namely verification) never resume sessions of each other.
+typedef std::map<std::string, SSL_SESSION*> ClientSSLSessionMap;
+static pthread_mutex_t g_client_session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ClientSSLSessionMap* g_client_sessions = NULL;
+static pthread_once_t g_session_key_index_once = PTHREAD_ONCE_INIT;
+static int g_session_key_index = -1;
+
+static std::string ClientSSLSessionKey(SSL_CTX* ctx,
+                                       const butil::EndPoint& remote,
+                                       const std::string& sni_name) {
+    std::string key((const char*)&ctx, sizeof(ctx));
+    key.append(butil::endpoint2str(remote).c_str());
+    key.push_back('|');
+    key.append(sni_name);
+    return key;
+}
+
+static void FreeSessionKey(void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) {
+    delete static_cast<std::string*>(ptr);
+}
+
+static void CreateSessionKeyIndex() {
+    g_session_key_index = SSL_get_ex_new_index(0, NULL, NULL, NULL,
+                                               FreeSessionKey);
+}
+
+static int OnNewClientSSLSession(SSL* ssl, SSL_SESSION* session) {
+    const std::string* key = NULL;
+    if (g_session_key_index >= 0) {
+        key = static_cast<std::string*>(
+            SSL_get_ex_data(ssl, g_session_key_index));
+    }
+    if (key == NULL || FLAGS_ssl_client_session_cache_size <= 0) {
+        return 0;
+    }
+    SSL_SESSION* replaced = NULL;
+    {
+        BAIDU_SCOPED_LOCK(g_client_session_mutex);
+        if (g_client_sessions == NULL) {
+            g_client_sessions = new ClientSSLSessionMap;
+        }
+        SSL_SESSION*& slot = (*g_client_sessions)[*key];
+        replaced = slot;
+        slot = session;
+        if (replaced == NULL && g_client_sessions->size() >
+            (size_t)FLAGS_ssl_client_session_cache_size) {
+            // Evict an arbitrary one, the cache is a hint anyway.
+            ClientSSLSessionMap::iterator it = g_client_sessions->begin();
+            if (it->second == session) {
+                ++it;
+            }
+            replaced = it->second;
+            g_client_sessions->erase(it);
+        }
+    }
+    if (replaced) {
+        SSL_SESSION_free(replaced);
+    }
+    // Take the ownership of `session'
+    return 1;
+}
+
+bool ResumeClientSSLSession(SSL* ssl, const butil::EndPoint& remote,
+                            const std::string& sni_name) {
+    pthread_once(&g_session_key_index_once, CreateSessionKeyIndex);
+    if (g_session_key_index < 0) {
+        return false;
+    }
+    std::string* key = new std::string(
+        ClientSSLSessionKey(SSL_get_SSL_CTX(ssl), remote, sni_name));
+    SSL_SESSION* session = NULL;
+    {
+        BAIDU_SCOPED_LOCK(g_client_session_mutex);
+        if (g_client_sessions != NULL) {
+            ClientSSLSessionMap::iterator it = g_client_sessions->find(*key);
+            if (it != g_client_sessions->end()) {
+                session = it->second;
+                SSL_SESSION_up_ref(session);
+            }
+        }
+    }
+    // Owned by `ssl' from now on.
+    SSL_set_ex_data(ssl, g_session_key_index, key);
+    if (session == NULL) {
+        return false;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    const bool ok = (SSL_SESSION_is_resumable(session) &&
+                     SSL_set_session(ssl, session) == 1);
+#else
+    const bool ok = (SSL_set_session(ssl, session) == 1);
+#endif
+    SSL_SESSION_free(session);
+    return ok;
+}
+
+void RemoveClientSSLSessions(SSL_CTX* ctx) {
+    const std::string prefix((const char*)&ctx, sizeof(ctx));
+    std::vector<SSL_SESSION*> removed;
+    {
+        BAIDU_SCOPED_LOCK(g_client_session_mutex);
+        if (g_client_sessions == NULL) {
+            return;
+        }
+        ClientSSLSessionMap::iterator it =
+            g_client_sessions->lower_bound(prefix);
+        while (it != g_client_sessions->end() &&
+               it->first.compare(0, prefix.size(), prefix) == 0) {
+            removed.push_back(it->second);
+            g_client_sessions->erase(it++);
+        }
+    }
+    for (size_t i = 0; i < removed.size(); ++i) {
+        SSL_SESSION_free(removed[i]);
+    }
+}
+
 SSL_CTX* CreateClientSSLContext(const ChannelSSLOptions& options) {
     std::unique_ptr<SSL_CTX, FreeSSLCTX> ssl_ctx(
         SSL_CTX_new(SSLv23_client_method()));
@@ -463,7 +588,10 @@ SSL_CTX* CreateClientSSLContext(const ChannelSSLOptions& options) {
         return NULL;
     }
 
-    SSL_CTX_set_session_cache_mode(ssl_ctx.get(), SSL_SESS_CACHE_CLIENT);
+    // Sessions are cached by ResumeClientSSLSession rather than SSL_CTX.
+    SSL_CTX_set_session_cache_mode(
+        ssl_ctx.get(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx.get(), OnNewClientSSLSession);
     return ssl_ctx.release();
 }
 
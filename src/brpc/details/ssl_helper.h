@@ -29,6 +29,7 @@
 #include <mesalink/openssl/err.h>
 #include <mesalink/openssl/x509.h>
 #endif
+#include "butil/endpoint.h"            // butil::EndPoint
 #include "brpc/socket_id.h"            // SocketId
 #include "brpc/ssl_options.h"          // ServerSSLOptions
 
@@ -94,6 +95,16 @@ SSL* CreateSSLSession(SSL_CTX* ctx, SocketId id, int fd, bool server_mode);
 // which can reduce the total number of calls to system read/write
 void AddBIOBuffer(SSL* ssl, int fd, int bufsize);
 
+// Resume client session `ssl' with the session cached by the last
+// connection to `remote' using the same SSL_CTX and `sni_name', and cache
+// new sessions(or TLS 1.3 tickets) received by `ssl' for later connections.
+// Returns true if a cached session was set.
+bool ResumeClientSSLSession(SSL* ssl, const butil::EndPoint& remote,
+                            const std::string& sni_name);
+
+// Remove sessions cached for `ctx' which is going to be freed.
+void RemoveClientSSLSessions(SSL_CTX* ctx);
+
 // Judge whether the underlying channel of `fd' is using SSL
 // If the return value is SSL_UNKNOWN, `error_code' will be
 // set to indicate the reason (0 for EOF)
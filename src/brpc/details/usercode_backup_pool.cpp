@@ -16,10 +16,13 @@
 // under the License.
 
 
+#include <errno.h>
+#include <algorithm>
 #include <deque>
 #include <vector>
 #include <gflags/gflags.h>
 #include "butil/scoped_lock.h"
+#include "bvar/bvar.h"
 #ifdef BAIDU_INTERNAL
 #include "butil/comlog_sink.h"
 #endif
@@ -35,20 +38,37 @@ namespace brpc {
 
 DEFINE_int32(usercode_backup_threads, 5, "# of backup threads to run user code"
              " when too many pthread worker of bthreads are used");
+DEFINE_int32(usercode_backup_max_threads, 64, "Max # of backup threads to"
+             " run user code. Threads are created when all backup threads are"
+             " busy and quit after idle for -usercode_backup_idle_timeout_ms,"
+             " until # of threads is -usercode_backup_threads. No more threads"
+             " are created if this value is not greater than"
+             " -usercode_backup_threads");
+DEFINE_int32(usercode_backup_idle_timeout_ms, 10000, "Backup threads more than"
+             " -usercode_backup_threads quit after idle for so many"
+             " milliseconds");
 DEFINE_int32(max_pending_in_each_backup_thread, 10,
-             "Max number of un-run user code in each backup thread, requests"
-             " still coming in will be failed");
+             "Max number of un-run user code in each backup thread (counted"
+             " by -usercode_backup_max_threads), requests still coming in will"
+             " be failed");
 
 // Store pending user code.
 struct UserCode {
     void (*fn)(void*);
     void* arg;
+    int64_t enqueue_time_us;
 };
 struct UserCodeBackupPool {
     // Run user code when parallelism of user code reaches the threshold
     std::deque<UserCode> queue;
+    // Number of all/idle backup threads, protected by s_usercode_mutex.
+    int nthreads;
+    int nidle;
     bvar::PassiveStatus<int> inplace_var;
     bvar::PassiveStatus<size_t> queue_size_var;
+    bvar::PassiveStatus<int> nthreads_var;
+    // Time that user code waits in the queue.
+    bvar::LatencyRecorder queue_latency;
     bvar::Adder<size_t> inpool_count;
     bvar::PerSecond<bvar::Adder<size_t> > inpool_per_second;
     // NOTE: we don't use Adder<double> directly which does not compile in gcc 3.4
@@ -58,6 +78,11 @@ struct UserCodeBackupPool {
 
     UserCodeBackupPool();
     int Init();
+    // True if all threads are busy and the number of threads is less than
+    // the cap. Called with s_usercode_mutex locked.
+    bool ShouldAddThread() const;
+    // Create a thread, `nthreads' should be increased before calling this.
+    int StartThread();
     void UserCodeRunningLoop();
 };
 
@@ -77,13 +102,28 @@ static size_t GetUserCodeQueueSize(void*) {
     return (s_usercode_pool != NULL ? s_usercode_pool->queue.size() : 0);
 }
 
+static int GetUserCodeBackupThreads(void*) {
+    BAIDU_SCOPED_LOCK(s_usercode_mutex);
+    return (s_usercode_pool != NULL ? s_usercode_pool->nthreads : 0);
+}
+
+static int GetMaxUserCodeBackupThreads() {
+    return std::max(FLAGS_usercode_backup_max_threads,
+                    FLAGS_usercode_backup_threads);
+}
+
 static double GetInPoolElapseInSecond(void* arg) {
     return static_cast<bvar::Adder<int64_t>*>(arg)->get_value() / 1000000.0;
 }
 
 UserCodeBackupPool::UserCodeBackupPool()
-    : inplace_var("rpc_usercode_inplace", GetUserCodeInPlace, NULL)
+    : nthreads(0)
+    , nidle(0)
+    , inplace_var("rpc_usercode_inplace", GetUserCodeInPlace, NULL)
     , queue_size_var("rpc_usercode_queue_size", GetUserCodeQueueSize, NULL)
+    , nthreads_var("rpc_usercode_backup_threads",
+                   GetUserCodeBackupThreads, NULL)
+    , queue_latency("rpc_usercode_queue")
     , inpool_count("rpc_usercode_backup_count")
     , inpool_per_second("rpc_usercode_backup_second", &inpool_count)
     , inpool_elapse_s(GetInPoolElapseInSecond, &inpool_elapse_us)
@@ -97,17 +137,40 @@ static void* UserCodeRunner(void* args) {
 
 int UserCodeBackupPool::Init() {
     // Like bthread workers, these threads never quit (to avoid potential hang
-    // during termination of program).
+    // during termination of program). Threads created later for bursts of
+    // user code quit after being idle for a while.
     for (int i = 0; i < FLAGS_usercode_backup_threads; ++i) {
-        pthread_t th;
-        if (pthread_create(&th, NULL, UserCodeRunner, this) != 0) {
-            LOG(ERROR) << "Fail to create UserCodeRunner";
+        {
+            BAIDU_SCOPED_LOCK(s_usercode_mutex);
+            ++nthreads;
+        }
+        if (StartThread() != 0) {
             return -1;
         }
     }
     return 0;
 }
 
+bool UserCodeBackupPool::ShouldAddThread() const {
+    return nidle < (int)queue.size() && nthreads < GetMaxUserCodeBackupThreads();
+}
+
+int UserCodeBackupPool::StartThread() {
+    pthread_t th;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    const int rc = pthread_create(&th, &attr, UserCodeRunner, this);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        LOG(ERROR) << "Fail to create UserCodeRunner: " << berror(rc);
+        BAIDU_SCOPED_LOCK(s_usercode_mutex);
+        --nthreads;
+        return -1;
+    }
+    return 0;
+}
+
 // Entry of backup thread for running user code.
 void UserCodeBackupPool::UserCodeRunningLoop() {
     bthread::run_worker_startfn();
@@ -118,21 +181,38 @@ void UserCodeBackupPool::UserCodeRunningLoop() {
     int64_t last_time = butil::cpuwide_time_us();
     while (true) {
         bool blocked = false;
-        UserCode usercode = { NULL, NULL };
+        UserCode usercode = { NULL, NULL, 0 };
         {
             BAIDU_SCOPED_LOCK(s_usercode_mutex);
             while (queue.empty()) {
-                pthread_cond_wait(&s_usercode_cond, &s_usercode_mutex);
+                ++nidle;
+                if (nthreads > FLAGS_usercode_backup_threads) {
+                    const timespec abstime = butil::milliseconds_from_now(
+                        FLAGS_usercode_backup_idle_timeout_ms);
+                    const int rc = pthread_cond_timedwait(
+                        &s_usercode_cond, &s_usercode_mutex, &abstime);
+                    --nidle;
+                    if (rc == ETIMEDOUT && queue.empty() &&
+                        nthreads > FLAGS_usercode_backup_threads) {
+                        --nthreads;
+                        return;
+                    }
+                } else {
+                    pthread_cond_wait(&s_usercode_cond, &s_usercode_mutex);
+                    --nidle;
+                }
                 blocked = true;
             }
             usercode = queue.front();
             queue.pop_front();
             if (g_too_many_usercode &&
-                (int)queue.size() <= FLAGS_usercode_backup_threads) {
+                (int)queue.size() <= nthreads) {
                 g_too_many_usercode = false;
             }
         }
         const int64_t begin_time = (blocked ? butil::cpuwide_time_us() : last_time);
+        queue_latency << (begin_time > usercode.enqueue_time_us ?
+                          begin_time - usercode.enqueue_time_us : 0);
         usercode.fn(usercode.arg);
         const int64_t end_time = butil::cpuwide_time_us();
         inpool_count << 1;
@@ -164,7 +244,7 @@ void EndRunningUserCodeInPool(void (*fn)(void*), void* arg) {
     // Not enough idle workers, run the code in backup threads to prevent
     // all workers from being blocked and no responses will be processed
     // anymore (deadlocked).
-    const UserCode usercode = { fn, arg };
+    const UserCode usercode = { fn, arg, butil::cpuwide_time_us() };
     pthread_mutex_lock(&s_usercode_mutex);
     s_usercode_pool->queue.push_back(usercode);
     // If the queue has too many items, we can't drop the user code
@@ -173,12 +253,21 @@ void EndRunningUserCodeInPool(void (*fn)(void*), void* arg) {
     // queue becomes short again. RPC code checks the mark before
     // submitting tasks that may generate more user code.
     if ((int)s_usercode_pool->queue.size() >=
-        (FLAGS_usercode_backup_threads *
+        (GetMaxUserCodeBackupThreads() *
          FLAGS_max_pending_in_each_backup_thread)) {
         g_too_many_usercode = true;
     }
+    // All threads are busy (probably blocked by user code), add a thread
+    // rather than letting the user code wait.
+    const bool add_thread = s_usercode_pool->ShouldAddThread();
+    if (add_thread) {
+        ++s_usercode_pool->nthreads;
+    }
     pthread_mutex_unlock(&s_usercode_mutex);
     pthread_cond_signal(&s_usercode_cond);
+    if (add_thread) {
+        s_usercode_pool->StartThread();
+    }
 }
 
 } // namespace brpc
@@ -34,6 +34,10 @@ DECLARE_int32(usercode_backup_threads);
 // -usercode_in_pthread is on. These threads are NOT supposed to be active
 // frequently, if they're, user should configure more num_threads for the
 // server or set -bthread_concurrency to a larger value.
+// When all backup threads are blocked by user code, more threads are created
+// (at most -usercode_backup_max_threads) and quit after being idle for a
+// while. Time that user code waits for backup threads is exported as
+// bvar rpc_usercode_queue_latency.
 
 // Run the user code in-place or in backup threads. The place depends on
 // busy-ness of bthread workers.
@@ -20,9 +20,14 @@
 #include "butil/compat.h"
 #include "butil/fd_utility.h"                         // make_close_on_exec
 #include "butil/logging.h"                            // LOG
+#include "butil/scoped_lock.h"                        // BAIDU_SCOPED_LOCK
+#include "butil/memory/singleton_on_pthread_once.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h"// fmix32
+#include "bvar/bvar.h"
 #include "bthread/bthread.h"                          // bthread_start_background
+#include "bthread/unstable.h"                         // bthread_fd_notify
 #include "brpc/event_dispatcher.h"
+#include "brpc/details/io_uring_poller.h"
 #ifdef BRPC_SOCKET_HAS_EOF
 #include "brpc/details/has_epollrdhup.h"
 #endif
@@ -40,17 +45,94 @@ DEFINE_int32(event_dispatcher_num, 1, "Number of event dispatcher");
 DEFINE_bool(usercode_in_pthread, false, 
             "Call user's callback in pthreads, use bthreads otherwise");
 
+DEFINE_bool(event_dispatcher_use_io_uring, false,
+            "[Linux >= 5.13] Watch events with io_uring instead of epoll, "
+            "adding/changing/removing events are queued in the ring rather "
+            "than being separate epoll_ctl calls. Only readiness is watched "
+            "by the ring, sockets are still read and written by readv/writev. "
+            "Falls back to epoll when io_uring is not supported");
+
+DEFINE_bool(io_uring_sqpoll, false,
+            "Consume io_uring submissions of event dispatchers in kernel "
+            "threads so that submitting needs no syscalls, at the cost of "
+            "a polling kernel thread per dispatcher");
+
+DEFINE_bool(bthread_fd_wait_in_event_dispatcher, false,
+            "Watch fds of bthread_fd_wait()/bthread_fd_timedwait() in bthreads "
+            "with event dispatchers (chosen by fd, io_uring is used as well "
+            "if it's on) instead of the separate epoll bthread of bthread. "
+            "Don't wait on fds of brpc's connections with this flag on. Read "
+            "at global initialization only");
+
+// Max events watched by one io_uring instance at the same time is not
+// limited by this value, which only limits the submissions in flight.
+static const unsigned IO_URING_ENTRIES = 4096;
+
+#ifdef BRPC_SOCKET_HAS_EOF
+static const uint32_t CONSUMER_EVENTS = EPOLLIN | has_epollrdhup;
+#else
+static const uint32_t CONSUMER_EVENTS = EPOLLIN;
+#endif
+
+// Events watched by AddFdWait() carry the fd in higher 32 bits and this
+// value in lower 32 bits, which are slots of SocketIds otherwise and never
+// reach the value.
+static const uint64_t FD_WAIT_TAG = 0xFFFFFFFFULL;
+
+inline uint64_t MakeFdWaitData(int fd) {
+    return ((uint64_t)(uint32_t)fd << 32) | FD_WAIT_TAG;
+}
+
+inline bool IsFdWaitData(uint64_t data) {
+    return (data & FD_WAIT_TAG) == FD_WAIT_TAG && data != INVALID_SOCKET_ID;
+}
+
+inline int FdOfFdWaitData(uint64_t data) {
+    return (int)(data >> 32);
+}
+
+#if defined(OS_LINUX)
+struct EpollCtlVars {
+    bvar::Adder<int64_t> count;
+    bvar::PerSecond<bvar::Adder<int64_t> > second;
+
+    EpollCtlVars()
+        : count("rpc_epoll_ctl_count")
+        , second("rpc_epoll_ctl_second", &count) {}
+};
+
+// epoll_ctl() counted in bvar rpc_epoll_ctl_count.
+static int EpollCtl(int epfd, int op, int fd, epoll_event* evt) {
+    butil::get_leaky_singleton<EpollCtlVars>()->count << 1;
+    return epoll_ctl(epfd, op, fd, evt);
+}
+#endif
+
 EventDispatcher::EventDispatcher()
     : _epfd(-1)
+    , _io_uring(NULL)
     , _stop(false)
     , _tid(0)
     , _consumer_thread_attr(BTHREAD_ATTR_NORMAL)
 {
 #if defined(OS_LINUX)
-    _epfd = epoll_create(1024 * 1024);
-    if (_epfd < 0) {
-        PLOG(FATAL) << "Fail to create epoll";
-        return;
+    if (FLAGS_event_dispatcher_use_io_uring) {
+        _io_uring = new IoUringPoller;
+        if (_io_uring->Init(IO_URING_ENTRIES, FLAGS_io_uring_sqpoll) != 0) {
+            PLOG(WARNING) << "Fail to create io_uring, use epoll instead";
+            delete _io_uring;
+            _io_uring = NULL;
+        } else {
+            CHECK_EQ(0, _fd_wait_polls.init(64));
+        }
+    }
+    if (_io_uring == NULL) {
+        _epfd = epoll_create(1024 * 1024);
+        if (_epfd < 0) {
+            PLOG(FATAL) << "Fail to create epoll";
+            return;
+        }
+        CHECK_EQ(0, butil::make_close_on_exec(_epfd));
     }
 #elif defined(OS_MACOSX)
     _epfd = kqueue();
@@ -61,7 +143,9 @@ EventDispatcher::EventDispatcher()
 #else
     #error Not implemented
 #endif
+#if defined(OS_MACOSX)
     CHECK_EQ(0, butil::make_close_on_exec(_epfd));
+#endif
 
     _wakeup_fds[0] = -1;
     _wakeup_fds[1] = -1;
@@ -78,6 +162,8 @@ EventDispatcher::~EventDispatcher() {
         close(_epfd);
         _epfd = -1;
     }
+    delete _io_uring;
+    _io_uring = NULL;
     if (_wakeup_fds[0] > 0) {
         close(_wakeup_fds[0]);
         close(_wakeup_fds[1]);
@@ -85,7 +171,7 @@ EventDispatcher::~EventDispatcher() {
 }
 
 int EventDispatcher::Start(const bthread_attr_t* consumer_thread_attr) {
-    if (_epfd < 0) {
+    if (_epfd < 0 && _io_uring == NULL) {
 #if defined(OS_LINUX)
         LOG(FATAL) << "epoll was not created";
 #elif defined(OS_MACOSX)
@@ -124,16 +210,23 @@ int EventDispatcher::Start(const bthread_attr_t* consumer_thread_attr) {
 }
 
 bool EventDispatcher::Running() const {
-    return !_stop  && _epfd >= 0 && _tid != 0;
+    return !_stop  && (_epfd >= 0 || _io_uring != NULL) && _tid != 0;
 }
 
 void EventDispatcher::Stop() {
     _stop = true;
 
+    if (_io_uring) {
+        // Completions with INVALID_SOCKET_ID are not reported, but still
+        // wake up the dispatcher to see _stop.
+        _io_uring->AddPoll(_wakeup_fds[1], EPOLLOUT, INVALID_SOCKET_ID);
+        return;
+    }
+
     if (_epfd >= 0) {
 #if defined(OS_LINUX)
         epoll_event evt = { EPOLLOUT,  { NULL } };
-        epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakeup_fds[1], &evt);
+        EpollCtl(_epfd, EPOLL_CTL_ADD, _wakeup_fds[1], &evt);
 #elif defined(OS_MACOSX)
         struct kevent kqueue_event;
         EV_SET(&kqueue_event, _wakeup_fds[1], EVFILT_WRITE, EV_ADD | EV_ENABLE,
@@ -151,6 +244,14 @@ void EventDispatcher::Join() {
 }
 
 int EventDispatcher::AddEpollOut(SocketId socket_id, int fd, bool pollin) {
+    if (_io_uring) {
+        // Errors of updating are not reported synchronously as epoll_ctl,
+        // callers wait for EPOLLOUT with timeout anyway.
+        if (pollin) {
+            return _io_uring->UpdatePoll(socket_id, CONSUMER_EVENTS | EPOLLOUT);
+        }
+        return _io_uring->AddPoll(fd, EPOLLOUT, socket_id);
+    }
     if (_epfd < 0) {
         errno = EINVAL;
         return -1;
@@ -165,13 +266,13 @@ int EventDispatcher::AddEpollOut(SocketId socket_id, int fd, bool pollin) {
 #endif
     if (pollin) {
         evt.events |= EPOLLIN;
-        if (epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &evt) < 0) {
+        if (EpollCtl(_epfd, EPOLL_CTL_MOD, fd, &evt) < 0) {
             // This fd has been removed from epoll via `RemoveConsumer',
             // in which case errno will be ENOENT
             return -1;
         }
     } else {
-        if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &evt) < 0) {
+        if (EpollCtl(_epfd, EPOLL_CTL_ADD, fd, &evt) < 0) {
             return -1;
         }
     }
@@ -196,6 +297,12 @@ int EventDispatcher::AddEpollOut(SocketId socket_id, int fd, bool pollin) {
 
 int EventDispatcher::RemoveEpollOut(SocketId socket_id, 
                                     int fd, bool pollin) {
+    if (_io_uring) {
+        if (pollin) {
+            return _io_uring->UpdatePoll(socket_id, CONSUMER_EVENTS);
+        }
+        return _io_uring->RemovePoll(socket_id);
+    }
 #if defined(OS_LINUX)
     if (pollin) {
         epoll_event evt;
@@ -204,9 +311,9 @@ int EventDispatcher::RemoveEpollOut(SocketId socket_id,
 #ifdef BRPC_SOCKET_HAS_EOF
         evt.events |= has_epollrdhup;
 #endif
-        return epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &evt);
+        return EpollCtl(_epfd, EPOLL_CTL_MOD, fd, &evt);
     } else {
-        return epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+        return EpollCtl(_epfd, EPOLL_CTL_DEL, fd, NULL);
     }
 #elif defined(OS_MACOSX)
     struct kevent evt;
@@ -224,7 +331,68 @@ int EventDispatcher::RemoveEpollOut(SocketId socket_id,
     return -1;
 }
 
+int EventDispatcher::AddFdWait(int fd, unsigned events) {
+    const uint64_t data = MakeFdWaitData(fd);
+    if (_io_uring) {
+        BAIDU_SCOPED_LOCK(_fd_wait_mutex);
+        if (_io_uring->AddOneShotPoll(fd, events, data) != 0) {
+            return -1;
+        }
+        ++_fd_wait_polls[fd];
+        return 0;
+    }
+    if (_epfd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+#if defined(OS_LINUX)
+    epoll_event evt;
+    evt.events = events | EPOLLONESHOT;
+    evt.data.u64 = data;
+    if (EpollCtl(_epfd, EPOLL_CTL_MOD, fd, &evt) < 0 &&
+        EpollCtl(_epfd, EPOLL_CTL_ADD, fd, &evt) < 0 &&
+        errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+#elif defined(OS_MACOSX)
+    struct kevent evt;
+    EV_SET(&evt, fd, events, EV_ADD | EV_ENABLE | EV_ONESHOT,
+                0, 0, (void*)data);
+    return kevent(_epfd, &evt, 1, NULL, 0, NULL);
+#endif
+    return -1;
+}
+
+int EventDispatcher::RemoveFdWait(int fd) {
+    if (_io_uring) {
+        BAIDU_SCOPED_LOCK(_fd_wait_mutex);
+        int* npoll = _fd_wait_polls.seek(fd);
+        if (npoll != NULL) {
+            for (int i = 0; i < *npoll; ++i) {
+                _io_uring->RemovePoll(MakeFdWaitData(fd));
+            }
+            _fd_wait_polls.erase(fd);
+        }
+        return 0;
+    }
+#if defined(OS_LINUX)
+    return EpollCtl(_epfd, EPOLL_CTL_DEL, fd, NULL);
+#elif defined(OS_MACOSX)
+    struct kevent evt;
+    EV_SET(&evt, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(_epfd, &evt, 1, NULL, 0, NULL);
+    EV_SET(&evt, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    kevent(_epfd, &evt, 1, NULL, 0, NULL);
+    return 0;
+#endif
+    return -1;
+}
+
 int EventDispatcher::AddConsumer(SocketId socket_id, int fd) {
+    if (_io_uring) {
+        return _io_uring->AddPoll(fd, CONSUMER_EVENTS, socket_id);
+    }
     if (_epfd < 0) {
         errno = EINVAL;
         return -1;
@@ -236,7 +404,7 @@ int EventDispatcher::AddConsumer(SocketId socket_id, int fd) {
 #ifdef BRPC_SOCKET_HAS_EOF
     evt.events |= has_epollrdhup;
 #endif
-    return epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &evt);
+    return EpollCtl(_epfd, EPOLL_CTL_ADD, fd, &evt);
 #elif defined(OS_MACOSX)
     struct kevent evt;
     EV_SET(&evt, fd, EVFILT_READ, EV_ADD | EV_ENABLE | EV_CLEAR,
@@ -246,10 +414,19 @@ int EventDispatcher::AddConsumer(SocketId socket_id, int fd) {
     return -1;
 }
 
-int EventDispatcher::RemoveConsumer(int fd) {
+int EventDispatcher::RemoveConsumer(SocketId socket_id, int fd) {
     if (fd < 0) {
         return -1;
     }
+    if (_io_uring) {
+        // Pending polls hold references to the file, the connection is not
+        // closed by close(fd) until the poll is removed.
+        if (_io_uring->RemovePoll(socket_id) < 0) {
+            PLOG(WARNING) << "Fail to remove fd=" << fd << " from io_uring";
+            return -1;
+        }
+        return 0;
+    }
     // Removing the consumer from dispatcher before closing the fd because
     // if process was forked and the fd is not marked as close-on-exec,
     // closing does not set reference count of the fd to 0, thus does not
@@ -258,7 +435,7 @@ int EventDispatcher::RemoveConsumer(int fd) {
     // epoll_wait will keep returning events of the fd continuously, making
     // program abnormal.
 #if defined(OS_LINUX)
-    if (epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+    if (EpollCtl(_epfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
         PLOG(WARNING) << "Fail to remove fd=" << fd << " from epfd=" << _epfd;
         return -1;
     }
@@ -277,7 +454,69 @@ void* EventDispatcher::RunThis(void* arg) {
     return NULL;
 }
 
+void EventDispatcher::RunIoUring() {
+    IoUringPoller::Event e[32];
+    while (!_stop) {
+        const int n = _io_uring->Wait(e, ARRAY_SIZE(e));
+        if (_stop) {
+            break;
+        }
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            PLOG(FATAL) << "Fail to wait io_uring";
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (IsFdWaitData(e[i].data)) {
+                // One-shot polls of AddFdWait() end after reporting.
+                const int fd = FdOfFdWaitData(e[i].data);
+                {
+                    BAIDU_SCOPED_LOCK(_fd_wait_mutex);
+                    int* npoll = _fd_wait_polls.seek(fd);
+                    if (npoll != NULL && --*npoll <= 0) {
+                        _fd_wait_polls.erase(fd);
+                    }
+                }
+                bthread_fd_notify(fd);
+                continue;
+            }
+            if (e[i].stopped) {
+                // The kernel stopped the multishot poll (namely CQ overflow),
+                // watch the same events again including EPOLLOUT of pending
+                // writes. Events lost in-between are not a problem because
+                // the fd is checked after re-adding. Removed polls (e.g. the
+                // socket was closed) stay removed.
+                _io_uring->RearmPoll(e[i].data);
+            }
+            if (e[i].events & EPOLLERR) {
+                Socket::HandleZeroCopyCompletion(e[i].data);
+            }
+            if (e[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)
+#ifdef BRPC_SOCKET_HAS_EOF
+                || (e[i].events & has_epollrdhup)
+#endif
+                ) {
+                Socket::StartInputEvent(e[i].data, e[i].events,
+                                        _consumer_thread_attr);
+            }
+        }
+        for (int i = 0; i < n; ++i) {
+            if (IsFdWaitData(e[i].data)) {
+                continue;
+            }
+            if (e[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                Socket::HandleEpollOut(e[i].data);
+            }
+        }
+    }
+}
+
 void EventDispatcher::Run() {
+    if (_io_uring) {
+        return RunIoUring();
+    }
     while (!_stop) {
 #if defined(OS_LINUX)
         epoll_event e[32];
@@ -314,6 +553,15 @@ void EventDispatcher::Run() {
         }
         for (int i = 0; i < n; ++i) {
 #if defined(OS_LINUX)
+            if (IsFdWaitData(e[i].data.u64)) {
+                bthread_fd_notify(FdOfFdWaitData(e[i].data.u64));
+                continue;
+            }
+            if (e[i].events & EPOLLERR) {
+                // Completions of MSG_ZEROCOPY writes are notified via the
+                // error queue, reap them before the socket sees the event.
+                Socket::HandleZeroCopyCompletion(e[i].data.u64);
+            }
             if (e[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)
 #ifdef BRPC_SOCKET_HAS_EOF
                 || (e[i].events & has_epollrdhup)
@@ -324,6 +572,10 @@ void EventDispatcher::Run() {
                                         _consumer_thread_attr);
             }
 #elif defined(OS_MACOSX)
+            if (IsFdWaitData((uint64_t)e[i].udata)) {
+                bthread_fd_notify(FdOfFdWaitData((uint64_t)e[i].udata));
+                continue;
+            }
             if ((e[i].flags & EV_ERROR) || e[i].filter == EVFILT_READ) {
                 // We don't care about the return value.
                 Socket::StartInputEvent((SocketId)e[i].udata, e[i].filter,
@@ -333,11 +585,17 @@ void EventDispatcher::Run() {
         }
         for (int i = 0; i < n; ++i) {
 #if defined(OS_LINUX)
+            if (IsFdWaitData(e[i].data.u64)) {
+                continue;
+            }
             if (e[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
                 // We don't care about the return value.
                 Socket::HandleEpollOut(e[i].data.u64);
             }
 #elif defined(OS_MACOSX)
+            if (IsFdWaitData((uint64_t)e[i].udata)) {
+                continue;
+            }
             if ((e[i].flags & EV_ERROR) || e[i].filter == EVFILT_WRITE) {
                 // We don't care about the return value.
                 Socket::HandleEpollOut((SocketId)e[i].udata);
@@ -377,4 +635,26 @@ EventDispatcher& GetGlobalEventDispatcher(int fd) {
     return g_edisp[index];
 }
 
+EventDispatcher& GetGlobalEventDispatcherAt(int index) {
+    pthread_once(&g_edisp_once, InitializeGlobalDispatchers);
+    return g_edisp[(unsigned)index % FLAGS_event_dispatcher_num];
+}
+
+static int WatchFdWait(int fd, unsigned events) {
+    return GetGlobalEventDispatcher(fd).AddFdWait(fd, events);
+}
+
+static int UnwatchFdWait(int fd) {
+    return GetGlobalEventDispatcher(fd).RemoveFdWait(fd);
+}
+
+int UseGlobalEventDispatchersForFdWait() {
+    const bthread_fd_poller_t poller = { WatchFdWait, UnwatchFdWait };
+    if (bthread_set_fd_poller(&poller) != 0) {
+        PLOG(WARNING) << "Fail to set poller of bthread_fd_wait";
+        return -1;
+    }
+    return 0;
+}
+
 } // namespace brpc
@@ -20,12 +20,16 @@
 #define BRPC_EVENT_DISPATCHER_H
 
 #include "butil/macros.h"                     // DISALLOW_COPY_AND_ASSIGN
+#include "butil/containers/flat_map.h"        // butil::FlatMap
+#include "butil/synchronization/lock.h"       // butil::Mutex
 #include "bthread/types.h"                   // bthread_t, bthread_attr_t
 #include "brpc/socket.h"                     // Socket, SocketId
 
 
 namespace brpc {
 
+class IoUringPoller;
+
 // Dispatch edge-triggered events of file descriptors to consumers
 // running in separate bthreads.
 class EventDispatcher {
@@ -44,6 +48,9 @@ public:
     // True iff this dispatcher is running in a bthread
     bool Running() const;
 
+    // True if events are watched with io_uring instead of epoll.
+    bool UsingIoUring() const { return _io_uring != NULL; }
+
     // Stop bthread of this dispatcher.
     void Stop();
 
@@ -70,6 +77,14 @@ public:
     // Returns 0 on success, -1 otherwise and errno is set
     int RemoveEpollOut(SocketId socket_id, int fd, bool pollin);
 
+    // Watch `events' of `fd' once for bthread_fd_wait(), bthread_fd_notify()
+    // is called when any of them happens.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int AddFdWait(int fd, unsigned events);
+
+    // Stop watching `fd' added by AddFdWait(), called before closing `fd'.
+    int RemoveFdWait(int fd);
+
 private:
     DISALLOW_COPY_AND_ASSIGN(EventDispatcher);
 
@@ -79,12 +94,20 @@ private:
     // Thread entry.
     void Run();
 
-    // Remove the file descriptor `fd' from epoll.
-    int RemoveConsumer(int fd);
+    // Remove the file descriptor `fd' added by AddConsumer(socket_id, fd)
+    // from epoll.
+    int RemoveConsumer(SocketId socket_id, int fd);
+
+    // Loop of the io_uring engine.
+    void RunIoUring();
 
     // The epoll to watch events.
     int _epfd;
 
+    // Non-NULL when -event_dispatcher_use_io_uring is on and io_uring is
+    // supported by the kernel, which replaces _epfd to watch events.
+    IoUringPoller* _io_uring;
+
     // false unless Stop() is called.
     volatile bool _stop;
 
@@ -99,10 +122,26 @@ private:
 
     // Pipe fds to wakeup EventDispatcher from `epoll_wait' in order to quit
     int _wakeup_fds[2];
+
+    // Number of pending one-shot polls of each fd added by AddFdWait() to
+    // _io_uring, which are all removed by RemoveFdWait().
+    butil::Mutex _fd_wait_mutex;
+    butil::FlatMap<int, int> _fd_wait_polls;
 };
 
 EventDispatcher& GetGlobalEventDispatcher(int fd);
 
+// Get the dispatcher at `index' (modulo -event_dispatcher_num) instead of
+// the one chosen by fd, so that several fds can be pinned to one dispatcher.
+EventDispatcher& GetGlobalEventDispatcherAt(int index);
+
+// Let bthread_fd_wait() and bthread_fd_timedwait() in bthreads watch fds
+// with the global dispatchers (chosen by fd) instead of the epoll bthreads
+// of bthread. Called at global initialization if
+// -bthread_fd_wait_in_event_dispatcher is on.
+// Returns 0 on success, -1 otherwise.
+int UseGlobalEventDispatchersForFdWait();
+
 } // namespace brpc
 
 
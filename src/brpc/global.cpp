@@ -28,6 +28,7 @@
 #include <signal.h>
 
 #include "butil/build_config.h"                  // OS_LINUX
+#include "butil/pool_registry.h"                 // trim_object_pools
 // Naming services
 #ifdef BAIDU_INTERNAL
 #include "brpc/policy/baidu_naming_service.h"
@@ -45,7 +46,11 @@
 #include "brpc/policy/randomized_load_balancer.h"
 #include "brpc/policy/weighted_randomized_load_balancer.h"
 #include "brpc/policy/locality_aware_load_balancer.h"
+#include "brpc/policy/p2c_load_balancer.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
 #include "brpc/policy/consistent_hashing_load_balancer.h"
+#include "brpc/policy/maglev_load_balancer.h"
+#include "brpc/policy/jump_hash_load_balancer.h"
 #include "brpc/policy/hasher.h"
 #include "brpc/policy/dynpart_load_balancer.h"
 
@@ -53,6 +58,8 @@
 #include "brpc/compress.h"
 #include "brpc/policy/gzip_compress.h"
 #include "brpc/policy/snappy_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
 
 // Protocols
 #include "brpc/protocol.h"
@@ -79,12 +86,15 @@
 #include "brpc/concurrency_limiter.h"
 #include "brpc/policy/auto_concurrency_limiter.h"
 #include "brpc/policy/constant_concurrency_limiter.h"
+#include "brpc/policy/gradient_concurrency_limiter.h"
 
 #include "brpc/input_messenger.h"     // get_or_new_client_side_messenger
 #include "brpc/socket_map.h"          // SocketMapList
 #include "brpc/server.h"
 #include "brpc/trackme.h"             // TrackMe
 #include "brpc/details/usercode_backup_pool.h"
+#include "brpc/hugepage_block_allocator.h"
+#include "brpc/event_dispatcher.h"    // UseGlobalEventDispatchersForFdWait
 #if defined(OS_LINUX)
 #include <malloc.h>                   // malloc_trim
 #endif
@@ -99,12 +109,19 @@ void BAIDU_WEAK MallocExtension_ReleaseFreeMemory(void);
 namespace brpc {
 
 DECLARE_bool(usercode_in_pthread);
+DECLARE_int32(iobuf_hugepage_max_arenas);
+DECLARE_bool(bthread_fd_wait_in_event_dispatcher);
 
 DEFINE_int32(free_memory_to_system_interval, 0,
              "Try to return free memory to system every so many seconds, "
              "values <= 0 disables this feature");
 BRPC_VALIDATE_GFLAG(free_memory_to_system_interval, PassValidate);
 
+DEFINE_int32(object_pool_trim_interval, 0,
+             "Free blocks of trimmable ObjectPools whose objects are all "
+             "returned every so many seconds, values <= 0 disables this feature");
+BRPC_VALIDATE_GFLAG(object_pool_trim_interval, PassValidate);
+
 namespace policy {
 // Defined in http_rpc_protocol.cpp
 void InitCommonStrings();
@@ -140,13 +157,18 @@ struct GlobalExtensions {
     RandomizedLoadBalancer randomized_lb;
     WeightedRandomizedLoadBalancer wr_lb;
     LocalityAwareLoadBalancer la_lb;
+    P2CLoadBalancer p2c_lb;
+    ZoneAwareLoadBalancer zone_aware_lb;
     ConsistentHashingLoadBalancer ch_mh_lb;
     ConsistentHashingLoadBalancer ch_md5_lb;
     ConsistentHashingLoadBalancer ch_ketama_lb;
+    MaglevLoadBalancer ch_maglev_lb;
+    JumpHashLoadBalancer ch_jump_lb;
     DynPartLoadBalancer dynpart_lb;
 
     AutoConcurrencyLimiter auto_cl;
     ConstantConcurrencyLimiter constant_cl;
+    GradientConcurrencyLimiter gradient_cl;
 };
 
 static pthread_once_t register_extensions_once = PTHREAD_ONCE_INIT;
@@ -227,6 +249,7 @@ static void* GlobalUpdate(void*) {
     int64_t last_time_us = start_time_us;
     int consecutive_nosleep = 0;
     int64_t last_return_free_memory_time = start_time_us;
+    int64_t last_trim_object_pools_time = start_time_us;
     while (1) {
         const int64_t sleep_us = 1000000L + last_time_us - butil::gettimeofday_us();
         if (sleep_us > 0) {
@@ -263,6 +286,16 @@ static void* GlobalUpdate(void*) {
             }
         }
 
+        const int trim_interval = FLAGS_object_pool_trim_interval/*reloadable*/;
+        if (trim_interval > 0 &&
+            last_time_us >= last_trim_object_pools_time +
+            trim_interval * 1000000L) {
+            last_trim_object_pools_time = last_time_us;
+            // Before returning free memory so that freed blocks are returned
+            // in the same round.
+            butil::trim_object_pools();
+        }
+
         const int return_mem_interval =
             FLAGS_free_memory_to_system_interval/*reloadable*/;
         if (return_mem_interval > 0 &&
@@ -324,6 +357,15 @@ static void GlobalInitializeOrDieImpl() {
     // Make GOOGLE_LOG print to comlog device
     SetLogHandler(&BaiduStreamingLogHandler);
 
+    if (FLAGS_iobuf_hugepage_max_arenas > 0 &&
+        InitHugepageBlockAllocator() != 0) {
+        LOG(WARNING) << "Fail to init hugepage allocator of IOBuf blocks";
+    }
+
+    if (FLAGS_bthread_fd_wait_in_event_dispatcher) {
+        UseGlobalEventDispatchersForFdWait();
+    }
+
     // Setting the variable here does not work, the profiler probably check
     // the variable before main() for only once.
     // setenv("TCMALLOC_SAMPLE_PARAMETER", "524288", 0);
@@ -363,9 +405,13 @@ static void GlobalInitializeOrDieImpl() {
     LoadBalancerExtension()->RegisterOrDie("random", &g_ext->randomized_lb);
     LoadBalancerExtension()->RegisterOrDie("wr", &g_ext->wr_lb);
     LoadBalancerExtension()->RegisterOrDie("la", &g_ext->la_lb);
+    LoadBalancerExtension()->RegisterOrDie("p2c", &g_ext->p2c_lb);
+    LoadBalancerExtension()->RegisterOrDie("zone_aware", &g_ext->zone_aware_lb);
     LoadBalancerExtension()->RegisterOrDie("c_murmurhash", &g_ext->ch_mh_lb);
     LoadBalancerExtension()->RegisterOrDie("c_md5", &g_ext->ch_md5_lb);
     LoadBalancerExtension()->RegisterOrDie("c_ketama", &g_ext->ch_ketama_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_maglev", &g_ext->ch_maglev_lb);
+    LoadBalancerExtension()->RegisterOrDie("c_jump", &g_ext->ch_jump_lb);
     LoadBalancerExtension()->RegisterOrDie("_dynpart", &g_ext->dynpart_lb);
 
     // Compress Handlers
@@ -384,17 +430,36 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterCompressHandler(COMPRESS_TYPE_SNAPPY, snappy_compress) != 0) {
         exit(1);
     }
+#ifdef BRPC_WITH_LZ4
+    const CompressHandler lz4_compress =
+        { Lz4Compress, Lz4Decompress, "lz4" };
+    if (RegisterCompressHandler(COMPRESS_TYPE_LZ4, lz4_compress) != 0) {
+        exit(1);
+    }
+#endif
+#ifdef BRPC_WITH_ZSTD
+    const CompressHandler zstd_compress =
+        { ZstdCompress, ZstdDecompress, "zstd" };
+    if (RegisterCompressHandler(COMPRESS_TYPE_ZSTD, zstd_compress) != 0) {
+        exit(1);
+    }
+#endif
 
-    // Protocols
+    // Protocols. Ones not selected by the build(BRPC_PROTOCOLS of cmake or
+    // --protocols of config_brpc.sh) are not registered, which also shortens
+    // the list of handlers tried on connections of unknown protocols.
+#ifndef BRPC_WITHOUT_PROTOCOL_BAIDU_STD
     Protocol baidu_protocol = { ParseRpcMessage,
-                                SerializeRequestDefault, PackRpcRequest,
+                                SerializeRpcRequest, PackRpcRequest,
                                 ProcessRpcRequest, ProcessRpcResponse,
                                 VerifyRpcRequest, NULL, NULL,
                                 CONNECTION_TYPE_ALL, "baidu_std" };
     if (RegisterProtocol(PROTOCOL_BAIDU_STD, baidu_protocol) != 0) {
         exit(1);
     }
+#endif
 
+#ifndef BRPC_WITHOUT_PROTOCOL_STREAMING_RPC
     Protocol streaming_protocol = { ParseStreamingMessage,
                                     NULL, NULL, ProcessStreamingMessage,
                                     ProcessStreamingMessage,
@@ -404,7 +469,9 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_STREAMING_RPC, streaming_protocol) != 0) {
         exit(1);
     }
+#endif
 
+#ifndef BRPC_WITHOUT_PROTOCOL_HTTP
     Protocol http_protocol = { ParseHttpMessage,
                                SerializeHttpRequest, PackHttpRequest,
                                ProcessHttpRequest, ProcessHttpResponse,
@@ -415,7 +482,9 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_HTTP, http_protocol) != 0) {
         exit(1);
     }
+#endif
 
+#ifndef BRPC_WITHOUT_PROTOCOL_H2
     Protocol http2_protocol = { ParseH2Message,
                                 SerializeHttpRequest, PackH2Request,
                                 ProcessHttpRequest, ProcessHttpResponse,
@@ -426,7 +495,9 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_H2, http2_protocol) != 0) {
         exit(1);
     }
+#endif
 
+#ifndef BRPC_WITHOUT_PROTOCOL_HULU_PBRPC
     Protocol hulu_protocol = { ParseHuluMessage,
                                SerializeRequestDefault, PackHuluRequest,
                                ProcessHuluRequest, ProcessHuluResponse,
@@ -435,8 +506,10 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_HULU_PBRPC, hulu_protocol) != 0) {
         exit(1);
     }
+#endif
 
     // Only valid at client side
+#ifndef BRPC_WITHOUT_PROTOCOL_NOVA_PBRPC
     Protocol nova_protocol = { ParseNsheadMessage,
                                SerializeNovaRequest, PackNovaRequest,
                                NULL, ProcessNovaResponse,
@@ -445,8 +518,10 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_NOVA_PBRPC, nova_protocol) != 0) {
         exit(1);
     }
+#endif
 
     // Only valid at client side
+#ifndef BRPC_WITHOUT_PROTOCOL_PUBLIC_PBRPC
     Protocol public_pbrpc_protocol = { ParseNsheadMessage,
                                        SerializePublicPbrpcRequest,
                                        PackPublicPbrpcRequest,
@@ -459,7 +534,9 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_PUBLIC_PBRPC, public_pbrpc_protocol) != 0) {
         exit(1);
     }
+#endif
 
+#ifndef BRPC_WITHOUT_PROTOCOL_SOFA_PBRPC
     Protocol sofa_protocol = { ParseSofaMessage,
                                SerializeRequestDefault, PackSofaRequest,
                                ProcessSofaRequest, ProcessSofaResponse,
@@ -468,19 +545,23 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_SOFA_PBRPC, sofa_protocol) != 0) {
         exit(1);
     }
+#endif
 
     // Only valid at server side. We generalize all the protocols that
     // prefixes with nshead as `nshead_protocol' and specify the content
     // parsing after nshead by ServerOptions.nshead_service.
+#ifndef BRPC_WITHOUT_PROTOCOL_NSHEAD
     Protocol nshead_protocol = { ParseNsheadMessage,
                                  SerializeNsheadRequest, PackNsheadRequest,
                                  ProcessNsheadRequest, ProcessNsheadResponse,
                                  VerifyNsheadRequest, NULL, NULL,
-                                 CONNECTION_TYPE_POOLED_AND_SHORT, "nshead" };
+                                 CONNECTION_TYPE_ALL, "nshead" };
     if (RegisterProtocol(PROTOCOL_NSHEAD, nshead_protocol) != 0) {
         exit(1);
     }
+#endif
 
+#ifndef BRPC_WITHOUT_PROTOCOL_MEMCACHE
     Protocol mc_binary_protocol = { ParseMemcacheMessage,
                                     SerializeMemcacheRequest,
                                     PackMemcacheRequest,
@@ -490,7 +571,9 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_MEMCACHE, mc_binary_protocol) != 0) {
         exit(1);
     }
+#endif
 
+#ifndef BRPC_WITHOUT_PROTOCOL_REDIS
     Protocol redis_protocol = { ParseRedisMessage,
                                 SerializeRedisRequest,
                                 PackRedisRequest,
@@ -500,7 +583,9 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_REDIS, redis_protocol) != 0) {
         exit(1);
     }
+#endif
 
+#ifndef BRPC_WITHOUT_PROTOCOL_MONGO
     Protocol mongo_protocol = { ParseMongoMessage,
                                 NULL, NULL,
                                 ProcessMongoRequest, NULL,
@@ -509,6 +594,7 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_MONGO, mongo_protocol) != 0) {
         exit(1);
     }
+#endif
 
 // Use Macro is more straight forward than weak link technology(becasue of static link issue)
 #ifdef ENABLE_THRIFT_FRAMED_PROTOCOL
@@ -517,13 +603,14 @@ static void GlobalInitializeOrDieImpl() {
         policy::SerializeThriftRequest, policy::PackThriftRequest,
         policy::ProcessThriftRequest, policy::ProcessThriftResponse,
         policy::VerifyThriftRequest, NULL, NULL,
-        CONNECTION_TYPE_POOLED_AND_SHORT, "thrift" };
+        CONNECTION_TYPE_ALL, "thrift" };
     if (RegisterProtocol(PROTOCOL_THRIFT, thrift_binary_protocol) != 0) {
         exit(1);
     }
 #endif
 
     // Only valid at client side
+#ifndef BRPC_WITHOUT_PROTOCOL_UBRPC_COMPACK
     Protocol ubrpc_compack_protocol = {
         ParseNsheadMessage,
         SerializeUbrpcCompackRequest, PackUbrpcRequest,
@@ -533,6 +620,8 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_UBRPC_COMPACK, ubrpc_compack_protocol) != 0) {
         exit(1);
     }
+#endif
+#ifndef BRPC_WITHOUT_PROTOCOL_UBRPC_MCPACK2
     Protocol ubrpc_mcpack2_protocol = {
         ParseNsheadMessage,
         SerializeUbrpcMcpack2Request, PackUbrpcRequest,
@@ -542,8 +631,10 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_UBRPC_MCPACK2, ubrpc_mcpack2_protocol) != 0) {
         exit(1);
     }
+#endif
 
     // Only valid at client side
+#ifndef BRPC_WITHOUT_PROTOCOL_NSHEAD_MCPACK
     Protocol nshead_mcpack_protocol = {
         ParseNsheadMessage,
         SerializeNsheadMcpackRequest, PackNsheadMcpackRequest,
@@ -553,7 +644,9 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_NSHEAD_MCPACK, nshead_mcpack_protocol) != 0) {
         exit(1);
     }
+#endif
 
+#ifndef BRPC_WITHOUT_PROTOCOL_RTMP
     Protocol rtmp_protocol = {
         ParseRtmpMessage,
         SerializeRtmpRequest, PackRtmpRequest,
@@ -564,7 +657,9 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_RTMP, rtmp_protocol) != 0) {
         exit(1);
     }
+#endif
 
+#ifndef BRPC_WITHOUT_PROTOCOL_ESP
     Protocol esp_protocol = {
         ParseEspMessage,
         SerializeEspRequest, PackEspRequest,
@@ -574,6 +669,7 @@ static void GlobalInitializeOrDieImpl() {
     if (RegisterProtocol(PROTOCOL_ESP, esp_protocol) != 0) {
         exit(1);
     }
+#endif
 
     std::vector<Protocol> protocols;
     ListProtocols(&protocols);
@@ -596,6 +692,7 @@ static void GlobalInitializeOrDieImpl() {
     // Concurrency Limiters
     ConcurrencyLimiterExtension()->RegisterOrDie("auto", &g_ext->auto_cl);
     ConcurrencyLimiterExtension()->RegisterOrDie("constant", &g_ext->constant_cl);
+    ConcurrencyLimiterExtension()->RegisterOrDie("gradient", &g_ext->gradient_cl);
     
     if (FLAGS_usercode_in_pthread) {
         // Optional. If channel/server are initialized before main(), this
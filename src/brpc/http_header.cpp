@@ -16,6 +16,7 @@
 // under the License.
 
 
+#include <strings.h>                     // strcasecmp
 #include "brpc/http_status_code.h"     // HTTP_STATUS_*
 #include "brpc/http_header.h"
 
@@ -29,6 +30,43 @@ HttpHeader::HttpHeader()
     // NOTE: don't forget to clear the field in Clear() as well.
 }
 
+// Enough for most messages so that the list is allocated only once.
+static const size_t INITIAL_HEADER_CAPACITY = 16;
+
+const std::string* HttpHeader::FindHeader(const char* key, size_t len) const {
+    for (HeaderList::const_iterator it = _headers.begin();
+         it != _headers.end(); ++it) {
+        if (it->first.size() == len &&
+            strcasecmp(it->first.c_str(), key) == 0) {
+            return &it->second;
+        }
+    }
+    return NULL;
+}
+
+void HttpHeader::RemoveHeader(const char* key, size_t len) {
+    for (HeaderList::iterator it = _headers.begin();
+         it != _headers.end(); ++it) {
+        if (it->first.size() == len &&
+            strcasecmp(it->first.c_str(), key) == 0) {
+            _headers.erase(it);
+            return;
+        }
+    }
+}
+
+std::string& HttpHeader::GetOrAddHeader(const std::string& key) {
+    const std::string* value = FindHeader(key.c_str(), key.size());
+    if (value != NULL) {
+        return const_cast<std::string&>(*value);
+    }
+    if (_headers.capacity() == 0) {
+        _headers.reserve(INITIAL_HEADER_CAPACITY);
+    }
+    _headers.push_back(std::make_pair(key, std::string()));
+    return _headers.back().second;
+}
+
 void HttpHeader::AppendHeader(const std::string& key,
                               const butil::StringPiece& value) {
     std::string& slot = GetOrAddHeader(key);
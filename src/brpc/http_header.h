@@ -19,8 +19,9 @@
 #ifndef  BRPC_HTTP_HEADER_H
 #define  BRPC_HTTP_HEADER_H
 
+#include <string.h>                      // strlen
+#include <vector>
 #include "butil/strings/string_piece.h"  // StringPiece
-#include "butil/containers/case_ignored_flat_map.h"
 #include "brpc/uri.h"              // URI
 #include "brpc/http_method.h"      // HttpMethod
 #include "brpc/http_status_code.h"
@@ -39,8 +40,11 @@ class H2StreamContext;
 // Non-body part of a HTTP message.
 class HttpHeader {
 public:
-    typedef butil::CaseIgnoredFlatMap<std::string> HeaderMap;
-    typedef HeaderMap::const_iterator HeaderIterator;
+    // Headers are few(10~20 typically) and stored in receiving(setting)
+    // order, finding them linearly is faster than hashing case-insensitively
+    // and saves allocations of hash buckets.
+    typedef std::vector<std::pair<std::string, std::string> > HeaderList;
+    typedef HeaderList::const_iterator HeaderIterator;
 
     HttpHeader();
 
@@ -76,12 +80,13 @@ public:
     //   https://www.w3.org/Protocols/rfc2616/rfc2616-sec4.html#sec4.2
     // Namely, GetHeader("log-id"), GetHeader("Log-Id"), GetHeader("LOG-ID")
     // point to the same value.
-    // Return pointer to the value, NULL on not found.
+    // Return pointer to the value, NULL on not found. The pointer is
+    // invalidated after adding or removing headers.
     // NOTE: Not work for "Content-Type", call content_type() instead.
     const std::string* GetHeader(const char* key) const
-    { return _headers.seek(key); }
+    { return FindHeader(key, strlen(key)); }
     const std::string* GetHeader(const std::string& key) const
-    { return _headers.seek(key); }
+    { return FindHeader(key.c_str(), key.size()); }
 
     // Set value of a header.
     // NOTE: Not work for "Content-Type", call set_content_type() instead.
@@ -89,15 +94,17 @@ public:
     { GetOrAddHeader(key) = value; }
 
     // Remove a header.
-    void RemoveHeader(const char* key) { _headers.erase(key); }
-    void RemoveHeader(const std::string& key) { _headers.erase(key); }
+    void RemoveHeader(const char* key) { RemoveHeader(key, strlen(key)); }
+    void RemoveHeader(const std::string& key)
+    { RemoveHeader(key.c_str(), key.size()); }
 
     // Append value to a header. If the header already exists, separate
     // old value and new value with comma(,) according to:
     //   https://www.w3.org/Protocols/rfc2616/rfc2616-sec4.html#sec4.2
     void AppendHeader(const std::string& key, const butil::StringPiece& value);
     
-    // Get header iterators which are invalidated after calling AppendHeader()
+    // Get header iterators which are invalidated after adding or removing
+    // headers.
     HeaderIterator HeaderBegin() const { return _headers.begin(); }
     HeaderIterator HeaderEnd() const { return _headers.end(); }
     // #headers
@@ -142,14 +149,11 @@ friend class HttpMessageSerializer;
 friend class policy::H2StreamContext;
 friend void policy::ProcessHttpRequest(InputMessageBase *msg);
 
-    std::string& GetOrAddHeader(const std::string& key) {
-        if (!_headers.initialized()) {
-            _headers.init(29);
-        }
-        return _headers[key];
-    }
+    const std::string* FindHeader(const char* key, size_t len) const;
+    void RemoveHeader(const char* key, size_t len);
+    std::string& GetOrAddHeader(const std::string& key);
 
-    HeaderMap _headers;
+    HeaderList _headers;
     URI _uri;
     int _status_code;
     HttpMethod _method;
@@ -0,0 +1,233 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <sys/mman.h>                           // mmap
+#include <pthread.h>
+#include <stdlib.h>                             // malloc
+#include <gflags/gflags.h>
+#include "butil/iobuf.h"                        // butil::iobuf::BlockAllocator
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"                  // BAIDU_SCOPED_LOCK
+#include "bvar/passive_status.h"
+#include "brpc/hugepage_block_allocator.h"
+
+#if !defined(MAP_HUGETLB)
+#define MAP_HUGETLB 0x40000
+#endif
+
+namespace brpc {
+
+DEFINE_int32(iobuf_hugepage_max_arenas, 0,
+             "Max number of 2MB hugepage arenas that IOBuf blocks are carved "
+             "from, the hugepage allocator is installed in "
+             "GlobalInitializeOrDie() if this flag is positive");
+DEFINE_bool(iobuf_hugepage_explicit, false,
+            "Map hugepage arenas with MAP_HUGETLB rather than transparent "
+            "hugepages, reserve enough pages in /proc/sys/vm/nr_hugepages");
+
+static const size_t ARENA_SIZE = 2 * 1024 * 1024;
+
+struct Arena {
+    uint32_t block_size;
+    uint32_t nblock;
+    uint32_t nused;
+    bool explicit_hugepage;
+};
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+static const size_t CLASS_SIZE[butil::IOBuf::BLOCK_CLASS_NUM] = {
+    butil::IOBuf::DEFAULT_BLOCK_SIZE,
+    butil::IOBuf::LARGE_BLOCK_SIZE,
+    butil::IOBuf::HUGE_BLOCK_SIZE,
+};
+
+// Arenas are mapped inside [g_base, g_base + g_max_arenas * ARENA_SIZE)
+// reserved at initialization, so that the arena of a block is found by
+// its address.
+static char* g_base = NULL;
+static size_t g_max_arenas = 0;
+static Arena* g_arenas = NULL;
+static butil::iobuf::BlockAllocator g_prev_allocator = { malloc, free };
+
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t g_narena = 0;
+static FreeBlock* g_free_list[butil::IOBuf::BLOCK_CLASS_NUM] = {};
+
+static int class_of_size(size_t size) {
+    for (int i = 0; i < butil::IOBuf::BLOCK_CLASS_NUM; ++i) {
+        if (size == CLASS_SIZE[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Map a new arena for blocks of class `cls'. g_mutex must be locked.
+static int AddArenaLocked(int cls) {
+    if (g_narena >= g_max_arenas) {
+        return -1;
+    }
+    char* const start = g_base + g_narena * ARENA_SIZE;
+    bool explicit_hugepage = false;
+    void* mem = MAP_FAILED;
+    if (FLAGS_iobuf_hugepage_explicit) {
+        mem = mmap(start, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+                   -1, 0);
+        if (mem != MAP_FAILED) {
+            explicit_hugepage = true;
+        } else {
+            PLOG_EVERY_SECOND(WARNING) << "Fail to map explicit hugepages, "
+                "use transparent hugepages instead";
+        }
+    }
+    if (mem == MAP_FAILED) {
+        mem = mmap(start, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (mem == MAP_FAILED) {
+            PLOG(ERROR) << "Fail to map arena";
+            return -1;
+        }
+#if defined(MADV_HUGEPAGE)
+        if (madvise(mem, ARENA_SIZE, MADV_HUGEPAGE) != 0) {
+            PLOG_EVERY_SECOND(WARNING) << "Fail to madvise MADV_HUGEPAGE";
+        }
+#endif
+    }
+    const size_t block_size = CLASS_SIZE[cls];
+    Arena& a = g_arenas[g_narena++];
+    a.block_size = block_size;
+    a.nblock = ARENA_SIZE / block_size;
+    a.nused = 0;
+    a.explicit_hugepage = explicit_hugepage;
+    for (size_t i = a.nblock; i > 0; --i) {
+        FreeBlock* b = reinterpret_cast<FreeBlock*>(start + (i - 1) * block_size);
+        b->next = g_free_list[cls];
+        g_free_list[cls] = b;
+    }
+    return 0;
+}
+
+void* AllocHugepageBlock(size_t size) {
+    const int cls = class_of_size(size);
+    if (cls >= 0) {
+        BAIDU_SCOPED_LOCK(g_mutex);
+        if (g_free_list[cls] != NULL || AddArenaLocked(cls) == 0) {
+            FreeBlock* b = g_free_list[cls];
+            g_free_list[cls] = b->next;
+            ++g_arenas[((char*)b - g_base) / ARENA_SIZE].nused;
+            return b;
+        }
+    }
+    return g_prev_allocator.allocate(size);
+}
+
+void DeallocHugepageBlock(void* mem) {
+    if (mem == NULL) {
+        return;
+    }
+    char* const p = static_cast<char*>(mem);
+    if (p < g_base || p >= g_base + g_max_arenas * ARENA_SIZE) {
+        return g_prev_allocator.deallocate(mem);
+    }
+    Arena& a = g_arenas[(p - g_base) / ARENA_SIZE];
+    FreeBlock* b = static_cast<FreeBlock*>(mem);
+    const int cls = class_of_size(a.block_size);
+    BAIDU_SCOPED_LOCK(g_mutex);
+    b->next = g_free_list[cls];
+    g_free_list[cls] = b;
+    --a.nused;
+}
+
+static size_t GetArenaCount(void*) {
+    BAIDU_SCOPED_LOCK(g_mutex);
+    return g_narena;
+}
+
+static size_t GetUsedBytes(void*) {
+    size_t n = 0;
+    BAIDU_SCOPED_LOCK(g_mutex);
+    for (size_t i = 0; i < g_narena; ++i) {
+        n += (size_t)g_arenas[i].nused * g_arenas[i].block_size;
+    }
+    return n;
+}
+
+// Print "<block_size>x<used>/<total>" of each arena, suffixed with "(E)" for
+// arenas backed by explicit hugepages.
+static void PrintArenas(std::ostream& os, void*) {
+    BAIDU_SCOPED_LOCK(g_mutex);
+    for (size_t i = 0; i < g_narena; ++i) {
+        const Arena& a = g_arenas[i];
+        if (i != 0) {
+            os << ' ';
+        }
+        os << a.block_size << 'x' << a.nused << '/' << a.nblock;
+        if (a.explicit_hugepage) {
+            os << "(E)";
+        }
+    }
+}
+
+int InitHugepageBlockAllocator() {
+    BAIDU_SCOPED_LOCK(g_mutex);
+    if (g_base != NULL) {
+        LOG(ERROR) << "InitHugepageBlockAllocator was called";
+        return -1;
+    }
+    if (FLAGS_iobuf_hugepage_max_arenas <= 0) {
+        LOG(ERROR) << "-iobuf_hugepage_max_arenas must be positive";
+        return -1;
+    }
+    const size_t max_arenas = FLAGS_iobuf_hugepage_max_arenas;
+    // Reserve one more arena to align the start to ARENA_SIZE.
+    const size_t reserved_size = (max_arenas + 1) * ARENA_SIZE;
+    void* mem = mmap(NULL, reserved_size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        PLOG(ERROR) << "Fail to reserve " << reserved_size << " bytes";
+        return -1;
+    }
+    Arena* arenas = (Arena*)calloc(max_arenas, sizeof(Arena));
+    if (arenas == NULL) {
+        munmap(mem, reserved_size);
+        LOG(ERROR) << "Fail to allocate arenas";
+        return -1;
+    }
+    const uintptr_t aligned =
+        ((uintptr_t)mem + ARENA_SIZE - 1) & ~(uintptr_t)(ARENA_SIZE - 1);
+    g_base = (char*)aligned;
+    g_max_arenas = max_arenas;
+    g_arenas = arenas;
+    const butil::iobuf::BlockAllocator allocator =
+        { AllocHugepageBlock, DeallocHugepageBlock };
+    g_prev_allocator = butil::iobuf::set_block_allocator(allocator);
+
+    new bvar::PassiveStatus<size_t>(
+        "iobuf_hugepage_arena_count", GetArenaCount, NULL);
+    new bvar::PassiveStatus<size_t>(
+        "iobuf_hugepage_used_bytes", GetUsedBytes, NULL);
+    new bvar::PassiveStatus<std::string>(
+        "iobuf_hugepage_arenas", PrintArenas, NULL);
+    return 0;
+}
+
+} // namespace brpc
@@ -0,0 +1,53 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_HUGEPAGE_BLOCK_ALLOCATOR_H
+#define BRPC_HUGEPAGE_BLOCK_ALLOCATOR_H
+
+#include <stddef.h>
+
+namespace brpc {
+
+// Carve IOBuf blocks out of 2MB arenas backed by hugepages to reduce TLB
+// misses of programs moving a lot of data through IOBuf. Each arena holds
+// blocks of one size class of IOBuf (8K/64K/1M), arenas are created on
+// demand until -iobuf_hugepage_max_arenas is reached, after which blocks
+// are allocated by the previous allocator, so are blocks of other sizes.
+// Arenas are never returned to the system.
+//
+// With -iobuf_hugepage_explicit, arenas are mapped with MAP_HUGETLB which
+// needs hugepages reserved in /proc/sys/vm/nr_hugepages, otherwise (or when
+// reserved hugepages are used up) arenas are advised with MADV_HUGEPAGE to
+// be backed by transparent hugepages.
+//
+// Usage of arenas is exposed as iobuf_hugepage_* in /vars.
+
+// Install the allocator for IOBuf blocks. Called in GlobalInitializeOrDie()
+// when -iobuf_hugepage_max_arenas is positive, call it at the beginning of
+// main() to cover blocks allocated before initializing brpc.
+// Returns 0 on success, -1 otherwise.
+int InitHugepageBlockAllocator();
+
+// Allocate or deallocate memory of IOBuf blocks, exposed for testing.
+void* AllocHugepageBlock(size_t size);
+void DeallocHugepageBlock(void* mem);
+
+} // namespace brpc
+
+
+#endif  // BRPC_HUGEPAGE_BLOCK_ALLOCATOR_H
@@ -32,6 +32,8 @@ protected:
     virtual void DestroyImpl() = 0;
     
 public:
+    InputMessageBase() : _run_inline(false) {}
+
     // Called to release the memory of this message instead of "delete"
     void Destroy();
     
@@ -48,6 +50,11 @@ public:
     int64_t received_us() const { return _received_us; }
     int64_t base_real_us() const { return _base_real_us; }
 
+    // [Internal] Called by Parse() of protocols to process this message in
+    // the bthread reading the socket right after it's cut, instead of in a
+    // new bthread. Only for messages processed quickly without blocking.
+    void set_run_inline() { _run_inline = true; }
+
 protected:
     virtual ~InputMessageBase();
 
@@ -60,6 +67,7 @@ friend class Stream;
     SocketUniquePtr _socket;
     void (*_process)(InputMessageBase* msg);
     const void* _arg;
+    bool _run_inline;
 };
 
 } // namespace brpc
@@ -16,11 +16,13 @@
 // under the License.
 
 
+#include <algorithm>                              // std::min
 #include <gflags/gflags.h>
 #include "butil/fd_guard.h"                      // fd_guard
 #include "butil/logging.h"                       // CHECK
 #include "butil/time.h"                          // cpuwide_time_us
 #include "butil/fd_utility.h"                    // make_non_blocking
+#include "butil/usdt.h"                          // BUTIL_USDT3
 #include "bthread/bthread.h"                     // bthread_start_background
 #include "bthread/unstable.h"                   // bthread_flush
 #include "bvar/bvar.h"                          // bvar::Adder
@@ -28,6 +30,7 @@
 #include "brpc/reloadable_flags.h"         // BRPC_VALIDATE_GFLAG
 #include "brpc/protocol.h"                 // ListProtocols
 #include "brpc/input_messenger.h"
+#include "brpc/details/protocol_dispatch.h"  // DispatchParse
 
 
 namespace brpc {
@@ -52,13 +55,91 @@ DEFINE_bool(log_connection_close, false,
             "Print log when remote side closes the connection");
 BRPC_VALIDATE_GFLAG(log_connection_close, PassValidate);
 
+DEFINE_int64(socket_input_bytes_budget, 0,
+             "After reading so many bytes from a socket in one event, the"
+             " bthread processing the socket yields to let other sockets run."
+             " <= 0 means unlimited");
+BRPC_VALIDATE_GFLAG(socket_input_bytes_budget, PassValidate);
+
+DEFINE_int32(socket_input_messages_budget, 0,
+             "After cutting so many messages from a socket in one event, the"
+             " bthread processing the socket yields to let other sockets run."
+             " <= 0 means unlimited");
+BRPC_VALIDATE_GFLAG(socket_input_messages_budget, PassValidate);
+
+static bvar::Adder<int64_t>* g_input_budget_exhausted = NULL;
+static pthread_once_t g_input_budget_bvar_once = PTHREAD_ONCE_INIT;
+static void InitInputBudgetBvar() {
+    g_input_budget_exhausted =
+        new bvar::Adder<int64_t>("rpc_socket_input_budget_exhausted_count");
+}
+
+static bvar::Adder<int64_t>* g_input_deferred = NULL;
+static pthread_once_t g_input_deferred_bvar_once = PTHREAD_ONCE_INIT;
+static void InitInputDeferredBvar() {
+    g_input_deferred =
+        new bvar::Adder<int64_t>("rpc_socket_input_deferred_count");
+}
+
 DECLARE_bool(usercode_in_pthread);
 DECLARE_uint64(max_body_size);
 
+DEFINE_bool(guess_protocol_by_signature, true,
+            "Try the protocol whose magic matches the first bytes of a new"
+            " connection before trying others one by one");
+BRPC_VALIDATE_GFLAG(guess_protocol_by_signature, PassValidate);
+
 const size_t MSG_SIZE_WINDOW = 10;  // Take last so many message into stat.
 const size_t MIN_ONCE_READ = 4096;
 const size_t MAX_ONCE_READ = 524288;
 
+#define BRPC_SIGNATURE(a, b, c, d)                                     \
+    (((uint32_t)(uint8_t)(a) << 24) | ((uint32_t)(uint8_t)(b) << 16) |  \
+     ((uint32_t)(uint8_t)(c) << 8) | (uint32_t)(uint8_t)(d))
+
+// Map leading bytes of `buf' to the protocol which is very likely to parse
+// it. This only decides which protocol is tried first, protocols are still
+// tried one by one if the guessed one does not match.
+static ProtocolType GuessProtocolBySignature(const butil::IOBuf& buf) {
+    char head[4];
+    if (buf.copy_to(head, sizeof(head)) != sizeof(head)) {
+        // Too short to tell, try protocols one by one.
+        return PROTOCOL_UNKNOWN;
+    }
+    switch (BRPC_SIGNATURE(head[0], head[1], head[2], head[3])) {
+    case BRPC_SIGNATURE('P', 'R', 'P', 'C'):
+        return PROTOCOL_BAIDU_STD;
+    case BRPC_SIGNATURE('S', 'T', 'R', 'M'):
+        return PROTOCOL_STREAMING_RPC;
+    case BRPC_SIGNATURE('H', 'U', 'L', 'U'):
+        return PROTOCOL_HULU_PBRPC;
+    case BRPC_SIGNATURE('S', 'O', 'F', 'A'):
+        return PROTOCOL_SOFA_PBRPC;
+    case BRPC_SIGNATURE('P', 'R', 'I', ' '):  // "PRI * HTTP/2.0"
+        return PROTOCOL_H2;
+    case BRPC_SIGNATURE('G', 'E', 'T', ' '):
+    case BRPC_SIGNATURE('P', 'O', 'S', 'T'):
+    case BRPC_SIGNATURE('P', 'U', 'T', ' '):
+    case BRPC_SIGNATURE('H', 'E', 'A', 'D'):
+    case BRPC_SIGNATURE('D', 'E', 'L', 'E'):
+    case BRPC_SIGNATURE('P', 'A', 'T', 'C'):
+    case BRPC_SIGNATURE('O', 'P', 'T', 'I'):
+    case BRPC_SIGNATURE('T', 'R', 'A', 'C'):
+    case BRPC_SIGNATURE('C', 'O', 'N', 'N'):
+    case BRPC_SIGNATURE('H', 'T', 'T', 'P'):
+        return PROTOCOL_HTTP;
+    default:
+        break;
+    }
+    if (head[0] == '*') {
+        // RESP array, e.g. "*3\r\n$3\r\nset..."
+        return PROTOCOL_REDIS;
+    }
+    return PROTOCOL_UNKNOWN;
+}
+
+#undef BRPC_SIGNATURE
+
 ParseResult InputMessenger::CutInputMessage(
         Socket* m, size_t* index, bool read_eof) {
     const int preferred = m->preferred_index();
@@ -67,8 +148,9 @@ ParseResult InputMessenger::CutInputMessage(
     // selection or by client.
     if (preferred >= 0 && preferred <= max_index
             && _handlers[preferred].parse != NULL) {
-        ParseResult result =
-            _handlers[preferred].parse(&m->_read_buf, m, read_eof, _handlers[preferred].arg);
+        ParseResult result = DispatchParse(_handlers[preferred].parse,
+                                           &m->_read_buf, m, read_eof,
+                                           _handlers[preferred].arg);
         if (result.is_ok() ||
             result.error() == PARSE_ERROR_NOT_ENOUGH_DATA) {
             *index = preferred;
@@ -99,12 +181,26 @@ ParseResult InputMessenger::CutInputMessage(
         }
         m->set_preferred_index(-1);
     }
-    for (int i = 0; i <= max_index; ++i) {
-        if (i == preferred || _handlers[i].parse == NULL) {
-            // Don't try preferred handler(already tried) or invalid handler
+    // Index of handler is protocol type unless non-protocol handlers are
+    // added.
+    int guessed = -1;
+    if (!_non_protocol && FLAGS_guess_protocol_by_signature) {
+        guessed = GuessProtocolBySignature(m->_read_buf);
+        if (guessed == PROTOCOL_UNKNOWN || guessed > max_index) {
+            guessed = -1;
+        }
+    }
+    // Try the guessed handler first, then others in order.
+    for (int j = (guessed >= 0 ? -1 : 0); j <= max_index; ++j) {
+        const int i = (j < 0 ? guessed : j);
+        if (i == preferred || _handlers[i].parse == NULL ||
+            (j >= 0 && i == guessed)) {
+            // Don't try preferred/guessed handler(already tried) or invalid
+            // handler
             continue;
         }
-        ParseResult result = _handlers[i].parse(&m->_read_buf, m, read_eof, _handlers[i].arg);
+        ParseResult result = DispatchParse(_handlers[i].parse, &m->_read_buf,
+                                           m, read_eof, _handlers[i].arg);
         if (result.is_ok() ||
             result.error() == PARSE_ERROR_NOT_ENOUGH_DATA) {
             m->set_preferred_index(i);
@@ -132,7 +228,7 @@ ParseResult InputMessenger::CutInputMessage(
 
 void* ProcessInputMessage(void* void_arg) {
     InputMessageBase* msg = static_cast<InputMessageBase*>(void_arg);
-    msg->_process(msg);
+    DispatchProcess(msg->_process, msg);
     return NULL;
 }
 
@@ -174,6 +270,8 @@ void InputMessenger::OnNewMessages(Socket* m) {
     //   "process") in this bthread. All messages except the last one will be
     //   processed in separate bthreads. To minimize the overhead, scheduling
     //   is batched(notice the BTHREAD_NOSIGNAL and bthread_flush).
+    // - Messages marked by InputMessageBase::set_run_inline() in Parse() are
+    //   processed in this bthread right after being cut.
     // - Verify will always be called in this bthread at most once and before
     //   any process.
     InputMessenger* messenger = static_cast<InputMessenger*>(m->user());
@@ -185,12 +283,34 @@ void InputMessenger::OnNewMessages(Socket* m) {
     // OK in most cases.
     std::unique_ptr<InputMessageBase, RunLastMessage> last_msg;
     bool read_eof = false;
+    // Bytes and messages since last yielding.
+    int64_t nbytes_in_budget = 0;
+    int nmsgs_in_budget = 0;
     while (!read_eof) {
+        if (messenger->InflightBytesExceeded()) {
+            // Too many bytes of requests are being processed. Stop reading
+            // so that the kernel buffer fills up and the sender is blocked
+            // by TCP flow control, until in-flight requests complete.
+            if (last_msg) {
+                int nbthread = 0;
+                QueueMessage(last_msg.release(), &nbthread, m->_keytable_pool);
+                bthread_flush();
+            }
+            pthread_once(&g_input_deferred_bvar_once, InitInputDeferredBvar);
+            *g_input_deferred << 1;
+            do {
+                bthread_usleep(1000);
+            } while (messenger->InflightBytesExceeded() && !m->Failed());
+            if (m->Failed()) {
+                return;
+            }
+        }
         const int64_t received_us = butil::cpuwide_time_us();
         const int64_t base_realtime = butil::gettimeofday_us() - received_us;
 
         // Calculate bytes to be read.
-        size_t once_read = m->_avg_msg_size * 16;
+        size_t once_read = std::max((size_t)m->_avg_msg_size * 16,
+                                    (size_t)m->_read_size);
         if (once_read < MIN_ONCE_READ) {
             once_read = MIN_ONCE_READ;
         } else if (once_read > MAX_ONCE_READ) {
@@ -198,8 +318,22 @@ void InputMessenger::OnNewMessages(Socket* m) {
         }
 
         // Read.
-        const ssize_t nr = m->DoRead(once_read);
-        if (nr <= 0) {
+        ssize_t nr = 0;
+        {
+            static const int s_owner =
+                butil::iobuf::register_block_owner("socket_read");
+            butil::iobuf::ScopedBlockOwner scoped_owner(s_owner);
+            nr = m->DoRead(once_read);
+        }
+        if (nr > 0) {
+            if ((size_t)nr >= once_read) {
+                // More data is likely to be pending, read more next time.
+                m->_read_size = std::min(once_read * 2, MAX_ONCE_READ);
+            } else if ((size_t)nr < m->_read_size / 4) {
+                m->_read_size = std::max(m->_read_size / 2,
+                                         (uint32_t)MIN_ONCE_READ);
+            }
+        } else {
             if (0 == nr) {
                 // Set `read_eof' flag and proceed to feed EOF into `Protocol'
                 // (implied by m->_read_buf.empty), which may produce a new
@@ -215,14 +349,22 @@ void InputMessenger::OnNewMessages(Socket* m) {
                 m->SetFailed(saved_errno, "Fail to read from %s: %s",
                              m->description().c_str(), berror(saved_errno));
                 return;
-            } else if (!m->MoreReadEvents(&progress)) {
-                return;
-            } else { // new events during processing
+            } else {
+                if (m->_read_buf.empty()) {
+                    // Don't hold partially filled blocks in idle sockets,
+                    // which adds up with many connections.
+                    m->_read_buf.return_cached_blocks();
+                }
+                if (!m->MoreReadEvents(&progress)) {
+                    return;
+                }
+                // new events during processing
                 continue;
             }
         }
         
         m->AddInputBytes(nr);
+        nbytes_in_budget += nr;
 
         // Avoid this socket to be closed due to idle_timeout_s
         m->_last_readtime_us.store(received_us, butil::memory_order_relaxed);
@@ -255,6 +397,7 @@ void InputMessenger::OnNewMessages(Socket* m) {
             }
 
             m->AddInputMessages(1);
+            ++nmsgs_in_budget;
             // Calculate average size of messages
             const size_t cur_size = m->_read_buf.length();
             if (cur_size == 0) {
@@ -273,6 +416,7 @@ void InputMessenger::OnNewMessages(Socket* m) {
             } else {
                 m->_avg_msg_size = m->_last_msg_size;
             }
+            BUTIL_USDT3(brpc, message_cut, m->id(), index, m->_last_msg_size);
             m->_last_msg_size = 0;
             
             if (pr.message() == NULL) { // the Process() step can be skipped.
@@ -314,7 +458,16 @@ void InputMessenger::OnNewMessages(Socket* m) {
                       "destroyed when authentication failed";
                 }
             }
-            if (!m->is_read_progressive()) {
+            if (msg->_run_inline && !m->is_read_progressive()) {
+                // Non-blocking and quick to process, don't pay for creating
+                // and scheduling a bthread. Start queued bthreads first so
+                // that they're not delayed by this message.
+                if (num_bthread_created) {
+                    bthread_flush();
+                    num_bthread_created = 0;
+                }
+                ProcessInputMessage(msg.release());
+            } else if (!m->is_read_progressive()) {
                 // Transfer ownership to last_msg
                 last_msg.reset(msg.release());
             } else {
@@ -327,6 +480,26 @@ void InputMessenger::OnNewMessages(Socket* m) {
         if (num_bthread_created) {
             bthread_flush();
         }
+        const int64_t bytes_budget = FLAGS_socket_input_bytes_budget;
+        const int msgs_budget = FLAGS_socket_input_messages_budget;
+        if (!read_eof &&
+            ((bytes_budget > 0 && nbytes_in_budget >= bytes_budget) ||
+             (msgs_budget > 0 && nmsgs_in_budget >= msgs_budget))) {
+            // The socket keeps receiving a lot of data, which may monopolize
+            // the worker. Process the pending message in another bthread and
+            // move this bthread to the end of runqueue so that events of
+            // other sockets run before reading this socket again.
+            if (last_msg) {
+                int nbthread = 0;
+                QueueMessage(last_msg.release(), &nbthread, m->_keytable_pool);
+                bthread_flush();
+            }
+            pthread_once(&g_input_budget_bvar_once, InitInputBudgetBvar);
+            *g_input_budget_exhausted << 1;
+            nbytes_in_budget = 0;
+            nmsgs_in_budget = 0;
+            bthread_yield();
+        }
     }
 
     if (read_eof) {
@@ -338,7 +511,15 @@ InputMessenger::InputMessenger(size_t capacity)
     : _handlers(NULL)
     , _max_index(-1)
     , _non_protocol(false)
-    , _capacity(capacity) {
+    , _capacity(capacity)
+    , _inflight_bytes(NULL)
+    , _max_inflight_bytes(0) {
+}
+
+void InputMessenger::LimitInflightBytes(
+    const butil::atomic<int64_t>* inflight_bytes, int64_t max_bytes) {
+    _inflight_bytes = inflight_bytes;
+    _max_inflight_bytes = (inflight_bytes != NULL ? max_bytes : 0);
 }
 
 InputMessenger::~InputMessenger() {
@@ -484,6 +665,8 @@ void InputMessageBase::Destroy() {
         _socket->CheckEOF();
         _socket.reset();
     }
+    // Messages may be pooled and reused.
+    _run_inline = false;
     DestroyImpl();
     // This object may be destroyed, don't touch fields anymore.
 }
@@ -101,6 +101,13 @@ public:
     // Channel nor Server. 
     int AddNonProtocolHandler(const InputMessageHandler& handler);
 
+    // Stop reading from sockets while `*inflight_bytes' >= `max_bytes', so
+    // that senders are slowed down by TCP flow control. `inflight_bytes'
+    // must outlive this messenger. Must be called before creating sockets.
+    // max_bytes <= 0 means unlimited.
+    void LimitInflightBytes(const butil::atomic<int64_t>* inflight_bytes,
+                            int64_t max_bytes);
+
 protected:
     // Load data from m->fd() into m->read_buf, cut off new messages and
     // call callbacks.
@@ -111,6 +118,12 @@ private:
     // from m->read_buf, save index of the scissor into `index'.
     ParseResult CutInputMessage(Socket* m, size_t* index, bool read_eof);
 
+    // Returns true if the socket should not be read for now.
+    bool InflightBytesExceeded() const {
+        return _max_inflight_bytes > 0 &&
+            _inflight_bytes->load(butil::memory_order_relaxed) >= _max_inflight_bytes;
+    }
+
     // User-supplied scissors and handlers.
     // the index of handler is exactly the same as the protocol
     InputMessageHandler* _handlers;
@@ -118,6 +131,8 @@ private:
     butil::atomic<int> _max_index;
     bool _non_protocol;
     size_t _capacity;
+    const butil::atomic<int64_t>* _inflight_bytes;
+    int64_t _max_inflight_bytes;
 
     butil::Mutex _add_handler_mutex;
 };
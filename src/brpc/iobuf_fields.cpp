@@ -0,0 +1,204 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <google/protobuf/descriptor.h>          // Descriptor
+#include "idl_options.pb.h"                       // option(iobuf_field)
+#include "brpc/protocol.h"                        // ParsePbFromIOBuf
+#include "brpc/iobuf_fields.h"
+
+namespace brpc {
+
+// Wire types of protobuf.
+enum {
+    WIRETYPE_VARINT = 0,
+    WIRETYPE_FIXED64 = 1,
+    WIRETYPE_LENGTH_DELIMITED = 2,
+    WIRETYPE_START_GROUP = 3,
+    WIRETYPE_END_GROUP = 4,
+    WIRETYPE_FIXED32 = 5,
+};
+
+// Groups nested deeper than this are treated as malformed.
+static const int MAX_GROUP_DEPTH = 64;
+
+size_t IOBufFields::count(int number) const {
+    size_t n = 0;
+    for (size_t i = 0; i < _fields.size(); ++i) {
+        n += (_fields[i].first == number);
+    }
+    return n;
+}
+
+const butil::IOBuf* IOBufFields::get(int number, size_t i) const {
+    for (size_t j = 0; j < _fields.size(); ++j) {
+        if (_fields[j].first == number && i-- == 0) {
+            return &_fields[j].second;
+        }
+    }
+    return NULL;
+}
+
+static bool IsIOBufField(const google::protobuf::FieldDescriptor* f) {
+    return f != NULL &&
+        f->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
+        f->options().GetExtension(iobuf_field);
+}
+
+bool HasIOBufFields(const google::protobuf::Descriptor* desc) {
+    // Fields can't be marked unless the file imports idl_options.proto,
+    // which is much cheaper to check than looking up options of all fields.
+    const google::protobuf::FileDescriptor* file = desc->file();
+    bool imported = false;
+    for (int i = 0; i < file->dependency_count() && !imported; ++i) {
+        imported = (file->dependency(i) == ConvertibleIdlType_descriptor()->file());
+    }
+    if (!imported) {
+        return false;
+    }
+    for (int i = 0; i < desc->field_count(); ++i) {
+        if (IsIOBufField(desc->field(i))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ReadVarint(butil::IOBufBytesIterator& it, uint64_t* value) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && it; shift += 7) {
+        const unsigned char c = *it;
+        ++it;
+        v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool Forward(butil::IOBufBytesIterator& it, uint64_t n) {
+    return it.bytes_left() >= n && it.forward(n) == n;
+}
+
+// Skip the value of a field whose tag was just read.
+static bool SkipField(butil::IOBufBytesIterator& it, uint64_t tag, int depth) {
+    uint64_t v = 0;
+    switch (tag & 7) {
+    case WIRETYPE_VARINT:
+        return ReadVarint(it, &v);
+    case WIRETYPE_FIXED64:
+        return Forward(it, 8);
+    case WIRETYPE_LENGTH_DELIMITED:
+        return ReadVarint(it, &v) && Forward(it, v);
+    case WIRETYPE_START_GROUP:
+        if (depth >= MAX_GROUP_DEPTH) {
+            return false;
+        }
+        while (ReadVarint(it, &v)) {
+            if ((v & 7) == WIRETYPE_END_GROUP) {
+                return (v >> 3) == (tag >> 3);
+            }
+            if (!SkipField(it, v, depth + 1)) {
+                return false;
+            }
+        }
+        return false;
+    case WIRETYPE_FIXED32:
+        return Forward(it, 4);
+    default:
+        return false;
+    }
+}
+
+bool ParsePbWithIOBufFields(const butil::IOBuf& buf,
+                            google::protobuf::Message* msg,
+                            IOBufFields* fields) {
+    const google::protobuf::Descriptor* desc = msg->GetDescriptor();
+    if (!HasIOBufFields(desc)) {
+        return ParsePbFromIOBuf(msg, buf);
+    }
+    // Bytes of other fields are collected into `rest' which shares blocks
+    // with `buf' as well.
+    butil::IOBuf rest;
+    butil::IOBufBytesIterator it(buf);
+    butil::IOBufBytesIterator pending(buf);
+    size_t npending = 0;
+    while (it) {
+        const size_t field_begin = it.bytes_left();
+        uint64_t tag = 0;
+        if (!ReadVarint(it, &tag)) {
+            return false;
+        }
+        const int number = (int)(tag >> 3);
+        if ((tag & 7) == WIRETYPE_LENGTH_DELIMITED &&
+            IsIOBufField(desc->FindFieldByNumber(number))) {
+            uint64_t len = 0;
+            if (!ReadVarint(it, &len) || it.bytes_left() < len) {
+                return false;
+            }
+            pending.append_and_forward(&rest, npending);
+            butil::IOBuf data;
+            it.append_and_forward(&data, len);
+            fields->add(number, data);
+            pending = it;
+            npending = 0;
+            continue;
+        }
+        if (!SkipField(it, tag, 0)) {
+            return false;
+        }
+        npending += field_begin - it.bytes_left();
+    }
+    pending.append_and_forward(&rest, npending);
+    return ParsePbFromIOBuf(msg, rest);
+}
+
+bool SerializePbWithIOBufFields(const google::protobuf::Message& msg,
+                                const IOBufFields& fields,
+                                butil::IOBuf* buf) {
+    {
+        // Flush the stream before appending payloads.
+        butil::IOBufAsZeroCopyOutputStream wrapper(buf);
+        if (!msg.SerializeToZeroCopyStream(&wrapper)) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < fields.size(); ++i) {
+        const IOBufFields::Field& f = fields[i];
+        // tag and length, 10 bytes at most for each.
+        char header[20];
+        size_t n = 0;
+        uint64_t values[2] = {
+            ((uint64_t)f.first << 3) | WIRETYPE_LENGTH_DELIMITED,
+            f.second.size() };
+        for (int j = 0; j < 2; ++j) {
+            uint64_t v = values[j];
+            while (v >= 0x80) {
+                header[n++] = (char)(v | 0x80);
+                v >>= 7;
+            }
+            header[n++] = (char)v;
+        }
+        buf->append(header, n);
+        buf->append(f.second);
+    }
+    return true;
+}
+
+} // namespace brpc
@@ -0,0 +1,86 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_IOBUF_FIELDS_H
+#define BRPC_IOBUF_FIELDS_H
+
+#include <utility>                               // std::pair
+#include <vector>
+#include <google/protobuf/message.h>             // Message
+#include "butil/iobuf.h"                          // butil::IOBuf
+
+namespace brpc {
+
+// Payloads of large bytes fields kept as IOBuf referencing blocks of the
+// received data instead of being copied into std::string of the message.
+// Mark such fields in the proto with:
+//   import "idl_options.proto";
+//   message PutRequest {
+//     required string key = 1;
+//     optional bytes value = 2 [(iobuf_field) = true];
+//   }
+// Only top-level fields of the message are recognized and they must not be
+// required. A field may appear more than once, namely a repeated field,
+// payloads are kept in order.
+class IOBufFields {
+public:
+    typedef std::pair<int, butil::IOBuf> Field;
+
+    // Add a payload of field `number'. Blocks of `data' are shared.
+    void add(int number, const butil::IOBuf& data) {
+        _fields.push_back(Field(number, data));
+    }
+
+    // Number of payloads of field `number'.
+    size_t count(int number) const;
+
+    // The i-th payload of field `number', NULL if absent.
+    const butil::IOBuf* get(int number, size_t i = 0) const;
+
+    size_t size() const { return _fields.size(); }
+    bool empty() const { return _fields.empty(); }
+    const Field& operator[](size_t i) const { return _fields[i]; }
+    void clear() { _fields.clear(); }
+    void swap(IOBufFields& other) { _fields.swap(other._fields); }
+
+private:
+    std::vector<Field> _fields;
+};
+
+// True if any top-level field of `desc' is marked with (iobuf_field).
+bool HasIOBufFields(const google::protobuf::Descriptor* desc);
+
+// Parse `buf' into `msg', payloads of marked fields are cut into `fields'
+// by reference and left unset in `msg'. Other fields are parsed as usual.
+// Returns true on success, false otherwise.
+bool ParsePbWithIOBufFields(const butil::IOBuf& buf,
+                            google::protobuf::Message* msg,
+                            IOBufFields* fields);
+
+// Serialize `msg' and then payloads in `fields' as length-delimited fields
+// into `buf' without copying the payloads. Don't set marked fields in `msg'
+// at the same time.
+// Returns true on success, false otherwise.
+bool SerializePbWithIOBufFields(const google::protobuf::Message& msg,
+                                const IOBufFields& fields,
+                                butil::IOBuf* buf);
+
+} // namespace brpc
+
+
+#endif // BRPC_IOBUF_FIELDS_H
@@ -23,7 +23,11 @@
 #include "butil/macros.h"
 #include "butil/sys_byteorder.h"
 #include "butil/logging.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
 #include "brpc/memcache.h"
+#include "brpc/details/channel_private_accessor.h"
+#include "brpc/policy/hasher.h"
 #include "brpc/policy/memcache_binary_header.h"
 
 namespace brpc {
@@ -489,6 +493,110 @@ bool MemcacheResponse::PopGet(
     return false;
 }
 
+// Quiet gets with keys(GETKQ) are replied only when the key is found or an
+// error occurs, the trailing NOOP is always replied and ends the response.
+bool MemcacheRequest::MultiGet(const std::vector<std::string>& keys) {
+    for (size_t i = 0; i < keys.size(); ++i) {
+        const std::string& key = keys[i];
+        const policy::MemcacheRequestHeader header = {
+            policy::MC_MAGIC_REQUEST,
+            policy::MC_BINARY_GETKQ,
+            butil::HostToNet16(key.size()),
+            0,
+            policy::MC_BINARY_RAW_BYTES,
+            0,
+            butil::HostToNet32(key.size()),
+            0,
+            0
+        };
+        if (_buf.append(&header, sizeof(header))) {
+            return false;
+        }
+        if (_buf.append(key.data(), key.size())) {
+            return false;
+        }
+    }
+    const policy::MemcacheRequestHeader noop_header = {
+        policy::MC_MAGIC_REQUEST,
+        policy::MC_BINARY_NOOP,
+        0,
+        0,
+        policy::MC_BINARY_RAW_BYTES,
+        0,
+        0,
+        0,
+        0
+    };
+    if (_buf.append(&noop_header, sizeof(noop_header))) {
+        return false;
+    }
+    // Quiet gets are not counted since they may not be replied.
+    ++_pipelined_count;
+    return true;
+}
+
+// GETKQ responses MUST have flags as extras, MUST have key, MAY have value.
+bool MemcacheResponse::PopMultiGet(std::map<std::string, MemcacheValue>* values) {
+    std::string err;
+    while (true) {
+        const size_t n = _buf.size();
+        policy::MemcacheResponseHeader header;
+        if (n < sizeof(header)) {
+            butil::string_printf(&_err, "buffer is too small to contain a header");
+            return false;
+        }
+        _buf.copy_to(&header, sizeof(header));
+        if (n < sizeof(header) + header.total_body_length) {
+            butil::string_printf(&_err, "response=%u < header=%u + body=%u",
+                      (unsigned)n, (unsigned)sizeof(header), header.total_body_length);
+            return false;
+        }
+        if (header.command == (uint8_t)policy::MC_BINARY_NOOP) {
+            _buf.pop_front(sizeof(header) + header.total_body_length);
+            _err = err;
+            return err.empty();
+        }
+        if (header.command != (uint8_t)policy::MC_BINARY_GETKQ) {
+            butil::string_printf(&_err, "not a GETKQ response");
+            return false;
+        }
+        const int value_size = (int)header.total_body_length - (int)header.extras_length
+            - (int)header.key_length;
+        if (value_size < 0) {
+            butil::string_printf(&_err, "value_size=%d is negative", value_size);
+            return false;
+        }
+        if (header.status != (uint16_t)STATUS_SUCCESS) {
+            // Remember the error and go on with other keys so that the
+            // response is consumed entirely.
+            _buf.pop_front(sizeof(header) + header.extras_length +
+                           header.key_length);
+            err.clear();
+            _buf.cutn(&err, value_size);
+            continue;
+        }
+        if (header.extras_length != 4u) {
+            butil::string_printf(&_err, "GETKQ response must have flags as extras, actual length=%u",
+                      header.extras_length);
+            return false;
+        }
+        _buf.pop_front(sizeof(header));
+        uint32_t raw_flags = 0;
+        _buf.cutn(&raw_flags, sizeof(raw_flags));
+        if (values == NULL) {
+            _buf.pop_front(header.key_length + value_size);
+            continue;
+        }
+        std::string key;
+        _buf.cutn(&key, header.key_length);
+        MemcacheValue& v = (*values)[key];
+        v.flags = butil::NetToHost32(raw_flags);
+        v.cas_value = header.cas_value;
+        v.value.clear();
+        _buf.cutn(&v.value, value_size);
+    }
+}
+
 // MUST NOT have extras
 // MUST NOT have key
 // MUST NOT have value
@@ -874,4 +982,56 @@ bool MemcacheResponse::PopVersion(std::string* version) {
     return true;
 }
  
+struct MultiGetGroup {
+    uint32_t request_code;
+    std::vector<std::string> keys;
+    Controller cntl;
+    MemcacheRequest request;
+    MemcacheResponse response;
+};
+
+void MemcacheMultiGet(Channel* channel,
+                      const std::vector<std::string>& keys,
+                      std::map<std::string, MemcacheValue>* values,
+                      Controller* cntl) {
+    // Group keys by servers selected at present. Another server may be
+    // selected when the group is sent if servers are changed meanwhile,
+    // which results in misses rather than wrong values.
+    ChannelPrivateAccessor accessor(channel);
+    std::map<SocketId, MultiGetGroup> groups;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        const uint32_t code = policy::MurmurHash32(keys[i].data(), keys[i].size());
+        MultiGetGroup& g = groups[accessor.SelectServer(code)];
+        if (g.keys.empty()) {
+            g.request_code = code;
+        }
+        g.keys.push_back(keys[i]);
+    }
+    for (std::map<SocketId, MultiGetGroup>::iterator
+             it = groups.begin(); it != groups.end(); ++it) {
+        MultiGetGroup& g = it->second;
+        g.request.MultiGet(g.keys);
+        g.cntl.set_request_code(g.request_code);
+        if (cntl) {
+            g.cntl.set_timeout_ms(cntl->timeout_ms());
+            g.cntl.set_max_retry(cntl->max_retry());
+        }
+        channel->CallMethod(NULL, &g.cntl, &g.request, &g.response, DoNothing());
+    }
+    for (std::map<SocketId, MultiGetGroup>::iterator
+             it = groups.begin(); it != groups.end(); ++it) {
+        MultiGetGroup& g = it->second;
+        Join(g.cntl.call_id());
+        if (g.cntl.Failed()) {
+            if (cntl && !cntl->Failed()) {
+                cntl->SetFailed(g.cntl.ErrorCode(), "%s", g.cntl.ErrorText().c_str());
+            }
+            continue;
+        }
+        if (!g.response.PopMultiGet(values) && cntl && !cntl->Failed()) {
+            cntl->SetFailed(ERESPONSE, "%s", g.response.LastError().c_str());
+        }
+    }
+}
+
 } // namespace brpc
@@ -19,7 +19,9 @@
 #ifndef BRPC_MEMCACHE_H
 #define BRPC_MEMCACHE_H
 
+#include <map>
 #include <string>
+#include <vector>
 #include <google/protobuf/message.h>
 
 #include "butil/iobuf.h"
@@ -28,6 +30,9 @@
 
 namespace brpc {
 
+class Channel;
+class Controller;
+
 // Request to memcache.
 // Notice that you can pipeline multiple operations in one request and sent
 // them to memcached server together.
@@ -53,6 +58,12 @@ public:
 
     bool Get(const butil::StringPiece& key);
 
+    // Get all `keys' with quiet gets(GETKQ) followed by a NOOP, which is
+    // replied as one response only containing keys found. Much cheaper than
+    // calling Get() for each key. Use MemcacheResponse::PopMultiGet() to
+    // get the values.
+    bool MultiGet(const std::vector<std::string>& keys);
+
     // If the cas_value(Data Version Check) is non-zero, the requested operation
     // MUST only succeed if the item exists and has a cas_value identical to the
     // provided value.
@@ -151,6 +162,13 @@ private:
 //   } else {
 //       // the SET was successful.
 //   }
+// A value returned by MemcacheResponse::PopMultiGet().
+struct MemcacheValue {
+    butil::IOBuf value;
+    uint32_t flags;
+    uint64_t cas_value;
+};
+
 class MemcacheResponse : public ::google::protobuf::Message {
 public:
     // Definition of the valid response status numbers.
@@ -182,6 +200,9 @@ public:
    
     bool PopGet(butil::IOBuf* value, uint32_t* flags, uint64_t* cas_value);
     bool PopGet(std::string* value, uint32_t* flags, uint64_t* cas_value);
+    // Pop the response to MemcacheRequest::MultiGet(), found keys are
+    // inserted into `values'.
+    bool PopMultiGet(std::map<std::string, MemcacheValue>* values);
     bool PopSet(uint64_t* cas_value);
     bool PopAdd(uint64_t* cas_value);
     bool PopReplace(uint64_t* cas_value);
@@ -233,6 +254,18 @@ private:
     mutable int _cached_size_;
 };
 
+// Get `keys' from servers of `channel' which is generally initialized with
+// a consistent hashing load balancer(c_murmurhash or c_md5). Keys are grouped
+// by the servers that requests with policy::MurmurHash32(key) as request
+// code would be sent to, and each group is fetched by one MultiGet(), all
+// groups are fetched concurrently. Found keys are inserted into `values'.
+// If `cntl' is not NULL, it's set failed when any group fails, in which
+// case values of other groups are still inserted.
+void MemcacheMultiGet(Channel* channel,
+                      const std::vector<std::string>& keys,
+                      std::map<std::string, MemcacheValue>* values,
+                      Controller* cntl);
+
 } // namespace brpc
 
 
@@ -0,0 +1,55 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_METHOD_EXECUTOR_OPTIONS_H
+#define BRPC_METHOD_EXECUTOR_OPTIONS_H
+
+#include "bthread/types.h"                    // bthread_tag_t
+
+namespace brpc {
+
+// Where methods bound to an executor are run, see Server::AddMethodExecutor()
+// and ServiceOptions.method_executors.
+struct MethodExecutorOptions {
+    MethodExecutorOptions()
+        : bthread_tag(BTHREAD_TAG_INVALID)
+        , num_pthreads(0)
+        , max_queue_size(0) {}
+
+    // Run methods in bthreads of this tag, on workers not shared with
+    // other tags. See -task_group_ntags.
+    // Default: BTHREAD_TAG_INVALID (the tag of the server)
+    bthread_tag_t bthread_tag;
+
+    // If this field is positive, run methods in so many dedicated pthreads
+    // instead of bthreads, `bthread_tag' is ignored. Methods blocking
+    // pthreads (e.g. calling blocking libraries) should be run in this way.
+    // Default: 0
+    int num_pthreads;
+
+    // Calls are failed with ELIMIT when so many calls are waiting to run
+    // in the executor.
+    // <= 0 means unlimited.
+    // Default: 0
+    int max_queue_size;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_METHOD_EXECUTOR_OPTIONS_H
@@ -25,6 +25,11 @@
 
 namespace brpc {
 
+class Controller;
+namespace policy {
+class MongoResponse;
+}
+
 // custom mongo context. derive this and implement your own functionalities.
 class MongoContext : public SharedObject {
 public:
@@ -55,6 +60,14 @@ public:
     virtual MongoContext* CreateSocketContext() const = 0;
 };
 
+// Send `sections' of `res' followed by cntl->response_attachment() as an
+// OP_MSG reply with MONGO_MSG_MORE_TO_COME set to the client, then clear
+// them so that the next batch can be filled. This is used for streaming
+// large cursor batches to clients setting MONGO_MSG_EXHAUST_ALLOWED in the
+// request, the last batch is sent by done->Run() as usual.
+// Returns 0 on success, -1 otherwise.
+int WriteMongoMsgBatch(Controller* cntl, policy::MongoResponse* res);
+
 } // namespace brpc
 
 
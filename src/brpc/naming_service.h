@@ -36,8 +36,12 @@ namespace brpc {
 class NamingServiceActions {
 public:
     virtual ~NamingServiceActions() {}
+    // Add or remove some servers, which is cheaper than ResetServers() with
+    // the full list if the naming service knows changes of servers.
     virtual void AddServers(const std::vector<ServerNode>& servers) = 0;
     virtual void RemoveServers(const std::vector<ServerNode>& servers) = 0;
+    // Replace all servers with `servers'. Only differences with the last
+    // servers are applied to load balancers.
     virtual void ResetServers(const std::vector<ServerNode>& servers) = 0;
 };
 
@@ -22,6 +22,7 @@
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/shared_request_buf.h"
 #include "brpc/parallel_channel.h"
 
 
@@ -29,7 +30,8 @@ namespace brpc {
 
 ParallelChannelOptions::ParallelChannelOptions()
     : timeout_ms(500)
-    , fail_limit(-1) {
+    , fail_limit(-1)
+    , success_limit(0) {
 }
 
 DECLARE_bool(usercode_in_pthread);
@@ -45,13 +47,16 @@ static __thread Memory tls_cached_pchan_mem = { 0, NULL };
 
 class ParallelChannelDone : public google::protobuf::Closure {
 private:
-    ParallelChannelDone(int fail_limit, int ndone, int nchan, int memsize,
-                        Controller* cntl, google::protobuf::Closure* user_done)
+    ParallelChannelDone(int fail_limit, int success_limit, int ndone, int nchan,
+                        int memsize, Controller* cntl,
+                        google::protobuf::Closure* user_done)
         : _fail_limit(fail_limit)
+        , _success_limit(success_limit)
         , _ndone(ndone)
         , _nchan(nchan)
         , _memsize(memsize)
         , _current_fail(0)
+        , _current_success(0)
         , _current_done(0)
         , _cntl(cntl)
         , _user_done(user_done)
@@ -89,8 +94,8 @@ public:
     };
     
     static ParallelChannelDone* Create(
-        int fail_limit, int ndone, const SubCall* aps, int nchan,
-        Controller* cntl, google::protobuf::Closure* user_done) {
+        int fail_limit, int success_limit, int ndone, const SubCall* aps,
+        int nchan, Controller* cntl, google::protobuf::Closure* user_done) {
         // We need to create the object in this way because _sub_done is
         // dynamically allocated.
         // The memory layout:
@@ -131,7 +136,7 @@ public:
         }
 #endif
         ParallelChannelDone* d = new (mem) ParallelChannelDone(
-            fail_limit, ndone, nchan, memsize, cntl, user_done);
+            fail_limit, success_limit, ndone, nchan, memsize, cntl, user_done);
 
         // Apply client settings of _cntl to controllers of sub calls, except
         // timeout. If we let sub channel do their timeout separately, when
@@ -221,9 +226,16 @@ public:
             // [ called from SubDone::Run() ]
 
             // Count failed sub calls, if fail_limit is reached, cancel others.
-            if (fin->cntl.FailedInline() &&
-                _current_fail.fetch_add(1, butil::memory_order_relaxed) + 1
-                == _fail_limit) {
+            // So do successful sub calls if success_limit is set.
+            bool cancel_others = false;
+            if (fin->cntl.FailedInline()) {
+                cancel_others = (_current_fail.fetch_add(
+                        1, butil::memory_order_relaxed) + 1 == _fail_limit);
+            } else if (_success_limit > 0) {
+                cancel_others = (_current_success.fetch_add(
+                        1, butil::memory_order_relaxed) + 1 == _success_limit);
+            }
+            if (cancel_others) {
                 for (int i = 0; i < _ndone; ++i) {
                     SubDone* sd = sub_done(i);
                     if (fin != sd) {
@@ -309,7 +321,14 @@ public:
         // to be failed since the RPC is still considered to be successful if
         // nfailed is less than fail_limit
         int nfailed = _current_fail.load(butil::memory_order_relaxed);
-        if (nfailed < _fail_limit) {
+        // Sub calls canceled after success_limit is reached are counted in
+        // nfailed as well, the RPC is successful if enough responses are
+        // merged.
+        bool quorum = (_success_limit > 0 &&
+                       _current_success.load(butil::memory_order_relaxed)
+                       >= _success_limit);
+        int nmerged = 0;
+        if (nfailed < _fail_limit || quorum) {
             for (int i = 0; i < _ndone; ++i) {
                 SubDone* sd = sub_done(i);
                 google::protobuf::Message* sub_res = sd->cntl._response;
@@ -317,8 +336,10 @@ public:
                     if (sd->merger == NULL) {
                         try {
                             _cntl->_response->MergeFrom(*sub_res);
+                            ++nmerged;
                         } catch (const std::exception& e) {
                             nfailed = _ndone;
+                            quorum = false;
                             _cntl->SetFailed(ERESPONSE, "%s", e.what());
                             break;
                         }
@@ -327,12 +348,14 @@ public:
                             sd->merger->Merge(_cntl->_response, sub_res);
                         switch (res) {
                         case ResponseMerger::MERGED:
+                            ++nmerged;
                             break;
                         case ResponseMerger::FAIL:
                             ++nfailed;
                             break;
                         case ResponseMerger::FAIL_ALL:
                             nfailed = _ndone;
+                            quorum = false;
                             _cntl->SetFailed(
                                 ERESPONSE,
                                 "Fail to merge response of channel[%d]", i);
@@ -343,8 +366,11 @@ public:
             }
         }
 
+        if (quorum && nmerged < _success_limit) {
+            quorum = false;
+        }
         // Note: 1 <= _fail_limit <= _ndone.
-        if (nfailed >= _fail_limit) {
+        if (nfailed >= _fail_limit && !quorum) {
             // If controller was already failed, don't change it.
             if (!_cntl->FailedInline()) {
                 char buf[16];
@@ -377,7 +403,8 @@ public:
             // considered to be successful. For example, a RPC to a
             // ParallelChannel is canceled by user however enough sub calls
             // (> _ndone - fail_limit) already succeed before the canceling,
-            // the RPC is still successful rather than ECANCELED.
+            // the RPC is still successful rather than ECANCELED. So is a RPC
+            // whose success_limit is reached.
             _cntl->_error_code = 0;
             _cntl->_error_text.clear();
         }
@@ -423,6 +450,7 @@ public:
 
 private:
     int _fail_limit;
+    int _success_limit;
     int _ndone;
     int _nchan;
 #if defined(__clang__)
@@ -431,6 +459,7 @@ private:
     int _memsize;
 #endif
     butil::atomic<int> _current_fail;
+    butil::atomic<int> _current_success;
     butil::atomic<uint32_t> _current_done;
     Controller* _cntl;
     google::protobuf::Closure* _user_done;
@@ -582,6 +611,7 @@ void ParallelChannel::CallMethod(
     ParallelChannelDone* d = NULL;
     int ndone = nchan;
     int fail_limit = 1;
+    int success_limit = 0;
     DEFINE_SMALL_ARRAY(SubCall, aps, nchan, 64);
 
     if (cntl->FailedInline()) {
@@ -636,8 +666,12 @@ void ParallelChannel::CallMethod(
         }
     }
     
-    d = ParallelChannelDone::Create(fail_limit, ndone, aps, nchan,
-                                    cntl, done);
+    if (_options.success_limit > 0) {
+        success_limit = std::min(_options.success_limit, ndone);
+    }
+    
+    d = ParallelChannelDone::Create(fail_limit, success_limit, ndone, aps,
+                                    nchan, cntl, done);
     if (NULL == d) {
         cntl->SetFailed(ENOMEM, "Fail to new ParallelChannelDone");
         goto FAIL;
@@ -673,6 +707,20 @@ void ParallelChannel::CallMethod(
     } else {
         cntl->_deadline_us = -1;
     }
+    if (ndone > 1) {
+        // Sub calls sending the request as it is (e.g. without CallMapper)
+        // serialize it only once.
+        butil::intrusive_ptr<SharedRequestBuf> shared = cntl->_shared_request_buf;
+        for (int i = 0; i < ndone; ++i) {
+            ParallelChannelDone::SubDone* sd = d->sub_done(i);
+            if (sd->ap.request == request) {
+                if (shared == NULL) {
+                    shared.reset(new SharedRequestBuf);
+                }
+                sd->cntl._shared_request_buf = shared;
+            }
+        }
+    }
     d->SaveThreadInfoOfCallsite();
     CHECK_EQ(0, bthread_id_unlock(cid));
     // Don't touch `cntl' and `d' again (for async RPC)
@@ -744,6 +792,9 @@ int ParallelChannel::CheckHealth() {
         threshold -= _options.fail_limit;
         ++threshold;
     }
+    if (_options.success_limit > 0 && _options.success_limit < threshold) {
+        threshold = _options.success_limit;
+    }
     if (threshold <= 0) {
         return 0;
     }
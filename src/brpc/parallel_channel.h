@@ -154,6 +154,13 @@ struct ParallelChannelOptions {
     // does not fail unless all sub RPC failed.
     int fail_limit;
 
+    // The RPC ends as soon as so many sub RPC succeed, other sub RPC are
+    // canceled, and the RPC is successful if responses of at least so many
+    // sub RPC are merged successfully. This cuts the latency of fanning out
+    // to many sub channels when responses of part of them are enough.
+    // Default: 0 (wait for all sub RPC)
+    int success_limit;
+
     // Construct with default options.
     ParallelChannelOptions();
 };
@@ -220,7 +227,7 @@ public:
     size_t channel_count() const { return _chans.size(); }
     
     // Reset to the state that this channel was just constructed.
-    // NOTE: fail_limit is kept.
+    // NOTE: fail_limit and success_limit are kept.
     void Reset();
 
     // Minimum weight of sub channels.
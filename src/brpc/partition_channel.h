@@ -63,6 +63,16 @@ struct PartitionChannelOptions : public ChannelOptions {
     // will not be canceled until all sub calls failed.
     int fail_limit;
 
+    // Make RPC call end soon when so many partitions succeeded, calls to
+    // other partitions are canceled. Combined with backup_request_ms or
+    // backup_request_percentile, which are applied to each partition
+    // separately so that a slow replica of a partition is backed up by
+    // another replica of the same partition, a RPC waits neither for slow
+    // replicas nor for slow partitions.
+    // Check comments on ParallelChannelOptions.success_limit.
+    // Default: 0 (wait for all partitions)
+    int success_limit;
+
     // Check comments on ParallelChannel.AddChannel in parallel_channel.h
     // Sub channels in PartitionChannel share the same mapper and merger.
     butil::intrusive_ptr<CallMapper> call_mapper;
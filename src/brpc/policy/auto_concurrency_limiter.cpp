@@ -16,6 +16,7 @@
 // under the License.
 
 #include <cmath>
+#include <algorithm>
 #include <gflags/gflags.h>
 #include "brpc/errno.pb.h"
 #include "brpc/policy/auto_concurrency_limiter.h"
@@ -77,6 +78,12 @@ DEFINE_int32(auto_cl_latency_fluctuation_correction_factor, 1,
              "the value, the higher the tolerance for the fluctuation of the "
              "latency. If the value is too large, the latency will be higher "
              "when the server is overloaded.");
+DEFINE_double(auto_cl_priority_headroom_ratio, 0.1,
+              "Requests with REQUEST_PRIORITY_LOW are rejected when the "
+              "concurrency exceeds max_concurrency*(1-this_value), while "
+              "requests with REQUEST_PRIORITY_HIGH are accepted until "
+              "max_concurrency*(1+this_value), so that low-priority requests "
+              "are shed first when the server is overloaded.");
 
 AutoConcurrencyLimiter::AutoConcurrencyLimiter()
     : _max_concurrency(FLAGS_auto_cl_initial_max_concurrency)
@@ -97,6 +104,18 @@ bool AutoConcurrencyLimiter::OnRequested(int current_concurrency) {
     return current_concurrency <= _max_concurrency;
 }
 
+bool AutoConcurrencyLimiter::OnRequested(int current_concurrency,
+                                         RequestPriority priority) {
+    if (priority == REQUEST_PRIORITY_NORMAL) {
+        return current_concurrency <= _max_concurrency;
+    }
+    const double headroom = FLAGS_auto_cl_priority_headroom_ratio *
+        (priority - REQUEST_PRIORITY_NORMAL);
+    const int limit = std::max(
+        (int)std::ceil(_max_concurrency * (1 + headroom)), 1);
+    return current_concurrency <= limit;
+}
+
 void AutoConcurrencyLimiter::OnResponded(int error_code, int64_t latency_us) {
     if (0 == error_code) {
         _total_succ_req.fetch_add(1, butil::memory_order_relaxed);
@@ -30,6 +30,11 @@ public:
     AutoConcurrencyLimiter();
 
     bool OnRequested(int current_concurrency) override;
+
+    // Requests with lower priorities are rejected at lower concurrency,
+    // see -auto_cl_priority_headroom_ratio.
+    bool OnRequested(int current_concurrency,
+                     RequestPriority priority) override;
     
     void OnResponded(int error_code, int64_t latency_us) override;
 
@@ -0,0 +1,151 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <errno.h>
+#include <algorithm>                            // std::min
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"                  // BAIDU_SCOPED_LOCK
+#include "brpc/policy/baidu_progressive_attachment.h"
+
+
+namespace brpc {
+namespace policy {
+
+class IgnoreAllRead : public ProgressiveReader {
+public:
+    // @ProgressiveReader
+    butil::Status OnReadOnePart(const void* /*data*/, size_t /*length*/) {
+        return butil::Status::OK();
+    }
+    void OnEndOfMessage(const butil::Status&) {}
+};
+
+// Feed blocks of `buf' to `r'.
+static butil::Status FeedReader(ProgressiveReader* r, const butil::IOBuf& buf) {
+    const size_t nblocks = buf.backing_block_num();
+    for (size_t i = 0; i < nblocks; ++i) {
+        butil::StringPiece blk = buf.backing_block(i);
+        if (blk.empty()) {
+            continue;
+        }
+        butil::Status st = r->OnReadOnePart(blk.data(), blk.size());
+        if (!st.ok()) {
+            return st;
+        }
+    }
+    return butil::Status::OK();
+}
+
+BaiduProgressiveAttachment::BaiduProgressiveAttachment(uint64_t size)
+    : _remaining(size)
+    , _reader(NULL)
+    , _has_reader(false)
+    , _ended(size == 0) {
+}
+
+BaiduProgressiveAttachment::~BaiduProgressiveAttachment() {
+    if (_reader) {
+        _reader->OnEndOfMessage(
+            butil::Status(ECONNRESET, "The attachment was not read completely"));
+        _reader = NULL;
+    }
+}
+
+butil::Status BaiduProgressiveAttachment::Append(butil::IOBuf* source) {
+    butil::IOBuf part;
+    const size_t n = (size_t)std::min((uint64_t)source->size(), _remaining);
+    source->cutn(&part, n);
+    _remaining -= n;
+    // The reader is called with the lock held so that parts are fed in
+    // order even if the reader is being set concurrently.
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_ended) {
+        // The reader failed before, drop the remaining bytes.
+        return _end_status;
+    }
+    if (_reader == NULL) {
+        _buf.append(part);
+        _ended = (_remaining == 0);
+        return butil::Status::OK();
+    }
+    butil::Status st = FeedReader(_reader, part);
+    if (!st.ok() || _remaining == 0) {
+        _ended = true;
+        _end_status = st;
+        _reader->OnEndOfMessage(st);
+        _reader = NULL;
+    }
+    return st;
+}
+
+void BaiduProgressiveAttachment::Abort(const butil::Status& status) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_ended) {
+        return;
+    }
+    _ended = true;
+    _end_status = status;
+    if (_reader) {
+        _reader->OnEndOfMessage(status);
+        _reader = NULL;
+    }
+}
+
+void BaiduProgressiveAttachment::ReadProgressiveAttachmentBy(
+    ProgressiveReader* r) {
+    if (r == NULL) {
+        LOG(FATAL) << "Param[r] is NULL";
+        return;
+    }
+    // The reader may end the RPC and release the last reference to this
+    // object in OnEndOfMessage(), keep it alive until the lock is released.
+    butil::intrusive_ptr<BaiduProgressiveAttachment> self_guard(this);
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_has_reader) {
+        return r->OnEndOfMessage(
+            butil::Status(EPERM, "ReadProgressiveAttachmentBy() was called"));
+    }
+    _has_reader = true;
+    butil::Status st = _end_status;
+    if (st.ok()) {
+        st = FeedReader(r, _buf);
+        _buf.clear();
+    }
+    if (!st.ok() || _ended) {
+        _ended = true;
+        _end_status = st;
+        return r->OnEndOfMessage(st);
+    }
+    _reader = r;
+}
+
+void BaiduProgressiveAttachment::Discard() {
+    static IgnoreAllRead* s_ignore_all_read = new IgnoreAllRead;
+    ReadProgressiveAttachmentBy(s_ignore_all_read);
+}
+
+void BaiduProgressiveContext::Destroy() {
+    if (!rpa->Completed()) {
+        rpa->Abort(butil::Status(ECONNRESET, "The connection was closed"
+                                 " before the attachment was read completely"));
+    }
+    delete this;
+}
+
+}  // namespace policy
+} // namespace brpc
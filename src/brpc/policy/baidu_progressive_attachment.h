@@ -0,0 +1,84 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_BAIDU_PROGRESSIVE_ATTACHMENT_H
+#define BRPC_POLICY_BAIDU_PROGRESSIVE_ATTACHMENT_H
+
+#include "butil/iobuf.h"                       // butil::IOBuf
+#include "butil/status.h"                      // butil::Status
+#include "butil/synchronization/lock.h"        // butil::Mutex
+#include "brpc/destroyable.h"                  // Destroyable
+#include "brpc/progressive_reader.h"           // ReadableProgressiveAttachment
+
+
+namespace brpc {
+namespace policy {
+
+// The attachment of a baidu_std message which is read from the connection
+// after the message is processed. Bytes are fed to the ProgressiveReader as
+// soon as they're read, or buffered until the reader is set. Since the
+// reader is called in the thread reading the connection, a slow reader
+// slows down reading instead of accumulating bytes in memory.
+class BaiduProgressiveAttachment : public ReadableProgressiveAttachment {
+public:
+    // `size' is the number of bytes of the attachment.
+    explicit BaiduProgressiveAttachment(uint64_t size);
+    ~BaiduProgressiveAttachment();
+
+    // Cut at most remaining bytes of the attachment from `source'.
+    // Returns error if the reader failed to consume the bytes.
+    butil::Status Append(butil::IOBuf* source);
+
+    // True if all bytes of the attachment were read.
+    bool Completed() const { return _remaining == 0; }
+
+    // The connection broke before the attachment was read completely.
+    void Abort(const butil::Status& status);
+
+    // Drop all bytes of the attachment since no one is going to read it.
+    void Discard();
+
+    // @ReadableProgressiveAttachment
+    void ReadProgressiveAttachmentBy(ProgressiveReader* r) override;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(BaiduProgressiveAttachment);
+
+    // Only touched by the thread reading the connection.
+    uint64_t _remaining;
+    butil::Mutex _mutex;
+    // Read before the reader is set.
+    butil::IOBuf _buf;
+    ProgressiveReader* _reader;
+    bool _has_reader;
+    bool _ended;
+    butil::Status _end_status;
+};
+
+// Parsing context of the connection in the middle of reading an attachment.
+struct BaiduProgressiveContext : public Destroyable {
+    butil::intrusive_ptr<BaiduProgressiveAttachment> rpa;
+
+    void Destroy() override;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_BAIDU_PROGRESSIVE_ATTACHMENT_H
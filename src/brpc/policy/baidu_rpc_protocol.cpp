@@ -16,6 +16,9 @@
 // under the License.
 
 
+#include <sys/resource.h>                       // getrusage
+#include <unistd.h>                             // sysconf
+#include <algorithm>                            // std::min
 #include <google/protobuf/descriptor.h>         // MethodDescriptor
 #include <google/protobuf/message.h>            // Message
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
@@ -24,20 +27,35 @@
 #include "butil/time.h"
 #include "butil/iobuf.h"                         // butil::IOBuf
 #include "butil/raw_pack.h"                      // RawPacker RawUnpacker
+#include "butil/crc32c.h"                        // crc32c::Extend
+#include "butil/class_name.h"                    // class_name_str
 #include "brpc/controller.h"                    // Controller
+#include "brpc/reloadable_flags.h"              // BRPC_VALIDATE_GFLAG
 #include "brpc/socket.h"                        // Socket
 #include "brpc/server.h"                        // Server
 #include "brpc/span.h"
 #include "brpc/compress.h"                      // ParseFromCompressedData
 #include "brpc/stream_impl.h"
 #include "brpc/rpc_dump.h"                      // SampledRequest
+#include "brpc/serialized_request.h"            // SerializedRequest
+#include "brpc/serialized_response.h"           // SerializedResponse
+#include "brpc/baidu_master_service.h"          // BaiduMasterService
 #include "brpc/policy/baidu_rpc_meta.pb.h"      // RpcRequestMeta
 #include "brpc/policy/baidu_rpc_protocol.h"
 #include "brpc/policy/most_common_message.h"
+#include "brpc/policy/baidu_progressive_attachment.h"
 #include "brpc/policy/streaming_rpc_protocol.h"
+#include "brpc/policy/zstd_compress.h"
 #include "brpc/details/usercode_backup_pool.h"
+#include "brpc/details/rpc_deadline.h"
+#include "brpc/details/running_method.h"
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/details/server_private_accessor.h"
+#include "brpc/details/pb_arena_pool.h"          // GetPooledArena
+#include "brpc/details/response_cache.h"         // ResponseCache
+#include "brpc/details/method_executor.h"        // MethodExecutor
+#include "brpc/details/method_id.h"              // MethodIdOf
+#include "brpc/iobuf_fields.h"                    // ParsePbWithIOBufFields
 
 extern "C" {
 void bthread_assign_data(void* data);
@@ -51,12 +69,110 @@ DEFINE_bool(baidu_protocol_use_fullname, true,
             "If this flag is true, baidu_std puts service.full_name in requests"
             ", otherwise puts service.name (required by jprotobuf).");
 
+DEFINE_bool(baidu_protocol_compact_meta, false,
+            "Ask servers to accept compact meta which carries an integer id of"
+            " the method instead of names. Requests without log_id, request_id"
+            ", tracing, streams, zstd dictionaries and authentication are sent"
+            " with compact meta after the server accepts");
+BRPC_VALIDATE_GFLAG(baidu_protocol_compact_meta, PassValidate);
+
+DEFINE_bool(baidu_protocol_checksum, false,
+            "Put crc32c of the body(payload and attachment) into meta of "
+            "requests and responses sent, to detect corruption on the path. "
+            "Messages are not sent with compact meta when this flag is on");
+BRPC_VALIDATE_GFLAG(baidu_protocol_checksum, PassValidate);
+
+DEFINE_bool(baidu_protocol_verify_checksum, true,
+            "Verify checksums of requests and responses received, messages "
+            "mismatching their checksums are failed with EREQUEST/ERESPONSE");
+BRPC_VALIDATE_GFLAG(baidu_protocol_verify_checksum, PassValidate);
+
+DEFINE_bool(baidu_protocol_load_report, false,
+            "Put cpu usage of the process and concurrency of the method into "
+            "meta of responses sent, for load balancers of clients to weight "
+            "servers by load. Responses are not sent with compact meta when "
+            "this flag is on");
+BRPC_VALIDATE_GFLAG(baidu_protocol_load_report, PassValidate);
+
 // Notes:
 // 1. 12-byte header [PRPC][body_size][meta_size]
 // 2. body_size and meta_size are in network byte order
 // 3. Use service->full_name() + method_name to specify the method to call
 // 4. `attachment_size' is set iff request/response has attachment
 // 5. Not supported: chunk_info
+// 6. `compress_dict_id' is set iff the sender has a zstd dictionary for the
+//    method. Requests are compressed with the dictionary of the client,
+//    responses are compressed with the dictionary only when the client has
+//    the same one as the server.
+// 7. Compact meta has a fixed layout and begins with byte 0 which is never
+//    the first byte of a serialized RpcMeta(field number 0 is invalid):
+//      request:  [0][1][compress_type][priority][correlation_id:8]
+//                [method_id:8][timeout_ms:4][attachment_size:4]
+//      response: [0][2][compress_type][0][correlation_id:8]
+//                [attachment_size:4]
+//    where method_id is MethodIdOf(method->full_name()) and timeout_ms is -1
+//    when unset. A client sends ask_compact_meta in RpcRequestMeta until the
+//    server answers with compact_meta in RpcResponseMeta or a compact
+//    response, requests on that connection may use compact meta since then.
+//    Servers send compact responses to clients that asked or sent compact
+//    requests, when the response has no error, stream or zstd dictionary.
+//    Peers not knowing these fields never see compact meta.
+// 8. `checksum' is crc32c of the whole body(payload and attachment), set
+//    iff the sender has -baidu_protocol_checksum on. Not verified when the
+//    attachment is read progressively.
+// 9. `load_report' in RpcResponseMeta is set iff the server has
+//    -baidu_protocol_load_report on, see ServerLoad in controller.h.
+
+// Cpu usage of this process in per mille of all cores, sampled at most
+// once per 100ms by whoever comes first.
+static int ProcessCpuPermille() {
+    static const int64_t ncore = std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    static butil::atomic<int64_t> last_wall_us(0);
+    static butil::atomic<int64_t> last_cpu_us(0);
+    static butil::atomic<int> permille(0);
+    const int64_t now_us = butil::gettimeofday_us();
+    int64_t wall_us = last_wall_us.load(butil::memory_order_relaxed);
+    if (now_us - wall_us < 100000L ||
+        !last_wall_us.compare_exchange_strong(
+            wall_us, now_us, butil::memory_order_relaxed)) {
+        return permille.load(butil::memory_order_relaxed);
+    }
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return permille.load(butil::memory_order_relaxed);
+    }
+    const int64_t cpu_us =
+        butil::timeval_to_microseconds(usage.ru_utime) +
+        butil::timeval_to_microseconds(usage.ru_stime);
+    const int64_t prev_cpu_us =
+        last_cpu_us.exchange(cpu_us, butil::memory_order_relaxed);
+    if (wall_us != 0) {
+        const int64_t p =
+            (cpu_us - prev_cpu_us) * 1000 / ((now_us - wall_us) * ncore);
+        permille.store((int)std::min(std::max(p, (int64_t)0), (int64_t)1000),
+                       butil::memory_order_relaxed);
+    }
+    return permille.load(butil::memory_order_relaxed);
+}
+
+static void FillLoadReport(const MethodStatus* method_status,
+                           ServerLoadReport* report) {
+    report->set_cpu_utilization(ProcessCpuPermille());
+    if (method_status) {
+        report->set_concurrency(method_status->concurrency());
+        report->set_max_concurrency(method_status->MaxConcurrency());
+    }
+}
+
+static const char COMPACT_META_REQUEST = 1;
+static const char COMPACT_META_RESPONSE = 2;
+static const size_t COMPACT_REQUEST_META_SIZE = 28;
+static const size_t COMPACT_RESPONSE_META_SIZE = 16;
+
+inline bool IsCompactMeta(const butil::IOBuf& meta) {
+    const char* p = (const char*)meta.fetch1();
+    return p != NULL && *p == 0;
+}
 
 // Pack header into `buf'
 inline void PackRpcHeader(char* rpc_header, int meta_size, int payload_size) {
@@ -67,6 +183,22 @@ inline void PackRpcHeader(char* rpc_header, int meta_size, int payload_size) {
         .pack32(meta_size);
 }
 
+// crc32c of `body' followed by `attachment', extended block by block
+// without copying or reading data twice.
+static uint32_t BodyChecksum(const butil::IOBuf& body,
+                             const butil::IOBuf& attachment) {
+    uint32_t crc = 0;
+    const butil::IOBuf* bufs[] = { &body, &attachment };
+    for (size_t i = 0; i < arraysize(bufs); ++i) {
+        const size_t nblock = bufs[i]->backing_block_num();
+        for (size_t j = 0; j < nblock; ++j) {
+            const butil::StringPiece blk = bufs[i]->backing_block(j);
+            crc = butil::crc32c::Extend(crc, blk.data(), blk.size());
+        }
+    }
+    return crc;
+}
+
 static void SerializeRpcHeaderAndMeta(
     butil::IOBuf* out, const RpcMeta& meta, int payload_size) {
     const int meta_size = meta.ByteSize();
@@ -89,8 +221,252 @@ static void SerializeRpcHeaderAndMeta(
     }
 }
 
+static void SerializeCompactRequestHeaderAndMeta(
+    butil::IOBuf* out, uint64_t correlation_id, uint64_t method_id,
+    CompressType compress_type, RequestPriority priority, int32_t timeout_ms,
+    uint32_t attachment_size, int payload_size) {
+    char buf[12 + COMPACT_REQUEST_META_SIZE];
+    PackRpcHeader(buf, COMPACT_REQUEST_META_SIZE, payload_size);
+    char* meta = buf + 12;
+    meta[0] = 0;
+    meta[1] = COMPACT_META_REQUEST;
+    meta[2] = (char)compress_type;
+    meta[3] = (char)priority;
+    butil::RawPacker(meta + 4)
+        .pack64(correlation_id)
+        .pack64(method_id)
+        .pack32((uint32_t)timeout_ms)
+        .pack32(attachment_size);
+    out->append(buf, sizeof(buf));
+}
+
+static void SerializeCompactResponseHeaderAndMeta(
+    butil::IOBuf* out, int64_t correlation_id, CompressType compress_type,
+    uint32_t attachment_size, int payload_size) {
+    char buf[12 + COMPACT_RESPONSE_META_SIZE];
+    PackRpcHeader(buf, COMPACT_RESPONSE_META_SIZE, payload_size);
+    char* meta = buf + 12;
+    meta[0] = 0;
+    meta[1] = COMPACT_META_RESPONSE;
+    meta[2] = (char)compress_type;
+    meta[3] = 0;
+    butil::RawPacker(meta + 4)
+        .pack64((uint64_t)correlation_id)
+        .pack32(attachment_size);
+    out->append(buf, sizeof(buf));
+}
+
+// Fill `meta' and `method_id' with the compact request meta in `buf'.
+static bool ParseCompactRequestMeta(const butil::IOBuf& buf, RpcMeta* meta,
+                                    uint64_t* method_id) {
+    char data[COMPACT_REQUEST_META_SIZE];
+    if (buf.size() != sizeof(data)) {
+        return false;
+    }
+    buf.copy_to(data, sizeof(data));
+    if (data[1] != COMPACT_META_REQUEST) {
+        return false;
+    }
+    uint64_t correlation_id = 0;
+    uint32_t timeout_ms = 0;
+    uint32_t attachment_size = 0;
+    butil::RawUnpacker(data + 4)
+        .unpack64(correlation_id)
+        .unpack64(*method_id)
+        .unpack32(timeout_ms)
+        .unpack32(attachment_size);
+    if (*method_id == 0) {
+        return false;
+    }
+    meta->set_correlation_id((int64_t)correlation_id);
+    meta->set_compress_type((uint8_t)data[2]);
+    if (attachment_size != 0) {
+        meta->set_attachment_size((int32_t)attachment_size);
+    }
+    RpcRequestMeta* request_meta = meta->mutable_request();
+    if ((uint8_t)data[3] != REQUEST_PRIORITY_NORMAL) {
+        request_meta->set_priority((uint8_t)data[3]);
+    }
+    if ((int32_t)timeout_ms >= 0) {
+        request_meta->set_timeout_ms((int32_t)timeout_ms);
+    }
+    return true;
+}
+
+static bool ParseCompactResponseMeta(const butil::IOBuf& buf, RpcMeta* meta) {
+    char data[COMPACT_RESPONSE_META_SIZE];
+    if (buf.size() != sizeof(data)) {
+        return false;
+    }
+    buf.copy_to(data, sizeof(data));
+    if (data[1] != COMPACT_META_RESPONSE) {
+        return false;
+    }
+    uint64_t correlation_id = 0;
+    uint32_t attachment_size = 0;
+    butil::RawUnpacker(data + 4)
+        .unpack64(correlation_id)
+        .unpack32(attachment_size);
+    meta->set_correlation_id((int64_t)correlation_id);
+    meta->set_compress_type((uint8_t)data[2]);
+    if (attachment_size != 0) {
+        meta->set_attachment_size((int32_t)attachment_size);
+    }
+    return true;
+}
+
+// Find the method requested with `meta', NULL if not found.
+static const Server::MethodProperty* FindRequestedMethod(
+    const Server* server, const RpcMeta& meta, uint64_t method_id) {
+    ServerPrivateAccessor server_accessor(server);
+    if (method_id != 0) {
+        return server_accessor.FindMethodPropertyById(method_id);
+    }
+    const RpcRequestMeta& request_meta = meta.request();
+    butil::StringPiece svc_name(request_meta.service_name());
+    if (svc_name.find('.') == butil::StringPiece::npos) {
+        const Server::ServiceProperty* sp =
+            server_accessor.FindServicePropertyByName(svc_name);
+        if (NULL == sp) {
+            return NULL;
+        }
+        svc_name = sp->service->GetDescriptor()->full_name();
+    }
+    return server_accessor.FindMethodPropertyByFullName(
+        svc_name, request_meta.method_name());
+}
+
+// True if the request with meta in `meta_buf' is sent to a method in
+// ServiceOptions.nonblocking_methods. The meta is parsed again in
+// ProcessRpcRequest(), which is cheap for compact meta.
+static bool IsRequestToNonBlockingMethod(const Server* server,
+                                         const butil::IOBuf& meta_buf) {
+    RpcMeta meta;
+    uint64_t method_id = 0;
+    if (IsCompactMeta(meta_buf)) {
+        if (!ParseCompactRequestMeta(meta_buf, &meta, &method_id)) {
+            return false;
+        }
+    } else if (!ParsePbFromIOBuf(&meta, meta_buf)) {
+        return false;
+    }
+    const Server::MethodProperty* mp =
+        FindRequestedMethod(server, meta, method_id);
+    return mp != NULL && mp->params.run_inline;
+}
+
+// Cut the message before its attachment, which is read progressively:
+//   - requests to methods with ServiceOptions.enable_progressive_read
+//   - responses to calls with Controller::response_will_be_read_progressively()
+// Remaining bytes of the attachment are read in following calls to
+// ParseRpcMessage() with the attachment set as the parsing context.
+// Returns false if the message should be parsed as a whole.
+static bool ParseProgressiveRpcMessage(butil::IOBuf* source, Socket* socket,
+                                       const Server* server,
+                                       uint32_t body_size, uint32_t meta_size,
+                                       ParseResult* result) {
+    const size_t header_size = 12;
+    if (source->length() < header_size + meta_size) {
+        *result = MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
+        return true;
+    }
+    butil::IOBuf meta_buf;
+    source->append_to(&meta_buf, meta_size, header_size);
+    RpcMeta meta;
+    if (server != NULL) {
+        uint64_t method_id = 0;
+        if (IsCompactMeta(meta_buf)) {
+            if (!ParseCompactRequestMeta(meta_buf, &meta, &method_id)) {
+                return false;
+            }
+        } else if (!ParsePbFromIOBuf(&meta, meta_buf)) {
+            return false;
+        }
+        const Server::MethodProperty* mp =
+            FindRequestedMethod(server, meta, method_id);
+        if (mp == NULL || !mp->params.enable_progressive_read) {
+            return false;
+        }
+    } else if (IsCompactMeta(meta_buf)) {
+        if (!ParseCompactResponseMeta(meta_buf, &meta)) {
+            return false;
+        }
+    } else if (!ParsePbFromIOBuf(&meta, meta_buf)) {
+        return false;
+    }
+    const int32_t attachment_size = meta.attachment_size();
+    if (attachment_size < 0 ||
+        (uint32_t)attachment_size > body_size - meta_size) {
+        // Rejected in processing.
+        return false;
+    }
+    const uint32_t head_size = body_size - attachment_size;
+    if (head_size > FLAGS_max_body_size) {
+        return false;
+    }
+    if (source->length() < header_size + head_size) {
+        *result = MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
+        return true;
+    }
+    source->pop_front(header_size);
+    MostCommonMessage* msg = MostCommonMessage::Get();
+    source->cutn(&msg->meta, meta_size);
+    source->cutn(&msg->payload, head_size - meta_size);
+    butil::intrusive_ptr<BaiduProgressiveAttachment> rpa(
+        new BaiduProgressiveAttachment(attachment_size));
+    // No reader yet, never fails.
+    rpa->Append(source);
+    msg->rpa = rpa;
+    if (!rpa->Completed()) {
+        BaiduProgressiveContext* ctx = new BaiduProgressiveContext;
+        ctx->rpa = rpa;
+        socket->reset_parsing_context(ctx);
+        if (server != NULL) {
+            // Process the request in another bthread so that the method can
+            // read the attachment while it's being read from the connection.
+            socket->read_will_be_progressive(CONNECTION_TYPE_SINGLE);
+        }
+    } else if (server == NULL) {
+        socket->OnProgressiveReadCompleted();
+    }
+    *result = MakeMessage(msg);
+    return true;
+}
+
+// Feed bytes of the attachment being read progressively to its reader.
+static ParseResult ParseProgressiveAttachment(butil::IOBuf* source,
+                                              Socket* socket,
+                                              BaiduProgressiveContext* ctx,
+                                              const Server* server) {
+    butil::Status st = ctx->rpa->Append(source);
+    if (!st.ok()) {
+        LOG(WARNING) << "Fail to read attachment from " << *socket
+                     << ": " << st;
+        return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG);
+    }
+    if (!ctx->rpa->Completed()) {
+        return MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
+    }
+    socket->reset_parsing_context(NULL);
+    if (server != NULL) {
+        socket->read_will_be_progressive(CONNECTION_TYPE_UNKNOWN);
+    } else {
+        socket->OnProgressiveReadCompleted();
+    }
+    // The message was returned before.
+    return MakeMessage(NULL);
+}
+
 ParseResult ParseRpcMessage(butil::IOBuf* source, Socket* socket,
-                            bool /*read_eof*/, const void*) {
+                            bool /*read_eof*/, const void* arg) {
+    const Server* server = static_cast<const Server*>(arg);
+    if (socket->parsing_context() != NULL) {
+        BaiduProgressiveContext* ctx =
+            dynamic_cast<BaiduProgressiveContext*>(socket->parsing_context());
+        if (ctx != NULL) {
+            return ParseProgressiveAttachment(source, socket, ctx, server);
+        }
+    }
     char header_buf[12];
     const size_t n = source->copy_to(header_buf, sizeof(header_buf));
     if (n >= 4) {
@@ -109,6 +485,25 @@ ParseResult ParseRpcMessage(butil::IOBuf* source, Socket* socket,
     uint32_t body_size;
     uint32_t meta_size;
     butil::RawUnpacker(header_buf + 4).unpack32(body_size).unpack32(meta_size);
+    bool progressive = false;
+    if (server == NULL) {
+        // Responses over single connections are never read progressively,
+        // see PackRpcRequest().
+        progressive = socket->is_read_progressive() &&
+            socket->connection_type_for_progressive_read() !=
+            CONNECTION_TYPE_SINGLE;
+    } else if (ServerPrivateAccessor(server).has_progressive_read_methods()) {
+        // Complete requests of normal sizes are processed as they are.
+        progressive = (body_size > FLAGS_max_body_size ||
+                       source->length() < sizeof(header_buf) + body_size);
+    }
+    if (progressive && meta_size <= body_size) {
+        ParseResult result = MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
+        if (ParseProgressiveRpcMessage(source, socket, server, body_size,
+                                       meta_size, &result)) {
+            return result;
+        }
+    }
     if (body_size > FLAGS_max_body_size) {
         // We need this log to report the body_size to give users some clues
         // which is not printed in InputMessenger.
@@ -129,27 +524,124 @@ ParseResult ParseRpcMessage(butil::IOBuf* source, Socket* socket,
     MostCommonMessage* msg = MostCommonMessage::Get();
     source->cutn(&msg->meta, meta_size);
     source->cutn(&msg->payload, body_size - meta_size);
+    if (progressive && server == NULL) {
+        socket->OnProgressiveReadCompleted();
+    }
+    if (server != NULL &&
+        ServerPrivateAccessor(server).has_nonblocking_methods() &&
+        IsRequestToNonBlockingMethod(server, msg->meta)) {
+        msg->set_run_inline();
+    }
     return MakeMessage(msg);
 }
 
-// Used by UT, can't be static.
-void SendRpcResponse(int64_t correlation_id,
-                     Controller* cntl, 
-                     const google::protobuf::Message* req,
-                     const google::protobuf::Message* res,
-                     const Server* server,
-                     MethodStatus* method_status,
-                     int64_t received_us) {
+// Key of a request in the response cache of server. Requests compressed
+// differently have different keys since the bytes are compared.
+static void MakeResponseCacheKey(const google::protobuf::MethodDescriptor* method,
+                                 const RpcMeta& meta,
+                                 const butil::IOBuf& payload,
+                                 std::string* key) {
+    const uint32_t compress_type = meta.compress_type();
+    const uint32_t dict_id = meta.compress_dict_id();
+    key->reserve(method->full_name().size() + 9 + payload.size());
+    key->append(method->full_name());
+    key->push_back('\0');
+    key->append((const char*)&compress_type, sizeof(compress_type));
+    key->append((const char*)&dict_id, sizeof(dict_id));
+    payload.append_to(key);
+}
+
+// Write the cached response of the call in `cntl' which is not run.
+static void SendCachedRpcResponse(int64_t correlation_id,
+                                  Controller* cntl,
+                                  const ResponseCache::Response& cached,
+                                  MethodStatus* method_status,
+                                  int64_t received_us) {
+    ControllerPrivateAccessor accessor(cntl);
+    const int64_t start_send_us = butil::cpuwide_time_us();
+    accessor.set_phase_begin_us(RPC_PHASE_SERVER_SERIALIZE, start_send_us);
+    Span* span = accessor.span();
+    if (span) {
+        span->set_start_send_us(start_send_us);
+    }
+    Socket* sock = accessor.get_sending_socket();
+    std::unique_ptr<Controller, LogErrorTextAndDelete> recycle_cntl(cntl);
+    ConcurrencyRemover concurrency_remover(method_status, cntl, received_us);
+
+    butil::IOBuf res_buf;
+    if (accessor.is_compact_rpc_meta() && !FLAGS_baidu_protocol_checksum &&
+        !FLAGS_baidu_protocol_load_report) {
+        SerializeCompactResponseHeaderAndMeta(
+            &res_buf, correlation_id, (CompressType)cached.compress_type,
+            cached.attachment.size(),
+            cached.body.size() + cached.attachment.size());
+    } else {
+        RpcMeta meta;
+        meta.mutable_response()->set_error_code(0);
+        if (FLAGS_baidu_protocol_load_report) {
+            FillLoadReport(method_status,
+                           meta.mutable_response()->mutable_load_report());
+        }
+        meta.set_correlation_id(correlation_id);
+        meta.set_compress_type(cached.compress_type);
+        if (!cached.attachment.empty()) {
+            meta.set_attachment_size(cached.attachment.size());
+        }
+        if (FLAGS_baidu_protocol_checksum) {
+            meta.set_checksum(BodyChecksum(cached.body, cached.attachment));
+        }
+        SerializeRpcHeaderAndMeta(&res_buf, meta,
+                                  cached.body.size() + cached.attachment.size());
+    }
+    res_buf.append(cached.body);
+    res_buf.append(cached.attachment);
+    if (span) {
+        span->set_response_size(res_buf.size());
+    }
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    accessor.set_phase_begin_us(RPC_PHASE_SERVER_WRITE,
+                                butil::cpuwide_time_us());
+    if (sock->Write(&res_buf, &wopt) != 0) {
+        const int errcode = errno;
+        PLOG_IF(WARNING, errcode != EPIPE) << "Fail to write into " << *sock;
+        cntl->SetFailed(errcode, "Fail to write into %s",
+                        sock->description().c_str());
+        return;
+    }
+    const int64_t sent_us = butil::cpuwide_time_us();
+    accessor.set_phase_begin_us(RPC_PHASE_SERVER_WRITTEN, sent_us);
+    if (span) {
+        span->set_sent_us(sent_us);
+    }
+}
+
+// Same as SendRpcResponse and puts the serialized response into the response
+// cache of server with `cache_key' if it's not NULL. `cache_key' is deleted.
+static void SendAndCacheRpcResponse(int64_t correlation_id,
+                                    Controller* cntl,
+                                    const google::protobuf::Message* req,
+                                    const google::protobuf::Message* res,
+                                    const Server* server,
+                                    MethodStatus* method_status,
+                                    int64_t received_us,
+                                    uint32_t res_dict_id,
+                                    std::string* cache_key) {
+    std::unique_ptr<std::string> recycle_cache_key(cache_key);
     ControllerPrivateAccessor accessor(cntl);
+    const int64_t start_send_us = butil::cpuwide_time_us();
+    accessor.set_phase_begin_us(RPC_PHASE_SERVER_SERIALIZE, start_send_us);
     Span* span = accessor.span();
     if (span) {
-        span->set_start_send_us(butil::cpuwide_time_us());
+        span->set_start_send_us(start_send_us);
     }
     Socket* sock = accessor.get_sending_socket();
     std::unique_ptr<Controller, LogErrorTextAndDelete> recycle_cntl(cntl);
     ConcurrencyRemover concurrency_remover(method_status, cntl, received_us);
-    std::unique_ptr<const google::protobuf::Message> recycle_req(req);
-    std::unique_ptr<const google::protobuf::Message> recycle_res(res);
+    // Messages allocated on the arena are destroyed along with cntl.
+    const bool on_arena = (cntl->arena() != NULL);
+    std::unique_ptr<const google::protobuf::Message> recycle_req(on_arena ? NULL : req);
+    std::unique_ptr<const google::protobuf::Message> recycle_res(on_arena ? NULL : res);
     
     StreamId response_stream_id = accessor.response_stream();
 
@@ -164,16 +656,56 @@ void SendRpcResponse(int64_t correlation_id,
     // If user calls `SetFailed' on Controller, we don't serialize
     // response either
     CompressType type = cntl->response_compress_type();
-    if (res != NULL && !cntl->Failed()) {
+    const SerializedResponse* raw_res =
+        dynamic_cast<const SerializedResponse*>(res);
+    if (raw_res != NULL && !cntl->Failed()) {
+        // Set by BaiduMasterService, already serialized (and compressed).
+        res_dict_id = 0;
+        res_body = raw_res->serialized_data();
+        append_body = true;
+    } else if (res != NULL && !cntl->Failed()) {
         if (!res->IsInitialized()) {
             cntl->SetFailed(
                 ERESPONSE, "Missing required fields in response: %s", 
                 res->InitializationErrorString().c_str());
-        } else if (!SerializeAsCompressedData(*res, &res_body, type)) {
-            cntl->SetFailed(ERESPONSE, "Fail to serialize response, "
-                            "CompressType=%s", CompressTypeToCStr(type));
         } else {
-            append_body = true;
+            AddZstdDictionarySample(cntl->method(), *res);
+            if (type != COMPRESS_TYPE_ZSTD) {
+                res_dict_id = 0;
+            }
+            bool serialized = false;
+            if (cntl->has_response_iobuf_fields() &&
+                !cntl->response_iobuf_fields().empty()) {
+                // Payloads of iobuf fields are not compressed.
+                serialized = (type == COMPRESS_TYPE_NONE &&
+                              SerializePbWithIOBufFields(
+                                  *res, cntl->response_iobuf_fields(), &res_body));
+            } else if (res_dict_id != 0) {
+                serialized = ZstdCompress(*res, &res_body, res_dict_id);
+            } else {
+                serialized = SerializeAsCompressedData(*res, &res_body, type);
+            }
+            if (!serialized) {
+                cntl->SetFailed(ERESPONSE, "Fail to serialize response, "
+                                "CompressType=%s", CompressTypeToCStr(type));
+            } else {
+                append_body = true;
+            }
+        }
+    }
+
+    if (cache_key != NULL) {
+        ResponseCache* cache = ServerPrivateAccessor(server).response_cache();
+        const ResponseCachePolicy* policy = cache->GetPolicy(cntl->method());
+        if (append_body && res_dict_id == 0 && policy != NULL &&
+            response_stream_id == INVALID_STREAM_ID) {
+            ResponseCache::Response cached;
+            cached.body = res_body;
+            cached.attachment = cntl->response_attachment();
+            cached.compress_type = cntl->response_compress_type();
+            cache->Insert(*cache_key, *policy, cached);
+        } else {
+            cache->Unrefresh(*cache_key);
         }
     }
 
@@ -191,33 +723,73 @@ void SendRpcResponse(int64_t correlation_id,
         // distinction between server error and client error
         error_code = EINTERNAL;
     }
-    RpcMeta meta;
-    RpcResponseMeta* response_meta = meta.mutable_response();
-    response_meta->set_error_code(error_code);
-    if (!cntl->ErrorText().empty()) {
-        // Only set error_text when it's not empty since protobuf Message
-        // always new the string no matter if it's empty or not.
-        response_meta->set_error_text(cntl->ErrorText());
-    }
-    meta.set_correlation_id(correlation_id);
-    meta.set_compress_type(cntl->response_compress_type());
-    if (attached_size > 0) {
-        meta.set_attachment_size(attached_size);
+    SampledRequest* sample = accessor.release_sampled_request();
+    if (sample) {
+        sample->meta.set_error_code(error_code);
+        if (append_body) {
+            if (type == COMPRESS_TYPE_NONE || raw_res != NULL) {
+                res_body.copy_to(sample->meta.mutable_response());
+            } else {
+                res->SerializeToString(sample->meta.mutable_response());
+            }
+        }
+        sample->submit();
     }
+    const bool compact = (accessor.is_compact_rpc_meta() &&
+                          error_code == 0 &&
+                          !(append_body && res_dict_id != 0) &&
+                          response_stream_id == INVALID_STREAM_ID &&
+                          !FLAGS_baidu_protocol_checksum &&
+                          !FLAGS_baidu_protocol_load_report);
+    RpcMeta meta;
     SocketUniquePtr stream_ptr;
-    if (response_stream_id != INVALID_STREAM_ID) {
-        if (Socket::Address(response_stream_id, &stream_ptr) == 0) {
-            Stream* s = (Stream*)stream_ptr->conn();
-            s->FillSettings(meta.mutable_stream_settings());
-            s->SetHostSocket(sock);
-        } else {
-            LOG(WARNING) << "Stream=" << response_stream_id 
-                         << " was closed before sending response";
+    if (!compact) {
+        RpcResponseMeta* response_meta = meta.mutable_response();
+        response_meta->set_error_code(error_code);
+        if (!cntl->ErrorText().empty()) {
+            // Only set error_text when it's not empty since protobuf Message
+            // always new the string no matter if it's empty or not.
+            response_meta->set_error_text(cntl->ErrorText());
+        }
+        if (accessor.is_compact_rpc_meta()) {
+            response_meta->set_compact_meta(true);
+        }
+        if (FLAGS_baidu_protocol_load_report) {
+            FillLoadReport(method_status,
+                           response_meta->mutable_load_report());
+        }
+        meta.set_correlation_id(correlation_id);
+        meta.set_compress_type(cntl->response_compress_type());
+        if (append_body && res_dict_id != 0) {
+            meta.set_compress_dict_id(res_dict_id);
+        }
+        if (attached_size > 0) {
+            meta.set_attachment_size(attached_size);
+        }
+        if (append_body && FLAGS_baidu_protocol_checksum) {
+            meta.set_checksum(BodyChecksum(res_body,
+                                           cntl->response_attachment()));
+        }
+        if (response_stream_id != INVALID_STREAM_ID) {
+            if (Socket::Address(response_stream_id, &stream_ptr) == 0) {
+                Stream* s = (Stream*)stream_ptr->conn();
+                s->FillSettings(meta.mutable_stream_settings());
+                s->SetHostSocket(sock);
+            } else {
+                LOG(WARNING) << "Stream=" << response_stream_id 
+                             << " was closed before sending response";
+            }
         }
     }
 
     butil::IOBuf res_buf;
-    SerializeRpcHeaderAndMeta(&res_buf, meta, res_size + attached_size);
+    if (compact) {
+        SerializeCompactResponseHeaderAndMeta(
+            &res_buf, correlation_id, cntl->response_compress_type(),
+            attached_size, res_size + attached_size);
+    } else {
+        SerializeRpcHeaderAndMeta(&res_buf, meta, res_size + attached_size);
+    }
     if (append_body) {
         res_buf.append(res_body.movable());
         if (attached_size) {
@@ -228,6 +800,8 @@ void SendRpcResponse(int64_t correlation_id,
     if (span) {
         span->set_response_size(res_buf.size());
     }
+    accessor.set_phase_begin_us(RPC_PHASE_SERVER_WRITE,
+                                butil::cpuwide_time_us());
     if (stream_ptr) {
         CHECK(accessor.remote_stream_settings() != NULL);
         // Send the response over stream to notify that this stream connection
@@ -259,12 +833,27 @@ void SendRpcResponse(int64_t correlation_id,
         }
     }
 
+    const int64_t sent_us = butil::cpuwide_time_us();
+    accessor.set_phase_begin_us(RPC_PHASE_SERVER_WRITTEN, sent_us);
     if (span) {
         // TODO: this is not sent
-        span->set_sent_us(butil::cpuwide_time_us());
+        span->set_sent_us(sent_us);
     }
 }
 
+// Used by UT, can't be static.
+void SendRpcResponse(int64_t correlation_id,
+                     Controller* cntl, 
+                     const google::protobuf::Message* req,
+                     const google::protobuf::Message* res,
+                     const Server* server,
+                     MethodStatus* method_status,
+                     int64_t received_us,
+                     uint32_t res_dict_id) {
+    SendAndCacheRpcResponse(correlation_id, cntl, req, res, server,
+                            method_status, received_us, res_dict_id, NULL);
+}
+
 struct CallMethodInBackupThreadArgs {
     ::google::protobuf::Service* service;
     const ::google::protobuf::MethodDescriptor* method;
@@ -276,8 +865,20 @@ struct CallMethodInBackupThreadArgs {
 
 static void CallMethodInBackupThread(void* void_args) {
     CallMethodInBackupThreadArgs* args = (CallMethodInBackupThreadArgs*)void_args;
-    args->service->CallMethod(args->method, args->controller, args->request,
-                              args->response, args->done);
+    Controller* cntl = static_cast<Controller*>(args->controller);
+    // The request may wait in the queue of the pool for long.
+    if (IsRpcDeadlineExpired(cntl->deadline_us())) {
+        cntl->SetFailed(ERPCTIMEDOUT, "Deadline of the request expired"
+                        " before running");
+        args->done->Run();
+    } else {
+        ControllerPrivateAccessor(cntl).set_phase_begin_us(
+            RPC_PHASE_SERVER_USERCODE, butil::cpuwide_time_us());
+        ScopedRpcDeadline deadline_guard(cntl->deadline_us());
+        ScopedRunningMethod method_guard(args->method);
+        args->service->CallMethod(args->method, args->controller,
+                                  args->request, args->response, args->done);
+    }
     delete args;
 }
 
@@ -299,6 +900,45 @@ void EndRunningCallMethodInPool(
     return EndRunningUserCodeInPool(CallMethodInBackupThread, args);
 };
 
+struct CallMasterServiceInBackupThreadArgs {
+    BaiduMasterService* service;
+    Controller* controller;
+    std::string service_name;
+    std::string method_name;
+    const SerializedRequest* request;
+    SerializedResponse* response;
+    google::protobuf::Closure* done;
+};
+
+static void CallMasterServiceInBackupThread(void* void_args) {
+    CallMasterServiceInBackupThreadArgs* args =
+        (CallMasterServiceInBackupThreadArgs*)void_args;
+    {
+        ScopedRpcDeadline deadline_guard(args->controller->deadline_us());
+        args->service->ProcessRpcRequest(args->controller, args->service_name,
+                                         args->method_name, args->request,
+                                         args->response, args->done);
+    }
+    delete args;
+}
+
+static void EndRunningMasterServiceInPool(
+    BaiduMasterService* service, Controller* controller,
+    const std::string& service_name, const std::string& method_name,
+    const SerializedRequest* request, SerializedResponse* response,
+    google::protobuf::Closure* done) {
+    CallMasterServiceInBackupThreadArgs* args =
+        new CallMasterServiceInBackupThreadArgs;
+    args->service = service;
+    args->controller = controller;
+    args->service_name = service_name;
+    args->method_name = method_name;
+    args->request = request;
+    args->response = response;
+    args->done = done;
+    return EndRunningUserCodeInPool(CallMasterServiceInBackupThread, args);
+}
+
 void ProcessRpcRequest(InputMessageBase* msg_base) {
     const int64_t start_parse_us = butil::cpuwide_time_us();
     DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage*>(msg_base));
@@ -308,36 +948,81 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
     ScopedNonServiceError non_service_error(server);
 
     RpcMeta meta;
-    if (!ParsePbFromIOBuf(&meta, msg->meta)) {
+    // Non-zero if the request is sent with compact meta.
+    uint64_t method_id = 0;
+    if (IsCompactMeta(msg->meta)) {
+        if (!ParseCompactRequestMeta(msg->meta, &meta, &method_id)) {
+            LOG(WARNING) << "Fail to parse compact RpcMeta from " << *socket;
+            socket->SetFailed(EREQUEST, "Fail to parse compact RpcMeta from %s",
+                              socket->description().c_str());
+            return;
+        }
+    } else if (!ParsePbFromIOBuf(&meta, msg->meta)) {
         LOG(WARNING) << "Fail to parse RpcMeta from " << *socket;
         socket->SetFailed(EREQUEST, "Fail to parse RpcMeta from %s",
                           socket->description().c_str());
         return;
     }
+    // Non-NULL if the attachment is being read from the connection, see
+    // ParseProgressiveRpcMessage().
+    butil::intrusive_ptr<BaiduProgressiveAttachment> rpa(
+        static_cast<BaiduProgressiveAttachment*>(msg->rpa.get()));
+    if (rpa != NULL) {
+        msg->rpa.reset(NULL);
+        meta.clear_attachment_size();
+    }
     const RpcRequestMeta &request_meta = meta.request();
+    ServerPrivateAccessor server_accessor(server);
 
     SampledRequest* sample = AskToBeSampled();
     if (sample) {
-        sample->meta.set_service_name(request_meta.service_name());
-        sample->meta.set_method_name(request_meta.method_name());
+        if (method_id != 0) {
+            const Server::MethodProperty* mp =
+                server_accessor.FindMethodPropertyById(method_id);
+            if (mp != NULL) {
+                sample->meta.set_service_name(mp->method->service()->full_name());
+                sample->meta.set_method_name(mp->method->name());
+            }
+        } else {
+            sample->meta.set_service_name(request_meta.service_name());
+            sample->meta.set_method_name(request_meta.method_name());
+        }
         sample->meta.set_compress_type((CompressType)meta.compress_type());
         sample->meta.set_protocol_type(PROTOCOL_BAIDU_STD);
         sample->meta.set_attachment_size(meta.attachment_size());
         sample->meta.set_authentication_data(meta.authentication_data());
         sample->request = msg->payload;
-        sample->submit(start_parse_us);
+        if (!FLAGS_rpc_dump_response) {
+            sample->submit(start_parse_us);
+            sample = NULL;
+        }
     }
 
     std::unique_ptr<Controller> cntl(new (std::nothrow) Controller);
     if (NULL == cntl.get()) {
         LOG(WARNING) << "Fail to new Controller";
+        if (sample) {
+            sample->submit(start_parse_us);
+        }
         return;
     }
+    if (sample) {
+        // Submitted along with the response in SendAndCacheRpcResponse().
+        ControllerPrivateAccessor(cntl.get()).set_sampled_request(sample);
+    }
     std::unique_ptr<google::protobuf::Message> req;
     std::unique_ptr<google::protobuf::Message> res;
 
-    ServerPrivateAccessor server_accessor(server);
     ControllerPrivateAccessor accessor(cntl.get());
+    if (rpa != NULL) {
+        // Discarded by the controller if the method does not read it.
+        accessor.set_readable_progressive_attachment(rpa.get());
+        accessor.set_read_progressively();
+    }
+    if (method_id != 0 ||
+        (request_meta.ask_compact_meta() && server_accessor.has_method_ids())) {
+        accessor.set_compact_rpc_meta();
+    }
     const bool security_mode = server->options().security_mode() &&
                                socket->user() == server_accessor.acceptor();
     if (request_meta.has_log_id()) {
@@ -346,6 +1031,16 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
     if (request_meta.has_request_id()) {
         cntl->set_request_id(request_meta.request_id());
     }
+    if (request_meta.has_priority() &&
+        RequestPriority_IsValid(request_meta.priority())) {
+        cntl->set_request_priority((RequestPriority)request_meta.priority());
+    }
+    if (request_meta.has_timeout_ms()) {
+        // Counted from receiving the request, which is not affected by
+        // difference between clocks of the client and server.
+        accessor.set_deadline_us(msg->base_real_us() + msg->received_us() +
+                                 request_meta.timeout_ms() * 1000L);
+    }
     cntl->set_request_compress_type((CompressType)meta.compress_type());
     accessor.set_server(server)
         .set_security_mode(security_mode)
@@ -355,6 +1050,8 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         .set_auth_context(socket->auth_context())
         .set_request_protocol(PROTOCOL_BAIDU_STD)
         .set_begin_time_us(msg->received_us())
+        .set_phase_begin_us(RPC_PHASE_SERVER_READ, msg->received_us())
+        .set_phase_begin_us(RPC_PHASE_SERVER_PARSE, start_parse_us)
         .move_in_server_receiving_sock(socket_guard);
 
     if (meta.has_stream_settings()) {
@@ -381,6 +1078,8 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
     }
 
     MethodStatus* method_status = NULL;
+    uint32_t res_dict_id = 0;
+    std::unique_ptr<std::string> cache_key;
     do {
         if (!server->IsRunning()) {
             cntl->SetFailed(ELOGOFF, "Server is stopping");
@@ -392,6 +1091,13 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
                             butil::endpoint2str(socket->remote_side()).c_str());
             break;
         }
+
+        if (meta.has_checksum() && rpa == NULL &&
+            FLAGS_baidu_protocol_verify_checksum &&
+            BodyChecksum(msg->payload, butil::IOBuf()) != meta.checksum()) {
+            cntl->SetFailed(EREQUEST, "Checksum of request mismatches");
+            break;
+        }
         
         if (!server_accessor.AddConcurrency(cntl.get())) {
             cntl->SetFailed(
@@ -406,28 +1112,135 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
             break;
         }
 
-        // NOTE(gejun): jprotobuf sends service names without packages. So the
-        // name should be changed to full when it's not.
-        butil::StringPiece svc_name(request_meta.service_name());
-        if (svc_name.find('.') == butil::StringPiece::npos) {
-            const Server::ServiceProperty* sp =
-                server_accessor.FindServicePropertyByName(svc_name);
-            if (NULL == sp) {
-                cntl->SetFailed(ENOSERVICE, "Fail to find service=%s",
-                                request_meta.service_name().c_str());
+        const Server::MethodProperty* mp = NULL;
+        BaiduMasterService* master = server->options().baidu_master_service;
+        if (method_id != 0) {
+            mp = server_accessor.FindMethodPropertyById(method_id);
+            if (NULL == mp) {
+                cntl->SetFailed(ENOMETHOD, "Fail to find method with id=%" PRIu64,
+                                method_id);
                 break;
             }
-            svc_name = sp->service->GetDescriptor()->full_name();
-        }
-        const Server::MethodProperty* mp =
-            server_accessor.FindMethodPropertyByFullName(
+        } else {
+            // NOTE(gejun): jprotobuf sends service names without packages. So the
+            // name should be changed to full when it's not.
+            butil::StringPiece svc_name(request_meta.service_name());
+            if (svc_name.find('.') == butil::StringPiece::npos) {
+                const Server::ServiceProperty* sp =
+                    server_accessor.FindServicePropertyByName(svc_name);
+                if (NULL == sp) {
+                    if (NULL == master) {
+                        cntl->SetFailed(ENOSERVICE, "Fail to find service=%s",
+                                        request_meta.service_name().c_str());
+                        break;
+                    }
+                } else {
+                    svc_name = sp->service->GetDescriptor()->full_name();
+                }
+            }
+            mp = server_accessor.FindMethodPropertyByFullName(
                 svc_name, request_meta.method_name());
+            if (NULL == mp && NULL == master) {
+                cntl->SetFailed(ENOMETHOD, "Fail to find method=%s/%s",
+                                request_meta.service_name().c_str(),
+                                request_meta.method_name().c_str());
+                break;
+            }
+        }
         if (NULL == mp) {
-            cntl->SetFailed(ENOMETHOD, "Fail to find method=%s/%s",
-                            request_meta.service_name().c_str(),
-                            request_meta.method_name().c_str());
-            break;
-        } else if (mp->service->GetDescriptor()
+            // Not added into this server, hand the request to
+            // BaiduMasterService without parsing it.
+            non_service_error.release();
+            method_status = master->_status;
+            if (method_status) {
+                int rejected_cc = 0;
+                if (!method_status->OnRequested(&rejected_cc,
+                                                cntl->request_priority())) {
+                    cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter,"
+                                    " concurrency=%d",
+                                    butil::class_name_str(*master).c_str(),
+                                    rejected_cc);
+                    break;
+                }
+            }
+            if (!server_accessor.AddInflightBytes(
+                    cntl.get(), method_status,
+                    msg->meta.size() + msg->payload.size())) {
+                cntl->SetFailed(ELIMIT, "Reached max_inflight_request_bytes=%" PRId64
+                                " of %s", method_status->max_inflight_bytes(),
+                                butil::class_name_str(*master).c_str());
+                break;
+            }
+            if (IsRpcDeadlineExpired(cntl->deadline_us())) {
+                cntl->SetFailed(ERPCTIMEDOUT, "Deadline of the request expired"
+                                " before running");
+                break;
+            }
+            if (meta.compress_dict_id() != 0) {
+                // Dictionaries are bound to methods of this server.
+                cntl->SetFailed(EREQUEST, "Request compressed with dictionary"
+                                " can't be relayed");
+                break;
+            }
+            if (span) {
+                span->ResetServerSpanName(request_meta.service_name() + '.' +
+                                          request_meta.method_name());
+            }
+            SerializedRequest* raw_req = new SerializedRequest;
+            req.reset(raw_req);
+            if (meta.has_attachment_size()) {
+                const int req_size = static_cast<int>(msg->payload.size());
+                if (req_size < meta.attachment_size()) {
+                    cntl->SetFailed(EREQUEST,
+                        "attachment_size=%d is larger than request_size=%d",
+                         meta.attachment_size(), req_size);
+                    break;
+                }
+                msg->payload.cutn(&raw_req->serialized_data(),
+                                  req_size - meta.attachment_size());
+                cntl->request_attachment().swap(msg->payload);
+            } else {
+                raw_req->serialized_data().swap(msg->payload);
+            }
+            SerializedResponse* raw_res = new SerializedResponse;
+            res.reset(raw_res);
+            google::protobuf::Closure* done = ::brpc::NewCallback<
+                int64_t, Controller*, const google::protobuf::Message*,
+                const google::protobuf::Message*, const Server*,
+                MethodStatus*, int64_t, uint32_t>(
+                    &SendRpcResponse, meta.correlation_id(), cntl.get(),
+                    req.get(), res.get(), server,
+                    method_status, msg->received_us(), 0u);
+            msg.reset();
+
+            const int64_t start_callback_us = butil::cpuwide_time_us();
+            accessor.set_phase_begin_us(RPC_PHASE_SERVER_QUEUE, start_callback_us)
+                .set_phase_begin_us(RPC_PHASE_SERVER_USERCODE, start_callback_us);
+            if (span) {
+                span->set_start_callback_us(start_callback_us);
+                span->AsParent();
+            }
+            req.release();
+            res.release();
+            if (!FLAGS_usercode_in_pthread) {
+                ScopedRpcDeadline deadline_guard(cntl->deadline_us());
+                return master->ProcessRpcRequest(
+                    cntl.release(), request_meta.service_name(),
+                    request_meta.method_name(), raw_req, raw_res, done);
+            }
+            if (BeginRunningUserCode()) {
+                ScopedRpcDeadline deadline_guard(cntl->deadline_us());
+                master->ProcessRpcRequest(
+                    cntl.release(), request_meta.service_name(),
+                    request_meta.method_name(), raw_req, raw_res, done);
+                return EndRunningUserCodeInPlace();
+            } else {
+                return EndRunningMasterServiceInPool(
+                    master, cntl.release(), request_meta.service_name(),
+                    request_meta.method_name(), raw_req, raw_res, done);
+            }
+        }
+        if (mp->service->GetDescriptor()
                    == BadMethodService::descriptor()) {
             BadMethodRequest breq;
             BadMethodResponse bres;
@@ -440,18 +1253,50 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         method_status = mp->status;
         if (method_status) {
             int rejected_cc = 0;
-            if (!method_status->OnRequested(&rejected_cc)) {
+            if (!method_status->OnRequested(&rejected_cc,
+                                            cntl->request_priority())) {
                 cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter, concurrency=%d",
                                 mp->method->full_name().c_str(), rejected_cc);
                 break;
             }
         }
+        if (!server_accessor.AddInflightBytes(
+                cntl.get(), method_status, msg->meta.size() + msg->payload.size())) {
+            cntl->SetFailed(ELIMIT, "Reached max_inflight_request_bytes=%" PRId64
+                            " of %s", method_status->max_inflight_bytes(),
+                            mp->method->full_name().c_str());
+            break;
+        }
+        // The request may have waited in the socket or the queue of bthreads
+        // for long, drop it before parsing if the client has given up.
+        if (IsRpcDeadlineExpired(cntl->deadline_us())) {
+            cntl->SetFailed(ERPCTIMEDOUT, "Deadline of the request expired"
+                            " before running");
+            break;
+        }
         google::protobuf::Service* svc = mp->service;
         const google::protobuf::MethodDescriptor* method = mp->method;
         accessor.set_method(method);
         if (span) {
             span->ResetServerSpanName(method->full_name());
         }
+        ResponseCache* response_cache = server_accessor.response_cache();
+        if (response_cache != NULL &&
+            response_cache->GetPolicy(method) != NULL &&
+            accessor.remote_stream_settings() == NULL &&
+            !mp->params.enable_progressive_read) {
+            cache_key.reset(new std::string);
+            MakeResponseCacheKey(method, meta, msg->payload, cache_key.get());
+            ResponseCache::Response cached;
+            if (response_cache->Lookup(*cache_key, &cached) ==
+                ResponseCache::CACHE_HIT) {
+                return SendCachedRpcResponse(
+                    meta.correlation_id(), cntl.release(), cached,
+                    method_status, msg->received_us());
+            }
+            // Missed or the first one seeing the stale response, run the
+            // method to fill the cache.
+        }
         const int req_size = static_cast<int>(msg->payload.size());
         butil::IOBuf req_buf;
         butil::IOBuf* req_buf_ptr = &msg->payload;
@@ -467,39 +1312,104 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
             req_buf_ptr = &req_buf;
             cntl->request_attachment().swap(msg->payload);
         }
+        if (mp->params.enable_progressive_read && rpa == NULL) {
+            // The request arrived as a whole, the attachment is still read
+            // by ReadProgressiveAttachmentBy().
+            rpa.reset(new BaiduProgressiveAttachment(
+                          cntl->request_attachment().size()));
+            rpa->Append(&cntl->request_attachment());
+            accessor.set_readable_progressive_attachment(rpa.get());
+            accessor.set_read_progressively();
+        }
 
+        google::protobuf::Arena* arena = NULL;
+        if (server->options().use_pb_arena) {
+            PooledArena* pa = GetPooledArena();
+            if (pa) {
+                // Owned by cntl, messages on it must not be deleted.
+                accessor.set_arena(pa);
+                arena = ArenaOf(pa);
+            }
+        }
         CompressType req_cmp_type = (CompressType)meta.compress_type();
-        req.reset(svc->GetRequestPrototype(method).New());
-        if (!ParseFromCompressedData(*req_buf_ptr, req.get(), req_cmp_type)) {
+        const uint32_t req_dict_id = meta.compress_dict_id();
+        req.reset(NewMessage(svc->GetRequestPrototype(method), arena));
+        bool parsed = false;
+        SerializedRequest* raw_req = dynamic_cast<SerializedRequest*>(req.get());
+        if (raw_req != NULL) {
+            // Bytes of RawService are taken as they are.
+            raw_req->serialized_data().swap(*req_buf_ptr);
+            parsed = true;
+        } else if (req_cmp_type == COMPRESS_TYPE_ZSTD && req_dict_id != 0) {
+            parsed = ZstdDecompress(*req_buf_ptr, req.get(), req_dict_id);
+        } else if (req_cmp_type == COMPRESS_TYPE_NONE &&
+                   HasIOBufFields(req->GetDescriptor())) {
+            parsed = ParsePbWithIOBufFields(*req_buf_ptr, req.get(),
+                                            &cntl->request_iobuf_fields());
+        } else {
+            parsed = ParseFromCompressedData(*req_buf_ptr, req.get(), req_cmp_type);
+        }
+        if (!parsed) {
             cntl->SetFailed(EREQUEST, "Fail to parse request message, "
                             "CompressType=%s, request_size=%d", 
                             CompressTypeToCStr(req_cmp_type), req_size);
             break;
         }
+        if (raw_req == NULL) {
+            AddZstdDictionarySample(method, *req);
+        }
+        if (req_dict_id != 0 && req_dict_id == GetZstdDictionaryId(method)) {
+            res_dict_id = req_dict_id;
+        }
         
-        res.reset(svc->GetResponsePrototype(method).New());
+        res.reset(NewMessage(svc->GetResponsePrototype(method), arena));
         // `socket' will be held until response has been sent
-        google::protobuf::Closure* done = ::brpc::NewCallback<
-            int64_t, Controller*, const google::protobuf::Message*,
-            const google::protobuf::Message*, const Server*,
-            MethodStatus*, int64_t>(
-                &SendRpcResponse, meta.correlation_id(), cntl.get(), 
-                req.get(), res.get(), server,
-                method_status, msg->received_us());
+        google::protobuf::Closure* done = NULL;
+        if (cache_key == NULL) {
+            done = ::brpc::NewCallback<
+                int64_t, Controller*, const google::protobuf::Message*,
+                const google::protobuf::Message*, const Server*,
+                MethodStatus*, int64_t, uint32_t>(
+                    &SendRpcResponse, meta.correlation_id(), cntl.get(),
+                    req.get(), res.get(), server,
+                    method_status, msg->received_us(), res_dict_id);
+        } else {
+            done = ::brpc::NewCallback<
+                int64_t, Controller*, const google::protobuf::Message*,
+                const google::protobuf::Message*, const Server*,
+                MethodStatus*, int64_t, uint32_t, std::string*>(
+                    &SendAndCacheRpcResponse, meta.correlation_id(), cntl.get(),
+                    req.get(), res.get(), server,
+                    method_status, msg->received_us(), res_dict_id,
+                    cache_key.release());
+        }
 
         // optional, just release resourse ASAP
         msg.reset();
         req_buf.clear();
 
+        const int64_t start_callback_us = butil::cpuwide_time_us();
+        // Queued in executors or the backup pool, USERCODE is reset when
+        // the method actually runs.
+        accessor.set_phase_begin_us(RPC_PHASE_SERVER_QUEUE, start_callback_us)
+            .set_phase_begin_us(RPC_PHASE_SERVER_USERCODE, start_callback_us);
         if (span) {
-            span->set_start_callback_us(butil::cpuwide_time_us());
+            span->set_start_callback_us(start_callback_us);
             span->AsParent();
         }
+        if (mp->params.executor != NULL) {
+            return mp->params.executor->CallMethod(
+                svc, method, cntl.release(), req.release(), res.release(), done);
+        }
         if (!FLAGS_usercode_in_pthread) {
+            ScopedRpcDeadline deadline_guard(cntl->deadline_us());
+            ScopedRunningMethod method_guard(method);
             return svc->CallMethod(method, cntl.release(), 
                                    req.release(), res.release(), done);
         }
         if (BeginRunningUserCode()) {
+            ScopedRpcDeadline deadline_guard(cntl->deadline_us());
+            ScopedRunningMethod method_guard(method);
             svc->CallMethod(method, cntl.release(), 
                             req.release(), res.release(), done);
             return EndRunningUserCodeInPlace();
@@ -512,9 +1422,10 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
     
     // `cntl', `req' and `res' will be deleted inside `SendRpcResponse'
     // `socket' will be held until response has been sent
-    SendRpcResponse(meta.correlation_id(), cntl.release(), 
-                    req.release(), res.release(), server,
-                    method_status, msg->received_us());
+    SendAndCacheRpcResponse(meta.correlation_id(), cntl.release(),
+                            req.release(), res.release(), server,
+                            method_status, msg->received_us(), 0,
+                            cache_key.release());
 }
 
 bool VerifyRpcRequest(const InputMessageBase* msg_base) {
@@ -524,7 +1435,8 @@ bool VerifyRpcRequest(const InputMessageBase* msg_base) {
     Socket* socket = msg->socket();
     
     RpcMeta meta;
-    if (!ParsePbFromIOBuf(&meta, msg->meta)) {
+    // Compact meta never carries authentication data.
+    if (!IsCompactMeta(msg->meta) && !ParsePbFromIOBuf(&meta, msg->meta)) {
         LOG(WARNING) << "Fail to parse RpcRequestMeta";
         return false;
     }
@@ -545,9 +1457,29 @@ void ProcessRpcResponse(InputMessageBase* msg_base) {
     const int64_t start_parse_us = butil::cpuwide_time_us();
     DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage*>(msg_base));
     RpcMeta meta;
-    if (!ParsePbFromIOBuf(&meta, msg->meta)) {
+    bool compact_meta = false;
+    if (IsCompactMeta(msg->meta)) {
+        if (!ParseCompactResponseMeta(msg->meta, &meta)) {
+            LOG(WARNING) << "Fail to parse from compact response meta";
+            return;
+        }
+        compact_meta = true;
+    } else if (!ParsePbFromIOBuf(&meta, msg->meta)) {
         LOG(WARNING) << "Fail to parse from response meta";
         return;
+    } else {
+        compact_meta = meta.response().compact_meta();
+    }
+    if (compact_meta && !msg->socket()->is_compact_rpc_meta_enabled()) {
+        msg->socket()->enable_compact_rpc_meta();
+    }
+    // Non-NULL if the attachment is being read from the connection, see
+    // ParseProgressiveRpcMessage().
+    butil::intrusive_ptr<BaiduProgressiveAttachment> rpa(
+        static_cast<BaiduProgressiveAttachment*>(msg->rpa.get()));
+    if (rpa != NULL) {
+        msg->rpa.reset(NULL);
+        meta.clear_attachment_size();
     }
 
     const bthread_id_t cid = { static_cast<uint64_t>(meta.correlation_id()) };
@@ -559,14 +1491,33 @@ void ProcessRpcResponse(InputMessageBase* msg_base) {
         if (meta.has_stream_settings()) {
             SendStreamRst(msg->socket(), meta.stream_settings().stream_id());
         }
+        if (rpa != NULL) {
+            rpa->Discard();
+        }
         return;
     }
     
     ControllerPrivateAccessor accessor(cntl);
+    if (rpa != NULL) {
+        if (cntl->is_response_read_progressively()) {
+            accessor.set_readable_progressive_attachment(rpa.get());
+        } else {
+            rpa->Discard();
+        }
+    }
     if (meta.has_stream_settings()) {
         accessor.set_remote_stream_settings(
                 new StreamSettings(meta.stream_settings()));
     }
+    if (meta.response().has_load_report()) {
+        const ServerLoadReport& report = meta.response().load_report();
+        ServerLoad load;
+        load.cpu_permille = report.cpu_utilization();
+        load.concurrency = report.concurrency();
+        load.max_concurrency = report.max_concurrency();
+        accessor.set_server_load(load);
+    }
+    accessor.set_phase_begin_us(RPC_PHASE_CLIENT_PARSE, start_parse_us);
     Span* span = accessor.span();
     if (span) {
         span->set_base_real_us(msg->base_real_us());
@@ -583,6 +1534,12 @@ void ProcessRpcResponse(InputMessageBase* msg_base) {
                                   "%s", response_meta.error_text().c_str());
             break;
         } 
+        if (meta.has_checksum() && rpa == NULL &&
+            FLAGS_baidu_protocol_verify_checksum &&
+            BodyChecksum(msg->payload, butil::IOBuf()) != meta.checksum()) {
+            cntl->SetFailed(ERESPONSE, "Checksum of response mismatches");
+            break;
+        }
         // Parse response message iff error code from meta is 0
         butil::IOBuf res_buf;
         const int res_size = msg->payload.length();
@@ -603,9 +1560,27 @@ void ProcessRpcResponse(InputMessageBase* msg_base) {
 
         const CompressType res_cmp_type = (CompressType)meta.compress_type();
         cntl->set_response_compress_type(res_cmp_type);
+        const uint32_t res_dict_id = meta.compress_dict_id();
         if (cntl->response()) {
-            if (!ParseFromCompressedData(
-                    *res_buf_ptr, cntl->response(), res_cmp_type)) {
+            bool parsed = false;
+            SerializedResponse* raw_res = NULL;
+            if (res_cmp_type == COMPRESS_TYPE_ZSTD && res_dict_id != 0) {
+                parsed = ZstdDecompress(*res_buf_ptr, cntl->response(), res_dict_id);
+            } else if (res_cmp_type == COMPRESS_TYPE_NONE &&
+                       (raw_res = dynamic_cast<SerializedResponse*>(
+                           cntl->response())) != NULL) {
+                // Relayed as it is, without copying.
+                raw_res->serialized_data().swap(*res_buf_ptr);
+                parsed = true;
+            } else if (res_cmp_type == COMPRESS_TYPE_NONE &&
+                       HasIOBufFields(cntl->response()->GetDescriptor())) {
+                parsed = ParsePbWithIOBufFields(
+                    *res_buf_ptr, cntl->response(), &cntl->response_iobuf_fields());
+            } else {
+                parsed = ParseFromCompressedData(
+                    *res_buf_ptr, cntl->response(), res_cmp_type);
+            }
+            if (!parsed) {
                 cntl->SetFailed(
                     ERESPONSE, "Fail to parse response message, "
                     "CompressType=%s, response_size=%d", 
@@ -619,6 +1594,46 @@ void ProcessRpcResponse(InputMessageBase* msg_base) {
     accessor.OnResponse(cid, saved_error);
 }
 
+void SerializeRpcRequest(butil::IOBuf* buf,
+                         Controller* cntl,
+                         const google::protobuf::Message* request) {
+    if (request != NULL && cntl->has_request_iobuf_fields() &&
+        !cntl->request_iobuf_fields().empty()) {
+        if (cntl->request_compress_type() != COMPRESS_TYPE_NONE) {
+            return cntl->SetFailed(
+                EREQUEST, "Can't compress request with iobuf fields");
+        }
+        if (!request->IsInitialized()) {
+            return cntl->SetFailed(
+                EREQUEST, "Missing required fields in request: %s",
+                request->InitializationErrorString().c_str());
+        }
+        if (!SerializePbWithIOBufFields(*request, cntl->request_iobuf_fields(), buf)) {
+            return cntl->SetFailed(EREQUEST, "Fail to serialize request");
+        }
+        return;
+    }
+    if (request != NULL && cntl->method() != NULL &&
+        cntl->request_compress_type() == COMPRESS_TYPE_ZSTD &&
+        request->GetDescriptor() != SerializedRequest::descriptor()) {
+        const uint32_t dict_id = GetZstdDictionaryId(cntl->method());
+        if (dict_id != 0) {
+            if (!request->IsInitialized()) {
+                return cntl->SetFailed(
+                    EREQUEST, "Missing required fields in request: %s",
+                    request->InitializationErrorString().c_str());
+            }
+            if (!ZstdCompress(*request, buf, dict_id)) {
+                return cntl->SetFailed(
+                    EREQUEST, "Fail to compress request with zstd "
+                    "dictionary=%u", dict_id);
+            }
+            return;
+        }
+    }
+    SerializeRequestDefault(buf, cntl, request);
+}
+
 void PackRpcRequest(butil::IOBuf* req_buf,
                     SocketMessage**,
                     uint64_t correlation_id,
@@ -626,13 +1641,48 @@ void PackRpcRequest(butil::IOBuf* req_buf,
                     Controller* cntl,
                     const butil::IOBuf& request_body,
                     const Authenticator* auth) {
+    ControllerPrivateAccessor accessor(cntl);
+    if (cntl->connection_type() == CONNECTION_TYPE_SINGLE &&
+        cntl->is_response_read_progressively()) {
+        // Responses to other calls would be blocked by the attachment.
+        return cntl->SetFailed(EREQUEST, "Can't read baidu_std response "
+                               "progressively over a single connection");
+    }
+    Socket* sock = accessor.get_sending_socket();
+    const size_t attached_size = cntl->request_attachment().length();
+    if (FLAGS_baidu_protocol_compact_meta && !FLAGS_baidu_protocol_checksum &&
+        sock != NULL && sock->is_compact_rpc_meta_enabled() &&
+        method != NULL && auth == NULL &&
+        FLAGS_baidu_protocol_use_fullname &&
+        !cntl->has_log_id() &&
+        cntl->request_id().empty() &&
+        accessor.request_stream() == INVALID_STREAM_ID &&
+        accessor.span() == NULL &&
+        GetZstdDictionaryId(method) == 0) {
+        int32_t timeout_ms = -1;
+        if (cntl->deadline_us() >= 0) {
+            const int64_t left_us = std::max(
+                cntl->deadline_us() - butil::gettimeofday_us(), (int64_t)0);
+            timeout_ms = (int32_t)std::min((left_us + 999) / 1000,
+                                           (int64_t)INT32_MAX);
+        }
+        SerializeCompactRequestHeaderAndMeta(
+            req_buf, correlation_id, MethodIdOf(method->full_name()),
+            cntl->request_compress_type(), cntl->request_priority(),
+            timeout_ms, attached_size, request_body.length() + attached_size);
+        req_buf->append(request_body);
+        if (attached_size) {
+            req_buf->append(cntl->request_attachment());
+        }
+        return;
+    }
+
     RpcMeta meta;
     if (auth && auth->GenerateCredential(
             meta.mutable_authentication_data()) != 0) {
         return cntl->SetFailed(EREQUEST, "Fail to generate credential");
     }
 
-    ControllerPrivateAccessor accessor(cntl);
     RpcRequestMeta* request_meta = meta.mutable_request();
     if (method) {
         request_meta->set_service_name(FLAGS_baidu_protocol_use_fullname ?
@@ -640,6 +1690,10 @@ void PackRpcRequest(butil::IOBuf* req_buf,
                                        method->service()->name());
         request_meta->set_method_name(method->name());
         meta.set_compress_type(cntl->request_compress_type());
+        const uint32_t dict_id = GetZstdDictionaryId(method);
+        if (dict_id != 0) {
+            meta.set_compress_dict_id(dict_id);
+        }
     } else if (cntl->sampled_request()) {
         // Replaying. Keep service-name as the one seen by server.
         request_meta->set_service_name(cntl->sampled_request()->meta.service_name());
@@ -654,6 +1708,21 @@ void PackRpcRequest(butil::IOBuf* req_buf,
     if (!cntl->request_id().empty()) {
         request_meta->set_request_id(cntl->request_id());
     }
+    if (FLAGS_baidu_protocol_compact_meta && method != NULL &&
+        sock != NULL && !sock->is_compact_rpc_meta_enabled()) {
+        request_meta->set_ask_compact_meta(true);
+    }
+    if (cntl->request_priority() != REQUEST_PRIORITY_NORMAL) {
+        request_meta->set_priority(cntl->request_priority());
+    }
+    if (cntl->deadline_us() >= 0) {
+        // Rounded up so that the server never drops the request earlier
+        // than the client times out. Retries send the time left then.
+        const int64_t left_us =
+            std::max(cntl->deadline_us() - butil::gettimeofday_us(), (int64_t)0);
+        request_meta->set_timeout_ms(
+            (int32_t)std::min((left_us + 999) / 1000, (int64_t)INT32_MAX));
+    }
     meta.set_correlation_id(correlation_id);
     StreamId request_stream_id = accessor.request_stream();
     if (request_stream_id != INVALID_STREAM_ID) {
@@ -668,10 +1737,13 @@ void PackRpcRequest(butil::IOBuf* req_buf,
 
     // Don't use res->ByteSize() since it may be compressed
     const size_t req_size = request_body.length(); 
-    const size_t attached_size = cntl->request_attachment().length();
     if (attached_size) {
         meta.set_attachment_size(attached_size);
     }
+    if (FLAGS_baidu_protocol_checksum) {
+        meta.set_checksum(BodyChecksum(request_body,
+                                       cntl->request_attachment()));
+    }
     Span* span = accessor.span();
     if (span) {
         request_meta->set_trace_id(span->trace_id());
@@ -37,6 +37,11 @@ void ProcessRpcResponse(InputMessageBase* msg);
 // Verify authentication information in baidu_std format
 bool VerifyRpcRequest(const InputMessageBase* msg);
 
+// Serialize `request' into `buf', with the zstd dictionary of the method
+// if there's one.
+void SerializeRpcRequest(butil::IOBuf* buf, Controller* cntl,
+                         const google::protobuf::Message* request);
+
 // Pack `request' to `method' into `buf'.
 void PackRpcRequest(butil::IOBuf* buf,
                     SocketMessage**,
@@ -0,0 +1,169 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>                          // std::min
+#include "butil/logging.h"
+#include "brpc/policy/brotli_compress.h"
+
+#ifdef BRPC_WITH_BROTLI
+#include <brotli/encode.h>
+#include <brotli/decode.h>
+#endif
+
+
+namespace brpc {
+namespace policy {
+
+#ifdef BRPC_WITH_BROTLI
+
+// Point `*next_out' to the space left in current block of `stream' if
+// there's no space left.
+static bool ReserveOutput(butil::IOBufAsZeroCopyOutputStream* stream,
+                          uint8_t** next_out, size_t* avail_out) {
+    if (*avail_out == 0) {
+        void* data = NULL;
+        int size = 0;
+        if (!stream->Next(&data, &size)) {
+            LOG(WARNING) << "Fail to allocate output";
+            return false;
+        }
+        *next_out = (uint8_t*)data;
+        *avail_out = size;
+    }
+    return true;
+}
+
+static bool BrotliCompressWithEncoder(BrotliEncoderState* s,
+                                      const butil::IOBuf& in,
+                                      butil::IOBufAsZeroCopyOutputStream* stream,
+                                      uint8_t** next_out, size_t* avail_out) {
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i <= nblock; ++i) {
+        // The extra round with no input finishes the stream.
+        const bool last = (i == nblock);
+        const butil::StringPiece blk =
+            last ? butil::StringPiece() : in.backing_block(i);
+        const uint8_t* next_in = (const uint8_t*)blk.data();
+        size_t avail_in = blk.size();
+        const BrotliEncoderOperation op =
+            last ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+        do {
+            if (!ReserveOutput(stream, next_out, avail_out)) {
+                return false;
+            }
+            if (!BrotliEncoderCompressStream(s, op, &avail_in, &next_in,
+                                             avail_out, next_out, NULL)) {
+                LOG(WARNING) << "Fail to BrotliEncoderCompressStream";
+                return false;
+            }
+        } while (avail_in != 0 || BrotliEncoderHasMoreOutput(s) ||
+                 (last && !BrotliEncoderIsFinished(s)));
+    }
+    return true;
+}
+
+bool BrotliCompress(const butil::IOBuf& in, butil::IOBuf* out, int quality) {
+    BrotliEncoderState* s = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (s == NULL) {
+        LOG(WARNING) << "Fail to BrotliEncoderCreateInstance";
+        return false;
+    }
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_QUALITY, quality);
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_SIZE_HINT,
+                              (uint32_t)std::min(in.size(), (size_t)(1 << 30)));
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    uint8_t* next_out = NULL;
+    size_t avail_out = 0;
+    const bool ok = BrotliCompressWithEncoder(s, in, &stream,
+                                              &next_out, &avail_out);
+    if (avail_out != 0) {
+        stream.BackUp(avail_out);
+    }
+    BrotliEncoderDestroyInstance(s);
+    return ok;
+}
+
+static bool BrotliDecompressWithDecoder(BrotliDecoderState* s,
+                                        const butil::IOBuf& in,
+                                        butil::IOBufAsZeroCopyOutputStream* stream,
+                                        uint8_t** next_out, size_t* avail_out) {
+    BrotliDecoderResult rc = BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT;
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        const butil::StringPiece blk = in.backing_block(i);
+        const uint8_t* next_in = (const uint8_t*)blk.data();
+        size_t avail_in = blk.size();
+        do {
+            if (rc == BROTLI_DECODER_RESULT_SUCCESS) {
+                LOG(WARNING) << "Unexpected data after brotli stream";
+                return false;
+            }
+            if (!ReserveOutput(stream, next_out, avail_out)) {
+                return false;
+            }
+            rc = BrotliDecoderDecompressStream(s, &avail_in, &next_in,
+                                               avail_out, next_out, NULL);
+            if (rc == BROTLI_DECODER_RESULT_ERROR) {
+                LOG(WARNING) << "Fail to BrotliDecoderDecompressStream: "
+                             << BrotliDecoderErrorString(
+                                 BrotliDecoderGetErrorCode(s));
+                return false;
+            }
+        } while (avail_in != 0 || rc == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
+    }
+    if (rc != BROTLI_DECODER_RESULT_SUCCESS) {
+        LOG(WARNING) << "Incomplete brotli stream, size=" << in.size();
+        return false;
+    }
+    return true;
+}
+
+bool BrotliDecompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    BrotliDecoderState* s = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+    if (s == NULL) {
+        LOG(WARNING) << "Fail to BrotliDecoderCreateInstance";
+        return false;
+    }
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    uint8_t* next_out = NULL;
+    size_t avail_out = 0;
+    const bool ok = BrotliDecompressWithDecoder(s, in, &stream,
+                                                &next_out, &avail_out);
+    if (avail_out != 0) {
+        stream.BackUp(avail_out);
+    }
+    BrotliDecoderDestroyInstance(s);
+    return ok;
+}
+
+#else  // BRPC_WITH_BROTLI
+
+bool BrotliCompress(const butil::IOBuf&, butil::IOBuf*, int) {
+    LOG_EVERY_SECOND(ERROR) << "Fail to compress: brpc is not built with brotli";
+    return false;
+}
+
+bool BrotliDecompress(const butil::IOBuf&, butil::IOBuf*) {
+    LOG_EVERY_SECOND(ERROR) << "Fail to decompress: brpc is not built with brotli";
+    return false;
+}
+
+#endif  // BRPC_WITH_BROTLI
+
+}  // namespace policy
+} // namespace brpc
@@ -18,6 +18,7 @@
 
 #include <algorithm>                                           // std::set_union
 #include <array>
+#include <cmath>                                               // std::ceil
 #include <gflags/gflags.h>
 #include "butil/containers/flat_map.h"
 #include "butil/errno.h"
@@ -143,35 +144,71 @@ inline const ReplicaPolicy* GetReplicaPolicy(ConsistentHashingLoadBalancerType t
 
 ConsistentHashingLoadBalancer::ConsistentHashingLoadBalancer(
     ConsistentHashingLoadBalancerType type)
-    : _num_replicas(FLAGS_chash_num_replicas), _type(type) {
+    : _num_replicas(FLAGS_chash_num_replicas), _type(type)
+    , _load_factor(0), _total_inflight(0) {
     CHECK(GetReplicaPolicy(_type))
         << "Fail to find replica policy for consistency lb type: '" << _type << '\'';
 }
 
+// Both buffers of _db_hash_ring are always same, changes are applied to
+// them in place so that the ring is never copied.
 size_t ConsistentHashingLoadBalancer::AddBatch(
-        std::vector<Node> &bg, const std::vector<Node> &fg, 
-        const std::vector<Node> &servers, bool *executed) {
-    if (*executed) {
-        // Hack DBD
-        return fg.size() - bg.size();
-    }
-    *executed = true;
-    bg.resize(fg.size() + servers.size());
-    bg.resize(std::set_union(fg.begin(), fg.end(), 
-                             servers.begin(), servers.end(), bg.begin())
-              - bg.begin());
-    return bg.size() - fg.size();
+        std::vector<Node> &bg, const std::vector<Node> &servers) {
+    // Same as std::set_union, a node is added if there are more equivalent
+    // nodes in `servers' than in `bg'.
+    const size_t old_size = bg.size();
+    for (size_t i = 0; i < servers.size();) {
+        size_t j = i + 1;
+        while (j < servers.size() &&
+               !(servers[i] < servers[j]) && !(servers[j] < servers[i])) {
+            ++j;
+        }
+        const std::pair<std::vector<Node>::iterator, std::vector<Node>::iterator>
+            range = std::equal_range(bg.begin(), bg.begin() + old_size, servers[i]);
+        for (size_t k = i + (range.second - range.first); k < j; ++k) {
+            bg.push_back(servers[k]);
+        }
+        i = j;
+    }
+    if (bg.size() != old_size) {
+        std::inplace_merge(bg.begin(), bg.begin() + old_size, bg.end());
+    }
+    return bg.size() - old_size;
 }
 
-size_t ConsistentHashingLoadBalancer::RemoveBatch(
-        std::vector<Node> &bg, const std::vector<Node> &fg,
-        const std::vector<ServerId> &servers, bool *executed) {
-    if (*executed) {
-        return bg.size() - fg.size();
+size_t ConsistentHashingLoadBalancer::AddInflights(
+        Inflights& bg, const Inflights& fg,
+        const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        const SocketId id = servers[i].id;
+        if (bg.inflights.seek(id) != NULL) {
+            continue;
+        }
+        const std::shared_ptr<butil::atomic<int32_t> >* p = fg.inflights.seek(id);
+        if (p != NULL) {
+            // Added to the other buffer just now, share the counter.
+            bg.inflights[id] = *p;
+        } else {
+            bg.inflights[id] = std::make_shared<butil::atomic<int32_t> >(0);
+        }
+        ++count;
+    }
+    return count;
+}
+
+size_t ConsistentHashingLoadBalancer::RemoveInflights(
+        Inflights& bg, const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += bg.inflights.erase(servers[i].id);
     }
-    *executed = true;
+    return count;
+}
+
+size_t ConsistentHashingLoadBalancer::RemoveBatch(
+        std::vector<Node> &bg, const std::vector<ServerId> &servers) {
     if (servers.empty()) {
-        bg = fg;
         return 0;
     }
     butil::FlatSet<ServerId> id_set;
@@ -187,33 +224,38 @@ size_t ConsistentHashingLoadBalancer::RemoveBatch(
         use_set = false;
     }
     CHECK(use_set) << "Fail to construct id_set, " << berror();
-    bg.clear();
-    for (size_t i = 0; i < fg.size(); ++i) {
+    const size_t old_size = bg.size();
+    size_t n = 0;
+    for (size_t i = 0; i < old_size; ++i) {
         const bool removed = 
-            use_set ? (id_set.seek(fg[i].server_sock) != NULL)
+            use_set ? (id_set.seek(bg[i].server_sock) != NULL)
                     : (std::find(servers.begin(), servers.end(), 
-                                fg[i].server_sock) != servers.end());
+                                bg[i].server_sock) != servers.end());
         if (!removed) {
-            bg.push_back(fg[i]);
+            if (n != i) {
+                bg[n] = bg[i];
+            }
+            ++n;
         }
     }
-    return fg.size() - bg.size();
+    bg.resize(n);
+    return old_size - n;
 }
 
 size_t ConsistentHashingLoadBalancer::Remove(
-        std::vector<Node> &bg, const std::vector<Node> &fg,
-        const ServerId& server, bool *executed) {
-    if (*executed) {
-        return bg.size() - fg.size();
-    }
-    *executed = true;
-    bg.clear();
-    for (size_t i = 0; i < fg.size(); ++i) {
-        if (fg[i].server_sock != server) {
-            bg.push_back(fg[i]);
+        std::vector<Node> &bg, const ServerId& server) {
+    const size_t old_size = bg.size();
+    size_t n = 0;
+    for (size_t i = 0; i < old_size; ++i) {
+        if (bg[i].server_sock != server) {
+            if (n != i) {
+                bg[n] = bg[i];
+            }
+            ++n;
         }
     }
-    return fg.size() - bg.size();
+    bg.resize(n);
+    return old_size - n;
 }
 
 bool ConsistentHashingLoadBalancer::AddServer(const ServerId& server) {
@@ -223,10 +265,12 @@ bool ConsistentHashingLoadBalancer::AddServer(const ServerId& server) {
         return false;
     }
     std::sort(add_nodes.begin(), add_nodes.end());
-    bool executed = false;
-    const size_t ret = _db_hash_ring.ModifyWithForeground(
-                        AddBatch, add_nodes, &executed);
+    const size_t ret = _db_hash_ring.Modify(AddBatch, add_nodes);
     CHECK(ret == 0 || ret == _num_replicas) << ret;
+    if (ret != 0 && _load_factor > 0) {
+        _db_inflights.ModifyWithForeground(
+            AddInflights, std::vector<ServerId>(1, server));
+    }
     return ret != 0;
 }
 
@@ -243,9 +287,11 @@ size_t ConsistentHashingLoadBalancer::AddServersInBatch(
         }
     }
     std::sort(add_nodes.begin(), add_nodes.end());
-    bool executed = false;
-    const size_t ret = _db_hash_ring.ModifyWithForeground(AddBatch, add_nodes, &executed);
+    const size_t ret = _db_hash_ring.Modify(AddBatch, add_nodes);
     CHECK(ret % _num_replicas == 0);
+    if (ret != 0 && _load_factor > 0) {
+        _db_inflights.ModifyWithForeground(AddInflights, servers);
+    }
     const size_t n = ret / _num_replicas;
     LOG_IF(ERROR, n != servers.size())
         << "Fail to AddServersInBatch, expected " << servers.size()
@@ -254,17 +300,21 @@ size_t ConsistentHashingLoadBalancer::AddServersInBatch(
 }
 
 bool ConsistentHashingLoadBalancer::RemoveServer(const ServerId& server) {
-    bool executed = false;
-    const size_t ret = _db_hash_ring.ModifyWithForeground(Remove, server, &executed);
+    const size_t ret = _db_hash_ring.Modify(Remove, server);
     CHECK(ret == 0 || ret == _num_replicas);
+    if (ret != 0 && _load_factor > 0) {
+        _db_inflights.Modify(RemoveInflights, std::vector<ServerId>(1, server));
+    }
     return ret != 0;
 }
 
 size_t ConsistentHashingLoadBalancer::RemoveServersInBatch(
     const std::vector<ServerId> &servers) {
-    bool executed = false;
-    const size_t ret = _db_hash_ring.ModifyWithForeground(RemoveBatch, servers, &executed);
+    const size_t ret = _db_hash_ring.Modify(RemoveBatch, servers);
     CHECK(ret % _num_replicas == 0);
+    if (ret != 0 && _load_factor > 0) {
+        _db_inflights.Modify(RemoveInflights, servers);
+    }
     const size_t n = ret / _num_replicas;
     LOG_IF(ERROR, n != servers.size())
         << "Fail to RemoveServersInBatch, expected " << servers.size()
@@ -308,6 +358,9 @@ int ConsistentHashingLoadBalancer::SelectServer(
     if (choice == s->end()) {
         choice = s->begin();
     }
+    if (_load_factor > 0) {
+        return SelectServerWithBoundedLoad(in, out, *s, choice);
+    }
     for (size_t i = 0; i < s->size(); ++i) {
         if (((i + 1) == s->size() // always take last chance
              || !ExcludedServers::IsExcluded(in.excluded, choice->server_sock.id))
@@ -323,6 +376,60 @@ int ConsistentHashingLoadBalancer::SelectServer(
     return EHOSTDOWN;
 }
 
+int ConsistentHashingLoadBalancer::SelectServerWithBoundedLoad(
+    const SelectIn &in, SelectOut *out, const std::vector<Node>& ring,
+    std::vector<Node>::const_iterator choice) {
+    butil::DoublyBufferedData<Inflights>::ScopedPtr s;
+    if (_db_inflights.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t nserver = s->inflights.size();
+    // Capacity of each server is c times the average load including
+    // this call.
+    const int64_t total = _total_inflight.load(butil::memory_order_relaxed) + 1;
+    const int64_t capacity = nserver == 0 ? total :
+        (int64_t)std::ceil(_load_factor * total / nserver);
+    for (size_t i = 0; i < ring.size(); ++i) {
+        const SocketId id = choice->server_sock.id;
+        const std::shared_ptr<butil::atomic<int32_t> >* inflight =
+            s->inflights.seek(id);
+        if (((i + 1) == ring.size() // always take last chance
+             || (!ExcludedServers::IsExcluded(in.excluded, id)
+                 && (inflight == NULL ||
+                     (*inflight)->load(butil::memory_order_relaxed) < capacity)))
+            && Socket::Address(id, out->ptr) == 0
+            && (*out->ptr)->IsAvailable()) {
+            if (inflight != NULL) {
+                (*inflight)->fetch_add(1, butil::memory_order_relaxed);
+                _total_inflight.fetch_add(1, butil::memory_order_relaxed);
+                out->need_feedback = true;
+            }
+            return 0;
+        }
+        if (++choice == ring.end()) {
+            choice = ring.begin();
+        }
+    }
+    return EHOSTDOWN;
+}
+
+void ConsistentHashingLoadBalancer::Feedback(const CallInfo& info) {
+    if (_load_factor <= 0) {
+        return;
+    }
+    // Every call counted in _total_inflight is fed back exactly once.
+    _total_inflight.fetch_sub(1, butil::memory_order_relaxed);
+    butil::DoublyBufferedData<Inflights>::ScopedPtr s;
+    if (_db_inflights.Read(&s) != 0) {
+        return;
+    }
+    const std::shared_ptr<butil::atomic<int32_t> >* inflight =
+        s->inflights.seek(info.server_id);
+    if (inflight != NULL) {
+        (*inflight)->fetch_sub(1, butil::memory_order_relaxed);
+    }
+}
+
 void ConsistentHashingLoadBalancer::Describe(
     std::ostream &os, const DescribeOptions& options) {
     if (!options.verbose) {
@@ -332,6 +439,9 @@ void ConsistentHashingLoadBalancer::Describe(
     os << "ConsistentHashingLoadBalancer {\n"
        << "  hash function: " << GetReplicaPolicy(_type)->name() << '\n'
        << "  replica per host: " << _num_replicas << '\n';
+    if (_load_factor > 0) {
+        os << "  load factor: " << _load_factor << '\n';
+    }
     std::map<butil::EndPoint, double> load_map;
     GetLoads(&load_map);
     os << "  number of hosts: " << load_map.size() << '\n';
@@ -391,6 +501,15 @@ bool ConsistentHashingLoadBalancer::SetParameters(const butil::StringPiece& para
             }
             continue;
         }
+        if (sp.key() == "load_factor") {
+            if (!butil::StringToDouble(sp.value().as_string(), &_load_factor)
+                || _load_factor < 1) {
+                LOG(ERROR) << "load_factor must be no less than 1, got "
+                           << sp.value();
+                return false;
+            }
+            continue;
+        }
         LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
     }
     return true;
@@ -21,8 +21,11 @@
 
 #include <stdint.h>                                     // uint32_t
 #include <functional>
+#include <memory>                                       // std::shared_ptr
 #include <vector>                                       // std::vector
+#include "butil/atomicops.h"                            // butil::atomic
 #include "butil/endpoint.h"                              // butil::EndPoint
+#include "butil/containers/flat_map.h"                  // butil::FlatMap
 #include "butil/containers/doubly_buffered_data.h"
 #include "brpc/load_balancer.h"
 
@@ -64,20 +67,39 @@ public:
     LoadBalancer *New(const butil::StringPiece& params) const;
     void Destroy();
     int SelectServer(const SelectIn &in, SelectOut *out);
+    void Feedback(const CallInfo& info);
     void Describe(std::ostream &os, const DescribeOptions& options);
 
 private:
+    // Inflight calls of servers, only maintained with bounded loads.
+    struct Inflights {
+        Inflights() {
+            CHECK_EQ(0, inflights.init(64));
+        }
+        butil::FlatMap<SocketId, std::shared_ptr<butil::atomic<int32_t> > > inflights;
+    };
     bool SetParameters(const butil::StringPiece& params);
+    static size_t AddInflights(Inflights& bg, const Inflights& fg,
+                               const std::vector<ServerId>& servers);
+    static size_t RemoveInflights(Inflights& bg,
+                                  const std::vector<ServerId>& servers);
+    int SelectServerWithBoundedLoad(const SelectIn &in, SelectOut *out,
+                                    const std::vector<Node>& ring,
+                                    std::vector<Node>::const_iterator choice);
     void GetLoads(std::map<butil::EndPoint, double> *load_map);
-    static size_t AddBatch(std::vector<Node> &bg, const std::vector<Node> &fg,
-                           const std::vector<Node> &servers, bool *executed);
-    static size_t RemoveBatch(std::vector<Node> &bg, const std::vector<Node> &fg,
-                              const std::vector<ServerId> &servers, bool *executed);
-    static size_t Remove(std::vector<Node> &bg, const std::vector<Node> &fg,
-                         const ServerId& server, bool *executed);
+    static size_t AddBatch(std::vector<Node> &bg, const std::vector<Node> &servers);
+    static size_t RemoveBatch(std::vector<Node> &bg,
+                              const std::vector<ServerId> &servers);
+    static size_t Remove(std::vector<Node> &bg, const ServerId& server);
     size_t _num_replicas;
     ConsistentHashingLoadBalancerType _type;
     butil::DoublyBufferedData<std::vector<Node> > _db_hash_ring;
+    // With a positive load factor c, servers with more than c times
+    // average inflight calls are skipped, as described in "Consistent
+    // Hashing with Bounded Loads".
+    double _load_factor;
+    butil::atomic<int64_t> _total_inflight;
+    butil::DoublyBufferedData<Inflights> _db_inflights;
 };
 
 }  // namespace policy
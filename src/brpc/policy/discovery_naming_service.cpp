@@ -16,6 +16,8 @@
 // under the License.
 
 
+#include <inttypes.h>
+#include <algorithm>
 #include <gflags/gflags.h>
 #include "butil/third_party/rapidjson/document.h"
 #include "butil/third_party/rapidjson/memorybuffer.h"
@@ -23,7 +25,9 @@
 #include "butil/string_printf.h"
 #include "butil/strings/string_split.h"
 #include "butil/fast_rand.h"
+#include "butil/time/time.h"
 #include "bthread/bthread.h"
+#include "brpc/log.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
 #include "brpc/policy/discovery_naming_service.h"
@@ -45,6 +49,17 @@ DEFINE_string(discovery_zone, "", "Zone of services");
 DEFINE_int32(discovery_renew_interval_s, 30, "The interval between two consecutive renews");
 DEFINE_int32(discovery_reregister_threshold, 3, "The renew error threshold beyond"
         " which Register would be called again");
+DEFINE_bool(discovery_long_poll, false, "Watch changes of services by long polling"
+        " /discovery/polls instead of fetching them periodically");
+DEFINE_int32(discovery_long_poll_timeout_ms, 40000, "Timeout for long polling"
+        " /discovery/polls, which should be longer than the holding time of"
+        " discovery servers");
+DEFINE_int32(discovery_retry_interval_ms, 1000, "Wait so many milliseconds"
+        " before long polling again when error happens");
+
+// Code of /discovery/polls when the service is unchanged before the server
+// ends the long polling.
+static const int DISCOVERY_NOT_MODIFIED = -304;
 
 static pthread_once_t s_init_discovery_channel_once = PTHREAD_ONCE_INIT;
 static Channel* s_discovery_channel = NULL;
@@ -345,6 +360,14 @@ int DiscoveryClient::DoCancel() const {
 
 int DiscoveryNamingService::GetServers(const char* service_name,
                                        std::vector<ServerNode>* servers) {
+    int64_t latest_timestamp = 0;
+    return FetchServers(service_name, 0, servers, &latest_timestamp);
+}
+
+int DiscoveryNamingService::FetchServers(const char* service_name,
+                                         int64_t last_timestamp,
+                                         std::vector<ServerNode>* servers,
+                                         int64_t* latest_timestamp) {
     if (service_name == NULL || *service_name == '\0' ||
         FLAGS_discovery_env.empty() ||
         FLAGS_discovery_status.empty()) {
@@ -354,20 +377,30 @@ int DiscoveryNamingService::GetServers(const char* service_name,
     Channel* chan = GetOrNewDiscoveryChannel();
     if (NULL == chan) {
         LOG(ERROR) << "Fail to create discovery channel";
+        return -1;
     }
     servers->clear();
     Controller cntl;
+    // Long polling /discovery/polls returns when the service changes after
+    // `last_timestamp', or the server has held the request for a while.
+    const bool poll = (last_timestamp > 0);
+    const char* const api = (poll ? "/discovery/polls" : "/discovery/fetchs");
     std::string uri_str = butil::string_printf(
-            "/discovery/fetchs?appid=%s&env=%s&status=%s", service_name,
+            "%s?appid=%s&env=%s&status=%s", api, service_name,
             FLAGS_discovery_env.c_str(), FLAGS_discovery_status.c_str());
     if (!FLAGS_discovery_zone.empty()) {
         uri_str.append("&zone=");
         uri_str.append(FLAGS_discovery_zone);
     }
+    if (poll) {
+        butil::string_appendf(&uri_str, "&latest_timestamp=%" PRId64,
+                              last_timestamp);
+        cntl.set_timeout_ms(FLAGS_discovery_long_poll_timeout_ms);
+    }
     cntl.http_request().uri() = uri_str;
     chan->CallMethod(NULL, &cntl, NULL, NULL, NULL);
     if (cntl.Failed()) {
-        LOG(ERROR) << "Fail to get /discovery/fetchs: " << cntl.ErrorText();
+        LOG(ERROR) << "Fail to get " << api << ": " << cntl.ErrorText();
         return -1;
     }
 
@@ -378,6 +411,12 @@ int DiscoveryNamingService::GetServers(const char* service_name,
         LOG(ERROR) << "Fail to parse " << response << " as json object";
         return -1;
     }
+    auto itr_code = d.FindMember("code");
+    if (itr_code != d.MemberEnd() && itr_code->value.IsInt() &&
+        itr_code->value.GetInt() == DISCOVERY_NOT_MODIFIED) {
+        *latest_timestamp = last_timestamp;
+        return 1;
+    }
     auto itr_data = d.FindMember("data");
     if (itr_data == d.MemberEnd()) {
         LOG(ERROR) << "No data field in discovery/fetchs response";
@@ -390,6 +429,13 @@ int DiscoveryNamingService::GetServers(const char* service_name,
         return -1;
     }
     const BUTIL_RAPIDJSON_NAMESPACE::Value& services = itr_service->value;
+    auto itr_timestamp = services.FindMember("latest_timestamp");
+    if (itr_timestamp != services.MemberEnd() &&
+        itr_timestamp->value.IsInt64()) {
+        *latest_timestamp = itr_timestamp->value.GetInt64();
+    } else {
+        *latest_timestamp = 0;
+    }
     auto itr_instances = services.FindMember("instances");
     if (itr_instances == services.MemberEnd()) {
         LOG(ERROR) << "Fail to find instances";
@@ -449,6 +495,58 @@ int DiscoveryNamingService::GetServers(const char* service_name,
     return 0;
 }
 
+int DiscoveryNamingService::RunNamingService(const char* service_name,
+                                             NamingServiceActions* actions) {
+    if (!FLAGS_discovery_long_poll) {
+        return PeriodicNamingService::RunNamingService(service_name, actions);
+    }
+    std::vector<ServerNode> servers;
+    bool ever_reset = false;
+    int64_t latest_timestamp = 0;
+    for (;;) {
+        int64_t new_timestamp = 0;
+        const int rc = FetchServers(service_name, latest_timestamp,
+                                    &servers, &new_timestamp);
+        if (bthread_stopped(bthread_self())) {
+            RPC_VLOG << "Quit NamingServiceThread=" << bthread_self();
+            return 0;
+        }
+        if (rc == 0) {
+            ever_reset = true;
+            actions->ResetServers(servers);
+            // Without timestamps, the next call fetches the servers again.
+            latest_timestamp = new_timestamp;
+            if (latest_timestamp > 0) {
+                continue;
+            }
+        } else if (rc > 0) {
+            // Not modified, poll again.
+            continue;
+        } else {
+            if (!ever_reset) {
+                // ResetServers must be called at first time even if
+                // FetchServers failed, to wake up callers to
+                // `WaitForFirstBatchOfServers'
+                ever_reset = true;
+                servers.clear();
+                actions->ResetServers(servers);
+            }
+            latest_timestamp = 0;
+        }
+        if (bthread_usleep(std::max(FLAGS_discovery_retry_interval_ms, 1) *
+                           butil::Time::kMicrosecondsPerMillisecond) < 0) {
+            if (errno == ESTOP) {
+                RPC_VLOG << "Quit NamingServiceThread=" << bthread_self();
+                return 0;
+            }
+            PLOG(FATAL) << "Fail to sleep";
+            return -1;
+        }
+    }
+    CHECK(false);
+    return -1;
+}
+
 void DiscoveryNamingService::Describe(std::ostream& os,
                                       const DescribeOptions&) const {
     os << "discovery";
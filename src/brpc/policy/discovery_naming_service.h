@@ -72,6 +72,18 @@ private:
     int GetServers(const char* service_name,
                    std::vector<ServerNode>* servers) override;
 
+    // Long poll changes of servers when -discovery_long_poll is on, otherwise
+    // fetch servers periodically.
+    int RunNamingService(const char* service_name,
+                         NamingServiceActions* actions) override;
+
+    // Fetches servers of `service_name' if `last_timestamp' is 0, otherwise
+    // waits for changes after `last_timestamp'. Returns 0 on success, 1 if
+    // not modified, -1 otherwise.
+    int FetchServers(const char* service_name, int64_t last_timestamp,
+                     std::vector<ServerNode>* servers,
+                     int64_t* latest_timestamp);
+
     void Describe(std::ostream& os, const DescribeOptions&) const override;
 
     NamingService* New() const override;
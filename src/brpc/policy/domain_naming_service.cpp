@@ -20,17 +20,167 @@
 #include <netdb.h>                                    // gethostbyname_r
 #include <stdlib.h>                                   // strtol
 #include <string>                                     // std::string
+#include <map>                                        // std::map
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "bvar/bvar.h"
 #include "bthread/bthread.h"
+#include "bthread/mutex.h"                            // bthread::Mutex
+#include "bthread/condition_variable.h"               // bthread::ConditionVariable
 #include "brpc/log.h"
+#include "brpc/reloadable_flags.h"
 #include "brpc/policy/domain_naming_service.h"
 
 
 namespace brpc {
 namespace policy {
 
+DEFINE_int32(dns_cache_ttl_s, 5, "Results of resolving a host name are shared "
+             "by all DomainNamingServices in the process for so many seconds");
+BRPC_VALIDATE_GFLAG(dns_cache_ttl_s, NonNegativeInteger);
+
+// Resolve IPv4 addresses of `host' with the blocking gethostbyname(_r).
+static int ResolveHost(const char* host, std::vector<butil::ip_t>* ips) {
+    ips->clear();
+#if defined(OS_MACOSX)
+    // gethostbyname on MAC is thread-safe (with current usage) since the
+    // returned hostent is TLS. Check following link for the ref:
+    // https://lists.apple.com/archives/darwin-dev/2006/May/msg00008.html
+    struct hostent* result = gethostbyname(host);
+    if (result == NULL) {
+        LOG(WARNING) << "result of gethostbyname is NULL";
+        return -1;
+    }
+#else
+    size_t aux_buf_len = 1024;
+    std::unique_ptr<char[]> aux_buf(new char[aux_buf_len]);
+    int ret = 0;
+    int error = 0;
+    struct hostent ent;
+    struct hostent* result = NULL;
+    do {
+        result = NULL;
+        error = 0;
+        ret = gethostbyname_r(host, &ent, aux_buf.get(), aux_buf_len,
+                              &result, &error);
+        if (ret != ERANGE) { // aux_buf is not long enough
+            break;
+        }
+        aux_buf_len *= 2;
+        aux_buf.reset(new char[aux_buf_len]);
+        RPC_VLOG << "Resized aux_buf to " << aux_buf_len
+                 << ", host=" << host;
+    } while (1);
+    if (ret != 0) {
+        // `hstrerror' is thread safe under linux
+        LOG(WARNING) << "Can't resolve `" << host << "', return=`" << berror(ret)
+                     << "' herror=`" << hstrerror(error) << '\'';
+        return -1;
+    }
+    if (result == NULL) {
+        LOG(WARNING) << "result of gethostbyname_r is NULL";
+        return -1;
+    }
+#endif
+    for (int i = 0; result->h_addr_list[i] != NULL; ++i) {
+        if (result->h_addrtype == AF_INET) {
+            // Only fetch IPv4 addresses
+            butil::ip_t ip;
+            bcopy(result->h_addr_list[i], &ip, result->h_length);
+            ips->push_back(ip);
+        } else {
+            LOG(WARNING) << "Found address of unsupported protocol="
+                         << result->h_addrtype;
+        }
+    }
+    return 0;
+}
+
+// Addresses of host names shared by all DomainNamingServices, so that
+// channels to the same host (with different ports or options) resolve the
+// name once per -dns_cache_ttl_s. Concurrent resolutions of one name are
+// merged into one, different names are resolved in parallel by their own
+// naming service bthreads.
+class DnsCache {
+public:
+    DnsCache()
+        : _hit_count("rpc_dns_cache_hit_count")
+        , _miss_count("rpc_dns_cache_miss_count") {}
+
+    int Resolve(const std::string& host, std::vector<butil::ip_t>* ips) {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        while (true) {
+            Entry& e = _entries[host];
+            if (e.expire_us > butil::monotonic_time_us()) {
+                *ips = e.ips;
+                mu.unlock();
+                _hit_count << 1;
+                return 0;
+            }
+            if (!e.resolving) {
+                e.resolving = true;
+                break;
+            }
+            // Wait for the one resolving the same name.
+            _cond.wait(mu);
+        }
+        mu.unlock();
+        _miss_count << 1;
+        const int rc = ResolveHost(host.c_str(), ips);
+        mu.lock();
+        Entry& e = _entries[host];
+        e.resolving = false;
+        if (rc == 0) {
+            e.ips = *ips;
+            e.expire_us = butil::monotonic_time_us() +
+                FLAGS_dns_cache_ttl_s * 1000000L;
+        } else {
+            // Failures are not cached, waiters resolve by themselves.
+            e.expire_us = 0;
+        }
+        if (_entries.size() > MAX_ENTRIES) {
+            RemoveExpiredEntries();
+        }
+        _cond.notify_all();
+        return rc;
+    }
+
+private:
+    static const size_t MAX_ENTRIES = 1024;
+
+    struct Entry {
+        Entry() : expire_us(0), resolving(false) {}
+        std::vector<butil::ip_t> ips;
+        int64_t expire_us;
+        bool resolving;
+    };
+
+    void RemoveExpiredEntries() {
+        const int64_t now_us = butil::monotonic_time_us();
+        for (std::map<std::string, Entry>::iterator it = _entries.begin();
+             it != _entries.end();) {
+            if (!it->second.resolving && it->second.expire_us <= now_us) {
+                _entries.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    bthread::Mutex _mutex;
+    bthread::ConditionVariable _cond;
+    std::map<std::string, Entry> _entries;
+    bvar::Adder<int64_t> _hit_count;
+    bvar::Adder<int64_t> _miss_count;
+};
+
+static DnsCache* get_dns_cache() {
+    return butil::get_leaky_singleton<DnsCache>();
+}
+
 DomainNamingService::DomainNamingService(int default_port)
-    : _aux_buf_len(0)
-    , _default_port(default_port) {}
+    : _default_port(default_port) {}
 
 int DomainNamingService::GetServers(const char* dns_name,
                                     std::vector<ServerNode>* servers) {
@@ -78,61 +228,15 @@ int DomainNamingService::GetServers(const char* dns_name,
         return -1;
     }
 
-#if defined(OS_MACOSX)
-    _aux_buf_len = 0; // suppress unused warning
-    // gethostbyname on MAC is thread-safe (with current usage) since the
-    // returned hostent is TLS. Check following link for the ref:
-    // https://lists.apple.com/archives/darwin-dev/2006/May/msg00008.html
-    struct hostent* result = gethostbyname(buf);
-    if (result == NULL) {
-        LOG(WARNING) << "result of gethostbyname is NULL";
-        return -1;
-    }
-#else
-    if (_aux_buf == NULL) {
-        _aux_buf_len = 1024;
-        _aux_buf.reset(new char[_aux_buf_len]);
-    }
-    int ret = 0;
-    int error = 0;
-    struct hostent ent;
-    struct hostent* result = NULL;
-    do {
-        result = NULL;
-        error = 0;
-        ret = gethostbyname_r(buf, &ent, _aux_buf.get(), _aux_buf_len,
-                              &result, &error);
-        if (ret != ERANGE) { // _aux_buf is not long enough
-            break;
-        }
-        _aux_buf_len *= 2;
-        _aux_buf.reset(new char[_aux_buf_len]);
-        RPC_VLOG << "Resized _aux_buf to " << _aux_buf_len
-                 << ", dns_name=" << dns_name;
-    } while (1);
-    if (ret != 0) {
-        // `hstrerror' is thread safe under linux
-        LOG(WARNING) << "Can't resolve `" << buf << "', return=`" << berror(ret)
-                     << "' herror=`" << hstrerror(error) << '\'';
-        return -1;
-    }
-    if (result == NULL) {
-        LOG(WARNING) << "result of gethostbyname_r is NULL";
+    std::vector<butil::ip_t> ips;
+    if (get_dns_cache()->Resolve(buf, &ips) != 0) {
         return -1;
     }
-#endif
-
     butil::EndPoint point;
     point.port = port;
-    for (int i = 0; result->h_addr_list[i] != NULL; ++i) {
-        if (result->h_addrtype == AF_INET) {
-            // Only fetch IPv4 addresses
-            bcopy(result->h_addr_list[i], &point.ip, result->h_length);
-            servers->push_back(ServerNode(point, std::string()));
-        } else {
-            LOG(WARNING) << "Found address of unsupported protocol="
-                         << result->h_addrtype;
-        }
+    for (size_t i = 0; i < ips.size(); ++i) {
+        point.ip = ips[i];
+        servers->push_back(ServerNode(point, std::string()));
     }
     return 0;
 }
@@ -42,8 +42,6 @@ private:
     void Destroy() override;
 
 private:
-    std::unique_ptr<char[]> _aux_buf;
-    size_t _aux_buf_len;
     int _default_port;
 };
 
@@ -0,0 +1,170 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <cmath>
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "butil/strings/string_number_conversions.h"
+#include "butil/time.h"
+#include "brpc/errno.pb.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/gradient_concurrency_limiter.h"
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(gradient_cl_latency_target_ms, 100,
+             "Target of latencies of methods limited by \"gradient\" without"
+             " parameters");
+DEFINE_double(gradient_cl_latency_percentile, 0.99,
+              "Percentile of latencies kept under the target by the gradient"
+              " concurrency limiter");
+DEFINE_int32(gradient_cl_window_size_s, 1,
+             "max_concurrency is updated with latencies in so many seconds");
+DEFINE_int32(gradient_cl_min_sample_count, 100,
+             "max_concurrency is not updated when there're fewer responses"
+             " than this value in the window");
+DEFINE_int32(gradient_cl_initial_max_concurrency, 40,
+             "Initial max_concurrency of the gradient concurrency limiter");
+DEFINE_int32(gradient_cl_min_concurrency, 4,
+             "max_concurrency of the gradient concurrency limiter is never"
+             " less than this value");
+DEFINE_int32(gradient_cl_max_concurrency, 10000,
+             "max_concurrency of the gradient concurrency limiter is never"
+             " greater than this value");
+DEFINE_double(gradient_cl_smoothing_factor, 0.2,
+              "Weight of the new max_concurrency in each update, in (0, 1]."
+              " The smaller the value, the less max_concurrency is affected"
+              " by bursts of traffic");
+BRPC_VALIDATE_GFLAG(gradient_cl_latency_percentile, PassValidate);
+BRPC_VALIDATE_GFLAG(gradient_cl_min_sample_count, PassValidate);
+BRPC_VALIDATE_GFLAG(gradient_cl_min_concurrency, PositiveInteger);
+BRPC_VALIDATE_GFLAG(gradient_cl_max_concurrency, PositiveInteger);
+BRPC_VALIDATE_GFLAG(gradient_cl_smoothing_factor, PassValidate);
+
+GradientConcurrencyLimiter::GradientConcurrencyLimiter()
+    : GradientConcurrencyLimiter(FLAGS_gradient_cl_latency_target_ms * 1000L) {
+}
+
+GradientConcurrencyLimiter::GradientConcurrencyLimiter(int64_t target_latency_us)
+    : _target_latency_us(target_latency_us)
+    , _latency(std::max(FLAGS_gradient_cl_window_size_s, 1))
+    , _max_concurrency(FLAGS_gradient_cl_initial_max_concurrency)
+    , _next_update_us(0)
+    , _max_seen_concurrency(0)
+    , _smoothed_max_concurrency(FLAGS_gradient_cl_initial_max_concurrency) {
+}
+
+GradientConcurrencyLimiter* GradientConcurrencyLimiter::New(
+    const AdaptiveMaxConcurrency& amc) const {
+    if (amc.params().empty()) {
+        return new (std::nothrow) GradientConcurrencyLimiter;
+    }
+    int target_latency_ms = 0;
+    if (!butil::StringToInt(amc.params(), &target_latency_ms) ||
+        target_latency_ms <= 0) {
+        LOG(ERROR) << "Invalid target latency in `" << amc.value()
+                   << "', should be a positive number of milliseconds";
+        return NULL;
+    }
+    return new (std::nothrow) GradientConcurrencyLimiter(
+        target_latency_ms * 1000L);
+}
+
+bool GradientConcurrencyLimiter::OnRequested(int current_concurrency) {
+    int max_seen = _max_seen_concurrency.load(butil::memory_order_relaxed);
+    while (current_concurrency > max_seen &&
+           !_max_seen_concurrency.compare_exchange_weak(
+               max_seen, current_concurrency, butil::memory_order_relaxed)) {}
+    return current_concurrency <=
+        _max_concurrency.load(butil::memory_order_relaxed);
+}
+
+void GradientConcurrencyLimiter::OnResponded(int error_code, int64_t latency_us) {
+    if (ELIMIT == error_code) {
+        // Rejected requests did not run.
+        return;
+    }
+    // Latencies of failed requests(e.g. timedout) are counted as well.
+    _latency << latency_us;
+
+    const int64_t now_us = butil::gettimeofday_us();
+    int64_t next_update_us = _next_update_us.load(butil::memory_order_relaxed);
+    if (next_update_us == 0) {
+        // The first window starts now.
+        _next_update_us.compare_exchange_strong(
+            next_update_us,
+            now_us + _latency.window_size() * 1000000L,
+            butil::memory_order_relaxed);
+        return;
+    }
+    if (now_us < next_update_us ||
+        !_next_update_us.compare_exchange_strong(
+            next_update_us, now_us + _latency.window_size() * 1000000L,
+            butil::memory_order_relaxed)) {
+        return;
+    }
+    UpdateMaxConcurrency();
+}
+
+void GradientConcurrencyLimiter::UpdateMaxConcurrency() {
+    const int max_seen_concurrency =
+        _max_seen_concurrency.exchange(0, butil::memory_order_relaxed);
+    if (_latency.qps() * _latency.window_size() <
+        FLAGS_gradient_cl_min_sample_count) {
+        return;
+    }
+    const int64_t latency_us =
+        _latency.latency_percentile(FLAGS_gradient_cl_latency_percentile);
+    if (latency_us <= 0) {
+        return;
+    }
+    const int max_concurrency = _max_concurrency.load(butil::memory_order_relaxed);
+    const double gradient = std::max(
+        0.5, std::min(1.0, (double)_target_latency_us / latency_us));
+    double next_max_concurrency = max_concurrency * gradient;
+    if (gradient >= 1.0 && max_seen_concurrency * 2 >= max_concurrency) {
+        // The latency is fine and the limit is used, try a larger one.
+        // Don't explore when the concurrency is far below the limit,
+        // otherwise the limit grows unboundedly during idle periods and
+        // does not protect the server against next bursts.
+        next_max_concurrency += std::sqrt((double)max_concurrency);
+    }
+    const double alpha = std::max(
+        0.01, std::min(1.0, FLAGS_gradient_cl_smoothing_factor));
+    _smoothed_max_concurrency = _smoothed_max_concurrency * (1 - alpha) +
+        next_max_concurrency * alpha;
+    _smoothed_max_concurrency = std::max(
+        (double)FLAGS_gradient_cl_min_concurrency,
+        std::min((double)FLAGS_gradient_cl_max_concurrency,
+                 _smoothed_max_concurrency));
+    _max_concurrency.store((int)std::ceil(_smoothed_max_concurrency),
+                           butil::memory_order_relaxed);
+    VLOG(1) << "max_concurrency=" << max_concurrency << " -> "
+            << _max_concurrency.load(butil::memory_order_relaxed)
+            << ", latency_us=" << latency_us
+            << ", target_latency_us=" << _target_latency_us
+            << ", max_seen_concurrency=" << max_seen_concurrency;
+}
+
+int GradientConcurrencyLimiter::MaxConcurrency() {
+    return _max_concurrency.load(butil::memory_order_relaxed);
+}
+
+}  // namespace policy
+}  // namespace brpc
@@ -0,0 +1,65 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_GRADIENT_CONCURRENCY_LIMITER_H
+#define BRPC_POLICY_GRADIENT_CONCURRENCY_LIMITER_H
+
+#include "bvar/bvar.h"
+#include "brpc/concurrency_limiter.h"
+
+namespace brpc {
+namespace policy {
+
+// Keep a percentile(p99 by default) of latencies of the method under a
+// target, e.g. MaxConcurrencyOf("example.EchoService.Echo") = "gradient:20"
+// means p99 of latencies should be less than 20ms.
+// Once per window, max_concurrency is multiplied by the gradient
+// target/latency capped to [0.5, 1], plus sqrt(max_concurrency) to explore
+// when the concurrency reached half of max_concurrency in the window, then
+// smoothed with previous values so that bursts do not change it much.
+class GradientConcurrencyLimiter : public ConcurrencyLimiter {
+public:
+    GradientConcurrencyLimiter();
+    explicit GradientConcurrencyLimiter(int64_t target_latency_us);
+
+    bool OnRequested(int current_concurrency) override;
+
+    void OnResponded(int error_code, int64_t latency_us) override;
+
+    int MaxConcurrency() override;
+
+    GradientConcurrencyLimiter* New(const AdaptiveMaxConcurrency&) const override;
+
+private:
+    // Only called by one thread at the same time.
+    void UpdateMaxConcurrency();
+
+    const int64_t _target_latency_us;
+    bvar::LatencyRecorder _latency;
+    butil::atomic<int> _max_concurrency;
+    butil::atomic<int64_t> _next_update_us;
+    // Maximum concurrency seen since last update.
+    butil::atomic<int> BAIDU_CACHELINE_ALIGNMENT _max_seen_concurrency;
+    double _smoothed_max_concurrency;
+};
+
+}  // namespace policy
+}  // namespace brpc
+
+
+#endif // BRPC_POLICY_GRADIENT_CONCURRENCY_LIMITER_H
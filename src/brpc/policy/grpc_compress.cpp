@@ -0,0 +1,189 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <string.h>                               // strcmp
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/macros.h"                        // arraysize
+#include "butil/string_splitter.h"
+#include "butil/strings/string_util.h"            // TrimWhitespaceASCII
+#include "brpc/compress.h"                        // CompressTypeToCStr
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/gzip_compress.h"
+#include "brpc/policy/snappy_compress.h"
+#ifdef BRPC_WITH_LZ4
+#include "brpc/policy/lz4_compress.h"
+#endif
+#ifdef BRPC_WITH_ZSTD
+#include "brpc/policy/zstd_compress.h"
+#endif
+#include "brpc/policy/grpc_compress.h"
+
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(grpc_compress_min_bytes, 512,
+             "gRPC messages less than so many bytes are not compressed even "
+             "if compress_type is set, since the saved bytes of tiny messages "
+             "hardly pay for the cpu");
+BRPC_VALIDATE_GFLAG(grpc_compress_min_bytes, NonNegativeInteger);
+
+DEFINE_int32(grpc_zstd_compression_level, 1,
+             "Level of zstd-ed gRPC messages, higher levels compress better "
+             "but slower");
+BRPC_VALIDATE_GFLAG(grpc_zstd_compression_level, PassValidate);
+
+// CompressTypes that gRPC messages may be compressed with, in the order
+// listed in grpc-accept-encoding.
+static const CompressType s_grpc_compress_types[] = {
+    COMPRESS_TYPE_GZIP,
+    COMPRESS_TYPE_SNAPPY,
+#ifdef BRPC_WITH_LZ4
+    COMPRESS_TYPE_LZ4,
+#endif
+#ifdef BRPC_WITH_ZSTD
+    COMPRESS_TYPE_ZSTD,
+#endif
+};
+
+static bool NameIs(const butil::StringPiece& name, const char* lower) {
+    return LowerCaseEqualsASCII(name.data(), name.data() + name.size(),
+                                lower);
+}
+
+const char* GrpcEncodingOf(CompressType type) {
+    if (type == COMPRESS_TYPE_NONE) {
+        return "identity";
+    }
+    for (size_t i = 0; i < arraysize(s_grpc_compress_types); ++i) {
+        if (s_grpc_compress_types[i] == type) {
+            const char* name = CompressTypeToCStr(type);
+            // Not registered.
+            return (strcmp(name, "unknown") != 0 ? name : NULL);
+        }
+    }
+    return NULL;
+}
+
+bool ParseGrpcEncoding(const butil::StringPiece& name, CompressType* type) {
+    if (name.empty() || NameIs(name, "identity")) {
+        *type = COMPRESS_TYPE_NONE;
+        return true;
+    }
+    for (size_t i = 0; i < arraysize(s_grpc_compress_types); ++i) {
+        const char* encoding = GrpcEncodingOf(s_grpc_compress_types[i]);
+        if (encoding != NULL && NameIs(name, encoding)) {
+            *type = s_grpc_compress_types[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::string* CreateGrpcAcceptEncoding() {
+    std::string* value = new std::string("identity");
+    for (size_t i = 0; i < arraysize(s_grpc_compress_types); ++i) {
+        const char* encoding = GrpcEncodingOf(s_grpc_compress_types[i]);
+        if (encoding != NULL) {
+            value->push_back(',');
+            value->append(encoding);
+        }
+    }
+    return value;
+}
+
+const std::string& GrpcAcceptEncoding() {
+    // Handlers are registered during global initialization which is
+    // done before any channel or server is created.
+    static const std::string* s_value = CreateGrpcAcceptEncoding();
+    return *s_value;
+}
+
+CompressType NegotiateGrpcEncoding(CompressType type,
+                                   const std::string* accept_encoding) {
+    const char* encoding = GrpcEncodingOf(type);
+    if (type == COMPRESS_TYPE_NONE || encoding == NULL) {
+        return COMPRESS_TYPE_NONE;
+    }
+    if (accept_encoding == NULL) {
+        // Compatible with peers which only understand gzip.
+        return (type == COMPRESS_TYPE_GZIP ? type : COMPRESS_TYPE_NONE);
+    }
+    for (butil::StringSplitter sp(*accept_encoding, ','); sp; ++sp) {
+        butil::StringPiece name(sp.field(), sp.length());
+        butil::TrimWhitespaceASCII(name, butil::TRIM_ALL, &name);
+        if (NameIs(name, encoding)) {
+            return type;
+        }
+    }
+    return COMPRESS_TYPE_NONE;
+}
+
+bool ShouldCompressGrpcMessage(size_t size) {
+    return size >= (size_t)FLAGS_grpc_compress_min_bytes;
+}
+
+bool GrpcCompress(CompressType type, const butil::IOBuf& in,
+                  butil::IOBuf* out) {
+    switch (type) {
+    case COMPRESS_TYPE_GZIP:
+        return GzipCompress(in, out, NULL);
+    case COMPRESS_TYPE_SNAPPY:
+        return SnappyCompress(in, out);
+#ifdef BRPC_WITH_LZ4
+    case COMPRESS_TYPE_LZ4:
+        return Lz4Compress(in, out);
+#endif
+#ifdef BRPC_WITH_ZSTD
+    case COMPRESS_TYPE_ZSTD:
+        return ZstdCompress(in, out, FLAGS_grpc_zstd_compression_level);
+#endif
+    default:
+        break;
+    }
+    LOG(ERROR) << "gRPC messages can't be compressed with "
+               << CompressTypeToCStr(type);
+    return false;
+}
+
+bool GrpcDecompress(CompressType type, const butil::IOBuf& in,
+                    butil::IOBuf* out) {
+    switch (type) {
+    case COMPRESS_TYPE_GZIP:
+        return GzipDecompress(in, out);
+    case COMPRESS_TYPE_SNAPPY:
+        return SnappyDecompress(in, out);
+#ifdef BRPC_WITH_LZ4
+    case COMPRESS_TYPE_LZ4:
+        return Lz4Decompress(in, out);
+#endif
+#ifdef BRPC_WITH_ZSTD
+    case COMPRESS_TYPE_ZSTD:
+        return ZstdDecompress(in, out);
+#endif
+    default:
+        break;
+    }
+    LOG(ERROR) << "gRPC messages can't be decompressed with "
+               << CompressTypeToCStr(type);
+    return false;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,70 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_GRPC_COMPRESS_H
+#define BRPC_POLICY_GRPC_COMPRESS_H
+
+#include <string>
+#include "butil/iobuf.h"                       // IOBuf
+#include "butil/strings/string_piece.h"        // StringPiece
+#include "brpc/options.pb.h"                   // CompressType
+
+
+namespace brpc {
+namespace policy {
+
+// Message encodings of gRPC are named after the registered CompressHandler
+// of the CompressType, e.g. "gzip", "snappy", "lz4" and "zstd". Only types
+// whose handlers are registered (see RegisterCompressHandler) and which can
+// compress IOBuf directly are usable.
+
+// Returns the name of `type' in grpc-encoding, NULL if gRPC messages can't
+// be compressed with `type'. "identity" for COMPRESS_TYPE_NONE.
+const char* GrpcEncodingOf(CompressType type);
+
+// Set `type' to the CompressType named `name' in grpc-encoding, case
+// insensitive. Returns false if the encoding is unknown or not registered.
+bool ParseGrpcEncoding(const butil::StringPiece& name, CompressType* type);
+
+// Value of grpc-accept-encoding: "identity" followed by all usable
+// encodings, e.g. "identity,gzip,snappy,zstd".
+const std::string& GrpcAcceptEncoding();
+
+// Returns `type' if it's listed in `accept_encoding' which is the value of
+// grpc-accept-encoding of the peer, COMPRESS_TYPE_NONE otherwise. Peers
+// not sending grpc-accept-encoding are assumed to accept gzip only.
+CompressType NegotiateGrpcEncoding(CompressType type,
+                                   const std::string* accept_encoding);
+
+// True if a gRPC message of `size' bytes is large enough to be compressed,
+// namely not less than -grpc_compress_min_bytes.
+bool ShouldCompressGrpcMessage(size_t size);
+
+// Put `in' compressed with `type' into `out'.
+bool GrpcCompress(CompressType type, const butil::IOBuf& in,
+                  butil::IOBuf* out);
+
+// Put `in' decompressed with `type' into `out'.
+bool GrpcDecompress(CompressType type, const butil::IOBuf& in,
+                    butil::IOBuf* out);
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif // BRPC_POLICY_GRPC_COMPRESS_H
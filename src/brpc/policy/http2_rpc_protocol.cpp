@@ -18,8 +18,12 @@
 
 #include "brpc/policy/http2_rpc_protocol.h"
 #include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/server_private_accessor.h"
 #include "brpc/server.h"
+#include "brpc/stream_impl.h"
 #include "butil/base64.h"
+#include "butil/time.h"
+#include "bvar/bvar.h"
 #include "brpc/log.h"
 
 namespace brpc {
@@ -47,6 +51,18 @@ DEFINE_bool(h2_hpack_encode_name, false,
 DEFINE_bool(h2_hpack_encode_value, false,
             "Encode value in HTTP2 headers with huffman encoding");
 
+DEFINE_int32(h2_data_quantum, 16 * 1024,
+             "Bodies larger than this are sent in rounds interleaved with "
+             "bodies of other streams of the connection, a stream of weight W "
+             "sends quantum*W/16 bytes in each round so that large bodies "
+             "don't block small ones. <= 0 disables interleaving");
+BRPC_VALIDATE_GFLAG(h2_data_quantum, PassValidate);
+DEFINE_int32(h2_data_batch_size, 256 * 1024,
+             "Max bytes of interleaved DATA of all streams packed into one "
+             "write, larger batches mean fewer writes but longer delays of "
+             "other messages of the connection");
+BRPC_VALIDATE_GFLAG(h2_data_batch_size, PositiveInteger);
+
 static bool CheckStreamWindowSize(const char*, int32_t val) {
     return val >= 0;
 }
@@ -57,6 +73,42 @@ static bool CheckConnWindowSize(const char*, int32_t val) {
 }
 BRPC_VALIDATE_GFLAG(h2_client_connection_window_size, CheckConnWindowSize);
 
+DEFINE_bool(h2_bdp_probe, true,
+            "Estimate bandwidth-delay product of http2 connections with PING "
+            "and grow local windows when they limit the throughput");
+BRPC_VALIDATE_GFLAG(h2_bdp_probe, PassValidate);
+DEFINE_int32(h2_max_stream_window_size, 16 * 1024 * 1024,
+             "Max stream-level window size that -h2_bdp_probe grows to");
+BRPC_VALIDATE_GFLAG(h2_max_stream_window_size, CheckConnWindowSize);
+DEFINE_int32(h2_max_connection_window_size, 64 * 1024 * 1024,
+             "Max connection-level window size that -h2_bdp_probe grows to");
+BRPC_VALIDATE_GFLAG(h2_max_connection_window_size, CheckConnWindowSize);
+
+// Interval between BDP pings. The interval is halved when the windows grow
+// and doubled otherwise, so that connections with stable throughput are
+// rarely pinged.
+static const int64_t MIN_BDP_PING_INTERVAL_US = 10000L;
+static const int64_t INITIAL_BDP_PING_INTERVAL_US = 100000L;
+static const int64_t MAX_BDP_PING_INTERVAL_US = 10000000L;
+
+struct H2FlowControlBvars {
+    // Time that remote sides were blocked by stream-level windows of this
+    // side, counted from the DATA frame using up the window to the next DATA
+    // frame of the stream.
+    bvar::Adder<int64_t> window_stall_us;
+    bvar::PerSecond<bvar::Adder<int64_t> > window_stall_us_second;
+    // Number of times that local windows were grown.
+    bvar::Adder<int64_t> window_grow_count;
+
+    H2FlowControlBvars()
+        : window_stall_us("h2_window_stall_us")
+        , window_stall_us_second("h2_window_stall_us_second", &window_stall_us)
+        , window_grow_count("h2_window_grow_count") {}
+};
+inline H2FlowControlBvars* get_h2_flow_control_bvars() {
+    return butil::get_leaky_singleton<H2FlowControlBvars>();
+}
+
 const char* H2StreamState2Str(H2StreamState s) {
     switch (s) {
     case H2_STREAM_IDLE: return "idle";
@@ -324,6 +376,7 @@ inline H2Context::FrameHandler FindFrameHandler(H2FrameType type) {
 
 H2Context::H2Context(Socket* socket, const Server* server)
     : _socket(socket)
+    , _server(server)
     // Maximize the window size to make sending big request possible before
     // receving the remote settings.
     , _remote_window_left(H2Settings::MAX_WINDOW_SIZE)
@@ -332,7 +385,16 @@ H2Context::H2Context(Socket* socket, const Server* server)
     , _last_sent_stream_id(1)
     , _goaway_stream_id(-1)
     , _remote_settings_received(false)
-    , _deferred_window_update(0) {
+    , _deferred_window_update(0)
+    , _local_conn_window_size(H2Settings::DEFAULT_INITIAL_WINDOW_SIZE)
+    , _bdp_ping_inflight(false)
+    , _bdp_ping_data(0)
+    , _bdp_ping_start_us(0)
+    , _bdp_next_ping_us(0)
+    , _bdp_ping_interval_us(INITIAL_BDP_PING_INTERVAL_US)
+    , _bdp_bytes(0)
+    , _ngrpc_streams(0)
+    , _scheduled_data_flushing(false) {
     // Stop printing the field which is useless for remote settings.
     _remote_settings.connection_window_size = 0;
     // Maximize the window size to make sending big request possible before
@@ -346,6 +408,11 @@ H2Context::H2Context(Socket* socket, const Server* server)
         _unack_local_settings.max_frame_size = FLAGS_h2_client_max_frame_size;
         _unack_local_settings.connection_window_size = FLAGS_h2_client_connection_window_size;
     }
+    // Connection-level window is enlarged by WINDOW_UPDATE rather than
+    // SETTINGS, see OnConnectionPreface and ClientConnectionPreface.
+    _local_conn_window_size = std::max(
+        (int64_t)_unack_local_settings.connection_window_size,
+        _local_conn_window_size);
 #if defined(UNIT_TEST)
     // In ut, we hope _last_sent_stream_id run out quickly to test the correctness
     // of creating new h2 socket. This value is 10,000 less than 0x7FFFFFFF.
@@ -359,6 +426,10 @@ H2Context::~H2Context() {
         delete it->second;
     }
     _pending_streams.clear();
+    for (size_t i = 0; i < _scheduled_data.size(); ++i) {
+        delete _scheduled_data[i];
+    }
+    _scheduled_data.clear();
 }
 
 int H2Context::Init() {
@@ -567,9 +638,12 @@ H2ParseResult H2Context::OnHeaders(
         pad_length = LoadUint8(it);
         --frag_size;
     }
+    // Only the weight is used to share bandwidth between streams, the
+    // dependency tree is ignored.
+    int weight = H2_DEFAULT_WEIGHT;
     if (has_priority) {
         const uint32_t ALLOW_UNUSED stream_dep = LoadUint32(it);
-        const uint32_t ALLOW_UNUSED weight = LoadUint8(it);
+        weight = LoadUint8(it) + 1;
         frag_size -= 5;
     }
     if (frag_size < pad_length) {
@@ -597,6 +671,7 @@ H2ParseResult H2Context::OnHeaders(
             delete sctx;
             return MakeH2Error(H2_REFUSED_STREAM);
         }
+        sctx->_weight = weight;
     } else {
         sctx = FindStream(frame_head.stream_id);
         if (sctx == NULL) {
@@ -642,10 +717,7 @@ H2ParseResult H2StreamContext::OnHeaders(
                 << ", stream_id=" << frame_head.stream_id;
             return MakeH2Error(H2_PROTOCOL_ERROR);
         }
-        if (frame_head.flags & H2_FLAGS_END_STREAM) {
-            return OnEndStream();
-        }
-        return MakeH2Message(NULL);
+        return OnEndHeaders(frame_head.flags & H2_FLAGS_END_STREAM);
     } else {
         if (frame_head.flags & H2_FLAGS_END_STREAM) {
             // Delay calling OnEndStream() in OnContinuation()
@@ -692,9 +764,7 @@ H2ParseResult H2StreamContext::OnContinuation(
                 << ", stream_id=" << frame_head.stream_id;
             return MakeH2Error(H2_PROTOCOL_ERROR);
         }
-        if (_stream_ended) {
-            return OnEndStream();
-        }
+        return OnEndHeaders(_stream_ended);
     }
     return MakeH2Message(NULL);
 }
@@ -712,6 +782,7 @@ H2ParseResult H2Context::OnData(
         return MakeH2Error(H2_FRAME_SIZE_ERROR);
     }
     frag_size -= pad_length;
+    SampleBdp(frag_size);
     H2StreamContext* sctx = FindStream(frame_head.stream_id);
     if (sctx == NULL) {
         // If a DATA frame is received whose stream is not in "open" or "half-closed (local)" state,
@@ -735,6 +806,9 @@ H2ParseResult H2StreamContext::OnData(
     butil::IOBuf data;
     it.append_and_forward(&data, frag_size);
     it.forward(pad_length);
+    if (_grpc != NULL && _grpc->deliver_messages) {
+        return OnGrpcData(data, frame_head, frag_size);
+    }
     for (size_t i = 0; i < data.backing_block_num(); ++i) {
         const butil::StringPiece blk = data.backing_block(i);
         if (OnBody(blk.data(), blk.size()) != 0) {
@@ -743,6 +817,18 @@ H2ParseResult H2StreamContext::OnData(
         }
     }
 
+    if (_window_stall_start_us) {
+        get_h2_flow_control_bvars()->window_stall_us
+            << butil::cpuwide_time_us() - _window_stall_start_us;
+        _window_stall_start_us = 0;
+    }
+    _local_window_left -= frag_size;
+    if (_local_window_left <= 0 && !(frame_head.flags & H2_FLAGS_END_STREAM)) {
+        // Remote side can't send more data of this stream until it receives
+        // the WINDOW_UPDATE.
+        _window_stall_start_us = butil::cpuwide_time_us();
+    }
+
     const int64_t acc = _deferred_window_update.fetch_add(frag_size, butil::memory_order_relaxed) + frag_size;
     if (acc >= _conn_ctx->local_settings().stream_window_size / 2) {
         if (acc > _conn_ctx->local_settings().stream_window_size) {
@@ -768,6 +854,7 @@ H2ParseResult H2StreamContext::OnData(
                 LOG(WARNING) << "Fail to send WINDOW_UPDATE to " << *_conn_ctx->_socket;
                 return MakeH2Error(H2_INTERNAL_ERROR);
             }
+            _local_window_left += stream_wu;
         }
     }
     if (frame_head.flags & H2_FLAGS_END_STREAM) {
@@ -783,6 +870,8 @@ H2ParseResult H2Context::OnResetStream(
         return MakeH2Error(H2_FRAME_SIZE_ERROR);
     }
     const H2Error h2_error = static_cast<H2Error>(LoadUint32(it));
+    // Responses may be removed from the stream map but not fully sent.
+    DropScheduledData(frame_head.stream_id);
     H2StreamContext* sctx = FindStream(frame_head.stream_id);
     if (sctx == NULL) {
         RPC_VLOG << "Fail to find stream_id=" << frame_head.stream_id;
@@ -832,6 +921,10 @@ H2ParseResult H2StreamContext::OnEndStream() {
         return MakeH2Error(H2_PROTOCOL_ERROR);
     }
 #endif
+    if (_grpc != NULL &&
+        (_conn_ctx->is_server_side() || _grpc->headers_emitted)) {
+        return OnGrpcEndStream();
+    }
     H2StreamContext* sctx = _conn_ctx->RemoveStream(stream_id());
     if (sctx == NULL) {
         RPC_VLOG << "Fail to find stream_id=" << stream_id();
@@ -843,6 +936,170 @@ H2ParseResult H2StreamContext::OnEndStream() {
     return MakeH2Message(sctx);
 }
 
+struct GrpcStreamEvents {
+    // Frames to be written after unlocking _stream_mutex, since writing into
+    // the socket may pack other messages which lock the mutex.
+    butil::IOBuf frames;
+    // Streams and bytes of framed messages sent to them in total.
+    std::vector<std::pair<StreamId, int64_t> > sent;
+    // http2 streams ended at both sides.
+    std::vector<int> finished;
+    // Addressed streams, released after unlocking since releasing the last
+    // reference closes the stream which locks _stream_mutex.
+    std::vector<SocketUniquePtr> streams;
+};
+
+// Find the method called by the gRPC request `h' whose path is
+// "/<service>/<method>", NULL if the method is not client-streaming or
+// server-streaming.
+static const google::protobuf::MethodDescriptor*
+FindStreamingGrpcMethod(const Server* server, const HttpHeader& h) {
+    bool is_grpc_ct = false;
+    ParseContentType(h.content_type(), &is_grpc_ct);
+    if (!is_grpc_ct) {
+        return NULL;
+    }
+    const std::string& path = h.uri().path();
+    if (path.size() < 2 || path[0] != '/') {
+        return NULL;
+    }
+    const size_t pos = path.find('/', 1);
+    if (pos == std::string::npos) {
+        return NULL;
+    }
+    const Server::MethodProperty* mp =
+        ServerPrivateAccessor(server).FindMethodPropertyByFullName(
+            butil::StringPiece(path.data() + 1, pos - 1),
+            butil::StringPiece(path.data() + pos + 1, path.size() - pos - 1));
+    if (mp == NULL || mp->method == NULL ||
+        !(mp->method->client_streaming() || mp->method->server_streaming())) {
+        return NULL;
+    }
+    return mp->method;
+}
+
+H2ParseResult H2StreamContext::OnEndHeaders(bool end_stream) {
+    if (_conn_ctx->is_server_side()) {
+        if (_grpc == NULL && _conn_ctx->_server != NULL) {
+            const google::protobuf::MethodDescriptor* md =
+                FindStreamingGrpcMethod(_conn_ctx->_server, header());
+            if (md != NULL) {
+                _conn_ctx->CreateGrpcStreamState(
+                    this, md->client_streaming(), md->server_streaming());
+            }
+        }
+        if (_grpc != NULL && _grpc->client_streaming &&
+            !_grpc->headers_emitted) {
+            // Dispatch the call without waiting for the requests, which are
+            // delivered to the stream accepted by the service.
+            _grpc->deliver_messages = true;
+            _grpc->headers_emitted = true;
+            if (end_stream) {
+                std::unique_lock<butil::Mutex> mu(_conn_ctx->_stream_mutex);
+                _grpc->remote_ended = true;
+            }
+            return MakeH2Message(NewGrpcStreamMessage());
+        }
+    } else if (_grpc != NULL && _grpc->server_streaming &&
+               !_grpc->headers_emitted && !end_stream) {
+        // End the RPC with the headers, responses are delivered to the
+        // stream created along with the RPC.
+        _grpc->deliver_messages = true;
+        _grpc->headers_emitted = true;
+        return MakeH2Message(NewGrpcStreamMessage());
+    }
+    if (end_stream) {
+        return OnEndStream();
+    }
+    return MakeH2Message(NULL);
+}
+
+H2StreamContext* H2StreamContext::NewGrpcStreamMessage() {
+    H2StreamContext* msg = new H2StreamContext(false);
+    msg->Init(_conn_ctx, _stream_id);
+    msg->_is_grpc_stream = true;
+    msg->_correlation_id = _correlation_id;
+    msg->_parsed_length = _parsed_length;
+    msg->header().Swap(header());
+    msg->body().swap(body());
+    return msg;
+}
+
+H2ParseResult H2StreamContext::OnGrpcData(
+    butil::IOBuf& data, const H2FrameHead& frame_head, uint32_t frag_size) {
+    // Connection-level window is returned at once while the stream-level
+    // one is returned after messages are consumed by the stream, which
+    // applies backpressure of the stream to the remote side.
+    _conn_ctx->DeferWindowUpdate(frag_size);
+    GrpcStreamEvents events;
+    int rc = 0;
+    {
+        std::unique_lock<butil::Mutex> mu(_conn_ctx->_stream_mutex);
+        H2GrpcStreamState* g = _grpc.get();
+        g->unconsumed_size += frag_size;
+        if (g->unconsumed_size + g->consumed_size >
+            _conn_ctx->local_settings().stream_window_size) {
+            LOG(ERROR) << "Fail to satisfy the stream-level flow control policy";
+            return MakeH2Error(H2_FLOW_CONTROL_ERROR, frame_head.stream_id);
+        }
+        g->received_data.append(butil::IOBuf::Movable(data));
+        rc = _conn_ctx->DeliverGrpcMessagesLocked(this, &events);
+    }
+    _conn_ctx->HandleGrpcStreamEvents(&events);
+    if (rc != 0) {
+        return MakeH2Error(H2_PROTOCOL_ERROR, frame_head.stream_id);
+    }
+    if (frame_head.flags & H2_FLAGS_END_STREAM) {
+        return OnEndStream();
+    }
+    return MakeH2Message(NULL);
+}
+
+H2ParseResult H2StreamContext::OnGrpcEndStream() {
+    H2Context* const conn_ctx = _conn_ctx;
+    const int id = stream_id();
+    if (conn_ctx->is_client_side()) {
+        // The RPC was ended by headers, end the stream after delivered
+        // responses.
+        const std::string* status = header().GetHeader("grpc-status");
+        if (status != NULL && strtol(status->c_str(), NULL, 10) != GRPC_OK) {
+            const std::string* message = header().GetHeader("grpc-message");
+            LOG(WARNING) << "Streaming gRPC call of stream_id=" << id
+                         << " ended with grpc-status=" << *status
+                         << (message ? " grpc-message=" : "")
+                         << (message ? *message : std::string());
+        }
+        delete conn_ctx->RemoveStream(id);
+        return MakeH2Message(NULL);
+    }
+    H2GrpcStreamState* g = _grpc.get();
+    H2StreamContext* msg = NULL;
+    if (!g->headers_emitted) {
+        // The only request of a server-streaming call is complete.
+        g->headers_emitted = true;
+        OnMessageComplete();
+        msg = NewGrpcStreamMessage();
+    }
+    GrpcStreamEvents events;
+    bool finished = false;
+    int rc = 0;
+    {
+        std::unique_lock<butil::Mutex> mu(conn_ctx->_stream_mutex);
+        g->remote_ended = true;
+        rc = conn_ctx->DeliverGrpcMessagesLocked(this, &events);
+        finished = g->local_ended;
+    }
+    conn_ctx->HandleGrpcStreamEvents(&events);
+    if (rc != 0) {
+        delete msg;
+        return MakeH2Error(H2_PROTOCOL_ERROR, id);
+    }
+    if (finished) {
+        delete conn_ctx->RemoveStream(id);
+    }
+    return MakeH2Message(msg);
+}
+
 H2ParseResult H2Context::OnSettings(
     butil::IOBufBytesIterator& it, const H2FrameHead& frame_head) {
     // SETTINGS frames always apply to a connection, never a single stream.
@@ -903,6 +1160,9 @@ H2ParseResult H2Context::OnSettings(
             }
         }
     }
+    if (window_diff > 0) {
+        FlushGrpcStreams(0);
+    }
     // Respond with ack
     char headbuf[FRAME_HEAD_SIZE];
     SerializeFrameHead(headbuf, 0, H2_FRAME_SETTINGS, H2_FLAGS_ACK, 0);
@@ -936,9 +1196,16 @@ H2ParseResult H2Context::OnPing(
         return MakeH2Error(H2_PROTOCOL_ERROR);
     }
     if (frame_head.flags & H2_FLAGS_ACK) {
+        char data[8];
+        it.copy_and_forward(data, sizeof(data));
+        if (_bdp_ping_inflight &&
+            memcmp(data, &_bdp_ping_data, sizeof(data)) == 0) {
+            OnBdpPingAck();
+        }
         return MakeH2Message(NULL);
     }
-    
+
+
     char pongbuf[FRAME_HEAD_SIZE + 8];
     SerializeFrameHead(pongbuf, 8, H2_FRAME_PING, H2_FLAGS_ACK, 0);
     it.copy_and_forward(pongbuf + FRAME_HEAD_SIZE, 8);
@@ -949,6 +1216,109 @@ H2ParseResult H2Context::OnPing(
     return MakeH2Message(NULL);
 }
 
+// Bytes received between sending a PING and receiving its ACK are an
+// estimation of the bandwidth-delay product(BDP) of the connection. When
+// the BDP gets close to the stream-level window, the window rather than the
+// network limits the throughput and is grown to twice of the BDP. All these
+// methods are called in the parsing thread.
+void H2Context::SampleBdp(uint32_t data_size) {
+    if (!FLAGS_h2_bdp_probe) {
+        return;
+    }
+    _bdp_bytes += data_size;
+    if (_bdp_ping_inflight) {
+        return;
+    }
+    if (_unack_local_settings.stream_window_size >=
+        (uint32_t)FLAGS_h2_max_stream_window_size &&
+        _local_conn_window_size >= FLAGS_h2_max_connection_window_size) {
+        // Nothing to grow.
+        return;
+    }
+    const int64_t now_us = butil::cpuwide_time_us();
+    if (now_us < _bdp_next_ping_us) {
+        return;
+    }
+    char pingbuf[FRAME_HEAD_SIZE + 8];
+    SerializeFrameHead(pingbuf, 8, H2_FRAME_PING, 0, 0);
+    ++_bdp_ping_data;
+    memcpy(pingbuf + FRAME_HEAD_SIZE, &_bdp_ping_data, 8);
+    if (WriteAck(_socket, pingbuf, sizeof(pingbuf)) != 0) {
+        LOG(WARNING) << "Fail to send PING to " << *_socket;
+        return;
+    }
+    _bdp_ping_inflight = true;
+    _bdp_ping_start_us = now_us;
+    // Data of current frame was sent before the PING.
+    _bdp_bytes = 0;
+}
+
+void H2Context::OnBdpPingAck() {
+    const int64_t now_us = butil::cpuwide_time_us();
+    _bdp_ping_inflight = false;
+    const int64_t bdp = _bdp_bytes;
+    RPC_VLOG << "bdp=" << bdp << " rtt=" << now_us - _bdp_ping_start_us
+             << "us of " << *_socket;
+    if (bdp * 3 >= (int64_t)_unack_local_settings.stream_window_size * 2) {
+        GrowLocalWindows(bdp * 2);
+        _bdp_ping_interval_us = std::max(_bdp_ping_interval_us / 2,
+                                         MIN_BDP_PING_INTERVAL_US);
+    } else {
+        _bdp_ping_interval_us = std::min(_bdp_ping_interval_us * 2,
+                                         MAX_BDP_PING_INTERVAL_US);
+    }
+    _bdp_next_ping_us = now_us + _bdp_ping_interval_us;
+}
+
+void H2Context::GrowLocalWindows(int64_t target_window_size) {
+    // Connection-level window should not be smaller than the stream-level
+    // one, otherwise a single stream could be blocked by the connection.
+    const int64_t max_stream_window = std::min(
+        FLAGS_h2_max_stream_window_size, FLAGS_h2_max_connection_window_size);
+    const int64_t old_stream_window = _unack_local_settings.stream_window_size;
+    const int64_t new_stream_window = std::max(
+        std::min(target_window_size, max_stream_window), old_stream_window);
+    const int64_t new_conn_window = std::max(
+        std::min(std::max(target_window_size, new_stream_window),
+                 (int64_t)FLAGS_h2_max_connection_window_size),
+        _local_conn_window_size);
+    if (new_stream_window == old_stream_window &&
+        new_conn_window == _local_conn_window_size) {
+        return;
+    }
+    char buf[FRAME_HEAD_SIZE + 6 + FRAME_HEAD_SIZE + 4];
+    char* p = buf;
+    if (new_stream_window > old_stream_window) {
+        // Increase windows of all streams including existing ones, which
+        // is what the peer does on receiving SETTINGS_INITIAL_WINDOW_SIZE.
+        SerializeFrameHead(p, 6, H2_FRAME_SETTINGS, 0, 0);
+        SaveUint16(p + FRAME_HEAD_SIZE, H2_SETTINGS_STREAM_WINDOW_SIZE);
+        SaveUint32(p + FRAME_HEAD_SIZE + 2, new_stream_window);
+        p += FRAME_HEAD_SIZE + 6;
+    }
+    if (new_conn_window > _local_conn_window_size) {
+        SerializeFrameHead(p, 4, H2_FRAME_WINDOW_UPDATE, 0, 0);
+        SaveUint32(p + FRAME_HEAD_SIZE, new_conn_window - _local_conn_window_size);
+        p += FRAME_HEAD_SIZE + 4;
+    }
+    if (WriteAck(_socket, buf, p - buf) != 0) {
+        LOG(WARNING) << "Fail to grow windows of " << *_socket;
+        return;
+    }
+    get_h2_flow_control_bvars()->window_grow_count << 1;
+    // Checked against _local_settings after the SETTINGS is acked.
+    _unack_local_settings.stream_window_size = new_stream_window;
+    _local_conn_window_size = new_conn_window;
+    const int64_t diff = new_stream_window - old_stream_window;
+    if (diff > 0) {
+        std::unique_lock<butil::Mutex> mu(_stream_mutex);
+        for (StreamMap::const_iterator it = _pending_streams.begin();
+             it != _pending_streams.end(); ++it) {
+            it->second->_local_window_left += diff;
+        }
+    }
+}
+
 static void* ProcessHttpResponseWrapper(void* void_arg) {
     ProcessHttpResponse(static_cast<InputMessageBase*>(void_arg));
     return NULL;
@@ -1019,6 +1389,7 @@ H2ParseResult H2Context::OnWindowUpdate(
             LOG(ERROR) << "Invalid connection-level window_size_increment=" << inc;
             return MakeH2Error(H2_FLOW_CONTROL_ERROR);
         }
+        FlushGrpcStreams(0);
         return MakeH2Message(NULL);
     } else {
         H2StreamContext* sctx = FindStream(frame_head.stream_id);
@@ -1031,6 +1402,9 @@ H2ParseResult H2Context::OnWindowUpdate(
                 << " to remote_window_left=" << sctx->_remote_window_left.load(butil::memory_order_relaxed);
             return MakeH2Error(H2_FLOW_CONTROL_ERROR);
         }
+        if (sctx->_grpc != NULL) {
+            FlushGrpcStreams(frame_head.stream_id);
+        }
         return MakeH2Message(NULL);
     }
 }
@@ -1050,6 +1424,8 @@ void H2Context::Describe(std::ostream& os, const DescribeOptions& opt) const {
        << sep << "remote_settings=" << _remote_settings
        << sep << "remote_settings_received=" << _remote_settings_received
        << sep << "local_settings=" << _local_settings
+       << sep << "local_conn_window_size=" << _local_conn_window_size
+       << sep << "bdp_ping_interval_us=" << _bdp_ping_interval_us
        << sep << "hpacker={";
     IndentingOStream os2(os, 2);
     _hpacker.Describe(os2, opt);
@@ -1059,8 +1435,14 @@ void H2Context::Describe(std::ostream& os, const DescribeOptions& opt) const {
         BAIDU_SCOPED_LOCK(_abandoned_streams_mutex);
         abandoned_size = _abandoned_streams.size();
     }
+    size_t scheduled_size = 0;
+    {
+        BAIDU_SCOPED_LOCK(_scheduled_data_mutex);
+        scheduled_size = _scheduled_data.size();
+    }
     os << sep << "abandoned_streams=" << abandoned_size
-       << sep << "pending_streams=" << VolatilePendingStreamSize();
+       << sep << "pending_streams=" << VolatilePendingStreamSize()
+       << sep << "scheduled_data_streams=" << scheduled_size;
     if (opt.verbose) {
         os << '\n';
     }
@@ -1166,9 +1548,13 @@ H2StreamContext::H2StreamContext(bool read_body_progressively)
 #endif
     , _stream_id(0)
     , _stream_ended(false)
+    , _weight(H2_DEFAULT_WEIGHT)
     , _remote_window_left(0)
     , _deferred_window_update(0)
-    , _correlation_id(INVALID_BTHREAD_ID.value) {
+    , _local_window_left(0)
+    , _window_stall_start_us(0)
+    , _correlation_id(INVALID_BTHREAD_ID.value)
+    , _is_grpc_stream(false) {
     header().set_version(2, 0);
 #ifndef NDEBUG
     get_h2_bvars()->h2_stream_context_count << 1;
@@ -1180,9 +1566,16 @@ void H2StreamContext::Init(H2Context* conn_ctx, int stream_id) {
     _stream_id = stream_id;
     _remote_window_left.store(conn_ctx->remote_settings().stream_window_size,
                               butil::memory_order_relaxed);
+    _local_window_left = conn_ctx->_unack_local_settings.stream_window_size;
 }
 
 H2StreamContext::~H2StreamContext() {
+    if (_grpc != NULL) {
+        _conn_ctx->_ngrpc_streams.fetch_sub(1, butil::memory_order_relaxed);
+        if (_grpc->stream != INVALID_STREAM_ID) {
+            Stream::SetFailed(_grpc->stream);
+        }
+    }
 #ifndef NDEBUG
     get_h2_bvars()->h2_stream_context_count << -1;
 #endif
@@ -1315,12 +1708,13 @@ static void PackH2Message(butil::IOBuf* out,
                           butil::IOBuf& trailer_headers,
                           const butil::IOBuf& data,
                           int stream_id,
-                          H2Context* conn_ctx) {
+                          H2Context* conn_ctx,
+                          bool end_stream) {
     const H2Settings& remote_settings = conn_ctx->remote_settings();
     char headbuf[FRAME_HEAD_SIZE];
     H2FrameHead headers_head = {
         (uint32_t)headers.size(), H2_FRAME_HEADERS, 0, stream_id};
-    if (data.empty() && trailer_headers.empty()) {
+    if (end_stream && data.empty() && trailer_headers.empty()) {
         headers_head.flags |= H2_FLAGS_END_STREAM;
     }
     if (headers_head.payload_size <= remote_settings.max_frame_size) {
@@ -1353,7 +1747,7 @@ static void PackH2Message(butil::IOBuf* out,
         while (it.bytes_left()) {
             if (it.bytes_left() <= remote_settings.max_frame_size) {
                 data_head.payload_size = it.bytes_left();
-                if (trailer_headers.empty()) {
+                if (end_stream && trailer_headers.empty()) {
                     data_head.flags |= H2_FLAGS_END_STREAM;
                 }
             } else {
@@ -1382,6 +1776,13 @@ static void PackH2Message(butil::IOBuf* out,
     }
 }
 
+// True if a body of `size' bytes should be sent in rounds interleaved with
+// bodies of other streams.
+static bool ShouldScheduleData(size_t size) {
+    const int32_t quantum = FLAGS_h2_data_quantum;
+    return quantum > 0 && size > (size_t)quantum;
+}
+
 H2UnsentRequest* H2UnsentRequest::New(Controller* c) {
     const HttpHeader& h = c->http_request();
     const CommonStrings* const common = get_common_strings();
@@ -1551,8 +1952,37 @@ H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     }
 
     _sctx->Init(ctx, id);
+    // Messages of a streaming gRPC call are carried by the request stream,
+    // which is connected along with the http2 stream.
+    SocketUniquePtr stream_ptr;
+    bool client_streaming = false;
+    const StreamId request_stream =
+        ControllerPrivateAccessor(_cntl).request_stream();
+    const google::protobuf::MethodDescriptor* md = _cntl->method();
+    if (request_stream != INVALID_STREAM_ID && md != NULL &&
+        (md->client_streaming() || md->server_streaming())) {
+        bool is_grpc_ct = false;
+        ParseContentType(_cntl->http_request().content_type(), &is_grpc_ct);
+        if (is_grpc_ct) {
+            if (Socket::Address(request_stream, &stream_ptr) != 0) {
+                return butil::Status(EREQUEST, "Request stream=%" PRIu64
+                                     " was closed", request_stream);
+            }
+            Stream* s = (Stream*)stream_ptr->conn();
+            if (s->SetH2Stream(socket, id) != 0) {
+                return butil::Status(EREQUEST, "Fail to bind request stream=%"
+                                     PRIu64, request_stream);
+            }
+            client_streaming = md->client_streaming();
+            ctx->CreateGrpcStreamState(_sctx.get(), client_streaming,
+                                       md->server_streaming());
+            _sctx->_grpc->stream = request_stream;
+            // The only request is sent along with headers.
+            _sctx->_grpc->local_ended = !client_streaming;
+        }
+    }
     // check flow control restriction
-    if (!_cntl->request_attachment().empty()) {
+    if (!client_streaming && !_cntl->request_attachment().empty()) {
         const int64_t data_size = _cntl->request_attachment().size();
         if (!_sctx->ConsumeWindowSize(data_size)) {
             return butil::Status(ELIMIT, "remote_window_left is not enough, data_size=%" PRId64, data_size);
@@ -1572,6 +2002,7 @@ H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     HPacker& hpacker = ctx->hpacker();
     butil::IOBufAppender appender;
     HPackOptions options;
+    options.index_policy = HPACK_AUTO_INDEX_HEADER;
     options.encode_name = FLAGS_h2_hpack_encode_name;
     options.encode_value = FLAGS_h2_hpack_encode_value;
     for (size_t i = 0; i < _size; ++i) {
@@ -1588,7 +2019,25 @@ H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     butil::IOBuf frag;
     appender.move_to(frag);
     butil::IOBuf dummy_buf;
-    PackH2Message(out, frag, dummy_buf, _cntl->request_attachment(), _stream_id, ctx);
+    if (client_streaming) {
+        // Requests are written into the stream, keep the http2 stream open.
+        butil::IOBuf empty_data;
+        PackH2Message(out, frag, dummy_buf, empty_data, _stream_id, ctx, false);
+    } else if (ShouldScheduleData(_cntl->request_attachment().size())) {
+        butil::IOBuf empty_data;
+        PackH2Message(out, frag, dummy_buf, empty_data, _stream_id, ctx, false);
+        H2ScheduledData* d = new H2ScheduledData;
+        d->stream_id = _stream_id;
+        d->weight = H2_DEFAULT_WEIGHT;
+        d->data = _cntl->request_attachment();
+        ctx->ScheduleData(d);
+    } else {
+        PackH2Message(out, frag, dummy_buf, _cntl->request_attachment(),
+                      _stream_id, ctx, true);
+    }
+    if (stream_ptr != NULL) {
+        ((Stream*)stream_ptr->conn())->SetConnected();
+    }
     return butil::Status::OK();
 }
 
@@ -1636,19 +2085,25 @@ void H2UnsentRequest::Print(std::ostream& os) const {
 
 }
 
-H2UnsentResponse::H2UnsentResponse(Controller* c, int stream_id, bool is_grpc)
+H2UnsentResponse::H2UnsentResponse(Controller* c, int stream_id, bool is_grpc,
+                                   bool end_stream)
     : _size(0)
     , _stream_id(stream_id)
+    , _weight(H2_DEFAULT_WEIGHT)
     , _http_response(c->release_http_response())
-    , _is_grpc(is_grpc) {
-    _data.swap(c->response_attachment());
+    , _is_grpc(is_grpc)
+    , _end_stream(end_stream) {
+    if (end_stream) {
+        _data.swap(c->response_attachment());
+    }
     if (is_grpc) {
         _grpc_status = ErrorCodeToGrpcStatus(c->ErrorCode());
         PercentEncode(c->ErrorText(), &_grpc_message);
     }
 }
 
-H2UnsentResponse* H2UnsentResponse::New(Controller* c, int stream_id, bool is_grpc) {
+H2UnsentResponse* H2UnsentResponse::New(Controller* c, int stream_id,
+                                         bool is_grpc, bool end_stream) {
     const HttpHeader* const h = &c->http_response();
     const CommonStrings* const common = get_common_strings();
     const bool need_content_type = !h->content_type().empty();
@@ -1656,7 +2111,8 @@ H2UnsentResponse* H2UnsentResponse::New(Controller* c, int stream_id, bool is_gr
         + (size_t)need_content_type;
     const size_t memsize = offsetof(H2UnsentResponse, _list) +
         sizeof(HPacker::Header) * maxsize;
-    H2UnsentResponse* msg = new (malloc(memsize)) H2UnsentResponse(c, stream_id, is_grpc);
+    H2UnsentResponse* msg = new (malloc(memsize)) H2UnsentResponse(
+        c, stream_id, is_grpc, end_stream);
     // :status
     if (h->status_code() == 200) {
         msg->push(common->H2_STATUS, common->STATUS_200);
@@ -1713,6 +2169,7 @@ H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     HPacker& hpacker = ctx->hpacker();
     butil::IOBufAppender appender;
     HPackOptions options;
+    options.index_policy = HPACK_AUTO_INDEX_HEADER;
     options.encode_name = FLAGS_h2_hpack_encode_name;
     options.encode_value = FLAGS_h2_hpack_encode_value;
 
@@ -1729,19 +2186,40 @@ H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     butil::IOBuf frag;
     appender.move_to(frag);
 
-    butil::IOBuf trailer_frag;
-    if (_is_grpc) {
-        HPacker::Header status_header("grpc-status",
-                                      butil::string_printf("%d", _grpc_status));
-        hpacker.Encode(&appender, status_header, options);
+    std::vector<HPacker::Header> trailers;
+    if (_is_grpc && _end_stream) {
+        trailers.push_back(HPacker::Header(
+                "grpc-status", butil::string_printf("%d", _grpc_status)));
         if (!_grpc_message.empty()) {
-            HPacker::Header msg_header("grpc-message", _grpc_message);
-            hpacker.Encode(&appender, msg_header, options);
+            trailers.push_back(HPacker::Header("grpc-message", _grpc_message));
         }
-        appender.move_to(trailer_frag);
+    }
+    // Trailers of streaming gRPC calls end them in OnGrpcResponseHeaders()
+    // which must not be ahead of the DATA.
+    if (_end_stream && ShouldScheduleData(_data.size()) &&
+        !(_is_grpc && ctx->_ngrpc_streams.load(butil::memory_order_relaxed) != 0)) {
+        butil::IOBuf empty_trailers;
+        butil::IOBuf empty_data;
+        PackH2Message(out, frag, empty_trailers, empty_data, _stream_id, ctx, false);
+        H2ScheduledData* d = new H2ScheduledData;
+        d->stream_id = _stream_id;
+        d->weight = _weight;
+        d->data.swap(_data);
+        d->trailers.swap(trailers);
+        ctx->ScheduleData(d);
+        return butil::Status::OK();
     }
 
-    PackH2Message(out, frag, trailer_frag, _data, _stream_id, ctx);
+    butil::IOBuf trailer_frag;
+    for (size_t i = 0; i < trailers.size(); ++i) {
+        hpacker.Encode(&appender, trailers[i], options);
+    }
+    appender.move_to(trailer_frag);
+
+    PackH2Message(out, frag, trailer_frag, _data, _stream_id, ctx, _end_stream);
+    if (_is_grpc) {
+        ctx->OnGrpcResponseHeaders(out, _stream_id, _end_stream);
+    }
     return butil::Status::OK();
 }
 
@@ -1777,6 +2255,574 @@ void H2UnsentResponse::Print(std::ostream& os) const {
     os << butil::ToPrintable(_data, FLAGS_http_verbose_max_body_length);
 }
 
+// Frames of streaming gRPC calls are packed when this message is written so
+// that they're ordered with other messages of the socket: DATA are never
+// before the headers and trailers are encoded by HPACK sequentially.
+class H2UnsentGrpcMessages : public SocketMessage {
+public:
+    // Pack frames of all streaming gRPC calls if `stream_id' is 0.
+    explicit H2UnsentGrpcMessages(int stream_id) : _stream_id(stream_id) {}
+
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) override {
+        std::unique_ptr<H2UnsentGrpcMessages> destroy_self(this);
+        if (socket == NULL) {
+            return butil::Status::OK();
+        }
+        H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+        if (ctx != NULL) {
+            ctx->AppendGrpcStreams(out, _stream_id);
+        }
+        return butil::Status::OK();
+    }
+
+private:
+    int _stream_id;
+};
+
+// Packs DATA of streams scheduled by H2Context::ScheduleData(). At most one
+// such message is being written for a connection, and another one is written
+// after packing if DATA are left, so that messages written in the meantime
+// (e.g. small responses) are not blocked by the remaining DATA.
+class H2UnsentScheduledData : public SocketMessage {
+public:
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) override {
+        std::unique_ptr<H2UnsentScheduledData> destroy_self(this);
+        if (socket == NULL) {
+            return butil::Status::OK();
+        }
+        H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+        if (ctx != NULL) {
+            ctx->AppendScheduledData(out);
+        }
+        return butil::Status::OK();
+    }
+};
+
+static void WriteScheduledData(Socket* socket) {
+    SocketMessagePtr<H2UnsentScheduledData> msg(new H2UnsentScheduledData);
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    // Nothing to do on failure, the streams are ended along with the socket.
+    socket->Write(msg, &wopt);
+}
+
+// Cut `size' bytes from `data' into DATA frames of `stream_id'.
+static void CutDataFrames(butil::IOBuf* out, butil::IOBuf* data, size_t size,
+                          int stream_id, uint32_t max_frame_size,
+                          bool end_stream) {
+    char headbuf[FRAME_HEAD_SIZE];
+    while (size > 0) {
+        const size_t n = std::min(size, (size_t)max_frame_size);
+        size -= n;
+        SerializeFrameHead(headbuf, n, H2_FRAME_DATA,
+                           (size == 0 && end_stream) ? H2_FLAGS_END_STREAM : 0,
+                           stream_id);
+        out->append(headbuf, sizeof(headbuf));
+        data->cutn(out, n);
+    }
+}
+
+void H2Context::ScheduleData(H2ScheduledData* d) {
+    {
+        BAIDU_SCOPED_LOCK(_scheduled_data_mutex);
+        _scheduled_data.push_back(d);
+        if (_scheduled_data_flushing) {
+            return;
+        }
+        _scheduled_data_flushing = true;
+    }
+    WriteScheduledData(_socket);
+}
+
+// Streams are served in deficit round-robin: the front stream sends at most
+// -h2_data_quantum * weight / 16 bytes and moves to the back if there're
+// DATA left, until -h2_data_batch_size bytes are packed. DATA of many
+// streams are sent in one write while a large body can't starve others.
+// Flow-control windows were consumed when the streams were scheduled.
+void H2Context::AppendScheduledData(butil::IOBuf* out) {
+    int64_t quantum = FLAGS_h2_data_quantum;
+    if (quantum <= 0) {
+        // Interleaving was disabled after the streams were scheduled.
+        quantum = H2Settings::DEFAULT_MAX_FRAME_SIZE;
+    }
+    int64_t budget = FLAGS_h2_data_batch_size;
+    const uint32_t max_frame_size = remote_settings().max_frame_size;
+    std::unique_lock<butil::Mutex> mu(_scheduled_data_mutex);
+    while (!_scheduled_data.empty() && budget > 0) {
+        H2ScheduledData* d = _scheduled_data.front();
+        _scheduled_data.pop_front();
+        int64_t n = std::max(quantum * d->weight / H2_DEFAULT_WEIGHT, (int64_t)1);
+        n = std::min(n, budget);
+        n = std::min(n, (int64_t)d->data.size());
+        const bool last = (n == (int64_t)d->data.size());
+        CutDataFrames(out, &d->data, n, d->stream_id, max_frame_size,
+                      last && d->trailers.empty());
+        budget -= n;
+        if (!last) {
+            _scheduled_data.push_back(d);
+            continue;
+        }
+        if (!d->trailers.empty()) {
+            // Encoded here rather than in ScheduleData() since the header
+            // blocks must be decoded in the same order as being encoded.
+            butil::IOBufAppender appender;
+            HPackOptions options;
+            options.index_policy = HPACK_AUTO_INDEX_HEADER;
+            options.encode_name = FLAGS_h2_hpack_encode_name;
+            options.encode_value = FLAGS_h2_hpack_encode_value;
+            for (size_t i = 0; i < d->trailers.size(); ++i) {
+                _hpacker.Encode(&appender, d->trailers[i], options);
+            }
+            butil::IOBuf trailer_frag;
+            appender.move_to(trailer_frag);
+            butil::IOBuf empty;
+            PackH2Message(out, trailer_frag, empty, empty, d->stream_id,
+                          this, true);
+        }
+        delete d;
+    }
+    if (_scheduled_data.empty()) {
+        _scheduled_data_flushing = false;
+        return;
+    }
+    mu.unlock();
+    WriteScheduledData(_socket);
+}
+
+void H2Context::DropScheduledData(int stream_id) {
+    std::unique_lock<butil::Mutex> mu(_scheduled_data_mutex);
+    for (std::deque<H2ScheduledData*>::iterator it = _scheduled_data.begin();
+         it != _scheduled_data.end(); ++it) {
+        if ((*it)->stream_id == stream_id) {
+            H2ScheduledData* d = *it;
+            _scheduled_data.erase(it);
+            mu.unlock();
+            delete d;
+            return;
+        }
+    }
+}
+
+static void AppendResetStream(butil::IOBuf* out, int stream_id, H2Error h2_error) {
+    char rstbuf[FRAME_HEAD_SIZE + 4];
+    SerializeFrameHead(rstbuf, 4, H2_FRAME_RST_STREAM, 0, stream_id);
+    SaveUint32(rstbuf + FRAME_HEAD_SIZE, h2_error);
+    out->append(rstbuf, sizeof(rstbuf));
+}
+
+void H2Context::CreateGrpcStreamState(H2StreamContext* sctx,
+                                      bool client_streaming,
+                                      bool server_streaming) {
+    H2GrpcStreamState* g = new H2GrpcStreamState;
+    g->client_streaming = client_streaming;
+    g->server_streaming = server_streaming;
+    g->headers_sent = is_client_side();
+    sctx->_grpc.reset(g);
+    sctx->_is_grpc_stream = true;
+    _ngrpc_streams.fetch_add(1, butil::memory_order_relaxed);
+}
+
+void H2Context::FlushGrpcStreams(int stream_id) {
+    if (_ngrpc_streams.load(butil::memory_order_relaxed) == 0) {
+        return;
+    }
+    SocketMessagePtr<H2UnsentGrpcMessages> msg(new H2UnsentGrpcMessages(stream_id));
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    // Nothing to do on failure, the calls are ended along with the socket.
+    _socket->Write(msg, &wopt);
+}
+
+void H2Context::AppendGrpcStreams(butil::IOBuf* out, int stream_id) {
+    GrpcStreamEvents events;
+    {
+        std::unique_lock<butil::Mutex> mu(_stream_mutex);
+        if (stream_id != 0) {
+            H2StreamContext** psctx = _pending_streams.seek(stream_id);
+            if (psctx != NULL && (*psctx)->_grpc != NULL) {
+                FlushGrpcStreamLocked(out, *psctx, &events);
+            }
+        } else {
+            for (StreamMap::const_iterator it = _pending_streams.begin();
+                 it != _pending_streams.end(); ++it) {
+                if (it->second->_grpc != NULL) {
+                    FlushGrpcStreamLocked(out, it->second, &events);
+                }
+            }
+        }
+    }
+    out->append(butil::IOBuf::Movable(events.frames));
+    HandleGrpcStreamEvents(&events);
+}
+
+// Called when headers of the response are packed at server-side. Messages
+// written before are sent from now on, or dropped if the call is ended by
+// the response.
+void H2Context::OnGrpcResponseHeaders(butil::IOBuf* out, int stream_id,
+                                      bool end_stream) {
+    if (_ngrpc_streams.load(butil::memory_order_relaxed) == 0) {
+        return;
+    }
+    GrpcStreamEvents events;
+    {
+        std::unique_lock<butil::Mutex> mu(_stream_mutex);
+        H2StreamContext** psctx = _pending_streams.seek(stream_id);
+        if (psctx == NULL || (*psctx)->_grpc == NULL) {
+            return;
+        }
+        H2GrpcStreamState* g = (*psctx)->_grpc.get();
+        g->headers_sent = true;
+        if (!end_stream) {
+            FlushGrpcStreamLocked(out, *psctx, &events);
+        } else if (!g->local_ended) {
+            g->local_ended = true;
+            g->unsent_data.clear();
+            if (!g->remote_ended) {
+                // Tell the client to stop sending requests.
+                AppendResetStream(&events.frames, stream_id, H2_NO_ERROR);
+            }
+            events.finished.push_back(stream_id);
+        }
+    }
+    out->append(butil::IOBuf::Movable(events.frames));
+    HandleGrpcStreamEvents(&events);
+}
+
+// Cut unsent messages into DATA frames as long as flow-control windows
+// allow, and end the http2 stream after all messages are sent if the
+// bound stream was closed.
+void H2Context::FlushGrpcStreamLocked(butil::IOBuf* out, H2StreamContext* sctx,
+                                      GrpcStreamEvents* events) {
+    H2GrpcStreamState* g = sctx->_grpc.get();
+    if (g->local_ended || !g->headers_sent) {
+        return;
+    }
+    const int stream_id = sctx->stream_id();
+    char headbuf[FRAME_HEAD_SIZE];
+    int64_t sent = 0;
+    while (!g->unsent_data.empty()) {
+        int64_t n = std::min((int64_t)g->unsent_data.size(),
+                             (int64_t)remote_settings().max_frame_size);
+        n = std::min(n, sctx->_remote_window_left.load(butil::memory_order_relaxed));
+        n = std::min(n, _remote_window_left.load(butil::memory_order_relaxed));
+        // Connection-level window may be consumed by other streams
+        // concurrently, wait for next WINDOW_UPDATE if it fails.
+        if (n <= 0 || !MinusWindowSize(&_remote_window_left, n)) {
+            break;
+        }
+        sctx->_remote_window_left.fetch_sub(n, butil::memory_order_relaxed);
+        SerializeFrameHead(headbuf, n, H2_FRAME_DATA, 0, stream_id);
+        out->append(headbuf, sizeof(headbuf));
+        g->unsent_data.cutn(out, n);
+        sent += n;
+    }
+    if (sent > 0) {
+        g->sent_size += sent;
+        if (g->stream != INVALID_STREAM_ID) {
+            events->sent.push_back(std::make_pair(g->stream, g->sent_size));
+        }
+    }
+    if (!g->local_end_pending || !g->unsent_data.empty()) {
+        return;
+    }
+    g->local_ended = true;
+    if (is_client_side()) {
+        // Half-close the call, the http2 stream is removed after the server
+        // ends it.
+        SerializeFrameHead(headbuf, 0, H2_FRAME_DATA, H2_FLAGS_END_STREAM,
+                           stream_id);
+        out->append(headbuf, sizeof(headbuf));
+        return;
+    }
+    butil::IOBufAppender appender;
+    HPackOptions options;
+    options.index_policy = HPACK_AUTO_INDEX_HEADER;
+    options.encode_name = FLAGS_h2_hpack_encode_name;
+    options.encode_value = FLAGS_h2_hpack_encode_value;
+    HPacker::Header status_header("grpc-status",
+                                  butil::string_printf("%d", GRPC_OK));
+    _hpacker.Encode(&appender, status_header, options);
+    butil::IOBuf trailer_frag;
+    appender.move_to(trailer_frag);
+    SerializeFrameHead(headbuf, trailer_frag.size(), H2_FRAME_HEADERS,
+                       H2_FLAGS_END_STREAM | H2_FLAGS_END_HEADERS, stream_id);
+    out->append(headbuf, sizeof(headbuf));
+    out->append(butil::IOBuf::Movable(trailer_frag));
+    if (!g->remote_ended) {
+        AppendResetStream(&events->frames, stream_id, H2_NO_ERROR);
+    }
+    events->finished.push_back(stream_id);
+}
+
+// Parse received data into messages and deliver them to the bound stream.
+// Stream-level windows are returned after messages are consumed by the
+// stream. As a result, a message larger than the window would never be
+// completed, windows of such partial messages are returned in advance and
+// deducted from the consumed size later.
+int H2Context::DeliverGrpcMessagesLocked(H2StreamContext* sctx,
+                                         GrpcStreamEvents* events) {
+    H2GrpcStreamState* g = sctx->_grpc.get();
+    if (!g->deliver_messages) {
+        return 0;
+    }
+    if (g->stream_closed) {
+        DropGrpcMessagesLocked(sctx, events);
+        return 0;
+    }
+    if (g->stream == INVALID_STREAM_ID) {
+        // Not accepted yet.
+        return 0;
+    }
+    SocketUniquePtr ptr;
+    if (Socket::Address(g->stream, &ptr) != 0) {
+        g->stream = INVALID_STREAM_ID;
+        g->stream_closed = true;
+        DropGrpcMessagesLocked(sctx, events);
+        return 0;
+    }
+    Stream* s = (Stream*)ptr->conn();
+    events->streams.push_back(std::move(ptr));
+    const int64_t window_size = local_settings().stream_window_size;
+    char prefix[GRPC_MESSAGE_PREFIX_SIZE];
+    while (g->received_data.copy_to(prefix, sizeof(prefix)) == sizeof(prefix)) {
+        if (prefix[0] != 0) {
+            LOG(ERROR) << "Compressed messages of streaming gRPC calls"
+                " are not supported, stream_id=" << sctx->stream_id();
+            return -1;
+        }
+        const size_t len = ((uint32_t)(uint8_t)prefix[1] << 24) |
+            ((uint32_t)(uint8_t)prefix[2] << 16) |
+            ((uint32_t)(uint8_t)prefix[3] << 8) | (uint32_t)(uint8_t)prefix[4];
+        if (g->received_data.size() < sizeof(prefix) + len) {
+            if ((int64_t)(sizeof(prefix) + len) > window_size / 2) {
+                const int64_t n =
+                    g->received_data.size() - g->partial_released_size;
+                g->partial_released_size += n;
+                g->released_size += n;
+                ReturnGrpcWindowLocked(sctx, n, events);
+            }
+            break;
+        }
+        g->received_data.pop_front(sizeof(prefix));
+        butil::IOBuf* msg = new butil::IOBuf;
+        g->received_data.cutn(msg, len);
+        g->partial_released_size = 0;
+        if (s->OnReceivedGrpcMessage(msg) != 0) {
+            g->stream = INVALID_STREAM_ID;
+            g->stream_closed = true;
+            DropGrpcMessagesLocked(sctx, events);
+            return 0;
+        }
+    }
+    if (g->remote_ended) {
+        if (!g->received_data.empty()) {
+            LOG(ERROR) << "Incomplete gRPC message at the end of stream_id="
+                       << sctx->stream_id();
+            return -1;
+        }
+        if (is_server_side() && !g->half_close_delivered) {
+            g->half_close_delivered = true;
+            s->OnRemoteHalfClosed();
+        }
+    }
+    return 0;
+}
+
+void H2Context::DropGrpcMessagesLocked(H2StreamContext* sctx,
+                                       GrpcStreamEvents* events) {
+    H2GrpcStreamState* g = sctx->_grpc.get();
+    const int64_t n = g->received_data.size() - g->partial_released_size;
+    g->received_data.clear();
+    g->partial_released_size = 0;
+    if (n > 0) {
+        ReturnGrpcWindowLocked(sctx, n, events);
+    }
+}
+
+void H2Context::ReturnGrpcWindowLocked(H2StreamContext* sctx, int64_t size,
+                                       GrpcStreamEvents* events) {
+    H2GrpcStreamState* g = sctx->_grpc.get();
+    g->unconsumed_size -= size;
+    g->consumed_size += size;
+    if (g->remote_ended) {
+        // No more DATA, sending back the WINDOW_UPDATE is pointless.
+        g->consumed_size = 0;
+        return;
+    }
+    if (g->consumed_size >= local_settings().stream_window_size / 2) {
+        char winbuf[FRAME_HEAD_SIZE + 4];
+        SerializeFrameHead(winbuf, 4, H2_FRAME_WINDOW_UPDATE, 0, sctx->stream_id());
+        SaveUint32(winbuf + FRAME_HEAD_SIZE, g->consumed_size);
+        events->frames.append(winbuf, sizeof(winbuf));
+        g->consumed_size = 0;
+    }
+}
+
+void H2Context::HandleGrpcStreamEvents(GrpcStreamEvents* events) {
+    if (!events->frames.empty()) {
+        Socket::WriteOptions wopt;
+        wopt.ignore_eovercrowded = true;
+        if (_socket->Write(&events->frames, &wopt) != 0) {
+            LOG(WARNING) << "Fail to write frames of streaming gRPC calls to "
+                         << *_socket;
+        }
+    }
+    for (size_t i = 0; i < events->sent.size(); ++i) {
+        Stream::OnGrpcMessagesSent(events->sent[i].first, events->sent[i].second);
+    }
+    for (size_t i = 0; i < events->finished.size(); ++i) {
+        AddAbandonedStream(events->finished[i]);
+    }
+    events->streams.clear();
+}
+
+int H2Context::BindGrpcStream(int stream_id, StreamId stream) {
+    GrpcStreamEvents events;
+    int rc = 0;
+    {
+        std::unique_lock<butil::Mutex> mu(_stream_mutex);
+        H2StreamContext** psctx = _pending_streams.seek(stream_id);
+        if (psctx == NULL || (*psctx)->_grpc == NULL) {
+            return -1;
+        }
+        H2StreamContext* sctx = *psctx;
+        H2GrpcStreamState* g = sctx->_grpc.get();
+        if (g->stream != INVALID_STREAM_ID || g->stream_closed) {
+            return -1;
+        }
+        g->stream = stream;
+        rc = DeliverGrpcMessagesLocked(sctx, &events);
+        if (rc != 0) {
+            g->stream = INVALID_STREAM_ID;
+            g->stream_closed = true;
+            DropGrpcMessagesLocked(sctx, &events);
+            AppendResetStream(&events.frames, stream_id, H2_PROTOCOL_ERROR);
+            events.finished.push_back(stream_id);
+        }
+    }
+    HandleGrpcStreamEvents(&events);
+    return rc;
+}
+
+int H2Context::WriteGrpcMessages(int stream_id, StreamId stream,
+                                 butil::IOBuf* const messages[], size_t size) {
+    {
+        std::unique_lock<butil::Mutex> mu(_stream_mutex);
+        H2StreamContext** psctx = _pending_streams.seek(stream_id);
+        H2GrpcStreamState* g = (psctx ? (*psctx)->_grpc.get() : NULL);
+        if (g == NULL || g->stream != stream ||
+            g->local_end_pending || g->local_ended) {
+            errno = EINVAL;
+            return -1;
+        }
+        char prefix[GRPC_MESSAGE_PREFIX_SIZE];
+        prefix[0] = 0;  // not compressed
+        for (size_t i = 0; i < size; ++i) {
+            SaveUint32(prefix + 1, messages[i]->size());
+            g->unsent_data.append(prefix, sizeof(prefix));
+            g->unsent_data.append(butil::IOBuf::Movable(*messages[i]));
+        }
+    }
+    FlushGrpcStreams(stream_id);
+    return 0;
+}
+
+void H2Context::OnGrpcMessagesConsumed(int stream_id, StreamId stream,
+                                       int64_t size) {
+    GrpcStreamEvents events;
+    {
+        std::unique_lock<butil::Mutex> mu(_stream_mutex);
+        H2StreamContext** psctx = _pending_streams.seek(stream_id);
+        H2GrpcStreamState* g = (psctx ? (*psctx)->_grpc.get() : NULL);
+        if (g == NULL || g->stream != stream) {
+            return;
+        }
+        const int64_t released = std::min(g->released_size, size);
+        g->released_size -= released;
+        if (size > released) {
+            ReturnGrpcWindowLocked(*psctx, size - released, &events);
+        }
+    }
+    HandleGrpcStreamEvents(&events);
+}
+
+void H2Context::CloseGrpcStream(int stream_id, StreamId stream) {
+    GrpcStreamEvents events;
+    bool flush = false;
+    {
+        std::unique_lock<butil::Mutex> mu(_stream_mutex);
+        H2StreamContext** psctx = _pending_streams.seek(stream_id);
+        H2GrpcStreamState* g = (psctx ? (*psctx)->_grpc.get() : NULL);
+        if (g == NULL || g->stream != stream) {
+            return;
+        }
+        g->stream = INVALID_STREAM_ID;
+        g->stream_closed = true;
+        DropGrpcMessagesLocked(*psctx, &events);
+        if (!g->local_ended) {
+            g->local_end_pending = true;
+            flush = true;
+        } else if (is_client_side()) {
+            // The request was ended, cancel the call.
+            AppendResetStream(&events.frames, stream_id, H2_CANCEL);
+            events.finished.push_back(stream_id);
+        }
+    }
+    HandleGrpcStreamEvents(&events);
+    if (flush) {
+        FlushGrpcStreams(stream_id);
+    }
+}
+
+int BindGrpcStream(Socket* socket, int h2_stream_id, StreamId stream) {
+    H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+    if (ctx == NULL || socket->Failed()) {
+        return -1;
+    }
+    SocketUniquePtr ptr;
+    if (Socket::Address(stream, &ptr) != 0) {
+        return -1;
+    }
+    Stream* s = (Stream*)ptr->conn();
+    if (s->SetH2Stream(socket, h2_stream_id) != 0) {
+        return -1;
+    }
+    if (ctx->BindGrpcStream(h2_stream_id, stream) != 0) {
+        return -1;
+    }
+    s->SetConnected();
+    return 0;
+}
+
+int WriteGrpcMessages(Socket* socket, int h2_stream_id, StreamId stream,
+                      butil::IOBuf* const messages[], size_t size) {
+    H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+    if (ctx == NULL || socket->Failed()) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ctx->WriteGrpcMessages(h2_stream_id, stream, messages, size);
+}
+
+void OnGrpcMessagesConsumed(Socket* socket, int h2_stream_id, StreamId stream,
+                            int64_t size) {
+    H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+    if (ctx == NULL || socket->Failed()) {
+        return;
+    }
+    ctx->OnGrpcMessagesConsumed(h2_stream_id, stream, size);
+}
+
+void CloseGrpcStream(Socket* socket, int h2_stream_id, StreamId stream) {
+    H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+    if (ctx == NULL || socket->Failed()) {
+        return;
+    }
+    ctx->CloseGrpcStream(h2_stream_id, stream);
+}
+
 void PackH2Request(butil::IOBuf*,
                    SocketMessage** user_message,
                    uint64_t correlation_id,
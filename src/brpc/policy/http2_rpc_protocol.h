@@ -19,6 +19,8 @@
 #ifndef BAIDU_RPC_POLICY_HTTP2_RPC_PROTOCOL_H
 #define BAIDU_RPC_POLICY_HTTP2_RPC_PROTOCOL_H
 
+#include <deque>
+#include <vector>
 #include "brpc/policy/http_rpc_protocol.h"   // HttpContext
 #include "brpc/input_message_base.h"
 #include "brpc/protocol.h"
@@ -195,12 +197,20 @@ private:
 
 class H2UnsentResponse : public SocketMessage {
 public:
-    static H2UnsentResponse* New(Controller* c, int stream_id, bool is_grpc);
+    // end_stream=false: send headers only and keep the stream open, used by
+    // streaming gRPC calls whose messages are written afterwards.
+    static H2UnsentResponse* New(Controller* c, int stream_id, bool is_grpc,
+                                 bool end_stream = true);
     void Destroy();
     void Print(std::ostream& os) const;
     // @SocketMessage
     butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket*) override;
     size_t EstimatedByteSize() override;
+
+    // Weight(1-256) of the stream in the priority of the request, which
+    // decides the share of DATA of this response when bodies of multiple
+    // streams are interleaved.
+    void set_weight(int weight) { _weight = weight; }
     
 private:
     std::string& push(const std::string& name)
@@ -209,7 +219,7 @@ private:
     void push(const std::string& name, const std::string& value)
     { new (&_list[_size++]) HPacker::Header(name, value); }
 
-    H2UnsentResponse(Controller* c, int stream_id, bool is_grpc);
+    H2UnsentResponse(Controller* c, int stream_id, bool is_grpc, bool end_stream);
     ~H2UnsentResponse() {}
     H2UnsentResponse(const H2UnsentResponse&);
     void operator=(const H2UnsentResponse&);
@@ -217,14 +227,79 @@ private:
 private:
     uint32_t _size;
     uint32_t _stream_id;
+    int _weight;
     std::unique_ptr<HttpHeader> _http_response;
     butil::IOBuf _data;
     bool _is_grpc;
+    bool _end_stream;
     GrpcStatus _grpc_status;
     std::string _grpc_message;
     HPacker::Header _list[0];
 };
 
+// Size of the compressed-flag and length before each gRPC message.
+const size_t GRPC_MESSAGE_PREFIX_SIZE = 5;
+
+// States of a http2 stream which is a client-streaming, server-streaming or
+// bidi-streaming gRPC call, messages of the call are delivered to and sent
+// from a brpc::Stream. Fields below `server_streaming' are accessed with
+// H2Context::_stream_mutex locked.
+struct H2GrpcStreamState {
+    H2GrpcStreamState()
+        : client_streaming(false)
+        , server_streaming(false)
+        , deliver_messages(false)
+        , headers_emitted(false)
+        , headers_sent(false)
+        , stream(INVALID_STREAM_ID)
+        , stream_closed(false)
+        , remote_ended(false)
+        , half_close_delivered(false)
+        , local_end_pending(false)
+        , local_ended(false)
+        , sent_size(0)
+        , unconsumed_size(0)
+        , consumed_size(0)
+        , released_size(0)
+        , partial_released_size(0) {}
+
+    bool client_streaming;
+    bool server_streaming;
+    // Only accessed by the parsing thread. DATA are parsed as messages of the
+    // stream rather than the body of the http message.
+    bool deliver_messages;
+    // Only accessed by the parsing thread. A message with the headers was
+    // emitted to start the call.
+    bool headers_emitted;
+
+    // Headers of the response were sent, messages written before are kept in
+    // unsent_data. Always true at client-side.
+    bool headers_sent;
+    // The bound brpc::Stream, INVALID_STREAM_ID before binding.
+    StreamId stream;
+    // The bound stream was closed, received messages are dropped.
+    bool stream_closed;
+    bool remote_ended;
+    bool half_close_delivered;
+    // END_STREAM or trailers are sent after unsent_data.
+    bool local_end_pending;
+    bool local_ended;
+    // Framed messages waiting for flow-control windows.
+    butil::IOBuf unsent_data;
+    // Bytes of framed messages sent in total.
+    int64_t sent_size;
+    // Received bytes which are not parsed into messages yet.
+    butil::IOBuf received_data;
+    // Received bytes whose stream-level window is not returned.
+    int64_t unconsumed_size;
+    // Consumed bytes waiting to be returned in a WINDOW_UPDATE.
+    int64_t consumed_size;
+    // Windows returned before the bytes were consumed, see comments in
+    // H2Context::DeliverGrpcMessagesLocked().
+    int64_t released_size;
+    int64_t partial_released_size;
+};
+
 // Used in http_rpc_protocol.cpp
 class H2StreamContext : public HttpContext {
 public:
@@ -244,6 +319,13 @@ public:
                           uint32_t frag_size, uint8_t pad_length);
     H2ParseResult OnContinuation(butil::IOBufBytesIterator&, const H2FrameHead&);
     H2ParseResult OnResetStream(H2Error h2_error, const H2FrameHead&);
+    H2ParseResult OnEndHeaders(bool end_stream);
+    H2ParseResult OnGrpcData(butil::IOBuf& data, const H2FrameHead&,
+                             uint32_t frag_size);
+    H2ParseResult OnGrpcEndStream();
+    // Create a message with headers (and body) of this stream which is kept
+    // registered to carry messages of the streaming gRPC call.
+    H2StreamContext* NewGrpcStreamMessage();
     
     uint64_t correlation_id() const { return _correlation_id; }
     void set_correlation_id(uint64_t cid) { _correlation_id = cid; }
@@ -251,6 +333,10 @@ public:
     size_t parsed_length() const { return this->_parsed_length; }
     int stream_id() const { return _stream_id; }
 
+    // True if this message belongs to a streaming gRPC call, whose messages
+    // are carried by a brpc::Stream instead of the body.
+    bool is_grpc_stream() const { return _is_grpc_stream; }
+
     int64_t ReleaseDeferredWindowUpdate() {
         if (_deferred_window_update.load(butil::memory_order_relaxed) == 0) {
             return 0;
@@ -260,26 +346,61 @@ public:
 
     bool ConsumeWindowSize(int64_t size);
 
+    // Weight(1-256) in the priority of HEADERS, 16 if absent.
+    int weight() const { return _weight; }
+
 #if defined(BRPC_H2_STREAM_STATE)
     H2StreamState state() const { return _state; }
     void SetState(H2StreamState state);
 #endif
 
 friend class H2Context;
+friend class H2UnsentRequest;
     H2Context* _conn_ctx;
 #if defined(BRPC_H2_STREAM_STATE)
     H2StreamState _state;
 #endif
     int _stream_id;
     bool _stream_ended;
+    int _weight;
     butil::atomic<int64_t> _remote_window_left;
     butil::atomic<int64_t> _deferred_window_update;
+    // Window of remote side in view of this side, and when remote side was
+    // blocked by the window. Only accessed by the parsing thread.
+    int64_t _local_window_left;
+    int64_t _window_stall_start_us;
     uint64_t _correlation_id;
     butil::IOBuf _remaining_header_fragment;
+    bool _is_grpc_stream;
+    std::unique_ptr<H2GrpcStreamState> _grpc;
 };
 
 StreamCreator* get_h2_global_stream_creator();
 
+// Following functions carry messages of brpc::Stream `stream' over the http2
+// stream `h2_stream_id' of `socket' which is a streaming gRPC call. They do
+// nothing or fail if `stream' is not bound to the http2 stream(anymore).
+
+// Bind `stream' to the http2 stream at server-side, messages received before
+// are delivered to `stream' at once.
+// Returns 0 on success, -1 otherwise.
+int BindGrpcStream(Socket* socket, int h2_stream_id, StreamId stream);
+
+// Frame `messages' as gRPC messages, which are sent as soon as flow-control
+// windows allow. Data of `messages' are cut off.
+// Returns 0 on success, -1 otherwise.
+int WriteGrpcMessages(Socket* socket, int h2_stream_id, StreamId stream,
+                      butil::IOBuf* const messages[], size_t size);
+
+// Return stream-level windows of `size' bytes of consumed messages.
+void OnGrpcMessagesConsumed(Socket* socket, int h2_stream_id, StreamId stream,
+                            int64_t size);
+
+// Called when the bound stream is closed. Server ends the call with trailers
+// after unsent messages. Client half-closes the call if the request is not
+// ended yet, otherwise cancels it.
+void CloseGrpcStream(Socket* socket, int h2_stream_id, StreamId stream);
+
 ParseResult ParseH2Message(butil::IOBuf *source, Socket *socket,
                              bool read_eof, const void *arg);
 void PackH2Request(butil::IOBuf* buf,
@@ -290,6 +411,22 @@ void PackH2Request(butil::IOBuf* buf,
                    const butil::IOBuf& request,
                    const Authenticator* auth);
 
+struct GrpcStreamEvents;
+
+// Default weight of http2 streams, see RFC 7540 5.3.5
+const int H2_DEFAULT_WEIGHT = 16;
+
+// DATA of a http2 stream which is sent in rounds along with DATA of other
+// streams, see H2Context::AppendScheduledData().
+struct H2ScheduledData {
+    int stream_id;
+    int weight;
+    butil::IOBuf data;
+    // Sent after the last DATA to end the stream. Encoded when they're sent
+    // since HPACK must encode header blocks in the order they're sent.
+    std::vector<HPacker::Header> trailers;
+};
+
 class H2GlobalStreamCreator : public StreamCreator {
 protected:
     StreamUserData* OnCreatingStream(SocketUniquePtr* inout, Controller* cntl) override;
@@ -348,13 +485,27 @@ public:
 
     void Describe(std::ostream& os, const DescribeOptions&) const override;
 
+    // Send data of `d' after DATA of other scheduled streams in weighted
+    // round-robin. Should be called inside SocketMessage::AppendAndDestroySelf()
+    // after headers of the stream are packed.
+    void ScheduleData(H2ScheduledData* d);
+
     void DeferWindowUpdate(int64_t);
     int64_t ReleaseDeferredWindowUpdate();
 
+    // See comments of the free functions with same names.
+    int BindGrpcStream(int stream_id, StreamId stream);
+    int WriteGrpcMessages(int stream_id, StreamId stream,
+                          butil::IOBuf* const messages[], size_t size);
+    void OnGrpcMessagesConsumed(int stream_id, StreamId stream, int64_t size);
+    void CloseGrpcStream(int stream_id, StreamId stream);
+
 private:
 friend class H2StreamContext;
 friend class H2UnsentRequest;
 friend class H2UnsentResponse;
+friend class H2UnsentGrpcMessages;
+friend class H2UnsentScheduledData;
 friend void InitFrameHandlers();
 
     ParseResult ConsumeFrameHead(butil::IOBufBytesIterator&, H2FrameHead*);
@@ -376,9 +527,35 @@ friend void InitFrameHandlers();
     H2StreamContext* FindStream(int stream_id);
     void ClearAbandonedStreamsImpl();
 
+    // Methods of streaming gRPC calls, ending with Locked must be called with
+    // _stream_mutex locked. See comments in .cpp
+    void CreateGrpcStreamState(H2StreamContext* sctx, bool client_streaming,
+                               bool server_streaming);
+    void FlushGrpcStreams(int stream_id);
+    void AppendGrpcStreams(butil::IOBuf* out, int stream_id);
+    void OnGrpcResponseHeaders(butil::IOBuf* out, int stream_id, bool end_stream);
+    void FlushGrpcStreamLocked(butil::IOBuf* out, H2StreamContext* sctx,
+                               GrpcStreamEvents* events);
+    int DeliverGrpcMessagesLocked(H2StreamContext* sctx, GrpcStreamEvents* events);
+    void DropGrpcMessagesLocked(H2StreamContext* sctx, GrpcStreamEvents* events);
+    void ReturnGrpcWindowLocked(H2StreamContext* sctx, int64_t size,
+                                GrpcStreamEvents* events);
+    void HandleGrpcStreamEvents(GrpcStreamEvents* events);
+
+    // Pack DATA of scheduled streams into `out', see comments in .cpp
+    void AppendScheduledData(butil::IOBuf* out);
+    void DropScheduledData(int stream_id);
+
+    // Estimate bandwidth-delay product of the connection with PING and grow
+    // local windows accordingly. See comments in .cpp
+    void SampleBdp(uint32_t data_size);
+    void OnBdpPingAck();
+    void GrowLocalWindows(int64_t target_window_size);
+
     // True if the connection is established by client, otherwise it's
     // accepted by server.
     Socket* _socket;
+    const Server* _server;
     butil::atomic<int64_t> _remote_window_left;
     H2ConnectionState _conn_state;
     int _last_received_stream_id;
@@ -395,6 +572,22 @@ friend void InitFrameHandlers();
     mutable butil::Mutex _stream_mutex;
     StreamMap _pending_streams;
     butil::atomic<int64_t> _deferred_window_update;
+    // Size of the connection-level window that remote side is given.
+    int64_t _local_conn_window_size;
+    // Fields of BDP estimation, only accessed by the parsing thread.
+    bool _bdp_ping_inflight;
+    uint64_t _bdp_ping_data;
+    int64_t _bdp_ping_start_us;
+    int64_t _bdp_next_ping_us;
+    int64_t _bdp_ping_interval_us;
+    int64_t _bdp_bytes;
+    // Number of registered streams of streaming gRPC calls.
+    butil::atomic<int> _ngrpc_streams;
+    // Streams whose DATA are sent in rounds, the front one is sent next.
+    mutable butil::Mutex _scheduled_data_mutex;
+    std::deque<H2ScheduledData*> _scheduled_data;
+    // A message to pack scheduled DATA is being written.
+    bool _scheduled_data_flushing;
 };
 
 inline int H2Context::AllocateClientStreamId() {
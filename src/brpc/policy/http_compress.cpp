@@ -0,0 +1,432 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdlib.h>                               // strtod
+#include <string.h>                               // memcpy
+#include <algorithm>                              // std::min
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/containers/mru_cache.h"           // HashingMRUCache
+#include "butil/logging.h"
+#include "butil/string_splitter.h"
+#include "butil/strings/string_util.h"            // TrimWhitespaceASCII
+#include "butil/synchronization/lock.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "bvar/bvar.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/gzip_compress.h"
+#include "brpc/policy/brotli_compress.h"
+#ifdef BRPC_WITH_ZSTD
+#include "brpc/policy/zstd_compress.h"
+#endif
+#include "brpc/policy/http_compress.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Codings in -http_response_encodings packed into 4 bits each, the first
+// one in the lowest bits. Updated by the validator of the flag since
+// string flags can't be read safely while being modified.
+static butil::atomic<uint32_t> g_response_encodings(
+    HTTP_CONTENT_ENCODING_ZSTD |
+    (HTTP_CONTENT_ENCODING_BROTLI << 4) |
+    (HTTP_CONTENT_ENCODING_GZIP << 8));
+
+DEFINE_string(http_response_encodings, "zstd,br,gzip",
+              "Comma-separated content codings that http responses with "
+              "compress_type set are compressed with, in preferred order. "
+              "Codings not accepted by clients or not built into brpc are "
+              "skipped");
+
+static bool validate_http_response_encodings(const char*,
+                                             const std::string& value) {
+    uint32_t packed = 0;
+    int n = 0;
+    for (butil::StringSplitter sp(value.c_str(), ','); sp; ++sp) {
+        butil::StringPiece name(sp.field(), sp.length());
+        butil::TrimWhitespaceASCII(name, butil::TRIM_ALL, &name);
+        if (name.empty()) {
+            continue;
+        }
+        const HttpContentEncoding e = ParseHttpContentEncoding(name);
+        if (e == HTTP_CONTENT_ENCODING_IDENTITY ||
+            e == HTTP_CONTENT_ENCODING_UNKNOWN) {
+            LOG(ERROR) << "Unsupported coding=`" << name
+                       << "' in -http_response_encodings";
+            return false;
+        }
+        if (n == 7) {
+            LOG(ERROR) << "Too many codings in -http_response_encodings";
+            return false;
+        }
+        packed |= ((uint32_t)e << (4 * n++));
+    }
+    g_response_encodings.store(packed, butil::memory_order_relaxed);
+    return true;
+}
+static const bool ALLOW_UNUSED register_http_response_encodings_dummy =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_http_response_encodings,
+                                       validate_http_response_encodings);
+
+static bool validate_http_gzip_compression_level(const char*, int32_t val) {
+    return val >= -1 && val <= 9;
+}
+DEFINE_int32(http_gzip_compression_level, -1,
+             "Level of gzip-ed http bodies, from 1(fastest) to 9(smallest), "
+             "-1 means the default of zlib(6)");
+BRPC_VALIDATE_GFLAG(http_gzip_compression_level,
+                    validate_http_gzip_compression_level);
+
+DEFINE_int32(http_zstd_compression_level, 3,
+             "Level of zstd-ed http bodies, higher levels compress better "
+             "but slower, negative levels are even faster than 1");
+BRPC_VALIDATE_GFLAG(http_zstd_compression_level, PassValidate);
+
+static bool validate_http_brotli_quality(const char*, int32_t val) {
+    return val >= 0 && val <= 11;
+}
+DEFINE_int32(http_brotli_quality, 5,
+             "Quality of brotli-ed http bodies, from 0(fastest) to 11"
+             "(smallest). Levels above 9 are too slow for dynamic content");
+BRPC_VALIDATE_GFLAG(http_brotli_quality, validate_http_brotli_quality);
+
+DEFINE_int64(http_compressed_body_cache_max_bytes, 32 * 1024 * 1024,
+             "Max bytes of compressed http bodies cached for builtin "
+             "services and responses marked by "
+             "Controller::set_cache_compressed_response(), 0 disables "
+             "the cache");
+BRPC_VALIDATE_GFLAG(http_compressed_body_cache_max_bytes, NonNegativeInteger);
+
+static bool NameIs(const butil::StringPiece& name, const char* lower) {
+    return LowerCaseEqualsASCII(name.data(), name.data() + name.size(),
+                                lower);
+}
+
+HttpContentEncoding ParseHttpContentEncoding(const butil::StringPiece& name) {
+    if (name.empty() || NameIs(name, "identity")) {
+        return HTTP_CONTENT_ENCODING_IDENTITY;
+    } else if (NameIs(name, "gzip") || NameIs(name, "x-gzip")) {
+        return HTTP_CONTENT_ENCODING_GZIP;
+    } else if (NameIs(name, "zstd")) {
+        return HTTP_CONTENT_ENCODING_ZSTD;
+    } else if (NameIs(name, "br")) {
+        return HTTP_CONTENT_ENCODING_BROTLI;
+    }
+    return HTTP_CONTENT_ENCODING_UNKNOWN;
+}
+
+const char* HttpContentEncodingToCStr(HttpContentEncoding e) {
+    switch (e) {
+    case HTTP_CONTENT_ENCODING_IDENTITY:
+        return "identity";
+    case HTTP_CONTENT_ENCODING_GZIP:
+        return "gzip";
+    case HTTP_CONTENT_ENCODING_ZSTD:
+        return "zstd";
+    case HTTP_CONTENT_ENCODING_BROTLI:
+        return "br";
+    case HTTP_CONTENT_ENCODING_UNKNOWN:
+        break;
+    }
+    return "unknown";
+}
+
+bool IsHttpContentEncodingSupported(HttpContentEncoding e) {
+    switch (e) {
+    case HTTP_CONTENT_ENCODING_IDENTITY:
+    case HTTP_CONTENT_ENCODING_GZIP:
+        return true;
+    case HTTP_CONTENT_ENCODING_ZSTD:
+#ifdef BRPC_WITH_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    case HTTP_CONTENT_ENCODING_BROTLI:
+#ifdef BRPC_WITH_BROTLI
+        return true;
+#else
+        return false;
+#endif
+    case HTTP_CONTENT_ENCODING_UNKNOWN:
+        break;
+    }
+    return false;
+}
+
+// q-values of codings in Accept-Encoding, in thousandths as RFC 7231 allows
+// at most 3 digits. -1 means the coding is not mentioned.
+struct AcceptedCodings {
+    AcceptedCodings() : any(-1) {
+        for (size_t i = 0; i < arraysize(q); ++i) {
+            q[i] = -1;
+        }
+    }
+    int QualityOf(HttpContentEncoding e) const {
+        return q[e] >= 0 ? q[e] : any;
+    }
+    int q[HTTP_CONTENT_ENCODING_UNKNOWN];
+    int any;
+};
+
+static int ParseQuality(butil::StringPiece params) {
+    // Params look like ";q=0.5", other params are ignored.
+    for (butil::StringSplitter sp(params.data(), params.data() + params.size(), ';');
+         sp; ++sp) {
+        butil::StringPiece param(sp.field(), sp.length());
+        butil::TrimWhitespaceASCII(param, butil::TRIM_ALL, &param);
+        if (param.size() < 2 || (param[0] != 'q' && param[0] != 'Q') ||
+            param[1] != '=') {
+            continue;
+        }
+        char buf[8];
+        const size_t len = std::min(param.size() - 2, sizeof(buf) - 1);
+        memcpy(buf, param.data() + 2, len);
+        buf[len] = '\0';
+        const double q = strtod(buf, NULL);
+        return q <= 0 ? 0 : (q >= 1 ? 1000 : (int)(q * 1000 + 0.5));
+    }
+    return 1000;
+}
+
+static void ParseAcceptEncoding(const std::string& value,
+                                AcceptedCodings* accepted) {
+    for (butil::StringSplitter sp(value.c_str(), ','); sp; ++sp) {
+        butil::StringPiece item(sp.field(), sp.length());
+        butil::StringPiece name = item;
+        butil::StringPiece params;
+        const size_t semicolon = item.find(';');
+        if (semicolon != butil::StringPiece::npos) {
+            name = item.substr(0, semicolon);
+            params = item.substr(semicolon + 1);
+        }
+        butil::TrimWhitespaceASCII(name, butil::TRIM_ALL, &name);
+        if (name.empty()) {
+            continue;
+        }
+        const int q = ParseQuality(params);
+        if (name == "*") {
+            accepted->any = q;
+            continue;
+        }
+        const HttpContentEncoding e = ParseHttpContentEncoding(name);
+        if (e != HTTP_CONTENT_ENCODING_UNKNOWN) {
+            accepted->q[e] = q;
+        }
+    }
+}
+
+HttpContentEncoding NegotiateHttpContentEncoding(
+    const std::string* accept_encoding) {
+    if (accept_encoding == NULL || accept_encoding->empty()) {
+        return HTTP_CONTENT_ENCODING_IDENTITY;
+    }
+    AcceptedCodings accepted;
+    ParseAcceptEncoding(*accept_encoding, &accepted);
+    HttpContentEncoding best = HTTP_CONTENT_ENCODING_IDENTITY;
+    int best_q = 0;
+    for (uint32_t packed = g_response_encodings.load(butil::memory_order_relaxed);
+         packed != 0; packed >>= 4) {
+        const HttpContentEncoding e = (HttpContentEncoding)(packed & 0xF);
+        const int q = accepted.QualityOf(e);
+        if (q > best_q && IsHttpContentEncodingSupported(e)) {
+            best = e;
+            best_q = q;
+        }
+    }
+    return best;
+}
+
+static int LevelOf(HttpContentEncoding e) {
+    switch (e) {
+    case HTTP_CONTENT_ENCODING_GZIP:
+        return FLAGS_http_gzip_compression_level;
+    case HTTP_CONTENT_ENCODING_ZSTD:
+        return FLAGS_http_zstd_compression_level;
+    case HTTP_CONTENT_ENCODING_BROTLI:
+        return FLAGS_http_brotli_quality;
+    default:
+        return 0;
+    }
+}
+
+static bool HttpCompressAtLevel(HttpContentEncoding e, int level,
+                                const butil::IOBuf& in, butil::IOBuf* out) {
+    switch (e) {
+    case HTTP_CONTENT_ENCODING_GZIP: {
+        GzipCompressOptions options;
+        options.compression_level = level;
+        return GzipCompress(in, out, &options);
+    }
+    case HTTP_CONTENT_ENCODING_ZSTD:
+#ifdef BRPC_WITH_ZSTD
+        return ZstdCompress(in, out, level);
+#else
+        LOG(ERROR) << "Fail to compress: brpc is not built with zstd";
+        return false;
+#endif
+    case HTTP_CONTENT_ENCODING_BROTLI:
+        return BrotliCompress(in, out, level);
+    default:
+        LOG(ERROR) << "Unsupported content coding=" << (int)e;
+        return false;
+    }
+}
+
+bool HttpCompress(HttpContentEncoding e, const butil::IOBuf& in,
+                  butil::IOBuf* out) {
+    return HttpCompressAtLevel(e, LevelOf(e), in, out);
+}
+
+bool HttpDecompress(HttpContentEncoding e, const butil::IOBuf& in,
+                    butil::IOBuf* out) {
+    switch (e) {
+    case HTTP_CONTENT_ENCODING_GZIP:
+        return GzipDecompress(in, out);
+    case HTTP_CONTENT_ENCODING_ZSTD:
+#ifdef BRPC_WITH_ZSTD
+        return ZstdDecompress(in, out);
+#else
+        LOG(ERROR) << "Fail to decompress: brpc is not built with zstd";
+        return false;
+#endif
+    case HTTP_CONTENT_ENCODING_BROTLI:
+        return BrotliDecompress(in, out);
+    default:
+        LOG(ERROR) << "Unsupported content coding=" << (int)e;
+        return false;
+    }
+}
+
+// Compressed bodies keyed by coding, level, size and 128-bit murmur3 hash
+// of the uncompressed body. Hashing is an order of magnitude faster than
+// any of the compressions. Cached IOBufs share blocks with responses.
+class CompressedBodyCache {
+public:
+    CompressedBodyCache()
+        : _entries(EntryMap::NO_AUTO_EVICT)
+        , _nbytes(0)
+        , _hit("rpc_http_compressed_body_cache_hit")
+        , _miss("rpc_http_compressed_body_cache_miss")
+        , _cached_bytes("rpc_http_compressed_body_cache_bytes",
+                        GetCachedBytes, this) {}
+
+    static void MakeKey(HttpContentEncoding e, int level,
+                        const butil::IOBuf& in, std::string* key) {
+        butil::MurmurHash3_x64_128_Context ctx;
+        butil::MurmurHash3_x64_128_Init(&ctx, 0);
+        const size_t nblock = in.backing_block_num();
+        for (size_t i = 0; i < nblock; ++i) {
+            const butil::StringPiece blk = in.backing_block(i);
+            butil::MurmurHash3_x64_128_Update(&ctx, blk.data(), blk.size());
+        }
+        struct {
+            uint64_t hash[2];
+            uint64_t size;
+            int32_t level;
+            int32_t coding;
+        } k;
+        butil::MurmurHash3_x64_128_Final(k.hash, &ctx);
+        k.size = in.size();
+        k.level = level;
+        k.coding = e;
+        key->assign((const char*)&k, sizeof(k));
+    }
+
+    bool Get(const std::string& key, butil::IOBuf* out) {
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            EntryMap::iterator it = _entries.Get(key);
+            if (it != _entries.end()) {
+                out->append(it->second);
+                _hit << 1;
+                return true;
+            }
+        }
+        _miss << 1;
+        return false;
+    }
+
+    void Put(const std::string& key, const butil::IOBuf& body) {
+        const int64_t max_bytes = FLAGS_http_compressed_body_cache_max_bytes;
+        const size_t nbytes = key.size() + body.size();
+        // Don't let a single huge body flush the cache.
+        if ((int64_t)nbytes * 4 > max_bytes) {
+            return;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        EntryMap::iterator it = _entries.Peek(key);
+        if (it != _entries.end()) {
+            return;
+        }
+        while (!_entries.empty() && (int64_t)(_nbytes + nbytes) > max_bytes) {
+            EntryMap::reverse_iterator oldest = _entries.rbegin();
+            _nbytes -= oldest->first.size() + oldest->second.size();
+            _entries.Erase(oldest);
+        }
+        _entries.Put(key, body);
+        _nbytes += nbytes;
+    }
+
+private:
+    typedef butil::HashingMRUCache<std::string, butil::IOBuf> EntryMap;
+
+    static int64_t GetCachedBytes(void* arg) {
+        CompressedBodyCache* c = static_cast<CompressedBodyCache*>(arg);
+        BAIDU_SCOPED_LOCK(c->_mutex);
+        return c->_nbytes;
+    }
+
+    butil::Mutex _mutex;
+    EntryMap _entries;
+    size_t _nbytes;
+    bvar::Adder<int64_t> _hit;
+    bvar::Adder<int64_t> _miss;
+    bvar::PassiveStatus<int64_t> _cached_bytes;
+};
+
+static CompressedBodyCache* g_compressed_body_cache = NULL;
+static pthread_once_t g_compressed_body_cache_once = PTHREAD_ONCE_INIT;
+static void CreateCompressedBodyCache() {
+    g_compressed_body_cache = new CompressedBodyCache;
+}
+
+bool HttpCompressCached(HttpContentEncoding e, const butil::IOBuf& in,
+                        butil::IOBuf* out) {
+    const int level = LevelOf(e);
+    if (FLAGS_http_compressed_body_cache_max_bytes <= 0) {
+        return HttpCompressAtLevel(e, level, in, out);
+    }
+    pthread_once(&g_compressed_body_cache_once, CreateCompressedBodyCache);
+    std::string key;
+    CompressedBodyCache::MakeKey(e, level, in, &key);
+    if (g_compressed_body_cache->Get(key, out)) {
+        return true;
+    }
+    butil::IOBuf compressed;
+    if (!HttpCompressAtLevel(e, level, in, &compressed)) {
+        return false;
+    }
+    g_compressed_body_cache->Put(key, compressed);
+    out->append(compressed);
+    return true;
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,79 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_HTTP_COMPRESS_H
+#define BRPC_POLICY_HTTP_COMPRESS_H
+
+#include <string>
+#include "butil/iobuf.h"                       // IOBuf
+#include "butil/strings/string_piece.h"        // StringPiece
+
+
+namespace brpc {
+namespace policy {
+
+// Content codings of http bodies.
+enum HttpContentEncoding {
+    HTTP_CONTENT_ENCODING_IDENTITY = 0,
+    HTTP_CONTENT_ENCODING_GZIP = 1,
+    HTTP_CONTENT_ENCODING_ZSTD = 2,
+    HTTP_CONTENT_ENCODING_BROTLI = 3,
+    HTTP_CONTENT_ENCODING_UNKNOWN = 4,
+};
+
+// Returns the coding named `name' in Content-Encoding or Accept-Encoding,
+// case-insensitive.
+HttpContentEncoding ParseHttpContentEncoding(const butil::StringPiece& name);
+
+// Returns the name of `e' in Content-Encoding.
+const char* HttpContentEncodingToCStr(HttpContentEncoding e);
+
+// True if brpc is built with the library of `e'.
+bool IsHttpContentEncodingSupported(HttpContentEncoding e);
+
+// Choose the coding of a response to a request with `accept_encoding' as
+// the value of Accept-Encoding (NULL when absent). Codings in
+// -http_response_encodings that brpc supports are candidates, the one
+// with the highest q-value wins and ties are broken by the order in the
+// flag. Returns HTTP_CONTENT_ENCODING_IDENTITY if none is acceptable.
+HttpContentEncoding NegotiateHttpContentEncoding(
+    const std::string* accept_encoding);
+
+// Put `in' compressed with coding `e' into `out', at the level of
+// -http_gzip_compression_level, -http_zstd_compression_level or
+// -http_brotli_quality.
+bool HttpCompress(HttpContentEncoding e, const butil::IOBuf& in,
+                  butil::IOBuf* out);
+
+// Same as HttpCompress() but the result is looked up in or inserted into
+// a process-wide cache keyed by (e, level, 128-bit hash of `in'), for
+// bodies which are likely to be sent again, e.g. static files and pages of
+// builtin services. The cache is bounded by
+// -http_compressed_body_cache_max_bytes and disabled when it's 0.
+bool HttpCompressCached(HttpContentEncoding e, const butil::IOBuf& in,
+                        butil::IOBuf* out);
+
+// Put `in' decompressed with coding `e' into `out'.
+bool HttpDecompress(HttpContentEncoding e, const butil::IOBuf& in,
+                    butil::IOBuf* out);
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif // BRPC_POLICY_HTTP_COMPRESS_H
@@ -31,16 +31,25 @@
 #include "brpc/errno.pb.h"                     // ENOSERVICE, ENOMETHOD
 #include "brpc/controller.h"                   // Controller
 #include "brpc/server.h"                       // Server
+#include "brpc/serialized_request.h"           // SerializedRequest
+#include "brpc/serialized_response.h"          // SerializedResponse
 #include "brpc/details/server_private_accessor.h"
 #include "brpc/span.h"
 #include "brpc/socket.h"                       // Socket
+#include "brpc/streaming_rpc_meta.pb.h"        // StreamSettings
 #include "brpc/http_status_code.h"             // HTTP_STATUS_*
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/builtin/index_service.h"        // IndexService
-#include "brpc/policy/gzip_compress.h"
+#include "brpc/policy/grpc_compress.h"
+#include "brpc/policy/http_compress.h"
 #include "brpc/policy/http2_rpc_protocol.h"
 #include "brpc/details/usercode_backup_pool.h"
+#include "brpc/details/response_cache.h"          // ResponseCache
+#include "brpc/details/rpc_deadline.h"          // ScopedRpcDeadline
+#include "brpc/details/running_method.h"        // ScopedRunningMethod
+#include "brpc/details/method_executor.h"       // MethodExecutor
 #include "brpc/grpc.h"
+#include "brpc/reloadable_flags.h"
 
 extern "C" {
 void bthread_assign_data(void* data);
@@ -74,6 +83,37 @@ DEFINE_bool(pb_enum_as_number, false,
 
 DEFINE_string(request_id_header, "x-request-id", "The http header to mark a session");
 
+DEFINE_int64(http_json_sax_threshold, 1024 * 1024,
+             "Json bodies not less than so many bytes are converted to protobuf "
+             "by a SAX-style parser which does not build the DOM of the whole "
+             "json, negative value to disable");
+BRPC_VALIDATE_GFLAG(http_json_sax_threshold, PassValidate);
+
+DEFINE_bool(http_client_pipelining, false,
+            "Allow http channels initialized with connection_type=\"single\" "
+            "to pipeline HTTP/1.1 requests over one connection. Responses are "
+            "matched with requests in FIFO order and later RPCs fall back to "
+            "pooled connections if the server closes the connection early");
+BRPC_VALIDATE_GFLAG(http_client_pipelining, PassValidate);
+
+// Convert json `body' to `msg', large bodies are converted without DOM.
+static bool JsonBodyToProtoMessage(const butil::IOBuf& body,
+                                   google::protobuf::Message* msg,
+                                   const json2pb::Json2PbOptions& options,
+                                   std::string* err) {
+    butil::IOBufAsZeroCopyInputStream wrapper(body);
+    if (FLAGS_http_json_sax_threshold < 0 ||
+        body.size() < (size_t)FLAGS_http_json_sax_threshold) {
+        return json2pb::JsonToProtoMessage(&wrapper, msg, options, err);
+    }
+    json2pb::JsonToProtoParser parser(msg, options);
+    const bool ok = parser.Parse(&wrapper) && parser.Finish();
+    if (err) {
+        *err = parser.error();
+    }
+    return ok;
+}
+
 // Read user address from the header specified by -http_header_of_user_ip
 static bool GetUserAddressFromHeaderImpl(const HttpHeader& headers,
                                          butil::EndPoint* user_addr) {
@@ -120,10 +160,12 @@ CommonStrings::CommonStrings()
     , ACCEPT_ENCODING("accept-encoding")
     , CONTENT_ENCODING("content-encoding")
     , GZIP("gzip")
+    , VARY("vary")
     , CONNECTION("connection")
     , KEEP_ALIVE("keep-alive")
     , CLOSE("close")
     , LOG_ID("log-id")
+    , PRIORITY("x-bd-priority")
     , DEFAULT_METHOD("default_method")
     , NO_METHOD("no_method")
     , H2_SCHEME(":scheme")
@@ -140,7 +182,6 @@ CommonStrings::CommonStrings()
     , TRAILERS("trailers")
     , GRPC_ENCODING("grpc-encoding")
     , GRPC_ACCEPT_ENCODING("grpc-accept-encoding")
-    , GRPC_ACCEPT_ENCODING_VALUE("identity,gzip")
     , GRPC_STATUS("grpc-status")
     , GRPC_MESSAGE("grpc-message")
     , GRPC_TIMEOUT("grpc-timeout")
@@ -262,9 +303,12 @@ void ProcessHttpResponse(InputMessageBase* msg) {
     Socket* socket = imsg_guard->socket();
     uint64_t cid_value;
     const bool is_http2 = imsg_guard->header().is_http2();
+    H2StreamContext* h2_sctx = NULL;
     if (is_http2) {
-        H2StreamContext* h2_sctx = static_cast<H2StreamContext*>(msg);
+        h2_sctx = static_cast<H2StreamContext*>(msg);
         cid_value = h2_sctx->correlation_id();
+    } else if (imsg_guard->pipelined_correlation_id() != 0) {
+        cid_value = imsg_guard->pipelined_correlation_id();
     } else {
         cid_value = socket->correlation_id();
     }
@@ -282,6 +326,7 @@ void ProcessHttpResponse(InputMessageBase* msg) {
     }
 
     ControllerPrivateAccessor accessor(cntl);
+    accessor.set_phase_begin_us(RPC_PHASE_CLIENT_PARSE, start_parse_us);
 
     Span* span = accessor.span();
     if (span) {
@@ -308,7 +353,20 @@ void ProcessHttpResponse(InputMessageBase* msg) {
         if (!is_http2) {
             // If header has "Connection: close", close the connection.
             const std::string* conn_cmd = res_header->GetHeader(common->CONNECTION);
-            if (conn_cmd != NULL && 0 == strcasecmp(conn_cmd->c_str(), "close")) {
+            const bool close_conn =
+                (conn_cmd != NULL && 0 == strcasecmp(conn_cmd->c_str(), "close"));
+            if (imsg_guard->pipelined_correlation_id() != 0 &&
+                (close_conn || res_header->before_http_1_1()) &&
+                !socket->is_single_connection_disabled()) {
+                // The server does not keep the connection alive, pending
+                // pipelined requests are failed along with the connection
+                // and retried over pooled connections.
+                socket->disable_single_connection();
+                LOG(WARNING) << "Server of " << *socket << " does not keep "
+                    "pipelined http connections alive, fall back to pooled "
+                    "connections";
+            }
+            if (close_conn) {
                 // Server asked to close the connection.
                 if (imsg_guard->read_body_progressively()) {
                     // Close the socket when reading completes.
@@ -341,6 +399,21 @@ void ProcessHttpResponse(InputMessageBase* msg) {
                     break;
                 }
             }
+            if (h2_sctx->is_grpc_stream() &&
+                accessor.remote_stream_settings() == NULL) {
+                // The server never tells settings of its stream, messages
+                // are carried by the http2 stream.
+                StreamSettings* settings = new StreamSettings;
+                settings->set_stream_id(h2_sctx->stream_id());
+                settings->set_need_feedback(false);
+                settings->set_writable(true);
+                accessor.set_remote_stream_settings(settings);
+                if (cntl->method() != NULL &&
+                    cntl->method()->server_streaming()) {
+                    // Responses are delivered to the stream.
+                    break;
+                }
+            }
         }
 
         if (imsg_guard->read_body_progressively()) {
@@ -415,16 +488,36 @@ void ProcessHttpResponse(InputMessageBase* msg) {
                                     " in compressed gRPC response");
                     break;
                 }
+                CompressType grpc_encoding = COMPRESS_TYPE_NONE;
+                if (!ParseGrpcEncoding(*encoding, &grpc_encoding)) {
+                    cntl->SetFailed(ERESPONSE, "Unsupported grpc-encoding=%s",
+                                    encoding->c_str());
+                    break;
+                }
+                TRACEPRINTF("Decompressing response=%lu",
+                            (unsigned long)res_body.size());
+                butil::IOBuf uncompressed;
+                if (!GrpcDecompress(grpc_encoding, res_body, &uncompressed)) {
+                    cntl->SetFailed(ERESPONSE, "Fail to decompress %s gRPC response",
+                                    encoding->c_str());
+                    break;
+                }
+                res_body.swap(uncompressed);
+                encoding = NULL;
             }
         } else {
             encoding = res_header->GetHeader(common->CONTENT_ENCODING);
         }
-        if (encoding != NULL && *encoding == common->GZIP) {
+        const HttpContentEncoding res_encoding = (encoding != NULL ?
+            ParseHttpContentEncoding(*encoding) : HTTP_CONTENT_ENCODING_IDENTITY);
+        if (res_encoding != HTTP_CONTENT_ENCODING_IDENTITY &&
+            res_encoding != HTTP_CONTENT_ENCODING_UNKNOWN) {
             TRACEPRINTF("Decompressing response=%lu",
                         (unsigned long)res_body.size());
             butil::IOBuf uncompressed;
-            if (!policy::GzipDecompress(res_body, &uncompressed)) {
-                cntl->SetFailed(ERESPONSE, "Fail to un-gzip response body");
+            if (!HttpDecompress(res_encoding, res_body, &uncompressed)) {
+                cntl->SetFailed(ERESPONSE, "Fail to decompress %s response body",
+                                HttpContentEncodingToCStr(res_encoding));
                 break;
             }
             res_body.swap(uncompressed);
@@ -436,11 +529,10 @@ void ProcessHttpResponse(InputMessageBase* msg) {
             }
         } else if (content_type == HTTP_CONTENT_JSON) {
             // message body is json
-            butil::IOBufAsZeroCopyInputStream wrapper(res_body);
             std::string err;
             json2pb::Json2PbOptions options;
             options.base64_to_bytes = cntl->has_pb_bytes_to_base64();
-            if (!json2pb::JsonToProtoMessage(&wrapper, cntl->response(), options, &err)) {
+            if (!JsonBodyToProtoMessage(res_body, cntl->response(), options, &err)) {
                 cntl->SetFailed(ERESPONSE, "Fail to parse content, %s", err.c_str());
                 break;
             }
@@ -543,8 +635,33 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
                         hreq.uri().status().error_cstr());
     }
     bool grpc_compressed = false;
-    if (cntl->request_compress_type() != COMPRESS_TYPE_NONE) {
-        if (cntl->request_compress_type() != COMPRESS_TYPE_GZIP) {
+    if (is_grpc && cntl->request_compress_type() != COMPRESS_TYPE_NONE) {
+        const CompressType type = cntl->request_compress_type();
+        const char* grpc_encoding = GrpcEncodingOf(type);
+        if (grpc_encoding == NULL) {
+            return cntl->SetFailed(EREQUEST, "gRPC does not support %s",
+                                   CompressTypeToCStr(type));
+        }
+        const size_t request_size = cntl->request_attachment().size();
+        if (ShouldCompressGrpcMessage(request_size)) {
+            TRACEPRINTF("Compressing request=%lu", (unsigned long)request_size);
+            butil::IOBuf compressed;
+            if (GrpcCompress(type, cntl->request_attachment(), &compressed)) {
+                cntl->request_attachment().swap(compressed);
+                grpc_compressed = true;
+                hreq.SetHeader(common->GRPC_ENCODING, grpc_encoding);
+            } else {
+                cntl->SetFailed("Fail to compress the request body, skip compressing");
+            }
+        }
+    } else if (cntl->request_compress_type() != COMPRESS_TYPE_NONE) {
+        HttpContentEncoding req_encoding = HTTP_CONTENT_ENCODING_UNKNOWN;
+        if (cntl->request_compress_type() == COMPRESS_TYPE_GZIP) {
+            req_encoding = HTTP_CONTENT_ENCODING_GZIP;
+        } else if (cntl->request_compress_type() == COMPRESS_TYPE_ZSTD) {
+            req_encoding = HTTP_CONTENT_ENCODING_ZSTD;
+        }
+        if (!IsHttpContentEncodingSupported(req_encoding)) {
             return cntl->SetFailed(EREQUEST, "http does not support %s",
                             CompressTypeToCStr(cntl->request_compress_type()));
         }
@@ -552,16 +669,12 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
         if (request_size >= (size_t)FLAGS_http_body_compress_threshold) {
             TRACEPRINTF("Compressing request=%lu", (unsigned long)request_size);
             butil::IOBuf compressed;
-            if (GzipCompress(cntl->request_attachment(), &compressed, NULL)) {
+            if (HttpCompress(req_encoding, cntl->request_attachment(), &compressed)) {
                 cntl->request_attachment().swap(compressed);
-                if (is_grpc) {
-                    grpc_compressed = true;
-                    hreq.SetHeader(common->GRPC_ENCODING, common->GZIP);
-                } else {
-                    hreq.SetHeader(common->CONTENT_ENCODING, common->GZIP);
-                }
+                hreq.SetHeader(common->CONTENT_ENCODING,
+                               HttpContentEncodingToCStr(req_encoding));
             } else {
-                cntl->SetFailed("Fail to gzip the request body, skip compressing");
+                cntl->SetFailed("Fail to compress the request body, skip compressing");
             }
         }
     }
@@ -574,6 +687,10 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
     if (!cntl->request_id().empty()) {
         hreq.SetHeader(FLAGS_request_id_header, cntl->request_id());
     }
+    if (cntl->request_priority() != REQUEST_PRIORITY_NORMAL) {
+        hreq.SetHeader(common->PRIORITY,
+                       butil::string_printf("%d", (int)cntl->request_priority()));
+    }
 
     if (!is_http2) {
         // HTTP before 1.1 needs to set keep-alive explicitly.
@@ -585,10 +702,7 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
     } else {
         cntl->set_stream_creator(get_h2_global_stream_creator());
         if (is_grpc) {
-            /*
-            hreq.SetHeader(common->GRPC_ACCEPT_ENCODING,
-                              common->GRPC_ACCEPT_ENCODING_VALUE);
-            */
+            hreq.SetHeader(common->GRPC_ACCEPT_ENCODING, GrpcAcceptEncoding());
             // TODO: do we need this?
             hreq.SetHeader(common->TE, common->TRAILERS);
             if (cntl->timeout_ms() >= 0) {
@@ -633,10 +747,12 @@ void PackHttpRequest(butil::IOBuf* buf,
                      Controller* cntl,
                      const butil::IOBuf& /*unused*/,
                      const Authenticator* auth) {
-    if (cntl->connection_type() == CONNECTION_TYPE_SINGLE) {
-        return cntl->SetFailed(EREQUEST, "http can't work with CONNECTION_TYPE_SINGLE");
-    }
     ControllerPrivateAccessor accessor(cntl);
+    const bool pipelined = (cntl->connection_type() == CONNECTION_TYPE_SINGLE);
+    if (pipelined && cntl->is_response_read_progressively()) {
+        return cntl->SetFailed(EREQUEST, "Can't read http response "
+                               "progressively over a pipelined connection");
+    }
     HttpHeader* header = &cntl->http_request();
     if (auth != NULL && header->GetHeader(common->AUTHORIZATION) == NULL) {
         std::string auth_data;
@@ -646,9 +762,15 @@ void PackHttpRequest(butil::IOBuf* buf,
         header->SetHeader(common->AUTHORIZATION, auth_data);
     }
 
-    // Store `correlation_id' into Socket since http server
-    // may not echo back this field. But we send it anyway.
-    accessor.get_sending_socket()->set_correlation_id(correlation_id);
+    if (pipelined) {
+        // Responses are matched with requests in the order of sending,
+        // see ParseHttpMessage().
+        accessor.set_pipelined_count(1);
+    } else {
+        // Store `correlation_id' into Socket since http server
+        // may not echo back this field. But we send it anyway.
+        accessor.get_sending_socket()->set_correlation_id(correlation_id);
+    }
 
     MakeRawHttpRequest(buf, header, cntl->remote_side(),
                        &cntl->request_attachment());
@@ -657,26 +779,37 @@ void PackHttpRequest(butil::IOBuf* buf,
     }
 }
 
-inline bool SupportGzip(Controller* cntl) {
-    const std::string* encodings =
+// Returns the coding of the response of `cntl', identity means no
+// compression.
+static HttpContentEncoding ChooseResponseEncoding(Controller* cntl,
+                                                  bool is_http2) {
+    const std::string* accept_encoding =
         cntl->http_request().GetHeader(common->ACCEPT_ENCODING);
-    return (encodings && encodings->find(common->GZIP) != std::string::npos);
+    if (accept_encoding == NULL && is_http2) {
+        // Compatible with the behavior before negotiation was supported.
+        return HTTP_CONTENT_ENCODING_GZIP;
+    }
+    return NegotiateHttpContentEncoding(accept_encoding);
 }
 
 class HttpResponseSender {
 friend class HttpResponseSenderAsDone;
 public:
     HttpResponseSender()
-        : _method_status(NULL), _received_us(0), _h2_stream_id(-1) {}
+        : _method_status(NULL), _received_us(0), _h2_stream_id(-1)
+        , _h2_weight(H2_DEFAULT_WEIGHT) {}
     HttpResponseSender(Controller* cntl/*own*/)
-        : _cntl(cntl), _method_status(NULL), _received_us(0), _h2_stream_id(-1) {}
+        : _cntl(cntl), _method_status(NULL), _received_us(0), _h2_stream_id(-1)
+        , _h2_weight(H2_DEFAULT_WEIGHT) {}
     HttpResponseSender(HttpResponseSender&& s)
         : _cntl(std::move(s._cntl))
         , _req(std::move(s._req))
         , _res(std::move(s._res))
         , _method_status(std::move(s._method_status))
         , _received_us(s._received_us)
-        , _h2_stream_id(s._h2_stream_id) {
+        , _h2_stream_id(s._h2_stream_id)
+        , _h2_weight(s._h2_weight) {
+        _response_cache_key.swap(s._response_cache_key);
     }
     ~HttpResponseSender();
 
@@ -685,6 +818,9 @@ public:
     void set_method_status(MethodStatus* ms) { _method_status = ms; }
     void set_received_us(int64_t t) { _received_us = t; }
     void set_h2_stream_id(int id) { _h2_stream_id = id; }
+    void set_h2_weight(int weight) { _h2_weight = weight; }
+    // Put the response body into the response cache of server with `key'.
+    void swap_response_cache_key(std::string* key) { _response_cache_key.swap(*key); }
 
 private:
     std::unique_ptr<Controller, LogErrorTextAndDelete> _cntl;
@@ -693,6 +829,8 @@ private:
     MethodStatus* _method_status;
     int64_t _received_us;
     int _h2_stream_id;
+    int _h2_weight;
+    std::string _response_cache_key;
 };
 
 class HttpResponseSenderAsDone : public google::protobuf::Closure {
@@ -709,9 +847,11 @@ HttpResponseSender::~HttpResponseSender() {
         return;
     }
     ControllerPrivateAccessor accessor(cntl);
+    const int64_t start_send_us = butil::cpuwide_time_us();
+    accessor.set_phase_begin_us(RPC_PHASE_SERVER_SERIALIZE, start_send_us);
     Span* span = accessor.span();
     if (span) {
-        span->set_start_send_us(butil::cpuwide_time_us());
+        span->set_start_send_us(start_send_us);
     }
     ConcurrencyRemover concurrency_remover(_method_status, cntl, _received_us);
     Socket* socket = accessor.get_sending_socket();
@@ -740,11 +880,25 @@ HttpResponseSender::~HttpResponseSender() {
     const HttpContentType content_type = ParseContentType(*content_type_str, &is_grpc_ct);
     const bool is_http2 = req_header->is_http2();
     const bool is_grpc = (is_http2 && is_grpc_ct);
+    // Responses of a server-streaming gRPC call are written into the accepted
+    // stream after the headers, the response given to the service is unused.
+    const bool is_streaming_response =
+        is_grpc && accessor.is_grpc_stream() &&
+        accessor.response_stream() != INVALID_STREAM_ID &&
+        cntl->method() != NULL && cntl->method()->server_streaming() &&
+        !cntl->Failed();
 
     // Convert response to json/proto if needed.
     // Notice: Not check res->IsInitialized() which should be checked in the
     // conversion function.
-    if (res != NULL &&
+    const SerializedResponse* raw_res =
+        dynamic_cast<const SerializedResponse*>(res);
+    if (raw_res != NULL) {
+        // Filled by RawService, the body as it is.
+        if (!is_streaming_response && !cntl->Failed()) {
+            cntl->response_attachment().append(raw_res->serialized_data());
+        }
+    } else if (res != NULL && !is_streaming_response &&
         cntl->response_attachment().empty() &&
         // ^ user did not fill the body yet.
         res->GetDescriptor()->field_count() > 0 &&
@@ -772,6 +926,25 @@ HttpResponseSender::~HttpResponseSender() {
         }
     }
 
+    if (!_response_cache_key.empty()) {
+        ResponseCache* cache =
+            ServerPrivateAccessor(cntl->server()).response_cache();
+        const ResponseCachePolicy* policy = cache->GetPolicy(cntl->method());
+        // Headers set by the method are not cached.
+        if (policy != NULL && !cntl->Failed() && !is_grpc &&
+            !cntl->has_progressive_writer() &&
+            res_header->status_code() == HTTP_STATUS_OK &&
+            res_header->HeaderCount() == 0) {
+            ResponseCache::Response cached;
+            cached.body = cntl->response_attachment();
+            cached.compress_type = cntl->response_compress_type();
+            cached.content_type = res_header->content_type();
+            cache->Insert(_response_cache_key, *policy, cached);
+        } else {
+            cache->Unrefresh(_response_cache_key);
+        }
+    }
+
     // In HTTP 0.9, the server always closes the connection after sending the
     // response. The client must close its end of the connection after
     // receiving the response.
@@ -806,6 +979,7 @@ HttpResponseSender::~HttpResponseSender() {
     } else if (is_grpc) {
         // status code is always 200 according to grpc protocol
         res_header->set_status_code(HTTP_STATUS_OK);
+        res_header->SetHeader(common->GRPC_ACCEPT_ENCODING, GrpcAcceptEncoding());
     }
     
     bool grpc_compressed = false;
@@ -839,26 +1013,57 @@ HttpResponseSender::~HttpResponseSender() {
                 " ignored when CreateProgressiveAttachment() was called";
         }
         // not set_content to enable chunked mode.
-    } else if (cntl->response_compress_type() == COMPRESS_TYPE_GZIP) {
+    } else if (is_grpc) {
+        // Compress with the encoding set by user only if the client accepts
+        // it, tiny messages are not compressed.
         const size_t response_size = cntl->response_attachment().size();
-        if (response_size >= (size_t)FLAGS_http_body_compress_threshold
-            && (is_http2 || SupportGzip(cntl))) {
+        CompressType type = COMPRESS_TYPE_NONE;
+        if (ShouldCompressGrpcMessage(response_size)) {
+            type = NegotiateGrpcEncoding(
+                cntl->response_compress_type(),
+                cntl->http_request().GetHeader(common->GRPC_ACCEPT_ENCODING));
+        }
+        if (type != COMPRESS_TYPE_NONE) {
             TRACEPRINTF("Compressing response=%lu", (unsigned long)response_size);
             butil::IOBuf tmpbuf;
-            if (GzipCompress(cntl->response_attachment(), &tmpbuf, NULL)) {
+            if (GrpcCompress(type, cntl->response_attachment(), &tmpbuf)) {
                 cntl->response_attachment().swap(tmpbuf);
-                if (is_grpc) {
-                    grpc_compressed = true;
-                    res_header->SetHeader(common->GRPC_ENCODING, common->GZIP);
-                } else {
-                    res_header->SetHeader(common->CONTENT_ENCODING, common->GZIP);
+                grpc_compressed = true;
+                res_header->SetHeader(common->GRPC_ENCODING, GrpcEncodingOf(type));
+            } else {
+                LOG(ERROR) << "Fail to compress the gRPC response with "
+                           << GrpcEncodingOf(type) << ", skip compression.";
+            }
+        }
+    } else if (cntl->response_compress_type() == COMPRESS_TYPE_GZIP ||
+               cntl->response_compress_type() == COMPRESS_TYPE_ZSTD) {
+        // Both types mean compressing with the coding negotiated by
+        // Accept-Encoding of the request.
+        const size_t response_size = cntl->response_attachment().size();
+        HttpContentEncoding res_encoding = HTTP_CONTENT_ENCODING_IDENTITY;
+        if (response_size >= (size_t)FLAGS_http_body_compress_threshold) {
+            res_encoding = ChooseResponseEncoding(cntl, is_http2);
+        }
+        if (res_encoding != HTTP_CONTENT_ENCODING_IDENTITY) {
+            TRACEPRINTF("Compressing response=%lu", (unsigned long)response_size);
+            butil::IOBuf tmpbuf;
+            const bool compressed = (cntl->has_cache_compressed_response() ?
+                HttpCompressCached(res_encoding, cntl->response_attachment(), &tmpbuf) :
+                HttpCompress(res_encoding, cntl->response_attachment(), &tmpbuf));
+            if (compressed) {
+                cntl->response_attachment().swap(tmpbuf);
+                res_header->SetHeader(common->CONTENT_ENCODING,
+                                      HttpContentEncodingToCStr(res_encoding));
+                if (res_header->GetHeader(common->VARY) == NULL) {
+                    res_header->SetHeader(common->VARY, common->ACCEPT_ENCODING);
                 }
             } else {
-                LOG(ERROR) << "Fail to gzip the http response, skip compression.";
+                LOG(ERROR) << "Fail to compress the http response with "
+                           << HttpContentEncodingToCStr(res_encoding)
+                           << ", skip compression.";
             }
         }
     } else {
-        // TODO(gejun): Support snappy (grpc)
         LOG_IF(ERROR, cntl->response_compress_type() != COMPRESS_TYPE_NONE)
             << "Unknown compress_type=" << cntl->response_compress_type()
             << ", skip compression.";
@@ -870,23 +1075,27 @@ HttpResponseSender::~HttpResponseSender() {
     Socket::WriteOptions wopt;
     wopt.ignore_eovercrowded = true;
     if (is_http2) {
-        if (is_grpc) {
+        if (is_grpc && !is_streaming_response) {
             // Append compressed and length before body
             AddGrpcPrefix(&cntl->response_attachment(), grpc_compressed);
         }
         SocketMessagePtr<H2UnsentResponse> h2_response(
-                H2UnsentResponse::New(cntl, _h2_stream_id, is_grpc));
+                H2UnsentResponse::New(cntl, _h2_stream_id, is_grpc,
+                                      !is_streaming_response));
         if (h2_response == NULL) {
             LOG(ERROR) << "Fail to make http2 response";
             errno = EINVAL;
             rc = -1;
         } else {
+            h2_response->set_weight(_h2_weight);
             if (FLAGS_http_verbose) {
                 LOG(INFO) << '\n' << *h2_response;
             }
             if (span) {
                 span->set_response_size(h2_response->EstimatedByteSize());
             }
+            accessor.set_phase_begin_us(RPC_PHASE_SERVER_WRITE,
+                                        butil::cpuwide_time_us());
             rc = socket->Write(h2_response, &wopt);
         }
     } else {
@@ -902,6 +1111,8 @@ HttpResponseSender::~HttpResponseSender() {
         if (span) {
             span->set_response_size(res_buf.size());
         }
+        accessor.set_phase_begin_us(RPC_PHASE_SERVER_WRITE,
+                                    butil::cpuwide_time_us());
         rc = socket->Write(&res_buf, &wopt);
     }
 
@@ -912,9 +1123,11 @@ HttpResponseSender::~HttpResponseSender() {
         cntl->SetFailed(errcode, "Fail to write into %s", socket->description().c_str());
         return;
     }
+    const int64_t sent_us = butil::cpuwide_time_us();
+    accessor.set_phase_begin_us(RPC_PHASE_SERVER_WRITTEN, sent_us);
     if (span) {
         // TODO: this is not sent
-        span->set_sent_us(butil::cpuwide_time_us());
+        span->set_sent_us(sent_us);
     }
 }
 
@@ -1039,8 +1252,28 @@ FindMethodPropertyByURI(const std::string& uri_path, const Server* server,
     return NULL;
 }
 
+// Called when a client-side connection reads EOF. Requests pipelined over
+// the connection but not responded yet mean that the server does not keep
+// the connection alive as HTTP/1.1 specifies, later RPCs should not be
+// pipelined to the server anymore.
+static void CheckPipelinedRequestsAtEOF(Socket* socket) {
+    PipelinedInfo pi;
+    if (!socket->PopPipelinedInfo(&pi)) {
+        return;
+    }
+    socket->GivebackPipelinedInfo(pi);
+    if (!socket->is_single_connection_disabled()) {
+        socket->disable_single_connection();
+        LOG(WARNING) << "Server closed " << *socket << " with pipelined http "
+            "requests, fall back to pooled connections";
+    }
+}
+
 ParseResult ParseHttpMessage(butil::IOBuf *source, Socket *socket,
                              bool read_eof, const void* /*arg*/) {
+    if (read_eof && socket->CreatedByConnect()) {
+        CheckPipelinedRequestsAtEOF(socket);
+    }
     HttpContext* http_imsg = 
         static_cast<HttpContext*>(socket->parsing_context());
     if (http_imsg == NULL) {
@@ -1103,6 +1336,11 @@ ParseResult ParseHttpMessage(butil::IOBuf *source, Socket *socket,
         source->pop_front(rc);
         if (http_imsg->Completed()) {
             CHECK_EQ(http_imsg, socket->release_parsing_context());
+            PipelinedInfo pi;
+            if (socket->CreatedByConnect() && socket->PopPipelinedInfo(&pi)) {
+                // Responses of pipelined requests come back in FIFO order.
+                http_imsg->set_pipelined_correlation_id(pi.id_wait.value);
+            }
             const ParseResult result = MakeMessage(http_imsg);
             if (socket->is_read_progressive()) {
                 socket->OnProgressiveReadCompleted();
@@ -1210,6 +1448,28 @@ void EndRunningCallMethodInPool(
     ::google::protobuf::Message* response,
     ::google::protobuf::Closure* done);
 
+// Key of a http request to a pb service in the response cache of server.
+// Headers except Content-Type and Content-Encoding are not covered.
+static void MakeResponseCacheKey(const google::protobuf::MethodDescriptor* method,
+                                 const HttpHeader& header,
+                                 const butil::IOBuf& body,
+                                 std::string* key) {
+    const std::string* encoding = header.GetHeader(common->CONTENT_ENCODING);
+    key->append(method->full_name());
+    key->push_back('\0');
+    key->append(header.unresolved_path());
+    key->push_back('\0');
+    key->append(header.uri().query());
+    key->push_back('\0');
+    key->append(header.content_type());
+    key->push_back('\0');
+    if (encoding) {
+        key->append(*encoding);
+    }
+    key->push_back('\0');
+    body.append_to(key);
+}
+
 void ProcessHttpRequest(InputMessageBase *msg) {
     const int64_t start_parse_us = butil::cpuwide_time_us();
     DestroyingPtr<HttpContext> imsg_guard(static_cast<HttpContext*>(msg));
@@ -1227,9 +1487,12 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     resp_sender.set_received_us(msg->received_us());
 
     const bool is_http2 = imsg_guard->header().is_http2();
+    bool is_grpc_stream = false;
     if (is_http2) {
         H2StreamContext* h2_sctx = static_cast<H2StreamContext*>(msg);
         resp_sender.set_h2_stream_id(h2_sctx->stream_id());
+        resp_sender.set_h2_weight(h2_sctx->weight());
+        is_grpc_stream = h2_sctx->is_grpc_stream();
     }
 
     ControllerPrivateAccessor accessor(cntl);
@@ -1252,7 +1515,19 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         .set_auth_context(socket->auth_context())
         .set_request_protocol(PROTOCOL_HTTP)
         .set_begin_time_us(msg->received_us())
+        .set_phase_begin_us(RPC_PHASE_SERVER_READ, msg->received_us())
+        .set_phase_begin_us(RPC_PHASE_SERVER_PARSE, start_parse_us)
         .move_in_server_receiving_sock(socket_guard);
+    if (is_grpc_stream) {
+        // Messages of the call are carried by the http2 stream, which is
+        // bound to the stream accepted by the service.
+        StreamSettings* settings = new StreamSettings;
+        settings->set_stream_id(static_cast<H2StreamContext*>(msg)->stream_id());
+        settings->set_need_feedback(false);
+        settings->set_writable(true);
+        accessor.set_remote_stream_settings(settings);
+        accessor.set_grpc_stream();
+    }
     
     // Read log-id. errno may be set when input to strtoull overflows.
     // atoi/atol/atoll don't support 64-bit integer and can't be used.
@@ -1274,6 +1549,18 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         cntl->set_request_id(*request_id);
     }
 
+    const std::string* priority_str = req_header.GetHeader(common->PRIORITY);
+    if (priority_str) {
+        char* priority_end = NULL;
+        const long priority = strtol(priority_str->c_str(), &priority_end, 10);
+        if (*priority_end || !RequestPriority_IsValid(priority)) {
+            LOG(ERROR) << "Invalid " << common->PRIORITY << '='
+                       << *priority_str << " in http request";
+        } else {
+            cntl->set_request_priority((RequestPriority)priority);
+        }
+    }
+
     // Tag the bthread with this server's key for
     // thread_local_data().
     if (server->thread_local_options().thread_local_data_factory) {
@@ -1327,9 +1614,12 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         accessor.set_method(md);
         cntl->request_attachment().swap(req_body);
         google::protobuf::Closure* done = new HttpResponseSenderAsDone(&resp_sender);
+        const int64_t start_callback_us = butil::cpuwide_time_us();
+        accessor.set_phase_begin_us(RPC_PHASE_SERVER_QUEUE, start_callback_us)
+            .set_phase_begin_us(RPC_PHASE_SERVER_USERCODE, start_callback_us);
         if (span) {
             span->ResetServerSpanName(md->full_name());
-            span->set_start_callback_us(butil::cpuwide_time_us());
+            span->set_start_callback_us(start_callback_us);
             span->AsParent();
         }
         // `cntl', `req' and `res' will be deleted inside `done'
@@ -1361,7 +1651,8 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     resp_sender.set_method_status(method_status);
     if (method_status) {
         int rejected_cc = 0;
-        if (!method_status->OnRequested(&rejected_cc)) {
+        if (!method_status->OnRequested(&rejected_cc,
+                                        cntl->request_priority())) {
             cntl->SetFailed(ELIMIT, "Rejected by %s's ConcurrencyLimiter, concurrency=%d",
                             sp->method->full_name().c_str(), rejected_cc);
             return;
@@ -1384,6 +1675,13 @@ void ProcessHttpRequest(InputMessageBase *msg) {
                             server->options().max_concurrency);
             return;
         }
+        if (!server_accessor.AddInflightBytes(
+                cntl, method_status, imsg_guard->parsed_length())) {
+            cntl->SetFailed(ELIMIT, "Reached max_inflight_request_bytes=%" PRId64
+                            " of %s", method_status->max_inflight_bytes(),
+                            sp->method->full_name().c_str());
+            return;
+        }
         if (FLAGS_usercode_in_pthread && TooManyUserCode()) {
             cntl->SetFailed(ELIMIT, "Too many user code to run when"
                             " -usercode_in_pthread is on");
@@ -1395,10 +1693,40 @@ void ProcessHttpRequest(InputMessageBase *msg) {
                         " internal network", server->options().internal_port);
         return;
     }
+    if (sp->is_builtin_service) {
+        // Pages of builtin services are often refreshed without changes.
+        cntl->set_cache_compressed_response(true);
+    }
 
     google::protobuf::Service* svc = sp->service;
     const google::protobuf::MethodDescriptor* method = sp->method;
     accessor.set_method(method);
+
+    ResponseCache* response_cache = server_accessor.response_cache();
+    if (response_cache != NULL &&
+        response_cache->GetPolicy(method) != NULL &&
+        sp->params.allow_http_body_to_pb &&
+        method->input_type()->field_count() > 0 &&
+        !is_grpc_stream) {
+        bool is_grpc_ct = false;
+        ParseContentType(req_header.content_type(), &is_grpc_ct);
+        if (!is_grpc_ct) {
+            std::string cache_key;
+            MakeResponseCacheKey(method, req_header, req_body, &cache_key);
+            ResponseCache::Response cached;
+            if (response_cache->Lookup(cache_key, &cached) ==
+                ResponseCache::CACHE_HIT) {
+                // Sent by `resp_sender' without running the method.
+                cntl->response_attachment().swap(cached.body);
+                cntl->set_response_compress_type(
+                    (CompressType)cached.compress_type);
+                cntl->http_response().set_content_type(cached.content_type);
+                return;
+            }
+            resp_sender.swap_response_cache_key(&cache_key);
+        }
+    }
+
     google::protobuf::Message* req = svc->GetRequestPrototype(method).New();
     resp_sender.own_request(req);
     google::protobuf::Message* res = svc->GetResponsePrototype(method).New();
@@ -1409,8 +1737,13 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         cntl->SetFailed("Fail to new req or res");
         return;
     }
-    if (sp->params.allow_http_body_to_pb &&
-        method->input_type()->field_count() > 0) {
+    // Bytes of RawService are taken as they are.
+    SerializedRequest* raw_req = dynamic_cast<SerializedRequest*>(req);
+    if ((raw_req != NULL ||
+         (sp->params.allow_http_body_to_pb &&
+          method->input_type()->field_count() > 0)) &&
+        !(is_grpc_stream && method->client_streaming())) {
+        // ^ requests of client-streaming calls are read from the stream.
         // A protobuf service. No matter if Content-type is set to
         // applcation/json or body is empty, we have to treat body as a json
         // and try to convert it to pb, which guarantees that a protobuf
@@ -1436,13 +1769,29 @@ void ProcessHttpRequest(InputMessageBase *msg) {
                         return;
                     }
                     if (grpc_compressed) {
-                        encoding = req_header.GetHeader(common->GRPC_ENCODING);
-                        if (encoding == NULL) {
+                        const std::string* grpc_encoding =
+                            req_header.GetHeader(common->GRPC_ENCODING);
+                        if (grpc_encoding == NULL) {
                             cntl->SetFailed(
                                 EREQUEST, "Fail to find header `grpc-encoding'"
                                 " in compressed gRPC request");
                             return;
                         }
+                        CompressType type = COMPRESS_TYPE_NONE;
+                        if (!ParseGrpcEncoding(*grpc_encoding, &type)) {
+                            cntl->SetFailed(EREQUEST, "Unsupported grpc-encoding=%s",
+                                            grpc_encoding->c_str());
+                            return;
+                        }
+                        TRACEPRINTF("Decompressing request=%lu",
+                                    (unsigned long)req_body.size());
+                        butil::IOBuf uncompressed;
+                        if (!GrpcDecompress(type, req_body, &uncompressed)) {
+                            cntl->SetFailed(EREQUEST, "Fail to decompress %s gRPC"
+                                            " request", grpc_encoding->c_str());
+                            return;
+                        }
+                        req_body.swap(uncompressed);
                     }
                     int64_t timeout_value_us =
                         ConvertGrpcTimeoutToUS(req_header.GetHeader(common->GRPC_TIMEOUT));
@@ -1454,29 +1803,34 @@ void ProcessHttpRequest(InputMessageBase *msg) {
             } else {
                 encoding = req_header.GetHeader(common->CONTENT_ENCODING);
             }
-            if (encoding != NULL && *encoding == common->GZIP) {
+            const HttpContentEncoding req_encoding = (encoding != NULL ?
+                ParseHttpContentEncoding(*encoding) : HTTP_CONTENT_ENCODING_IDENTITY);
+            if (req_encoding != HTTP_CONTENT_ENCODING_IDENTITY &&
+                req_encoding != HTTP_CONTENT_ENCODING_UNKNOWN) {
                 TRACEPRINTF("Decompressing request=%lu",
                             (unsigned long)req_body.size());
                 butil::IOBuf uncompressed;
-                if (!policy::GzipDecompress(req_body, &uncompressed)) {
-                    cntl->SetFailed(EREQUEST, "Fail to un-gzip request body");
+                if (!HttpDecompress(req_encoding, req_body, &uncompressed)) {
+                    cntl->SetFailed(EREQUEST, "Fail to decompress %s request body",
+                                    HttpContentEncodingToCStr(req_encoding));
                     return;
                 }
                 req_body.swap(uncompressed);
             }
-            if (content_type == HTTP_CONTENT_PROTO) {
+            if (raw_req != NULL) {
+                raw_req->serialized_data().swap(req_body);
+            } else if (content_type == HTTP_CONTENT_PROTO) {
                 if (!ParsePbFromIOBuf(req, req_body)) {
                     cntl->SetFailed(EREQUEST, "Fail to parse http body as %s",
                                     req->GetDescriptor()->full_name().c_str());
                     return;
                 }
             } else {
-                butil::IOBufAsZeroCopyInputStream wrapper(req_body);
                 std::string err;
                 json2pb::Json2PbOptions options;
                 options.base64_to_bytes = sp->params.pb_bytes_to_base64;
                 cntl->set_pb_bytes_to_base64(sp->params.pb_bytes_to_base64);
-                if (!json2pb::JsonToProtoMessage(&wrapper, req, options, &err)) {
+                if (!JsonBodyToProtoMessage(req_body, req, options, &err)) {
                     cntl->SetFailed(EREQUEST, "Fail to parse http body as %s, %s",
                                     req->GetDescriptor()->full_name().c_str(), err.c_str());
                     return;
@@ -1491,14 +1845,26 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     google::protobuf::Closure* done = new HttpResponseSenderAsDone(&resp_sender);
     imsg_guard.reset();  // optional, just release resourse ASAP
 
+    const int64_t start_callback_us = butil::cpuwide_time_us();
+    // USERCODE is reset by executors or the backup pool when the method runs.
+    accessor.set_phase_begin_us(RPC_PHASE_SERVER_QUEUE, start_callback_us)
+        .set_phase_begin_us(RPC_PHASE_SERVER_USERCODE, start_callback_us);
     if (span) {
-        span->set_start_callback_us(butil::cpuwide_time_us());
+        span->set_start_callback_us(start_callback_us);
         span->AsParent();
     }
+    if (sp->params.executor != NULL) {
+        return sp->params.executor->CallMethod(svc, method, cntl, req, res, done);
+    }
+    // Deadlines are set by gRPC requests only.
     if (!FLAGS_usercode_in_pthread) {
+        ScopedRpcDeadline deadline_guard(cntl->deadline_us());
+        ScopedRunningMethod method_guard(method);
         return svc->CallMethod(method, cntl, req, res, done);
     }
     if (BeginRunningUserCode()) {
+        ScopedRpcDeadline deadline_guard(cntl->deadline_us());
+        ScopedRunningMethod method_guard(method);
         svc->CallMethod(method, cntl, req, res, done);
         return EndRunningUserCodeInPlace();
     } else {
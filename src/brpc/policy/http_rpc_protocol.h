@@ -44,6 +44,7 @@ struct CommonStrings {
     std::string CONTENT_ENCODING;
     std::string CONTENT_LENGTH;
     std::string GZIP;
+    std::string VARY;
     std::string CONNECTION;
     std::string KEEP_ALIVE;
     std::string CLOSE;
@@ -51,6 +52,7 @@ struct CommonStrings {
     // rename this to `x-bd-log-id'.
     // NOTE: Keep in mind that this name also appears inside `http_message.cpp'
     std::string LOG_ID;
+    std::string PRIORITY;
     std::string DEFAULT_METHOD;
     std::string NO_METHOD;
     std::string H2_SCHEME;
@@ -70,7 +72,6 @@ struct CommonStrings {
     std::string TRAILERS;
     std::string GRPC_ENCODING;
     std::string GRPC_ACCEPT_ENCODING;
-    std::string GRPC_ACCEPT_ENCODING_VALUE;
     std::string GRPC_STATUS;
     std::string GRPC_MESSAGE;
     std::string GRPC_TIMEOUT;
@@ -86,7 +87,8 @@ public:
     HttpContext(bool read_body_progressively)
         : InputMessageBase()
         , HttpMessage(read_body_progressively)
-        , _is_stage2(false) {
+        , _is_stage2(false)
+        , _pipelined_correlation_id(0) {
         // add one ref for Destroy
         butil::intrusive_ptr<HttpContext>(this).detach();
     }
@@ -103,6 +105,13 @@ public:
     // True if AddOneRefForStage2() was ever called.
     bool is_stage2() const { return _is_stage2; }
 
+    // Correlation id of the request matching this response on a pipelined
+    // http connection, 0 if the connection is not pipelined.
+    void set_pipelined_correlation_id(uint64_t id)
+    { _pipelined_correlation_id = id; }
+    uint64_t pipelined_correlation_id() const
+    { return _pipelined_correlation_id; }
+
     // @InputMessageBase
     void DestroyImpl() {
         RemoveOneRefForStage2();
@@ -115,6 +124,7 @@ public:
 
 private:
     bool _is_stage2;
+    uint64_t _pipelined_correlation_id;
 };
 
 // Implement functions required in protocol.h
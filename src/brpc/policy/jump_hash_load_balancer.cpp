@@ -0,0 +1,186 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>                                    // std::sort
+#include "butil/containers/flat_map.h"
+#include "brpc/socket.h"
+#include "brpc/policy/jump_hash_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+int32_t JumpHashLoadBalancer::JumpConsistentHash(uint64_t key,
+                                                 int32_t num_buckets) {
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < num_buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+    }
+    return (int32_t)b;
+}
+
+size_t JumpHashLoadBalancer::BatchAdd(std::vector<Node>& bg,
+                                      const std::vector<Node>& nodes) {
+    butil::FlatSet<ServerId> existing;
+    CHECK_EQ(0, existing.init((bg.size() + nodes.size()) * 2 + 1));
+    for (size_t i = 0; i < bg.size(); ++i) {
+        existing.insert(bg[i].server_sock);
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (existing.seek(nodes[i].server_sock) == NULL) {
+            existing.insert(nodes[i].server_sock);
+            bg.push_back(nodes[i]);
+            ++count;
+        }
+    }
+    if (count) {
+        std::sort(bg.begin(), bg.end());
+    }
+    return count;
+}
+
+size_t JumpHashLoadBalancer::BatchRemove(std::vector<Node>& bg,
+                                         const std::vector<ServerId>& servers) {
+    butil::FlatSet<ServerId> removed;
+    CHECK_EQ(0, removed.init(servers.size() * 2 + 1));
+    for (size_t i = 0; i < servers.size(); ++i) {
+        removed.insert(servers[i]);
+    }
+    // Erasing keeps the order.
+    const size_t old_size = bg.size();
+    size_t j = 0;
+    for (size_t i = 0; i < bg.size(); ++i) {
+        if (removed.seek(bg[i].server_sock) == NULL) {
+            bg[j++] = bg[i];
+        }
+    }
+    bg.resize(j);
+    return old_size - j;
+}
+
+static bool GetJumpHashNode(const ServerId& server,
+                            JumpHashLoadBalancer::Node* node) {
+    SocketUniquePtr ptr;
+    if (Socket::AddressFailedAsWell(server.id, &ptr) == -1) {
+        return false;
+    }
+    node->server_sock = server;
+    node->server_addr = ptr->remote_side();
+    return true;
+}
+
+bool JumpHashLoadBalancer::AddServer(const ServerId& server) {
+    std::vector<Node> nodes(1);
+    if (!GetJumpHashNode(server, &nodes[0])) {
+        return false;
+    }
+    return _db_servers.Modify(BatchAdd, nodes) != 0;
+}
+
+bool JumpHashLoadBalancer::RemoveServer(const ServerId& server) {
+    return _db_servers.Modify(
+        BatchRemove, std::vector<ServerId>(1, server)) != 0;
+}
+
+size_t JumpHashLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    std::vector<Node> nodes;
+    nodes.reserve(servers.size());
+    Node node;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (GetJumpHashNode(servers[i], &node)) {
+            nodes.push_back(node);
+        }
+    }
+    const size_t n = _db_servers.Modify(BatchAdd, nodes);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t JumpHashLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.Modify(BatchRemove, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+LoadBalancer* JumpHashLoadBalancer::New(const butil::StringPiece&) const {
+    return new (std::nothrow) JumpHashLoadBalancer;
+}
+
+void JumpHashLoadBalancer::Destroy() {
+    delete this;
+}
+
+int JumpHashLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    if (!in.has_request_code) {
+        LOG(ERROR) << "Controller.set_request_code() is required";
+        return EINVAL;
+    }
+    butil::DoublyBufferedData<std::vector<Node> >::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t n = s->size();
+    if (n == 0) {
+        return ENODATA;
+    }
+    size_t index = JumpConsistentHash(in.request_code, n);
+    for (size_t i = 0; i < n; ++i) {
+        const SocketId id = (*s)[index].server_sock.id;
+        if (((i + 1) == n // always take last chance
+             || !ExcludedServers::IsExcluded(in.excluded, id))
+            && Socket::Address(id, out->ptr) == 0
+            && (*out->ptr)->IsAvailable()) {
+            return 0;
+        }
+        if (++index == n) {
+            index = 0;
+        }
+    }
+    return EHOSTDOWN;
+}
+
+void JumpHashLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "c_jump";
+        return;
+    }
+    os << "JumpHashLoadBalancer{";
+    butil::DoublyBufferedData<std::vector<Node> >::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        os << "fail to read _db_servers";
+    } else {
+        os << "n=" << s->size() << ':';
+        for (size_t i = 0; i < s->size(); ++i) {
+            os << ' ' << (*s)[i].server_addr;
+        }
+    }
+    os << '}';
+}
+
+}  // namespace policy
+} // namespace brpc
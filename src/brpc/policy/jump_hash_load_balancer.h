@@ -0,0 +1,67 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef  BRPC_JUMP_HASH_LOAD_BALANCER_H
+#define  BRPC_JUMP_HASH_LOAD_BALANCER_H
+
+#include <stdint.h>                                     // uint64_t
+#include <vector>                                       // std::vector
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/policy/maglev_load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Consistent hashing described in "A Fast, Minimal Memory, Consistent Hash
+// Algorithm". Servers are sorted by addresses and the request code is
+// mapped to one of them in O(log n) without any extra memory. Only keys
+// of the removed server move when the last server in the order is
+// removed, but removing servers in the middle moves keys of the servers
+// after it as well, use c_maglev if servers change often.
+class JumpHashLoadBalancer : public LoadBalancer {
+public:
+    typedef MaglevLoadBalancer::Node Node;
+
+    bool AddServer(const ServerId& server);
+    bool RemoveServer(const ServerId& server);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    LoadBalancer* New(const butil::StringPiece& params) const;
+    void Destroy();
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Describe(std::ostream& os, const DescribeOptions& options);
+
+    // Returns the bucket of `key' in [0, num_buckets).
+    static int32_t JumpConsistentHash(uint64_t key, int32_t num_buckets);
+
+private:
+    static size_t BatchAdd(std::vector<Node>& bg,
+                           const std::vector<Node>& nodes);
+    static size_t BatchRemove(std::vector<Node>& bg,
+                              const std::vector<ServerId>& servers);
+
+    // Sorted.
+    butil::DoublyBufferedData<std::vector<Node> > _db_servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  //BRPC_JUMP_HASH_LOAD_BALANCER_H
@@ -34,6 +34,12 @@ DEFINE_double(punish_inflight_ratio, 1.5, "Decrease weight proportionally if "
               "latency of the node times this ratio");
 DEFINE_double(punish_error_ratio, 1.2,
               "Multiply latencies caused by errors with this ratio");
+DEFINE_bool(lalb_wait_free_read, false, "SelectServer() of LALB created "
+            "afterwards never waits for adding/removing servers, at the cost "
+            "of a memory fence per selection");
+DEFINE_bool(lalb_use_server_load, true, "Decrease weights of servers "
+            "proportionally to the load reported in their responses, see "
+            "-baidu_protocol_load_report");
 
 static const int64_t DEFAULT_QPS = 1;
 static const size_t INITIAL_WEIGHT_TREE_SIZE = 128;
@@ -42,7 +48,10 @@ static const int64_t WEIGHT_SCALE =
     std::numeric_limits<int64_t>::max() / 72000000 / (INITIAL_WEIGHT_TREE_SIZE - 1);
 
 LocalityAwareLoadBalancer::LocalityAwareLoadBalancer()
-    : _total(0) {
+    : _total(0)
+    , _db_servers(FLAGS_lalb_wait_free_read ?
+                  butil::DOUBLY_BUFFERED_READ_WAIT_FREE :
+                  butil::DOUBLY_BUFFERED_READ_MUTEX) {
 }
 
 LocalityAwareLoadBalancer::~LocalityAwareLoadBalancer() {
@@ -385,6 +394,13 @@ int64_t LocalityAwareLoadBalancer::Weight::Update(
         // time skews, ignore the sample.
         return 0;
     }
+    if (ci.error_code == 0 && ci.controller != NULL &&
+        ci.controller->server_load().reported()) {
+        // Smooth the reported load which is an instant value.
+        const int load = ci.controller->server_load().utilization_permille();
+        _load_permille = (_load_permille < 0 ? load :
+                          (_load_permille * 7 + load) / 8);
+    }
     if (ci.error_code == 0) {
         // Add a new entry
         TimeInfo tm_info = { latency, end_time_us };
@@ -412,9 +428,15 @@ int64_t LocalityAwareLoadBalancer::Weight::Update(
             ndone = ci.controller->retried_count();
             nleft = ci.controller->max_retry() - ndone;
         }
+        const int64_t punished_latency =
+            (int64_t)(latency * FLAGS_punish_error_ratio);
+        // Calls without timeout (e.g. SelectiveChannel with timeout_ms=-1)
+        // are punished by latency only.
+        const int64_t timeout_us = (ci.controller->timeout_ms() > 0 ?
+                                    ci.controller->timeout_ms() * 1000L :
+                                    punished_latency);
         const int64_t err_latency =
-            (nleft * (int64_t)(latency * FLAGS_punish_error_ratio)
-             + ndone * ci.controller->timeout_ms() * 1000L) / (ndone + nleft);
+            (nleft * punished_latency + ndone * timeout_us) / (ndone + nleft);
         
         if (!_time_q.empty()) {
             TimeInfo* ti = _time_q.bottom();
@@ -424,7 +446,7 @@ int64_t LocalityAwareLoadBalancer::Weight::Update(
             // If the first response is error, enlarge the latency as timedout
             // since we know nothing about the normal latency yet.
             const TimeInfo tm_info = {
-                std::max(err_latency, ci.controller->timeout_ms() * 1000L),
+                std::max(err_latency, timeout_us),
                 end_time_us
             };
             _time_q.push(tm_info);
@@ -460,6 +482,13 @@ int64_t LocalityAwareLoadBalancer::Weight::Update(
         return 0;
     }
     _base_weight = scaled_qps / _avg_latency;
+    if (_load_permille > 0 && FLAGS_lalb_use_server_load) {
+        // Latencies reflect the load of servers too late when the load
+        // changes quickly, e.g. other clients start sending to the server.
+        // Keep at least 1/10 of the weight so that the load is still known.
+        _base_weight = _base_weight *
+            (1000 - std::min(_load_permille, 900)) / 1000;
+    }
     return ResetWeight(index, end_time_us);
 }
 
@@ -548,6 +577,7 @@ LocalityAwareLoadBalancer::Weight::Weight(int64_t initial_weight)
     , _old_index((size_t)-1L)
     , _old_weight(0)
     , _avg_latency(0)
+    , _load_permille(-1)
     , _time_q(_time_q_items, sizeof(_time_q_items), butil::NOT_OWN_STORAGE) {
 }
 
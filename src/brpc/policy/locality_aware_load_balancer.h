@@ -101,6 +101,8 @@ private:
         size_t _old_index;
         int64_t _old_weight;
         int64_t _avg_latency;
+        // Smoothed load reported by the server, -1 if it's not reported.
+        int _load_permille;
         butil::BoundedQueue<TimeInfo> _time_q;
         // content of _time_q
         TimeInfo _time_q_items[RECV_QUEUE_SIZE];
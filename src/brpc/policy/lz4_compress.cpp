@@ -0,0 +1,284 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifdef BRPC_WITH_LZ4
+
+#include <lz4frame.h>
+#include "butil/logging.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/protocol.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Compressed output of a piece no larger than SMALL_PIECE always fits in
+// SMALL_CAPACITY bytes.
+static const size_t SMALL_PIECE = 32;
+static const size_t SMALL_CAPACITY = 128;
+
+static void LogError(const char* what, size_t code) {
+    LOG(WARNING) << "Fail to " << what << ": " << LZ4F_getErrorName(code);
+}
+
+namespace {
+// Writes into blocks of an IOBuf.
+class Lz4Output {
+public:
+    explicit Lz4Output(butil::IOBuf* buf)
+        : _stream(buf), _data(NULL), _size(0) {}
+
+    ~Lz4Output() {
+        if (_size != 0) {
+            _stream.BackUp(_size);
+        }
+    }
+
+    // Make sure that there's space left in current block.
+    bool Reserve() {
+        if (_size == 0) {
+            void* data = NULL;
+            int size = 0;
+            if (!_stream.Next(&data, &size)) {
+                LOG(WARNING) << "Fail to allocate output";
+                return false;
+            }
+            _data = (char*)data;
+            _size = size;
+        }
+        return true;
+    }
+
+    bool Append(const char* data, size_t n) {
+        while (n > 0) {
+            if (!Reserve()) {
+                return false;
+            }
+            const size_t len = std::min(n, _size);
+            memcpy(_data, data, len);
+            Consume(len);
+            data += len;
+            n -= len;
+        }
+        return true;
+    }
+
+    char* data() const { return _data; }
+    size_t size() const { return _size; }
+    void Consume(size_t n) {
+        _data += n;
+        _size -= n;
+    }
+
+private:
+    butil::IOBufAsZeroCopyOutputStream _stream;
+    char* _data;
+    size_t _size;
+};
+}  // namespace
+
+// Largest n <= `max_n' whose compressed output fits in `capacity' bytes.
+static size_t FitPiece(size_t max_n, size_t capacity,
+                       const LZ4F_preferences_t& prefs) {
+    size_t n = std::min(max_n, capacity);
+    while (n > 0) {
+        const size_t bound = LZ4F_compressBound(n, &prefs);
+        if (bound <= capacity) {
+            break;
+        }
+        n = (bound - capacity >= n) ? 0 : n - (bound - capacity);
+    }
+    return n;
+}
+
+// LZ4F requires the whole worst-case output to fit in the given buffer.
+// Pieces of input are sized according to space left in current block, and
+// the tail of a block too small for any piece is filled via a small buffer
+// on stack.
+static bool Lz4Write(LZ4F_cctx* cctx, const LZ4F_preferences_t& prefs,
+                     const char* src, size_t n, Lz4Output* out) {
+    while (n > 0) {
+        if (!out->Reserve()) {
+            return false;
+        }
+        size_t piece = FitPiece(n, out->size(), prefs);
+        if (piece > 0) {
+            const size_t rc = LZ4F_compressUpdate(
+                cctx, out->data(), out->size(), src, piece, NULL);
+            if (LZ4F_isError(rc)) {
+                LogError("LZ4F_compressUpdate", rc);
+                return false;
+            }
+            out->Consume(rc);
+        } else {
+            piece = std::min(n, SMALL_PIECE);
+            char buf[SMALL_CAPACITY];
+            const size_t rc = LZ4F_compressUpdate(
+                cctx, buf, sizeof(buf), src, piece, NULL);
+            if (LZ4F_isError(rc)) {
+                LogError("LZ4F_compressUpdate", rc);
+                return false;
+            }
+            if (!out->Append(buf, rc)) {
+                return false;
+            }
+        }
+        src += piece;
+        n -= piece;
+    }
+    return true;
+}
+
+static bool Lz4CompressWithContext(LZ4F_cctx* cctx, const butil::IOBuf& in,
+                                   butil::IOBuf* buf) {
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+    prefs.frameInfo.contentSize = in.size();
+    // Flush every piece so that the output of LZ4F_compressUpdate is
+    // bounded by size of the piece rather than size of the block.
+    prefs.autoFlush = 1;
+    Lz4Output out(buf);
+    char small[SMALL_CAPACITY];
+    BAIDU_CASSERT(sizeof(small) >= LZ4F_HEADER_SIZE_MAX, small_buffer_too_small);
+    size_t rc = LZ4F_compressBegin(cctx, small, sizeof(small), &prefs);
+    if (LZ4F_isError(rc)) {
+        LogError("LZ4F_compressBegin", rc);
+        return false;
+    }
+    if (!out.Append(small, rc)) {
+        return false;
+    }
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        const butil::StringPiece blk = in.backing_block(i);
+        if (!Lz4Write(cctx, prefs, blk.data(), blk.size(), &out)) {
+            return false;
+        }
+    }
+    rc = LZ4F_compressEnd(cctx, small, sizeof(small), NULL);
+    if (LZ4F_isError(rc)) {
+        LogError("LZ4F_compressEnd", rc);
+        return false;
+    }
+    return out.Append(small, rc);
+}
+
+static bool Lz4DecompressWithContext(LZ4F_dctx* dctx,
+                                     const butil::IOBuf& in,
+                                     butil::IOBuf* buf) {
+    Lz4Output out(buf);
+    // 0 when a frame is fully decoded.
+    size_t hint = 1;
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        const butil::StringPiece blk = in.backing_block(i);
+        const char* src = blk.data();
+        size_t left = blk.size();
+        while (left > 0) {
+            if (hint == 0) {
+                LOG(WARNING) << "Unexpected data after the lz4 frame";
+                return false;
+            }
+            if (!out.Reserve()) {
+                return false;
+            }
+            size_t dst_size = out.size();
+            size_t src_size = left;
+            hint = LZ4F_decompress(dctx, out.data(), &dst_size,
+                                   src, &src_size, NULL);
+            if (LZ4F_isError(hint)) {
+                LogError("LZ4F_decompress", hint);
+                return false;
+            }
+            out.Consume(dst_size);
+            src += src_size;
+            left -= src_size;
+        }
+    }
+    // Flush output buffered inside the context due to full blocks.
+    while (hint != 0) {
+        if (!out.Reserve()) {
+            return false;
+        }
+        size_t dst_size = out.size();
+        size_t src_size = 0;
+        hint = LZ4F_decompress(dctx, out.data(), &dst_size,
+                               NULL, &src_size, NULL);
+        if (LZ4F_isError(hint)) {
+            LogError("LZ4F_decompress", hint);
+            return false;
+        }
+        if (dst_size == 0) {
+            break;
+        }
+        out.Consume(dst_size);
+    }
+    if (hint != 0) {
+        LOG(WARNING) << "Incomplete lz4 frame, size=" << in.size();
+        return false;
+    }
+    return true;
+}
+
+bool Lz4Compress(const butil::IOBuf& in, butil::IOBuf* out) {
+    LZ4F_cctx* cctx = NULL;
+    const size_t rc = LZ4F_createCompressionContext(&cctx, LZ4F_VERSION);
+    if (LZ4F_isError(rc)) {
+        LogError("LZ4F_createCompressionContext", rc);
+        return false;
+    }
+    const bool ok = Lz4CompressWithContext(cctx, in, out);
+    LZ4F_freeCompressionContext(cctx);
+    return ok;
+}
+
+bool Lz4Decompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    LZ4F_dctx* dctx = NULL;
+    const size_t rc = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+    if (LZ4F_isError(rc)) {
+        LogError("LZ4F_createDecompressionContext", rc);
+        return false;
+    }
+    const bool ok = Lz4DecompressWithContext(dctx, in, out);
+    LZ4F_freeDecompressionContext(dctx);
+    return ok;
+}
+
+bool Lz4Compress(const google::protobuf::Message& res, butil::IOBuf* buf) {
+    butil::IOBuf serialized_pb;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&serialized_pb);
+    if (res.SerializeToZeroCopyStream(&wrapper)) {
+        return Lz4Compress(serialized_pb, buf);
+    }
+    LOG(WARNING) << "Fail to serialize input pb=" << &res;
+    return false;
+}
+
+bool Lz4Decompress(const butil::IOBuf& data, google::protobuf::Message* req) {
+    butil::IOBuf binary_pb;
+    if (Lz4Decompress(data, &binary_pb)) {
+        return ParsePbFromIOBuf(req, binary_pb);
+    }
+    return false;
+}
+
+}  // namespace policy
+} // namespace brpc
+
+#endif  // BRPC_WITH_LZ4
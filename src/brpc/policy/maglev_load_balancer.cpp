@@ -0,0 +1,298 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>                                    // std::sort
+#include <gflags/gflags.h>
+#include "butil/containers/flat_map.h"
+#include "butil/strings/string_number_conversions.h"
+#include "brpc/socket.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/hasher.h"
+#include "brpc/policy/maglev_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+static bool IsPrime(uint64_t n) {
+    if (n < 2) {
+        return false;
+    }
+    for (uint64_t i = 2; i * i <= n; ++i) {
+        if (n % i == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool ValidateMaglevTableSize(const char*, int32_t val) {
+    return IsPrime(val);
+}
+
+DEFINE_int32(maglev_table_size, 65537, "Number of slots in the lookup table "
+             "of c_maglev, must be a prime. Servers are balanced better when "
+             "it is much larger than number of servers, such as 100 times");
+BRPC_VALIDATE_GFLAG(maglev_table_size, ValidateMaglevTableSize);
+
+static bool GetNode(const ServerId& server, MaglevLoadBalancer::Node* node) {
+    SocketUniquePtr ptr;
+    if (Socket::AddressFailedAsWell(server.id, &ptr) == -1) {
+        return false;
+    }
+    node->server_sock = server;
+    node->server_addr = ptr->remote_side();
+    return true;
+}
+
+void MaglevLoadBalancer::BuildTable(const std::vector<Node>& nodes,
+                                    size_t table_size,
+                                    std::vector<uint32_t>* table) {
+    table->clear();
+    if (nodes.empty()) {
+        return;
+    }
+    const size_t n = nodes.size();
+    // The permutation of node i is (offset[i] + j * skip[i]) % table_size,
+    // which visits every slot since table_size is a prime.
+    std::vector<uint64_t> offset(n);
+    std::vector<uint64_t> skip(n);
+    std::vector<uint64_t> next(n, 0);
+    for (size_t i = 0; i < n; ++i) {
+        std::string name = endpoint2str(nodes[i].server_addr).c_str();
+        if (!nodes[i].server_sock.tag.empty()) {
+            name.push_back('-');
+            name.append(nodes[i].server_sock.tag);
+        }
+        offset[i] = MurmurHash32(name.data(), name.size()) % table_size;
+        skip[i] = MD5Hash32(name.data(), name.size()) % (table_size - 1) + 1;
+    }
+    const uint32_t EMPTY = (uint32_t)-1;
+    table->assign(table_size, EMPTY);
+    size_t nfilled = 0;
+    while (true) {
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t slot = (offset[i] + next[i] * skip[i]) % table_size;
+            while ((*table)[slot] != EMPTY) {
+                ++next[i];
+                slot = (offset[i] + next[i] * skip[i]) % table_size;
+            }
+            (*table)[slot] = i;
+            ++next[i];
+            if (++nfilled == table_size) {
+                return;
+            }
+        }
+    }
+}
+
+MaglevLoadBalancer::MaglevLoadBalancer()
+    : _table_size(FLAGS_maglev_table_size) {
+}
+
+size_t MaglevLoadBalancer::Update(Servers& bg, const Servers& fg,
+                                  const Change& change, size_t* nchanged) {
+    if (*nchanged) {
+        // Hack DBD: `fg' is the one rebuilt in the first call.
+        bg = fg;
+        return *nchanged;
+    }
+    butil::FlatSet<ServerId> removed;
+    if (!change.removed.empty()) {
+        CHECK_EQ(0, removed.init(change.removed.size() * 2));
+        for (size_t i = 0; i < change.removed.size(); ++i) {
+            removed.insert(change.removed[i]);
+        }
+    }
+    butil::FlatSet<ServerId> existing;
+    CHECK_EQ(0, existing.init((fg.nodes.size() + change.added.size()) * 2 + 1));
+    std::vector<Node> nodes;
+    nodes.reserve(fg.nodes.size() + change.added.size());
+    size_t n = 0;
+    for (size_t i = 0; i < fg.nodes.size(); ++i) {
+        if (!removed.empty() && removed.seek(fg.nodes[i].server_sock) != NULL) {
+            ++n;
+            continue;
+        }
+        existing.insert(fg.nodes[i].server_sock);
+        nodes.push_back(fg.nodes[i]);
+    }
+    for (size_t i = 0; i < change.added.size(); ++i) {
+        if (existing.seek(change.added[i].server_sock) == NULL) {
+            existing.insert(change.added[i].server_sock);
+            nodes.push_back(change.added[i]);
+            ++n;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    std::sort(nodes.begin(), nodes.end());
+    bg.nodes.swap(nodes);
+    BuildTable(bg.nodes, change.table_size, &bg.table);
+    *nchanged = n;
+    return n;
+}
+
+size_t MaglevLoadBalancer::Apply(const Change& change) {
+    size_t nchanged = 0;
+    return _db_servers.ModifyWithForeground(Update, change, &nchanged);
+}
+
+bool MaglevLoadBalancer::AddServer(const ServerId& server) {
+    Change change;
+    change.table_size = _table_size;
+    change.added.resize(1);
+    if (!GetNode(server, &change.added[0])) {
+        return false;
+    }
+    return Apply(change) != 0;
+}
+
+bool MaglevLoadBalancer::RemoveServer(const ServerId& server) {
+    Change change;
+    change.table_size = _table_size;
+    change.removed.push_back(server);
+    return Apply(change) != 0;
+}
+
+size_t MaglevLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    Change change;
+    change.table_size = _table_size;
+    change.added.reserve(servers.size());
+    Node node;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (GetNode(servers[i], &node)) {
+            change.added.push_back(node);
+        }
+    }
+    const size_t n = Apply(change);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t MaglevLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    Change change;
+    change.table_size = _table_size;
+    change.removed = servers;
+    const size_t n = Apply(change);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+LoadBalancer* MaglevLoadBalancer::New(const butil::StringPiece& params) const {
+    MaglevLoadBalancer* lb = new (std::nothrow) MaglevLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        lb = NULL;
+    }
+    return lb;
+}
+
+void MaglevLoadBalancer::Destroy() {
+    delete this;
+}
+
+int MaglevLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    if (!in.has_request_code) {
+        LOG(ERROR) << "Controller.set_request_code() is required";
+        return EINVAL;
+    }
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t table_size = s->table.size();
+    if (table_size == 0) {
+        return ENODATA;
+    }
+    size_t slot = in.request_code % table_size;
+    uint32_t last_index = (uint32_t)-1;
+    for (size_t i = 0; i < table_size; ++i) {
+        const uint32_t index = s->table[slot];
+        if (++slot == table_size) {
+            slot = 0;
+        }
+        if (index == last_index && (i + 1) != table_size) {
+            // Tried just now.
+            continue;
+        }
+        last_index = index;
+        const SocketId id = s->nodes[index].server_sock.id;
+        if (((i + 1) == table_size // always take last chance
+             || !ExcludedServers::IsExcluded(in.excluded, id))
+            && Socket::Address(id, out->ptr) == 0
+            && (*out->ptr)->IsAvailable()) {
+            return 0;
+        }
+    }
+    return EHOSTDOWN;
+}
+
+void MaglevLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "c_maglev";
+        return;
+    }
+    os << "MaglevLoadBalancer {\n"
+       << "  table size: " << _table_size << '\n';
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        os << "  fail to read _db_servers\n}\n";
+        return;
+    }
+    std::vector<size_t> slots(s->nodes.size(), 0);
+    for (size_t i = 0; i < s->table.size(); ++i) {
+        ++slots[s->table[i]];
+    }
+    os << "  number of hosts: " << s->nodes.size() << '\n';
+    os << "  slots of hosts: {\n";
+    for (size_t i = 0; i < s->nodes.size(); ++i) {
+        os << "    " << s->nodes[i].server_addr << ": " << slots[i] << '\n';
+    }
+    os << "  }\n}\n";
+}
+
+bool MaglevLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+            sp; ++sp) {
+        if (sp.value().empty()) {
+            LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+            return false;
+        }
+        if (sp.key() == "table_size") {
+            if (!butil::StringToSizeT(sp.value(), &_table_size)
+                || !IsPrime(_table_size)) {
+                LOG(ERROR) << "table_size must be a prime, got " << sp.value();
+                return false;
+            }
+            continue;
+        }
+        LOG(ERROR) << "Failed to set this unknown parameters " << sp.key_and_value();
+    }
+    return true;
+}
+
+}  // namespace policy
+} // namespace brpc
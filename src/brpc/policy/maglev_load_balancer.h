@@ -0,0 +1,91 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef  BRPC_MAGLEV_LOAD_BALANCER_H
+#define  BRPC_MAGLEV_LOAD_BALANCER_H
+
+#include <stdint.h>                                     // uint32_t
+#include <vector>                                       // std::vector
+#include "butil/endpoint.h"                             // butil::EndPoint
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+
+
+namespace brpc {
+namespace policy {
+
+// Consistent hashing described in "Maglev: A Fast and Reliable Software
+// Network Load Balancer". Every server fills slots of a lookup table in
+// the order of its own permutation, so that servers own almost equal
+// numbers of slots and few slots change owners when servers are added or
+// removed. Selecting a server is one lookup of the table, and memory is
+// fixed by the table size instead of number of servers times replicas.
+class MaglevLoadBalancer : public LoadBalancer {
+public:
+    struct Node {
+        ServerId server_sock;
+        butil::EndPoint server_addr;  // To make the table same among all clients
+        bool operator<(const Node& rhs) const {
+            if (server_addr < rhs.server_addr) { return true; }
+            if (rhs.server_addr < server_addr) { return false; }
+            return server_sock.tag < rhs.server_sock.tag;
+        }
+    };
+    struct Servers {
+        // Sorted.
+        std::vector<Node> nodes;
+        // Indexes of `nodes'.
+        std::vector<uint32_t> table;
+    };
+
+    MaglevLoadBalancer();
+    bool AddServer(const ServerId& server);
+    bool RemoveServer(const ServerId& server);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    LoadBalancer* New(const butil::StringPiece& params) const;
+    void Destroy();
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Describe(std::ostream& os, const DescribeOptions& options);
+
+    // Fill `table' of `table_size' slots with indexes of `nodes'.
+    static void BuildTable(const std::vector<Node>& nodes, size_t table_size,
+                           std::vector<uint32_t>* table);
+
+private:
+    struct Change {
+        std::vector<Node> added;
+        std::vector<ServerId> removed;
+        size_t table_size;
+    };
+    bool SetParameters(const butil::StringPiece& params);
+    // Apply `change' to `fg' and rebuild the table into `bg'. The second
+    // call after flipping just copies the rebuilt one.
+    static size_t Update(Servers& bg, const Servers& fg,
+                         const Change& change, size_t* nchanged);
+    size_t Apply(const Change& change);
+
+    size_t _table_size;
+    butil::DoublyBufferedData<Servers> _db_servers;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  //BRPC_MAGLEV_LOAD_BALANCER_H
@@ -35,6 +35,7 @@
 #include "brpc/memcache.h"
 #include "brpc/policy/most_common_message.h"
 #include "butil/containers/flat_map.h"
+#include "brpc/reloadable_flags.h"
 
 
 namespace brpc {
@@ -43,6 +44,12 @@ DECLARE_bool(enable_rpcz);
 
 namespace policy {
 
+DEFINE_int32(memcache_batch_window_us, 0,
+             "Requests sent over a single connection within so many "
+             "microseconds are combined into one write, 0 to write requests "
+             "immediately");
+BRPC_VALIDATE_GFLAG(memcache_batch_window_us, NonNegativeInteger);
+
 BAIDU_CASSERT(sizeof(MemcacheRequestHeader) == 24, must_match);
 BAIDU_CASSERT(sizeof(MemcacheResponseHeader) == 24, must_match);
 
@@ -52,6 +59,7 @@ static pthread_once_t supported_cmd_map_once = PTHREAD_ONCE_INIT;
 static void InitSupportedCommandMap() {
     butil::bit_array_clear(supported_cmd_map, 256);
     butil::bit_array_set(supported_cmd_map, MC_BINARY_GET);
+    butil::bit_array_set(supported_cmd_map, MC_BINARY_GETKQ);
     butil::bit_array_set(supported_cmd_map, MC_BINARY_SET);
     butil::bit_array_set(supported_cmd_map, MC_BINARY_ADD);
     butil::bit_array_set(supported_cmd_map, MC_BINARY_REPLACE);
@@ -137,6 +145,10 @@ ParseResult ParseMemcacheMessage(butil::IOBuf* source,
             DestroyingPtr<MostCommonMessage> auth_msg(
                  static_cast<MostCommonMessage*>(socket->release_parsing_context()));
             socket->GivebackPipelinedInfo(pi);
+        } else if (header->command == MC_BINARY_GETKQ) {
+            // Quiet gets are not counted in pipelined_count since misses
+            // are not replied, the NOOP following them is.
+            socket->GivebackPipelinedInfo(pi);
         } else {
             if (++msg->pi.count >= pi.count) {
                 CHECK_EQ(msg->pi.count, pi.count);
@@ -221,6 +233,12 @@ void PackMemcacheRequest(butil::IOBuf* buf,
         buf->append(auth_str);
     }
     buf->append(request);
+    if (cntl->connection_type() == CONNECTION_TYPE_SINGLE) {
+        // Responses are matched with requests by PipelinedInfo, no matter
+        // how requests are combined.
+        ControllerPrivateAccessor(cntl).get_sending_socket()
+            ->set_write_coalescing_us(FLAGS_memcache_batch_window_us);
+    }
 }
 
 const std::string& GetMemcacheMethodName(
@@ -20,6 +20,8 @@
 #include <gflags/gflags.h>
 #include "butil/time.h" 
 #include "butil/iobuf.h"                         // butil::IOBuf
+#include "butil/crc32c.h"
+#include "butil/sys_byteorder.h"
 #include "brpc/controller.h"               // Controller
 #include "brpc/socket.h"                   // Socket
 #include "brpc/server.h"                   // Server
@@ -41,6 +43,151 @@ void bthread_assign_data(void* data);
 namespace brpc {
 namespace policy {
 
+// Integers in mongo messages are little-endian.
+inline void AppendLE32(butil::IOBuf* out, uint32_t v) {
+    v = butil::ByteSwapToLE32(v);
+    out->append(&v, sizeof(v));
+}
+
+inline uint32_t ReadLE32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return butil::ByteSwapToLE32(v);
+}
+
+static uint32_t MongoChecksum(const butil::IOBuf& buf) {
+    uint32_t crc = 0;
+    const size_t nblock = buf.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        const butil::StringPiece blk = buf.backing_block(i);
+        crc = butil::crc32c::Extend(crc, blk.data(), blk.size());
+    }
+    return crc;
+}
+
+// Parse flag bits and sections of OP_MSG from `body' which is the message
+// following `head'. The checksum is verified if present.
+static bool ParseMongoMsg(const butil::IOBuf& head, const std::string& body,
+                          MongoRequest* req, std::string* error) {
+    if (body.size() < 4) {
+        *error = "OP_MSG is too short";
+        return false;
+    }
+    const uint32_t flag_bits = ReadLE32(body.data());
+    size_t end = body.size();
+    if (flag_bits & MONGO_MSG_CHECKSUM_PRESENT) {
+        if (end < 8) {
+            *error = "OP_MSG is too short to contain checksum";
+            return false;
+        }
+        end -= 4;
+        uint32_t crc = MongoChecksum(head);
+        crc = butil::crc32c::Extend(crc, body.data(), end);
+        if (crc != ReadLE32(body.data() + end)) {
+            *error = "Checksum of OP_MSG does not match";
+            return false;
+        }
+    }
+    req->set_flag_bits(flag_bits);
+    size_t pos = 4;
+    while (pos < end) {
+        const int32_t kind = (uint8_t)body[pos++];
+        MongoMsgSection* section = req->add_sections();
+        section->set_kind(kind);
+        size_t docs_end = 0;
+        if (kind == 0) {
+            // The body section contains only one document.
+            if (end - pos < 4) {
+                *error = "Fail to read size of the body document";
+                return false;
+            }
+            docs_end = pos + ReadLE32(body.data() + pos);
+        } else if (kind == 1) {
+            if (end - pos < 4) {
+                *error = "Fail to read size of the document sequence";
+                return false;
+            }
+            const uint32_t size = ReadLE32(body.data() + pos);
+            if (size < 4 || size > end - pos) {
+                *error = "Invalid size of the document sequence";
+                return false;
+            }
+            docs_end = pos + size;
+            pos += 4;
+            const size_t id_end = body.find('\0', pos);
+            if (id_end == std::string::npos || id_end >= docs_end) {
+                *error = "Fail to read identifier of the document sequence";
+                return false;
+            }
+            section->set_identifier(body.data() + pos, id_end - pos);
+            pos = id_end + 1;
+        } else {
+            *error = "Unknown kind of section";
+            return false;
+        }
+        if (docs_end > end) {
+            *error = "Section exceeds the message";
+            return false;
+        }
+        while (pos < docs_end) {
+            const uint32_t doc_size =
+                (docs_end - pos >= 4 ? ReadLE32(body.data() + pos) : 0);
+            if (doc_size < 5 || doc_size > docs_end - pos) {
+                *error = "Invalid size of the document";
+                return false;
+            }
+            section->add_documents(body.data() + pos, doc_size);
+            pos += doc_size;
+        }
+    }
+    return true;
+}
+
+// Serialize `res' and `raw_sections' as an OP_MSG reply into `out'.
+static void SerializeMongoMsg(const MongoResponse& res, uint32_t flag_bits,
+                              const butil::IOBuf& raw_sections,
+                              butil::IOBuf* out) {
+    butil::IOBuf body;
+    AppendLE32(&body, flag_bits);
+    for (int i = 0; i < res.sections_size(); ++i) {
+        const MongoMsgSection& section = res.sections(i);
+        const char kind = (char)section.kind();
+        body.push_back(kind);
+        if (section.kind() == 1) {
+            uint32_t size = 4 + section.identifier().size() + 1;
+            for (int j = 0; j < section.documents_size(); ++j) {
+                size += section.documents(j).size();
+            }
+            AppendLE32(&body, size);
+            body.append(section.identifier());
+            body.push_back('\0');
+        } else {
+            LOG_IF(ERROR, section.documents_size() != 1)
+                << "Section of kind 0 should contain exactly one document";
+        }
+        for (int j = 0; j < section.documents_size(); ++j) {
+            body.append(section.documents(j));
+        }
+    }
+    body.append(raw_sections);
+    const bool checksum = (flag_bits & MONGO_MSG_CHECKSUM_PRESENT);
+    mongo_head_t header = {
+        (int32_t)(sizeof(mongo_head_t) + body.size() + (checksum ? 4 : 0)),
+        res.header().request_id(),
+        res.header().response_to(),
+        MONGO_OPCODE_OP_MSG
+    };
+    header.make_host_endian();
+    const size_t old_size = out->size();
+    out->append(&header, sizeof(header));
+    out->append(butil::IOBuf::Movable(body));
+    if (checksum) {
+        butil::IOBuf msg;
+        out->append_to(&msg, out->size() - old_size, old_size);
+        AppendLE32(out, MongoChecksum(msg));
+    }
+}
+
 struct SendMongoResponse : public google::protobuf::Closure {
     SendMongoResponse(const Server *server) :
         status(NULL),
@@ -76,6 +223,9 @@ void SendMongoResponse::Run() {
     butil::IOBuf res_buf;
     if (cntl.Failed()) {
         adaptor->SerializeError(res.header().response_to(), &res_buf);
+    } else if (res.header().op_code() == OP_MSG) {
+        SerializeMongoMsg(res, res.flag_bits() & ~MONGO_MSG_MORE_TO_COME,
+                          cntl.response_attachment(), &res_buf);
     } else if (res.has_message()) {
         mongo_head_t header = {
             res.header().message_length(),
@@ -107,6 +257,10 @@ void SendMongoResponse::Run() {
     }
 }
 
+// Request ids of replies streamed by WriteMongoMsgBatch().
+static butil::static_atomic<int32_t> g_mongo_batch_request_id =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+
 ParseResult ParseMongoMessage(butil::IOBuf* source,
                               Socket* socket, bool /*read_eof*/, const void *arg) {
     const Server* server = static_cast<const Server*>(arg);
@@ -268,6 +422,15 @@ void ProcessMongoRequest(InputMessageBase* msg_base) {
         mongo_done->req.mutable_header()->set_op_code(
                 static_cast<MongoOp>(header->op_code));
         mongo_done->res.mutable_header()->set_response_to(header->request_id);
+        if (header->op_code == MONGO_OPCODE_OP_MSG) {
+            std::string error;
+            if (!ParseMongoMsg(msg->meta, body_str, &mongo_done->req, &error)) {
+                mongo_done->cntl.SetFailed(EREQUEST, "%s", error.c_str());
+                break;
+            }
+            // Reply in OP_MSG as well.
+            mongo_done->res.mutable_header()->set_op_code(OP_MSG);
+        }
         mongo_done->received_us = msg->received_us();
 
         google::protobuf::Service* svc = mp->service;
@@ -295,4 +458,32 @@ void ProcessMongoRequest(InputMessageBase* msg_base) {
 }
 
 }  // namespace policy
+
+int WriteMongoMsgBatch(Controller* cntl, policy::MongoResponse* res) {
+    using namespace policy;
+    Socket* socket = ControllerPrivateAccessor(cntl).get_sending_socket();
+    if (socket == NULL) {
+        LOG(ERROR) << "Not a server-side controller";
+        return -1;
+    }
+    MongoHeader* header = res->mutable_header();
+    const int32_t request_id =
+        g_mongo_batch_request_id.fetch_add(1, butil::memory_order_relaxed) + 1;
+    header->set_request_id(request_id);
+    butil::IOBuf buf;
+    SerializeMongoMsg(*res, res->flag_bits() | MONGO_MSG_MORE_TO_COME,
+                      cntl->response_attachment(), &buf);
+    res->clear_sections();
+    cntl->response_attachment().clear();
+    // Next reply of the exhaust cursor is a response to this one.
+    header->set_response_to(request_id);
+    header->set_request_id(
+        g_mongo_batch_request_id.fetch_add(1, butil::memory_order_relaxed) + 1);
+    if (socket->Write(&buf) != 0) {
+        PLOG(WARNING) << "Fail to write into " << *socket;
+        return -1;
+    }
+    return 0;
+}
+
 } // namespace brpc
@@ -21,7 +21,21 @@
 
 #include "butil/object_pool.h"
 #include "brpc/input_messenger.h"
+#include "brpc/progressive_reader.h"
 
+namespace brpc {
+namespace policy {
+struct MostCommonMessage;
+}  // namespace policy
+}  // namespace brpc
+
+namespace butil {
+// Messages are not referenced after DestroyImpl(), let trim_object_pools()
+// free memory of them after traffic spikes.
+template <> struct ObjectPoolAllowTrim<brpc::policy::MostCommonMessage> {
+    static const bool value = true;
+};
+}  // namespace butil
 
 namespace brpc {
 namespace policy {
@@ -34,6 +48,8 @@ struct BAIDU_CACHELINE_ALIGNMENT MostCommonMessage : public InputMessageBase {
     butil::IOBuf meta;
     butil::IOBuf payload;
     PipelinedInfo pi;
+    // Non-NULL if the attachment is read progressively after the message.
+    butil::intrusive_ptr<ReadableProgressiveAttachment> rpa;
 
     inline static MostCommonMessage* Get() {
         return butil::get_object<MostCommonMessage>();
@@ -44,6 +60,7 @@ struct BAIDU_CACHELINE_ALIGNMENT MostCommonMessage : public InputMessageBase {
         meta.clear();
         payload.clear();
         pi.reset();
+        rpa.reset(NULL);
         butil::return_object(this);
     }
 };
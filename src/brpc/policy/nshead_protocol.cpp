@@ -31,6 +31,7 @@
 #include "brpc/nshead_service.h"
 #include "brpc/policy/most_common_message.h"
 #include "brpc/policy/nshead_protocol.h"
+#include "brpc/policy/seq_id_correlator.h"
 #include "brpc/details/usercode_backup_pool.h"
 
 extern "C" {
@@ -137,8 +138,15 @@ void NsheadClosure::SetMethodName(const std::string& full_method_name) {
 
 namespace policy {
 
+DEFINE_bool(nshead_match_response_by_log_id, false,
+            "Match responses with requests over single connections by log_id "
+            "of nshead which is overwritten with a unique number for each "
+            "request, servers echoing log_id may answer out of order. When "
+            "it's off, responses are matched in the order of sending");
+
 ParseResult ParseNsheadMessage(butil::IOBuf* source,
-                               Socket*, bool /*read_eof*/, const void* /*arg*/) {
+                               Socket* socket, bool /*read_eof*/,
+                               const void* /*arg*/) {
     char header_buf[sizeof(nshead_t)];
     const size_t n = source->copy_to(header_buf, sizeof(header_buf));
     if (n < offsetof(nshead_t, magic_num) + 4) {
@@ -165,6 +173,11 @@ ParseResult ParseNsheadMessage(butil::IOBuf* source,
     policy::MostCommonMessage* msg = policy::MostCommonMessage::Get();
     source->cutn(&msg->meta, sizeof(header_buf));
     source->cutn(&msg->payload, body_len);
+    if (socket->CreatedByConnect()) {
+        // Responses to requests pipelined in order, must be popped here
+        // rather than in ProcessNsheadResponse() which runs concurrently.
+        socket->PopPipelinedInfo(&msg->pi);
+    }
     return MakeMessage(msg);
 }
 
@@ -329,8 +342,24 @@ void ProcessNsheadResponse(InputMessageBase* msg_base) {
     const int64_t start_parse_us = butil::cpuwide_time_us();
     DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage*>(msg_base));
     
+    Socket* socket = msg->socket();
+
     // Fetch correlation id that we saved before in `PackNsheadRequest'
-    const CallId cid = { static_cast<uint64_t>(msg->socket()->correlation_id()) };
+    CallId cid = { static_cast<uint64_t>(socket->correlation_id()) };
+    SeqIdCorrelator* correlator =
+        static_cast<SeqIdCorrelator*>(socket->parsing_context());
+    if (msg->pi.id_wait != INVALID_BTHREAD_ID) {
+        cid = msg->pi.id_wait;
+    } else if (correlator != NULL) {
+        nshead_t head;
+        msg->meta.copy_to(&head, sizeof(head));
+        if (!correlator->RemoveRequest(head.log_id, &cid.value)) {
+            // The RPC was probably timed out and its log_id was reused.
+            LOG(WARNING) << "Fail to find the request with log_id="
+                         << head.log_id << " sent to " << *socket;
+            return;
+        }
+    }
     Controller* cntl = NULL;
     const int rc = bthread_id_lock(cid, (void**)&cntl);
     if (rc != 0) {
@@ -402,14 +431,6 @@ void PackNsheadRequest(
     const butil::IOBuf& request,
     const Authenticator*) {
     ControllerPrivateAccessor accessor(cntl);
-    if (cntl->connection_type() == CONNECTION_TYPE_SINGLE) {
-        return cntl->SetFailed(
-            EINVAL, "nshead protocol can't work with CONNECTION_TYPE_SINGLE");
-    }
-    // Store `correlation_id' into the socket since nshead protocol can't
-    // pack the field.
-    accessor.get_sending_socket()->set_correlation_id(correlation_id);
-
     Span* span = accessor.span();
     if (span) {
         span->set_request_size(request.length());
@@ -418,7 +439,32 @@ void PackNsheadRequest(
         // request_meta->set_span_id(span->span_id());
         // request_meta->set_parent_span_id(span->parent_span_id());
     }
-    packet_buf->append(request);
+
+    Socket* sock = accessor.get_sending_socket();
+    if (cntl->connection_type() != CONNECTION_TYPE_SINGLE) {
+        // Store `correlation_id' into the socket since nshead protocol can't
+        // pack the field.
+        sock->set_correlation_id(correlation_id);
+        packet_buf->append(request);
+        return;
+    }
+    if (!FLAGS_nshead_match_response_by_log_id) {
+        // Responses are matched with requests in the order of sending, see
+        // ParseNsheadMessage().
+        accessor.set_pipelined_count(1);
+        packet_buf->append(request);
+        return;
+    }
+    // Overwrite log_id with a number echoed back by the server to find
+    // this RPC.
+    butil::IOBuf body = request;
+    nshead_t head;
+    if (body.cutn(&head, sizeof(head)) != sizeof(head)) {
+        return cntl->SetFailed(EREQUEST, "Fail to cut nshead from request");
+    }
+    head.log_id = SeqIdCorrelator::Get(sock)->AddRequest(correlation_id);
+    packet_buf->append(&head, sizeof(head));
+    packet_buf->append(butil::IOBuf::Movable(body));
 }
 
 } // namespace policy
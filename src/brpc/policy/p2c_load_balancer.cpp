@@ -0,0 +1,313 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <cmath>                                       // std::exp
+#include <algorithm>                                   // std::max
+#include <gflags/gflags.h>
+#include "butil/macros.h"
+#include "butil/fast_rand.h"
+#include "butil/time.h"
+#include "brpc/socket.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/policy/p2c_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+DEFINE_int32(p2c_latency_decay_ms, 10000, "Latencies remembered by p2c "
+             "load balancer decay by e every so many milliseconds");
+BRPC_VALIDATE_GFLAG(p2c_latency_decay_ms, PositiveInteger);
+
+const uint32_t p2c_prime_offset[] = {
+#include "bthread/offset_inl.list"
+};
+
+inline uint32_t GenP2CRandomStride() {
+    return p2c_prime_offset[
+        butil::fast_rand_less_than(ARRAY_SIZE(p2c_prime_offset))];
+}
+
+P2CLoadBalancer::P2CLoadBalancer()
+    : _db_servers(butil::DOUBLY_BUFFERED_READ_WAIT_FREE) {
+}
+
+bool P2CLoadBalancer::Add(Servers& bg, const Servers& fg,
+                          const ServerId& id) {
+    if (bg.server_list.capacity() < 128) {
+        bg.server_list.reserve(128);
+    }
+    if (bg.server_map.seek(id.id) != NULL) {
+        return false;
+    }
+    Node node;
+    node.server = id;
+    const size_t* pindex = fg.server_map.seek(id.id);
+    if (pindex != NULL) {
+        // Added to the other buffer just now, share the stat.
+        node.stat = fg.server_list[*pindex].stat;
+    } else {
+        node.stat = std::make_shared<Stat>();
+    }
+    bg.server_map[id.id] = bg.server_list.size();
+    bg.server_list.push_back(node);
+    return true;
+}
+
+bool P2CLoadBalancer::Remove(Servers& bg, const ServerId& id) {
+    size_t* pindex = bg.server_map.seek(id.id);
+    if (pindex == NULL) {
+        return false;
+    }
+    const size_t index = *pindex;
+    bg.server_list[index] = bg.server_list.back();
+    bg.server_map[bg.server_list[index].server.id] = index;
+    bg.server_list.pop_back();
+    bg.server_map.erase(id.id);
+    return true;
+}
+
+size_t P2CLoadBalancer::BatchAdd(Servers& bg, const Servers& fg,
+                                 const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!Add(bg, fg, servers[i]);
+    }
+    return count;
+}
+
+size_t P2CLoadBalancer::BatchRemove(Servers& bg,
+                                    const std::vector<ServerId>& servers) {
+    size_t count = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        count += !!Remove(bg, servers[i]);
+    }
+    return count;
+}
+
+bool P2CLoadBalancer::AddServer(const ServerId& id) {
+    return _db_servers.ModifyWithForeground(Add, id);
+}
+
+bool P2CLoadBalancer::RemoveServer(const ServerId& id) {
+    return _db_servers.Modify(Remove, id);
+}
+
+size_t P2CLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.ModifyWithForeground(BatchAdd, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to AddServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+size_t P2CLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    const size_t n = _db_servers.Modify(BatchRemove, servers);
+    LOG_IF(ERROR, n != servers.size())
+        << "Fail to RemoveServersInBatch, expected " << servers.size()
+        << " actually " << n;
+    return n;
+}
+
+// Latency decayed to now, which is never less than 1 so that idle
+// servers are still compared by inflight calls.
+static int64_t DecayedLatency(int64_t ewma_latency_us, int64_t last_update_us,
+                              int64_t now_us) {
+    if (ewma_latency_us <= 0) {
+        return 1;
+    }
+    const int64_t elapsed_us = now_us - last_update_us;
+    if (elapsed_us > 0) {
+        ewma_latency_us = (int64_t)(ewma_latency_us * std::exp(
+            -(double)elapsed_us / (FLAGS_p2c_latency_decay_ms * 1000L)));
+    }
+    return std::max(ewma_latency_us, (int64_t)1);
+}
+
+int64_t P2CLoadBalancer::Cost(const Stat& stat, int64_t now_us) {
+    const int64_t latency = DecayedLatency(
+        stat.ewma_latency_us.load(butil::memory_order_relaxed),
+        stat.last_update_us.load(butil::memory_order_relaxed), now_us);
+    const int32_t inflight = stat.inflight.load(butil::memory_order_relaxed);
+    return latency * (std::max(inflight, 0) + 1);
+}
+
+bool P2CLoadBalancer::IsSelectable(const SelectIn& in, SocketId id,
+                                   SelectOut* out) {
+    return !ExcludedServers::IsExcluded(in.excluded, id)
+        && Socket::Address(id, out->ptr) == 0
+        && (*out->ptr)->IsAvailable();
+}
+
+int P2CLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return ENOMEM;
+    }
+    const size_t n = s->server_list.size();
+    if (n == 0) {
+        return ENODATA;
+    }
+    if (_cluster_recover_policy && _cluster_recover_policy->StopRecoverIfNecessary()) {
+        std::vector<ServerId> servers;
+        servers.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            servers.push_back(s->server_list[i].server);
+        }
+        if (_cluster_recover_policy->DoReject(servers)) {
+            return EREJECT;
+        }
+    }
+    const Node* chosen = NULL;
+    if (n == 1) {
+        const Node& node = s->server_list[0];
+        // Always take the only chance.
+        if (Socket::Address(node.server.id, out->ptr) == 0
+            && (*out->ptr)->IsAvailable()) {
+            chosen = &node;
+        }
+    } else {
+        const size_t i1 = butil::fast_rand_less_than(n);
+        size_t i2 = butil::fast_rand_less_than(n - 1);
+        if (i2 >= i1) {
+            ++i2;
+        }
+        const Node* a = &s->server_list[i1];
+        const Node* b = &s->server_list[i2];
+        const int64_t now_us = butil::gettimeofday_us();
+        if (Cost(*b->stat, now_us) < Cost(*a->stat, now_us)) {
+            std::swap(a, b);
+        }
+        if (IsSelectable(in, a->server.id, out)) {
+            chosen = a;
+        } else if (IsSelectable(in, b->server.id, out)) {
+            chosen = b;
+        } else {
+            // Both choices are unavailable, probe the list randomly.
+            uint32_t stride = GenP2CRandomStride();
+            size_t offset = (i1 + stride) % n;
+            for (size_t i = 0; i < n; ++i) {
+                const Node& node = s->server_list[offset];
+                if (((i + 1) == n  // always take last chance
+                     || !ExcludedServers::IsExcluded(in.excluded, node.server.id))
+                    && Socket::Address(node.server.id, out->ptr) == 0
+                    && (*out->ptr)->IsAvailable()) {
+                    chosen = &node;
+                    break;
+                }
+                offset = (offset + stride) % n;
+            }
+        }
+    }
+    if (chosen == NULL) {
+        if (_cluster_recover_policy) {
+            _cluster_recover_policy->StartRecover();
+        }
+        return EHOSTDOWN;
+    }
+    chosen->stat->inflight.fetch_add(1, butil::memory_order_relaxed);
+    out->need_feedback = true;
+    return 0;
+}
+
+void P2CLoadBalancer::Feedback(const CallInfo& info) {
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        return;
+    }
+    const size_t* pindex = s->server_map.seek(info.server_id);
+    if (pindex == NULL) {
+        // The server was removed.
+        return;
+    }
+    Stat& stat = *s->server_list[*pindex].stat;
+    stat.inflight.fetch_sub(1, butil::memory_order_relaxed);
+    const int64_t now_us = butil::gettimeofday_us();
+    int64_t latency = now_us - info.begin_time_us;
+    if (latency <= 0) {
+        // Time skews, ignore the sample.
+        return;
+    }
+    const int64_t prev = DecayedLatency(
+        stat.ewma_latency_us.load(butil::memory_order_relaxed),
+        stat.last_update_us.load(butil::memory_order_relaxed), now_us);
+    if (info.error_code != 0 && info.error_code != ECANCELED) {
+        // Failed calls may end fast, punish the server to make it less
+        // likely to be selected.
+        latency = std::max(latency, prev * 2);
+    }
+    // Peak EWMA: jump to higher latencies at once and decrease slowly,
+    // so that a server slowing down is avoided quickly.
+    int64_t ewma = latency;
+    if (latency < prev) {
+        ewma = (int64_t)(prev * 0.9 + latency * 0.1);
+    }
+    // Concurrent feedbacks may overwrite each other, which is acceptable
+    // for a statistic.
+    stat.ewma_latency_us.store(ewma, butil::memory_order_relaxed);
+    stat.last_update_us.store(now_us, butil::memory_order_relaxed);
+}
+
+P2CLoadBalancer* P2CLoadBalancer::New(
+    const butil::StringPiece& params) const {
+    P2CLoadBalancer* lb = new (std::nothrow) P2CLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        lb = NULL;
+    }
+    return lb;
+}
+
+void P2CLoadBalancer::Destroy() {
+    delete this;
+}
+
+void P2CLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "p2c";
+        return;
+    }
+    os << "P2C{";
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) != 0) {
+        os << "fail to read _db_servers";
+    } else {
+        const int64_t now_us = butil::gettimeofday_us();
+        os << "n=" << s->server_list.size() << ':';
+        for (size_t i = 0; i < s->server_list.size(); ++i) {
+            const Node& node = s->server_list[i];
+            os << "\n  " << node.server << " ewma_latency="
+               << DecayedLatency(
+                   node.stat->ewma_latency_us.load(butil::memory_order_relaxed),
+                   node.stat->last_update_us.load(butil::memory_order_relaxed),
+                   now_us)
+               << "us inflight="
+               << node.stat->inflight.load(butil::memory_order_relaxed);
+        }
+    }
+    os << '}';
+}
+
+bool P2CLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    return GetRecoverPolicyByParams(params, &_cluster_recover_policy);
+}
+
+}  // namespace policy
+} // namespace brpc
@@ -0,0 +1,90 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_P2C_LOAD_BALANCER_H
+#define BRPC_POLICY_P2C_LOAD_BALANCER_H
+
+#include <vector>                                      // std::vector
+#include <memory>                                      // std::shared_ptr
+#include "butil/atomicops.h"                           // butil::atomic
+#include "butil/containers/flat_map.h"                 // butil::FlatMap
+#include "butil/containers/doubly_buffered_data.h"
+#include "brpc/load_balancer.h"
+#include "brpc/cluster_recover_policy.h"
+
+namespace brpc {
+namespace policy {
+
+// This LoadBalancer samples two servers randomly and selects the one with
+// lower cost, which is EWMA of latencies multiplied by number of inflight
+// calls plus one (the "power of two choices"). Latencies of servers are
+// decayed with time so that slow servers are tried again later.
+// Selecting a server is O(1) and statistics are updated by Feedback()
+// with atomics, without modifying the server list. The server list is read
+// in wait-free mode so that selections never wait for adding/removing servers.
+class P2CLoadBalancer : public LoadBalancer {
+public:
+    P2CLoadBalancer();
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    P2CLoadBalancer* New(const butil::StringPiece&) const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+private:
+    struct Stat {
+        Stat() : inflight(0), ewma_latency_us(0), last_update_us(0) {}
+        butil::atomic<int32_t> inflight;
+        butil::atomic<int64_t> ewma_latency_us;
+        butil::atomic<int64_t> last_update_us;
+    };
+    struct Node {
+        ServerId server;
+        // Shared by both buffers of _db_servers.
+        std::shared_ptr<Stat> stat;
+    };
+    struct Servers {
+        Servers() {
+            CHECK_EQ(0, server_map.init(1024, 70));
+        }
+        std::vector<Node> server_list;
+        butil::FlatMap<SocketId, size_t> server_map;
+    };
+    bool SetParameters(const butil::StringPiece& params);
+    static bool Add(Servers& bg, const Servers& fg, const ServerId& id);
+    static bool Remove(Servers& bg, const ServerId& id);
+    static size_t BatchAdd(Servers& bg, const Servers& fg,
+                           const std::vector<ServerId>& servers);
+    static size_t BatchRemove(Servers& bg, const std::vector<ServerId>& servers);
+    static int64_t Cost(const Stat& stat, int64_t now_us);
+    static bool IsSelectable(const SelectIn& in, SocketId id,
+                             SelectOut* out);
+
+    butil::DoublyBufferedData<Servers> _db_servers;
+    std::shared_ptr<ClusterRecoverPolicy> _cluster_recover_policy;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_P2C_LOAD_BALANCER_H
@@ -17,12 +17,14 @@
 
 //          Jiashun Zhu(zhujiashun2010@gmail.com)
 
+#include <algorithm>                             // std::find
 #include <google/protobuf/descriptor.h>         // MethodDescriptor
 #include <google/protobuf/message.h>            // Message
 #include <gflags/gflags.h>
 #include "butil/logging.h"                       // LOG()
 #include "butil/time.h"
 #include "butil/iobuf.h"                         // butil::IOBuf
+#include "bthread/bthread.h"                     // bthread_start_background
 #include "brpc/controller.h"               // Controller
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/socket.h"                   // Socket
@@ -32,6 +34,8 @@
 #include "brpc/redis.h"
 #include "brpc/redis_command.h"
 #include "brpc/policy/redis_protocol.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/details/redis_near_cache.h"
 
 namespace brpc {
 
@@ -43,9 +47,19 @@ namespace policy {
 DEFINE_bool(redis_verbose, false,
             "[DEBUG] Print EVERY redis request/response");
 
+DEFINE_int32(redis_batch_window_us, 0,
+             "Commands sent over a single connection within so many "
+             "microseconds are combined into one write, 0 to write commands "
+             "immediately");
+BRPC_VALIDATE_GFLAG(redis_batch_window_us, NonNegativeInteger);
+
 struct InputResponse : public InputMessageBase {
+    InputResponse() : npush_dispatched(0) {}
+
     bthread_id_t id_wait;
     RedisResponse response;
+    // Number of push messages in `response' already dispatched.
+    int npush_dispatched;
 
     // @InputMessageBase
     void DestroyImpl() {
@@ -133,6 +147,133 @@ int ConsumeCommand(RedisConnContext* ctx,
     return 0;
 }
 
+// A command run concurrently with other commands.
+struct ConcurrentCommand {
+    ConcurrentCommand() : args(NULL), handler(NULL), output(&arena) {}
+
+    const std::vector<butil::StringPiece>* args;
+    RedisCommandHandler* handler;
+    butil::Arena arena;
+    RedisReply output;
+    RedisCommandHandlerResult result;
+};
+
+static void* RunConcurrentCommand(void* arg) {
+    ConcurrentCommand* c = static_cast<ConcurrentCommand*>(arg);
+    c->result = c->handler->Run(*c->args, &c->output, true);
+    return NULL;
+}
+
+// Returns the handler if commands[i] can be run concurrently, NULL otherwise.
+static RedisCommandHandler* FindConcurrentHandler(
+    const RedisConnContext* ctx,
+    const std::vector<butil::StringPiece>& args) {
+    if (ctx->transaction_handler || ctx->batched_size != 0) {
+        return NULL;
+    }
+    RedisCommandHandler* ch = ctx->redis_service->FindCommandHandler(args[0]);
+    if (ch == NULL || !ch->AllowConcurrentRun()) {
+        return NULL;
+    }
+    return ch;
+}
+
+// Run commands[begin, end) which are found runnable concurrently in parallel
+// and serialize replies in order.
+static int ConsumeConcurrentCommands(
+    const std::vector<std::vector<butil::StringPiece> >& commands,
+    const std::vector<RedisCommandHandler*>& handlers,
+    size_t begin, size_t end,
+    butil::IOBufAppender* appender) {
+    const size_t n = end - begin;
+    std::unique_ptr<ConcurrentCommand[]> cmds(new ConcurrentCommand[n]);
+    std::unique_ptr<bthread_t[]> tids(new bthread_t[n]);
+    for (size_t i = 0; i < n; ++i) {
+        cmds[i].args = &commands[begin + i];
+        cmds[i].handler = handlers[begin + i];
+        tids[i] = INVALID_BTHREAD;
+    }
+    // The first command is run in the calling bthread.
+    for (size_t i = 1; i < n; ++i) {
+        if (bthread_start_background(&tids[i], NULL, RunConcurrentCommand,
+                                     &cmds[i]) != 0) {
+            tids[i] = INVALID_BTHREAD;
+            RunConcurrentCommand(&cmds[i]);
+        }
+    }
+    RunConcurrentCommand(&cmds[0]);
+    int rc = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (tids[i] != INVALID_BTHREAD) {
+            bthread_join(tids[i], NULL);
+        }
+        if (cmds[i].result != REDIS_CMD_HANDLED) {
+            LOG(ERROR) << "Concurrently run command `" << (*cmds[i].args)[0]
+                       << "' returned status=" << cmds[i].result;
+            rc = -1;
+        }
+        if (rc == 0) {
+            cmds[i].output.SerializeTo(appender);
+        }
+    }
+    return rc;
+}
+
+// Key of a command which decides if commands are independent.
+static butil::StringPiece CommandKey(const std::vector<butil::StringPiece>& args) {
+    return args.size() > 1 ? args[1] : butil::StringPiece();
+}
+
+// Consume `commands' parsed from one read in order. Runs of commands whose
+// handlers allow concurrent running and keys are different are run in
+// parallel, others are run one by one with ConsumeCommand().
+static int ConsumeCommands(
+    RedisConnContext* ctx,
+    const std::vector<std::vector<butil::StringPiece> >& commands,
+    butil::IOBufAppender* appender) {
+    std::vector<RedisCommandHandler*> handlers;
+    std::vector<butil::StringPiece> keys;
+    size_t i = 0;
+    while (i < commands.size()) {
+        const bool last = (i + 1 == commands.size());
+        handlers.resize(i + 1);
+        handlers[i] = FindConcurrentHandler(ctx, commands[i]);
+        if (handlers[i] == NULL || last) {
+            if (ConsumeCommand(ctx, commands[i], last, appender) != 0) {
+                return -1;
+            }
+            ++i;
+            continue;
+        }
+        keys.clear();
+        keys.push_back(CommandKey(commands[i]));
+        size_t j = i + 1;
+        for (; j < commands.size(); ++j) {
+            handlers.resize(j + 1);
+            handlers[j] = FindConcurrentHandler(ctx, commands[j]);
+            if (handlers[j] == NULL) {
+                break;
+            }
+            const butil::StringPiece key = CommandKey(commands[j]);
+            if (std::find(keys.begin(), keys.end(), key) != keys.end()) {
+                // Commands with a same key are run in order.
+                break;
+            }
+            keys.push_back(key);
+        }
+        if (j - i == 1) {
+            if (ConsumeCommand(ctx, commands[i], false, appender) != 0) {
+                return -1;
+            }
+        } else if (ConsumeConcurrentCommands(commands, handlers, i, j,
+                                             appender) != 0) {
+            return -1;
+        }
+        i = j;
+    }
+    return 0;
+}
+
 // ========== impl of RedisConnContext ==========
 
 RedisConnContext::~RedisConnContext() { }
@@ -143,6 +284,22 @@ void RedisConnContext::Destroy() {
 
 // ========== impl of RedisConnContext ==========
 
+static InputResponse* GetInputResponse(Socket* socket) {
+    InputResponse* msg = static_cast<InputResponse*>(socket->parsing_context());
+    if (msg == NULL) {
+        msg = new InputResponse;
+        socket->reset_parsing_context(msg);
+    }
+    return msg;
+}
+
+static void DispatchPushes(InputResponse* msg) {
+    for (; msg->npush_dispatched < msg->response.push_size();
+         ++msg->npush_dispatched) {
+        InvalidateRedisNearCaches(msg->response.push(msg->npush_dispatched));
+    }
+}
+
 ParseResult ParseRedisMessage(butil::IOBuf* source, Socket* socket,
                               bool read_eof, const void* arg) {
     if (read_eof || source->empty()) {
@@ -159,27 +316,25 @@ ParseResult ParseRedisMessage(butil::IOBuf* source, Socket* socket,
             ctx = new RedisConnContext(rs);
             socket->reset_parsing_context(ctx);
         }
-        std::vector<butil::StringPiece> current_args;
+        // Parse all commands in `source' first so that replies of the
+        // pipelined commands are written at once and independent commands
+        // can be run concurrently.
+        std::vector<std::vector<butil::StringPiece> > commands(1);
         butil::IOBufAppender appender;
-        ParseError err = PARSE_OK;
-
-        err = ctx->parser.Consume(*source, &current_args, &ctx->arena);
+        ParseError err = ctx->parser.Consume(*source, &commands[0], &ctx->arena);
         if (err != PARSE_OK) {
             return MakeParseError(err);
         }
         while (true) {
-            std::vector<butil::StringPiece> next_args;
-            err = ctx->parser.Consume(*source, &next_args, &ctx->arena);
+            commands.resize(commands.size() + 1);
+            err = ctx->parser.Consume(*source, &commands.back(), &ctx->arena);
             if (err != PARSE_OK) {
+                commands.pop_back();
                 break;
             }
-            if (ConsumeCommand(ctx, current_args, false, &appender) != 0) {
-                return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG);
-            }
-            current_args.swap(next_args);
         }
-        if (ConsumeCommand(ctx, current_args,
-                    true /*must be the last message*/, &appender) != 0) {
+        // The last command is consumed with flush_batched=true.
+        if (ConsumeCommands(ctx, commands, &appender) != 0) {
             return MakeParseError(PARSE_ERROR_ABSOLUTELY_WRONG);
         }
         butil::IOBuf sendbuf;
@@ -203,20 +358,31 @@ ParseResult ParseRedisMessage(butil::IOBuf* source, Socket* socket,
         // in most cases, and the time decreases to ~0.14s.
         PipelinedInfo pi;
         if (!socket->PopPipelinedInfo(&pi)) {
+            // Push messages(RESP3) may come without outstanding requests.
+            InputResponse* msg = GetInputResponse(socket);
+            ParseError err = msg->response.ConsumePartialIOBuf(*source, 0);
+            DispatchPushes(msg);
+            if (err != PARSE_OK) {
+                return MakeParseError(err);
+            }
+            if (source->empty()) {
+                DestroyingPtr<InputResponse> push_msg(
+                    static_cast<InputResponse*>(socket->release_parsing_context()));
+                return MakeParseError(PARSE_ERROR_NOT_ENOUGH_DATA);
+            }
             LOG(WARNING) << "No corresponding PipelinedInfo in socket";
             return MakeParseError(PARSE_ERROR_TRY_OTHERS);
         }
 
         do {
-            InputResponse* msg = static_cast<InputResponse*>(socket->parsing_context());
-            if (msg == NULL) {
-                msg = new InputResponse;
-                socket->reset_parsing_context(msg);
-            }
+            InputResponse* msg = GetInputResponse(socket);
 
             const int consume_count = (pi.with_auth ? 1 : pi.count);
 
             ParseError err = msg->response.ConsumePartialIOBuf(*source, consume_count);
+            // Invalidations must be applied before replies after them are
+            // seen by users.
+            DispatchPushes(msg);
             if (err != PARSE_OK) {
                 socket->GivebackPipelinedInfo(pi);
                 return MakeParseError(err);
@@ -334,6 +500,12 @@ void PackRedisRequest(butil::IOBuf* buf,
     }
 
     buf->append(request);
+    if (cntl->connection_type() == CONNECTION_TYPE_SINGLE) {
+        // Replies are matched with commands by PipelinedInfo, no matter
+        // how commands are combined.
+        ControllerPrivateAccessor(cntl).get_sending_socket()
+            ->set_write_coalescing_us(FLAGS_redis_batch_window_us);
+    }
 }
 
 const std::string& GetRedisMethodName(
@@ -808,6 +808,34 @@ RtmpUnsentMessage::AppendAndDestroySelf(butil::IOBuf* out, Socket* s) {
     return p->AppendAndDestroySelf(out, s);
 }
 
+butil::Status
+RtmpSerializedMessage::AppendAndDestroySelf(butil::IOBuf* out, Socket* s) {
+    std::unique_ptr<RtmpSerializedMessage> destroy_self(this);
+    if (s == NULL) { // abandoned
+        RPC_VLOG << "Socket=NULL";
+        return butil::Status::OK();
+    }
+    RtmpContext* ctx = static_cast<RtmpContext*>(s->parsing_context());
+    RtmpChunkStream* cstream = ctx->GetChunkStream(chunk_stream_id);
+    if (cstream == NULL) {
+        s->SetFailed(EINVAL, "Invalid chunk_stream_id=%u", chunk_stream_id);
+        return butil::Status(EINVAL, "Invalid chunk_stream_id=%u", chunk_stream_id);
+    }
+    if (ctx->chunk_size_out() != chunk_size) {
+        // Chunk size was changed after the message was serialized.
+        if (cstream->SerializeMessage(out, header, &body) != 0) {
+            s->SetFailed(EINVAL, "Fail to serialize message");
+            return butil::Status(EINVAL, "Fail to serialize message");
+        }
+        return butil::Status::OK();
+    }
+    if (!chunks.empty()) {
+        out->append(chunks);
+        cstream->OnMessageWrittenWithType0(header);
+    }
+    return butil::Status::OK();
+}
+
 RtmpContext::SubChunkArray::SubChunkArray() {
     memset(static_cast<void*>(ptrs), 0, sizeof(ptrs));
 }
@@ -1735,6 +1763,55 @@ int RtmpChunkStream::SerializeMessage(butil::IOBuf* buf,
     return 0;
 }
 
+int RtmpChunkStream::SerializeMessageWithType0(butil::IOBuf* buf,
+                                               uint32_t cs_id,
+                                               uint32_t chunk_size,
+                                               const RtmpMessageHeader& mh,
+                                               butil::IOBuf* body) {
+    const size_t bh_size = GetBasicHeaderLength(cs_id);
+    if (bh_size == 0) {
+        CHECK(false) << "Invalid chunk_stream_id=" << cs_id;
+        return -1;
+    }
+    if (chunk_size == 0) {
+        CHECK(false) << "Invalid chunk_size=0";
+        return -1;
+    }
+    uint32_t left_size = mh.message_length;
+    CHECK_LE((size_t)left_size, body->size());
+    const bool has_extended_ts = (mh.timestamp >= 0xFFFFFFu);
+    bool first_chunk = true;
+    // Empty messages are not sent, same with SerializeMessage().
+    while (left_size > 0) {
+        const uint32_t cur_chunk_size = std::min(chunk_size, left_size);
+        left_size -= cur_chunk_size;
+        char header_buf[32]; // enough
+        char* p = header_buf;
+        if (first_chunk) {
+            first_chunk = false;
+            WriteBasicHeader(&p, RTMP_CHUNK_TYPE0, cs_id);
+            WriteBigEndian3Bytes(&p, has_extended_ts ? 0xFFFFFFu : mh.timestamp);
+            WriteBigEndian3Bytes(&p, mh.message_length);
+            *p++ = mh.message_type;
+            WriteLittleEndian4Bytes(&p, mh.stream_id);
+        } else {
+            WriteBasicHeader(&p, RTMP_CHUNK_TYPE3, cs_id);
+        }
+        if (has_extended_ts) {
+            WriteBigEndian4Bytes(&p, mh.timestamp);
+        }
+        buf->append(header_buf, p - header_buf);
+        body->cutn(buf, cur_chunk_size);
+    }
+    return 0;
+}
+
+void RtmpChunkStream::OnMessageWrittenWithType0(const RtmpMessageHeader& mh) {
+    _w.last_has_extended_ts = (mh.timestamp >= 0xFFFFFFu);
+    _w.last_timestamp_delta = mh.timestamp;
+    _w.last_msg_header = mh;
+}
+
 static const RtmpChunkStream::MessageHandler s_msg_handlers[] = {
     &RtmpChunkStream::OnSetChunkSize, // 1
     &RtmpChunkStream::OnAbortMessage, // 2
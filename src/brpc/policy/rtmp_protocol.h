@@ -179,6 +179,26 @@ public:
     butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket*);
 };
 
+// A message serialized into chunks before being written, so that the chunks
+// can be shared by all connections with the same outbound chunk size.
+// The first chunk is always of type 0 which does not depend on previous
+// messages of the chunk stream.
+class RtmpSerializedMessage : public SocketMessage {
+public:
+    RtmpMessageHeader header;
+    uint32_t chunk_stream_id;
+    // Chunk size used for serializing `chunks'.
+    uint32_t chunk_size;
+    butil::IOBuf chunks;
+    // Serialized again if the chunk size of the connection is not
+    // `chunk_size' when this message is written.
+    butil::IOBuf body;
+public:
+    RtmpSerializedMessage() : chunk_stream_id(0), chunk_size(0) {}
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket*);
+};
+
 // Notice that we can't directly pack CreateStream command in PackRtmpRequest, because 
 // we need to pack an AMFObject according to ctx->can_stream_be_created_with_play_or_publish(),
 // which is in the response of Connect command(sent in RtmpConnect::StartConnect).
@@ -269,6 +289,10 @@ public:
     ParseResult Feed(butil::IOBuf* source, Socket* socket);
 
     const RtmpClientOptions* client_options() const { return _client_options; }
+
+    // Outbound chunk size. Modified in the writing thread, so the value read
+    // in other threads may be stale.
+    uint32_t chunk_size_out() const { return _chunk_size_out; }
     const Server* server() const { return _server; }
     RtmpService* service() const { return _service; }
 
@@ -424,6 +448,16 @@ public:
 
     int SerializeMessage(butil::IOBuf* buf, const RtmpMessageHeader& mh,
                          butil::IOBuf* body);
+
+    // Serialize the message into chunks of `chunk_size' without depending
+    // on previous messages, namely the first chunk is of type 0.
+    static int SerializeMessageWithType0(butil::IOBuf* buf, uint32_t cs_id,
+                                         uint32_t chunk_size,
+                                         const RtmpMessageHeader& mh,
+                                         butil::IOBuf* body);
+    // Called after a message serialized by SerializeMessageWithType0() is
+    // written, so that later messages are compressed against it.
+    void OnMessageWrittenWithType0(const RtmpMessageHeader& mh);
     
     bool OnMessage(
         const RtmpBasicHeader& bh, const RtmpMessageHeader& mh,
@@ -0,0 +1,84 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_SEQ_ID_CORRELATOR_H
+#define BRPC_POLICY_SEQ_ID_CORRELATOR_H
+
+#include "butil/containers/flat_map.h"          // FlatMap
+#include "butil/synchronization/lock.h"
+#include "brpc/destroyable.h"                   // Destroyable
+#include "brpc/socket.h"                        // Socket
+
+
+namespace brpc {
+namespace policy {
+
+// Requests in flight over a client-side single connection, indexed by 32-bit
+// sequence numbers which are written into the requests and echoed back by
+// servers in responses, e.g. seqid of thrift and log_id of nshead. This is
+// for protocols without a field to carry the 64-bit correlation_id.
+// Set as the parsing context of the connection when it's used at the first
+// time, see Get().
+class SeqIdCorrelator : public Destroyable {
+public:
+    SeqIdCorrelator() : _next_seq_id(1) {
+        CHECK_EQ(0, _pending.init(64));
+    }
+
+    // Returns the correlator of `sock', created if absent.
+    static SeqIdCorrelator* Get(Socket* sock) {
+        SeqIdCorrelator* c = static_cast<SeqIdCorrelator*>(sock->parsing_context());
+        if (c == NULL) {
+            c = new SeqIdCorrelator;
+            sock->initialize_parsing_context(&c);
+        }
+        return c;
+    }
+
+    // Returns the non-zero sequence number assigned to the request with
+    // `correlation_id'.
+    uint32_t AddRequest(uint64_t correlation_id) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        uint32_t seq_id = _next_seq_id++;
+        if (seq_id == 0) {  // 0 is often sent by callers not caring about it
+            seq_id = _next_seq_id++;
+        }
+        _pending[seq_id] = correlation_id;
+        return seq_id;
+    }
+
+    // Remove the request with `seq_id' and put its correlation_id into
+    // `correlation_id'. Returns false if the request was not found.
+    bool RemoveRequest(uint32_t seq_id, uint64_t* correlation_id) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _pending.erase(seq_id, correlation_id) == 1;
+    }
+
+    void Destroy() override { delete this; }
+
+private:
+    butil::Mutex _mutex;
+    uint32_t _next_seq_id;
+    butil::FlatMap<uint32_t, uint64_t> _pending;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif // BRPC_POLICY_SEQ_ID_CORRELATOR_H
@@ -18,6 +18,7 @@
 
 #include "brpc/policy/streaming_rpc_protocol.h"
 
+#include <algorithm>
 #include <google/protobuf/descriptor.h>         // MethodDescriptor
 #include <google/protobuf/message.h>            // Message
 #include <gflags/gflags.h>
@@ -27,6 +28,7 @@
 #include "butil/iobuf.h"                         // butil::IOBuf
 #include "butil/raw_pack.h"                      // RawPacker RawUnpacker
 #include "brpc/log.h"
+#include "brpc/reloadable_flags.h"              // BRPC_VALIDATE_GFLAG
 #include "brpc/socket.h"                        // Socket
 #include "brpc/streaming_rpc_meta.pb.h"         // StreamFrameMeta
 #include "brpc/policy/most_common_message.h"
@@ -36,6 +38,41 @@
 namespace brpc {
 namespace policy {
 
+DEFINE_int64(stream_connection_buffer_budget, 0,
+             "Max bytes of unconsumed messages of all streams over one "
+             "connection at the receiving side, shared evenly by the streams "
+             "as their windows. 0 means no limit");
+BRPC_VALIDATE_GFLAG(stream_connection_buffer_budget, NonNegativeInteger);
+
+DEFINE_int64(stream_process_buffer_budget, 0,
+             "Max bytes of unconsumed messages of all streams in this process, "
+             "shared evenly by the streams as their windows. 0 means no limit");
+BRPC_VALIDATE_GFLAG(stream_process_buffer_budget, NonNegativeInteger);
+
+static butil::static_atomic<int64_t> g_nreceiving_stream =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+
+void AddReceivingStreamCount(int n) {
+    g_nreceiving_stream.fetch_add(n, butil::memory_order_relaxed);
+}
+
+int64_t GetStreamWindow(size_t nstream_in_connection) {
+    int64_t window = 0;
+    const int64_t conn_budget = FLAGS_stream_connection_buffer_budget;
+    if (conn_budget > 0) {
+        const int64_t n = std::max(nstream_in_connection, (size_t)1);
+        window = std::max(conn_budget / n, (int64_t)1);
+    }
+    const int64_t process_budget = FLAGS_stream_process_buffer_budget;
+    if (process_budget > 0) {
+        const int64_t n = std::max(
+            g_nreceiving_stream.load(butil::memory_order_relaxed), (int64_t)1);
+        const int64_t share = std::max(process_budget / n, (int64_t)1);
+        window = (window > 0 ? std::min(window, share) : share);
+    }
+    return window;
+}
+
 // Notes on Streaming RPC Protocol:
 // 1 - Header format is [STRM][body_size][meta_size], 12 bytes in total
 // 2 - body_size and meta_size are in network byte order
@@ -43,6 +43,16 @@ void SendStreamClose(Socket *sock, int64_t remote_stream_id,
 int SendStreamData(Socket* sock, const butil::IOBuf* data,
                    int64_t remote_stream_id, int64_t source_stream_id);
 
+// Called when a stream able to receive messages is created(n=1) or
+// destroyed(n=-1).
+void AddReceivingStreamCount(int n);
+
+// Returns the window of a stream receiving messages over a connection
+// shared by `nstream_in_connection' streams, namely the even share of
+// -stream_connection_buffer_budget and -stream_process_buffer_budget,
+// 0 when there's no budget.
+int64_t GetStreamWindow(size_t nstream_in_connection);
+
 }  // namespace policy
 } // namespace brpc
 
@@ -32,11 +32,14 @@
 #include "brpc/thrift_service.h"
 #include "brpc/policy/most_common_message.h"
 #include "brpc/policy/thrift_protocol.h"
+#include "brpc/policy/seq_id_correlator.h"
 #include "brpc/details/usercode_backup_pool.h"
 
 #include <thrift/Thrift.h>
-#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TVirtualTransport.h>
+#include <thrift/transport/TTransportException.h>
 #include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
 #include <thrift/TApplicationException.h>
 
 // _THRIFT_STDCXX_H_ is defined by thrift/stdcxx.h which was added since thrift 0.11.0
@@ -57,20 +60,171 @@ void bthread_assign_data(void* data);
 namespace brpc {
 namespace policy {
 
+DEFINE_bool(thrift_compact_protocol, false,
+            "Serialize thrift requests with TCompactProtocol instead of "
+            "TBinaryProtocol. Servers always reply in the protocol of requests");
+
+DEFINE_bool(thrift_match_response_by_seqid, true,
+            "Match responses with requests over single connections by seqid, "
+            "which allows servers to answer out of order. Turn off for servers "
+            "not echoing seqid, responses are matched in the order of sending");
+
 static const uint32_t MAX_THRIFT_METHOD_NAME_LENGTH = 256; // reasonably large
 static const uint32_t THRIFT_HEAD_VERSION_MASK = (uint32_t)0xffffff00;
 static const uint32_t THRIFT_HEAD_VERSION_1 = (uint32_t)0x80010000;
+static const uint8_t THRIFT_COMPACT_PROTOCOL_ID = 0x82;
+static const uint8_t THRIFT_COMPACT_VERSION = 1;
+static const uint8_t THRIFT_COMPACT_VERSION_MASK = 0x1f;
+static const int THRIFT_COMPACT_TYPE_SHIFT = 5;
 struct thrift_head_t {
     uint32_t body_len;
 };
 
+// A thrift transport reading from and writing to IOBuf in place. Compared
+// to TMemoryBuffer, framed payloads are not flattened before being read
+// and serialized bytes are not copied again into IOBuf.
+class IOBufTransport
+    : public apache::thrift::transport::TVirtualTransport<IOBufTransport> {
+public:
+    // Read bytes are cut from `in', written bytes are appended to `out'.
+    IOBufTransport(butil::IOBuf* in, butil::IOBuf* out) : _in(in), _out(out) {}
+
+    uint32_t read(uint8_t* buf, uint32_t len) {
+        return _in->cutn(buf, len);
+    }
+
+    uint32_t readAll(uint8_t* buf, uint32_t len) {
+        if (_in->cutn(buf, len) != len) {
+            throw apache::thrift::transport::TTransportException(
+                apache::thrift::transport::TTransportException::END_OF_FILE,
+                "No more data to read");
+        }
+        return len;
+    }
+
+    void write(const uint8_t* buf, uint32_t len) {
+        _out->append(buf, len);
+    }
+
+    // Strings inside the first block are read without copying.
+    const uint8_t* borrow(uint8_t* /*buf*/, uint32_t* len) {
+        if (_in->backing_block_num() == 0) {
+            return NULL;
+        }
+        const butil::StringPiece front = _in->backing_block(0);
+        if (front.size() < *len) {
+            return NULL;
+        }
+        *len = front.size();
+        return (const uint8_t*)front.data();
+    }
+
+    void consume(uint32_t len) {
+        _in->pop_front(len);
+    }
+
+private:
+    butil::IOBuf* _in;
+    butil::IOBuf* _out;
+};
+
+typedef apache::thrift::protocol::TBinaryProtocolT<IOBufTransport> IOBufBinaryProtocol;
+typedef apache::thrift::protocol::TCompactProtocolT<IOBufTransport> IOBufCompactProtocol;
+
+inline bool IsCompactMessageBegin(const char* p) {
+    return (uint8_t)p[0] == THRIFT_COMPACT_PROTOCOL_ID &&
+        ((uint8_t)p[1] & THRIFT_COMPACT_VERSION_MASK) == THRIFT_COMPACT_VERSION;
+}
+
+static bool ReadVarint32(const uint8_t* buf, size_t n, size_t* pos, uint32_t* value) {
+    uint32_t v = 0;
+    for (int shift = 0; shift < 35 && *pos < n; shift += 7) {
+        const uint8_t b = buf[(*pos)++];
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void AppendVarint32(butil::IOBuf* out, uint32_t value) {
+    uint8_t buf[5];
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (uint8_t)value;
+    out->append(buf, n);
+}
+
+// TCompactProtocol format of message begin:
+// Protocol id + Version and type + Sequence Id + Length + Method
+//      |              |                |           |        |
+//      1       +      1        +    varint   +  varint  +  >0
+static butil::Status
+ReadCompactMessageBegin(butil::IOBuf* body,
+                        std::string* method_name,
+                        ::apache::thrift::protocol::TMessageType* mtype,
+                        uint32_t* seq_id) {
+    uint8_t buf[2 + 5 + 5 + MAX_THRIFT_METHOD_NAME_LENGTH];
+    const size_t n = body->copy_to(buf, sizeof(buf));
+    if (n < 2 || !IsCompactMessageBegin((const char*)buf)) {
+        return butil::Status(-1, "Invalid compact message begin");
+    }
+    *mtype = (apache::thrift::protocol::TMessageType)
+        ((buf[1] >> THRIFT_COMPACT_TYPE_SHIFT) & 0x07);
+    size_t pos = 2;
+    uint32_t method_name_length = 0;
+    if (!ReadVarint32(buf, n, &pos, seq_id) ||
+        !ReadVarint32(buf, n, &pos, &method_name_length)) {
+        return butil::Status(-1, "Fail to read varint from body");
+    }
+    if (method_name_length > MAX_THRIFT_METHOD_NAME_LENGTH) {
+        return butil::Status(-1, "method_name_length=%u is too long",
+                             method_name_length);
+    }
+    if (pos + method_name_length > n) {
+        return butil::Status(-1, "Fail to cut %" PRIu64 " bytes",
+                             (uint64_t)(pos + method_name_length));
+    }
+    method_name->assign((const char*)buf + pos, method_name_length);
+    body->pop_front(pos + method_name_length);
+    return butil::Status::OK();
+}
+
+static void
+AppendCompactMessageBegin(butil::IOBuf* out,
+                          const std::string& method_name,
+                          ::apache::thrift::protocol::TMessageType mtype,
+                          uint32_t seq_id) {
+    const uint8_t head[2] = {
+        THRIFT_COMPACT_PROTOCOL_ID,
+        (uint8_t)(THRIFT_COMPACT_VERSION | (((uint8_t)mtype) << THRIFT_COMPACT_TYPE_SHIFT))
+    };
+    out->append(head, sizeof(head));
+    AppendVarint32(out, seq_id);
+    AppendVarint32(out, method_name.size());
+    out->append(method_name);
+}
+
 // A faster implementation of TProtocol::readMessageBegin without depending
 // on thrift stuff.
 static butil::Status
 ReadThriftMessageBegin(butil::IOBuf* body,
                        std::string* method_name,
                        ::apache::thrift::protocol::TMessageType* mtype,
-                       uint32_t* seq_id) {
+                       uint32_t* seq_id,
+                       bool* compact_protocol) {
+    char first2[2];
+    if (body->copy_to(first2, sizeof(first2)) == sizeof(first2) &&
+        IsCompactMessageBegin(first2)) {
+        *compact_protocol = true;
+        return ReadCompactMessageBegin(body, method_name, mtype, seq_id);
+    }
+    *compact_protocol = false;
     // Thrift protocol format:
     // Version + Message type + Length + Method + Sequence Id
     //   |             |          |        |          |
@@ -117,20 +271,49 @@ WriteThriftMessageBegin(char* buf,
     p += 4;
     memcpy(p, method_name.data(), method_name.size());
     p += method_name.size();
-    *p = htonl(seq_id);
+    *(uint32_t*)p = htonl(seq_id);
 }
 
-bool ReadThriftStruct(const butil::IOBuf& body,
-                      ThriftMessageBase* raw_msg,
-                      int16_t expected_fid) {
-    const size_t body_len  = body.size();
-    uint8_t* thrift_buffer = (uint8_t*)malloc(body_len);
-    body.copy_to(thrift_buffer, body_len);
-    auto in_buffer =
-        THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>(
-            thrift_buffer, body_len,
-            ::apache::thrift::transport::TMemoryBuffer::TAKE_OWNERSHIP);
-    apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> iprot(in_buffer);
+// Append thrift framed head and message begin of the protocol.
+static void
+AppendThriftFrameAndMessageBegin(butil::IOBuf* out,
+                                 const std::string& method_name,
+                                 ::apache::thrift::protocol::TMessageType mtype,
+                                 uint32_t seq_id,
+                                 size_t body_size,
+                                 bool compact_protocol) {
+    if (compact_protocol) {
+        butil::IOBuf mb;
+        AppendCompactMessageBegin(&mb, method_name, mtype, seq_id);
+        const thrift_head_t head = { htonl(mb.size() + body_size) };
+        out->append(&head, sizeof(head));
+        out->append(butil::IOBuf::Movable(mb));
+        return;
+    }
+    const size_t mb_size = ThriftMessageBeginSize(method_name);
+    char buf[sizeof(thrift_head_t) + mb_size];
+    // suppress strict-aliasing warning
+    thrift_head_t* head = (thrift_head_t*)buf;
+    head->body_len = htonl(mb_size + body_size);
+    WriteThriftMessageBegin(buf + sizeof(thrift_head_t), method_name,
+                            mtype, seq_id);
+    out->append(buf, sizeof(buf));
+}
+
+// Append `payload' along with the framed head into `out'.
+static void AppendThriftFrame(butil::IOBuf* out, butil::IOBuf* payload) {
+    const thrift_head_t head = { htonl(payload->size()) };
+    out->append(&head, sizeof(head));
+    out->append(butil::IOBuf::Movable(*payload));
+}
+
+template <typename Protocol>
+static bool ReadThriftStructT(const butil::IOBuf& body,
+                              ThriftMessageBase* raw_msg,
+                              int16_t expected_fid) {
+    // Copying IOBuf only references the blocks.
+    butil::IOBuf in = body;
+    Protocol iprot(THRIFT_STDCXX::make_shared<IOBufTransport>(&in, (butil::IOBuf*)NULL));
 
     // The following code was taken from thrift auto generate code
     std::string fname;
@@ -164,22 +347,95 @@ bool ReadThriftStruct(const butil::IOBuf& body,
     return success;
 }
 
-void ReadThriftException(const butil::IOBuf& body,
-                         ::apache::thrift::TApplicationException* x) {
-    size_t body_len  = body.size();
-    uint8_t* thrift_buffer = (uint8_t*)malloc(body_len);
-    body.copy_to(thrift_buffer, body_len);
-    auto in_buffer =
-        THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>(
-            thrift_buffer, body_len,
-            ::apache::thrift::transport::TMemoryBuffer::TAKE_OWNERSHIP);
-    apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> iprot(in_buffer);
+bool ReadThriftStruct(const butil::IOBuf& body,
+                      ThriftMessageBase* raw_msg,
+                      int16_t expected_fid,
+                      bool compact_protocol) {
+    if (compact_protocol) {
+        return ReadThriftStructT<IOBufCompactProtocol>(body, raw_msg, expected_fid);
+    }
+    return ReadThriftStructT<IOBufBinaryProtocol>(body, raw_msg, expected_fid);
+}
 
+template <typename Protocol>
+static void ReadThriftExceptionT(const butil::IOBuf& body,
+                                 ::apache::thrift::TApplicationException* x) {
+    butil::IOBuf in = body;
+    Protocol iprot(THRIFT_STDCXX::make_shared<IOBufTransport>(&in, (butil::IOBuf*)NULL));
     x->read(&iprot);
     iprot.readMessageEnd();
     iprot.getTransport()->readEnd();
 }
 
+void ReadThriftException(const butil::IOBuf& body,
+                         ::apache::thrift::TApplicationException* x,
+                         bool compact_protocol) {
+    if (compact_protocol) {
+        return ReadThriftExceptionT<IOBufCompactProtocol>(body, x);
+    }
+    return ReadThriftExceptionT<IOBufBinaryProtocol>(body, x);
+}
+
+template <typename Protocol>
+static void WriteThriftExceptionT(butil::IOBuf* payload,
+                                  const std::string& method_name,
+                                  uint32_t seq_id,
+                                  const std::string& error_text) {
+    Protocol oprot(THRIFT_STDCXX::make_shared<IOBufTransport>((butil::IOBuf*)NULL, payload));
+    ::apache::thrift::TApplicationException x(error_text);
+    oprot.writeMessageBegin(
+        method_name, ::apache::thrift::protocol::T_EXCEPTION, seq_id);
+    x.write(&oprot);
+    oprot.writeMessageEnd();
+    oprot.getTransport()->writeEnd();
+    oprot.getTransport()->flush();
+}
+
+// Write `raw_msg' as the field `fid' of a struct inside a message. The
+// code was taken and modified from thrift auto generated code.
+template <typename Protocol>
+static void WriteThriftStructT(butil::IOBuf* payload,
+                               const std::string& method_name,
+                               ::apache::thrift::protocol::TMessageType mtype,
+                               uint32_t seq_id,
+                               const char* struct_name,
+                               const char* field_name,
+                               int16_t fid,
+                               const ThriftMessageBase* raw_msg) {
+    Protocol oprot(THRIFT_STDCXX::make_shared<IOBufTransport>((butil::IOBuf*)NULL, payload));
+    oprot.writeMessageBegin(method_name, mtype, seq_id);
+
+    uint32_t xfer = 0;
+    xfer += oprot.writeStructBegin(struct_name);
+    xfer += oprot.writeFieldBegin(field_name,
+                                  ::apache::thrift::protocol::T_STRUCT, fid);
+    xfer += raw_msg->Write(&oprot);
+    xfer += oprot.writeFieldEnd();
+    xfer += oprot.writeFieldStop();
+    xfer += oprot.writeStructEnd();
+
+    oprot.writeMessageEnd();
+    oprot.getTransport()->writeEnd();
+    oprot.getTransport()->flush();
+}
+
+static void WriteThriftStruct(butil::IOBuf* payload,
+                              const std::string& method_name,
+                              ::apache::thrift::protocol::TMessageType mtype,
+                              uint32_t seq_id,
+                              const char* struct_name,
+                              const char* field_name,
+                              int16_t fid,
+                              const ThriftMessageBase* raw_msg,
+                              bool compact_protocol) {
+    if (compact_protocol) {
+        return WriteThriftStructT<IOBufCompactProtocol>(
+            payload, method_name, mtype, seq_id, struct_name, field_name, fid, raw_msg);
+    }
+    return WriteThriftStructT<IOBufBinaryProtocol>(
+        payload, method_name, mtype, seq_id, struct_name, field_name, fid, raw_msg);
+}
+
 // The continuation of request processing. Namely send response back to client.
 class ThriftClosure : public google::protobuf::Closure {
 public:
@@ -278,61 +534,30 @@ void ThriftClosure::DoRun() {
 
     butil::IOBuf write_buf;
 
-    // The following code was taken and modified from thrift auto generated code
+    // Reply in the protocol of the request.
+    const bool compact_protocol = _request.compact_protocol;
     if (_controller.Failed()) {
-        auto out_buffer =
-            THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>();
-        apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> oprot(out_buffer);
-        ::apache::thrift::TApplicationException x(_controller.ErrorText());
-        oprot.writeMessageBegin(
-            method_name, ::apache::thrift::protocol::T_EXCEPTION, seq_id);
-        x.write(&oprot);
-        oprot.writeMessageEnd();
-        oprot.getTransport()->writeEnd();
-        oprot.getTransport()->flush();
-
-        uint8_t* buf;
-        uint32_t sz;
-        out_buffer->getBuffer(&buf, &sz);
-        const thrift_head_t head = { htonl(sz) };
-        write_buf.append(&head, sizeof(head));
-        write_buf.append(buf, sz);
+        butil::IOBuf payload;
+        if (compact_protocol) {
+            WriteThriftExceptionT<IOBufCompactProtocol>(
+                &payload, method_name, seq_id, _controller.ErrorText());
+        } else {
+            WriteThriftExceptionT<IOBufBinaryProtocol>(
+                &payload, method_name, seq_id, _controller.ErrorText());
+        }
+        AppendThriftFrame(&write_buf, &payload);
     } else if (_response.raw_instance()) {
-        auto out_buffer =
-            THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>();
-        apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> oprot(out_buffer);
-        oprot.writeMessageBegin(
-            method_name, ::apache::thrift::protocol::T_REPLY, seq_id);
-
-        uint32_t xfer = 0;
-        xfer += oprot.writeStructBegin("rpc_result"); // can be any valid name
-        xfer += oprot.writeFieldBegin("success",
-                                      ::apache::thrift::protocol::T_STRUCT,
-                                      THRIFT_RESPONSE_FID);
-        xfer += _response.raw_instance()->Write(&oprot);
-        xfer += oprot.writeFieldEnd();
-        xfer += oprot.writeFieldStop();
-        xfer += oprot.writeStructEnd();
-
-        oprot.writeMessageEnd();
-        oprot.getTransport()->writeEnd();
-        oprot.getTransport()->flush();
-
-        uint8_t* buf;
-        uint32_t sz;
-        out_buffer->getBuffer(&buf, &sz);
-        const thrift_head_t head = { htonl(sz) };
-        write_buf.append(&head, sizeof(head));
-        write_buf.append(buf, sz);
+        butil::IOBuf payload;
+        WriteThriftStruct(&payload, method_name,
+                          ::apache::thrift::protocol::T_REPLY, seq_id,
+                          "rpc_result"/*can be any valid name*/, "success",
+                          THRIFT_RESPONSE_FID, _response.raw_instance(),
+                          compact_protocol);
+        AppendThriftFrame(&write_buf, &payload);
     } else {
-        const size_t mb_size = ThriftMessageBeginSize(method_name);
-        char buf[sizeof(thrift_head_t) + mb_size];
-        // suppress strict-aliasing warning
-        thrift_head_t* head = (thrift_head_t*)buf;
-        head->body_len = htonl(mb_size + _response.body.size());
-        WriteThriftMessageBegin(buf + sizeof(thrift_head_t), method_name,
-                                ::apache::thrift::protocol::T_REPLY, seq_id);
-        write_buf.append(buf, sizeof(buf));
+        AppendThriftFrameAndMessageBegin(
+            &write_buf, method_name, ::apache::thrift::protocol::T_REPLY,
+            seq_id, _response.body.size(), compact_protocol);
         write_buf.append(_response.body.movable());
     }
     
@@ -358,7 +583,8 @@ void ThriftClosure::DoRun() {
 }
 
 ParseResult ParseThriftMessage(butil::IOBuf* source,
-                               Socket*, bool /*read_eof*/, const void* /*arg*/) {
+                               Socket* socket, bool /*read_eof*/,
+                               const void* /*arg*/) {
     char header_buf[sizeof(thrift_head_t) + 4];
     const size_t n = source->copy_to(header_buf, sizeof(header_buf));
     if (n < sizeof(header_buf)) {
@@ -367,7 +593,8 @@ ParseResult ParseThriftMessage(butil::IOBuf* source,
 
     const uint32_t sz = ntohl(*(uint32_t*)(header_buf + sizeof(thrift_head_t)));
     uint32_t version = sz & THRIFT_HEAD_VERSION_MASK;
-    if (version != THRIFT_HEAD_VERSION_1) {
+    if (version != THRIFT_HEAD_VERSION_1 &&
+        !IsCompactMessageBegin(header_buf + sizeof(thrift_head_t))) {
         RPC_VLOG << "version=" << version
                  << " doesn't match THRIFT_VERSION=" << THRIFT_HEAD_VERSION_1;
         return MakeParseError(PARSE_ERROR_TRY_OTHERS);
@@ -384,6 +611,11 @@ ParseResult ParseThriftMessage(butil::IOBuf* source,
     MostCommonMessage* msg = MostCommonMessage::Get();
     source->pop_front(sizeof(thrift_head_t));
     source->cutn(&msg->payload, body_len);
+    if (socket->CreatedByConnect()) {
+        // Responses to requests pipelined in order, must be popped here
+        // rather than in ProcessThriftResponse() which runs concurrently.
+        socket->PopPipelinedInfo(&msg->pi);
+    }
     return MakeMessage(msg);
 }
 
@@ -472,12 +704,15 @@ void ProcessThriftRequest(InputMessageBase* msg_base) {
 
     uint32_t seq_id;
     ::apache::thrift::protocol::TMessageType mtype;
+    bool compact_protocol = false;
     butil::Status st = ReadThriftMessageBegin(
-        &msg->payload, &cntl->_thrift_method_name, &mtype, &seq_id);
+        &msg->payload, &cntl->_thrift_method_name, &mtype, &seq_id,
+        &compact_protocol);
     if (!st.ok()) {
         return cntl->SetFailed(EREQUEST, "%s", st.error_cstr());
     }
     msg->payload.swap(req->body);
+    req->compact_protocol = compact_protocol;
     req->field_id = THRIFT_REQUEST_FID;
     cntl->set_log_id(seq_id);    // Pass seq_id by log_id
 
@@ -558,9 +793,35 @@ void ProcessThriftRequest(InputMessageBase* msg_base) {
 void ProcessThriftResponse(InputMessageBase* msg_base) {
     const int64_t start_parse_us = butil::cpuwide_time_us();
     DestroyingPtr<MostCommonMessage> msg(static_cast<MostCommonMessage*>(msg_base));
-    
-    // Fetch correlation id that we saved before in `PacThriftRequest'
-    const CallId cid = { static_cast<uint64_t>(msg->socket()->correlation_id()) };
+    Socket* socket = msg->socket();
+
+    // The following code was taken from thrift auto generate code
+    std::string fname;
+    ::apache::thrift::protocol::TMessageType mtype;
+    uint32_t seq_id = 0;
+    bool compact_protocol = false;
+    const butil::Status st = ReadThriftMessageBegin(
+        &msg->payload, &fname, &mtype, &seq_id, &compact_protocol);
+
+    // Fetch correlation id that we saved before in `PackThriftRequest'
+    CallId cid = { static_cast<uint64_t>(socket->correlation_id()) };
+    SeqIdCorrelator* correlator =
+        static_cast<SeqIdCorrelator*>(socket->parsing_context());
+    if (msg->pi.id_wait != INVALID_BTHREAD_ID) {
+        cid = msg->pi.id_wait;
+    } else if (correlator != NULL) {
+        if (!st.ok()) {
+            LOG(WARNING) << "Fail to read seqid of the response from "
+                         << *socket << ": " << st;
+            return;
+        }
+        if (!correlator->RemoveRequest(seq_id, &cid.value)) {
+            // The RPC was probably timed out and its seqid was reused.
+            LOG(WARNING) << "Fail to find the request with seqid=" << seq_id
+                         << " sent to " << *socket;
+            return;
+        }
+    }
     Controller* cntl = NULL;
     const int rc = bthread_id_lock(cid, (void**)&cntl);
     if (rc != 0) {
@@ -580,19 +841,13 @@ void ProcessThriftResponse(InputMessageBase* msg_base) {
 
     const int saved_error = cntl->ErrorCode();
     do {
-        // The following code was taken from thrift auto generate code
-        std::string fname;
-        ::apache::thrift::protocol::TMessageType mtype;
-        uint32_t seq_id = 0; // unchecked
-        
-        butil::Status st = ReadThriftMessageBegin(&msg->payload, &fname, &mtype, &seq_id);
         if (!st.ok()) {
             cntl->SetFailed(ERESPONSE, "%s", st.error_cstr());
             break;
         }
         if (mtype == ::apache::thrift::protocol::T_EXCEPTION) {
             ::apache::thrift::TApplicationException x;
-            ReadThriftException(msg->payload, &x);
+            ReadThriftException(msg->payload, &x, compact_protocol);
             // TODO: Convert exception type to brpc errors.
             cntl->SetFailed(x.what());
             break;
@@ -615,13 +870,14 @@ void ProcessThriftResponse(InputMessageBase* msg_base) {
         if (response) {
             if (response->raw_instance()) {
                 if (!ReadThriftStruct(msg->payload, response->raw_instance(),
-                                      THRIFT_RESPONSE_FID)) {
+                                      THRIFT_RESPONSE_FID, compact_protocol)) {
                     cntl->SetFailed(ERESPONSE, "Fail to read presult");
                     break;
                 }
             } else {
                 msg->payload.swap(response->body);
                 response->field_id = THRIFT_RESPONSE_FID;
+                response->compact_protocol = compact_protocol;
             }
         } // else just ignore the response.
     } while (false);
@@ -668,14 +924,6 @@ void SerializeThriftRequest(butil::IOBuf* request_buf, Controller* cntl,
 
     // xxx_pargs write
     if (req->raw_instance()) {
-        auto out_buffer =
-            THRIFT_STDCXX::make_shared<apache::thrift::transport::TMemoryBuffer>();
-        apache::thrift::protocol::TBinaryProtocolT<apache::thrift::transport::TMemoryBuffer> oprot(out_buffer);
-
-        oprot.writeMessageBegin(
-            method_name, ::apache::thrift::protocol::T_CALL, 0/*seq_id*/);
-
-        uint32_t xfer = 0;
         char struct_begin_str[32 + method_name.size()];
         char* p = struct_begin_str;
         memcpy(p, "ThriftService_", 14);
@@ -685,37 +933,17 @@ void SerializeThriftRequest(butil::IOBuf* request_buf, Controller* cntl,
         memcpy(p, "_pargs", 6);
         p += 6;
         *p = '\0';
-        xfer += oprot.writeStructBegin(struct_begin_str);
-        xfer += oprot.writeFieldBegin("request", ::apache::thrift::protocol::T_STRUCT,
-                                      THRIFT_REQUEST_FID);
-
-        // request's write
-        xfer += req->raw_instance()->Write(&oprot);
-        
-        xfer += oprot.writeFieldEnd();
-        xfer += oprot.writeFieldStop();
-        xfer += oprot.writeStructEnd();
-
-        oprot.writeMessageEnd();
-        oprot.getTransport()->writeEnd();
-        oprot.getTransport()->flush();
-
-        uint8_t* buf;
-        uint32_t sz;
-        out_buffer->getBuffer(&buf, &sz);
-
-        const thrift_head_t head = { htonl(sz) };
-        request_buf->append(&head, sizeof(head));
-        request_buf->append(buf, sz);
+        butil::IOBuf payload;
+        WriteThriftStruct(&payload, method_name,
+                          ::apache::thrift::protocol::T_CALL, 0/*seq_id*/,
+                          struct_begin_str, "request", THRIFT_REQUEST_FID,
+                          req->raw_instance(), FLAGS_thrift_compact_protocol);
+        AppendThriftFrame(request_buf, &payload);
     } else {
-        const size_t mb_size = ThriftMessageBeginSize(method_name);
-        char buf[sizeof(thrift_head_t) + mb_size];
-        // suppress strict-aliasing warning
-        thrift_head_t* head = (thrift_head_t*)buf;
-        head->body_len = htonl(mb_size + req->body.size());
-        WriteThriftMessageBegin(buf + sizeof(thrift_head_t), method_name,
-                                ::apache::thrift::protocol::T_CALL, 0/*seq_id*/);
-        request_buf->append(buf, sizeof(buf));
+        // `body' is serialized by users in the protocol it tells.
+        AppendThriftFrameAndMessageBegin(
+            request_buf, method_name, ::apache::thrift::protocol::T_CALL,
+            0/*seq_id*/, req->body.size(), req->compact_protocol);
         request_buf->append(req->body);
     }
 }
@@ -729,14 +957,6 @@ void PackThriftRequest(
     const butil::IOBuf& request,
     const Authenticator*) {
     ControllerPrivateAccessor accessor(cntl);
-    if (cntl->connection_type() == CONNECTION_TYPE_SINGLE) {
-        return cntl->SetFailed(
-            EINVAL, "thrift protocol can't work with CONNECTION_TYPE_SINGLE");
-    }
-    // Store `correlation_id' into the socket since thrift protocol can't
-    // pack the field.
-    accessor.get_sending_socket()->set_correlation_id(correlation_id);
-
     Span* span = accessor.span();
     if (span) {
         span->set_request_size(request.length());
@@ -745,7 +965,39 @@ void PackThriftRequest(
         // request_meta->set_span_id(span->span_id());
         // request_meta->set_parent_span_id(span->parent_span_id());
     }
-    packet_buf->append(request);
+
+    Socket* sock = accessor.get_sending_socket();
+    if (cntl->connection_type() != CONNECTION_TYPE_SINGLE) {
+        // Store `correlation_id' into the socket since thrift protocol can't
+        // pack the field.
+        sock->set_correlation_id(correlation_id);
+        packet_buf->append(request);
+        return;
+    }
+    if (!FLAGS_thrift_match_response_by_seqid) {
+        // Responses are matched with requests in the order of sending, see
+        // ParseThriftMessage().
+        accessor.set_pipelined_count(1);
+        packet_buf->append(request);
+        return;
+    }
+    // Rewrite the message begin with a seqid which is echoed back by the
+    // server to find this RPC.
+    butil::IOBuf body = request;
+    body.pop_front(sizeof(thrift_head_t));
+    std::string method_name;
+    ::apache::thrift::protocol::TMessageType mtype;
+    uint32_t seq_id = 0;
+    bool compact_protocol = false;
+    const butil::Status st = ReadThriftMessageBegin(
+        &body, &method_name, &mtype, &seq_id, &compact_protocol);
+    if (!st.ok()) {
+        return cntl->SetFailed(EREQUEST, "%s", st.error_cstr());
+    }
+    seq_id = SeqIdCorrelator::Get(sock)->AddRequest(correlation_id);
+    AppendThriftFrameAndMessageBegin(packet_buf, method_name, mtype, seq_id,
+                                     body.size(), compact_protocol);
+    packet_buf->append(butil::IOBuf::Movable(body));
 }
 
 } // namespace policy
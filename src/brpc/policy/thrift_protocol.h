@@ -24,7 +24,7 @@
 namespace brpc {
 namespace policy {
 
-// Parse binary protocol format of thrift framed
+// Parse thrift framed messages in binary or compact protocol
 ParseResult ParseThriftMessage(butil::IOBuf* source, Socket* socket, bool read_eof, const void *arg);
 
 // Actions to a (client) request in thrift binary framed format
@@ -0,0 +1,355 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <algorithm>                                    // std::min
+#include <map>
+#include <pthread.h>
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/time.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_splitter.h"
+#include "butil/strings/string_number_conversions.h"
+#include "brpc/socket.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+DEFINE_string(local_zone, "", "Zone of this process. zone_aware load "
+              "balancer prefers servers tagged with the same zone");
+
+// Refresh share of local servers at most once in this interval.
+static const int64_t REFRESH_INTERVAL_US = 100000;
+
+std::string GetZoneFromTag(const std::string& tag) {
+    for (butil::KeyValuePairsSplitter sp(tag.data(), tag.data() + tag.size(),
+                                         ' ', '='); sp; ++sp) {
+        if (sp.key() == "zone") {
+            return sp.value().as_string();
+        }
+    }
+    return std::string();
+}
+
+// Calls to zones, shared by all zone_aware load balancers.
+static pthread_mutex_t s_zone_counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, bvar::Adder<int64_t>*>* s_zone_counters = NULL;
+static bvar::Adder<int64_t>* s_spill_count = NULL;
+
+static bvar::Adder<int64_t>* GetZoneCounter(const std::string& zone) {
+    BAIDU_SCOPED_LOCK(s_zone_counters_mutex);
+    if (s_zone_counters == NULL) {
+        s_zone_counters = new std::map<std::string, bvar::Adder<int64_t>*>;
+        s_spill_count = new bvar::Adder<int64_t>("rpc_zone_aware_lb_spill_count");
+    }
+    bvar::Adder<int64_t>*& counter = (*s_zone_counters)[zone];
+    if (counter == NULL) {
+        counter = new bvar::Adder<int64_t>(
+            "rpc_zone_aware_lb_" + (zone.empty() ? std::string("unknown") : zone),
+            "count");
+    }
+    return counter;
+}
+
+ZoneAwareLoadBalancer::ZoneAwareLoadBalancer()
+    : _local_zone(FLAGS_local_zone)
+    , _min_healthy_ratio(0.7)
+    , _max_latency_us(0)
+    , _local_lb(NULL)
+    , _remote_lb(NULL)
+    , _local_share(1000)
+    , _last_refresh_us(0)
+    , _local_latency_us(0) {
+}
+
+ZoneAwareLoadBalancer::~ZoneAwareLoadBalancer() {
+    if (_local_lb) {
+        _local_lb->Destroy();
+        _local_lb = NULL;
+    }
+    if (_remote_lb) {
+        _remote_lb->Destroy();
+        _remote_lb = NULL;
+    }
+}
+
+bool ZoneAwareLoadBalancer::IsLocal(const ServerId& id) const {
+    if (_local_zone.empty()) {
+        return true;
+    }
+    const std::string zone = GetZoneFromTag(id.tag);
+    return zone.empty() || zone == _local_zone;
+}
+
+bool ZoneAwareLoadBalancer::Add(Servers& bg, SocketId id, const Member& m) {
+    if (bg.members.seek(id) != NULL) {
+        return false;
+    }
+    Member& added = bg.members[id];
+    added = m;
+    if (m.local) {
+        added.index = bg.local_servers.size();
+        bg.local_servers.push_back(id);
+    }
+    return true;
+}
+
+bool ZoneAwareLoadBalancer::Remove(Servers& bg, SocketId id) {
+    Member* m = bg.members.seek(id);
+    if (m == NULL) {
+        return false;
+    }
+    if (m->local) {
+        const size_t index = m->index;
+        bg.local_servers[index] = bg.local_servers.back();
+        bg.members[bg.local_servers[index]].index = index;
+        bg.local_servers.pop_back();
+    }
+    bg.members.erase(id);
+    return true;
+}
+
+void ZoneAwareLoadBalancer::AddMember(const ServerId& id, bool local) {
+    Member m;
+    m.local = local;
+    m.index = 0;
+    m.nselected = GetZoneCounter(GetZoneFromTag(id.tag));
+    _db_servers.Modify(Add, id.id, m);
+}
+
+bool ZoneAwareLoadBalancer::AddServer(const ServerId& id) {
+    const bool local = IsLocal(id);
+    if (!(local ? _local_lb : _remote_lb)->AddServer(id)) {
+        return false;
+    }
+    AddMember(id, local);
+    return true;
+}
+
+bool ZoneAwareLoadBalancer::RemoveServer(const ServerId& id) {
+    if (!(IsLocal(id) ? _local_lb : _remote_lb)->RemoveServer(id)) {
+        return false;
+    }
+    _db_servers.Modify(Remove, id.id);
+    return true;
+}
+
+size_t ZoneAwareLoadBalancer::AddServersInBatch(
+    const std::vector<ServerId>& servers) {
+    std::vector<ServerId> local_servers;
+    std::vector<ServerId> remote_servers;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        (IsLocal(servers[i]) ? local_servers : remote_servers).push_back(servers[i]);
+    }
+    const size_t n = _local_lb->AddServersInBatch(local_servers) +
+        _remote_lb->AddServersInBatch(remote_servers);
+    for (size_t i = 0; i < local_servers.size(); ++i) {
+        AddMember(local_servers[i], true);
+    }
+    for (size_t i = 0; i < remote_servers.size(); ++i) {
+        AddMember(remote_servers[i], false);
+    }
+    return n;
+}
+
+size_t ZoneAwareLoadBalancer::RemoveServersInBatch(
+    const std::vector<ServerId>& servers) {
+    std::vector<ServerId> local_servers;
+    std::vector<ServerId> remote_servers;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        (IsLocal(servers[i]) ? local_servers : remote_servers).push_back(servers[i]);
+    }
+    const size_t n = _local_lb->RemoveServersInBatch(local_servers) +
+        _remote_lb->RemoveServersInBatch(remote_servers);
+    for (size_t i = 0; i < servers.size(); ++i) {
+        _db_servers.Modify(Remove, servers[i].id);
+    }
+    return n;
+}
+
+void ZoneAwareLoadBalancer::RefreshLocalShare(int64_t now_us) {
+    int64_t last_us = _last_refresh_us.load(butil::memory_order_relaxed);
+    if (now_us < last_us + REFRESH_INTERVAL_US ||
+        !_last_refresh_us.compare_exchange_strong(
+            last_us, now_us, butil::memory_order_relaxed)) {
+        return;
+    }
+    size_t nlocal = 0;
+    size_t nhealthy = 0;
+    {
+        butil::DoublyBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            return;
+        }
+        nlocal = s->local_servers.size();
+        for (size_t i = 0; i < nlocal; ++i) {
+            SocketUniquePtr ptr;
+            if (Socket::Address(s->local_servers[i], &ptr) == 0 &&
+                ptr->IsAvailable()) {
+                ++nhealthy;
+            }
+        }
+    }
+    double share = 0;
+    if (nlocal != 0) {
+        share = std::min(1.0, (double)nhealthy / nlocal / _min_healthy_ratio);
+    }
+    const int64_t latency_us = _local_latency_us.load(butil::memory_order_relaxed);
+    if (_max_latency_us > 0 && latency_us > _max_latency_us) {
+        share = share * _max_latency_us / latency_us;
+    }
+    _local_share.store((int)(share * 1000), butil::memory_order_relaxed);
+}
+
+int ZoneAwareLoadBalancer::SelectServer(const SelectIn& in, SelectOut* out) {
+    RefreshLocalShare(butil::gettimeofday_us());
+    const int share = _local_share.load(butil::memory_order_relaxed);
+    const bool local_first =
+        (share >= 1000 || (int)butil::fast_rand_less_than(1000) < share);
+    LoadBalancer* first = local_first ? _local_lb : _remote_lb;
+    LoadBalancer* second = local_first ? _remote_lb : _local_lb;
+    int rc = first->SelectServer(in, out);
+    if (rc != 0 && second->SelectServer(in, out) != 0) {
+        return rc;
+    }
+    // Feedback() measures latencies of local servers.
+    out->need_feedback = true;
+    butil::DoublyBufferedData<Servers>::ScopedPtr s;
+    if (_db_servers.Read(&s) == 0) {
+        const Member* m = s->members.seek((*out->ptr)->id());
+        if (m != NULL) {
+            *m->nselected << 1;
+            if (!m->local && !s->local_servers.empty()) {
+                *s_spill_count << 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void ZoneAwareLoadBalancer::Feedback(const CallInfo& info) {
+    bool local = true;
+    {
+        butil::DoublyBufferedData<Servers>::ScopedPtr s;
+        if (_db_servers.Read(&s) != 0) {
+            return;
+        }
+        const Member* m = s->members.seek(info.server_id);
+        if (m == NULL) {
+            return;
+        }
+        local = m->local;
+    }
+    if (local) {
+        const int64_t latency = butil::gettimeofday_us() - info.begin_time_us;
+        if (info.error_code == 0 && latency > 0) {
+            const int64_t prev = _local_latency_us.load(butil::memory_order_relaxed);
+            // Concurrent feedbacks may overwrite each other, which is
+            // acceptable for a statistic.
+            _local_latency_us.store(prev == 0 ? latency :
+                                    (prev * 15 + latency) / 16,
+                                    butil::memory_order_relaxed);
+        }
+        _local_lb->Feedback(info);
+    } else {
+        _remote_lb->Feedback(info);
+    }
+}
+
+ZoneAwareLoadBalancer* ZoneAwareLoadBalancer::New(
+    const butil::StringPiece& params) const {
+    ZoneAwareLoadBalancer* lb = new (std::nothrow) ZoneAwareLoadBalancer;
+    if (lb && !lb->SetParameters(params)) {
+        delete lb;
+        lb = NULL;
+    }
+    return lb;
+}
+
+void ZoneAwareLoadBalancer::Destroy() {
+    delete this;
+}
+
+void ZoneAwareLoadBalancer::Describe(
+    std::ostream& os, const DescribeOptions& options) {
+    if (!options.verbose) {
+        os << "zone_aware";
+        return;
+    }
+    os << "ZoneAware{local_zone=" << _local_zone
+       << " local_share=" << local_share() / 10.0 << '%';
+    if (_local_lb) {
+        os << " local=";
+        _local_lb->Describe(os, options);
+    }
+    if (_remote_lb) {
+        os << " remote=";
+        _remote_lb->Describe(os, options);
+    }
+    os << '}';
+}
+
+bool ZoneAwareLoadBalancer::SetParameters(const butil::StringPiece& params) {
+    std::string inner = "rr";
+    for (butil::KeyValuePairsSplitter sp(params.begin(), params.end(), ' ', '=');
+            sp; ++sp) {
+        if (sp.value().empty()) {
+            LOG(ERROR) << "Empty value for " << sp.key() << " in lb parameter";
+            return false;
+        }
+        if (sp.key() == "inner") {
+            inner = sp.value().as_string();
+        } else if (sp.key() == "local_zone") {
+            _local_zone = sp.value().as_string();
+        } else if (sp.key() == "min_healthy_ratio") {
+            if (!butil::StringToDouble(sp.value().as_string(), &_min_healthy_ratio)
+                || _min_healthy_ratio <= 0 || _min_healthy_ratio > 1) {
+                LOG(ERROR) << "min_healthy_ratio must be in (0, 1], got "
+                           << sp.value();
+                return false;
+            }
+        } else if (sp.key() == "max_latency_ms") {
+            int64_t max_latency_ms = 0;
+            if (!butil::StringToInt64(sp.value(), &max_latency_ms)
+                || max_latency_ms < 0) {
+                LOG(ERROR) << "Invalid max_latency_ms=" << sp.value();
+                return false;
+            }
+            _max_latency_us = max_latency_ms * 1000;
+        } else {
+            LOG(ERROR) << "Failed to set this unknown parameters "
+                       << sp.key_and_value();
+        }
+    }
+    if (inner == "zone_aware") {
+        LOG(ERROR) << "inner load balancer can't be zone_aware";
+        return false;
+    }
+    const LoadBalancer* proto = LoadBalancerExtension()->Find(inner.c_str());
+    if (proto == NULL) {
+        LOG(ERROR) << "Fail to find inner load balancer " << inner;
+        return false;
+    }
+    _local_lb = proto->New(butil::StringPiece());
+    _remote_lb = proto->New(butil::StringPiece());
+    return _local_lb != NULL && _remote_lb != NULL;
+}
+
+}  // namespace policy
+} // namespace brpc
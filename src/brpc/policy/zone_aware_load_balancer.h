@@ -0,0 +1,102 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
+#define BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
+
+#include <string>
+#include <vector>                                      // std::vector
+#include "butil/atomicops.h"                           // butil::atomic
+#include "butil/containers/flat_map.h"                 // butil::FlatMap
+#include "butil/containers/doubly_buffered_data.h"
+#include "bvar/reducer.h"                              // bvar::Adder
+#include "brpc/load_balancer.h"
+
+namespace brpc {
+namespace policy {
+
+// Returns zone in `tag' of a server, which is the value of "zone" in
+// space-separated key=value pairs, e.g. "zone=z1". Empty if not found.
+std::string GetZoneFromTag(const std::string& tag);
+
+// This LoadBalancer prefers servers in the same zone with this process
+// (-local_zone or local_zone=<zone> parameter). Servers are selected by an
+// inner load balancer (inner=<name>, rr by default) of local servers, or
+// of servers in other zones when:
+//  - local servers are less than min_healthy_ratio healthy, traffic
+//    proportional to the shortage spills, or
+//  - average latency of local servers exceeds max_latency_ms, traffic
+//    proportional to the excess spills, or
+//  - no local server is available.
+// Servers without zones in their tags are considered local. Calls to each
+// zone are counted in /vars as rpc_zone_aware_lb_<zone>_count.
+class ZoneAwareLoadBalancer : public LoadBalancer {
+public:
+    ZoneAwareLoadBalancer();
+    ~ZoneAwareLoadBalancer();
+    bool AddServer(const ServerId& id);
+    bool RemoveServer(const ServerId& id);
+    size_t AddServersInBatch(const std::vector<ServerId>& servers);
+    size_t RemoveServersInBatch(const std::vector<ServerId>& servers);
+    int SelectServer(const SelectIn& in, SelectOut* out);
+    void Feedback(const CallInfo& info);
+    ZoneAwareLoadBalancer* New(const butil::StringPiece& params) const;
+    void Destroy();
+    void Describe(std::ostream& os, const DescribeOptions&);
+
+    // Permille of calls sent to local servers.
+    int local_share() const {
+        return _local_share.load(butil::memory_order_relaxed);
+    }
+
+private:
+    struct Member {
+        bool local;
+        size_t index;       // in local_servers
+        bvar::Adder<int64_t>* nselected;
+    };
+    struct Servers {
+        Servers() {
+            CHECK_EQ(0, members.init(1024, 70));
+        }
+        butil::FlatMap<SocketId, Member> members;
+        std::vector<SocketId> local_servers;
+    };
+    bool SetParameters(const butil::StringPiece& params);
+    bool IsLocal(const ServerId& id) const;
+    static bool Add(Servers& bg, SocketId id, const Member& m);
+    static bool Remove(Servers& bg, SocketId id);
+    void AddMember(const ServerId& id, bool local);
+    void RefreshLocalShare(int64_t now_us);
+
+    std::string _local_zone;
+    double _min_healthy_ratio;
+    int64_t _max_latency_us;
+    LoadBalancer* _local_lb;
+    LoadBalancer* _remote_lb;
+    butil::DoublyBufferedData<Servers> _db_servers;
+    butil::atomic<int> _local_share;
+    butil::atomic<int64_t> _last_refresh_us;
+    butil::atomic<int64_t> _local_latency_us;
+};
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif  // BRPC_POLICY_ZONE_AWARE_LOAD_BALANCER_H
@@ -0,0 +1,646 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <map>
+#include <vector>
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_printf.h"
+#include "butil/thread_local.h"
+#include "brpc/policy/zstd_compress.h"
+#include "brpc/protocol.h"
+#include "brpc/reloadable_flags.h"
+
+#ifdef BRPC_WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>                                // ZDICT_trainFromBuffer
+#endif
+
+
+namespace brpc {
+namespace policy {
+
+#ifdef BRPC_WITH_ZSTD
+
+static bool validate_zstd_compression_level(const char*, int32_t val) {
+    return val >= ZSTD_minCLevel() && val <= ZSTD_maxCLevel();
+}
+DEFINE_int32(zstd_compression_level, 1,
+             "Compression level of COMPRESS_TYPE_ZSTD, higher levels compress "
+             "better but slower, negative levels are even faster than 1");
+BRPC_VALIDATE_GFLAG(zstd_compression_level, validate_zstd_compression_level);
+
+DEFINE_int32(zstd_dict_max_samples, 0,
+             "Max number of messages sampled for each method of baidu_std "
+             "to train zstd dictionaries, 0 disables sampling");
+BRPC_VALIDATE_GFLAG(zstd_dict_max_samples, NonNegativeInteger);
+
+struct ZstdDictionary {
+    ZSTD_CDict* cdict;
+    ZSTD_DDict* ddict;
+};
+
+// Modified by RegisterZstdDictionary() only, which is not thread-safe.
+static std::map<uint32_t, ZstdDictionary>* g_dicts = NULL;
+static std::map<const google::protobuf::MethodDescriptor*, uint32_t>*
+g_method_dicts = NULL;
+
+struct ZstdSamples {
+    ZstdSamples() : nseen(0) {}
+    std::vector<std::string> samples;
+    int64_t nseen;
+};
+static pthread_mutex_t g_samples_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, ZstdSamples>* g_samples = NULL;
+
+static BAIDU_THREAD_LOCAL ZSTD_CCtx* tls_cctx = NULL;
+static BAIDU_THREAD_LOCAL ZSTD_DCtx* tls_dctx = NULL;
+
+static void LogError(const char* what, size_t code) {
+    LOG(WARNING) << "Fail to " << what << ": " << ZSTD_getErrorName(code);
+}
+
+static void FreeCCtx(void* cctx) {
+    ZSTD_freeCCtx((ZSTD_CCtx*)cctx);
+}
+
+static void FreeDCtx(void* dctx) {
+    ZSTD_freeDCtx((ZSTD_DCtx*)dctx);
+}
+
+// Contexts are reused by all compressions in current thread, which saves
+// allocating and initializing of internal tables for each message.
+// Compressions never block, thus it's safe for bthreads to use contexts of
+// the worker running them.
+static ZSTD_CCtx* GetThreadLocalCCtx() {
+    if (tls_cctx == NULL) {
+        tls_cctx = ZSTD_createCCtx();
+        if (tls_cctx == NULL) {
+            LOG(WARNING) << "Fail to ZSTD_createCCtx";
+            return NULL;
+        }
+        butil::thread_atexit(FreeCCtx, tls_cctx);
+    } else {
+        ZSTD_CCtx_reset(tls_cctx, ZSTD_reset_session_and_parameters);
+    }
+    return tls_cctx;
+}
+
+static ZSTD_DCtx* GetThreadLocalDCtx() {
+    if (tls_dctx == NULL) {
+        tls_dctx = ZSTD_createDCtx();
+        if (tls_dctx == NULL) {
+            LOG(WARNING) << "Fail to ZSTD_createDCtx";
+            return NULL;
+        }
+        butil::thread_atexit(FreeDCtx, tls_dctx);
+    } else {
+        ZSTD_DCtx_reset(tls_dctx, ZSTD_reset_session_and_parameters);
+    }
+    return tls_dctx;
+}
+
+static const ZstdDictionary* FindDictionary(uint32_t dict_id) {
+    if (g_dicts == NULL) {
+        return NULL;
+    }
+    std::map<uint32_t, ZstdDictionary>::const_iterator
+        it = g_dicts->find(dict_id);
+    return it != g_dicts->end() ? &it->second : NULL;
+}
+
+// Point `ob' to the space left in current block of `stream' if `ob' is full.
+static bool ReserveOutput(butil::IOBufAsZeroCopyOutputStream* stream,
+                          ZSTD_outBuffer* ob) {
+    if (ob->pos == ob->size) {
+        void* data = NULL;
+        int size = 0;
+        if (!stream->Next(&data, &size)) {
+            LOG(WARNING) << "Fail to allocate output";
+            return false;
+        }
+        ob->dst = data;
+        ob->size = size;
+        ob->pos = 0;
+    }
+    return true;
+}
+
+// Compress `in' and end the frame if `end_op' is ZSTD_e_end, or just flush
+// the compressed data if it's ZSTD_e_flush.
+static bool ZstdCompressWithContext(ZSTD_CCtx* cctx, const butil::IOBuf& in,
+                                    butil::IOBufAsZeroCopyOutputStream* stream,
+                                    ZSTD_outBuffer* ob,
+                                    ZSTD_EndDirective end_op) {
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        const butil::StringPiece blk = in.backing_block(i);
+        ZSTD_inBuffer ib = { blk.data(), blk.size(), 0 };
+        while (ib.pos < ib.size) {
+            if (!ReserveOutput(stream, ob)) {
+                return false;
+            }
+            const size_t rc = ZSTD_compressStream2(cctx, ob, &ib, ZSTD_e_continue);
+            if (ZSTD_isError(rc)) {
+                LogError("ZSTD_compressStream2", rc);
+                return false;
+            }
+        }
+    }
+    ZSTD_inBuffer ib = { NULL, 0, 0 };
+    size_t remaining = 0;
+    do {
+        if (!ReserveOutput(stream, ob)) {
+            return false;
+        }
+        remaining = ZSTD_compressStream2(cctx, ob, &ib, end_op);
+        if (ZSTD_isError(remaining)) {
+            LogError("ZSTD_compressStream2", remaining);
+            return false;
+        }
+    } while (remaining != 0);
+    return true;
+}
+
+static bool ZstdDecompressWithContext(ZSTD_DCtx* dctx, const butil::IOBuf& in,
+                                      butil::IOBufAsZeroCopyOutputStream* stream,
+                                      ZSTD_outBuffer* ob) {
+    // 0 when a frame is fully decoded and flushed.
+    size_t hint = 1;
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; i < nblock; ++i) {
+        const butil::StringPiece blk = in.backing_block(i);
+        ZSTD_inBuffer ib = { blk.data(), blk.size(), 0 };
+        while (ib.pos < ib.size) {
+            if (!ReserveOutput(stream, ob)) {
+                return false;
+            }
+            hint = ZSTD_decompressStream(dctx, ob, &ib);
+            if (ZSTD_isError(hint)) {
+                LogError("ZSTD_decompressStream", hint);
+                return false;
+            }
+        }
+    }
+    // Flush output buffered inside the context due to full blocks.
+    ZSTD_inBuffer ib = { NULL, 0, 0 };
+    while (hint != 0) {
+        if (!ReserveOutput(stream, ob)) {
+            return false;
+        }
+        const size_t pos = ob->pos;
+        hint = ZSTD_decompressStream(dctx, ob, &ib);
+        if (ZSTD_isError(hint)) {
+            LogError("ZSTD_decompressStream", hint);
+            return false;
+        }
+        if (ob->pos == pos) {
+            break;
+        }
+    }
+    if (hint != 0) {
+        LOG(WARNING) << "Incomplete zstd frame, size=" << in.size();
+        return false;
+    }
+    return true;
+}
+
+// Compress with `dict' if it's not NULL, at `level' otherwise.
+static bool ZstdCompress(const butil::IOBuf& in, butil::IOBuf* out,
+                         int level, const ZstdDictionary* dict) {
+    ZSTD_CCtx* cctx = GetThreadLocalCCtx();
+    if (cctx == NULL) {
+        return false;
+    }
+    size_t rc = 0;
+    if (dict != NULL) {
+        rc = ZSTD_CCtx_refCDict(cctx, dict->cdict);
+    } else {
+        rc = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    }
+    if (ZSTD_isError(rc)) {
+        LogError("set compression parameters", rc);
+        return false;
+    }
+    rc = ZSTD_CCtx_setPledgedSrcSize(cctx, in.size());
+    if (ZSTD_isError(rc)) {
+        LogError("ZSTD_CCtx_setPledgedSrcSize", rc);
+        return false;
+    }
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    ZSTD_outBuffer ob = { NULL, 0, 0 };
+    const bool ok = ZstdCompressWithContext(cctx, in, &stream, &ob, ZSTD_e_end);
+    if (ob.pos != ob.size) {
+        stream.BackUp(ob.size - ob.pos);
+    }
+    return ok;
+}
+
+static bool ZstdDecompress(const butil::IOBuf& in, butil::IOBuf* out,
+                           const ZstdDictionary* dict) {
+    ZSTD_DCtx* dctx = GetThreadLocalDCtx();
+    if (dctx == NULL) {
+        return false;
+    }
+    if (dict != NULL) {
+        const size_t rc = ZSTD_DCtx_refDDict(dctx, dict->ddict);
+        if (ZSTD_isError(rc)) {
+            LogError("ZSTD_DCtx_refDDict", rc);
+            return false;
+        }
+    }
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    ZSTD_outBuffer ob = { NULL, 0, 0 };
+    const bool ok = ZstdDecompressWithContext(dctx, in, &stream, &ob);
+    if (ob.pos != ob.size) {
+        stream.BackUp(ob.size - ob.pos);
+    }
+    return ok;
+}
+
+bool ZstdCompress(const butil::IOBuf& in, butil::IOBuf* out, int level) {
+    return ZstdCompress(in, out, level, NULL);
+}
+
+bool ZstdDecompress(const butil::IOBuf& in, butil::IOBuf* out) {
+    return ZstdDecompress(in, out, NULL);
+}
+
+static bool ZstdCompressMessage(const google::protobuf::Message& res,
+                                butil::IOBuf* buf,
+                                const ZstdDictionary* dict) {
+    butil::IOBuf serialized_pb;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&serialized_pb);
+    if (res.SerializeToZeroCopyStream(&wrapper)) {
+        return ZstdCompress(serialized_pb, buf,
+                            FLAGS_zstd_compression_level, dict);
+    }
+    LOG(WARNING) << "Fail to serialize input pb=" << &res;
+    return false;
+}
+
+bool ZstdCompress(const google::protobuf::Message& res, butil::IOBuf* buf) {
+    return ZstdCompressMessage(res, buf, NULL);
+}
+
+bool ZstdDecompress(const butil::IOBuf& data, google::protobuf::Message* req) {
+    butil::IOBuf binary_pb;
+    if (ZstdDecompress(data, &binary_pb, NULL)) {
+        return ParsePbFromIOBuf(req, binary_pb);
+    }
+    return false;
+}
+
+ZstdStreamCompressor::ZstdStreamCompressor() : _cctx(NULL) {}
+
+ZstdStreamCompressor::~ZstdStreamCompressor() {
+    ZSTD_freeCCtx(_cctx);
+}
+
+int ZstdStreamCompressor::Init() {
+    if (_cctx != NULL) {
+        LOG(ERROR) << "Already initialized";
+        return -1;
+    }
+    _cctx = ZSTD_createCCtx();
+    if (_cctx == NULL) {
+        LOG(WARNING) << "Fail to ZSTD_createCCtx";
+        return -1;
+    }
+    const size_t rc = ZSTD_CCtx_setParameter(
+        _cctx, ZSTD_c_compressionLevel, FLAGS_zstd_compression_level);
+    if (ZSTD_isError(rc)) {
+        LogError("set compression level", rc);
+        return -1;
+    }
+    return 0;
+}
+
+bool ZstdStreamCompressor::Compress(const butil::IOBuf& in, butil::IOBuf* out) {
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    ZSTD_outBuffer ob = { NULL, 0, 0 };
+    const bool ok = ZstdCompressWithContext(_cctx, in, &stream, &ob, ZSTD_e_flush);
+    if (ob.pos != ob.size) {
+        stream.BackUp(ob.size - ob.pos);
+    }
+    return ok;
+}
+
+ZstdStreamDecompressor::ZstdStreamDecompressor() : _dctx(NULL) {}
+
+ZstdStreamDecompressor::~ZstdStreamDecompressor() {
+    ZSTD_freeDCtx(_dctx);
+}
+
+int ZstdStreamDecompressor::Init() {
+    if (_dctx != NULL) {
+        LOG(ERROR) << "Already initialized";
+        return -1;
+    }
+    _dctx = ZSTD_createDCtx();
+    if (_dctx == NULL) {
+        LOG(WARNING) << "Fail to ZSTD_createDCtx";
+        return -1;
+    }
+    return 0;
+}
+
+bool ZstdStreamDecompressor::Decompress(const butil::IOBuf& in,
+                                        butil::IOBuf* out) {
+    butil::IOBufAsZeroCopyOutputStream stream(out);
+    ZSTD_outBuffer ob = { NULL, 0, 0 };
+    bool ok = true;
+    const size_t nblock = in.backing_block_num();
+    for (size_t i = 0; ok && i < nblock; ++i) {
+        const butil::StringPiece blk = in.backing_block(i);
+        ZSTD_inBuffer ib = { blk.data(), blk.size(), 0 };
+        while (ib.pos < ib.size) {
+            if (!ReserveOutput(&stream, &ob)) {
+                ok = false;
+                break;
+            }
+            const size_t rc = ZSTD_decompressStream(_dctx, &ob, &ib);
+            if (ZSTD_isError(rc)) {
+                LogError("ZSTD_decompressStream", rc);
+                ok = false;
+                break;
+            }
+        }
+    }
+    // The input ends with a flushed block, all of which is decoded when
+    // the context no longer fills up the output.
+    while (ok) {
+        if (!ReserveOutput(&stream, &ob)) {
+            ok = false;
+            break;
+        }
+        ZSTD_inBuffer ib = { NULL, 0, 0 };
+        const size_t rc = ZSTD_decompressStream(_dctx, &ob, &ib);
+        if (ZSTD_isError(rc)) {
+            LogError("ZSTD_decompressStream", rc);
+            ok = false;
+            break;
+        }
+        if (ob.pos < ob.size) {
+            break;
+        }
+    }
+    if (ob.pos != ob.size) {
+        stream.BackUp(ob.size - ob.pos);
+    }
+    return ok;
+}
+
+uint32_t RegisterZstdDictionary(const std::string& method_full_name,
+                                const butil::StringPiece& dict) {
+    const google::protobuf::MethodDescriptor* method =
+        google::protobuf::DescriptorPool::generated_pool()->FindMethodByName(
+            method_full_name);
+    if (method == NULL) {
+        LOG(ERROR) << "Fail to find method=" << method_full_name;
+        return 0;
+    }
+    const uint32_t dict_id = ZSTD_getDictID_fromDict(dict.data(), dict.size());
+    if (dict_id == 0) {
+        LOG(ERROR) << "The dictionary of " << method_full_name
+                   << " is not trained by zstd";
+        return 0;
+    }
+    if (g_dicts == NULL) {
+        g_dicts = new std::map<uint32_t, ZstdDictionary>;
+        g_method_dicts =
+            new std::map<const google::protobuf::MethodDescriptor*, uint32_t>;
+    }
+    if (g_method_dicts->find(method) != g_method_dicts->end()) {
+        LOG(ERROR) << "A dictionary was registered for " << method_full_name;
+        return 0;
+    }
+    if (FindDictionary(dict_id) == NULL) {
+        ZstdDictionary d;
+        d.cdict = ZSTD_createCDict(dict.data(), dict.size(),
+                                   FLAGS_zstd_compression_level);
+        d.ddict = ZSTD_createDDict(dict.data(), dict.size());
+        if (d.cdict == NULL || d.ddict == NULL) {
+            LOG(ERROR) << "Fail to load the dictionary of " << method_full_name;
+            ZSTD_freeCDict(d.cdict);
+            ZSTD_freeDDict(d.ddict);
+            return 0;
+        }
+        (*g_dicts)[dict_id] = d;
+    }
+    (*g_method_dicts)[method] = dict_id;
+    return dict_id;
+}
+
+uint32_t GetZstdDictionaryId(const google::protobuf::MethodDescriptor* method) {
+    if (g_method_dicts == NULL) {
+        return 0;
+    }
+    std::map<const google::protobuf::MethodDescriptor*, uint32_t>::const_iterator
+        it = g_method_dicts->find(method);
+    return it != g_method_dicts->end() ? it->second : 0;
+}
+
+bool ZstdCompress(const google::protobuf::Message& msg, butil::IOBuf* buf,
+                  uint32_t dict_id) {
+    const ZstdDictionary* dict = FindDictionary(dict_id);
+    if (dict == NULL) {
+        LOG(WARNING) << "Unknown zstd dictionary=" << dict_id;
+        return false;
+    }
+    return ZstdCompressMessage(msg, buf, dict);
+}
+
+bool ZstdDecompress(const butil::IOBuf& data, google::protobuf::Message* msg,
+                    uint32_t dict_id) {
+    const ZstdDictionary* dict = FindDictionary(dict_id);
+    if (dict == NULL) {
+        LOG(WARNING) << "Unknown zstd dictionary=" << dict_id;
+        return false;
+    }
+    butil::IOBuf binary_pb;
+    if (ZstdDecompress(data, &binary_pb, dict)) {
+        return ParsePbFromIOBuf(msg, binary_pb);
+    }
+    return false;
+}
+
+void AddZstdDictionarySample(const google::protobuf::MethodDescriptor* method,
+                             const google::protobuf::Message& msg) {
+    const size_t max_samples = FLAGS_zstd_dict_max_samples;
+    if (max_samples == 0 || method == NULL) {
+        return;
+    }
+    // Reservoir sampling: the n-th message replaces a random sample with
+    // probability of max_samples/n.
+    size_t index = 0;
+    {
+        BAIDU_SCOPED_LOCK(g_samples_mutex);
+        if (g_samples == NULL) {
+            g_samples = new std::map<std::string, ZstdSamples>;
+        }
+        ZstdSamples& s = (*g_samples)[method->full_name()];
+        ++s.nseen;
+        if (s.samples.size() < max_samples) {
+            index = s.samples.size();
+            s.samples.push_back(std::string());
+        } else {
+            index = butil::fast_rand_less_than(s.nseen);
+            if (index >= s.samples.size()) {
+                return;
+            }
+        }
+    }
+    // Serialize out of the lock.
+    std::string data;
+    if (!msg.SerializeToString(&data)) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(g_samples_mutex);
+    ZstdSamples& s = (*g_samples)[method->full_name()];
+    if (index < s.samples.size()) {
+        s.samples[index].swap(data);
+    }
+}
+
+bool TrainZstdDictionary(const std::string& method_full_name,
+                         size_t max_size, butil::IOBuf* dict,
+                         std::string* error) {
+    std::string samples;
+    std::vector<size_t> sizes;
+    {
+        BAIDU_SCOPED_LOCK(g_samples_mutex);
+        std::map<std::string, ZstdSamples>::const_iterator it;
+        if (g_samples == NULL ||
+            (it = g_samples->find(method_full_name)) == g_samples->end()) {
+            *error = "No samples of " + method_full_name;
+            return false;
+        }
+        for (size_t i = 0; i < it->second.samples.size(); ++i) {
+            const std::string& sample = it->second.samples[i];
+            if (!sample.empty()) {
+                samples.append(sample);
+                sizes.push_back(sample.size());
+            }
+        }
+    }
+    std::string buf;
+    buf.resize(max_size);
+    const size_t rc = ZDICT_trainFromBuffer(
+        &buf[0], buf.size(), samples.data(), sizes.data(), sizes.size());
+    if (ZDICT_isError(rc)) {
+        *error = butil::string_printf(
+            "Fail to train dictionary from %lu samples: %s",
+            (unsigned long)sizes.size(), ZDICT_getErrorName(rc));
+        return false;
+    }
+    dict->append(buf.data(), rc);
+    return true;
+}
+
+void DescribeZstdDictionaries(std::ostream& os) {
+    os << "dictionaries:\n";
+    if (g_method_dicts != NULL) {
+        for (std::map<const google::protobuf::MethodDescriptor*, uint32_t>::
+                 const_iterator it = g_method_dicts->begin();
+             it != g_method_dicts->end(); ++it) {
+            os << "  " << it->first->full_name() << " : " << it->second << '\n';
+        }
+    }
+    os << "samples:\n";
+    BAIDU_SCOPED_LOCK(g_samples_mutex);
+    if (g_samples != NULL) {
+        for (std::map<std::string, ZstdSamples>::const_iterator
+                 it = g_samples->begin(); it != g_samples->end(); ++it) {
+            size_t nbytes = 0;
+            for (size_t i = 0; i < it->second.samples.size(); ++i) {
+                nbytes += it->second.samples[i].size();
+            }
+            os << "  " << it->first << " : " << it->second.samples.size()
+               << " samples (" << nbytes << " bytes) out of "
+               << it->second.nseen << " messages\n";
+        }
+    }
+}
+
+#else  // BRPC_WITH_ZSTD
+
+ZstdStreamCompressor::ZstdStreamCompressor() : _cctx(NULL) {}
+ZstdStreamCompressor::~ZstdStreamCompressor() {}
+
+int ZstdStreamCompressor::Init() {
+    LOG(ERROR) << "Fail to init zstd stream compressor: "
+        "brpc is not built with zstd";
+    return -1;
+}
+
+bool ZstdStreamCompressor::Compress(const butil::IOBuf&, butil::IOBuf*) {
+    return false;
+}
+
+ZstdStreamDecompressor::ZstdStreamDecompressor() : _dctx(NULL) {}
+ZstdStreamDecompressor::~ZstdStreamDecompressor() {}
+
+int ZstdStreamDecompressor::Init() {
+    LOG(ERROR) << "Fail to init zstd stream decompressor: "
+        "brpc is not built with zstd";
+    return -1;
+}
+
+bool ZstdStreamDecompressor::Decompress(const butil::IOBuf&, butil::IOBuf*) {
+    return false;
+}
+
+uint32_t RegisterZstdDictionary(const std::string& method_full_name,
+                                const butil::StringPiece&) {
+    LOG(ERROR) << "Fail to register zstd dictionary of " << method_full_name
+               << ": brpc is not built with zstd";
+    return 0;
+}
+
+uint32_t GetZstdDictionaryId(const google::protobuf::MethodDescriptor*) {
+    return 0;
+}
+
+bool ZstdCompress(const google::protobuf::Message&, butil::IOBuf*, uint32_t) {
+    return false;
+}
+
+bool ZstdDecompress(const butil::IOBuf&, google::protobuf::Message*, uint32_t) {
+    return false;
+}
+
+void AddZstdDictionarySample(const google::protobuf::MethodDescriptor*,
+                             const google::protobuf::Message&) {}
+
+bool TrainZstdDictionary(const std::string&, size_t, butil::IOBuf*,
+                         std::string* error) {
+    *error = "brpc is not built with zstd";
+    return false;
+}
+
+void DescribeZstdDictionaries(std::ostream& os) {
+    os << "brpc is not built with zstd\n";
+}
+
+#endif  // BRPC_WITH_ZSTD
+
+}  // namespace policy
+} // namespace brpc
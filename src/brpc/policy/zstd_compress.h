@@ -0,0 +1,144 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POLICY_ZSTD_COMPRESS_H
+#define BRPC_POLICY_ZSTD_COMPRESS_H
+
+#include <ostream>
+#include <string>
+#include <google/protobuf/descriptor.h>       // MethodDescriptor
+#include <google/protobuf/message.h>          // Message
+#include "butil/iobuf.h"                       // IOBuf
+#include "butil/macros.h"
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
+namespace brpc {
+namespace policy {
+
+// [Only available when brpc is built with BRPC_WITH_ZSTD]
+// Input and output are streamed over blocks of IOBuf without being
+// flattened. Handlers registered for COMPRESS_TYPE_ZSTD compress at level
+// of -zstd_compression_level. Compression contexts are cached in each
+// worker thread.
+
+// Compress serialized `msg' into `buf'.
+bool ZstdCompress(const google::protobuf::Message& msg, butil::IOBuf* buf);
+
+// Parse `msg' from decompressed `buf'
+bool ZstdDecompress(const butil::IOBuf& data, google::protobuf::Message* msg);
+
+// Put compressed `in' into `out' at compression `level', which ranges
+// from ZSTD_minCLevel() to ZSTD_maxCLevel(). Negative levels are faster
+// and compress less.
+bool ZstdCompress(const butil::IOBuf& in, butil::IOBuf* out, int level);
+
+// Put decompressed `in' into `out'.
+bool ZstdDecompress(const butil::IOBuf& in, butil::IOBuf* out);
+
+// Compress messages of a stream with one context, namely each message is
+// compressed with history of former ones, which compresses small and similar
+// messages much better and faster than compressing them separately. Each
+// message is flushed so that it can be decompressed without later ones.
+// Messages must be decompressed by one ZstdStreamDecompressor in the same
+// order. Not thread-safe.
+class ZstdStreamCompressor {
+public:
+    ZstdStreamCompressor();
+    ~ZstdStreamCompressor();
+
+    // Compress at -zstd_compression_level.
+    // Returns 0 on success, -1 otherwise.
+    int Init();
+
+    // Append compressed `in' to `out'. The stream is broken on failure.
+    bool Compress(const butil::IOBuf& in, butil::IOBuf* out);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ZstdStreamCompressor);
+    ZSTD_CCtx_s* _cctx;
+};
+
+class ZstdStreamDecompressor {
+public:
+    ZstdStreamDecompressor();
+    ~ZstdStreamDecompressor();
+
+    // Returns 0 on success, -1 otherwise.
+    int Init();
+
+    // Append decompressed `in', which is one compressed message of
+    // ZstdStreamCompressor, to `out'. The stream is broken on failure.
+    bool Decompress(const butil::IOBuf& in, butil::IOBuf* out);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ZstdStreamDecompressor);
+    ZSTD_DCtx_s* _dctx;
+};
+
+// Small messages are hardly compressible by themselves, a dictionary
+// trained from typical messages makes the difference. Dictionaries are
+// registered per method and used by baidu_std when the compress type is
+// COMPRESS_TYPE_ZSTD, with id of the dictionary carried in RpcMeta:
+//  - A client compresses requests with the dictionary of the method, thus
+//    servers must have registered the dictionary before clients.
+//  - A server compresses responses with the dictionary only when the
+//    client registered the same one.
+
+// [NOT thread-safe] Register dictionary `dict' trained by zstd (namely
+// `zstd --train' or /zstd_dict/<method> of builtin services) for method
+// `method_full_name' (e.g. "example.EchoService.Echo"). Messages are
+// compressed at -zstd_compression_level when the dictionary is registered.
+// Should be called before any RPC is issued or received.
+// Returns non-zero id of the dictionary on success, 0 otherwise.
+uint32_t RegisterZstdDictionary(const std::string& method_full_name,
+                                const butil::StringPiece& dict);
+
+// Returns id of the dictionary registered for `method', 0 if none.
+uint32_t GetZstdDictionaryId(const google::protobuf::MethodDescriptor* method);
+
+// Compress serialized `msg' into `buf' with dictionary `dict_id'.
+bool ZstdCompress(const google::protobuf::Message& msg, butil::IOBuf* buf,
+                  uint32_t dict_id);
+
+// Parse `msg' from `data' decompressed with dictionary `dict_id'.
+bool ZstdDecompress(const butil::IOBuf& data, google::protobuf::Message* msg,
+                    uint32_t dict_id);
+
+// Keep serialized `msg' as a sample of `method' for training dictionaries,
+// at most -zstd_dict_max_samples samples are kept for each method.
+// Does nothing when the flag is 0.
+void AddZstdDictionarySample(const google::protobuf::MethodDescriptor* method,
+                             const google::protobuf::Message& msg);
+
+// Train a dictionary no larger than `max_size' from samples of method
+// `method_full_name'.
+// Returns true on success, false otherwise and `error' is set.
+bool TrainZstdDictionary(const std::string& method_full_name,
+                         size_t max_size, butil::IOBuf* dict,
+                         std::string* error);
+
+// Print samples and registered dictionaries of all methods.
+void DescribeZstdDictionaries(std::ostream& os);
+
+}  // namespace policy
+} // namespace brpc
+
+
+#endif // BRPC_POLICY_ZSTD_COMPRESS_H
@@ -0,0 +1,108 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_POOLED_CALL_H
+#define BRPC_POOLED_CALL_H
+
+#include <google/protobuf/service.h>
+#include "butil/macros.h"
+#include "butil/object_pool.h"
+#include "brpc/controller.h"
+
+
+namespace brpc {
+
+// Get a Controller from a pool with thread-local free lists. The Controller
+// is in its initial state. Return it by ReturnPooledController() after the
+// RPC finishes rather than deleting it.
+inline Controller* GetPooledController() {
+    return butil::get_object<Controller>();
+}
+
+// Reset `cntl' and put it back into the pool.
+inline void ReturnPooledController(Controller* cntl) {
+    cntl->Reset();
+    butil::return_object(cntl);
+}
+
+// A pooled closure carrying the Controller and the Response of an
+// asynchronous call. Run() calls the user callback and puts the object
+// back into the pool, thus a steady-state async client does not allocate
+// memory per call:
+//
+//   static void OnEchoDone(brpc::PooledCall<EchoResponse>* call, void* arg) {
+//       if (call->cntl()->Failed()) { ... }
+//       ... call->response() ...
+//       // Don't touch `call' after returning.
+//   }
+//   brpc::PooledCall<EchoResponse>* call =
+//       brpc::PooledCall<EchoResponse>::New(OnEchoDone, arg);
+//   stub.Echo(call->cntl(), &request, call->response(), call);
+//
+// The Controller is Reset() and the Response is Clear()-ed before reuse,
+// both keep their internal buffers.
+template <typename Response>
+class PooledCall : public google::protobuf::Closure {
+public:
+    typedef void (*Callback)(PooledCall* call, void* arg);
+
+    static PooledCall* New(Callback callback, void* arg) {
+        PooledCall* call = butil::get_object<PooledCall>();
+        if (call != NULL) {
+            call->_callback = callback;
+            call->_arg = arg;
+        }
+        return call;
+    }
+
+    Controller* cntl() { return &_cntl; }
+    Response* response() { return &_response; }
+
+    void Run() override {
+        if (_callback) {
+            _callback(this, _arg);
+        }
+        Recycle();
+    }
+
+    // Put this object back into the pool without running the callback,
+    // for calls that were never issued.
+    void Recycle() {
+        _cntl.Reset();
+        _response.Clear();
+        _callback = NULL;
+        _arg = NULL;
+        butil::return_object(this);
+    }
+
+    // Use New() instead, the constructor is public for ObjectPool only.
+    PooledCall() : _callback(NULL), _arg(NULL) {}
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PooledCall);
+
+    Callback _callback;
+    void* _arg;
+    Controller _cntl;
+    Response _response;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_POOLED_CALL_H
@@ -70,9 +70,9 @@ ProgressiveAttachment::~ProgressiveAttachment() {
 
 static char s_hex_map[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8',
                             '9', 'A', 'B', 'C', 'D', 'E', 'F' };
-inline char ToHex(uint32_t size/*0-15*/) { return s_hex_map[size]; }
+inline char ToHex(uint64_t size/*0-15*/) { return s_hex_map[size]; }
 
-inline void AppendChunkHead(butil::IOBuf* buf, uint32_t size) {
+inline void AppendChunkHead(butil::IOBuf* buf, uint64_t size) {
     char tmp[32];
     int i = (int)sizeof(tmp);
     tmp[--i] = '\n';
@@ -81,7 +81,7 @@ inline void AppendChunkHead(butil::IOBuf* buf, uint32_t size) {
         tmp[--i] = '0';
     } else {
         for (--i; i >= 0; --i) {
-            const uint32_t new_size = (size >> 4);
+            const uint64_t new_size = (size >> 4);
             tmp[i] = ToHex(size - (new_size << 4));
             size = new_size;
             if (size == 0) {
@@ -182,6 +182,48 @@ int ProgressiveAttachment::Write(const void* data, size_t n) {
     }
 }
 
+int ProgressiveAttachment::WriteFile(int fd, off_t offset, size_t length) {
+    if (length == 0) {
+        LOG_EVERY_SECOND(WARNING)
+            << "Write an empty chunk. To suppress this warning, check emptiness"
+            " of the chunk before calling ProgressiveAttachment.WriteFile()";
+        return 0;
+    }
+    int rpc_state = _rpc_state.load(butil::memory_order_acquire);
+    if (rpc_state == RPC_RUNNING) {
+        // Http headers are not written yet, the content has to be saved
+        // in _saved_buf.
+        butil::IOPortal content;
+        size_t nread = 0;
+        while (nread < length) {
+            const ssize_t nr = content.pappend_from_file_descriptor(
+                fd, offset + nread, length - nread);
+            if (nr <= 0) {
+                if (nr == 0) {
+                    errno = ENODATA;
+                } else if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            nread += nr;
+        }
+        return Write(content);
+    }
+    if (rpc_state == RPC_SUCCEED) {
+        butil::IOBuf head;
+        butil::IOBuf tail;
+        if (!_before_http_1_1) {
+            AppendChunkHead(&head, length);
+            tail.append("\r\n", 2);
+        }
+        return _httpsock->WriteFile(&head, fd, offset, length, &tail);
+    } else {
+        errno = ECANCELED;
+        return -1;
+    }
+}
+
 void ProgressiveAttachment::MarkRPCAsDone(bool rpc_failed) {
     // Notes:
     // * Writing here is more timely than being flushed in next Write(), in
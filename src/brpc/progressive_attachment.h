@@ -39,6 +39,16 @@ public:
     int Write(const butil::IOBuf& data);
     int Write(const void* data, size_t n);
 
+    // [Thread-safe]
+    // Write `length' bytes of file `fd' starting from `offset' as one HTTP
+    // chunk. The content is sent by sendfile() without being read into
+    // memory on non-SSL connections after the RPC is done, otherwise it's
+    // read and written as Write(). `fd' can be closed after return.
+    // Returns 0 on success, -1 otherwise and errno is set. Namely errno is
+    // EOVERCROWDED when written but unsent bytes, including the file regions,
+    // exceed -socket_max_unwritten_bytes, in which case retry later.
+    int WriteFile(int fd, off_t offset, size_t length);
+
     // Get ip/port of peer/self.
     butil::EndPoint remote_side() const;
     butil::EndPoint local_side() const;
@@ -0,0 +1,94 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <google/protobuf/descriptor.pb.h>     // FileDescriptorProto
+#include "butil/logging.h"
+#include "brpc/raw_service.h"
+
+
+namespace brpc {
+
+RawService::RawService(const std::string& full_service_name,
+                       const std::vector<std::string>& method_names)
+    : _pool(new google::protobuf::DescriptorPool)
+    , _descriptor(NULL) {
+    // Describe the service in a standalone proto file so that it can be
+    // added into Server like services generated by protoc. Requests and
+    // responses are empty messages which are never parsed.
+    std::string package;
+    std::string service_name = full_service_name;
+    const size_t dot_pos = full_service_name.rfind('.');
+    if (dot_pos != std::string::npos) {
+        package = full_service_name.substr(0, dot_pos);
+        service_name = full_service_name.substr(dot_pos + 1);
+    }
+    const std::string prefix = (package.empty() ? "." : "." + package + ".");
+    google::protobuf::FileDescriptorProto file;
+    file.set_name(full_service_name + ".raw.proto");
+    if (!package.empty()) {
+        file.set_package(package);
+    }
+    file.add_message_type()->set_name("RawRequest");
+    file.add_message_type()->set_name("RawResponse");
+    google::protobuf::ServiceDescriptorProto* svc = file.add_service();
+    svc->set_name(service_name);
+    for (size_t i = 0; i < method_names.size(); ++i) {
+        google::protobuf::MethodDescriptorProto* m = svc->add_method();
+        m->set_name(method_names[i]);
+        m->set_input_type(prefix + "RawRequest");
+        m->set_output_type(prefix + "RawResponse");
+    }
+    const google::protobuf::FileDescriptor* fd = _pool->BuildFile(file);
+    if (fd == NULL || fd->service_count() != 1) {
+        LOG(ERROR) << "Invalid service=" << full_service_name
+                   << " or its methods";
+        return;
+    }
+    _descriptor = fd->service(0);
+}
+
+RawService::~RawService() {}
+
+const google::protobuf::ServiceDescriptor* RawService::GetDescriptor() {
+    return _descriptor;
+}
+
+void RawService::CallMethod(const google::protobuf::MethodDescriptor*,
+                            google::protobuf::RpcController* controller,
+                            const google::protobuf::Message* request,
+                            google::protobuf::Message* response,
+                            google::protobuf::Closure* done) {
+    // Protocols put bytes of RawService into SerializedRequest and send
+    // SerializedResponse as it is.
+    const SerializedRequest* req = static_cast<const SerializedRequest*>(request);
+    SerializedResponse* res = static_cast<SerializedResponse*>(response);
+    ProcessRawRequest(static_cast<Controller*>(controller),
+                      req->serialized_data(), &res->serialized_data(), done);
+}
+
+const google::protobuf::Message& RawService::GetRequestPrototype(
+    const google::protobuf::MethodDescriptor*) const {
+    return _request_prototype;
+}
+
+const google::protobuf::Message& RawService::GetResponsePrototype(
+    const google::protobuf::MethodDescriptor*) const {
+    return _response_prototype;
+}
+
+} // namespace brpc
@@ -0,0 +1,104 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RAW_SERVICE_H
+#define BRPC_RAW_SERVICE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <google/protobuf/service.h>
+#include <google/protobuf/descriptor.h>
+#include "butil/iobuf.h"                       // butil::IOBuf
+#include "brpc/controller.h"                   // Controller
+#include "brpc/serialized_request.h"           // SerializedRequest
+#include "brpc/serialized_response.h"          // SerializedResponse
+
+
+namespace brpc {
+
+// A service whose requests and responses are bytes instead of protobuf
+// messages, for payloads in formats like FlatBuffers or Cap'n Proto which
+// need no parsing. It's added into Server by AddService() like other
+// services and accessed with baidu_std, http or h2(gRPC), sharing naming,
+// load balancing, tracing, limiters and /status of protobuf services.
+//
+//   class MyRawService : public brpc::RawService {
+//   public:
+//       MyRawService() : brpc::RawService("example.FooService", {"Get", "Set"}) {}
+//       void ProcessRawRequest(brpc::Controller* cntl,
+//                              const butil::IOBuf& request,
+//                              butil::IOBuf* response,
+//                              google::protobuf::Closure* done) override {
+//           brpc::ClosureGuard done_guard(done);
+//           if (cntl->method()->name() == "Get") { ... }
+//       }
+//   };
+//
+// Clients send the bytes of requests with:
+//   baidu_std: SetRawBaiduStdMethod() (baidu_master_service.h) and
+//              SerializedRequest/SerializedResponse, NULL MethodDescriptor.
+//   http/h2:   the body of request to /example.FooService/Get.
+class RawService : public google::protobuf::Service {
+public:
+    // `full_service_name' is the service name with package, e.g.
+    // "example.FooService", `method_names' are names of all methods.
+    // Check GetDescriptor() for errors of the names.
+    RawService(const std::string& full_service_name,
+               const std::vector<std::string>& method_names);
+    ~RawService();
+
+    // Process the request to cntl->method(). `request' is the bytes sent by
+    // the client, which over baidu_std are compressed with
+    // cntl->request_compress_type(). Put bytes of the response into
+    // `response', which are sent as they are and over baidu_std tagged with
+    // cntl->response_compress_type(). Encodings of http/h2 are handled by
+    // the framework. You must call done->Run() to send the response.
+    virtual void ProcessRawRequest(Controller* cntl,
+                                   const butil::IOBuf& request,
+                                   butil::IOBuf* response,
+                                   google::protobuf::Closure* done) = 0;
+
+    // implements Service ----------------------------------------------
+
+    // NULL if the names given to the constructor are invalid, in which case
+    // Server::AddService() fails.
+    const google::protobuf::ServiceDescriptor* GetDescriptor() override;
+    void CallMethod(const google::protobuf::MethodDescriptor* method,
+                    google::protobuf::RpcController* controller,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done) override;
+    const google::protobuf::Message& GetRequestPrototype(
+        const google::protobuf::MethodDescriptor* method) const override;
+    const google::protobuf::Message& GetResponsePrototype(
+        const google::protobuf::MethodDescriptor* method) const override;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RawService);
+
+    std::unique_ptr<google::protobuf::DescriptorPool> _pool;
+    const google::protobuf::ServiceDescriptor* _descriptor;
+    SerializedRequest _request_prototype;
+    SerializedResponse _response_prototype;
+};
+
+} // namespace brpc
+
+
+#endif // BRPC_RAW_SERVICE_H
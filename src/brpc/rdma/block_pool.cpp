@@ -0,0 +1,183 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdlib.h>                             // posix_memalign, malloc
+#include <algorithm>                            // std::min
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"                    // butil::atomic
+#include "butil/iobuf.h"                        // IOBuf::DEFAULT_BLOCK_SIZE
+#include "butil/logging.h"
+#include "butil/macros.h"
+#include "butil/scoped_lock.h"                  // BAIDU_SCOPED_LOCK
+#include "brpc/rdma/block_pool.h"
+
+DECLARE_int32(iobuf_max_block_size);
+
+namespace brpc {
+namespace rdma {
+
+DEFINE_int32(rdma_memory_region_size_mb, 64,
+             "Size of each registered memory region of the block pool");
+DEFINE_int32(rdma_max_memory_regions, 16,
+             "Max number of registered memory regions of the block pool, "
+             "blocks are allocated by malloc and copied when being posted "
+             "after all regions are used up");
+
+static const size_t MAX_REGIONS = 64;
+static const size_t REGION_ALIGNMENT = 4096;
+
+struct Region {
+    char* start;
+    size_t size;
+    uint32_t id;
+};
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+// Regions are only appended and never removed, readers see a region after
+// loading g_nregion with acquire.
+static Region g_regions[MAX_REGIONS];
+static butil::static_atomic<size_t> g_nregion = BUTIL_STATIC_ATOMIC_INIT(0);
+
+static RegisterMemoryCallback g_register_memory = NULL;
+// Allocator replaced by the pool, blocks not in regions belong to it.
+static butil::iobuf::BlockAllocator g_prev_allocator = { malloc, free };
+static pthread_mutex_t g_free_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FreeBlock* g_free_list = NULL;
+static size_t g_nfree = 0;
+
+static size_t max_regions() {
+    return std::min((size_t)std::max(FLAGS_rdma_max_memory_regions, 0),
+                    MAX_REGIONS);
+}
+
+// Create a region and put its blocks into the free list.
+// g_free_mutex must be locked.
+static int AddRegionLocked() {
+    const size_t nregion = g_nregion.load(butil::memory_order_relaxed);
+    if (nregion >= max_regions()) {
+        return -1;
+    }
+    const size_t block_size = butil::IOBuf::DEFAULT_BLOCK_SIZE;
+    const size_t size = (size_t)FLAGS_rdma_memory_region_size_mb << 20;
+    const size_t nblock = size / block_size;
+    if (nblock == 0) {
+        LOG(ERROR) << "-rdma_memory_region_size_mb is too small";
+        return -1;
+    }
+    void* mem = NULL;
+    if (posix_memalign(&mem, REGION_ALIGNMENT, size) != 0) {
+        LOG(ERROR) << "Fail to allocate memory region of " << size << " bytes";
+        return -1;
+    }
+    const uint32_t id = g_register_memory(mem, size);
+    if (id == 0) {
+        LOG(ERROR) << "Fail to register memory region of " << size << " bytes";
+        free(mem);
+        return -1;
+    }
+    Region& r = g_regions[nregion];
+    r.start = static_cast<char*>(mem);
+    r.size = nblock * block_size;
+    r.id = id;
+    g_nregion.store(nregion + 1, butil::memory_order_release);
+    for (size_t i = nblock; i > 0; --i) {
+        FreeBlock* b = reinterpret_cast<FreeBlock*>(r.start + (i - 1) * block_size);
+        b->next = g_free_list;
+        g_free_list = b;
+    }
+    g_nfree += nblock;
+    return 0;
+}
+
+static const Region* FindRegion(const void* buf) {
+    const char* p = static_cast<const char*>(buf);
+    const size_t nregion = g_nregion.load(butil::memory_order_acquire);
+    for (size_t i = 0; i < nregion; ++i) {
+        const Region& r = g_regions[i];
+        if (p >= r.start && p < r.start + r.size) {
+            return &r;
+        }
+    }
+    return NULL;
+}
+
+int InitBlockPool(RegisterMemoryCallback cb) {
+    if (cb == NULL) {
+        LOG(ERROR) << "Param[cb] is NULL";
+        return -1;
+    }
+    BAIDU_SCOPED_LOCK(g_free_mutex);
+    if (g_register_memory != NULL) {
+        LOG(ERROR) << "InitBlockPool was called";
+        return -1;
+    }
+    g_register_memory = cb;
+    if (AddRegionLocked() != 0) {
+        g_register_memory = NULL;
+        return -1;
+    }
+    const butil::iobuf::BlockAllocator allocator = { AllocBlock, DeallocBlock };
+    g_prev_allocator = butil::iobuf::set_block_allocator(allocator);
+    // Only blocks of DEFAULT_BLOCK_SIZE are carved from regions, larger
+    // blocks would be copied when being posted.
+    FLAGS_iobuf_max_block_size = butil::IOBuf::DEFAULT_BLOCK_SIZE;
+    return 0;
+}
+
+void* AllocBlock(size_t size) {
+    if (size == butil::IOBuf::DEFAULT_BLOCK_SIZE) {
+        BAIDU_SCOPED_LOCK(g_free_mutex);
+        if (g_free_list != NULL || AddRegionLocked() == 0) {
+            FreeBlock* b = g_free_list;
+            g_free_list = b->next;
+            --g_nfree;
+            return b;
+        }
+    }
+    return g_prev_allocator.allocate(size);
+}
+
+void DeallocBlock(void* buf) {
+    if (buf == NULL) {
+        return;
+    }
+    if (FindRegion(buf) == NULL) {
+        return g_prev_allocator.deallocate(buf);
+    }
+    FreeBlock* b = static_cast<FreeBlock*>(buf);
+    BAIDU_SCOPED_LOCK(g_free_mutex);
+    b->next = g_free_list;
+    g_free_list = b;
+    ++g_nfree;
+}
+
+uint32_t GetRegionId(const void* buf) {
+    const Region* r = FindRegion(buf);
+    return r ? r->id : 0;
+}
+
+size_t GetFreeBlockCount() {
+    BAIDU_SCOPED_LOCK(g_free_mutex);
+    return g_nfree;
+}
+
+} // namespace rdma
+} // namespace brpc
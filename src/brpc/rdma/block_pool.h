@@ -0,0 +1,69 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RDMA_BLOCK_POOL_H
+#define BRPC_RDMA_BLOCK_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace brpc {
+namespace rdma {
+
+// Memory of IOBuf blocks must be registered to the NIC before being posted
+// to RDMA queue pairs and registering is too slow to be done per block.
+// The block pool carves IOBuf blocks out of a few large regions which are
+// registered once when created, and replaces the allocator of IOBuf blocks
+// so that data appended into IOBuf can be sent without copying.
+//
+// The pool does not depend on any verbs library: the RDMA layer passes in
+// a callback to register regions (namely calling ibv_reg_mr) and looks up
+// the returned id (namely lkey of the memory region) with GetRegionId()
+// when posting blocks.
+
+// Register [buf, buf + len) and return a non-zero id of the registration,
+// 0 on failure.
+typedef uint32_t (*RegisterMemoryCallback)(void* buf, size_t len);
+
+// Create the first region, call `cb' on every created region and install
+// the pool as allocator of IOBuf blocks.
+// Returns 0 on success, -1 otherwise.
+int InitBlockPool(RegisterMemoryCallback cb);
+
+// Allocate `size' bytes of memory for an IOBuf block. Blocks with size of
+// IOBuf::DEFAULT_BLOCK_SIZE come from registered regions unless all regions
+// are used up, other sizes are allocated by the allocator replaced by
+// InitBlockPool().
+void* AllocBlock(size_t size);
+
+// Deallocate memory returned by AllocBlock().
+void DeallocBlock(void* buf);
+
+// Returns id of the registered region containing `buf', 0 if `buf' is not
+// allocated from regions, in which case the data should be copied into
+// registered memory before being posted.
+uint32_t GetRegionId(const void* buf);
+
+// Number of blocks in regions that are not allocated now. For testing.
+size_t GetFreeBlockCount();
+
+} // namespace rdma
+} // namespace brpc
+
+
+#endif  // BRPC_RDMA_BLOCK_POOL_H
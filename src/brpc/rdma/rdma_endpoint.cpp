@@ -0,0 +1,801 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>                          // htonl
+#include <sys/socket.h>
+#include <algorithm>                            // std::min
+#include <gflags/gflags.h>
+#include "butil/fast_rand.h"
+#include "butil/fd_utility.h"                   // make_non_blocking
+#include "butil/logging.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/butex.h"
+#include "bthread/unstable.h"                   // bthread_timer_add
+#include "bvar/bvar.h"                          // bvar::Adder
+#include "brpc/errno.pb.h"
+#include "brpc/event_dispatcher.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/rdma/block_pool.h"
+#include "brpc/rdma/rdma_helper.h"
+#include "brpc/rdma/rdma_endpoint.h"
+
+namespace brpc {
+namespace rdma {
+
+DEFINE_int32(rdma_window_size, 128,
+             "Number of receive buffers posted by each RDMA connection, which"
+             " is also the max number of sends in flight to the peer");
+BRPC_VALIDATE_GFLAG(rdma_window_size, PositiveInteger);
+
+static const char RDMA_HELLO[] = "BRPCRDMH";
+static const char RDMA_ACCEPTED[] = "BRPCRDMA";
+static const char RDMA_DECLINED[] = "BRPCRDMD";
+static const size_t RDMA_MAGIC_LEN = sizeof(RDMA_HELLO) - 1;
+static const int64_t RDMA_HANDSHAKE_TIMEOUT_MS = 3000;
+
+#if defined(MSG_NOSIGNAL)
+static const int RDMA_SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int RDMA_SEND_FLAGS = 0;
+#endif
+
+// Integers are in network byte order.
+struct RdmaHello {
+    char magic[8];
+    uint32_t qpn;
+    uint32_t psn;
+    uint16_t lid;
+    uint8_t mtu;
+    uint8_t reserved;
+    // Bytes of each receive buffer.
+    uint32_t block_size;
+    // Number of receive buffers for sends of the peer.
+    uint32_t window;
+    uint8_t gid[16];
+};
+BAIDU_CASSERT(sizeof(RdmaHello) == 44, sizeof_RdmaHello_must_be_44);
+
+static bvar::Adder<int64_t>* g_rdma_conn_count = NULL;
+static pthread_once_t g_rdma_conn_count_once = PTHREAD_ONCE_INIT;
+static void InitRdmaConnectionCount() {
+    g_rdma_conn_count = new bvar::Adder<int64_t>("rpc_rdma_connection_count");
+}
+
+static int SendHelloMessage(int fd, const RdmaHello& msg) {
+    ssize_t nw = 0;
+    do {
+        nw = send(fd, &msg, sizeof(msg), RDMA_SEND_FLAGS);
+    } while (nw < 0 && errno == EINTR);
+    if (nw != (ssize_t)sizeof(msg)) {
+        if (nw >= 0) {
+            // Nothing was written before on the connection.
+            errno = ENOBUFS;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+RdmaEndpoint::RdmaEndpoint()
+    : _state(HANDSHAKING)
+    , _channel(NULL)
+    , _cq(NULL)
+    , _qp(NULL)
+    , _psn(0)
+    , _recv_block_size(0)
+    , _sq_tail(0)
+    , _sq_head(0)
+    , _remote_window(0)
+    , _remote_block_size(0)
+    , _credits(0)
+    , _nack_inflight(0)
+    , _writable_butex(bthread::butex_create_checked<butil::atomic<int> >())
+    , _notify_armed(false)
+    , _nreply(0)
+    , _done_taken(false)
+    , _done(NULL)
+    , _done_data(NULL)
+    , _timer(0) {
+    _writable_butex->store(0, butil::memory_order_relaxed);
+}
+
+RdmaEndpoint* RdmaEndpoint::CreateClientSide() {
+    RdmaEndpoint* ep = new RdmaEndpoint;
+    if (ep->Init() != 0) {
+        delete ep;
+        return NULL;
+    }
+    return ep;
+}
+
+void RdmaEndpoint::set_active() {
+    pthread_once(&g_rdma_conn_count_once, InitRdmaConnectionCount);
+    *g_rdma_conn_count << 1;
+    _state.store(ACTIVE, butil::memory_order_release);
+}
+
+int RdmaEndpoint::SendHello(int fd) {
+    RdmaHello hello;
+    FillHello(&hello, RDMA_HELLO);
+    return SendHelloMessage(fd, hello);
+}
+
+int RdmaEndpoint::ReadReply(int fd) {
+    BAIDU_CASSERT(sizeof(_reply) >= sizeof(RdmaHello), reply_is_too_small);
+    while (_nreply < sizeof(RdmaHello)) {
+        const ssize_t nr = read(fd, _reply + _nreply, sizeof(RdmaHello) - _nreply);
+        if (nr <= 0) {
+            if (nr == 0) {
+                // Probably closed by a server not knowing the hello.
+                errno = ECONNRESET;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        _nreply += nr;
+    }
+    RdmaHello reply;
+    memcpy(&reply, _reply, sizeof(reply));
+    if (memcmp(reply.magic, RDMA_ACCEPTED, RDMA_MAGIC_LEN) == 0) {
+        return Connect(reply) == 0 ? 1 : -1;
+    }
+    if (memcmp(reply.magic, RDMA_DECLINED, RDMA_MAGIC_LEN) == 0) {
+        return 0;
+    }
+    errno = EPROTO;
+    return -1;
+}
+
+ssize_t RdmaEndpoint::ReadHello(int fd, butil::IOBuf* buf, bool accept,
+                                bool* is_hello, RdmaEndpoint** endpoint) {
+    *is_hello = false;
+    *endpoint = NULL;
+    RdmaHello hello;
+    ssize_t nr = recv(fd, &hello, sizeof(hello), MSG_PEEK);
+    if (nr <= 0) {
+        return nr;
+    }
+    if (memcmp(hello.magic, RDMA_HELLO,
+               std::min((size_t)nr, RDMA_MAGIC_LEN)) != 0) {
+        // Consume the peeked bytes as usual.
+        nr = read(fd, &hello, nr);
+        if (nr > 0) {
+            buf->append(&hello, nr);
+        }
+        return nr;
+    }
+    if ((size_t)nr < sizeof(hello)) {
+        // The rest of the hello triggers another event.
+        errno = EAGAIN;
+        return -1;
+    }
+    nr = read(fd, &hello, sizeof(hello));
+    if (nr != (ssize_t)sizeof(hello)) {
+        if (nr >= 0) {
+            errno = EPROTO;
+        }
+        return -1;
+    }
+    *is_hello = true;
+    if (accept) {
+        RdmaEndpoint* ep = new RdmaEndpoint;
+        if (ep->Init() == 0 && ep->Connect(hello) == 0) {
+            *endpoint = ep;
+        } else {
+            PLOG(WARNING) << "Fail to accept RDMA from fd=" << fd;
+            delete ep;
+        }
+    }
+    return nr;
+}
+
+int RdmaEndpoint::SendReply(int fd, const RdmaEndpoint* endpoint) {
+    RdmaHello reply;
+    if (endpoint != NULL) {
+        endpoint->FillHello(&reply, RDMA_ACCEPTED);
+    } else {
+        memset(&reply, 0, sizeof(reply));
+        memcpy(reply.magic, RDMA_DECLINED, RDMA_MAGIC_LEN);
+    }
+    return SendHelloMessage(fd, reply);
+}
+
+void RdmaEndpoint::set_connect_done(void (*done)(int err, void* data),
+                                    void* data) {
+    _done = done;
+    _done_data = data;
+}
+
+bool RdmaEndpoint::RunConnectDone(int err) {
+    if (_done == NULL || _done_taken.exchange(true, butil::memory_order_acquire)) {
+        return false;
+    }
+    if (_timer) {
+        bthread_timer_del(_timer);
+    }
+    _done(err, _done_data);
+    return true;
+}
+
+bool RdmaEndpoint::Writable() const {
+    return _remote_window.load(butil::memory_order_acquire) > 0 &&
+        _sq_tail - _sq_head.load(butil::memory_order_acquire) < _sbuf.size();
+}
+
+int RdmaEndpoint::WaitWritable(const timespec* abstime) {
+    const int expected = _writable_butex->load(butil::memory_order_acquire);
+    if (Writable()) {
+        return 0;
+    }
+    if (bthread::butex_wait(_writable_butex, expected, abstime) < 0 &&
+        errno != EWOULDBLOCK && errno != EINTR) {
+        return -1;
+    }
+    return 0;
+}
+
+#if defined(BRPC_WITH_RDMA)
+
+// Extra receive buffers for credit-only sends, which are not limited by
+// the window.
+static const int RDMA_ACK_RESERVE = 4;
+static const int RDMA_MAX_SGE = 4;
+static const int RDMA_POLL_BATCH = 16;
+static const uint64_t RDMA_DATA_WR_ID = 0;
+static const uint64_t RDMA_ACK_WR_ID = 1;
+
+RdmaEndpoint::~RdmaEndpoint() {
+    if (active()) {
+        *g_rdma_conn_count << -1;
+    }
+    // Buffers are released after the queue pair, which may still access
+    // them before being destroyed.
+    if (_qp) {
+        IbvDestroyQp(_qp);
+    }
+    if (_cq) {
+        IbvDestroyCq(_cq);
+    }
+    if (_channel) {
+        IbvDestroyCompChannel(_channel);
+    }
+    bthread::butex_destroy(_writable_butex);
+}
+
+int RdmaEndpoint::Init() {
+    if (!InitRdma()) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    const int window = FLAGS_rdma_window_size;
+    const int nrecv = window + RDMA_ACK_RESERVE;
+    _channel = IbvCreateCompChannel(GetRdmaContext());
+    if (_channel == NULL) {
+        PLOG(WARNING) << "Fail to create completion channel";
+        return -1;
+    }
+    if (butil::make_non_blocking(_channel->fd) != 0) {
+        return -1;
+    }
+    butil::make_close_on_exec(_channel->fd);
+    _cq = IbvCreateCq(GetRdmaContext(), 2 * nrecv, NULL, _channel, 0);
+    if (_cq == NULL) {
+        PLOG(WARNING) << "Fail to create completion queue";
+        return -1;
+    }
+    ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = _cq;
+    init_attr.recv_cq = _cq;
+    init_attr.cap.max_send_wr = nrecv;
+    init_attr.cap.max_recv_wr = nrecv;
+    init_attr.cap.max_send_sge = RDMA_MAX_SGE;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    init_attr.sq_sig_all = 1;
+    _qp = IbvCreateQp(GetRdmaPd(), &init_attr);
+    if (_qp == NULL) {
+        PLOG(WARNING) << "Fail to create queue pair";
+        return -1;
+    }
+    ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = GetRdmaPortNum();
+    attr.qp_access_flags = 0;
+    const int rc = IbvModifyQp(_qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+                               IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
+    if (rc != 0) {
+        errno = rc;
+        PLOG(WARNING) << "Fail to modify queue pair to INIT";
+        return -1;
+    }
+    _sbuf.resize(window);
+    _rbuf.resize(nrecv);
+    for (int i = 0; i < nrecv; ++i) {
+        if (PostRecv(i) != 0) {
+            return -1;
+        }
+    }
+    const int rc2 = ibv_req_notify_cq(_cq, 0);
+    if (rc2 != 0) {
+        errno = rc2;
+        return -1;
+    }
+    _notify_armed = true;
+    _psn = butil::fast_rand() & 0xffffff;
+    return 0;
+}
+
+void RdmaEndpoint::FillHello(RdmaHello* hello, const char* magic) const {
+    memset(hello, 0, sizeof(*hello));
+    memcpy(hello->magic, magic, RDMA_MAGIC_LEN);
+    hello->qpn = htonl(_qp->qp_num);
+    hello->psn = htonl(_psn);
+    hello->lid = htons(GetRdmaLid());
+    hello->mtu = (uint8_t)GetRdmaMtu();
+    hello->block_size = htonl(_recv_block_size);
+    hello->window = htonl(_rbuf.size() - RDMA_ACK_RESERVE);
+    memcpy(hello->gid, GetRdmaGid().raw, sizeof(hello->gid));
+}
+
+int RdmaEndpoint::Connect(const RdmaHello& remote) {
+    _remote_block_size = std::min(ntohl(remote.block_size), _recv_block_size);
+    const uint32_t window = ntohl(remote.window);
+    if (_remote_block_size == 0 || window == 0 || remote.mtu == 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    _remote_window.store(std::min(window, (uint32_t)_sbuf.size()),
+                         butil::memory_order_relaxed);
+
+    ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = std::min(GetRdmaMtu(), (ibv_mtu)remote.mtu);
+    attr.dest_qp_num = ntohl(remote.qpn);
+    attr.rq_psn = ntohl(remote.psn);
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.dlid = ntohs(remote.lid);
+    attr.ah_attr.port_num = GetRdmaPortNum();
+    static const uint8_t zero_gid[16] = {};
+    if (memcmp(remote.gid, zero_gid, sizeof(zero_gid)) != 0) {
+        // Required by RoCE and harmless in a subnet of IB.
+        attr.ah_attr.is_global = 1;
+        memcpy(attr.ah_attr.grh.dgid.raw, remote.gid, sizeof(remote.gid));
+        attr.ah_attr.grh.sgid_index = GetRdmaGidIndex();
+        attr.ah_attr.grh.hop_limit = 64;
+    }
+    int rc = IbvModifyQp(_qp, &attr, IBV_QP_STATE | IBV_QP_AV |
+                         IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                         IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    if (rc != 0) {
+        errno = rc;
+        PLOG(WARNING) << "Fail to modify queue pair to RTR";
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    // Retry infinitely when the peer has not reposted receive buffers.
+    attr.rnr_retry = 7;
+    attr.sq_psn = _psn;
+    attr.max_rd_atomic = 1;
+    rc = IbvModifyQp(_qp, &attr, IBV_QP_STATE | IBV_QP_TIMEOUT |
+                     IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN |
+                     IBV_QP_MAX_QP_RD_ATOMIC);
+    if (rc != 0) {
+        errno = rc;
+        PLOG(WARNING) << "Fail to modify queue pair to RTS";
+        return -1;
+    }
+    return 0;
+}
+
+int RdmaEndpoint::PostRecv(uint32_t index) {
+    butil::IOBuf& rbuf = _rbuf[index];
+    rbuf.clear();
+    void* data = NULL;
+    int size = 0;
+    {
+        // A fresh block of registered memory for each receive, which is
+        // appended into the input buffer without copying.
+        butil::IOBufAsZeroCopyOutputStream os(
+            &rbuf, butil::IOBuf::DEFAULT_BLOCK_SIZE);
+        if (!os.Next(&data, &size)) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    const uint32_t lkey = GetRegionId(data);
+    if (lkey == 0) {
+        LOG_EVERY_SECOND(WARNING) << "Registered memory is used up";
+        errno = ENOMEM;
+        return -1;
+    }
+    if (_recv_block_size == 0) {
+        _recv_block_size = size;
+    }
+    ibv_sge sge;
+    sge.addr = (uintptr_t)data;
+    sge.length = _recv_block_size;
+    sge.lkey = lkey;
+    ibv_recv_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = index;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    ibv_recv_wr* bad = NULL;
+    const int rc = ibv_post_recv(_qp, &wr, &bad);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+int RdmaEndpoint::PostAck() {
+    if (_nack_inflight.load(butil::memory_order_relaxed) >= RDMA_ACK_RESERVE) {
+        // Posted after completions of inflight ones.
+        return 0;
+    }
+    const uint32_t credits = _credits.exchange(0, butil::memory_order_relaxed);
+    if (credits == 0) {
+        return 0;
+    }
+    _nack_inflight.fetch_add(1, butil::memory_order_relaxed);
+    ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = RDMA_ACK_WR_ID;
+    wr.opcode = IBV_WR_SEND_WITH_IMM;
+    wr.imm_data = htonl(credits);
+    wr.send_flags = IBV_SEND_SIGNALED;
+    ibv_send_wr* bad = NULL;
+    const int rc = ibv_post_send(_qp, &wr, &bad);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+int RdmaEndpoint::PollCompletions(butil::IOBuf* buf, size_t* nread) {
+    ibv_wc wc[RDMA_POLL_BATCH];
+    const int n = ibv_poll_cq(_cq, RDMA_POLL_BATCH, wc);
+    if (n < 0) {
+        errno = EIO;
+        return -1;
+    }
+    bool writable_changed = false;
+    for (int i = 0; i < n; ++i) {
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            // Including flushed requests after the peer is gone.
+            LOG(WARNING) << "Fail to complete RDMA work request, status="
+                         << wc[i].status << " opcode=" << wc[i].opcode;
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (wc[i].opcode & IBV_WC_RECV) {
+            if (wc[i].wc_flags & IBV_WC_WITH_IMM) {
+                const uint32_t credits = ntohl(wc[i].imm_data);
+                if (credits > 0) {
+                    _remote_window.fetch_add(credits, butil::memory_order_release);
+                    writable_changed = true;
+                }
+            }
+            const uint32_t index = wc[i].wr_id;
+            const uint32_t len = wc[i].byte_len;
+            if (index >= _rbuf.size() || len > _recv_block_size) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (len > 0) {
+                _rbuf[index].cutn(buf, len);
+                *nread += len;
+            }
+            if (PostRecv(index) != 0) {
+                return -1;
+            }
+            if (len > 0) {
+                // Credit-only receives are not limited by the window.
+                _credits.fetch_add(1, butil::memory_order_relaxed);
+            }
+        } else if (wc[i].wr_id == RDMA_ACK_WR_ID) {
+            _nack_inflight.fetch_sub(1, butil::memory_order_relaxed);
+        } else {
+            // Sends complete in the order of posting.
+            const uint64_t head = _sq_head.load(butil::memory_order_relaxed);
+            _sbuf[head % _sbuf.size()].clear();
+            _sq_head.store(head + 1, butil::memory_order_release);
+            writable_changed = true;
+        }
+    }
+    // Return credits before the peer runs out of window, if they're not
+    // carried by sends of this side.
+    if (_credits.load(butil::memory_order_relaxed) >=
+        std::max(_rbuf.size() - RDMA_ACK_RESERVE, (size_t)2) / 2) {
+        if (PostAck() != 0) {
+            return -1;
+        }
+    }
+    if (writable_changed) {
+        _writable_butex->fetch_add(1, butil::memory_order_release);
+        bthread::butex_wake_all(_writable_butex);
+    }
+    return n;
+}
+
+ssize_t RdmaEndpoint::Read(int fd, butil::IOBuf* buf) {
+    ibv_cq* cq = NULL;
+    void* cq_context = NULL;
+    if (IbvGetCqEvent(_channel, &cq, &cq_context) == 0) {
+        IbvAckCqEvents(cq, 1);
+        _notify_armed = false;
+    }
+    while (true) {
+        size_t nread = 0;
+        const int n = PollCompletions(buf, &nread);
+        if (n < 0) {
+            return -1;
+        }
+        if (nread > 0) {
+            return nread;
+        }
+        if (n > 0) {
+            continue;
+        }
+        if (_notify_armed) {
+            break;
+        }
+        // Completions after arming signal the channel, poll once more for
+        // the ones before.
+        const int rc = ibv_req_notify_cq(_cq, 0);
+        if (rc != 0) {
+            errno = rc;
+            return -1;
+        }
+        _notify_armed = true;
+    }
+    // Nothing is completed and completion_fd() will be signaled on next
+    // one. The connection itself carries nothing but EOF now.
+    char c;
+    const ssize_t n = read(fd, &c, 1);
+    if (n > 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    return n;
+}
+
+ssize_t RdmaEndpoint::Write(butil::IOBuf* const* data_list, size_t ndata) {
+    size_t nw = 0;
+    for (size_t i = 0; i < ndata && Writable(); ++i) {
+        butil::IOBuf* data = data_list[i];
+        while (!data->empty() && Writable()) {
+            // One receive buffer of the peer for each send.
+            size_t len = 0;
+            const size_t nblock =
+                std::min(data->backing_block_num(), (size_t)RDMA_MAX_SGE);
+            for (size_t j = 0; j < nblock; ++j) {
+                len += data->backing_block(j).size();
+            }
+            len = std::min(len, (size_t)_remote_block_size);
+            butil::IOBuf& piece = _sbuf[_sq_tail % _sbuf.size()];
+            piece.clear();
+            data->cutn(&piece, len);
+
+            ibv_sge sge[RDMA_MAX_SGE];
+            int nsge = 0;
+            for (size_t j = 0; j < piece.backing_block_num(); ++j) {
+                const butil::StringPiece b = piece.backing_block(j);
+                sge[j].addr = (uintptr_t)b.data();
+                sge[j].length = b.size();
+                sge[j].lkey = GetRegionId(b.data());
+                if (sge[j].lkey == 0) {
+                    nsge = -1;
+                    break;
+                }
+                ++nsge;
+            }
+            if (nsge < 0) {
+                // Not in registered memory, e.g. user data or blocks
+                // allocated after the regions were used up.
+                butil::IOBuf copy;
+                void* mem = NULL;
+                int size = 0;
+                {
+                    butil::IOBufAsZeroCopyOutputStream os(
+                        &copy, butil::IOBuf::DEFAULT_BLOCK_SIZE);
+                    if (!os.Next(&mem, &size) || (size_t)size < len) {
+                        errno = ENOMEM;
+                        return -1;
+                    }
+                    piece.copy_to(mem, len);
+                    os.BackUp(size - len);
+                }
+                piece.swap(copy);
+                sge[0].addr = (uintptr_t)mem;
+                sge[0].length = len;
+                sge[0].lkey = GetRegionId(mem);
+                if (sge[0].lkey == 0) {
+                    LOG_EVERY_SECOND(WARNING) << "Registered memory is used up";
+                    errno = ENOMEM;
+                    return -1;
+                }
+                nsge = 1;
+            }
+            ibv_send_wr wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id = RDMA_DATA_WR_ID;
+            wr.opcode = IBV_WR_SEND_WITH_IMM;
+            wr.imm_data =
+                htonl(_credits.exchange(0, butil::memory_order_relaxed));
+            wr.send_flags = IBV_SEND_SIGNALED;
+            wr.sg_list = sge;
+            wr.num_sge = nsge;
+            ibv_send_wr* bad = NULL;
+            const int rc = ibv_post_send(_qp, &wr, &bad);
+            if (rc != 0) {
+                errno = rc;
+                return -1;
+            }
+            _remote_window.fetch_sub(1, butil::memory_order_relaxed);
+            ++_sq_tail;
+            nw += len;
+        }
+    }
+    if (nw == 0) {
+        for (size_t i = 0; i < ndata; ++i) {
+            if (!data_list[i]->empty()) {
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+    }
+    return nw;
+}
+
+int RdmaEndpoint::completion_fd() const {
+    return _channel ? _channel->fd : -1;
+}
+
+#else  // BRPC_WITH_RDMA
+
+RdmaEndpoint::~RdmaEndpoint() {
+    if (active()) {
+        *g_rdma_conn_count << -1;
+    }
+    bthread::butex_destroy(_writable_butex);
+}
+
+int RdmaEndpoint::Init() {
+    errno = ENOTSUP;
+    return -1;
+}
+
+void RdmaEndpoint::FillHello(RdmaHello* hello, const char* magic) const {
+    memset(hello, 0, sizeof(*hello));
+    memcpy(hello->magic, magic, RDMA_MAGIC_LEN);
+}
+
+int RdmaEndpoint::Connect(const RdmaHello&) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t RdmaEndpoint::Read(int, butil::IOBuf*) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t RdmaEndpoint::Write(butil::IOBuf* const*, size_t) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+int RdmaEndpoint::completion_fd() const {
+    return -1;
+}
+
+#endif  // BRPC_WITH_RDMA
+
+static void* RunRdmaHandshakeTimeout(void* arg) {
+    SocketUniquePtr s;
+    if (Socket::AddressFailedAsWell((SocketId)(uintptr_t)arg, &s) >= 0) {
+        RdmaConnect::OnHandshakeTimeout(s.get());
+    }
+    return NULL;
+}
+
+static void HandleRdmaHandshakeTimeout(void* arg) {
+    // Don't run the callback in the timer thread.
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, RunRdmaHandshakeTimeout, arg) != 0) {
+        PLOG(WARNING) << "Fail to start bthread";
+        RunRdmaHandshakeTimeout(arg);
+    }
+}
+
+void RdmaConnect::StartConnect(const Socket* socket,
+                               void (*done)(int err, void* data),
+                               void* data) {
+    Socket* s = const_cast<Socket*>(socket);
+    RdmaEndpoint* ep = NULL;
+    // Consumers of io_uring are removed by SocketId, which can't tell the
+    // connection from the completion channel.
+    if (s->_conn == NULL && !s->GetEventDispatcher(s->fd()).UsingIoUring()) {
+        ep = RdmaEndpoint::CreateClientSide();
+    }
+    if (ep == NULL) {
+        // Carry on as an ordinary TCP connection.
+        return done(0, data);
+    }
+    ep->set_connect_done(done, data);
+    // Published before the hello so that the reply is read by DoRdmaRead().
+    s->_rdma_endpoint.store(ep, butil::memory_order_release);
+    bthread_timer_t timer;
+    if (bthread_timer_add(&timer,
+                          butil::milliseconds_from_now(RDMA_HANDSHAKE_TIMEOUT_MS),
+                          HandleRdmaHandshakeTimeout,
+                          (void*)(uintptr_t)s->id()) == 0) {
+        ep->set_connect_timer(timer);
+    }
+    if (ep->SendHello(s->fd()) != 0) {
+        const int saved_errno = errno;
+        PLOG(WARNING) << "Fail to send RDMA hello to " << *s;
+        ep->RunConnectDone(saved_errno);
+    }
+}
+
+void RdmaConnect::StopConnect(Socket* s) {
+    RdmaEndpoint* ep = s->_rdma_endpoint.load(butil::memory_order_acquire);
+    if (ep) {
+        ep->RunConnectDone(EFAILEDSOCKET);
+    }
+}
+
+void RdmaConnect::OnHandshakeTimeout(Socket* s) {
+    RdmaEndpoint* ep = s->_rdma_endpoint.load(butil::memory_order_acquire);
+    if (ep) {
+        ep->RunConnectDone(ETIMEDOUT);
+    }
+}
+
+static std::shared_ptr<AppConnect>* g_rdma_connect = NULL;
+static pthread_once_t g_rdma_connect_once = PTHREAD_ONCE_INIT;
+static void InitRdmaConnect() {
+    g_rdma_connect = new std::shared_ptr<AppConnect>(
+        std::make_shared<RdmaConnect>());
+}
+
+const std::shared_ptr<AppConnect>& GetRdmaConnect() {
+    pthread_once(&g_rdma_connect_once, InitRdmaConnect);
+    return *g_rdma_connect;
+}
+
+} // namespace rdma
+} // namespace brpc
@@ -0,0 +1,190 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RDMA_RDMA_ENDPOINT_H
+#define BRPC_RDMA_RDMA_ENDPOINT_H
+
+#include <time.h>                               // timespec
+#include <sys/types.h>                          // ssize_t
+#include <memory>                               // std::shared_ptr
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/iobuf.h"
+#include "bthread/types.h"                      // bthread_timer_t
+#include "brpc/socket.h"                        // AppConnect
+
+struct ibv_comp_channel;
+struct ibv_cq;
+struct ibv_qp;
+
+namespace brpc {
+namespace rdma {
+
+struct RdmaHello;
+
+// Bytes of a TCP connection carried by an RDMA reliable-connected queue
+// pair after a handshake over the connection:
+//
+//   client                                            server
+//     "BRPCRDMH" + qpn/psn/lid/gid/receive window ---->
+//     <---- "BRPCRDMA" + the same of server(accepted), or "BRPCRDMD"
+//
+// The client does not write anything else before the reply. After
+// acceptance, both sides send and receive through the queue pair and the
+// connection itself only carries EOF, which closes the endpoint as usual.
+// After declination, e.g. the server has no RDMA device or does not enable
+// ServerOptions.use_rdma, the connection is used as plain TCP.
+//
+// Data is sent from IOBuf blocks of registered memory (see block_pool.h)
+// without copying, and received into blocks which are appended to the
+// input buffer of the socket directly. Each side posts a window of receive
+// buffers, senders stop when the window of the peer is used up and the
+// peer returns credits in immediate data after reposting buffers.
+class RdmaEndpoint {
+public:
+    enum State {
+        HANDSHAKING,
+        ACTIVE,
+        DECLINED,
+    };
+
+    ~RdmaEndpoint();
+
+    // Create the queue pair of the client side, NULL if RDMA is not
+    // available.
+    static RdmaEndpoint* CreateClientSide();
+
+    // [Client] Send the hello to `fd'.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int SendHello(int fd);
+
+    // [Client] Read the reply from `fd' and connect the queue pair if the
+    // server accepted. Returns 1 if the server accepted, 0 if it declined,
+    // -1 otherwise and errno is set (EAGAIN when the reply is not complete
+    // yet).
+    int ReadReply(int fd);
+
+    // [Server] Read the first bytes of a connection. If they're a hello,
+    // `*is_hello' is set to true and `*endpoint' to the connected endpoint
+    // or NULL if `accept' is false or RDMA is not available, the hello must
+    // be replied by SendReply() in all cases. Otherwise the bytes are
+    // appended into `buf'.
+    // Returns bytes read, 0 on EOF, -1 otherwise and errno is set.
+    static ssize_t ReadHello(int fd, butil::IOBuf* buf, bool accept,
+                             bool* is_hello, RdmaEndpoint** endpoint);
+
+    // [Server] Send the reply to `fd', declining if `endpoint' is NULL.
+    static int SendReply(int fd, const RdmaEndpoint* endpoint);
+
+    // Append received bytes into `buf' after polling completions. `fd' is
+    // the connection which is checked for EOF when nothing is received.
+    // Returns bytes read, 0 on EOF, -1 otherwise and errno is set.
+    ssize_t Read(int fd, butil::IOBuf* buf);
+
+    // Post as many bytes of `data_list' as the window of the peer allows.
+    // Returns bytes written, -1 with errno=EAGAIN when the window is used
+    // up.
+    ssize_t Write(butil::IOBuf* const* data_list, size_t ndata);
+
+    // Suspend until the window allows writing or `abstime' is reached.
+    int WaitWritable(const timespec* abstime);
+
+    // Signaled on completions, to be polled by the EventDispatcher after
+    // activation.
+    int completion_fd() const;
+
+    State state() const { return _state.load(butil::memory_order_acquire); }
+    bool active() const { return state() == ACTIVE; }
+    // Counted in rpc_rdma_connection_count until destruction.
+    void set_active();
+    void set_declined() { _state.store(DECLINED, butil::memory_order_release); }
+
+    // [Client] The connect callback of AppConnect which is called once by
+    // RunConnectDone() with the result of the handshake, or the timeout.
+    void set_connect_done(void (*done)(int err, void* data), void* data);
+    // Removed when the callback is run.
+    void set_connect_timer(bthread_timer_t timer) { _timer = timer; }
+    // Returns false if the callback was already run.
+    bool RunConnectDone(int err);
+
+private:
+    RdmaEndpoint();
+    DISALLOW_COPY_AND_ASSIGN(RdmaEndpoint);
+
+    // Create the queue pair and post receive buffers.
+    int Init();
+    void FillHello(RdmaHello* hello, const char* magic) const;
+    // Move the queue pair to RTS with the queue pair of the peer.
+    int Connect(const RdmaHello& remote);
+    int PostRecv(uint32_t index);
+    int PostAck();
+    bool Writable() const;
+    // Poll completions, received bytes are appended into `buf'.
+    // Returns number of completions, -1 on error.
+    int PollCompletions(butil::IOBuf* buf, size_t* nread);
+
+    butil::atomic<State> _state;
+    ibv_comp_channel* _channel;
+    ibv_cq* _cq;
+    ibv_qp* _qp;
+    uint32_t _psn;
+    // Receive buffers of this side, one block each.
+    std::vector<butil::IOBuf> _rbuf;
+    uint32_t _recv_block_size;
+    // Data being sent, released by send completions in order.
+    std::vector<butil::IOBuf> _sbuf;
+    uint64_t _sq_tail;
+    butil::atomic<uint64_t> _sq_head;
+    // Sends that the peer can receive now, replenished by its credits.
+    butil::atomic<int> _remote_window;
+    uint32_t _remote_block_size;
+    // Reposted receive buffers not told to the peer yet.
+    butil::atomic<uint32_t> _credits;
+    butil::atomic<int> _nack_inflight;
+    // Changed when Writable() may change, waited by WaitWritable().
+    butil::atomic<int>* _writable_butex;
+    bool _notify_armed;
+    char _reply[64];
+    size_t _nreply;
+    butil::atomic<bool> _done_taken;
+    void (*_done)(int err, void* data);
+    void* _done_data;
+    bthread_timer_t _timer;
+};
+
+// Handshake of RdmaEndpoint as the AppConnect of client sockets, enabled
+// by ChannelOptions.use_rdma on TCP connections.
+class RdmaConnect : public AppConnect {
+public:
+    void StartConnect(const Socket* socket,
+                      void (*done)(int err, void* data),
+                      void* data) override;
+    void StopConnect(Socket* socket) override;
+
+    // Fail the handshake of `socket' which is not replied in time.
+    static void OnHandshakeTimeout(Socket* socket);
+};
+
+// Shared by all sockets.
+const std::shared_ptr<AppConnect>& GetRdmaConnect();
+
+} // namespace rdma
+} // namespace brpc
+
+
+#endif  // BRPC_RDMA_RDMA_ENDPOINT_H
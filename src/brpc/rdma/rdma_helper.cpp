@@ -0,0 +1,238 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <pthread.h>
+#include <string.h>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "brpc/rdma/block_pool.h"
+#include "brpc/rdma/rdma_helper.h"
+#if defined(BRPC_WITH_RDMA)
+#include <dlfcn.h>
+#endif
+
+namespace brpc {
+namespace rdma {
+
+DEFINE_string(rdma_device, "", "Name of the RDMA device to use, the first "
+              "device is used if this flag is empty");
+DEFINE_int32(rdma_port, 1, "Port number of the RDMA device");
+DEFINE_int32(rdma_gid_index, 0, "Index of GID of the port, which selects "
+             "RoCE v1/v2 and the address on RoCE devices, see show_gids");
+
+static pthread_once_t g_init_rdma_once = PTHREAD_ONCE_INIT;
+static bool g_rdma_available = false;
+
+#if defined(BRPC_WITH_RDMA)
+
+ibv_comp_channel* (*IbvCreateCompChannel)(ibv_context*) = NULL;
+int (*IbvDestroyCompChannel)(ibv_comp_channel*) = NULL;
+ibv_cq* (*IbvCreateCq)(ibv_context*, int, void*, ibv_comp_channel*, int) = NULL;
+int (*IbvDestroyCq)(ibv_cq*) = NULL;
+int (*IbvGetCqEvent)(ibv_comp_channel*, ibv_cq**, void**) = NULL;
+void (*IbvAckCqEvents)(ibv_cq*, unsigned int) = NULL;
+ibv_qp* (*IbvCreateQp)(ibv_pd*, ibv_qp_init_attr*) = NULL;
+int (*IbvModifyQp)(ibv_qp*, ibv_qp_attr*, int) = NULL;
+int (*IbvDestroyQp)(ibv_qp*) = NULL;
+
+static ibv_device** (*IbvGetDeviceList)(int*) = NULL;
+static void (*IbvFreeDeviceList)(ibv_device**) = NULL;
+static const char* (*IbvGetDeviceName)(ibv_device*) = NULL;
+static ibv_context* (*IbvOpenDevice)(ibv_device*) = NULL;
+static int (*IbvCloseDevice)(ibv_context*) = NULL;
+static ibv_pd* (*IbvAllocPd)(ibv_context*) = NULL;
+static int (*IbvDeallocPd)(ibv_pd*) = NULL;
+// ibv_reg_mr and ibv_query_port are macros of verbs.h, the exported
+// symbols take the same arguments.
+static ibv_mr* (*IbvRegMr)(ibv_pd*, void*, size_t, int) = NULL;
+static int (*IbvQueryPort)(ibv_context*, uint8_t, ibv_port_attr*) = NULL;
+static int (*IbvQueryGid)(ibv_context*, uint8_t, int, ibv_gid*) = NULL;
+
+static void* g_ibverbs = NULL;
+static ibv_context* g_context = NULL;
+static ibv_pd* g_pd = NULL;
+static uint8_t g_port_num = 1;
+static uint8_t g_gid_index = 0;
+static uint16_t g_lid = 0;
+static ibv_mtu g_mtu = IBV_MTU_1024;
+static ibv_gid g_gid;
+
+template <typename Fn>
+static bool LoadSymbol(const char* name, Fn* fn) {
+    void* sym = dlsym(g_ibverbs, name);
+    if (sym == NULL) {
+        LOG(WARNING) << "Fail to find " << name << " in libibverbs: "
+                     << dlerror();
+        return false;
+    }
+    *fn = reinterpret_cast<Fn>(sym);
+    return true;
+}
+
+static bool LoadIbverbs() {
+    g_ibverbs = dlopen("libibverbs.so", RTLD_LAZY);
+    if (g_ibverbs == NULL) {
+        // Runtime packages only have the versioned name.
+        g_ibverbs = dlopen("libibverbs.so.1", RTLD_LAZY);
+    }
+    if (g_ibverbs == NULL) {
+        LOG(WARNING) << "Fail to load libibverbs: " << dlerror();
+        return false;
+    }
+    return LoadSymbol("ibv_create_comp_channel", &IbvCreateCompChannel) &&
+        LoadSymbol("ibv_destroy_comp_channel", &IbvDestroyCompChannel) &&
+        LoadSymbol("ibv_create_cq", &IbvCreateCq) &&
+        LoadSymbol("ibv_destroy_cq", &IbvDestroyCq) &&
+        LoadSymbol("ibv_get_cq_event", &IbvGetCqEvent) &&
+        LoadSymbol("ibv_ack_cq_events", &IbvAckCqEvents) &&
+        LoadSymbol("ibv_create_qp", &IbvCreateQp) &&
+        LoadSymbol("ibv_modify_qp", &IbvModifyQp) &&
+        LoadSymbol("ibv_destroy_qp", &IbvDestroyQp) &&
+        LoadSymbol("ibv_get_device_list", &IbvGetDeviceList) &&
+        LoadSymbol("ibv_free_device_list", &IbvFreeDeviceList) &&
+        LoadSymbol("ibv_get_device_name", &IbvGetDeviceName) &&
+        LoadSymbol("ibv_open_device", &IbvOpenDevice) &&
+        LoadSymbol("ibv_close_device", &IbvCloseDevice) &&
+        LoadSymbol("ibv_alloc_pd", &IbvAllocPd) &&
+        LoadSymbol("ibv_dealloc_pd", &IbvDeallocPd) &&
+        LoadSymbol("ibv_reg_mr", &IbvRegMr) &&
+        LoadSymbol("ibv_query_port", &IbvQueryPort) &&
+        LoadSymbol("ibv_query_gid", &IbvQueryGid);
+}
+
+static ibv_context* OpenDevice() {
+    int ndevice = 0;
+    ibv_device** devices = IbvGetDeviceList(&ndevice);
+    if (devices == NULL) {
+        PLOG(WARNING) << "Fail to get RDMA devices";
+        return NULL;
+    }
+    ibv_context* context = NULL;
+    for (int i = 0; i < ndevice; ++i) {
+        const char* name = IbvGetDeviceName(devices[i]);
+        if (!FLAGS_rdma_device.empty() && FLAGS_rdma_device != name) {
+            continue;
+        }
+        context = IbvOpenDevice(devices[i]);
+        if (context == NULL) {
+            PLOG(WARNING) << "Fail to open RDMA device " << name;
+        } else {
+            LOG(INFO) << "Use RDMA device " << name;
+        }
+        break;
+    }
+    if (context == NULL && ndevice == 0) {
+        LOG(WARNING) << "No RDMA device";
+    }
+    IbvFreeDeviceList(devices);
+    return context;
+}
+
+static uint32_t RegisterMemory(void* buf, size_t len) {
+    ibv_mr* mr = IbvRegMr(g_pd, buf, len, IBV_ACCESS_LOCAL_WRITE);
+    if (mr == NULL) {
+        PLOG(WARNING) << "Fail to register memory of " << len << " bytes";
+        return 0;
+    }
+    // Regions are never deregistered.
+    return mr->lkey;
+}
+
+static bool DoInitRdma() {
+    if (!LoadIbverbs()) {
+        return false;
+    }
+    g_context = OpenDevice();
+    if (g_context == NULL) {
+        return false;
+    }
+    if (FLAGS_rdma_port <= 0 || FLAGS_rdma_port > 255 ||
+        FLAGS_rdma_gid_index < 0 || FLAGS_rdma_gid_index > 255) {
+        LOG(WARNING) << "Invalid -rdma_port=" << FLAGS_rdma_port
+                     << " or -rdma_gid_index=" << FLAGS_rdma_gid_index;
+        return false;
+    }
+    g_port_num = FLAGS_rdma_port;
+    g_gid_index = FLAGS_rdma_gid_index;
+    ibv_port_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    if (IbvQueryPort(g_context, g_port_num, &attr) != 0) {
+        PLOG(WARNING) << "Fail to query port " << (int)g_port_num;
+        return false;
+    }
+    if (attr.state != IBV_PORT_ACTIVE) {
+        LOG(WARNING) << "Port " << (int)g_port_num << " of RDMA device is "
+            "not active";
+        return false;
+    }
+    g_lid = attr.lid;
+    g_mtu = attr.active_mtu;
+    if (IbvQueryGid(g_context, g_port_num, g_gid_index, &g_gid) != 0) {
+        PLOG(WARNING) << "Fail to query gid " << (int)g_gid_index;
+        return false;
+    }
+    g_pd = IbvAllocPd(g_context);
+    if (g_pd == NULL) {
+        PLOG(WARNING) << "Fail to allocate protection domain";
+        return false;
+    }
+    if (InitBlockPool(RegisterMemory) != 0) {
+        return false;
+    }
+    return true;
+}
+
+static void InitRdmaOnce() {
+    g_rdma_available = DoInitRdma();
+    if (!g_rdma_available) {
+        LOG(WARNING) << "RDMA is not available, connections use TCP";
+        if (g_pd) {
+            IbvDeallocPd(g_pd);
+            g_pd = NULL;
+        }
+        if (g_context) {
+            IbvCloseDevice(g_context);
+            g_context = NULL;
+        }
+    }
+}
+
+ibv_context* GetRdmaContext() { return g_context; }
+ibv_pd* GetRdmaPd() { return g_pd; }
+uint8_t GetRdmaPortNum() { return g_port_num; }
+uint8_t GetRdmaGidIndex() { return g_gid_index; }
+uint16_t GetRdmaLid() { return g_lid; }
+ibv_mtu GetRdmaMtu() { return g_mtu; }
+const ibv_gid& GetRdmaGid() { return g_gid; }
+
+#else
+
+static void InitRdmaOnce() {
+    LOG(WARNING) << "brpc is not built with RDMA(WITH_RDMA), connections "
+        "use TCP";
+}
+
+#endif  // BRPC_WITH_RDMA
+
+bool InitRdma() {
+    pthread_once(&g_init_rdma_once, InitRdmaOnce);
+    return g_rdma_available;
+}
+
+} // namespace rdma
+} // namespace brpc
@@ -0,0 +1,67 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RDMA_RDMA_HELPER_H
+#define BRPC_RDMA_RDMA_HELPER_H
+
+#include <stdint.h>
+#if defined(BRPC_WITH_RDMA)
+#include <infiniband/verbs.h>
+#endif
+
+namespace brpc {
+namespace rdma {
+
+// Load libibverbs with dlopen(), open the device of -rdma_device, allocate
+// the protection domain and install the registered block pool (see
+// block_pool.h) as allocator of IOBuf blocks. Only the first call does
+// the work, later calls return the same result.
+// Returns true if RDMA is usable, false if brpc is not built with
+// WITH_RDMA, libibverbs can't be loaded or no device is active, in which
+// case connections asking for RDMA fall back to TCP.
+bool InitRdma();
+
+#if defined(BRPC_WITH_RDMA)
+// Valid after InitRdma() returns true.
+ibv_context* GetRdmaContext();
+ibv_pd* GetRdmaPd();
+uint8_t GetRdmaPortNum();
+uint8_t GetRdmaGidIndex();
+uint16_t GetRdmaLid();
+ibv_mtu GetRdmaMtu();
+const ibv_gid& GetRdmaGid();
+
+// Functions of libibverbs loaded by InitRdma(). Functions inlined in
+// infiniband/verbs.h (e.g. ibv_post_send, ibv_poll_cq) call through the
+// context and can be used directly.
+extern ibv_comp_channel* (*IbvCreateCompChannel)(ibv_context*);
+extern int (*IbvDestroyCompChannel)(ibv_comp_channel*);
+extern ibv_cq* (*IbvCreateCq)(ibv_context*, int, void*, ibv_comp_channel*, int);
+extern int (*IbvDestroyCq)(ibv_cq*);
+extern int (*IbvGetCqEvent)(ibv_comp_channel*, ibv_cq**, void**);
+extern void (*IbvAckCqEvents)(ibv_cq*, unsigned int);
+extern ibv_qp* (*IbvCreateQp)(ibv_pd*, ibv_qp_init_attr*);
+extern int (*IbvModifyQp)(ibv_qp*, ibv_qp_attr*, int);
+extern int (*IbvDestroyQp)(ibv_qp*);
+#endif
+
+} // namespace rdma
+} // namespace brpc
+
+
+#endif  // BRPC_RDMA_RDMA_HELPER_H
@@ -274,6 +274,7 @@ RedisResponse* RedisResponse::New() const {
 void RedisResponse::Clear() {
     _first_reply.Reset();
     _other_replies = NULL;
+    _pushes.clear();
     _arena.clear();
     _nreply = 0;
     _cached_size_ = 0;
@@ -341,6 +342,35 @@ void RedisResponse::MergeFrom(const RedisResponse& from) {
     _nreply = new_nreply;
 }
 
+void RedisResponse::MergeReplies(const RedisReply* const* replies, int n) {
+    if (n <= 0) {
+        return;
+    }
+    int i = 0;
+    if (_nreply == 0) {
+        _first_reply.CopyFromDifferentArena(*replies[i++]);
+    }
+    const int new_nreply = _nreply + n;
+    if (new_nreply > 1) {
+        RedisReply* new_others =
+            (RedisReply*)_arena.allocate(sizeof(RedisReply) * (new_nreply - 1));
+        for (int j = 0; j < new_nreply - 1; ++j) {
+            new (new_others + j) RedisReply(&_arena);
+        }
+        int new_other_index = 0;
+        for (int j = 1; j < _nreply; ++j) {
+            new_others[new_other_index++].CopyFromSameArena(
+                _other_replies[j - 1]);
+        }
+        for (; i < n; ++i) {
+            new_others[new_other_index++].CopyFromDifferentArena(*replies[i]);
+        }
+        DCHECK_EQ(new_nreply - 1, new_other_index);
+        _other_replies = new_others;
+    }
+    _nreply = new_nreply;
+}
+
 void RedisResponse::CopyFrom(const ::google::protobuf::Message& from) {
     if (&from == this) return;
     Clear();
@@ -361,6 +391,7 @@ void RedisResponse::Swap(RedisResponse* other) {
     if (other != this) {
         _first_reply.Swap(other->_first_reply);
         std::swap(_other_replies, other->_other_replies);
+        _pushes.swap(other->_pushes);
         _arena.swap(other->_arena);
         std::swap(_nreply, other->_nreply);
         std::swap(_cached_size_, other->_cached_size_);
@@ -380,10 +411,43 @@ const ::google::protobuf::Descriptor* RedisResponse::descriptor() {
 
 // ===================================================================
 
+ParseError RedisResponse::ConsumeReply(butil::IOBuf& buf, RedisReply* slot,
+                                       bool pushes_only) {
+    while (true) {
+        if (pushes_only && !slot->is_push()/*not partially parsed push*/) {
+            const void* fc = buf.fetch1();
+            if (fc == NULL || *(const char*)fc != '>') {
+                return PARSE_OK;
+            }
+        }
+        const ParseError err = slot->ConsumePartialIOBuf(buf);
+        if (err != PARSE_OK || !slot->is_push()) {
+            return err;
+        }
+        RedisReply* push = (RedisReply*)_arena.allocate(sizeof(RedisReply));
+        if (push == NULL) {
+            LOG(ERROR) << "Fail to allocate RedisReply";
+            return PARSE_ERROR_ABSOLUTELY_WRONG;
+        }
+        new (push) RedisReply(&_arena);
+        push->CopyFromSameArena(*slot);
+        _pushes.push_back(push);
+        slot->Reset();
+    }
+}
+
 ParseError RedisResponse::ConsumePartialIOBuf(butil::IOBuf& buf, int reply_count) {
     size_t oldsize = buf.size();
+    if (reply_count <= 0) {
+        if (reply_size() != 0) {
+            return PARSE_OK;
+        }
+        const ParseError err = ConsumeReply(buf, &_first_reply, true);
+        _cached_size_ += oldsize - buf.size();
+        return err;
+    }
     if (reply_size() == 0) {
-        ParseError err = _first_reply.ConsumePartialIOBuf(buf);
+        ParseError err = ConsumeReply(buf, &_first_reply, false);
         if (err != PARSE_OK) {
             return err;
         }
@@ -405,7 +469,7 @@ ParseError RedisResponse::ConsumePartialIOBuf(butil::IOBuf& buf, int reply_count
             }
         }
         for (int i = reply_size(); i < reply_count; ++i) {
-            ParseError err = _other_replies[i - 1].ConsumePartialIOBuf(buf);
+            ParseError err = ConsumeReply(buf, &_other_replies[i - 1], false);
             if (err != PARSE_OK) {
                 return err;
             }
@@ -23,6 +23,7 @@
 #include <unordered_map>
 #include <memory>
 #include <list>
+#include <vector>
 #include "butil/iobuf.h"
 #include "butil/strings/string_piece.h"
 #include "butil/arena.h"
@@ -169,11 +170,25 @@ public:
         return redis_nil;
     }
 
-    // Parse and consume intact replies from the buf.
+    // Number of push messages of RESP3(e.g. invalidations of client-side
+    // caching) received before or between the replies. They're not counted
+    // in reply_size().
+    int push_size() const { return (int)_pushes.size(); }
+
+    // Get index-th push message, index must be less than push_size().
+    const RedisReply& push(int index) const { return *_pushes[index]; }
+
+    // Parse and consume intact replies from the buf. Push messages are
+    // moved aside and don't take places of replies. If `reply_count' is 0,
+    // only leading push messages are consumed.
     // Returns PARSE_OK on success.
     // Returns PARSE_ERROR_NOT_ENOUGH_DATA if data in `buf' is not enough to parse.
     // Returns PARSE_ERROR_ABSOLUTELY_WRONG if the parsing failed.
     ParseError ConsumePartialIOBuf(butil::IOBuf& buf, int reply_count);
+
+    // Append copies of `n' replies(probably from other responses) to this
+    // response in order.
+    void MergeReplies(const RedisReply* const* replies, int n);
     
     // implements Message ----------------------------------------------
   
@@ -202,9 +217,15 @@ private:
     void SharedCtor();
     void SharedDtor();
     void SetCachedSize(int size) const;
+    // Parse a reply into `slot', moving push messages before it into
+    // _pushes. If `pushes_only' is true, stop before the first reply which
+    // is not a push message.
+    ParseError ConsumeReply(butil::IOBuf& buf, RedisReply* slot,
+                            bool pushes_only);
 
     RedisReply _first_reply;
     RedisReply* _other_replies;
+    std::vector<RedisReply*> _pushes;  // allocated in _arena
     butil::Arena _arena;
     int _nreply;
     mutable int _cached_size_;
@@ -280,6 +301,14 @@ public:
     // 5) An ending marker(exec) is found in transaction_handler.Run(), user exeuctes all
     // the commands and return OK. This Transation is done.
     virtual RedisCommandHandler* NewTransactionHandler();
+
+    // Return true if Run() of this handler can be called concurrently with
+    // handlers of other commands from the same connection, in which case
+    // Run() must return REDIS_CMD_HANDLED. Consecutive commands pipelined
+    // in one read which are handled by such handlers and have different
+    // keys(args[1]) are run in parallel bthreads, replies are still sent in
+    // the order of commands.
+    virtual bool AllowConcurrentRun() const { return false; }
 };
 
 } // namespace brpc
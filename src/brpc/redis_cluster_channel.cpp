@@ -0,0 +1,642 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <strings.h>                             // strncasecmp
+#include <algorithm>
+#include "butil/fast_rand.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_splitter.h"
+#include "butil/strings/string_number_conversions.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/countdown_event.h"
+#include "brpc/callback.h"
+#include "brpc/redis.h"
+#include "brpc/redis_command.h"
+#include "brpc/redis_cluster_channel.h"
+
+namespace brpc {
+
+RedisClusterChannelOptions::RedisClusterChannelOptions()
+    : max_redirect(5)
+    , refresh_interval_s(60) {
+    channel_options.protocol = PROTOCOL_REDIS;
+}
+
+// CRC16-CCITT(XMODEM) used by Redis Cluster.
+static uint16_t Crc16(const char* buf, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= (uint16_t)((unsigned char)buf[i]) << 8;
+        for (int j = 0; j < 8; ++j) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021)
+                                 : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+int RedisClusterChannel::GetHashSlot(const butil::StringPiece& key) {
+    butil::StringPiece hashed = key;
+    // Only the part between the first { and the following } is hashed
+    // if it's not empty, so that keys with the same tag are in one slot.
+    const size_t start = key.find('{');
+    if (start != butil::StringPiece::npos) {
+        const size_t end = key.find('}', start + 1);
+        if (end != butil::StringPiece::npos && end != start + 1) {
+            hashed = key.substr(start + 1, end - start - 1);
+        }
+    }
+    return Crc16(hashed.data(), hashed.size()) & (SLOT_NUM - 1);
+}
+
+// Set `key' with the key of the command. Returns false if the command has
+// no keys and can be sent to any node.
+static bool GetCommandKey(const std::vector<butil::StringPiece>& args,
+                          butil::StringPiece* key) {
+    if (args.size() < 2) {
+        return false;
+    }
+    // Command names are lowercased by RedisCommandParser.
+    const butil::StringPiece& cmd = args[0];
+    if (cmd == "eval" || cmd == "evalsha" ||
+        cmd == "eval_ro" || cmd == "evalsha_ro") {
+        // EVAL script numkeys key [key ...] arg [arg ...]
+        if (args.size() < 4 || args[2] == "0") {
+            return false;
+        }
+        *key = args[3];
+        return true;
+    }
+    if (cmd == "cluster" || cmd == "config" || cmd == "echo" ||
+        cmd == "info" || cmd == "ping" || cmd == "script" ||
+        cmd == "select" || cmd == "auth" || cmd == "hello") {
+        return false;
+    }
+    *key = args[1];
+    return true;
+}
+
+// "host:port" of the node at `ip' and `port'.
+static std::string NodeAddress(const butil::StringPiece& ip, int64_t port) {
+    std::string addr;
+    if (ip.find(':') != butil::StringPiece::npos) {
+        // IPv6
+        addr.push_back('[');
+        addr.append(ip.data(), ip.size());
+        addr.push_back(']');
+    } else {
+        addr.append(ip.data(), ip.size());
+    }
+    addr.push_back(':');
+    addr.append(butil::Int64ToString(port));
+    return addr;
+}
+
+// Host part of "host:port".
+static butil::StringPiece NodeHost(const butil::StringPiece& node) {
+    const size_t pos = node.rfind(':');
+    butil::StringPiece host =
+        (pos == butil::StringPiece::npos ? node : node.substr(0, pos));
+    if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    return host;
+}
+
+// Parse "MOVED <slot> <host:port>" or "ASK <slot> <host:port>".
+// Returns false if `error' is not a redirection.
+static bool ParseRedirection(const butil::StringPiece& error,
+                             bool* asking, std::string* node) {
+    butil::StringPiece rest;
+    if (error.starts_with("MOVED ")) {
+        *asking = false;
+        rest = error.substr(6);
+    } else if (error.starts_with("ASK ")) {
+        *asking = true;
+        rest = error.substr(4);
+    } else {
+        return false;
+    }
+    const size_t pos = rest.find(' ');
+    if (pos == butil::StringPiece::npos || pos + 1 >= rest.size()) {
+        return false;
+    }
+    rest.substr(pos + 1).CopyToString(node);
+    return true;
+}
+
+// A call to the cluster, split into sub calls to nodes in rounds. Each
+// round sends commands not done yet to their nodes, commands redirected
+// by nodes are sent again in the next round.
+class RedisClusterChannel::Call {
+public:
+    Call(RedisClusterChannel* channel, Controller* cntl,
+         RedisResponse* response, google::protobuf::Closure* done)
+        : _channel(channel)
+        , _cntl(cntl)
+        , _response(response)
+        , _done(done)
+        , _deadline_us(-1)
+        , _nround(0)
+        , _npending(0)
+        , _error_code(0) {}
+
+    ~Call() {
+        for (size_t i = 0; i < _subs.size(); ++i) {
+            delete _subs[i];
+        }
+    }
+
+    // Split commands of `request'. Returns false on failure.
+    bool Init(const RedisRequest& request, int64_t timeout_ms);
+
+    // Send the first round. `this' may be deleted when this function
+    // returns.
+    void Start();
+
+private:
+    struct Command {
+        std::vector<butil::StringPiece> args;
+        std::string node;
+        bool asking;
+        const RedisReply* reply;
+    };
+    struct SubCall {
+        Call* call;
+        std::string node;
+        bool asking;
+        std::vector<int> indexes;
+        Controller cntl;
+        RedisRequest request;
+        RedisResponse response;
+    };
+
+    void IssueRound(const std::vector<int>& indexes);
+    static void OnSubCallDone(SubCall* sub);
+    void OnRoundDone();
+    void Finish();
+
+    RedisClusterChannel* _channel;
+    Controller* _cntl;
+    RedisResponse* _response;
+    google::protobuf::Closure* _done;
+    int64_t _deadline_us;
+    int _nround;
+    butil::Arena _arena;
+    std::vector<Command> _commands;
+    // Commands sent in current round.
+    std::vector<int> _round;
+    // Sub calls of all rounds, replies are referenced until the end.
+    std::vector<SubCall*> _subs;
+    butil::atomic<int> _npending;
+    butil::Mutex _error_mutex;
+    int _error_code;
+    std::string _error_text;
+};
+
+bool RedisClusterChannel::Call::Init(const RedisRequest& request,
+                                     int64_t timeout_ms) {
+    if (request.has_error() || request.command_size() == 0) {
+        _cntl->SetFailed(EREQUEST, "Invalid RedisRequest");
+        return false;
+    }
+    butil::IOBuf buf;
+    if (!request.SerializeTo(&buf)) {
+        _cntl->SetFailed(EREQUEST, "Fail to serialize RedisRequest");
+        return false;
+    }
+    std::shared_ptr<const SlotMap> slot_map = _channel->GetSlotMap();
+    RedisCommandParser parser;
+    _commands.resize(request.command_size());
+    for (size_t i = 0; i < _commands.size(); ++i) {
+        Command& c = _commands[i];
+        if (parser.Consume(buf, &c.args, &_arena) != PARSE_OK) {
+            _cntl->SetFailed(EREQUEST, "Fail to parse command[%d]", (int)i);
+            return false;
+        }
+        c.asking = false;
+        c.reply = NULL;
+        butil::StringPiece key;
+        int node_index = -1;
+        if (GetCommandKey(c.args, &key) && slot_map != NULL) {
+            node_index = slot_map->slots[GetHashSlot(key)];
+        }
+        if (node_index >= 0) {
+            c.node = slot_map->nodes[node_index];
+        } else {
+            // Keyless or the slot is not covered by the map, the node
+            // redirects the command if it's not the right one.
+            c.node = _channel->AnyNode();
+        }
+        _round.push_back(i);
+    }
+    if (timeout_ms >= 0) {
+        _deadline_us = butil::gettimeofday_us() + timeout_ms * 1000L;
+    }
+    return true;
+}
+
+void RedisClusterChannel::Call::Start() {
+    const std::vector<int> round = _round;
+    IssueRound(round);
+}
+
+void RedisClusterChannel::Call::IssueRound(const std::vector<int>& indexes) {
+    int64_t timeout_ms = -1;
+    if (_deadline_us >= 0) {
+        timeout_ms = (_deadline_us - butil::gettimeofday_us()) / 1000;
+        if (timeout_ms <= 0) {
+            _error_code = ERPCTIMEDOUT;
+            _error_text = "Reached timeout before following redirections";
+            return Finish();
+        }
+    }
+    // Pipeline commands to the same node in one sub call.
+    std::vector<SubCall*> subs;
+    std::map<std::pair<std::string, bool>, SubCall*> groups;
+    for (size_t i = 0; i < indexes.size(); ++i) {
+        Command& c = _commands[indexes[i]];
+        SubCall*& sub = groups[std::make_pair(c.node, c.asking)];
+        if (sub == NULL) {
+            sub = new SubCall;
+            sub->call = this;
+            sub->node = c.node;
+            sub->asking = c.asking;
+            sub->cntl.set_timeout_ms(timeout_ms);
+            if (_cntl->has_log_id()) {
+                sub->cntl.set_log_id(_cntl->log_id());
+            }
+            subs.push_back(sub);
+            _subs.push_back(sub);
+        }
+        if (c.asking) {
+            sub->request.AddCommand("ASKING");
+        }
+        sub->request.AddCommandByComponents(c.args.data(), c.args.size());
+        sub->indexes.push_back(indexes[i]);
+    }
+    // Set before any sub call which may complete in-place.
+    _npending.store(subs.size(), butil::memory_order_relaxed);
+    // NOTE: `this' may be deleted by the last sub call, don't touch it.
+    for (size_t i = 0; i < subs.size(); ++i) {
+        SubCall* sub = subs[i];
+        Channel* channel = _channel->GetNodeChannel(sub->node);
+        if (channel == NULL) {
+            sub->cntl.SetFailed(EHOSTDOWN, "Invalid redis node=%s",
+                                sub->node.c_str());
+            OnSubCallDone(sub);
+            continue;
+        }
+        channel->CallMethod(NULL, &sub->cntl, &sub->request, &sub->response,
+                            brpc::NewCallback(OnSubCallDone, sub));
+    }
+}
+
+void RedisClusterChannel::Call::OnSubCallDone(SubCall* sub) {
+    Call* call = sub->call;
+    const int nreply_per_cmd = (sub->asking ? 2 : 1);
+    if (!sub->cntl.Failed() && sub->response.reply_size() !=
+        (int)sub->indexes.size() * nreply_per_cmd) {
+        sub->cntl.SetFailed(ERESPONSE, "Unmatched number of replies from %s",
+                            sub->node.c_str());
+    }
+    if (sub->cntl.Failed()) {
+        BAIDU_SCOPED_LOCK(call->_error_mutex);
+        if (call->_error_code == 0) {
+            call->_error_code = sub->cntl.ErrorCode();
+            call->_error_text = sub->node + ": " + sub->cntl.ErrorText();
+        }
+    } else {
+        // Sub calls of a round fill different commands.
+        for (size_t i = 0; i < sub->indexes.size(); ++i) {
+            call->_commands[sub->indexes[i]].reply =
+                &sub->response.reply(i * nreply_per_cmd + nreply_per_cmd - 1);
+        }
+    }
+    if (call->_npending.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+        call->OnRoundDone();
+    }
+}
+
+void RedisClusterChannel::Call::OnRoundDone() {
+    if (_error_code != 0) {
+        return Finish();
+    }
+    std::vector<int> redirected;
+    bool moved = false;
+    for (size_t i = 0; i < _round.size(); ++i) {
+        Command& c = _commands[_round[i]];
+        if (!c.reply->is_error()) {
+            continue;
+        }
+        bool asking = false;
+        std::string node;
+        if (ParseRedirection(c.reply->error_message(), &asking, &node)) {
+            moved = moved || !asking;
+            c.node.swap(node);
+            c.asking = asking;
+            redirected.push_back(_round[i]);
+        }
+    }
+    if (redirected.empty() || _nround >= _channel->_options.max_redirect) {
+        // Replies of MOVED/ASK are returned to the user if there're too
+        // many redirections.
+        return Finish();
+    }
+    if (moved) {
+        _channel->TriggerRefresh();
+    }
+    ++_nround;
+    _round = redirected;
+    IssueRound(redirected);
+}
+
+void RedisClusterChannel::Call::Finish() {
+    if (_error_code != 0) {
+        _cntl->SetFailed(_error_code, "%s", _error_text.c_str());
+    } else {
+        std::vector<const RedisReply*> replies(_commands.size());
+        for (size_t i = 0; i < _commands.size(); ++i) {
+            replies[i] = _commands[i].reply;
+        }
+        _response->MergeReplies(replies.data(), replies.size());
+    }
+    google::protobuf::Closure* done = _done;
+    delete this;
+    done->Run();
+}
+
+namespace {
+struct SignalEvent : public google::protobuf::Closure {
+    explicit SignalEvent(bthread::CountdownEvent* e) : event(e) {}
+    void Run() override { event->signal(); }
+    bthread::CountdownEvent* event;
+};
+}  // namespace
+
+RedisClusterChannel::RedisClusterChannel()
+    : _refreshing(false)
+    , _stopped(false)
+    , _refresh_tid(INVALID_BTHREAD)
+    , _periodic_tid(INVALID_BTHREAD) {
+}
+
+RedisClusterChannel::~RedisClusterChannel() {
+    bthread_t refresh_tid = INVALID_BTHREAD;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _stopped = true;
+        refresh_tid = _refresh_tid;
+    }
+    if (_periodic_tid != INVALID_BTHREAD) {
+        bthread_stop(_periodic_tid);
+        bthread_join(_periodic_tid, NULL);
+    }
+    if (refresh_tid != INVALID_BTHREAD) {
+        bthread_join(refresh_tid, NULL);
+    }
+}
+
+int RedisClusterChannel::Init(const char* seeds,
+                              const RedisClusterChannelOptions* options) {
+    if (options) {
+        _options = *options;
+    }
+    _options.channel_options.protocol = PROTOCOL_REDIS;
+    for (butil::StringSplitter sp(seeds, ','); sp; ++sp) {
+        butil::StringPiece seed(sp.field(), sp.length());
+        seed.trim_spaces();
+        if (!seed.empty()) {
+            _seeds.push_back(seed.as_string());
+        }
+    }
+    if (_seeds.empty()) {
+        LOG(ERROR) << "No seeds of the redis cluster";
+        return -1;
+    }
+    if (RefreshSlots() != 0) {
+        LOG(ERROR) << "Fail to get slots of the redis cluster from " << seeds;
+        return -1;
+    }
+    if (_options.refresh_interval_s > 0 &&
+        bthread_start_background(&_periodic_tid, NULL,
+                                 RunPeriodicRefresh, this) != 0) {
+        LOG(ERROR) << "Fail to start bthread refreshing slots";
+        _periodic_tid = INVALID_BTHREAD;
+        return -1;
+    }
+    return 0;
+}
+
+void RedisClusterChannel::CallMethod(
+    const google::protobuf::MethodDescriptor* /*method*/,
+    google::protobuf::RpcController* controller,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response,
+    google::protobuf::Closure* done) {
+    Controller* cntl = static_cast<Controller*>(controller);
+    const RedisRequest* req = dynamic_cast<const RedisRequest*>(request);
+    RedisResponse* res = dynamic_cast<RedisResponse*>(response);
+    if (req == NULL || res == NULL) {
+        cntl->SetFailed(EINVAL, "RedisClusterChannel only accepts "
+                        "RedisRequest and RedisResponse");
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    int64_t timeout_ms = cntl->timeout_ms();
+    if (timeout_ms == UNSET_MAGIC_NUM) {
+        timeout_ms = _options.channel_options.timeout_ms;
+    }
+    bthread::CountdownEvent event(1);
+    SignalEvent signal_event(&event);
+    Call* call = new Call(this, cntl, res, done ? done : &signal_event);
+    if (!call->Init(*req, timeout_ms)) {
+        delete call;
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    call->Start();
+    if (done == NULL) {
+        event.wait();
+    }
+}
+
+std::shared_ptr<const RedisClusterChannel::SlotMap>
+RedisClusterChannel::GetSlotMap() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _slot_map;
+}
+
+Channel* RedisClusterChannel::GetNodeChannel(const std::string& node) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    std::unique_ptr<Channel>& channel = _node_channels[node];
+    if (channel == NULL) {
+        std::unique_ptr<Channel> new_channel(new Channel);
+        if (new_channel->Init(node.c_str(), &_options.channel_options) != 0) {
+            LOG(ERROR) << "Fail to init channel to redis node=" << node;
+            _node_channels.erase(node);
+            return NULL;
+        }
+        channel.swap(new_channel);
+    }
+    return channel.get();
+}
+
+std::string RedisClusterChannel::AnyNode() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_slot_map != NULL && !_slot_map->nodes.empty()) {
+        return _slot_map->nodes[
+            butil::fast_rand_less_than(_slot_map->nodes.size())];
+    }
+    return _seeds[butil::fast_rand_less_than(_seeds.size())];
+}
+
+int RedisClusterChannel::RefreshSlots() {
+    std::vector<std::string> candidates;
+    std::shared_ptr<const SlotMap> old_map = GetSlotMap();
+    if (old_map != NULL) {
+        candidates = old_map->nodes;
+    }
+    candidates.insert(candidates.end(), _seeds.begin(), _seeds.end());
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        const std::string& candidate = candidates[i];
+        Channel* channel = GetNodeChannel(candidate);
+        if (channel == NULL) {
+            continue;
+        }
+        RedisRequest request;
+        request.AddCommand("CLUSTER SLOTS");
+        RedisResponse response;
+        Controller cntl;
+        channel->CallMethod(NULL, &cntl, &request, &response, NULL);
+        if (cntl.Failed()) {
+            LOG(WARNING) << "Fail to get slots from " << candidate << ": "
+                         << cntl.ErrorText();
+            continue;
+        }
+        const RedisReply& reply = response.reply(0);
+        if (!reply.is_array()) {
+            LOG(WARNING) << "Unexpected reply of CLUSTER SLOTS from "
+                         << candidate << ": " << reply;
+            continue;
+        }
+        std::shared_ptr<SlotMap> new_map(new SlotMap);
+        std::fill(new_map->slots, new_map->slots + SLOT_NUM, -1);
+        std::map<std::string, int> node_index;
+        // Each element is [start, end, [ip, port, id], replicas...]
+        for (size_t j = 0; j < reply.size(); ++j) {
+            const RedisReply& range = reply[j];
+            if (!range.is_array() || range.size() < 3 ||
+                !range[0].is_integer() || !range[1].is_integer()) {
+                continue;
+            }
+            const RedisReply& master = range[2];
+            if (!master.is_array() || master.size() < 2 ||
+                !master[0].is_string() || !master[1].is_integer()) {
+                continue;
+            }
+            butil::StringPiece ip = master[0].data();
+            if (ip.empty() || ip == "?") {
+                // The node doesn't know its address, use the one we
+                // connected to.
+                ip = NodeHost(candidate);
+            }
+            const std::string node = NodeAddress(ip, master[1].integer());
+            std::map<std::string, int>::iterator it = node_index.find(node);
+            if (it == node_index.end()) {
+                it = node_index.insert(std::make_pair(
+                    node, (int)new_map->nodes.size())).first;
+                new_map->nodes.push_back(node);
+            }
+            const int64_t start = std::max(range[0].integer(), (int64_t)0);
+            const int64_t end = std::min(range[1].integer(),
+                                         (int64_t)SLOT_NUM - 1);
+            for (int64_t slot = start; slot <= end; ++slot) {
+                new_map->slots[slot] = it->second;
+            }
+        }
+        if (new_map->nodes.empty()) {
+            LOG(WARNING) << "No slots are served according to " << candidate;
+            continue;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        _slot_map = new_map;
+        return 0;
+    }
+    return -1;
+}
+
+void RedisClusterChannel::TriggerRefresh() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_refreshing || _stopped) {
+        return;
+    }
+    bthread_t tid;
+    if (bthread_start_background(&tid, NULL, RunRefresh, this) != 0) {
+        LOG(ERROR) << "Fail to start bthread refreshing slots";
+        return;
+    }
+    _refreshing = true;
+    _refresh_tid = tid;
+}
+
+void* RedisClusterChannel::RunRefresh(void* arg) {
+    RedisClusterChannel* channel = static_cast<RedisClusterChannel*>(arg);
+    if (channel->RefreshSlots() != 0) {
+        LOG(WARNING) << "Fail to refresh slots of the redis cluster";
+    }
+    BAIDU_SCOPED_LOCK(channel->_mutex);
+    channel->_refreshing = false;
+    return NULL;
+}
+
+void* RedisClusterChannel::RunPeriodicRefresh(void* arg) {
+    RedisClusterChannel* channel = static_cast<RedisClusterChannel*>(arg);
+    // bthread_usleep fails with ESTOP when the channel is destroyed.
+    while (bthread_usleep(channel->_options.refresh_interval_s * 1000000L) == 0) {
+        channel->RefreshSlots();
+    }
+    return NULL;
+}
+
+int RedisClusterChannel::CheckHealth() {
+    std::shared_ptr<const SlotMap> slot_map = GetSlotMap();
+    return (slot_map != NULL && !slot_map->nodes.empty()) ? 0 : -1;
+}
+
+void RedisClusterChannel::Describe(std::ostream& os,
+                                   const DescribeOptions&) const {
+    std::shared_ptr<const SlotMap> slot_map = GetSlotMap();
+    os << "RedisClusterChannel[nodes=";
+    if (slot_map != NULL) {
+        for (size_t i = 0; i < slot_map->nodes.size(); ++i) {
+            if (i) {
+                os << ',';
+            }
+            os << slot_map->nodes[i];
+        }
+    }
+    os << ']';
+}
+
+} // namespace brpc
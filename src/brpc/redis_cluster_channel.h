@@ -0,0 +1,146 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_REDIS_CLUSTER_CHANNEL_H
+#define BRPC_REDIS_CLUSTER_CHANNEL_H
+
+// To brpc developers: This is a header included by user, don't depend
+// on internal structures, use opaque pointers instead.
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "butil/strings/string_piece.h"
+#include "butil/synchronization/lock.h"
+#include "bthread/types.h"
+#include "brpc/channel.h"
+
+namespace brpc {
+
+struct RedisClusterChannelOptions {
+    RedisClusterChannelOptions();
+
+    // Options of channels to nodes of the cluster. `protocol' is always
+    // redis and `timeout_ms' is the timeout of the whole call including
+    // redirections.
+    ChannelOptions channel_options;
+
+    // Max rounds of following MOVED/ASK redirections of a call.
+    // Default: 5
+    int max_redirect;
+
+    // Refresh the slot map from the cluster every so many seconds besides
+    // refreshing on MOVED. Non-positive values disable periodic refreshing.
+    // Default: 60
+    int refresh_interval_s;
+};
+
+// A channel to Redis Cluster without proxies. It keeps the map from the
+// 16384 hash slots to nodes (fetched with CLUSTER SLOTS), routes each
+// command of a RedisRequest to the node serving the hash slot of its key,
+// sends commands to the same node in one pipeline and merges replies back
+// in the order of commands.
+// Commands redirected by MOVED are resent to the new node and trigger a
+// refresh of the slot map in background, commands redirected by ASK are
+// resent to the importing node after ASKING. Calls in flight are never
+// blocked by refreshing.
+// Limitations:
+//   * The key of a command is its first argument(the 4th one for
+//     EVAL/EVALSHA). Multi-key commands must have keys in the same slot
+//     (use hash tags like {user1000}), otherwise the node replies CROSSSLOT.
+//   * MULTI/EXEC and blocking commands are not supported.
+//   * The channel must outlive asynchronous calls.
+// Example:
+//   brpc::RedisClusterChannel channel;
+//   if (channel.Init("10.0.0.1:6379,10.0.0.2:6379", NULL) != 0) { ... }
+//   brpc::RedisRequest request;
+//   request.AddCommand("SET a 1");
+//   request.AddCommand("GET b");
+//   brpc::RedisResponse response;
+//   brpc::Controller cntl;
+//   channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+class RedisClusterChannel : public ChannelBase {
+public:
+    static const int SLOT_NUM = 16384;
+
+    RedisClusterChannel();
+    ~RedisClusterChannel();
+
+    // Initialize with comma-separated "host:port" of some nodes of the
+    // cluster, and fetch the slot map from one of them.
+    // If `options' is NULL, use default options.
+    // Returns 0 on success, -1 otherwise.
+    int Init(const char* seeds, const RedisClusterChannelOptions* options);
+
+    // `request' must be RedisRequest and `response' must be RedisResponse.
+    void CallMethod(const google::protobuf::MethodDescriptor* method,
+                    google::protobuf::RpcController* controller,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done) override;
+
+    int CheckHealth() override;
+
+    void Describe(std::ostream& os, const DescribeOptions&) const override;
+
+    // Fetch the slot map from the cluster synchronously.
+    // Returns 0 on success, -1 otherwise.
+    int RefreshSlots();
+
+    // Hash slot of `key', honoring hash tags.
+    static int GetHashSlot(const butil::StringPiece& key);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RedisClusterChannel);
+
+    class Call;
+    struct SlotMap {
+        // Index of nodes serving the slot, -1 means unknown.
+        short slots[SLOT_NUM];
+        std::vector<std::string> nodes;
+    };
+
+    std::shared_ptr<const SlotMap> GetSlotMap() const;
+    // Get or create the channel to `node'("host:port"). Never NULL unless
+    // the address is invalid.
+    Channel* GetNodeChannel(const std::string& node);
+    // Address of any node, for commands without keys.
+    std::string AnyNode() const;
+    // Refresh the slot map in a background bthread if it's not running.
+    void TriggerRefresh();
+    static void* RunRefresh(void* arg);
+    static void* RunPeriodicRefresh(void* arg);
+
+    RedisClusterChannelOptions _options;
+    std::vector<std::string> _seeds;
+
+    mutable butil::Mutex _mutex;
+    std::shared_ptr<const SlotMap> _slot_map;
+    // Channels are never removed before the channel is destroyed so that
+    // calls in flight can use them without locking.
+    std::map<std::string, std::unique_ptr<Channel> > _node_channels;
+    bool _refreshing;
+    bool _stopped;
+    bthread_t _refresh_tid;
+    bthread_t _periodic_tid;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_REDIS_CLUSTER_CHANNEL_H
@@ -0,0 +1,241 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <string>
+#include <vector>
+#include "butil/logging.h"
+#include "butil/string_printf.h"
+#include "brpc/redis.h"
+#include "brpc/redis_command.h"
+#include "brpc/details/channel_private_accessor.h"
+#include "brpc/details/redis_near_cache.h"
+#include "brpc/redis_near_cache_channel.h"
+
+namespace brpc {
+
+RedisNearCacheChannelOptions::RedisNearCacheChannelOptions()
+    : max_bytes(64 * 1024 * 1024)
+    , nshard(16) {
+    channel_options.protocol = PROTOCOL_REDIS;
+    channel_options.connection_type = CONNECTION_TYPE_SINGLE;
+}
+
+// Returns true and sets `key' if `request' is a single GET.
+static bool GetKeyOfSingleGet(const RedisRequest& request, std::string* key) {
+    if (request.has_error() || request.command_size() != 1) {
+        return false;
+    }
+    butil::IOBuf buf;
+    if (!request.SerializeTo(&buf)) {
+        return false;
+    }
+    RedisCommandParser parser;
+    butil::Arena arena;
+    std::vector<butil::StringPiece> args;
+    // Command names are lowercased by RedisCommandParser.
+    if (parser.Consume(buf, &args, &arena) != PARSE_OK ||
+        args.size() != 2 || args[0] != "get") {
+        return false;
+    }
+    key->assign(args[1].data(), args[1].size());
+    return true;
+}
+
+// Ends a GET missing the cache, caching the value if the connection was
+// tracked when the GET was sent.
+class RedisNearCacheChannel::MissDone : public google::protobuf::Closure {
+public:
+    MissDone(RedisNearCacheChannel* channel, SocketId server_id,
+             const std::string& key, Controller* cntl,
+             RedisResponse* response, google::protobuf::Closure* done)
+        : _channel(channel), _server_id(server_id), _key(key)
+        , _with_tracking(false), _cntl(cntl), _user_response(response)
+        , _done(done) {}
+
+    // Build the request, turning on tracking in front of the GET if the
+    // connection is not known to be tracked.
+    bool Init() {
+        _channel->_cache->TakeSnapshot(_server_id, _key, &_snapshot);
+        _with_tracking = (_snapshot.conn_stamp < 0 ||
+                          _snapshot.conn_stamp != _channel->_tracked_stamp.load(
+                              butil::memory_order_acquire));
+        if (_with_tracking) {
+            if (!request.AddCommand("HELLO 3") ||
+                !request.AddCommand("CLIENT TRACKING ON")) {
+                return false;
+            }
+        }
+        const butil::StringPiece components[] = { "GET", _key };
+        return request.AddCommandByComponents(components,
+                                              arraysize(components));
+    }
+
+    void Run() override {
+        if (!_cntl->Failed()) {
+            Complete();
+        }
+        google::protobuf::Closure* done = _done;
+        delete this;
+        if (done) {
+            done->Run();
+        }
+    }
+
+    RedisRequest request;
+    RedisResponse response;
+
+private:
+    void Complete() {
+        const int nreply = response.reply_size();
+        if (nreply != request.command_size()) {
+            _cntl->SetFailed(ERESPONSE, "Unmatched number of replies");
+            return;
+        }
+        bool tracked = true;
+        if (_with_tracking) {
+            const RedisReply& hello = response.reply(0);
+            const RedisReply& tracking = response.reply(1);
+            tracked = (!hello.is_error() && tracking.is_string() &&
+                       tracking.data() == "OK");
+            if (tracked) {
+                // An earlier stamp may overwrite a later one, which only
+                // makes next miss turn on tracking again.
+                _channel->_tracked_stamp.store(_snapshot.conn_stamp,
+                                               butil::memory_order_release);
+            } else {
+                LOG_EVERY_SECOND(WARNING) << "Fail to turn on client tracking: "
+                                          << hello << ", " << tracking;
+            }
+        }
+        const RedisReply* value = &response.reply(nreply - 1);
+        _user_response->Clear();
+        _user_response->MergeReplies(&value, 1);
+        if (tracked) {
+            _channel->_cache->Insert(_server_id, _key, _snapshot, *value);
+        }
+    }
+
+    RedisNearCacheChannel* _channel;
+    SocketId _server_id;
+    std::string _key;
+    RedisNearCache::Snapshot _snapshot;
+    bool _with_tracking;
+    Controller* _cntl;
+    RedisResponse* _user_response;
+    google::protobuf::Closure* _done;
+};
+
+RedisNearCacheChannel::RedisNearCacheChannel()
+    : _tracked_stamp(-1) {}
+
+RedisNearCacheChannel::~RedisNearCacheChannel() {}
+
+int RedisNearCacheChannel::Init(const char* server_addr_and_port,
+                                const RedisNearCacheChannelOptions* options) {
+    static butil::atomic<int> s_nchannel(0);
+    if (options) {
+        _options = *options;
+    }
+    ChannelOptions& copts = _options.channel_options;
+    copts.protocol = PROTOCOL_REDIS;
+    // Invalidations are pushed on the connection reading the keys, which
+    // must not be shared with channels having no cache.
+    copts.connection_type = CONNECTION_TYPE_SINGLE;
+    copts.connection_group = butil::string_printf(
+        "redis_near_cache_%d",
+        s_nchannel.fetch_add(1, butil::memory_order_relaxed));
+    if (_channel.Init(server_addr_and_port, &copts) != 0) {
+        LOG(ERROR) << "Fail to init channel to " << server_addr_and_port;
+        return -1;
+    }
+    _cache.reset(new RedisNearCache(_options.max_bytes, _options.nshard));
+    return 0;
+}
+
+void RedisNearCacheChannel::CallMethod(
+    const google::protobuf::MethodDescriptor* method,
+    google::protobuf::RpcController* controller,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response,
+    google::protobuf::Closure* done) {
+    Controller* cntl = static_cast<Controller*>(controller);
+    const RedisRequest* req = dynamic_cast<const RedisRequest*>(request);
+    RedisResponse* res = dynamic_cast<RedisResponse*>(response);
+    if (req == NULL || res == NULL || _cache == NULL) {
+        cntl->SetFailed(EINVAL, "RedisNearCacheChannel only accepts "
+                        "RedisRequest and RedisResponse after Init()");
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    std::string key;
+    if (!GetKeyOfSingleGet(*req, &key)) {
+        return _channel.CallMethod(method, cntl, request, response, done);
+    }
+    const SocketId server_id = ChannelPrivateAccessor(&_channel).SelectServer(0);
+    butil::IOBuf cached;
+    if (_cache->Lookup(server_id, key, &cached)) {
+        res->Clear();
+        if (res->ConsumePartialIOBuf(cached, 1) == PARSE_OK) {
+            if (done) {
+                done->Run();
+            }
+            return;
+        }
+        LOG(WARNING) << "Fail to parse cached reply of " << key;
+        res->Clear();
+    }
+    MissDone* miss_done = new MissDone(this, server_id, key, cntl, res, done);
+    if (!miss_done->Init()) {
+        cntl->SetFailed(EREQUEST, "Fail to build request of GET %s",
+                        key.c_str());
+        delete miss_done;
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    if (done) {
+        _channel.CallMethod(method, cntl, &miss_done->request,
+                            &miss_done->response, miss_done);
+    } else {
+        _channel.CallMethod(method, cntl, &miss_done->request,
+                            &miss_done->response, NULL);
+        miss_done->Run();
+    }
+}
+
+int RedisNearCacheChannel::CheckHealth() {
+    // Channel::CheckHealth() is public in ChannelBase only.
+    ChannelBase* channel = &_channel;
+    return channel->CheckHealth();
+}
+
+void RedisNearCacheChannel::Describe(std::ostream& os,
+                                     const DescribeOptions& options) const {
+    os << "RedisNearCacheChannel[";
+    _channel.Describe(os, options);
+    os << " cache_bytes=" << cache_bytes() << ']';
+}
+
+size_t RedisNearCacheChannel::cache_bytes() const {
+    return _cache ? _cache->bytes() : 0;
+}
+
+} // namespace brpc
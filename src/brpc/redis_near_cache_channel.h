@@ -0,0 +1,111 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_REDIS_NEAR_CACHE_CHANNEL_H
+#define BRPC_REDIS_NEAR_CACHE_CHANNEL_H
+
+// To brpc developers: This is a header included by user, don't depend
+// on internal structures, use opaque pointers instead.
+
+#include <memory>
+#include "butil/atomicops.h"
+#include "brpc/channel.h"
+
+namespace brpc {
+
+class RedisNearCache;
+
+struct RedisNearCacheChannelOptions {
+    RedisNearCacheChannelOptions();
+
+    // Options of the channel to the redis-server. `protocol' is always redis
+    // and `connection_type' is always single. `connection_group' is set to
+    // a unique one so that the connection is not shared with other channels.
+    ChannelOptions channel_options;
+
+    // Max bytes of keys and values in the cache.
+    // Default: 64MB
+    size_t max_bytes;
+
+    // Cached values are spread into so many shards with separate locks.
+    // Default: 16
+    size_t nshard;
+};
+
+// A channel to one redis-server(6.0+) caching values of keys read by GET
+// in local memory. The connection is switched to RESP3 and CLIENT TRACKING
+// is turned on, so that the server pushes invalidations on the connection
+// when keys read through it are modified by anyone, and cached values are
+// dropped before replies after the invalidations are seen.
+// Values of keys read after the connection is broken are not cached until
+// tracking is turned on again, and all values are dropped once the
+// connection is re-established since invalidations might be lost.
+// Limitations:
+//   * Only requests with a single GET are served from the cache, other
+//     requests are sent to the server as is, with replies in RESP3(maps and
+//     sets become arrays, booleans become integers, doubles become strings).
+//   * Values may be stale for the time an invalidation is on the way.
+//   * The channel must outlive asynchronous calls.
+// Example:
+//   brpc::RedisNearCacheChannel channel;
+//   if (channel.Init("127.0.0.1:6379", NULL) != 0) { ... }
+//   brpc::RedisRequest request;
+//   request.AddCommand("GET a");
+//   brpc::RedisResponse response;
+//   brpc::Controller cntl;
+//   channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+class RedisNearCacheChannel : public ChannelBase {
+public:
+    RedisNearCacheChannel();
+    ~RedisNearCacheChannel();
+
+    // Initialize with "host:port" of the redis-server.
+    // If `options' is NULL, use default options.
+    // Returns 0 on success, -1 otherwise.
+    int Init(const char* server_addr_and_port,
+             const RedisNearCacheChannelOptions* options);
+
+    // `request' must be RedisRequest and `response' must be RedisResponse.
+    void CallMethod(const google::protobuf::MethodDescriptor* method,
+                    google::protobuf::RpcController* controller,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done) override;
+
+    int CheckHealth() override;
+
+    void Describe(std::ostream& os, const DescribeOptions&) const override;
+
+    // Bytes of keys and values in the cache.
+    size_t cache_bytes() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RedisNearCacheChannel);
+
+    class MissDone;
+
+    RedisNearCacheChannelOptions _options;
+    Channel _channel;
+    std::unique_ptr<RedisNearCache> _cache;
+    // Connection stamp of the connection on which tracking was turned on.
+    butil::atomic<int64_t> _tracked_stamp;
+};
+
+} // namespace brpc
+
+#endif  // BRPC_REDIS_NEAR_CACHE_CHANNEL_H
@@ -17,15 +17,27 @@
 
 
 #include <limits>
+#include <gflags/gflags.h>
 #include "butil/logging.h"
 #include "butil/string_printf.h"
+#include "brpc/reloadable_flags.h"
 #include "brpc/redis_reply.h"
 
 namespace brpc {
 
+DEFINE_int32(redis_reply_iobuf_threshold, 0,
+             "Bulk strings in redis replies not shorter than this value "
+             "reference blocks of the read buffer instead of being copied "
+             "into the arena, 0 disables it");
+BRPC_VALIDATE_GFLAG(redis_reply_iobuf_threshold, NonNegativeInteger);
+
 //BAIDU_CASSERT(sizeof(RedisReply) == 24, size_match);
 const int RedisReply::npos = -1;
 
+static void DestroyIOBuf(void* arg) {
+    static_cast<butil::IOBuf*>(arg)->~IOBuf();
+}
+
 const char* RedisReplyTypeToString(RedisReplyType type) {
     switch (type) {
     case REDIS_REPLY_STRING: return "string";
@@ -34,6 +46,7 @@ const char* RedisReplyTypeToString(RedisReplyType type) {
     case REDIS_REPLY_NIL: return "nil";
     case REDIS_REPLY_STATUS: return "status";
     case REDIS_REPLY_ERROR: return "error";
+    case REDIS_REPLY_PUSH: return "push";
     default: return "unknown redis type";
     }
 }
@@ -47,7 +60,7 @@ bool RedisReply::SerializeTo(butil::IOBufAppender* appender) {
             if (_length < (int)sizeof(_data.short_str)) {
                 appender->append(_data.short_str, _length);
             } else {
-                appender->append(_data.long_str, _length);
+                appender->append(_data.long_str.str, _length);
             }
             appender->append("\r\n", 2);
             return true;
@@ -63,14 +76,20 @@ bool RedisReply::SerializeTo(butil::IOBufAppender* appender) {
             if (_length != npos) {
                 if (_length < (int)sizeof(_data.short_str)) {
                     appender->append(_data.short_str, _length);
+                } else if (_data.long_str.buf != NULL) {
+                    // buf() flushes pending bytes of the appender so that
+                    // the blocks can be appended in order.
+                    appender->buf().append(*_data.long_str.buf);
                 } else {
-                    appender->append(_data.long_str, _length);
+                    appender->append(_data.long_str.str, _length);
                 }
                 appender->append("\r\n", 2);
             }
             return true;
         case REDIS_REPLY_ARRAY:
-            appender->push_back('*');
+            // fall through
+        case REDIS_REPLY_PUSH:
+            appender->push_back((_type == REDIS_REPLY_ARRAY) ? '*' : '>');
             appender->append_decimal(_length);
             appender->append("\r\n", 2);
             if (_length != npos) {
@@ -90,7 +109,8 @@ bool RedisReply::SerializeTo(butil::IOBufAppender* appender) {
 }
 
 ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
-    if (_type == REDIS_REPLY_ARRAY && _data.array.last_index >= 0) {
+    if ((_type == REDIS_REPLY_ARRAY || _type == REDIS_REPLY_PUSH) &&
+        _data.array.last_index >= 0) {
         // The parsing was suspended while parsing sub replies,
         // continue the parsing.
         RedisReply* subs = (RedisReply*)_data.array.replies;
@@ -113,10 +133,35 @@ ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
     }
     const char fc = *pfc;  // first character
     switch (fc) {
+    case '_':   // Null(RESP3)    "_\r\n"
+    case '#': { // Boolean(RESP3) "#t\r\n" or "#f\r\n"
+        const size_t len = (fc == '_' ? 3 : 4);
+        char line[4];
+        if (buf.copy_to(line, len) < len) {
+            return PARSE_ERROR_NOT_ENOUGH_DATA;
+        }
+        if (line[len - 2] != '\r' || line[len - 1] != '\n' ||
+            (fc == '#' && line[1] != 't' && line[1] != 'f')) {
+            LOG(ERROR) << "Invalid RESP3 " << (fc == '_' ? "null" : "boolean");
+            return PARSE_ERROR_ABSOLUTELY_WRONG;
+        }
+        buf.pop_front(len);
+        _type = (fc == '_' ? REDIS_REPLY_NIL : REDIS_REPLY_INTEGER);
+        _length = 0;
+        _data.integer = (fc == '#' && line[1] == 't');
+        return PARSE_OK;
+    }
     case '-':   // Error          "-<message>\r\n"
-    case '+': { // Simple String  "+<string>\r\n"
-        butil::IOBuf str;
-        if (buf.cut_until(&str, "\r\n") != 0) {
+    case '+':   // Simple String  "+<string>\r\n"
+    case ',':   // Double(RESP3)  ",<floating-point>\r\n"
+    case '(': { // Big number(RESP3) "(<big number>\r\n"
+        const RedisReplyType type = (fc == '-' ? REDIS_REPLY_ERROR :
+                                     fc == '+' ? REDIS_REPLY_STATUS :
+                                     REDIS_REPLY_STRING);
+        // Copy the string out of `buf' directly rather than cutting it into
+        // an intermediate IOBuf.
+        const size_t crlf_pos = buf.find("\r\n");
+        if (crlf_pos == butil::IOBuf::npos) {
             const size_t len = buf.size();
             if (len > std::numeric_limits<uint32_t>::max()) {
                 LOG(ERROR) << "simple string is too long! max length=2^32-1,"
@@ -125,12 +170,13 @@ ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
             }
             return PARSE_ERROR_NOT_ENOUGH_DATA;
         }
-        const size_t len = str.size() - 1;
+        const size_t len = crlf_pos - 1;
         if (len < sizeof(_data.short_str)) {
             // SSO short strings, including empty string.
-            _type = (fc == '-' ? REDIS_REPLY_ERROR : REDIS_REPLY_STATUS);
+            _type = type;
             _length = len;
-            str.copy_to_cstr(_data.short_str, (size_t)-1L, 1/*skip fc*/);
+            buf.copy_to_cstr(_data.short_str, len, 1/*skip fc*/);
+            buf.pop_front(crlf_pos + 2/*CRLF*/);
             return PARSE_OK;
         }
         char* d = (char*)_arena->allocate((len/8 + 1)*8);
@@ -138,14 +184,21 @@ ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
             LOG(FATAL) << "Fail to allocate string[" << len << "]";
             return PARSE_ERROR_ABSOLUTELY_WRONG;
         }
-        CHECK_EQ(len, str.copy_to_cstr(d, (size_t)-1L, 1/*skip fc*/));
-        _type = (fc == '-' ? REDIS_REPLY_ERROR : REDIS_REPLY_STATUS);
+        CHECK_EQ(len, buf.copy_to_cstr(d, len, 1/*skip fc*/));
+        buf.pop_front(crlf_pos + 2/*CRLF*/);
+        _type = type;
         _length = len;
-        _data.long_str = d;
+        _data.long_str.str = d;
+        _data.long_str.buf = NULL;
         return PARSE_OK;
     }
     case '$':   // Bulk String   "$<length>\r\n<string>\r\n"
+    case '!':   // Blob error(RESP3) "!<length>\r\n<error>\r\n"
+    case '=':   // Verbatim string(RESP3) "=<length>\r\n<fmt>:<string>\r\n"
     case '*':   // Array         "*<size>\r\n<sub-reply1><sub-reply2>..."
+    case '~':   // Set(RESP3)    "~<size>\r\n<sub-reply1><sub-reply2>..."
+    case '%':   // Map(RESP3)    "%<size>\r\n<key1><value1><key2>..."
+    case '>':   // Push(RESP3)   "><size>\r\n<sub-reply1><sub-reply2>..."
     case ':': { // Integer       ":<integer>\r\n"
         char intbuf[32];  // enough for fc + 64-bit decimal + \r\n
         const size_t ncopied = buf.copy_to(intbuf, sizeof(intbuf) - 1);
@@ -166,9 +219,9 @@ ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
             _length = 0;
             _data.integer = value;
             return PARSE_OK;
-        } else if (fc == '$') {
-            const int64_t len = value;  // `value' is length of the string
-            if (len < 0) {  // redis nil
+        } else if (fc == '$' || fc == '!' || fc == '=') {
+            int64_t len = value;  // `value' is length of the string
+            if (len < 0 && fc == '$') {  // redis nil
                 buf.pop_front(crlf_pos + 2/*CRLF*/);
                 _type = REDIS_REPLY_NIL;
                 _length = 0;
@@ -182,28 +235,64 @@ ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
             }
             // We provide c_str(), thus even if bulk string is started with
             // length, we have to end it with \0.
+            if (len < 0 || (fc == '=' && len < 4)) {
+                LOG(ERROR) << "Invalid length=" << len << " of "
+                           << (fc == '!' ? "blob error" : "verbatim string");
+                return PARSE_ERROR_ABSOLUTELY_WRONG;
+            }
             if (buf.size() < crlf_pos + 2 + (size_t)len + 2/*CRLF*/) {
                 return PARSE_ERROR_NOT_ENOUGH_DATA;
             }
+            size_t header_size = crlf_pos + 2/*CRLF*/;
+            if (fc == '=') {
+                // Skip the 3-byte format and the colon.
+                header_size += 4;
+                len -= 4;
+            }
+            const RedisReplyType type =
+                (fc == '!' ? REDIS_REPLY_ERROR : REDIS_REPLY_STRING);
             if ((size_t)len < sizeof(_data.short_str)) {
                 // SSO short strings, including empty string.
-                _type = REDIS_REPLY_STRING;
+                _type = type;
                 _length = len;
-                buf.pop_front(crlf_pos + 2);
+                buf.pop_front(header_size);
                 buf.cutn(_data.short_str, len);
                 _data.short_str[len] = '\0';
+            } else if (type == REDIS_REPLY_STRING &&
+                       FLAGS_redis_reply_iobuf_threshold > 0 &&
+                       len >= FLAGS_redis_reply_iobuf_threshold) {
+                // Reference blocks of `buf' rather than copying, the IOBuf
+                // is destroyed along with the arena.
+                void* mem = _arena->allocate_aligned(sizeof(butil::IOBuf));
+                if (mem == NULL) {
+                    LOG(FATAL) << "Fail to allocate IOBuf";
+                    return PARSE_ERROR_ABSOLUTELY_WRONG;
+                }
+                butil::IOBuf* b = new (mem) butil::IOBuf;
+                if (_arena->add_cleanup(DestroyIOBuf, b) != 0) {
+                    b->~IOBuf();
+                    LOG(FATAL) << "Fail to add cleanup of IOBuf";
+                    return PARSE_ERROR_ABSOLUTELY_WRONG;
+                }
+                buf.pop_front(header_size);
+                buf.cutn(b, len);
+                _type = REDIS_REPLY_STRING;
+                _length = len;
+                _data.long_str.str = NULL;
+                _data.long_str.buf = b;
             } else {
                 char* d = (char*)_arena->allocate((len/8 + 1)*8);
                 if (d == NULL) {
                     LOG(FATAL) << "Fail to allocate string[" << len << "]";
                     return PARSE_ERROR_ABSOLUTELY_WRONG;
                 }
-                buf.pop_front(crlf_pos + 2/*CRLF*/);
+                buf.pop_front(header_size);
                 buf.cutn(d, len);
                 d[len] = '\0';
-                _type = REDIS_REPLY_STRING;
+                _type = type;
                 _length = len;
-                _data.long_str = d;
+                _data.long_str.str = d;
+                _data.long_str.buf = NULL;
             }
             char crlf[2];
             buf.cutn(crlf, sizeof(crlf));
@@ -213,7 +302,10 @@ ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
             }
             return PARSE_OK;
         } else {
-            const int64_t count = value;  // `value' is count of sub replies
+            // `value' is count of sub replies, or pairs of them in a map.
+            const int64_t count = (fc == '%' ? value * 2 : value);
+            const RedisReplyType type =
+                (fc == '>' ? REDIS_REPLY_PUSH : REDIS_REPLY_ARRAY);
             if (count < 0) { // redis nil
                 buf.pop_front(crlf_pos + 2/*CRLF*/);
                 _type = REDIS_REPLY_NIL;
@@ -223,7 +315,7 @@ ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
             }
             if (count == 0) { // empty array
                 buf.pop_front(crlf_pos + 2/*CRLF*/);
-                _type = REDIS_REPLY_ARRAY;
+                _type = type;
                 _length = 0;
                 _data.array.last_index = -1;
                 _data.array.replies = NULL;
@@ -234,8 +326,8 @@ ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
                     " actually=" << count;
                 return PARSE_ERROR_ABSOLUTELY_WRONG;
             }
-            // FIXME(gejun): Call allocate_aligned instead.
-            RedisReply* subs = (RedisReply*)_arena->allocate(sizeof(RedisReply) * count);
+            // All sub replies are allocated in one chunk.
+            RedisReply* subs = (RedisReply*)_arena->allocate_aligned(sizeof(RedisReply) * count);
             if (subs == NULL) {
                 LOG(FATAL) << "Fail to allocate RedisReply[" << count << "]";
                 return PARSE_ERROR_ABSOLUTELY_WRONG;
@@ -244,7 +336,7 @@ ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
                 new (&subs[i]) RedisReply(_arena);
             }
             buf.pop_front(crlf_pos + 2/*CRLF*/);
-            _type = REDIS_REPLY_ARRAY;
+            _type = type;
             _length = count;
             _data.array.replies = subs;
 
@@ -269,6 +361,33 @@ ParseError RedisReply::ConsumePartialIOBuf(butil::IOBuf& buf) {
     return PARSE_ERROR_ABSOLUTELY_WRONG;
 }
 
+const char* RedisReply::FlattenIOBufData() const {
+    char* d = (char*)_arena->allocate((_length/8 + 1)*8);
+    if (d == NULL) {
+        LOG(FATAL) << "Fail to allocate string[" << _length << "]";
+        return "";
+    }
+    _data.long_str.buf->copy_to(d, _length);
+    d[_length] = '\0';
+    // Cache the flattened string, `buf' is kept for iobuf_data().
+    const_cast<RedisReply*>(this)->_data.long_str.str = d;
+    return d;
+}
+
+bool RedisReply::AppendDataTo(butil::IOBuf* out) const {
+    if (!is_string()) {
+        return false;
+    }
+    const butil::IOBuf* b = iobuf_data();
+    if (b != NULL) {
+        out->append(*b);
+    } else {
+        const butil::StringPiece str = data();
+        out->append(str.data(), str.size());
+    }
+    return true;
+}
+
 class RedisStringPrinter {
 public:
     RedisStringPrinter(const char* str, size_t length)
@@ -320,10 +439,14 @@ void RedisReply::Print(std::ostream& os) const {
         if (_length < (int)sizeof(_data.short_str)) {
             os << RedisStringPrinter(_data.short_str, _length);
         } else {
-            os << RedisStringPrinter(_data.long_str, _length);
+            const butil::StringPiece str = data();
+            os << RedisStringPrinter(str.data(), str.size());
         }
         os << '"';
         break;
+    case REDIS_REPLY_PUSH:
+        os << "(push) ";
+        // fall through
     case REDIS_REPLY_ARRAY:
         os << '[';
         for (int i = 0; i < _length; ++i) {
@@ -347,7 +470,7 @@ void RedisReply::Print(std::ostream& os) const {
         if (_length < (int)sizeof(_data.short_str)) {
             os << RedisStringPrinter(_data.short_str, _length);
         } else {
-            os << RedisStringPrinter(_data.long_str, _length);
+            os << RedisStringPrinter(_data.long_str.str, _length);
         }
         break;
     default:
@@ -360,8 +483,10 @@ void RedisReply::CopyFromDifferentArena(const RedisReply& other) {
     _type = other._type;
     _length = other._length;
     switch (_type) {
-    case REDIS_REPLY_ARRAY: {
-        RedisReply* subs = (RedisReply*)_arena->allocate(sizeof(RedisReply) * _length);
+    case REDIS_REPLY_ARRAY:
+        // fall through
+    case REDIS_REPLY_PUSH: {
+        RedisReply* subs = (RedisReply*)_arena->allocate_aligned(sizeof(RedisReply) * _length);
         if (subs == NULL) {
             LOG(FATAL) << "Fail to allocate RedisReply[" << _length << "]";
             return;
@@ -401,8 +526,15 @@ void RedisReply::CopyFromDifferentArena(const RedisReply& other) {
                 LOG(FATAL) << "Fail to allocate string[" << _length << "]";
                 return;
             }
-            memcpy(d, other._data.long_str, _length + 1);
-            _data.long_str = d;
+            const butil::IOBuf* b = other._data.long_str.buf;
+            if (b != NULL && other._data.long_str.str == NULL) {
+                b->copy_to(d, _length);
+                d[_length] = '\0';
+            } else {
+                memcpy(d, other._data.long_str.str, _length + 1);
+            }
+            _data.long_str.str = d;
+            _data.long_str.buf = NULL;
         }
         break;
     }
@@ -420,7 +552,7 @@ void RedisReply::SetArray(int size) {
         _length = 0;
         return;
     }
-    RedisReply* subs = (RedisReply*)_arena->allocate(sizeof(RedisReply) * size);
+    RedisReply* subs = (RedisReply*)_arena->allocate_aligned(sizeof(RedisReply) * size);
     if (!subs) {
         LOG(FATAL) << "Fail to allocate RedisReply[" << size << "]";
         return;
@@ -448,7 +580,8 @@ void RedisReply::SetStringImpl(const butil::StringPiece& str, RedisReplyType typ
         }
         memcpy(d, str.data(), size);
         d[size] = '\0';
-        _data.long_str = d;
+        _data.long_str.str = d;
+        _data.long_str.buf = NULL;
     }
     _type = type;
     _length = size;
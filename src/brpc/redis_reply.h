@@ -35,7 +35,10 @@ enum RedisReplyType {
     REDIS_REPLY_INTEGER = 3,
     REDIS_REPLY_NIL = 4,
     REDIS_REPLY_STATUS = 5,  // Simple String
-    REDIS_REPLY_ERROR = 6
+    REDIS_REPLY_ERROR = 6,
+    // Out-of-band data pushed by RESP3 servers, e.g. invalidations of
+    // client-side caching. Sub replies are visited like arrays.
+    REDIS_REPLY_PUSH = 7
 };
 
 const char* RedisReplyTypeToString(RedisReplyType);
@@ -55,6 +58,7 @@ public:
     bool is_error() const;   // True if the reply is an error.
     bool is_string() const;  // True if the reply is a string.
     bool is_array() const;   // True if the reply is an array.
+    bool is_push() const;    // True if the reply is a push message.
 
     // Set the reply to the null string.
     void SetNullString();
@@ -98,8 +102,20 @@ public:
     // Convert the reply to a StringPiece. If the reply is not a string,
     // call stacks are logged and "" is returned. 
     // If you need a std::string, call .data().as_string() (which allocates mem)
+    // NOTE: If the string references blocks of the parsed IOBuf (see
+    // iobuf_data()), c_str() and data() copy the string into the arena at
+    // the first call, which is not thread-safe.
     butil::StringPiece data() const;
 
+    // Return the IOBuf referencing blocks of the parsed IOBuf if this reply
+    // is a bulk string not shorter than -redis_reply_iobuf_threshold, NULL
+    // otherwise. Large values can be consumed without copying in this way.
+    const butil::IOBuf* iobuf_data() const;
+
+    // Append the string to `out' without copying if it is referencing
+    // blocks of the parsed IOBuf. Returns false if the reply is not a string.
+    bool AppendDataTo(butil::IOBuf* out) const;
+
     // Return number of sub replies in the array if this reply is an array, or
     // return the length of string if this reply is a string, otherwise 0 is
     // returned (call stacks are not logged).
@@ -110,6 +126,10 @@ public:
     RedisReply& operator[](size_t index);
 
     // Parse from `buf' which may be incomplete.
+    // Types of RESP3 are converted to the nearest ones above: null to nil,
+    // boolean to integer 1/0, double/big number/verbatim string to string,
+    // blob error to error, map(as key, value, key, value...) and set to
+    // array, push to REDIS_REPLY_PUSH.
     // Returns PARSE_OK when an intact reply is parsed and cut off from `buf'.
     // Returns PARSE_ERROR_NOT_ENOUGH_DATA if data in `buf' is not enough to parse,
     // and `buf' is guaranteed to be UNCHANGED so that you can call this
@@ -148,13 +168,19 @@ private:
 
     void FormatStringImpl(const char* fmt, va_list args, RedisReplyType type);
     void SetStringImpl(const butil::StringPiece& str, RedisReplyType type);
+    const char* FlattenIOBufData() const;
     
     RedisReplyType _type;
     int _length;  // length of short_str/long_str, count of replies
     union {
         int64_t integer;
         char short_str[16];
-        const char* long_str;
+        struct {
+            const char* str;
+            // Non-NULL if the string references blocks of the parsed IOBuf,
+            // in which case `str' is NULL until the string is flattened.
+            butil::IOBuf* buf;
+        } long_str;
         struct {
             int32_t last_index;  // >= 0 if previous parsing suspends on replies.
             RedisReply* replies;
@@ -175,7 +201,7 @@ inline void RedisReply::Reset() {
     _type = REDIS_REPLY_NIL;
     _length = 0;
     _data.array.last_index = -1;
-    _data.array.replies = NULL;
+    _data.array.replies = NULL;  // also clears _data.long_str.buf
     // _arena should not be reset because further memory allocation needs it.
 }
 
@@ -192,6 +218,7 @@ inline bool RedisReply::is_integer() const { return _type == REDIS_REPLY_INTEGER
 inline bool RedisReply::is_string() const
 { return _type == REDIS_REPLY_STRING || _type == REDIS_REPLY_STATUS; }
 inline bool RedisReply::is_array() const { return _type == REDIS_REPLY_ARRAY; }
+inline bool RedisReply::is_push() const { return _type == REDIS_REPLY_PUSH; }
 
 inline int64_t RedisReply::integer() const {
     if (is_integer()) {
@@ -262,7 +289,7 @@ inline const char* RedisReply::c_str() const {
         if (_length < (int)sizeof(_data.short_str)) { // SSO
             return _data.short_str;
         } else {
-            return _data.long_str;
+            return _data.long_str.str ? _data.long_str.str : FlattenIOBufData();
         }
     }
     CHECK(false) << "The reply is " << RedisReplyTypeToString(_type)
@@ -275,7 +302,9 @@ inline butil::StringPiece RedisReply::data() const {
         if (_length < (int)sizeof(_data.short_str)) { // SSO
             return butil::StringPiece(_data.short_str, _length);
         } else {
-            return butil::StringPiece(_data.long_str, _length);
+            return butil::StringPiece(
+                _data.long_str.str ? _data.long_str.str : FlattenIOBufData(),
+                _length);
         }
     }
     CHECK(false) << "The reply is " << RedisReplyTypeToString(_type)
@@ -288,7 +317,7 @@ inline const char* RedisReply::error_message() const {
         if (_length < (int)sizeof(_data.short_str)) { // SSO
             return _data.short_str;
         } else {
-            return _data.long_str;
+            return _data.long_str.str;
         }
     }
     CHECK(false) << "The reply is " << RedisReplyTypeToString(_type)
@@ -296,6 +325,13 @@ inline const char* RedisReply::error_message() const {
     return "";
 }
 
+inline const butil::IOBuf* RedisReply::iobuf_data() const {
+    if (_type == REDIS_REPLY_STRING && _length >= (int)sizeof(_data.short_str)) {
+        return _data.long_str.buf;
+    }
+    return NULL;
+}
+
 inline size_t RedisReply::size() const {
     return _length;
 }
@@ -306,7 +342,7 @@ inline RedisReply& RedisReply::operator[](size_t index) {
 }
 
 inline const RedisReply& RedisReply::operator[](size_t index) const {
-    if (is_array() && index < (size_t)_length) {
+    if ((is_array() || is_push()) && index < (size_t)_length) {
         return _data.array.replies[index];
     }
     static RedisReply redis_nil(NULL);
@@ -0,0 +1,151 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "bthread/bthread.h"
+#include "brpc/controller.h"
+#include "brpc/request_batcher.h"
+
+
+namespace brpc {
+
+RequestBatcherOptions::RequestBatcherOptions()
+    : max_batch_size(32)
+    , max_wait_us(1000) {
+}
+
+struct RequestBatcher::FlusherArgs {
+    RequestBatcher* batcher;
+    uint64_t batch_seq;
+};
+
+RequestBatcher::RequestBatcher()
+    : _handler(NULL)
+    , _batch_seq(0)
+    , _nflusher(0) {
+}
+
+RequestBatcher::~RequestBatcher() {
+    // Every non-empty batch has a flusher, which runs the batch within
+    // max_wait_us.
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    while (_nflusher > 0) {
+        _cond.wait(mu);
+    }
+    CHECK(_pending.empty());
+}
+
+int RequestBatcher::Init(const RequestBatcherOptions& options,
+                         BatchHandler* handler) {
+    if (handler == NULL) {
+        LOG(ERROR) << "Param[handler] is NULL";
+        return -1;
+    }
+    if (options.max_batch_size <= 0) {
+        LOG(ERROR) << "Invalid max_batch_size=" << options.max_batch_size;
+        return -1;
+    }
+    _options = options;
+    _handler = handler;
+    _pending.reserve(_options.max_batch_size);
+    return 0;
+}
+
+void RequestBatcher::Submit(google::protobuf::RpcController* cntl_base,
+                            const google::protobuf::Message* request,
+                            google::protobuf::Message* response,
+                            google::protobuf::Closure* done) {
+    BatchedCall call = { static_cast<Controller*>(cntl_base),
+                         request, response, done };
+    if (_handler == NULL) {
+        call.cntl->SetFailed(EINTERNAL, "RequestBatcher is not initialized");
+        return done->Run();
+    }
+    std::vector<BatchedCall> batch;
+    uint64_t batch_seq = 0;
+    bool start_flusher = false;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _pending.push_back(call);
+        if ((int)_pending.size() >= _options.max_batch_size) {
+            batch.reserve(_options.max_batch_size);
+            batch.swap(_pending);
+            ++_batch_seq;
+        } else if (_pending.size() == 1u) {
+            batch_seq = _batch_seq;
+            start_flusher = true;
+            ++_nflusher;
+        }
+    }
+    if (!batch.empty()) {
+        return RunCalls(&batch);
+    }
+    if (start_flusher) {
+        FlusherArgs* args = new FlusherArgs;
+        args->batcher = this;
+        args->batch_seq = batch_seq;
+        bthread_t th;
+        if (bthread_start_background(&th, NULL, RunFlusher, args) != 0) {
+            LOG(ERROR) << "Fail to start bthread, run the batch now";
+            delete args;
+            Flush(batch_seq);
+        }
+    }
+}
+
+void* RequestBatcher::RunFlusher(void* void_args) {
+    FlusherArgs* args = static_cast<FlusherArgs*>(void_args);
+    RequestBatcher* batcher = args->batcher;
+    const uint64_t batch_seq = args->batch_seq;
+    delete args;
+    if (batcher->_options.max_wait_us > 0) {
+        bthread_usleep(batcher->_options.max_wait_us);
+    }
+    batcher->Flush(batch_seq);
+    return NULL;
+}
+
+void RequestBatcher::Flush(uint64_t batch_seq) {
+    std::vector<BatchedCall> batch;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        // The batch may be full and run already.
+        if (batch_seq == _batch_seq) {
+            batch.reserve(_options.max_batch_size);
+            batch.swap(_pending);
+            ++_batch_seq;
+        }
+    }
+    if (!batch.empty()) {
+        RunCalls(&batch);
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (--_nflusher == 0) {
+        _cond.notify_all();
+    }
+}
+
+void RequestBatcher::RunCalls(std::vector<BatchedCall>* calls) {
+    _handler->RunBatch(*calls);
+    for (size_t i = 0; i < calls->size(); ++i) {
+        (*calls)[i].done->Run();
+    }
+}
+
+} // namespace brpc
@@ -0,0 +1,131 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_REQUEST_BATCHER_H
+#define BRPC_REQUEST_BATCHER_H
+
+// To brpc developers: This is a header included by user, don't depend
+// on internal structures, use opaque pointers instead.
+
+#include <stdint.h>
+#include <vector>
+#include <google/protobuf/message.h>
+#include <google/protobuf/stubs/callback.h>   // google::protobuf::Closure
+#include "butil/macros.h"
+#include "bthread/mutex.h"
+#include "bthread/condition_variable.h"
+
+namespace brpc {
+
+class Controller;
+
+// A call of the method gathered into a batch.
+struct BatchedCall {
+    Controller* cntl;
+    const google::protobuf::Message* request;
+    google::protobuf::Message* response;
+    google::protobuf::Closure* done;
+};
+
+// Implement this to process gathered requests together.
+class BatchHandler {
+public:
+    virtual ~BatchHandler() {}
+
+    // Fill responses of `calls', or call calls[i].cntl->SetFailed() to fail
+    // some of them. Done closures of the calls are run after this method
+    // returns, don't run them in this method.
+    virtual void RunBatch(const std::vector<BatchedCall>& calls) = 0;
+};
+
+struct RequestBatcherOptions {
+    RequestBatcherOptions();
+
+    // A batch is run at once when it has so many calls.
+    // Default: 32
+    int max_batch_size;
+
+    // A batch is run after the first call in the batch has waited for so
+    // many microseconds, even if it's not full.
+    // Default: 1000
+    int64_t max_wait_us;
+};
+
+// Gather concurrent calls of a method into batches and run them with
+// BatchHandler. Call Submit() inside the method of the service:
+//
+//   class InferServiceImpl : public InferService, public brpc::BatchHandler {
+//   public:
+//       InferServiceImpl() { _batcher.Init(brpc::RequestBatcherOptions(), this); }
+//       void Infer(google::protobuf::RpcController* cntl,
+//                  const InferRequest* req, InferResponse* res,
+//                  google::protobuf::Closure* done) {
+//           _batcher.Submit(cntl, req, res, done);
+//       }
+//       void RunBatch(const std::vector<brpc::BatchedCall>& calls) {
+//           ... static_cast<const InferRequest*>(calls[i].request) ...
+//       }
+//   private:
+//       brpc::RequestBatcher _batcher;
+//   };
+//
+// A full batch is run in the bthread submitting the last call of it, a
+// batch timed out is run in a separate bthread. Batches may be run
+// concurrently, BatchHandler::RunBatch() must be thread-safe.
+class RequestBatcher {
+public:
+    RequestBatcher();
+    // Run calls not batched yet. The batcher must not be destroyed before
+    // the server is stopped, otherwise calls may be submitted after this.
+    ~RequestBatcher();
+
+    // `handler' is not owned and must outlive the batcher.
+    // Returns 0 on success, -1 otherwise.
+    int Init(const RequestBatcherOptions& options, BatchHandler* handler);
+
+    // Add a call into current batch. `done' is run after the batch
+    // containing the call is run by the handler.
+    void Submit(google::protobuf::RpcController* cntl,
+                const google::protobuf::Message* request,
+                google::protobuf::Message* response,
+                google::protobuf::Closure* done);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RequestBatcher);
+
+    struct FlusherArgs;
+    static void* RunFlusher(void* args);
+
+    void Flush(uint64_t batch_seq);
+    void RunCalls(std::vector<BatchedCall>* calls);
+
+    RequestBatcherOptions _options;
+    BatchHandler* _handler;
+    bthread::Mutex _mutex;
+    bthread::ConditionVariable _cond;
+    std::vector<BatchedCall> _pending;
+    // Increased when a batch is taken out of _pending.
+    uint64_t _batch_seq;
+    // Number of bthreads waiting to run batches timed out.
+    int _nflusher;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_REQUEST_BATCHER_H
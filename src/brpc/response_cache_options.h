@@ -0,0 +1,71 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_RESPONSE_CACHE_OPTIONS_H
+#define BRPC_RESPONSE_CACHE_OPTIONS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <string>
+
+namespace brpc {
+
+// How responses of a method are cached.
+struct ResponseCachePolicy {
+    ResponseCachePolicy() : ttl_ms(0), stale_while_revalidate_ms(0) {}
+
+    // Calls are ended with the cached response within so many milliseconds
+    // after the response was cached.
+    // <= 0 means responses of the method are not cached.
+    // Default: 0
+    int32_t ttl_ms;
+
+    // After ttl_ms expires, calls are still ended with the cached response
+    // within so many milliseconds, and the first of them refreshes the cache:
+    // a Channel sends a call in background, a Server runs the method.
+    // Default: 0 (the response is dropped once ttl_ms expires)
+    int32_t stale_while_revalidate_ms;
+};
+
+struct ResponseCacheOptions {
+    ResponseCacheOptions() : max_bytes(64 * 1024 * 1024), nshard(16) {}
+
+    // Least recently used responses are dropped when size of cached
+    // responses, attachments and keys exceeds so many bytes.
+    // Default: 64MB
+    size_t max_bytes;
+
+    // Split the cache into so many shards with separate locks to reduce
+    // contentions between calls.
+    // Default: 16
+    int nshard;
+
+    // Policy of methods not in `method_policies'.
+    // Default: not cached
+    ResponseCachePolicy default_policy;
+
+    // Policies of methods, keyed by full names of methods,
+    // e.g. "example.EchoService.Echo".
+    std::map<std::string, ResponseCachePolicy> method_policies;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_RESPONSE_CACHE_OPTIONS_H
@@ -17,6 +17,8 @@
 
 
 #include <google/protobuf/descriptor.h>
+#include "butil/containers/flat_map.h"
+#include "butil/containers/stack_container.h"
 #include "brpc/log.h"
 #include "brpc/restful.h"
 #include "brpc/details/method_status.h"
@@ -252,6 +254,43 @@ bool ParseRestfulMappings(const butil::StringPiece& mappings,
     return true;
 }
 
+// A node of the trie corresponds to a normalized prefix, say paths with
+// prefix "/A/B/" are stored in root->children["A"]->children["B"], paths
+// with prefix "/" are stored in root.
+struct RestfulMap::TrieNode {
+    typedef butil::FlatMap<std::string, TrieNode*> ChildMap;
+    // Initialized on first insertion.
+    ChildMap children;
+    // Paths with the prefix, in the order of being tried.
+    std::vector<const RestfulMethodProperty*> paths;
+
+    ~TrieNode() {
+        for (ChildMap::iterator it = children.begin();
+             it != children.end(); ++it) {
+            delete it->second;
+        }
+    }
+    TrieNode* FindOrAddChild(const butil::StringPiece& component) {
+        if (!children.initialized()) {
+            CHECK_EQ(0, children.init(8));
+        }
+        TrieNode** child = children.seek(component);
+        if (child != NULL) {
+            return *child;
+        }
+        TrieNode* node = new TrieNode;
+        children[component.as_string()] = node;
+        return node;
+    }
+    const TrieNode* FindChild(const butil::StringPiece& component) const {
+        if (!children.initialized()) {
+            return NULL;
+        }
+        TrieNode* const* child = children.seek(component);
+        return child ? *child : NULL;
+    }
+};
+
 RestfulMap::~RestfulMap() {
     ClearMethods();
 }
@@ -301,7 +340,8 @@ bool RestfulMap::AddMethod(const RestfulMethodPath& path,
 }
 
 void RestfulMap::ClearMethods() {
-    _sorted_paths.clear();
+    delete _trie;
+    _trie = NULL;
     for (DedupMap::iterator it = _dedup_map.begin();
          it != _dedup_map.end(); ++it) {
         if (it->second.own_method_status) {
@@ -341,41 +381,43 @@ struct CompareItemInPathList {
 };
 
 void RestfulMap::PrepareForFinding() {
-    _sorted_paths.clear();
-    _sorted_paths.reserve(_dedup_map.size());
+    PathList sorted_paths;
+    sorted_paths.reserve(_dedup_map.size());
     for (DedupMap::iterator it = _dedup_map.begin(); it != _dedup_map.end();
          ++it) {
-        _sorted_paths.push_back(&it->second);
+        sorted_paths.push_back(&it->second);
     }
-    std::sort(_sorted_paths.begin(), _sorted_paths.end(),
+    std::sort(sorted_paths.begin(), sorted_paths.end(),
               CompareItemInPathList());
     if (VLOG_IS_ON(RPC_VLOG_LEVEL + 1)) {
         std::ostringstream os;
-        os << "_sorted_paths(" << _service_name << "):";
-        for (PathList::const_iterator it = _sorted_paths.begin();
-             it != _sorted_paths.end(); ++it) {
+        os << "sorted_paths(" << _service_name << "):";
+        for (PathList::const_iterator it = sorted_paths.begin();
+             it != sorted_paths.end(); ++it) {
             os << ' ' << (*it)->path;
         }
         VLOG(RPC_VLOG_LEVEL + 1) << os.str();
     }
-}
-
-// Remove last component from the (normalized) path:
-// Say /A/B/C/ -> /A/B/
-// Notice that /A/ is modified to / and returns true.
-static bool RemoveLastComponent(butil::StringPiece* path) {
-    if (path->empty()) {
-        return false;
-    }
-    if (path->back() == '/') {
-        path->remove_suffix(1);
-    }
-    size_t slash_pos = path->rfind('/');
-    if (slash_pos == std::string::npos) {
-        return false;
+    TrieNode* trie = NULL;
+    if (!sorted_paths.empty()) {
+        trie = new TrieNode;
+        // Paths with a same prefix are tried in reversed order so that exact
+        // patterns are tried before wildcards.
+        for (PathList::const_reverse_iterator it = sorted_paths.rbegin();
+             it != sorted_paths.rend(); ++it) {
+            const std::string& prefix = (*it)->path.prefix;
+            TrieNode* node = trie;
+            for (butil::StringSplitter sp(prefix.data(),
+                                          prefix.data() + prefix.size(), '/');
+                 sp; ++sp) {
+                node = node->FindOrAddChild(
+                    butil::StringPiece(sp.field(), sp.length()));
+            }
+            node->paths.push_back(*it);
+        }
     }
-    path->remove_suffix(path->size() - slash_pos - 1); // keep the slash
-    return true;
+    std::swap(trie, _trie);
+    delete trie;
 }
 
 // Normalized as /A/B/C/
@@ -392,121 +434,75 @@ static std::string NormalizeSlashes(const butil::StringPiece& path) {
 }
 
 size_t RestfulMap::RemoveByPathString(const std::string& path) {
-    // removal only happens when server stops, clear _sorted_paths to make
-    // sure wild pointers do not exist.
-    if (!_sorted_paths.empty()) {
-        _sorted_paths.clear();
-    }
+    // removal only happens when server stops, clear _trie to make sure wild
+    // pointers do not exist.
+    delete _trie;
+    _trie = NULL;
     return _dedup_map.erase(path);
 }
 
-struct PrefixLess {
-    bool operator()(const butil::StringPiece& path,
-                    const RestfulMethodProperty* p) const {
-        return path < p->path.prefix;
-    }
-};
-
 const Server::MethodProperty*
 RestfulMap::FindMethodProperty(const butil::StringPiece& method_path,
                                std::string* unresolved_path) const {
-    if (_sorted_paths.empty()) {
-        LOG(ERROR) << "_sorted_paths is empty, method_path=" << method_path;
+    if (_trie == NULL) {
+        LOG(ERROR) << "_trie is empty, method_path=" << method_path;
         return NULL;
     }
     const std::string full_path = NormalizeSlashes(method_path);
-    butil::StringPiece sub_path = full_path;
-    PathList::const_iterator last_find_pos = _sorted_paths.end();
-    do {
-        if (last_find_pos == _sorted_paths.begin()) {
-            return NULL;
+    // Nodes whose prefixes are prefixes of full_path, from short to long.
+    butil::StackVector<const TrieNode*, 16> nodes;
+    nodes->push_back(_trie);
+    for (butil::StringSplitter sp(full_path.data(),
+                                  full_path.data() + full_path.size(), '/');
+         sp; ++sp) {
+        const TrieNode* child = nodes->back()->FindChild(
+            butil::StringPiece(sp.field(), sp.length()));
+        if (child == NULL) {
+            break;
         }
-        // Note: stop trying places that we already visited or skipped.
-        PathList::const_iterator it =
-            std::upper_bound(_sorted_paths.begin(), last_find_pos/*note*/,
-                             sub_path, PrefixLess());
-        if (it != _sorted_paths.begin()) {
-            --it;
-        }
-        
-        bool matched = false;
-        bool remove_heading_slash_from_unresolved = false;
-        butil::StringPiece left;
-        do {
-            const RestfulMethodPath& rpath = (*it)->path;
-            if (!sub_path.starts_with(rpath.prefix)) {
-                VLOG(RPC_VLOG_LEVEL + 1)
-                    << "sub_path=" << sub_path << " does not match prefix="
-                    << rpath.prefix << " full_path=" << full_path
-                    << " candidate=" << DebugPrinter(rpath);
-                // NOTE: We can stop trying patterns before *it because pattern
-                // "/A*B => M" is disabled which makes prefixes of all restful
-                // paths end with /. If `full_path' matches with a prefix, the
-                // prefix must be a sub path of the full_path, which makes 
-                // prefix matching runs at most #components-of-path times.
-                // Otherwise we have to match all "/A*B" patterns before *it,
-                // which is more complicated but rarely needed by users.
-                break;
-            }
-            left = full_path;
-            // Remove matched prefix from `left'.
+        nodes->push_back(child);
+    }
+    // Try paths with longer prefixes first.
+    for (size_t i = nodes->size(); i > 0; --i) {
+        const TrieNode* node = nodes[i - 1];
+        for (size_t j = 0; j < node->paths.size(); ++j) {
+            const RestfulMethodPath& rpath = node->paths[j]->path;
+            butil::StringPiece left = full_path;
+            // Remove matched prefix from `left', make sure `left' is still
+            // starting with /. Prefixes of all restful paths end with /
+            // since pattern "/A*B => M" is disabled.
             if (!rpath.prefix.empty()) {
-                // make sure `left' is still starting with /
-                size_t removal = rpath.prefix.size();
-                if (rpath.prefix[removal - 1] == '/') {
-                    --removal;
-                    remove_heading_slash_from_unresolved = true;
-                }
-                left.remove_prefix(removal);
+                left.remove_prefix(rpath.prefix.size() - 1);
             }
             // Match postfix.
-            if (left.ends_with(rpath.postfix)) {
-                left.remove_suffix(rpath.postfix.size());
-                if (!left.empty() && !rpath.has_wildcard) {
-                    VLOG(RPC_VLOG_LEVEL + 1)
-                        << "Unmatched extra=" << left
-                        << " sub_path=" << sub_path
-                        << " full_path=" << full_path
-                        << " candidate=" << DebugPrinter(rpath);
-                } else {
-                    matched = true;
-                    VLOG(RPC_VLOG_LEVEL + 1)
-                        << "Matched sub_path=" << sub_path
-                        << " full_path=" << full_path
-                        << " with restful_path=" << DebugPrinter(rpath);
-                    break;
-                }
+            if (!left.ends_with(rpath.postfix)) {
+                continue;
             }
-            if (it == _sorted_paths.begin()) {
+            left.remove_suffix(rpath.postfix.size());
+            if (!left.empty() && !rpath.has_wildcard) {
                 VLOG(RPC_VLOG_LEVEL + 1)
-                    << "Hit beginning, sub_path=" << sub_path
+                    << "Unmatched extra=" << left
                     << " full_path=" << full_path
                     << " candidate=" << DebugPrinter(rpath);
-                return NULL;
+                continue;
             }
-            // Matched with prefix but postfix or wildcard, moving forward
-            --it;
-        } while (true);
-        last_find_pos = it;
-        
-        if (!matched) {
-            continue;
-        }
-        if (unresolved_path) {
-            if (!left.empty()) {
-                if (remove_heading_slash_from_unresolved && left[0] == '/') {
-                    unresolved_path->assign(left.data() + 1, left.size() - 1);
+            VLOG(RPC_VLOG_LEVEL + 1)
+                << "Matched full_path=" << full_path
+                << " with restful_path=" << DebugPrinter(rpath);
+            if (unresolved_path) {
+                if (!left.empty()) {
+                    if (left[0] == '/') {
+                        unresolved_path->assign(left.data() + 1, left.size() - 1);
+                    } else {
+                        unresolved_path->assign(left.data(), left.size());
+                    }
                 } else {
-                    unresolved_path->assign(left.data(), left.size());
+                    unresolved_path->clear();
                 }
-            } else {
-                unresolved_path->clear();
             }
+            return node->paths[j];
         }
-        return *it;
-    } while (RemoveLastComponent(&sub_path));
-    //                            ^^^^^^^^
-    // sub_path can be / to match patterns like "*.flv => M" whose prefix is /
+    }
     return NULL;
 }
 
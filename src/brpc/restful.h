@@ -65,7 +65,7 @@ public:
     typedef std::vector<RestfulMethodProperty*> PathList;
 
     explicit RestfulMap(const std::string& service_name)
-        : _service_name(service_name) {}
+        : _service_name(service_name), _trie(NULL) {}
     virtual ~RestfulMap();
 
     // Map `path' to the method denoted by `method_name' in `service'.
@@ -83,11 +83,13 @@ public:
     // Remove all methods.
     void ClearMethods();
 
-    // Called after by Server at starting moment, to refresh _sorted_paths
+    // Called after by Server at starting moment, to rebuild _trie. The new
+    // trie replaces the old one after being fully built.
     void PrepareForFinding();
     
     // Find the method by path.
-    // Time complexity in worst-case is #slashes-in-input * log(#paths-stored)
+    // Time complexity is O(length-of-input) plus matching postfixes of paths
+    // sharing the prefixes of input, independent of #paths-stored.
     const Server::MethodProperty*
     FindMethodProperty(const butil::StringPiece& method_path,
                        std::string* unresolved_path) const;
@@ -99,10 +101,11 @@ public:
     
 private:
     DISALLOW_COPY_AND_ASSIGN(RestfulMap);
+    struct TrieNode;
     
     std::string _service_name;
-    // refreshed each time 
-    PathList _sorted_paths;
+    // Components of prefixes of paths, refreshed by PrepareForFinding().
+    TrieNode* _trie;
     DedupMap _dedup_map;
 };
 
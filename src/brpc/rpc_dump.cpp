@@ -18,7 +18,14 @@
 
 #include <gflags/gflags.h>
 #include <fcntl.h>                    // O_CREAT
+#include <string.h>                   // memcmp
+#include <unistd.h>                   // pread
+#include <sys/uio.h>                  // writev
 #include "butil/file_util.h"
+#include "butil/recordio.h"
+#include "butil/scoped_lock.h"
+#include "butil/string_printf.h"
+#include "butil/containers/bounded_queue.h"
 #include "butil/raw_pack.h"
 #include "butil/unique_ptr.h"
 #include "butil/fast_rand.h"
@@ -28,6 +35,11 @@
 #include "brpc/reloadable_flags.h"
 #include "brpc/rpc_dump.h"
 #include "brpc/protocol.h"
+#include "brpc/compress.h"
+#include "brpc/policy/snappy_compress.h"
+#include "brpc/policy/gzip_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
 
 namespace bvar {
 std::string read_command_name();
@@ -57,30 +69,132 @@ DEFINE_int32(rpc_dump_max_files, 32,
              "If new file is needed, oldest file is removed.");
 DEFINE_int32(rpc_dump_max_requests_in_one_file, 1000,
              "Max number of requests in one dumped file");
+DEFINE_bool(rpc_dump_response, false,
+            "Dump responses along with requests of baidu_std so that replayed "
+            "responses can be compared. Requests are dumped after responses "
+            "are sent.");
+
+DEFINE_double(rpc_dump_ratio, 0,
+              "Dump this ratio of requests (e.g. 0.05) regardless of the speed "
+              "limit shared with rpcz and contention profiler. 0 means the "
+              "ratio is adjusted to dump at most "
+              "-bvar_collector_expected_per_second requests per second");
+DEFINE_int32(rpc_dump_compress_type, 0,
+             "Compress batches of dumped requests. None:0 Snappy:1 Gzip:2 "
+             "LZ4:4 Zstd:5 (LZ4 and Zstd require brpc built with them)");
+DEFINE_int32(rpc_dump_max_pending, 16384,
+             "Max number of requests waiting to be written, more requests "
+             "are dropped and counted in bvar rpc_dump_dropped");
+
+static bool validate_rpc_dump_ratio(const char*, double val) {
+    return val >= 0 && val <= 1;
+}
+static bool validate_rpc_dump_compress_type(const char*, int32_t val) {
+    switch (val) {
+    case COMPRESS_TYPE_NONE:
+    case COMPRESS_TYPE_SNAPPY:
+    case COMPRESS_TYPE_GZIP:
+        return true;
+#ifdef BRPC_WITH_LZ4
+    case COMPRESS_TYPE_LZ4:
+        return true;
+#endif
+#ifdef BRPC_WITH_ZSTD
+    case COMPRESS_TYPE_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
 
 BRPC_VALIDATE_GFLAG(rpc_dump, PassValidate);
+BRPC_VALIDATE_GFLAG(rpc_dump_ratio, validate_rpc_dump_ratio);
+BRPC_VALIDATE_GFLAG(rpc_dump_compress_type, validate_rpc_dump_compress_type);
+BRPC_VALIDATE_GFLAG(rpc_dump_response, PassValidate);
 BRPC_VALIDATE_GFLAG(rpc_dump_max_requests_in_one_file, PositiveInteger);
 BRPC_VALIDATE_GFLAG(rpc_dump_max_files, PositiveInteger);
 
 static const size_t UNWRITTEN_BUFSIZE = 1024 * 1024;
 static const int64_t FLUSH_TIMEOUT = 2000000L; // 2s
+// Interval of the writing thread checking FLUSH_TIMEOUT and reloaded flags.
+static const int64_t WRITER_TICK_US = 100000L;
+
+// Name of the meta in dumped records, the value is CompressType in text.
+static const char* const COMPRESS_META = "compress_type";
+
+static bool CompressBatch(const butil::IOBuf& in, butil::IOBuf* out,
+                          CompressType type) {
+    switch (type) {
+    case COMPRESS_TYPE_SNAPPY:
+        return policy::SnappyCompress(in, out);
+    case COMPRESS_TYPE_GZIP:
+        return policy::GzipCompress(in, out, NULL);
+#ifdef BRPC_WITH_LZ4
+    case COMPRESS_TYPE_LZ4:
+        return policy::Lz4Compress(in, out);
+#endif
+#ifdef BRPC_WITH_ZSTD
+    case COMPRESS_TYPE_ZSTD:
+        return policy::ZstdCompress(in, out, 1);
+#endif
+    default:
+        return false;
+    }
+}
+
+static bool DecompressBatch(const butil::IOBuf& in, butil::IOBuf* out,
+                            CompressType type) {
+    switch (type) {
+    case COMPRESS_TYPE_NONE:
+        out->append(in);
+        return true;
+    case COMPRESS_TYPE_SNAPPY:
+        return policy::SnappyDecompress(in, out);
+    case COMPRESS_TYPE_GZIP:
+        return policy::GzipDecompress(in, out);
+#ifdef BRPC_WITH_LZ4
+    case COMPRESS_TYPE_LZ4:
+        return policy::Lz4Decompress(in, out);
+#endif
+#ifdef BRPC_WITH_ZSTD
+    case COMPRESS_TYPE_ZSTD:
+        return policy::ZstdDecompress(in, out);
+#endif
+    default:
+        LOG(ERROR) << "Unsupported compress_type=" << type;
+        return false;
+    }
+}
+
+class FdWriter : public butil::IWriter {
+public:
+    explicit FdWriter(int fd) : _fd(fd) {}
+    ssize_t WriteV(const iovec* iov, int iovcnt) override {
+        return writev(_fd, iov, iovcnt);
+    }
+private:
+    int _fd;
+};
 
 class RpcDumpContext {
 public:
     void SaveFlags();
 
-    void SetRound(size_t round);
-    
-    void Dump(size_t round, SampledRequest*);
+    void Dump(SampledRequest*);
+
+    // Write buffered requests if there're enough of them or they have
+    // been buffered for long.
+    void MaybeWrite();
     
     static bool Serialize(butil::IOBuf& buf, SampledRequest* sample);
     
     RpcDumpContext()
         : _cur_req_count(0)
         , _cur_fd(-1)
-        , _last_round(0)
         , _max_requests_in_one_file(0)
         , _max_files(0)
+        , _compress_type(COMPRESS_TYPE_NONE)
         , _sched_write_time(butil::gettimeofday_us() + FLUSH_TIMEOUT)
         , _last_file_time(0)
     {
@@ -100,10 +214,10 @@ private:
     std::string _command_name;
     int _cur_req_count; // written #req in current file
     int _cur_fd;        // fd of current file
-    size_t _last_round;
     // save gflags which could be reloaded at anytime.
     int _max_requests_in_one_file;
     int _max_files;
+    CompressType _compress_type;
     int64_t _sched_write_time;     // duetime of last write
     int64_t _last_file_time;  // time for the postfix of last file
     // the queue for remembering oldest file to remove.
@@ -116,20 +230,107 @@ private:
 };
 
 bvar::CollectorSpeedLimit g_rpc_dump_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
-static RpcDumpContext* g_rpc_dump_ctx = NULL;
 
-void SampledRequest::dump_and_destroy(size_t round) {
+// Requests waiting to be written by the writing thread.
+struct PendingSamples {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    butil::BoundedQueue<SampledRequest*> queue;
+    bvar::Adder<int64_t> ndropped;
+    bvar::Adder<int64_t> nwritten;
+
+    PendingSamples()
+        : queue(FLAGS_rpc_dump_max_pending)
+        , ndropped("rpc_dump_dropped")
+        , nwritten("rpc_dump_written") {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+};
+
+static pthread_once_t g_pending_samples_once = PTHREAD_ONCE_INIT;
+static PendingSamples* g_pending_samples = NULL;
+
+static void* RunRpcDumpWriter(void* arg) {
+    PendingSamples* pending = static_cast<PendingSamples*>(arg);
+    RpcDumpContext ctx;
+    std::vector<SampledRequest*> samples;
+    int64_t last_save_flags_us = butil::gettimeofday_us();
+    while (true) {
+        {
+            BAIDU_SCOPED_LOCK(pending->mutex);
+            if (pending->queue.empty()) {
+                const timespec abstime = butil::microseconds_from_now(WRITER_TICK_US);
+                pthread_cond_timedwait(&pending->cond, &pending->mutex, &abstime);
+            }
+            SampledRequest* sample = NULL;
+            while (pending->queue.pop(&sample)) {
+                samples.push_back(sample);
+            }
+        }
+        const int64_t now_us = butil::gettimeofday_us();
+        if (now_us >= last_save_flags_us + 1000000L) {
+            last_save_flags_us = now_us;
+            ctx.SaveFlags();
+        }
+        for (size_t i = 0; i < samples.size(); ++i) {
+            ctx.Dump(samples[i]);
+            samples[i]->destroy();
+        }
+        pending->nwritten << samples.size();
+        samples.clear();
+        ctx.MaybeWrite();
+    }
+    return NULL;
+}
+
+static void CreatePendingSamples() {
+    PendingSamples* pending = new PendingSamples;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, RunRpcDumpWriter, pending) != 0) {
+        LOG(ERROR) << "Fail to create the thread writing dumped requests";
+        delete pending;
+        return;
+    }
+    g_pending_samples = pending;
+}
+
+// Queue `sample' for the writing thread, or drop it if too many are
+// pending.
+static void EnqueueSample(SampledRequest* sample) {
+    pthread_once(&g_pending_samples_once, CreatePendingSamples);
+    PendingSamples* pending = g_pending_samples;
+    if (pending == NULL) {
+        sample->destroy();
+        return;
+    }
+    bool was_empty = false;
+    bool pushed = false;
+    {
+        BAIDU_SCOPED_LOCK(pending->mutex);
+        was_empty = pending->queue.empty();
+        pushed = pending->queue.push(sample);
+    }
+    if (!pushed) {
+        pending->ndropped << 1;
+        sample->destroy();
+    } else if (was_empty) {
+        pthread_cond_signal(&pending->cond);
+    }
+}
+
+void SampledRequest::submit(int64_t cpuwide_us) {
+    if (FLAGS_rpc_dump_ratio > 0) {
+        EnqueueSample(this);
+    } else {
+        bvar::Collected::submit(cpuwide_us);
+    }
+}
+
+void SampledRequest::dump_and_destroy(size_t) {
     static bvar::DisplaySamplingRatio sampling_ratio_var(
         "rpc_dump_sampling_ratio", &g_rpc_dump_sl);
-    
-    // Safe to modify g_rpc_dump_ctx w/o locking.
-    RpcDumpContext* rpc_dump_ctx = g_rpc_dump_ctx;
-    if (rpc_dump_ctx == NULL) {
-        rpc_dump_ctx = new RpcDumpContext;
-        g_rpc_dump_ctx = rpc_dump_ctx;
-    }
-    rpc_dump_ctx->Dump(round, this);
-    destroy();
+    EnqueueSample(this);
 }
 
 void SampledRequest::destroy() {
@@ -149,20 +350,22 @@ void RpcDumpContext::SaveFlags() {
 
     _max_requests_in_one_file = FLAGS_rpc_dump_max_requests_in_one_file;
     _max_files = FLAGS_rpc_dump_max_files;
+    _compress_type = (CompressType)FLAGS_rpc_dump_compress_type;
 }
 
 // Dump a request.
-void RpcDumpContext::Dump(size_t round, SampledRequest* sample) {
-    if (_last_round != round) {
-        _last_round = round;
-        SaveFlags();
-    }
-
+void RpcDumpContext::Dump(SampledRequest* sample) {
     if (!Serialize(_unwritten_buf, sample)) {
         return;
     }
     ++_cur_req_count;
-    if (_cur_req_count >= _max_requests_in_one_file) {
+    MaybeWrite();
+}
+
+void RpcDumpContext::MaybeWrite() {
+    if (_unwritten_buf.empty()) {
+        return;
+    } else if (_cur_req_count >= _max_requests_in_one_file) {
         // Reach the limit of #request in a file.
         RPC_VLOG << "Write because _cur_req_count=" << _cur_req_count;
     } else if (_unwritten_buf.size() >= UNWRITTEN_BUFSIZE) {
@@ -210,17 +413,28 @@ void RpcDumpContext::Dump(size_t round, SampledRequest* sample) {
         _last_file_time = cur_file_time;
         _filenames.push_back(_cur_filename);
     }
-    // Write all data in _unwritten_buf. This is different from writing
-    // into a socket: local file should always be writable unless error occurs
-    bool fail_to_write = false;
-    while (!_unwritten_buf.empty()) {
-        if (_unwritten_buf.cut_into_file_descriptor(_cur_fd) < 0) {
-            if (errno != EINTR && errno != EAGAIN) {
-                PLOG(ERROR) << "Fail to write into " << _cur_filename;
-                fail_to_write = true;
-                break;
-            }
-        }
+    // Write all data in _unwritten_buf as one record. This is different
+    // from writing into a socket: local file should always be writable
+    // unless error occurs
+    butil::Record record;
+    CompressType type = _compress_type;
+    if (type != COMPRESS_TYPE_NONE &&
+        !CompressBatch(_unwritten_buf, record.MutablePayload(), type)) {
+        LOG(ERROR) << "Fail to compress dumped requests with "
+                   << CompressTypeToCStr(type);
+        record.MutablePayload()->clear();
+        type = COMPRESS_TYPE_NONE;
+    }
+    if (type == COMPRESS_TYPE_NONE) {
+        record.MutablePayload()->swap(_unwritten_buf);
+    }
+    record.MutableMeta(COMPRESS_META)->append(
+        butil::string_printf("%d", (int)type));
+    FdWriter fd_writer(_cur_fd);
+    butil::RecordWriter writer(&fd_writer);
+    const bool fail_to_write = (writer.Write(record) != 0);
+    if (fail_to_write) {
+        PLOG(ERROR) << "Fail to write into " << _cur_filename;
     }
     _unwritten_buf.clear();
     _sched_write_time = butil::gettimeofday_us() + FLUSH_TIMEOUT;
@@ -259,6 +473,8 @@ bool RpcDumpContext::Serialize(butil::IOBuf& buf, SampledRequest* sample) {
 
 SampleIterator::SampleIterator(const butil::StringPiece& dir)
     : _cur_fd(-1)
+    , _mapped_file(NULL)
+    , _record_reader(NULL)
     , _enum(NULL)
     , _dir(std::string(dir.data(), dir.size())) {
 }
@@ -268,10 +484,36 @@ SampleIterator::~SampleIterator() {
         ::close(_cur_fd);
         _cur_fd = -1;
     }
+    delete _record_reader;
+    _record_reader = NULL;
+    delete _mapped_file;
+    _mapped_file = NULL;
     delete _enum;
     _enum = NULL;
 }
 
+bool SampleIterator::ReadNextBatch() {
+    butil::RecordView record;
+    if (!_record_reader->ReadNext(&record)) {
+        return false;
+    }
+    const butil::StringPiece* compress_meta = record.Meta(COMPRESS_META);
+    const CompressType type = (compress_meta ?
+        (CompressType)strtol(compress_meta->as_string().c_str(), NULL, 10) :
+        COMPRESS_TYPE_NONE);
+    if (type == COMPRESS_TYPE_NONE) {
+        _cur_buf.append(record.payload.data(), record.payload.size());
+        return true;
+    }
+    butil::IOBuf payload;
+    payload.append(record.payload.data(), record.payload.size());
+    if (!DecompressBatch(payload, &_cur_buf, type)) {
+        LOG(ERROR) << "Fail to decompress dumped requests";
+        return false;
+    }
+    return true;
+}
+
 SampledRequest* SampleIterator::Next() {
     if (!_cur_buf.empty()) {
         bool error = false;
@@ -281,6 +523,10 @@ SampledRequest* SampleIterator::Next() {
         }
         if (error) {
             _cur_buf.clear();
+            delete _record_reader;
+            _record_reader = NULL;
+            delete _mapped_file;
+            _mapped_file = NULL;
             if (_cur_fd >= 0) {
                 ::close(_cur_fd);
                 _cur_fd = -1;
@@ -288,6 +534,18 @@ SampledRequest* SampleIterator::Next() {
         }
     }
     while (1) {
+        if (_record_reader) {
+            if (ReadNextBatch()) {
+                return Next();
+            }
+            delete _record_reader;
+            _record_reader = NULL;
+            delete _mapped_file;
+            _mapped_file = NULL;
+            _cur_buf.clear();
+            ::close(_cur_fd);
+            _cur_fd = -1;
+        }
         while (_cur_fd >= 0) {
             ssize_t nr = _cur_buf.append_from_file_descriptor(_cur_fd, 524288);
             if (nr < 0) {
@@ -316,6 +574,23 @@ SampledRequest* SampleIterator::Next() {
             return NULL;
         }
         _cur_fd = open(filename.value().c_str(), O_RDONLY);
+        char magic[4];
+        if (_cur_fd >= 0 && pread(_cur_fd, magic, sizeof(magic), 0) == 4 &&
+            memcmp(magic, "RDIO", 4) == 0) {
+            // Written in batches as records of recordio, which are read
+            // from the mapped file without copying. Older files are
+            // sequences of requests.
+            _mapped_file = new butil::MappedRecordFile;
+            if (_mapped_file->Open(filename.value().c_str()) != 0) {
+                PLOG(ERROR) << "Fail to map " << filename.value();
+                delete _mapped_file;
+                _mapped_file = NULL;
+                ::close(_cur_fd);
+                _cur_fd = -1;
+                continue;
+            }
+            _record_reader = new butil::MappedRecordReader(_mapped_file);
+        }
     }
 }
 
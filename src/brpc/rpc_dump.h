@@ -22,16 +22,22 @@
 #include <gflags/gflags_declare.h>
 #include "butil/iobuf.h"                            // IOBuf
 #include "butil/files/file_path.h"                  // FilePath
+#include "butil/time.h"                             // gettimeofday_us
+#include "butil/fast_rand.h"                        // fast_rand_double
 #include "bvar/collector.h"
 #include "brpc/rpc_dump.pb.h"                       // RpcDumpMeta
 
 namespace butil {
 class FileEnumerator;
+class MappedRecordFile;
+class MappedRecordReader;
 }
 
 namespace brpc {
 
 DECLARE_bool(rpc_dump);
+DECLARE_bool(rpc_dump_response);
+DECLARE_double(rpc_dump_ratio);
 
 // Randomly take samples of all requests and write into a file in batch in
 // a background thread.
@@ -46,12 +52,20 @@ DECLARE_bool(rpc_dump);
 //
 // In practice, sampled requests are just small fraction of all requests.
 // The overhead of sampling should be negligible for overall performance.
+// Submitted requests are written by a background thread in batches, which
+// may be compressed (-rpc_dump_compress_type). Requests are dropped rather
+// than blocking the submitter when the thread can't keep up.
 
 class SampledRequest : public bvar::Collected {
 public:
     butil::IOBuf request;
     RpcDumpMeta meta;
 
+    // Submit this sample for dumping. Hides bvar::Collected::submit() to
+    // bypass the collector when -rpc_dump_ratio is set.
+    void submit(int64_t cpuwide_us);
+    void submit() { submit(butil::cpuwide_time_us()); }
+
     // Implement methods of Sampled.
     void dump_and_destroy(size_t round) override;
     void destroy() override;
@@ -66,10 +80,22 @@ public:
 // the caller ignores non-NULL return value, the object is leaked.
 inline SampledRequest* AskToBeSampled() {
     extern bvar::CollectorSpeedLimit g_rpc_dump_sl;
-    if (!FLAGS_rpc_dump || !bvar::is_collectable(&g_rpc_dump_sl)) {
+    if (!FLAGS_rpc_dump) {
+        return NULL;
+    }
+    const double ratio = FLAGS_rpc_dump_ratio;
+    if (ratio > 0) {
+        if (butil::fast_rand_double() >= ratio) {
+            return NULL;
+        }
+    } else if (!bvar::is_collectable(&g_rpc_dump_sl)) {
         return NULL;
     }
-    return new (std::nothrow) SampledRequest;
+    SampledRequest* sample = new (std::nothrow) SampledRequest;
+    if (sample) {
+        sample->meta.set_received_us(butil::gettimeofday_us());
+    }
+    return sample;
 }
 
 // Read samples from dumped files in a directory.
@@ -94,8 +120,15 @@ private:
     // the buf does not match the format.
     static SampledRequest* Pop(butil::IOBuf& buf, bool* format_error);
     
+    // Read the next batch of a recordio file into _cur_buf.
+    // Returns false at the end of the file.
+    bool ReadNextBatch();
+
     butil::IOPortal _cur_buf;
     int _cur_fd;
+    // Non-NULL when the current file is written in recordio.
+    butil::MappedRecordFile* _mapped_file;
+    butil::MappedRecordReader* _record_reader;
     butil::FileEnumerator* _enum;
     butil::FilePath _dir;
 };
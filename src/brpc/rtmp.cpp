@@ -42,12 +42,14 @@ struct RtmpBvars {
     bvar::Adder<int> client_stream_count;
     bvar::Adder<int> retrying_client_stream_count;
     bvar::Adder<int> server_stream_count;
+    bvar::Adder<int> fanout_player_count;
 
     RtmpBvars()
         : client_count("rtmp_client_count")
         , client_stream_count("rtmp_client_stream_count")
         , retrying_client_stream_count("rtmp_retrying_client_stream_count")
-        , server_stream_count("rtmp_server_stream_count") {
+        , server_stream_count("rtmp_server_stream_count")
+        , fanout_player_count("rtmp_fanout_player_count") {
     }
 };
 inline RtmpBvars* get_rtmp_bvars() {
@@ -1248,6 +1250,62 @@ void RtmpStreamBase::Destroy() {
     return;
 }
 
+// Serialize bodies of media messages, shared by RtmpStreamBase and RtmpFanout.
+static int SerializeMetaData(const RtmpMetaData& metadata,
+                             const butil::StringPiece& name,
+                             butil::IOBuf* body) {
+    butil::IOBufAsZeroCopyOutputStream zc_stream(body);
+    AMFOutputStream ostream(&zc_stream);
+    WriteAMFString(name, &ostream);
+    WriteAMFObject(metadata.data, &ostream);
+    if (!ostream.good()) {
+        LOG(ERROR) << "Fail to serialize metadata";
+        return -1;
+    }
+    return 0;
+}
+
+static void SerializeAudioMessage(const RtmpAudioMessage& msg,
+                                  butil::IOBuf* body) {
+    const char audio_head =
+        ((msg.codec & 0xF) << 4)
+        | ((msg.rate & 0x3) << 2)
+        | ((msg.bits & 0x1) << 1)
+        | (msg.type & 0x1);
+    body->push_back(audio_head);
+    body->append(msg.data);
+}
+
+static void SerializeAACMessage(const RtmpAACMessage& msg,
+                                butil::IOBuf* body) {
+    char aac_head[2];
+    aac_head[0] = ((FLV_AUDIO_AAC & 0xF) << 4)
+        | ((msg.rate & 0x3) << 2)
+        | ((msg.bits & 0x1) << 1)
+        | (msg.type & 0x1);
+    aac_head[1] = (FlvAACPacketType)msg.packet_type;
+    body->append(aac_head, sizeof(aac_head));
+    body->append(msg.data);
+}
+
+static void SerializeVideoMessage(const RtmpVideoMessage& msg,
+                                  butil::IOBuf* body) {
+    const char video_head = ((msg.frame_type & 0xF) << 4) | (msg.codec & 0xF);
+    body->push_back(video_head);
+    body->append(msg.data);
+}
+
+static void SerializeAVCMessage(const RtmpAVCMessage& msg,
+                                butil::IOBuf* body) {
+    char avc_head[5];
+    char* p = avc_head;
+    *p++ = ((msg.frame_type & 0xF) << 4) | (FLV_VIDEO_AVC & 0xF);
+    *p++ = (FlvAVCPacketType)msg.packet_type;
+    policy::WriteBigEndian3Bytes(&p, msg.composition_time);
+    body->append(avc_head, sizeof(avc_head));
+    body->append(msg.data);
+}
+
 int RtmpStreamBase::SendMessage(uint32_t timestamp,
                                 uint8_t message_type,
                                 const butil::IOBuf& body) {
@@ -1300,15 +1358,8 @@ int RtmpStreamBase::SendCuePoint(const RtmpCuePoint& cuepoint) {
 int RtmpStreamBase::SendMetaData(const RtmpMetaData& metadata,
                                  const butil::StringPiece& name) {
     butil::IOBuf req_buf;
-    {
-        butil::IOBufAsZeroCopyOutputStream zc_stream(&req_buf);
-        AMFOutputStream ostream(&zc_stream);
-        WriteAMFString(name, &ostream);
-        WriteAMFObject(metadata.data, &ostream);
-        if (!ostream.good()) {
-            LOG(ERROR) << "Fail to serialize metadata";
-            return -1;
-        }
+    if (SerializeMetaData(metadata, name, &req_buf) != 0) {
+        return -1;
     }
     return SendMessage(metadata.timestamp, policy::RTMP_MESSAGE_DATA_AMF0, req_buf);
 }
@@ -1338,14 +1389,7 @@ int RtmpStreamBase::SendAudioMessage(const RtmpAudioMessage& msg) {
     msg2->header.message_type = policy::RTMP_MESSAGE_AUDIO;
     msg2->header.stream_id = _message_stream_id;
     msg2->chunk_stream_id = _chunk_stream_id;
-    // Make audio header.
-    const char audio_head =
-        ((msg.codec & 0xF) << 4)
-        | ((msg.rate & 0x3) << 2)
-        | ((msg.bits & 0x1) << 1)
-        | (msg.type & 0x1);
-    msg2->body.push_back(audio_head);
-    msg2->body.append(msg.data);
+    SerializeAudioMessage(msg, &msg2->body);
     return _rtmpsock->Write(msg2);
 }
 
@@ -1369,15 +1413,7 @@ int RtmpStreamBase::SendAACMessage(const RtmpAACMessage& msg) {
     msg2->header.message_type = policy::RTMP_MESSAGE_AUDIO;
     msg2->header.stream_id = _message_stream_id;
     msg2->chunk_stream_id = _chunk_stream_id;
-    // Make audio header.
-    char aac_head[2];
-    aac_head[0] = ((FLV_AUDIO_AAC & 0xF) << 4)
-        | ((msg.rate & 0x3) << 2)
-        | ((msg.bits & 0x1) << 1)
-        | (msg.type & 0x1);
-    aac_head[1] = (FlvAACPacketType)msg.packet_type;
-    msg2->body.append(aac_head, sizeof(aac_head));
-    msg2->body.append(msg.data);
+    SerializeAACMessage(msg, &msg2->body);
     return _rtmpsock->Write(msg2);
 }
 
@@ -1412,10 +1448,7 @@ int RtmpStreamBase::SendVideoMessage(const RtmpVideoMessage& msg) {
     msg2->header.message_type = policy::RTMP_MESSAGE_VIDEO;
     msg2->header.stream_id = _message_stream_id;
     msg2->chunk_stream_id = _chunk_stream_id;
-    // Make video header
-    const char video_head = ((msg.frame_type & 0xF) << 4) | (msg.codec & 0xF);
-    msg2->body.push_back(video_head);
-    msg2->body.append(msg.data);
+    SerializeVideoMessage(msg, &msg2->body);
     return _rtmpsock->Write(msg2);
 }
 
@@ -1442,14 +1475,7 @@ int RtmpStreamBase::SendAVCMessage(const RtmpAVCMessage& msg) {
     msg2->header.message_type = policy::RTMP_MESSAGE_VIDEO;
     msg2->header.stream_id = _message_stream_id;
     msg2->chunk_stream_id = _chunk_stream_id;
-    // Make video header
-    char avc_head[5];
-    char* p = avc_head;
-    *p++ = ((msg.frame_type & 0xF) << 4) | (FLV_VIDEO_AVC & 0xF);
-    *p++ = (FlvAVCPacketType)msg.packet_type;
-    policy::WriteBigEndian3Bytes(&p, msg.composition_time);
-    msg2->body.append(avc_head, sizeof(avc_head));
-    msg2->body.append(msg.data);
+    SerializeAVCMessage(msg, &msg2->body);
     return _rtmpsock->Write(msg2);
 }
 
@@ -2871,4 +2897,308 @@ std::string MakeRtmpURL(const butil::StringPiece& host,
     return result;
 }
 
+RtmpFanoutOptions::RtmpFanoutOptions()
+    : gop_cache(true)
+    , gop_cache_max_bytes(8 * 1024 * 1024)
+    , drop_on_overcrowded(true) {
+}
+
+RtmpFanout::RtmpFanout(const RtmpFanoutOptions* options)
+    : _last_timestamp(0)
+    , _has_metadata(false)
+    , _has_video_header(false)
+    , _has_audio_header(false)
+    , _gop_bytes(0) {
+    if (options) {
+        _options = *options;
+    }
+}
+
+RtmpFanout::~RtmpFanout() {
+    get_rtmp_bvars()->fanout_player_count << -(int)_players.size();
+}
+
+int RtmpFanout::AddPlayer(RtmpStreamBase* player) {
+    if (player == NULL || player->socket() == NULL ||
+        player->chunk_stream_id() == 0) {
+        LOG(ERROR) << "AddPlayer can't be called before play() is received";
+        errno = EINVAL;
+        return -1;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (size_t i = 0; i < _players.size(); ++i) {
+        if (_players[i].stream.get() == player) {
+            errno = EEXIST;
+            return -1;
+        }
+    }
+    _players.push_back(Player());
+    Player& p = _players.back();
+    p.stream.reset(player);
+    p.sent_messages = 0;
+    p.dropped_messages = 0;
+    p.last_timestamp = _last_timestamp;
+    p.waiting_keyframe = true;
+    get_rtmp_bvars()->fanout_player_count << 1;
+    SendCacheLocked(&p);
+    return 0;
+}
+
+bool RtmpFanout::RemovePlayer(RtmpStreamBase* player) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (size_t i = 0; i < _players.size(); ++i) {
+        if (_players[i].stream.get() == player) {
+            _players[i] = _players.back();
+            _players.pop_back();
+            get_rtmp_bvars()->fanout_player_count << -1;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t RtmpFanout::player_count() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _players.size();
+}
+
+void RtmpFanout::ClearCache() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    _has_metadata = false;
+    _metadata.body.clear();
+    _has_video_header = false;
+    _video_header.body.clear();
+    _has_audio_header = false;
+    _audio_header.body.clear();
+    _gop.clear();
+    _gop_bytes = 0;
+}
+
+void RtmpFanout::GetPlayerStats(std::vector<RtmpFanoutPlayerStats>* stats) const {
+    stats->clear();
+    BAIDU_SCOPED_LOCK(_mutex);
+    stats->resize(_players.size());
+    for (size_t i = 0; i < _players.size(); ++i) {
+        const Player& p = _players[i];
+        RtmpFanoutPlayerStats& st = (*stats)[i];
+        st.remote_side = p.stream->remote_side();
+        st.stream_id = p.stream->stream_id();
+        st.sent_messages = p.sent_messages;
+        st.dropped_messages = p.dropped_messages;
+        st.lag_ms = (int64_t)_last_timestamp - (int64_t)p.last_timestamp;
+        const Socket* sock = p.stream->socket();
+        st.unwritten_bytes = (sock ? sock->unwritten_bytes() : 0);
+    }
+}
+
+int RtmpFanout::SendMetaData(const RtmpMetaData& metadata,
+                             const butil::StringPiece& name) {
+    Message msg;
+    msg.timestamp = metadata.timestamp;
+    msg.message_type = policy::RTMP_MESSAGE_DATA_AMF0;
+    if (SerializeMetaData(metadata, name, &msg.body) != 0) {
+        return -1;
+    }
+    return Broadcast(msg, MESSAGE_DATA);
+}
+
+int RtmpFanout::SendAudioMessage(const RtmpAudioMessage& amsg) {
+    Message msg;
+    msg.timestamp = amsg.timestamp;
+    msg.message_type = policy::RTMP_MESSAGE_AUDIO;
+    SerializeAudioMessage(amsg, &msg.body);
+    return Broadcast(msg, amsg.IsAACSequenceHeader() ?
+                     MESSAGE_SEQUENCE_HEADER : MESSAGE_FRAME);
+}
+
+int RtmpFanout::SendAACMessage(const RtmpAACMessage& amsg) {
+    Message msg;
+    msg.timestamp = amsg.timestamp;
+    msg.message_type = policy::RTMP_MESSAGE_AUDIO;
+    SerializeAACMessage(amsg, &msg.body);
+    return Broadcast(msg, amsg.packet_type == FLV_AAC_PACKET_SEQUENCE_HEADER ?
+                     MESSAGE_SEQUENCE_HEADER : MESSAGE_FRAME);
+}
+
+int RtmpFanout::SendVideoMessage(const RtmpVideoMessage& vmsg) {
+    Message msg;
+    msg.timestamp = vmsg.timestamp;
+    msg.message_type = policy::RTMP_MESSAGE_VIDEO;
+    SerializeVideoMessage(vmsg, &msg.body);
+    MessageKind kind = MESSAGE_FRAME;
+    if (vmsg.IsAVCSequenceHeader() || vmsg.IsHEVCSequenceHeader()) {
+        kind = MESSAGE_SEQUENCE_HEADER;
+    } else if (vmsg.frame_type == FLV_VIDEO_FRAME_KEYFRAME) {
+        kind = MESSAGE_KEYFRAME;
+    }
+    return Broadcast(msg, kind);
+}
+
+int RtmpFanout::SendAVCMessage(const RtmpAVCMessage& vmsg) {
+    Message msg;
+    msg.timestamp = vmsg.timestamp;
+    msg.message_type = policy::RTMP_MESSAGE_VIDEO;
+    SerializeAVCMessage(vmsg, &msg.body);
+    MessageKind kind = MESSAGE_FRAME;
+    if (vmsg.packet_type == FLV_AVC_PACKET_SEQUENCE_HEADER) {
+        kind = MESSAGE_SEQUENCE_HEADER;
+    } else if (vmsg.frame_type == FLV_VIDEO_FRAME_KEYFRAME) {
+        kind = MESSAGE_KEYFRAME;
+    }
+    return Broadcast(msg, kind);
+}
+
+void RtmpFanout::CacheMessageLocked(const Message& msg, MessageKind kind) {
+    switch (kind) {
+    case MESSAGE_DATA:
+        _has_metadata = true;
+        _metadata = msg;
+        return;
+    case MESSAGE_SEQUENCE_HEADER:
+        if (msg.message_type == policy::RTMP_MESSAGE_VIDEO) {
+            _has_video_header = true;
+            _video_header = msg;
+        } else {
+            _has_audio_header = true;
+            _audio_header = msg;
+        }
+        return;
+    case MESSAGE_KEYFRAME:
+        _gop.clear();
+        _gop_bytes = 0;
+        if (!_options.gop_cache) {
+            return;
+        }
+        break;
+    case MESSAGE_FRAME:
+        if (_gop.empty()) {
+            // Not caching until the next keyframe.
+            return;
+        }
+        break;
+    }
+    if (_gop_bytes + msg.body.size() > _options.gop_cache_max_bytes) {
+        _gop.clear();
+        _gop_bytes = 0;
+        return;
+    }
+    _gop.push_back(msg);
+    _gop_bytes += msg.body.size();
+}
+
+void RtmpFanout::SendCacheLocked(Player* player) {
+    if (_has_metadata) {
+        SendToPlayerLocked(player, _metadata, MESSAGE_DATA, NULL);
+    }
+    if (_has_video_header) {
+        SendToPlayerLocked(player, _video_header, MESSAGE_SEQUENCE_HEADER, NULL);
+    }
+    if (_has_audio_header) {
+        SendToPlayerLocked(player, _audio_header, MESSAGE_SEQUENCE_HEADER, NULL);
+    }
+    for (size_t i = 0; i < _gop.size(); ++i) {
+        // The GOP starts with a keyframe.
+        SendToPlayerLocked(player, _gop[i],
+                           (i == 0 ? MESSAGE_KEYFRAME : MESSAGE_FRAME), NULL);
+    }
+}
+
+int RtmpFanout::SendToPlayerLocked(Player* player, const Message& msg,
+                                   MessageKind kind,
+                                   std::vector<Chunks>* shared) {
+    RtmpStreamBase* stream = player->stream.get();
+    if (stream->is_stopped()) {
+        return -1;
+    }
+    const bool droppable = (kind == MESSAGE_KEYFRAME || kind == MESSAGE_FRAME);
+    if (droppable) {
+        if (kind == MESSAGE_KEYFRAME) {
+            player->waiting_keyframe = false;
+        }
+        if (player->waiting_keyframe || stream->is_paused()) {
+            player->waiting_keyframe = true;
+            ++player->dropped_messages;
+            return 0;
+        }
+    }
+    Socket* sock = stream->socket();
+    policy::RtmpContext* ctx =
+        static_cast<policy::RtmpContext*>(sock->parsing_context());
+    if (ctx == NULL) {
+        return -1;
+    }
+    SocketMessagePtr<policy::RtmpSerializedMessage> smsg(
+        new policy::RtmpSerializedMessage);
+    smsg->header.timestamp = msg.timestamp;
+    smsg->header.message_length = msg.body.size();
+    smsg->header.message_type = msg.message_type;
+    smsg->header.stream_id = stream->stream_id();
+    smsg->chunk_stream_id = stream->chunk_stream_id();
+    smsg->chunk_size = ctx->chunk_size_out();
+    smsg->body = msg.body;
+    Chunks* chunks = NULL;
+    if (shared) {
+        for (size_t i = 0; i < shared->size(); ++i) {
+            Chunks& c = (*shared)[i];
+            if (c.chunk_stream_id == smsg->chunk_stream_id &&
+                c.stream_id == smsg->header.stream_id &&
+                c.chunk_size == smsg->chunk_size) {
+                chunks = &c;
+                break;
+            }
+        }
+    }
+    if (chunks) {
+        smsg->chunks = chunks->chunks;
+    } else {
+        butil::IOBuf body = msg.body;
+        if (policy::RtmpChunkStream::SerializeMessageWithType0(
+                &smsg->chunks, smsg->chunk_stream_id, smsg->chunk_size,
+                smsg->header, &body) != 0) {
+            return -1;
+        }
+        if (shared) {
+            shared->push_back(Chunks());
+            Chunks& c = shared->back();
+            c.chunk_stream_id = smsg->chunk_stream_id;
+            c.stream_id = smsg->header.stream_id;
+            c.chunk_size = smsg->chunk_size;
+            c.chunks = smsg->chunks;
+        }
+    }
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = !(droppable && _options.drop_on_overcrowded);
+    SocketMessagePtr<> wmsg(smsg.release());
+    if (sock->Write(wmsg, &wopt) != 0) {
+        if (errno == EOVERCROWDED) {
+            player->waiting_keyframe = true;
+            ++player->dropped_messages;
+            return 0;
+        }
+        return -1;
+    }
+    ++player->sent_messages;
+    player->last_timestamp = msg.timestamp;
+    return 0;
+}
+
+int RtmpFanout::Broadcast(const Message& msg, MessageKind kind) {
+    std::vector<Chunks> shared;
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (kind == MESSAGE_KEYFRAME || kind == MESSAGE_FRAME) {
+        _last_timestamp = msg.timestamp;
+    }
+    CacheMessageLocked(msg, kind);
+    for (size_t i = 0; i < _players.size();) {
+        if (SendToPlayerLocked(&_players[i], msg, kind, &shared) != 0) {
+            _players[i] = _players.back();
+            _players.pop_back();
+            get_rtmp_bvars()->fanout_player_count << -1;
+        } else {
+            ++i;
+        }
+    }
+    return 0;
+}
+
 } // namespace brpc
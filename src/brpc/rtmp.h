@@ -1110,6 +1110,132 @@ friend class policy::RtmpChunkStream;
     bthread_id_t _onfail_id;
 };
 
+struct RtmpFanoutOptions {
+    RtmpFanoutOptions();
+
+    // Cache messages since the latest video keyframe so that new players
+    // start from the keyframe immediately instead of waiting for the next
+    // one from the encoder.
+    // Default: true
+    bool gop_cache;
+
+    // Max bytes of cached messages. The cache is dropped until the next
+    // keyframe when a GOP is longer than this.
+    // Default: 8MB
+    size_t gop_cache_max_bytes;
+
+    // Skip audio and video messages to a player whose connection is
+    // overcrowded until the next keyframe, otherwise messages are queued in
+    // the connection without limit.
+    // Default: true
+    bool drop_on_overcrowded;
+};
+
+struct RtmpFanoutPlayerStats {
+    butil::EndPoint remote_side;
+    uint32_t stream_id;
+    // Messages sent to or skipped for the player.
+    int64_t sent_messages;
+    int64_t dropped_messages;
+    // Timestamp of the latest published message minus the timestamp of the
+    // latest message sent to the player, in milliseconds.
+    int64_t lag_ms;
+    // Bytes written into the connection but not sent to the player yet.
+    int64_t unwritten_bytes;
+};
+
+// Send messages of one publisher to many players. Each message is serialized
+// into RTMP chunks once for all players with the same chunk size(and ids of
+// chunk stream and message stream, which are same for most players), and
+// the players share memory of the chunks.
+// Methods of this class are thread-safe.
+class RtmpFanout {
+public:
+    explicit RtmpFanout(const RtmpFanoutOptions* options = NULL);
+    ~RtmpFanout();
+
+    // Add a player which must have received play(namely called inside or
+    // after RtmpServerStream::OnPlay()). Cached metadata, sequence headers
+    // and the GOP are sent to the player before following messages.
+    // Players are removed automatically after they're stopped.
+    // Returns 0 on success, -1 otherwise.
+    int AddPlayer(RtmpStreamBase* player);
+
+    // Returns true if the player was added and is removed now.
+    bool RemovePlayer(RtmpStreamBase* player);
+
+    size_t player_count() const;
+
+    // Send messages to all players.
+    // Returns 0 on success, -1 otherwise. Failing to send to some players
+    // does not fail these methods.
+    int SendMetaData(const RtmpMetaData&,
+                     const butil::StringPiece& name = "onMetaData");
+    int SendAudioMessage(const RtmpAudioMessage& msg);
+    int SendAACMessage(const RtmpAACMessage& msg);
+    int SendVideoMessage(const RtmpVideoMessage& msg);
+    int SendAVCMessage(const RtmpAVCMessage& msg);
+
+    // Drop cached metadata, sequence headers and the GOP, namely when the
+    // publisher is changed.
+    void ClearCache();
+
+    // Get lag and counters of all players.
+    void GetPlayerStats(std::vector<RtmpFanoutPlayerStats>* stats) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RtmpFanout);
+
+    struct Message {
+        uint32_t timestamp;
+        uint8_t message_type;
+        butil::IOBuf body;
+    };
+    struct Player {
+        butil::intrusive_ptr<RtmpStreamBase> stream;
+        int64_t sent_messages;
+        int64_t dropped_messages;
+        uint32_t last_timestamp;
+        bool waiting_keyframe;
+    };
+    // Chunks of a message serialized for players with the same ids and
+    // chunk size.
+    struct Chunks {
+        uint32_t chunk_stream_id;
+        uint32_t stream_id;
+        uint32_t chunk_size;
+        butil::IOBuf chunks;
+    };
+    enum MessageKind {
+        MESSAGE_DATA,
+        MESSAGE_SEQUENCE_HEADER,
+        MESSAGE_KEYFRAME,
+        MESSAGE_FRAME
+    };
+
+    int Broadcast(const Message& msg, MessageKind kind);
+    void CacheMessageLocked(const Message& msg, MessageKind kind);
+    // Serialized chunks are looked up in or added into `shared' if it's not
+    // NULL. Returns 0 on success, -1 when the player should be removed.
+    int SendToPlayerLocked(Player* player, const Message& msg, MessageKind kind,
+                           std::vector<Chunks>* shared);
+    void SendCacheLocked(Player* player);
+
+    RtmpFanoutOptions _options;
+    mutable butil::Mutex _mutex;
+    std::vector<Player> _players;
+    uint32_t _last_timestamp;
+    bool _has_metadata;
+    Message _metadata;
+    bool _has_video_header;
+    Message _video_header;
+    bool _has_audio_header;
+    Message _audio_header;
+    // Messages since the latest keyframe, empty when not caching.
+    std::vector<Message> _gop;
+    size_t _gop_bytes;
+};
+
 } // namespace brpc
 
 
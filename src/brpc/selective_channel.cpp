@@ -22,6 +22,7 @@
 #include "brpc/socket.h"                             // SocketUser
 #include "brpc/load_balancer.h"                      // LoadBalancer
 #include "brpc/details/controller_private_accessor.h"        // RPCSender
+#include "brpc/details/shared_request_buf.h"         // SharedRequestBuf
 #include "brpc/selective_channel.h"
 #include "brpc/global.h"
 
@@ -324,9 +325,17 @@ int Sender::IssueRPC(int64_t start_realtime_us) {
     sub_cntl->set_type_of_service(_main_cntl->_tos);
     sub_cntl->set_request_compress_type(_main_cntl->request_compress_type());
     sub_cntl->set_log_id(_main_cntl->log_id());
+    sub_cntl->set_request_priority(_main_cntl->request_priority());
     sub_cntl->set_request_code(_main_cntl->request_code());
     // Forward request attachment to the subcall
     sub_cntl->request_attachment().append(_main_cntl->request_attachment());
+    // Retries and backup requests reuse the request serialized by the
+    // first sub call.
+    if (_main_cntl->_shared_request_buf == NULL &&
+        (_main_cntl->max_retry() > 0 || _main_cntl->backup_request_ms() >= 0)) {
+        _main_cntl->_shared_request_buf.reset(new SharedRequestBuf);
+    }
+    sub_cntl->_shared_request_buf = _main_cntl->_shared_request_buf;
     
     sel_out.channel()->CallMethod(_main_cntl->_method,
                                   &r.sub_done->_cntl,
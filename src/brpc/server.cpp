@@ -19,6 +19,7 @@
 #include <wordexp.h>                                // wordexp
 #include <iomanip>
 #include <arpa/inet.h>                              // inet_aton
+#include <netinet/tcp.h>                            // TCP_FASTOPEN
 #include <fcntl.h>                                  // O_CREAT
 #include <sys/stat.h>                               // mkdir
 #include <gflags/gflags.h>
@@ -40,6 +41,7 @@
 #include "brpc/details/ssl_helper.h"           // CreateServerSSLContext
 #include "brpc/protocol.h"                     // ListProtocols
 #include "brpc/nshead_service.h"               // NsheadService
+#include "brpc/baidu_master_service.h"         // BaiduMasterService
 #ifdef ENABLE_THRIFT_FRAMED_PROTOCOL
 #include "brpc/thrift_service.h"               // ThriftService
 #endif
@@ -62,10 +64,19 @@
 #include "brpc/builtin/pprof_service.h"        // PProfService
 #include "brpc/builtin/bthreads_service.h"     // BthreadsService
 #include "brpc/builtin/ids_service.h"          // IdsService
+#include "brpc/builtin/zstd_dict_service.h"    // ZstdDictService
+#include "brpc/builtin/iobuf_service.h"        // IOBufService
+#include "brpc/builtin/pools_service.h"        // PoolsService
 #include "brpc/builtin/sockets_service.h"      // SocketsService
 #include "brpc/builtin/hotspots_service.h"     // HotspotsService
 #include "brpc/builtin/prometheus_metrics_service.h"
 #include "brpc/details/method_status.h"
+#include "brpc/details/response_cache.h"       // ResponseCache
+#include "brpc/details/listen_fd_handover.h"   // ListenFdHandover
+#include "brpc/details/method_executor.h"      // MethodExecutor
+#include "brpc/details/method_id.h"            // MethodIdOf
+#include "brpc/details/continuous_profiler.h"   // EnableContinuousCpuProfiler
+#include "brpc/rdma/rdma_helper.h"             // InitRdma
 #include "brpc/load_balancer.h"
 #include "brpc/naming_service.h"
 #include "brpc/simple_data_pool.h"
@@ -111,6 +122,7 @@ DEFINE_bool(enable_dir_service, false, "Enable /dir");
 DEFINE_bool(enable_threads_service, false, "Enable /threads");
 
 DECLARE_int32(usercode_backup_threads);
+DECLARE_int32(event_dispatcher_num);
 DECLARE_bool(usercode_in_pthread);
 
 const int INITIAL_SERVICE_CAP = 64;
@@ -123,11 +135,15 @@ ServerOptions::ServerOptions()
     : idle_timeout_sec(-1)
     , nshead_service(NULL)
     , thrift_service(NULL)
+    , baidu_master_service(NULL)
     , mongo_service_adaptor(NULL)
     , auth(NULL)
     , server_owns_auth(false)
     , num_threads(8)
     , max_concurrency(0)
+    , max_inflight_request_bytes(0)
+    , method_max_inflight_request_bytes(0)
+    , use_pb_arena(false)
     , session_local_data_factory(NULL)
     , reserved_session_local_data(0)
     , thread_local_data_factory(NULL)
@@ -137,6 +153,12 @@ ServerOptions::ServerOptions()
     , bthread_init_count(0)
     , internal_port(-1)
     , has_builtin_services(true)
+    , reuse_port_per_dispatcher(false)
+    , shm_transport(false)
+    , use_rdma(false)
+    , bthread_tag(BTHREAD_TAG_DEFAULT)
+    , shared_nothing(false)
+    , tcp_fastopen_queue_length(0)
     , http_master_service(NULL)
     , health_reporter(NULL)
     , rtmp_service(NULL)
@@ -153,11 +175,21 @@ ServerSSLOptions* ServerOptions::mutable_ssl_options() {
     return _ssl_options.get();
 }
 
+ResponseCacheOptions* ServerOptions::mutable_response_cache_options() {
+    if (!_response_cache_options) {
+        _response_cache_options.reset(new ResponseCacheOptions);
+    }
+    return _response_cache_options.get();
+}
+
 Server::MethodProperty::OpaqueParams::OpaqueParams()
     : is_tabbed(false)
     , allow_default_url(false)
     , allow_http_body_to_pb(true)
-    , pb_bytes_to_base64(false) {
+    , pb_bytes_to_base64(false)
+    , executor(NULL)
+    , enable_progressive_read(false)
+    , run_inline(false) {
 }
 
 Server::MethodProperty::MethodProperty()
@@ -166,7 +198,8 @@ Server::MethodProperty::MethodProperty()
     , http_url(NULL)
     , service(NULL)
     , method(NULL)
-    , status(NULL) {
+    , status(NULL)
+    , max_inflight_request_bytes(-1) {
 }
 
 static timeval GetUptime(void* arg/*start_time*/) {
@@ -224,7 +257,7 @@ static void PrintEnabledProfilers(std::ostream& os, void*) {
             os << "heap(no TCMALLOC_SAMPLE_PARAMETER in env) ";
         }
     }
-    os << "contention";
+    os << "contention offcpu";
 }
 
 static bvar::PassiveStatus<std::string> s_lb_st(
@@ -269,6 +302,10 @@ static bvar::Vector<unsigned, 2> GetSessionLocalDataCount(void* arg) {
     return v;
 }
 
+static unsigned GetSessionLocalDataCreated(void* arg) {
+    return static_cast<Server*>(arg)->session_local_data_pool()->stat().ncreated;
+}
+
 std::string Server::ServerPrefix() const {
     return butil::string_printf("%s_%d", g_server_info_prefix, listen_address().port);
 }
@@ -300,9 +337,15 @@ void* Server::UpdateDerivedVars(void* arg) {
 
     bvar::PassiveStatus<bvar::Vector<unsigned, 2> > nsessiondata_st(
         GetSessionLocalDataCount, server);
+    bvar::PassiveStatus<unsigned> nsessiondata_created_st(
+        GetSessionLocalDataCreated, server);
+    bvar::PerSecond<bvar::PassiveStatus<unsigned> > sessiondata_created_second(
+        &nsessiondata_created_st);
     if (server->session_local_data_pool()) {
         nsessiondata_st.expose_as(prefix, "session_local_data_count");
         nsessiondata_st.set_vector_names("using,free");
+        sessiondata_created_second.expose_as(
+            prefix, "session_local_data_created_second");
     }
 
     std::string mprefix = prefix;
@@ -319,6 +362,9 @@ void* Server::UpdateDerivedVars(void* arg) {
     if (server->options().nshead_service) {
         server->options().nshead_service->Expose(prefix);
     }
+    if (server->options().baidu_master_service) {
+        server->options().baidu_master_service->Expose(prefix);
+    }
 
 #ifdef ENABLE_THRIFT_FRAMED_PROTOCOL
     if (server->options().thrift_service) {
@@ -383,15 +429,21 @@ Server::Server(ProfilerLinker)
     , _builtin_service_count(0)
     , _virtual_service_count(0)
     , _failed_to_set_max_concurrency_of_method(false)
+    , _has_progressive_read_methods(false)
+    , _has_nonblocking_methods(false)
     , _am(NULL)
     , _internal_am(NULL)
+    , _listen_fd_handover(NULL)
     , _first_service(NULL)
     , _tab_info_list(NULL)
     , _global_restful_map(NULL)
     , _last_start_time(0)
     , _derivative_thread(INVALID_BTHREAD)
     , _keytable_pool(NULL)
-    , _concurrency(0) {
+    , _response_cache(NULL)
+    , _concurrency(0)
+    , _inflight_request_bytes(0)
+    , _nshard(0) {
     BAIDU_CASSERT(offsetof(Server, _concurrency) % 64 == 0,
                   Server_concurrency_must_be_aligned_by_cacheline);
 }
@@ -408,6 +460,9 @@ Server::~Server() {
     delete _options.nshead_service;
     _options.nshead_service = NULL;
 
+    delete _options.baidu_master_service;
+    _options.baidu_master_service = NULL;
+
 #ifdef ENABLE_THRIFT_FRAMED_PROTOCOL
     delete _options.thrift_service;
     _options.thrift_service = NULL;
@@ -416,6 +471,8 @@ Server::~Server() {
     delete _options.http_master_service;
     _options.http_master_service = NULL;
 
+    delete _listen_fd_handover;
+    _listen_fd_handover = NULL;
     delete _am;
     _am = NULL;
     delete _internal_am;
@@ -424,9 +481,19 @@ Server::~Server() {
     delete _tab_info_list;
     _tab_info_list = NULL;
 
+    for (std::map<std::string, MethodExecutor*>::iterator
+             it = _method_executors.begin();
+         it != _method_executors.end(); ++it) {
+        delete it->second;
+    }
+    _method_executors.clear();
+
     delete _global_restful_map;
     _global_restful_map = NULL;
 
+    delete _response_cache;
+    _response_cache = NULL;
+
     if (!_options.pid_file.empty()) {
         unlink(_options.pid_file.c_str());
     }
@@ -529,6 +596,18 @@ int Server::AddBuiltinServices() {
         LOG(ERROR) << "Fail to add SocketsService";
         return -1;
     }
+    if (AddBuiltinService(new (std::nothrow) ZstdDictService)) {
+        LOG(ERROR) << "Fail to add ZstdDictService";
+        return -1;
+    }
+    if (AddBuiltinService(new (std::nothrow) IOBufService)) {
+        LOG(ERROR) << "Fail to add IOBufService";
+        return -1;
+    }
+    if (AddBuiltinService(new (std::nothrow) PoolsService)) {
+        LOG(ERROR) << "Fail to add PoolsService";
+        return -1;
+    }
     if (AddBuiltinService(new (std::nothrow) GetFaviconService)) {
         LOG(ERROR) << "Fail to add GetFaviconService";
         return -1;
@@ -555,7 +634,8 @@ Acceptor* Server::BuildAcceptor() {
         whitelist.insert(protocol);
     }
     const bool has_whitelist = !whitelist.empty();
-    Acceptor* acceptor = new (std::nothrow) Acceptor(_keytable_pool);
+    Acceptor* acceptor = new (std::nothrow) Acceptor(_keytable_pool,
+                                                     _options.bthread_tag);
     if (NULL == acceptor) {
         LOG(ERROR) << "Fail to new Acceptor";
         return NULL;
@@ -624,6 +704,10 @@ int Server::InitializeOnce() {
         LOG(ERROR) << "Fail to init _method_map";
         return -1;
     }
+    if (_method_id_map.init(INITIAL_SERVICE_CAP * 2) != 0) {
+        LOG(ERROR) << "Fail to init _method_id_map";
+        return -1;
+    }
     if (_ssl_ctx_map.init(INITIAL_CERT_MAP) != 0) {
         LOG(ERROR) << "Fail to init _ssl_ctx_map";
         return -1;
@@ -676,6 +760,19 @@ static int get_port_from_fd(int fd) {
     return ntohs(addr.sin_port);
 }
 
+static void EnableTcpFastOpen(int fd, int queue_length) {
+#if defined(OS_LINUX) && defined(TCP_FASTOPEN)
+    // OK to fail, clients just connect without TFO.
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+                   &queue_length, sizeof(queue_length)) != 0) {
+        PLOG(WARNING) << "Fail to enable TCP Fast Open of fd=" << fd;
+    }
+#else
+    (void)fd;
+    (void)queue_length;
+#endif
+}
+
 static bool CreateConcurrencyLimiter(const AdaptiveMaxConcurrency& amc,
                                      ConcurrencyLimiter** out) {
     if (amc.type() == AdaptiveMaxConcurrency::UNLIMITED()) {
@@ -698,15 +795,16 @@ static bool CreateConcurrencyLimiter(const AdaptiveMaxConcurrency& amc,
 }
 
 static AdaptiveMaxConcurrency g_default_max_concurrency_of_method(0);
+static int64_t g_default_max_inflight_request_bytes_of_method = 0;
 
-int Server::StartInternal(const butil::ip_t& ip,
+int Server::StartInternal(const butil::EndPoint& endpoint,
                           const PortRange& port_range,
                           const ServerOptions *opt) {
     std::unique_ptr<Server, RevertServerStatus> revert_server(this);
     if (_failed_to_set_max_concurrency_of_method) {
         _failed_to_set_max_concurrency_of_method = false;
-        LOG(ERROR) << "previous call to MaxConcurrencyOf() was failed, "
-            "fix it before starting server";
+        LOG(ERROR) << "previous call to MaxConcurrencyOf() or "
+            "MaxInflightRequestBytesOf() was failed, fix it before starting server";
         return -1;
     }
     if (InitializeOnce() != 0) {
@@ -764,6 +862,13 @@ int Server::StartInternal(const butil::ip_t& ip,
     //   Following code may run multiple times if this server is started and
     //   stopped more than once. Reuse or delete previous resources!
 
+    // Responses cached in last run are dropped.
+    delete _response_cache;
+    _response_cache = NULL;
+    if (_options.has_response_cache_options()) {
+        _response_cache = new ResponseCache(_options.response_cache_options());
+    }
+
     if (_options.session_local_data_factory) {
         if (_session_local_data_pool == NULL) {
             _session_local_data_pool =
@@ -778,6 +883,31 @@ int Server::StartInternal(const butil::ip_t& ip,
         _session_local_data_pool->Reserve(_options.reserved_session_local_data);
     }
 
+    if (bthread_getconcurrency_by_tag(_options.bthread_tag) < 0) {
+        LOG(ERROR) << "Invalid bthread_tag=" << _options.bthread_tag;
+        return -1;
+    }
+    _nshard = 0;
+    if (_options.shared_nothing) {
+        for (int i = 1; i < FLAGS_event_dispatcher_num; ++i) {
+            if (bthread_getconcurrency_by_tag(_options.bthread_tag + i) < 0) {
+                LOG(ERROR) << "Invalid bthread_tag=" << _options.bthread_tag + i
+                           << " for shard " << i << ", -task_group_ntags must"
+                           " be at least bthread_tag + -event_dispatcher_num="
+                           << _options.bthread_tag + FLAGS_event_dispatcher_num;
+                return -1;
+            }
+        }
+        for (int i = 0; i < FLAGS_event_dispatcher_num; ++i) {
+            if (bthread_getconcurrency_by_tag(_options.bthread_tag + i) > 1) {
+                LOG(WARNING) << "Shard " << i << " has more than one worker,"
+                    " tasks may still be stolen between workers of the shard";
+                break;
+            }
+        }
+        _nshard = FLAGS_event_dispatcher_num;
+    }
+
     // Init _keytable_pool always. If the server was stopped before, the pool
     // should be destroyed in Join().
     _keytable_pool = new bthread_keytable_pool_t;
@@ -821,6 +951,7 @@ int Server::StartInternal(const butil::ip_t& ip,
             init_args[i].stop = false;
             bthread_attr_t tmp = BTHREAD_ATTR_NORMAL;
             tmp.keytable_pool = _keytable_pool;
+            tmp.tag = _options.bthread_tag;
             if (bthread_start_background(
                     &init_args[i].th, &tmp, BthreadInitEntry, &init_args[i]) != 0) {
                 break;
@@ -879,6 +1010,7 @@ int Server::StartInternal(const butil::ip_t& ip,
     }
 
     _concurrency = 0;
+    _inflight_request_bytes.store(0, butil::memory_order_relaxed);
 
     if (_options.has_builtin_services &&
         _builtin_service_count <= 0 &&
@@ -920,7 +1052,12 @@ int Server::StartInternal(const butil::ip_t& ip,
         it != _method_map.end(); ++it) {
         if (it->second.is_builtin_service) {
             it->second.status->SetConcurrencyLimiter(NULL);
+            it->second.status->SetMaxInflightBytes(0);
         } else {
+            it->second.status->SetMaxInflightBytes(
+                it->second.max_inflight_request_bytes >= 0 ?
+                it->second.max_inflight_request_bytes :
+                _options.method_max_inflight_request_bytes);
             const AdaptiveMaxConcurrency* amc = &it->second.max_concurrency;
             if (amc->type() == AdaptiveMaxConcurrency::UNLIMITED()) {
                 amc = &_options.method_max_concurrency;
@@ -933,6 +1070,7 @@ int Server::StartInternal(const butil::ip_t& ip,
             it->second.status->SetConcurrencyLimiter(cl);
         }
     }
+    BuildMethodIdMap();
 
     // Create listening ports
     if (port_range.min_port > port_range.max_port) {
@@ -940,16 +1078,47 @@ int Server::StartInternal(const butil::ip_t& ip,
                    << port_range.max_port << ']';
         return -1;
     }
-    _listen_addr.ip = ip;
-    for (int port = port_range.min_port; port <= port_range.max_port; ++port) {
-        _listen_addr.port = port;
-        butil::fd_guard sockfd(tcp_listen(_listen_addr));
+    const bool extended = butil::is_endpoint_extended(endpoint);
+    if (extended && port_range.min_port != port_range.max_port) {
+        LOG(ERROR) << "port_range is not supported by " << endpoint;
+        return -1;
+    }
+    _listen_addr = endpoint;
+    // Take over listening fds from the old process if it exists.
+    std::vector<int> handed_fds;
+    int handover_ack_fd = -1;
+    int min_port = port_range.min_port;
+    if (!_options.listen_fd_handover_path.empty() &&
+        ReceiveListenFds(_options.listen_fd_handover_path,
+                         &handed_fds, &handover_ack_fd) == 0) {
+        if (butil::get_local_side(handed_fds[0], &_listen_addr) != 0) {
+            LOG(ERROR) << "Fail to get address of fd=" << handed_fds[0];
+            for (size_t i = 0; i < handed_fds.size(); ++i) {
+                close(handed_fds[i]);
+            }
+            close(handover_ack_fd);
+            return -1;
+        }
+        min_port = _listen_addr.port;
+    }
+    butil::fd_guard handover_ack_guard(handover_ack_fd);
+    const bool reuse_port = handed_fds.size() > 1 ||
+        ((_options.reuse_port_per_dispatcher || _options.shared_nothing) &&
+         FLAGS_event_dispatcher_num > 1 &&
+         butil::get_endpoint_type(endpoint) != AF_UNIX);
+    for (int port = min_port; port <= port_range.max_port; ++port) {
+        if (!extended) {
+            _listen_addr.port = port;
+        }
+        butil::fd_guard sockfd(handed_fds.empty() ?
+                               tcp_listen(_listen_addr, reuse_port) :
+                               handed_fds[0]);
         if (sockfd < 0) {
             if (port != port_range.max_port) { // not the last port, try next
                 continue;
             }
             if (port_range.min_port != port_range.max_port) {
-                LOG(ERROR) << "Fail to listen " << ip
+                LOG(ERROR) << "Fail to listen " << endpoint.ip
                            << ":[" << port_range.min_port << '-'
                            << port_range.max_port << ']';
             } else {
@@ -957,7 +1126,13 @@ int Server::StartInternal(const butil::ip_t& ip,
             }
             return -1;
         }
-        if (_listen_addr.port == 0) {
+        if (extended) {
+            // Get the actual address in case that port of IPv6 is 0.
+            if (butil::get_local_side(sockfd, &_listen_addr) != 0) {
+                LOG(ERROR) << "Fail to get address from fd=" << sockfd;
+                return -1;
+            }
+        } else if (_listen_addr.port == 0) {
             // port=0 makes kernel dynamically select a port from
             // https://en.wikipedia.org/wiki/Ephemeral_port
             _listen_addr.port = get_port_from_fd(sockfd);
@@ -966,6 +1141,11 @@ int Server::StartInternal(const butil::ip_t& ip,
                 return -1;
             }
         }
+        const bool fastopen = _options.tcp_fastopen_queue_length > 0 &&
+            butil::get_endpoint_type(_listen_addr) != AF_UNIX;
+        if (fastopen) {
+            EnableTcpFastOpen(sockfd, _options.tcp_fastopen_queue_length);
+        }
         if (_am == NULL) {
             _am = BuildAcceptor();
             if (NULL == _am) {
@@ -973,6 +1153,19 @@ int Server::StartInternal(const butil::ip_t& ip,
                 return -1;
             }
         }
+        _am->set_shard_count(_nshard);
+        _am->set_shm_transport(_options.shm_transport);
+        // Clients asking for RDMA are declined if it's not available.
+        _am->set_use_rdma(_options.use_rdma && rdma::InitRdma());
+        // Builtin services on internal_port are not limited.
+        _am->LimitInflightBytes(&_inflight_request_bytes,
+                                _options.max_inflight_request_bytes);
+        if (_options.socket_tuning_options.empty()) {
+            _am->set_tuning_options(NULL);
+        } else {
+            _am->set_tuning_options(std::make_shared<SocketTuningOptions>(
+                                        _options.socket_tuning_options));
+        }
         // Set `_status' to RUNNING before accepting connections
         // to prevent requests being rejected as ELOGOFF
         _status = RUNNING;
@@ -980,6 +1173,35 @@ int Server::StartInternal(const butil::ip_t& ip,
         GenerateVersionIfNeeded();
         g_running_server_count.fetch_add(1, butil::memory_order_relaxed);
 
+        if (reuse_port) {
+            // Other sockets listen to the port decided by the first one.
+            std::vector<int> fds(1, sockfd.release());
+            if (handed_fds.size() > 1) {
+                fds.insert(fds.end(), handed_fds.begin() + 1, handed_fds.end());
+            }
+            for (int i = fds.size(); i < FLAGS_event_dispatcher_num; ++i) {
+                const int fd = tcp_listen(_listen_addr, true);
+                if (fd < 0) {
+                    PLOG(ERROR) << "Fail to listen " << _listen_addr
+                                << " with SO_REUSEPORT";
+                    for (size_t j = 0; j < fds.size(); ++j) {
+                        close(fds[j]);
+                    }
+                    return -1;
+                }
+                fds.push_back(fd);
+            }
+            for (size_t j = 1; fastopen && j < fds.size(); ++j) {
+                EnableTcpFastOpen(fds[j], _options.tcp_fastopen_queue_length);
+            }
+            // Pass ownership of `fds' to `_am'
+            if (_am->StartAccept(fds, _options.idle_timeout_sec,
+                                 _default_ssl_ctx) != 0) {
+                LOG(ERROR) << "Fail to start acceptor";
+                return -1;
+            }
+            break;
+        }
         // Pass ownership of `sockfd' to `_am'
         if (_am->StartAccept(sockfd, _options.idle_timeout_sec,
                              _default_ssl_ctx) != 0) {
@@ -990,6 +1212,11 @@ int Server::StartInternal(const butil::ip_t& ip,
         break; // stop trying
     }
     if (_options.internal_port >= 0 && _options.has_builtin_services) {
+        if (extended) {
+            LOG(ERROR) << "ServerOptions.internal_port is not supported by "
+                       << _listen_addr;
+            return -1;
+        }
         if (_options.internal_port  == _listen_addr.port) {
             LOG(ERROR) << "ServerOptions.internal_port=" << _options.internal_port
                        << " is same with port=" << _listen_addr.port << " to Start()";
@@ -1023,6 +1250,23 @@ int Server::StartInternal(const butil::ip_t& ip,
         }
         sockfd.release();
     }
+    if (handover_ack_guard >= 0) {
+        // We're accepting connections, let the old process stop.
+        AckListenFds(handover_ack_guard);
+        LOG(INFO) << "Took over listening fds of " << _listen_addr
+                  << " from " << _options.listen_fd_handover_path;
+    }
+    if (!_options.listen_fd_handover_path.empty()) {
+        if (NULL == _listen_fd_handover) {
+            _listen_fd_handover = new ListenFdHandover;
+        }
+        if (_listen_fd_handover->Start(_options.listen_fd_handover_path,
+                                       this) != 0) {
+            LOG(ERROR) << "Fail to serve handover of listening fds at "
+                       << _options.listen_fd_handover_path;
+            return -1;
+        }
+    }
 
     PutPidFileIfNeeded();
 
@@ -1037,30 +1281,40 @@ int Server::StartInternal(const butil::ip_t& ip,
     // Print tips to server launcher.
     int http_port = _listen_addr.port;
     std::ostringstream server_info;
-    server_info << "Server[" << version() << "] is serving on port="
-                << _listen_addr.port;
+    server_info << "Server[" << version() << "] is serving on ";
+    if (extended) {
+        server_info << _listen_addr;
+    } else {
+        server_info << "port=" << _listen_addr.port;
+    }
     if (_options.internal_port >= 0 && _options.has_builtin_services) {
         http_port = _options.internal_port;
         server_info << " and internal_port=" << _options.internal_port;
     }
     LOG(INFO) << server_info.str() << '.';
 
-    if (_options.has_builtin_services) {
-        LOG(INFO) << "Check out http://" << butil::my_hostname() << ':'
-                  << http_port << " in web browser.";
-    } else {
+    if (!_options.has_builtin_services) {
         LOG(WARNING) << "Builtin services are disabled according to "
             "ServerOptions.has_builtin_services";
+    } else if (!extended) {
+        LOG(INFO) << "Check out http://" << butil::my_hostname() << ':'
+                  << http_port << " in web browser.";
     }
-    // For trackme reporting
-    SetTrackMeAddress(butil::EndPoint(butil::my_ip(), http_port));
+    if (!extended) {
+        // For trackme reporting
+        SetTrackMeAddress(butil::EndPoint(butil::my_ip(), http_port));
+    }
+    EnableContinuousCpuProfiler();
     revert_server.release();
     return 0;
 }
 
 int Server::Start(const butil::EndPoint& endpoint, const ServerOptions* opt) {
+    if (butil::is_endpoint_extended(endpoint)) {
+        return StartInternal(endpoint, PortRange(0, 0), opt);
+    }
     return StartInternal(
-        endpoint.ip, PortRange(endpoint.port, endpoint.port), opt);
+        endpoint, PortRange(endpoint.port, endpoint.port), opt);
 }
 
 int Server::Start(const char* ip_port_str, const ServerOptions* opt) {
@@ -1089,7 +1343,7 @@ int Server::Start(const char* ip_str, PortRange port_range,
         LOG(ERROR) << "Invalid address=`" << ip_str << '\'';
         return -1;
     }
-    return StartInternal(ip, port_range, opt);
+    return StartInternal(butil::EndPoint(ip, 0), port_range, opt);
 }
 
 int Server::Stop(int timeout_ms) {
@@ -1100,6 +1354,9 @@ int Server::Stop(int timeout_ms) {
 
     LOG(INFO) << "Server[" << version() << "] is going to quit";
 
+    if (_listen_fd_handover) {
+        _listen_fd_handover->Stop();
+    }
     if (_am) {
         _am->StopAccept(timeout_ms);
     }
@@ -1169,6 +1426,11 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
         return -1;
     }
     const google::protobuf::ServiceDescriptor* sd = service->GetDescriptor();
+    if (NULL == sd) {
+        // e.g. RawService with invalid names.
+        LOG(ERROR) << "Parameter[service] does not have descriptor";
+        return -1;
+    }
     if (sd->method_count() == 0) {
         LOG(ERROR) << "service=" << sd->full_name()
                    << " does not have any method.";
@@ -1198,6 +1460,30 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
         return -1;
     }
 
+    for (std::map<std::string, std::string>::const_iterator
+             it = svc_opt.method_executors.begin();
+         it != svc_opt.method_executors.end(); ++it) {
+        if (sd->FindMethodByName(it->first) == NULL) {
+            LOG(ERROR) << "service=" << sd->full_name()
+                       << " has no method called `" << it->first << '\'';
+            return -1;
+        }
+        if (_method_executors.find(it->second) == _method_executors.end()) {
+            LOG(ERROR) << "Unknown executor=`" << it->second << "' of method="
+                       << sd->full_name() << '.' << it->first;
+            return -1;
+        }
+    }
+    for (std::set<std::string>::const_iterator
+             it = svc_opt.nonblocking_methods.begin();
+         it != svc_opt.nonblocking_methods.end(); ++it) {
+        if (sd->FindMethodByName(*it) == NULL) {
+            LOG(ERROR) << "service=" << sd->full_name()
+                       << " has no method called `" << *it << '\'';
+            return -1;
+        }
+    }
+
     // defined `option (idl_support) = true' or not.
     const bool is_idl_support = sd->file()->options().GetExtension(idl_support);
 
@@ -1211,6 +1497,19 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
         mp.params.allow_default_url = svc_opt.allow_default_url;
         mp.params.allow_http_body_to_pb = svc_opt.allow_http_body_to_pb;
         mp.params.pb_bytes_to_base64 = svc_opt.pb_bytes_to_base64;
+        mp.params.enable_progressive_read = svc_opt.enable_progressive_read;
+        if (svc_opt.enable_progressive_read) {
+            _has_progressive_read_methods = true;
+        }
+        if (svc_opt.nonblocking_methods.count(md->name())) {
+            mp.params.run_inline = true;
+            _has_nonblocking_methods = true;
+        }
+        std::map<std::string, std::string>::const_iterator exec_it =
+            svc_opt.method_executors.find(md->name());
+        if (exec_it != svc_opt.method_executors.end()) {
+            mp.params.executor = _method_executors[exec_it->second];
+        }
         mp.service = service;
         mp.method = md;
         mp.status = new MethodStatus;
@@ -1298,6 +1597,8 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
                 params.allow_default_url = svc_opt.allow_default_url;
                 params.allow_http_body_to_pb = svc_opt.allow_http_body_to_pb;
                 params.pb_bytes_to_base64 = svc_opt.pb_bytes_to_base64;
+                params.executor = mp->params.executor;
+                params.enable_progressive_read = mp->params.enable_progressive_read;
                 if (!_global_restful_map->AddMethod(
                         mappings[i].path, service, params,
                         mappings[i].method_name, mp->status)) {
@@ -1336,6 +1637,8 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
             params.allow_default_url = svc_opt.allow_default_url;
             params.allow_http_body_to_pb = svc_opt.allow_http_body_to_pb;
             params.pb_bytes_to_base64 = svc_opt.pb_bytes_to_base64;
+            params.executor = mp->params.executor;
+            params.enable_progressive_read = mp->params.enable_progressive_read;
             if (!m->AddMethod(mappings[i].path, service, params,
                               mappings[i].method_name, mp->status)) {
                 LOG(ERROR) << "Fail to map `" << mappings[i].path << "' to `"
@@ -1395,8 +1698,33 @@ ServiceOptions::ServiceOptions()
 #else
     , pb_bytes_to_base64(true)
 #endif
+    , enable_progressive_read(false)
     {}
 
+int Server::AddMethodExecutor(const std::string& name,
+                              const MethodExecutorOptions& options) {
+    if (InitializeOnce() != 0) {
+        LOG(ERROR) << "Fail to initialize Server[" << version() << ']';
+        return -1;
+    }
+    if (status() != READY) {
+        LOG(ERROR) << "Can't add executor=" << name << " to Server["
+                   << version() << "] which is " << status_str(status());
+        return -1;
+    }
+    if (_method_executors.find(name) != _method_executors.end()) {
+        LOG(ERROR) << "executor=" << name << " already exists";
+        return -1;
+    }
+    MethodExecutor* executor = new MethodExecutor;
+    if (executor->Init(name, options) != 0) {
+        delete executor;
+        return -1;
+    }
+    _method_executors[name] = executor;
+    return 0;
+}
+
 int Server::AddService(google::protobuf::Service* service,
                        ServiceOwnership ownership) {
     ServiceOptions options;
@@ -1486,6 +1814,8 @@ void Server::RemoveMethodsOf(google::protobuf::Service* service) {
         }
         _method_map.erase(md->full_name());
     }
+    // Rebuilt at next start.
+    _method_id_map.clear();
 }
 
 int Server::RemoveService(google::protobuf::Service* service) {
@@ -1549,9 +1879,12 @@ void Server::ClearServices() {
     _fullname_service_map.clear();
     _service_map.clear();
     _method_map.clear();
+    _method_id_map.clear();
     _builtin_service_count = 0;
     _virtual_service_count = 0;
     _first_service = NULL;
+    _has_progressive_read_methods = false;
+    _has_nonblocking_methods = false;
 }
 
 google::protobuf::Service* Server::FindServiceByFullName(
@@ -1597,7 +1930,8 @@ void Server::GenerateVersionIfNeeded() {
         return;
     }
     int extra_count = !!_options.nshead_service + !!_options.rtmp_service +
-        !!_options.thrift_service + !!_options.redis_service;
+        !!_options.thrift_service + !!_options.redis_service +
+        !!_options.baidu_master_service;
     _version.reserve((extra_count + service_count()) * 20);
     for (ServiceMap::const_iterator it = _fullname_service_map.begin();
          it != _fullname_service_map.end(); ++it) {
@@ -1615,6 +1949,13 @@ void Server::GenerateVersionIfNeeded() {
         _version.append(butil::class_name_str(*_options.nshead_service));
     }
 
+    if (_options.baidu_master_service) {
+        if (!_version.empty()) {
+            _version.push_back('+');
+        }
+        _version.append(butil::class_name_str(*_options.baidu_master_service));
+    }
+
 #ifdef ENABLE_THRIFT_FRAMED_PROTOCOL
     if (_options.thrift_service) {
         if (!_version.empty()) {
@@ -1689,7 +2030,8 @@ void Server::PutPidFileIfNeeded() {
 }
 
 void Server::RunUntilAskedToQuit() {
-    while (!IsAskedToQuit()) {
+    // The server may be stopped after handing listening fds over.
+    while (!IsAskedToQuit() && IsRunning()) {
         bthread_usleep(1000000L);
     }
     Stop(0/*not used now*/);
@@ -1817,6 +2159,34 @@ Server::FindMethodPropertyByNameAndIndex(const butil::StringPiece& service_name,
     return FindMethodPropertyByFullName(method->full_name());
 }
 
+const Server::MethodProperty*
+Server::FindMethodPropertyById(uint64_t method_id) const {
+    const MethodProperty* const* mp = _method_id_map.seek(method_id);
+    return mp ? *mp : NULL;
+}
+
+void Server::BuildMethodIdMap() {
+    _method_id_map.clear();
+    for (MethodMap::const_iterator it = _method_map.begin();
+         it != _method_map.end(); ++it) {
+        const MethodProperty& mp = it->second;
+        if (mp.method == NULL || it->first != mp.method->full_name()) {
+            // Aliases without namespaces share the method.
+            continue;
+        }
+        const uint64_t id = MethodIdOf(it->first);
+        const MethodProperty** slot = &_method_id_map[id];
+        if (*slot != NULL) {
+            LOG(WARNING) << "Ids of " << it->first << " and "
+                         << (*slot)->method->full_name()
+                         << " collide, methods can only be found by names";
+            _method_id_map.clear();
+            return;
+        }
+        *slot = &mp;
+    }
+}
+
 const Server::ServiceProperty*
 Server::FindServicePropertyByFullName(const butil::StringPiece& fullname) const {
     return _fullname_service_map.seek(fullname);
@@ -2114,6 +2484,51 @@ int Server::MaxConcurrencyOf(google::protobuf::Service* service,
     return MaxConcurrencyOf(service->GetDescriptor()->full_name(), method_name);
 }
 
+int64_t& Server::MaxInflightRequestBytesOf(const butil::StringPiece& full_method_name) {
+    if (IsRunning()) {
+        LOG(WARNING) << "MaxInflightRequestBytesOf is only allowd before Server started";
+        return g_default_max_inflight_request_bytes_of_method;
+    }
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL || mp->status == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        _failed_to_set_max_concurrency_of_method = true;
+        return g_default_max_inflight_request_bytes_of_method;
+    }
+    return mp->max_inflight_request_bytes;
+}
+
+int64_t Server::MaxInflightRequestBytesOf(const butil::StringPiece& full_method_name) const {
+    const MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL || mp->status == NULL) {
+        return 0;
+    }
+    if (mp->max_inflight_request_bytes >= 0) {
+        return mp->max_inflight_request_bytes;
+    }
+    return _options.method_max_inflight_request_bytes;
+}
+
+int Server::current_shard() const {
+    if (_nshard <= 0) {
+        return -1;
+    }
+    const int shard = bthread_self_tag() - _options.bthread_tag;
+    return (shard >= 0 && shard < _nshard) ? shard : -1;
+}
+
+int Server::RunInShard(int shard, void* (*fn)(void*), void* arg) {
+    if (shard < 0 || shard >= _nshard) {
+        LOG(ERROR) << "Invalid shard=" << shard << ", shard_count=" << _nshard;
+        return EINVAL;
+    }
+    bthread_t th;
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.keytable_pool = _keytable_pool;
+    attr.tag = _options.bthread_tag + shard;
+    return bthread_start_background(&th, &attr, fn, arg);
+}
+
 #ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
 int Server::SSLSwitchCTXByHostname(struct ssl_st* ssl,
                                    int* al, Server* server) {
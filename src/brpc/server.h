@@ -25,6 +25,7 @@
 #include "bthread/errno.h"        // Redefine errno
 #include "bthread/bthread.h"      // Server may need some bthread functions,
                                   // e.g. bthread_usleep
+#include <set>
 #include <google/protobuf/service.h>                 // google::protobuf::Service
 #include "butil/macros.h"                            // DISALLOW_COPY_AND_ASSIGN
 #include "butil/containers/doubly_buffered_data.h"   // DoublyBufferedData
@@ -33,6 +34,9 @@
 #include "butil/ptr_container.h"
 #include "brpc/controller.h"                   // brpc::Controller
 #include "brpc/ssl_options.h"                  // ServerSSLOptions
+#include "brpc/response_cache_options.h"       // ResponseCacheOptions
+#include "brpc/method_executor_options.h"      // MethodExecutorOptions
+#include "brpc/socket_tuning_options.h"        // SocketTuningOptions
 #include "brpc/describable.h"                  // User often needs this
 #include "brpc/data_factory.h"                 // DataFactory
 #include "brpc/builtin/tabbed.h"
@@ -45,6 +49,8 @@
 namespace brpc {
 
 class Acceptor;
+class BaiduMasterService;
+class ListenFdHandover;
 class MethodStatus;
 class NsheadService;
 class ThriftService;
@@ -53,6 +59,8 @@ class MongoServiceAdaptor;
 class RestfulMap;
 class RtmpService;
 class RedisService;
+class ResponseCache;
+class MethodExecutor;
 struct SocketSSLContext;
 
 struct ServerOptions {
@@ -62,6 +70,12 @@ struct ServerOptions {
     // Default: -1 (disabled)
     int idle_timeout_sec;
 
+    // Set TCP congestion control, pacing rate, TOS and buffer sizes of
+    // accepted connections, see socket_tuning_options.h. Connections to
+    // internal_port are not affected.
+    // Default: all options are system defaults
+    SocketTuningOptions socket_tuning_options;
+
     // If this option is not empty, a file named so containing Process Id
     // of the server will be created when the server is started.
     // Default: ""
@@ -77,6 +91,12 @@ struct ServerOptions {
     // Default: NULL
     ThriftService* thrift_service;
 
+    // Process baidu_std requests to methods not added into the server,
+    // without parsing them. Useful for proxies, see baidu_master_service.h
+    // Owned by Server and deleted in server's destructor.
+    // Default: NULL
+    BaiduMasterService* baidu_master_service;
+
     // Adaptor for Mongo protocol, check src/brpc/mongo_service_adaptor.h for details
     // The adaptor will not be deleted by server
     // and must remain valid when server is running.
@@ -122,6 +142,32 @@ struct ServerOptions {
     // Overridable by Server.MaxConcurrencyOf().
     AdaptiveMaxConcurrency method_max_concurrency;
 
+    // Max total bytes of requests which are parsed but not responded yet,
+    // counting both payloads and metas. Sizes of requests are unrelated to
+    // max_concurrency, a burst of large requests may run the server out of
+    // memory even if the concurrency is low. When the limit is reached, the
+    // server stops reading from sockets until in-flight requests complete,
+    // which slows down clients with TCP flow control rather than failing
+    // requests.
+    // NOTE: only requests of baidu_std and http are counted.
+    // Default: 0 (unlimited)
+    int64_t max_inflight_request_bytes;
+
+    // Default value of method-level max in-flight request bytes,
+    // overridable by Server.MaxInflightRequestBytesOf(). Requests exceeding
+    // the limit of their method are rejected with ELIMIT.
+    // Default: 0 (unlimited)
+    int64_t method_max_inflight_request_bytes;
+
+    // [protobuf >= 3.0, baidu_std only] Allocate request and response of
+    // methods on a protobuf arena which is reused by later requests and
+    // reset after the response is sent, saving malloc/free of deeply nested
+    // messages. Services must not delete the messages or reference them
+    // after calling `done'. Messages allocated by users on
+    // Controller::arena() have the same lifetime.
+    // Default: false
+    bool use_pb_arena;
+
     // -------------------------------------------------------
     // Differences between session-local and thread-local data
     // -------------------------------------------------------
@@ -199,6 +245,71 @@ struct ServerOptions {
     // Default: true
     bool has_builtin_services;
 
+    // Listen to the port with one SO_REUSEPORT socket per EventDispatcher
+    // (-event_dispatcher_num, Linux >= 3.9). The kernel spreads incoming
+    // connections over the sockets so that accepting scales with the
+    // dispatchers, and each connection stays in the dispatcher accepting it.
+    // Not applied to unix domain sockets and internal_port.
+    // Default: false
+    bool reuse_port_per_dispatcher;
+
+    // [Linux] Accept the shared-memory transport asked by clients with
+    // -shm_transport on unix domain sockets, bytes of the connection are
+    // then carried by memory shared with the client process. Only enable
+    // this when clients are trusted, e.g. processes of the same user.
+    // Default: false
+    bool shm_transport;
+
+    // [Linux] Accept RDMA asked by clients with ChannelOptions.use_rdma on
+    // TCP connections, bytes of the connection are then carried by an RDMA
+    // queue pair. Needs brpc built with WITH_RDMA and an active device
+    // (-rdma_device), connections stay on TCP otherwise.
+    // Default: false
+    bool use_rdma;
+
+    // If this field is non-empty, the server takes over listening fds from
+    // the process serving at this unix domain socket path (e.g. the old
+    // process before restarting), accepts connections from them at once
+    // and then asks the old process to stop, thus no connections are
+    // refused during restarting. The port given to Start() is ignored when
+    // the fds are taken over. Later processes can take over fds from this
+    // server through the path as well. The old server is stopped after
+    // handover, Join() or RunUntilAskedToQuit() returns after existing
+    // requests are processed. Not applied to internal_port.
+    // Default: "" (not enabled)
+    std::string listen_fd_handover_path;
+
+    // Connections of this server are accepted and processed by bthread
+    // workers with this tag, so that servers with different tags do not
+    // share workers, e.g. put builtin or background services on an
+    // internal server with another tag to keep them from inflating latency
+    // of the serving path. Tags are in [0, -task_group_ntags).
+    // Default: BTHREAD_TAG_DEFAULT
+    bthread_tag_t bthread_tag;
+
+    // [Linux] Shared-nothing mode: split the server into one shard per
+    // EventDispatcher (-event_dispatcher_num). The i-th shard listens to
+    // the port with its own SO_REUSEPORT socket (reuse_port_per_dispatcher
+    // is implied), and its connections as well as bthreads processing
+    // requests from them run on workers with tag `bthread_tag + i', so
+    // that no connection, request or bthread migrates between shards.
+    // Tags of shards must exist (-task_group_ntags >= bthread_tag +
+    // -event_dispatcher_num). Give each tag one worker (e.g. set
+    // -bthread_concurrency to -task_group_ntags) to make a thread-per-core
+    // server in which workers never steal tasks from each other. Pass work
+    // across shards explicitly with Server::RunInShard().
+    // Default: false
+    bool shared_nothing;
+
+    // [Linux] Accept TCP Fast Open(TCP_FASTOPEN) on listening sockets with
+    // at most so many pending connections which haven't completed the
+    // handshake, so that requests of clients connecting with TFO(see
+    // SocketTuningOptions.tcp_fastopen) are processed one round trip
+    // earlier. The server side must be allowed by sysctl
+    // net.ipv4.tcp_fastopen(bit 2). Not applied to internal_port.
+    // Default: 0 (disabled)
+    int tcp_fastopen_queue_length;
+
     // Enable more secured code which protects internal information from exposure.
     bool security_mode() const { return internal_port >= 0 || !has_builtin_services; }
 
@@ -241,10 +352,23 @@ struct ServerOptions {
     // Default: NULL (disabled)
     RedisService* redis_service;
 
+    // Cache serialized responses of methods in memory, requests in baidu_std
+    // or http(pb services) with same method and bytes are answered with the
+    // cached response without parsing the request, running the method or
+    // serializing the response. Only responses of successful calls without
+    // streams or http headers set by the method are cached. The first request
+    // seeing a stale response runs the method to refresh the cache.
+    // Refer to `ResponseCacheOptions' for details.
+    bool has_response_cache_options() const { return _response_cache_options != NULL; }
+    const ResponseCacheOptions& response_cache_options() const
+    { return *_response_cache_options.get(); }
+    ResponseCacheOptions* mutable_response_cache_options();
+
 private:
     // SSLOptions is large and not often used, allocate it on heap to
     // prevent ServerOptions from being bloated in most cases.
     butil::PtrContainer<ServerSSLOptions> _ssl_options;
+    butil::PtrContainer<ResponseCacheOptions> _response_cache_options;
 };
 
 // This struct is originally designed to contain basic statistics of the
@@ -297,6 +421,29 @@ struct ServiceOptions {
     // option is turned on.
     // Default: false if BAIDU_INTERNAL is defined, otherwise true
     bool pb_bytes_to_base64;
+
+    // Run methods in executors added by Server::AddMethodExecutor(), keyed
+    // by names of methods (without the service name), valued by names of
+    // executors. Requests of baidu_std and http/h2 are applied.
+    // Default: empty (methods are run in bthreads of the server)
+    std::map<std::string, std::string> method_executors;
+
+    // If this flag is true, attachments of baidu_std requests to methods of
+    // the service are not buffered before running the methods. Instead the
+    // methods read them by Controller::ReadProgressiveAttachmentBy() while
+    // they're being received, and the attachments are not limited by
+    // -max_body_size. Useful for uploading huge files.
+    // Default: false
+    bool enable_progressive_read;
+
+    // Names of methods (without the service name) which never block and
+    // finish quickly (say in several microseconds, e.g. lookups in memory).
+    // baidu_std requests to these methods are run in the bthread reading
+    // the connection right after being cut, without creating and
+    // scheduling a new bthread for each request. Methods blocking or running
+    // long in this way delay other requests from the same connection.
+    // Default: empty
+    std::set<std::string> nonblocking_methods;
 };
 
 // Represent ports inside [min_port, max_port]
@@ -346,6 +493,11 @@ public:
             bool allow_default_url;
             bool allow_http_body_to_pb;
             bool pb_bytes_to_base64;
+            // NULL if the method is run in bthreads of the server.
+            MethodExecutor* executor;
+            bool enable_progressive_read;
+            // In ServiceOptions.nonblocking_methods.
+            bool run_inline;
             OpaqueParams();
         };
         OpaqueParams params;        
@@ -356,10 +508,13 @@ public:
         const google::protobuf::MethodDescriptor* method;
         MethodStatus* status;
         AdaptiveMaxConcurrency max_concurrency;
+        // -1 means ServerOptions.method_max_inflight_request_bytes.
+        int64_t max_inflight_request_bytes;
 
         MethodProperty();
     };
     typedef butil::FlatMap<std::string, MethodProperty> MethodMap;
+    typedef butil::FlatMap<uint64_t, const MethodProperty*> MethodIdMap;
 
     struct ThreadLocalOptions {
         bthread_key_t tls_key;
@@ -425,6 +580,16 @@ public:
     int AddService(google::protobuf::Service* service,
                    const ServiceOptions& options);
 
+    // Add an executor named `name' to run methods bound to it by
+    // ServiceOptions.method_executors, isolating them from other methods.
+    // Queueing of the executor is exported as bvar
+    // rpc_executor_<name>_queue_latency and rpc_executor_<name>_queue_size.
+    // NOTE: Must be called before adding services using the executor and
+    // adding executors while server is running is forbidden.
+    // Returns 0 on success, -1 otherwise.
+    int AddMethodExecutor(const std::string& name,
+                          const MethodExecutorOptions& options);
+
     // Remove a service from this server.
     // NOTE: removing a service while server is running is forbidden.
     // Returns 0 on success, -1 otherwise.
@@ -532,6 +697,28 @@ public:
     int MaxConcurrencyOf(google::protobuf::Service* service,
                          const butil::StringPiece& method_name) const;
 
+    // Get/set max bytes of in-flight requests of a method, overriding
+    // ServerOptions.method_max_inflight_request_bytes.
+    // Example:
+    //    server.MaxInflightRequestBytesOf("example.EchoService.Echo") = 64 << 20;
+    // Note: This interface can ONLY be called before the server is started.
+    int64_t& MaxInflightRequestBytesOf(const butil::StringPiece& full_method_name);
+    int64_t MaxInflightRequestBytesOf(const butil::StringPiece& full_method_name) const;
+
+    // Number of shards when ServerOptions.shared_nothing is on, 0 otherwise.
+    int shard_count() const { return _nshard; }
+
+    // Index of the shard running the calling bthread, -1 if the calling
+    // bthread is not in any shard of this server.
+    int current_shard() const;
+
+    // Run `fn(arg)' in a new bthread in the shard `shard', which is the way
+    // of passing messages between shards, e.g. forwarding a request to the
+    // shard owning its data. The bthread uses the keytable pool of the
+    // server as bthreads processing requests do.
+    // Returns 0 on success, errno otherwise.
+    int RunInShard(int shard, void* (*fn)(void*), void* arg);
+
 private:
 friend class StatusService;
 friend class ProtobufsService;
@@ -540,6 +727,7 @@ friend class BadMethodService;
 friend class ServerPrivateAccessor;
 friend class PrometheusMetricsService;
 friend class Controller;
+friend class ListenFdHandover;
 
     int AddServiceInternal(google::protobuf::Service* service,
                            bool is_builtin_service,
@@ -559,7 +747,9 @@ friend class Controller;
     // Create acceptor with handlers of protocols.
     Acceptor* BuildAcceptor();
 
-    int StartInternal(const butil::ip_t& ip,
+    // `endpoint' provides the ip when port_range is used, IPv6 and unix
+    // domain socket endpoints are listened as they are.
+    int StartInternal(const butil::EndPoint& endpoint,
                       const PortRange& port_range,
                       const ServerOptions *opt);
 
@@ -588,6 +778,17 @@ friend class Controller;
     const MethodProperty*
     FindMethodPropertyByNameAndIndex(const butil::StringPiece& service_name,
                                      int method_index) const;
+
+    // Find by MethodIdOf(method->full_name()), NULL if not found or ids of
+    // methods are ambiguous.
+    const MethodProperty* FindMethodPropertyById(uint64_t method_id) const;
+    bool has_method_ids() const { return !_method_id_map.empty(); }
+    // True if any method reads baidu_std attachments progressively.
+    bool has_progressive_read_methods() const
+    { return _has_progressive_read_methods; }
+    // True if any method is in ServiceOptions.nonblocking_methods.
+    bool has_nonblocking_methods() const
+    { return _has_nonblocking_methods; }
     
     const ServiceProperty*
     FindServicePropertyByFullName(const butil::StringPiece& fullname) const;
@@ -621,6 +822,9 @@ friend class Controller;
     static bool ResetCertMappings(CertMaps& bg, const SSLContextMap& ctx_map);
     static bool ClearCertMapping(CertMaps& bg);
 
+    // Fill _method_id_map with methods in _method_map.
+    void BuildMethodIdMap();
+
     AdaptiveMaxConcurrency& MaxConcurrencyOf(MethodProperty*);
     int MaxConcurrencyOf(const MethodProperty*) const;
     
@@ -635,12 +839,19 @@ friend class Controller;
     // number of the virtual services for mapping URL to methods.
     int _virtual_service_count;
     bool _failed_to_set_max_concurrency_of_method;
+    bool _has_progressive_read_methods;
+    bool _has_nonblocking_methods;
     Acceptor* _am;
     Acceptor* _internal_am;
+    ListenFdHandover* _listen_fd_handover;
     
     // Use method->full_name() as key
     MethodMap _method_map;
 
+    // Use MethodIdOf(method->full_name()) as key, built when server starts.
+    // Empty if ids of two methods collide.
+    MethodIdMap _method_id_map;
+
     // Use service->full_name() as key
     ServiceMap _fullname_service_map;
     
@@ -677,9 +888,21 @@ friend class Controller;
     
     bthread_keytable_pool_t* _keytable_pool;
 
+    // Created when ServerOptions.response_cache_options is set.
+    ResponseCache* _response_cache;
+
+    // Added by AddMethodExecutor(), deleted in destructor.
+    std::map<std::string, MethodExecutor*> _method_executors;
+
     // mutable is required for `ServerPrivateAccessor' to change this bvar
     mutable bvar::Adder<int64_t> _nerror_bvar;
     mutable int32_t BAIDU_CACHELINE_ALIGNMENT _concurrency;
+    // Bytes of requests being processed, limited by
+    // ServerOptions.max_inflight_request_bytes.
+    mutable butil::atomic<int64_t> BAIDU_CACHELINE_ALIGNMENT _inflight_request_bytes;
+
+    // Number of shards in shared-nothing mode, 0 otherwise.
+    int _nshard;
 
 };
 
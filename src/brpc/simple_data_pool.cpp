@@ -16,15 +16,19 @@
 // under the License.
 
 
+#include <algorithm>
+#include "butil/macros.h"
 #include "brpc/simple_data_pool.h"
 
 namespace brpc {
 
+static butil::static_atomic<unsigned> g_next_local_index =
+    BUTIL_STATIC_ATOMIC_INIT(0);
+static __thread unsigned tls_local_index = (unsigned)-1;
+
 SimpleDataPool::SimpleDataPool(const DataFactory* factory)
-    : _capacity(0)
-    , _size(0)
+    : _nfree(0)
     , _ncreated(0)
-    , _pool(NULL)
     , _factory(factory) {
 }
 
@@ -33,67 +37,106 @@ SimpleDataPool::~SimpleDataPool() {
 }
 
 void SimpleDataPool::Reset(const DataFactory* factory) {
-    unsigned saved_size = 0;
-    void** saved_pool = NULL;
+    std::vector<void*> saved;
     const DataFactory* saved_factory = NULL;
     {
-        BAIDU_SCOPED_LOCK(_mutex);
-        saved_size = _size;
-        saved_pool = _pool;
+        BAIDU_SCOPED_LOCK(_global.mutex);
+        for (size_t i = 0; i < NLOCAL; ++i) {
+            Transfer(&_local[i], &_global.data, _local[i].data.size());
+        }
+        saved.swap(_global.data);
         saved_factory = _factory;
-        _capacity = 0;
-        _size = 0;
+        _nfree.store(0, butil::memory_order_relaxed);
         _ncreated.store(0, butil::memory_order_relaxed);
-        _pool = NULL;
         _factory = factory;
     }
-    if (saved_pool) {
-        if (saved_factory) {
-            for (unsigned i = 0; i < saved_size; ++i) {
-                saved_factory->DestroyData(saved_pool[i]);
-            }
+    if (saved_factory) {
+        for (size_t i = 0; i < saved.size(); ++i) {
+            saved_factory->DestroyData(saved[i]);
         }
-        free(saved_pool);
     }
 }
 
 void SimpleDataPool::Reserve(unsigned n) {
-    if (_capacity >= n) {
-        return;
-    }
-    BAIDU_SCOPED_LOCK(_mutex);
-    if (_capacity >= n) {
-        return;
-    }
-    // Resize.
-    const unsigned new_cap = std::max(_capacity * 3 / 2, n);
-    void** new_pool = (void**)malloc(new_cap * sizeof(void*));
-    if (NULL == new_pool) {
+    if (_ncreated.load(butil::memory_order_relaxed) >= n) {
         return;
     }
-    if (_pool) {
-        memcpy(new_pool, _pool, _capacity * sizeof(void*));
-        free(_pool);
-    }
-    unsigned i = _capacity;
-    _capacity = new_cap;
-    _pool = new_pool;
-
-    for (; i < n; ++i) {
+    BAIDU_SCOPED_LOCK(_global.mutex);
+    while (_ncreated.load(butil::memory_order_relaxed) < n) {
         void* data = _factory->CreateData();
         if (data == NULL) {
             break;
         }
         _ncreated.fetch_add(1,  butil::memory_order_relaxed);
-        _pool[_size++] = data;
+        _global.data.push_back(data);
+        _nfree.fetch_add(1, butil::memory_order_relaxed);
+    }
+}
+
+SimpleDataPool::FreeList* SimpleDataPool::LocalList() {
+    if (BAIDU_UNLIKELY(tls_local_index == (unsigned)-1)) {
+        tls_local_index = g_next_local_index.fetch_add(
+            1, butil::memory_order_relaxed) % NLOCAL;
+    }
+    return &_local[tls_local_index];
+}
+
+void* SimpleDataPool::Pop(FreeList* list) {
+    if (list->data.empty()) {
+        return NULL;
     }
+    void* data = list->data.back();
+    list->data.pop_back();
+    _nfree.fetch_sub(1, butil::memory_order_relaxed);
+    return data;
+}
+
+void SimpleDataPool::Transfer(FreeList* from, std::vector<void*>* to,
+                              size_t n) {
+    BAIDU_SCOPED_LOCK(from->mutex);
+    n = std::min(n, from->data.size());
+    to->insert(to->end(), from->data.end() - n, from->data.end());
+    from->data.resize(from->data.size() - n);
 }
 
 void* SimpleDataPool::Borrow() {
-    if (_size) {
-        BAIDU_SCOPED_LOCK(_mutex);
-        if (_size) {
-            return _pool[--_size];
+    if (_nfree.load(butil::memory_order_relaxed) != 0) {
+        FreeList* local = LocalList();
+        {
+            BAIDU_SCOPED_LOCK(local->mutex);
+            void* data = Pop(local);
+            if (data) {
+                return data;
+            }
+        }
+        // Refill from the global list.
+        std::vector<void*> batch;
+        {
+            BAIDU_SCOPED_LOCK(_global.mutex);
+            const size_t n = std::min(_global.data.size(), MAX_LOCAL_SIZE / 2);
+            batch.assign(_global.data.end() - n, _global.data.end());
+            _global.data.resize(_global.data.size() - n);
+        }
+        if (!batch.empty()) {
+            void* data = batch.back();
+            batch.pop_back();
+            _nfree.fetch_sub(1, butil::memory_order_relaxed);
+            if (!batch.empty()) {
+                BAIDU_SCOPED_LOCK(local->mutex);
+                local->data.insert(local->data.end(), batch.begin(), batch.end());
+            }
+            return data;
+        }
+        // Steal from other workers, skipping busy ones.
+        for (size_t i = 0; i < NLOCAL; ++i) {
+            FreeList* other = &_local[i];
+            if (other != local && other->mutex.try_lock()) {
+                void* data = Pop(other);
+                other->mutex.unlock();
+                if (data) {
+                    return data;
+                }
+            }
         }
     }
     void* data = _factory->CreateData();
@@ -110,28 +153,28 @@ void SimpleDataPool::Return(void* data) {
     if (!_factory->ResetData(data)) {
         return _factory->DestroyData(data); 
     }
-    std::unique_lock<butil::Mutex> mu(_mutex);
-    if (_capacity == _size) {
-        const unsigned new_cap = (_capacity <= 1 ? 128 : (_capacity * 3 / 2));
-        void** new_pool = (void**)malloc(new_cap * sizeof(void*));
-        if (NULL == new_pool) {
-            mu.unlock();
-            return _factory->DestroyData(data);
-        }
-        if (_pool) {
-            memcpy(new_pool, _pool, _capacity * sizeof(void*));
-            free(_pool);
+    FreeList* local = LocalList();
+    std::vector<void*> overflow;
+    {
+        BAIDU_SCOPED_LOCK(local->mutex);
+        local->data.push_back(data);
+        _nfree.fetch_add(1, butil::memory_order_relaxed);
+        if (local->data.size() > MAX_LOCAL_SIZE) {
+            const size_t n = local->data.size() / 2;
+            overflow.assign(local->data.begin(), local->data.begin() + n);
+            local->data.erase(local->data.begin(), local->data.begin() + n);
         }
-        _capacity = new_cap;
-        _pool = new_pool;
     }
-    _pool[_size++] = data;
+    if (!overflow.empty()) {
+        BAIDU_SCOPED_LOCK(_global.mutex);
+        _global.data.insert(_global.data.end(), overflow.begin(), overflow.end());
+    }
 }
 
 SimpleDataPool::Stat SimpleDataPool::stat() const {
-    Stat s = { _size, _ncreated.load(butil::memory_order_relaxed) };
+    Stat s = { _nfree.load(butil::memory_order_relaxed),
+               _ncreated.load(butil::memory_order_relaxed) };
     return s;
 }
 
 } // namespace brpc
-
@@ -19,18 +19,23 @@
 #ifndef BRPC_SIMPLE_DATA_POOL_H
 #define BRPC_SIMPLE_DATA_POOL_H
 
+#include <vector>
 #include "butil/scoped_lock.h"
+#include "butil/atomicops.h"
 #include "brpc/data_factory.h"
 
 
 namespace brpc {
 
 // As the name says, this is a simple unbounded dynamic-size pool for
-// reusing void* data. We're assuming that data consumes considerable
-// memory and should be reused as much as possible, thus unlike the
-// multi-threaded allocator caching objects thread-locally, we just
-// put everything in a global list to maximize sharing. It's currently
-// used by Server to reuse session-local data. 
+// reusing void* data. It's currently used by Server to reuse session-local
+// data.
+// Data is borrowed from and returned to the free list of current worker
+// (pthread) to avoid contentions on a global lock. We're assuming that data
+// consumes considerable memory and should be reused as much as possible,
+// thus each free list keeps a few data only, the rest is moved to a global
+// list shared by all workers. A worker finding both lists empty steals data
+// from other workers before creating new data.
 class SimpleDataPool {
 public:
     struct Stat {
@@ -47,11 +52,27 @@ public:
     Stat stat() const;
     
 private:
-    butil::Mutex _mutex;
-    unsigned _capacity;
-    unsigned _size;
+    struct BAIDU_CACHELINE_ALIGNMENT FreeList {
+        butil::Mutex mutex;
+        std::vector<void*> data;
+    };
+
+    // Number of free lists of workers. Workers are mapped to the lists
+    // round-robin.
+    static const size_t NLOCAL = 32;
+    // A free list of worker moves half of its data to the global list when
+    // it has more data than this.
+    static const size_t MAX_LOCAL_SIZE = 32;
+
+    FreeList* LocalList();
+    void* Pop(FreeList* list);
+    // Move at most `n' data from `from' into `to' which is locked already.
+    static void Transfer(FreeList* from, std::vector<void*>* to, size_t n);
+
+    FreeList _local[NLOCAL];
+    FreeList _global;
+    butil::atomic<unsigned> _nfree;
     butil::atomic<unsigned> _ncreated;
-    void** _pool;
     const DataFactory* _factory;
 };
 
@@ -25,6 +25,7 @@
 #include <mesalink/openssl/x509.h>
 #endif
 #include <netinet/tcp.h>                         // getsockopt
+#include <limits.h>                              // UINT_MAX
 #include <gflags/gflags.h>
 #include "bthread/unstable.h"                    // bthread_timer_del
 #include "butil/fd_utility.h"                     // make_non_blocking
@@ -34,6 +35,7 @@
 #include "butil/logging.h"                        // CHECK
 #include "butil/macros.h"
 #include "butil/class_name.h"                     // butil::class_name
+#include "butil/usdt.h"                           // BUTIL_USDT3
 #include "brpc/log.h"
 #include "brpc/reloadable_flags.h"          // BRPC_VALIDATE_GFLAG
 #include "brpc/errno.pb.h"
@@ -48,9 +50,27 @@
 #include "brpc/policy/rtmp_protocol.h"  // FIXME
 #include "brpc/periodic_task.h"
 #include "brpc/details/health_check.h"
+#include "brpc/details/ssl_handshake_pool.h" // DoSSLHandshakeStep
+#include "brpc/details/shm_transport.h"
+#include "brpc/rdma/rdma_endpoint.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "bvar/multi_dimension.h"
 #if defined(OS_MACOSX)
 #include <sys/event.h>
 #endif
+#if defined(OS_LINUX)
+#include <linux/errqueue.h>                      // sock_extended_err
+#include <sys/sendfile.h>                        // sendfile
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif
 
 namespace bthread {
 size_t __attribute__((weak))
@@ -79,14 +99,67 @@ DEFINE_int32(socket_send_buffer_size, -1,
 
 DEFINE_int32(ssl_bio_buffer_size, 16*1024, "Set buffer size for SSL read/write");
 
+DEFINE_bool(ssl_ktls, false, "Offload encryption of SSL connections to the "
+            "kernel(kTLS) when the cipher is supported, so that data is written "
+            "by plain writev. Requires OpenSSL >= 3.0 with kTLS and the tls "
+            "module of Linux kernel");
+BRPC_VALIDATE_GFLAG(ssl_ktls, PassValidate);
+
 DEFINE_int64(socket_max_unwritten_bytes, 64 * 1024 * 1024,
              "Max unwritten bytes in each socket, if the limit is reached,"
              " Socket.Write fails with EOVERCROWDED");
 
+DEFINE_bool(socket_zerocopy, false,
+            "Send large writes with MSG_ZEROCOPY(linux >= 4.14) on newly "
+            "created sockets to avoid copying data into the kernel");
+
+DEFINE_int64(socket_zerocopy_min_bytes, 64 * 1024,
+             "Writes with fewer bytes than this value are copied into the "
+             "kernel even if -socket_zerocopy is on, since pinning pages and "
+             "reaping completions cost more than copying small data");
+BRPC_VALIDATE_GFLAG(socket_zerocopy_min_bytes, PassValidate);
+
+DEFINE_int32(socket_write_coalescing_us, 0,
+             "Writes into a socket are delayed for so many microseconds to be"
+             " written together with later writes in one writev, unless the"
+             " socket has its own coalescing window. <= 0 means no delay");
+BRPC_VALIDATE_GFLAG(socket_write_coalescing_us, PassValidate);
+
+DEFINE_bool(socket_write_cork, false,
+            "Set TCP_CORK on the socket while more pending writes are to be"
+            " written in the background, so that small writes are merged"
+            " into full packets. Cleared after the pending writes are written"
+            " or the socket becomes unwritable");
+BRPC_VALIDATE_GFLAG(socket_write_cork, PassValidate);
+
+DEFINE_bool(socket_keep_epollout, false,
+            "Keep connections watching EPOLLOUT (edge-triggered) after they "
+            "wait for writability for the first time, instead of adding and "
+            "removing EPOLLOUT with two epoll_ctl for each wait. EPOLLOUT of "
+            "connections without waiters are ignored. Not applied to io_uring");
+BRPC_VALIDATE_GFLAG(socket_keep_epollout, PassValidate);
+
+DEFINE_bool(socket_worker_affinity, false,
+            "Start bthreads processing events of a socket on the bthread "
+            "worker chosen by its SocketId, so that messages of a connection "
+            "and bthreads spawned for them mostly stay on one worker");
+BRPC_VALIDATE_GFLAG(socket_worker_affinity, PassValidate);
+
+DEFINE_bool(socket_sample_tcp_info, false,
+            "Sample TCP_INFO of each connection every second, show it in "
+            "/connections and export it per remote endpoint of client "
+            "connections as rpc_socket_tcp_* bvars");
+BRPC_VALIDATE_GFLAG(socket_sample_tcp_info, PassValidate);
+
 DEFINE_int32(max_connection_pool_size, 100,
              "Max number of pooled connections to a single endpoint");
 BRPC_VALIDATE_GFLAG(max_connection_pool_size, PassValidate);
 
+DEFINE_int32(min_connection_pool_size, 0,
+             "Pooled connections to a single endpoint are connected in "
+             "advance and kept until there're so many of them");
+BRPC_VALIDATE_GFLAG(min_connection_pool_size, NonNegativeInteger);
+
 DEFINE_int32(connect_timeout_as_unreachable, 3,
              "If the socket failed to connect due to ETIMEDOUT for so many "
              "times *continuously*, the error is changed to ENETUNREACH which "
@@ -102,15 +175,21 @@ BRPC_VALIDATE_GFLAG(connect_timeout_as_unreachable,
 
 const int WAIT_EPOLLOUT_TIMEOUT_MS = 50;
 
+// After the fd is closed, completions of zero-copy writes can't be received
+// anymore while the kernel may still be transmitting the pages. Blocks of
+// these writes are released after this delay instead of immediately.
+const int ZEROCOPY_LINGER_MS = 30000;
+
 class BAIDU_CACHELINE_ALIGNMENT SocketPool {
 friend class Socket;
 public:
     explicit SocketPool(const SocketOptions& opt);
     ~SocketPool();
 
-    // Get an address-able socket. If the pool is empty, create one.
+    // Get an address-able socket. If the pool is empty, create one and
+    // set `*created' to true.
     // Returns 0 on success.
-    int GetSocket(SocketUniquePtr* ptr);
+    int GetSocket(SocketUniquePtr* ptr, bool* created);
     
     // Return a socket (which was returned by GetSocket) back to the pool,
     // if the pool is full, setfail the socket directly.
@@ -118,8 +197,32 @@ public:
     
     // Get all pooled sockets inside.
     void ListSockets(std::vector<SocketId>* list, size_t max_count);
-    
+
+    // Returns true if sockets can be connected by ConnectSocket().
+    bool CanConnectInAdvance() const { return _options.app_connect == NULL; }
+
+    // Reserve sockets to be connected by ConnectSocket() so that the pool
+    // has at most `count' sockets including in-flight ones.
+    // Returns number of reserved sockets.
+    int ReserveSockets(int count);
+
+    // Connect a socket reserved by ReserveSockets() and put it into the pool.
+    void ConnectSocket();
+
+    // Close one free socket if sockets exceed the max of in-flight sockets
+    // since last call and -min_connection_pool_size.
+    void Shrink();
+
+    // Number of free, in-flight and connecting sockets.
+    int size() const {
+        return _numfree.load(butil::memory_order_relaxed) +
+            _numinflight.load(butil::memory_order_relaxed) +
+            _numconnecting.load(butil::memory_order_relaxed);
+    }
+
 private:
+    void AddInflight();
+
     // options used to create this instance
     SocketOptions _options;
     butil::Mutex _mutex;
@@ -127,6 +230,37 @@ private:
     butil::EndPoint _remote_side;
     butil::atomic<int> _numfree; // #free sockets in all sub pools.
     butil::atomic<int> _numinflight; // #inflight sockets in all sub pools.
+    butil::atomic<int> _numconnecting; // #sockets being connected in advance.
+    butil::atomic<int> _peak_inflight; // max _numinflight since last Shrink().
+};
+
+// Connections to the same place as a main socket which are multiplexed by
+// calls with CONNECTION_TYPE_SINGLE, so that writing to and reading from
+// one server are spread to several connections and bthreads.
+class SocketGroup {
+public:
+    // The main socket is one of `count' connections.
+    SocketGroup(const SocketOptions& opt, int count);
+    ~SocketGroup();
+
+    int size() const { return _size; }
+
+    // Get the connection with least unwritten bytes among `main' and other
+    // connections of the group, which are created if absent or failed.
+    // Returns 0 on success.
+    int GetSocket(Socket* main, SocketUniquePtr* ptr);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SocketGroup);
+
+    SocketOptions _options;
+    int _size;
+    butil::Mutex _mutex;
+    // Connections except the main socket.
+    std::unique_ptr<butil::atomic<SocketId>[]> _ids;
+    // Connections are checked starting from this index so that calls are
+    // spread evenly when no connection has unwritten bytes.
+    butil::atomic<uint32_t> _next;
 };
 
 // NOTE: sizeof of this class is 1200 bytes. If we have 10K sockets, total
@@ -146,11 +280,16 @@ struct ExtendedSocketStat : public SocketStat {
     };
     SparseMinuteCounter<Sampled> _minute_counter;
 
+    uint32_t last_tcp_total_retrans;
+    // Label of per-endpoint tcp vars, empty if not exported.
+    std::string tcp_vars_remote;
+
     ExtendedSocketStat()
         : last_in_size(0)
         , last_in_num_messages(0)
         , last_out_size(0)
-        , last_out_num_messages(0) {
+        , last_out_num_messages(0)
+        , last_tcp_total_retrans(0) {
         memset((SocketStat*)this, 0, sizeof(SocketStat));
     }
 };
@@ -166,6 +305,10 @@ public:
     // which has the disadvantage that accesses to different pools contend
     // with each other.
     butil::atomic<SocketPool*> socket_pool;
+
+    // Multiplexed connections of CONNECTION_TYPE_SINGLE, NULL if only
+    // the main socket is used.
+    butil::atomic<SocketGroup*> socket_group;
     
     // The socket newing this object.
     SocketId creator_socket_id;
@@ -192,10 +335,15 @@ public:
 
     // Call this method every second (roughly)
     void UpdateStatsEverySecond(int64_t now_ms);
+
+    // Sample TCP_INFO of `fd' into extended_stat, export it to bvars
+    // labeled with `remote' if it's not empty.
+    void UpdateTcpInfo(int fd, const std::string& remote);
 };
 
 Socket::SharedPart::SharedPart(SocketId creator_socket_id2)
     : socket_pool(NULL)
+    , socket_group(NULL)
     , creator_socket_id(creator_socket_id2)
     , num_continuous_connect_timeouts(0)
     , in_size(0)
@@ -206,10 +354,16 @@ Socket::SharedPart::SharedPart(SocketId creator_socket_id2)
     , recent_error_count(0) {
 }
 
+static void RemoveTcpInfoVars(const std::string& remote);
+
 Socket::SharedPart::~SharedPart() {
+    if (extended_stat != NULL && !extended_stat->tcp_vars_remote.empty()) {
+        RemoveTcpInfoVars(extended_stat->tcp_vars_remote);
+    }
     delete extended_stat;
     extended_stat = NULL;
     delete socket_pool.exchange(NULL, butil::memory_order_relaxed);
+    delete socket_group.exchange(NULL, butil::memory_order_relaxed);
 }
 
 void Socket::SharedPart::UpdateStatsEverySecond(int64_t now_ms) {
@@ -271,6 +425,142 @@ void Socket::SharedPart::UpdateStatsEverySecond(int64_t now_ms) {
     }
 }
 
+#if defined(OS_LINUX)
+// struct tcp_info of glibc stops at tcpi_total_retrans, this is the layout
+// of the kernel until tcpi_delivery_rate. Older kernels fill a prefix.
+struct KernelTcpInfo {
+    uint8_t state;
+    uint8_t ca_state;
+    uint8_t retransmits;
+    uint8_t probes;
+    uint8_t backoff;
+    uint8_t options;
+    uint8_t wscale;
+    uint8_t delivery_rate_app_limited;
+    uint32_t rto;
+    uint32_t ato;
+    uint32_t snd_mss;
+    uint32_t rcv_mss;
+    uint32_t unacked;
+    uint32_t sacked;
+    uint32_t lost;
+    uint32_t retrans;
+    uint32_t fackets;
+    uint32_t last_data_sent;
+    uint32_t last_ack_sent;
+    uint32_t last_data_recv;
+    uint32_t last_ack_recv;
+    uint32_t pmtu;
+    uint32_t rcv_ssthresh;
+    uint32_t rtt;
+    uint32_t rttvar;
+    uint32_t snd_ssthresh;
+    uint32_t snd_cwnd;
+    uint32_t advmss;
+    uint32_t reordering;
+    uint32_t rcv_rtt;
+    uint32_t rcv_space;
+    uint32_t total_retrans;
+    uint64_t pacing_rate;
+    uint64_t max_pacing_rate;
+    uint64_t bytes_acked;
+    uint64_t bytes_received;
+    uint32_t segs_out;
+    uint32_t segs_in;
+    uint32_t notsent_bytes;
+    uint32_t min_rtt;
+    uint32_t data_segs_in;
+    uint32_t data_segs_out;
+    uint64_t delivery_rate;
+};
+#endif
+
+struct TcpInfoVars {
+    bvar::MultiDimension<bvar::Status<int64_t> > rtt_us;
+    bvar::MultiDimension<bvar::Status<int64_t> > rttvar_us;
+    bvar::MultiDimension<bvar::Status<int64_t> > snd_cwnd;
+    bvar::MultiDimension<bvar::Status<int64_t> > unacked;
+    bvar::MultiDimension<bvar::Status<int64_t> > delivery_rate;
+    bvar::MultiDimension<bvar::Adder<int64_t> > retrans;
+
+    TcpInfoVars()
+        : rtt_us("rpc_socket_tcp_rtt_us", {"remote"})
+        , rttvar_us("rpc_socket_tcp_rttvar_us", {"remote"})
+        , snd_cwnd("rpc_socket_tcp_snd_cwnd", {"remote"})
+        , unacked("rpc_socket_tcp_unacked", {"remote"})
+        , delivery_rate("rpc_socket_tcp_delivery_rate", {"remote"})
+        , retrans("rpc_socket_tcp_retrans_count", {"remote"}) {}
+};
+
+static TcpInfoVars* GetTcpInfoVars() {
+    return butil::get_leaky_singleton<TcpInfoVars>();
+}
+
+static void RemoveTcpInfoVars(const std::string& remote) {
+    const std::list<std::string> labels(1, remote);
+    TcpInfoVars* vars = GetTcpInfoVars();
+    vars->rtt_us.delete_stats(labels);
+    vars->rttvar_us.delete_stats(labels);
+    vars->snd_cwnd.delete_stats(labels);
+    vars->unacked.delete_stats(labels);
+    vars->delivery_rate.delete_stats(labels);
+    vars->retrans.delete_stats(labels);
+}
+
+void Socket::SharedPart::UpdateTcpInfo(int fd, const std::string& remote) {
+    ExtendedSocketStat* stat = extended_stat;
+    if (stat == NULL) {
+        return;
+    }
+#if defined(OS_LINUX)
+    KernelTcpInfo ti;
+    memset(&ti, 0, sizeof(ti));
+    socklen_t len = sizeof(ti);
+    if (getsockopt(fd, SOL_TCP, TCP_INFO, &ti, &len) != 0) {
+        return;
+    }
+    const uint32_t total_retrans = ti.total_retrans;
+    stat->tcp_rtt_us = ti.rtt;
+    stat->tcp_rttvar_us = ti.rttvar;
+    stat->tcp_retrans_s = total_retrans - stat->last_tcp_total_retrans;
+    stat->tcp_snd_cwnd = ti.snd_cwnd;
+    stat->tcp_unacked = ti.unacked;
+    stat->tcp_delivery_rate = ti.delivery_rate;
+    stat->last_tcp_total_retrans = total_retrans;
+    if (remote.empty()) {
+        return;
+    }
+    const std::list<std::string> labels(1, remote);
+    TcpInfoVars* vars = GetTcpInfoVars();
+    bvar::Status<int64_t>* gauge = vars->rtt_us.get_stats(labels);
+    if (gauge == NULL) {
+        // Too many stats.
+        return;
+    }
+    stat->tcp_vars_remote = remote;
+    gauge->set_value(stat->tcp_rtt_us);
+    if ((gauge = vars->rttvar_us.get_stats(labels)) != NULL) {
+        gauge->set_value(stat->tcp_rttvar_us);
+    }
+    if ((gauge = vars->snd_cwnd.get_stats(labels)) != NULL) {
+        gauge->set_value(stat->tcp_snd_cwnd);
+    }
+    if ((gauge = vars->unacked.get_stats(labels)) != NULL) {
+        gauge->set_value(stat->tcp_unacked);
+    }
+    if ((gauge = vars->delivery_rate.get_stats(labels)) != NULL) {
+        gauge->set_value(stat->tcp_delivery_rate);
+    }
+    bvar::Adder<int64_t>* retrans = vars->retrans.get_stats(labels);
+    if (retrans != NULL && stat->tcp_retrans_s != 0) {
+        *retrans << stat->tcp_retrans_s;
+    }
+#else
+    (void)fd;
+    (void)remote;
+#endif
+}
+
 SocketVarsCollector* g_vars = NULL;
 
 static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
@@ -297,6 +587,22 @@ bool Socket::CreatedByConnect() const {
 SocketMessage* const DUMMY_USER_MESSAGE = (SocketMessage*)0x1;
 const uint32_t MAX_PIPELINED_COUNT = 32768;
 
+struct Socket::ZeroCopyBuffer {
+    butil::IOBuf data;
+    bool completed;
+};
+
+// A region of file written after data of a WriteRequest, and `suffix' is
+// written after the region.
+struct FileRegion {
+    int fd;
+    off_t offset;
+    size_t length;
+    butil::IOBuf suffix;
+};
+// FileRegion are allocated by new and aligned, the lowest bits are free.
+static const uint64_t FILE_REGION_TAG = 0x2;
+
 struct BAIDU_CACHELINE_ALIGNMENT Socket::WriteRequest {
     static WriteRequest* const UNCONNECTED;
     
@@ -315,7 +621,8 @@ struct BAIDU_CACHELINE_ALIGNMENT Socket::WriteRequest {
         _pc_and_udmsg &= 0xFFFFFFFFFFFFULL;
     }
     SocketMessage* user_message() const {
-        return (SocketMessage*)(_pc_and_udmsg & 0xFFFFFFFFFFFFULL);
+        const uint64_t p = (_pc_and_udmsg & 0xFFFFFFFFFFFFULL);
+        return (p & FILE_REGION_TAG) ? NULL : (SocketMessage*)p;
     }
     void clear_user_message() {
         _pc_and_udmsg &= 0xFFFF000000000000ULL;
@@ -343,6 +650,36 @@ struct BAIDU_CACHELINE_ALIGNMENT Socket::WriteRequest {
         return false;
     }
 
+    // The place of user message is taken by the file region written after
+    // `data', which is distinguished by FILE_REGION_TAG. Bytes of requests
+    // with file regions are counted into unwritten bytes by WriteFile()
+    // rather than Setup().
+    FileRegion* file() const {
+        const uint64_t p = (_pc_and_udmsg & 0xFFFFFFFFFFFFULL);
+        return (p & FILE_REGION_TAG) ?
+            (FileRegion*)(p & ~FILE_REGION_TAG) : NULL;
+    }
+    void set_file(FileRegion* f) {
+        _pc_and_udmsg = (_pc_and_udmsg & 0xFFFF000000000000ULL) |
+            (uint64_t)(uintptr_t)f | FILE_REGION_TAG;
+    }
+    void clear_file() {
+        FileRegion* f = file();
+        if (f) {
+            close(f->fd);
+            delete f;
+            _pc_and_udmsg &= 0xFFFF000000000000ULL;
+        }
+    }
+
+    // True when nothing of this request remains to be written.
+    bool empty() const { return data.empty() && file() == NULL; }
+
+    size_t unwritten_size() const {
+        const FileRegion* f = file();
+        return data.size() + (f ? f->length + f->suffix.size() : 0);
+    }
+
     // Register pipelined_count and user_message
     void Setup(Socket* s);
     
@@ -363,11 +700,7 @@ void Socket::WriteRequest::Setup(Socket* s) {
                 return;
             }
         }
-        const int64_t before_write =
-            s->_unwritten_bytes.fetch_add(data.size(), butil::memory_order_relaxed);
-        if (before_write + (int64_t)data.size() >= FLAGS_socket_max_unwritten_bytes) {
-            s->_overcrowded = true;
-        }
+        s->AddUnwrittenBytes(data.size());
     }
     const uint32_t pc = pipelined_count();
     if (pc) {
@@ -417,42 +750,65 @@ Socket::Socket(Forbidden)
     // must be even because Address() relies on evenness of version
     : _versioned_ref(0)
     , _shared_part(NULL)
-    , _nevent(0)
-    , _keytable_pool(NULL)
+    , _this_id(0)
     , _fd(-1)
-    , _tos(0)
-    , _reset_fd_real_us(-1)
     , _on_edge_triggered_events(NULL)
     , _user(NULL)
     , _conn(NULL)
-    , _this_id(0)
+    , _keytable_pool(NULL)
+    , _bthread_tag(BTHREAD_TAG_INVALID)
+    , _ssl_state(SSL_UNKNOWN)
+    , _ssl_session(NULL)
+    , _ktls_send(false)
+    , _connection_type_for_progressive_read(CONNECTION_TYPE_UNKNOWN)
+    , _controller_released_socket(false)
+    , _single_connection_disabled(false)
+    , _compact_rpc_meta(false)
+    , _write_coalescing_us(0)
+    , _logoff_flag(false)
+    , _nevent(0)
     , _preferred_index(-1)
-    , _hc_count(0)
     , _last_msg_size(0)
     , _avg_msg_size(0)
+    , _read_size(0)
     , _last_readtime_us(0)
     , _parsing_context(NULL)
     , _correlation_id(0)
-    , _health_check_interval_s(-1)
     , _ninprocess(1)
+    , _write_head(NULL)
+    , _overcrowded(false)
+    , _last_writetime_us(0)
+    , _unwritten_bytes(0)
+    , _unwritten_bytes_max(0)
+    , _novercrowded(0)
+    , _write_probe(NULL)
+    , _write_probe_us(0)
+    , _write_queue_max_us(0)
+    , _epollout_butex(NULL)
+    , _nepollout_waiter(0)
+    , _epollout_kept(false)
+    , _tos(0)
+    , _reset_fd_real_us(-1)
+    , _event_dispatcher_index(-1)
+    , _hc_count(0)
+    , _health_check_interval_s(-1)
     , _auth_flag_error(0)
     , _auth_id(INVALID_BTHREAD_ID)
     , _auth_context(NULL)
-    , _ssl_state(SSL_UNKNOWN)
-    , _ssl_session(NULL)
-    , _connection_type_for_progressive_read(CONNECTION_TYPE_UNKNOWN)
-    , _controller_released_socket(false)
-    , _overcrowded(false)
     , _fail_me_at_server_stop(false)
-    , _logoff_flag(false)
     , _recycle_flag(false)
     , _error_code(0)
     , _pipeline_q(NULL)
-    , _last_writetime_us(0)
-    , _unwritten_bytes(0)
-    , _epollout_butex(NULL)
-    , _write_head(NULL)
     , _stream_set(NULL)
+    , _zerocopy_enabled(false)
+    , _zerocopy_q(NULL)
+    , _zerocopy_first_id(0)
+    , _shm_transport(NULL)
+    , _shm_hello_expected(false)
+    , _shm_transport_accepted(false)
+    , _rdma_endpoint(NULL)
+    , _rdma_hello_expected(false)
+    , _rdma_accepted(false)
     , _ninflight_app_health_check(0)
 {
     CreateVarsOnce();
@@ -466,7 +822,9 @@ Socket::~Socket() {
 }
 
 void Socket::ReturnSuccessfulWriteRequest(Socket::WriteRequest* p) {
-    DCHECK(p->data.empty());
+    DCHECK(p->empty());
+    BUTIL_USDT3(brpc, socket_write_done, id(), p, 0);
+    FinishWriteProbe(p, true);
     AddOutputMessages(1);
     const bthread_id_t id_wait = p->id_wait;
     butil::return_object(p);
@@ -477,10 +835,13 @@ void Socket::ReturnSuccessfulWriteRequest(Socket::WriteRequest* p) {
 
 void Socket::ReturnFailedWriteRequest(Socket::WriteRequest* p, int error_code,
                                       const std::string& error_text) {
+    BUTIL_USDT3(brpc, socket_write_done, id(), p, error_code);
+    FinishWriteProbe(p, false);
     if (!p->reset_pipelined_count_and_user_message()) {
-        CancelUnwrittenBytes(p->data.size());
+        CancelUnwrittenBytes(p->unwritten_size());
     }
     p->data.clear();  // data is probably not written.
+    p->clear_file();
     const bthread_id_t id_wait = p->id_wait;
     butil::return_object(p);
     if (id_wait != INVALID_BTHREAD_ID) {
@@ -509,17 +870,24 @@ void Socket::ReleaseAllFailedWriteRequests(Socket::WriteRequest* req) {
     do {
         req = ReleaseWriteRequestsExceptLast(req, error_code, error_text);
         if (!req->reset_pipelined_count_and_user_message()) {
-            CancelUnwrittenBytes(req->data.size());
+            CancelUnwrittenBytes(req->unwritten_size());
         }
         req->data.clear();  // MUST, otherwise IsWriteComplete is false
+        req->clear_file();
     } while (!IsWriteComplete(req, true, NULL));
     ReturnFailedWriteRequest(req, error_code, error_text);
 }
 
-int Socket::ResetFileDescriptor(int fd) {
+int Socket::ResetFileDescriptor(int fd, bool nonblocking_cloexec) {
     // Reset message sizes when fd is changed.
     _last_msg_size = 0;
     _avg_msg_size = 0;
+    _read_size = 0;
+    // The peer may be a different server now.
+    _compact_rpc_meta.store(false, butil::memory_order_relaxed);
+    _epollout_kept = false;
+    _shm_hello_expected = false;
+    _rdma_hello_expected = false;
     // MUST store `_fd' before adding itself into epoll device to avoid
     // race conditions with the callback function inside epoll
     _fd.store(fd, butil::memory_order_release);
@@ -531,27 +899,54 @@ int Socket::ResetFileDescriptor(int fd) {
     if (butil::get_local_side(fd, &_local_side) != 0) {
         _local_side = butil::EndPoint();
     }
-
-    // FIXME : close-on-exec should be set by new syscalls or worse: set right
-    // after fd-creation syscall. Setting at here has higher probabilities of
-    // race condition.
-    butil::make_close_on_exec(fd);
-
-    // Make the fd non-blocking.
-    if (butil::make_non_blocking(fd) != 0) {
-        PLOG(ERROR) << "Fail to set fd=" << fd << " to non-blocking";
-        return -1;
+    // Clients with -shm_transport send the hello first, see ReadShmHello().
+    // The hello is declined unless SocketOptions.shm_transport is set.
+    _shm_hello_expected = (_on_edge_triggered_events != NULL &&
+                           !CreatedByConnect() &&
+                           butil::get_endpoint_type(_local_side) == AF_UNIX);
+    // Same for clients with ChannelOptions.use_rdma, see ReadRdmaHello().
+    // The hello is declined unless SocketOptions.use_rdma is set.
+    const int family = butil::get_endpoint_type(_local_side);
+    _rdma_hello_expected = (_on_edge_triggered_events != NULL &&
+                            !CreatedByConnect() &&
+                            (family == AF_INET || family == AF_INET6));
+
+    if (!nonblocking_cloexec) {
+        // FIXME : close-on-exec should be set by new syscalls or worse: set
+        // right after fd-creation syscall. Setting at here has higher
+        // probabilities of race condition.
+        butil::make_close_on_exec(fd);
+
+        // Make the fd non-blocking.
+        if (butil::make_non_blocking(fd) != 0) {
+            PLOG(ERROR) << "Fail to set fd=" << fd << " to non-blocking";
+            return -1;
+        }
     }
     // turn off nagling.
     // OK to fail, namely unix domain socket does not support this.
     butil::make_no_delay(fd);
+    const SocketTuningOptions* tuning = _tuning_options.get();
+    if (_tos <= 0 && tuning != NULL) {
+        _tos = tuning->tos;
+    }
     if (_tos > 0 &&
         setsockopt(fd, IPPROTO_IP, IP_TOS, &_tos, sizeof(_tos)) < 0) {
         PLOG(FATAL) << "Fail to set tos of fd=" << fd << " to " << _tos;
     }
 
-    if (FLAGS_socket_send_buffer_size > 0) {
-        int buff_size = FLAGS_socket_send_buffer_size;
+    int send_buffer_size = FLAGS_socket_send_buffer_size;
+    int recv_buffer_size = FLAGS_socket_recv_buffer_size;
+    if (tuning != NULL) {
+        if (tuning->send_buffer_size > 0) {
+            send_buffer_size = tuning->send_buffer_size;
+        }
+        if (tuning->recv_buffer_size > 0) {
+            recv_buffer_size = tuning->recv_buffer_size;
+        }
+    }
+    if (send_buffer_size > 0) {
+        int buff_size = send_buffer_size;
         socklen_t size = sizeof(buff_size);
         if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buff_size, size) != 0) {
             PLOG(FATAL) << "Fail to set sndbuf of fd=" << fd << " to " 
@@ -559,8 +954,8 @@ int Socket::ResetFileDescriptor(int fd) {
         }
     }
 
-    if (FLAGS_socket_recv_buffer_size > 0) {
-        int buff_size = FLAGS_socket_recv_buffer_size;
+    if (recv_buffer_size > 0) {
+        int buff_size = recv_buffer_size;
         socklen_t size = sizeof(buff_size);
         if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buff_size, size) != 0) {
             PLOG(FATAL) << "Fail to set rcvbuf of fd=" << fd << " to " 
@@ -568,8 +963,43 @@ int Socket::ResetFileDescriptor(int fd) {
         }
     }
 
+#if defined(OS_LINUX) && defined(TCP_CONGESTION)
+    // OK to fail, the algorithm may be not allowed or the socket is not TCP.
+    if (tuning != NULL && !tuning->congestion_control.empty() &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION,
+                   tuning->congestion_control.data(),
+                   tuning->congestion_control.size()) != 0) {
+        PLOG_EVERY_SECOND(WARNING) << "Fail to set congestion control of fd="
+                                   << fd << " to " << tuning->congestion_control;
+    }
+#endif
+#if defined(OS_LINUX) && defined(SO_MAX_PACING_RATE)
+    if (tuning != NULL && tuning->max_pacing_rate > 0) {
+        // Older kernels only accept 32-bit rates.
+        unsigned int rate = (unsigned int)std::min<int64_t>(
+            tuning->max_pacing_rate, UINT_MAX - 1);
+        if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                       &rate, sizeof(rate)) != 0) {
+            PLOG_EVERY_SECOND(WARNING) << "Fail to set pacing rate of fd="
+                                       << fd << " to " << rate;
+        }
+    }
+#endif
+
+    _zerocopy_enabled = false;
+    _zerocopy_first_id = 0;
+#if defined(OS_LINUX)
+    if (FLAGS_socket_zerocopy) {
+        // OK to fail, namely unix domain socket and old kernels do not
+        // support this, ordinary writes are used.
+        int on = 1;
+        _zerocopy_enabled =
+            (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0);
+    }
+#endif
+
     if (_on_edge_triggered_events) {
-        if (GetGlobalEventDispatcher(fd).AddConsumer(id(), fd) != 0) {
+        if (GetEventDispatcher(fd).AddConsumer(id(), fd) != 0) {
             PLOG(ERROR) << "Fail to add SocketId=" << id() 
                         << " into EventDispatcher";
             _fd.store(-1, butil::memory_order_release);
@@ -579,6 +1009,13 @@ int Socket::ResetFileDescriptor(int fd) {
     return 0;
 }
 
+EventDispatcher& Socket::GetEventDispatcher(int fd) const {
+    if (_event_dispatcher_index >= 0) {
+        return GetGlobalEventDispatcherAt(_event_dispatcher_index);
+    }
+    return GetGlobalEventDispatcher(fd);
+}
+
 // SocketId = 32-bit version + 32-bit slot.
 //   version: from version part of _versioned_nref, must be an EVEN number.
 //   slot: designated by ResourcePool.
@@ -593,6 +1030,7 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     CHECK(NULL == m->_shared_part.load(butil::memory_order_relaxed));
     m->_nevent.store(0, butil::memory_order_relaxed);
     m->_keytable_pool = options.keytable_pool;
+    m->_bthread_tag = options.bthread_tag;
     m->_tos = 0;
     m->_remote_side = options.remote_side;
     m->_on_edge_triggered_events = options.on_edge_triggered_events;
@@ -607,6 +1045,7 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
             VersionOfVRef(m->_versioned_ref.fetch_add(
                     1, butil::memory_order_release)), slot);
     m->_preferred_index = -1;
+    m->_event_dispatcher_index = options.event_dispatcher_index;
     m->_hc_count = 0;
     CHECK(m->_read_buf.empty());
     const int64_t cpuwide_now = butil::cpuwide_time_us();
@@ -625,12 +1064,19 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     // Disable SSL check if there is no SSL context
     m->_ssl_state = (options.initial_ssl_ctx == NULL ? SSL_OFF : SSL_UNKNOWN);
     m->_ssl_session = NULL;
+    m->_ktls_send = false;
     m->_ssl_ctx = options.initial_ssl_ctx;
+    m->_tuning_options = options.tuning_options;
+    m->_shm_transport_accepted = options.shm_transport;
+    m->_rdma_accepted = options.use_rdma;
     m->_connection_type_for_progressive_read = CONNECTION_TYPE_UNKNOWN;
     m->_controller_released_socket.store(false, butil::memory_order_relaxed);
     m->_overcrowded = false;
     // May be non-zero for RTMP connections.
     m->_fail_me_at_server_stop = false;
+    m->_single_connection_disabled.store(false, butil::memory_order_relaxed);
+    m->_compact_rpc_meta.store(false, butil::memory_order_relaxed);
+    m->_write_coalescing_us.store(0, butil::memory_order_relaxed);
     m->_logoff_flag.store(false, butil::memory_order_relaxed);
     m->_recycle_flag.store(false, butil::memory_order_relaxed);
     m->_error_code = 0;
@@ -646,10 +1092,15 @@ int Socket::Create(const SocketOptions& options, SocketId* id) {
     }
     m->_last_writetime_us.store(cpuwide_now, butil::memory_order_relaxed);
     m->_unwritten_bytes.store(0, butil::memory_order_relaxed);
+    m->_unwritten_bytes_max.store(0, butil::memory_order_relaxed);
+    m->_novercrowded.store(0, butil::memory_order_relaxed);
+    m->_write_probe.store(NULL, butil::memory_order_relaxed);
+    m->_write_probe_us.store(0, butil::memory_order_relaxed);
+    m->_write_queue_max_us.store(0, butil::memory_order_relaxed);
     CHECK(NULL == m->_write_head.load(butil::memory_order_relaxed));
     // Must be last one! Internal fields of this Socket may be access
     // just after calling ResetFileDescriptor.
-    if (m->ResetFileDescriptor(options.fd) != 0) {
+    if (m->ResetFileDescriptor(options.fd, options.fd_nonblocking_cloexec) != 0) {
         const int saved_errno = errno;
         PLOG(ERROR) << "Fail to ResetFileDescriptor";
         m->SetFailed(saved_errno, "Fail to ResetFileDescriptor: %s", 
@@ -690,18 +1141,22 @@ int Socket::WaitAndReset(int32_t expected_nref) {
     const int prev_fd = _fd.exchange(-1, butil::memory_order_relaxed);
     if (ValidFileDescriptor(prev_fd)) {
         if (_on_edge_triggered_events != NULL) {
-            GetGlobalEventDispatcher(prev_fd).RemoveConsumer(prev_fd);
+            GetEventDispatcher(prev_fd).RemoveConsumer(id(), prev_fd);
         }
+        ReleaseShmTransport(prev_fd);
+        ReleaseRdmaEndpoint(prev_fd);
         close(prev_fd);
         if (CreatedByConnect()) {
             g_vars->channel_conn << -1;
         }
     }
+    ReleaseZeroCopyBuffers();
     _local_side = butil::EndPoint();
     if (_ssl_session) {
         SSL_free(_ssl_session);
         _ssl_session = NULL;
     }        
+    _ktls_send = false;
     _ssl_state = SSL_UNKNOWN;
     _nevent.store(0, butil::memory_order_relaxed);
     // parsing_context is very likely to be associated with the fd,
@@ -965,18 +1420,26 @@ void Socket::OnRecycle() {
     }
     SharedPart* sp = _shared_part.exchange(NULL, butil::memory_order_acquire);
     if (sp) {
+        if (sp->creator_socket_id == id()) {
+            // Multiplexed connections reference `sp', release them first
+            // to break the cycle.
+            delete sp->socket_group.exchange(NULL, butil::memory_order_acquire);
+        }
         sp->RemoveRefManually();
     }
     const int prev_fd = _fd.exchange(-1, butil::memory_order_relaxed);
     if (ValidFileDescriptor(prev_fd)) {
         if (_on_edge_triggered_events != NULL) {
-            GetGlobalEventDispatcher(prev_fd).RemoveConsumer(prev_fd);
+            GetEventDispatcher(prev_fd).RemoveConsumer(id(), prev_fd);
         }
+        ReleaseShmTransport(prev_fd);
+        ReleaseRdmaEndpoint(prev_fd);
         close(prev_fd);
         if (create_by_connect) {
             g_vars->channel_conn << -1;
         }
     }
+    ReleaseZeroCopyBuffers();
     reset_parsing_context(NULL);
     _read_buf.clear();
 
@@ -989,8 +1452,10 @@ void Socket::OnRecycle() {
         SSL_free(_ssl_session);
         _ssl_session = NULL;
     }
+    _ktls_send = false;
 
     _ssl_ctx = NULL;
+    _tuning_options.reset();
     
     delete _pipeline_q;
     _pipeline_q = NULL;
@@ -1035,7 +1500,7 @@ bool Socket::IsWriteComplete(Socket::WriteRequest* old_head,
     WriteRequest* new_head = old_head;
     WriteRequest* desired = NULL;
     bool return_when_no_more = true;
-    if (!old_head->data.empty() || !singular_node) {
+    if (!old_head->empty() || !singular_node) {
         desired = old_head;
         // Write is obviously not complete if old_head is not fully written.
         return_when_no_more = false;
@@ -1089,25 +1554,62 @@ int Socket::WaitEpollOut(int fd, bool pollin, const timespec* abstime) {
     // Do not need to check addressable since it will be called by
     // health checker which called `SetFailed' before
     const int expected_val = _epollout_butex->load(butil::memory_order_relaxed);
-    EventDispatcher& edisp = GetGlobalEventDispatcher(fd);
+    EventDispatcher& edisp = GetEventDispatcher(fd);
     if (edisp.AddEpollOut(id(), fd, pollin) != 0) {
         return -1;
     }
 
-    int rc = bthread::butex_wait(_epollout_butex, expected_val, abstime);
+    const int rc = WaitEpollOutButex(expected_val, abstime);
     const int saved_errno = errno;
-    if (rc < 0 && errno == EWOULDBLOCK) {
-        // Could be writable or spurious wakeup
-        rc = 0;
-    }
     // Ignore return value since `fd' might have been removed
     // by `RemoveConsumer' in `SetFailed'
     butil::ignore_result(edisp.RemoveEpollOut(id(), fd, pollin));
+    if (pollin) {
+        // EPOLLOUT kept by WaitKeptEpollOut() is removed as well.
+        _epollout_kept = false;
+    }
     errno = saved_errno;
     // Could be writable or spurious wakeup (by former epollout)
     return rc;
 }
 
+int Socket::WaitKeptEpollOut(int fd, int expected_val,
+                             const timespec* abstime) {
+    if (!ValidFileDescriptor(fd)) {
+        return 0;
+    }
+    if (!_epollout_kept) {
+        EventDispatcher& edisp = GetEventDispatcher(fd);
+        if (edisp.UsingIoUring()) {
+            return WaitEpollOut(fd, true, abstime);
+        }
+        // Adding EPOLLOUT of a writable fd triggers the event at once.
+        if (edisp.AddEpollOut(id(), fd, true) != 0) {
+            return -1;
+        }
+        _epollout_kept = true;
+    }
+    return WaitEpollOutButex(expected_val, abstime);
+}
+
+int Socket::WaitEpollOutButex(int expected_val, const timespec* abstime) {
+    // Pairs with HandleEpollOut(): either the waiter sees the new value or
+    // HandleEpollOut() sees the waiter and wakes it up.
+    _nepollout_waiter.fetch_add(1, butil::memory_order_seq_cst);
+    int rc = 0;
+    if (_epollout_butex->load(butil::memory_order_seq_cst) == expected_val) {
+        rc = bthread::butex_wait(_epollout_butex, expected_val, abstime);
+        if (rc < 0 && errno == EWOULDBLOCK) {
+            // Could be writable or spurious wakeup
+            rc = 0;
+        }
+    }
+    const int saved_errno = errno;
+    _nepollout_waiter.fetch_sub(1, butil::memory_order_relaxed);
+    errno = saved_errno;
+    return rc;
+}
+
 int Socket::Connect(const timespec* abstime,
                     int (*on_connect)(int, int, void*), void* data) {
     if (_ssl_ctx) {
@@ -1115,7 +1617,13 @@ int Socket::Connect(const timespec* abstime,
     } else {
         _ssl_state = SSL_OFF;
     }
-    butil::fd_guard sockfd(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_size = 0;
+    if (butil::endpoint2sockaddr(remote_side(), &serv_addr, &serv_addr_size) != 0) {
+        LOG(ERROR) << "Fail to get sockaddr of " << remote_side();
+        return -1;
+    }
+    butil::fd_guard sockfd(socket(serv_addr.ss_family, SOCK_STREAM, 0));
     if (sockfd < 0) {
         PLOG(ERROR) << "Fail to create socket";
         return -1;
@@ -1123,14 +1631,21 @@ int Socket::Connect(const timespec* abstime,
     CHECK_EQ(0, butil::make_close_on_exec(sockfd));
     // We need to do async connect (to manage the timeout by ourselves).
     CHECK_EQ(0, butil::make_non_blocking(sockfd));
-    
-    struct sockaddr_in serv_addr;
-    bzero((char*)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr = remote_side().ip;
-    serv_addr.sin_port = htons(remote_side().port);
+#if defined(OS_LINUX) && defined(TCP_FASTOPEN_CONNECT)
+    // connect() returns at once and SYN is sent with the first write.
+    // OK to fail, the connection is established normally.
+    if (_tuning_options != NULL && _tuning_options->tcp_fastopen) {
+        const int on = 1;
+        if (setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                       &on, sizeof(on)) != 0) {
+            PLOG_EVERY_SECOND(WARNING) << "Fail to enable TCP Fast Open of fd="
+                                       << sockfd;
+        }
+    }
+#endif
+
     const int rc = ::connect(
-        sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+        sockfd, (struct sockaddr*)&serv_addr, serv_addr_size);
     if (rc != 0 && errno != EINPROGRESS) {
         PLOG(WARNING) << "Fail to connect to " << remote_side();
         return -1;
@@ -1217,13 +1732,12 @@ int Socket::CheckConnected(int sockfd) {
         return -1;
     }
 
-    struct sockaddr_in client;
-    socklen_t size = sizeof(client);
-    CHECK_EQ(0, getsockname(sockfd, (struct sockaddr*) &client, &size));
+    butil::EndPoint local_side;
+    CHECK_EQ(0, butil::get_local_side(sockfd, &local_side));
     LOG_IF(INFO, FLAGS_log_connected)
             << "Connected to " << remote_side()
             << " via fd=" << (int)sockfd << " SocketId=" << id()
-            << " local_port=" << ntohs(client.sin_port);
+            << " local_side=" << local_side;
     if (CreatedByConnect()) {
         g_vars->channel_conn << 1;
     }
@@ -1271,8 +1785,12 @@ int Socket::HandleEpollOut(SocketId id) {
     
     // Currently `WaitEpollOut' needs `_epollout_butex'
     // TODO(jiangrujie): Remove this in the future
-    s->_epollout_butex->fetch_add(1, butil::memory_order_relaxed);
-    bthread::butex_wake_except(s->_epollout_butex, 0);  
+    s->_epollout_butex->fetch_add(1, butil::memory_order_seq_cst);
+    // EPOLLOUT kept in epoll is also reported with EPOLLIN of writable
+    // connections, which has nobody to wake up mostly.
+    if (s->_nepollout_waiter.load(butil::memory_order_seq_cst) > 0) {
+        bthread::butex_wake_except(s->_epollout_butex, 0);
+    }
     return 0;
 }
 
@@ -1448,7 +1966,7 @@ int Socket::Write(butil::IOBuf* data, const WriteOptions* options_in) {
     }
 
     if (!opt.ignore_eovercrowded && _overcrowded) {
-        return SetError(opt.id_wait, EOVERCROWDED);
+        return RejectOvercrowdedWrite(opt.id_wait);
     }
 
     WriteRequest* req = butil::get_object<WriteRequest>();
@@ -1466,6 +1984,99 @@ int Socket::Write(butil::IOBuf* data, const WriteOptions* options_in) {
     return StartWrite(req, opt);
 }
 
+// Read [offset, offset + length) of file `fd' into `out'.
+static int AppendFileRegion(butil::IOBuf* out, int fd, off_t offset,
+                            size_t length) {
+    butil::IOPortal buf;
+    while (length > 0) {
+        const ssize_t nr = buf.pappend_from_file_descriptor(fd, offset, length);
+        if (nr <= 0) {
+            if (nr == 0) {
+                errno = ENODATA;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        offset += nr;
+        length -= nr;
+    }
+    out->append(butil::IOBuf::Movable(buf));
+    return 0;
+}
+
+int Socket::WriteFile(butil::IOBuf* prefix, int fd, off_t offset,
+                      size_t length, butil::IOBuf* suffix,
+                      const WriteOptions* options_in) {
+    WriteOptions opt;
+    if (options_in) {
+        opt = *options_in;
+    }
+#if defined(OS_LINUX)
+    const bool use_sendfile = (ssl_state() == SSL_OFF && _conn == NULL);
+#else
+    const bool use_sendfile = false;
+#endif
+    if (!use_sendfile) {
+        // Read the region into user space.
+        if (AppendFileRegion(prefix, fd, offset, length) != 0) {
+            const int saved_errno = errno;
+            PLOG(WARNING) << "Fail to read file region of fd=" << fd;
+            return SetError(opt.id_wait, saved_errno);
+        }
+        if (suffix) {
+            prefix->append(butil::IOBuf::Movable(*suffix));
+        }
+        return Write(prefix, &opt);
+    }
+    if (opt.pipelined_count > MAX_PIPELINED_COUNT) {
+        LOG(ERROR) << "pipelined_count=" << opt.pipelined_count
+                   << " is too large";
+        return SetError(opt.id_wait, EOVERFLOW);
+    }
+    if (Failed()) {
+        const int rc = ConductError(opt.id_wait);
+        if (rc <= 0) {
+            return rc;
+        }
+    }
+
+    if (!opt.ignore_eovercrowded && _overcrowded) {
+        return RejectOvercrowdedWrite(opt.id_wait);
+    }
+
+    // The region is written after this function returns, hold a duplicated
+    // fd so that users can close `fd' at any time.
+    const int file_fd = dup(fd);
+    if (file_fd < 0) {
+        return SetError(opt.id_wait, errno);
+    }
+    WriteRequest* req = butil::get_object<WriteRequest>();
+    if (!req) {
+        close(file_fd);
+        return SetError(opt.id_wait, ENOMEM);
+    }
+
+    FileRegion* file = new FileRegion;
+    file->fd = file_fd;
+    file->offset = offset;
+    file->length = length;
+    if (suffix) {
+        file->suffix.swap(*suffix);
+    }
+    req->data.swap(*prefix);
+    // Set `req->next' to UNCONNECTED so that the KeepWrite thread will
+    // wait until it points to a valid WriteRequest or NULL.
+    req->next = WriteRequest::UNCONNECTED;
+    req->id_wait = opt.id_wait;
+    req->set_pipelined_count_and_user_message(
+        opt.pipelined_count, NULL, opt.with_auth);
+    req->set_file(file);
+    // Count the bytes now since Setup() does not know the request.
+    AddUnwrittenBytes(req->unwritten_size());
+    return StartWrite(req, opt);
+}
+
 int Socket::Write(SocketMessagePtr<>& msg, const WriteOptions* options_in) {
     WriteOptions opt;
     if (options_in) {
@@ -1485,7 +2096,7 @@ int Socket::Write(SocketMessagePtr<>& msg, const WriteOptions* options_in) {
     }
     
     if (!opt.ignore_eovercrowded && _overcrowded) {
-        return SetError(opt.id_wait, EOVERCROWDED);
+        return RejectOvercrowdedWrite(opt.id_wait);
     }
     
     WriteRequest* req = butil::get_object<WriteRequest>();
@@ -1502,6 +2113,7 @@ int Socket::Write(SocketMessagePtr<>& msg, const WriteOptions* options_in) {
 }
 
 int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
+    BUTIL_USDT3(brpc, socket_write_enter, id(), req, req->data.size());
     // Release fence makes sure the thread getting request sees *req
     WriteRequest* const prev_head =
         _write_head.exchange(req, butil::memory_order_release);
@@ -1511,6 +2123,9 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
         // lock-free, but the duration is so short(1~2 instructions,
         // depending on compiler) that the spin rarely occurs in practice
         // (I've not seen any spin in highly contended tests).
+        // Probe before linking `req', which may be written and returned
+        // right after that.
+        ProbeQueuedWrite(req);
         req->next = prev_head;
         return 0;
     }
@@ -1539,6 +2154,18 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
     // which is assumed to run before any SocketMessage.AppendAndDestroySelf()
     // in some protocols(namely RTMP).
     req->Setup(this);
+
+    if (write_coalescing_us() > 0 || FLAGS_socket_write_coalescing_us > 0) {
+        // Wait for more requests in background and write them together.
+        ReAddress(&ptr_for_keep_write);
+        req->socket = ptr_for_keep_write.release();
+        if (bthread_start_background(&th, &BTHREAD_ATTR_NORMAL,
+                                     KeepWriteAfterCoalescing, req) != 0) {
+            LOG(FATAL) << "Fail to start KeepWriteAfterCoalescing";
+            KeepWrite(req);
+        }
+        return 0;
+    }
     
     if (ssl_state() != SSL_OFF) {
         // Writing into SSL may block the current bthread, always write
@@ -1548,9 +2175,15 @@ int Socket::StartWrite(WriteRequest* req, const WriteOptions& opt) {
     
     // Write once in the calling thread. If the write is not complete,
     // continue it in KeepWrite thread.
-    if (_conn) {
+    if (req->file()) {
+        nw = DoWrite(req);
+    } else if (_conn) {
         butil::IOBuf* data_arr[1] = { &req->data };
         nw = _conn->CutMessageIntoFileDescriptor(fd(), data_arr, 1);
+    } else if (_zerocopy_enabled &&
+               req->data.size() >= (size_t)FLAGS_socket_zerocopy_min_bytes) {
+        butil::IOBuf* data_arr[1] = { &req->data };
+        nw = DoZeroCopyWrite(data_arr, 1);
     } else {
         nw = req->data.cut_into_file_descriptor(fd());
     }
@@ -1593,6 +2226,12 @@ FAIL_TO_WRITE:
 
 static const size_t DATA_LIST_MAX = 256;
 
+// Returns true if TCP_CORK is set.
+static bool SetCork(int fd, bool cork) {
+    const int flag = cork;
+    return setsockopt(fd, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag)) == 0;
+}
+
 void* Socket::KeepWrite(void* void_arg) {
     g_vars->nkeepwrite << 1;
     WriteRequest* req = static_cast<WriteRequest*>(void_arg);
@@ -1602,13 +2241,25 @@ void* Socket::KeepWrite(void* void_arg) {
     // returning directly otherwise _write_head is permantly non-NULL which
     // makes later Write() abnormal.
     WriteRequest* cur_tail = NULL;
+    // Whether TCP_CORK is set by this function.
+    bool corked = false;
     do {
         // req was written, skip it.
-        if (req->next != NULL && req->data.empty()) {
+        if (req->next != NULL && req->empty()) {
             WriteRequest* const saved_req = req;
             req = req->next;
             s->ReturnSuccessfulWriteRequest(saved_req);
         }
+        if (!corked && req->next != NULL && FLAGS_socket_write_cork &&
+            s->ssl_state() == SSL_OFF) {
+            // More than one request to write, merge them into full packets.
+            // Fails on non-TCP sockets, which is fine.
+            corked = SetCork(s->fd(), true);
+        }
+        // Loaded before writing so that EPOLLOUT after EAGAIN of the write
+        // is not missed by WaitKeptEpollOut().
+        const int epollout_val =
+            s->_epollout_butex->load(butil::memory_order_seq_cst);
         const ssize_t nw = s->DoWrite(req);
         if (nw < 0) {
             if (errno != EAGAIN && errno != EOVERCROWDED) {
@@ -1622,7 +2273,7 @@ void* Socket::KeepWrite(void* void_arg) {
             s->AddOutputBytes(nw);
         }
         // Release WriteRequest until non-empty data or last request.
-        while (req->next != NULL && req->data.empty()) {
+        while (req->next != NULL && req->empty()) {
             WriteRequest* const saved_req = req;
             req = req->next;
             s->ReturnSuccessfulWriteRequest(saved_req);
@@ -1634,6 +2285,11 @@ void* Socket::KeepWrite(void* void_arg) {
         // Update(8/15/2017): Not working, performance downgraded.
         //if (nw <= 0 || req->data.empty()/*note*/) {
         if (nw <= 0) {
+            if (corked) {
+                // Push out data in the kernel before waiting.
+                SetCork(s->fd(), false);
+                corked = false;
+            }
             g_vars->nwaitepollout << 1;
             bool pollin = (s->_on_edge_triggered_events != NULL);
             // NOTE: Waiting epollout within timeout is a must to force
@@ -1642,7 +2298,22 @@ void* Socket::KeepWrite(void* void_arg) {
             // growing infinitely.
             const timespec duetime =
                 butil::milliseconds_from_now(WAIT_EPOLLOUT_TIMEOUT_MS);
-            const int rc = s->WaitEpollOut(s->fd(), pollin, &duetime);
+            ShmTransport* const shm =
+                s->_shm_transport.load(butil::memory_order_acquire);
+            rdma::RdmaEndpoint* const rdma_ep =
+                s->_rdma_endpoint.load(butil::memory_order_acquire);
+            int rc = 0;
+            if (shm != NULL && shm->active()) {
+                // The ring rather than the fd is full.
+                rc = shm->WaitWritable(&duetime);
+            } else if (rdma_ep != NULL && rdma_ep->active()) {
+                // The window of the peer is used up.
+                rc = rdma_ep->WaitWritable(&duetime);
+            } else if (pollin && FLAGS_socket_keep_epollout) {
+                rc = s->WaitKeptEpollOut(s->fd(), epollout_val, &duetime);
+            } else {
+                rc = s->WaitEpollOut(s->fd(), pollin, &duetime);
+            }
             if (rc < 0 && errno != ETIMEDOUT) {
                 const int saved_errno = errno;
                 PLOG(WARNING) << "Fail to wait epollout of " << *s;
@@ -1657,6 +2328,12 @@ void* Socket::KeepWrite(void* void_arg) {
         }
         // Return when there's no more WriteRequests and req is completely
         // written.
+        if (corked && req == cur_tail && req->empty()) {
+            // All data was written, flush it before checking new requests
+            // which may be written by other threads directly.
+            SetCork(s->fd(), false);
+            corked = false;
+        }
         if (s->IsWriteComplete(cur_tail, (req == cur_tail), &cur_tail)) {
             CHECK_EQ(cur_tail, req);
             s->ReturnSuccessfulWriteRequest(req);
@@ -1669,24 +2346,86 @@ void* Socket::KeepWrite(void* void_arg) {
     return NULL;
 }
 
+void* Socket::KeepWriteAfterCoalescing(void* void_arg) {
+    WriteRequest* req = static_cast<WriteRequest*>(void_arg);
+    Socket* s = req->socket;
+    int32_t coalescing_us = s->write_coalescing_us();
+    if (coalescing_us <= 0) {
+        coalescing_us = FLAGS_socket_write_coalescing_us;
+    }
+    if (coalescing_us > 0) {
+        bthread_usleep(coalescing_us);
+    }
+    // Link requests written during the window after `req' so that they're
+    // written by one DoWrite() in KeepWrite. `req' is not written yet, the
+    // write can't be complete here.
+    CHECK(!s->IsWriteComplete(req, false, NULL));
+    return KeepWrite(req);
+}
+
 ssize_t Socket::DoWrite(WriteRequest* req) {
     // Group butil::IOBuf in the list into a batch array.
     butil::IOBuf* data_list[DATA_LIST_MAX];
     size_t ndata = 0;
+    WriteRequest* file_req = NULL;
     for (WriteRequest* p = req; p != NULL && ndata < DATA_LIST_MAX;
          p = p->next) {
         data_list[ndata++] = &p->data;
+        if (p->file()) {
+            // Data after the file region can't be written in this batch.
+            file_req = p;
+            break;
+        }
+    }
+
+    ShmTransport* const shm = _shm_transport.load(butil::memory_order_acquire);
+    rdma::RdmaEndpoint* const rdma_ep =
+        _rdma_endpoint.load(butil::memory_order_acquire);
+    if ((shm != NULL && shm->active()) ||
+        (rdma_ep != NULL && rdma_ep->active())) {
+        if (Failed()) {
+            // The peer may not read the ring or the queue pair anymore.
+            errno = EFAILEDSOCKET;
+            return -1;
+        }
+        if (file_req) {
+            // Queued before the handshake, copy the region since the ring
+            // or the queue pair can't be written by sendfile().
+            FileRegion* const file = file_req->file();
+            if (AppendFileRegion(&file_req->data, file->fd,
+                                 file->offset, file->length) != 0) {
+                return -1;
+            }
+            file_req->data.append(butil::IOBuf::Movable(file->suffix));
+            file_req->clear_file();
+        }
+        if (shm != NULL && shm->active()) {
+            return shm->Write(data_list, ndata);
+        }
+        return rdma_ep->Write(data_list, ndata);
     }
 
     if (ssl_state() == SSL_OFF) {
+        if (file_req) {
+            return DoFileWrite(data_list, ndata, file_req);
+        }
         // Write IOBuf in the batch array into the fd.
         if (_conn) {
             return _conn->CutMessageIntoFileDescriptor(fd(), data_list, ndata);
-        } else {
-            ssize_t nw = butil::IOBuf::cut_multiple_into_file_descriptor(
-                fd(), data_list, ndata);
-            return nw;
         }
+        if (_zerocopy_enabled) {
+            const size_t min_bytes = FLAGS_socket_zerocopy_min_bytes;
+            size_t nbytes = 0;
+            for (size_t i = 0; i < ndata && nbytes < min_bytes; ++i) {
+                nbytes += data_list[i]->size();
+            }
+            if (nbytes >= min_bytes) {
+                return DoZeroCopyWrite(data_list, ndata);
+            }
+        }
+        ssize_t nw = butil::IOBuf::cut_multiple_into_file_descriptor(
+            fd(), data_list, ndata);
+        return nw;
     }
 
     CHECK_EQ(SSL_CONNECTED, ssl_state());
@@ -1694,6 +2433,11 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
         // TODO: Separate SSL stuff from SocketConnection
         return _conn->CutMessageIntoSSLChannel(_ssl_session, data_list, ndata);
     }
+    if (_ktls_send) {
+        // The kernel wraps whatever written to the fd into TLS records.
+        return butil::IOBuf::cut_multiple_into_file_descriptor(
+            fd(), data_list, ndata);
+    }
     int ssl_error = 0;
     ssize_t nw = butil::IOBuf::cut_multiple_into_SSL_channel(
         _ssl_session, data_list, ndata, &ssl_error);
@@ -1726,30 +2470,250 @@ ssize_t Socket::DoWrite(WriteRequest* req) {
     return nw;
 }
 
-int Socket::SSLHandshake(int fd, bool server_mode) {
-    if (_ssl_ctx == NULL) {
-        if (server_mode) {
-            LOG(ERROR) << "Lack SSL configuration to handle SSL request";
-            return -1;
+ssize_t Socket::DoFileWrite(butil::IOBuf* const* data_list, size_t ndata,
+                            WriteRequest* file_req) {
+    size_t nbytes = 0;
+    for (size_t i = 0; i < ndata; ++i) {
+        nbytes += data_list[i]->size();
+    }
+    ssize_t nw = 0;
+    if (nbytes > 0) {
+        nw = butil::IOBuf::cut_multiple_into_file_descriptor(
+            fd(), data_list, ndata);
+        if (nw < (ssize_t)nbytes) {
+            return nw;
         }
-        return 0;
     }
-
-    // TODO: Reuse ssl session id for client
-    if (_ssl_session) {
-        // Free the last session, which may be deprecated when socket failed
-        SSL_free(_ssl_session);
+#if defined(OS_LINUX)
+    FileRegion* const file = file_req->file();
+    if (file->length > 0) {
+        // Max bytes transferred by one sendfile() on linux.
+        const size_t MAX_SENDFILE_BYTES = 0x7ffff000;
+        off_t offset = file->offset;
+        const ssize_t ns = sendfile(
+            fd(), file->fd, &offset, std::min(file->length, MAX_SENDFILE_BYTES));
+        if (ns <= 0) {
+            if (ns == 0) {
+                LOG(WARNING) << "File of fd=" << file->fd
+                             << " ends before the region to write";
+                errno = ENODATA;
+            }
+            // Report written data first.
+            return nw > 0 ? nw : -1;
+        }
+        g_vars->nsendfile << 1;
+        nw += ns;
+        file->offset = offset;
+        file->length -= ns;
+    }
+    if (file->length == 0) {
+        // Write suffix as data of the request.
+        file_req->data.swap(file->suffix);
+        file_req->clear_file();
+    }
+    return nw;
+#else
+    CHECK(false) << "File regions are only written on linux";
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+ssize_t Socket::DoZeroCopyWrite(butil::IOBuf* const* data_list,
+                                size_t ndata) {
+    // Reserve the slot before writing because the completion may be reaped
+    // by EventDispatcher before cut_multiple_into_socket_zerocopy returns.
+    // Only one thread writes the fd at any time, the back of the queue is
+    // not touched by others.
+    uint32_t id = 0;
+    {
+        BAIDU_SCOPED_LOCK(_zerocopy_mutex);
+        if (_zerocopy_q == NULL) {
+            _zerocopy_q = new std::deque<ZeroCopyBuffer>;
+        }
+        id = _zerocopy_first_id + _zerocopy_q->size();
+        _zerocopy_q->push_back(ZeroCopyBuffer());
+        _zerocopy_q->back().completed = false;
+    }
+    butil::IOBuf sent;
+    const ssize_t nw = butil::IOBuf::cut_multiple_into_socket_zerocopy(
+        fd(), data_list, ndata, &sent);
+    const int saved_errno = errno;
+    {
+        BAIDU_SCOPED_LOCK(_zerocopy_mutex);
+        const uint32_t index = id - _zerocopy_first_id;
+        if (nw <= 0) {
+            // Failed writes do not consume notification ids.
+            CHECK_EQ(index + 1, _zerocopy_q->size());
+            _zerocopy_q->pop_back();
+        } else if (index < _zerocopy_q->size()) {
+            _zerocopy_q->at(index).data.swap(sent);
+        }
+        // Otherwise the write was completed and popped already, `sent' is
+        // released at the end of this function.
+    }
+    if (nw > 0) {
+        g_vars->nzerocopy_send << 1;
+        return nw;
+    }
+    if (saved_errno == ENOBUFS) {
+        // Exceeded optmem limit with too many pending zero-copy writes,
+        // copy the data instead.
+        g_vars->nzerocopy_copied << 1;
+        return butil::IOBuf::cut_multiple_into_file_descriptor(
+            fd(), data_list, ndata);
+    }
+    errno = saved_errno;
+    return nw;
+}
+
+void Socket::HandleZeroCopyCompletion(SocketId socket_id) {
+    SocketUniquePtr s;
+    // Failed sockets are still addressed to release the buffers.
+    if (Socket::AddressFailedAsWell(socket_id, &s) < 0) {
+        return;
+    }
+    if (s->_zerocopy_enabled) {
+        s->ReapZeroCopyCompletions();
+    }
+}
+
+void Socket::ReapZeroCopyCompletions() {
+#if defined(OS_LINUX)
+    const int fd = this->fd();
+    if (fd < 0) {
+        return;
+    }
+    while (true) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN: no more notifications.
+            return;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            const struct sock_extended_err* serr =
+                (const struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // Notifications of consecutive writes are coalesced into
+            // range [ee_info, ee_data].
+            OnZeroCopyCompleted(serr->ee_info, serr->ee_data,
+                                (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED));
+        }
+    }
+#endif
+}
+
+void Socket::OnZeroCopyCompleted(uint32_t lo, uint32_t hi, bool copied) {
+    if (copied) {
+        g_vars->nzerocopy_copied << (int64_t)(hi - lo + 1);
+    }
+    BAIDU_SCOPED_LOCK(_zerocopy_mutex);
+    if (_zerocopy_q == NULL) {
+        return;
+    }
+    for (uint32_t id = lo; ; ++id) {
+        const uint32_t index = id - _zerocopy_first_id;
+        if (index < _zerocopy_q->size()) {
+            _zerocopy_q->at(index).completed = true;
+        }
+        if (id == hi) {
+            break;
+        }
+    }
+    // Completions are in order mostly, release from the front.
+    while (!_zerocopy_q->empty() && _zerocopy_q->front().completed) {
+        _zerocopy_q->pop_front();
+        ++_zerocopy_first_id;
+    }
+}
+
+static void DeleteZeroCopyBuffers(void* arg) {
+    delete static_cast<std::deque<butil::IOBuf>*>(arg);
+}
+
+void Socket::ReleaseZeroCopyBuffers() {
+    std::deque<butil::IOBuf>* lingering = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_zerocopy_mutex);
+        if (_zerocopy_q == NULL) {
+            return;
+        }
+        for (size_t i = 0; i < _zerocopy_q->size(); ++i) {
+            ZeroCopyBuffer& buf = (*_zerocopy_q)[i];
+            if (!buf.completed && !buf.data.empty()) {
+                if (lingering == NULL) {
+                    lingering = new std::deque<butil::IOBuf>;
+                }
+                lingering->push_back(butil::IOBuf());
+                lingering->back().swap(buf.data);
+            }
+        }
+        delete _zerocopy_q;
+        _zerocopy_q = NULL;
+        _zerocopy_first_id = 0;
+    }
+    if (lingering) {
+        bthread_timer_t timer;
+        if (bthread_timer_add(&timer,
+                              butil::milliseconds_from_now(ZEROCOPY_LINGER_MS),
+                              DeleteZeroCopyBuffers, lingering) != 0) {
+            LOG(ERROR) << "Fail to add timer to release zero-copy buffers";
+            delete lingering;
+        }
+    }
+}
+
+int Socket::SSLHandshake(int fd, bool server_mode) {
+    if (_ssl_ctx == NULL) {
+        if (server_mode) {
+            LOG(ERROR) << "Lack SSL configuration to handle SSL request";
+            return -1;
+        }
+        return 0;
     }
+
+    // TODO: Reuse ssl session id for client
+    if (_ssl_session) {
+        // Free the last session, which may be deprecated when socket failed
+        SSL_free(_ssl_session);
+    }
+    _ktls_send = false;
     _ssl_session = CreateSSLSession(_ssl_ctx->raw_ctx, id(), fd, server_mode);
     if (_ssl_session == NULL) {
         LOG(ERROR) << "Fail to CreateSSLSession";
         return -1;
     }
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(USE_MESALINK)
+    const bool ktls = FLAGS_ssl_ktls && _conn == NULL;
+    if (ktls) {
+        // OpenSSL installs keys of supported ciphers into the kernel once
+        // the handshake is done, and falls back to userspace otherwise.
+        SSL_set_options(_ssl_session, SSL_OP_ENABLE_KTLS);
+    }
+#endif
 #if defined(SSL_CTRL_SET_TLSEXT_HOSTNAME) || defined(USE_MESALINK)
     if (!_ssl_ctx->sni_name.empty()) {
         SSL_set_tlsext_host_name(_ssl_session, _ssl_ctx->sni_name.c_str());
     }
 #endif
+    if (!server_mode) {
+        ResumeClientSSLSession(_ssl_session, _remote_side, _ssl_ctx->sni_name);
+    }
 
     _ssl_state = SSL_CONNECTING;
 
@@ -1757,14 +2721,40 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
     // we use bthread_fd_wait as polling mechanism instead of EventDispatcher
     // as it may confuse the origin event processing code.
     while (true) {
-        int rc = SSL_do_handshake(_ssl_session);
-        if (rc == 1) {
+        SSLHandshakeStep step;
+        if (DoSSLHandshakeStep(_ssl_session, &step) != 0) {
+            LOG(WARNING) << "Too many SSL handshakes waiting, fail the one of "
+                         << _remote_side;
+            return -1;
+        }
+        if (step.rc == 1) {
             _ssl_state = SSL_CONNECTED;
+#ifndef USE_MESALINK
+            if (!server_mode) {
+                if (SSL_session_reused(_ssl_session)) {
+                    g_vars->nssl_session_hit << 1;
+                } else {
+                    g_vars->nssl_session_miss << 1;
+                }
+            }
+#endif
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(USE_MESALINK)
+            if (ktls) {
+                _ktls_send = BIO_get_ktls_send(SSL_get_wbio(_ssl_session));
+                // kTLS is bound to the socket BIO, don't replace it.
+                if (_ktls_send ||
+                    BIO_get_ktls_recv(SSL_get_rbio(_ssl_session))) {
+                    return 0;
+                }
+                RPC_VLOG << "kTLS is not supported by cipher="
+                         << SSL_get_cipher(_ssl_session) << " of " << *this;
+            }
+#endif
             AddBIOBuffer(_ssl_session, fd, FLAGS_ssl_bio_buffer_size);
             return 0;
         }
 
-        int ssl_error = SSL_get_error(_ssl_session, rc);
+        const int ssl_error = step.ssl_error;
         switch (ssl_error) {
         case SSL_ERROR_WANT_READ:
 #if defined(OS_LINUX)
@@ -1787,11 +2777,12 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
             break;
  
         default: {
-            const unsigned long e = ERR_get_error();
+            const unsigned long e = step.error;
             if (ssl_error == SSL_ERROR_ZERO_RETURN || e == 0) {
                 errno = ECONNRESET;
                 LOG(ERROR) << "SSL connection was shutdown by peer: " << _remote_side;
             } else if (ssl_error == SSL_ERROR_SYSCALL) {
+                errno = step.saved_errno;
                 PLOG(ERROR) << "Fail to SSL_do_handshake";
             } else {
                 errno = ESSL;
@@ -1803,7 +2794,186 @@ int Socket::SSLHandshake(int fd, bool server_mode) {
     }
 }
 
+ssize_t Socket::DoShmRead(ShmTransport* shm, size_t size_hint) {
+    if (shm->state() == ShmTransport::HANDSHAKING) {
+        const int rc = shm->ReadReply(fd());
+        if (rc < 0) {
+            if (errno != EAGAIN) {
+                const int saved_errno = errno;
+                shm->RunConnectDone(saved_errno);
+                errno = saved_errno;
+            }
+            return -1;
+        }
+        if (rc == 0) {
+            shm->set_declined();
+            shm->RunConnectDone(0);
+            return _read_buf.append_from_file_descriptor(fd(), size_hint);
+        }
+        // The server writes the ring after the reply.
+        if (GetEventDispatcher(fd()).AddConsumer(id(), shm->readable_fd()) != 0) {
+            const int saved_errno = errno;
+            PLOG(WARNING) << "Fail to add shm ring of " << *this
+                          << " into EventDispatcher";
+            shm->RunConnectDone(saved_errno);
+            errno = saved_errno;
+            return -1;
+        }
+        shm->set_active();
+        shm->RunConnectDone(0);
+    }
+    return shm->Read(fd(), &_read_buf, size_hint);
+}
+
+ssize_t Socket::ReadShmHello(size_t size_hint) {
+    bool is_hello = false;
+    ShmTransport* shm = NULL;
+    const ssize_t nr = ShmTransport::ReadHello(
+        fd(), &_read_buf, _shm_transport_accepted, &is_hello, &shm);
+    if (nr < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return -1;
+    }
+    _shm_hello_expected = false;
+    if (!is_hello) {
+        return nr;
+    }
+    bool accepted = false;
+    EventDispatcher& edisp = GetEventDispatcher(fd());
+    // Consumers of io_uring are removed by SocketId, which can't tell the
+    // connection from the ring.
+    if (shm != NULL && !edisp.UsingIoUring()) {
+        if (edisp.AddConsumer(id(), shm->readable_fd()) == 0) {
+            shm->set_active();
+            // Published before the reply so that responses are written
+            // into the ring.
+            _shm_transport.store(shm, butil::memory_order_release);
+            accepted = true;
+        } else {
+            PLOG(WARNING) << "Fail to add shm ring of " << *this
+                          << " into EventDispatcher";
+        }
+    }
+    if (!accepted) {
+        delete shm;
+    }
+    if (ShmTransport::SendReply(fd(), accepted) != 0) {
+        return -1;
+    }
+    if (!accepted) {
+        return _read_buf.append_from_file_descriptor(fd(), size_hint);
+    }
+    return shm->Read(fd(), &_read_buf, size_hint);
+}
+
+void Socket::ReleaseShmTransport(int fd) {
+    _shm_hello_expected = false;
+    ShmTransport* const shm =
+        _shm_transport.exchange(NULL, butil::memory_order_relaxed);
+    if (shm == NULL) {
+        return;
+    }
+    if (shm->active()) {
+        GetEventDispatcher(fd).RemoveConsumer(id(), shm->readable_fd());
+    }
+    delete shm;
+}
+
+ssize_t Socket::DoRdmaRead(rdma::RdmaEndpoint* ep, size_t size_hint) {
+    if (ep->state() == rdma::RdmaEndpoint::HANDSHAKING) {
+        const int rc = ep->ReadReply(fd());
+        if (rc < 0) {
+            if (errno != EAGAIN) {
+                const int saved_errno = errno;
+                ep->RunConnectDone(saved_errno);
+                errno = saved_errno;
+            }
+            return -1;
+        }
+        if (rc == 0) {
+            ep->set_declined();
+            ep->RunConnectDone(0);
+            return _read_buf.append_from_file_descriptor(fd(), size_hint);
+        }
+        if (GetEventDispatcher(fd()).AddConsumer(id(), ep->completion_fd()) != 0) {
+            const int saved_errno = errno;
+            PLOG(WARNING) << "Fail to add completion channel of " << *this
+                          << " into EventDispatcher";
+            ep->RunConnectDone(saved_errno);
+            errno = saved_errno;
+            return -1;
+        }
+        ep->set_active();
+        ep->RunConnectDone(0);
+    }
+    return ep->Read(fd(), &_read_buf);
+}
+
+ssize_t Socket::ReadRdmaHello(size_t size_hint) {
+    bool is_hello = false;
+    rdma::RdmaEndpoint* ep = NULL;
+    EventDispatcher& edisp = GetEventDispatcher(fd());
+    // Consumers of io_uring are removed by SocketId, which can't tell the
+    // connection from the completion channel.
+    const ssize_t nr = rdma::RdmaEndpoint::ReadHello(
+        fd(), &_read_buf, _rdma_accepted && !edisp.UsingIoUring(),
+        &is_hello, &ep);
+    if (nr < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return -1;
+    }
+    _rdma_hello_expected = false;
+    if (!is_hello) {
+        return nr;
+    }
+    bool accepted = false;
+    if (ep != NULL) {
+        if (edisp.AddConsumer(id(), ep->completion_fd()) == 0) {
+            ep->set_active();
+            // Published before the reply so that responses are sent
+            // through the queue pair.
+            _rdma_endpoint.store(ep, butil::memory_order_release);
+            accepted = true;
+        } else {
+            PLOG(WARNING) << "Fail to add completion channel of " << *this
+                          << " into EventDispatcher";
+        }
+    }
+    if (!accepted) {
+        delete ep;
+        ep = NULL;
+    }
+    if (rdma::RdmaEndpoint::SendReply(fd(), ep) != 0) {
+        return -1;
+    }
+    if (!accepted) {
+        return _read_buf.append_from_file_descriptor(fd(), size_hint);
+    }
+    return ep->Read(fd(), &_read_buf);
+}
+
+void Socket::ReleaseRdmaEndpoint(int fd) {
+    _rdma_hello_expected = false;
+    rdma::RdmaEndpoint* const ep =
+        _rdma_endpoint.exchange(NULL, butil::memory_order_relaxed);
+    if (ep == NULL) {
+        return;
+    }
+    if (ep->active()) {
+        GetEventDispatcher(fd).RemoveConsumer(id(), ep->completion_fd());
+    }
+    delete ep;
+}
+
 ssize_t Socket::DoRead(size_t size_hint) {
+    ShmTransport* const shm = _shm_transport.load(butil::memory_order_acquire);
+    if (shm != NULL && shm->state() != ShmTransport::DECLINED) {
+        return DoShmRead(shm, size_hint);
+    }
+    rdma::RdmaEndpoint* const rdma_ep =
+        _rdma_endpoint.load(butil::memory_order_acquire);
+    if (rdma_ep != NULL &&
+        rdma_ep->state() != rdma::RdmaEndpoint::DECLINED) {
+        return DoRdmaRead(rdma_ep, size_hint);
+    }
     if (ssl_state() == SSL_UNKNOWN) {
         int error_code = 0;
         _ssl_state = DetectSSLState(fd(), &error_code);
@@ -1833,6 +3003,12 @@ ssize_t Socket::DoRead(size_t size_hint) {
     }
     // _ssl_state has been set
     if (ssl_state() == SSL_OFF) {
+        if (_shm_hello_expected) {
+            return ReadShmHello(size_hint);
+        }
+        if (_rdma_hello_expected) {
+            return ReadRdmaHello(size_hint);
+        }
         return _read_buf.append_from_file_descriptor(fd(), size_hint);
     }
 
@@ -1957,7 +3133,14 @@ int Socket::StartInputEvent(SocketId id, uint32_t events,
 
         bthread_attr_t attr = thread_attr;
         attr.keytable_pool = p->_keytable_pool;
-        if (bthread_start_urgent(&tid, &attr, ProcessEvent, p) != 0) {
+        if (p->_bthread_tag != BTHREAD_TAG_INVALID) {
+            attr.tag = p->_bthread_tag;
+        }
+        const int rc = (FLAGS_socket_worker_affinity ?
+                        bthread_start_background_with_affinity(
+                            &tid, &attr, ProcessEvent, p, p->id()) :
+                        bthread_start_urgent(&tid, &attr, ProcessEvent, p));
+        if (rc != 0) {
             LOG(FATAL) << "Fail to start ProcessEvent";
             ProcessEvent(p);
         }
@@ -1975,6 +3158,26 @@ void Socket::UpdateStatsEverySecond(int64_t now_ms) {
     SharedPart* sp = GetSharedPart();
     if (sp) {
         sp->UpdateStatsEverySecond(now_ms);
+        if (FLAGS_socket_sample_tcp_info && sp->creator_socket_id == id()) {
+            // Main sockets of pooled connections are not connected, sample
+            // one of the pooled sockets instead.
+            SocketUniquePtr pooled;
+            int sockfd = fd();
+            if (sockfd < 0 && HasSocketPool()) {
+                std::vector<SocketId> ids;
+                ListPooledSockets(&ids, 1);
+                if (!ids.empty() && Socket::Address(ids[0], &pooled) == 0) {
+                    sockfd = pooled->fd();
+                }
+            }
+            // Accepted connections are not exported to bvars because their
+            // remote ports are ephemeral, which make too many labels.
+            if (sockfd >= 0) {
+                sp->UpdateTcpInfo(sockfd, CreatedByConnect() ?
+                                  butil::endpoint2str(remote_side()).c_str() :
+                                  std::string());
+            }
+        }
     }
 }
 
@@ -2066,6 +3269,12 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
        << "\nnevent=" << ptr->_nevent.load(butil::memory_order_relaxed)
        << "\nfd=" << fd
        << "\ntos=" << ptr->_tos
+       << "\ncongestion_control="
+       << (ptr->_tuning_options ? ptr->_tuning_options->congestion_control : "")
+       << "\nmax_pacing_rate="
+       << (ptr->_tuning_options ? ptr->_tuning_options->max_pacing_rate : 0)
+       << "\ntcp_fastopen="
+       << (ptr->_tuning_options && ptr->_tuning_options->tcp_fastopen)
        << "\nreset_fd_to_now=" << butil::gettimeofday_us() - ptr->_reset_fd_real_us << "us"
        << "\nremote_side=" << ptr->_remote_side
        << "\nlocal_side=" << ptr->_local_side
@@ -2080,12 +3289,17 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
     const int64_t cpuwide_now = butil::cpuwide_time_us();
     os << "\nhc_count=" << ptr->_hc_count
        << "\navg_input_msg_size=" << ptr->_avg_msg_size
+       << "\nread_size=" << ptr->_read_size
         // NOTE: We're assuming that butil::IOBuf.size() is thread-safe, it is now
         // however it's not guaranteed.
        << "\nread_buf=" << ptr->_read_buf.size()
        << "\nlast_read_to_now=" << cpuwide_now - ptr->_last_readtime_us << "us"
        << "\nlast_write_to_now=" << cpuwide_now - ptr->_last_writetime_us << "us"
-       << "\novercrowded=" << ptr->_overcrowded;
+       << "\novercrowded=" << ptr->_overcrowded
+       << "\novercrowded_count=" << ptr->_novercrowded.load(butil::memory_order_relaxed)
+       << "\nunwritten_bytes=" << ptr->unwritten_bytes()
+       << "\nunwritten_bytes_max=" << ptr->_unwritten_bytes_max.load(butil::memory_order_relaxed)
+       << "\nwrite_queue_max=" << ptr->_write_queue_max_us.load(butil::memory_order_relaxed) << "us";
     os << "\nid_wait_list={";
     for (size_t i = 0; i < nidsize; ++i) {
         if (i) {
@@ -2197,6 +3411,20 @@ void Socket::DebugSocket(std::ostream& os, SocketId id) {
 #endif
 }
 
+int Socket::ConnectAndWait(const timespec* abstime) {
+    const int fd = Connect(abstime, NULL, NULL);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ResetFileDescriptor(fd) != 0) {
+        const int saved_errno = errno;
+        ::close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
 int Socket::CheckHealth() {
     if (_hc_count == 0) {
         LOG(INFO) << "Checking " << *this;
@@ -2237,6 +3465,11 @@ int Socket::RemoveStream(StreamId stream_id) {
     return 0;
 }
 
+size_t Socket::StreamCount() {
+    BAIDU_SCOPED_LOCK(_stream_mutex);
+    return _stream_set ? _stream_set->size() : 0;
+}
+
 void Socket::ResetAllStreams() {
     DCHECK(Failed());
     std::set<StreamId> saved_stream_set;
@@ -2268,7 +3501,9 @@ inline SocketPool::SocketPool(const SocketOptions& opt)
     : _options(opt)
     , _remote_side(opt.remote_side)
     , _numfree(0)
-    , _numinflight(0) {
+    , _numinflight(0)
+    , _numconnecting(0)
+    , _peak_inflight(0) {
 }
 
 inline SocketPool::~SocketPool() {
@@ -2281,8 +3516,17 @@ inline SocketPool::~SocketPool() {
     }
 }
 
-inline int SocketPool::GetSocket(SocketUniquePtr* ptr) {
+inline void SocketPool::AddInflight() {
+    const int n = _numinflight.fetch_add(1, butil::memory_order_relaxed) + 1;
+    int peak = _peak_inflight.load(butil::memory_order_relaxed);
+    while (n > peak &&
+           !_peak_inflight.compare_exchange_weak(
+               peak, n, butil::memory_order_relaxed)) {}
+}
+
+inline int SocketPool::GetSocket(SocketUniquePtr* ptr, bool* created) {
     const int connection_pool_size = FLAGS_max_connection_pool_size;
+    *created = false;
 
     // In prev rev, SocketPool could be sharded into multiple SubSocketPools to
     // reduce thread contentions. The sharding key is mixed from pthread-id so
@@ -2313,7 +3557,7 @@ inline int SocketPool::GetSocket(SocketUniquePtr* ptr) {
             // Not address inside the lock since at most time the pooled socket
             // is likely to be valid.
             if (Socket::Address(sid, ptr) == 0) {
-                _numinflight.fetch_add(1, butil::memory_order_relaxed);
+                AddInflight();
                 return 0;
             }
         }
@@ -2323,12 +3567,70 @@ inline int SocketPool::GetSocket(SocketUniquePtr* ptr) {
     opt.health_check_interval_s = -1;
     if (get_client_side_messenger()->Create(opt, &sid) == 0 &&
         Socket::Address(sid, ptr) == 0) {
-        _numinflight.fetch_add(1, butil::memory_order_relaxed);
+        AddInflight();
+        *created = true;
         return 0;
     }
     return -1;
 }
 
+int SocketPool::ReserveSockets(int count) {
+    count = std::min(count, FLAGS_max_connection_pool_size);
+    int n = 0;
+    while (size() < count) {
+        _numconnecting.fetch_add(1, butil::memory_order_relaxed);
+        ++n;
+    }
+    return n;
+}
+
+void SocketPool::ConnectSocket() {
+    SocketOptions opt = _options;
+    opt.health_check_interval_s = -1;
+    SocketId sid;
+    SocketUniquePtr ptr;
+    if (get_client_side_messenger()->Create(opt, &sid) == 0 &&
+        Socket::Address(sid, &ptr) == 0) {
+        const timespec abstime =
+            butil::milliseconds_from_now(FLAGS_health_check_timeout_ms);
+        if (ptr->ConnectAndWait(&abstime) == 0) {
+            {
+                BAIDU_SCOPED_LOCK(_mutex);
+                _pool.push_back(sid);
+            }
+            _numfree.fetch_add(1, butil::memory_order_relaxed);
+        } else {
+            ptr->SetFailed(errno ? errno : EFAILEDSOCKET,
+                           "Fail to connect pooled socket in advance");
+        }
+    }
+    _numconnecting.fetch_sub(1, butil::memory_order_relaxed);
+}
+
+void SocketPool::Shrink() {
+    const int ninflight = _numinflight.load(butil::memory_order_relaxed);
+    const int peak = _peak_inflight.exchange(ninflight, butil::memory_order_relaxed);
+    if (_numfree.load(butil::memory_order_relaxed) + ninflight <=
+        std::max(peak, FLAGS_min_connection_pool_size)) {
+        return;
+    }
+    SocketId sid;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_pool.empty()) {
+            return;
+        }
+        // The front one is least recently used.
+        sid = _pool.front();
+        _pool.erase(_pool.begin());
+    }
+    _numfree.fetch_sub(1, butil::memory_order_relaxed);
+    SocketUniquePtr ptr;
+    if (Socket::Address(sid, &ptr) == 0) {
+        ptr->SetFailed(EUNUSED, "Close pooled socket exceeding demand");
+    }
+}
+
 inline void SocketPool::ReturnSocket(Socket* sock) {
     // NOTE: save the gflag which may be reloaded at any time.
     const int connection_pool_size = FLAGS_max_connection_pool_size;
@@ -2371,6 +3673,70 @@ inline void SocketPool::ListSockets(std::vector<SocketId>* out, size_t max_count
     _mutex.unlock();
 }
 
+////////// SocketGroup //////////////
+
+SocketGroup::SocketGroup(const SocketOptions& opt, int count)
+    : _options(opt)
+    , _size(std::max(count, 1))
+    , _ids(new butil::atomic<SocketId>[_size - 1])
+    , _next(0) {
+    for (int i = 0; i < _size - 1; ++i) {
+        _ids[i].store(INVALID_SOCKET_ID, butil::memory_order_relaxed);
+    }
+}
+
+SocketGroup::~SocketGroup() {
+    for (int i = 0; i < _size - 1; ++i) {
+        SocketUniquePtr ptr;
+        if (Socket::Address(_ids[i].load(butil::memory_order_relaxed), &ptr) == 0) {
+            ptr->ReleaseAdditionalReference();
+        }
+    }
+}
+
+int SocketGroup::GetSocket(Socket* main, SocketUniquePtr* ptr) {
+    const uint32_t start = _next.fetch_add(1, butil::memory_order_relaxed);
+    SocketUniquePtr best;
+    int64_t best_bytes = 0;
+    for (int n = 0; n < _size; ++n) {
+        // Index 0 is the main socket.
+        const int i = (start + n) % _size;
+        SocketUniquePtr s;
+        if (i == 0) {
+            main->ReAddress(&s);
+        } else if (Socket::Address(_ids[i - 1].load(butil::memory_order_acquire),
+                                   &s) != 0) {
+            BAIDU_SCOPED_LOCK(_mutex);
+            // Another thread may have created the socket.
+            if (Socket::Address(_ids[i - 1].load(butil::memory_order_relaxed),
+                                &s) != 0) {
+                SocketOptions opt = _options;
+                opt.health_check_interval_s = -1;
+                SocketId id;
+                if (get_client_side_messenger()->Create(opt, &id) != 0 ||
+                    Socket::Address(id, &s) != 0) {
+                    continue;
+                }
+                s->ShareStats(main);
+                _ids[i - 1].store(id, butil::memory_order_release);
+            }
+        }
+        const int64_t bytes = s->unwritten_bytes();
+        if (best == NULL || bytes < best_bytes) {
+            best_bytes = bytes;
+            best.reset(s.release());
+            if (best_bytes == 0) {
+                break;
+            }
+        }
+    }
+    if (best == NULL) {
+        return -1;
+    }
+    ptr->reset(best.release());
+    return 0;
+}
+
 Socket::SharedPart* Socket::GetOrNewSharedPartSlower() {
     // Create _shared_part optimistically.
     SharedPart* shared_part = GetSharedPart();
@@ -2398,15 +3764,11 @@ void Socket::ShareStats(Socket* main_socket) {
     }
 }
 
-int Socket::GetPooledSocket(SocketUniquePtr* pooled_socket) {
-    if (pooled_socket == NULL) {
-        LOG(ERROR) << "pooled_socket is NULL";
-        return -1;
-    }
+SocketPool* Socket::GetOrNewSocketPool() {
     SharedPart* main_sp = GetOrNewSharedPart();
     if (main_sp == NULL) {
         LOG(ERROR) << "_shared_part is NULL";
-        return -1;
+        return NULL;
     }
     // Create socket_pool optimistically.
     SocketPool* socket_pool = main_sp->socket_pool.load(butil::memory_order_consume);
@@ -2416,7 +3778,9 @@ int Socket::GetPooledSocket(SocketUniquePtr* pooled_socket) {
         opt.user = user();
         opt.on_edge_triggered_events = _on_edge_triggered_events;
         opt.initial_ssl_ctx = _ssl_ctx;
+        opt.tuning_options = _tuning_options;
         opt.keytable_pool = _keytable_pool;
+        opt.bthread_tag = _bthread_tag;
         opt.app_connect = _app_connect;
         socket_pool = new SocketPool(opt);
         SocketPool* expected = NULL;
@@ -2427,9 +3791,30 @@ int Socket::GetPooledSocket(SocketUniquePtr* pooled_socket) {
             socket_pool = expected;
         }
     }
-    if (socket_pool->GetSocket(pooled_socket) != 0) {
+    return socket_pool;
+}
+
+int Socket::GetPooledSocket(SocketUniquePtr* pooled_socket) {
+    if (pooled_socket == NULL) {
+        LOG(ERROR) << "pooled_socket is NULL";
+        return -1;
+    }
+    const int64_t start_us = butil::cpuwide_time_us();
+    SocketPool* socket_pool = GetOrNewSocketPool();
+    if (socket_pool == NULL) {
         return -1;
     }
+    bool created = false;
+    if (socket_pool->GetSocket(pooled_socket, &created) != 0) {
+        return -1;
+    }
+    g_vars->pooled_socket_wait << butil::cpuwide_time_us() - start_us;
+    if (created) {
+        g_vars->npool_miss << 1;
+        // Demand exceeds the pool, connect one more socket in advance for
+        // following calls.
+        WarmUpSocketPool(socket_pool->size() + 1);
+    }
     (*pooled_socket)->ShareStats(this);
     CHECK((*pooled_socket)->parsing_context() == NULL)
         << "context=" << (*pooled_socket)->parsing_context()
@@ -2487,6 +3872,93 @@ void Socket::ListPooledSockets(std::vector<SocketId>* out, size_t max_count) {
     pool->ListSockets(out, max_count);
 }
 
+int Socket::GetMultiplexedSocket(int count, SocketUniquePtr* socket) {
+    if (socket == NULL) {
+        LOG(ERROR) << "socket is NULL";
+        return -1;
+    }
+    SharedPart* main_sp = GetOrNewSharedPart();
+    if (main_sp == NULL) {
+        LOG(ERROR) << "_shared_part is NULL";
+        return -1;
+    }
+    SocketGroup* group = main_sp->socket_group.load(butil::memory_order_consume);
+    if (group == NULL) {
+        SocketOptions opt;
+        opt.remote_side = remote_side();
+        opt.user = user();
+        opt.on_edge_triggered_events = _on_edge_triggered_events;
+        opt.initial_ssl_ctx = _ssl_ctx;
+        opt.tuning_options = _tuning_options;
+        opt.keytable_pool = _keytable_pool;
+        opt.bthread_tag = _bthread_tag;
+        opt.app_connect = _app_connect;
+        group = new SocketGroup(opt, count);
+        SocketGroup* expected = NULL;
+        if (!main_sp->socket_group.compare_exchange_strong(
+                expected, group, butil::memory_order_acq_rel)) {
+            delete group;
+            CHECK(expected);
+            group = expected;
+        }
+    }
+    return group->GetSocket(this, socket);
+}
+
+struct WarmUpSocketPoolArgs {
+    // Referenced to keep the pool alive.
+    SharedObject* shared_part;
+    SocketPool* pool;
+    int count;
+};
+
+static void* RunWarmUpSocketPool(void* arg) {
+    WarmUpSocketPoolArgs* args = static_cast<WarmUpSocketPoolArgs*>(arg);
+    for (int i = 0; i < args->count; ++i) {
+        args->pool->ConnectSocket();
+    }
+    args->shared_part->RemoveRefManually();
+    delete args;
+    return NULL;
+}
+
+void Socket::WarmUpSocketPool(int count) {
+    SocketPool* pool = GetOrNewSocketPool();
+    if (pool == NULL || !pool->CanConnectInAdvance()) {
+        return;
+    }
+    const int n = pool->ReserveSockets(count);
+    if (n <= 0) {
+        return;
+    }
+    WarmUpSocketPoolArgs* args = new WarmUpSocketPoolArgs;
+    args->shared_part = GetSharedPart();
+    args->shared_part->AddRefManually();
+    args->pool = pool;
+    args->count = n;
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, RunWarmUpSocketPool, args) != 0) {
+        LOG(ERROR) << "Fail to start bthread";
+        RunWarmUpSocketPool(args);
+    }
+}
+
+void Socket::ResizeSocketPool() {
+    SharedPart* sp = GetSharedPart();
+    if (sp == NULL) {
+        return;
+    }
+    SocketPool* pool = sp->socket_pool.load(butil::memory_order_consume);
+    if (pool == NULL) {
+        return;
+    }
+    pool->Shrink();
+    const int min_size = FLAGS_min_connection_pool_size;
+    if (min_size > 0 && pool->size() < min_size) {
+        WarmUpSocketPool(min_size);
+    }
+}
+
 bool Socket::GetPooledSocketStats(int* numfree, int* numinflight) {
     SharedPart* sp = GetSharedPart();
     if (sp == NULL) {
@@ -2512,7 +3984,9 @@ int Socket::GetShortSocket(SocketUniquePtr* short_socket) {
     opt.user = user();
     opt.on_edge_triggered_events = _on_edge_triggered_events;
     opt.initial_ssl_ctx = _ssl_ctx;
+    opt.tuning_options = _tuning_options;
     opt.keytable_pool = _keytable_pool;
+    opt.bthread_tag = _bthread_tag;
     opt.app_connect = _app_connect;
     if (get_client_side_messenger()->Create(opt, &id) != 0 ||
         Socket::Address(id, short_socket) != 0) {
@@ -2587,6 +4061,58 @@ void Socket::CancelUnwrittenBytes(size_t bytes) {
         _overcrowded = false;
     }
 }
+void Socket::AddUnwrittenBytes(size_t bytes) {
+    const int64_t before_add =
+        _unwritten_bytes.fetch_add(bytes, butil::memory_order_relaxed);
+    const int64_t after_add = before_add + (int64_t)bytes;
+    if (after_add >= FLAGS_socket_max_unwritten_bytes) {
+        _overcrowded = true;
+    }
+    if (before_add > 0) {
+        // Only sockets with backlogs are interesting, which also saves the
+        // cost for sockets that write everything at once.
+        g_vars->unwritten_bytes_max << after_add;
+    }
+    int64_t max_bytes = _unwritten_bytes_max.load(butil::memory_order_relaxed);
+    while (after_add > max_bytes &&
+           !_unwritten_bytes_max.compare_exchange_weak(
+               max_bytes, after_add, butil::memory_order_relaxed)) {}
+}
+int Socket::RejectOvercrowdedWrite(bthread_id_t id_wait) {
+    _novercrowded.fetch_add(1, butil::memory_order_relaxed);
+    g_vars->novercrowded << 1;
+    return SetError(id_wait, EOVERCROWDED);
+}
+void Socket::ProbeQueuedWrite(WriteRequest* req) {
+    if (_write_probe.load(butil::memory_order_relaxed) != NULL) {
+        return;
+    }
+    WriteRequest* expected = NULL;
+    if (_write_probe.compare_exchange_strong(
+            expected, req, butil::memory_order_relaxed)) {
+        _write_probe_us.store(butil::cpuwide_time_us(),
+                              butil::memory_order_relaxed);
+    }
+}
+void Socket::FinishWriteProbe(WriteRequest* req, bool written) {
+    if (_write_probe.load(butil::memory_order_relaxed) != req) {
+        return;
+    }
+    // 0 if the request is done before ProbeQueuedWrite() sets the time,
+    // which is too short to matter.
+    const int64_t start_us =
+        _write_probe_us.exchange(0, butil::memory_order_relaxed);
+    _write_probe.store(NULL, butil::memory_order_relaxed);
+    if (!written || start_us == 0) {
+        return;
+    }
+    const int64_t wait_us = butil::cpuwide_time_us() - start_us;
+    g_vars->write_queue << wait_us;
+    int64_t max_us = _write_queue_max_us.load(butil::memory_order_relaxed);
+    while (wait_us > max_us &&
+           !_write_queue_max_us.compare_exchange_weak(
+               max_us, wait_us, butil::memory_order_relaxed)) {}
+}
 void Socket::AddOutputBytes(size_t bytes) {
     GetOrNewSharedPart()->out_size.fetch_add(bytes, butil::memory_order_relaxed);
     _last_writetime_us.store(butil::cpuwide_time_us(),
@@ -2643,6 +4169,7 @@ SocketSSLContext::SocketSSLContext()
 
 SocketSSLContext::~SocketSSLContext() {
     if (raw_ctx) {
+        RemoveClientSSLSessions(raw_ctx);
         SSL_CTX_free(raw_ctx);
     }
 }
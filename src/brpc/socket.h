@@ -37,6 +37,7 @@
 #include "brpc/options.pb.h"              // ConnectionType
 #include "brpc/socket_id.h"               // SocketId
 #include "brpc/socket_message.h"          // SocketMessagePtr
+#include "brpc/socket_tuning_options.h"   // SocketTuningOptions
 #include "bvar/bvar.h"
 
 namespace brpc {
@@ -53,6 +54,13 @@ class Socket;
 class AuthContext;
 class EventDispatcher;
 class Stream;
+class SocketPool;
+class SocketGroup;
+class ShmTransport;
+namespace rdma {
+class RdmaEndpoint;
+class RdmaConnect;
+}  // namespace rdma
 
 // A special closure for processing the about-to-recycle socket. Socket does
 // not delete SocketUser, if you want, `delete this' at the end of
@@ -125,6 +133,14 @@ struct SocketStat {
     uint64_t out_size_m;
     uint32_t in_num_messages_m;
     uint32_t out_num_messages_m;
+    // Sampled from TCP_INFO every second when -socket_sample_tcp_info is
+    // true, all zero otherwise.
+    uint32_t tcp_rtt_us;
+    uint32_t tcp_rttvar_us;
+    uint32_t tcp_retrans_s;      // segments retransmitted in last second
+    uint32_t tcp_snd_cwnd;       // in segments
+    uint32_t tcp_unacked;        // segments sent but not acked
+    uint64_t tcp_delivery_rate;  // bytes per second, linux >= 4.9
 };
 
 struct SocketVarsCollector {
@@ -136,6 +152,17 @@ struct SocketVarsCollector {
         , nkeepwrite_second("rpc_keepwrite_second", &nkeepwrite)
         , nwaitepollout("rpc_waitepollout_count")
         , nwaitepollout_second("rpc_waitepollout_second", &nwaitepollout)
+        , nzerocopy_send("rpc_socket_zerocopy_send_count")
+        , nzerocopy_copied("rpc_socket_zerocopy_copied_count")
+        , nsendfile("rpc_socket_sendfile_count")
+        , nssl_session_hit("rpc_client_ssl_session_hit_count")
+        , nssl_session_miss("rpc_client_ssl_session_miss_count")
+        , pooled_socket_wait("rpc_socket_pool_wait")
+        , npool_miss("rpc_socket_pool_miss_count")
+        , novercrowded("rpc_socket_overcrowded_count")
+        , unwritten_bytes_max_window("rpc_socket_unwritten_bytes_max",
+                                     &unwritten_bytes_max, 10)
+        , write_queue("rpc_socket_write_queue")
     {}
 
     bvar::Adder<int64_t> nsocket;
@@ -147,6 +174,28 @@ struct SocketVarsCollector {
     bvar::PerSecond<bvar::Adder<int64_t> > nkeepwrite_second;
     bvar::Adder<int64_t> nwaitepollout;
     bvar::PerSecond<bvar::Adder<int64_t> > nwaitepollout_second;
+    // Writes sent with MSG_ZEROCOPY.
+    bvar::Adder<int64_t> nzerocopy_send;
+    // Zero-copy writes which were copied anyway, either reported so by the
+    // kernel or falling back to ordinary writes on ENOBUFS.
+    bvar::Adder<int64_t> nzerocopy_copied;
+    // Successful sendfile() of file regions.
+    bvar::Adder<int64_t> nsendfile;
+    // Client SSL handshakes that resumed or did not resume cached sessions.
+    bvar::Adder<int64_t> nssl_session_hit;
+    bvar::Adder<int64_t> nssl_session_miss;
+    // Time to get a pooled socket, and times of creating a pooled socket
+    // because the pool is empty.
+    bvar::LatencyRecorder pooled_socket_wait;
+    bvar::Adder<int64_t> npool_miss;
+    // Writes rejected with EOVERCROWDED.
+    bvar::Adder<int64_t> novercrowded;
+    // Max unwritten bytes of sockets with backlogs in recent 10 seconds.
+    bvar::Maxer<int64_t> unwritten_bytes_max;
+    bvar::Window<bvar::Maxer<int64_t> > unwritten_bytes_max_window;
+    // Time that sampled writes waited behind earlier writes of the same
+    // socket until being completely written.
+    bvar::LatencyRecorder write_queue;
 };
 
 struct PipelinedInfo {
@@ -193,6 +242,24 @@ struct SocketOptions {
     std::shared_ptr<AppConnect> app_connect;
     // The created socket will set parsing_context with this value.
     Destroyable* initial_parsing_context;
+    // Watch `fd' with the EventDispatcher at this index rather than the one
+    // chosen by `fd', if it's non-negative.
+    int event_dispatcher_index;
+    // Input events of the socket are processed by bthread workers with this
+    // tag. BTHREAD_TAG_INVALID means the tag of the EventDispatcher.
+    bthread_tag_t bthread_tag;
+    // Set on the fd by setsockopt() if it's not NULL.
+    std::shared_ptr<const SocketTuningOptions> tuning_options;
+    // True if `fd' is already non-blocking and close-on-exec, e.g. created
+    // by accept4(SOCK_NONBLOCK|SOCK_CLOEXEC), to skip setting them again.
+    bool fd_nonblocking_cloexec;
+    // [Server] Accept rather than decline the hello of ShmTransport if `fd'
+    // is a unix domain socket, see details/shm_transport.h
+    bool shm_transport;
+    // [Client] Carry the TCP connection by RDMA if both sides support it.
+    // [Server] Accept rather than decline the hello of RdmaEndpoint.
+    // See rdma/rdma_endpoint.h
+    bool use_rdma;
 };
 
 // Abstractions on reading from and writing into file descriptors.
@@ -212,6 +279,9 @@ friend class HealthCheckTask;
 friend class OnAppHealthCheckDone;
 friend class HealthCheckManager;
 friend class policy::H2GlobalStreamCreator;
+friend class SocketPool;
+friend class ShmConnect;
+friend class rdma::RdmaConnect;
     class SharedPart;
     struct Forbidden {};
     struct WriteRequest;
@@ -273,6 +343,17 @@ public:
     // successful and *may* remain unchanged otherwise.
     int Write(SocketMessagePtr<>& msg, const WriteOptions* options = NULL);
 
+    // Write `prefix', `length' bytes of file `fd' starting from `offset'
+    // and `suffix'(if it's not NULL) in order. The file region is written
+    // by sendfile() without being copied into user space on non-SSL
+    // connections, otherwise it's read into memory and written as usual.
+    // `fd' can be closed after return. Bytes of the region are counted as
+    // unwritten bytes, thus writes after large regions fail with
+    // EOVERCROWDED until the socket catches up.
+    // Errnos are same as Write(), plus errors of reading the file.
+    int WriteFile(butil::IOBuf* prefix, int fd, off_t offset, size_t length,
+                  butil::IOBuf* suffix, const WriteOptions* options = NULL);
+
     // The file descriptor
     int fd() const { return _fd.load(butil::memory_order_relaxed); }
 
@@ -420,6 +501,10 @@ public:
     void set_preferred_index(int index) { _preferred_index = index; }
     int preferred_index() const { return _preferred_index; }
 
+    // Index of the EventDispatcher watching this socket, negative when
+    // the dispatcher is chosen by fd.
+    int event_dispatcher_index() const { return _event_dispatcher_index; }
+
     void set_type_of_service(int tos) { _tos = tos; }
 
     // Call this method every second (roughly)
@@ -466,6 +551,22 @@ public:
     // Return true on success
     bool GetPooledSocketStats(int* numfree, int* numinflight);
 
+    // Get one of `count' connections (including this socket) to the same
+    // place as this socket, which carry calls with CONNECTION_TYPE_SINGLE
+    // concurrently. The one with least unwritten bytes is chosen so that
+    // traffic to one server is spread to multiple connections. `count' is
+    // only used at the first call.
+    int GetMultiplexedSocket(int count, SocketUniquePtr* socket);
+
+    // Connect pooled sockets of this socket in background until the pool
+    // has `count' sockets (no more than -max_connection_pool_size), so that
+    // calls over CONNECTION_TYPE_POOLED do not wait for connecting.
+    void WarmUpSocketPool(int count);
+
+    // Grow the pool to -min_connection_pool_size and close one unused
+    // pooled socket exceeding recent demand. Called periodically.
+    void ResizeSocketPool();
+
     // Create a socket connecting to the same place as this socket.
     int GetShortSocket(SocketUniquePtr* short_socket);
 
@@ -499,6 +600,33 @@ public:
     void fail_me_at_server_stop() { _fail_me_at_server_stop = true; }
     bool shall_fail_me_at_server_stop() const { return _fail_me_at_server_stop; }
 
+    // Make RPCs of CONNECTION_TYPE_SINGLE to this socket use pooled
+    // connections instead. Called when the server is found unable to handle
+    // requests pipelined over one connection, namely HTTP/1.1 servers
+    // closing the connection with outstanding requests.
+    void disable_single_connection()
+    { _single_connection_disabled.store(true, butil::memory_order_relaxed); }
+    bool is_single_connection_disabled() const
+    { return _single_connection_disabled.load(butil::memory_order_relaxed); }
+
+    // Called when the server accepts compact meta of baidu_std on this
+    // connection. Reset when the fd is changed.
+    void enable_compact_rpc_meta()
+    { _compact_rpc_meta.store(true, butil::memory_order_relaxed); }
+    bool is_compact_rpc_meta_enabled() const
+    { return _compact_rpc_meta.load(butil::memory_order_relaxed); }
+
+    // Positive value makes the thread getting the right to write wait so
+    // many microseconds in background before writing, so that requests
+    // written by other threads during the window are combined into one
+    // write. Useful for pipelined protocols(namely redis) with many small
+    // requests from concurrent callers: syscalls are reduced at the cost of
+    // latency. 0 disables the waiting.
+    void set_write_coalescing_us(int32_t us)
+    { _write_coalescing_us.store(us, butil::memory_order_relaxed); }
+    int32_t write_coalescing_us() const
+    { return _write_coalescing_us.load(butil::memory_order_relaxed); }
+
     // Tag the socket so that the response coming back from socket will be
     // parsed progressively. For example: in HTTP, the RPC may end w/o reading
     // the body part fully.
@@ -509,10 +637,18 @@ public:
     bool is_read_progressive() const
     { return _connection_type_for_progressive_read != CONNECTION_TYPE_UNKNOWN; }
 
+    // ConnectionType passed to read_will_be_progressive().
+    ConnectionType connection_type_for_progressive_read() const
+    { return _connection_type_for_progressive_read; }
+
     // Handle the socket according to its connection_type when the progressive
     // reading is finally done.
     void OnProgressiveReadCompleted();
 
+    // Realtime in microseconds when the fd was reset, which changes after
+    // each reconnection.
+    int64_t reset_fd_real_us() const { return _reset_fd_real_us; }
+
     // Last cpuwide-time at when this socket was read or write.
     int64_t last_active_time_us() const {
         return std::max(
@@ -526,8 +662,14 @@ public:
     // Returns true if the remote side is overcrowded.
     bool is_overcrowded() const { return _overcrowded; }
 
+    // Bytes written into this socket but not sent to the peer yet.
+    int64_t unwritten_bytes() const
+    { return _unwritten_bytes.load(butil::memory_order_relaxed); }
+
     bthread_keytable_pool_t* keytable_pool() const { return _keytable_pool; }
 
+    bthread_tag_t bthread_tag() const { return _bthread_tag; }
+
 private:
     DISALLOW_COPY_AND_ASSIGN(Socket);
 
@@ -557,6 +699,42 @@ friend void DereferenceSocket(Socket*);
     // success, -1 otherwise and errno is set
     ssize_t DoWrite(WriteRequest* req);
 
+    // Write `data_list' into the fd with MSG_ZEROCOPY. Blocks of written
+    // bytes are kept in _zerocopy_q until the kernel reports completion.
+    ssize_t DoZeroCopyWrite(butil::IOBuf* const* data_list, size_t ndata);
+
+    // Write `data_list' whose last element belongs to `file_req', and then
+    // the file region of `file_req' by sendfile() if all data were written.
+    ssize_t DoFileWrite(butil::IOBuf* const* data_list, size_t ndata,
+                        WriteRequest* file_req);
+
+    // Called by EventDispatcher on EPOLLERR. Drain completion notifications
+    // of zero-copy writes from the error queue and release written blocks.
+    static void HandleZeroCopyCompletion(SocketId socket_id);
+    void ReapZeroCopyCompletions();
+    void OnZeroCopyCompleted(uint32_t lo, uint32_t hi, bool copied);
+
+    // Release blocks of zero-copy writes after the fd is closed.
+    void ReleaseZeroCopyBuffers();
+
+    // Read from the ShmTransport `shm', including the reply of handshake
+    // at client-side.
+    ssize_t DoShmRead(ShmTransport* shm, size_t size_hint);
+    // [Server] Read the first bytes of the connection which may be the
+    // hello of ShmTransport.
+    ssize_t ReadShmHello(size_t size_hint);
+    // Remove the ShmTransport from `fd' which is about to be closed.
+    void ReleaseShmTransport(int fd);
+
+    // Read from the RdmaEndpoint `ep', including the reply of handshake at
+    // client-side.
+    ssize_t DoRdmaRead(rdma::RdmaEndpoint* ep, size_t size_hint);
+    // [Server] Read the first bytes of the connection which may be the
+    // hello of RdmaEndpoint.
+    ssize_t ReadRdmaHello(size_t size_hint);
+    // Remove the RdmaEndpoint from `fd' which is about to be closed.
+    void ReleaseRdmaEndpoint(int fd);
+
     // Called before returning to pool.
     void OnRecycle();
 
@@ -567,6 +745,16 @@ friend void DereferenceSocket(Socket*);
     // is writable or not even when it returns 0
     int WaitEpollOut(int fd, bool pollin, const timespec* abstime);
 
+    // [Not thread-safe] Same as WaitEpollOut(fd, true, abstime) except that
+    // EPOLLOUT stays in epoll after the first call (-socket_keep_epollout).
+    // Returns immediately if the value of _epollout_butex is not
+    // `expected_val', which should be loaded before the write failing with
+    // EAGAIN, otherwise the edge-triggered EPOLLOUT may be missed.
+    int WaitKeptEpollOut(int fd, int expected_val, const timespec* abstime);
+
+    // Wait until the value of _epollout_butex is not `expected_val'.
+    int WaitEpollOutButex(int expected_val, const timespec* abstime);
+
     // [Not thread-safe] Establish a tcp connection to `remote_side()'
     // If `on_connect' is NULL, this function blocks current thread
     // until connected/timeout. Otherwise, it returns immediately after
@@ -584,7 +772,10 @@ friend void DereferenceSocket(Socket*);
     //   -1 - Failed to connect to remote side
     int ConnectIfNot(const timespec* abstime, WriteRequest* req);
 
-    int ResetFileDescriptor(int fd);
+    int ResetFileDescriptor(int fd, bool nonblocking_cloexec = false);
+
+    // The EventDispatcher watching `fd' of this socket.
+    EventDispatcher& GetEventDispatcher(int fd) const;
 
     // Wait until nref hits `expected_nref' and reset some internal resources.
     int WaitAndReset(int32_t expected_nref);
@@ -595,6 +786,7 @@ friend void DereferenceSocket(Socket*);
     static void* ProcessEvent(void*);
 
     static void* KeepWrite(void*);
+    static void* KeepWriteAfterCoalescing(void*);
 
     bool IsWriteComplete(WriteRequest* old_head, bool singular_node,
                          WriteRequest** new_tail);
@@ -628,12 +820,20 @@ friend void DereferenceSocket(Socket*);
     // Default impl. of health checking.
     int CheckHealth();
 
+    // [Not thread-safe] Connect to remote_side() and block until connected
+    // (including SSL handshake) or `abstime'. Returns 0 on success.
+    int ConnectAndWait(const timespec* abstime);
+
+    SocketPool* GetOrNewSocketPool();
+
     // Add a stream over this Socket. And |stream_id| would be automatically
     // closed when this socket fails.
     // Retuns 0 on success. -1 otherwise, indicating that this is currently a
     // broken socket.
     int AddStream(StreamId stream_id);
     int RemoveStream(StreamId stream_id);
+    // Number of streams added and not removed yet.
+    size_t StreamCount();
     void ResetAllStreams();
 
     bool ValidFileDescriptor(int fd);
@@ -661,7 +861,26 @@ friend void DereferenceSocket(Socket*);
 
     void CancelUnwrittenBytes(size_t bytes);
 
+    // Count `bytes' queued for writing, turn on _overcrowded when there're
+    // too many unwritten bytes.
+    void AddUnwrittenBytes(size_t bytes);
+
+    // Fail a write because the socket is overcrowded.
+    int RejectOvercrowdedWrite(bthread_id_t id_wait);
+
+    // Measure the time that `req' waits behind earlier writes, unless
+    // another request of this socket is being measured.
+    void ProbeQueuedWrite(WriteRequest* req);
+    // Called when `req' is done, record the waiting time if `req' is
+    // measured and `written' is true.
+    void FinishWriteProbe(WriteRequest* req, bool written);
+
 private:
+    // Fields are grouped by sides accessing them and groups except the cold
+    // one start at new cachelines, so that the reading side, the writing
+    // side and references from all threads don't falsely share cachelines.
+    // Put new fields into the group matching their accesses.
+
     // unsigned 32-bit version + signed 32-bit referenced-count.
     // Meaning of version:
     // * Created version: no SetFailed() is called on the Socket yet. Must be
@@ -672,25 +891,19 @@ private:
     // * Other versions: the socket is already recycled.
     butil::atomic<uint64_t> _versioned_ref;
 
+    // [ Read-mostly ]
+    // Set when the socket is created or connected, read by both sides.
+
     // In/Out bytes/messages, SocketPool etc
     // _shared_part is shared by a main socket and all its pooled sockets.
     // Can't use intrusive_ptr because the creation is based on optimistic
     // locking and relies on atomic CAS. We manage references manually.
-    butil::atomic<SharedPart*> _shared_part;
+    butil::atomic<SharedPart*> BAIDU_CACHELINE_ALIGNMENT _shared_part;
 
-    // [ Set in dispatcher ]
-    // To keep the callback in at most one bthread at any time. Read comments
-    // about ProcessEvent in socket.cpp to understand the tricks.
-    butil::atomic<int> _nevent;
-
-    // May be set by Acceptor to share keytables between reading threads
-    // on sockets created by the Acceptor.
-    bthread_keytable_pool_t* _keytable_pool;
+    // Identifier of this Socket in ResourcePool
+    SocketId _this_id;
 
-    // [ Set in ResetFileDescriptor ]
     butil::atomic<int> _fd;  // -1 when not connected.
-    int _tos;                // Type of service which is actually only 8bits.
-    int64_t _reset_fd_real_us; // When _fd was reset, in microseconds.
 
     // Address of peer. Initialized by SocketOptions.remote_side.
     butil::EndPoint _remote_side;
@@ -710,25 +923,54 @@ private:
     // Customize creation of the connection. Initialized by SocketOptions.conn
     SocketConnection* _conn;
 
-    // User-level connection after TCP-connected.
-    // Initialized by SocketOptions.app_connect.
-    std::shared_ptr<AppConnect> _app_connect;
+    // May be set by Acceptor to share keytables between reading threads
+    // on sockets created by the Acceptor.
+    bthread_keytable_pool_t* _keytable_pool;
 
-    // Identifier of this Socket in ResourcePool
-    SocketId _this_id;
+    // Set by Acceptor to process input events on workers of the server.
+    bthread_tag_t _bthread_tag;
+
+    SSLState _ssl_state;
+    SSL* _ssl_session;               // owner
+
+    // Records written to the fd are encrypted by the kernel(kTLS)
+    bool _ktls_send;
+
+    // Pass from controller, for progressive reading.
+    ConnectionType _connection_type_for_progressive_read;
+    butil::atomic<bool> _controller_released_socket;
+
+    // Set by disable_single_connection(), kept after reviving.
+    butil::atomic<bool> _single_connection_disabled;
+
+    // Set by enable_compact_rpc_meta()
+    butil::atomic<bool> _compact_rpc_meta;
+
+    // Set by set_write_coalescing_us()
+    butil::atomic<int32_t> _write_coalescing_us;
+
+    // Set by SetLogOff
+    butil::atomic<bool> _logoff_flag;
+
+    // [ Reading side ]
+    // Modified by the dispatcher and the bthread processing input.
+
+    // To keep the callback in at most one bthread at any time. Read comments
+    // about ProcessEvent in socket.cpp to understand the tricks.
+    butil::atomic<int> BAIDU_CACHELINE_ALIGNMENT _nevent;
 
     // last chosen index of the protocol as a heuristic value to avoid
     // iterating all protocol handlers each time.
     int _preferred_index;
 
-    // Number of HC since the last SetFailed() was called. Set to 0 when the
-    // socket is revived. Only set in HealthCheckTask::OnTriggeringTask()
-    int _hc_count;
-
     // Size of current incomplete message, set to 0 on complete.
     uint32_t _last_msg_size;
     // Average message size of last #MSG_SIZE_WINDOW messages (roughly)
     uint32_t _avg_msg_size;
+    // Bytes to read at least in next DoRead(). Doubled when a read fills
+    // the requested size and halved when a read gets much less, which is
+    // similar to autotuning of TCP receive buffers.
+    uint32_t _read_size;
 
     // Storing data read from `_fd' but cut-off yet.
     butil::IOPortal _read_buf;
@@ -744,9 +986,6 @@ private:
     // connection simultaneously.
     uint64_t _correlation_id;
 
-    // Non-zero when health-checking is on.
-    int _health_check_interval_s;
-
     // +-1 bit-+---31 bit---+
     // |  flag |   counter  |
     // +-------+------------+
@@ -754,6 +993,59 @@ private:
     // 31-bit counter of requests that are currently being processed
     butil::atomic<uint32_t> _ninprocess;
 
+    // [ Writing side ]
+    // Modified by threads writing into the socket and KeepWrite.
+
+    // Storing data that are not flushed into `fd' yet.
+    butil::atomic<WriteRequest*> BAIDU_CACHELINE_ALIGNMENT _write_head;
+
+    // True if the socket is too full to write.
+    volatile bool _overcrowded;
+
+    // Set with cpuwide_time_us() at last write operation
+    butil::atomic<int64_t> _last_writetime_us;
+    // Queued but written
+    butil::atomic<int64_t> _unwritten_bytes;
+    // Max of _unwritten_bytes since the socket was created.
+    butil::atomic<int64_t> _unwritten_bytes_max;
+    // Times of writes rejected with EOVERCROWDED.
+    butil::atomic<int64_t> _novercrowded;
+    // The queued request being measured by ProbeQueuedWrite() and when it
+    // was queued.
+    butil::atomic<WriteRequest*> _write_probe;
+    butil::atomic<int64_t> _write_probe_us;
+    // Max waiting time of measured requests.
+    butil::atomic<int64_t> _write_queue_max_us;
+
+    // Butex to wait for EPOLLOUT event
+    butil::atomic<int>* _epollout_butex;
+    // Number of bthreads waiting on _epollout_butex, EPOLLOUT events are
+    // not waking up anyone when it's 0.
+    butil::atomic<int> _nepollout_waiter;
+    // EPOLLOUT of the fd is kept in epoll, see WaitKeptEpollOut().
+    bool _epollout_kept;
+
+    // [ Cold ]
+    // Used in connecting, authentication, health checking, failing etc.
+
+    // Type of service which is actually only 8bits.
+    int BAIDU_CACHELINE_ALIGNMENT _tos;
+    // When _fd was reset, in microseconds.
+    int64_t _reset_fd_real_us;
+
+    // User-level connection after TCP-connected.
+    // Initialized by SocketOptions.app_connect.
+    std::shared_ptr<AppConnect> _app_connect;
+
+    int _event_dispatcher_index;
+
+    // Number of HC since the last SetFailed() was called. Set to 0 when the
+    // socket is revived. Only set in HealthCheckTask::OnTriggeringTask()
+    int _hc_count;
+
+    // Non-zero when health-checking is on.
+    int _health_check_interval_s;
+
     // +---32 bit---+---32 bit---+
     // |  auth flag | auth error |
     // +------------+------------+
@@ -768,22 +1060,12 @@ private:
     // exists in server side
     AuthContext* _auth_context;
 
-    SSLState _ssl_state;
-    SSL* _ssl_session;               // owner
     std::shared_ptr<SocketSSLContext> _ssl_ctx;
 
-    // Pass from controller, for progressive reading.
-    ConnectionType _connection_type_for_progressive_read;
-    butil::atomic<bool> _controller_released_socket;
-
-    // True if the socket is too full to write.
-    volatile bool _overcrowded;
+    std::shared_ptr<const SocketTuningOptions> _tuning_options;
 
     bool _fail_me_at_server_stop;
 
-    // Set by SetLogOff
-    butil::atomic<bool> _logoff_flag;
-
     // Flag used to mark whether additional reference has been decreased
     // by either `SetFailed' or `SetRecycle'
     butil::atomic<bool> _recycle_flag;
@@ -803,20 +1085,34 @@ private:
     pthread_mutex_t _id_wait_list_mutex;
     bthread_id_list_t _id_wait_list;
 
-    // Set with cpuwide_time_us() at last write operation
-    butil::atomic<int64_t> _last_writetime_us;
-    // Queued but written
-    butil::atomic<int64_t> _unwritten_bytes;
-
-    // Butex to wait for EPOLLOUT event
-    butil::atomic<int>* _epollout_butex;
-
-    // Storing data that are not flushed into `fd' yet.
-    butil::atomic<WriteRequest*> _write_head;
-
     butil::Mutex _stream_mutex;
     std::set<StreamId> *_stream_set;
 
+    // True if SO_ZEROCOPY is set on _fd successfully.
+    bool _zerocopy_enabled;
+    // Zero-copy writes not completed by the kernel yet, the first one
+    // has notification id _zerocopy_first_id.
+    struct ZeroCopyBuffer;
+    butil::Mutex _zerocopy_mutex;
+    std::deque<ZeroCopyBuffer>* _zerocopy_q;
+    uint32_t _zerocopy_first_id;
+
+    // Non-NULL when bytes of this unix domain socket are (being negotiated
+    // to be) carried by shared memory, see details/shm_transport.h
+    butil::atomic<ShmTransport*> _shm_transport;
+    // True before reading anything from a server-side unix domain socket.
+    bool _shm_hello_expected;
+    // Attach rings in the hello rather than declining it.
+    bool _shm_transport_accepted;
+
+    // Non-NULL when bytes of this TCP connection are (being negotiated to
+    // be) carried by RDMA, see rdma/rdma_endpoint.h
+    butil::atomic<rdma::RdmaEndpoint*> _rdma_endpoint;
+    // True before reading anything from a server-side TCP connection.
+    bool _rdma_hello_expected;
+    // Accept rather than decline the hello.
+    bool _rdma_accepted;
+
     butil::atomic<int64_t> _ninflight_app_health_check;
 };
 
@@ -61,6 +61,11 @@ inline SocketOptions::SocketOptions()
     , conn(NULL)
     , app_connect(NULL)
     , initial_parsing_context(NULL)
+    , event_dispatcher_index(-1)
+    , bthread_tag(BTHREAD_TAG_INVALID)
+    , fd_nonblocking_cloexec(false)
+    , shm_transport(false)
+    , use_rdma(false)
 {}
 
 inline int Socket::Dereference() {
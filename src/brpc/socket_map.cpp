@@ -18,6 +18,7 @@
 
 #include <gflags/gflags.h>
 #include <map>
+#include <algorithm>                          // std::max
 #include "bthread/bthread.h"
 #include "butil/time.h"
 #include "butil/scoped_lock.h"
@@ -27,6 +28,8 @@
 #include "brpc/input_messenger.h"
 #include "brpc/reloadable_flags.h"
 #include "brpc/socket_map.h"
+#include "brpc/details/shm_transport.h"         // GetShmConnect
+#include "brpc/rdma/rdma_endpoint.h"            // GetRdmaConnect
 
 namespace brpc {
 
@@ -46,6 +49,9 @@ DEFINE_int32(defer_close_second, 0,
              "non-positive values.");
 BRPC_VALIDATE_GFLAG(defer_close_second, PassValidate);
 
+DECLARE_int32(min_connection_pool_size);
+DECLARE_bool(shm_transport);
+
 DEFINE_bool(show_socketmap_in_vars, false,
             "[DEBUG] Describe SocketMaps in /vars");
 BRPC_VALIDATE_GFLAG(show_socketmap_in_vars, PassValidate);
@@ -58,6 +64,16 @@ public:
     int CreateSocket(const SocketOptions& opt, SocketId* id) {
         SocketOptions sock_opt = opt;
         sock_opt.health_check_interval_s = FLAGS_health_check_interval;
+        if (FLAGS_shm_transport && sock_opt.app_connect == NULL &&
+            sock_opt.initial_ssl_ctx == NULL &&
+            butil::get_endpoint_type(sock_opt.remote_side) == AF_UNIX) {
+            sock_opt.app_connect = GetShmConnect();
+        }
+        if (sock_opt.use_rdma && sock_opt.app_connect == NULL &&
+            sock_opt.initial_ssl_ctx == NULL &&
+            butil::get_endpoint_type(sock_opt.remote_side) != AF_UNIX) {
+            sock_opt.app_connect = rdma::GetRdmaConnect();
+        }
         return get_client_side_messenger()->Create(sock_opt, id);
     }
 };
@@ -89,6 +105,14 @@ SocketMap* get_or_new_client_side_socket_map() {
 int SocketMapInsert(const SocketMapKey& key, SocketId* id,
                     const std::shared_ptr<SocketSSLContext>& ssl_ctx) {
     return get_or_new_client_side_socket_map()->Insert(key, id, ssl_ctx);
+}
+
+int SocketMapInsert(const SocketMapKey& key, SocketId* id,
+                    const std::shared_ptr<SocketSSLContext>& ssl_ctx,
+                    const std::shared_ptr<const SocketTuningOptions>& tuning_options,
+                    bool use_rdma) {
+    return get_or_new_client_side_socket_map()->Insert(
+        key, id, ssl_ctx, tuning_options, use_rdma);
 }    
 
 int SocketMapFind(const SocketMapKey& key, SocketId* id) {
@@ -124,6 +148,7 @@ void SocketMapList(std::vector<SocketId>* ids) {
 SocketMapOptions::SocketMapOptions()
     : socket_creator(NULL)
     , suggested_map_size(1024)
+    , nshard(32)
     , idle_timeout_second_dynamic(NULL)
     , idle_timeout_second(0)
     , defer_close_second_dynamic(NULL)
@@ -142,10 +167,11 @@ SocketMap::~SocketMap() {
         bthread_stop(_close_idle_thread);
         bthread_join(_close_idle_thread, NULL);
     }
-    if (!_map.empty()) {
-        std::ostringstream err;
-        int nleft = 0;
-        for (Map::iterator it = _map.begin(); it != _map.end(); ++it) {
+    std::ostringstream err;
+    int nleft = 0;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        Map& map = _shards[i]->map;
+        for (Map::iterator it = map.begin(); it != map.end(); ++it) {
             SingleConnection* sc = &it->second;
             if ((!sc->socket->Failed() ||
                  sc->socket->health_check_interval() > 0/*HC enabled*/) &&
@@ -157,9 +183,11 @@ SocketMap::~SocketMap() {
                 err << ' ' << *sc->socket;
             }
         }
-        if (nleft) {
-            LOG(ERROR) << err.str();
-        }
+        delete _shards[i];
+    }
+    _shards.clear();
+    if (nleft) {
+        LOG(ERROR) << err.str();
     }
 
     delete _this_map_bvar;
@@ -179,9 +207,18 @@ int SocketMap::Init(const SocketMapOptions& options) {
         LOG(ERROR) << "SocketOptions.socket_creator must be set";
         return -1;
     }
-    if (_map.init(_options.suggested_map_size, 70) != 0) {
-        LOG(ERROR) << "Fail to init _map";
-        return -1;
+    if (_options.nshard == 0) {
+        _options.nshard = 1;
+    }
+    const size_t map_size =
+        std::max(_options.suggested_map_size / _options.nshard, (size_t)16);
+    _shards.resize(_options.nshard);
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        _shards[i] = new Shard;
+        if (_shards[i]->map.init(map_size, 70) != 0) {
+            LOG(ERROR) << "Fail to init map of shard=" << i;
+            return -1;
+        }
     }
     if (_options.idle_timeout_second_dynamic != NULL ||
         _options.idle_timeout_second > 0) {
@@ -198,21 +235,37 @@ int SocketMap::Init(const SocketMapOptions& options) {
 void SocketMap::Print(std::ostream& os) {
     // TODO: Elaborate.
     size_t count = 0;
-    {
-        std::unique_lock<butil::Mutex> mu(_mutex);
-        count = _map.size();
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i]->mutex);
+        count += _shards[i]->map.size();
     }
-    os << "count=" << count;
+    os << "count=" << count
+       << " nshard=" << _shards.size();
 }
 
 void SocketMap::PrintSocketMap(std::ostream& os, void* arg) {
     static_cast<SocketMap*>(arg)->Print(os);
 }
 
+void SocketMap::ExposeInBvar() {
+    if (!FLAGS_show_socketmap_in_vars ||
+        _exposed_in_bvar.load(butil::memory_order_relaxed) ||
+        _exposed_in_bvar.exchange(true, butil::memory_order_relaxed)) {
+        return;
+    }
+    char namebuf[32];
+    int len = snprintf(namebuf, sizeof(namebuf), "rpc_socketmap_%p", this);
+    _this_map_bvar = new bvar::PassiveStatus<std::string>(
+        butil::StringPiece(namebuf, len), PrintSocketMap, this);
+}
+
 int SocketMap::Insert(const SocketMapKey& key, SocketId* id,
-                      const std::shared_ptr<SocketSSLContext>& ssl_ctx) {
-    std::unique_lock<butil::Mutex> mu(_mutex);
-    SingleConnection* sc = _map.seek(key);
+                      const std::shared_ptr<SocketSSLContext>& ssl_ctx,
+                      const std::shared_ptr<const SocketTuningOptions>& tuning_options,
+                      bool use_rdma) {
+    Shard* shard = GetShard(key);
+    std::unique_lock<butil::Mutex> mu(shard->mutex);
+    SingleConnection* sc = shard->map.seek(key);
     if (sc) {
         if (!sc->socket->Failed() ||
             sc->socket->health_check_interval() > 0/*HC enabled*/) {
@@ -222,7 +275,7 @@ int SocketMap::Insert(const SocketMapKey& key, SocketId* id,
         }
         // A socket w/o HC is failed (permanently), replace it.
         SocketUniquePtr ptr(sc->socket);  // Remove the ref added at insertion.
-        _map.erase(key); // in principle, we can override the entry in map w/o
+        shard->map.erase(key); // in principle, we can override the entry in map w/o
         // removing and inserting it again. But this would make error branches
         // below have to remove the entry before returning, which is
         // error-prone. We prefer code maintainability here.
@@ -232,6 +285,8 @@ int SocketMap::Insert(const SocketMapKey& key, SocketId* id,
     SocketOptions opt;
     opt.remote_side = key.peer.addr;
     opt.initial_ssl_ctx = ssl_ctx;
+    opt.tuning_options = tuning_options;
+    opt.use_rdma = use_rdma;
     if (_options.socket_creator->CreateSocket(opt, &tmp_id) != 0) {
         PLOG(FATAL) << "Fail to create socket to " << key.peer;
         return -1;
@@ -245,20 +300,10 @@ int SocketMap::Insert(const SocketMapKey& key, SocketId* id,
         return -1;
     }
     SingleConnection new_sc = { 1, ptr.release(), 0 };
-    _map[key] = new_sc;
+    shard->map[key] = new_sc;
     *id = tmp_id;
-    bool need_to_create_bvar = false;
-    if (FLAGS_show_socketmap_in_vars && !_exposed_in_bvar) {
-        _exposed_in_bvar = true;
-        need_to_create_bvar = true;
-    }
     mu.unlock();
-    if (need_to_create_bvar) {
-        char namebuf[32];
-        int len = snprintf(namebuf, sizeof(namebuf), "rpc_socketmap_%p", this);
-        _this_map_bvar = new bvar::PassiveStatus<std::string>(
-            butil::StringPiece(namebuf, len), PrintSocketMap, this);
-    }
+    ExposeInBvar();
     return 0;
 }
 
@@ -269,8 +314,9 @@ void SocketMap::Remove(const SocketMapKey& key, SocketId expected_id) {
 void SocketMap::RemoveInternal(const SocketMapKey& key,
                                SocketId expected_id,
                                bool remove_orphan) {
-    std::unique_lock<butil::Mutex> mu(_mutex);
-    SingleConnection* sc = _map.seek(key);
+    Shard* shard = GetShard(key);
+    std::unique_lock<butil::Mutex> mu(shard->mutex);
+    SingleConnection* sc = shard->map.seek(key);
     if (!sc) {
         return;
     }
@@ -288,19 +334,9 @@ void SocketMap::RemoveInternal(const SocketMapKey& key,
             sc->no_ref_us = butil::cpuwide_time_us();
         } else {
             Socket* const s = sc->socket;
-            _map.erase(key);
-            bool need_to_create_bvar = false;
-            if (FLAGS_show_socketmap_in_vars && !_exposed_in_bvar) {
-                _exposed_in_bvar = true;
-                need_to_create_bvar = true;
-            }
+            shard->map.erase(key);
             mu.unlock();
-            if (need_to_create_bvar) {
-                char namebuf[32];
-                int len = snprintf(namebuf, sizeof(namebuf), "rpc_socketmap_%p", this);
-                _this_map_bvar = new bvar::PassiveStatus<std::string>(
-                    butil::StringPiece(namebuf, len), PrintSocketMap, this);
-            }
+            ExposeInBvar();
             s->ReleaseAdditionalReference(); // release extra ref
             SocketUniquePtr ptr(s);  // Dereference
         }
@@ -308,8 +344,9 @@ void SocketMap::RemoveInternal(const SocketMapKey& key,
 }
 
 int SocketMap::Find(const SocketMapKey& key, SocketId* id) {
-    BAIDU_SCOPED_LOCK(_mutex);
-    SingleConnection* sc = _map.seek(key);
+    Shard* shard = GetShard(key);
+    BAIDU_SCOPED_LOCK(shard->mutex);
+    SingleConnection* sc = shard->map.seek(key);
     if (sc) {
         *id = sc->socket->id();
         return 0;
@@ -319,28 +356,37 @@ int SocketMap::Find(const SocketMapKey& key, SocketId* id) {
 
 void SocketMap::List(std::vector<SocketId>* ids) {
     ids->clear();
-    BAIDU_SCOPED_LOCK(_mutex);
-    for (Map::iterator it = _map.begin(); it != _map.end(); ++it) {
-        ids->push_back(it->second.socket->id());
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i]->mutex);
+        Map& map = _shards[i]->map;
+        for (Map::iterator it = map.begin(); it != map.end(); ++it) {
+            ids->push_back(it->second.socket->id());
+        }
     }
 }
 
 void SocketMap::List(std::vector<butil::EndPoint>* pts) {
     pts->clear();
-    BAIDU_SCOPED_LOCK(_mutex);
-    for (Map::iterator it = _map.begin(); it != _map.end(); ++it) {
-        pts->push_back(it->second.socket->remote_side());
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i]->mutex);
+        Map& map = _shards[i]->map;
+        for (Map::iterator it = map.begin(); it != map.end(); ++it) {
+            pts->push_back(it->second.socket->remote_side());
+        }
     }
 }
 
 void SocketMap::ListOrphans(int64_t defer_us, std::vector<SocketMapKey>* out) {
     out->clear();
     const int64_t now = butil::cpuwide_time_us();
-    BAIDU_SCOPED_LOCK(_mutex);
-    for (Map::iterator it = _map.begin(); it != _map.end(); ++it) {
-        SingleConnection& sc = it->second;
-        if (sc.ref_count == 0 && now - sc.no_ref_us >= defer_us) {
-            out->push_back(it->first);
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i]->mutex);
+        Map& map = _shards[i]->map;
+        for (Map::iterator it = map.begin(); it != map.end(); ++it) {
+            SingleConnection& sc = it->second;
+            if (sc.ref_count == 0 && now - sc.no_ref_us >= defer_us) {
+                out->push_back(it->first);
+            }
         }
     }
 }
@@ -360,13 +406,26 @@ void SocketMap::WatchConnections() {
         const int idle_seconds = _options.idle_timeout_second_dynamic ?
             *_options.idle_timeout_second_dynamic
             : _options.idle_timeout_second;
+        List(&main_sockets);
+        for (size_t i = 0; i < main_sockets.size(); ++i) {
+            SocketUniquePtr s;
+            if (Socket::Address(main_sockets[i], &s) == 0) {
+                s->ResizeSocketPool();
+            }
+        }
         if (idle_seconds > 0) {
-            // Check idle pooled connections
-            List(&main_sockets);
+            // Check idle pooled connections, except the most recently used
+            // ones kept by -min_connection_pool_size.
+            const size_t nkept = FLAGS_min_connection_pool_size;
             for (size_t i = 0; i < main_sockets.size(); ++i) {
                 SocketUniquePtr s;
                 if (Socket::Address(main_sockets[i], &s) == 0) {
                     s->ListPooledSockets(&pooled_sockets);
+                    if (pooled_sockets.size() > nkept) {
+                        pooled_sockets.resize(pooled_sockets.size() - nkept);
+                    } else {
+                        pooled_sockets.clear();
+                    }
                     for (size_t i = 0; i < pooled_sockets.size(); ++i) {
                         SocketUniquePtr s2;
                         if (Socket::Address(pooled_sockets[i], &s2) == 0) {
@@ -81,6 +81,13 @@ struct SocketMapKeyHasher {
 // Return 0 on success, -1 otherwise.
 int SocketMapInsert(const SocketMapKey& key, SocketId* id,
                     const std::shared_ptr<SocketSSLContext>& ssl_ctx);
+// Sockets created by this call are tuned with `tuning_options' and carried
+// by RDMA if `use_rdma' is true. Channels with different tuning options or
+// `use_rdma' must have different signatures in `key'.
+int SocketMapInsert(const SocketMapKey& key, SocketId* id,
+                    const std::shared_ptr<SocketSSLContext>& ssl_ctx,
+                    const std::shared_ptr<const SocketTuningOptions>& tuning_options,
+                    bool use_rdma = false);
 
 inline int SocketMapInsert(const SocketMapKey& key, SocketId* id) {
     std::shared_ptr<SocketSSLContext> empty_ptr;
@@ -119,6 +126,12 @@ struct SocketMapOptions {
     // Initial size of the map (proper size reduces number of resizes)
     // Default: 1024
     size_t suggested_map_size;
+
+    // Split the map into so many shards with separate locks so that
+    // inserting and removing sockets of different keys (e.g. creating
+    // channels or changes of naming services) do not contend.
+    // Default: 32
+    size_t nshard;
     
     // Pooled connections without data transmission for so many seconds will
     // be closed. No effect for non-positive values.
@@ -144,7 +157,14 @@ public:
     ~SocketMap();
     int Init(const SocketMapOptions&);
     int Insert(const SocketMapKey& key, SocketId* id,
-               const std::shared_ptr<SocketSSLContext>& ssl_ctx);
+               const std::shared_ptr<SocketSSLContext>& ssl_ctx,
+               const std::shared_ptr<const SocketTuningOptions>& tuning_options,
+               bool use_rdma = false);
+    int Insert(const SocketMapKey& key, SocketId* id,
+               const std::shared_ptr<SocketSSLContext>& ssl_ctx) {
+        std::shared_ptr<const SocketTuningOptions> empty_ptr;
+        return Insert(key, id, ssl_ctx, empty_ptr);
+    }
     int Insert(const SocketMapKey& key, SocketId* id) {
         std::shared_ptr<SocketSSLContext> empty_ptr;
         return Insert(key, id, empty_ptr);
@@ -172,14 +192,21 @@ private:
         int64_t no_ref_us;
     };
 
-    // TODO: When RpcChannels connecting to one EndPoint are frequently created
-    //       and destroyed, a single map+mutex may become hot-spots.
     typedef butil::FlatMap<SocketMapKey, SingleConnection,
                            SocketMapKeyHasher> Map;
+    struct Shard {
+        butil::Mutex mutex;
+        Map map;
+    };
+
+    Shard* GetShard(const SocketMapKey& key) const {
+        return _shards[SocketMapKeyHasher()(key) % _shards.size()];
+    }
+    void ExposeInBvar();
+
     SocketMapOptions _options;
-    butil::Mutex _mutex;
-    Map _map;
-    bool _exposed_in_bvar;
+    std::vector<Shard*> _shards;
+    butil::atomic<bool> _exposed_in_bvar;
     bvar::PassiveStatus<std::string>* _this_map_bvar;
     bool _has_close_idle_thread;
     bthread_t _close_idle_thread;
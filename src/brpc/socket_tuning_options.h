@@ -0,0 +1,80 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_SOCKET_TUNING_OPTIONS_H
+#define BRPC_SOCKET_TUNING_OPTIONS_H
+
+#include <stdint.h>
+#include <string>
+
+namespace brpc {
+
+// Options set on fds of connections with setsockopt(), so that different
+// kinds of traffic on the same host can be tuned differently, e.g. bulk
+// replication uses BBR and a pacing rate while latency-sensitive RPCs keep
+// the defaults. Options not supported by the platform or the kernel are
+// ignored with warnings.
+struct SocketTuningOptions {
+    SocketTuningOptions()
+        : max_pacing_rate(0)
+        , tos(0)
+        , send_buffer_size(0)
+        , recv_buffer_size(0)
+        , tcp_fastopen(false) {}
+
+    // TCP congestion control algorithm(TCP_CONGESTION), e.g. "bbr",
+    // "cubic". Must be in /proc/sys/net/ipv4/tcp_allowed_congestion_control
+    // for unprivileged processes. Linux only.
+    // Default: "" (system default)
+    std::string congestion_control;
+
+    // Max sending rate of a connection in bytes per second
+    // (SO_MAX_PACING_RATE). Linux only.
+    // Default: 0 (unlimited)
+    int64_t max_pacing_rate;
+
+    // Type of service(IP_TOS), the upper 6 bits are DSCP. Overridden by
+    // Controller::set_type_of_service().
+    // Default: 0 (not set)
+    int tos;
+
+    // Sizes of kernel buffers(SO_SNDBUF/SO_RCVBUF), overriding
+    // -socket_send_buffer_size and -socket_recv_buffer_size.
+    // Default: 0 (use the gflags)
+    int send_buffer_size;
+    int recv_buffer_size;
+
+    // Connect with TCP Fast Open(TCP_FASTOPEN_CONNECT, Linux >= 4.11), so
+    // that the first request to a server connected before is carried by
+    // SYN, saving the round trip of handshake over WAN. Servers must enable
+    // it as well(ServerOptions.tcp_fastopen_queue_length) and the client
+    // side must be allowed by sysctl net.ipv4.tcp_fastopen(bit 1).
+    // Default: false
+    bool tcp_fastopen;
+
+    // True if all options are default.
+    bool empty() const {
+        return congestion_control.empty() && max_pacing_rate <= 0 &&
+            tos <= 0 && send_buffer_size <= 0 && recv_buffer_size <= 0 &&
+            !tcp_fastopen;
+    }
+};
+
+} // namespace brpc
+
+#endif // BRPC_SOCKET_TUNING_OPTIONS_H
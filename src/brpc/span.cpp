@@ -29,9 +29,12 @@
 #include "butil/object_pool.h"
 #include "butil/fast_rand.h"
 #include "butil/file_util.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "bvar/bvar.h"
 #include "brpc/shared_object.h"
 #include "brpc/reloadable_flags.h"
 #include "brpc/span.h"
+#include "brpc/details/span_exporter.h"
 
 #define BRPC_SPAN_INFO_SEP "\1"
 
@@ -59,6 +62,37 @@ BRPC_VALIDATE_GFLAG(rpcz_keep_span_seconds, PositiveInteger);
 
 DEFINE_bool(rpcz_keep_span_db, false, "Don't remove DB of rpcz at program's exit");
 
+DEFINE_bool(rpcz_save_to_leveldb, true,
+            "Index spans into leveldb under -rpcz_database_dir. If false, "
+            "only the most recent -rpcz_ring_size spans are kept in memory");
+
+DEFINE_int32(rpcz_ring_size, 16384,
+             "Keep at most so many spans in memory when -rpcz_save_to_leveldb "
+             "is false. Read when the first span is dumped");
+BRPC_VALIDATE_GFLAG(rpcz_ring_size, PositiveInteger);
+
+DEFINE_bool(rpcz_tail_sampling, false,
+            "Create spans for all requests when rpcz is on and decide when "
+            "they end: failed ones, slow ones(see "
+            "-rpcz_tail_sampling_latency_us and "
+            "-rpcz_tail_sampling_percentile) and ones sampled under the speed "
+            "limit of rpcz are kept, others are dropped");
+BRPC_VALIDATE_GFLAG(rpcz_tail_sampling, PassValidate);
+
+DEFINE_int64(rpcz_tail_sampling_latency_us, 0,
+             "Keep spans taking at least so many microseconds when "
+             "-rpcz_tail_sampling is on, 0 means no such threshold");
+BRPC_VALIDATE_GFLAG(rpcz_tail_sampling_latency_us, NonNegativeInteger);
+
+DEFINE_int32(rpcz_tail_sampling_percentile, 99,
+             "Keep spans slower than this percentile of recently ended spans "
+             "when -rpcz_tail_sampling is on, 0 means no such threshold");
+static bool validate_rpcz_tail_sampling_percentile(const char*, int32_t val) {
+    return val >= 0 && val < 100;
+}
+BRPC_VALIDATE_GFLAG(rpcz_tail_sampling_percentile,
+                    validate_rpcz_tail_sampling_percentile);
+
 struct IdGen {
     bool init;
     uint16_t seq;
@@ -124,7 +158,7 @@ Span* Span::CreateClientSpan(const std::string& full_method_name,
     span->_tls_next = NULL;
     span->_full_method_name = full_method_name;
     span->_info.clear();
-    Span* parent = (Span*)bthread::tls_bls.rpcz_parent_span;
+    Span* parent = Span::tls_parent();
     if (parent) {
         span->_trace_id = parent->trace_id();
         span->_parent_span_id = parent->span_id();
@@ -292,11 +326,11 @@ bool SpanInfoExtractor::PopAnnotation(
 }
 
 bool CanAnnotateSpan() {
-    return bthread::tls_bls.rpcz_parent_span;
+    return Span::tls_parent();
 }
 
 void AnnotateSpan(const char* fmt, ...) {
-    Span* span = (Span*)bthread::tls_bls.rpcz_parent_span;
+    Span* span = Span::tls_parent();
     va_list ap;
     va_start(ap, fmt);
     span->Annotate(fmt, ap);
@@ -312,6 +346,8 @@ public:
 
     SpanDB() : id_db(NULL), time_db(NULL) { }
     static SpanDB* Open();
+    // Convert `span' and its client spans into protobufs.
+    static void ToProtos(const Span* span, BriefSpan* brief, RpczSpan* full);
     leveldb::Status Index(const Span* span, std::string* value_buf);
     leveldb::Status RemoveSpansBefore(int64_t tm);
 
@@ -338,6 +374,38 @@ private:
     }
 };
 
+// Recent spans kept in memory instead of leveldb. Written by the rpcz
+// collecting thread only, so the lock is contended only when /rpcz is
+// being read. Memory is bounded by the capacity since slots are reused.
+class SpanRing {
+public:
+    explicit SpanRing(size_t capacity)
+        : _slots(capacity), _next(0), _count(0) {
+        pthread_mutex_init(&_mutex, NULL);
+    }
+
+    // Swap `brief' and `full' into the slot of the oldest span.
+    void Add(BriefSpan* brief, RpczSpan* full);
+    int Find(uint64_t trace_id, uint64_t span_id, RpczSpan* out);
+    void Find(uint64_t trace_id, std::deque<RpczSpan>* out);
+    void List(int64_t before_this_time, size_t max_scan,
+              std::deque<BriefSpan>* out, SpanFilter* filter);
+    void Describe(std::ostream& os);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SpanRing);
+
+    struct Slot {
+        BriefSpan brief;
+        RpczSpan full;
+    };
+
+    pthread_mutex_t _mutex;
+    std::vector<Slot> _slots;
+    size_t _next;
+    size_t _count;
+};
+
 static bool started_span_indexing = false;
 static pthread_once_t start_span_indexing_once = PTHREAD_ONCE_INIT;
 static int64_t g_last_time_key = 0;
@@ -348,7 +416,8 @@ static pthread_mutex_t g_span_db_mutex = PTHREAD_MUTEX_INITIALIZER;
 static bool g_span_ending = false;  // don't open span again if this var is true.
 // Can't use intrusive_ptr which has ctor/dtor issues.
 static SpanDB* g_span_db = NULL;
-bool has_span_db() { return !!g_span_db; }
+static SpanRing* g_span_ring = NULL;
+bool has_span_db() { return g_span_db != NULL || g_span_ring != NULL; }
 bvar::CollectorSpeedLimit g_span_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
 static bvar::DisplaySamplingRatio s_display_sampling_ratio(
     "rpcz_sampling_ratio", &g_span_sl);
@@ -418,8 +487,84 @@ inline int GetSpanDB(butil::intrusive_ptr<SpanDB>* db) {
     return -1;
 }
 
+// Created at the first dump with -rpcz_save_to_leveldb=false and never
+// destroyed, readers may hold it without references.
+static SpanRing* GetOrCreateSpanRing() {
+    BAIDU_SCOPED_LOCK(g_span_db_mutex);
+    if (g_span_ring == NULL) {
+        g_span_ring = new SpanRing(FLAGS_rpcz_ring_size);
+    }
+    return g_span_ring;
+}
+
+inline SpanRing* GetSpanRing() {
+    BAIDU_SCOPED_LOCK(g_span_db_mutex);
+    return g_span_ring;
+}
+
+struct TailSamplingStatus {
+    bvar::LatencyRecorder latency;
+    bvar::Adder<int64_t> kept;
+    bvar::Adder<int64_t> dropped;
+    // Latency of -rpcz_tail_sampling_percentile, updated every second
+    // since computing it is not cheap.
+    butil::atomic<int64_t> percentile_us;
+    butil::atomic<int64_t> last_update_us;
+
+    TailSamplingStatus()
+        : latency("rpcz_tail_sampling")
+        , kept("rpcz_tail_sampling_kept")
+        , dropped("rpcz_tail_sampling_dropped")
+        , percentile_us(0)
+        , last_update_us(0) {}
+};
+
+inline TailSamplingStatus* get_tail_sampling_status() {
+    return butil::get_leaky_singleton<TailSamplingStatus>();
+}
+
+bool IsTailSampled(const Span* span) {
+    TailSamplingStatus* s = get_tail_sampling_status();
+    const int64_t latency_us = std::max<int64_t>(
+        span->GetEndRealTimeUs() - span->GetStartRealTimeUs(), 0);
+    s->latency << latency_us;
+    bool keep = (span->error_code() != 0);
+    if (!keep && FLAGS_rpcz_tail_sampling_latency_us > 0) {
+        keep = (latency_us >= FLAGS_rpcz_tail_sampling_latency_us);
+    }
+    const int32_t percentile = FLAGS_rpcz_tail_sampling_percentile;
+    if (!keep && percentile > 0) {
+        const int64_t now_us = butil::gettimeofday_us();
+        int64_t last_us = s->last_update_us.load(butil::memory_order_relaxed);
+        if (now_us - last_us >= 1000000L &&
+            s->last_update_us.compare_exchange_strong(last_us, now_us)) {
+            s->percentile_us.store(s->latency.latency_percentile(
+                                       percentile / 100.0),
+                                   butil::memory_order_relaxed);
+        }
+        // 0 before any span in the window.
+        const int64_t threshold_us =
+            s->percentile_us.load(butil::memory_order_relaxed);
+        keep = (threshold_us > 0 && latency_us > threshold_us);
+    }
+    if (!keep) {
+        // Spans of ordinary requests are kept at the rate of head sampling.
+        keep = bvar::is_collectable(&g_span_sl);
+    }
+    if (keep) {
+        s->kept << 1;
+    } else {
+        s->dropped << 1;
+    }
+    return keep;
+}
+
 void Span::Submit(Span* span, int64_t cpuwide_time_us) {
     if (span->local_parent() == NULL) {
+        if (FLAGS_rpcz_tail_sampling && !IsTailSampled(span)) {
+            span->destroy();
+            return;
+        }
         span->submit(cpuwide_time_us);
     }
 }
@@ -509,6 +654,31 @@ SpanDB* SpanDB::Open() {
     return db;
 }
 
+void SpanDB::ToProtos(const Span* span, BriefSpan* brief, RpczSpan* full) {
+    const int64_t start_time = span->GetStartRealTimeUs();
+    brief->set_trace_id(span->trace_id());
+    brief->set_span_id(span->span_id());
+    brief->set_log_id(span->log_id());
+    brief->set_type(span->type());
+    brief->set_error_code(span->error_code());
+    brief->set_request_size(span->request_size());
+    brief->set_response_size(span->response_size());
+    brief->set_start_real_us(start_time);
+    brief->set_latency_us(span->GetEndRealTimeUs() - start_time);
+    brief->set_full_method_name(span->full_method_name());
+
+    Span2Proto(span, full);
+    // client spans should be reversed.
+    size_t client_span_count = span->CountClientSpans();
+    for (size_t i = 0; i < client_span_count; ++i) {
+        full->add_client_spans();
+    }
+    size_t i = 0;
+    for (const Span* p = span->_next_client; p; p = p->_next_client, ++i) {
+        Span2Proto(p, full->mutable_client_spans(client_span_count - i - 1));
+    }
+}
+
 leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
     leveldb::WriteOptions options;
     options.sync = false;
@@ -521,16 +691,8 @@ leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
 
     const int64_t start_time = span->GetStartRealTimeUs();
     BriefSpan brief;
-    brief.set_trace_id(span->trace_id());
-    brief.set_span_id(span->span_id());
-    brief.set_log_id(span->log_id());
-    brief.set_type(span->type());
-    brief.set_error_code(span->error_code());
-    brief.set_request_size(span->request_size());
-    brief.set_response_size(span->response_size());
-    brief.set_start_real_us(start_time);
-    brief.set_latency_us(span->GetEndRealTimeUs() - start_time);
-    brief.set_full_method_name(span->full_method_name());
+    RpczSpan value_proto;
+    ToProtos(span, &brief, &value_proto);
     if (!brief.SerializeToString(value_buf)) {
         return leveldb::Status::InvalidArgument(
             leveldb::Slice("Fail to serialize BriefSpan"));
@@ -569,17 +731,6 @@ leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
     ToBigEndian(span->trace_id(), key_data);
     ToBigEndian(span->span_id(), key_data + 2);
     leveldb::Slice key((char*)key_data, sizeof(key_data));
-    RpczSpan value_proto;
-    Span2Proto(span, &value_proto);
-    // client spans should be reversed.
-    size_t client_span_count = span->CountClientSpans();
-    for (size_t i = 0; i < client_span_count; ++i) {
-        value_proto.add_client_spans();
-    }
-    size_t i = 0;
-    for (const Span* p = span->_next_client; p; p = p->_next_client, ++i) {
-        Span2Proto(p, value_proto.mutable_client_spans(client_span_count - i - 1));
-    }
     if (!value_proto.SerializeToString(value_buf)) {
         return leveldb::Status::InvalidArgument(
             leveldb::Slice("Fail to serialize RpczSpan"));
@@ -632,10 +783,86 @@ leveldb::Status SpanDB::RemoveSpansBefore(int64_t tm) {
     return rc;
 }
 
-// Write span into leveldb.
+void SpanRing::Add(BriefSpan* brief, RpczSpan* full) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    Slot& slot = _slots[_next];
+    slot.brief.Swap(brief);
+    slot.full.Swap(full);
+    if (++_next == _slots.size()) {
+        _next = 0;
+    }
+    if (_count < _slots.size()) {
+        ++_count;
+    }
+}
+
+int SpanRing::Find(uint64_t trace_id, uint64_t span_id, RpczSpan* out) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (size_t i = 0; i < _count; ++i) {
+        const RpczSpan& span = _slots[i].full;
+        if (span.trace_id() == trace_id && span.span_id() == span_id) {
+            out->CopyFrom(span);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void SpanRing::Find(uint64_t trace_id, std::deque<RpczSpan>* out) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    for (size_t i = 0; i < _count; ++i) {
+        if (_slots[i].full.trace_id() == trace_id) {
+            out->push_back(_slots[i].full);
+        }
+    }
+}
+
+void SpanRing::List(int64_t before_this_time, size_t max_scan,
+                    std::deque<BriefSpan>* out, SpanFilter* filter) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    size_t nscan = 0;
+    // From the newest to the oldest, spans are dumped in ascending order
+    // of starting time mostly, see SpanPreprocessor.
+    for (size_t i = 0; i < _count && nscan < max_scan; ++i) {
+        const size_t index = (_next + _slots.size() - 1 - i) % _slots.size();
+        const BriefSpan& brief = _slots[index].brief;
+        if (brief.start_real_us() > before_this_time) {
+            continue;
+        }
+        if (NULL == filter || filter->Keep(brief)) {
+            out->push_back(brief);
+        }
+        ++nscan;
+    }
+}
+
+void SpanRing::Describe(std::ostream& os) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    os << "[ in-memory ring ]\nspans: " << _count
+       << "\ncapacity: " << _slots.size() << '\n';
+}
+
+// Write span into leveldb or the in-memory ring.
 void Span::dump_and_destroy(size_t /*round*/) {
     StartIndexingIfNeeded();
 
+    const bool exporting = IsSpanExportEnabled();
+    if (exporting || !FLAGS_rpcz_save_to_leveldb) {
+        BriefSpan brief;
+        RpczSpan full;
+        SpanDB::ToProtos(this, &brief, &full);
+        if (exporting) {
+            ExportSpan(full);
+        }
+        if (!FLAGS_rpcz_save_to_leveldb) {
+            destroy();
+            if (!g_span_ending) {
+                GetOrCreateSpanRing()->Add(&brief, &full);
+            }
+            return;
+        }
+    }
+
     std::string value_buf;
 
     butil::intrusive_ptr<SpanDB> db;
@@ -683,7 +910,8 @@ void Span::dump_and_destroy(size_t /*round*/) {
 int FindSpan(uint64_t trace_id, uint64_t span_id, RpczSpan* response) {
     butil::intrusive_ptr<SpanDB> db;
     if (GetSpanDB(&db) != 0) {
-        return -1;
+        SpanRing* ring = GetSpanRing();
+        return ring ? ring->Find(trace_id, span_id, response) : -1;
     }
     uint32_t key_data[4];
     ToBigEndian(trace_id, key_data);
@@ -705,6 +933,10 @@ void FindSpans(uint64_t trace_id, std::deque<RpczSpan>* out) {
     out->clear();
     butil::intrusive_ptr<SpanDB> db;
     if (GetSpanDB(&db) != 0) {
+        SpanRing* ring = GetSpanRing();
+        if (ring) {
+            ring->Find(trace_id, out);
+        }
         return;
     }
     leveldb::Iterator* it = db->id_db->NewIterator(leveldb::ReadOptions());
@@ -737,6 +969,10 @@ void ListSpans(int64_t starting_realtime, size_t max_scan,
     out->clear();
     butil::intrusive_ptr<SpanDB> db;
     if (GetSpanDB(&db) != 0) {
+        SpanRing* ring = GetSpanRing();
+        if (ring) {
+            ring->List(starting_realtime, max_scan, out, filter);
+        }
         return;
     }
     leveldb::Iterator* it = db->time_db->NewIterator(leveldb::ReadOptions());
@@ -772,6 +1008,10 @@ void ListSpans(int64_t starting_realtime, size_t max_scan,
 }
 
 void DescribeSpanDB(std::ostream& os) {
+    SpanRing* ring = GetSpanRing();
+    if (ring) {
+        ring->Describe(os);
+    }
     butil::intrusive_ptr<SpanDB> db;
     if (GetSpanDB(&db) != 0) {
         return;
@@ -29,18 +29,15 @@
 #include "butil/endpoint.h"
 #include "butil/string_splitter.h"
 #include "bvar/collector.h"
-#include "bthread/task_meta.h"
+#include "bthread/inline_local.h"
 #include "brpc/options.pb.h"                 // ProtocolType
 #include "brpc/span.pb.h"
 
-namespace bthread {
-extern thread_local bthread::LocalStorage tls_bls;
-}
-
 
 namespace brpc {
 
 DECLARE_bool(enable_rpcz);
+DECLARE_bool(rpcz_tail_sampling);
 
 // Collect information required by /rpcz and tracing system whose idea is
 // described in http://static.googleusercontent.com/media/research.google.com/en//pubs/archive/36356.pdf
@@ -73,7 +70,7 @@ public:
 
     // Set tls parent.
     void AsParent() {
-        bthread::tls_bls.rpcz_parent_span = this;
+        TlsParentSpan::set(this);
     }
 
     // Add log with time.
@@ -113,7 +110,7 @@ public:
 
     Span* local_parent() const { return _local_parent; }
     static Span* tls_parent() {
-        return (Span*)bthread::tls_bls.rpcz_parent_span;
+        return TlsParentSpan::get();
     }
 
     uint64_t trace_id() const { return _trace_id; }
@@ -140,14 +137,17 @@ public:
 private:
     DISALLOW_COPY_AND_ASSIGN(Span);
 
+    typedef bthread::InlineLocal<
+        Span, bthread::INLINE_LOCAL_SLOT_RPCZ_PARENT_SPAN> TlsParentSpan;
+
     void dump_and_destroy(size_t round_index);
     void destroy();
     bvar::CollectorSpeedLimit* speed_limit();
     bvar::CollectorPreprocessor* preprocessor();
 
     void EndAsParent() {
-        if (this == (Span*)bthread::tls_bls.rpcz_parent_span) {
-            bthread::tls_bls.rpcz_parent_span = NULL;
+        if (this == TlsParentSpan::get()) {
+            TlsParentSpan::set(NULL);
         }
     }
 
@@ -227,12 +227,21 @@ void ListSpans(SpanDB* db, int64_t before_this_time, size_t max_scan,
 
 // Check this function first before creating a span.
 // If rpcz of upstream is enabled, local rpcz is enabled automatically.
+// With -rpcz_tail_sampling, all requests are traced and spans are sampled
+// in Span::Submit() when their latencies and errors are known.
 inline bool IsTraceable(bool is_upstream_traced) {
     extern bvar::CollectorSpeedLimit g_span_sl;
     return is_upstream_traced ||
-        (FLAGS_enable_rpcz && bvar::is_collectable(&g_span_sl));
+        (FLAGS_enable_rpcz &&
+         (FLAGS_rpcz_tail_sampling || bvar::is_collectable(&g_span_sl)));
 }
 
+// Returns true if the ended root `span' should be kept when
+// -rpcz_tail_sampling is on: it failed, it's slower than
+// -rpcz_tail_sampling_latency_us or -rpcz_tail_sampling_percentile of
+// recent spans, or it's sampled under the speed limit of rpcz.
+bool IsTailSampled(const Span* span);
+
 } // namespace brpc
 
 
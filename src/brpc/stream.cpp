@@ -18,6 +18,8 @@
 
 #include "brpc/stream.h"
 
+#include <algorithm>
+#include <vector>
 #include <gflags/gflags.h>
 #include "butil/time.h"
 #include "butil/object_pool.h"
@@ -29,6 +31,7 @@
 #include "brpc/input_messenger.h"
 #include "brpc/policy/streaming_rpc_protocol.h"
 #include "brpc/policy/baidu_rpc_protocol.h"
+#include "brpc/policy/http2_rpc_protocol.h"
 #include "brpc/stream_impl.h"
 
 
@@ -37,6 +40,28 @@ namespace brpc {
 DECLARE_bool(usercode_in_pthread);
 
 const static butil::IOBuf *TIMEOUT_TASK = (butil::IOBuf*)-1L;
+const static butil::IOBuf *HALF_CLOSED_TASK = (butil::IOBuf*)-2L;
+
+// Messages in a DATA frame are not batched further once the payload exceeds
+// this size.
+const static size_t MAX_BATCHED_PAYLOAD_SIZE = 64 * 1024;
+
+// Messages written into the fake socket are prefixed with their lengths so
+// that messages written together can be separated again.
+static void AppendStreamMessage(butil::IOBuf* buf, const butil::IOBuf& msg) {
+    const size_t length = msg.length();
+    buf->append(&length, sizeof(length));
+    buf->append(msg);
+}
+
+// Cut a message appended by AppendStreamMessage() from |buf| into |msg|.
+// Returns bytes cut from |buf|.
+static size_t CutStreamMessage(butil::IOBuf* buf, butil::IOBuf* msg) {
+    size_t length = 0;
+    CHECK_EQ(sizeof(length), buf->cutn(&length, sizeof(length)));
+    buf->cutn(msg, length);
+    return sizeof(length) + length;
+}
 
 Stream::Stream() 
     : _host_socket(NULL)
@@ -45,9 +70,12 @@ Stream::Stream()
     , _closed(false)
     , _produced(0)
     , _remote_consumed(0)
+    , _remote_window(0)
     , _local_consumed(0)
     , _parse_rpc_response(false)
+    , _h2_stream_id(0)
     , _pending_buf(NULL)
+    , _compressor_inited(false)
     , _start_idle_timer_us(0)
     , _idle_timer(0)
 {
@@ -58,6 +86,9 @@ Stream::Stream()
 
 Stream::~Stream() {
     CHECK(_host_socket == NULL);
+    if (_options.handler != NULL) {
+        policy::AddReceivingStreamCount(-1);
+    }
     bthread_mutex_destroy(&_connect_mutex);
     bthread_mutex_destroy(&_congestion_control_mutex);
     bthread_id_list_destroy(&_writable_wait_list);
@@ -74,10 +105,14 @@ int Stream::Create(const StreamOptions &options,
     s->_closed = false;
     if (remote_settings != NULL) {
         s->_remote_settings.MergeFrom(*remote_settings);
+        s->_remote_window = remote_settings->window();
         s->_parse_rpc_response = false;
     } else {
         s->_parse_rpc_response = true;
     }
+    if (options.handler != NULL) {
+        policy::AddReceivingStreamCount(1);
+    }
     if (bthread_id_list_init(&s->_writable_wait_list, 8, 8/*FIXME*/)) {
         delete s;
         return -1;
@@ -99,6 +134,11 @@ int Stream::Create(const StreamOptions &options,
     }
     SocketUniquePtr ptr;
     CHECK_EQ(0, Socket::Address(fake_sock_id, &ptr));
+    if (options.write_coalescing_us > 0) {
+        // Writes within the window are cut by one
+        // CutMessageIntoFileDescriptor().
+        ptr->set_write_coalescing_us(options.write_coalescing_us);
+    }
     s->_fake_socket_weak_ref = ptr.get();
     s->_id = fake_sock_id;
     *id = s->id();
@@ -109,11 +149,16 @@ void Stream::BeforeRecycle(Socket *) {
     // No one holds reference now, so we don't need lock here
     bthread_id_list_reset(&_writable_wait_list, ECONNRESET);
     if (_connected) {
-        // Send CLOSE frame
-        RPC_VLOG << "Send close frame";
         CHECK(_host_socket != NULL);
-        policy::SendStreamClose(_host_socket,
-                                _remote_settings.stream_id(), id());
+        if (_h2_stream_id != 0) {
+            // End the gRPC call after unsent messages
+            policy::CloseGrpcStream(_host_socket, _h2_stream_id, id());
+        } else {
+            // Send CLOSE frame
+            RPC_VLOG << "Send close frame";
+            policy::SendStreamClose(_host_socket,
+                                    _remote_settings.stream_id(), id());
+        }
     }
 
     if (_host_socket) {
@@ -140,23 +185,138 @@ ssize_t Stream::CutMessageIntoFileDescriptor(int /*fd*/,
         errno = EBADF;
         return -1;
     }
-    butil::IOBuf out;
+    // Bytes cut from |data_list|, including the length prefixes.
     ssize_t len = 0;
+    if (_h2_stream_id != 0) {
+        std::vector<butil::IOBuf> msgs;
+        for (size_t i = 0; i < size; ++i) {
+            while (!data_list[i]->empty()) {
+                msgs.push_back(butil::IOBuf());
+                len += CutStreamMessage(data_list[i], &msgs.back());
+            }
+        }
+        std::vector<butil::IOBuf*> msg_list(msgs.size());
+        for (size_t i = 0; i < msgs.size(); ++i) {
+            msg_list[i] = &msgs[i];
+        }
+        if (_options.max_buf_size > 0) {
+            // Windows of http2 are consumed by framed messages, which are
+            // what the http2 layer reports to SetRemoteConsumed().
+            BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+            _produced += msgs.size() * policy::GRPC_MESSAGE_PREFIX_SIZE;
+        }
+        if (policy::WriteGrpcMessages(_host_socket, _h2_stream_id, id(),
+                                      msg_list.data(), msg_list.size()) != 0) {
+            return -1;
+        }
+        return len;
+    }
+    if (!_compressor_inited) {
+        InitCompressor();
+    }
+    const bool batched = _remote_settings.batched_messages();
+    butil::IOBuf out;
+    StreamFrameMeta fm;
+    fm.set_stream_id(_remote_settings.stream_id());
+    fm.set_source_stream_id(id());
+    fm.set_frame_type(FRAME_TYPE_DATA);
+    // TODO: split large data
+    fm.set_has_continuation(false);
+    if (_compressor != NULL) {
+        fm.set_compress_type(COMPRESS_TYPE_ZSTD);
+    }
+    butil::IOBuf payload;
     for (size_t i = 0; i < size; ++i) {
-        StreamFrameMeta fm;
-        fm.set_stream_id(_remote_settings.stream_id());
-        fm.set_source_stream_id(id());
-        fm.set_frame_type(FRAME_TYPE_DATA);
-        // TODO: split large data
-        fm.set_has_continuation(false);
-        policy::PackStreamMessage(&out, fm, data_list[i]);
-        len += data_list[i]->length();
-        data_list[i]->clear();
+        while (!data_list[i]->empty()) {
+            butil::IOBuf msg;
+            len += CutStreamMessage(data_list[i], &msg);
+            if (_compressor != NULL) {
+                butil::IOBuf compressed;
+                if (!_compressor->Compress(msg, &compressed)) {
+                    // The context is broken, so is the stream.
+                    LOG(ERROR) << "Fail to compress message of stream=" << id();
+                    errno = EINVAL;
+                    return -1;
+                }
+                msg.swap(compressed);
+            }
+            if (!batched) {
+                policy::PackStreamMessage(&out, fm, &msg);
+                continue;
+            }
+            fm.add_message_sizes(msg.length());
+            payload.append(butil::IOBuf::Movable(msg));
+            if (payload.length() >= MAX_BATCHED_PAYLOAD_SIZE) {
+                PackBatchedMessages(&out, &fm, &payload);
+            }
+        }
+    }
+    if (fm.message_sizes_size() > 0) {
+        PackBatchedMessages(&out, &fm, &payload);
     }
     WriteToHostSocket(&out);
     return len;
 }
 
+void Stream::InitCompressor() {
+    _compressor_inited = true;
+    if (_options.compress_type == COMPRESS_TYPE_NONE) {
+        return;
+    }
+    if (_options.compress_type != COMPRESS_TYPE_ZSTD) {
+        LOG(WARNING) << "Stream=" << id() << " doesn't support compress_type="
+                     << CompressType_Name(_options.compress_type)
+                     << ", messages are not compressed";
+        return;
+    }
+    if (!_remote_settings.zstd_stream_compression()) {
+        RPC_VLOG << "The remote side of stream=" << id()
+                 << " can't decompress messages";
+        return;
+    }
+    std::unique_ptr<policy::ZstdStreamCompressor> c(
+        new policy::ZstdStreamCompressor);
+    if (c->Init() != 0) {
+        LOG(WARNING) << "Messages of stream=" << id() << " are not compressed";
+        return;
+    }
+    _compressor.reset(c.release());
+}
+
+int Stream::DecompressMessage(CompressType type, butil::IOBuf* msg) {
+    if (type != COMPRESS_TYPE_ZSTD) {
+        LOG(ERROR) << "Unsupported compress_type=" << type
+                   << " of stream=" << id();
+        return -1;
+    }
+    if (_decompressor == NULL) {
+        std::unique_ptr<policy::ZstdStreamDecompressor> d(
+            new policy::ZstdStreamDecompressor);
+        if (d->Init() != 0) {
+            return -1;
+        }
+        _decompressor.reset(d.release());
+    }
+    butil::IOBuf out;
+    if (!_decompressor->Decompress(*msg, &out)) {
+        LOG(ERROR) << "Fail to decompress message of stream=" << id();
+        return -1;
+    }
+    msg->swap(out);
+    return 0;
+}
+
+void Stream::PackBatchedMessages(butil::IOBuf* out, StreamFrameMeta* fm,
+                                 butil::IOBuf* payload) {
+    if (fm->message_sizes_size() == 1) {
+        // Same as non-batched frames.
+        fm->clear_message_sizes();
+    }
+    policy::PackStreamMessage(out, *fm, payload);
+    fm->clear_message_sizes();
+    payload->clear();
+}
+
 void Stream::WriteToHostSocket(butil::IOBuf* b) {
     BRPC_HANDLE_EOVERCROWDED(_host_socket->Write(b));
 }
@@ -217,7 +377,8 @@ void Stream::SetConnected(const StreamSettings* remote_settings) {
         return;
     }
     if (_connected) {
-        CHECK(false);
+        // Streams over http2 are connected once bound, before the RPC ends.
+        CHECK(_h2_stream_id != 0);
         bthread_mutex_unlock(&_connect_mutex);
         return;
     }
@@ -225,6 +386,8 @@ void Stream::SetConnected(const StreamSettings* remote_settings) {
     if (remote_settings != NULL) {
         CHECK(!_remote_settings.IsInitialized());
         _remote_settings.MergeFrom(*remote_settings);
+        BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+        _remote_window = remote_settings->window();
     } else {
         CHECK(_remote_settings.IsInitialized());
     }
@@ -260,9 +423,20 @@ void Stream::TriggerOnConnectIfNeed() {
 }
 
 int Stream::AppendIfNotFull(const butil::IOBuf &data) {
+    return AppendIfNotFull(&data, 1);
+}
+
+int Stream::AppendIfNotFull(const butil::IOBuf msgs[], size_t size) {
+    size_t length = 0;
+    butil::IOBuf data;
+    for (size_t i = 0; i < size; ++i) {
+        length += msgs[i].length();
+        AppendStreamMessage(&data, msgs[i]);
+    }
     if (_options.max_buf_size > 0) {
         std::unique_lock<bthread_mutex_t> lck(_congestion_control_mutex);
-        if (_produced >= _remote_consumed + (size_t)_options.max_buf_size) {
+        const size_t limit = buf_limit();
+        if (_produced >= _remote_consumed + limit) {
             const size_t saved_produced = _produced;
             const size_t saved_remote_consumed = _remote_consumed;
             lck.unlock();
@@ -270,35 +444,40 @@ int Stream::AppendIfNotFull(const butil::IOBuf &data) {
                      << "_produced=" << saved_produced
                      << " _remote_consumed=" << saved_remote_consumed
                      << " gap=" << saved_produced - saved_remote_consumed
-                     << " max_buf_size=" << _options.max_buf_size;
+                     << " max_buf_size=" << _options.max_buf_size
+                     << " limit=" << limit;
             return 1;
         }
-        _produced += data.length();
+        _produced += length;
     }
-    butil::IOBuf copied_data(data);
-    const int rc = _fake_socket_weak_ref->Write(&copied_data);
+    const int rc = _fake_socket_weak_ref->Write(&data);
     if (rc != 0) {
         // Stream may be closed by peer before
         LOG(WARNING) << "Fail to write to _fake_socket, " << berror();
-        BAIDU_SCOPED_LOCK(_congestion_control_mutex);
-        _produced -= data.length();
+        if (_options.max_buf_size > 0) {
+            BAIDU_SCOPED_LOCK(_congestion_control_mutex);
+            _produced -= length;
+        }
         return -1;
     }
     return 0;
 }
 
-void Stream::SetRemoteConsumed(size_t new_remote_consumed) {
+void Stream::SetRemoteConsumed(size_t new_remote_consumed,
+                               int64_t new_remote_window) {
     CHECK(_options.max_buf_size > 0);
     bthread_id_list_t tmplist;
     bthread_id_list_init(&tmplist, 0, 0);
     bthread_mutex_lock(&_congestion_control_mutex);
-    if (_remote_consumed >= new_remote_consumed) {
+    if (_remote_consumed >= new_remote_consumed &&
+        _remote_window == new_remote_window) {
         bthread_mutex_unlock(&_congestion_control_mutex);
         return;
     }
-    const bool was_full = _produced >= _remote_consumed + (size_t)_options.max_buf_size;
-    _remote_consumed = new_remote_consumed;
-    const bool is_full = _produced >= _remote_consumed + (size_t)_options.max_buf_size;
+    const bool was_full = _produced >= _remote_consumed + buf_limit();
+    _remote_consumed = std::max(_remote_consumed, new_remote_consumed);
+    _remote_window = new_remote_window;
+    const bool is_full = _produced >= _remote_consumed + buf_limit();
     if (was_full && !is_full) {
         bthread_id_list_swap(&tmplist, &_writable_wait_list);
     }
@@ -375,7 +554,7 @@ void Stream::Wait(void (*on_writable)(StreamId, void*, int), void* arg,
     }
     bthread_mutex_lock(&_congestion_control_mutex);
     if (_options.max_buf_size <= 0 
-            || _produced < _remote_consumed + (size_t)_options.max_buf_size) {
+            || _produced < _remote_consumed + buf_limit()) {
         bthread_mutex_unlock(&_congestion_control_mutex);
         CHECK_EQ(0, TriggerOnWritable(wait_id, wm, 0));
         return;
@@ -413,10 +592,14 @@ int Stream::OnReceived(const StreamFrameMeta& fm, butil::IOBuf *buf, Socket* soc
     }
     switch (fm.frame_type()) {
     case FRAME_TYPE_FEEDBACK:
-        SetRemoteConsumed(fm.feedback().consumed_size());
+        SetRemoteConsumed(fm.feedback().consumed_size(),
+                          fm.feedback().window());
         CHECK(buf->empty());
         break;
     case FRAME_TYPE_DATA:
+        if (fm.message_sizes_size() > 0) {
+            return OnReceivedBatchedMessages(fm, buf);
+        }
         if (_pending_buf != NULL) {
             _pending_buf->append(*buf);
             buf->clear();
@@ -427,6 +610,12 @@ int Stream::OnReceived(const StreamFrameMeta& fm, butil::IOBuf *buf, Socket* soc
         if (!fm.has_continuation()) {
             butil::IOBuf *tmp = _pending_buf;
             _pending_buf = NULL;
+            if (fm.compress_type() != COMPRESS_TYPE_NONE &&
+                DecompressMessage(fm.compress_type(), tmp) != 0) {
+                delete tmp;
+                Close();
+                break;
+            }
             if (bthread::execution_queue_execute(_consumer_queue, tmp) != 0) {
                 CHECK(false) << "Fail to push into channel";
                 delete tmp;
@@ -450,6 +639,41 @@ int Stream::OnReceived(const StreamFrameMeta& fm, butil::IOBuf *buf, Socket* soc
     return 0;
 }
 
+int Stream::OnReceivedBatchedMessages(const StreamFrameMeta& fm,
+                                      butil::IOBuf* buf) {
+    if (_pending_buf != NULL || fm.has_continuation()) {
+        LOG(ERROR) << "Batched messages of stream=" << id()
+                   << " can't be continued";
+        return -1;
+    }
+    for (int i = 0; i < fm.message_sizes_size(); ++i) {
+        const int64_t msg_size = fm.message_sizes(i);
+        if (msg_size < 0 || (uint64_t)msg_size > buf->size()) {
+            LOG(ERROR) << "Invalid message_sizes of stream=" << id();
+            return -1;
+        }
+        butil::IOBuf* msg = new butil::IOBuf;
+        buf->cutn(msg, msg_size);
+        if (fm.compress_type() != COMPRESS_TYPE_NONE &&
+            DecompressMessage(fm.compress_type(), msg) != 0) {
+            delete msg;
+            buf->clear();
+            Close();
+            return 0;
+        }
+        if (bthread::execution_queue_execute(_consumer_queue, msg) != 0) {
+            CHECK(false) << "Fail to push into channel";
+            delete msg;
+            Close();
+            return 0;
+        }
+    }
+    LOG_IF(ERROR, !buf->empty()) << "Ignored " << buf->size()
+        << " bytes after batched messages of stream=" << id();
+    buf->clear();
+    return 0;
+}
+
 class MessageBatcher {
 public:
     MessageBatcher(butil::IOBuf* storage[], size_t cap, Stream* s) 
@@ -457,6 +681,7 @@ public:
         , _cap(cap)
         , _size(0)
         , _total_length(0)
+        , _total_count(0)
         , _s(s)
     {}
     ~MessageBatcher() { flush(); }
@@ -476,14 +701,16 @@ public:
         }
         _storage[_size++] = buf;
         _total_length += buf->length();
-
+        ++_total_count;
     }
     size_t total_length() { return _total_length; }
+    size_t total_count() { return _total_count; }
 private:
     butil::IOBuf** _storage;
     size_t _cap;
     size_t _size;
     size_t _total_length;
+    size_t _total_count;
     Stream* _s;
 };
 
@@ -505,10 +732,13 @@ int Stream::Consume(void *meta, bthread::TaskIterator<butil::IOBuf*>& iter) {
     DEFINE_SMALL_ARRAY(butil::IOBuf*, buf_list, s->_options.messages_in_batch, 256);
     MessageBatcher mb(buf_list, s->_options.messages_in_batch, s);
     bool has_timeout_task = false;
+    bool has_half_closed_task = false;
     for (; iter; ++iter) {
         butil::IOBuf* t= *iter;
         if (t == TIMEOUT_TASK) {
             has_timeout_task = true;
+        } else if (t == HALF_CLOSED_TASK) {
+            has_half_closed_task = true;
         } else {
             if (s->_parse_rpc_response) {
                 s->_parse_rpc_response = false;
@@ -524,7 +754,18 @@ int Stream::Consume(void *meta, bthread::TaskIterator<butil::IOBuf*>& iter) {
         }
     }
     mb.flush();
-    if (s->_remote_settings.need_feedback() && mb.total_length() > 0) {
+    if (has_half_closed_task && s->_options.handler != NULL) {
+        s->_options.handler->on_remote_half_closed(s->id());
+    }
+    if (s->_h2_stream_id != 0) {
+        if (mb.total_count() > 0) {
+            // Return windows of http2 to the remote side.
+            policy::OnGrpcMessagesConsumed(
+                s->_host_socket, s->_h2_stream_id, s->id(),
+                mb.total_length() +
+                mb.total_count() * policy::GRPC_MESSAGE_PREFIX_SIZE);
+        }
+    } else if (s->_remote_settings.need_feedback() && mb.total_length() > 0) {
         s->_local_consumed += mb.total_length();
         s->SendFeedback();
     }
@@ -538,6 +779,10 @@ void Stream::SendFeedback() {
     fm.set_stream_id(_remote_settings.stream_id());
     fm.set_source_stream_id(id());
     fm.mutable_feedback()->set_consumed_size(_local_consumed);
+    const int64_t window = LocalWindow();
+    if (window > 0) {
+        fm.mutable_feedback()->set_window(window);
+    }
     butil::IOBuf out;
     policy::PackStreamMessage(&out, fm, NULL);
     WriteToHostSocket(&out);
@@ -558,10 +803,77 @@ int Stream::SetHostSocket(Socket *host_socket) {
     return 0;
 }
 
+int Stream::SetH2Stream(Socket* host_socket, int h2_stream_id) {
+    if (_h2_stream_id != 0) {
+        // Messages sent over the previous http2 stream can't be resent,
+        // namely the RPC is being retried.
+        return -1;
+    }
+    if (SetHostSocket(host_socket) != 0) {
+        return -1;
+    }
+    _h2_stream_id = h2_stream_id;
+    // Response of the RPC is not carried by the stream.
+    _parse_rpc_response = false;
+    if (!_remote_settings.IsInitialized()) {
+        // Client-side, the server never tells its settings.
+        _remote_settings.set_stream_id(h2_stream_id);
+        _remote_settings.set_need_feedback(false);
+        _remote_settings.set_writable(true);
+    }
+    return 0;
+}
+
+int Stream::OnReceivedGrpcMessage(butil::IOBuf* message) {
+    if (bthread::execution_queue_execute(_consumer_queue, message) != 0) {
+        delete message;
+        Close();
+        return -1;
+    }
+    return 0;
+}
+
+int Stream::OnRemoteHalfClosed() {
+    if (bthread::execution_queue_execute(
+            _consumer_queue, (butil::IOBuf*)HALF_CLOSED_TASK) != 0) {
+        Close();
+        return -1;
+    }
+    return 0;
+}
+
+void Stream::OnGrpcMessagesSent(StreamId id, size_t sent_size) {
+    SocketUniquePtr ptr;
+    if (Socket::Address(id, &ptr) != 0) {
+        return;
+    }
+    Stream* s = (Stream*)ptr->conn();
+    if (s->_options.max_buf_size > 0) {
+        s->SetRemoteConsumed(sent_size, 0);
+    }
+}
+
 void Stream::FillSettings(StreamSettings *settings) {
     settings->set_stream_id(id());
     settings->set_need_feedback(_options.max_buf_size > 0);
     settings->set_writable(_options.handler != NULL);
+    settings->set_batched_messages(true);
+#ifdef BRPC_WITH_ZSTD
+    settings->set_zstd_stream_compression(true);
+#endif
+    if (_options.handler != NULL) {
+        const int64_t window = LocalWindow();
+        if (window > 0) {
+            settings->set_window(window);
+        }
+    }
+}
+
+int64_t Stream::LocalWindow() {
+    // The host socket is unknown before the stream is connected at
+    // client-side, regard the stream as the only one over the connection.
+    return policy::GetStreamWindow(
+        _host_socket ? _host_socket->StreamCount() : 1);
 }
 
 void OnIdleTimeout(void *arg) {
@@ -655,6 +967,23 @@ int StreamWrite(StreamId stream_id, const butil::IOBuf &message) {
     return (rc == 1) ? EAGAIN : errno;
 }
 
+int StreamWrite(StreamId stream_id, const butil::IOBuf messages[],
+                size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    SocketUniquePtr ptr;
+    if (Socket::Address(stream_id, &ptr) != 0) {
+        return EINVAL;
+    }
+    Stream* s = (Stream*)ptr->conn();
+    const int rc = s->AppendIfNotFull(messages, size);
+    if (rc == 0) {
+        return 0;
+    }
+    return (rc == 1) ? EAGAIN : errno;
+}
+
 void StreamWait(StreamId stream_id, const timespec *due_time,
                 void (*on_writable)(StreamId, void*, int), void *arg) {
     SocketUniquePtr ptr;
@@ -740,6 +1069,18 @@ int StreamAccept(StreamId* response_stream, Controller &cntl,
         LOG(ERROR) << "Fail to create stream";
         return -1;
     }
+    if (cntl.has_flag(Controller::FLAGS_GRPC_STREAM)) {
+        // Connect the stream at once so that messages of the gRPC call can
+        // be read and written before the RPC is responded.
+        if (policy::BindGrpcStream(cntl._current_call.sending_sock.get(),
+                                   cntl._remote_stream_settings->stream_id(),
+                                   stream_id) != 0) {
+            LOG(ERROR) << "Fail to bind stream=" << stream_id
+                       << " to the gRPC call";
+            Stream::SetFailed(stream_id);
+            return -1;
+        }
+    }
     cntl._response_stream = stream_id;
     *response_stream = stream_id;
     return 0;
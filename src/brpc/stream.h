@@ -22,6 +22,7 @@
 #include "butil/iobuf.h"
 #include "butil/scoped_generic.h"
 #include "brpc/socket_id.h"
+#include "brpc/options.pb.h"                // CompressType
 
 namespace brpc {
 
@@ -45,6 +46,11 @@ public:
                                      size_t size) = 0;
     virtual void on_idle_timeout(StreamId id) = 0;
     virtual void on_closed(StreamId id) = 0; 
+    // Called after all messages are received when the remote side finished
+    // writing but is still reading, namely the client half-closed a
+    // client-streaming or bidi-streaming gRPC call. Responding messages can
+    // still be written until the stream is closed.
+    virtual void on_remote_half_closed(StreamId id) {}
 };
 
 struct StreamOptions {
@@ -52,6 +58,8 @@ struct StreamOptions {
         : max_buf_size(2 * 1024 * 1024)
         , idle_timeout_ms(-1)
         , messages_in_batch(128)
+        , write_coalescing_us(0)
+        , compress_type(COMPRESS_TYPE_NONE)
         , handler(NULL)
     {}
 
@@ -70,6 +78,24 @@ struct StreamOptions {
     // default: 128
     size_t messages_in_batch;
 
+    // Messages written within |write_coalescing_us| microseconds since the
+    // first unsent one are sent together, in fewer frames if the remote side
+    // supports. This delays messages by at most the window but saves frames
+    // and writes to the connection for many small messages.
+    // default: 0 (send at once)
+    int write_coalescing_us;
+
+    // Compress messages written into the stream with a context of the whole
+    // stream rather than each message separately, namely a message is
+    // compressed with history of former ones, which is much better for small
+    // and similar messages. Each message is flushed so that the remote side
+    // receives it without waiting for later ones.
+    // Only COMPRESS_TYPE_ZSTD is supported(brpc must be built with zstd).
+    // Messages are not compressed if the remote side is not able to
+    // decompress them or the stream is over gRPC.
+    // default: COMPRESS_TYPE_NONE
+    CompressType compress_type;
+
     // Handle input message, if handler is NULL, the remote side is not allowd to
     // write any message, who will get EBADF on writting
     // default: NULL
@@ -80,6 +106,12 @@ struct StreamOptions {
 // Create a stream at client-side along with the |cntl|, which will be connected
 // when receiving the response with a stream from server-side. If |options| is
 // NULL, the stream will be created with default options
+// Over gRPC("h2:grpc"), calling a method with client-streaming or
+// server-streaming request/response carries messages of the stream as
+// messages of the gRPC call, flow-controlled by windows of http2. Requests of
+// client-streaming methods are not sent, write them into the stream instead,
+// and responses of server-streaming methods are not filled. Closing the stream
+// half-closes the call when the request is not ended yet, or cancels it.
 // Return 0 on success, -1 otherwise
 int StreamCreate(StreamId* request_stream, Controller &cntl,
                  const StreamOptions* options);
@@ -100,6 +132,13 @@ int StreamAccept(StreamId* response_stream, Controller &cntl,
 //  - EINVAL: |stream_id| is invalied or has been closed
 int StreamWrite(StreamId stream_id, const butil::IOBuf &message);
 
+// Write |size| messages in |messages| into |stream_id| as a whole, they are
+// either all written or not written. The messages are carried by fewer
+// frames than writing them one by one if the remote side supports, which
+// is much more efficient for small messages.
+// Returns 0 on success, errno otherwise, same as above.
+int StreamWrite(StreamId stream_id, const butil::IOBuf messages[], size_t size);
+
 // Write util the pending buffer size is less than |max_buf_size| or orrur
 // occurs
 // Returns 0 on success, errno otherwise
@@ -19,11 +19,13 @@
 #ifndef  BRPC_STREAM_IMPL_H
 #define  BRPC_STREAM_IMPL_H
 
+#include <memory>
 #include "bthread/bthread.h"
 #include "bthread/execution_queue.h"
 #include "brpc/socket.h"
 #include "brpc/stream.h"
 #include "brpc/streaming_rpc_meta.pb.h"
+#include "brpc/policy/zstd_compress.h"
 
 namespace brpc {
 
@@ -43,6 +45,7 @@ public:
     // --------------------- SocketConnection --------------
 
     int AppendIfNotFull(const butil::IOBuf& msg);
+    int AppendIfNotFull(const butil::IOBuf msgs[], size_t size);
     static int Create(const StreamOptions& options,
                       const StreamSettings *remote_settings,
                       StreamId *id);
@@ -63,6 +66,18 @@ public:
     static int SetFailed(StreamId id);
     void Close();
 
+    // Carry messages over the http2 stream |h2_stream_id| of |host_socket|
+    // which is a streaming gRPC call, instead of streaming_rpc_protocol.
+    int SetH2Stream(Socket* host_socket, int h2_stream_id);
+    // Called by the http2 layer when a message of the gRPC call is received,
+    // ownership of |message| is transferred.
+    int OnReceivedGrpcMessage(butil::IOBuf* message);
+    // Called by the http2 layer when the remote side ended the gRPC call.
+    int OnRemoteHalfClosed();
+    // Called by the http2 layer when |sent_size| bytes of framed messages in
+    // total were sent to the remote side of |id|.
+    static void OnGrpcMessagesSent(StreamId id, size_t sent_size);
+
 private:
 friend void StreamWait(StreamId stream_id, const timespec *due_time,
                 void (*on_writable)(StreamId, void*, int), void *arg);
@@ -70,7 +85,18 @@ friend class MessageBatcher;
     Stream();
     ~Stream();
     int Init(const StreamOptions options);
-    void SetRemoteConsumed(size_t _remote_consumed);
+    // Update bytes consumed by the remote side and the window it granted.
+    void SetRemoteConsumed(size_t remote_consumed, int64_t remote_window);
+    // Max bytes not consumed by the remote side, namely max_buf_size
+    // restricted by the window of the remote side.
+    // _congestion_control_mutex must be locked.
+    size_t buf_limit() const {
+        const size_t limit = _options.max_buf_size;
+        return (_remote_window > 0 && (size_t)_remote_window < limit) ?
+            (size_t)_remote_window : limit;
+    }
+    // Window of this side to be sent to the remote side.
+    int64_t LocalWindow();
     void TriggerOnConnectIfNeed();
     void Wait(void (*on_writable)(StreamId, void*, int), void* arg, 
               const timespec* due_time, bool new_thread, bthread_id_t *join_id);
@@ -79,6 +105,17 @@ friend class MessageBatcher;
     void StopIdleTimer();
     void HandleRpcResponse(butil::IOBuf* response_buffer);
     void WriteToHostSocket(butil::IOBuf* b);
+    // Pack |payload| as a DATA frame carrying messages in message_sizes of
+    // |fm| into |out|, then clear both.
+    static void PackBatchedMessages(butil::IOBuf* out, StreamFrameMeta* fm,
+                                    butil::IOBuf* payload);
+    int OnReceivedBatchedMessages(const StreamFrameMeta& fm, butil::IOBuf* buf);
+    // Create _compressor if messages should be compressed. Called before
+    // writing the first message.
+    void InitCompressor();
+    // Decompress |msg| compressed in |type| with the context of the stream.
+    // Returns 0 on success, -1 otherwise.
+    int DecompressMessage(CompressType type, butil::IOBuf* msg);
 
     static int Consume(void *meta, bthread::TaskIterator<butil::IOBuf*>& iter);
     static int TriggerOnWritable(bthread_id_t id, void *data, int error_code);
@@ -114,14 +151,24 @@ friend class MessageBatcher;
     bthread_mutex_t _congestion_control_mutex;
     size_t _produced;
     size_t _remote_consumed;
+    int64_t _remote_window;
     bthread_id_list_t _writable_wait_list;
 
     int64_t _local_consumed;
     StreamSettings _remote_settings;   
 
     bool _parse_rpc_response;
+    // Non-zero if messages are carried over the http2 stream.
+    int _h2_stream_id;
     bthread::ExecutionQueueId<butil::IOBuf*> _consumer_queue;
     butil::IOBuf *_pending_buf;
+    // Written messages are compressed by _compressor if it's not NULL.
+    // Accessed by the writing thread of _fake_socket_weak_ref only.
+    bool _compressor_inited;
+    std::unique_ptr<policy::ZstdStreamCompressor> _compressor;
+    // Created at the first compressed message received. Accessed in
+    // OnReceived() only, which is called in order of frames.
+    std::unique_ptr<policy::ZstdStreamDecompressor> _decompressor;
     int64_t _start_idle_timer_us;
     bthread_timer_t _idle_timer;
 };
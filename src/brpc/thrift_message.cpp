@@ -37,6 +37,7 @@ ThriftFramedMessage::ThriftFramedMessage()
 
 void ThriftFramedMessage::SharedCtor() {
     field_id = THRIFT_INVALID_FID;
+    compact_protocol = false;
     _own_raw_instance = false;
     _raw_instance = nullptr;
 }
@@ -127,6 +128,7 @@ void ThriftFramedMessage::Swap(ThriftFramedMessage* other) {
     if (other != this) {
         body.swap(other->body);
         std::swap(field_id, other->field_id);
+        std::swap(compact_protocol, other->compact_protocol);
         std::swap(_own_raw_instance, other->_own_raw_instance);
         std::swap(_raw_instance, other->_raw_instance);
     }
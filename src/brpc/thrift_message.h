@@ -59,6 +59,9 @@ friend class ThriftStub;
 public:
     butil::IOBuf body; // ~= "{ raw_instance }"
     int16_t field_id;  // must be set when body is set.
+    // True if body is serialized by TCompactProtocol rather than
+    // TBinaryProtocol. Set by brpc when body is read from the network.
+    bool compact_protocol;
     
 private:
     bool _own_raw_instance;
@@ -132,7 +135,8 @@ namespace policy {
 // Implemented in policy/thrift_protocol.cpp
 bool ReadThriftStruct(const butil::IOBuf& body,
                       ThriftMessageBase* raw_msg,
-                      int16_t expected_fid);
+                      int16_t expected_fid,
+                      bool compact_protocol);
 }
 
 namespace details {
@@ -197,7 +201,8 @@ T* ThriftFramedMessage::Cast() {
     _own_raw_instance = true;
 
     if (!body.empty()) {
-        if (!policy::ReadThriftStruct(body, _raw_instance, field_id)) {
+        if (!policy::ReadThriftStruct(body, _raw_instance, field_id,
+                                      compact_protocol)) {
             LOG(ERROR) << "Fail to parse " << butil::class_name<T>();
         }
     }
@@ -1465,11 +1465,17 @@ butil::Status TsWriter::EncodePES(TsMessage* msg, TsStream sid, TsPid pid,
                            << msg->payload.size();
             }
         }
-        msg->payload.cutn(buf + pkt_size, left);
         if (pkt.Encode(buf) != 0) {
             return butil::Status(EINVAL, "Fail to encode PES");
         }
-        _outbuf->append(buf, TS_PACKET_SIZE);
+        // Only the header is copied, the payload is referenced by _outbuf
+        // without copying.
+        _outbuf->append(buf, pkt_size);
+        msg->payload.cutn(_outbuf, left);
+        if (pkt_size + left < TS_PACKET_SIZE) {
+            _outbuf->resize(_outbuf->size() + TS_PACKET_SIZE - pkt_size - left,
+                            (char)0xFF);
+        }
     }
     return butil::Status::OK();
 }
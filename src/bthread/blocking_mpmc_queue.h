@@ -0,0 +1,170 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_BLOCKING_MPMC_QUEUE_H
+#define BTHREAD_BLOCKING_MPMC_QUEUE_H
+
+#include <errno.h>
+#include <time.h>                                  // timespec
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/containers/mpmc_bounded_queue.h"
+#include "bthread/butex.h"
+
+namespace bthread {
+
+// A butil::MPMCBoundedQueue whose push()/pop() block the calling bthread
+// (or pthread) while the queue is full/empty. Items are passed without
+// locks, waiters are parked on butexes which are only touched when
+// someone is waiting, so that the non-blocking path is not slowed down
+// by syscalls.
+template <typename T>
+class BlockingMPMCQueue {
+public:
+    BlockingMPMCQueue()
+        : _not_empty(NULL)
+        , _not_full(NULL)
+        , _npop_waiter(0)
+        , _npush_waiter(0) {}
+
+    ~BlockingMPMCQueue() {
+        if (_not_empty) {
+            butex_destroy(_not_empty);
+            _not_empty = NULL;
+        }
+        if (_not_full) {
+            butex_destroy(_not_full);
+            _not_full = NULL;
+        }
+    }
+
+    // Capacity is rounded up to power of 2.
+    // Returns 0 on success, -1 otherwise.
+    int init(size_t cap) {
+        if (_queue.init(cap) != 0) {
+            return -1;
+        }
+        _not_empty = butex_create_checked<butil::atomic<int> >();
+        _not_full = butex_create_checked<butil::atomic<int> >();
+        if (_not_empty == NULL || _not_full == NULL) {
+            return -1;
+        }
+        _not_empty->store(0, butil::memory_order_relaxed);
+        _not_full->store(0, butil::memory_order_relaxed);
+        return 0;
+    }
+
+    // Returns true on success, false if the queue is full.
+    bool try_push(const T& item) {
+        if (!_queue.push(item)) {
+            return false;
+        }
+        signal(_not_empty, &_npop_waiter);
+        return true;
+    }
+
+    // Returns true on success, false if the queue is empty.
+    bool try_pop(T* item) {
+        if (!_queue.pop(item)) {
+            return false;
+        }
+        signal(_not_full, &_npush_waiter);
+        return true;
+    }
+
+    // Push |item|, wait while the queue is full until CLOCK_REALTIME
+    // reaches |abstime| if it's not NULL.
+    // Returns 0 on success, -1 otherwise and errno is ETIMEDOUT.
+    int push(const T& item, const timespec* abstime = NULL) {
+        while (!try_push(item)) {
+            if (wait(_not_full, &_npush_waiter, abstime) != 0) {
+                if (try_push(item)) {
+                    return 0;
+                }
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // Pop the oldest item into |item|, wait while the queue is empty until
+    // CLOCK_REALTIME reaches |abstime| if it's not NULL.
+    // Returns 0 on success, -1 otherwise and errno is ETIMEDOUT.
+    int pop(T* item, const timespec* abstime = NULL) {
+        while (!try_pop(item)) {
+            if (wait(_not_empty, &_npop_waiter, abstime) != 0) {
+                if (try_pop(item)) {
+                    return 0;
+                }
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    size_t capacity() const { return _queue.capacity(); }
+
+    // Number of items, which is just a hint under contention.
+    size_t size() const { return _queue.size(); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(BlockingMPMCQueue);
+
+    // Wake up a waiter of `butex' after an item is pushed or popped. The
+    // fence pairs with the one in wait(): either the waiter sees the item
+    // or the waiter is counted here.
+    static void signal(butil::atomic<int>* butex, butil::atomic<int>* nwaiter) {
+        butil::atomic_thread_fence(butil::memory_order_seq_cst);
+        if (nwaiter->load(butil::memory_order_relaxed) > 0) {
+            butex->fetch_add(1, butil::memory_order_release);
+            butex_wake(butex);
+        }
+    }
+
+    // Wait until `butex' is signaled if the queue is still not ready.
+    // Returns 0 when the caller should retry, -1 on timeout.
+    int wait(butil::atomic<int>* butex, butil::atomic<int>* nwaiter,
+             const timespec* abstime) {
+        nwaiter->fetch_add(1, butil::memory_order_relaxed);
+        const int expected = butex->load(butil::memory_order_relaxed);
+        butil::atomic_thread_fence(butil::memory_order_seq_cst);
+        int rc = 0;
+        const bool ready = (butex == _not_empty ?
+                            !_queue.empty() : _queue.size() < _queue.capacity());
+        if (!ready && butex_wait(butex, expected, abstime) < 0 &&
+            errno == ETIMEDOUT) {
+            rc = -1;
+        }
+        nwaiter->fetch_sub(1, butil::memory_order_relaxed);
+        return rc;
+    }
+
+    butil::MPMCBoundedQueue<T> _queue;
+    // Bumped after pushing/popping when there're waiters.
+    butil::atomic<int>* _not_empty;
+    butil::atomic<int>* _not_full;
+    butil::atomic<int> _npop_waiter;
+    butil::atomic<int> _npush_waiter;
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_BLOCKING_MPMC_QUEUE_H
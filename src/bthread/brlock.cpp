@@ -0,0 +1,166 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+// bthread - A M:N threading library to make applications more concurrent.
+
+#include <stdlib.h>                              // posix_memalign
+#include <new>                                  // placement new
+#include "butil/logging.h"
+#include "bthread/butex.h"
+#include "bthread/brlock.h"
+
+namespace bthread {
+
+struct BAIDU_CACHELINE_ALIGNMENT BRLock::Slot {
+    // Number of readers locked with this slot minus number of readers
+    // unlocked with this slot, which may be negative when a bthread is
+    // unlocking in a worker different from the locking one. Only the sum
+    // of all slots makes sense.
+    butil::atomic<int64_t> nreader;
+};
+
+// Index of the slot used by current thread, -1 means unassigned.
+static __thread int tls_slot_index = -1;
+static butil::static_atomic<int> g_next_slot_index = BUTIL_STATIC_ATOMIC_INIT(0);
+
+static inline int slot_index() {
+    int index = tls_slot_index;
+    if (index < 0) {
+        index = g_next_slot_index.fetch_add(1, butil::memory_order_relaxed)
+            % BRLock::NSLOT;
+        tls_slot_index = index;
+    }
+    return index;
+}
+
+static inline butil::atomic<int>* as_atomic(int* butex) {
+    return (butil::atomic<int>*)butex;
+}
+
+BRLock::BRLock() {
+    if (posix_memalign(&_slots_mem, BAIDU_CACHELINE_SIZE,
+                       sizeof(Slot) * NSLOT) != 0) {
+        LOG(FATAL) << "Fail to allocate slots of BRLock";
+        abort();
+    }
+    _slots = static_cast<Slot*>(_slots_mem);
+    for (int i = 0; i < NSLOT; ++i) {
+        new (&_slots[i]) Slot;
+        _slots[i].nreader.store(0, butil::memory_order_relaxed);
+    }
+    _writer_butex = butex_create_checked<int>();
+    *_writer_butex = 0;
+    _drain_butex = butex_create_checked<int>();
+    *_drain_butex = 0;
+}
+
+BRLock::~BRLock() {
+    butex_destroy(_writer_butex);
+    butex_destroy(_drain_butex);
+    free(_slots_mem);
+}
+
+int64_t BRLock::count_readers() const {
+    int64_t n = 0;
+    for (int i = 0; i < NSLOT; ++i) {
+        n += _slots[i].nreader.load(butil::memory_order_seq_cst);
+    }
+    return n;
+}
+
+void BRLock::leave_read(Slot* s) {
+    // Save the butexes, *this may be destroyed by the writer once it sees
+    // the decrement.
+    int* const writer_butex = _writer_butex;
+    int* const drain_butex = _drain_butex;
+    // seq_cst pairs with the writer publishing _writer_butex before
+    // counting readers: either the writer sees the decrement, or we see the
+    // writer and wake it up.
+    s->nreader.fetch_sub(1, butil::memory_order_seq_cst);
+    if (as_atomic(writer_butex)->load(butil::memory_order_seq_cst) != 0) {
+        as_atomic(drain_butex)->fetch_add(1, butil::memory_order_release);
+        butex_wake(drain_butex);
+    }
+}
+
+void BRLock::lock_shared() {
+    for (;;) {
+        Slot* s = &_slots[slot_index()];
+        s->nreader.fetch_add(1, butil::memory_order_seq_cst);
+        if (as_atomic(_writer_butex)->load(butil::memory_order_seq_cst) == 0) {
+            return;
+        }
+        // A writer is pending or holding the lock, step back and wait.
+        leave_read(s);
+        while (as_atomic(_writer_butex)->load(butil::memory_order_acquire)) {
+            // EWOULDBLOCK and EINTR are ignored, the loop checks again.
+            butex_wait(_writer_butex, 1, NULL);
+        }
+    }
+}
+
+bool BRLock::try_lock_shared() {
+    Slot* s = &_slots[slot_index()];
+    s->nreader.fetch_add(1, butil::memory_order_seq_cst);
+    if (as_atomic(_writer_butex)->load(butil::memory_order_seq_cst) == 0) {
+        return true;
+    }
+    leave_read(s);
+    return false;
+}
+
+void BRLock::unlock_shared() {
+    leave_read(&_slots[slot_index()]);
+}
+
+void BRLock::lock() {
+    _write_mutex.lock();
+    as_atomic(_writer_butex)->store(1, butil::memory_order_seq_cst);
+    for (;;) {
+        const int seq = as_atomic(_drain_butex)->load(butil::memory_order_acquire);
+        if (count_readers() == 0) {
+            return;
+        }
+        // Readers leaving after counting change `seq', so that the wait
+        // returns immediately.
+        butex_wait(_drain_butex, seq, NULL);
+    }
+}
+
+bool BRLock::try_lock() {
+    if (!_write_mutex.try_lock()) {
+        return false;
+    }
+    as_atomic(_writer_butex)->store(1, butil::memory_order_seq_cst);
+    if (count_readers() == 0) {
+        return true;
+    }
+    wake_readers();
+    _write_mutex.unlock();
+    return false;
+}
+
+void BRLock::unlock() {
+    wake_readers();
+    _write_mutex.unlock();
+}
+
+void BRLock::wake_readers() {
+    as_atomic(_writer_butex)->store(0, butil::memory_order_release);
+    butex_wake_all(_writer_butex);
+}
+
+}  // namespace bthread
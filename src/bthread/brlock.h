@@ -0,0 +1,84 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef  BTHREAD_BRLOCK_H
+#define  BTHREAD_BRLOCK_H
+
+#include <stdint.h>
+#include "butil/atomicops.h"
+#include "butil/macros.h"                        // DISALLOW_COPY_AND_ASSIGN
+#include "bthread/mutex.h"
+
+namespace bthread {
+
+// A reader-biased read-write lock in the style of big-reader locks, usable
+// in both bthreads and pthreads.
+// Readers count themselves in one of many cacheline-aligned slots chosen by
+// the calling thread, which is the worker(namely the TaskGroup) when called
+// from a bthread, so that readers on different workers never share a
+// cacheline and read-locking scales with number of workers. A writer blocks
+// new readers, drains all slots and parks on a butex until the last reader
+// leaves, thus writers are much more expensive than readers and this lock
+// only suits data being read far more frequently than written.
+// Readers arriving when a writer is pending or holding the lock wait for the
+// writer, new readers never starve writers.
+// This class satisfies SharedMutex so that std::unique_lock and
+// std::shared_lock work on it.
+class BRLock {
+public:
+    // Slots are indexed by threads modulo this number. Threads sharing a
+    // slot are still correct, just slower.
+    static const int NSLOT = 64;
+
+    BRLock();
+    ~BRLock();
+
+    void lock_shared();
+    bool try_lock_shared();
+    // Can be called in a thread(or worker) different from the one calling
+    // lock_shared().
+    void unlock_shared();
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(BRLock);
+
+    struct Slot;
+
+    void leave_read(Slot* s);
+    int64_t count_readers() const;
+    void wake_readers();
+
+    Slot* _slots;
+    void* _slots_mem;
+    // 1 when a writer is pending or holding the lock, 0 otherwise. Blocked
+    // readers wait on it.
+    int* _writer_butex;
+    // Bumped by readers leaving when writer is pending, the pending writer
+    // waits on it.
+    int* _drain_butex;
+    // Serialize writers.
+    Mutex _write_mutex;
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_BRLOCK_H
@@ -28,6 +28,8 @@
 #include "bthread/list_of_abafree_id.h"
 #include "bthread/bthread.h"
 
+DECLARE_int32(task_group_ntags);
+
 namespace bthread {
 
 DEFINE_int32(bthread_concurrency, 8 + BTHREAD_EPOLL_THREAD_NUM,
@@ -38,6 +40,10 @@ DEFINE_int32(bthread_min_concurrency, 0,
             " The laziness is disabled when this value is non-positive,"
             " and workers will be created eagerly according to -bthread_concurrency and bthread_setconcurrency(). ");
 
+DEFINE_int32(bthread_maybe_yield_us, 1000,
+             "bthread_maybe_yield() yields when the bthread has been running "
+             "for so many microseconds since it was scheduled");
+
 static bool never_set_bthread_concurrency = true;
 
 static bool validate_bthread_concurrency(const char*, int32_t val) {
@@ -120,6 +126,12 @@ static bool validate_bthread_min_concurrency(const char*, int32_t val) {
 
 __thread TaskGroup* tls_task_group_nosignal = NULL;
 
+inline bthread_tag_t get_attr_tag(const bthread_attr_t* attr,
+                                  bthread_tag_t default_tag) {
+    return (attr == NULL || attr->tag == BTHREAD_TAG_INVALID) ?
+        default_tag : attr->tag;
+}
+
 BUTIL_FORCE_INLINE int
 start_from_non_worker(bthread_t* __restrict tid,
                       const bthread_attr_t* __restrict attr,
@@ -129,19 +141,28 @@ start_from_non_worker(bthread_t* __restrict tid,
     if (NULL == c) {
         return ENOMEM;
     }
+    const bthread_tag_t tag = get_attr_tag(attr, BTHREAD_TAG_DEFAULT);
+    if (tag < 0 || tag >= c->ntags()) {
+        return EINVAL;
+    }
     if (attr != NULL && (attr->flags & BTHREAD_NOSIGNAL)) {
         // Remember the TaskGroup to insert NOSIGNAL tasks for 2 reasons:
         // 1. NOSIGNAL is often for creating many bthreads in batch,
         //    inserting into the same TaskGroup maximizes the batch.
         // 2. bthread_flush() needs to know which TaskGroup to flush.
         TaskGroup* g = tls_task_group_nosignal;
+        if (g != NULL && g->tag() != tag) {
+            // Tasks of the previous tag must not wait for bthread_flush().
+            g->flush_nosignal_tasks_remote();
+            g = NULL;
+        }
         if (NULL == g) {
-            g = c->choose_one_group();
+            g = c->choose_one_group(tag);
             tls_task_group_nosignal = g;
         }
         return g->start_background<true>(tid, attr, fn, arg);
     }
-    return c->choose_one_group()->start_background<true>(
+    return c->choose_one_group(tag)->start_background<true>(
         tid, attr, fn, arg);
 }
 
@@ -165,6 +186,13 @@ struct TidJoiner {
     }
 };
 
+void print_stuck_workers(std::ostream& os) {
+    TaskControl* c = get_task_control();
+    if (c != NULL) {
+        c->print_stuck_workers(os);
+    }
+}
+
 }  // namespace bthread
 
 extern "C" {
@@ -174,7 +202,7 @@ int bthread_start_urgent(bthread_t* __restrict tid,
                          void * (*fn)(void*),
                          void* __restrict arg) {
     bthread::TaskGroup* g = bthread::tls_task_group;
-    if (g) {
+    if (g && bthread::get_attr_tag(attr, g->tag()) == g->tag()) {
         // start from worker
         return bthread::TaskGroup::start_foreground(&g, tid, attr, fn, arg);
     }
@@ -186,21 +214,51 @@ int bthread_start_background(bthread_t* __restrict tid,
                              void * (*fn)(void*),
                              void* __restrict arg) {
     bthread::TaskGroup* g = bthread::tls_task_group;
-    if (g) {
+    if (g && bthread::get_attr_tag(attr, g->tag()) == g->tag()) {
         // start from worker
         return g->start_background<false>(tid, attr, fn, arg);
     }
     return bthread::start_from_non_worker(tid, attr, fn, arg);
 }
 
+int bthread_start_background_with_affinity(bthread_t* __restrict tid,
+                                           const bthread_attr_t* __restrict attr,
+                                           void * (*fn)(void*),
+                                           void* __restrict arg,
+                                           uint64_t affinity) {
+    bthread::TaskControl* c = bthread::get_or_new_task_control();
+    if (NULL == c) {
+        return ENOMEM;
+    }
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    const bthread_tag_t tag = bthread::get_attr_tag(
+        attr, g ? g->tag() : BTHREAD_TAG_DEFAULT);
+    if (tag < 0 || tag >= c->ntags()) {
+        return EINVAL;
+    }
+    bthread::TaskGroup* target = c->choose_group_by_affinity(tag, affinity);
+    if (target == g) {
+        return g->start_background<false>(tid, attr, fn, arg);
+    }
+    if (attr != NULL && (attr->flags & BTHREAD_NOSIGNAL)) {
+        // bthread_flush() only flushes the group remembered by the caller,
+        // signal the target group right now.
+        bthread_attr_t tmp = *attr;
+        tmp.flags &= ~BTHREAD_NOSIGNAL;
+        return target->start_background<true>(tid, &tmp, fn, arg);
+    }
+    return target->start_background<true>(tid, attr, fn, arg);
+}
+
 void bthread_flush() {
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (g) {
-        return g->flush_nosignal_tasks();
+        g->flush_nosignal_tasks();
     }
     g = bthread::tls_task_group_nosignal;
     if (g) {
-        // NOSIGNAL tasks were created in this non-worker.
+        // NOSIGNAL tasks were created in this non-worker, or in a worker
+        // for groups with another tag.
         bthread::tls_task_group_nosignal = NULL;
         return g->flush_nosignal_tasks_remote();
     }
@@ -230,6 +288,11 @@ bthread_t bthread_self(void) {
     return INVALID_BTHREAD;
 }
 
+bthread_tag_t bthread_self_tag(void) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    return g != NULL ? g->tag() : BTHREAD_TAG_INVALID;
+}
+
 int bthread_equal(bthread_t t1, bthread_t t2) {
     return t1 == t2;
 }
@@ -264,6 +327,14 @@ int bthread_getconcurrency(void) {
     return bthread::FLAGS_bthread_concurrency;
 }
 
+int bthread_getconcurrency_by_tag(bthread_tag_t tag) {
+    bthread::TaskControl* c = bthread::get_task_control();
+    if (c == NULL) {
+        return (tag >= 0 && tag < FLAGS_task_group_ntags) ? 0 : -1;
+    }
+    return c->concurrency(tag);
+}
+
 int bthread_setconcurrency(int num) {
     if (num < BTHREAD_MIN_CONCURRENCY || num > BTHREAD_MAX_CONCURRENCY) {
         LOG(ERROR) << "Invalid concurrency=" << num;
@@ -376,6 +447,26 @@ int bthread_yield(void) {
     return sched_yield();
 }
 
+int bthread_set_self_deadline(int64_t deadline_us) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (NULL == g || g->is_current_main_task()) {
+        return EINVAL;
+    }
+    g->current_task()->attr.deadline_us = (deadline_us > 0 ? deadline_us : 0);
+    return 0;
+}
+
+int bthread_maybe_yield(void) {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (NULL == g || g->is_current_pthread_task() ||
+        butil::cpuwide_time_ns() - g->last_run_ns() <
+        bthread::FLAGS_bthread_maybe_yield_us * 1000L) {
+        return 0;
+    }
+    bthread::TaskGroup::yield(&g);
+    return 1;
+}
+
 int bthread_set_worker_startfn(void (*start_fn)()) {
     if (start_fn == NULL) {
         return EINVAL;
@@ -146,6 +146,11 @@ extern int bthread_getconcurrency(void);
 // NOTE: currently concurrency cannot be reduced after any bthread created.
 extern int bthread_setconcurrency(int num);
 
+// Get number of worker pthreads with `tag', see bthread_tag_t. Workers
+// created by bthread_setconcurrency() are evenly assigned to all tags.
+// Returns -1 if `tag' is invalid.
+extern int bthread_getconcurrency_by_tag(bthread_tag_t tag);
+
 // Yield processor to another bthread. 
 // Notice that current implementation is not fair, which means that 
 // even if bthread_yield() is called, suspended threads may still starve.
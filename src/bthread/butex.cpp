@@ -28,6 +28,7 @@
 #endif
 #include "butil/logging.h"
 #include "butil/object_pool.h"
+#include "butil/usdt.h"                     // BUTIL_USDT2
 #include "bthread/errno.h"                 // EWOULDBLOCK
 #include "bthread/sys_futex.h"             // futex_*
 #include "bthread/processor.h"             // cpu_relax
@@ -100,6 +101,8 @@ struct ButexBthreadWaiter : public ButexWaiter {
     int expected_value;
     Butex* initial_butex;
     TaskControl* control;
+    // The waiter must be woken up into a group of this tag.
+    bthread_tag_t tag;
 };
 
 // pthread_task or main_task allocates this structure on stack and queue it
@@ -256,9 +259,20 @@ void butex_destroy(void* butex) {
     butil::return_object(b);
 }
 
-inline TaskGroup* get_task_group(TaskControl* c) {
+inline TaskGroup* get_task_group(TaskControl* c, bthread_tag_t tag) {
     TaskGroup* g = tls_task_group;
-    return g ? g : c->choose_one_group();
+    return (g && g->tag() == tag) ? g : c->choose_one_group(tag);
+}
+
+// Queue `w' into `g' which is batching wakeups, or signal a group of w's
+// tag directly if the tags differ. Tasks never run on workers of other tags.
+inline void ready_to_run_in_tag(TaskGroup* g, ButexBthreadWaiter* w,
+                                bool nosignal) {
+    if (g->tag() == w->tag) {
+        g->ready_to_run_general(w->tid, nosignal);
+    } else {
+        get_task_group(w->control, w->tag)->ready_to_run_general(w->tid);
+    }
 }
 
 int butex_wake(void* arg) {
@@ -279,11 +293,12 @@ int butex_wake(void* arg) {
     }
     ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(front);
     unsleep_if_necessary(bbw, get_global_timer_thread());
+    BUTIL_USDT2(bthread, butex_wake, arg, bbw->tid);
     TaskGroup* g = tls_task_group;
-    if (g) {
+    if (g && g->tag() == bbw->tag) {
         TaskGroup::exchange(&g, bbw->tid);
     } else {
-        bbw->control->choose_one_group()->ready_to_run_remote(bbw->tid);
+        bbw->control->choose_one_group(bbw->tag)->ready_to_run_remote(bbw->tid);
     }
     return 1;
 }
@@ -323,8 +338,9 @@ int butex_wake_all(void* arg) {
         bthread_waiters.head()->value());
     next->RemoveFromList();
     unsleep_if_necessary(next, get_global_timer_thread());
+    BUTIL_USDT2(bthread, butex_wake, arg, next->tid);
     ++nwakeup;
-    TaskGroup* g = get_task_group(next->control);
+    TaskGroup* g = get_task_group(next->control, next->tag);
     const int saved_nwakeup = nwakeup;
     while (!bthread_waiters.empty()) {
         // pop reversely
@@ -332,7 +348,8 @@ int butex_wake_all(void* arg) {
             bthread_waiters.tail()->value());
         w->RemoveFromList();
         unsleep_if_necessary(w, get_global_timer_thread());
-        g->ready_to_run_general(w->tid, true);
+        BUTIL_USDT2(bthread, butex_wake, arg, w->tid);
+        ready_to_run_in_tag(g, w, true);
         ++nwakeup;
     }
     if (saved_nwakeup != nwakeup) {
@@ -391,7 +408,7 @@ int butex_wake_except(void* arg, bthread_t excluded_bthread) {
     ButexBthreadWaiter* front = static_cast<ButexBthreadWaiter*>(
                 bthread_waiters.head()->value());
 
-    TaskGroup* g = get_task_group(front->control);
+    TaskGroup* g = get_task_group(front->control, front->tag);
     const int saved_nwakeup = nwakeup;
     do {
         // pop reversely
@@ -399,7 +416,8 @@ int butex_wake_except(void* arg, bthread_t excluded_bthread) {
             bthread_waiters.tail()->value());
         w->RemoveFromList();
         unsleep_if_necessary(w, get_global_timer_thread());
-        g->ready_to_run_general(w->tid, true);
+        BUTIL_USDT2(bthread, butex_wake, arg, w->tid);
+        ready_to_run_in_tag(g, w, true);
         ++nwakeup;
     } while (!bthread_waiters.empty());
     if (saved_nwakeup != nwakeup) {
@@ -439,11 +457,12 @@ int butex_requeue(void* arg, void* arg2) {
     }
     ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(front);
     unsleep_if_necessary(bbw, get_global_timer_thread());
+    BUTIL_USDT2(bthread, butex_wake, arg, bbw->tid);
     TaskGroup* g = tls_task_group;
-    if (g) {
+    if (g && g->tag() == bbw->tag) {
         TaskGroup::exchange(&g, front->tid);
     } else {
-        bbw->control->choose_one_group()->ready_to_run_remote(front->tid);
+        bbw->control->choose_one_group(bbw->tag)->ready_to_run_remote(front->tid);
     }
     return 1;
 }
@@ -481,7 +500,7 @@ inline bool erase_from_butex(ButexWaiter* bw, bool wakeup, WaiterState state) {
     if (erased && wakeup) {
         if (bw->tid) {
             ButexBthreadWaiter* bbw = static_cast<ButexBthreadWaiter*>(bw);
-            get_task_group(bbw->control)->ready_to_run_general(bw->tid);
+            get_task_group(bbw->control, bbw->tag)->ready_to_run_general(bw->tid);
         } else {
             ButexPthreadWaiter* pw = static_cast<ButexPthreadWaiter*>(bw);
             wakeup_pthread(pw);
@@ -630,6 +649,7 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     bbw.expected_value = expected_value;
     bbw.initial_butex = b;
     bbw.control = g->control();
+    bbw.tag = g->tag();
 
     if (abstime != NULL) {
         // Schedule timer before queueing. If the timer is triggered before
@@ -656,7 +676,8 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     // in task_group.cpp to guarantee visibility of `interrupted'.
     bbw.task_meta->current_waiter.store(&bbw, butil::memory_order_release);
     g->set_remained(wait_for_butex, &bbw);
-    TaskGroup::sched(&g);
+    BUTIL_USDT2(bthread, butex_wait_begin, arg, bbw.tid);
+    TaskGroup::park(&g);
 
     // erase_from_butex_and_wakeup (called by TimerThread) is possibly still
     // running and using bbw. The chance is small, just spin until it's done.
@@ -668,6 +689,7 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime) {
     BT_LOOP_WHEN(bbw.task_meta->current_waiter.exchange(
                      NULL, butil::memory_order_acquire) == NULL,
                  30/*nops before sched_yield*/);
+    BUTIL_USDT3(bthread, butex_wait_end, arg, bbw.tid, (int)bbw.waiter_state);
 #ifdef SHOW_BTHREAD_BUTEX_WAITER_COUNT_IN_VARS
     num_waiters << -1;
 #endif
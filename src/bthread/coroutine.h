@@ -0,0 +1,360 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_COROUTINE_H
+#define BTHREAD_COROUTINE_H
+
+// [C++20 only] Stackless coroutines running on bthread workers.
+//
+// A function returning bthread::Awaitable<T> is a coroutine which may
+// co_await other Awaitables and the awaiters below. While suspended, a
+// coroutine only holds its heap-allocated frame rather than a whole bthread
+// stack, and it's resumed on a bthread worker when the awaited event
+// happens, so that thousands of in-flight operations are cheap.
+//
+//   bthread::Awaitable<int> add_slowly(int a, int b) {
+//       co_await bthread::co_usleep(1000);
+//       co_return a + b;
+//   }
+//   bthread::Awaitable<void> work() {
+//       const int c = co_await add_slowly(1, 2);
+//       ...
+//   }
+//   bthread::start_coroutine(work());               // fire and forget
+//   int c = bthread::sync_wait(add_slowly(1, 2));   // block until done
+//
+// Exceptions thrown out of coroutines terminate the program.
+// This file is empty unless compiled with -std=c++20 or newer.
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define BTHREAD_HAS_COROUTINE 1
+#endif
+#endif
+
+#ifdef BTHREAD_HAS_COROUTINE
+
+#include <coroutine>
+#include <exception>                         // std::terminate
+#include <optional>
+#include <type_traits>                       // std::is_void
+#include <utility>                           // std::move
+#include <errno.h>
+#include "butil/time.h"                      // microseconds_from_now
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"                // bthread_timer_add
+#include "bthread/mutex.h"
+#include "bthread/countdown_event.h"
+
+namespace bthread {
+
+namespace internal {
+
+inline void* run_coroutine(void* arg) {
+    std::coroutine_handle<>::from_address(arg).resume();
+    return NULL;
+}
+
+// Resume `h' in a new bthread.
+inline void resume_in_bthread(std::coroutine_handle<> h) {
+    bthread_t th;
+    if (bthread_start_background(&th, NULL, run_coroutine, h.address()) != 0) {
+        // Better than never resuming it.
+        h.resume();
+    }
+}
+
+// Resume `h' in the calling thread if it's a bthread, in a new bthread
+// otherwise.
+inline void resume_on_worker(std::coroutine_handle<> h) {
+    if (bthread_self() != INVALID_BTHREAD) {
+        h.resume();
+    } else {
+        resume_in_bthread(h);
+    }
+}
+
+class PromiseBase {
+public:
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(
+                std::coroutine_handle<P> h) const noexcept {
+            // Transfer to the awaiting coroutine without growing the stack.
+            std::coroutine_handle<> c = h.promise()._continuation;
+            return c ? c : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    // Awaitables are lazy, they start running when being awaited.
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() const noexcept { std::terminate(); }
+
+    std::coroutine_handle<> _continuation;
+};
+
+template <typename T>
+class Promise : public PromiseBase {
+public:
+    void return_value(T value) { _value.emplace(std::move(value)); }
+    T result() { return std::move(*_value); }
+private:
+    std::optional<T> _value;
+};
+
+template <>
+class Promise<void> : public PromiseBase {
+public:
+    void return_void() const noexcept {}
+    void result() const noexcept {}
+};
+
+}  // namespace internal
+
+// Return type of coroutines. Not copyable, the coroutine is destroyed along
+// with the Awaitable if it's not finished.
+template <typename T = void>
+class Awaitable {
+public:
+    class promise_type : public internal::Promise<T> {
+    public:
+        Awaitable get_return_object() noexcept {
+            return Awaitable(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+    Awaitable(Awaitable&& rhs) noexcept : _handle(rhs._handle) {
+        rhs._handle = nullptr;
+    }
+    Awaitable& operator=(Awaitable&& rhs) noexcept {
+        if (this != &rhs) {
+            if (_handle) {
+                _handle.destroy();
+            }
+            _handle = rhs._handle;
+            rhs._handle = nullptr;
+        }
+        return *this;
+    }
+    ~Awaitable() {
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<> awaiting) noexcept {
+        _handle.promise()._continuation = awaiting;
+        return _handle;
+    }
+    T await_resume() { return _handle.promise().result(); }
+
+private:
+    explicit Awaitable(std::coroutine_handle<promise_type> h) : _handle(h) {}
+    Awaitable(const Awaitable&) = delete;
+    Awaitable& operator=(const Awaitable&) = delete;
+
+    std::coroutine_handle<promise_type> _handle;
+};
+
+namespace internal {
+
+// Coroutine destroying itself after completion.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() noexcept {
+            return Detached{
+                std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+Detached run_detached(Awaitable<T> task) {
+    co_await task;
+}
+
+template <typename T>
+Detached run_and_signal(Awaitable<T> task, std::optional<T>* result,
+                        CountdownEvent* event) {
+    result->emplace(co_await task);
+    event->signal();
+}
+
+inline Detached run_and_signal(Awaitable<void> task, CountdownEvent* event) {
+    co_await task;
+    event->signal();
+}
+
+// Suspend the coroutine and call block() in a new bthread which resumes
+// the coroutine after block() returns. Used for primitives without
+// asynchronous interfaces, only the blocking bthread holds a stack.
+class BlockingAwaiter {
+public:
+    bool await_suspend(std::coroutine_handle<> h) {
+        _handle = h;
+        bthread_t th;
+        if (bthread_start_background(&th, NULL, run, this) != 0) {
+            block();
+            return false;
+        }
+        return true;
+    }
+
+protected:
+    virtual ~BlockingAwaiter() {}
+    virtual void block() = 0;
+
+private:
+    static void* run(void* arg) {
+        BlockingAwaiter* a = static_cast<BlockingAwaiter*>(arg);
+        a->block();
+        // The coroutine keeps running in this bthread.
+        a->_handle.resume();
+        return NULL;
+    }
+
+    std::coroutine_handle<> _handle;
+};
+
+}  // namespace internal
+
+// Run `task' in a new bthread and detach it. Resources of the coroutine are
+// released after it finishes.
+template <typename T>
+void start_coroutine(Awaitable<T> task) {
+    internal::resume_in_bthread(
+        internal::run_detached(std::move(task)).handle);
+}
+
+// Run `task' in a new bthread and block the calling bthread or pthread
+// until it finishes. Returns the result of `task'.
+template <typename T>
+T sync_wait(Awaitable<T> task) {
+    CountdownEvent event(1);
+    if constexpr (std::is_void<T>::value) {
+        internal::resume_in_bthread(
+            internal::run_and_signal(std::move(task), &event).handle);
+        event.wait();
+    } else {
+        std::optional<T> result;
+        internal::resume_in_bthread(
+            internal::run_and_signal(std::move(task), &result, &event).handle);
+        event.wait();
+        return std::move(*result);
+    }
+}
+
+// co_await bthread::co_usleep(us) suspends the coroutine for at least `us'
+// microseconds without occupying a bthread.
+// The co_await expression is 0 on success, -1 otherwise and errno is set.
+class SleepAwaiter {
+public:
+    explicit SleepAwaiter(int64_t us) : _us(us), _rc(0) {}
+
+    bool await_ready() const noexcept { return _us <= 0; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        bthread_timer_t id;
+        const int rc = bthread_timer_add(
+            &id, butil::microseconds_from_now(_us), on_timer, h.address());
+        if (rc != 0) {
+            _rc = rc;
+            return false;
+        }
+        return true;
+    }
+    int await_resume() const noexcept {
+        if (_rc != 0) {
+            errno = _rc;
+            return -1;
+        }
+        return 0;
+    }
+
+private:
+    // Called in the TimerThread which must not run user code.
+    static void on_timer(void* arg) {
+        internal::resume_in_bthread(std::coroutine_handle<>::from_address(arg));
+    }
+
+    int64_t _us;
+    int _rc;
+};
+
+inline SleepAwaiter co_usleep(int64_t us) {
+    return SleepAwaiter(us);
+}
+
+// co_await bthread::co_lock(mutex) locks `mutex'. If the mutex is contended,
+// it's locked in another bthread in which the coroutine is resumed.
+// Unlock it with mutex.unlock() as usual.
+class LockAwaiter : public internal::BlockingAwaiter {
+public:
+    explicit LockAwaiter(Mutex& mutex) : _mutex(mutex) {}
+
+    bool await_ready() { return _mutex.try_lock(); }
+    void await_resume() const noexcept {}
+
+private:
+    void block() override { _mutex.lock(); }
+
+    Mutex& _mutex;
+};
+
+inline LockAwaiter co_lock(Mutex& mutex) {
+    return LockAwaiter(mutex);
+}
+
+// co_await bthread::co_wait(event) suspends the coroutine until counter of
+// `event' reaches 0. The co_await expression is the same as
+// CountdownEvent::wait().
+class CountdownAwaiter : public internal::BlockingAwaiter {
+public:
+    explicit CountdownAwaiter(CountdownEvent& event)
+        : _event(event), _rc(0) {}
+
+    bool await_ready() const noexcept { return false; }
+    int await_resume() const noexcept { return _rc; }
+
+private:
+    void block() override { _rc = _event.wait(); }
+
+    CountdownEvent& _event;
+    int _rc;
+};
+
+inline CountdownAwaiter co_wait(CountdownEvent& event) {
+    return CountdownAwaiter(event);
+}
+
+}  // namespace bthread
+
+#endif  // BTHREAD_HAS_COROUTINE
+
+#endif  // BTHREAD_COROUTINE_H
@@ -0,0 +1,100 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_DEADLINE_TASK_QUEUE_H
+#define BTHREAD_DEADLINE_TASK_QUEUE_H
+
+#include <stdint.h>
+#include <algorithm>                      // std::push_heap
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#include "bthread/types.h"
+
+namespace bthread {
+
+// A bounded min-heap of bthreads ordered by their deadlines, popped in
+// earliest-deadline-first order by the owner worker and stealing workers.
+// Pushed by the owner as well as other workers waking up bthreads, thus
+// protected by a mutex. Popping an empty queue does not lock.
+class DeadlineTaskQueue {
+public:
+    static const size_t CAPACITY = 256;
+
+    DeadlineTaskQueue() : _size(0) {
+        _tasks.reserve(CAPACITY);
+    }
+
+    // Returns false if the queue is full.
+    bool push(bthread_t task, int64_t deadline_us) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_tasks.size() >= CAPACITY) {
+            return false;
+        }
+        Task t = { deadline_us, task };
+        _tasks.push_back(t);
+        std::push_heap(_tasks.begin(), _tasks.end(), Later());
+        _size.store(_tasks.size(), butil::memory_order_release);
+        return true;
+    }
+
+    // Pop the task with the earliest deadline.
+    bool pop(bthread_t* task, int64_t* deadline_us) {
+        if (_size.load(butil::memory_order_acquire) == 0) {
+            return false;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_tasks.empty()) {
+            return false;
+        }
+        std::pop_heap(_tasks.begin(), _tasks.end(), Later());
+        *task = _tasks.back().task;
+        *deadline_us = _tasks.back().deadline_us;
+        _tasks.pop_back();
+        _size.store(_tasks.size(), butil::memory_order_release);
+        return true;
+    }
+
+    size_t volatile_size() const {
+        return _size.load(butil::memory_order_relaxed);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DeadlineTaskQueue);
+
+    struct Task {
+        int64_t deadline_us;
+        bthread_t task;
+    };
+    struct Later {
+        bool operator()(const Task& a, const Task& b) const {
+            return a.deadline_us > b.deadline_us;
+        }
+    };
+
+    butil::Mutex _mutex;
+    std::vector<Task> _tasks;
+    butil::atomic<size_t> _size;
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_DEADLINE_TASK_QUEUE_H
@@ -129,6 +129,8 @@ void* ExecutionQueueBase::_execute_tasks(void* arg) {
     ExecutionQueueBase* m = (ExecutionQueueBase*)head->q;
     TaskNode* cur_tail = NULL;
     bool destroy_queue = false;
+    const int64_t time_slice_us = m->_options.time_slice_us;
+    int64_t slice_start_us = time_slice_us > 0 ? butil::cpuwide_time_us() : 0;
     for (;;) {
         if (head->iterated) {
             CHECK(head->next != NULL);
@@ -170,6 +172,14 @@ void* ExecutionQueueBase::_execute_tasks(void* arg) {
             m->return_task_node(head);
             break;
         }
+        if (time_slice_us > 0) {
+            const int64_t now_us = butil::cpuwide_time_us();
+            if (now_us - slice_start_us >= time_slice_us) {
+                // Let other bthreads (namely consumers of other queues) run.
+                bthread_yield();
+                slice_start_us = butil::cpuwide_time_us();
+            }
+        }
     }
     if (destroy_queue) {
         CHECK(m->_head.load(butil::memory_order_relaxed) == NULL);
@@ -390,6 +400,12 @@ void TaskIteratorBase::operator++() {
     if (should_break_for_high_priority_tasks()) {
         return;
     }  // else the next high_priority_task would be delayed for at most one task
+    const int max_tasks = _q->_options.max_tasks_per_batch;
+    if (max_tasks > 0 && _num_iterated >= max_tasks) {
+        // Remaining tasks are passed in the next batch.
+        _should_break = true;
+        return;
+    }
 
     while (_cur_node && !_cur_node->stop_task) {
         if (_high_priority == _cur_node->high_priority) {
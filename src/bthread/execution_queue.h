@@ -35,10 +35,13 @@ template <typename T> struct ExecutionQueueId;
 template <typename T> class ExecutionQueue;
 struct TaskNode;
 class ExecutionQueueBase;
+template <typename T, typename K, typename Hash> class ShardedExecutionQueue;
 
 class TaskIteratorBase {
 DISALLOW_COPY_AND_ASSIGN(TaskIteratorBase);
 friend class ExecutionQueueBase;
+template <typename T, typename K, typename Hash>
+friend class ShardedExecutionQueue;
 public:
     // Returns true when the ExecutionQueue is stopped and there will never be
     // more tasks and you can safely release all the related resources ever 
@@ -149,6 +152,17 @@ struct ExecutionQueueOptions {
     // Note that TaskOptions.in_place_if_possible = false will not work, if implementation of
     // Executor is in-place(synchronous).
     Executor * executor;
+
+    // Max number of tasks passed to one call of execute, the remaining tasks
+    // are passed in following calls. 0 means unlimited.
+    // default: 0
+    int max_tasks_per_batch;
+
+    // The consumer yields (bthread_yield) between calls of execute after
+    // running so many microseconds continuously, so that consumers of busy
+    // queues don't monopolize workers. 0 means never yielding.
+    // default: 0
+    int64_t time_slice_us;
 };
 
 // Start a ExecutionQueue. If |options| is NULL, the queue will be created with
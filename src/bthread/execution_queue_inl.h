@@ -321,6 +321,7 @@ public:
 
 inline ExecutionQueueOptions::ExecutionQueueOptions()
     : bthread_attr(BTHREAD_ATTR_NORMAL), executor(NULL)
+    , max_tasks_per_batch(0), time_slice_us(0)
 {}
 
 template <typename T>
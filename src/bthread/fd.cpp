@@ -30,10 +30,12 @@
 #include "butil/time.h"
 #include "butil/fd_utility.h"                     // make_non_blocking
 #include "butil/logging.h"
+#include "butil/scoped_lock.h"                     // BAIDU_SCOPED_LOCK
 #include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix32
 #include "bthread/butex.h"                       // butex_*
 #include "bthread/task_group.h"                  // TaskGroup
 #include "bthread/bthread.h"                             // bthread_start_urgent
+#include "bthread/unstable.h"                    // bthread_fd_poller_t
 
 // Implement bthread functions on file descriptors
 
@@ -108,6 +110,66 @@ LazyArray<EpollButex*, 262144/*NBLOCK*/, 256/*BLOCK_SIZE*/> fd_butexes;
 
 static const int BTHREAD_DEFAULT_EPOLL_SIZE = 65536;
 
+// Set by bthread_set_fd_poller().
+static bthread_fd_poller_t g_fd_poller = { NULL, NULL };
+static butil::static_atomic<bool> g_has_fd_poller = BUTIL_STATIC_ATOMIC_INIT(false);
+
+// Returns the butex that waiters on `fd' wait for, NULL on error.
+static EpollButex* get_or_create_fd_butex(int fd) {
+    butil::atomic<EpollButex*>* p = fd_butexes.get_or_new(fd);
+    if (NULL == p) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    EpollButex* butex = p->load(butil::memory_order_consume);
+    if (NULL == butex) {
+        // It is rare to wait on one file descriptor from multiple threads
+        // simultaneously. Creating singleton by optimistic locking here
+        // saves mutexes for each butex.
+        butex = butex_create_checked<EpollButex>();
+        butex->store(0, butil::memory_order_relaxed);
+        EpollButex* expected = NULL;
+        if (!p->compare_exchange_strong(expected, butex,
+                                        butil::memory_order_release,
+                                        butil::memory_order_consume)) {
+            butex_destroy(butex);
+            butex = expected;
+        }
+    }
+
+    while (butex == CLOSING_GUARD) {  // bthread_close() is running.
+        if (sched_yield() < 0) {
+            return NULL;
+        }
+        butex = p->load(butil::memory_order_consume);
+    }
+    return butex;
+}
+
+static void wake_fd_waiters(EpollButex* butex) {
+    if (butex != NULL && butex != CLOSING_GUARD) {
+        butex->fetch_add(1, butil::memory_order_relaxed);
+        butex_wake_all(butex);
+    }
+}
+
+static void wake_fd_waiters(int fd) {
+    butil::atomic<EpollButex*>* pbutex = fd_butexes.get(fd);
+    if (pbutex != NULL) {
+        wake_fd_waiters(pbutex->load(butil::memory_order_consume));
+    }
+}
+
+static int wait_fd_butex(EpollButex* butex, int expected_val,
+                         const timespec* abstime) {
+    if (butex_wait(butex, expected_val, abstime) < 0 &&
+        errno != EWOULDBLOCK && errno != EINTR) {
+        return -1;
+    }
+    return 0;
+}
+
 class EpollThread {
 public:
     EpollThread()
@@ -197,33 +259,9 @@ public:
     }
 
     int fd_wait(int fd, unsigned events, const timespec* abstime) {
-        butil::atomic<EpollButex*>* p = fd_butexes.get_or_new(fd);
-        if (NULL == p) {
-            errno = ENOMEM;
-            return -1;
-        }
-
-        EpollButex* butex = p->load(butil::memory_order_consume);
+        EpollButex* butex = get_or_create_fd_butex(fd);
         if (NULL == butex) {
-            // It is rare to wait on one file descriptor from multiple threads
-            // simultaneously. Creating singleton by optimistic locking here
-            // saves mutexes for each butex.
-            butex = butex_create_checked<EpollButex>();
-            butex->store(0, butil::memory_order_relaxed);
-            EpollButex* expected = NULL;
-            if (!p->compare_exchange_strong(expected, butex,
-                                            butil::memory_order_release,
-                                            butil::memory_order_consume)) {
-                butex_destroy(butex);
-                butex = expected;
-            }
-        }
-        
-        while (butex == CLOSING_GUARD) {  // bthread_close() is running.
-            if (sched_yield() < 0) {
-                return -1;
-            }
-            butex = p->load(butil::memory_order_consume);
+            return -1;
         }
         // Save value of butex before adding to epoll because the butex may
         // be changed before butex_wait. No memory fence because EPOLL_CTL_MOD
@@ -259,34 +297,13 @@ public:
             return -1;
         }
 #endif
-        if (butex_wait(butex, expected_val, abstime) < 0 &&
-            errno != EWOULDBLOCK && errno != EINTR) {
-            return -1;
-        }
-        return 0;
+        return wait_fd_butex(butex, expected_val, abstime);
     }
 
-    int fd_close(int fd) {
-        if (fd < 0) {
-            // what close(-1) returns
-            errno = EBADF;
-            return -1;
-        }
-        butil::atomic<EpollButex*>* pbutex = bthread::fd_butexes.get(fd);
-        if (NULL == pbutex) {
-            // Did not call bthread_fd functions, close directly.
-            return close(fd);
-        }
-        EpollButex* butex = pbutex->exchange(
-            CLOSING_GUARD, butil::memory_order_relaxed);
-        if (butex == CLOSING_GUARD) {
-            // concurrent double close detected.
-            errno = EBADF;
-            return -1;
-        }
-        if (butex != NULL) {
-            butex->fetch_add(1, butil::memory_order_relaxed);
-            butex_wake_all(butex);
+    // Remove `fd' from the epoll before it's closed.
+    void unwatch(int fd) {
+        if (!started()) {
+            return;
         }
 #if defined(OS_LINUX)
         epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, NULL);
@@ -297,9 +314,6 @@ public:
         EV_SET(&evt, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
         kevent(_epfd, &evt, 1, NULL, 0, NULL);
 #endif
-        const int rc = close(fd);
-        pbutex->exchange(butex, butil::memory_order_relaxed);
-        return rc;
     }
 
     bool started() const {
@@ -368,19 +382,13 @@ private:
             for (int i = 0; i < n; ++i) {
 #if defined(OS_LINUX)
 # ifdef BAIDU_KERNEL_FIXED_EPOLLONESHOT_BUG
-                EpollButex* butex = static_cast<EpollButex*>(e[i].data.ptr);
+                wake_fd_waiters(static_cast<EpollButex*>(e[i].data.ptr));
 # else
-                butil::atomic<EpollButex*>* pbutex = fd_butexes.get(e[i].data.fd);
-                EpollButex* butex = pbutex ?
-                    pbutex->load(butil::memory_order_consume) : NULL;
+                wake_fd_waiters(e[i].data.fd);
 # endif
 #elif defined(OS_MACOSX)
-                EpollButex* butex = static_cast<EpollButex*>(e[i].udata);
+                wake_fd_waiters(static_cast<EpollButex*>(e[i].udata));
 #endif
-                if (butex != NULL && butex != CLOSING_GUARD) {
-                    butex->fetch_add(1, butil::memory_order_relaxed);
-                    butex_wake_all(butex);
-                }
             }
         }
 
@@ -398,18 +406,73 @@ private:
 
 EpollThread epoll_thread[BTHREAD_EPOLL_THREAD_NUM];
 
-static inline EpollThread& get_epoll_thread(int fd) {
+static inline EpollThread& get_epoll_thread(int fd, bool start = true) {
     if (BTHREAD_EPOLL_THREAD_NUM == 1UL) {
         EpollThread& et = epoll_thread[0];
-        et.start(BTHREAD_DEFAULT_EPOLL_SIZE);
+        if (start) {
+            et.start(BTHREAD_DEFAULT_EPOLL_SIZE);
+        }
         return et;
     }
 
     EpollThread& et = epoll_thread[butil::fmix32(fd) % BTHREAD_EPOLL_THREAD_NUM];
-    et.start(BTHREAD_DEFAULT_EPOLL_SIZE);
+    if (start) {
+        et.start(BTHREAD_DEFAULT_EPOLL_SIZE);
+    }
     return et;
 }
 
+// Wait with the poller set by bthread_set_fd_poller().
+static int poller_fd_wait(int fd, unsigned events, const timespec* abstime) {
+    EpollButex* butex = get_or_create_fd_butex(fd);
+    if (NULL == butex) {
+        return -1;
+    }
+    // Events happening after watch() bump the butex and make butex_wait
+    // return immediately.
+    const int expected_val = butex->load(butil::memory_order_relaxed);
+    if (g_fd_poller.watch(fd, events) != 0) {
+        return -1;
+    }
+    return wait_fd_butex(butex, expected_val, abstime);
+}
+
+static int fd_wait(int fd, unsigned events, const timespec* abstime) {
+    if (g_has_fd_poller.load(butil::memory_order_acquire)) {
+        return poller_fd_wait(fd, events, abstime);
+    }
+    return get_epoll_thread(fd).fd_wait(fd, events, abstime);
+}
+
+static int fd_close(int fd) {
+    if (fd < 0) {
+        // what close(-1) returns
+        errno = EBADF;
+        return -1;
+    }
+    butil::atomic<EpollButex*>* pbutex = fd_butexes.get(fd);
+    if (NULL == pbutex) {
+        // Did not call bthread_fd functions, close directly.
+        return close(fd);
+    }
+    EpollButex* butex = pbutex->exchange(
+        CLOSING_GUARD, butil::memory_order_relaxed);
+    if (butex == CLOSING_GUARD) {
+        // concurrent double close detected.
+        errno = EBADF;
+        return -1;
+    }
+    wake_fd_waiters(butex);
+    // The fd may be watched by both if the poller was set after waits.
+    get_epoll_thread(fd, false).unwatch(fd);
+    if (g_has_fd_poller.load(butil::memory_order_acquire)) {
+        g_fd_poller.unwatch(fd);
+    }
+    const int rc = close(fd);
+    pbutex->exchange(butex, butil::memory_order_relaxed);
+    return rc;
+}
+
 //TODO(zhujiashun): change name
 int stop_and_join_epoll_threads() {
     // Returns -1 if any epoll thread failed to stop.
@@ -498,8 +561,7 @@ int bthread_fd_wait(int fd, unsigned events) {
     }
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (NULL != g && !g->is_current_pthread_task()) {
-        return bthread::get_epoll_thread(fd).fd_wait(
-            fd, events, NULL);
+        return bthread::fd_wait(fd, events, NULL);
     }
     return bthread::pthread_fd_wait(fd, events, NULL);
 }
@@ -515,8 +577,7 @@ int bthread_fd_timedwait(int fd, unsigned events,
     }
     bthread::TaskGroup* g = bthread::tls_task_group;
     if (NULL != g && !g->is_current_pthread_task()) {
-        return bthread::get_epoll_thread(fd).fd_wait(
-            fd, events, abstime);
+        return bthread::fd_wait(fd, events, abstime);
     }
     return bthread::pthread_fd_wait(fd, events, abstime);
 }
@@ -556,7 +617,29 @@ int bthread_connect(int sockfd, const sockaddr* serv_addr,
 
 // This does not wake pthreads calling bthread_fd_*wait.
 int bthread_close(int fd) {
-    return bthread::get_epoll_thread(fd).fd_close(fd);
+    return bthread::fd_close(fd);
+}
+
+int bthread_set_fd_poller(const bthread_fd_poller_t* poller) {
+    if (NULL == poller || NULL == poller->watch || NULL == poller->unwatch) {
+        errno = EINVAL;
+        return -1;
+    }
+    static butil::Mutex s_mutex;
+    BAIDU_SCOPED_LOCK(s_mutex);
+    if (bthread::g_has_fd_poller.load(butil::memory_order_relaxed)) {
+        errno = EPERM;
+        return -1;
+    }
+    bthread::g_fd_poller = *poller;
+    bthread::g_has_fd_poller.store(true, butil::memory_order_release);
+    return 0;
+}
+
+void bthread_fd_notify(int fd) {
+    if (fd >= 0) {
+        bthread::wake_fd_waiters(fd);
+    }
 }
 
 }  // extern "C"
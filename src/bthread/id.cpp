@@ -20,6 +20,7 @@
 // Date: Sun Aug  3 12:46:15 CST 2014
 
 #include <deque>
+#include "butil/atomicops.h"
 #include "butil/logging.h"
 #include "bthread/butex.h"                       // butex_*
 #include "bthread/mutex.h"
@@ -140,6 +141,17 @@ struct BAIDU_CACHELINE_ALIGNMENT Id {
     inline bool has_version(uint32_t id_ver) const {
         return id_ver >= first_ver && id_ver < locked_ver;
     }
+    // The value of butex is also the lock word. Uncontended lock/unlock
+    // change it with CAS without touching `mutex', thus all changes of it
+    // that race with them(from first_ver or from locked_ver) must be CAS
+    // as well, even if `mutex' is held.
+    inline butil::atomic<uint32_t>* lock_word() const {
+        return reinterpret_cast<butil::atomic<uint32_t>*>(butex);
+    }
+    inline bool cas_lock_word(uint32_t expected, uint32_t desired) const {
+        return lock_word()->compare_exchange_strong(
+            expected, desired, butil::memory_order_acquire);
+    }
     inline uint32_t contended_ver() const { return locked_ver + 1; }
     inline uint32_t unlockable_ver() const { return locked_ver + 2; }
     inline uint32_t last_ver() const { return unlockable_ver(); }
@@ -409,14 +421,29 @@ int bthread_id_lock_and_reset_range_verbose(
     }
     const uint32_t id_ver = bthread::get_version(id);
     uint32_t* butex = meta->butex;
+    if (range == 0) {
+        // Fast path: lock an unlocked id without the mutex. The versions may
+        // be changed concurrently, but the CAS fails unless the lock word is
+        // still the first version of the same id.
+        const uint32_t first_ver = meta->first_ver;
+        const uint32_t locked_ver = meta->locked_ver;
+        if (id_ver >= first_ver && id_ver < locked_ver &&
+            meta->cas_lock_word(first_ver, locked_ver)) {
+            meta->lock_location = location;
+            if (pdata) {
+                *pdata = meta->data;
+            }
+            return 0;
+        }
+    }
     bool ever_contended = false;
     meta->mutex.lock();
     while (meta->has_version(id_ver)) {
-        if (*butex == meta->first_ver) {
-            // contended locker always wakes up the butex at unlock.
-            meta->lock_location = location;
+        const uint32_t cur_ver = *butex;
+        if (cur_ver == meta->first_ver) {
+            uint32_t locked_ver = meta->locked_ver;
             if (range == 0) {
-                // fast path
+                // no change
             } else if (range < 0 ||
                        range > bthread::ID_MAX_RANGE ||
                        range + meta->first_ver <= meta->locked_ver) {
@@ -426,17 +453,28 @@ int bthread_id_lock_and_reset_range_verbose(
                     << "max range is " << bthread::ID_MAX_RANGE
                     << ", actually " << range;
             } else {
-                meta->locked_ver = meta->first_ver + range;
+                locked_ver = meta->first_ver + range;
             }
-            *butex = (ever_contended ? meta->contended_ver() : meta->locked_ver);
+            // contended locker always wakes up the butex at unlock.
+            if (!meta->cas_lock_word(
+                    cur_ver, (ever_contended ? locked_ver + 1 : locked_ver))) {
+                // Locked by the fast path just now.
+                continue;
+            }
+            meta->locked_ver = locked_ver;
+            meta->lock_location = location;
             meta->mutex.unlock();
             if (pdata) {
                 *pdata = meta->data;
             }
             return 0;
-        } else if (*butex != meta->unlockable_ver()) {
-            *butex = meta->contended_ver();
-            uint32_t expected_ver = *butex;
+        } else if (cur_ver != meta->unlockable_ver()) {
+            const uint32_t expected_ver = meta->contended_ver();
+            if (cur_ver != expected_ver &&
+                !meta->cas_lock_word(cur_ver, expected_ver)) {
+                // Unlocked by the fast path just now.
+                continue;
+            }
             meta->mutex.unlock();
             ever_contended = true;
             if (bthread::butex_wait(butex, expected_ver, NULL) < 0 &&
@@ -476,7 +514,7 @@ int bthread_id_about_to_destroy(bthread_id_t id) {
         return EPERM;
     }
     const bool contended = (*butex == meta->contended_ver());
-    *butex = meta->unlockable_ver();
+    meta->lock_word()->store(meta->unlockable_ver(), butil::memory_order_relaxed);
     meta->mutex.unlock();
     if (contended) {
         // wake up all waiting lockers.
@@ -490,20 +528,19 @@ int bthread_id_cancel(bthread_id_t id) {
     if (!meta) {
         return EINVAL;
     }
-    uint32_t* butex = meta->butex;
     const uint32_t id_ver = bthread::get_version(id);
     meta->mutex.lock();
     if (!meta->has_version(id_ver)) {
         meta->mutex.unlock();
         return EINVAL;
     }
-    if (*butex != meta->first_ver) {
+    const uint32_t end_ver = meta->end_ver();
+    if (!meta->cas_lock_word(meta->first_ver, end_ver)) {
         meta->mutex.unlock();
         return EPERM;
-    }       
-    *butex = meta->end_ver();
-    meta->first_ver = *butex;
-    meta->locked_ver = *butex;
+    }
+    meta->first_ver = end_ver;
+    meta->locked_ver = end_ver;
     meta->mutex.unlock();
     return_resource(bthread::get_slot(id));
     return 0;
@@ -539,18 +576,16 @@ int bthread_id_trylock(bthread_id_t id, void** pdata) {
     if (!meta) {
         return EINVAL;
     }
-    uint32_t* butex = meta->butex;
     const uint32_t id_ver = bthread::get_version(id);
     meta->mutex.lock();
     if (!meta->has_version(id_ver)) {
         meta->mutex.unlock();
         return EINVAL;
     }
-    if (*butex != meta->first_ver) {
+    if (!meta->cas_lock_word(meta->first_ver, meta->locked_ver)) {
         meta->mutex.unlock();
         return EBUSY;
     }
-    *butex = meta->locked_ver;
     meta->mutex.unlock();
     if (pdata != NULL) {
         *pdata = meta->data;
@@ -569,9 +604,20 @@ int bthread_id_unlock(bthread_id_t id) {
         return EINVAL;
     }
     uint32_t* butex = meta->butex;
+    const uint32_t id_ver = bthread::get_version(id);
+    // Fast path: versions don't change while the id is locked by us. The
+    // lock word stays locked_ver only when nobody waits for the lock and
+    // no error is pending(see bthread_id_error2_verbose).
+    const uint32_t locked_ver = meta->locked_ver;
+    if (id_ver >= meta->first_ver && id_ver < locked_ver) {
+        uint32_t expected = locked_ver;
+        if (meta->lock_word()->compare_exchange_strong(
+                expected, meta->first_ver, butil::memory_order_release)) {
+            return 0;
+        }
+    }
     // Release fence makes sure all changes made before signal visible to
     // woken-up waiters.
-    const uint32_t id_ver = bthread::get_version(id);
     meta->mutex.lock();
     if (!meta->has_version(id_ver)) {
         meta->mutex.unlock();
@@ -595,7 +641,7 @@ int bthread_id_unlock(bthread_id_t id) {
         }
     } else {
         const bool contended = (*butex == meta->contended_ver());
-        *butex = meta->first_ver;
+        meta->lock_word()->store(meta->first_ver, butil::memory_order_release);
         meta->mutex.unlock();
         if (contended) {
             // We may wake up already-reused id, but that's OK.
@@ -625,7 +671,7 @@ int bthread_id_unlock_and_destroy(bthread_id_t id) {
         return EPERM;
     }
     const uint32_t next_ver = meta->end_ver();
-    *butex = next_ver;
+    meta->lock_word()->store(next_ver, butil::memory_order_relaxed);
     *join_butex = next_ver;
     meta->first_ver = next_ver;
     meta->locked_ver = next_ver;
@@ -719,8 +765,22 @@ int bthread_id_error2_verbose(bthread_id_t id, int error_code,
         meta->mutex.unlock();
         return EINVAL;
     }
-    if (*butex == meta->first_ver) {
-        *butex = meta->locked_ver;
+    uint32_t cur_ver = *butex;
+    while (true) {
+        if (cur_ver == meta->first_ver) {
+            if (meta->cas_lock_word(cur_ver, meta->locked_ver)) {
+                break;
+            }
+        } else if (cur_ver == meta->contended_ver() ||
+                   cur_ver == meta->unlockable_ver() ||
+                   meta->cas_lock_word(cur_ver, meta->contended_ver())) {
+            // The lock word is not locked_ver anymore, the holder has to
+            // unlock in the slow path and handle the pending error.
+            break;
+        }
+        cur_ver = *butex;
+    }
+    if (cur_ver == meta->first_ver) {
         meta->lock_location = location;
         meta->mutex.unlock();
         if (meta->on_error) {
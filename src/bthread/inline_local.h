@@ -0,0 +1,80 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_INLINE_LOCAL_H
+#define BTHREAD_INLINE_LOCAL_H
+
+#include "bthread/task_meta.h"       // LocalStorage
+
+namespace bthread {
+
+extern thread_local LocalStorage tls_bls;
+
+// Indexes of inline slots. Unlike keys of bthread_key_create(), slots are
+// fixed at compile-time and shared by the whole program, thus each slot
+// must be assigned to one component explicitly.
+enum InlineLocalSlot {
+    // Reserved by brpc for the span of current rpcz trace.
+    INLINE_LOCAL_SLOT_RPCZ_PARENT_SPAN = 0,
+    // Reserved by brpc for the deadline of the server-side RPC being
+    // processed, inherited by RPCs issued inside.
+    INLINE_LOCAL_SLOT_RPC_DEADLINE = 1,
+    // Reserved by brpc for the method whose user code is running, read by
+    // the continuous cpu profiler to attribute samples.
+    INLINE_LOCAL_SLOT_RUNNING_METHOD = 2,
+    // Slots in [INLINE_LOCAL_SLOT_USER_BEGIN, INLINE_LOCAL_SLOT_COUNT) are
+    // free for applications.
+    INLINE_LOCAL_SLOT_USER_BEGIN = 3,
+};
+
+// Pointer-sized bthread-local storage without indirection.
+// bthread_getspecific() looks up KeyTable and checks the version of the key
+// on every call, which is noticeable when called many times per request.
+// The value of an inline slot is stored in LocalStorage which is swapped in
+// and out with the bthread, so getting and setting it are plain loads and
+// stores of a thread-local variable.
+// Values are NULL in new bthreads and not destroyed when bthreads quit,
+// owners of slots must manage the lifetime of pointed objects.
+// Outside bthreads, the slot is local to the pthread.
+//
+// Example:
+//   typedef bthread::InlineLocal<RequestContext,
+//                                bthread::INLINE_LOCAL_SLOT_USER_BEGIN>
+//       TlsRequestContext;
+//   TlsRequestContext::set(ctx);
+//   ...
+//   RequestContext* ctx = TlsRequestContext::get();
+template <typename T, int SLOT>
+class InlineLocal {
+public:
+    static T* get() { return static_cast<T*>(tls_bls.inline_slots[SLOT]); }
+    // T may be const-qualified, constness is restored by get().
+    static void set(T* value) {
+        tls_bls.inline_slots[SLOT] =
+            const_cast<void*>(static_cast<const void*>(value));
+    }
+
+private:
+    static_assert(SLOT >= 0 && SLOT < INLINE_LOCAL_SLOT_COUNT,
+                  "SLOT must be in [0, INLINE_LOCAL_SLOT_COUNT)");
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_INLINE_LOCAL_H
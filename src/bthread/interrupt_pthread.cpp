@@ -19,18 +19,64 @@
 
 // Date: Tue Jul 10 17:40:58 CST 2012
 
+#include <errno.h>
 #include <signal.h>
+#include <unistd.h>
+#include <algorithm>                           // std::min
+#include "butil/atomicops.h"
+#include "butil/build_config.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#if defined(OS_LINUX) || defined(OS_MACOSX)
+#include <execinfo.h>                          // backtrace
+#endif
 #include "bthread/interrupt_pthread.h"
 
 namespace bthread {
 
+static const int MAX_CAPTURED_FRAMES = 64;
+
+// At most one capture at the same time, serialized by s_capture_mutex.
+struct StackCapture {
+    pthread_t target;
+    void* frames[MAX_CAPTURED_FRAMES];
+    int nframe;
+    // Sequence of the request, and the one answered by the handler.
+    butil::atomic<int> seq;
+    butil::atomic<int> done_seq;
+};
+
+static StackCapture s_capture;
+static butil::Mutex s_capture_mutex;
+
 // TODO: Make sure SIGURG is not used by user.
-// This empty handler is simply for triggering EINTR in blocking syscalls.
-void do_nothing_handler(int) {}
+// Besides capturing stacks requested by capture_pthread_stack(), this
+// handler is simply for triggering EINTR in blocking syscalls.
+void do_nothing_handler(int) {
+    const int seq = s_capture.seq.load(butil::memory_order_acquire);
+    if (seq == s_capture.done_seq.load(butil::memory_order_relaxed) ||
+        !pthread_equal(s_capture.target, pthread_self())) {
+        return;
+    }
+    const int saved_errno = errno;
+#if defined(OS_LINUX) || defined(OS_MACOSX)
+    s_capture.nframe = backtrace(s_capture.frames, MAX_CAPTURED_FRAMES);
+#else
+    s_capture.nframe = 0;
+#endif
+    errno = saved_errno;
+    s_capture.done_seq.store(seq, butil::memory_order_release);
+}
 
 static pthread_once_t register_sigurg_once = PTHREAD_ONCE_INIT;
 
 static void register_sigurg() {
+#if defined(OS_LINUX) || defined(OS_MACOSX)
+    // The first call to backtrace() may allocate memory, which is not
+    // allowed in signal handlers.
+    void* dummy[1];
+    backtrace(dummy, 1);
+#endif
     signal(SIGURG, do_nothing_handler);
 }
 
@@ -39,4 +85,32 @@ int interrupt_pthread(pthread_t th) {
     return pthread_kill(th, SIGURG);
 }
 
+int capture_pthread_stack(pthread_t th, void** frames, int max,
+                          int timeout_ms) {
+    BAIDU_SCOPED_LOCK(s_capture_mutex);
+    const int seq = s_capture.done_seq.load(butil::memory_order_relaxed) + 1;
+    s_capture.target = th;
+    s_capture.nframe = 0;
+    s_capture.seq.store(seq, butil::memory_order_release);
+    if (interrupt_pthread(th) != 0) {
+        s_capture.done_seq.store(seq, butil::memory_order_relaxed);
+        return -1;
+    }
+    for (int waited_us = 0;
+         s_capture.done_seq.load(butil::memory_order_acquire) != seq;
+         waited_us += 100) {
+        if (waited_us >= timeout_ms * 1000) {
+            // Cancel the request, a late handler sees no pending request.
+            s_capture.done_seq.store(seq, butil::memory_order_release);
+            return -1;
+        }
+        usleep(100);
+    }
+    const int n = std::min(s_capture.nframe, max);
+    for (int i = 0; i < n; ++i) {
+        frames[i] = s_capture.frames[i];
+    }
+    return n;
+}
+
 }  // namespace bthread
@@ -30,6 +30,14 @@ namespace bthread {
 // Returns what pthread_kill returns.
 int interrupt_pthread(pthread_t th);
 
+// Capture at most `max' frames of the call stack of pthread `th' by
+// interrupting it as above. The pthread should be running user code rather
+// than blocking on syscalls, which may return EINTR.
+// Returns number of frames, -1 if the pthread does not respond within
+// `timeout_ms' milliseconds or on other errors.
+int capture_pthread_stack(pthread_t th, void** frames, int max,
+                          int timeout_ms);
+
 }  // namespace bthread
 
 #endif // BTHREAD_INTERRUPT_PTHREAD_H
@@ -23,6 +23,9 @@
 #include <execinfo.h>
 #include <dlfcn.h>                               // dlsym
 #include <fcntl.h>                               // O_RDONLY
+#include <algorithm>                             // std::min
+#include <unistd.h>                              // sysconf
+#include <gflags/gflags.h>
 #include "butil/atomicops.h"
 #include "bvar/bvar.h"
 #include "bvar/collector.h"
@@ -47,6 +50,11 @@ extern "C" {
 extern void* _dl_sym(void* handle, const char* symbol, void* caller);
 }
 
+DEFINE_int32(bthread_mutex_max_spin, 100,
+             "Max times of spinning before a contended bthread_mutex_lock "
+             "parks the caller, the actual times adapt to spins needed to get "
+             "the lock recently. 0 disables spinning");
+
 namespace bthread {
 // Warm up backtrace before main().
 void* dummy_buf[4];
@@ -86,6 +94,21 @@ struct SampledContention : public bvar::Collected {
 
 BAIDU_CASSERT(sizeof(SampledContention) == 256, be_friendly_to_allocator);
 
+// For controlling off-cpu samples collected per second.
+static bvar::CollectorSpeedLimit g_ocp_sl = BVAR_COLLECTOR_SPEED_LIMIT_INITIALIZER;
+// Skip submit_offcpu_sample()
+const int OFFCPU_SKIPPED_STACK_FRAMES = 1;
+
+// Waits of bthreads share the format with contentions: duration_ns is the
+// time that the bthread was parked and count is the number of waits.
+struct SampledOffCpu : public SampledContention {
+    void dump_and_destroy(size_t round) override;
+    void destroy() override;
+    bvar::CollectorSpeedLimit* speed_limit() override { return &g_ocp_sl; }
+};
+
+BAIDU_CASSERT(sizeof(SampledOffCpu) == 256, be_friendly_to_allocator);
+
 // Functor to compare contentions.
 struct ContentionEqual {
     bool operator()(const SampledContention* c1,
@@ -109,7 +132,8 @@ public:
     typedef butil::FlatMap<SampledContention*, SampledContention*,
                           ContentionHash, ContentionEqual> ContentionMap;
 
-    explicit ContentionProfiler(const char* name);
+    // `skipped_frames' innermost frames of each sample are not written.
+    ContentionProfiler(const char* name, int skipped_frames);
     ~ContentionProfiler();
     
     void dump_and_destroy(SampledContention* c);
@@ -121,14 +145,16 @@ public:
     void init_if_needed();
 private:
     bool _init;  // false before first dump_and_destroy is called
+    int _skipped_frames;
     bool _first_write;      // true if buffer was not written to file yet.
     std::string _filename;  // the file storing profiling result.
     butil::IOBuf _disk_buf;  // temp buf before saving the file.
     ContentionMap _dedup_map; // combining same samples to make result smaller.
 };
 
-ContentionProfiler::ContentionProfiler(const char* name)
+ContentionProfiler::ContentionProfiler(const char* name, int skipped_frames)
     : _init(false)
+    , _skipped_frames(skipped_frames)
     , _first_write(true)
     , _filename(name) {
 }
@@ -181,7 +207,7 @@ void ContentionProfiler::flush_to_disk(bool ending) {
                  it = _dedup_map.begin(); it != _dedup_map.end(); ++it) {
             SampledContention* c = it->second;
             os << c->duration_ns << ' ' << (size_t)ceil(c->count) << " @";
-            for (int i = SKIPPED_STACK_FRAMES; i < c->nframes; ++i) {
+            for (int i = _skipped_frames; i < c->nframes; ++i) {
                 os << ' ' << (void*)c->stack[i];
             }
             os << '\n';
@@ -297,12 +323,51 @@ void SampledContention::destroy() {
     butil::return_object(this);
 }
 
+// Same as g_cp, for profiling waits of bthreads.
+static ContentionProfiler* g_ocp = NULL;
+static pthread_mutex_t g_ocp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void SampledOffCpu::dump_and_destroy(size_t /*round*/) {
+    if (g_ocp) {
+        BAIDU_SCOPED_LOCK(g_ocp_mutex);
+        if (g_ocp) {
+            g_ocp->dump_and_destroy(this);
+            return;
+        }
+    }
+    destroy();
+}
+
+void SampledOffCpu::destroy() {
+    butil::return_object(this);
+}
+
 // Remember the conflict hashes for troubleshooting, should be 0 at most of time.
 static butil::static_atomic<int64_t> g_nconflicthash = BUTIL_STATIC_ATOMIC_INIT(0);
 static int64_t get_nconflicthash(void*) {
     return g_nconflicthash.load(butil::memory_order_relaxed);
 }
 
+// Contended bthread_mutex_lock which spun, and which got the lock by spinning.
+struct MutexSpinStat {
+    bvar::Adder<int64_t> nspin;
+    bvar::Adder<int64_t> nacquired;
+
+    MutexSpinStat()
+        : nspin("bthread_mutex_spin_count")
+        , nacquired("bthread_mutex_spin_acquired_count") {}
+};
+static MutexSpinStat* get_mutex_spin_stat() {
+    // Never deleted since locks may be used during or after exiting main().
+    static MutexSpinStat* s = new MutexSpinStat;
+    return s;
+}
+static double get_mutex_spin_success_ratio(void*) {
+    MutexSpinStat* s = get_mutex_spin_stat();
+    const int64_t nspin = s->nspin.get_value();
+    return nspin > 0 ? (double)s->nacquired.get_value() / nspin : 0;
+}
+
 // Start profiling contention.
 bool ContentionProfilerStart(const char* filename) {
     if (filename == NULL) {
@@ -319,9 +384,13 @@ bool ContentionProfilerStart(const char* filename) {
         ("contention_profiler_conflict_hash", get_nconflicthash, NULL);
     static bvar::DisplaySamplingRatio g_sampling_ratio_var(
         "contention_profiler_sampling_ratio", &g_cp_sl);
+    static bvar::PassiveStatus<double> g_spin_success_ratio_var(
+        "contention_profiler_mutex_spin_success_ratio",
+        get_mutex_spin_success_ratio, NULL);
     
     // Optimistic locking. A not-used ContentionProfiler does not write file.
-    std::unique_ptr<ContentionProfiler> ctx(new ContentionProfiler(filename));
+    std::unique_ptr<ContentionProfiler> ctx(
+        new ContentionProfiler(filename, SKIPPED_STACK_FRAMES));
     {
         BAIDU_SCOPED_LOCK(g_cp_mutex);
         if (g_cp) {
@@ -354,6 +423,46 @@ void ContentionProfilerStop() {
     LOG(ERROR) << "Contention profiler is not started!";
 }
 
+// Start profiling waits of bthreads.
+bool OffCpuProfilerStart(const char* filename) {
+    if (filename == NULL) {
+        LOG(ERROR) << "Parameter [filename] is NULL";
+        return false;
+    }
+    if (g_ocp) {
+        return false;
+    }
+    static bvar::DisplaySamplingRatio g_sampling_ratio_var(
+        "offcpu_profiler_sampling_ratio", &g_ocp_sl);
+    std::unique_ptr<ContentionProfiler> ctx(
+        new ContentionProfiler(filename, OFFCPU_SKIPPED_STACK_FRAMES));
+    {
+        BAIDU_SCOPED_LOCK(g_ocp_mutex);
+        if (g_ocp) {
+            return false;
+        }
+        g_ocp = ctx.release();
+    }
+    return true;
+}
+
+// Stop off-cpu profiler.
+void OffCpuProfilerStop() {
+    ContentionProfiler* ctx = NULL;
+    if (g_ocp) {
+        std::unique_lock<pthread_mutex_t> mu(g_ocp_mutex);
+        if (g_ocp) {
+            ctx = g_ocp;
+            g_ocp = NULL;
+            mu.unlock();
+            ctx->init_if_needed();
+            delete ctx;
+            return;
+        }
+    }
+    LOG(ERROR) << "Off-cpu profiler is not started!";
+}
+
 BUTIL_FORCE_INLINE bool
 is_contention_site_valid(const bthread_contention_site_t& cs) {
     return cs.sampling_range;
@@ -517,6 +626,28 @@ void submit_contention(const bthread_contention_site_t& csite, int64_t now_ns) {
     tls_inside_lock = false;
 }
 
+// Returns non-zero sampling range if the next wait of current bthread
+// should be sampled.
+size_t offcpu_sampling_range() {
+    if (!g_ocp) {
+        return 0;
+    }
+    return bvar::is_collectable(&g_ocp_sl);
+}
+
+// Submit the wait along with the stacktrace of the waiter.
+void submit_offcpu_sample(size_t sampling_range, int64_t duration_ns,
+                          int64_t now_ns) {
+    tls_inside_lock = true;
+    SampledOffCpu* sc = butil::get_object<SampledOffCpu>();
+    sc->duration_ns = duration_ns * bvar::COLLECTOR_SAMPLING_BASE
+        / sampling_range;
+    sc->count = bvar::COLLECTOR_SAMPLING_BASE / (double)sampling_range;
+    sc->nframes = backtrace(sc->stack, arraysize(sc->stack)); // may lock
+    sc->submit(now_ns / 1000);  // may lock
+    tls_inside_lock = false;
+}
+
 BUTIL_FORCE_INLINE int pthread_mutex_lock_impl(pthread_mutex_t* mutex) {
     // Don't change behavior of lock when profiler is off.
     if (!g_cp ||
@@ -628,7 +759,47 @@ const MutexInternal MUTEX_LOCKED_RAW = {{1},{0},0};
 BAIDU_CASSERT(sizeof(unsigned) == sizeof(MutexInternal),
               sizeof_mutex_internal_must_equal_unsigned);
 
+// Spinning is useless when the owner can't run simultaneously.
+static const bool g_spin_on_multi_cpu = (sysconf(_SC_NPROCESSORS_ONLN) > 1);
+
+// Spin on the lock for a while before parking, which is much cheaper than
+// butex_wait + butex_wake when the lock is held for a short time. Like
+// PTHREAD_MUTEX_ADAPTIVE_NP, the times of spinning follow spins needed
+// recently, so locks held for long stop wasting CPU quickly.
+// Returns true if the lock is got.
+inline bool mutex_spin_lock(bthread_mutex_t* m) {
+    const int max_spin = FLAGS_bthread_mutex_max_spin;
+    if (max_spin <= 0 || !g_spin_on_multi_cpu) {
+        return false;
+    }
+    MutexInternal* split = (MutexInternal*)m->butex;
+    // spin_avg is read and written without synchronization, it's just a
+    // hint and a stale value does no harm.
+    const int avg = m->spin_avg;
+    const int limit = std::min(max_spin, avg * 2 + 10);
+    bool acquired = false;
+    int cnt = 0;
+    for (; cnt < limit; ++cnt) {
+        if (!split->locked.load(butil::memory_order_relaxed) &&
+            !split->locked.exchange(1, butil::memory_order_acquire)) {
+            acquired = true;
+            break;
+        }
+        cpu_relax();
+    }
+    m->spin_avg = avg + (cnt - avg) / 8;
+    MutexSpinStat* s = get_mutex_spin_stat();
+    s->nspin << 1;
+    if (acquired) {
+        s->nacquired << 1;
+    }
+    return acquired;
+}
+
 inline int mutex_lock_contended(bthread_mutex_t* m) {
+    if (mutex_spin_lock(m)) {
+        return 0;
+    }
     butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
     while (whole->exchange(BTHREAD_MUTEX_CONTENDED) & BTHREAD_MUTEX_LOCKED) {
         if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, NULL) < 0 &&
@@ -643,6 +814,9 @@ inline int mutex_lock_contended(bthread_mutex_t* m) {
 
 inline int mutex_timedlock_contended(
     bthread_mutex_t* m, const struct timespec* __restrict abstime) {
+    if (mutex_spin_lock(m)) {
+        return 0;
+    }
     butil::atomic<unsigned>* whole = (butil::atomic<unsigned>*)m->butex;
     while (whole->exchange(BTHREAD_MUTEX_CONTENDED) & BTHREAD_MUTEX_LOCKED) {
         if (bthread::butex_wait(whole, BTHREAD_MUTEX_CONTENDED, abstime) < 0 &&
@@ -700,6 +874,7 @@ extern "C" {
 int bthread_mutex_init(bthread_mutex_t* __restrict m,
                        const bthread_mutexattr_t* __restrict) {
     bthread::make_contention_site_invalid(&m->csite);
+    m->spin_avg = 0;
     m->butex = bthread::butex_create_checked<unsigned>();
     if (!m->butex) {
         return ENOMEM;
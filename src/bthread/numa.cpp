@@ -0,0 +1,104 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+
+#include <stdio.h>
+#include <stdlib.h>                        // strtol
+#include "butil/build_config.h"            // OS_LINUX
+#include "bthread/numa.h"
+
+namespace bthread {
+
+int parse_cpu_list(const char* str, std::vector<int>* cpus) {
+    if (str == NULL || cpus == NULL) {
+        return -1;
+    }
+    const char* p = str;
+    while (*p != '\0' && *p != '\n') {
+        char* end = NULL;
+        const long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long i = first; i <= last; ++i) {
+            cpus->push_back((int)i);
+        }
+        if (*p == ',') {
+            ++p;
+        } else if (*p != '\0' && *p != '\n') {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#if defined(OS_LINUX)
+static int read_cpu_list(const char* path, std::vector<int>* cpus) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char buf[4096];
+    const bool ok = (fgets(buf, sizeof(buf), fp) != NULL);
+    fclose(fp);
+    if (!ok) {
+        // cpulist of a memory-only node is an empty line.
+        return 0;
+    }
+    return parse_cpu_list(buf, cpus);
+}
+
+int get_numa_nodes(std::vector<std::vector<int> >* nodes) {
+    std::vector<int> online;
+    if (read_cpu_list("/sys/devices/system/node/online", &online) != 0 ||
+        online.empty()) {
+        return -1;
+    }
+    nodes->clear();
+    for (size_t i = 0; i < online.size(); ++i) {
+        char path[64];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", online[i]);
+        std::vector<int> cpus;
+        if (read_cpu_list(path, &cpus) != 0) {
+            return -1;
+        }
+        if (!cpus.empty()) {
+            nodes->push_back(cpus);
+        }
+    }
+    return nodes->empty() ? -1 : 0;
+}
+#else
+int get_numa_nodes(std::vector<std::vector<int> >*) {
+    return -1;
+}
+#endif  // OS_LINUX
+
+}  // namespace bthread
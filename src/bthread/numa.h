@@ -0,0 +1,41 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+
+#ifndef BTHREAD_NUMA_H
+#define BTHREAD_NUMA_H
+
+#include <vector>
+
+namespace bthread {
+
+// Parse a cpu list in the format of /sys/devices/system/node/node*/cpulist,
+// e.g. "0-23,48-71", and append the cpus to `cpus'.
+// Returns 0 on success, -1 otherwise.
+int parse_cpu_list(const char* str, std::vector<int>* cpus);
+
+// Get cpus of each online NUMA node which has cpus. Memory-only nodes are
+// skipped so that nodes->size() is # of nodes that workers can run on.
+// Returns 0 on success, -1 if the topology is not available (namely not
+// Linux or sysfs is not mounted).
+int get_numa_nodes(std::vector<std::vector<int> >* nodes);
+
+}  // namespace bthread
+
+#endif  // BTHREAD_NUMA_H
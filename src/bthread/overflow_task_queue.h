@@ -0,0 +1,74 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_OVERFLOW_TASK_QUEUE_H
+#define BTHREAD_OVERFLOW_TASK_QUEUE_H
+
+#include <deque>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#include "bthread/types.h"
+
+namespace bthread {
+
+// An unbounded queue storing bthreads which don't fit in the full runqueue
+// of a worker, pushed by the owner worker and popped by the owner as well
+// as stealing workers. It's only used in bursts of creating bthreads, thus
+// a mutex is good enough. Popping an empty queue does not lock.
+class OverflowTaskQueue {
+public:
+    OverflowTaskQueue() : _size(0) {}
+
+    void push(bthread_t task) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _tasks.push_back(task);
+        _size.store(_tasks.size(), butil::memory_order_release);
+    }
+
+    bool pop(bthread_t* task) {
+        if (_size.load(butil::memory_order_acquire) == 0) {
+            return false;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (_tasks.empty()) {
+            return false;
+        }
+        *task = _tasks.front();
+        _tasks.pop_front();
+        _size.store(_tasks.size(), butil::memory_order_release);
+        return true;
+    }
+
+    size_t volatile_size() const {
+        return _size.load(butil::memory_order_relaxed);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(OverflowTaskQueue);
+
+    butil::Mutex _mutex;
+    std::deque<bthread_t> _tasks;
+    butil::atomic<size_t> _size;
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_OVERFLOW_TASK_QUEUE_H
@@ -23,6 +23,7 @@
 #define BTHREAD_PARKING_LOT_H
 
 #include "butil/atomicops.h"
+#include "butil/time.h"
 #include "bthread/sys_futex.h"
 
 namespace bthread {
@@ -40,11 +41,13 @@ public:
         int val;
     };
 
-    ParkingLot() : _pending_signal(0) {}
+    ParkingLot() : _pending_signal(0), _last_signal_ns(0) {}
 
     // Wake up at most `num_task' workers.
     // Returns #workers woken up.
     int signal(int num_task) {
+        _last_signal_ns.store(butil::cpuwide_time_ns(),
+                              butil::memory_order_relaxed);
         _pending_signal.fetch_add((num_task << 1), butil::memory_order_release);
         return futex_wake_private(&_pending_signal, num_task);
     }
@@ -60,6 +63,11 @@ public:
         futex_wait_private(&_pending_signal, expected_state.val, NULL);
     }
 
+    // Time of the last signal(), for measuring wakeup latency.
+    int64_t last_signal_ns() const {
+        return _last_signal_ns.load(butil::memory_order_relaxed);
+    }
+
     // Wakeup suspended wait() and make them unwaitable ever. 
     void stop() {
         _pending_signal.fetch_or(1);
@@ -68,6 +76,7 @@ public:
 private:
     // higher 31 bits for signalling, LSB for stopping.
     butil::atomic<int> _pending_signal;
+    butil::atomic<int64_t> _last_signal_ns;
 };
 
 }  // namespace bthread
@@ -0,0 +1,110 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#include <errno.h>
+#include <algorithm>                    // std::max
+#include "butil/logging.h"
+#include "butil/time.h"
+#include "bthread/errno.h"              // ESTOP
+#include "bthread/rate_limiter.h"
+
+namespace bthread {
+
+RateLimiter::RateLimiter(double permits_per_second, int burst) {
+    if (permits_per_second <= 0 || burst <= 0) {
+        LOG(FATAL) << "Invalid permits_per_second=" << permits_per_second
+                   << " burst=" << burst;
+        abort();
+    }
+    _interval_ns = std::max((int64_t)(1000000000.0 / permits_per_second),
+                            (int64_t)1);
+    _burst_ns = _interval_ns * burst;
+    // Full at the beginning.
+    _full_ns.store(0, butil::memory_order_relaxed);
+}
+
+int64_t RateLimiter::reserve(int n, int64_t max_wait_ns) {
+    const int64_t now_ns = butil::cpuwide_time_ns();
+    int64_t full_ns = _full_ns.load(butil::memory_order_relaxed);
+    while (true) {
+        // Tokens consumed move the time of being full later.
+        const int64_t new_full_ns = std::max(full_ns, now_ns) + n * _interval_ns;
+        // The bucket can't hold more than _burst_ns of tokens.
+        const int64_t wait_ns = new_full_ns - _burst_ns - now_ns;
+        if (wait_ns > max_wait_ns) {
+            return -1;
+        }
+        if (_full_ns.compare_exchange_weak(full_ns, new_full_ns,
+                                           butil::memory_order_relaxed)) {
+            return std::max(wait_ns, (int64_t)0);
+        }
+    }
+}
+
+int RateLimiter::wait(int64_t wait_ns) {
+    if (wait_ns <= 0) {
+        return 0;
+    }
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const int64_t end_ns = start_ns + wait_ns;
+    // The permits are reserved, sleep again if the sleep is interrupted.
+    for (int64_t now_ns = start_ns; now_ns < end_ns;
+         now_ns = butil::cpuwide_time_ns()) {
+        if (bthread_usleep((end_ns - now_ns + 999) / 1000) != 0 &&
+            errno == ESTOP) {
+            return ESTOP;
+        }
+    }
+    _wait_latency << (butil::cpuwide_time_ns() - start_ns) / 1000;
+    return 0;
+}
+
+bool RateLimiter::try_acquire(int n) {
+    return n > 0 && reserve(n, 0) == 0;
+}
+
+int RateLimiter::acquire(int n) {
+    if (n <= 0) {
+        return EINVAL;
+    }
+    return wait(reserve(n, INT64_MAX));
+}
+
+int RateLimiter::timed_acquire(const timespec& duetime, int n) {
+    if (n <= 0) {
+        return EINVAL;
+    }
+    const int64_t max_wait_us =
+        butil::timespec_to_microseconds(duetime) - butil::gettimeofday_us();
+    const int64_t wait_ns = reserve(n, std::max(max_wait_us, (int64_t)0) * 1000);
+    if (wait_ns < 0) {
+        _ntimeout << 1;
+        return ETIMEDOUT;
+    }
+    return wait(wait_ns);
+}
+
+int RateLimiter::expose(const butil::StringPiece& prefix) {
+    if (_wait_latency.expose(prefix, "wait") != 0) {
+        return -1;
+    }
+    return _ntimeout.expose_as(prefix, "timeout_count");
+}
+
+}  // namespace bthread
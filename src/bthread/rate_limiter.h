@@ -0,0 +1,89 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_RATE_LIMITER_H
+#define BTHREAD_RATE_LIMITER_H
+
+#include <stdint.h>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/strings/string_piece.h"
+#include "bvar/bvar.h"
+#include "bthread/bthread.h"
+
+namespace bthread {
+
+// A token bucket refilled with `permits_per_second' tokens per second and
+// holding at most `burst' tokens, e.g. for limiting qps to a downstream.
+// The bucket is a single atomic timestamp (the time when the bucket would
+// be refilled to full, as in GCRA), acquiring permits is a lock-free CAS.
+// Acquirers without enough tokens reserve tokens in the future and sleep
+// with bthread_usleep() until then, so they're served in order of arrival
+// and never block pthread workers.
+// Example:
+//   bthread::RateLimiter limiter(1000, 100);
+//   limiter.expose("downstream_rate");
+//   if (limiter.timed_acquire(butil::milliseconds_from_now(5)) != 0) {
+//       return busy;
+//   }
+//   call_downstream();
+class RateLimiter {
+public:
+    RateLimiter(double permits_per_second, int burst);
+
+    // Acquire `n' permits if they're available without blocking.
+    bool try_acquire(int n = 1);
+
+    // Block until `n' permits are acquired.
+    // Returns 0 on success, error code otherwise.
+    int acquire(int n = 1);
+
+    // Acquire `n' permits if they're available before `duetime' and block
+    // until then. Fails immediately without consuming permits when they
+    // can't be available in time.
+    // Returns 0 on success, error code otherwise. ETIMEDOUT is for timeout.
+    int timed_acquire(const timespec& duetime, int n = 1);
+
+    // Expose latencies of acquires which had to wait as
+    // <prefix>_wait_latency, <prefix>_wait_max_latency etc, and number of
+    // timed-out acquires as <prefix>_timeout_count.
+    int expose(const butil::StringPiece& prefix);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RateLimiter);
+
+    // Reserve `n' permits if they're available within `max_wait_ns'
+    // nanoseconds. Returns nanoseconds to wait for the permits, -1 if
+    // they're not reserved.
+    int64_t reserve(int n, int64_t max_wait_ns);
+    int wait(int64_t wait_ns);
+
+    // Nanoseconds to refill one token.
+    int64_t _interval_ns;
+    // Nanoseconds to refill the whole bucket.
+    int64_t _burst_ns;
+    // cpuwide time when the bucket is full.
+    butil::atomic<int64_t> _full_ns;
+    bvar::LatencyRecorder _wait_latency;
+    bvar::Adder<int64_t> _ntimeout;
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_RATE_LIMITER_H
@@ -22,60 +22,35 @@
 #ifndef BTHREAD_REMOTE_TASK_QUEUE_H
 #define BTHREAD_REMOTE_TASK_QUEUE_H
 
-#include "butil/containers/bounded_queue.h"
 #include "butil/macros.h"
+#include "butil/containers/mpmc_bounded_queue.h"
+#include "bthread/types.h"
 
 namespace bthread {
 
-class TaskGroup;
-
-// A queue for storing bthreads created by non-workers. Since non-workers
-// randomly choose a TaskGroup to push which distributes the contentions,
-// this queue is simply implemented as a queue protected with a lock.
+// A queue for storing bthreads created by non-workers, pushed by any thread
+// and popped by the owner worker as well as stealing workers.
+// It's a bounded lock-free queue (butil::MPMCBoundedQueue). push() fails
+// when the queue is full rather than dropping the task, the caller should
+// retry.
 // The function names should be self-explanatory.
 class RemoteTaskQueue {
 public:
     RemoteTaskQueue() {}
 
-    int init(size_t cap) {
-        const size_t memsize = sizeof(bthread_t) * cap;
-        void* q_mem = malloc(memsize);
-        if (q_mem == NULL) {
-            return -1;
-        }
-        butil::BoundedQueue<bthread_t> q(q_mem, memsize, butil::OWNS_STORAGE);
-        _tasks.swap(q);
-        return 0;
-    }
-
-    bool pop(bthread_t* task) {
-        if (_tasks.empty()) {
-            return false;
-        }
-        _mutex.lock();
-        const bool result = _tasks.pop(task);
-        _mutex.unlock();
-        return result;
-    }
+    // Capacity is rounded up to power of 2.
+    int init(size_t cap) { return _tasks.init(cap); }
 
-    bool push(bthread_t task) {
-        _mutex.lock();
-        const bool res = push_locked(task);
-        _mutex.unlock();
-        return res;
-    }
+    bool pop(bthread_t* task) { return _tasks.pop(task); }
 
-    bool push_locked(bthread_t task) {
-        return _tasks.push(task);
-    }
+    bool push(bthread_t task) { return _tasks.push(task); }
 
     size_t capacity() const { return _tasks.capacity(); }
     
 private:
-friend class TaskGroup;
     DISALLOW_COPY_AND_ASSIGN(RemoteTaskQueue);
-    butil::BoundedQueue<bthread_t> _tasks;
-    butil::Mutex _mutex;
+
+    butil::MPMCBoundedQueue<bthread_t> _tasks;
 };
 
 }  // namespace bthread
@@ -0,0 +1,138 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#include "butil/logging.h"
+#include "butil/time.h"
+#include "bthread/butex.h"
+#include "bthread/semaphore.h"
+
+namespace bthread {
+
+Semaphore::Semaphore(int permits)
+    : _nwaiter(0)
+    , _nbatch_waiter(0) {
+    if (permits < 0) {
+        LOG(FATAL) << "Invalid permits=" << permits;
+        abort();
+    }
+    _permits = butex_create_checked<butil::atomic<int> >();
+    _permits->store(permits, butil::memory_order_relaxed);
+}
+
+Semaphore::~Semaphore() {
+    butex_destroy(_permits);
+}
+
+bool Semaphore::try_acquire(int n) {
+    int seen = _permits->load(butil::memory_order_relaxed);
+    while (seen >= n) {
+        if (_permits->compare_exchange_weak(seen, seen - n,
+                                            butil::memory_order_acquire,
+                                            butil::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int Semaphore::acquire(int n) {
+    if (n <= 0) {
+        return EINVAL;
+    }
+    if (try_acquire(n)) {
+        return 0;
+    }
+    return acquire_slow(NULL, n);
+}
+
+int Semaphore::timed_acquire(const timespec& duetime, int n) {
+    if (n <= 0) {
+        return EINVAL;
+    }
+    if (try_acquire(n)) {
+        return 0;
+    }
+    return acquire_slow(&duetime, n);
+}
+
+int Semaphore::acquire_slow(const timespec* duetime, int n) {
+    const int64_t start_us = butil::cpuwide_time_us();
+    // Counted before checking permits again, paired with release() which
+    // checks waiters after adding permits, so that wakeups are not missed.
+    _nwaiter.fetch_add(1, butil::memory_order_seq_cst);
+    if (n > 1) {
+        _nbatch_waiter.fetch_add(1, butil::memory_order_seq_cst);
+    }
+    int rc = 0;
+    while (true) {
+        int seen = _permits->load(butil::memory_order_seq_cst);
+        if (seen >= n) {
+            if (_permits->compare_exchange_weak(seen, seen - n,
+                                                butil::memory_order_acquire,
+                                                butil::memory_order_relaxed)) {
+                break;
+            }
+            continue;
+        }
+        if (butex_wait(_permits, seen, duetime) < 0 &&
+            errno != EWOULDBLOCK && errno != EINTR) {
+            rc = errno;
+            break;
+        }
+    }
+    if (n > 1) {
+        _nbatch_waiter.fetch_sub(1, butil::memory_order_relaxed);
+    }
+    _nwaiter.fetch_sub(1, butil::memory_order_relaxed);
+    if (rc == 0) {
+        _wait_latency << butil::cpuwide_time_us() - start_us;
+    } else if (rc == ETIMEDOUT) {
+        _ntimeout << 1;
+    }
+    return rc;
+}
+
+void Semaphore::release(int n) {
+    if (n <= 0) {
+        LOG_IF(ERROR, n < 0) << "Invalid n=" << n;
+        return;
+    }
+    _permits->fetch_add(n, butil::memory_order_seq_cst);
+    if (_nwaiter.load(butil::memory_order_seq_cst) == 0) {
+        return;
+    }
+    if (n == 1 && _nbatch_waiter.load(butil::memory_order_relaxed) == 0) {
+        butex_wake(_permits);
+    } else {
+        butex_wake_all(_permits);
+    }
+}
+
+int Semaphore::available() const {
+    return _permits->load(butil::memory_order_relaxed);
+}
+
+int Semaphore::expose(const butil::StringPiece& prefix) {
+    if (_wait_latency.expose(prefix, "wait") != 0) {
+        return -1;
+    }
+    return _ntimeout.expose_as(prefix, "timeout_count");
+}
+
+}  // namespace bthread
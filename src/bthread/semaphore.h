@@ -0,0 +1,89 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_SEMAPHORE_H
+#define BTHREAD_SEMAPHORE_H
+
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/strings/string_piece.h"
+#include "bvar/bvar.h"
+#include "bthread/bthread.h"
+
+namespace bthread {
+
+// A counting semaphore blocking bthreads (or pthreads) without blocking
+// pthread workers, e.g. for limiting concurrent calls to a downstream.
+// Acquiring available permits and releasing permits without waiters are
+// lock-free. Waiting is done with a butex holding the number of permits.
+// Example:
+//   bthread::Semaphore sem(32);
+//   sem.expose("downstream_concurrency");
+//   if (sem.timed_acquire(butil::milliseconds_from_now(10)) != 0) {
+//       return busy;
+//   }
+//   call_downstream();
+//   sem.release();
+class Semaphore {
+public:
+    explicit Semaphore(int permits);
+    ~Semaphore();
+
+    // Acquire `n' permits if they're available without blocking.
+    bool try_acquire(int n = 1);
+
+    // Block until `n' permits are acquired.
+    // Returns 0 on success, error code otherwise.
+    // This method never returns EINTR.
+    int acquire(int n = 1);
+
+    // Block until `n' permits are acquired or `duetime' has expired.
+    // Returns 0 on success, error code otherwise. ETIMEDOUT is for timeout.
+    // This method never returns EINTR.
+    int timed_acquire(const timespec& duetime, int n = 1);
+
+    // Return `n' permits and wake up waiters.
+    void release(int n = 1);
+
+    // Number of permits available now.
+    int available() const;
+
+    // Expose latencies of acquires which had to wait as
+    // <prefix>_wait_latency, <prefix>_wait_max_latency etc, and number of
+    // timed-out acquires as <prefix>_timeout_count.
+    int expose(const butil::StringPiece& prefix);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Semaphore);
+
+    int acquire_slow(const timespec* duetime, int n);
+
+    butil::atomic<int>* _permits;
+    butil::atomic<int> _nwaiter;
+    // Waiters acquiring more than one permit, which may not be the one
+    // woken up by butex_wake(), thus all waiters are woken up when there're
+    // such waiters.
+    butil::atomic<int> _nbatch_waiter;
+    bvar::LatencyRecorder _wait_latency;
+    bvar::Adder<int64_t> _ntimeout;
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_SEMAPHORE_H
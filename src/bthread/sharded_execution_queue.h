@@ -0,0 +1,248 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - A M:N threading library to make applications more concurrent.
+
+#ifndef BTHREAD_SHARDED_EXECUTION_QUEUE_H
+#define BTHREAD_SHARDED_EXECUTION_QUEUE_H
+
+#include <errno.h>                                     // EINVAL
+#include <stdio.h>                                     // snprintf
+#include <functional>                                  // std::hash
+#include <string>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h" // fmix64
+#include "bvar/latency_recorder.h"
+#include "bthread/execution_queue.h"
+
+namespace bthread {
+
+struct ShardedExecutionQueueOptions {
+    ShardedExecutionQueueOptions();
+
+    // Number of shards, namely ExecutionQueues.
+    // default: 16
+    int num_shards;
+
+    // Options of each shard, set max_tasks_per_batch and time_slice_us to
+    // keep a busy shard from delaying others.
+    ExecutionQueueOptions queue_options;
+
+    // If non-empty, expose histograms of each shard:
+    //   <prefix>_<shard>_depth_*: number of pending tasks when a batch starts
+    //   <prefix>_<shard>_batch_size_*: number of tasks in each batch
+    // where `*' are suffixes of bvar::LatencyRecorder namely latency,
+    // max_latency, latency_99 etc.
+    // default: ""
+    std::string bvar_prefix;
+};
+
+// A fixed set of ExecutionQueues, tasks with the same key always go to the
+// same shard (fmix64(Hash()(key)) % num_shards) and are executed in the
+// order of being pushed, like one ExecutionQueue per key without creating
+// so many queues. As ExecutionQueue, a shard occupies no bthread when it
+// has nothing to execute.
+//
+// `execute' is called with tasks of one shard at a time, calls on different
+// shards may run concurrently. It's called with is_queue_stopped() being
+// true exactly once after all shards are stopped.
+template <typename T, typename K = uint64_t, typename Hash = std::hash<K> >
+class ShardedExecutionQueue {
+public:
+    typedef int (*execute_func_t)(void* meta, TaskIterator<T>& iter);
+
+    ShardedExecutionQueue();
+    // Stop and join if it's started.
+    ~ShardedExecutionQueue();
+
+    // Start all shards, see execution_queue_start for `execute' and `meta'.
+    // If `options' is NULL, default options are used.
+    // Returns 0 on success, errno otherwise.
+    int start(const ShardedExecutionQueueOptions* options,
+              execute_func_t execute, void* meta);
+
+    // Thread-safe and wait-free as execution_queue_execute.
+    // Returns 0 on success, errno otherwise.
+    int execute(const K& key, typename butil::add_const_reference<T>::type task,
+                const TaskOptions* options = NULL) {
+        if (_nshard == 0) {
+            return EINVAL;
+        }
+        return execute_in_shard(shard_of(key), task, options);
+    }
+    int execute_in_shard(size_t shard,
+                         typename butil::add_const_reference<T>::type task,
+                         const TaskOptions* options = NULL);
+
+    // Stop all shards, following execute() fail.
+    void stop();
+
+    // Wait until all shards are stopped and executed.
+    void join();
+
+    // Must be called after start() succeeds.
+    size_t shard_of(const K& key) const {
+        return butil::fmix64(_hash(key)) % _nshard;
+    }
+    size_t shard_count() const { return _nshard; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ShardedExecutionQueue);
+
+    struct Shard {
+        ShardedExecutionQueue* owner;
+        ExecutionQueueId<T> id;
+        butil::atomic<int64_t> depth;
+        bvar::LatencyRecorder depth_recorder;
+        bvar::LatencyRecorder batch_size_recorder;
+    };
+
+    static int execute_shard(void* meta, TaskIterator<T>& iter);
+
+    Hash _hash;
+    size_t _nshard;
+    Shard* _shards;
+    execute_func_t _execute;
+    void* _meta;
+    butil::atomic<int> _nrunning_shard;
+    bool _stopped;
+};
+
+inline ShardedExecutionQueueOptions::ShardedExecutionQueueOptions()
+    : num_shards(16) {}
+
+template <typename T, typename K, typename Hash>
+ShardedExecutionQueue<T, K, Hash>::ShardedExecutionQueue()
+    : _nshard(0)
+    , _shards(NULL)
+    , _execute(NULL)
+    , _meta(NULL)
+    , _nrunning_shard(0)
+    , _stopped(false) {}
+
+template <typename T, typename K, typename Hash>
+ShardedExecutionQueue<T, K, Hash>::~ShardedExecutionQueue() {
+    stop();
+    join();
+    delete [] _shards;
+    _shards = NULL;
+}
+
+template <typename T, typename K, typename Hash>
+int ShardedExecutionQueue<T, K, Hash>::start(
+        const ShardedExecutionQueueOptions* options,
+        execute_func_t execute, void* meta) {
+    if (_shards != NULL) {
+        return EPERM;
+    }
+    ShardedExecutionQueueOptions opt;
+    if (options != NULL) {
+        opt = *options;
+    }
+    if (opt.num_shards <= 0 || execute == NULL) {
+        return EINVAL;
+    }
+    _nshard = opt.num_shards;
+    _shards = new (std::nothrow) Shard[_nshard];
+    if (_shards == NULL) {
+        return ENOMEM;
+    }
+    _execute = execute;
+    _meta = meta;
+    _nrunning_shard.store(_nshard, butil::memory_order_relaxed);
+    for (size_t i = 0; i < _nshard; ++i) {
+        Shard& s = _shards[i];
+        s.owner = this;
+        s.depth.store(0, butil::memory_order_relaxed);
+        if (!opt.bvar_prefix.empty()) {
+            char name[16];
+            snprintf(name, sizeof(name), "_%zu", i);
+            s.depth_recorder.expose(opt.bvar_prefix + name + "_depth");
+            s.batch_size_recorder.expose(opt.bvar_prefix + name + "_batch_size");
+        }
+        const int rc = execution_queue_start(
+            &s.id, &opt.queue_options, execute_shard, &s);
+        if (rc != 0) {
+            // Shards not started are never stopped by themselves.
+            _nrunning_shard.fetch_sub(_nshard - i, butil::memory_order_relaxed);
+            _nshard = i;
+            stop();
+            join();
+            return rc;
+        }
+    }
+    return 0;
+}
+
+template <typename T, typename K, typename Hash>
+int ShardedExecutionQueue<T, K, Hash>::execute_in_shard(
+        size_t shard, typename butil::add_const_reference<T>::type task,
+        const TaskOptions* options) {
+    if (shard >= _nshard) {
+        return EINVAL;
+    }
+    Shard& s = _shards[shard];
+    s.depth.fetch_add(1, butil::memory_order_relaxed);
+    const int rc = execution_queue_execute(s.id, task, options);
+    if (rc != 0) {
+        s.depth.fetch_sub(1, butil::memory_order_relaxed);
+    }
+    return rc;
+}
+
+template <typename T, typename K, typename Hash>
+void ShardedExecutionQueue<T, K, Hash>::stop() {
+    if (_stopped) {
+        return;
+    }
+    _stopped = true;
+    for (size_t i = 0; i < _nshard; ++i) {
+        execution_queue_stop(_shards[i].id);
+    }
+}
+
+template <typename T, typename K, typename Hash>
+void ShardedExecutionQueue<T, K, Hash>::join() {
+    for (size_t i = 0; i < _nshard; ++i) {
+        execution_queue_join(_shards[i].id);
+    }
+}
+
+template <typename T, typename K, typename Hash>
+int ShardedExecutionQueue<T, K, Hash>::execute_shard(
+        void* meta, TaskIterator<T>& iter) {
+    Shard* s = static_cast<Shard*>(meta);
+    ShardedExecutionQueue* q = s->owner;
+    if (iter.is_queue_stopped()) {
+        // Pass the stop to user only once, after the last shard.
+        if (q->_nrunning_shard.fetch_sub(1, butil::memory_order_acq_rel) == 1) {
+            return q->_execute(q->_meta, iter);
+        }
+        return 0;
+    }
+    s->depth_recorder << s->depth.load(butil::memory_order_relaxed);
+    const int rc = q->_execute(q->_meta, iter);
+    const int n = iter.num_iterated();
+    s->batch_size_recorder << n;
+    s->depth.fetch_sub(n, butil::memory_order_relaxed);
+    return rc;
+}
+
+}  // namespace bthread
+
+#endif  // BTHREAD_SHARDED_EXECUTION_QUEUE_H
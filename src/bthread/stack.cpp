@@ -27,6 +27,7 @@
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "butil/third_party/dynamic_annotations/dynamic_annotations.h" // RunningOnValgrind
 #include "butil/third_party/valgrind/valgrind.h"   // VALGRIND_STACK_REGISTER
+#include "butil/unique_ptr.h"
 #include "bvar/passive_status.h"
 #include "bthread/types.h"                        // BTHREAD_STACKTYPE_*
 #include "bthread/stack.h"
@@ -37,6 +38,19 @@ DEFINE_int32(stack_size_large, 8388608, "size of large stacks");
 DEFINE_int32(guard_page_size, 4096, "size of guard page, allocate stacks by malloc if it's 0(not recommended)");
 DEFINE_int32(tc_stack_small, 32, "maximum small stacks cached by each thread");
 DEFINE_int32(tc_stack_normal, 8, "maximum normal stacks cached by each thread");
+DEFINE_int32(max_idle_stack_small, 0, "Memory of small stacks returned when "
+             "there're more than so many idle ones is released, 0 means "
+             "unlimited");
+DEFINE_int32(max_idle_stack_normal, 0, "Memory of normal stacks returned when "
+             "there're more than so many idle ones is released, 0 means "
+             "unlimited");
+DEFINE_int32(max_idle_stack_large, 0, "Memory of large stacks returned when "
+             "there're more than so many idle ones is released, 0 means "
+             "unlimited");
+DEFINE_bool(stack_madvise_free, false, "Advise the kernel to reclaim unused "
+            "pages of stacks being cached(MADV_FREE or MADV_DONTNEED), which "
+            "reduces RSS after bursts of bthreads at the cost of page faults "
+            "when the stacks are reused");
 
 namespace bthread {
 
@@ -53,6 +67,43 @@ static int64_t get_stack_count(void*) {
 static bvar::PassiveStatus<int64_t> bvar_stack_count(
     "bthread_stack_count", get_stack_count, NULL);
 
+StackStat g_stack_stats[STACK_TYPE_LARGE + 1];
+
+static const char* const s_stack_type_names[STACK_TYPE_LARGE + 1] = {
+    NULL, NULL, "small", "normal", "large"
+};
+
+static int64_t get_stack_stat_count(void* arg) {
+    return ((StackStat*)arg)->nstack.load(butil::memory_order_relaxed);
+}
+static int64_t get_stack_stat_idle(void* arg) {
+    return ((StackStat*)arg)->nidle.load(butil::memory_order_relaxed);
+}
+static int64_t get_stack_stat_bytes(void* arg) {
+    return ((StackStat*)arg)->nbytes.load(butil::memory_order_relaxed);
+}
+
+// bthread_stack_<type>_count/idle_count/bytes
+struct StackStatVars {
+    StackStatVars() {
+        for (int i = STACK_TYPE_SMALL; i <= STACK_TYPE_LARGE; ++i) {
+            const std::string prefix =
+                std::string("bthread_stack_") + s_stack_type_names[i];
+            StackStat* st = &g_stack_stats[i];
+            count[i].reset(new bvar::PassiveStatus<int64_t>(
+                prefix + "_count", get_stack_stat_count, st));
+            idle[i].reset(new bvar::PassiveStatus<int64_t>(
+                prefix + "_idle_count", get_stack_stat_idle, st));
+            bytes[i].reset(new bvar::PassiveStatus<int64_t>(
+                prefix + "_bytes", get_stack_stat_bytes, st));
+        }
+    }
+    std::unique_ptr<bvar::PassiveStatus<int64_t> > count[STACK_TYPE_LARGE + 1];
+    std::unique_ptr<bvar::PassiveStatus<int64_t> > idle[STACK_TYPE_LARGE + 1];
+    std::unique_ptr<bvar::PassiveStatus<int64_t> > bytes[STACK_TYPE_LARGE + 1];
+};
+static StackStatVars s_stack_stat_vars;
+
 int allocate_stack_storage(StackStorage* s, int stacksize_in, int guardsize_in) {
     const static int PAGESIZE = getpagesize();
     const int PAGESIZE_M1 = PAGESIZE - 1;
@@ -146,8 +197,47 @@ void deallocate_stack_storage(StackStorage* s) {
     }
 }
 
+bool cache_stack(ContextualStack* s, int max_idle) {
+    StackStat& st = g_stack_stats[s->stacktype];
+    const int64_t nidle = st.nidle.fetch_add(1, butil::memory_order_relaxed) + 1;
+    if (max_idle > 0 && nidle > max_idle) {
+        st.nidle.fetch_sub(1, butil::memory_order_relaxed);
+        return false;
+    }
+    if (FLAGS_stack_madvise_free && s->storage.guardsize > 0) {
+        // Frames above the saved context are resumed when the stack is
+        // reused, keep them and one more page for safety.
+        const static uintptr_t PAGESIZE = getpagesize();
+        const uintptr_t begin =
+            (uintptr_t)s->storage.bottom - s->storage.stacksize;
+        const uintptr_t end = ((uintptr_t)s->context & ~(PAGESIZE - 1)) - PAGESIZE;
+        if (end > begin) {
+#ifdef MADV_FREE
+            const int advice = MADV_FREE;
+#else
+            const int advice = MADV_DONTNEED;
+#endif
+            madvise((void*)begin, end - begin, advice);
+        }
+    }
+    return true;
+}
+
+void print_stack_stats(std::ostream& os) {
+    for (int i = STACK_TYPE_SMALL; i <= STACK_TYPE_LARGE; ++i) {
+        const StackStat& st = g_stack_stats[i];
+        os << s_stack_type_names[i] << " stacks: count="
+           << st.nstack.load(butil::memory_order_relaxed)
+           << " idle=" << st.nidle.load(butil::memory_order_relaxed)
+           << " bytes=" << st.nbytes.load(butil::memory_order_relaxed) << '\n';
+    }
+}
+
 int* SmallStackClass::stack_size_flag = &FLAGS_stack_size_small;
 int* NormalStackClass::stack_size_flag = &FLAGS_stack_size_normal;
 int* LargeStackClass::stack_size_flag = &FLAGS_stack_size_large;
+int* SmallStackClass::max_idle_flag = &FLAGS_max_idle_stack_small;
+int* NormalStackClass::max_idle_flag = &FLAGS_max_idle_stack_normal;
+int* LargeStackClass::max_idle_flag = &FLAGS_max_idle_stack_large;
 
 }  // namespace bthread
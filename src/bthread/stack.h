@@ -23,7 +23,9 @@
 #define BTHREAD_ALLOCATE_STACK_H
 
 #include <assert.h>
+#include <ostream>
 #include <gflags/gflags.h>          // DECLARE_int32
+#include "butil/atomicops.h"
 #include "bthread/types.h"
 #include "bthread/context.h"        // bthread_fcontext_t
 #include "butil/object_pool.h"
@@ -67,6 +69,28 @@ struct ContextualStack {
     StackStorage storage;
 };
 
+// Statistics of pooled stacks of one type.
+struct BAIDU_CACHELINE_ALIGNMENT StackStat {
+    // Stacks with allocated storage.
+    butil::atomic<int64_t> nstack;
+    // Stacks cached in the pool, not used by any bthread.
+    butil::atomic<int64_t> nidle;
+    // Memory mapped by the stacks, including guard pages.
+    butil::atomic<int64_t> nbytes;
+};
+// Indexed by StackType.
+extern StackStat g_stack_stats[STACK_TYPE_LARGE + 1];
+
+// Called before returning stack `s' with allocated storage into the pool.
+// Returns false if the storage should be deallocated because there're more
+// than `max_idle'(0 means unlimited) idle stacks of the type already, true
+// otherwise in which case unused pages of the stack may be advised to be
+// freed according to -stack_madvise_free
+bool cache_stack(ContextualStack* s, int max_idle);
+
+// Print statistics of stacks of each type.
+void print_stack_stats(std::ostream& os);
+
 // Get a stack in the `type' and run `entry' at the first time that the
 // stack is jumped.
 ContextualStack* get_stack(StackType type, void (*entry)(intptr_t));
@@ -25,6 +25,9 @@
 DECLARE_int32(guard_page_size);
 DECLARE_int32(tc_stack_small);
 DECLARE_int32(tc_stack_normal);
+DECLARE_int32(max_idle_stack_small);
+DECLARE_int32(max_idle_stack_normal);
+DECLARE_int32(max_idle_stack_large);
 
 namespace bthread {
 
@@ -32,47 +35,91 @@ struct MainStackClass {};
 
 struct SmallStackClass {
     static int* stack_size_flag;
+    static int* max_idle_flag;
     // Older gcc does not allow static const enum, use int instead.
     static const int stacktype = (int)STACK_TYPE_SMALL;
 };
 
 struct NormalStackClass {
     static int* stack_size_flag;
+    static int* max_idle_flag;
     static const int stacktype = (int)STACK_TYPE_NORMAL;
 };
 
 struct LargeStackClass {
     static int* stack_size_flag;
+    static int* max_idle_flag;
     static const int stacktype = (int)STACK_TYPE_LARGE;
 };
 
 template <typename StackClass> struct StackFactory {
     struct Wrapper : public ContextualStack {
-        explicit Wrapper(void (*entry)(intptr_t)) {
+        explicit Wrapper(void (*entry)(intptr_t)) : idle(false) {
+            stacktype = (StackType)StackClass::stacktype;
+            allocate(entry);
+        }
+        ~Wrapper() { deallocate(); }
+
+        bool allocate(void (*entry)(intptr_t)) {
             if (allocate_stack_storage(&storage, *StackClass::stack_size_flag,
                                        FLAGS_guard_page_size) != 0) {
                 storage.zeroize();
                 context = NULL;
-                return;
+                return false;
             }
             context = bthread_make_fcontext(storage.bottom, storage.stacksize, entry);
-            stacktype = (StackType)StackClass::stacktype;
+            StackStat& st = g_stack_stats[StackClass::stacktype];
+            st.nstack.fetch_add(1, butil::memory_order_relaxed);
+            st.nbytes.fetch_add(storage.stacksize + storage.guardsize,
+                                butil::memory_order_relaxed);
+            return true;
         }
-        ~Wrapper() {
+
+        void deallocate() {
             if (context) {
                 context = NULL;
+                StackStat& st = g_stack_stats[StackClass::stacktype];
+                st.nstack.fetch_sub(1, butil::memory_order_relaxed);
+                st.nbytes.fetch_sub(storage.stacksize + storage.guardsize,
+                                    butil::memory_order_relaxed);
                 deallocate_stack_storage(&storage);
                 storage.zeroize();
             }
         }
+
+        // True when the stack is cached in the pool.
+        bool idle;
     };
     
     static ContextualStack* get_stack(void (*entry)(intptr_t)) {
-        return butil::get_object<Wrapper>(entry);
+        Wrapper* w = butil::get_object<Wrapper>(entry);
+        if (w == NULL) {
+            return NULL;
+        }
+        if (w->idle) {
+            w->idle = false;
+            g_stack_stats[StackClass::stacktype].nidle.fetch_sub(
+                1, butil::memory_order_relaxed);
+        } else if (w->context == NULL && !w->allocate(entry)) {
+            // Storage of the stack was deallocated by return_stack().
+            butil::return_object(w);
+            return NULL;
+        }
+        return w;
     }
     
     static void return_stack(ContextualStack* sc) {
-        butil::return_object(static_cast<Wrapper*>(sc));
+        Wrapper* w = static_cast<Wrapper*>(sc);
+        if (w->context != NULL) {
+            if (cache_stack(w, *StackClass::max_idle_flag)) {
+                w->idle = true;
+            } else {
+                // Too many idle stacks, release memory of this one and
+                // allocate again when it's reused.
+                w->deallocate();
+            }
+        }
+        butil::return_object(w);
     }
 };
 
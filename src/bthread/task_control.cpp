@@ -19,16 +19,21 @@
 
 // Date: Tue Jul 10 17:40:58 CST 2012
 
+#include <algorithm>                      // std::max
+#include <sstream>                        // std::ostringstream
 #include "butil/scoped_lock.h"             // BAIDU_SCOPED_LOCK
 #include "butil/errno.h"                   // berror
+#include "butil/build_config.h"            // OS_LINUX
 #include "butil/logging.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "butil/debug/stack_trace.h"     // StackTrace
 #include "bthread/sys_futex.h"            // futex_wake_private
 #include "bthread/interrupt_pthread.h"
 #include "bthread/processor.h"            // cpu_relax
 #include "bthread/task_group.h"           // TaskGroup
 #include "bthread/task_control.h"
 #include "bthread/timer_thread.h"         // global_timer_thread
+#include "bthread/numa.h"                 // get_numa_nodes
 #include <gflags/gflags.h>
 #include "bthread/log.h"
 
@@ -36,11 +41,55 @@ DEFINE_int32(task_group_delete_delay, 1,
              "delay deletion of TaskGroup for so many seconds");
 DEFINE_int32(task_group_runqueue_capacity, 4096,
              "capacity of runqueue in each TaskGroup");
+DEFINE_int32(task_group_remote_runqueue_capacity, 0,
+             "capacity of the runqueue for bthreads created by non-workers in "
+             "each TaskGroup, rounded up to power of 2. 0 means half of "
+             "-task_group_runqueue_capacity");
 DEFINE_int32(task_group_yield_before_idle, 0,
              "TaskGroup yields so many times before idle");
+DEFINE_int32(task_group_steal_batch, 16,
+             "Max number of tasks a worker steals from another worker at once, "
+             "capped by WorkStealingQueue::MAX_STEAL_BATCH, only from workers "
+             "with more than 2 * MAX_STEAL_BATCH tasks. Tasks other than "
+             "the one to run are put into the local runqueue of the thief. "
+             "1 steals tasks one by one");
+DEFINE_bool(bthread_numa_aware, false,
+            "Partition workers by NUMA nodes: workers are bound to cpus of "
+            "their nodes and steal tasks from the same node first. Only "
+            "effective before bthread is initialized");
+DEFINE_int32(task_group_ntags, 1,
+             "Number of tags of workers, workers are evenly assigned to tags "
+             "in [0, task_group_ntags) and bthreads only run on workers with "
+             "the same tag. Only effective before bthread is initialized");
+
+DEFINE_bool(bthread_autoscale, false,
+            "Periodically retire idle workers and bring them back or create "
+            "new ones (up to -bthread_concurrency) when workers are busy. "
+            "Only effective before bthread is initialized");
+DEFINE_int32(bthread_autoscale_interval_ms, 1000,
+             "Interval of checking load of workers for -bthread_autoscale");
+DEFINE_int32(bthread_autoscale_grow_usage, 80,
+             "Add one worker to a tag when average usage(in percent) of its "
+             "active workers is higher than this value or runqueues are not "
+             "drained in time");
+DEFINE_int32(bthread_autoscale_shrink_usage, 30,
+             "Retire one worker of a tag when average usage(in percent) of "
+             "its active workers is lower than this value and runqueues are "
+             "empty");
+DEFINE_int32(bthread_autoscale_min_workers, 1,
+             "Minimum number of active workers of each tag kept by "
+             "-bthread_autoscale");
+DEFINE_int32(bthread_watchdog_threshold_ms, 0,
+             "Report workers running one bthread for longer than so many "
+             "milliseconds without yielding, along with the call stack of "
+             "the bthread, in logs and /bthreads. 0 disables the watchdog. "
+             "Only effective before bthread is initialized");
 
 namespace bthread {
 
+// Number of recent reports of stuck workers kept for /bthreads.
+static const size_t MAX_STUCK_REPORTS = 16;
+
 DECLARE_int32(bthread_concurrency);
 DECLARE_int32(bthread_min_concurrency);
 
@@ -55,24 +104,74 @@ void run_worker_startfn() {
     }
 }
 
+struct TaskControl::WorkerArgs {
+    TaskControl* control;
+    bthread_tag_t tag;
+};
+
+TaskControl::TaggedGroups::TaggedGroups()
+    : ngroup(0)
+    , groups(NULL)
+    , nworker(0)
+    , next_numa_node(0)
+    , nbusy_polling(0)
+    , last_cputime_ns(0)
+    , last_autoscale_ns(0) {
+    for (int i = 0; i < MAX_NUMA_NODES; ++i) {
+        numa_ngroup[i].store(0, butil::memory_order_relaxed);
+        numa_groups[i] = NULL;
+    }
+}
+
+TaskControl::TaggedGroups::~TaggedGroups() {
+    free(groups);
+    groups = NULL;
+    for (int i = 0; i < MAX_NUMA_NODES; ++i) {
+        free(numa_groups[i]);
+        numa_groups[i] = NULL;
+    }
+}
+
+int TaskControl::TaggedGroups::init(int nnuma) {
+    groups = (TaskGroup**)calloc(BTHREAD_MAX_CONCURRENCY, sizeof(TaskGroup*));
+    if (groups == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < nnuma; ++i) {
+        numa_groups[i] = (TaskGroup**)calloc(
+            BTHREAD_MAX_CONCURRENCY, sizeof(TaskGroup*));
+        if (numa_groups[i] == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 void* TaskControl::worker_thread(void* arg) {
     run_worker_startfn();    
 #ifdef BAIDU_INTERNAL
     logging::ComlogInitializer comlog_initializer;
 #endif
     
-    TaskControl* c = static_cast<TaskControl*>(arg);
-    TaskGroup* g = c->create_group();
+    WorkerArgs* args = static_cast<WorkerArgs*>(arg);
+    TaskControl* c = args->control;
+    const bthread_tag_t tag = args->tag;
+    delete args;
+    // Bind before creating the group so that the group, its runqueue and
+    // stacks allocated later are first touched on the local node.
+    const int numa_node = c->bind_worker_to_numa_node(tag);
+    TaskGroup* g = c->create_group(tag, numa_node);
     TaskStatistics stat;
     if (NULL == g) {
         LOG(ERROR) << "Fail to create TaskGroup in pthread=" << pthread_self();
         return NULL;
     }
     BT_VLOG << "Created worker=" << pthread_self()
-            << " bthread=" << g->main_tid();
+            << " bthread=" << g->main_tid() << " tag=" << tag;
 
     tls_task_group = g;
     c->_nworkers << 1;
+    c->_tagged[tag]->nworker.fetch_add(1, butil::memory_order_relaxed);
     g->run_main_task();
 
     stat = g->main_stat();
@@ -82,16 +181,56 @@ void* TaskControl::worker_thread(void* arg) {
     tls_task_group = NULL;
     g->destroy_self();
     c->_nworkers << -1;
+    c->_tagged[tag]->nworker.fetch_sub(1, butil::memory_order_relaxed);
     return NULL;
 }
 
-TaskGroup* TaskControl::create_group() {
+int TaskControl::bind_worker_to_numa_node(bthread_tag_t tag) {
+    if (_nnuma <= 0) {
+        return -1;
+    }
+    // Spread workers of each tag over all nodes.
+    const int node = _tagged[tag]->next_numa_node.fetch_add(
+        1, butil::memory_order_relaxed) % _nnuma;
+#if defined(OS_LINUX)
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    const std::vector<int>& cpus = _numa_cpus[node];
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        CPU_SET(cpus[i], &cs);
+    }
+    const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+    if (rc) {
+        LOG(WARNING) << "Fail to bind worker=" << pthread_self()
+                     << " to numa node=" << node << ", " << berror(rc);
+    }
+#endif
+    return node;
+}
+
+TaskGroup* TaskControl::create_group(bthread_tag_t tag, int numa_node) {
+    if (tag < 0 || tag >= _ntags) {
+        LOG(ERROR) << "Invalid tag=" << tag;
+        return NULL;
+    }
     TaskGroup* g = new (std::nothrow) TaskGroup(this);
     if (NULL == g) {
         LOG(FATAL) << "Fail to new TaskGroup";
         return NULL;
     }
-    if (g->init(FLAGS_task_group_runqueue_capacity) != 0) {
+    g->_tag = tag;
+    ParkingLot* pl = _tagged[tag]->pl;
+    if (numa_node >= 0 && numa_node < _nnuma) {
+        g->_numa_node = numa_node;
+        // Workers of a node share parking lots so that signal_task() in the
+        // node wakes up local workers first.
+        g->_pl = &pl[numa_node % PARKING_LOT_NUM];
+    } else {
+        g->_pl = &pl[butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM];
+    }
+    const int remote_cap = FLAGS_task_group_remote_runqueue_capacity;
+    if (g->init(FLAGS_task_group_runqueue_capacity,
+                remote_cap > 0 ? remote_cap : 0) != 0) {
         LOG(ERROR) << "Fail to init TaskGroup";
         delete g;
         return NULL;
@@ -120,6 +259,23 @@ static int64_t get_cumulated_signal_count_from_this(void *arg) {
     return static_cast<TaskControl*>(arg)->get_cumulated_signal_count();
 }
 
+static int64_t get_cumulated_steal_count_from_this(void *arg) {
+    return static_cast<TaskControl*>(arg)->get_cumulated_steal_count();
+}
+
+static int64_t get_cumulated_steal_success_count_from_this(void *arg) {
+    return static_cast<TaskControl*>(arg)->get_cumulated_steal_success_count();
+}
+
+static double get_steal_success_ratio_from_this(void *arg) {
+    TaskControl* c = static_cast<TaskControl*>(arg);
+    const int64_t nsteal = c->get_cumulated_steal_count();
+    if (nsteal <= 0) {
+        return 0;
+    }
+    return (double)c->get_cumulated_steal_success_count() / nsteal;
+}
+
 TaskControl::TaskControl()
     // NOTE: all fileds must be initialized before the vars.
     : _ngroup(0)
@@ -128,6 +284,7 @@ TaskControl::TaskControl()
     , _concurrency(0)
     , _nworkers("bthread_worker_count")
     , _pending_time(NULL)
+    , _sched_latency(NULL)
       // Delay exposure of following two vars because they rely on TC which
       // is not initialized yet.
     , _cumulated_worker_time(get_cumulated_worker_time_from_this, this)
@@ -136,11 +293,26 @@ TaskControl::TaskControl()
     , _switch_per_second(&_cumulated_switch_count)
     , _cumulated_signal_count(get_cumulated_signal_count_from_this, this)
     , _signal_per_second(&_cumulated_signal_count)
+    , _cumulated_steal_count(get_cumulated_steal_count_from_this, this)
+    , _cumulated_steal_success_count(
+        get_cumulated_steal_success_count_from_this, this)
+    , _steal_success_ratio(get_steal_success_ratio_from_this, this)
     , _status(print_rq_sizes_in_the_tc, this)
     , _nbthreads("bthread_count")
+    , _rq_overflow("bthread_rq_overflow_count")
+    , _ntags(0)
+    , _next_worker_tag(0)
+    , _nnuma(0)
+    , _cross_numa_steal_second(&_cross_numa_steal)
+    , _busy_poll_us_second(&_busy_poll_us)
+    , _has_autoscaler(false)
+    , _has_watchdog(false)
 {
     // calloc shall set memory to zero
     CHECK(_groups) << "Fail to create array of groups";
+    for (int i = 0; i < MAX_TAGS; ++i) {
+        _tagged[i] = NULL;
+    }
 }
 
 int TaskControl::init(int concurrency) {
@@ -152,6 +324,40 @@ int TaskControl::init(int concurrency) {
         LOG(ERROR) << "Invalid concurrency=" << concurrency;
         return -1;
     }
+    if (FLAGS_task_group_ntags <= 0 || FLAGS_task_group_ntags > MAX_TAGS) {
+        LOG(ERROR) << "Invalid task_group_ntags=" << FLAGS_task_group_ntags;
+        return -1;
+    }
+    // Every tag needs at least one worker.
+    if (concurrency < FLAGS_task_group_ntags) {
+        concurrency = FLAGS_task_group_ntags;
+    }
+
+    if (FLAGS_bthread_numa_aware) {
+        std::vector<std::vector<int> > nodes;
+        if (get_numa_nodes(&nodes) != 0) {
+            LOG(WARNING) << "Fail to get numa nodes, -bthread_numa_aware"
+                " is ignored";
+        } else if (nodes.size() > 1) {
+            if (nodes.size() > (size_t)MAX_NUMA_NODES) {
+                LOG(WARNING) << "Only first " << MAX_NUMA_NODES << " of "
+                             << nodes.size() << " numa nodes are used";
+                nodes.resize(MAX_NUMA_NODES);
+            }
+            _numa_cpus.swap(nodes);
+            _nnuma = (int)_numa_cpus.size();
+            _cross_numa_steal.expose("bthread_numa_cross_node_steal_count");
+            _cross_numa_steal_second.expose("bthread_numa_cross_node_steal_second");
+        }
+    }
+    for (int i = 0; i < FLAGS_task_group_ntags; ++i) {
+        _tagged[i] = new (std::nothrow) TaggedGroups;
+        if (_tagged[i] == NULL || _tagged[i]->init(_nnuma) != 0) {
+            LOG(ERROR) << "Fail to create groups of tag=" << i;
+            return -1;
+        }
+    }
+    _ntags = FLAGS_task_group_ntags;
     _concurrency = concurrency;
 
     // Make sure TimerThread is ready.
@@ -162,8 +368,12 @@ int TaskControl::init(int concurrency) {
     
     _workers.resize(_concurrency);   
     for (int i = 0; i < _concurrency; ++i) {
-        const int rc = pthread_create(&_workers[i], NULL, worker_thread, this);
+        WorkerArgs* args = new WorkerArgs;
+        args->control = this;
+        args->tag = i % _ntags;
+        const int rc = pthread_create(&_workers[i], NULL, worker_thread, args);
         if (rc) {
+            delete args;
             LOG(ERROR) << "Fail to create _workers[" << i << "], " << berror(rc);
             return -1;
         }
@@ -171,18 +381,56 @@ int TaskControl::init(int concurrency) {
     _worker_usage_second.expose("bthread_worker_usage");
     _switch_per_second.expose("bthread_switch_second");
     _signal_per_second.expose("bthread_signal_second");
+    _cumulated_steal_count.expose("bthread_steal_count");
+    _cumulated_steal_success_count.expose("bthread_steal_success_count");
+    _steal_success_ratio.expose("bthread_steal_success_ratio");
     _status.expose("bthread_group_status");
+    _busy_poll_us.expose("bthread_worker_busy_poll_us");
+    _busy_poll_us_second.expose("bthread_worker_busy_poll_us_second");
+    _wakeup_latency.expose("bthread_worker_wakeup");
 
-    // Wait for at least one group is added so that choose_one_group()
-    // never returns NULL.
+    // Wait for at least one group of each tag is added so that
+    // choose_one_group() never returns NULL.
     // TODO: Handle the case that worker quits before add_group
-    while (_ngroup == 0) {
-        usleep(100);  // TODO: Elaborate
+    for (int i = 0; i < _ntags; ++i) {
+        while (_tagged[i]->ngroup == 0) {
+            usleep(100);  // TODO: Elaborate
+        }
+    }
+
+    if (FLAGS_bthread_autoscale) {
+        const int rc = pthread_create(&_autoscaler, NULL, autoscaler_thread, this);
+        if (rc) {
+            LOG(ERROR) << "Fail to create autoscaler, " << berror(rc);
+            return -1;
+        }
+        _has_autoscaler = true;
+        _nretired_workers.expose("bthread_retired_worker_count");
+    }
+    if (FLAGS_bthread_watchdog_threshold_ms > 0) {
+        const int rc = pthread_create(&_watchdog, NULL, watchdog_thread, this);
+        if (rc) {
+            LOG(ERROR) << "Fail to create watchdog, " << berror(rc);
+            return -1;
+        }
+        _has_watchdog = true;
+        _nstuck_workers.expose("bthread_worker_stuck_count");
     }
     return 0;
 }
 
-int TaskControl::add_workers(int num) {
+int TaskControl::concurrency(bthread_tag_t tag) const {
+    if (tag < 0 || tag >= _ntags) {
+        return -1;
+    }
+    return _tagged[tag]->nworker.load(butil::memory_order_relaxed);
+}
+
+int TaskControl::add_workers(int num, bthread_tag_t tag) {
+    if (tag != BTHREAD_TAG_INVALID && (tag < 0 || tag >= _ntags)) {
+        LOG(ERROR) << "Invalid tag=" << tag;
+        return 0;
+    }
     if (num <= 0) {
         return 0;
     }
@@ -196,9 +444,14 @@ int TaskControl::add_workers(int num) {
         // Worker will add itself to _idle_workers, so we have to add
         // _concurrency before create a worker.
         _concurrency.fetch_add(1);
+        WorkerArgs* args = new WorkerArgs;
+        args->control = this;
+        args->tag = (tag != BTHREAD_TAG_INVALID ? tag :
+                     _next_worker_tag.fetch_add(1, butil::memory_order_relaxed) % _ntags);
         const int rc = pthread_create(
-                &_workers[i + old_concurency], NULL, worker_thread, this);
+                &_workers[i + old_concurency], NULL, worker_thread, args);
         if (rc) {
+            delete args;
             LOG(WARNING) << "Fail to create _workers[" << i + old_concurency
                          << "], " << berror(rc);
             _concurrency.fetch_sub(1, butil::memory_order_release);
@@ -210,15 +463,266 @@ int TaskControl::add_workers(int num) {
     return _concurrency.load(butil::memory_order_relaxed) - old_concurency;
 }
 
-TaskGroup* TaskControl::choose_one_group() {
-    const size_t ngroup = _ngroup.load(butil::memory_order_acquire);
+TaskGroup* TaskControl::choose_one_group(bthread_tag_t tag) {
+    if (tag < 0 || tag >= _ntags) {
+        LOG(ERROR) << "Invalid tag=" << tag;
+        return NULL;
+    }
+    TaggedGroups* tg = _tagged[tag];
+    const size_t ngroup = tg->ngroup.load(butil::memory_order_acquire);
     if (ngroup != 0) {
-        return _groups[butil::fast_rand_less_than(ngroup)];
+        return tg->groups[butil::fast_rand_less_than(ngroup)];
     }
     CHECK(false) << "Impossible: ngroup is 0";
     return NULL;
 }
 
+TaskGroup* TaskControl::choose_group_by_affinity(bthread_tag_t tag,
+                                                 uint64_t affinity) {
+    if (tag < 0 || tag >= _ntags) {
+        LOG(ERROR) << "Invalid tag=" << tag;
+        return NULL;
+    }
+    TaggedGroups* tg = _tagged[tag];
+    const size_t ngroup = tg->ngroup.load(butil::memory_order_acquire);
+    if (ngroup != 0) {
+        return tg->groups[affinity % ngroup];
+    }
+    CHECK(false) << "Impossible: ngroup is 0";
+    return NULL;
+}
+
+int TaskControl::retired_workers(bthread_tag_t tag) {
+    if (tag < 0 || tag >= _ntags) {
+        return -1;
+    }
+    BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    return (int)_tagged[tag]->retired.size();
+}
+
+bool TaskControl::retire_one_worker(bthread_tag_t tag) {
+    TaskGroup* g = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        if (_stop) {
+            return false;
+        }
+        TaggedGroups* tg = _tagged[tag];
+        const size_t ngroup = tg->ngroup.load(butil::memory_order_relaxed);
+        const int min_workers = std::max(FLAGS_bthread_autoscale_min_workers, 1);
+        if (ngroup <= (size_t)min_workers) {
+            return false;
+        }
+        // Only retire an idle worker with empty runqueue. Once erased from
+        // the tag, tasks in its runqueue can't be stolen and have to wait
+        // for the worker itself.
+        for (size_t i = ngroup; i > 0; --i) {
+            TaskGroup* cand = tg->groups[i - 1];
+            if (cand->is_current_main_task() && cand->rq_size() == 0) {
+                g = cand;
+                break;
+            }
+        }
+        if (g == NULL) {
+            return false;
+        }
+        erase_from_tag_locked(g);
+        tg->retired.push_back(g);
+        g->_retired.store(1, butil::memory_order_release);
+    }
+    _nretired_workers << 1;
+    // Wake up parked workers sharing the parking lot so that the retired
+    // one notices.
+    g->_pl->signal(std::max(concurrency(tag), 1));
+    return true;
+}
+
+bool TaskControl::reactivate_one_worker(bthread_tag_t tag) {
+    TaskGroup* g = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        if (_stop) {
+            return false;
+        }
+        std::vector<TaskGroup*>& retired = _tagged[tag]->retired;
+        if (retired.empty()) {
+            return false;
+        }
+        g = retired.back();
+        retired.pop_back();
+        add_to_tag_locked(g);
+        g->_retired.store(0, butil::memory_order_release);
+    }
+    _nretired_workers << -1;
+    futex_wake_private(&g->_retired, 1);
+    return true;
+}
+
+void TaskControl::autoscale() {
+    const int64_t now_ns = butil::cpuwide_time_ns();
+    for (int tag = 0; tag < _ntags; ++tag) {
+        TaggedGroups* tg = _tagged[tag];
+        int64_t cputime_ns = 0;
+        size_t nactive = 0;
+        size_t nqueued = 0;
+        {
+            BAIDU_SCOPED_LOCK(_modify_group_mutex);
+            nactive = tg->ngroup.load(butil::memory_order_relaxed);
+            for (size_t i = 0; i < nactive; ++i) {
+                cputime_ns += tg->groups[i]->cumulated_cputime_ns();
+                nqueued += tg->groups[i]->rq_size();
+            }
+            // Count retired groups as well so that the sum does not drop
+            // when groups are retired.
+            for (size_t i = 0; i < tg->retired.size(); ++i) {
+                cputime_ns += tg->retired[i]->cumulated_cputime_ns();
+            }
+        }
+        const int64_t last_cputime_ns = tg->last_cputime_ns;
+        const int64_t last_ns = tg->last_autoscale_ns;
+        tg->last_cputime_ns = cputime_ns;
+        tg->last_autoscale_ns = now_ns;
+        if (last_ns == 0 || now_ns <= last_ns || nactive == 0) {
+            continue;
+        }
+        const int64_t usage = (cputime_ns - last_cputime_ns) * 100
+            / ((now_ns - last_ns) * (int64_t)nactive);
+        if (usage >= FLAGS_bthread_autoscale_grow_usage || nqueued > nactive) {
+            if (!reactivate_one_worker(tag)) {
+                BAIDU_SCOPED_LOCK(g_task_control_mutex);
+                if (_concurrency.load(butil::memory_order_acquire)
+                    < FLAGS_bthread_concurrency) {
+                    add_workers(1, tag);
+                }
+            }
+        } else if (usage < FLAGS_bthread_autoscale_shrink_usage && nqueued == 0) {
+            retire_one_worker(tag);
+        }
+    }
+}
+
+void* TaskControl::autoscaler_thread(void* arg) {
+    TaskControl* c = static_cast<TaskControl*>(arg);
+    while (true) {
+        const int interval_ms = std::max(FLAGS_bthread_autoscale_interval_ms, 1);
+        // Sleep in small steps to quit quickly in stop_and_join().
+        for (int i = 0; i < interval_ms; i += 10) {
+            usleep(std::min(interval_ms - i, 10) * 1000);
+            BAIDU_SCOPED_LOCK(c->_modify_group_mutex);
+            if (c->_stop) {
+                return NULL;
+            }
+        }
+        c->autoscale();
+    }
+    return NULL;
+}
+
+void TaskControl::check_stuck_workers(std::map<TaskGroup*, int64_t>* reported) {
+    struct StuckWorker {
+        TaskGroup* g;
+        bthread_t tid;
+        int64_t last_run_ns;
+    };
+    const int64_t threshold_ns =
+        FLAGS_bthread_watchdog_threshold_ms * 1000000L;
+    const int64_t now_ns = butil::cpuwide_time_ns();
+    std::vector<StuckWorker> stuck;
+    {
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
+        for (size_t i = 0; i < ngroup; ++i) {
+            TaskGroup* g = _groups[i];
+            // Racy reads, the bthread may be switched out meanwhile, which
+            // is checked again after capturing the stack.
+            const int64_t last_run_ns = g->last_run_ns();
+            const bthread_t tid = g->current_tid();
+            if (tid == g->main_tid() || now_ns - last_run_ns < threshold_ns) {
+                continue;
+            }
+            int64_t& reported_ns = (*reported)[g];
+            if (reported_ns == last_run_ns) {
+                continue;
+            }
+            reported_ns = last_run_ns;
+            StuckWorker w = { g, tid, last_run_ns };
+            stuck.push_back(w);
+        }
+    }
+    for (size_t i = 0; i < stuck.size(); ++i) {
+        const StuckWorker& w = stuck[i];
+        // Groups are deleted after -task_group_delete_delay seconds, long
+        // enough for accessing them here.
+        void* frames[64];
+        const int nframe = capture_pthread_stack(
+            w.g->worker_pthread(), frames, arraysize(frames), 100);
+        if (w.g->last_run_ns() != w.last_run_ns) {
+            // Yielded before the stack was captured.
+            continue;
+        }
+        _nstuck_workers << 1;
+        std::ostringstream os;
+        os << "worker=" << w.g->worker_pthread() << " tag=" << w.g->tag()
+           << " has been running bthread=" << w.tid << " for "
+           << (butil::cpuwide_time_ns() - w.last_run_ns) / 1000000L
+           << "ms without yielding";
+        if (nframe > 0) {
+            os << ", stack:\n"
+               << butil::debug::StackTrace(frames, nframe).ToString();
+        } else {
+            os << ", fail to capture its stack\n";
+        }
+        LOG(WARNING) << os.str();
+        BAIDU_SCOPED_LOCK(_stuck_mutex);
+        _stuck_reports.push_back(os.str());
+        if (_stuck_reports.size() > MAX_STUCK_REPORTS) {
+            _stuck_reports.pop_front();
+        }
+    }
+    // Forget old reports so that destroyed groups don't accumulate. A
+    // bthread still running after that is reported again as a reminder.
+    for (std::map<TaskGroup*, int64_t>::iterator
+             it = reported->begin(); it != reported->end();) {
+        if (now_ns - it->second >= threshold_ns * 64) {
+            reported->erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void TaskControl::print_stuck_workers(std::ostream& os) {
+    if (!_has_watchdog) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(_stuck_mutex);
+    os << "\nRecent workers stuck on bthreads for more than "
+       << FLAGS_bthread_watchdog_threshold_ms << "ms: "
+       << _stuck_reports.size() << '\n';
+    for (size_t i = 0; i < _stuck_reports.size(); ++i) {
+        os << '\n' << _stuck_reports[i];
+    }
+}
+
+void* TaskControl::watchdog_thread(void* arg) {
+    TaskControl* c = static_cast<TaskControl*>(arg);
+    std::map<TaskGroup*, int64_t> reported;
+    while (true) {
+        const int interval_ms =
+            std::max(FLAGS_bthread_watchdog_threshold_ms / 2, 10);
+        // Sleep in small steps to quit quickly in stop_and_join().
+        for (int i = 0; i < interval_ms; i += 10) {
+            usleep(std::min(interval_ms - i, 10) * 1000);
+            BAIDU_SCOPED_LOCK(c->_modify_group_mutex);
+            if (c->_stop) {
+                return NULL;
+            }
+        }
+        c->check_stuck_workers(&reported);
+    }
+    return NULL;
+}
+
 extern int stop_and_join_epoll_threads();
 
 void TaskControl::stop_and_join() {
@@ -231,9 +735,35 @@ void TaskControl::stop_and_join() {
         BAIDU_SCOPED_LOCK(_modify_group_mutex);
         _stop = true;
         _ngroup.exchange(0, butil::memory_order_relaxed); 
+        for (int i = 0; i < _ntags; ++i) {
+            _tagged[i]->ngroup.exchange(0, butil::memory_order_relaxed);
+            for (int j = 0; j < _nnuma; ++j) {
+                _tagged[i]->numa_ngroup[j].exchange(0, butil::memory_order_relaxed);
+            }
+        }
+    }
+    for (int i = 0; i < _ntags; ++i) {
+        for (int j = 0; j < PARKING_LOT_NUM; ++j) {
+            _tagged[i]->pl[j].stop();
+        }
+    }
+    if (_has_autoscaler) {
+        pthread_join(_autoscaler, NULL);
+        _has_autoscaler = false;
     }
-    for (int i = 0; i < PARKING_LOT_NUM; ++i) {
-        _pl[i].stop();
+    if (_has_watchdog) {
+        pthread_join(_watchdog, NULL);
+        _has_watchdog = false;
+    }
+    // Retired workers check the parking lot after waking up.
+    {
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        for (int i = 0; i < _ntags; ++i) {
+            const std::vector<TaskGroup*>& retired = _tagged[i]->retired;
+            for (size_t j = 0; j < retired.size(); ++j) {
+                futex_wake_private(&retired[j]->_retired, 1);
+            }
+        }
     }
     // Interrupt blocking operations.
     for (size_t i = 0; i < _workers.size(); ++i) {
@@ -249,15 +779,29 @@ TaskControl::~TaskControl() {
     // NOTE: g_task_control is not destructed now because the situation
     //       is extremely racy.
     delete _pending_time.exchange(NULL, butil::memory_order_relaxed);
+    delete _sched_latency.exchange(NULL, butil::memory_order_relaxed);
     _worker_usage_second.hide();
     _switch_per_second.hide();
     _signal_per_second.hide();
+    _cumulated_steal_count.hide();
+    _cumulated_steal_success_count.hide();
+    _steal_success_ratio.hide();
     _status.hide();
+    _cross_numa_steal.hide();
+    _cross_numa_steal_second.hide();
+    _busy_poll_us.hide();
+    _busy_poll_us_second.hide();
+    _wakeup_latency.hide();
+    _nretired_workers.hide();
     
     stop_and_join();
 
     free(_groups);
     _groups = NULL;
+    for (int i = 0; i < MAX_TAGS; ++i) {
+        delete _tagged[i];
+        _tagged[i] = NULL;
+    }
 }
 
 int TaskControl::_add_group(TaskGroup* g) {
@@ -273,13 +817,54 @@ int TaskControl::_add_group(TaskGroup* g) {
         _groups[ngroup] = g;
         _ngroup.store(ngroup + 1, butil::memory_order_release);
     }
+    add_to_tag_locked(g);
     mu.unlock();
     // See the comments in _destroy_group
     // TODO: Not needed anymore since non-worker pthread cannot have TaskGroup
-    signal_task(65536);
+    signal_task(65536, g->_tag);
     return 0;
 }
 
+// Remove `g' from groups[0, *ngroup) in the same way as _destroy_group.
+// _modify_group_mutex must be locked.
+static void erase_group(TaskGroup** groups, butil::atomic<size_t>* ngroup,
+                        TaskGroup* g) {
+    const size_t n = ngroup->load(butil::memory_order_relaxed);
+    for (size_t i = 0; i < n; ++i) {
+        if (groups[i] == g) {
+            groups[i] = groups[n - 1];
+            ngroup->store(n - 1, butil::memory_order_release);
+            return;
+        }
+    }
+}
+
+void TaskControl::add_to_tag_locked(TaskGroup* g) {
+    TaggedGroups* tg = _tagged[g->_tag];
+    const size_t n = tg->ngroup.load(butil::memory_order_relaxed);
+    if (n < (size_t)BTHREAD_MAX_CONCURRENCY) {
+        tg->groups[n] = g;
+        tg->ngroup.store(n + 1, butil::memory_order_release);
+    }
+    if (g->_numa_node >= 0) {
+        const int node = g->_numa_node;
+        const size_t nn = tg->numa_ngroup[node].load(butil::memory_order_relaxed);
+        if (nn < (size_t)BTHREAD_MAX_CONCURRENCY) {
+            tg->numa_groups[node][nn] = g;
+            tg->numa_ngroup[node].store(nn + 1, butil::memory_order_release);
+        }
+    }
+}
+
+void TaskControl::erase_from_tag_locked(TaskGroup* g) {
+    TaggedGroups* tg = _tagged[g->_tag];
+    erase_group(tg->groups, &tg->ngroup, g);
+    if (g->_numa_node >= 0) {
+        erase_group(tg->numa_groups[g->_numa_node],
+                    &tg->numa_ngroup[g->_numa_node], g);
+    }
+}
+
 void TaskControl::delete_task_group(void* arg) {
     delete(TaskGroup*)arg;
 }
@@ -317,6 +902,19 @@ int TaskControl::_destroy_group(TaskGroup* g) {
                 break;
             }
         }
+        if (erased) {
+            // Same as above.
+            erase_from_tag_locked(g);
+            std::vector<TaskGroup*>& retired = _tagged[g->_tag]->retired;
+            for (size_t i = 0; i < retired.size(); ++i) {
+                if (retired[i] == g) {
+                    retired[i] = retired.back();
+                    retired.pop_back();
+                    _nretired_workers << -1;
+                    break;
+                }
+            }
+        }
     }
 
     // Can't delete g immediately because for performance consideration,
@@ -332,22 +930,54 @@ int TaskControl::_destroy_group(TaskGroup* g) {
     return 0;
 }
 
-bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
-    // 1: Acquiring fence is paired with releasing fence in _add_group to
-    // avoid accessing uninitialized slot of _groups.
-    const size_t ngroup = _ngroup.load(butil::memory_order_acquire/*1*/);
-    if (0 == ngroup) {
+// Steal a batch of tasks from `victim' into `local_rq' which belongs to the
+// calling worker. The first stolen task is returned in `tid'.
+static bool steal_batch(WorkStealingQueue<bthread_t>* victim,
+                        WorkStealingQueue<bthread_t>* local_rq,
+                        bthread_t* tid) {
+    size_t max = std::max(FLAGS_task_group_steal_batch, 1);
+    if (local_rq == NULL || max == 1) {
+        return victim->steal(tid);
+    }
+    // Never steal more than what the local runqueue can hold.
+    const size_t nfree = local_rq->capacity() - local_rq->volatile_size();
+    max = std::min(max, nfree + 1);
+    bthread_t tids[WorkStealingQueue<bthread_t>::MAX_STEAL_BATCH];
+    const size_t n = victim->steal_batch(tids, max);
+    if (n == 0) {
         return false;
     }
+    *tid = tids[0];
+    for (size_t i = 1; i < n; ++i) {
+        // Only the calling worker pushes into local_rq and stealers of it
+        // only make room, so `nfree' above is never overestimated.
+        const bool pushed = local_rq->push(tids[i]);
+        CHECK(pushed) << "Fail to push stolen bthread=" << tids[i];
+    }
+    return true;
+}
 
+bool TaskControl::steal_from_groups(TaskGroup* const* groups, size_t ngroup,
+                                    bthread_t* tid, size_t* seed,
+                                    size_t offset,
+                                    WorkStealingQueue<bthread_t>* local_rq) {
+    if (0 == ngroup) {
+        return false;
+    }
     // NOTE: Don't return inside `for' iteration since we need to update |seed|
     bool stolen = false;
     size_t s = *seed;
     for (size_t i = 0; i < ngroup; ++i, s += offset) {
-        TaskGroup* g = _groups[s % ngroup];
+        TaskGroup* g = groups[s % ngroup];
         // g is possibly NULL because of concurrent _destroy_group
         if (g) {
-            if (g->_rq.steal(tid)) {
+            // Tasks with deadlines go first as they do in the owner.
+            int64_t deadline_us;
+            if (g->_deadline_rq.pop(tid, &deadline_us)) {
+                stolen = true;
+                break;
+            }
+            if (steal_batch(&g->_rq, local_rq, tid)) {
                 stolen = true;
                 break;
             }
@@ -355,13 +985,47 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
                 stolen = true;
                 break;
             }
+            if (g->_overflow_rq.pop(tid)) {
+                stolen = true;
+                break;
+            }
         }
     }
     *seed = s;
     return stolen;
 }
 
-void TaskControl::signal_task(int num_task) {
+bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                             bthread_tag_t tag, int numa_node,
+                             WorkStealingQueue<bthread_t>* local_rq) {
+    // Never steal tasks from groups with other tags.
+    TaggedGroups* tg = _tagged[tag];
+    // 1: Acquiring fence is paired with releasing fence in _add_group to
+    // avoid accessing uninitialized slot of groups.
+    if (numa_node < 0 || numa_node >= _nnuma) {
+        const size_t ngroup = tg->ngroup.load(butil::memory_order_acquire/*1*/);
+        return steal_from_groups(tg->groups, ngroup, tid, seed, offset,
+                                 local_rq);
+    }
+    // Tasks of the local node are likely to touch local memory.
+    size_t ngroup = tg->numa_ngroup[numa_node].load(butil::memory_order_acquire/*1*/);
+    if (steal_from_groups(tg->numa_groups[numa_node], ngroup, tid, seed,
+                          offset, local_rq)) {
+        return true;
+    }
+    for (int i = 1; i < _nnuma; ++i) {
+        const int node = (numa_node + i) % _nnuma;
+        ngroup = tg->numa_ngroup[node].load(butil::memory_order_acquire/*1*/);
+        if (steal_from_groups(tg->numa_groups[node], ngroup, tid, seed,
+                              offset, local_rq)) {
+            _cross_numa_steal << 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskControl::signal_task(int num_task, bthread_tag_t tag) {
     if (num_task <= 0) {
         return;
     }
@@ -372,14 +1036,22 @@ void TaskControl::signal_task(int num_task) {
     if (num_task > 2) {
         num_task = 2;
     }
+    ParkingLot* pl = _tagged[tag]->pl;
     int start_index = butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM;
-    num_task -= _pl[start_index].signal(1);
+    if (_nnuma > 0) {
+        // Wake up workers of the caller's node first.
+        TaskGroup* g = tls_task_group;
+        if (g != NULL && g->_numa_node >= 0) {
+            start_index = g->_numa_node % PARKING_LOT_NUM;
+        }
+    }
+    num_task -= pl[start_index].signal(1);
     if (num_task > 0) {
         for (int i = 1; i < PARKING_LOT_NUM && num_task > 0; ++i) {
             if (++start_index >= PARKING_LOT_NUM) {
                 start_index = 0;
             }
-            num_task -= _pl[start_index].signal(1);
+            num_task -= pl[start_index].signal(1);
         }
     }
     if (num_task > 0 &&
@@ -388,7 +1060,7 @@ void TaskControl::signal_task(int num_task) {
         // TODO: Reduce this lock
         BAIDU_SCOPED_LOCK(g_task_control_mutex);
         if (_concurrency.load(butil::memory_order_acquire) < FLAGS_bthread_concurrency) {
-            add_workers(1);
+            add_workers(1, tag);
         }
     }
 }
@@ -440,12 +1112,53 @@ int64_t TaskControl::get_cumulated_signal_count() {
     for (size_t i = 0; i < ngroup; ++i) {
         TaskGroup* g = _groups[i];
         if (g) {
-            c += g->_nsignaled + g->_remote_nsignaled;
+            c += g->_nsignaled +
+                g->_remote_nsignaled.load(butil::memory_order_relaxed);
+        }
+    }
+    return c;
+}
+
+int64_t TaskControl::get_cumulated_steal_count() {
+    int64_t c = 0;
+    BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
+    for (size_t i = 0; i < ngroup; ++i) {
+        if (_groups[i]) {
+            c += _groups[i]->_nsteal;
         }
     }
     return c;
 }
 
+int64_t TaskControl::get_cumulated_steal_success_count() {
+    int64_t c = 0;
+    BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    const size_t ngroup = _ngroup.load(butil::memory_order_relaxed);
+    for (size_t i = 0; i < ngroup; ++i) {
+        if (_groups[i]) {
+            c += _groups[i]->_nsteal_success;
+        }
+    }
+    return c;
+}
+
+bvar::LatencyRecorder* TaskControl::create_exposed_sched_latency() {
+    bool is_creator = false;
+    _pending_time_mutex.lock();
+    bvar::LatencyRecorder* sl = _sched_latency.load(butil::memory_order_consume);
+    if (!sl) {
+        sl = new bvar::LatencyRecorder;
+        _sched_latency.store(sl, butil::memory_order_release);
+        is_creator = true;
+    }
+    _pending_time_mutex.unlock();
+    if (is_creator) {
+        sl->expose("bthread_sched");
+    }
+    return sl;
+}
+
 bvar::LatencyRecorder* TaskControl::create_exposed_pending_time() {
     bool is_creator = false;
     _pending_time_mutex.lock();
@@ -26,6 +26,10 @@
 #include <iostream>                             // std::ostream
 #endif
 #include <stddef.h>                             // size_t
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
 #include "butil/atomicops.h"                     // butil::atomic
 #include "bvar/bvar.h"                          // bvar::PassiveStatus
 #include "bthread/task_meta.h"                  // TaskMeta
@@ -48,14 +52,22 @@ public:
     // Must be called before using. `nconcurrency' is # of worker pthreads.
     int init(int nconcurrency);
     
-    // Create a TaskGroup in this control.
-    TaskGroup* create_group();
+    // Create a TaskGroup with `tag' in this control. The group runs on
+    // `numa_node' which is -1 when workers are not NUMA-aware.
+    TaskGroup* create_group(bthread_tag_t tag, int numa_node = -1);
 
-    // Steal a task from a "random" group.
-    bool steal_task(bthread_t* tid, size_t* seed, size_t offset);
+    // Steal a task from a "random" group with `tag'. When workers are
+    // NUMA-aware and `numa_node' is not -1, groups on the node are tried
+    // before others. If `local_rq' is not NULL, it must be the runqueue of
+    // the calling worker and up to -task_group_steal_batch tasks are stolen
+    // at once, tasks other than the returned one are pushed into it.
+    bool steal_task(bthread_t* tid, size_t* seed, size_t offset,
+                    bthread_tag_t tag, int numa_node = -1,
+                    WorkStealingQueue<bthread_t>* local_rq = NULL);
 
-    // Tell other groups that `n' tasks was just added to caller's runqueue
-    void signal_task(int num_task);
+    // Tell other groups with `tag' that `n' tasks was just added to
+    // caller's runqueue
+    void signal_task(int num_task, bthread_tag_t tag);
 
     // Stop and join worker threads in TaskControl.
     void stop_and_join();
@@ -64,19 +76,51 @@ public:
     int concurrency() const 
     { return _concurrency.load(butil::memory_order_acquire); }
 
+    // Get # of worker threads with `tag', -1 if the tag is invalid.
+    int concurrency(bthread_tag_t tag) const;
+
+    // Get # of tags, namely -task_group_ntags when this control was inited.
+    int ntags() const { return _ntags; }
+
     void print_rq_sizes(std::ostream& os);
 
     double get_cumulated_worker_time();
     int64_t get_cumulated_switch_count();
     int64_t get_cumulated_signal_count();
+    int64_t get_cumulated_steal_count();
+    int64_t get_cumulated_steal_success_count();
 
-    // [Not thread safe] Add more worker threads.
+    // [Not thread safe] Add more worker threads with `tag', workers are
+    // evenly assigned to all tags if `tag' is BTHREAD_TAG_INVALID.
     // Return the number of workers actually added, which may be less than |num|
-    int add_workers(int num);
+    int add_workers(int num, bthread_tag_t tag = BTHREAD_TAG_INVALID);
+
+    // Choose one TaskGroup with `tag' (randomly right now).
+    // If this method is called after init() with a valid tag, it never
+    // returns NULL.
+    TaskGroup* choose_one_group(bthread_tag_t tag = BTHREAD_TAG_DEFAULT);
+
+    // Choose the TaskGroup with `tag' at index `affinity' modulo number of
+    // groups, so that same `affinity' maps to same group as long as workers
+    // are not added or retired.
+    // Returns NULL if `tag' is invalid.
+    TaskGroup* choose_group_by_affinity(bthread_tag_t tag, uint64_t affinity);
+
+    // Get # of workers with `tag' retired by the autoscaler.
+    int retired_workers(bthread_tag_t tag);
+
+    // Grow or shrink active workers of each tag by one according to load
+    // since last call. Called periodically when -bthread_autoscale is on.
+    void autoscale();
 
-    // Choose one TaskGroup (randomly right now).
-    // If this method is called after init(), it never returns NULL.
-    TaskGroup* choose_one_group();
+    // Report workers running one bthread for longer than
+    // -bthread_watchdog_threshold_ms. `reported' maps groups to the
+    // scheduling time of bthreads reported, each bthread is reported once
+    // until it's scheduled again. Called periodically by the watchdog.
+    void check_stuck_workers(std::map<TaskGroup*, int64_t>* reported);
+
+    // Print recent reports of check_stuck_workers().
+    void print_stuck_workers(std::ostream& os);
 
 private:
     // Add/Remove a TaskGroup.
@@ -84,12 +128,39 @@ private:
     int _add_group(TaskGroup*);
     int _destroy_group(TaskGroup*);
 
+    // Add `g' into groups of its tag. _modify_group_mutex must be locked.
+    void add_to_tag_locked(TaskGroup* g);
+    // Remove `g' from groups of its tag. _modify_group_mutex must be locked.
+    void erase_from_tag_locked(TaskGroup* g);
+
+    // Stop scheduling tasks to `g' and park its worker, or resume it.
+    bool retire_one_worker(bthread_tag_t tag);
+    bool reactivate_one_worker(bthread_tag_t tag);
+
+    static void* autoscaler_thread(void* arg);
+    static void* watchdog_thread(void* arg);
+
     static void delete_task_group(void* arg);
 
+    // Steal a task from groups[0, ngroup) starting at *seed.
+    static bool steal_from_groups(TaskGroup* const* groups, size_t ngroup,
+                                  bthread_t* tid, size_t* seed, size_t offset,
+                                  WorkStealingQueue<bthread_t>* local_rq);
+
+    // Choose the NUMA node for a new worker with `tag' and bind the calling
+    // pthread to cpus of the node. Returns -1 when workers are not
+    // NUMA-aware.
+    int bind_worker_to_numa_node(bthread_tag_t tag);
+
+    struct WorkerArgs;
+    struct TaggedGroups;
+
     static void* worker_thread(void* task_control);
 
     bvar::LatencyRecorder& exposed_pending_time();
     bvar::LatencyRecorder* create_exposed_pending_time();
+    bvar::LatencyRecorder& exposed_sched_latency();
+    bvar::LatencyRecorder* create_exposed_sched_latency();
 
     butil::atomic<size_t> _ngroup;
     TaskGroup** _groups;
@@ -102,17 +173,78 @@ private:
     bvar::Adder<int64_t> _nworkers;
     butil::Mutex _pending_time_mutex;
     butil::atomic<bvar::LatencyRecorder*> _pending_time;
+    butil::atomic<bvar::LatencyRecorder*> _sched_latency;
     bvar::PassiveStatus<double> _cumulated_worker_time;
     bvar::PerSecond<bvar::PassiveStatus<double> > _worker_usage_second;
     bvar::PassiveStatus<int64_t> _cumulated_switch_count;
     bvar::PerSecond<bvar::PassiveStatus<int64_t> > _switch_per_second;
     bvar::PassiveStatus<int64_t> _cumulated_signal_count;
     bvar::PerSecond<bvar::PassiveStatus<int64_t> > _signal_per_second;
+    bvar::PassiveStatus<int64_t> _cumulated_steal_count;
+    bvar::PassiveStatus<int64_t> _cumulated_steal_success_count;
+    bvar::PassiveStatus<double> _steal_success_ratio;
     bvar::PassiveStatus<std::string> _status;
     bvar::Adder<int64_t> _nbthreads;
+    // Tasks pushed into overflow queues since runqueues were full.
+    bvar::Adder<int64_t> _rq_overflow;
 
     static const int PARKING_LOT_NUM = 4;
-    ParkingLot _pl[PARKING_LOT_NUM];
+    static const int MAX_NUMA_NODES = 16;
+    static const int MAX_TAGS = 64;
+
+    // Groups and parking lots of workers with the same tag, tasks are only
+    // stolen from and signaled to groups of the same tag. `groups' is a
+    // subset of _groups, maintained in the same way.
+    // Workers are further partitioned by NUMA nodes when
+    // -bthread_numa_aware is on and the machine has more than one node,
+    // in which case numa_groups[i] is the subset of `groups' on node i.
+    struct TaggedGroups {
+        butil::atomic<size_t> ngroup;
+        TaskGroup** groups;
+        butil::atomic<int> nworker;
+        butil::atomic<int> next_numa_node;
+        // Idle workers busy-polling for tasks now.
+        butil::atomic<int> nbusy_polling;
+        // Groups retired by the autoscaler, which are not in `groups'.
+        // Protected by _modify_group_mutex.
+        std::vector<TaskGroup*> retired;
+        // Accumulated cputime of groups and time of last autoscale().
+        int64_t last_cputime_ns;
+        int64_t last_autoscale_ns;
+        butil::atomic<size_t> numa_ngroup[MAX_NUMA_NODES];
+        TaskGroup** numa_groups[MAX_NUMA_NODES];
+        ParkingLot pl[PARKING_LOT_NUM];
+
+        TaggedGroups();
+        ~TaggedGroups();
+        int init(int nnuma);
+    };
+
+    int _ntags;
+    butil::atomic<int> _next_worker_tag;
+    TaggedGroups* _tagged[MAX_TAGS];
+
+    // 0 when workers are not NUMA-aware.
+    int _nnuma;
+    std::vector<std::vector<int> > _numa_cpus;
+    bvar::Adder<int64_t> _cross_numa_steal;
+    bvar::PerSecond<bvar::Adder<int64_t> > _cross_numa_steal_second;
+
+    // Microseconds spent by idle workers on busy-polling.
+    bvar::Adder<int64_t> _busy_poll_us;
+    bvar::PerSecond<bvar::Adder<int64_t> > _busy_poll_us_second;
+    // Microseconds from signalling a task to an idle worker getting it.
+    bvar::LatencyRecorder _wakeup_latency;
+
+    bool _has_autoscaler;
+    pthread_t _autoscaler;
+    bvar::Adder<int64_t> _nretired_workers;
+
+    bool _has_watchdog;
+    pthread_t _watchdog;
+    bvar::Adder<int64_t> _nstuck_workers;
+    butil::Mutex _stuck_mutex;
+    std::deque<std::string> _stuck_reports;
 };
 
 inline bvar::LatencyRecorder& TaskControl::exposed_pending_time() {
@@ -123,6 +255,14 @@ inline bvar::LatencyRecorder& TaskControl::exposed_pending_time() {
     return *pt;
 }
 
+inline bvar::LatencyRecorder& TaskControl::exposed_sched_latency() {
+    bvar::LatencyRecorder* sl = _sched_latency.load(butil::memory_order_consume);
+    if (!sl) {
+        sl = create_exposed_sched_latency();
+    }
+    return *sl;
+}
+
 }  // namespace bthread
 
 #endif  // BTHREAD_TASK_CONTROL_H
@@ -28,6 +28,7 @@
 #include "butil/fast_rand.h"
 #include "butil/unique_ptr.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h" // fmix64
+#include "butil/usdt.h"                     // BUTIL_USDT3
 #include "bthread/errno.h"                  // ESTOP
 #include "bthread/butex.h"                  // butex_*
 #include "bthread/sys_futex.h"              // futex_wake_private
@@ -40,7 +41,7 @@
 namespace bthread {
 
 static const bthread_attr_t BTHREAD_ATTR_TASKGROUP = {
-    BTHREAD_STACKTYPE_UNKNOWN, 0, NULL };
+    BTHREAD_STACKTYPE_UNKNOWN, 0, NULL, BTHREAD_TAG_INVALID, 0 };
 
 static bool pass_bool(const char*, bool) { return true; }
 
@@ -51,12 +52,37 @@ const bool ALLOW_UNUSED dummy_show_bthread_creation_in_vars =
     ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_show_bthread_creation_in_vars,
                                     pass_bool);
 
+DEFINE_bool(show_bthread_sched_latency_in_vars, false,
+            "When this flags is on, the time from a bthread being pushed "
+            "into a runqueue to running will be recorded and shown in "
+            "/vars/bthread_sched_*");
+const bool ALLOW_UNUSED dummy_show_bthread_sched_latency_in_vars =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_show_bthread_sched_latency_in_vars,
+                                    pass_bool);
+
 DEFINE_bool(show_per_worker_usage_in_vars, false,
             "Show per-worker usage in /vars/bthread_per_worker_usage_<tid>");
 const bool ALLOW_UNUSED dummy_show_per_worker_usage_in_vars =
     ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_show_per_worker_usage_in_vars,
                                     pass_bool);
 
+static bool pass_int32(const char*, int32_t) { return true; }
+
+DEFINE_int32(bthread_busy_poll_workers, 0,
+             "Max number of idle workers of each tag that keep polling for "
+             "tasks before parking, which trades cpu for lower latency of "
+             "waking up workers. 0 disables busy-polling");
+const bool ALLOW_UNUSED dummy_bthread_busy_poll_workers =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_busy_poll_workers,
+                                    pass_int32);
+
+DEFINE_int32(bthread_busy_poll_us, 50,
+             "Max microseconds that an idle worker busy-polls for tasks "
+             "before parking, see -bthread_busy_poll_workers");
+const bool ALLOW_UNUSED dummy_bthread_busy_poll_us =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bthread_busy_poll_us,
+                                    pass_int32);
+
 __thread TaskGroup* tls_task_group = NULL;
 // Sync with TaskMeta::local_storage when a bthread is created or destroyed.
 // During running, the two fields may be inconsistent, use tls_bls as the
@@ -115,14 +141,94 @@ bool TaskGroup::is_stopped(bthread_t tid) {
     return true;
 }
 
+void TaskGroup::record_wakeup_latency(int64_t since_ns, int64_t now_ns) {
+    const int64_t signal_ns = _pl->last_signal_ns();
+    // Tasks got without a signal after `since_ns' were pushed with
+    // nosignal or signalled to other parking lots, skip them.
+    if (signal_ns > since_ns && now_ns > signal_ns) {
+        _control->_wakeup_latency << (now_ns - signal_ns) / 1000;
+    }
+}
+
+bool TaskGroup::busy_poll_task(bthread_t* tid) {
+    const int max_workers = FLAGS_bthread_busy_poll_workers;
+    const int poll_us = FLAGS_bthread_busy_poll_us;
+    if (max_workers <= 0 || poll_us <= 0) {
+        return false;
+    }
+    butil::atomic<int>& npolling = _control->_tagged[_tag]->nbusy_polling;
+    if (npolling.fetch_add(1, butil::memory_order_relaxed) >= max_workers) {
+        npolling.fetch_sub(1, butil::memory_order_relaxed);
+        return false;
+    }
+    const int64_t start_ns = butil::cpuwide_time_ns();
+    const int64_t deadline_ns = start_ns + poll_us * 1000L;
+    int64_t now_ns = start_ns;
+    bool found = false;
+    while (!_pl->get_state().stopped()) {
+        if (steal_task(tid)) {
+            found = true;
+            now_ns = butil::cpuwide_time_ns();
+            break;
+        }
+        cpu_relax();
+        now_ns = butil::cpuwide_time_ns();
+        if (now_ns >= deadline_ns) {
+            break;
+        }
+    }
+    npolling.fetch_sub(1, butil::memory_order_relaxed);
+    _control->_busy_poll_us << (now_ns - start_ns) / 1000;
+    if (found) {
+        record_wakeup_latency(start_ns, now_ns);
+    }
+    return found;
+}
+
+bool TaskGroup::wait_until_reactivated() {
+    while (_retired.load(butil::memory_order_acquire)) {
+        if (_pl->get_state().stopped()) {
+            return false;
+        }
+        // The group may be chosen by remote pushers just before it's
+        // erased from the tag.
+        bthread_t tid;
+        int64_t deadline_us;
+        while (_remote_rq.pop(&tid) || _deadline_rq.pop(&tid, &deadline_us)) {
+            TaskGroup* g = _control->choose_one_group(_tag);
+            if (g == NULL || g == this) {
+                return false;
+            }
+            g->ready_to_run_remote(tid);
+        }
+        // Wake up periodically to move late pushes.
+        const timespec timeout = butil::milliseconds_to_timespec(100);
+        futex_wait_private(&_retired, 1, &timeout);
+    }
+    return true;
+}
+
 bool TaskGroup::wait_task(bthread_t* tid) {
     do {
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         if (_last_pl_state.stopped()) {
             return false;
         }
+        if (_retired.load(butil::memory_order_relaxed)) {
+            if (!wait_until_reactivated()) {
+                return false;
+            }
+            continue;
+        }
+        // Polling updates _last_pl_state, signals after the last steal
+        // still wake up wait() below.
+        if (busy_poll_task(tid)) {
+            return true;
+        }
+        const int64_t wait_start_ns = butil::cpuwide_time_ns();
         _pl->wait(_last_pl_state);
         if (steal_task(tid)) {
+            record_wakeup_latency(wait_start_ns, butil::cpuwide_time_ns());
             return true;
         }
 #else
@@ -130,10 +236,24 @@ bool TaskGroup::wait_task(bthread_t* tid) {
         if (st.stopped()) {
             return false;
         }
+        if (_retired.load(butil::memory_order_relaxed)) {
+            if (!wait_until_reactivated()) {
+                return false;
+            }
+            continue;
+        }
         if (steal_task(tid)) {
             return true;
         }
+        if (busy_poll_task(tid)) {
+            return true;
+        }
+        const int64_t wait_start_ns = butil::cpuwide_time_ns();
         _pl->wait(st);
+        if (steal_task(tid)) {
+            record_wakeup_latency(wait_start_ns, butil::cpuwide_time_ns());
+            return true;
+        }
 #endif
     } while (true);
 }
@@ -142,10 +262,15 @@ static double get_cumulated_cputime_from_this(void* arg) {
     return static_cast<TaskGroup*>(arg)->cumulated_cputime_ns() / 1000000000.0;
 }
 
+static int64_t get_rq_size_from_this(void* arg) {
+    return static_cast<TaskGroup*>(arg)->rq_size();
+}
+
 void TaskGroup::run_main_task() {
     bvar::PassiveStatus<double> cumulated_cputime(
         get_cumulated_cputime_from_this, this);
     std::unique_ptr<bvar::PerSecond<bvar::PassiveStatus<double> > > usage_bvar;
+    std::unique_ptr<bvar::PassiveStatus<int64_t> > rq_size_bvar;
 
     TaskGroup* dummy = this;
     bthread_t tid;
@@ -158,15 +283,22 @@ void TaskGroup::run_main_task() {
         }
         if (FLAGS_show_per_worker_usage_in_vars && !usage_bvar) {
             char name[32];
+            char rq_name[40];
 #if defined(OS_MACOSX)
             snprintf(name, sizeof(name), "bthread_worker_usage_%" PRIu64,
                      pthread_numeric_id());
+            snprintf(rq_name, sizeof(rq_name), "bthread_worker_rq_size_%" PRIu64,
+                     pthread_numeric_id());
 #else
             snprintf(name, sizeof(name), "bthread_worker_usage_%ld",
                      (long)syscall(SYS_gettid));
+            snprintf(rq_name, sizeof(rq_name), "bthread_worker_rq_size_%ld",
+                     (long)syscall(SYS_gettid));
 #endif
             usage_bvar.reset(new bvar::PerSecond<bvar::PassiveStatus<double> >
                              (name, &cumulated_cputime, 1));
+            rq_size_bvar.reset(new bvar::PassiveStatus<int64_t>(
+                rq_name, get_rq_size_from_this, this));
         }
     }
     // Don't forget to add elapse of last wait_task.
@@ -185,17 +317,23 @@ TaskGroup::TaskGroup(TaskControl* c)
     , _last_run_ns(butil::cpuwide_time_ns())
     , _cumulated_cputime_ns(0)
     , _nswitch(0)
+    , _nsteal(0)
+    , _nsteal_success(0)
     , _last_context_remained(NULL)
     , _last_context_remained_arg(NULL)
     , _pl(NULL)
+    , _tag(BTHREAD_TAG_DEFAULT)
+    , _numa_node(-1)
     , _main_stack(NULL)
     , _main_tid(0)
+    , _worker_pthread(0)
+    , _ndeadline_popped(0)
     , _remote_num_nosignal(0)
     , _remote_nsignaled(0)
+    , _retired(0)
 {
     _steal_seed = butil::fast_rand();
     _steal_offset = OFFSET_TABLE[_steal_seed % ARRAY_SIZE(OFFSET_TABLE)];
-    _pl = &c->_pl[butil::fmix64(pthread_numeric_id()) % TaskControl::PARKING_LOT_NUM];
     CHECK(c);
 }
 
@@ -209,12 +347,16 @@ TaskGroup::~TaskGroup() {
     }
 }
 
-int TaskGroup::init(size_t runqueue_capacity) {
+int TaskGroup::init(size_t runqueue_capacity,
+                    size_t remote_runqueue_capacity) {
     if (_rq.init(runqueue_capacity) != 0) {
         LOG(FATAL) << "Fail to init _rq";
         return -1;
     }
-    if (_remote_rq.init(runqueue_capacity / 2) != 0) {
+    if (remote_runqueue_capacity == 0) {
+        remote_runqueue_capacity = runqueue_capacity / 2;
+    }
+    if (_remote_rq.init(remote_runqueue_capacity) != 0) {
         LOG(FATAL) << "Fail to init _remote_rq";
         return -1;
     }
@@ -236,14 +378,17 @@ int TaskGroup::init(size_t runqueue_capacity) {
     m->arg = NULL;
     m->local_storage = LOCAL_STORAGE_INIT;
     m->cpuwide_start_ns = butil::cpuwide_time_ns();
+    m->cpuwide_ready_ns = 0;
     m->stat = EMPTY_STAT;
     m->attr = BTHREAD_ATTR_TASKGROUP;
+    m->attr.tag = _tag;
     m->tid = make_tid(*m->version_butex, slot);
     m->set_stack(stk);
 
     _cur_meta = m;
     _main_tid = m->tid;
     _main_stack = stk;
+    _worker_pthread = pthread_self();
     _last_run_ns = butil::cpuwide_time_ns();
     return 0;
 }
@@ -378,8 +523,11 @@ int TaskGroup::start_foreground(TaskGroup** pg,
     m->arg = arg;
     CHECK(m->stack == NULL);
     m->attr = using_attr;
+    // The new task runs in the same group as the caller.
+    m->attr.tag = (*pg)->_tag;
     m->local_storage = LOCAL_STORAGE_INIT;
     m->cpuwide_start_ns = start_ns;
+    m->cpuwide_ready_ns = 0;
     m->stat = EMPTY_STAT;
     m->tid = make_tid(*m->version_butex, slot);
     *th = m->tid;
@@ -433,8 +581,10 @@ int TaskGroup::start_background(bthread_t* __restrict th,
     m->arg = arg;
     CHECK(m->stack == NULL);
     m->attr = using_attr;
+    m->attr.tag = _tag;
     m->local_storage = LOCAL_STORAGE_INIT;
     m->cpuwide_start_ns = start_ns;
+    m->cpuwide_ready_ns = 0;
     m->stat = EMPTY_STAT;
     m->tid = make_tid(*m->version_butex, slot);
     *th = m->tid;
@@ -512,9 +662,11 @@ void TaskGroup::ending_sched(TaskGroup** pg) {
     // When BTHREAD_FAIR_WSQ is defined, profiling shows that cpu cost of
     // WSQ::steal() in example/multi_threaded_echo_c++ changes from 1.9%
     // to 2.9%
-    const bool popped = g->_rq.pop(&next_tid);
+    const bool popped = g->pop_deadline_task(&next_tid) ||
+        g->_rq.pop(&next_tid);
 #else
-    const bool popped = g->_rq.steal(&next_tid);
+    const bool popped = g->pop_deadline_task(&next_tid) ||
+        g->_rq.steal(&next_tid);
 #endif
     if (!popped && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
@@ -550,9 +702,11 @@ void TaskGroup::sched(TaskGroup** pg) {
     bthread_t next_tid = 0;
     // Find next task to run, if none, switch to idle thread of the group.
 #ifndef BTHREAD_FAIR_WSQ
-    const bool popped = g->_rq.pop(&next_tid);
+    const bool popped = g->pop_deadline_task(&next_tid) ||
+        g->_rq.pop(&next_tid);
 #else
-    const bool popped = g->_rq.steal(&next_tid);
+    const bool popped = g->pop_deadline_task(&next_tid) ||
+        g->_rq.steal(&next_tid);
 #endif
     if (!popped && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
@@ -585,6 +739,11 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta) {
     ++ g->_nswitch;
     // Switch to the task
     if (__builtin_expect(next_meta != cur_meta, 1)) {
+        if (next_meta->cpuwide_ready_ns) {
+            g->_control->exposed_sched_latency() <<
+                (now - next_meta->cpuwide_ready_ns) / 1000L;
+            next_meta->cpuwide_ready_ns = 0;
+        }
         g->_cur_meta = next_meta;
         // Switch tls_bls
         cur_meta->local_storage = tls_bls;
@@ -597,6 +756,10 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta) {
             LOG(INFO) << "Switch bthread: " << cur_meta->tid << " -> "
                       << next_meta->tid;
         }
+        // The current bthread is switched out after running for `elp_ns'
+        // and `next' is switched in.
+        BUTIL_USDT3(bthread, context_switch, cur_meta->tid, next_meta->tid,
+                    elp_ns);
 
         if (cur_meta->stack != NULL) {
             if (next_meta->stack != cur_meta->stack) {
@@ -643,7 +806,17 @@ void TaskGroup::destroy_self() {
     }
 }
 
+static void mark_ready(bthread_t tid) {
+    if (FLAGS_show_bthread_sched_latency_in_vars) {
+        TaskMeta* m = TaskGroup::address_meta(tid);
+        if (m) {
+            m->cpuwide_ready_ns = butil::cpuwide_time_ns();
+        }
+    }
+}
+
 void TaskGroup::ready_to_run(bthread_t tid, bool nosignal) {
+    mark_ready(tid);
     push_rq(tid);
     if (nosignal) {
         ++_num_nosignal;
@@ -651,7 +824,7 @@ void TaskGroup::ready_to_run(bthread_t tid, bool nosignal) {
         const int additional_signal = _num_nosignal;
         _num_nosignal = 0;
         _nsignaled += 1 + additional_signal;
-        _control->signal_task(1 + additional_signal);
+        _control->signal_task(1 + additional_signal, _tag);
     }
 }
 
@@ -660,41 +833,29 @@ void TaskGroup::flush_nosignal_tasks() {
     if (val) {
         _num_nosignal = 0;
         _nsignaled += val;
-        _control->signal_task(val);
+        _control->signal_task(val, _tag);
     }
 }
 
 void TaskGroup::ready_to_run_remote(bthread_t tid, bool nosignal) {
-    _remote_rq._mutex.lock();
-    while (!_remote_rq.push_locked(tid)) {
-        flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
+    mark_ready(tid);
+    while (!push_deadline_rq(tid) && !_remote_rq.push(tid)) {
+        // Never drop the task, wake up workers to consume the queue.
+        flush_nosignal_tasks_remote();
         LOG_EVERY_SECOND(ERROR) << "_remote_rq is full, capacity="
                                 << _remote_rq.capacity();
         ::usleep(1000);
-        _remote_rq._mutex.lock();
     }
     if (nosignal) {
-        ++_remote_num_nosignal;
-        _remote_rq._mutex.unlock();
+        _remote_num_nosignal.fetch_add(1, butil::memory_order_relaxed);
     } else {
-        const int additional_signal = _remote_num_nosignal;
-        _remote_num_nosignal = 0;
-        _remote_nsignaled += 1 + additional_signal;
-        _remote_rq._mutex.unlock();
-        _control->signal_task(1 + additional_signal);
-    }
-}
-
-void TaskGroup::flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex) {
-    const int val = _remote_num_nosignal;
-    if (!val) {
-        locked_mutex.unlock();
-        return;
+        // Signal tasks pushed with nosignal before in one batch.
+        const int additional_signal =
+            _remote_num_nosignal.exchange(0, butil::memory_order_relaxed);
+        _remote_nsignaled.fetch_add(1 + additional_signal,
+                                    butil::memory_order_relaxed);
+        _control->signal_task(1 + additional_signal, _tag);
     }
-    _remote_num_nosignal = 0;
-    _remote_nsignaled += val;
-    locked_mutex.unlock();
-    _control->signal_task(val);
 }
 
 void TaskGroup::ready_to_run_general(bthread_t tid, bool nosignal) {
@@ -731,7 +892,8 @@ struct SleepArgs {
 static void ready_to_run_from_timer_thread(void* arg) {
     CHECK(tls_task_group == NULL);
     const SleepArgs* e = static_cast<const SleepArgs*>(arg);
-    e->group->control()->choose_one_group()->ready_to_run_remote(e->tid);
+    e->group->control()->choose_one_group(e->group->tag())
+        ->ready_to_run_remote(e->tid);
 }
 
 void TaskGroup::_add_sleep_event(void* void_args) {
@@ -777,6 +939,22 @@ void TaskGroup::_add_sleep_event(void* void_args) {
 }
 
 // To be consistent with sys_usleep, set errno and return -1 on error.
+// Defined in mutex.cpp
+size_t offcpu_sampling_range();
+void submit_offcpu_sample(size_t sampling_range, int64_t duration_ns,
+                          int64_t now_ns);
+
+void TaskGroup::park(TaskGroup** pg) {
+    const size_t sampling_range = offcpu_sampling_range();
+    if (!sampling_range) {
+        return sched(pg);
+    }
+    const int64_t begin_ns = butil::cpuwide_time_ns();
+    sched(pg);
+    const int64_t end_ns = butil::cpuwide_time_ns();
+    submit_offcpu_sample(sampling_range, end_ns - begin_ns, end_ns);
+}
+
 int TaskGroup::usleep(TaskGroup** pg, uint64_t timeout_us) {
     if (0 == timeout_us) {
         yield(pg);
@@ -787,7 +965,7 @@ int TaskGroup::usleep(TaskGroup** pg, uint64_t timeout_us) {
     // the timer may wake up(jump to) current still-running context.
     SleepArgs e = { timeout_us, g->current_tid(), g->current_task(), g };
     g->set_remained(_add_sleep_event, &e);
-    sched(pg);
+    park(pg);
     g = *pg;
     e.meta->current_sleep = 0;
     if (e.meta->interrupted) {
@@ -867,14 +1045,16 @@ int TaskGroup::interrupt(bthread_t tid, TaskControl* c) {
         }
     } else if (sleep_id != 0) {
         if (get_global_timer_thread()->unschedule(sleep_id) == 0) {
+            // The sleeping bthread must be resumed by a group of its tag.
+            const bthread_tag_t tag = address_meta(tid)->attr.tag;
             bthread::TaskGroup* g = bthread::tls_task_group;
-            if (g) {
+            if (g && g->tag() == tag) {
                 g->ready_to_run(tid);
             } else {
                 if (!c) {
                     return EINVAL;
                 }
-                c->choose_one_group()->ready_to_run_remote(tid);
+                c->choose_one_group(tag)->ready_to_run_remote(tid);
             }
         }
     }
@@ -27,6 +27,8 @@
 #include "bthread/task_meta.h"                     // bthread_t, TaskMeta
 #include "bthread/work_stealing_queue.h"           // WorkStealingQueue
 #include "bthread/remote_task_queue.h"             // RemoteTaskQueue
+#include "bthread/overflow_task_queue.h"           // OverflowTaskQueue
+#include "bthread/deadline_task_queue.h"           // DeadlineTaskQueue
 #include "butil/resource_pool.h"                    // ResourceId
 #include "bthread/parking_lot.h"
 
@@ -76,6 +78,11 @@ public:
 
     // Suspend caller and run next bthread in TaskGroup *pg.
     static void sched(TaskGroup** pg);
+
+    // Same as sched(), called by bthreads waiting for something (butex,
+    // timer) rather than yielding, the wait may be sampled by the off-cpu
+    // profiler.
+    static void park(TaskGroup** pg);
     static void ending_sched(TaskGroup** pg);
 
     // Suspend caller and run bthread `next_tid' in TaskGroup *pg.
@@ -150,6 +157,17 @@ public:
     // Active time in nanoseconds spent by this TaskGroup.
     int64_t cumulated_cputime_ns() const { return _cumulated_cputime_ns; }
 
+    // cpuwide time when current task was scheduled to run.
+    int64_t last_run_ns() const { return _last_run_ns; }
+
+    // The pthread running run_main_task().
+    pthread_t worker_pthread() const { return _worker_pthread; }
+
+    // Number of tasks in the local runqueue, not accurate.
+    int64_t rq_size() const
+    { return _rq.volatile_size() + _overflow_rq.volatile_size() +
+            _deadline_rq.volatile_size(); }
+
     // Push a bthread into the runqueue
     void ready_to_run(bthread_t tid, bool nosignal = false);
     // Flush tasks pushed to rq but signalled.
@@ -157,7 +175,6 @@ public:
 
     // Push a bthread into the runqueue from another non-worker thread.
     void ready_to_run_remote(bthread_t tid, bool nosignal = false);
-    void flush_nosignal_tasks_remote_locked(butil::Mutex& locked_mutex);
     void flush_nosignal_tasks_remote();
 
     // Automatically decide the caller is remote or local, and call
@@ -168,6 +185,9 @@ public:
     // The TaskControl that this TaskGroup belongs to.
     TaskControl* control() const { return _control; }
 
+    // Tag of the worker running this group, see bthread_tag_t.
+    bthread_tag_t tag() const { return _tag; }
+
     // Call this instead of delete.
     void destroy_self();
 
@@ -178,8 +198,8 @@ public:
     // Get the meta associate with the task.
     static TaskMeta* address_meta(bthread_t tid);
 
-    // Push a task into _rq, if _rq is full, retry after some time. This
-    // process make go on indefinitely.
+    // Push a task into _deadline_rq if it has a deadline not reached yet,
+    // otherwise into _rq, or _overflow_rq if _rq is full. Never blocks.
     void push_rq(bthread_t tid);
 
 private:
@@ -188,7 +208,9 @@ friend class TaskControl;
     // You shall use TaskControl::create_group to create new instance.
     explicit TaskGroup(TaskControl*);
 
-    int init(size_t runqueue_capacity);
+    // Capacity of the remote runqueue is half of `runqueue_capacity' when
+    // `remote_runqueue_capacity' is 0.
+    int init(size_t runqueue_capacity, size_t remote_runqueue_capacity = 0);
 
     // You shall call destroy_self() instead of destructor because deletion
     // of groups are postponed to avoid race.
@@ -211,14 +233,48 @@ friend class TaskControl;
     // loop calling this function should end.
     bool wait_task(bthread_t* tid);
 
+    // Keep stealing tasks for at most -bthread_busy_poll_us before parking
+    // if less than -bthread_busy_poll_workers workers of the tag are doing
+    // so. Returns true if a task is got.
+    bool busy_poll_task(bthread_t* tid);
+
+    // Park the retired worker until it's reactivated by the autoscaler,
+    // moving tasks pushed into _remote_rq meanwhile to active groups.
+    // Returns false if the control is stopped.
+    bool wait_until_reactivated();
+
+    // Record latency from the last signal after `since_ns' to `now_ns'.
+    void record_wakeup_latency(int64_t since_ns, int64_t now_ns);
+
+    // Push `tid' into _deadline_rq if it has a deadline not reached yet.
+    // Returns false if it's not pushed.
+    bool push_deadline_rq(bthread_t tid);
+
+    // Pop the task with the earliest deadline not reached yet. Returns
+    // false after popping a batch of tasks in a row when _rq is not empty,
+    // so that tasks without deadlines are not starved.
+    bool pop_deadline_task(bthread_t* tid);
+
     bool steal_task(bthread_t* tid) {
+        if (pop_deadline_task(tid)) {
+            return true;
+        }
         if (_remote_rq.pop(tid)) {
             return true;
         }
+        if (_overflow_rq.pop(tid)) {
+            return true;
+        }
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         _last_pl_state = _pl->get_state();
 #endif
-        return _control->steal_task(tid, &_steal_seed, _steal_offset);
+        ++_nsteal;
+        if (_control->steal_task(tid, &_steal_seed, _steal_offset,
+                                 _tag, _numa_node, &_rq)) {
+            ++_nsteal_success;
+            return true;
+        }
+        return false;
     }
 
 #ifndef NDEBUG
@@ -236,6 +292,9 @@ friend class TaskControl;
     int64_t _cumulated_cputime_ns;
 
     size_t _nswitch;
+    // Attempts of stealing tasks from other groups and successful ones.
+    int64_t _nsteal;
+    int64_t _nsteal_success;
     RemainedFn _last_context_remained;
     void* _last_context_remained_arg;
 
@@ -245,12 +304,24 @@ friend class TaskControl;
 #endif
     size_t _steal_seed;
     size_t _steal_offset;
+    bthread_tag_t _tag;
+    // NUMA node that the worker is bound to, -1 when not NUMA-aware.
+    int _numa_node;
     ContextualStack* _main_stack;
     bthread_t _main_tid;
+    pthread_t _worker_pthread;
     WorkStealingQueue<bthread_t> _rq;
     RemoteTaskQueue _remote_rq;
-    int _remote_num_nosignal;
-    int _remote_nsignaled;
+    // Tasks pushed when _rq is full, drained by this group and stealers.
+    OverflowTaskQueue _overflow_rq;
+    // Ready tasks with deadlines, run before tasks in other queues.
+    DeadlineTaskQueue _deadline_rq;
+    // Tasks popped from _deadline_rq in a row.
+    int _ndeadline_popped;
+    butil::atomic<int> _remote_num_nosignal;
+    butil::atomic<int> _remote_nsignaled;
+    // 1 when the group is retired by the autoscaler, waited as a futex.
+    butil::atomic<int> _retired;
 };
 
 }  // namespace bthread
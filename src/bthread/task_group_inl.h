@@ -78,29 +78,72 @@ inline void TaskGroup::sched_to(TaskGroup** pg, bthread_t next_tid) {
     sched_to(pg, next_meta);
 }
 
+inline bool TaskGroup::push_deadline_rq(bthread_t tid) {
+    const int64_t deadline_us = address_meta(tid)->attr.deadline_us;
+    if (deadline_us <= 0) {
+        return false;
+    }
+    // Tasks already missing deadlines are put into normal queues, so that
+    // tasks still able to meet deadlines run first under overload.
+    if (deadline_us <= butil::gettimeofday_us()) {
+        return false;
+    }
+    return _deadline_rq.push(tid, deadline_us);
+}
+
+inline bool TaskGroup::pop_deadline_task(bthread_t* tid) {
+    // Deadline-first in batches, check _rq once per batch.
+    static const int DEADLINE_POP_BATCH = 16;
+    if (_deadline_rq.volatile_size() == 0) {
+        return false;
+    }
+    if (_ndeadline_popped >= DEADLINE_POP_BATCH &&
+        _rq.volatile_size() != 0) {
+        _ndeadline_popped = 0;
+        return false;
+    }
+    int64_t deadline_us = 0;
+    int64_t now_us = 0;
+    while (_deadline_rq.pop(tid, &deadline_us)) {
+        if (now_us == 0) {
+            now_us = butil::gettimeofday_us();
+        }
+        if (deadline_us > now_us) {
+            ++_ndeadline_popped;
+            return true;
+        }
+        // Missed the deadline while waiting, run it after other tasks.
+        if (__builtin_expect(!_rq.push(*tid), 0)) {
+            _overflow_rq.push(*tid);
+            _control->_rq_overflow << 1;
+        }
+    }
+    _ndeadline_popped = 0;
+    return false;
+}
+
 inline void TaskGroup::push_rq(bthread_t tid) {
-    while (!_rq.push(tid)) {
-        // Created too many bthreads: a promising approach is to insert the
-        // task into another TaskGroup, but we don't use it because:
-        // * There're already many bthreads to run, inserting the bthread
-        //   into other TaskGroup does not help.
-        // * Insertions into other TaskGroups perform worse when all workers
-        //   are busy at creating bthreads (proved by test_input_messenger in
-        //   brpc)
-        flush_nosignal_tasks();
-        LOG_EVERY_SECOND(ERROR) << "_rq is full, capacity=" << _rq.capacity();
-        // TODO(gejun): May cause deadlock when all workers are spinning here.
-        // A better solution is to pop and run existing bthreads, however which
-        // make set_remained()-callbacks do context switches and need extensive
-        // reviews on related code.
-        ::usleep(1000);
+    if (push_deadline_rq(tid)) {
+        return;
+    }
+    if (__builtin_expect(!_rq.push(tid), 0)) {
+        // Created too many bthreads, e.g. one request fans out to thousands
+        // of bthreads. Sleeping until _rq has room stalls the creator and
+        // may deadlock when all workers are doing so, spill the task to
+        // _overflow_rq which is drained by this group and stealers instead.
+        _overflow_rq.push(tid);
+        _control->_rq_overflow << 1;
     }
 }
 
 inline void TaskGroup::flush_nosignal_tasks_remote() {
-    if (_remote_num_nosignal) {
-        _remote_rq._mutex.lock();
-        flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
+    if (_remote_num_nosignal.load(butil::memory_order_relaxed)) {
+        const int val =
+            _remote_num_nosignal.exchange(0, butil::memory_order_relaxed);
+        if (val) {
+            _remote_nsignaled.fetch_add(val, butil::memory_order_relaxed);
+            _control->signal_task(val, _tag);
+        }
     }
 }
 
@@ -38,13 +38,16 @@ struct TaskStatistics {
 class KeyTable;
 struct ButexWaiter;
 
+// Number of fixed-index slots in LocalStorage, see bthread/inline_local.h
+static const int INLINE_LOCAL_SLOT_COUNT = 5;
+
 struct LocalStorage {
     KeyTable* keytable;
     void* assigned_data;
-    void* rpcz_parent_span;
+    void* inline_slots[INLINE_LOCAL_SLOT_COUNT];
 };
 
-#define BTHREAD_LOCAL_STORAGE_INITIALIZER { NULL, NULL, NULL }
+#define BTHREAD_LOCAL_STORAGE_INITIALIZER { NULL, NULL, { NULL } }
 
 const static LocalStorage LOCAL_STORAGE_INIT = BTHREAD_LOCAL_STORAGE_INITIALIZER;
 
@@ -84,6 +87,8 @@ struct TaskMeta {
     
     // Statistics
     int64_t cpuwide_start_ns;
+    // When the task was pushed into a runqueue, 0 if it's not recorded.
+    int64_t cpuwide_ready_ns;
     TaskStatistics stat;
 
     // bthread local storage, sync with tls_bls (defined in task_group.cpp)
@@ -19,6 +19,7 @@
 
 
 #include <queue>                           // heap functions
+#include <string.h>                        // memset
 #include "butil/scoped_lock.h"
 #include "butil/logging.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h"   // fmix64
@@ -310,6 +311,138 @@ static T deref_value(void* arg) {
     return *(T*)arg;
 }
 
+// Hierarchical timing wheel of tasks pulled from buckets, only accessed by
+// the timer thread. Adding a task into a slot is O(1) no matter how far the
+// run time is, tasks in distant slots are moved towards lower levels when
+// the time approaches. Tasks of the current tick are kept in a small min
+// heap so that they still run at precise time. Unscheduled tasks are
+// deleted whenever they're moved, most RPC timeouts are unscheduled before
+// expiration and never reach the heap.
+class TimingWheel {
+public:
+    typedef TimerThread::Task Task;
+    static const int64_t TICK_US = 1000;
+    static const int LEVEL_BITS = 8;
+    static const int NLEVEL = 4;
+    static const int64_t NSLOT = 1L << LEVEL_BITS;
+    static const int64_t SLOT_MASK = NSLOT - 1;
+    // Tasks further than this are put in the last slot of the top level
+    // and re-added when the slot is reached.
+    static const int64_t MAX_TICKS = (1L << (LEVEL_BITS * NLEVEL)) - 1;
+
+    explicit TimingWheel(int64_t now_us)
+        : _cur_tick(now_us / TICK_US), _nwheel(0) {
+        memset(_slots, 0, sizeof(_slots));
+        _heap.reserve(4096);
+    }
+
+    // Add a task which is not unscheduled.
+    void add(Task* task) {
+        const int64_t tick = task->run_time / TICK_US;
+        if (tick < _cur_tick) {
+            push_heap(task);
+        } else {
+            add_to_wheel(task, tick);
+        }
+    }
+
+    // Move tasks of ticks until `now_us' into the heap.
+    void advance(int64_t now_us) {
+        const int64_t now_tick = now_us / TICK_US;
+        if (_nwheel == 0) {
+            _cur_tick = std::max(_cur_tick, now_tick + 1);
+            return;
+        }
+        for (; _cur_tick <= now_tick; ++_cur_tick) {
+            const int64_t index = _cur_tick & SLOT_MASK;
+            if (index == 0) {
+                // Lower levels wrapped around, cascade upper levels.
+                for (int level = 1; level < NLEVEL; ++level) {
+                    const int64_t i =
+                        (_cur_tick >> (LEVEL_BITS * level)) & SLOT_MASK;
+                    cascade(level, i);
+                    if (i != 0) {
+                        break;
+                    }
+                }
+            }
+            Task* p = _slots[0][index];
+            _slots[0][index] = NULL;
+            while (p) {
+                Task* next_task = p->next;
+                --_nwheel;
+                if (!p->try_delete()) {
+                    push_heap(p);
+                }
+                p = next_task;
+            }
+        }
+    }
+
+    // Number of tasks in the wheel and the heap.
+    size_t size() const { return _nwheel + _heap.size(); }
+
+    // The earliest task to run, NULL if the heap is empty.
+    Task* top() const { return _heap.empty() ? NULL : _heap[0]; }
+
+    void pop() {
+        std::pop_heap(_heap.begin(), _heap.end(), task_greater);
+        _heap.pop_back();
+    }
+
+    // Realtime when advance() should be called next, max if no tasks are
+    // in the wheel.
+    int64_t next_advance_time() const {
+        if (_nwheel == 0) {
+            return std::numeric_limits<int64_t>::max();
+        }
+        int64_t tick = _cur_tick;
+        for (; (tick & SLOT_MASK) != 0 && !_slots[0][tick & SLOT_MASK]; ++tick) {}
+        return tick * TICK_US;
+    }
+
+private:
+    void push_heap(Task* task) {
+        _heap.push_back(task);
+        std::push_heap(_heap.begin(), _heap.end(), task_greater);
+    }
+
+    void add_to_wheel(Task* task, int64_t tick) {
+        int64_t delta = tick - _cur_tick;
+        if (delta > MAX_TICKS) {
+            delta = MAX_TICKS;
+            tick = _cur_tick + MAX_TICKS;
+        }
+        int level = 0;
+        while (delta >= (1L << (LEVEL_BITS * (level + 1)))) {
+            ++level;
+        }
+        Task*& head = _slots[level][(tick >> (LEVEL_BITS * level)) & SLOT_MASK];
+        task->next = head;
+        head = task;
+        ++_nwheel;
+    }
+
+    // Re-add tasks in _slots[level][index] relative to _cur_tick.
+    void cascade(int level, int64_t index) {
+        Task* p = _slots[level][index];
+        _slots[level][index] = NULL;
+        while (p) {
+            Task* next_task = p->next;
+            --_nwheel;
+            if (!p->try_delete()) {
+                add(p);
+            }
+            p = next_task;
+        }
+    }
+
+    int64_t _cur_tick;      // tasks before this tick are in _heap.
+    size_t _nwheel;         // number of tasks in _slots.
+    Task* _slots[NLEVEL][NSLOT];
+    std::vector<Task*> _heap;
+};
+
 void TimerThread::run() {
     run_worker_startfn();
 #ifdef BAIDU_INTERNAL
@@ -319,9 +452,7 @@ void TimerThread::run() {
     int64_t last_sleep_time = butil::gettimeofday_us();
     BT_VLOG << "Started TimerThread=" << pthread_self();
 
-    // min heap of tasks (ordered by run_time)
-    std::vector<Task*> tasks;
-    tasks.reserve(4096);
+    TimingWheel tasks(last_sleep_time);
 
     // vars
     size_t nscheduled = 0;
@@ -357,16 +488,16 @@ void TimerThread::run() {
                 Task* next_task = p->next;
 
                 if (!p->try_delete()) { // remove the task if it's unscheduled
-                    tasks.push_back(p);
-                    std::push_heap(tasks.begin(), tasks.end(), task_greater);
+                    tasks.add(p);
                 }
                 p = next_task;
             }
         }
 
         bool pull_again = false;
-        while (!tasks.empty()) {
-            Task* task1 = tasks[0];  // the about-to-run task
+        tasks.advance(butil::gettimeofday_us());
+        while (tasks.top() != NULL) {
+            Task* task1 = tasks.top();  // the about-to-run task
             if (butil::gettimeofday_us() < task1->run_time) {  // not ready yet.
                 break;
             }
@@ -388,8 +519,7 @@ void TimerThread::run() {
                     break;
                 }
             }
-            std::pop_heap(tasks.begin(), tasks.end(), task_greater);
-            tasks.pop_back();
+            tasks.pop();
             if (task1->run_and_delete()) {
                 ++ntriggered;
             }
@@ -400,9 +530,9 @@ void TimerThread::run() {
         }
 
         // The realtime to wait for.
-        int64_t next_run_time = std::numeric_limits<int64_t>::max();
-        if (!tasks.empty()) {
-            next_run_time = tasks[0]->run_time;
+        int64_t next_run_time = tasks.next_advance_time();
+        if (tasks.top() != NULL) {
+            next_run_time = std::min(next_run_time, tasks.top()->run_time);
         }
         // Similarly with the situation before running tasks, we check
         // _nearest_run_time to prevent us from waiting on a non-earliest
@@ -423,6 +553,10 @@ void TimerThread::run() {
         timespec* ptimeout = NULL;
         timespec next_timeout = { 0, 0 };
         const int64_t now = butil::gettimeofday_us();
+        if (next_run_time <= now) {
+            // Running tasks took long, slots of the wheel are due.
+            continue;
+        }
         if (next_run_time != std::numeric_limits<int64_t>::max()) {
             next_timeout = butil::microseconds_to_timespec(next_run_time - now);
             ptimeout = &next_timeout;
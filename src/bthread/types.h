@@ -47,6 +47,14 @@ static const bthread_attrflags_t BTHREAD_LOG_CONTEXT_SWITCH = 16;
 static const bthread_attrflags_t BTHREAD_NOSIGNAL = 32;
 static const bthread_attrflags_t BTHREAD_NEVER_QUIT = 64;
 
+// Workers are partitioned into groups by tags in [0, -task_group_ntags),
+// a bthread only runs on workers with the same tag and tasks are never
+// stolen across tags. BTHREAD_TAG_INVALID in attributes means the tag of
+// the creating worker, or BTHREAD_TAG_DEFAULT when created from non-worker.
+typedef int bthread_tag_t;
+static const bthread_tag_t BTHREAD_TAG_INVALID = -1;
+static const bthread_tag_t BTHREAD_TAG_DEFAULT = 0;
+
 // Key of thread-local data, created by bthread_key_create.
 typedef struct {
     uint32_t index;    // index in KeyTable
@@ -92,12 +100,20 @@ typedef struct bthread_attr_t {
     bthread_stacktype_t stack_type;
     bthread_attrflags_t flags;
     bthread_keytable_pool_t* keytable_pool;
+    bthread_tag_t tag;
+    // Deadline (since the Epoch in microseconds) of the work done by the
+    // bthread, e.g. the RPC being processed. Ready bthreads with deadlines
+    // not reached yet run before others in earliest-deadline-first order.
+    // 0 means no deadline.
+    int64_t deadline_us;
 
 #if defined(__cplusplus)
     void operator=(unsigned stacktype_and_flags) {
         stack_type = (stacktype_and_flags & 7);
         flags = (stacktype_and_flags & ~(unsigned)7u);
         keytable_pool = NULL;
+        tag = BTHREAD_TAG_INVALID;
+        deadline_us = 0;
     }
     bthread_attr_t operator|(unsigned other_flags) const {
         CHECK(!(other_flags & 7)) << "flags=" << other_flags;
@@ -115,23 +131,25 @@ typedef struct bthread_attr_t {
 // obvious drawback is that you need more worker pthreads when you have a lot
 // of such bthreads.
 static const bthread_attr_t BTHREAD_ATTR_PTHREAD =
-{ BTHREAD_STACKTYPE_PTHREAD, 0, NULL };
+{ BTHREAD_STACKTYPE_PTHREAD, 0, NULL, BTHREAD_TAG_INVALID, 0 };
 
 // bthreads created with following attributes will have different size of
 // stacks. Default is BTHREAD_ATTR_NORMAL.
 static const bthread_attr_t BTHREAD_ATTR_SMALL =
-{ BTHREAD_STACKTYPE_SMALL, 0, NULL };
+{ BTHREAD_STACKTYPE_SMALL, 0, NULL, BTHREAD_TAG_INVALID, 0 };
 static const bthread_attr_t BTHREAD_ATTR_NORMAL =
-{ BTHREAD_STACKTYPE_NORMAL, 0, NULL };
+{ BTHREAD_STACKTYPE_NORMAL, 0, NULL, BTHREAD_TAG_INVALID, 0 };
 static const bthread_attr_t BTHREAD_ATTR_LARGE =
-{ BTHREAD_STACKTYPE_LARGE, 0, NULL };
+{ BTHREAD_STACKTYPE_LARGE, 0, NULL, BTHREAD_TAG_INVALID, 0 };
 
 // bthreads created with this attribute will print log when it's started,
 // context-switched, finished.
 static const bthread_attr_t BTHREAD_ATTR_DEBUG = {
     BTHREAD_STACKTYPE_NORMAL,
     BTHREAD_LOG_START_AND_FINISH | BTHREAD_LOG_CONTEXT_SWITCH,
-    NULL
+    NULL,
+    BTHREAD_TAG_INVALID,
+    0
 };
 
 static const size_t BTHREAD_EPOLL_THREAD_NUM = 1;
@@ -160,6 +178,9 @@ typedef struct {
 typedef struct {
     unsigned* butex;
     bthread_contention_site_t csite;
+    // Average times of spinning needed to get the lock recently, which
+    // bounds the spinning before a contended locker parks.
+    int spin_avg;
 } bthread_mutex_t;
 
 typedef struct {
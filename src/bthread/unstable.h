@@ -39,6 +39,22 @@ __BEGIN_DECLS
 // Schedule tasks created by BTHREAD_NOSIGNAL
 extern void bthread_flush();
 
+// Create a bthread like bthread_start_background() but queue it to the
+// worker chosen by `affinity' among workers of the tag, e.g. passing the
+// SocketId or a worker index in [0, bthread_getconcurrency()). Bthreads
+// with same `affinity' run on the same worker unless they're stolen by
+// idle workers for balance, or workers are added or retired, which changes
+// the mapping. BTHREAD_NOSIGNAL is ignored when the chosen worker is not
+// the calling one.
+// Returns 0 on success, errno otherwise.
+extern int bthread_start_background_with_affinity(
+    bthread_t* __restrict tid, const bthread_attr_t* __restrict attr,
+    void * (*fn)(void*), void* __restrict arg, uint64_t affinity);
+
+// Tag of the worker running the calling bthread, BTHREAD_TAG_INVALID if
+// it's not called from a bthread worker.
+extern bthread_tag_t bthread_self_tag(void);
+
 // Mark the calling bthread as "about to quit". When the bthread is scheduled,
 // worker pthreads are not notified.
 extern int bthread_about_to_quit();
@@ -75,10 +91,42 @@ extern int bthread_fd_timedwait(int fd, unsigned epoll_events,
 // NOTE: This function does not wake up pthread waiters.(tested on linux 2.6.32)
 extern int bthread_close(int fd);
 
+// Hooks of another event loop (e.g. brpc::EventDispatcher) watching file
+// descriptors for bthread_fd_wait() and bthread_fd_timedwait(), instead of
+// the epoll bthreads of bthread.
+typedef struct {
+    // Watch `events' of `fd' once and call bthread_fd_notify(fd) when any
+    // of them happens. Returns 0 on success, -1 otherwise and errno is set.
+    int (*watch)(int fd, unsigned events);
+    // Stop watching `fd', called by bthread_close() before closing `fd'.
+    int (*unwatch)(int fd);
+} bthread_fd_poller_t;
+
+// Set the poller of bthread_fd_*wait, which can be set only once and
+// better before any call to bthread_fd_*wait. Waits started before are
+// still woken by the epoll bthreads.
+// Returns 0 on success, -1 otherwise and errno is set.
+extern int bthread_set_fd_poller(const bthread_fd_poller_t* poller);
+
+// Wake up bthreads waiting on `fd' with bthread_fd_*wait.
+extern void bthread_fd_notify(int fd);
+
 // Replacement of connect(2) in bthreads.
 extern int bthread_connect(int sockfd, const sockaddr* serv_addr,
                            socklen_t addrlen);
 
+// Yield if the calling bthread has been running for more than
+// -bthread_maybe_yield_us microseconds since it was scheduled, so that
+// long computations calling this function periodically don't starve other
+// bthreads of the worker. Cheap enough to be called in loops.
+// Returns 1 if the bthread yielded, 0 otherwise.
+extern int bthread_maybe_yield(void);
+
+// Set deadline of the calling bthread, which is used in scheduling the
+// bthread from now on, see bthread_attr_t.deadline_us. 0 clears it.
+// Returns 0 on success, EINVAL if it's not called in a bthread.
+extern int bthread_set_self_deadline(int64_t deadline_us);
+
 // Add a startup function that each pthread worker will run at the beginning
 // To run code at the end, use butil::thread_atexit()
 // Returns 0 on success, error code otherwise.
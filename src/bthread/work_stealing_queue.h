@@ -31,11 +31,16 @@ namespace bthread {
 template <typename T>
 class WorkStealingQueue {
 public:
+    // Max number of items taken by one steal_batch(), which only takes
+    // more than one item when there're more than 2 * MAX_STEAL_BATCH items.
+    static const size_t MAX_STEAL_BATCH = 16;
+
     WorkStealingQueue()
         : _bottom(1)
         , _capacity(0)
         , _buffer(NULL)
-        , _top(1) {
+        , _top(1)
+        , _nbatch(0) {
     }
 
     ~WorkStealingQueue() {
@@ -95,20 +100,40 @@ public:
         const size_t newb = b - 1;
         _bottom.store(newb, butil::memory_order_relaxed);
         butil::atomic_thread_fence(butil::memory_order_seq_cst);
+        // Loaded before _top, see steal_batch().
+        const int nbatch = _nbatch.load(butil::memory_order_acquire);
         t = _top.load(butil::memory_order_relaxed);
         if (t > newb) {
             _bottom.store(b, butil::memory_order_relaxed);
             return false;
         }
-        *val = _buffer[newb & (_capacity - 1)];
-        if (t != newb) {
+        if (t != newb &&
+            (nbatch == 0 || t + MAX_STEAL_BATCH <= newb)) {
+            *val = _buffer[newb & (_capacity - 1)];
             return true;
         }
-        // Single last element, compete with steal()
-        const bool popped = _top.compare_exchange_strong(
-            t, t + 1, butil::memory_order_seq_cst, butil::memory_order_relaxed);
+        if (t == newb) {
+            // Single last element, compete with steal()
+            *val = _buffer[newb & (_capacity - 1)];
+            const bool popped = _top.compare_exchange_strong(
+                t, t + 1, butil::memory_order_seq_cst,
+                butil::memory_order_relaxed);
+            _bottom.store(b, butil::memory_order_relaxed);
+            return popped;
+        }
+        // A steal_batch() which saw a _bottom before this pop may be
+        // claiming up to MAX_STEAL_BATCH items from _top, including the
+        // newest one. Serialize with it on _top by taking the oldest item.
         _bottom.store(b, butil::memory_order_relaxed);
-        return popped;
+        do {
+            *val = _buffer[t & (_capacity - 1)];
+            if (_top.compare_exchange_strong(t, t + 1,
+                                             butil::memory_order_seq_cst,
+                                             butil::memory_order_relaxed)) {
+                return true;
+            }
+        } while (t < b);
+        return false;
     }
 
     // Steal one item from the queue.
@@ -134,6 +159,48 @@ public:
         return true;
     }
 
+    // Steal at most `max' (capped by MAX_STEAL_BATCH) of the oldest items
+    // with one CAS if there're more than 2 * MAX_STEAL_BATCH items, steal
+    // one item like steal() otherwise.
+    // Returns number of items written to `vals'.
+    // May run in parallel with push() pop() or another steal().
+    size_t steal_batch(T* vals, size_t max) {
+        size_t t = _top.load(butil::memory_order_acquire);
+        size_t b = _bottom.load(butil::memory_order_acquire);
+        if (t >= b || max == 0) {
+            return 0;
+        }
+        if (max == 1 || b - t <= 2 * MAX_STEAL_BATCH) {
+            return steal(vals) ? 1 : 0;
+        }
+        if (max > MAX_STEAL_BATCH) {
+            max = MAX_STEAL_BATCH;
+        }
+        // pop() takes the newest item without CAS when _top is not near it.
+        // A stealer reading _bottom before a series of pops may still claim
+        // the items being popped, so tell pop() that a batch is in flight
+        // before reading _bottom.
+        _nbatch.fetch_add(1, butil::memory_order_seq_cst);
+        t = _top.load(butil::memory_order_acquire);
+        size_t n = 0;
+        do {
+            butil::atomic_thread_fence(butil::memory_order_seq_cst);
+            b = _bottom.load(butil::memory_order_acquire);
+            if (t >= b) {
+                n = 0;
+                break;
+            }
+            n = (b - t > 2 * MAX_STEAL_BATCH ? max : 1);
+            for (size_t i = 0; i < n; ++i) {
+                vals[i] = _buffer[(t + i) & (_capacity - 1)];
+            }
+        } while (!_top.compare_exchange_strong(t, t + n,
+                                               butil::memory_order_seq_cst,
+                                               butil::memory_order_relaxed));
+        _nbatch.fetch_sub(1, butil::memory_order_release);
+        return n;
+    }
+
     size_t volatile_size() const {
         const size_t b = _bottom.load(butil::memory_order_relaxed);
         const size_t t = _top.load(butil::memory_order_relaxed);
@@ -150,8 +217,14 @@ private:
     size_t _capacity;
     T* _buffer;
     butil::atomic<size_t> BAIDU_CACHELINE_ALIGNMENT _top;
+    // Number of steal_batch() claiming more than one item, sharing the
+    // cacheline of _top which pop() reads anyway.
+    butil::atomic<int> _nbatch;
 };
 
+template <typename T>
+const size_t WorkStealingQueue<T>::MAX_STEAL_BATCH;
+
 }  // namespace bthread
 
 #endif  // BTHREAD_WORK_STEALING_QUEUE_H
@@ -31,11 +31,14 @@ ArenaOptions::ArenaOptions()
 Arena::Arena(const ArenaOptions& options)
     : _cur_block(NULL)
     , _isolated_blocks(NULL)
+    , _cleanups(NULL)
     , _block_size(options.initial_block_size)
     , _options(options) {
 }
 
 Arena::~Arena() {
+    // Cleanups are allocated in the blocks, run them before freeing blocks.
+    run_cleanups();
     while (_cur_block != NULL) {
         Block* const saved_next = _cur_block->next;
         free(_cur_block);
@@ -51,6 +54,7 @@ Arena::~Arena() {
 void Arena::swap(Arena& other) {
     std::swap(_cur_block, other._cur_block);
     std::swap(_isolated_blocks, other._isolated_blocks);
+    std::swap(_cleanups, other._cleanups);
     std::swap(_block_size, other._block_size);
     const ArenaOptions tmp = _options;
     _options = other._options;
@@ -63,8 +67,58 @@ void Arena::clear() {
     swap(a);
 }
 
+void Arena::reset() {
+    run_cleanups();
+    while (_isolated_blocks != NULL) {
+        Block* const saved_next = _isolated_blocks->next;
+        free(_isolated_blocks);
+        _isolated_blocks = saved_next;
+    }
+    // _cur_block is always the only block in its list.
+    if (_cur_block != NULL) {
+        _cur_block->alloc_size = 0;
+    }
+}
+
+void Arena::run_cleanups() {
+    while (_cleanups != NULL) {
+        Cleanup* const c = _cleanups;
+        _cleanups = c->next;
+        c->fn(c->arg);
+    }
+}
+
+int Arena::add_cleanup(void (*fn)(void*), void* arg) {
+    Cleanup* c = (Cleanup*)allocate_aligned(sizeof(Cleanup));
+    if (NULL == c) {
+        return -1;
+    }
+    c->fn = fn;
+    c->arg = arg;
+    c->next = _cleanups;
+    _cleanups = c;
+    return 0;
+}
+
+void* Arena::allocate_aligned(size_t n) {
+    if (_cur_block != NULL) {
+        const uint32_t aligned_size = (_cur_block->alloc_size + 7) & ~7u;
+        if (aligned_size <= _cur_block->size &&
+            _cur_block->size - aligned_size >= n) {
+            void* ret = _cur_block->data + aligned_size;
+            _cur_block->alloc_size = aligned_size + n;
+            return ret;
+        }
+    }
+    // data of newly malloc-ed blocks are 8-byte aligned.
+    return allocate_in_other_blocks(n);
+}
+
 void* Arena::allocate_new_block(size_t n) {
     Block* b = (Block*)malloc(offsetof(Block, data) + n);
+    if (NULL == b) {
+        return NULL;
+    }
     b->next = _isolated_blocks;
     b->alloc_size = n;
     b->size = n;
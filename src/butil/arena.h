@@ -23,6 +23,8 @@
 #define BUTIL_ARENA_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <new>                          // std::bad_alloc
 #include "butil/macros.h"
 
 namespace butil {
@@ -42,9 +44,21 @@ public:
     ~Arena();
     void swap(Arena&);
     void* allocate(size_t n);
-    void* allocate_aligned(size_t n);  // not implemented.
+    // Allocate `n' bytes aligned to 8 bytes, which is enough for objects
+    // placed in the arena.
+    void* allocate_aligned(size_t n);
     void clear();
 
+    // Like clear() but keep the current block for later allocations, so
+    // that reused arenas(e.g. pooled ones) allocate without malloc.
+    void reset();
+
+    // Call fn(arg) before memory of the arena is freed by clear() or the
+    // destructor, in reverse order of registration. This is generally used
+    // for destructing non-trivial objects placed in the arena.
+    // Returns 0 on success, -1 otherwise.
+    int add_cleanup(void (*fn)(void*), void* arg);
+
 private:
     DISALLOW_COPY_AND_ASSIGN(Arena);
 
@@ -57,6 +71,14 @@ private:
         char data[0];
     };
 
+    struct Cleanup {
+        void (*fn)(void*);
+        void* arg;
+        Cleanup* next;
+    };
+
+    void run_cleanups();
+
     void* allocate_in_other_blocks(size_t n);
     void* allocate_new_block(size_t n);
     Block* pop_block(Block* & head) {
@@ -67,10 +89,57 @@ private:
     
     Block* _cur_block;
     Block* _isolated_blocks;
+    Cleanup* _cleanups;
     size_t _block_size;
     ArenaOptions _options;
 };
 
+// STL allocator allocating from an Arena. Deallocation is a no-op and
+// memory is returned when the arena is cleared, so containers on arenas
+// should be short-lived and should not grow repeatedly.
+// Example:
+//   std::vector<int, butil::ArenaAllocator<int> > v(
+//       butil::ArenaAllocator<int>(&arena));
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    template <typename U> struct rebind { typedef ArenaAllocator<U> other; };
+
+    explicit ArenaAllocator(Arena* arena) : _arena(arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : _arena(other.arena()) {}
+
+    T* allocate(size_t n) {
+        void* p = _arena->allocate_aligned(n * sizeof(T));
+        if (p == NULL) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+    void deallocate(T*, size_t) {}
+
+    Arena* arena() const { return _arena; }
+
+private:
+    Arena* _arena;
+};
+
+template <typename T, typename U>
+inline bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena() == b.arena();
+}
+template <typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena() != b.arena();
+}
+
 inline void* Arena::allocate(size_t n) {
     if (_cur_block != NULL && _cur_block->left_space() >= n) {
         void* ret = _cur_block->data + _cur_block->alloc_size;
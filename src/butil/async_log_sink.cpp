@@ -0,0 +1,320 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "butil/config.h"   // BRPC_WITH_GLOG
+
+#if !BRPC_WITH_GLOG
+
+#include <string.h>
+#include <algorithm>                   // std::min
+#include <sstream>
+#include "butil/scoped_lock.h"        // BAIDU_SCOPED_LOCK
+#include "butil/thread_local.h"       // thread_atexit
+#include "butil/time/time.h"          // TimeDelta
+#include "butil/async_log_sink.h"
+
+namespace logging {
+
+// Write batches of logs larger than this even if there're more logs.
+static const size_t MAX_BATCH_SIZE = 64 * 1024;
+
+AsyncLogSinkOptions::AsyncLogSinkOptions()
+    : target(NULL)
+    , thread_buffer_size(1024 * 1024)
+    , flush_interval_ms(20) {
+}
+
+struct RecordHeader {
+    int32_t severity;
+    int32_t line;
+    uint32_t file_len;
+    uint32_t content_len;
+};
+
+// Ring buffer of logs written by one thread and read by the thread
+// flushing logs.
+class AsyncLogSink::ThreadBuffer {
+public:
+    explicit ThreadBuffer(size_t capacity)
+        : _data(new char[capacity])
+        , _capacity(capacity)
+        , _write_pos(0)
+        , _read_pos(0) {}
+
+    ~ThreadBuffer() { delete [] _data; }
+
+    // Called by the owner thread. Returns false if the buffer is full.
+    bool Append(const RecordHeader& h, const char* file, const char* content) {
+        const size_t n = sizeof(h) + h.file_len + h.content_len;
+        const uint64_t w = _write_pos.load(butil::memory_order_relaxed);
+        const uint64_t r = _read_pos.load(butil::memory_order_acquire);
+        if (n > _capacity - (w - r)) {
+            return false;
+        }
+        CopyIn(w, &h, sizeof(h));
+        CopyIn(w + sizeof(h), file, h.file_len);
+        CopyIn(w + sizeof(h) + h.file_len, content, h.content_len);
+        _write_pos.store(w + n, butil::memory_order_release);
+        return true;
+    }
+
+    // Called by the flushing thread. Put the file name and content of the
+    // oldest log into `data'. Returns false if the buffer is empty.
+    bool Pop(RecordHeader* h, std::string* data) {
+        const uint64_t r = _read_pos.load(butil::memory_order_relaxed);
+        const uint64_t w = _write_pos.load(butil::memory_order_acquire);
+        if (r == w) {
+            return false;
+        }
+        CopyOut(r, h, sizeof(*h));
+        data->resize(h->file_len + h->content_len);
+        CopyOut(r + sizeof(*h), &(*data)[0], data->size());
+        _read_pos.store(r + sizeof(*h) + data->size(),
+                        butil::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return _read_pos.load(butil::memory_order_relaxed) ==
+            _write_pos.load(butil::memory_order_acquire);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ThreadBuffer);
+
+    void CopyIn(uint64_t pos, const void* src, size_t n) {
+        const size_t off = pos % _capacity;
+        const size_t n1 = std::min(n, _capacity - off);
+        memcpy(_data + off, src, n1);
+        memcpy(_data, (const char*)src + n1, n - n1);
+    }
+
+    void CopyOut(uint64_t pos, void* dst, size_t n) const {
+        const size_t off = pos % _capacity;
+        const size_t n1 = std::min(n, _capacity - off);
+        memcpy(dst, _data + off, n1);
+        memcpy((char*)dst + n1, _data, n - n1);
+    }
+
+    char* _data;
+    const size_t _capacity;
+    // Monotonic, positions in the buffer are modulo _capacity.
+    butil::atomic<uint64_t> _write_pos BAIDU_CACHELINE_ALIGNMENT;
+    butil::atomic<uint64_t> _read_pos BAIDU_CACHELINE_ALIGNMENT;
+};
+
+struct ThreadBufferRef {
+    int64_t sink_id;
+    std::shared_ptr<AsyncLogSink::ThreadBuffer> buf;
+};
+
+static __thread ThreadBufferRef* tls_buffer_ref = NULL;
+// True in the background thread, whose logs are written synchronously.
+static __thread bool tls_flushing = false;
+static butil::atomic<int64_t> s_next_sink_id(1);
+
+static void DeleteThreadBufferRef(void* arg) {
+    // The buffer is deleted by the sink after being flushed.
+    delete static_cast<ThreadBufferRef*>(arg);
+    tls_buffer_ref = NULL;
+}
+
+AsyncLogSink::AsyncLogSink()
+    : _id(s_next_sink_id.fetch_add(1, butil::memory_order_relaxed))
+    , _ndropped(0)
+    , _nreported_dropped(0)
+    , _stop_cond(&_stop_mutex)
+    , _started(false)
+    , _stop(false)
+    , _flusher(0) {
+}
+
+AsyncLogSink::~AsyncLogSink() {
+    if (_started) {
+        {
+            BAIDU_SCOPED_LOCK(_stop_mutex);
+            _stop = true;
+            _stop_cond.Signal();
+        }
+        pthread_join(_flusher, NULL);
+        _started = false;
+    }
+    Flush();
+}
+
+int AsyncLogSink::Start(const AsyncLogSinkOptions* options) {
+    if (_started) {
+        return -1;
+    }
+    if (options) {
+        _options = *options;
+    }
+    if (_options.thread_buffer_size < 4096 || _options.flush_interval_ms <= 0) {
+        return -1;
+    }
+    if (pthread_create(&_flusher, NULL, RunFlusher, this) != 0) {
+        return -1;
+    }
+    _started = true;
+    return 0;
+}
+
+void* AsyncLogSink::RunFlusher(void* arg) {
+    AsyncLogSink* sink = static_cast<AsyncLogSink*>(arg);
+    tls_flushing = true;
+    const butil::TimeDelta interval =
+        butil::TimeDelta::FromMilliseconds(sink->_options.flush_interval_ms);
+    while (true) {
+        {
+            BAIDU_SCOPED_LOCK(sink->_stop_mutex);
+            if (sink->_stop) {
+                break;
+            }
+            sink->_stop_cond.TimedWait(interval);
+        }
+        sink->Flush();
+    }
+    return NULL;
+}
+
+AsyncLogSink::ThreadBuffer* AsyncLogSink::GetOrCreateThreadBuffer() {
+    ThreadBufferRef* ref = tls_buffer_ref;
+    if (ref != NULL && ref->sink_id == _id) {
+        return ref->buf.get();
+    }
+    if (ref == NULL) {
+        ref = new ThreadBufferRef;
+        tls_buffer_ref = ref;
+        butil::thread_atexit(DeleteThreadBufferRef, ref);
+    }
+    ref->sink_id = _id;
+    ref->buf = std::make_shared<ThreadBuffer>(_options.thread_buffer_size);
+    BAIDU_SCOPED_LOCK(_buffers_mutex);
+    _buffers.push_back(ref->buf);
+    return ref->buf.get();
+}
+
+bool AsyncLogSink::OnLogMessage(int severity, const char* file, int line,
+                                const butil::StringPiece& content) {
+    if (!_started || tls_flushing) {
+        // Written by the default sink.
+        return false;
+    }
+    if (severity >= BLOG_FATAL) {
+        // The process is likely to crash, write it out right now.
+        BAIDU_SCOPED_LOCK(_flush_mutex);
+        FlushAllBuffers();
+        std::string batch;
+        int batch_severity = BLOG_INFO;
+        WriteLog(severity, file, line, content, &batch, &batch_severity);
+        WriteBatch(&batch, &batch_severity);
+        return true;
+    }
+    RecordHeader h;
+    h.severity = severity;
+    h.line = line;
+    h.file_len = (file ? strlen(file) : 0);
+    h.content_len = content.size();
+    if (!GetOrCreateThreadBuffer()->Append(h, file, content.data())) {
+        _ndropped.fetch_add(1, butil::memory_order_relaxed);
+    }
+    return true;
+}
+
+void AsyncLogSink::Flush() {
+    BAIDU_SCOPED_LOCK(_flush_mutex);
+    FlushAllBuffers();
+}
+
+void AsyncLogSink::FlushAllBuffers() {
+    std::vector<std::shared_ptr<ThreadBuffer> > buffers;
+    {
+        BAIDU_SCOPED_LOCK(_buffers_mutex);
+        buffers = _buffers;
+    }
+    std::string batch;
+    int batch_severity = BLOG_INFO;
+    RecordHeader h;
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        while (buffers[i]->Pop(&h, &_record)) {
+            const std::string file(_record.data(), h.file_len);
+            WriteLog(h.severity, file.c_str(), h.line,
+                     butil::StringPiece(_record.data() + h.file_len,
+                                        h.content_len),
+                     &batch, &batch_severity);
+        }
+    }
+    const int64_t ndropped = _ndropped.load(butil::memory_order_relaxed);
+    if (ndropped != _nreported_dropped) {
+        std::ostringstream os;
+        os << "Dropped " << ndropped - _nreported_dropped
+           << " logs since buffers of logging threads were full";
+        _nreported_dropped = ndropped;
+        WriteLog(BLOG_WARNING, __FILE__, __LINE__, os.str(),
+                 &batch, &batch_severity);
+    }
+    WriteBatch(&batch, &batch_severity);
+    buffers.clear();
+
+    // Remove buffers of exited threads.
+    BAIDU_SCOPED_LOCK(_buffers_mutex);
+    for (size_t i = 0; i < _buffers.size();) {
+        if (_buffers[i].use_count() == 1 && _buffers[i]->empty()) {
+            _buffers[i] = _buffers.back();
+            _buffers.pop_back();
+        } else {
+            ++i;
+        }
+    }
+}
+
+void AsyncLogSink::WriteLog(int severity, const char* file, int line,
+                            const butil::StringPiece& content,
+                            std::string* batch, int* batch_severity) {
+    if (_options.target) {
+        const bool prev_flushing = tls_flushing;
+        tls_flushing = true;
+        _options.target->OnLogMessage(severity, file, line, content);
+        tls_flushing = prev_flushing;
+        return;
+    }
+    // Errors are written to stderr as well, write them separately to
+    // keep other logs out of stderr.
+    if (severity >= BLOG_ERROR || batch->size() >= MAX_BATCH_SIZE) {
+        WriteBatch(batch, batch_severity);
+    }
+    std::ostringstream os;
+    PrintLog(os, severity, file, line, content);
+    os << '\n';
+    batch->append(os.str());
+    *batch_severity = std::max(*batch_severity, severity);
+    if (severity >= BLOG_ERROR) {
+        WriteBatch(batch, batch_severity);
+    }
+}
+
+void AsyncLogSink::WriteBatch(std::string* batch, int* batch_severity) {
+    if (!batch->empty()) {
+        WriteLogsToDestinations(*batch_severity, *batch);
+        batch->clear();
+    }
+    *batch_severity = BLOG_INFO;
+}
+
+}  // namespace logging
+
+#endif  // BRPC_WITH_GLOG
@@ -0,0 +1,118 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// Write LOG() in a background thread.
+
+#ifndef BUTIL_ASYNC_LOG_SINK_H
+#define BUTIL_ASYNC_LOG_SINK_H
+
+#include <pthread.h>
+#include <memory>
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/logging.h"
+#include "butil/synchronization/condition_variable.h"
+
+namespace logging {
+
+struct AsyncLogSinkOptions {
+    AsyncLogSinkOptions();
+
+    // Logs are passed to this sink in the background thread, e.g.
+    // ComlogSink::GetInstance(). If it's NULL, logs are written to the
+    // destinations set by InitLogging() in batches.
+    // Not owned, must outlive the AsyncLogSink.
+    // default: NULL
+    LogSink* target;
+
+    // Bytes of the buffer of each logging thread. Logs are dropped when
+    // the buffer is full, namely the background thread can't catch up.
+    // default: 1MB
+    size_t thread_buffer_size;
+
+    // The background thread checks buffers every so many milliseconds.
+    // default: 20
+    int flush_interval_ms;
+};
+
+// A LogSink copying logs into lock-free buffers of logging threads, which
+// are written by a background thread, so that LOG() does not block when
+// the disk is slow or other threads are logging heavily. FATAL logs are
+// written synchronously after pending logs.
+// Usage:
+//   logging::AsyncLogSink* sink = new logging::AsyncLogSink;
+//   CHECK_EQ(0, sink->Start(NULL));
+//   logging::SetLogSink(sink);
+class AsyncLogSink : public LogSink {
+public:
+    AsyncLogSink();
+    // Stop the background thread and write all pending logs. Call
+    // SetLogSink() to remove this sink before destroying it.
+    ~AsyncLogSink();
+
+    // Start the background thread. Returns 0 on success.
+    int Start(const AsyncLogSinkOptions* options);
+
+    // Write all logs buffered before calling this function.
+    void Flush();
+
+    // Number of logs dropped because of full buffers.
+    int64_t dropped_count() const
+    { return _ndropped.load(butil::memory_order_relaxed); }
+
+    // @LogSink
+    bool OnLogMessage(int severity, const char* file, int line,
+                      const butil::StringPiece& content) override;
+
+    class ThreadBuffer;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AsyncLogSink);
+
+    // The buffer is referenced by the thread until it exits.
+    ThreadBuffer* GetOrCreateThreadBuffer();
+    static void* RunFlusher(void* arg);
+    // Write logs in all buffers. Called with _flush_mutex held.
+    void FlushAllBuffers();
+    void WriteLog(int severity, const char* file, int line,
+                  const butil::StringPiece& content, std::string* batch,
+                  int* batch_severity);
+    void WriteBatch(std::string* batch, int* batch_severity);
+
+    AsyncLogSinkOptions _options;
+    // Distinguish buffers of different sinks in thread-local storage.
+    int64_t _id;
+    butil::atomic<int64_t> _ndropped;
+    int64_t _nreported_dropped;
+
+    butil::Mutex _buffers_mutex;
+    std::vector<std::shared_ptr<ThreadBuffer> > _buffers;
+
+    // Only one thread writes logs at any time to keep them in order.
+    butil::Mutex _flush_mutex;
+    std::string _record;
+
+    butil::Mutex _stop_mutex;
+    butil::ConditionVariable _stop_cond;
+    bool _started;
+    bool _stop;
+    pthread_t _flusher;
+};
+
+}  // namespace logging
+
+#endif  // BUTIL_ASYNC_LOG_SINK_H
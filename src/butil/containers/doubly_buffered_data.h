@@ -22,6 +22,7 @@
 
 #include <vector>                                       // std::vector
 #include <pthread.h>
+#include <sched.h>                                      // sched_yield
 #include "butil/scoped_lock.h"
 #include "butil/thread_local.h"
 #include "butil/logging.h"
@@ -48,9 +49,23 @@ namespace butil {
 // foreground and background, lock thread-local mutexes one by one to make
 // sure all existing Read() finish and later Read() see new foreground,
 // then modify background(foreground before flip) again.
+//
+// With DOUBLY_BUFFERED_READ_WAIT_FREE, Read() never waits: it bumps a
+// thread-local sequence number to odd before reading and to even after
+// reading. Modify() waits for threads with odd sequence numbers to finish
+// their current Read() by polling, instead of locking their mutexes, thus
+// Read() is not stalled by Modify() anymore even if there're many threads.
+// The cost is a full memory fence in each Read(), which is comparable to
+// locking an uncontended mutex.
 
 class Void { };
 
+// How Read() is synchronized with Modify().
+enum DoublyBufferedReadMode {
+    DOUBLY_BUFFERED_READ_MUTEX,
+    DOUBLY_BUFFERED_READ_WAIT_FREE,
+};
+
 template <typename T, typename TLS = Void>
 class DoublyBufferedData {
     class Wrapper;
@@ -75,7 +90,8 @@ public:
         Wrapper* _w;
     };
     
-    DoublyBufferedData();
+    explicit DoublyBufferedData(
+        DoublyBufferedReadMode read_mode = DOUBLY_BUFFERED_READ_MUTEX);
     ~DoublyBufferedData();
 
     // Put foreground instance into ptr. The instance will not be changed until
@@ -169,6 +185,8 @@ private:
     // Foreground and background void.
     T _data[2];
 
+    const DoublyBufferedReadMode _read_mode;
+
     // Index of foreground instance.
     butil::atomic<int> _index;
 
@@ -206,7 +224,10 @@ class DoublyBufferedData<T, TLS>::Wrapper
     : public DoublyBufferedDataWrapperBase<T, TLS> {
 friend class DoublyBufferedData;
 public:
-    explicit Wrapper(DoublyBufferedData* c) : _control(c) {
+    explicit Wrapper(DoublyBufferedData* c)
+        : _control(c)
+        , _wait_free(c->_read_mode == DOUBLY_BUFFERED_READ_WAIT_FREE)
+        , _seq(0) {
         pthread_mutex_init(&_mutex, NULL);
     }
     
@@ -220,21 +241,48 @@ public:
     // _mutex will be locked by the calling pthread and DoublyBufferedData.
     // Most of the time, no modifications are done, so the mutex is
     // uncontended and fast.
+    // In wait-free mode, _seq is only modified by the calling pthread and
+    // the fence pairs with the one in Modify(): either Modify() sees the odd
+    // _seq and waits, or this Read() sees the flipped index.
     inline void BeginRead() {
-        pthread_mutex_lock(&_mutex);
+        if (_wait_free) {
+            _seq.store(_seq.load(butil::memory_order_relaxed) + 1,
+                       butil::memory_order_relaxed);
+            butil::atomic_thread_fence(butil::memory_order_seq_cst);
+        } else {
+            pthread_mutex_lock(&_mutex);
+        }
     }
 
     inline void EndRead() {
-        pthread_mutex_unlock(&_mutex);
+        if (_wait_free) {
+            _seq.store(_seq.load(butil::memory_order_relaxed) + 1,
+                       butil::memory_order_release);
+        } else {
+            pthread_mutex_unlock(&_mutex);
+        }
     }
 
     inline void WaitReadDone() {
-        BAIDU_SCOPED_LOCK(_mutex);
+        if (_wait_free) {
+            const uint64_t seq = _seq.load(butil::memory_order_acquire);
+            if (seq & 1) {
+                // The Read() may have seen the old index, wait until it ends.
+                while (_seq.load(butil::memory_order_acquire) == seq) {
+                    sched_yield();
+                }
+            }
+        } else {
+            BAIDU_SCOPED_LOCK(_mutex);
+        }
     }
     
 private:
     DoublyBufferedData* _control;
+    const bool _wait_free;
     pthread_mutex_t _mutex;
+    // Odd when the thread is in Read().
+    butil::atomic<uint64_t> _seq;
 };
 
 // Called when thread initializes thread-local wrapper.
@@ -272,8 +320,9 @@ void DoublyBufferedData<T, TLS>::RemoveWrapper(
 }
 
 template <typename T, typename TLS>
-DoublyBufferedData<T, TLS>::DoublyBufferedData()
-    : _index(0)
+DoublyBufferedData<T, TLS>::DoublyBufferedData(DoublyBufferedReadMode read_mode)
+    : _read_mode(read_mode)
+    , _index(0)
     , _created_key(false)
     , _wrapper_key(0) {
     _wrappers.reserve(64);
@@ -366,6 +415,9 @@ size_t DoublyBufferedData<T, TLS>::Modify(Fn& fn) {
     
     // Wait until all threads finishes current reading. When they begin next
     // read, they should see updated _index.
+    if (_read_mode == DOUBLY_BUFFERED_READ_WAIT_FREE) {
+        butil::atomic_thread_fence(butil::memory_order_seq_cst);
+    }
     {
         BAIDU_SCOPED_LOCK(_wrappers_mutex);
         for (size_t i = 0; i < _wrappers.size(); ++i) {
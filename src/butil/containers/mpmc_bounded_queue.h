@@ -0,0 +1,175 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// A thread-safe bounded queue(ring buffer) for multiple producers and
+// multiple consumers without locks. Every cell has a sequence number
+// telling whether it's ready for the producer or the consumer of a lap,
+// producers and consumers claim positions with CAS on separate cachelines
+// and copy items outside of any critical section. The algorithm is from
+// Dmitry Vyukov's "Bounded MPMC queue".
+// push()/pop() never block: they fail when the queue is full/empty. Check
+// bthread/blocking_mpmc_queue.h for blocking variants.
+
+#ifndef BUTIL_MPMC_BOUNDED_QUEUE_H
+#define BUTIL_MPMC_BOUNDED_QUEUE_H
+
+#include <stdlib.h>                               // malloc
+#include <stdint.h>                               // intptr_t
+#include <new>                                    // placement new
+#include <type_traits>                            // std::aligned_storage
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/logging.h"
+
+namespace butil {
+
+template <typename T>
+class MPMCBoundedQueue {
+public:
+    MPMCBoundedQueue()
+        : _cells(NULL)
+        , _mask(0)
+        , _head(0)
+        , _tail(0) {}
+
+    // Not thread-safe, remaining items are destroyed.
+    ~MPMCBoundedQueue() {
+        if (_cells != NULL) {
+            const size_t tail = _tail.load(butil::memory_order_relaxed);
+            for (size_t pos = _head.load(butil::memory_order_relaxed);
+                 pos != tail; ++pos) {
+                _cells[pos & _mask].item()->~T();
+            }
+            free(_cells);
+            _cells = NULL;
+        }
+    }
+
+    // Capacity is rounded up to power of 2.
+    // Returns 0 on success, -1 otherwise.
+    int init(size_t cap) {
+        if (_cells != NULL) {
+            LOG(ERROR) << "Already initialized";
+            return -1;
+        }
+        if (cap == 0) {
+            LOG(ERROR) << "Invalid capacity=" << cap;
+            return -1;
+        }
+        size_t n = 1;
+        while (n < cap) {
+            n <<= 1;
+        }
+        _cells = (Cell*)malloc(sizeof(Cell) * n);
+        if (_cells == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            new (&_cells[i].seq) butil::atomic<size_t>(i);
+        }
+        _mask = n - 1;
+        return 0;
+    }
+
+    bool initialized() const { return _cells != NULL; }
+
+    // Push a copy of |item| into the queue.
+    // Returns true on success, false if the queue is full.
+    bool push(const T& item) {
+        size_t pos = _tail.load(butil::memory_order_relaxed);
+        Cell* c = NULL;
+        for (;;) {
+            c = &_cells[pos & _mask];
+            const size_t seq = c->seq.load(butil::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(
+                        pos, pos + 1, butil::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Full.
+                return false;
+            } else {
+                pos = _tail.load(butil::memory_order_relaxed);
+            }
+        }
+        new (c->item()) T(item);
+        c->seq.store(pos + 1, butil::memory_order_release);
+        return true;
+    }
+
+    // Pop the oldest item into |item|.
+    // Returns true on success, false if the queue is empty.
+    bool pop(T* item) {
+        size_t pos = _head.load(butil::memory_order_relaxed);
+        Cell* c = NULL;
+        for (;;) {
+            c = &_cells[pos & _mask];
+            const size_t seq = c->seq.load(butil::memory_order_acquire);
+            const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (_head.compare_exchange_weak(
+                        pos, pos + 1, butil::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Empty, or the producer of this cell has not finished.
+                return false;
+            } else {
+                pos = _head.load(butil::memory_order_relaxed);
+            }
+        }
+        T* p = c->item();
+        *item = *p;
+        p->~T();
+        // Make the cell ready for the producer of next lap.
+        c->seq.store(pos + _mask + 1, butil::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return _mask + 1; }
+
+    // Number of items, which is just a hint under contention.
+    size_t size() const {
+        const size_t head = _head.load(butil::memory_order_relaxed);
+        const size_t tail = _tail.load(butil::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MPMCBoundedQueue);
+
+    struct Cell {
+        T* item() { return reinterpret_cast<T*>(&storage); }
+
+        butil::atomic<size_t> seq;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    Cell* _cells;
+    size_t _mask;
+    // Consumers and producers modify different cachelines.
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<size_t> _head;
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<size_t> _tail;
+};
+
+}  // namespace butil
+
+#endif  // BUTIL_MPMC_BOUNDED_QUEUE_H
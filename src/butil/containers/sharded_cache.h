@@ -0,0 +1,310 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// A thread-safe cache bounded by number of entries and/or bytes.
+
+#ifndef BUTIL_CONTAINERS_SHARDED_CACHE_H
+#define BUTIL_CONTAINERS_SHARDED_CACHE_H
+
+#include <stdint.h>
+#include <functional>                         // std::hash
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "butil/iobuf.h"                      // butil::IOBuf
+#include "butil/macros.h"
+#include "butil/scoped_lock.h"                // BAIDU_SCOPED_LOCK
+#include "butil/synchronization/lock.h"       // butil::Mutex
+#include "butil/time.h"                       // monotonic_time_us
+
+namespace butil {
+
+// Bytes of keys and values counted against ShardedCacheOptions.max_bytes.
+// Pass a functor overloading operator() for other types as the SizeOf
+// parameter of ShardedCache.
+struct CacheSizeOf {
+    size_t operator()(const std::string& s) const { return s.size(); }
+    size_t operator()(const IOBuf& buf) const { return buf.size(); }
+    template <typename T>
+    size_t operator()(const T&) const { return sizeof(T); }
+};
+
+struct ShardedCacheOptions {
+    ShardedCacheOptions()
+        : nshard(16), max_entries(0), max_bytes(0), ttl_ms(0) {}
+
+    // Entries are spread into so many shards protected by separate locks.
+    size_t nshard;
+
+    // Limits of the cache, divided evenly among shards. 0 means unlimited.
+    size_t max_entries;
+    size_t max_bytes;
+
+    // Entries put without ttl expire after so many milliseconds.
+    // 0 means never.
+    int64_t ttl_ms;
+};
+
+// Entries are evicted in CLOCK order: a hit sets the reference bit of the
+// entry, the clock hand clears set bits and evicts the first entry without
+// the bit, which approximates LRU without reordering entries on hits.
+// Expired entries are removed when they're looked up or met by the hand.
+// Locks are held shortly without blocking, so that the cache can be used
+// in bthreads as well as pthreads.
+// Keys and values must be default-constructible and copyable.
+// Example:
+//   butil::ShardedCacheOptions options;
+//   options.max_bytes = 64 * 1024 * 1024;
+//   options.ttl_ms = 60000;
+//   butil::ShardedCache<std::string, butil::IOBuf> cache(options);
+//   cache.Put("key", buf);
+//   butil::IOBuf cached;
+//   if (cache.Get("key", &cached)) { ... }
+template <typename K, typename V,
+          typename Hash = std::hash<K>, typename SizeOf = CacheSizeOf>
+class ShardedCache {
+public:
+    explicit ShardedCache(const ShardedCacheOptions& options)
+        : _options(options) {
+        if (_options.nshard == 0) {
+            _options.nshard = 1;
+        }
+        _max_entries_per_shard = PerShard(_options.max_entries);
+        _max_bytes_per_shard = PerShard(_options.max_bytes);
+        _shards.resize(_options.nshard);
+        for (size_t i = 0; i < _shards.size(); ++i) {
+            _shards[i] = new Shard;
+        }
+    }
+
+    ~ShardedCache() {
+        for (size_t i = 0; i < _shards.size(); ++i) {
+            delete _shards[i];
+        }
+    }
+
+    // Copy the value of `key' into `value'. Returns false if the key is not
+    // found or expired.
+    bool Get(const K& key, V* value) {
+        CopyTo fn = { value };
+        return Visit(key, fn);
+    }
+
+    // Call fn(V*) with the value of `key' under the lock of its shard, which
+    // is useful for updating the value in place or copying part of it.
+    // Don't block or access the cache inside.
+    // Returns false if the key is not found or expired.
+    template <typename Fn>
+    bool Visit(const K& key, Fn& fn) {
+        const size_t h = _hash(key);
+        Shard* s = GetShard(h);
+        BAIDU_SCOPED_LOCK(s->mutex);
+        typename IndexMap::iterator it = s->index.find(key);
+        if (it == s->index.end()) {
+            ++s->nmiss;
+            return false;
+        }
+        Slot& slot = s->slots[it->second];
+        if (slot.expire_us != 0 && monotonic_time_us() >= slot.expire_us) {
+            RemoveSlot(s, it->second);
+            ++s->nmiss;
+            return false;
+        }
+        slot.referenced = true;
+        ++s->nhit;
+        fn(&slot.value);
+        return true;
+    }
+
+    // Insert or overwrite the value of `key', which expires after
+    // options.ttl_ms. Entries larger than the limit of bytes are not cached.
+    void Put(const K& key, const V& value) {
+        Put(key, value, _options.ttl_ms);
+    }
+
+    // Same as above, expires after `ttl_ms' milliseconds, 0 means never.
+    void Put(const K& key, const V& value, int64_t ttl_ms) {
+        const size_t nbytes = _sizeof(key) + _sizeof(value);
+        const int64_t now = monotonic_time_us();
+        const int64_t expire_us = (ttl_ms > 0 ? now + ttl_ms * 1000L : 0);
+        Shard* s = GetShard(_hash(key));
+        BAIDU_SCOPED_LOCK(s->mutex);
+        typename IndexMap::iterator it = s->index.find(key);
+        if (it != s->index.end()) {
+            RemoveSlot(s, it->second);
+        }
+        if (_max_bytes_per_shard != 0 && nbytes > _max_bytes_per_shard) {
+            return;
+        }
+        while ((_max_entries_per_shard != 0 &&
+                s->index.size() + 1 > _max_entries_per_shard) ||
+               (_max_bytes_per_shard != 0 &&
+                s->nbytes + nbytes > _max_bytes_per_shard)) {
+            EvictOne(s, now);
+        }
+        size_t i = 0;
+        if (!s->free_slots.empty()) {
+            i = s->free_slots.back();
+            s->free_slots.pop_back();
+        } else {
+            i = s->slots.size();
+            s->slots.push_back(Slot());
+        }
+        Slot& slot = s->slots[i];
+        slot.key = key;
+        slot.value = value;
+        slot.expire_us = expire_us;
+        slot.nbytes = nbytes;
+        slot.referenced = false;
+        slot.used = true;
+        s->index[key] = i;
+        s->nbytes += nbytes;
+    }
+
+    // Returns true if `key' was in the cache.
+    bool Erase(const K& key) {
+        Shard* s = GetShard(_hash(key));
+        BAIDU_SCOPED_LOCK(s->mutex);
+        typename IndexMap::iterator it = s->index.find(key);
+        if (it == s->index.end()) {
+            return false;
+        }
+        RemoveSlot(s, it->second);
+        return true;
+    }
+
+    void Clear() {
+        for (size_t i = 0; i < _shards.size(); ++i) {
+            Shard* s = _shards[i];
+            BAIDU_SCOPED_LOCK(s->mutex);
+            s->index.clear();
+            s->slots.clear();
+            s->free_slots.clear();
+            s->hand = 0;
+            s->nbytes = 0;
+        }
+    }
+
+    // Number of entries, including expired ones not removed yet.
+    size_t size() const { return Sum(&Shard::CountEntries); }
+    // Bytes of entries measured by SizeOf.
+    size_t bytes() const { return Sum(&Shard::CountBytes); }
+    // Lookups by Get() and Visit() that found or missed entries.
+    size_t hit_count() const { return Sum(&Shard::CountHits); }
+    size_t miss_count() const { return Sum(&Shard::CountMisses); }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ShardedCache);
+
+    struct Slot {
+        Slot() : expire_us(0), nbytes(0), referenced(false), used(false) {}
+        K key;
+        V value;
+        int64_t expire_us;
+        size_t nbytes;
+        bool referenced;
+        bool used;
+    };
+
+    typedef std::unordered_map<K, size_t, Hash> IndexMap;
+
+    struct Shard {
+        Shard() : hand(0), nbytes(0), nhit(0), nmiss(0) {}
+        size_t CountEntries() const { return index.size(); }
+        size_t CountBytes() const { return nbytes; }
+        size_t CountHits() const { return nhit; }
+        size_t CountMisses() const { return nmiss; }
+
+        mutable Mutex mutex;
+        IndexMap index;
+        std::vector<Slot> slots;
+        std::vector<size_t> free_slots;
+        // Position of the clock hand in `slots'.
+        size_t hand;
+        size_t nbytes;
+        size_t nhit;
+        size_t nmiss;
+    };
+
+    struct CopyTo {
+        V* value;
+        void operator()(V* v) const { *value = *v; }
+    };
+
+    size_t PerShard(size_t limit) const {
+        return limit == 0 ? 0 :
+            (limit + _options.nshard - 1) / _options.nshard;
+    }
+
+    Shard* GetShard(size_t h) const {
+        // Mix the bits so that shards do not correlate with buckets of the
+        // index which also use the hash.
+        h ^= (h >> 33);
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= (h >> 33);
+        return _shards[h % _shards.size()];
+    }
+
+    size_t Sum(size_t (Shard::*count)() const) const {
+        size_t n = 0;
+        for (size_t i = 0; i < _shards.size(); ++i) {
+            BAIDU_SCOPED_LOCK(_shards[i]->mutex);
+            n += (_shards[i]->*count)();
+        }
+        return n;
+    }
+
+    void RemoveSlot(Shard* s, size_t i) {
+        Slot& slot = s->slots[i];
+        s->index.erase(slot.key);
+        s->nbytes -= slot.nbytes;
+        // Release memory referenced by the entry.
+        slot = Slot();
+        s->free_slots.push_back(i);
+    }
+
+    // Called with the shard locked and at least one entry in it.
+    void EvictOne(Shard* s, int64_t now) {
+        while (!s->index.empty()) {
+            if (s->hand >= s->slots.size()) {
+                s->hand = 0;
+            }
+            const size_t i = s->hand++;
+            Slot& slot = s->slots[i];
+            if (!slot.used) {
+                continue;
+            }
+            const bool expired = (slot.expire_us != 0 && now >= slot.expire_us);
+            if (slot.referenced && !expired) {
+                slot.referenced = false;
+                continue;
+            }
+            return RemoveSlot(s, i);
+        }
+    }
+
+    ShardedCacheOptions _options;
+    size_t _max_entries_per_shard;
+    size_t _max_bytes_per_shard;
+    Hash _hash;
+    SizeOf _sizeof;
+    std::vector<Shard*> _shards;
+};
+
+}  // namespace butil
+
+#endif  // BUTIL_CONTAINERS_SHARDED_CACHE_H
@@ -0,0 +1,212 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// An open addressing hash map probing slots in groups of 16 with SIMD,
+// which resembles SwissTable of abseil:
+//  - Every slot has a control byte which is empty, deleted or 7 bits of the
+//    hash code (H2) of the stored key.
+//  - Slots are probed group by group, the control bytes of a group are
+//    compared with H2 in one instruction and keys are only compared in slots
+//    with matched control bytes, thus unmatched keys are rarely touched.
+//  - Values are stored in the slot array directly, no node is allocated per
+//    collision as FlatMap.
+// The interface is same as FlatMap's except that iterators are not
+// restorable (no save_iterator/restore_iterator). Compared to FlatMap, this
+// map saves memory when keys collide and keeps seeking fast under higher
+// load factors, check out test/swiss_flat_map_unittest.cpp for benchmarks.
+//
+// NOTE: Objects stored in SwissFlatMap MUST be copyable.
+// NOTE: Inserting or erasing during iteration is not allowed.
+
+#ifndef BUTIL_SWISS_FLAT_MAP_H
+#define BUTIL_SWISS_FLAT_MAP_H
+
+#include <stdint.h>
+#include <utility>                                // std::pair
+#include <iterator>                               // std::forward_iterator_tag
+#include "butil/type_traits.h"
+#include "butil/logging.h"
+#include "butil/containers/flat_map.h"            // DefaultHasher
+
+namespace butil {
+
+template <typename _Map, typename _Value> class SwissFlatMapIterator;
+
+template <typename _K, typename _T,
+          // Compute hash code from key. The hash code is mixed inside, thus
+          // identity hashes of integers are OK.
+          typename _Hash = DefaultHasher<_K>,
+          // Test equivalence between stored-key and passed-key.
+          // stored-key is always on LHS, passed-key is always on RHS.
+          typename _Equal = DefaultEqualTo<_K> >
+class SwissFlatMap {
+public:
+    typedef _K key_type;
+    typedef _T mapped_type;
+    typedef std::pair<const _K, _T> value_type;
+    typedef SwissFlatMapIterator<SwissFlatMap, value_type> iterator;
+    typedef SwissFlatMapIterator<SwissFlatMap, const value_type> const_iterator;
+    typedef _Hash hasher;
+    typedef _Equal key_equal;
+
+    SwissFlatMap(const hasher& hashfn = hasher(), const key_equal& eql = key_equal());
+    ~SwissFlatMap();
+    SwissFlatMap(const SwissFlatMap& rhs);
+    void operator=(const SwissFlatMap& rhs);
+    void swap(SwissFlatMap& rhs);
+
+    // Must be called to initialize this map, otherwise insert/operator[]
+    // crashes, and seek/erase fails.
+    // `nbucket' is the initial number of slots which is rounded up to power
+    // of 2 (at least 16). `load_factor' is the maximum value of
+    // (size() + #deleted-slots)*100/nbucket, if the value is reached, all
+    // items are rehashed into a doubled map (or a same-sized map when most
+    // of the used slots are deleted). Must be in [10, 93] so that there're
+    // always empty slots to stop probing.
+    int init(size_t nbucket, u_int load_factor = 87);
+
+    // Insert a pair of |key| and |value|. Overwrite the value if |key|
+    // exists.
+    // Returns address of the inserted value, NULL on error.
+    mapped_type* insert(const key_type& key, const mapped_type& value);
+
+    // Remove |key| and the associated value
+    // Returns: 1 on erased, 0 otherwise.
+    template <typename K2>
+    size_t erase(const K2& key, mapped_type* old_value = NULL);
+
+    // Remove all items. Allocated spaces are NOT returned by system.
+    void clear();
+
+    // Same as clear(), for compatibility with FlatMap which has no pool.
+    void clear_and_reset_pool() { clear(); }
+
+    // Search for the value associated with |key|
+    // Returns: address of the value
+    template <typename K2> mapped_type* seek(const K2& key) const;
+
+    // Get the value associated with |key|. If |key| does not exist,
+    // insert with a default-constructed value.
+    // Returns reference of the value
+    mapped_type& operator[](const key_type& key);
+
+    // Rehash all items into `nbucket' slots which is rounded as in init().
+    // Returns false when the new slots can't hold all items under the load
+    // factor or memory is not enough.
+    bool resize(size_t nbucket);
+
+    // Iterators
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    // True if init() was successfully called.
+    bool initialized() const { return _ctrl != NULL; }
+
+    bool empty() const { return _size == 0; }
+    size_t size() const { return _size; }
+    size_t bucket_count() const { return _nbucket; }
+    u_int load_factor () const { return _load_factor; }
+
+    // Bytes of memory allocated for slots and control bytes.
+    size_t memory_usage() const
+    { return _nbucket * (sizeof(value_type) + 1); }
+
+private:
+template <typename _Map, typename _Value> friend class SwissFlatMapIterator;
+
+    static const size_t npos = (size_t)-1;
+
+    template <typename K2> size_t hash_of(const K2& key) const;
+    // Index of the slot storing `key', npos if not found.
+    template <typename K2> size_t find_index(const K2& key, size_t hash) const;
+    // Index of the first empty or deleted slot to hold a new key with
+    // `hash', npos if the map is full.
+    size_t find_insert_index(size_t hash) const;
+    // Move all items into a new map with `nbucket' slots.
+    bool rehash(size_t nbucket);
+
+    inline bool is_too_crowded(size_t nused) const
+    { return nused * 100 > _nbucket * _load_factor; }
+
+    size_t _size;
+    // Number of deleted slots which are not reusable for probing.
+    size_t _ndeleted;
+    size_t _nbucket;
+    int8_t* _ctrl;
+    value_type* _slots;
+    u_int _load_factor;
+    hasher _hashfn;
+    key_equal _eql;
+};
+
+template <typename _K,
+          typename _Hash = DefaultHasher<_K>,
+          typename _Equal = DefaultEqualTo<_K> >
+class SwissFlatSet {
+public:
+    typedef SwissFlatMap<_K, FlatMapVoid, _Hash, _Equal> Map;
+    typedef typename Map::key_type key_type;
+    typedef typename Map::value_type value_type;
+    typedef typename Map::iterator iterator;
+    typedef typename Map::const_iterator const_iterator;
+    typedef typename Map::hasher hasher;
+    typedef typename Map::key_equal key_equal;
+
+    SwissFlatSet(const hasher& hashfn = hasher(), const key_equal& eql = key_equal())
+        : _map(hashfn, eql) {}
+    void swap(SwissFlatSet & rhs) { _map.swap(rhs._map); }
+
+    int init(size_t nbucket, u_int load_factor = 87)
+    { return _map.init(nbucket, load_factor); }
+
+    const void* insert(const key_type& key)
+    { return _map.insert(key, FlatMapVoid()); }
+
+    template <typename K2>
+    size_t erase(const K2& key) { return _map.erase(key, NULL); }
+
+    void clear() { return _map.clear(); }
+    void clear_and_reset_pool() { return _map.clear_and_reset_pool(); }
+
+    template <typename K2>
+    const void* seek(const K2& key) const { return _map.seek(key); }
+
+    bool resize(size_t nbucket) { return _map.resize(nbucket); }
+
+    iterator begin() { return _map.begin(); }
+    iterator end() { return _map.end(); }
+    const_iterator begin() const { return _map.begin(); }
+    const_iterator end() const { return _map.end(); }
+
+    bool initialized() const { return _map.initialized(); }
+    bool empty() const { return _map.empty(); }
+    size_t size() const { return _map.size(); }
+    size_t bucket_count() const { return _map.bucket_count(); }
+    u_int load_factor () const { return _map.load_factor(); }
+    size_t memory_usage() const { return _map.memory_usage(); }
+
+private:
+    Map _map;
+};
+
+}  // namespace butil
+
+#include "butil/containers/swiss_flat_map_inl.h"
+
+#endif  // BUTIL_SWISS_FLAT_MAP_H
@@ -0,0 +1,473 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BUTIL_SWISS_FLAT_MAP_INL_H
+#define BUTIL_SWISS_FLAT_MAP_INL_H
+
+#include <stdlib.h>                               // malloc
+#include <string.h>                               // memset
+#if defined(__SSE2__)
+#include <emmintrin.h>                            // _mm_cmpeq_epi8
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>                             // vceqq_s8
+#endif
+
+namespace butil {
+
+namespace swiss_flat_map_internal {
+
+// Control bytes. Full slots have non-negative control bytes (H2).
+static const int8_t CTRL_EMPTY = -128;
+static const int8_t CTRL_DELETED = -2;
+static const size_t GROUP_WIDTH = 16;
+
+// Hash codes from DefaultHasher are not well distributed (namely identity
+// for integers) while both low bits (H1, to select the group) and high
+// bits (H2) are used. Mix them with the finalizer of murmurhash3.
+inline size_t mix_hash(size_t h) {
+    uint64_t k = h;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return (size_t)k;
+}
+
+inline size_t group_of(size_t hash) { return hash >> 7; }
+inline int8_t h2_of(size_t hash) { return (int8_t)(hash & 0x7F); }
+
+// Control bytes of 16 consecutive slots. match*() return bitmasks in which
+// bit i is set iff the i-th control byte matches.
+class Group {
+public:
+    explicit Group(const int8_t* ctrl) {
+#if defined(__SSE2__)
+        _ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+        _ctrl = vld1q_s8(ctrl);
+#else
+        _ctrl = ctrl;
+#endif
+    }
+
+    uint32_t match(int8_t c) const {
+#if defined(__SSE2__)
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(c), _ctrl));
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+        return movemask(vceqq_s8(vdupq_n_s8(c), _ctrl));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+            mask |= (uint32_t)(_ctrl[i] == c) << i;
+        }
+        return mask;
+#endif
+    }
+
+    uint32_t match_empty() const { return match(CTRL_EMPTY); }
+
+    // Both CTRL_EMPTY and CTRL_DELETED are less than -1.
+    uint32_t match_empty_or_deleted() const {
+#if defined(__SSE2__)
+        return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), _ctrl));
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+        return movemask(vcltq_s8(_ctrl, vdupq_n_s8(-1)));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+            mask |= (uint32_t)(_ctrl[i] < -1) << i;
+        }
+        return mask;
+#endif
+    }
+
+private:
+#if defined(__SSE2__)
+    __m128i _ctrl;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    // NEON has no movemask, sum up weighted bits of both halves instead.
+    static uint32_t movemask(uint8x16_t eq) {
+        static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                          1, 2, 4, 8, 16, 32, 64, 128 };
+        const uint8x16_t m = vandq_u8(eq, vld1q_u8(bits));
+        return (uint32_t)vaddv_u8(vget_low_u8(m)) |
+            ((uint32_t)vaddv_u8(vget_high_u8(m)) << 8);
+    }
+    int8x16_t _ctrl;
+#else
+    const int8_t* _ctrl;
+#endif
+};
+
+inline size_t round_nbucket(size_t nbucket) {
+    return nbucket <= GROUP_WIDTH ? GROUP_WIDTH : find_power2(nbucket);
+}
+
+}  // namespace swiss_flat_map_internal
+
+// Iterate SwissFlatMap
+template <typename Map, typename Value> class SwissFlatMapIterator {
+public:
+    typedef Value value_type;
+    typedef Value& reference;
+    typedef Value* pointer;
+    typedef typename add_const<Value>::type ConstValue;
+    typedef ConstValue& const_reference;
+    typedef ConstValue* const_pointer;
+    typedef std::forward_iterator_tag iterator_category;
+    typedef ptrdiff_t difference_type;
+    typedef typename remove_const<Value>::type NonConstValue;
+
+    SwissFlatMapIterator() : _map(NULL), _index(0) {}
+    SwissFlatMapIterator(const Map* map, size_t index)
+        : _map(map), _index(index) {
+        find_full_slot();
+    }
+    SwissFlatMapIterator(const SwissFlatMapIterator<Map, NonConstValue>& rhs)
+        : _map(rhs._map), _index(rhs._index) {}
+    ~SwissFlatMapIterator() {}  // required by style-checker
+
+    // *this == rhs
+    bool operator==(const SwissFlatMapIterator& rhs) const
+    { return _index == rhs._index; }
+
+    // *this != rhs
+    bool operator!=(const SwissFlatMapIterator& rhs) const
+    { return _index != rhs._index; }
+
+    // ++ it
+    SwissFlatMapIterator& operator++() {
+        ++_index;
+        find_full_slot();
+        return *this;
+    }
+
+    // it ++
+    SwissFlatMapIterator operator++(int) {
+        SwissFlatMapIterator tmp = *this;
+        this->operator++();
+        return tmp;
+    }
+
+    reference operator*() { return _map->_slots[_index]; }
+    pointer operator->() { return &_map->_slots[_index]; }
+    const_reference operator*() const { return _map->_slots[_index]; }
+    const_pointer operator->() const { return &_map->_slots[_index]; }
+
+private:
+friend class SwissFlatMapIterator<Map, ConstValue>;
+
+    void find_full_slot() {
+        for (; _index < _map->_nbucket && _map->_ctrl[_index] < 0; ++_index);
+    }
+
+    const Map* _map;
+    size_t _index;
+};
+
+template <typename _K, typename _T, typename _H, typename _E>
+SwissFlatMap<_K, _T, _H, _E>::SwissFlatMap(const hasher& hashfn,
+                                           const key_equal& eql)
+    : _size(0)
+    , _ndeleted(0)
+    , _nbucket(0)
+    , _ctrl(NULL)
+    , _slots(NULL)
+    , _load_factor(0)
+    , _hashfn(hashfn)
+    , _eql(eql) {}
+
+template <typename _K, typename _T, typename _H, typename _E>
+SwissFlatMap<_K, _T, _H, _E>::~SwissFlatMap() {
+    clear();
+    free(_ctrl);
+    _ctrl = NULL;
+    free(_slots);
+    _slots = NULL;
+    _nbucket = 0;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+SwissFlatMap<_K, _T, _H, _E>::SwissFlatMap(const SwissFlatMap& rhs)
+    : _size(0)
+    , _ndeleted(0)
+    , _nbucket(0)
+    , _ctrl(NULL)
+    , _slots(NULL)
+    , _load_factor(rhs._load_factor)
+    , _hashfn(rhs._hashfn)
+    , _eql(rhs._eql) {
+    operator=(rhs);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissFlatMap<_K, _T, _H, _E>::operator=(const SwissFlatMap& rhs) {
+    if (this == &rhs) {
+        return;
+    }
+    clear();
+    if (!rhs.initialized()) {
+        return;
+    }
+    if (!initialized() || _nbucket < rhs._nbucket) {
+        SwissFlatMap tmp(rhs._hashfn, rhs._eql);
+        if (tmp.init(rhs._nbucket, rhs._load_factor) != 0) {
+            LOG(ERROR) << "Fail to init map, nbucket=" << rhs._nbucket;
+            return;
+        }
+        swap(tmp);
+    }
+    for (const_iterator it = rhs.begin(); it != rhs.end(); ++it) {
+        operator[](it->first) = it->second;
+    }
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissFlatMap<_K, _T, _H, _E>::swap(SwissFlatMap& rhs) {
+    std::swap(rhs._size, _size);
+    std::swap(rhs._ndeleted, _ndeleted);
+    std::swap(rhs._nbucket, _nbucket);
+    std::swap(rhs._ctrl, _ctrl);
+    std::swap(rhs._slots, _slots);
+    std::swap(rhs._load_factor, _load_factor);
+    std::swap(rhs._hashfn, _hashfn);
+    std::swap(rhs._eql, _eql);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+int SwissFlatMap<_K, _T, _H, _E>::init(size_t nbucket, u_int load_factor) {
+    if (initialized()) {
+        LOG(ERROR) << "Already initialized";
+        return -1;
+    }
+    if (load_factor < 10 || load_factor > 93) {
+        LOG(ERROR) << "Invalid load_factor=" << load_factor;
+        return -1;
+    }
+    const size_t n = swiss_flat_map_internal::round_nbucket(nbucket);
+    int8_t* ctrl = (int8_t*)malloc(n);
+    value_type* slots = (value_type*)malloc(sizeof(value_type) * n);
+    if (NULL == ctrl || NULL == slots) {
+        LOG(ERROR) << "Fail to new slots, nbucket=" << n;
+        free(ctrl);
+        free(slots);
+        return -1;
+    }
+    memset(ctrl, swiss_flat_map_internal::CTRL_EMPTY, n);
+    _size = 0;
+    _ndeleted = 0;
+    _nbucket = n;
+    _ctrl = ctrl;
+    _slots = slots;
+    _load_factor = load_factor;
+    return 0;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+template <typename K2>
+inline size_t SwissFlatMap<_K, _T, _H, _E>::hash_of(const K2& key) const {
+    return swiss_flat_map_internal::mix_hash(_hashfn(key));
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+template <typename K2>
+inline size_t SwissFlatMap<_K, _T, _H, _E>::find_index(
+    const K2& key, size_t hash) const {
+    using namespace swiss_flat_map_internal;
+    const int8_t h2 = h2_of(hash);
+    const size_t group_mask = _nbucket / GROUP_WIDTH - 1;
+    size_t g = group_of(hash) & group_mask;
+    // Triangular probing visits all groups when number of groups is
+    // power of 2.
+    for (size_t i = 1; i <= group_mask + 1; ++i) {
+        const Group group(_ctrl + g * GROUP_WIDTH);
+        for (uint32_t m = group.match(h2); m; m &= (m - 1)) {
+            const size_t index = g * GROUP_WIDTH + __builtin_ctz(m);
+            if (_eql(_slots[index].first, key)) {
+                return index;
+            }
+        }
+        if (group.match_empty()) {
+            return npos;
+        }
+        g = (g + i) & group_mask;
+    }
+    return npos;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+inline size_t SwissFlatMap<_K, _T, _H, _E>::find_insert_index(size_t hash) const {
+    using namespace swiss_flat_map_internal;
+    const size_t group_mask = _nbucket / GROUP_WIDTH - 1;
+    size_t g = group_of(hash) & group_mask;
+    for (size_t i = 1; i <= group_mask + 1; ++i) {
+        const uint32_t m =
+            Group(_ctrl + g * GROUP_WIDTH).match_empty_or_deleted();
+        if (m) {
+            return g * GROUP_WIDTH + __builtin_ctz(m);
+        }
+        g = (g + i) & group_mask;
+    }
+    return npos;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+template <typename K2>
+_T* SwissFlatMap<_K, _T, _H, _E>::seek(const K2& key) const {
+    if (!initialized()) {
+        return NULL;
+    }
+    const size_t index = find_index(key, hash_of(key));
+    return index != npos ? &_slots[index].second : NULL;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+_T& SwissFlatMap<_K, _T, _H, _E>::operator[](const key_type& key) {
+    const size_t hash = hash_of(key);
+    size_t index = find_index(key, hash);
+    if (index != npos) {
+        return _slots[index].second;
+    }
+    if (is_too_crowded(_size + _ndeleted + 1)) {
+        // Reclaim deleted slots if they're the majority, grow otherwise.
+        const size_t nbucket2 =
+            (_ndeleted > _size ? _nbucket : _nbucket * 2);
+        rehash(nbucket2);
+        // fail to rehash is OK as long as there're empty slots.
+    }
+    index = find_insert_index(hash);
+    CHECK(index != npos) << "SwissFlatMap is full, size=" << _size;
+    if (_ctrl[index] == swiss_flat_map_internal::CTRL_DELETED) {
+        --_ndeleted;
+    }
+    _ctrl[index] = swiss_flat_map_internal::h2_of(hash);
+    new (&_slots[index]) value_type(key, _T());
+    ++_size;
+    return _slots[index].second;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+_T* SwissFlatMap<_K, _T, _H, _E>::insert(const key_type& key,
+                                         const mapped_type& value) {
+    mapped_type *p = &operator[](key);
+    *p = value;
+    return p;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+template <typename K2>
+size_t SwissFlatMap<_K, _T, _H, _E>::erase(const K2& key, _T* old_value) {
+    using namespace swiss_flat_map_internal;
+    if (!initialized()) {
+        return 0;
+    }
+    const size_t index = find_index(key, hash_of(key));
+    if (index == npos) {
+        return 0;
+    }
+    if (old_value) {
+        *old_value = _slots[index].second;
+    }
+    _slots[index].~value_type();
+    --_size;
+    // Probing for any key never passes a group with empty slots, thus the
+    // slot can be marked empty directly if its group has empty slots.
+    const int8_t* group_ctrl = _ctrl + index / GROUP_WIDTH * GROUP_WIDTH;
+    if (Group(group_ctrl).match_empty()) {
+        _ctrl[index] = CTRL_EMPTY;
+    } else {
+        _ctrl[index] = CTRL_DELETED;
+        ++_ndeleted;
+    }
+    return 1;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+void SwissFlatMap<_K, _T, _H, _E>::clear() {
+    if (!initialized()) {
+        return;
+    }
+    if (_size != 0) {
+        for (size_t i = 0; i < _nbucket; ++i) {
+            if (_ctrl[i] >= 0) {
+                _slots[i].~value_type();
+            }
+        }
+    }
+    memset(_ctrl, swiss_flat_map_internal::CTRL_EMPTY, _nbucket);
+    _size = 0;
+    _ndeleted = 0;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+bool SwissFlatMap<_K, _T, _H, _E>::rehash(size_t nbucket2) {
+    SwissFlatMap new_map(_hashfn, _eql);
+    if (new_map.init(nbucket2, _load_factor) != 0) {
+        LOG(ERROR) << "Fail to init new_map, nbucket=" << nbucket2;
+        return false;
+    }
+    for (size_t i = 0; i < _nbucket; ++i) {
+        if (_ctrl[i] >= 0) {
+            // Keys are unique, put them into slots without comparing.
+            const size_t hash = hash_of(_slots[i].first);
+            const size_t index = new_map.find_insert_index(hash);
+            new_map._ctrl[index] = swiss_flat_map_internal::h2_of(hash);
+            new (&new_map._slots[index]) value_type(_slots[i]);
+            ++new_map._size;
+        }
+    }
+    new_map.swap(*this);
+    return true;
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+bool SwissFlatMap<_K, _T, _H, _E>::resize(size_t nbucket2) {
+    nbucket2 = swiss_flat_map_internal::round_nbucket(nbucket2);
+    if (_size * 100 > nbucket2 * _load_factor) {
+        return false;
+    }
+    return rehash(nbucket2);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissFlatMap<_K, _T, _H, _E>::iterator
+SwissFlatMap<_K, _T, _H, _E>::begin() {
+    return iterator(this, 0);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissFlatMap<_K, _T, _H, _E>::iterator
+SwissFlatMap<_K, _T, _H, _E>::end() {
+    return iterator(this, _nbucket);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissFlatMap<_K, _T, _H, _E>::const_iterator
+SwissFlatMap<_K, _T, _H, _E>::begin() const {
+    return const_iterator(this, 0);
+}
+
+template <typename _K, typename _T, typename _H, typename _E>
+typename SwissFlatMap<_K, _T, _H, _E>::const_iterator
+SwissFlatMap<_K, _T, _H, _E>::end() const {
+    return const_iterator(this, _nbucket);
+}
+
+}  // namespace butil
+
+#endif  // BUTIL_SWISS_FLAT_MAP_INL_H
@@ -25,11 +25,15 @@
 #include <string.h>                            // strcpy
 #include <stdio.h>                             // snprintf
 #include <stdlib.h>                            // strtol
+#include <map>
+#include <string>
 #include <gflags/gflags.h>
 #include "butil/fd_guard.h"                    // fd_guard
 #include "butil/endpoint.h"                    // ip_t
 #include "butil/logging.h"
 #include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/resource_pool.h"
+#include "butil/scoped_lock.h"                 // BAIDU_SCOPED_LOCK
 #include "butil/strings/string_piece.h"
 #include <sys/socket.h>                        // SO_REUSEADDR SO_REUSEPORT
 
@@ -47,6 +51,177 @@ __END_DECLS
 
 namespace butil {
 
+namespace details {
+
+// Address of extended EndPoints, shared by EndPoints of the same address.
+struct ExtendedEndPoint {
+    butil::atomic<int64_t> ref_count;
+    sockaddr_storage ss;
+    socklen_t size;
+};
+
+typedef std::map<std::string, ResourceId<ExtendedEndPoint> > ExtendedEndPointMap;
+
+static pthread_mutex_t g_extended_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Never deleted, extended EndPoints may be destructed after main().
+static ExtendedEndPointMap* g_extended_map = NULL;
+
+static ExtendedEndPoint* address_extended_endpoint(ip_t id) {
+    const ResourceId<ExtendedEndPoint> rid = { ip2int(id) };
+    return address_resource(rid);
+}
+
+void extended_endpoint_ref(ip_t id) {
+    // The caller holds a reference, the count can't be 0.
+    address_extended_endpoint(id)->ref_count.fetch_add(
+        1, butil::memory_order_relaxed);
+}
+
+void extended_endpoint_unref(ip_t id) {
+    ExtendedEndPoint* e = address_extended_endpoint(id);
+    int64_t n = e->ref_count.load(butil::memory_order_relaxed);
+    while (n > 1) {
+        if (e->ref_count.compare_exchange_weak(
+                n, n - 1, butil::memory_order_relaxed)) {
+            return;
+        }
+    }
+    // Releasing the last reference races with finding the address in
+    // create_extended_endpoint(), do it inside the lock.
+    BAIDU_SCOPED_LOCK(g_extended_mutex);
+    if (e->ref_count.fetch_sub(1, butil::memory_order_relaxed) == 1) {
+        g_extended_map->erase(std::string((const char*)&e->ss, e->size));
+        const ResourceId<ExtendedEndPoint> rid = { ip2int(id) };
+        return_resource(rid);
+    }
+}
+
+// `ss' must be filled by make_*_sockaddr() so that equal addresses are
+// equal in bytes.
+static int create_extended_endpoint(const sockaddr_storage& ss, socklen_t size,
+                                    EndPoint* point) {
+    const std::string key((const char*)&ss, size);
+    ResourceId<ExtendedEndPoint> rid;
+    {
+        BAIDU_SCOPED_LOCK(g_extended_mutex);
+        if (g_extended_map == NULL) {
+            g_extended_map = new ExtendedEndPointMap;
+        }
+        ExtendedEndPointMap::iterator it = g_extended_map->find(key);
+        if (it != g_extended_map->end()) {
+            rid = it->second;
+            address_resource(rid)->ref_count.fetch_add(
+                1, butil::memory_order_relaxed);
+        } else {
+            ExtendedEndPoint* e = get_resource(&rid);
+            if (e == NULL || rid.value > (in_addr_t)-1) {
+                return -1;
+            }
+            e->ref_count.store(1, butil::memory_order_relaxed);
+            e->ss = ss;
+            e->size = size;
+            (*g_extended_map)[key] = rid;
+        }
+    }
+    EndPoint tmp;
+    tmp.ip = int2ip(rid.value);
+    tmp.port = EXTENDED_ENDPOINT_PORT;
+    // `tmp' owns the reference now and `*point' shares it.
+    *point = tmp;
+    return 0;
+}
+
+}  // namespace details
+
+static socklen_t make_in6_sockaddr(const in6_addr& addr, int port,
+                                   uint32_t scope_id, sockaddr_storage* ss) {
+    memset(ss, 0, sizeof(*ss));
+    sockaddr_in6* in6 = (sockaddr_in6*)ss;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_addr = addr;
+    in6->sin6_port = htons(port);
+    in6->sin6_scope_id = scope_id;
+    return sizeof(sockaddr_in6);
+}
+
+static int make_un_sockaddr(const char* path, size_t len, sockaddr_storage* ss,
+                            socklen_t* size) {
+    sockaddr_un* un = (sockaddr_un*)ss;
+    if (len >= sizeof(un->sun_path)) {
+        return -1;
+    }
+    memset(ss, 0, sizeof(*ss));
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, path, len);
+    *size = offsetof(sockaddr_un, sun_path) + len + 1;
+    return 0;
+}
+
+sa_family_t get_endpoint_type(const EndPoint& point) {
+    if (is_endpoint_extended(point)) {
+        return details::address_extended_endpoint(point.ip)->ss.ss_family;
+    }
+    return AF_INET;
+}
+
+int endpoint2sockaddr(const EndPoint& point, sockaddr_storage* ss,
+                      socklen_t* size) {
+    socklen_t len = 0;
+    if (is_endpoint_extended(point)) {
+        const details::ExtendedEndPoint* e =
+            details::address_extended_endpoint(point.ip);
+        *ss = e->ss;
+        len = e->size;
+    } else {
+        memset(ss, 0, sizeof(*ss));
+        sockaddr_in* in4 = (sockaddr_in*)ss;
+        in4->sin_family = AF_INET;
+        in4->sin_addr = point.ip;
+        in4->sin_port = htons(point.port);
+        len = sizeof(sockaddr_in);
+    }
+    if (size) {
+        *size = len;
+    }
+    return 0;
+}
+
+int sockaddr2endpoint(const sockaddr_storage* ss, socklen_t size,
+                      EndPoint* point) {
+    switch (ss->ss_family) {
+    case AF_INET:
+        if (size < sizeof(sockaddr_in)) {
+            return -1;
+        }
+        *point = EndPoint(*(const sockaddr_in*)ss);
+        return 0;
+    case AF_INET6: {
+        if (size < sizeof(sockaddr_in6)) {
+            return -1;
+        }
+        const sockaddr_in6* in6 = (const sockaddr_in6*)ss;
+        sockaddr_storage tmp;
+        const socklen_t len = make_in6_sockaddr(
+            in6->sin6_addr, ntohs(in6->sin6_port), in6->sin6_scope_id, &tmp);
+        return details::create_extended_endpoint(tmp, len, point);
+    }
+    case AF_UNIX: {
+        // Unnamed sockets(namely connecting side) have empty paths.
+        const sockaddr_un* un = (const sockaddr_un*)ss;
+        const size_t off = offsetof(sockaddr_un, sun_path);
+        const size_t len = (size > off ? strnlen(un->sun_path, size - off) : 0);
+        sockaddr_storage tmp;
+        socklen_t tmp_size = 0;
+        if (make_un_sockaddr(un->sun_path, len, &tmp, &tmp_size) != 0) {
+            return -1;
+        }
+        return details::create_extended_endpoint(tmp, tmp_size, point);
+    }
+    default:
+        return -1;
+    }
+}
+
 int str2ip(const char* ip_str, ip_t* ip) {
     // ip_str can be NULL when called by EndPoint(0, ...)
     if (ip_str != NULL) {
@@ -100,6 +275,25 @@ int ip2hostname(ip_t ip, std::string* host) {
 
 EndPointStr endpoint2str(const EndPoint& point) {
     EndPointStr str;
+    if (is_endpoint_extended(point)) {
+        const details::ExtendedEndPoint* e =
+            details::address_extended_endpoint(point.ip);
+        if (e->ss.ss_family == AF_UNIX) {
+            snprintf(str._buf, sizeof(str._buf), "unix:%s",
+                     ((const sockaddr_un*)&e->ss)->sun_path);
+            return str;
+        }
+        const sockaddr_in6* in6 = (const sockaddr_in6*)&e->ss;
+        str._buf[0] = '[';
+        if (inet_ntop(AF_INET6, &in6->sin6_addr, str._buf + 1,
+                      sizeof(str._buf) - 1) == NULL) {
+            return endpoint2str(EndPoint(IP_NONE, 0));
+        }
+        char* buf = str._buf + strlen(str._buf);
+        snprintf(buf, str._buf + sizeof(str._buf) - buf, "]:%d",
+                 ntohs(in6->sin6_port));
+        return str;
+    }
     if (inet_ntop(AF_INET, &point.ip, str._buf, INET_ADDRSTRLEN) == NULL) {
         return endpoint2str(EndPoint(IP_NONE, 0));
     }
@@ -172,7 +366,62 @@ const char* my_hostname() {
     return get_leaky_singleton<MyAddressInfo>()->my_hostname;
 }
 
+static int parse_port(const char* str, int* port) {
+    char* end = NULL;
+    const long value = strtol(str, &end, 10);
+    if (end == str) {
+        return -1;
+    } else if (*end) {
+        for (; isspace(*end); ++end);
+        if (*end) {
+            return -1;
+        }
+    }
+    if (value < 0 || value > 65535) {
+        return -1;
+    }
+    *port = value;
+    return 0;
+}
+
+// Parse IPv6 address optionally surrounded by brackets.
+static int str2ip6(const char* ip_str, in6_addr* addr) {
+    char buf[INET6_ADDRSTRLEN + 2];
+    for (; isspace(*ip_str); ++ip_str);
+    if (*ip_str == '[') {
+        ++ip_str;
+    }
+    size_t i = 0;
+    for (; i < sizeof(buf) - 1 && ip_str[i] != '\0' && ip_str[i] != ']'; ++i) {
+        buf[i] = ip_str[i];
+    }
+    buf[i] = '\0';
+    return inet_pton(AF_INET6, buf, addr) > 0 ? 0 : -1;
+}
+
 int str2endpoint(const char* str, EndPoint* point) {
+    if (strncmp(str, "unix:", 5) == 0) {
+        const char* path = str + 5;
+        sockaddr_storage ss;
+        socklen_t size = 0;
+        if (*path == '\0' ||
+            make_un_sockaddr(path, strlen(path), &ss, &size) != 0) {
+            return -1;
+        }
+        return details::create_extended_endpoint(ss, size, point);
+    }
+    if (*str == '[') {
+        const char* end = strchr(str, ']');
+        int port = 0;
+        in6_addr addr;
+        if (end == NULL || end[1] != ':' || str2ip6(str, &addr) != 0 ||
+            parse_port(end + 2, &port) != 0) {
+            return -1;
+        }
+        sockaddr_storage ss;
+        const socklen_t size = make_in6_sockaddr(addr, port, 0, &ss);
+        return details::create_extended_endpoint(ss, size, point);
+    }
     // Should be enough to hold ip address
     char buf[64];
     size_t i = 0;
@@ -183,12 +432,13 @@ int str2endpoint(const char* str, EndPoint* point) {
         return -1;
     }
     buf[i] = '\0';
-    if (str2ip(buf, &point->ip) != 0) {
+    ip_t ip;
+    if (str2ip(buf, &ip) != 0) {
         return -1;
     }
     ++i;
     char* end = NULL;
-    point->port = strtol(str + i, &end, 10);
+    const long port = strtol(str + i, &end, 10);
     if (end == str + i) {
         return -1;
     } else if (*end) {
@@ -197,24 +447,35 @@ int str2endpoint(const char* str, EndPoint* point) {
             return -1;
         }
     }
-    if (point->port < 0 || point->port > 65535) {
+    if (port < 0 || port > 65535) {
         return -1;
     }
+    *point = EndPoint(ip, port);
     return 0;
 }
 
 int str2endpoint(const char* ip_str, int port, EndPoint* point) {
-    if (str2ip(ip_str, &point->ip) != 0) {
-        return -1;
-    }
     if (port < 0 || port > 65535) {
         return -1;
     }
-    point->port = port;
-    return 0;
+    ip_t ip;
+    if (str2ip(ip_str, &ip) == 0) {
+        *point = EndPoint(ip, port);
+        return 0;
+    }
+    in6_addr addr;
+    if (ip_str != NULL && str2ip6(ip_str, &addr) == 0) {
+        sockaddr_storage ss;
+        const socklen_t size = make_in6_sockaddr(addr, port, 0, &ss);
+        return details::create_extended_endpoint(ss, size, point);
+    }
+    return -1;
 }
 
 int hostname2endpoint(const char* str, EndPoint* point) {
+    if (strncmp(str, "unix:", 5) == 0 || *str == '[') {
+        return str2endpoint(str, point);
+    }
     // Should be enough to hold ip address
     char buf[64];
     size_t i = 0;
@@ -226,14 +487,15 @@ int hostname2endpoint(const char* str, EndPoint* point) {
     }
 
     buf[i] = '\0';
-    if (hostname2ip(buf, &point->ip) != 0) {
+    ip_t ip;
+    if (hostname2ip(buf, &ip) != 0) {
         return -1;
     }
     if (str[i] == ':') {
         ++i;
     }
     char* end = NULL;
-    point->port = strtol(str + i, &end, 10);
+    const long port = strtol(str + i, &end, 10);
     if (end == str + i) {
         return -1;
     } else if (*end) {
@@ -242,24 +504,39 @@ int hostname2endpoint(const char* str, EndPoint* point) {
             return -1;
         }
     }
-    if (point->port < 0 || point->port > 65535) {
+    if (port < 0 || port > 65535) {
         return -1;
     }
+    *point = EndPoint(ip, port);
     return 0;
 }
 
 int hostname2endpoint(const char* name_str, int port, EndPoint* point) {
-    if (hostname2ip(name_str, &point->ip) != 0) {
+    in6_addr addr;
+    if (name_str != NULL && str2ip6(name_str, &addr) == 0) {
+        return str2endpoint(name_str, port, point);
+    }
+    ip_t ip;
+    if (hostname2ip(name_str, &ip) != 0) {
         return -1;
     }
     if (port < 0 || port > 65535) {
         return -1;
     }
-    point->port = port;
+    *point = EndPoint(ip, port);
     return 0;
 }
 
 int endpoint2hostname(const EndPoint& point, char* host, size_t host_len) {
+    if (is_endpoint_extended(point)) {
+        // Reverse lookup is only done for IPv4.
+        if (host == NULL || host_len == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        snprintf(host, host_len, "%s", endpoint2str(point).c_str());
+        return 0;
+    }
     if (ip2hostname(point.ip, host, host_len) == 0) {
         size_t len = strlen(host);
         if (len + 1 < host_len) {
@@ -280,38 +557,54 @@ int endpoint2hostname(const EndPoint& point, std::string* host) {
 }
 
 int tcp_connect(EndPoint point, int* self_port) {
-    fd_guard sockfd(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_size = 0;
+    if (endpoint2sockaddr(point, &serv_addr, &serv_addr_size) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    fd_guard sockfd(socket(serv_addr.ss_family, SOCK_STREAM, 0));
     if (sockfd < 0) {
         return -1;
     }
-    struct sockaddr_in serv_addr;
-    bzero((char*)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr = point.ip;
-    serv_addr.sin_port = htons(point.port);
     int rc = 0;
     if (bthread_connect != NULL) {
         rc = bthread_connect(sockfd, (struct sockaddr*)&serv_addr,
-                             sizeof(serv_addr));
+                             serv_addr_size);
     } else {
-        rc = ::connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+        rc = ::connect(sockfd, (struct sockaddr*)&serv_addr, serv_addr_size);
     }
     if (rc < 0) {
         return -1;
     }
     if (self_port != NULL) {
-        EndPoint pt;
-        if (get_local_side(sockfd, &pt) == 0) {
-            *self_port = pt.port;
-        } else {
+        struct sockaddr_storage addr;
+        socklen_t socklen = sizeof(addr);
+        if (getsockname(sockfd, (struct sockaddr*)&addr, &socklen) != 0) {
             CHECK(false) << "Fail to get the local port of sockfd=" << sockfd;
+        } else if (addr.ss_family == AF_INET) {
+            *self_port = ntohs(((sockaddr_in*)&addr)->sin_port);
+        } else if (addr.ss_family == AF_INET6) {
+            *self_port = ntohs(((sockaddr_in6*)&addr)->sin6_port);
+        } else {
+            *self_port = 0;
         }
     }
     return sockfd.release();
 }
 
 int tcp_listen(EndPoint point) {
-    fd_guard sockfd(socket(AF_INET, SOCK_STREAM, 0));
+    return tcp_listen(point, false);
+}
+
+int tcp_listen(EndPoint point, bool reuse_port) {
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_size = 0;
+    if (endpoint2sockaddr(point, &serv_addr, &serv_addr_size) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    fd_guard sockfd(socket(serv_addr.ss_family, SOCK_STREAM, 0));
     if (sockfd < 0) {
         return -1;
     }
@@ -329,11 +622,14 @@ int tcp_listen(EndPoint point) {
 #endif
     }
 
-    if (FLAGS_reuse_port) {
+    if ((reuse_port || FLAGS_reuse_port) && serv_addr.ss_family != AF_UNIX) {
 #if defined(SO_REUSEPORT)
         const int on = 1;
         if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
                        &on, sizeof(on)) != 0) {
+            if (reuse_port) {
+                return -1;
+            }
             LOG(WARNING) << "Fail to setsockopt SO_REUSEPORT of sockfd=" << sockfd;
         }
 #else
@@ -342,12 +638,7 @@ int tcp_listen(EndPoint point) {
 #endif
     }
 
-    struct sockaddr_in serv_addr;
-    bzero((char*)&serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr = point.ip;
-    serv_addr.sin_port = htons(point.port);
-    if (bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) != 0) {
+    if (bind(sockfd, (struct sockaddr*)&serv_addr, serv_addr_size) != 0) {
         return -1;
     }
     if (listen(sockfd, 65535) != 0) {
@@ -360,27 +651,27 @@ int tcp_listen(EndPoint point) {
 }
 
 int get_local_side(int fd, EndPoint *out) {
-    struct sockaddr addr;
+    struct sockaddr_storage addr;
     socklen_t socklen = sizeof(addr);
-    const int rc = getsockname(fd, &addr, &socklen);
+    const int rc = getsockname(fd, (struct sockaddr*)&addr, &socklen);
     if (rc != 0) {
         return rc;
     }
     if (out) {
-        *out = butil::EndPoint(*(sockaddr_in*)&addr);
+        return sockaddr2endpoint(&addr, socklen, out);
     }
     return 0;
 }
 
 int get_remote_side(int fd, EndPoint *out) {
-    struct sockaddr addr;
+    struct sockaddr_storage addr;
     socklen_t socklen = sizeof(addr);
-    const int rc = getpeername(fd, &addr, &socklen);
+    const int rc = getpeername(fd, (struct sockaddr*)&addr, &socklen);
     if (rc != 0) {
         return rc;
     }
     if (out) {
-        *out = butil::EndPoint(*(sockaddr_in*)&addr);
+        return sockaddr2endpoint(&addr, socklen, out);
     }
     return 0;
 }
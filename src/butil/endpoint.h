@@ -23,6 +23,8 @@
 #define BUTIL_ENDPOINT_H
 
 #include <netinet/in.h>                          // in_addr
+#include <sys/socket.h>                          // sockaddr_storage
+#include <sys/un.h>                              // sockaddr_un
 #include <iostream>                              // std::ostream
 #include "butil/containers/hash_tables.h"         // hashing functions
 
@@ -79,20 +81,74 @@ ip_t my_ip();
 // String form.
 const char* my_ip_cstr();
 
-// ipv4 + port
+// EndPoints of IPv6 addresses and unix domain sockets are "extended":
+// `port' is EXTENDED_ENDPOINT_PORT which is never a valid port and `ip' is
+// the id of a reference-counted address shared by all EndPoints of the
+// same address, thus comparing and hashing EndPoints with ip and port
+// still work, and EndPoints of IPv4 are as small and cheap as before.
+static const int EXTENDED_ENDPOINT_PORT = 123456789;
+
+namespace details {
+void extended_endpoint_ref(ip_t id);
+void extended_endpoint_unref(ip_t id);
+}  // namespace details
+
+// ipv4 + port, or an extended address(see above)
 struct EndPoint {
     EndPoint() : ip(IP_ANY), port(0) {}
     EndPoint(ip_t ip2, int port2) : ip(ip2), port(port2) {}
     explicit EndPoint(const sockaddr_in& in)
         : ip(in.sin_addr), port(ntohs(in.sin_port)) {}
-    
+    EndPoint(const EndPoint& rhs) : ip(rhs.ip), port(rhs.port) {
+        if (port == EXTENDED_ENDPOINT_PORT) {
+            details::extended_endpoint_ref(ip);
+        }
+    }
+    ~EndPoint() {
+        if (port == EXTENDED_ENDPOINT_PORT) {
+            details::extended_endpoint_unref(ip);
+        }
+    }
+    EndPoint& operator=(const EndPoint& rhs) {
+        if (rhs.port == EXTENDED_ENDPOINT_PORT) {
+            details::extended_endpoint_ref(rhs.ip);
+        }
+        if (port == EXTENDED_ENDPOINT_PORT) {
+            details::extended_endpoint_unref(ip);
+        }
+        ip = rhs.ip;
+        port = rhs.port;
+        return *this;
+    }
+
+    // NOTE: Don't modify fields of extended EndPoints.
     ip_t ip;
     int port;
 };
 
+inline bool is_endpoint_extended(const EndPoint& point) {
+    return point.port == EXTENDED_ENDPOINT_PORT;
+}
+
+// Address family of `point': AF_INET, AF_INET6 or AF_UNIX.
+sa_family_t get_endpoint_type(const EndPoint& point);
+
+// Convert `point' to sockaddr which can be passed to connect/bind, and
+// write size of the sockaddr into `size' if it's not NULL.
+// Returns 0 on success, -1 otherwise.
+int endpoint2sockaddr(const EndPoint& point, struct sockaddr_storage* ss,
+                      socklen_t* size = NULL);
+
+// Convert sockaddr of AF_INET, AF_INET6 or AF_UNIX returned by accept,
+// getsockname, getpeername... to EndPoint.
+// Returns 0 on success, -1 otherwise.
+int sockaddr2endpoint(const struct sockaddr_storage* ss, socklen_t size,
+                      EndPoint* point);
+
 struct EndPointStr {
     const char* c_str() const { return _buf; }
-    char _buf[INET_ADDRSTRLEN + 16];
+    // Large enough to hold `unix:<path>'
+    char _buf[sizeof("unix:") + sizeof(((sockaddr_un*)0)->sun_path)];
 };
 
 // Convert EndPoint to c-style string. Notice that you can serialize 
@@ -102,6 +158,9 @@ struct EndPointStr {
 EndPointStr endpoint2str(const EndPoint&);
 
 // Convert string `ip_and_port_str' to a EndPoint *point.
+// Besides `127.0.0.1:8000', `[::1]:8000' of IPv6 and `unix:/path/to/sock'
+// of unix domain sockets are accepted as well. `ip_str' in the second
+// version can be IPv4 or IPv6.
 // Returns 0 on success, -1 otherwise.
 int str2endpoint(const char* ip_and_port_str, EndPoint* point);
 int str2endpoint(const char* ip_str, int port, EndPoint* point);
@@ -118,15 +177,24 @@ int endpoint2hostname(const EndPoint& point, std::string* host);
 
 // Create a TCP socket and connect it to `server'. Write port of this side
 // into `self_port' if it's not NULL.
+// A unix domain socket is created if `server' is unix:<path>, in which case
+// `self_port' is set to 0.
 // Returns the socket descriptor, -1 otherwise and errno is set.
 int tcp_connect(EndPoint server, int* self_port);
 
 // Create and listen to a TCP socket bound with `ip_and_port'.
 // To enable SO_REUSEADDR for the whole program, enable gflag -reuse_addr
 // To enable SO_REUSEPORT for the whole program, enable gflag -reuse_port
+// A unix domain socket is created if `ip_and_port' is unix:<path>, which
+// fails with EADDRINUSE if the path exists.
 // Returns the socket descriptor, -1 otherwise and errno is set.
 int tcp_listen(EndPoint ip_and_port);
 
+// Same as above, but SO_REUSEPORT is enabled(and must succeed) if
+// `reuse_port' is true regardless of -reuse_port, so that several sockets
+// can listen to the same address.
+int tcp_listen(EndPoint ip_and_port, bool reuse_port);
+
 // Get the local end of a socket connection
 int get_local_side(int fd, EndPoint *out);
 
@@ -185,6 +253,9 @@ inline bool operator!=(EndPoint p1, EndPoint p2) {
 }
 
 inline std::ostream& operator<<(std::ostream& os, const EndPoint& ep) {
+    if (is_endpoint_extended(ep)) {
+        return os << endpoint2str(ep).c_str();
+    }
     return os << ep.ip << ':' << ep.port;
 }
 inline std::ostream& operator<<(std::ostream& os, const EndPointStr& ep_str) {
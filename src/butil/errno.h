@@ -22,7 +22,7 @@
 #ifndef BUTIL_BAIDU_ERRNO_H
 #define BUTIL_BAIDU_ERRNO_H
 
-#define __const__
+#define __const__ __unused__
 #include <errno.h>                           // errno
 #include "butil/macros.h"                     // BAIDU_CONCAT
 
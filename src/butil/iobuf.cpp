@@ -25,18 +25,39 @@
 #include <mesalink/openssl/err.h>
 #endif
 #include <sys/syscall.h>                   // syscall
+#include <sys/socket.h>                    // sendmsg
+#include <sys/mman.h>                      // mmap
+#include <unistd.h>                        // getpagesize
 #include <fcntl.h>                         // O_RDONLY
 #include <errno.h>                         // errno
 #include <limits.h>                        // CHAR_BIT
 #include <stdexcept>                       // std::invalid_argument
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>                     // _mm_cmpestri
+#endif
+#include <gflags/gflags.h>
 #include "butil/build_config.h"             // ARCH_CPU_X86_64
 #include "butil/atomicops.h"                // butil::atomic
 #include "butil/thread_local.h"             // thread_atexit
 #include "butil/macros.h"                   // BAIDU_CASSERT
 #include "butil/logging.h"                  // CHECK, LOG
 #include "butil/fd_guard.h"                 // butil::fd_guard
+#include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
 #include "butil/iobuf.h"
 
+DEFINE_int32(iobuf_max_block_size, butil::IOBuf::HUGE_BLOCK_SIZE,
+             "Max size of IOBuf blocks which are chosen from size classes "
+             "of 8K, 64K and 1M according to sizes of appended or read data, "
+             "set to 8192 to use blocks of DEFAULT_BLOCK_SIZE only");
+
+DEFINE_bool(iobuf_track_block_owners, false,
+            "Charge IOBuf blocks to owners set by butil::iobuf::"
+            "ScopedBlockOwner when the blocks are created");
+
+#if defined(OS_LINUX) && !defined(MSG_ZEROCOPY)
+#define MSG_ZEROCOPY 0x4000000             // Since linux 4.14
+#endif
+
 namespace butil {
 namespace iobuf {
 
@@ -169,6 +190,18 @@ void reset_blockmem_allocate_and_deallocate() {
     blockmem_deallocate = ::free;
 }
 
+BlockAllocator get_block_allocator() {
+    const BlockAllocator allocator = { blockmem_allocate, blockmem_deallocate };
+    return allocator;
+}
+
+BlockAllocator set_block_allocator(const BlockAllocator& allocator) {
+    const BlockAllocator prev = get_block_allocator();
+    blockmem_allocate = allocator.allocate;
+    blockmem_deallocate = allocator.deallocate;
+    return prev;
+}
+
 butil::static_atomic<size_t> g_nblock = BUTIL_STATIC_ATOMIC_INIT(0);
 butil::static_atomic<size_t> g_blockmem = BUTIL_STATIC_ATOMIC_INIT(0);
 butil::static_atomic<size_t> g_newbigview = BUTIL_STATIC_ATOMIC_INIT(0);
@@ -188,10 +221,78 @@ size_t IOBuf::new_bigview_count() {
 }
 
 const uint16_t IOBUF_BLOCK_FLAGS_USER_DATA = 0x1;
+// Higher bits of flags of blocks with memory allocated by IOBuf are id of
+// the owner charged for the block, 0 means not charged.
+const int IOBUF_BLOCK_OWNER_SHIFT = 8;
 typedef void (*UserDataDeleter)(void*);
+typedef void (*UserDataDeleterWithArg)(void*, void*);
+
+namespace iobuf {
+
+struct BlockOwner {
+    // Set once when the owner is registered.
+    char name[32];
+    butil::atomic<int64_t> nblock;
+    butil::atomic<int64_t> nbytes;
+};
+
+static BlockOwner g_block_owners[MAX_BLOCK_OWNERS];
+static butil::static_atomic<int> g_nblock_owner = BUTIL_STATIC_ATOMIC_INIT(1);
+static pthread_mutex_t g_block_owner_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int tls_block_owner = 0;
+
+inline void charge_block_owner(int owner, int64_t nblock, int64_t nbytes) {
+    BlockOwner& o = g_block_owners[owner];
+    o.nblock.fetch_add(nblock, butil::memory_order_relaxed);
+    o.nbytes.fetch_add(nbytes, butil::memory_order_relaxed);
+}
+
+int register_block_owner(const char* name) {
+    BAIDU_SCOPED_LOCK(g_block_owner_mutex);
+    const int n = g_nblock_owner.load(butil::memory_order_relaxed);
+    for (int i = 1; i < n; ++i) {
+        if (strncmp(g_block_owners[i].name, name,
+                    sizeof(g_block_owners[i].name) - 1) == 0) {
+            return i;
+        }
+    }
+    if (n >= MAX_BLOCK_OWNERS) {
+        LOG(ERROR) << "Too many owners of IOBuf blocks";
+        return 0;
+    }
+    snprintf(g_block_owners[n].name, sizeof(g_block_owners[n].name), "%s", name);
+    g_nblock_owner.store(n + 1, butil::memory_order_release);
+    return n;
+}
+
+ScopedBlockOwner::ScopedBlockOwner(int owner)
+    : _saved_owner(tls_block_owner) {
+    tls_block_owner = owner;
+}
+
+ScopedBlockOwner::~ScopedBlockOwner() {
+    tls_block_owner = _saved_owner;
+}
+
+void list_block_owners(std::vector<BlockOwnerStat>* out) {
+    out->clear();
+    const int n = g_nblock_owner.load(butil::memory_order_acquire);
+    for (int i = 1; i < n; ++i) {
+        BlockOwnerStat st;
+        st.name = g_block_owners[i].name;
+        st.nblock = g_block_owners[i].nblock.load(butil::memory_order_relaxed);
+        st.nbytes = g_block_owners[i].nbytes.load(butil::memory_order_relaxed);
+        out->push_back(st);
+    }
+}
+
+}  // namespace iobuf
 
 struct UserDataExtension {
     UserDataDeleter deleter;
+    // Called instead of `deleter' if it's not NULL.
+    UserDataDeleterWithArg deleter_with_arg;
+    void* arg;
 };
 
 struct IOBuf::Block {
@@ -227,7 +328,10 @@ struct IOBuf::Block {
         , cap(data_size)
         , portal_next(NULL)
         , data(data_in) {
-        get_user_data_extension()->deleter = deleter;
+        UserDataExtension* ext = get_user_data_extension();
+        ext->deleter = deleter;
+        ext->deleter_with_arg = NULL;
+        ext->arg = NULL;
     }
 
     // Undefined behavior when (flags & IOBUF_BLOCK_FLAGS_USER_DATA) is 0.
@@ -254,14 +358,23 @@ struct IOBuf::Block {
         check_abi();
         if (nshared.fetch_sub(1, butil::memory_order_release) == 1) {
             butil::atomic_thread_fence(butil::memory_order_acquire);
-            if (!flags) {
+            if (!(flags & IOBUF_BLOCK_FLAGS_USER_DATA)) {
                 iobuf::g_nblock.fetch_sub(1, butil::memory_order_relaxed);
                 iobuf::g_blockmem.fetch_sub(cap + sizeof(Block),
                                             butil::memory_order_relaxed);
+                const int owner = (flags >> IOBUF_BLOCK_OWNER_SHIFT);
+                if (owner) {
+                    iobuf::charge_block_owner(owner, -1, -(int64_t)(cap + sizeof(Block)));
+                }
                 this->~Block();
                 iobuf::blockmem_deallocate(this);
-            } else if (flags & IOBUF_BLOCK_FLAGS_USER_DATA) {
-                get_user_data_extension()->deleter(data);
+            } else {
+                UserDataExtension* ext = get_user_data_extension();
+                if (ext->deleter_with_arg) {
+                    ext->deleter_with_arg(data, ext->arg);
+                } else {
+                    ext->deleter(data);
+                }
                 this->~Block();
                 free(this);
             }
@@ -302,35 +415,78 @@ inline IOBuf::Block* create_block(const size_t block_size) {
     if (mem == NULL) {
         return NULL;
     }
-    return new (mem) IOBuf::Block(mem + sizeof(IOBuf::Block),
-                                  block_size - sizeof(IOBuf::Block));
+    IOBuf::Block* b = new (mem) IOBuf::Block(mem + sizeof(IOBuf::Block),
+                                             block_size - sizeof(IOBuf::Block));
+    const int owner = tls_block_owner;
+    if (owner && FLAGS_iobuf_track_block_owners) {
+        b->flags = (uint16_t)(owner << IOBUF_BLOCK_OWNER_SHIFT);
+        charge_block_owner(owner, 1, block_size);
+    }
+    return b;
 }
 
 inline IOBuf::Block* create_block() {
     return create_block(IOBuf::DEFAULT_BLOCK_SIZE);
 }
 
-// === Share TLS blocks between appending operations ===
-// Max number of blocks in each TLS. This is a soft limit namely
-// release_tls_block_chain() may exceed this limit sometimes.
-const int MAX_BLOCKS_PER_THREAD = 8;
+// === Block size classes ===
+// Appending or reading large data into blocks of DEFAULT_BLOCK_SIZE makes
+// too many BlockRefs and iovecs, larger classes are used when the data to
+// be copied or read is not less than size of the class. Each class has its
+// own TLS block chain.
+static const size_t BLOCK_CLASS_SIZE[IOBuf::BLOCK_CLASS_NUM] = {
+    IOBuf::DEFAULT_BLOCK_SIZE,
+    IOBuf::LARGE_BLOCK_SIZE,
+    IOBuf::HUGE_BLOCK_SIZE,
+};
+
+// Max number of blocks in each TLS chain of the class. This is a soft
+// limit namely release_tls_block_chain() may exceed this limit sometimes.
+static const int MAX_BLOCKS_PER_THREAD[IOBuf::BLOCK_CLASS_NUM] = { 8, 2, 1 };
 
+// Class of blocks to hold `nbytes' bytes.
+inline int block_class_of(size_t nbytes) {
+    const size_t max_size = (size_t)FLAGS_iobuf_max_block_size;
+    for (int i = IOBuf::BLOCK_CLASS_NUM - 1; i > 0; --i) {
+        if (nbytes >= BLOCK_CLASS_SIZE[i] && max_size >= BLOCK_CLASS_SIZE[i]) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// Class that the block belongs to. Blocks with other sizes (created by
+// IOBufAsZeroCopyOutputStream with block_size) are put in class 0 as before.
+inline int block_class_of(const IOBuf::Block* b) {
+    const size_t size = b->cap + sizeof(IOBuf::Block);
+    for (int i = IOBuf::BLOCK_CLASS_NUM - 1; i > 0; --i) {
+        if (size == BLOCK_CLASS_SIZE[i]) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// === Share TLS blocks between appending operations ===
 struct TLSData {
     // Head of the TLS block chain.
     IOBuf::Block* block_head;
     
     // Number of TLS blocks
     int num_blocks;
-    
-    // True if the remote_tls_block_chain is registered to the thread.
-    bool registered;
 };
 
-static __thread TLSData g_tls_data = { NULL, 0, false };
+static __thread TLSData g_tls_data[IOBuf::BLOCK_CLASS_NUM] = {
+    { NULL, 0 }, { NULL, 0 }, { NULL, 0 } };
+
+// True if the remove_tls_block_chain is registered to the thread.
+static __thread bool g_tls_registered = false;
 
 // Used in UT
-IOBuf::Block* get_tls_block_head() { return g_tls_data.block_head; }
-int get_tls_block_count() { return g_tls_data.num_blocks; }
+IOBuf::Block* get_tls_block_head(int cls) { return g_tls_data[cls].block_head; }
+int get_tls_block_count(int cls) { return g_tls_data[cls].num_blocks; }
+IOBuf::Block* get_tls_block_head() { return get_tls_block_head(0); }
+int get_tls_block_count() { return get_tls_block_count(0); }
 
 // Number of blocks that can't be returned to TLS which has too many block
 // already. This counter should be 0 in most scenarios, otherwise performance
@@ -339,27 +495,37 @@ static butil::static_atomic<size_t> g_num_hit_tls_threshold = BUTIL_STATIC_ATOMI
 
 // Called in UT.
 void remove_tls_block_chain() {
-    TLSData& tls_data = g_tls_data;
-    IOBuf::Block* b = tls_data.block_head;
-    if (!b) {
-        return;
+    for (int i = 0; i < IOBuf::BLOCK_CLASS_NUM; ++i) {
+        TLSData& tls_data = g_tls_data[i];
+        IOBuf::Block* b = tls_data.block_head;
+        if (!b) {
+            continue;
+        }
+        tls_data.block_head = NULL;
+        int n = 0;
+        do {
+            IOBuf::Block* const saved_next = b->portal_next;
+            b->dec_ref();
+            b = saved_next;
+            ++n;
+        } while (b);
+        CHECK_EQ(n, tls_data.num_blocks);
+        tls_data.num_blocks = 0;
+    }
+}
+
+inline void register_tls_block_chain() {
+    if (!g_tls_registered) {
+        g_tls_registered = true;
+        // Only register atexit at the first time
+        butil::thread_atexit(remove_tls_block_chain);
     }
-    tls_data.block_head = NULL;
-    int n = 0;
-    do {
-        IOBuf::Block* const saved_next = b->portal_next;
-        b->dec_ref();
-        b = saved_next;
-        ++n;
-    } while (b);
-    CHECK_EQ(n, tls_data.num_blocks);
-    tls_data.num_blocks = 0;
 }
 
-// Get a (non-full) block from TLS.
+// Get a (non-full) block of class `cls' from TLS.
 // Notice that the block is not removed from TLS.
-IOBuf::Block* share_tls_block() {
-    TLSData& tls_data = g_tls_data;
+IOBuf::Block* share_tls_block(int cls) {
+    TLSData& tls_data = g_tls_data[cls];
     IOBuf::Block* const b = tls_data.block_head;
     if (b != NULL && !b->full()) {
         return b;
@@ -373,13 +539,11 @@ IOBuf::Block* share_tls_block() {
             --tls_data.num_blocks;
             new_block = saved_next;
         }
-    } else if (!tls_data.registered) {
-        tls_data.registered = true;
-        // Only register atexit at the first time
-        butil::thread_atexit(remove_tls_block_chain);
+    } else {
+        register_tls_block_chain();
     }
     if (!new_block) {
-        new_block = create_block(); // may be NULL
+        new_block = create_block(BLOCK_CLASS_SIZE[cls]); // may be NULL
         if (new_block) {
             ++tls_data.num_blocks;
         }
@@ -388,69 +552,83 @@ IOBuf::Block* share_tls_block() {
     return new_block;
 }
 
+IOBuf::Block* share_tls_block() {
+    return share_tls_block(0);
+}
+
 // Return one block to TLS.
 inline void release_tls_block(IOBuf::Block *b) {
     if (!b) {
         return;
     }
-    TLSData& tls_data = g_tls_data;
+    const int cls = block_class_of(b);
+    TLSData& tls_data = g_tls_data[cls];
     if (b->full()) {
         b->dec_ref();
-    } else if (tls_data.num_blocks >= MAX_BLOCKS_PER_THREAD) {
+    } else if (tls_data.num_blocks >= MAX_BLOCKS_PER_THREAD[cls]) {
         b->dec_ref();
         g_num_hit_tls_threshold.fetch_add(1, butil::memory_order_relaxed);
     } else {
         b->portal_next = tls_data.block_head;
         tls_data.block_head = b;
         ++tls_data.num_blocks;
-        if (!tls_data.registered) {
-            tls_data.registered = true;
-            butil::thread_atexit(remove_tls_block_chain);
-        }
+        register_tls_block_chain();
     }
 }
 
 // Return chained blocks to TLS.
 // NOTE: b MUST be non-NULL and all blocks linked SHOULD not be full.
 void release_tls_block_chain(IOBuf::Block* b) {
-    TLSData& tls_data = g_tls_data;
-    size_t n = 0;
-    if (tls_data.num_blocks >= MAX_BLOCKS_PER_THREAD) {
-        do {
-            ++n;
-            IOBuf::Block* const saved_next = b->portal_next;
-            b->dec_ref();
-            b = saved_next;
-        } while (b);
-        g_num_hit_tls_threshold.fetch_add(n, butil::memory_order_relaxed);
-        return;
-    }
-    IOBuf::Block* first_b = b;
-    IOBuf::Block* last_b = NULL;
+    // Split the chain by classes, keeping the order.
+    IOBuf::Block* first_b[IOBuf::BLOCK_CLASS_NUM] = { NULL, NULL, NULL };
+    IOBuf::Block* last_b[IOBuf::BLOCK_CLASS_NUM] = { NULL, NULL, NULL };
+    int n[IOBuf::BLOCK_CLASS_NUM] = { 0, 0, 0 };
     do {
-        ++n;
-        CHECK(!b->full());
-        if (b->portal_next == NULL) {
-            last_b = b;
-            break;
+        IOBuf::Block* const saved_next = b->portal_next;
+        const int cls = block_class_of(b);
+        b->portal_next = NULL;
+        if (last_b[cls] != NULL) {
+            last_b[cls]->portal_next = b;
+        } else {
+            first_b[cls] = b;
         }
-        b = b->portal_next;
-    } while (true);
-    last_b->portal_next = tls_data.block_head;
-    tls_data.block_head = first_b;
-    tls_data.num_blocks += n;
-    if (!tls_data.registered) {
-        tls_data.registered = true;
-        butil::thread_atexit(remove_tls_block_chain);
+        last_b[cls] = b;
+        ++n[cls];
+        b = saved_next;
+    } while (b);
+
+    for (int i = 0; i < IOBuf::BLOCK_CLASS_NUM; ++i) {
+        if (first_b[i] == NULL) {
+            continue;
+        }
+        TLSData& tls_data = g_tls_data[i];
+        if (tls_data.num_blocks >= MAX_BLOCKS_PER_THREAD[i]) {
+            b = first_b[i];
+            do {
+                IOBuf::Block* const saved_next = b->portal_next;
+                b->dec_ref();
+                b = saved_next;
+            } while (b);
+            g_num_hit_tls_threshold.fetch_add(n[i], butil::memory_order_relaxed);
+            continue;
+        }
+        for (IOBuf::Block* p = first_b[i]; p != NULL; p = p->portal_next) {
+            CHECK(!p->full());
+        }
+        last_b[i]->portal_next = tls_data.block_head;
+        tls_data.block_head = first_b[i];
+        tls_data.num_blocks += n[i];
+        register_tls_block_chain();
     }
 }
 
-// Get and remove one (non-full) block from TLS. If TLS is empty, create one.
-IOBuf::Block* acquire_tls_block() {
-    TLSData& tls_data = g_tls_data;
+// Get and remove one (non-full) block of class `cls' from TLS. If TLS is
+// empty, create one.
+IOBuf::Block* acquire_tls_block(int cls) {
+    TLSData& tls_data = g_tls_data[cls];
     IOBuf::Block* b = tls_data.block_head;
     if (!b) {
-        return create_block();
+        return create_block(BLOCK_CLASS_SIZE[cls]);
     }
     while (b->full()) {
         IOBuf::Block* const saved_next = b->portal_next;
@@ -459,7 +637,7 @@ IOBuf::Block* acquire_tls_block() {
         --tls_data.num_blocks;
         b = saved_next;
         if (!b) {
-            return create_block();
+            return create_block(BLOCK_CLASS_SIZE[cls]);
         }
     }
     tls_data.block_head = b->portal_next;
@@ -468,6 +646,10 @@ IOBuf::Block* acquire_tls_block() {
     return b;
 }
 
+IOBuf::Block* acquire_tls_block() {
+    return acquire_tls_block(0);
+}
+
 inline IOBuf::BlockRef* acquire_blockref_array(size_t cap) {
     iobuf::g_newbigview.fetch_add(1, butil::memory_order_relaxed);
     return new IOBuf::BlockRef[cap];
@@ -853,62 +1035,171 @@ size_t IOBuf::cutn(std::string* out, size_t n) {
     return cutn(&(*out)[old_size], n);
 }
 
+const size_t IOBuf::npos;
+
 int IOBuf::_cut_by_char(IOBuf* out, char d) {
+    const size_t n = find(d);
+    if (n == npos) {
+        return -1;
+    }
+    // There's no way cutn/pop_front fails
+    cutn(out, n);
+    pop_front(1);
+    return 0;
+}
+
+int IOBuf::_cut_by_delim(IOBuf* out, char const* dbegin, size_t ndelim) {
+    const size_t n = find(butil::StringPiece(dbegin, ndelim));
+    if (n == npos) {
+        return -1;
+    }
+    // There's no way cutn/pop_front fails
+    cutn(out, n);
+    pop_front(ndelim);
+    return 0;
+}
+
+bool IOBuf::_equals_from(size_t i, size_t off, const butil::StringPiece& s) const {
     const size_t nref = _ref_num();
-    size_t n = 0;
-    
+    size_t soff = 0;
+    for (; i < nref && soff < s.size(); ++i, off = 0) {
+        const BlockRef& r = _ref_at(i);
+        const size_t n = std::min((size_t)r.length - off, s.size() - soff);
+        if (memcmp(r.block->data + r.offset + off, s.data() + soff, n) != 0) {
+            return false;
+        }
+        soff += n;
+    }
+    return soff == s.size();
+}
+
+size_t IOBuf::find(char c, size_t pos) const {
+    const size_t nref = _ref_num();
+    size_t base = 0;  // position of the first byte of current BlockRef
     for (size_t i = 0; i < nref; ++i) {
-        IOBuf::BlockRef const& r = _ref_at(i);
-        char const* const s = r.block->data + r.offset;
-        for (uint32_t j = 0; j < r.length; ++j, ++n) {
-            if (s[j] == d) {
-                // There's no way cutn/pop_front fails
-                cutn(out, n);
-                pop_front(1);
-                return 0;
+        const BlockRef& r = _ref_at(i);
+        if (pos < base + r.length) {
+            // memchr of libc is vectorized on all mainstream platforms.
+            const char* const s = r.block->data + r.offset;
+            const size_t off = (pos > base ? pos - base : 0);
+            const void* p = memchr(s + off, c, r.length - off);
+            if (p != NULL) {
+                return base + (static_cast<const char*>(p) - s);
             }
         }
+        base += r.length;
     }
+    return npos;
+}
 
-    return -1;
+size_t IOBuf::find(const butil::StringPiece& str, size_t pos) const {
+    if (str.size() <= 1) {
+        if (str.empty()) {
+            return pos <= size() ? pos : npos;
+        }
+        return find(str[0], pos);
+    }
+    const size_t nref = _ref_num();
+    size_t base = 0;
+    for (size_t i = 0; i < nref; ++i) {
+        const BlockRef& r = _ref_at(i);
+        if (pos < base + r.length) {
+            const char* const s = r.block->data + r.offset;
+            size_t off = (pos > base ? pos - base : 0);
+            while (off < r.length) {
+                const void* p = memchr(s + off, str[0], r.length - off);
+                if (p == NULL) {
+                    break;
+                }
+                off = static_cast<const char*>(p) - s;
+                if (_equals_from(i, off, str)) {
+                    return base + off;
+                }
+                ++off;
+            }
+        }
+        base += r.length;
+    }
+    return npos;
 }
 
-int IOBuf::_cut_by_delim(IOBuf* out, char const* dbegin, size_t ndelim) {
-    typedef unsigned long SigType;
-    const size_t NMAX = sizeof(SigType);
-    
-    if (ndelim > NMAX || ndelim > length()) {
-        return -1;
+namespace {
+// Matches bytes in a set of at most 256 bytes.
+class ByteSetMatcher {
+public:
+    explicit ByteSetMatcher(const butil::StringPiece& chars) {
+        memset(_bits, 0, sizeof(_bits));
+        for (size_t i = 0; i < chars.size(); ++i) {
+            const uint8_t c = chars[i];
+            _bits[c >> 6] |= ((uint64_t)1 << (c & 63));
+        }
+#if defined(__SSE4_2__)
+        _nchars = chars.size();
+        if (_nchars <= 16) {
+            char tmp[16] = {};
+            memcpy(tmp, chars.data(), _nchars);
+            _chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tmp));
+        }
+#endif
     }
-    
-    SigType dsig = 0;
-    for (size_t i = 0; i < ndelim; ++i) {
-        dsig = (dsig << CHAR_BIT) | static_cast<SigType>(dbegin[i]);
+
+    // Returns the first matched byte in [s, s + n), NULL otherwise.
+    const char* match(const char* s, size_t n) const {
+        size_t i = 0;
+#if defined(__SSE4_2__)
+        if (_nchars <= 16) {
+            // Compare 16 bytes with every byte of the set at once.
+            for (; i + 16 <= n; i += 16) {
+                const __m128i data =
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+                const int idx = _mm_cmpestri(
+                    _chars, _nchars, data, 16,
+                    _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                    _SIDD_LEAST_SIGNIFICANT);
+                if (idx < 16) {
+                    return s + i + idx;
+                }
+            }
+        }
+#endif
+        for (; i < n; ++i) {
+            const uint8_t c = s[i];
+            if (_bits[c >> 6] & ((uint64_t)1 << (c & 63))) {
+                return s + i;
+            }
+        }
+        return NULL;
     }
-    
-    const SigType SIGMASK =
-        (ndelim == NMAX ? (SigType)-1 : (((SigType)1 << (ndelim * CHAR_BIT)) - 1));
 
-    const size_t nref = _ref_num();
-    SigType sig = 0;
-    size_t n = 0;
+private:
+    uint64_t _bits[4];
+#if defined(__SSE4_2__)
+    int _nchars;
+    __m128i _chars;
+#endif
+};
+}  // namespace
 
+size_t IOBuf::find_first_of(const butil::StringPiece& chars, size_t pos) const {
+    if (chars.size() <= 1) {
+        return chars.empty() ? npos : find(chars[0], pos);
+    }
+    const ByteSetMatcher matcher(chars);
+    const size_t nref = _ref_num();
+    size_t base = 0;
     for (size_t i = 0; i < nref; ++i) {
-        IOBuf::BlockRef const& r = _ref_at(i);
-        char const* const s = r.block->data + r.offset;
-        
-        for (uint32_t j = 0; j < r.length; ++j, ++n) {
-            sig = ((sig << CHAR_BIT) | static_cast<SigType>(s[j])) & SIGMASK;
-            if (sig == dsig) {
-                // There's no way cutn/pop_front fails
-                cutn(out, n + 1 - ndelim);
-                pop_front(ndelim);
-                return 0;
+        const BlockRef& r = _ref_at(i);
+        if (pos < base + r.length) {
+            const char* const s = r.block->data + r.offset;
+            const size_t off = (pos > base ? pos - base : 0);
+            const char* p = matcher.match(s + off, r.length - off);
+            if (p != NULL) {
+                return base + (p - s);
             }
         }
+        base += r.length;
     }
-
-    return -1;
+    return npos;
 }
 
 // Since cut_into_file_descriptor() allocates iovec on stack, IOV_MAX=1024
@@ -1080,6 +1371,51 @@ ssize_t IOBuf::pcut_multiple_into_file_descriptor(
     return nw;
 }
 
+ssize_t IOBuf::cut_multiple_into_socket_zerocopy(
+    int fd, IOBuf* const* pieces, size_t count, IOBuf* sent) {
+#if defined(OS_LINUX)
+    struct iovec vec[IOBUF_IOV_MAX];
+    size_t nvec = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const IOBuf* p = pieces[i];
+        const size_t nref = p->_ref_num();
+        for (size_t j = 0; j < nref && nvec < IOBUF_IOV_MAX; ++j, ++nvec) {
+            IOBuf::BlockRef const& r = p->_ref_at(j);
+            vec[nvec].iov_base = r.block->data + r.offset;
+            vec[nvec].iov_len = r.length;
+        }
+    }
+    if (BAIDU_UNLIKELY(nvec == 0)) {
+        return 0;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = nvec;
+    const ssize_t nw = ::sendmsg(fd, &msg, MSG_ZEROCOPY);
+    if (nw <= 0) {
+        return nw;
+    }
+    // The kernel references the pages directly, move the blocks into
+    // `sent' rather than releasing them.
+    size_t ncut_all = nw;
+    for (size_t i = 0; i < count; ++i) {
+        ncut_all -= pieces[i]->cutn(sent, ncut_all);
+        if (ncut_all == 0) {
+            break;
+        }
+    }
+    return nw;
+#else
+    (void)fd;
+    (void)pieces;
+    (void)count;
+    (void)sent;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
 ssize_t IOBuf::cut_multiple_into_writer(
         IWriter* writer, IOBuf* const* pieces, size_t count) {
     if (BAIDU_UNLIKELY(count == 0)) {
@@ -1166,7 +1502,8 @@ int IOBuf::append(void const* data, size_t count) {
     }
     size_t total_nc = 0;
     while (total_nc < count) {  // excluded count == 0
-        IOBuf::Block* b = iobuf::share_tls_block();
+        IOBuf::Block* b = iobuf::share_tls_block(
+            iobuf::block_class_of(count - total_nc));
         if (BAIDU_UNLIKELY(!b)) {
             return -1;
         }
@@ -1225,6 +1562,94 @@ int IOBuf::append_user_data(void* data, size_t size, void (*deleter)(void*)) {
     return 0;
 }
 
+int IOBuf::append_user_data(void* data, size_t size,
+                            void (*deleter)(void*, void*), void* arg) {
+    if (size > 0xFFFFFFFFULL - 100) {
+        LOG(FATAL) << "data_size=" << size << " is too large";
+        return -1;
+    }
+    if (deleter == NULL) {
+        LOG(FATAL) << "deleter is NULL";
+        return -1;
+    }
+    char* mem = (char*)malloc(sizeof(IOBuf::Block) + sizeof(UserDataExtension));
+    if (mem == NULL) {
+        return -1;
+    }
+    IOBuf::Block* b = new (mem) IOBuf::Block((char*)data, size, NULL);
+    UserDataExtension* ext = b->get_user_data_extension();
+    ext->deleter_with_arg = deleter;
+    ext->arg = arg;
+    const IOBuf::BlockRef r = { 0, b->cap, b };
+    _move_back_ref(r);
+    return 0;
+}
+
+// A file range mapped by append_file_region(), unmapped after all blocks
+// referencing it are released.
+struct MappedFileRegion {
+    butil::atomic<int> nref;
+    void* addr;
+    size_t length;
+};
+
+static void release_mapped_file_region(MappedFileRegion* region, int n) {
+    if (region->nref.fetch_sub(n, butil::memory_order_release) == n) {
+        butil::atomic_thread_fence(butil::memory_order_acquire);
+        munmap(region->addr, region->length);
+        delete region;
+    }
+}
+
+static void release_file_region_block(void* /*data*/, void* arg) {
+    release_mapped_file_region(static_cast<MappedFileRegion*>(arg), 1);
+}
+
+int IOBuf::append_file_region(int fd, off_t offset, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (offset < 0) {
+        LOG(ERROR) << "Invalid offset=" << offset;
+        return -1;
+    }
+    // Offset of mmap() must be aligned with pages.
+    const off_t page_size = getpagesize();
+    const off_t map_offset = offset / page_size * page_size;
+    const size_t skipped = offset - map_offset;
+    void* addr = mmap(NULL, skipped + count, PROT_READ, MAP_SHARED,
+                      fd, map_offset);
+    if (addr == MAP_FAILED) {
+        PLOG(ERROR) << "Fail to mmap fd=" << fd << " offset=" << offset
+                    << " count=" << count;
+        return -1;
+    }
+    const size_t MAX_BLOCK_SIZE = 1UL << 30;
+    const int nblock = (count + MAX_BLOCK_SIZE - 1) / MAX_BLOCK_SIZE;
+    MappedFileRegion* region = new (std::nothrow) MappedFileRegion;
+    if (region == NULL) {
+        munmap(addr, skipped + count);
+        return -1;
+    }
+    region->nref.store(nblock, butil::memory_order_relaxed);
+    region->addr = addr;
+    region->length = skipped + count;
+    // Append to `this' only if all blocks are created.
+    IOBuf tmp;
+    char* p = (char*)addr + skipped;
+    for (int i = 0; i < nblock; ++i) {
+        const size_t n = std::min(count - i * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        if (tmp.append_user_data(p, n, release_file_region_block, region) != 0) {
+            // Blocks in `tmp' release their refs when `tmp' is destructed.
+            release_mapped_file_region(region, nblock - i);
+            return -1;
+        }
+        p += n;
+    }
+    append(tmp);
+    return 0;
+}
+
 int IOBuf::resize(size_t n, char c) {
     const size_t saved_len = length();
     if (n < saved_len) {
@@ -1234,7 +1659,8 @@ int IOBuf::resize(size_t n, char c) {
     const size_t count = n - saved_len;
     size_t total_nc = 0;
     while (total_nc < count) {  // excluded count == 0
-        IOBuf::Block* b = iobuf::share_tls_block();
+        IOBuf::Block* b = iobuf::share_tls_block(
+            iobuf::block_class_of(count - total_nc));
         if (BAIDU_UNLIKELY(!b)) {
             return -1;
         }
@@ -1301,6 +1727,42 @@ IOBuf::Area IOBuf::reserve(size_t count) {
     return result;
 }
 
+void* IOBuf::reserve_contiguous(size_t count) {
+    if (count == 0) {
+        return NULL;
+    }
+    // Find the smallest class whose blocks are able to hold `count' bytes.
+    int cls = 0;
+    while (iobuf::BLOCK_CLASS_SIZE[cls] - sizeof(IOBuf::Block) < count) {
+        if (++cls == BLOCK_CLASS_NUM ||
+            iobuf::BLOCK_CLASS_SIZE[cls] > (size_t)FLAGS_iobuf_max_block_size) {
+            return NULL;
+        }
+    }
+    IOBuf::Block* b = iobuf::share_tls_block(cls);
+    if (BAIDU_UNLIKELY(!b)) {
+        return NULL;
+    }
+    bool new_block = false;
+    if (b->left_space() < count) {
+        // Not enough space left in the TLS block, put a new block into TLS
+        // after reserving so that rest of it can be used by later appending.
+        b = iobuf::create_block(iobuf::BLOCK_CLASS_SIZE[cls]);
+        if (BAIDU_UNLIKELY(!b)) {
+            return NULL;
+        }
+        new_block = true;
+    }
+    char* const data = b->data + b->size;
+    const IOBuf::BlockRef r = { (uint32_t)b->size, (uint32_t)count, b };
+    _push_back_ref(r);
+    b->size += count;
+    if (new_block) {
+        iobuf::release_tls_block(b);
+    }
+    return data;
+}
+
 int IOBuf::unsafe_assign(Area area, const void* data) {
     if (area == INVALID_AREA || data == NULL) {
         LOG(ERROR) << "Invalid parameters";
@@ -1558,7 +2020,8 @@ ssize_t IOPortal::pappend_from_file_descriptor(
     // Prepare at most MAX_APPEND_IOVEC blocks or space of blocks >= max_count
     do {
         if (p == NULL) {
-            p = iobuf::acquire_tls_block();
+            p = iobuf::acquire_tls_block(
+                iobuf::block_class_of(max_count - space));
             if (BAIDU_UNLIKELY(!p)) {
                 errno = ENOMEM;
                 return -1;
@@ -1619,7 +2082,8 @@ ssize_t IOPortal::append_from_reader(IReader* reader, size_t max_count) {
     // Prepare at most MAX_APPEND_IOVEC blocks or space of blocks >= max_count
     do {
         if (p == NULL) {
-            p = iobuf::acquire_tls_block();
+            p = iobuf::acquire_tls_block(
+                iobuf::block_class_of(max_count - space));
             if (BAIDU_UNLIKELY(!p)) {
                 errno = ENOMEM;
                 return -1;
@@ -1671,7 +2135,8 @@ ssize_t IOPortal::append_from_SSL_channel(
     size_t nr = 0;
     do {
         if (!_block) {
-            _block = iobuf::acquire_tls_block();
+            _block = iobuf::acquire_tls_block(
+                iobuf::block_class_of(max_count - nr));
             if (BAIDU_UNLIKELY(!_block)) {
                 errno = ENOMEM;
                 *ssl_error = SSL_ERROR_SYSCALL;
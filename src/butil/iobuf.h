@@ -25,6 +25,7 @@
 #include <sys/uio.h>                             // iovec
 #include <stdint.h>                              // uint32_t
 #include <string>                                // std::string
+#include <vector>                                // std::vector
 #include <ostream>                               // std::ostream
 #include <google/protobuf/io/zero_copy_stream.h> // ZeroCopyInputStream
 #include "butil/strings/string_piece.h"           // butil::StringPiece
@@ -65,6 +66,11 @@ friend class IOBufBytesIterator;
 friend class IOBufCutter;
 public:
     static const size_t DEFAULT_BLOCK_SIZE = 8192;
+    // Larger size classes of blocks for appending and reading large data,
+    // see -iobuf_max_block_size.
+    static const size_t LARGE_BLOCK_SIZE = 65536;
+    static const size_t HUGE_BLOCK_SIZE = 1048576;
+    static const int BLOCK_CLASS_NUM = 3;
     static const size_t INITIAL_CAP = 32; // must be power of 2
 
     struct Block;
@@ -194,6 +200,14 @@ public:
     static ssize_t pcut_multiple_into_file_descriptor(
         int fd, off_t offset, IOBuf* const* pieces, size_t count);
 
+    // Cut `count' number of `pieces' into socket `fd' with MSG_ZEROCOPY
+    // (Linux >= 4.14). Instead of being released, blocks of the cut bytes
+    // are moved into `sent' which must be kept until the kernel reports
+    // completion of this send on the error queue of `fd'.
+    // Returns bytes cut on success, -1 otherwise and errno is set.
+    static ssize_t cut_multiple_into_socket_zerocopy(
+        int fd, IOBuf* const* pieces, size_t count, IOBuf* sent);
+
     // Cut `count' number of `pieces' into SSL channel `ssl'.
     // Returns bytes cut on success, -1 otherwise and errno is set.
     static ssize_t cut_multiple_into_SSL_channel(
@@ -248,6 +262,23 @@ public:
     // deleted using the deleter func when no IOBuf references it anymore.
     int append_user_data(void* data, size_t size, void (*deleter)(void*));
 
+    // Append the user-data like above, but `deleter(data, arg)' is called
+    // when no IOBuf references it anymore, e.g. to release an owner shared
+    // by several pieces of user-data.
+    int append_user_data(void* data, size_t size,
+                         void (*deleter)(void* data, void* arg), void* arg);
+
+    // Append `count' bytes of file `fd' from `offset' WITHOUT copying, by
+    // mapping the range into memory read-only. The mapping is split into
+    // blocks of at most 1GB, shared by all IOBufs referencing them and
+    // unmapped after all the blocks are released, so that large immutable
+    // files are sent without being read into heap memory. The range must
+    // not be truncated or modified while being referenced, otherwise
+    // readers may get SIGBUS or changed content. `fd' can be closed after
+    // this call.
+    // Returns 0 on success, -1 otherwise.
+    int append_file_region(int fd, off_t offset, size_t count);
+
     // Resizes the buf to a length of n characters.
     // If n is smaller than the current length, all bytes after n will be
     // truncated.
@@ -263,6 +294,14 @@ public:
     // NOTE: reserve(0) returns INVALID_AREA.
     Area reserve(size_t n);
 
+    // Reserve `n' uninitialized and contiguous bytes at back-side, a block
+    // larger than DEFAULT_BLOCK_SIZE is used if necessary. Data can be
+    // written into the returned memory directly unless this IOBuf is cut,
+    // copied or shared after reserving, similar to unsafe_assign().
+    // Returns NULL when `n' is 0 or larger than the largest block allowed
+    // by -iobuf_max_block_size, or memory is insufficient.
+    void* reserve_contiguous(size_t n);
+
     // [EXTREMELY UNSAFE]
     // Copy `data' to the reserved `area'. `data' must be as long as the
     // reserved size.
@@ -347,6 +386,19 @@ public:
     bool equals(const butil::StringPiece&) const;
     bool equals(const IOBuf& other) const;
 
+    // Returned by find*() when nothing matches.
+    static const size_t npos = (size_t)-1;
+
+    // Find the first occurrence of `c' or `s' at or after `pos', matches
+    // spanning multiple blocks are found as well.
+    // Returns position of the match, npos otherwise.
+    size_t find(char c, size_t pos = 0) const;
+    size_t find(const butil::StringPiece& s, size_t pos = 0) const;
+
+    // Find the first byte equal to any byte in `chars' at or after `pos'.
+    // Returns position of the byte, npos otherwise.
+    size_t find_first_of(const butil::StringPiece& chars, size_t pos = 0) const;
+
     // Get the number of backing blocks
     size_t backing_block_num() const { return _ref_num(); }
 
@@ -360,6 +412,9 @@ protected:
     int _cut_by_char(IOBuf* out, char);
     int _cut_by_delim(IOBuf* out, char const* dbegin, size_t ndelim);
 
+    // True iff bytes starting from offset `off' of BlockRef #i equal `s'.
+    bool _equals_from(size_t i, size_t off, const butil::StringPiece& s) const;
+
     // Returns: true iff this should be viewed as SmallView
     bool _small() const;
 
@@ -708,6 +763,7 @@ public:
     // Construct from another iterator.
     IOBufBytesIterator(const IOBufBytesIterator& it);
     IOBufBytesIterator(const IOBufBytesIterator& it, size_t bytes_left);
+    IOBufBytesIterator& operator=(const IOBufBytesIterator& it);
     // Returning unsigned is safer than char which would be more error prone
     // to bitwise operations. For example: in "uint32_t value = *it", value
     // is (unexpected) 4294967168 when *it returns (char)128.
@@ -735,6 +791,62 @@ private:
     const butil::IOBuf* _buf;
 };
 
+namespace iobuf {
+
+// Allocator of memory of IOBuf blocks, malloc/free by default. Sizes passed
+// to `allocate' are IOBuf::DEFAULT_BLOCK_SIZE, LARGE_BLOCK_SIZE,
+// HUGE_BLOCK_SIZE or block_size of IOBufAsZeroCopyOutputStream.
+struct BlockAllocator {
+    void* (*allocate)(size_t size);
+    void (*deallocate)(void* mem);
+};
+
+// Returns current allocator of blocks.
+BlockAllocator get_block_allocator();
+
+// Replace the allocator of blocks and return the previous one. Blocks
+// allocated before are still alive and will be passed to the new
+// `deallocate', which should pass memory not allocated by itself to the
+// previous allocator.
+// This function is not thread-safe and should be called before any IOBuf is
+// used concurrently, generally at the beginning of main().
+BlockAllocator set_block_allocator(const BlockAllocator& allocator);
+
+// Owners of IOBuf blocks, to find out which code pins memory of blocks.
+// When -iobuf_track_block_owners is on, blocks created within the scope of
+// a ScopedBlockOwner are charged to the owner until they're destroyed.
+// Notice that blocks are charged to the code creating them, appending
+// to an IOBuf may reuse the thread-local block created by other owners.
+static const int MAX_BLOCK_OWNERS = 256;
+
+// Register an owner named `name' (truncated to 31 characters) and return
+// its id. Registering a same name returns the same id.
+// Returns 0 (not charging) when there're too many owners.
+int register_block_owner(const char* name);
+
+// Charge blocks created in the scope to `owner'. The owner is thread-local,
+// don't let the scope span bthread functions which may block and switch.
+class ScopedBlockOwner {
+public:
+    explicit ScopedBlockOwner(int owner);
+    ~ScopedBlockOwner();
+private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedBlockOwner);
+    int _saved_owner;
+};
+
+struct BlockOwnerStat {
+    std::string name;
+    // Number and bytes of alive blocks charged to the owner.
+    int64_t nblock;
+    int64_t nbytes;
+};
+
+// Put stats of all registered owners into `out'.
+void list_block_owners(std::vector<BlockOwnerStat>* out);
+
+}  // namespace iobuf
+
 }  // namespace butil
 
 // Specialize std::swap for IOBuf
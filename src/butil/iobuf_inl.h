@@ -347,6 +347,16 @@ inline IOBufBytesIterator::IOBufBytesIterator(const IOBufBytesIterator& it)
     , _buf(it._buf) {
 }
 
+inline IOBufBytesIterator&
+IOBufBytesIterator::operator=(const IOBufBytesIterator& it) {
+    _block_begin = it._block_begin;
+    _block_end = it._block_end;
+    _block_count = it._block_count;
+    _bytes_left = it._bytes_left;
+    _buf = it._buf;
+    return *this;
+}
+
 inline IOBufBytesIterator::IOBufBytesIterator(
     const IOBufBytesIterator& it, size_t bytes_left)
     : _block_begin(it._block_begin)
@@ -565,9 +565,9 @@ static void PrintLogPrefixAsJSON(
     os << "\"C\":\"" << file << ':' << line << "\"";
 }
 
-static void PrintLog(std::ostream& os,
-                     int severity, const char* file, int line,
-                     const butil::StringPiece& content) {
+void PrintLog(std::ostream& os,
+              int severity, const char* file, int line,
+              const butil::StringPiece& content) {
     if (!FLAGS_log_as_json) {
         PrintLogPrefix(os, severity, file, line);
         os.write(content.data(), content.size());
@@ -841,6 +841,46 @@ inline void DestroyLogStream(LogStream* stream) {
 
 #endif  // __GNUC__
 
+void WriteLogsToDestinations(int severity, const butil::StringPiece& logs) {
+    if ((logging_destination & LOG_TO_SYSTEM_DEBUG_LOG) != 0) {
+        fwrite(logs.data(), logs.size(), 1, stderr);
+        fflush(stderr);
+    } else if (severity >= kAlwaysPrintErrorLevel) {
+        // When we're only outputting to a log file, above a certain log level, we
+        // should still output to stderr so that we can better detect and diagnose
+        // problems with unit tests, especially on the buildbots.
+        fwrite(logs.data(), logs.size(), 1, stderr);
+        fflush(stderr);
+    }
+
+    // write to log file
+    if ((logging_destination & LOG_TO_FILE) != 0) {
+        // We can have multiple threads and/or processes, so try to prevent them
+        // from clobbering each other's writes.
+        // If the client app did not call InitLogging, and the lock has not
+        // been created do it now. We do this on demand, but if two threads try
+        // to do this at the same time, there will be a race condition to create
+        // the lock. This is why InitLogging should be called from the main
+        // thread at the beginning of execution.
+        LoggingLock::Init(LOCK_LOG_FILE, NULL);
+        LoggingLock logging_lock;
+        if (InitializeLogFileHandle()) {
+#if defined(OS_WIN)
+            SetFilePointer(log_file, 0, 0, SEEK_END);
+            DWORD num_written;
+            WriteFile(log_file,
+                      static_cast<const void*>(logs.data()),
+                      static_cast<DWORD>(logs.size()),
+                      &num_written,
+                      NULL);
+#else
+            fwrite(logs.data(), logs.size(), 1, log_file);
+            fflush(log_file);
+#endif
+        }
+    }
+}
+
 class DefaultLogSink : public LogSink {
 public:
     static DefaultLogSink* GetInstance() {
@@ -857,45 +897,7 @@ public:
         std::ostringstream os;
         PrintLog(os, severity, file, line, content);
         os << '\n';
-        std::string log = os.str();
-        
-        if ((logging_destination & LOG_TO_SYSTEM_DEBUG_LOG) != 0) {
-            fwrite(log.data(), log.size(), 1, stderr);
-            fflush(stderr);
-        } else if (severity >= kAlwaysPrintErrorLevel) {
-            // When we're only outputting to a log file, above a certain log level, we
-            // should still output to stderr so that we can better detect and diagnose
-            // problems with unit tests, especially on the buildbots.
-            fwrite(log.data(), log.size(), 1, stderr);
-            fflush(stderr);
-        }
-
-        // write to log file
-        if ((logging_destination & LOG_TO_FILE) != 0) {
-            // We can have multiple threads and/or processes, so try to prevent them
-            // from clobbering each other's writes.
-            // If the client app did not call InitLogging, and the lock has not
-            // been created do it now. We do this on demand, but if two threads try
-            // to do this at the same time, there will be a race condition to create
-            // the lock. This is why InitLogging should be called from the main
-            // thread at the beginning of execution.
-            LoggingLock::Init(LOCK_LOG_FILE, NULL);
-            LoggingLock logging_lock;
-            if (InitializeLogFileHandle()) {
-#if defined(OS_WIN)
-                SetFilePointer(log_file, 0, 0, SEEK_END);
-                DWORD num_written;
-                WriteFile(log_file,
-                          static_cast<const void*>(log.data()),
-                          static_cast<DWORD>(log.size()),
-                          &num_written,
-                          NULL);
-#else
-                fwrite(log.data(), log.size(), 1, log_file);
-                fflush(log_file);
-#endif
-            }
-        }
+        WriteLogsToDestinations(severity, os.str());
         return true;
     }
 private:
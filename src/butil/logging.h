@@ -319,6 +319,18 @@ private:
 // Returns previous sink.
 BUTIL_EXPORT LogSink* SetLogSink(LogSink* sink);
 
+// Print the log in the same format as the default sink (or as JSON when
+// -log_as_json is on) into `os', without the trailing newline.
+BUTIL_EXPORT void PrintLog(std::ostream& os,
+                           int severity, const char* file, int line,
+                           const butil::StringPiece& content);
+
+// Write `logs' which are lines printed by PrintLog() to destinations set by
+// InitLogging() at once. `severity' is the highest severity of the lines,
+// logs at or above ERROR are written to stderr as well.
+BUTIL_EXPORT void WriteLogsToDestinations(int severity,
+                                          const butil::StringPiece& logs);
+
 // The LogSink mainly for unit-testing. Logs will be appended to it.
 class StringSink : public LogSink, public std::string {
 public:
@@ -63,6 +63,14 @@ template <typename T> struct ObjectPoolValidator {
     static bool validate(const T*) { return true; }
 };
 
+// Blocks whose objects are all returned can be destructed and freed by
+// butil::trim_object_pools() when this is true. Only specialize it for
+// types whose objects are never touched after return_object(), which is
+// not the case of many types in bthread (namely Butex).
+template <typename T> struct ObjectPoolAllowTrim {
+    static const bool value = false;
+};
+
 }  // namespace butil
 
 #include "butil/object_pool_inl.h"
@@ -29,7 +29,10 @@
 #include "butil/macros.h"                 // BAIDU_CACHELINE_ALIGNMENT
 #include "butil/scoped_lock.h"            // BAIDU_SCOPED_LOCK
 #include "butil/thread_local.h"           // BAIDU_THREAD_LOCAL
+#include <typeinfo>                      // typeid
 #include <vector>
+#include "butil/class_name.h"              // demangle
+#include "butil/pool_registry.h"           // register_pool
 
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
 #define BAIDU_OBJECT_POOL_FREE_ITEM_NUM_ADD1                    \
@@ -63,6 +66,11 @@ struct ObjectPoolInfo {
     size_t block_item_num;
     size_t free_chunk_item_num;
     size_t total_size;
+    // Blocks freed by trim(), which are not counted in block_num.
+    size_t released_block_num;
+    // Objects in free lists shared by threads, not including the ones
+    // cached by each thread.
+    size_t global_free_item_num;
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
     size_t free_item_num;
 #endif
@@ -89,7 +97,7 @@ public:
     static const size_t FREE_CHUNK_NITEM = BLOCK_NITEM;
 
     // Free objects are batched in a FreeChunk before they're added to
-    // global list(_free_chunks).
+    // global lists(_free_lists).
     typedef ObjectPoolFreeChunk<T, FREE_CHUNK_NITEM>    FreeChunk;
     typedef ObjectPoolFreeChunk<T, 0> DynamicFreeChunk;
 
@@ -124,14 +132,15 @@ public:
         explicit LocalPool(ObjectPool* pool)
             : _pool(pool)
             , _cur_block(NULL)
-            , _cur_block_index(0) {
+            , _cur_block_index(0)
+            , _numa_node(pool_numa_node()) {
             _cur_free.nfree = 0;
         }
 
         ~LocalPool() {
             // Add to global _free if there're some free objects
             if (_cur_free.nfree) {
-                _pool->push_free_chunk(_cur_free);
+                _pool->push_free_chunk(_numa_node, _cur_free);
             }
 
             _pool->clear_from_destructor_of_local_pool();
@@ -154,7 +163,7 @@ public:
         /* Fetch a FreeChunk from global.                               \
            TODO: Popping from _free needs to copy a FreeChunk which is  \
            costly, but hardly impacts amortized performance. */         \
-        if (_pool->pop_free_chunk(_cur_free)) {                         \
+        if (_pool->pop_free_chunk(_numa_node, _cur_free)) {                         \
             BAIDU_OBJECT_POOL_FREE_ITEM_NUM_SUB1;                       \
             return _cur_free.ptrs[--_cur_free.nfree];                   \
         }                                                               \
@@ -165,7 +174,10 @@ public:
                 obj->~T();                                              \
                 return NULL;                                            \
             }                                                           \
-            ++_cur_block->nitem;                                        \
+            if (++_cur_block->nitem == BLOCK_NITEM) {                   \
+                /* trim() may free the block once it's full */          \
+                _cur_block = NULL;                                      \
+            }                                                           \
             return obj;                                                 \
         }                                                               \
         /* Fetch a Block from global */                                 \
@@ -176,7 +188,10 @@ public:
                 obj->~T();                                              \
                 return NULL;                                            \
             }                                                           \
-            ++_cur_block->nitem;                                        \
+            if (++_cur_block->nitem == BLOCK_NITEM) {                   \
+                /* trim() may free the block once it's full */          \
+                _cur_block = NULL;                                      \
+            }                                                           \
             return obj;                                                 \
         }                                                               \
         return NULL;                                                    \
@@ -207,7 +222,7 @@ public:
             }
             // Local free list is full, return it to global.
             // For copying issue, check comment in upper get()
-            if (_pool->push_free_chunk(_cur_free)) {
+            if (_pool->push_free_chunk(_numa_node, _cur_free)) {
                 _cur_free.nfree = 1;
                 _cur_free.ptrs[0] = ptr;
                 BAIDU_OBJECT_POOL_FREE_ITEM_NUM_ADD1;
@@ -220,6 +235,7 @@ public:
         ObjectPool* _pool;
         Block* _cur_block;
         size_t _cur_block_index;
+        size_t _numa_node;
         FreeChunk _cur_free;
     };
 
@@ -273,6 +289,8 @@ public:
 
     // Number of all allocated objects, including being used and free.
     ObjectPoolInfo describe_objects() const {
+        // Blocks may be freed by trim() concurrently.
+        BAIDU_SCOPED_LOCK(_trim_mutex);
         ObjectPoolInfo info;
         info.local_pool_num = _nlocal.load(butil::memory_order_relaxed);
         info.block_group_num = _ngroup.load(butil::memory_order_acquire);
@@ -280,6 +298,12 @@ public:
         info.item_num = 0;
         info.free_chunk_item_num = free_chunk_nitem();
         info.block_item_num = BLOCK_NITEM;
+        info.released_block_num = _nreleased.load(butil::memory_order_relaxed);
+        info.global_free_item_num = 0;
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            BAIDU_SCOPED_LOCK(_free_lists[i].mutex);
+            info.global_free_item_num += _free_lists[i].nitem;
+        }
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
         info.free_item_num = _global_nfree.load(butil::memory_order_relaxed);
 #endif
@@ -291,10 +315,10 @@ public:
             }
             size_t nblock = std::min(bg->nblock.load(butil::memory_order_relaxed),
                                      OP_GROUP_NBLOCK);
-            info.block_num += nblock;
             for (size_t j = 0; j < nblock; ++j) {
                 Block* b = bg->blocks[j].load(butil::memory_order_consume);
                 if (NULL != b) {
+                    ++info.block_num;
                     info.item_num += b->nitem;
                 }
             }
@@ -303,6 +327,108 @@ public:
         return info;
     }
 
+    // Destruct and free blocks whose objects are all in the global free
+    // lists, objects cached by threads keep their blocks alive.
+    // Returns bytes of memory released.
+    size_t trim() {
+        if (!ObjectPoolAllowTrim<T>::value) {
+            return 0;
+        }
+        BAIDU_SCOPED_LOCK(_trim_mutex);
+        // Index fully used blocks by address, partially used ones may still
+        // be allocated from by some thread.
+        std::vector<BlockRef> refs;
+        const size_t ngroup = _ngroup.load(butil::memory_order_acquire);
+        for (size_t i = 0; i < ngroup; ++i) {
+            BlockGroup* bg = _block_groups[i].load(butil::memory_order_consume);
+            if (NULL == bg) {
+                break;
+            }
+            const size_t nblock = std::min(
+                bg->nblock.load(butil::memory_order_relaxed), OP_GROUP_NBLOCK);
+            for (size_t j = 0; j < nblock; ++j) {
+                Block* b = bg->blocks[j].load(butil::memory_order_consume);
+                if (NULL != b && b->nitem == BLOCK_NITEM) {
+                    BlockRef r = { b, &bg->blocks[j], 0 };
+                    refs.push_back(r);
+                }
+            }
+        }
+        if (refs.empty()) {
+            return 0;
+        }
+        std::sort(refs.begin(), refs.end());
+
+        // Take all free chunks out so that objects are not reused while
+        // being counted and removed.
+        std::vector<DynamicFreeChunk*> chunks[POOL_MAX_NUMA_NODE];
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            BAIDU_SCOPED_LOCK(_free_lists[i].mutex);
+            chunks[i].swap(_free_lists[i].chunks);
+            _free_lists[i].nitem = 0;
+        }
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            for (size_t j = 0; j < chunks[i].size(); ++j) {
+                const DynamicFreeChunk* p = chunks[i][j];
+                for (size_t k = 0; k < p->nfree; ++k) {
+                    BlockRef* r = find_block(refs, p->ptrs[k]);
+                    if (r) {
+                        ++r->nfree;
+                    }
+                }
+            }
+        }
+        size_t nreleased = 0;
+        for (size_t i = 0; i < refs.size(); ++i) {
+            nreleased += (refs[i].nfree == BLOCK_NITEM);
+        }
+        for (size_t i = 0; nreleased && i < POOL_MAX_NUMA_NODE; ++i) {
+            // Remove objects of released blocks from the chunks.
+            size_t nchunk = 0;
+            for (size_t j = 0; j < chunks[i].size(); ++j) {
+                DynamicFreeChunk* p = chunks[i][j];
+                size_t n = 0;
+                for (size_t k = 0; k < p->nfree; ++k) {
+                    BlockRef* r = find_block(refs, p->ptrs[k]);
+                    if (r == NULL || r->nfree != BLOCK_NITEM) {
+                        p->ptrs[n++] = p->ptrs[k];
+                    }
+                }
+                p->nfree = n;
+                if (n) {
+                    chunks[i][nchunk++] = p;
+                } else {
+                    free(p);
+                }
+            }
+            chunks[i].resize(nchunk);
+        }
+        for (size_t i = 0; i < refs.size(); ++i) {
+            if (refs[i].nfree != BLOCK_NITEM) {
+                continue;
+            }
+            Block* b = refs[i].block;
+            refs[i].slot->store(NULL, butil::memory_order_relaxed);
+            T* const objs = (T*)b->items;
+            for (size_t k = 0; k < b->nitem; ++k) {
+                objs[k].~T();
+            }
+            delete b;
+        }
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            size_t nitem = 0;
+            for (size_t j = 0; j < chunks[i].size(); ++j) {
+                nitem += chunks[i][j]->nfree;
+            }
+            BAIDU_SCOPED_LOCK(_free_lists[i].mutex);
+            _free_lists[i].chunks.insert(_free_lists[i].chunks.end(),
+                                         chunks[i].begin(), chunks[i].end());
+            _free_lists[i].nitem += nitem;
+        }
+        _nreleased.fetch_add(nreleased, butil::memory_order_relaxed);
+        return nreleased * sizeof(Block);
+    }
+
     static inline ObjectPool* singleton() {
         ObjectPool* p = _singleton.load(butil::memory_order_consume);
         if (p) {
@@ -313,19 +439,76 @@ public:
         if (!p) {
             p = new ObjectPool();
             _singleton.store(p, butil::memory_order_release);
+            detail::register_pool(describe_pool,
+                                  ObjectPoolAllowTrim<T>::value ? trim_pool : NULL);
         }
         pthread_mutex_unlock(&_singleton_mutex);
         return p;
     }
 
 private:
+    // Free chunks returned by threads running on a NUMA node.
+    struct BAIDU_CACHELINE_ALIGNMENT FreeList {
+        pthread_mutex_t mutex;
+        std::vector<DynamicFreeChunk*> chunks;
+        size_t nitem;
+    };
+
+    struct BlockRef {
+        Block* block;
+        butil::atomic<Block*>* slot;
+        size_t nfree;
+
+        bool operator<(const BlockRef& rhs) const { return block < rhs.block; }
+    };
+
+    // Find the block containing `ptr' in `refs' sorted by address.
+    static BlockRef* find_block(std::vector<BlockRef>& refs, const T* ptr) {
+        size_t lo = 0;
+        size_t hi = refs.size();
+        while (lo < hi) {
+            const size_t mid = (lo + hi) / 2;
+            const T* const items = (const T*)refs[mid].block->items;
+            if (ptr < items) {
+                hi = mid;
+            } else if (ptr >= items + BLOCK_NITEM) {
+                lo = mid + 1;
+            } else {
+                return &refs[mid];
+            }
+        }
+        return NULL;
+    }
+
+    static void describe_pool(PoolStat* s) {
+        const ObjectPoolInfo info = singleton()->describe_objects();
+        s->name = demangle(typeid(T).name());
+        s->kind = "object";
+        s->item_size = sizeof(T);
+        s->block_num = info.block_num;
+        s->released_block_num = info.released_block_num;
+        s->item_num = info.item_num;
+        s->free_item_num = info.global_free_item_num;
+        s->total_size = info.total_size;
+        s->trimmable = ObjectPoolAllowTrim<T>::value;
+    }
+
+    static size_t trim_pool() {
+        return singleton()->trim();
+    }
+
     ObjectPool() {
-        _free_chunks.reserve(OP_INITIAL_FREE_LIST_SIZE);
-        pthread_mutex_init(&_free_chunks_mutex, NULL);
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            pthread_mutex_init(&_free_lists[i].mutex, NULL);
+            _free_lists[i].nitem = 0;
+        }
+        _free_lists[0].chunks.reserve(OP_INITIAL_FREE_LIST_SIZE);
     }
 
     ~ObjectPool() {
-        pthread_mutex_destroy(&_free_chunks_mutex);
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            pthread_mutex_destroy(&_free_lists[i].mutex);
+        }
     }
 
     // Create a Block and append it to right-most BlockGroup.
@@ -420,7 +603,8 @@ private:
 
         // Clear global free list.
         FreeChunk dummy;
-        while (pop_free_chunk(dummy));
+        while (pop_free_chunk(0, dummy));
+        _nreleased.store(0, butil::memory_order_relaxed);
 
         // Delete all memory
         const size_t ngroup = _ngroup.exchange(0, butil::memory_order_relaxed);
@@ -450,27 +634,38 @@ private:
     }
 
 private:
-    bool pop_free_chunk(FreeChunk& c) {
+    // Pop a chunk from free list of `node', or other nodes if it's empty.
+    bool pop_free_chunk(size_t node, FreeChunk& c) {
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            if (pop_free_chunk(_free_lists[(node + i) % POOL_MAX_NUMA_NODE], c)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool pop_free_chunk(FreeList& fl, FreeChunk& c) {
         // Critical for the case that most return_object are called in
         // different threads of get_object.
-        if (_free_chunks.empty()) {
+        if (fl.chunks.empty()) {
             return false;
         }
-        pthread_mutex_lock(&_free_chunks_mutex);
-        if (_free_chunks.empty()) {
-            pthread_mutex_unlock(&_free_chunks_mutex);
+        pthread_mutex_lock(&fl.mutex);
+        if (fl.chunks.empty()) {
+            pthread_mutex_unlock(&fl.mutex);
             return false;
         }
-        DynamicFreeChunk* p = _free_chunks.back();
-        _free_chunks.pop_back();
-        pthread_mutex_unlock(&_free_chunks_mutex);
+        DynamicFreeChunk* p = fl.chunks.back();
+        fl.chunks.pop_back();
+        fl.nitem -= p->nfree;
+        pthread_mutex_unlock(&fl.mutex);
         c.nfree = p->nfree;
         memcpy(c.ptrs, p->ptrs, sizeof(*p->ptrs) * p->nfree);
         free(p);
         return true;
     }
 
-    bool push_free_chunk(const FreeChunk& c) {
+    bool push_free_chunk(size_t node, const FreeChunk& c) {
         DynamicFreeChunk* p = (DynamicFreeChunk*)malloc(
             offsetof(DynamicFreeChunk, ptrs) + sizeof(*c.ptrs) * c.nfree);
         if (!p) {
@@ -478,9 +673,11 @@ private:
         }
         p->nfree = c.nfree;
         memcpy(p->ptrs, c.ptrs, sizeof(*c.ptrs) * c.nfree);
-        pthread_mutex_lock(&_free_chunks_mutex);
-        _free_chunks.push_back(p);
-        pthread_mutex_unlock(&_free_chunks_mutex);
+        FreeList& fl = _free_lists[node];
+        pthread_mutex_lock(&fl.mutex);
+        fl.chunks.push_back(p);
+        fl.nitem += c.nfree;
+        pthread_mutex_unlock(&fl.mutex);
         return true;
     }
     
@@ -492,9 +689,10 @@ private:
     static pthread_mutex_t _block_group_mutex;
     static pthread_mutex_t _change_thread_mutex;
     static butil::static_atomic<BlockGroup*> _block_groups[OP_MAX_BLOCK_NGROUP];
+    static pthread_mutex_t _trim_mutex;
+    static butil::static_atomic<size_t> _nreleased;
 
-    std::vector<DynamicFreeChunk*> _free_chunks;
-    pthread_mutex_t _free_chunks_mutex;
+    mutable FreeList _free_lists[POOL_MAX_NUMA_NODE];
 
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
     static butil::static_atomic<size_t> _global_nfree;
@@ -532,6 +730,12 @@ template <typename T>
 butil::static_atomic<typename ObjectPool<T>::BlockGroup*>
 ObjectPool<T>::_block_groups[OP_MAX_BLOCK_NGROUP] = {};
 
+template <typename T>
+pthread_mutex_t ObjectPool<T>::_trim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+template <typename T>
+butil::static_atomic<size_t> ObjectPool<T>::_nreleased = BUTIL_STATIC_ATOMIC_INIT(0);
+
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
 template <typename T>
 butil::static_atomic<size_t> ObjectPool<T>::_global_nfree = BUTIL_STATIC_ATOMIC_INIT(0);
@@ -546,6 +750,8 @@ inline std::ostream& operator<<(std::ostream& os,
               << "\nblock_item_num: " << info.block_item_num
               << "\nfree_chunk_item_num: " << info.free_chunk_item_num
               << "\ntotal_size: " << info.total_size
+              << "\nreleased_block_num: " << info.released_block_num
+              << "\nglobal_free_item_num: " << info.global_free_item_num
 #ifdef BUTIL_OBJECT_POOL_NEED_FREE_ITEM_NUM
               << "\nfree_num: " << info.free_item_num
 #endif
@@ -0,0 +1,92 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <pthread.h>
+#include "butil/build_config.h"             // OS_LINUX
+#if defined(OS_LINUX)
+#include <unistd.h>                        // syscall
+#include <sys/syscall.h>                   // SYS_getcpu
+#endif
+#include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
+#include "butil/pool_registry.h"
+
+namespace butil {
+
+size_t pool_numa_node() {
+#if defined(OS_LINUX) && defined(SYS_getcpu)
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        return node % POOL_MAX_NUMA_NODE;
+    }
+#endif
+    return 0;
+}
+
+namespace {
+struct PoolEntry {
+    detail::DescribePoolFn describe;
+    detail::TrimPoolFn trim;
+};
+
+pthread_mutex_t g_pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Never deleted, pools may be created or listed during static destruction.
+std::vector<PoolEntry>* g_pools = NULL;
+
+void get_pools(std::vector<PoolEntry>* out) {
+    BAIDU_SCOPED_LOCK(g_pools_mutex);
+    if (g_pools) {
+        *out = *g_pools;
+    }
+}
+}  // namespace
+
+namespace detail {
+void register_pool(DescribePoolFn describe, TrimPoolFn trim) {
+    PoolEntry e = { describe, trim };
+    BAIDU_SCOPED_LOCK(g_pools_mutex);
+    if (g_pools == NULL) {
+        g_pools = new std::vector<PoolEntry>;
+    }
+    g_pools->push_back(e);
+}
+}  // namespace detail
+
+void list_pools(std::vector<PoolStat>* stats) {
+    stats->clear();
+    std::vector<PoolEntry> pools;
+    get_pools(&pools);
+    stats->resize(pools.size());
+    for (size_t i = 0; i < pools.size(); ++i) {
+        pools[i].describe(&(*stats)[i]);
+    }
+}
+
+size_t trim_object_pools() {
+    std::vector<PoolEntry> pools;
+    get_pools(&pools);
+    size_t nreleased = 0;
+    for (size_t i = 0; i < pools.size(); ++i) {
+        if (pools[i].trim) {
+            nreleased += pools[i].trim();
+        }
+    }
+    return nreleased;
+}
+
+}  // namespace butil
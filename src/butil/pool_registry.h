@@ -0,0 +1,67 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BUTIL_POOL_REGISTRY_H
+#define BUTIL_POOL_REGISTRY_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace butil {
+
+// Free chunks of ObjectPool and ResourcePool are kept in one list per NUMA
+// node so that memory returned by threads of a node is preferably reused by
+// threads of the same node. Nodes beyond POOL_MAX_NUMA_NODE are folded.
+static const size_t POOL_MAX_NUMA_NODE = 8;
+
+// Returns NUMA node of the cpu that calling thread runs on, within
+// [0, POOL_MAX_NUMA_NODE). Always 0 on platforms without getcpu().
+size_t pool_numa_node();
+
+struct PoolStat {
+    std::string name;          // type of pooled items
+    const char* kind;          // "object" or "resource"
+    size_t item_size;
+    size_t block_num;          // blocks in use, released blocks excluded
+    size_t released_block_num; // blocks released by trim_object_pools()
+    size_t item_num;           // constructed items, being used or free
+    size_t free_item_num;      // items in free lists shared by threads
+    size_t total_size;
+    bool trimmable;
+};
+
+namespace detail {
+typedef void (*DescribePoolFn)(PoolStat*);
+// Returns bytes of memory released.
+typedef size_t (*TrimPoolFn)();
+// Called once by each pool when it's created.
+void register_pool(DescribePoolFn describe, TrimPoolFn trim);
+}  // namespace detail
+
+// Fill stats of all created pools into `stats'.
+void list_pools(std::vector<PoolStat>* stats);
+
+// Release blocks of ObjectPools whose objects are all in free lists shared
+// by threads. Only pools of types with ObjectPoolAllowTrim<T>::value being
+// true are trimmed. Returns bytes of memory released.
+size_t trim_object_pools();
+
+}  // namespace butil
+
+#endif  // BUTIL_POOL_REGISTRY_H
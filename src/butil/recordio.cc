@@ -15,6 +15,12 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <algorithm>                      // std::min
+#include <fcntl.h>                        // open
+#include <string.h>                       // memmem
+#include <unistd.h>                       // close
+#include <sys/mman.h>                     // mmap
+#include <sys/stat.h>                     // fstat
 #include <gflags/gflags.h>
 #include "butil/logging.h"
 #include "butil/recordio.h"
@@ -385,4 +391,205 @@ int RecordWriter::Write(const Record& record) {
 }
 
 
+const butil::StringPiece* RecordView::Meta(const butil::StringPiece& name) const {
+    for (size_t i = 0; i < metas.size(); ++i) {
+        if (metas[i].name == name) {
+            return &metas[i].data;
+        }
+    }
+    return NULL;
+}
+
+MappedRecordFile::MappedRecordFile() : _data(NULL), _size(0) {}
+
+MappedRecordFile::~MappedRecordFile() {
+    Close();
+}
+
+int MappedRecordFile::Open(const char* path) {
+    Close();
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        const int saved_errno = errno;
+        close(fd);
+        return saved_errno;
+    }
+    if (st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            const int saved_errno = errno;
+            close(fd);
+            return saved_errno;
+        }
+        // Each reader scans its range sequentially.
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        _data = (const char*)p;
+        _size = st.st_size;
+    }
+    // The mapping is still valid after closing the fd.
+    close(fd);
+    return 0;
+}
+
+void MappedRecordFile::Close() {
+    if (_data) {
+        munmap((void*)_data, _size);
+        _data = NULL;
+        _size = 0;
+    }
+}
+
+void MappedRecordFile::Split(
+    size_t n, std::vector<std::pair<size_t, size_t> >* ranges) const {
+    ranges->clear();
+    if (n == 0) {
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        ranges->push_back(std::make_pair(_size * i / n, _size * (i + 1) / n));
+    }
+}
+
+// Header of a record: magic(4) + size and meta bit(4) + checksum of size(1)
+static const size_t RECORD_HEADER_SIZE = 9;
+
+// True if |p| could be the beginning of a record, which is possibly
+// truncated by the end of the file.
+static bool LooksLikeRecordHeader(const char* p, size_t left) {
+    if (left < RECORD_HEADER_SIZE) {
+        return memcmp(p, BRPC_RECORDIO_MAGIC, std::min(left, (size_t)4)) == 0;
+    }
+    if (memcmp(p, BRPC_RECORDIO_MAGIC, 4) != 0) {
+        return false;
+    }
+    uint32_t tmp;
+    memcpy(&tmp, p + 4, 4);
+    return SizeChecksum(NetToHost32(tmp)) == (uint8_t)p[8];
+}
+
+// Parse the record at |p| which has |left| bytes after it, fill |out| if
+// it's not NULL. Returns size of the record, 0 if the record is invalid or
+// truncated.
+static size_t ParseRecordView(const char* p, size_t left, RecordView* out) {
+    if (left < RECORD_HEADER_SIZE || !LooksLikeRecordHeader(p, left)) {
+        return 0;
+    }
+    uint32_t tmp;
+    memcpy(&tmp, p + 4, 4);
+    tmp = NetToHost32(tmp);
+    bool has_meta = (tmp & 0x80000000);
+    const size_t data_size = (tmp & 0x7FFFFFFF);
+    if (data_size > (size_t)FLAGS_recordio_max_record_size ||
+        RECORD_HEADER_SIZE + data_size > left) {
+        return 0;
+    }
+    const char* data = p + RECORD_HEADER_SIZE;
+    size_t consumed_bytes = 0;
+    if (out) {
+        out->metas.clear();
+    }
+    while (has_meta) {
+        if (consumed_bytes + 5 > data_size) {
+            return 0;
+        }
+        const size_t name_size = (uint8_t)data[consumed_bytes];
+        if (name_size == 0 || consumed_bytes + 5 + name_size > data_size) {
+            return 0;
+        }
+        memcpy(&tmp, data + consumed_bytes + 1 + name_size, 4);
+        tmp = NetToHost32(tmp);
+        has_meta = (tmp & 0x80000000);
+        const size_t meta_size = (tmp & 0x7FFFFFFF);
+        if (consumed_bytes + 5 + name_size + meta_size > data_size) {
+            return 0;
+        }
+        if (out) {
+            RecordView::NamedMeta meta;
+            meta.name.set(data + consumed_bytes + 1, name_size);
+            meta.data.set(data + consumed_bytes + 5 + name_size, meta_size);
+            out->metas.push_back(meta);
+        }
+        consumed_bytes += 5 + name_size + meta_size;
+    }
+    if (out) {
+        out->payload.set(data + consumed_bytes, data_size - consumed_bytes);
+    }
+    return RECORD_HEADER_SIZE + data_size;
+}
+
+MappedRecordReader::MappedRecordReader(const MappedRecordFile* file)
+    : _file(file)
+    , _offset(0)
+    , _end(file->size())
+    , _skipped(0)
+    , _synced(false) {
+}
+
+MappedRecordReader::MappedRecordReader(const MappedRecordFile* file,
+                                       size_t begin, size_t end)
+    : _file(file)
+    , _offset(std::min(begin, file->size()))
+    , _end(std::min(end, file->size()))
+    , _skipped(0)
+    , _synced(false) {
+}
+
+bool MappedRecordReader::SkipToNextRecord() {
+    const char* const base = _file->data();
+    const size_t size = _file->size();
+    while (_offset < _end) {
+        // The magic must start before _end.
+        const size_t search_end = std::min(size, _end + 3);
+        const void* found = memmem(base + _offset, search_end - _offset,
+                                   BRPC_RECORDIO_MAGIC, 4);
+        if (found == NULL) {
+            _skipped += _end - _offset;
+            _offset = _end;
+            return false;
+        }
+        const size_t pos = (const char*)found - base;
+        // Payloads may contain the magic by chance, check the record and
+        // the header after it to make mistakes unlikely.
+        const size_t len = ParseRecordView(base + pos, size - pos, NULL);
+        if (len != 0 && (pos + len == size ||
+                         LooksLikeRecordHeader(base + pos + len, size - pos - len))) {
+            _skipped += pos - _offset;
+            _offset = pos;
+            return true;
+        }
+        _skipped += pos + 1 - _offset;
+        _offset = pos + 1;
+    }
+    return false;
+}
+
+bool MappedRecordReader::ReadNext(RecordView* out) {
+    if (!_synced) {
+        _synced = true;
+        if (!SkipToNextRecord()) {
+            return false;
+        }
+    }
+    while (_offset < _end) {
+        const size_t len = ParseRecordView(
+            _file->data() + _offset, _file->size() - _offset, out);
+        if (len != 0) {
+            out->offset = _offset;
+            _offset += len;
+            return true;
+        }
+        LOG(ERROR) << "Invalid record at offset=" << _offset;
+        ++_offset;
+        ++_skipped;
+        if (!SkipToNextRecord()) {
+            return false;
+        }
+    }
+    return false;
+}
+
 } // namespace butil
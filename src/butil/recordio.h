@@ -18,7 +18,10 @@
 #define BUTIL_RECORDIO_H
 
 #include "butil/iobuf.h"
+#include "butil/macros.h"
+#include "butil/strings/string_piece.h"
 #include <memory>
+#include <vector>
 
 namespace butil {
 
@@ -138,6 +141,98 @@ private:
     IWriter* _writer;
 };
 
+// A record parsed from a MappedRecordFile without copying. Pointed data is
+// valid until the file is closed.
+struct RecordView {
+    struct NamedMeta {
+        butil::StringPiece name;
+        butil::StringPiece data;
+    };
+    std::vector<NamedMeta> metas;
+    butil::StringPiece payload;
+    // Offset of the record in the file.
+    size_t offset;
+
+    RecordView() : offset(0) {}
+
+    // Get meta by |name|. NULL on not found.
+    const butil::StringPiece* Meta(const butil::StringPiece& name) const;
+};
+
+// A file mapped into memory read-only for MappedRecordReader.
+class MappedRecordFile {
+public:
+    MappedRecordFile();
+    ~MappedRecordFile();
+
+    // Map the file at |path|. Returns 0 on success, errno otherwise.
+    int Open(const char* path);
+    void Close();
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+    // Split the file into |n| ranges of similar sizes, for scanning one file
+    // with n MappedRecordReader in parallel. Boundaries are not aligned to
+    // records, see MappedRecordReader.
+    void Split(size_t n, std::vector<std::pair<size_t, size_t> >* ranges) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MappedRecordFile);
+
+    const char* _data;
+    size_t _size;
+};
+
+// Parse records from a MappedRecordFile without copying them, which is much
+// faster than RecordReader for large files.
+// Reading a range [begin, end) yields records starting inside the range,
+// no index is needed: the reader skips to the first valid record at or
+// after |begin| by searching the magic string and verifying the header,
+// the one after it and the metas, and reads the last record beyond |end|
+// if it starts before |end|. Thus readers of adjacent ranges yield every
+// record exactly once, as long as payloads do not embed valid recordio
+// records themselves. Corrupted records are skipped in the same way.
+// Example:
+//    MappedRecordFile file;
+//    file.Open(path);
+//    std::vector<std::pair<size_t, size_t> > ranges;
+//    file.Split(nthread, &ranges);
+//    // In thread i:
+//    MappedRecordReader rd(&file, ranges[i].first, ranges[i].second);
+//    RecordView rec;
+//    while (rd.ReadNext(&rec)) {
+//        // Handle the rec
+//    }
+class MappedRecordReader {
+public:
+    // Read the whole file.
+    explicit MappedRecordReader(const MappedRecordFile* file);
+    // Read records starting in [begin, end).
+    MappedRecordReader(const MappedRecordFile* file, size_t begin, size_t end);
+
+    // Returns true on success and |out| is overwritten by the record.
+    // False at the end of the range.
+    bool ReadNext(RecordView* out);
+
+    // Current position in the file.
+    size_t offset() const { return _offset; }
+
+    // Bytes skipped due to corruptions or resynchronization.
+    size_t skipped_bytes() const { return _skipped; }
+
+private:
+    // Move _offset to the next valid record at or after _offset.
+    // Returns false if there's none in the range.
+    bool SkipToNextRecord();
+
+    const MappedRecordFile* _file;
+    size_t _offset;
+    size_t _end;
+    size_t _skipped;
+    bool _synced;
+};
+
 } // namespace butil
 
 #endif  // BUTIL_RECORDIO_H
@@ -29,7 +29,10 @@
 #include "butil/macros.h"                 // BAIDU_CACHELINE_ALIGNMENT
 #include "butil/scoped_lock.h"            // BAIDU_SCOPED_LOCK
 #include "butil/thread_local.h"           // thread_atexit
+#include <typeinfo>                      // typeid
 #include <vector>
+#include "butil/class_name.h"              // demangle
+#include "butil/pool_registry.h"           // register_pool
 
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
 #define BAIDU_RESOURCE_POOL_FREE_ITEM_NUM_ADD1                \
@@ -78,6 +81,9 @@ struct ResourcePoolInfo {
     size_t block_item_num;
     size_t free_chunk_item_num;
     size_t total_size;
+    // Resources in free lists shared by threads, not including the ones
+    // cached by each thread.
+    size_t global_free_item_num;
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
     size_t free_item_num;
 #endif
@@ -105,7 +111,7 @@ public:
     static const size_t FREE_CHUNK_NITEM = BLOCK_NITEM;
 
     // Free identifiers are batched in a FreeChunk before they're added to
-    // global list(_free_chunks).
+    // global lists(_free_lists).
     typedef ResourcePoolFreeChunk<T, FREE_CHUNK_NITEM>      FreeChunk;
     typedef ResourcePoolFreeChunk<T, 0> DynamicFreeChunk;
 
@@ -141,14 +147,15 @@ public:
         explicit LocalPool(ResourcePool* pool)
             : _pool(pool)
             , _cur_block(NULL)
-            , _cur_block_index(0) {
+            , _cur_block_index(0)
+            , _numa_node(pool_numa_node()) {
             _cur_free.nfree = 0;
         }
 
         ~LocalPool() {
-            // Add to global _free_chunks if there're some free resources
+            // Add to global _free_lists if there're some free resources
             if (_cur_free.nfree) {
-                _pool->push_free_chunk(_cur_free);
+                _pool->push_free_chunk(_numa_node, _cur_free);
             }
 
             _pool->clear_from_destructor_of_local_pool();
@@ -173,7 +180,7 @@ public:
         /* Fetch a FreeChunk from global.                               \
            TODO: Popping from _free needs to copy a FreeChunk which is  \
            costly, but hardly impacts amortized performance. */         \
-        if (_pool->pop_free_chunk(_cur_free)) {                         \
+        if (_pool->pop_free_chunk(_numa_node, _cur_free)) {                         \
             --_cur_free.nfree;                                          \
             const ResourceId<T> free_id =  _cur_free.ids[_cur_free.nfree]; \
             *id = free_id;                                              \
@@ -231,7 +238,7 @@ public:
             }
             // Local free list is full, return it to global.
             // For copying issue, check comment in upper get()
-            if (_pool->push_free_chunk(_cur_free)) {
+            if (_pool->push_free_chunk(_numa_node, _cur_free)) {
                 _cur_free.nfree = 1;
                 _cur_free.ids[0] = id;
                 BAIDU_RESOURCE_POOL_FREE_ITEM_NUM_ADD1;
@@ -244,6 +251,7 @@ public:
         ResourcePool* _pool;
         Block* _cur_block;
         size_t _cur_block_index;
+        size_t _numa_node;
         FreeChunk _cur_free;
     };
 
@@ -334,6 +342,11 @@ public:
         info.item_num = 0;
         info.free_chunk_item_num = free_chunk_nitem();
         info.block_item_num = BLOCK_NITEM;
+        info.global_free_item_num = 0;
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            BAIDU_SCOPED_LOCK(_free_lists[i].mutex);
+            info.global_free_item_num += _free_lists[i].nitem;
+        }
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
         info.free_item_num = _global_nfree.load(butil::memory_order_relaxed);
 #endif
@@ -367,19 +380,48 @@ public:
         if (!p) {
             p = new ResourcePool();
             _singleton.store(p, butil::memory_order_release);
-        } 
+            // Blocks are never freed because identifiers address them
+            // permanently and freed resources are still read through
+            // address_resource() to check versions, thus no trimming.
+            detail::register_pool(describe_pool, NULL);
+        }
         pthread_mutex_unlock(&_singleton_mutex);
         return p;
     }
 
 private:
+    // Free chunks returned by threads running on a NUMA node.
+    struct BAIDU_CACHELINE_ALIGNMENT FreeList {
+        pthread_mutex_t mutex;
+        std::vector<DynamicFreeChunk*> chunks;
+        size_t nitem;
+    };
+
+    static void describe_pool(PoolStat* s) {
+        const ResourcePoolInfo info = singleton()->describe_resources();
+        s->name = demangle(typeid(T).name());
+        s->kind = "resource";
+        s->item_size = sizeof(T);
+        s->block_num = info.block_num;
+        s->released_block_num = 0;
+        s->item_num = info.item_num;
+        s->free_item_num = info.global_free_item_num;
+        s->total_size = info.total_size;
+        s->trimmable = false;
+    }
+
     ResourcePool() {
-        _free_chunks.reserve(RP_INITIAL_FREE_LIST_SIZE);
-        pthread_mutex_init(&_free_chunks_mutex, NULL);
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            pthread_mutex_init(&_free_lists[i].mutex, NULL);
+            _free_lists[i].nitem = 0;
+        }
+        _free_lists[0].chunks.reserve(RP_INITIAL_FREE_LIST_SIZE);
     }
 
     ~ResourcePool() {
-        pthread_mutex_destroy(&_free_chunks_mutex);
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            pthread_mutex_destroy(&_free_lists[i].mutex);
+        }
     }
 
     // Create a Block and append it to right-most BlockGroup.
@@ -475,7 +517,7 @@ private:
 
         // Clear global free list.
         FreeChunk dummy;
-        while (pop_free_chunk(dummy));
+        while (pop_free_chunk(0, dummy));
 
         // Delete all memory
         const size_t ngroup = _ngroup.exchange(0, butil::memory_order_relaxed);
@@ -505,27 +547,38 @@ private:
     }
 
 private:
-    bool pop_free_chunk(FreeChunk& c) {
+    // Pop a chunk from free list of `node', or other nodes if it's empty.
+    bool pop_free_chunk(size_t node, FreeChunk& c) {
+        for (size_t i = 0; i < POOL_MAX_NUMA_NODE; ++i) {
+            if (pop_free_chunk(_free_lists[(node + i) % POOL_MAX_NUMA_NODE], c)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool pop_free_chunk(FreeList& fl, FreeChunk& c) {
         // Critical for the case that most return_object are called in
         // different threads of get_object.
-        if (_free_chunks.empty()) {
+        if (fl.chunks.empty()) {
             return false;
         }
-        pthread_mutex_lock(&_free_chunks_mutex);
-        if (_free_chunks.empty()) {
-            pthread_mutex_unlock(&_free_chunks_mutex);
+        pthread_mutex_lock(&fl.mutex);
+        if (fl.chunks.empty()) {
+            pthread_mutex_unlock(&fl.mutex);
             return false;
         }
-        DynamicFreeChunk* p = _free_chunks.back();
-        _free_chunks.pop_back();
-        pthread_mutex_unlock(&_free_chunks_mutex);
+        DynamicFreeChunk* p = fl.chunks.back();
+        fl.chunks.pop_back();
+        fl.nitem -= p->nfree;
+        pthread_mutex_unlock(&fl.mutex);
         c.nfree = p->nfree;
         memcpy(c.ids, p->ids, sizeof(*p->ids) * p->nfree);
         free(p);
         return true;
     }
 
-    bool push_free_chunk(const FreeChunk& c) {
+    bool push_free_chunk(size_t node, const FreeChunk& c) {
         DynamicFreeChunk* p = (DynamicFreeChunk*)malloc(
             offsetof(DynamicFreeChunk, ids) + sizeof(*c.ids) * c.nfree);
         if (!p) {
@@ -533,9 +586,11 @@ private:
         }
         p->nfree = c.nfree;
         memcpy(p->ids, c.ids, sizeof(*c.ids) * c.nfree);
-        pthread_mutex_lock(&_free_chunks_mutex);
-        _free_chunks.push_back(p);
-        pthread_mutex_unlock(&_free_chunks_mutex);
+        FreeList& fl = _free_lists[node];
+        pthread_mutex_lock(&fl.mutex);
+        fl.chunks.push_back(p);
+        fl.nitem += c.nfree;
+        pthread_mutex_unlock(&fl.mutex);
         return true;
     }
     
@@ -548,8 +603,7 @@ private:
     static pthread_mutex_t _change_thread_mutex;
     static butil::static_atomic<BlockGroup*> _block_groups[RP_MAX_BLOCK_NGROUP];
 
-    std::vector<DynamicFreeChunk*> _free_chunks;
-    pthread_mutex_t _free_chunks_mutex;
+    mutable FreeList _free_lists[POOL_MAX_NUMA_NODE];
 
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
     static butil::static_atomic<size_t> _global_nfree;
@@ -619,7 +673,8 @@ inline std::ostream& operator<<(std::ostream& os,
               << "\nitem_num: " << info.item_num
               << "\nblock_item_num: " << info.block_item_num
               << "\nfree_chunk_item_num: " << info.free_chunk_item_num
-              << "\ntotal_size: " << info.total_size;
+              << "\ntotal_size: " << info.total_size
+              << "\nglobal_free_item_num: " << info.global_free_item_num
 #ifdef BUTIL_RESOURCE_POOL_NEED_FREE_ITEM_NUM
               << "\nfree_num: " << info.free_item_num
 #endif
@@ -0,0 +1,50 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BUTIL_USDT_H
+#define BUTIL_USDT_H
+
+#include "butil/build_config.h"                      // OS_LINUX
+
+// User-level statically defined tracing probes which can be attached by
+// bpftrace/bcc/perf, e.g.
+//   bpftrace -e 'usdt:./server:brpc:socket_write_enter { @[arg2] = count(); }'
+// Probes are compiled in with -DBRPC_WITH_USDT (needs <sys/sdt.h> of
+// systemtap-sdt-dev) and cost a nop each when not attached. Otherwise they
+// expand to nothing and arguments are not evaluated.
+// List probes of a binary with: bpftrace -l 'usdt:./server:*'
+
+#if defined(BRPC_WITH_USDT) && defined(OS_LINUX)
+#include <sys/sdt.h>
+#define BUTIL_USDT0(provider, name) DTRACE_PROBE(provider, name)
+#define BUTIL_USDT1(provider, name, a1) DTRACE_PROBE1(provider, name, a1)
+#define BUTIL_USDT2(provider, name, a1, a2)     \
+    DTRACE_PROBE2(provider, name, a1, a2)
+#define BUTIL_USDT3(provider, name, a1, a2, a3) \
+    DTRACE_PROBE3(provider, name, a1, a2, a3)
+#define BUTIL_USDT4(provider, name, a1, a2, a3, a4)     \
+    DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+#else
+#define BUTIL_USDT0(provider, name) ((void)0)
+#define BUTIL_USDT1(provider, name, a1) ((void)0)
+#define BUTIL_USDT2(provider, name, a1, a2) ((void)0)
+#define BUTIL_USDT3(provider, name, a1, a2, a3) ((void)0)
+#define BUTIL_USDT4(provider, name, a1, a2, a3, a4) ((void)0)
+#endif
+
+#endif  // BUTIL_USDT_H
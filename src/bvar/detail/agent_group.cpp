@@ -0,0 +1,36 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "bvar/detail/agent_group.h"
+#include "bvar/passive_status.h"
+
+namespace bvar {
+namespace detail {
+
+butil::static_atomic<int64_t> g_agent_block_memory = BUTIL_STATIC_ATOMIC_INIT(0);
+
+static int64_t get_agent_block_memory(void*) {
+    return g_agent_block_memory.load(butil::memory_order_relaxed);
+}
+
+// Memory overhead of thread-local agents of reducers, which grows with
+// number of threads and number of reducers used by them.
+static PassiveStatus<int64_t> s_agent_block_memory(
+    "bvar_agent_block_memory", get_agent_block_memory, NULL);
+
+}  // namespace detail
+}  // namespace bvar
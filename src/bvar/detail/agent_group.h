@@ -24,10 +24,12 @@
 #include <stdlib.h>                         // abort
 
 #include <new>                              // std::nothrow
-#include <deque>                            // std::deque
+#include <algorithm>                        // std::push_heap
+#include <functional>                       // std::greater
 #include <vector>                           // std::vector
 
 #include "butil/errno.h"                     // errno
+#include "butil/atomicops.h"                 // butil::static_atomic
 #include "butil/thread_local.h"              // thread_atexit
 #include "butil/macros.h"                    // BAIDU_CACHELINE_ALIGNMENT
 #include "butil/scoped_lock.h"
@@ -38,6 +40,10 @@ namespace detail {
 
 typedef int AgentId;
 
+// Bytes of per-thread agent blocks of all AgentGroups, exposed as bvar
+// "bvar_agent_block_memory".
+extern butil::static_atomic<int64_t> g_agent_block_memory;
+
 // General NOTES:
 // * Don't use bound-checking vector::at.
 // * static functions in template class are not guaranteed to be inlined,
@@ -86,12 +92,18 @@ public:
         Agent _agents[ELEMENTS_PER_BLOCK];
     };
 
+    // Ids of destroyed agents are reused smallest first, so that ids in
+    // use are packed in leading blocks and threads touching them allocate
+    // as few blocks as possible.
     inline static AgentId create_new_agent() {
         BAIDU_SCOPED_LOCK(_s_mutex);
         AgentId agent_id = 0;
-        if (!_get_free_ids().empty()) {
-            agent_id = _get_free_ids().back();
-            _get_free_ids().pop_back();
+        std::vector<AgentId>& free_ids = _get_free_ids();
+        if (!free_ids.empty()) {
+            std::pop_heap(free_ids.begin(), free_ids.end(),
+                          std::greater<AgentId>());
+            agent_id = free_ids.back();
+            free_ids.pop_back();
         } else {
             agent_id = _s_agent_kinds++;
         }
@@ -105,7 +117,10 @@ public:
             errno = EINVAL;
             return -1;
         }
-        _get_free_ids().push_back(id);
+        std::vector<AgentId>& free_ids = _get_free_ids();
+        free_ids.push_back(id);
+        std::push_heap(free_ids.begin(), free_ids.end(),
+                       std::greater<AgentId>());
         return 0;
     }
 
@@ -153,6 +168,8 @@ public:
             }
             tb = new_block;
             (*_s_tls_blocks)[block_id] = new_block;
+            g_agent_block_memory.fetch_add(sizeof(ThreadBlock),
+                                           butil::memory_order_relaxed);
         }
         return tb->at(id - block_id * ELEMENTS_PER_BLOCK);
     }
@@ -163,15 +180,20 @@ private:
             return;
         }
         for (size_t i = 0; i < _s_tls_blocks->size(); ++i) {
-            delete (*_s_tls_blocks)[i];
+            if ((*_s_tls_blocks)[i]) {
+                delete (*_s_tls_blocks)[i];
+                g_agent_block_memory.fetch_sub(sizeof(ThreadBlock),
+                                               butil::memory_order_relaxed);
+            }
         }
         delete _s_tls_blocks;
         _s_tls_blocks = NULL;
     }
 
-    inline static std::deque<AgentId> &_get_free_ids() {
+    // A min-heap of ids of destroyed agents.
+    inline static std::vector<AgentId> &_get_free_ids() {
         if (__builtin_expect(!_s_free_ids, 0)) {
-            _s_free_ids = new (std::nothrow) std::deque<AgentId>();
+            _s_free_ids = new (std::nothrow) std::vector<AgentId>();
             if (!_s_free_ids) {
                 abort();
             }
@@ -181,7 +203,7 @@ private:
 
     static pthread_mutex_t                      _s_mutex;
     static AgentId                              _s_agent_kinds;
-    static std::deque<AgentId>                  *_s_free_ids;
+    static std::vector<AgentId>                 *_s_free_ids;
     static __thread std::vector<ThreadBlock *>  *_s_tls_blocks;
 };
 
@@ -189,7 +211,7 @@ template <typename Agent>
 pthread_mutex_t AgentGroup<Agent>::_s_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 template <typename Agent>
-std::deque<AgentId>* AgentGroup<Agent>::_s_free_ids = NULL;
+std::vector<AgentId>* AgentGroup<Agent>::_s_free_ids = NULL;
 
 template <typename Agent>
 AgentId AgentGroup<Agent>::_s_agent_kinds = 0;
@@ -17,14 +17,33 @@
 
 // Date: Tue Jul 28 18:14:40 CST 2015
 
+#include <gflags/gflags.h>
 #include "butil/time.h"
+#include "butil/scoped_lock.h"
 #include "butil/memory/singleton_on_pthread_once.h"
 #include "bvar/reducer.h"
 #include "bvar/detail/sampler.h"
 #include "bvar/passive_status.h"
 #include "bvar/window.h"
+#include "bvar/latency_recorder.h"
 
 namespace bvar {
+
+static const int MAX_SAMPLER_THREAD_NUM = 64;
+
+DEFINE_int32(bvar_sampler_thread_num, 1,
+             "Number of threads calling take_sample() of samplers, say "
+             "windows of bvar. Samplers are distributed evenly among threads. "
+             "Increase this when there're too many windows to sample in one "
+             "second. Can only go larger");
+
+static bool validate_bvar_sampler_thread_num(const char*, int32_t v) {
+    return v >= 1 && v <= MAX_SAMPLER_THREAD_NUM;
+}
+const bool ALLOW_UNUSED dummy_bvar_sampler_thread_num =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_sampler_thread_num,
+                                       validate_bvar_sampler_thread_num);
+
 namespace detail {
 
 const int WARN_NOSLEEP_THRESHOLD = 2;
@@ -47,6 +66,17 @@ struct CombineSampler {
 // of child as well, no need to register in the child again.
 static bool registered_atfork = false;
 
+// Samplers sampled by one thread.
+struct SamplerShard {
+    SamplerShard() : nsampler(0) {}
+
+    // Locked by the sampling thread during a pass and by the first sampling
+    // thread when adding samplers.
+    butil::Mutex mutex;
+    butil::LinkNode<Sampler> root;
+    butil::atomic<int64_t> nsampler;
+};
+
 // Call take_sample() of all scheduled samplers.
 // This can be done with regular timer thread, but it's way too slow(global
 // contention + log(N) heap manipulations). We need it to be super fast so that
@@ -55,7 +85,9 @@ static bool registered_atfork = false;
 // doubly linked, thus we can reduce multiple Samplers into one cicurlarly
 // doubly linked list, and multiple lists into larger lists. We create a
 // dedicated thread to periodically get_value() which is just the combined
-// list of Samplers. Waking through the list and call take_sample().
+// list of Samplers, and distribute them to shards sampled by
+// -bvar_sampler_thread_num threads. Walking through the lists and call
+// take_sample().
 // If a Sampler needs to be deleted, we just mark it as unused and the
 // deletion is taken place in the thread as well.
 class SamplerCollector : public bvar::Reducer<Sampler*, CombineSampler> {
@@ -63,7 +95,14 @@ public:
     SamplerCollector()
         : _created(false)
         , _stop(false)
-        , _cumulated_time_us(0) {
+        , _cumulated_time_us(0)
+        , _nshard(1)
+        , _next_shard(0)
+        , _pass_latency(NULL) {
+        for (int i = 0; i < MAX_SAMPLER_THREAD_NUM; ++i) {
+            _shards[i] = NULL;
+        }
+        _shards[0] = new SamplerShard;
         create_sampling_thread();
     }
     ~SamplerCollector() {
@@ -72,6 +111,9 @@ public:
             pthread_join(_tid, NULL);
             _created = false;
         }
+        for (int i = 1; i < _nshard.load(butil::memory_order_relaxed); ++i) {
+            pthread_join(_shard_tids[i], NULL);
+        }
     }
 
 private:
@@ -100,81 +142,212 @@ private:
     }
 
     void after_forked_as_child() {
+        // Other sampling threads are gone in the child, move their samplers
+        // into the first shard which is sampled by the re-created thread and
+        // redistributed later. The child is single-threaded here, locks of
+        // shards possibly held by gone threads are skipped or re-created.
+        const int nshard = _nshard.load(butil::memory_order_relaxed);
+        for (int i = 1; i < nshard; ++i) {
+            SamplerShard* shard = _shards[i];
+            if (shard->root.next() != &shard->root) {
+                butil::LinkNode<Sampler>* first = shard->root.next();
+                shard->root.RemoveFromList();
+                first->InsertBeforeAsList(&_shards[0]->root);
+            }
+            _shards[0]->nsampler.fetch_add(shard->nsampler.exchange(0));
+        }
+        new (&_shards[0]->mutex) butil::Mutex;
+        _nshard.store(1, butil::memory_order_relaxed);
         _created = false;
         create_sampling_thread();
     }
 
-    void run();
+    // Called by the first sampling thread.
+    void add_samplers(Sampler* s);
+    void grow_shards(int nshard);
+
+    // Sample `shard' every second until stopped.
+    void run_shard(int index);
+
+    // Returns microseconds spent.
+    int64_t sample_shard(SamplerShard* shard);
 
     static void* sampling_thread(void* arg) {
-        static_cast<SamplerCollector*>(arg)->run();
+        static_cast<SamplerCollector*>(arg)->run_shard(0);
+        return NULL;
+    }
+
+    struct ShardArg {
+        SamplerCollector* collector;
+        int index;
+    };
+    static void* shard_sampling_thread(void* arg) {
+        ShardArg* a = static_cast<ShardArg*>(arg);
+        a->collector->run_shard(a->index);
+        delete a;
         return NULL;
     }
 
     static double get_cumulated_time(void* arg) {
-        return static_cast<SamplerCollector*>(arg)->_cumulated_time_us / 1000.0 / 1000.0;
+        return static_cast<SamplerCollector*>(arg)->_cumulated_time_us.load(
+            butil::memory_order_relaxed) / 1000.0 / 1000.0;
+    }
+
+    static int64_t get_sampler_count(void* arg) {
+        SamplerCollector* c = static_cast<SamplerCollector*>(arg);
+        int64_t n = 0;
+        const int nshard = c->_nshard.load(butil::memory_order_acquire);
+        for (int i = 0; i < nshard; ++i) {
+            n += c->_shards[i]->nsampler.load(butil::memory_order_relaxed);
+        }
+        return n;
     }
 
 private:
     bool _created;
     bool _stop;
-    int64_t _cumulated_time_us;
+    butil::atomic<int64_t> _cumulated_time_us;
     pthread_t _tid;
+    butil::atomic<int> _nshard;
+    // Shard to add next sampler into.
+    int _next_shard;
+    SamplerShard* _shards[MAX_SAMPLER_THREAD_NUM];
+    pthread_t _shard_tids[MAX_SAMPLER_THREAD_NUM];
+    // Microseconds spent by each pass over a shard.
+    LatencyRecorder* _pass_latency;
 };
 
 #ifndef UNIT_TEST
 static PassiveStatus<double>* s_cumulated_time_bvar = NULL;
 static bvar::PerSecond<bvar::PassiveStatus<double> >* s_sampling_thread_usage_bvar = NULL;
+static PassiveStatus<int64_t>* s_sampler_count_bvar = NULL;
 #endif
 
-void SamplerCollector::run() {
+void SamplerCollector::add_samplers(Sampler* s) {
+    butil::LinkNode<Sampler> list;
+    s->InsertBeforeAsList(&list);
+    const int nshard = _nshard.load(butil::memory_order_relaxed);
+    while (list.next() != &list) {
+        butil::LinkNode<Sampler>* p = list.next();
+        p->RemoveFromList();
+        SamplerShard* shard = _shards[_next_shard];
+        _next_shard = (_next_shard + 1) % nshard;
+        BAIDU_SCOPED_LOCK(shard->mutex);
+        p->InsertBefore(&shard->root);
+        shard->nsampler.fetch_add(1, butil::memory_order_relaxed);
+    }
+}
+
+void SamplerCollector::grow_shards(int nshard) {
+    const int old_nshard = _nshard.load(butil::memory_order_relaxed);
+    for (int i = old_nshard; i < nshard; ++i) {
+        if (_shards[i] == NULL) {
+            _shards[i] = new SamplerShard;
+        }
+    }
+    // Gather all samplers and distribute them to the new shards evenly.
+    butil::LinkNode<Sampler> all;
+    for (int i = 0; i < old_nshard; ++i) {
+        SamplerShard* shard = _shards[i];
+        BAIDU_SCOPED_LOCK(shard->mutex);
+        if (shard->root.next() != &shard->root) {
+            butil::LinkNode<Sampler>* first = shard->root.next();
+            shard->root.RemoveFromList();
+            first->InsertBeforeAsList(&all);
+        }
+        shard->nsampler.store(0, butil::memory_order_relaxed);
+    }
+    _nshard.store(nshard, butil::memory_order_release);
+    _next_shard = 0;
+    if (all.next() != &all) {
+        Sampler* first = all.next()->value();
+        all.RemoveFromList();
+        add_samplers(first);
+    }
+    for (int i = old_nshard; i < nshard; ++i) {
+        ShardArg* arg = new ShardArg;
+        arg->collector = this;
+        arg->index = i;
+        const int rc = pthread_create(&_shard_tids[i], NULL,
+                                      shard_sampling_thread, arg);
+        if (rc != 0) {
+            // Sampled by nobody, which is unlikely to happen.
+            LOG(FATAL) << "Fail to create sampling thread, " << berror(rc);
+            delete arg;
+        }
+    }
+}
+
+int64_t SamplerCollector::sample_shard(SamplerShard* shard) {
+    const int64_t begin_us = butil::gettimeofday_us();
+    BAIDU_SCOPED_LOCK(shard->mutex);
+    butil::LinkNode<Sampler>* root = &shard->root;
+    for (butil::LinkNode<Sampler>* p = root->next(); p != root;) {
+        // We may remove p from the list, save next first.
+        butil::LinkNode<Sampler>* saved_next = p->next();
+        Sampler* s = p->value();
+        s->_mutex.lock();
+        if (!s->_used) {
+            s->_mutex.unlock();
+            p->RemoveFromList();
+            delete s;
+            shard->nsampler.fetch_sub(1, butil::memory_order_relaxed);
+        } else {
+            s->take_sample();
+            s->_mutex.unlock();
+        }
+        p = saved_next;
+    }
+    return butil::gettimeofday_us() - begin_us;
+}
+
+void SamplerCollector::run_shard(int index) {
 #ifndef UNIT_TEST
     // NOTE:
     // * Following vars can't be created on thread's stack since this thread
     //   may be adandoned at any time after forking.
     // * They can't created inside the constructor of SamplerCollector as well,
     //   which results in deadlock.
-    if (s_cumulated_time_bvar == NULL) {
-        s_cumulated_time_bvar =
-            new PassiveStatus<double>(get_cumulated_time, this);
-    }
-    if (s_sampling_thread_usage_bvar == NULL) {
-        s_sampling_thread_usage_bvar =
-            new bvar::PerSecond<bvar::PassiveStatus<double> >(
+    if (index == 0) {
+        if (s_cumulated_time_bvar == NULL) {
+            s_cumulated_time_bvar =
+                new PassiveStatus<double>(get_cumulated_time, this);
+        }
+        if (s_sampling_thread_usage_bvar == NULL) {
+            s_sampling_thread_usage_bvar =
+                new bvar::PerSecond<bvar::PassiveStatus<double> >(
                     "bvar_sampler_collector_usage", s_cumulated_time_bvar, 10);
+        }
+        if (s_sampler_count_bvar == NULL) {
+            s_sampler_count_bvar = new PassiveStatus<int64_t>(
+                "bvar_sampler_collector_sampler_count", get_sampler_count, this);
+        }
+        if (_pass_latency == NULL) {
+            _pass_latency = new LatencyRecorder("bvar_sampler_collector_pass");
+        }
     }
 #endif
 
-    butil::LinkNode<Sampler> root;
     int consecutive_nosleep = 0;
     while (!_stop) {
         int64_t abstime = butil::gettimeofday_us();
-        Sampler* s = this->reset();
-        if (s) {
-            s->InsertBeforeAsList(&root);
-        }
-        int nremoved = 0;
-        int nsampled = 0;
-        for (butil::LinkNode<Sampler>* p = root.next(); p != &root;) {
-            // We may remove p from the list, save next first.
-            butil::LinkNode<Sampler>* saved_next = p->next();
-            Sampler* s = p->value();
-            s->_mutex.lock();
-            if (!s->_used) {
-                s->_mutex.unlock();
-                p->RemoveFromList();
-                delete s;
-                ++nremoved;
-            } else {
-                s->take_sample();
-                s->_mutex.unlock();
-                ++nsampled;
+        if (index == 0) {
+            const int nshard = FLAGS_bvar_sampler_thread_num;
+            if (nshard > _nshard.load(butil::memory_order_relaxed)) {
+                grow_shards(nshard);
             }
-            p = saved_next;
+            Sampler* s = this->reset();
+            if (s) {
+                add_samplers(s);
+            }
+        }
+        const int64_t cost_us = sample_shard(_shards[index]);
+        if (_pass_latency) {
+            *_pass_latency << cost_us;
         }
         bool slept = false;
         int64_t now = butil::gettimeofday_us();
-        _cumulated_time_us += now - abstime;
+        _cumulated_time_us.fetch_add(now - abstime, butil::memory_order_relaxed);
         abstime += 1000000L;
         while (abstime > now) {
             ::usleep(abstime - now);
@@ -187,7 +360,8 @@ void SamplerCollector::run() {
             if (++consecutive_nosleep >= WARN_NOSLEEP_THRESHOLD) {
                 consecutive_nosleep = 0;
                 LOG(WARNING) << "bvar is busy at sampling for "
-                             << WARN_NOSLEEP_THRESHOLD << " seconds!";
+                             << WARN_NOSLEEP_THRESHOLD << " seconds!"
+                             << " Consider increasing -bvar_sampler_thread_num";
             }
         }
     }
@@ -175,6 +175,21 @@ public:
         return true;
     }
 
+    // Get the latest sample which equals to a recent get_value() of the
+    // reducer, only available when the operator can be inversed.
+    bool get_latest(T* value) {
+        if (butil::is_same<InvOp, VoidOp>::value) {
+            return false;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        Sample<T>* latest = _q.bottom();
+        if (NULL == latest) {
+            return false;
+        }
+        *value = latest->data;
+        return true;
+    }
+
     // Change the time window which can only go larger.
     int set_window_size(time_t window_size) {
         if (window_size <= 0 || window_size > MAX_SECONDS_LIMIT) {
@@ -0,0 +1,150 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+#include <math.h>
+#include <gflags/gflags.h>
+#include "bvar/latency_histogram.h"
+
+namespace bvar {
+
+DECLARE_int32(bvar_dump_interval);
+
+namespace detail {
+
+int64_t HistogramBuckets::get_percentile(double ratio) const {
+    if (_count <= 0) {
+        return 0;
+    }
+    int64_t rank = (int64_t)ceil(ratio * _count);
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > _count) {
+        rank = _count;
+    }
+    int64_t n = 0;
+    for (size_t i = 0; i < NBUCKET; ++i) {
+        n += _buckets[i];
+        if (n >= rank) {
+            return upper_bound(i);
+        }
+    }
+    return upper_bound(NBUCKET - 1);
+}
+
+Histogram::Histogram() : _combiner(NULL), _sampler(NULL) {
+    _combiner = new combiner_type;
+}
+
+Histogram::~Histogram() {
+    // Have to destroy sampler first to avoid the race between destruction and
+    // sampler
+    if (_sampler != NULL) {
+        _sampler->destroy();
+        _sampler = NULL;
+    }
+    delete _combiner;
+}
+
+Histogram::value_type Histogram::reset() {
+    return _combiner->reset_all_agents();
+}
+
+Histogram::value_type Histogram::get_value() const {
+    return _combiner->combine_agents();
+}
+
+struct AddToBuckets {
+    void operator()(HistogramBuckets& b, int64_t value) const {
+        b.add(value);
+    }
+};
+
+Histogram& Histogram::operator<<(int64_t value) {
+    agent_type* agent = _combiner->get_or_create_tls_agent();
+    if (BAIDU_UNLIKELY(!agent)) {
+        LOG(FATAL) << "Fail to create agent";
+        return *this;
+    }
+    if (value < 0) {
+        if (!_debug_name.empty()) {
+            LOG(WARNING) << "Input=" << value << " to `" << _debug_name
+                         << "' is negative, drop";
+        } else {
+            LOG(WARNING) << "Input=" << value << " to Histogram("
+                         << (void*)this << ") is negative, drop";
+        }
+        return *this;
+    }
+    agent->element.modify(AddToBuckets(), value);
+    return *this;
+}
+
+std::ostream& operator<<(std::ostream& os, const HistogramBuckets& b) {
+    // Buckets with upper bounds of 2^N-1 which are exact, stopped after the
+    // one containing all values.
+    os << "{\"count\":" << b.count() << ",\"sum\":" << b.sum()
+       << ",\"buckets\":[";
+    int64_t n = 0;
+    size_t i = 0;
+    for (int bits = 0; bits <= HistogramBuckets::MAX_BITS; ++bits) {
+        const int64_t le = ((int64_t)1 << bits) - 1;
+        for (; i < HistogramBuckets::NBUCKET &&
+                 HistogramBuckets::upper_bound(i) <= le; ++i) {
+            n += b.bucket(i);
+        }
+        if (bits != 0) {
+            os << ',';
+        }
+        os << '[' << le << ',' << n << ']';
+        if (n >= b.count()) {
+            break;
+        }
+    }
+    return os << "]}";
+}
+
+}  // namespace detail
+
+void LatencyHistogram::init() {
+    if (_window_size <= 0) {
+        _window_size = FLAGS_bvar_dump_interval;
+    }
+    _sampler = _histogram.get_sampler();
+    _sampler->set_window_size(_window_size);
+}
+
+detail::HistogramBuckets
+LatencyHistogram::get_window_buckets(time_t window_size) const {
+    detail::Sample<detail::HistogramBuckets> s;
+    if (window_size <= 0 || !_sampler->get_value(window_size, &s)) {
+        return detail::HistogramBuckets();
+    }
+    return s.data;
+}
+
+int64_t LatencyHistogram::get_percentile(double ratio,
+                                         time_t window_size) const {
+    return get_window_buckets(window_size).get_percentile(ratio);
+}
+
+void LatencyHistogram::describe(std::ostream& os, bool) const {
+    os << get_value();
+}
+
+}  // namespace bvar
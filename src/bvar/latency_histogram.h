@@ -0,0 +1,263 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+#ifndef  BVAR_LATENCY_HISTOGRAM_H
+#define  BVAR_LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>                           // memset
+#include <ostream>
+#include <string>
+#include "butil/macros.h"
+#include "bvar/variable.h"
+#include "bvar/detail/combiner.h"
+#include "bvar/detail/sampler.h"
+
+namespace bvar {
+namespace detail {
+
+// Counts of values in log-linear buckets: values less than 2^SUB_BUCKET_BITS
+// are counted exactly, larger values are counted in buckets whose widths are
+// at most 1/2^SUB_BUCKET_BITS(~3%) of the values. Unlike PercentileSamples,
+// no value is dropped, so rare latencies are always reflected in tail
+// percentiles. Buckets are fixed, thus buckets of different threads, windows
+// or processes can be added or subtracted directly.
+class HistogramBuckets {
+public:
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKET_COUNT = (1 << SUB_BUCKET_BITS);
+    // Values not less than 2^MAX_BITS are counted in the last bucket.
+    static const int MAX_BITS = 36;
+    static const size_t NBUCKET =
+        (size_t)(MAX_BITS - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+    HistogramBuckets() : _count(0), _sum(0) {
+        memset(_buckets, 0, sizeof(_buckets));
+    }
+
+    // Index of the bucket counting `value' which must be non-negative.
+    static size_t index_of(int64_t value) {
+        if (value < SUB_BUCKET_COUNT) {
+            return (size_t)value;
+        }
+        if (value >= ((int64_t)1 << MAX_BITS)) {
+            value = ((int64_t)1 << MAX_BITS) - 1;
+        }
+        const int exp = 63 - __builtin_clzll((uint64_t)value);
+        const int shift = exp - SUB_BUCKET_BITS;
+        return ((size_t)(shift + 1) << SUB_BUCKET_BITS) +
+            (size_t)((value >> shift) - SUB_BUCKET_COUNT);
+    }
+    // Smallest value counted in the bucket at `index'.
+    static int64_t lower_bound(size_t index) {
+        if (index < (size_t)SUB_BUCKET_COUNT) {
+            return (int64_t)index;
+        }
+        const int shift = (int)(index >> SUB_BUCKET_BITS) - 1;
+        return (int64_t)(SUB_BUCKET_COUNT + (index & (SUB_BUCKET_COUNT - 1)))
+            << shift;
+    }
+    // Largest value counted in the bucket at `index'.
+    static int64_t upper_bound(size_t index) {
+        if (index < (size_t)SUB_BUCKET_COUNT) {
+            return (int64_t)index;
+        }
+        const int shift = (int)(index >> SUB_BUCKET_BITS) - 1;
+        return lower_bound(index) + ((int64_t)1 << shift) - 1;
+    }
+
+    void add(int64_t value) {
+        ++_buckets[index_of(value)];
+        ++_count;
+        _sum += value;
+    }
+    void merge(const HistogramBuckets& rhs) {
+        for (size_t i = 0; i < NBUCKET; ++i) {
+            _buckets[i] += rhs._buckets[i];
+        }
+        _count += rhs._count;
+        _sum += rhs._sum;
+    }
+    void subtract(const HistogramBuckets& rhs) {
+        for (size_t i = 0; i < NBUCKET; ++i) {
+            _buckets[i] -= rhs._buckets[i];
+        }
+        _count -= rhs._count;
+        _sum -= rhs._sum;
+    }
+
+    // Get the |ratio|-ile value, e.g. 0.999 means 99.9%-ile. The value is
+    // the largest one counted in the bucket, thus never less than the
+    // actual percentile. Returns 0 when nothing was added.
+    int64_t get_percentile(double ratio) const;
+
+    int64_t count() const { return _count; }
+    int64_t sum() const { return _sum; }
+    int64_t bucket(size_t index) const { return _buckets[index]; }
+
+private:
+    int64_t _buckets[NBUCKET];
+    int64_t _count;
+    int64_t _sum;
+};
+
+// Print buckets in the same format as LatencyHistogram.
+std::ostream& operator<<(std::ostream& os, const HistogramBuckets&);
+
+// Reducer-alike histogram whose threads add values into their own buckets,
+// which are merged when the value is read. Never reset, the value inside a
+// window is the difference between samples at both ends.
+class Histogram {
+public:
+    struct AddHistogram {
+        void operator()(HistogramBuckets& b1, const HistogramBuckets& b2) const {
+            b1.merge(b2);
+        }
+    };
+    struct SubtractHistogram {
+        void operator()(HistogramBuckets& b1, const HistogramBuckets& b2) const {
+            b1.subtract(b2);
+        }
+    };
+
+    typedef HistogramBuckets                                value_type;
+    typedef ReducerSampler<Histogram, HistogramBuckets,
+                           AddHistogram, SubtractHistogram> sampler_type;
+    typedef AgentCombiner<HistogramBuckets, HistogramBuckets,
+                          AddHistogram>                     combiner_type;
+    typedef combiner_type::Agent                            agent_type;
+
+    Histogram();
+    ~Histogram();
+
+    AddHistogram op() const { return AddHistogram(); }
+    SubtractHistogram inv_op() const { return SubtractHistogram(); }
+
+    // The sampler for windows over the histogram.
+    sampler_type* get_sampler() {
+        if (NULL == _sampler) {
+            _sampler = new sampler_type(this);
+            _sampler->schedule();
+        }
+        return _sampler;
+    }
+
+    value_type reset();
+
+    value_type get_value() const;
+
+    Histogram& operator<<(int64_t value);
+
+    bool valid() const { return _combiner != NULL; }
+
+    // This name is useful for warning negative values in operator<<
+    void set_debug_name(const butil::StringPiece& name) {
+        _debug_name.assign(name.data(), name.size());
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Histogram);
+
+    combiner_type*          _combiner;
+    sampler_type*           _sampler;
+    std::string _debug_name;
+};
+
+}  // namespace detail
+
+// Record latencies into log-linear buckets and get percentiles in recent
+// window_size seconds from the buckets. Comparing to
+// LatencyRecorder::latency_percentile() which estimates from limited samples,
+// percentiles are within ~3% of the actual ones no matter how many latencies
+// are recorded, at the cost of ~8KB memory per thread and per second in the
+// window.
+// The exposed value is cumulative buckets since creation, printed as
+//   {"count":N,"sum":S,"buckets":[[LE,COUNT],...]}
+// where COUNT is the number of latencies not greater than LE. Such values of
+// different processes can be added together, and /brpc_metrics outputs them
+// as prometheus histograms.
+// Example:
+//   bvar::LatencyHistogram g_write_histogram("foo_write_histogram");
+//   ...
+//   g_write_histogram << latency_us;
+//   ...
+//   int64_t p999 = g_write_histogram.get_percentile(0.999);
+class LatencyHistogram : public Variable {
+public:
+    LatencyHistogram() : _window_size(-1) { init(); }
+    explicit LatencyHistogram(time_t window_size)
+        : _window_size(window_size) { init(); }
+    explicit LatencyHistogram(const butil::StringPiece& name)
+        : _window_size(-1) {
+        init();
+        expose(name);
+    }
+    LatencyHistogram(const butil::StringPiece& prefix,
+                     const butil::StringPiece& name)
+        : _window_size(-1) {
+        init();
+        expose_as(prefix, name);
+    }
+    LatencyHistogram(const butil::StringPiece& name, time_t window_size)
+        : _window_size(window_size) {
+        init();
+        expose(name);
+    }
+    ~LatencyHistogram() { hide(); }
+
+    // Record the latency.
+    LatencyHistogram& operator<<(int64_t latency) {
+        _histogram << latency;
+        return *this;
+    }
+
+    // Get |ratio|-ile latency in recent |window_size| seconds, e.g. 0.99
+    // means 99%-ile.
+    // If |window_size| is absent, use the window_size to ctor.
+    int64_t get_percentile(double ratio, time_t window_size) const;
+    int64_t get_percentile(double ratio) const
+    { return get_percentile(ratio, _window_size); }
+
+    // Get buckets of latencies recorded in recent |window_size| seconds.
+    // If |window_size| is absent, use the window_size to ctor.
+    detail::HistogramBuckets get_window_buckets(time_t window_size) const;
+    detail::HistogramBuckets get_window_buckets() const
+    { return get_window_buckets(_window_size); }
+
+    // Get buckets of all recorded latencies.
+    detail::HistogramBuckets get_value() const
+    { return _histogram.get_value(); }
+
+    time_t window_size() const { return _window_size; }
+
+    void describe(std::ostream& os, bool quote_string) const override;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LatencyHistogram);
+
+    void init();
+
+    time_t _window_size;
+    detail::Histogram _histogram;
+    detail::Histogram::sampler_type* _sampler;
+};
+
+}  // namespace bvar
+
+#endif  //BVAR_LATENCY_HISTOGRAM_H
@@ -0,0 +1,319 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+#ifndef  BVAR_MULTI_DIMENSION_H
+#define  BVAR_MULTI_DIMENSION_H
+
+#include <gflags/gflags_declare.h>
+#include "butil/logging.h"                             // LOG
+#include "butil/containers/flat_map.h"                 // butil::FlatMap
+#include "butil/containers/doubly_buffered_data.h"     // DoublyBufferedData
+#include "butil/synchronization/lock.h"                // butil::Mutex
+#include "butil/scoped_lock.h"                         // BAIDU_SCOPED_LOCK
+#include "bvar/mvariable.h"
+
+namespace bvar {
+
+DECLARE_int32(bvar_max_multi_dimension_stats_count);
+
+namespace detail {
+
+struct LabelValuesHash {
+    size_t operator()(const std::list<std::string>& values) const {
+        size_t h = 0;
+        for (std::list<std::string>::const_iterator it = values.begin();
+             it != values.end(); ++it) {
+            h = h * 31 + butil::DefaultHasher<std::string>()(*it);
+        }
+        return h;
+    }
+};
+
+// Escape `value' to be put inside double quotes of label values.
+void append_escaped_label_value(std::string* out, const std::string& value);
+
+}  // namespace detail
+
+// A family of variables of type T (e.g. Adder<int>, Maxer<int64_t>,
+// IntRecorder) distinguished by values of labels. The stats are not
+// exposed individually, which saves entries in the variable map and
+// allows /brpc_metrics to output them with prometheus labels.
+// Example:
+//   bvar::MultiDimension<bvar::Adder<int> > g_request_count(
+//       "request_count", {"method", "peer", "status"});
+//   ...
+//   bvar::Adder<int>* stats = g_request_count.get_stats(
+//       {"Echo", "127.0.0.1", "OK"});
+//   if (stats) {
+//       *stats << 1;
+//   }
+// Outputs of /brpc_metrics:
+//   request_count{method="Echo",peer="127.0.0.1",status="OK"} 1
+//
+// Existing stats are found in a map read under thread-local sequences
+// without waiting, only the first get_stats() of new label values modifies
+// the map, which is much slower. Pointers returned by get_stats() are valid
+// until delete_stats()/clear_stats() or destruction of this variable.
+template <typename T>
+class MultiDimension : public MVariable {
+public:
+    typedef std::list<std::string> key_type;
+    typedef T value_type;
+
+    explicit MultiDimension(const key_type& labels);
+    MultiDimension(const butil::StringPiece& name, const key_type& labels);
+    MultiDimension(const butil::StringPiece& prefix,
+                   const butil::StringPiece& name,
+                   const key_type& labels);
+    ~MultiDimension();
+
+    // Get the stats of `label_values' whose size must be count_labels(),
+    // create one if absent. Returns NULL when the size mismatches or there're
+    // too many stats (-bvar_max_multi_dimension_stats_count).
+    T* get_stats(const key_type& label_values);
+
+    // Remove the stats of `label_values'.
+    void delete_stats(const key_type& label_values);
+
+    // Remove all stats.
+    void clear_stats();
+
+    bool has_stats(const key_type& label_values);
+
+    size_t count_stats() override;
+
+    // Put label values of all stats into `names'.
+    void list_stats(std::vector<key_type>* names);
+
+    int dump(Dumper* dumper, const DumpOptions* options) override;
+
+private:
+    struct Stats {
+        T* stats;
+        // Labels rendered as `{label1="v1",label2="v2"}' for dump().
+        std::string rendered_labels;
+    };
+    typedef butil::FlatMap<key_type, Stats, detail::LabelValuesHash> MetricMap;
+    typedef typename butil::DoublyBufferedData<MetricMap>::ScopedPtr
+        MetricMapScopedPtr;
+
+    static bool init_map(MetricMap& m) {
+        return m.init(128, 80) == 0;
+    }
+    static bool add_to_map(MetricMap& m, const key_type& key,
+                           const Stats& stats) {
+        m[key] = stats;
+        return true;
+    }
+    static bool erase_from_map(MetricMap& m, const key_type& key) {
+        return m.erase(key) != 0;
+    }
+    static bool clear_map(MetricMap& m) {
+        m.clear();
+        return true;
+    }
+
+    void init();
+    T* find_stats(const key_type& label_values);
+
+    butil::DoublyBufferedData<MetricMap> _metric_map;
+    // Serialize creations and deletions of stats.
+    butil::Mutex _modify_mutex;
+};
+
+template <typename T>
+MultiDimension<T>::MultiDimension(const key_type& labels)
+    : MVariable(labels)
+    , _metric_map(butil::DOUBLY_BUFFERED_READ_WAIT_FREE) {
+    init();
+}
+
+template <typename T>
+MultiDimension<T>::MultiDimension(const butil::StringPiece& name,
+                                  const key_type& labels)
+    : MVariable(labels)
+    , _metric_map(butil::DOUBLY_BUFFERED_READ_WAIT_FREE) {
+    init();
+    expose(name);
+}
+
+template <typename T>
+MultiDimension<T>::MultiDimension(const butil::StringPiece& prefix,
+                                  const butil::StringPiece& name,
+                                  const key_type& labels)
+    : MVariable(labels)
+    , _metric_map(butil::DOUBLY_BUFFERED_READ_WAIT_FREE) {
+    init();
+    expose_as(prefix, name);
+}
+
+template <typename T>
+MultiDimension<T>::~MultiDimension() {
+    hide();
+    clear_stats();
+}
+
+template <typename T>
+void MultiDimension<T>::init() {
+    _metric_map.Modify(init_map);
+}
+
+template <typename T>
+T* MultiDimension<T>::find_stats(const key_type& label_values) {
+    MetricMapScopedPtr ptr;
+    if (_metric_map.Read(&ptr) != 0) {
+        return NULL;
+    }
+    const Stats* stats = ptr->seek(label_values);
+    return stats ? stats->stats : NULL;
+}
+
+template <typename T>
+T* MultiDimension<T>::get_stats(const key_type& label_values) {
+    if (label_values.size() != _labels.size()) {
+        LOG(ERROR) << "Expect " << _labels.size() << " label values, actually "
+                   << label_values.size();
+        return NULL;
+    }
+    T* stats = find_stats(label_values);
+    if (stats) {
+        return stats;
+    }
+    BAIDU_SCOPED_LOCK(_modify_mutex);
+    stats = find_stats(label_values);
+    if (stats) {
+        return stats;
+    }
+    if (count_stats() >= (size_t)FLAGS_bvar_max_multi_dimension_stats_count) {
+        LOG_EVERY_SECOND(ERROR) << "Too many stats in `" << name() << "'";
+        return NULL;
+    }
+    Stats s;
+    s.stats = new T;
+    s.rendered_labels.push_back('{');
+    key_type::const_iterator label = _labels.begin();
+    key_type::const_iterator value = label_values.begin();
+    for (; label != _labels.end(); ++label, ++value) {
+        if (label != _labels.begin()) {
+            s.rendered_labels.push_back(',');
+        }
+        s.rendered_labels.append(*label);
+        s.rendered_labels.append("=\"");
+        detail::append_escaped_label_value(&s.rendered_labels, *value);
+        s.rendered_labels.push_back('"');
+    }
+    s.rendered_labels.push_back('}');
+    _metric_map.Modify(add_to_map, label_values, s);
+    return s.stats;
+}
+
+template <typename T>
+void MultiDimension<T>::delete_stats(const key_type& label_values) {
+    BAIDU_SCOPED_LOCK(_modify_mutex);
+    T* stats = find_stats(label_values);
+    if (stats == NULL) {
+        return;
+    }
+    // Modify() returns after all reads of the old map finish, nobody
+    // references the stats inside the map anymore.
+    _metric_map.Modify(erase_from_map, label_values);
+    delete stats;
+}
+
+template <typename T>
+void MultiDimension<T>::clear_stats() {
+    BAIDU_SCOPED_LOCK(_modify_mutex);
+    std::vector<T*> all_stats;
+    {
+        MetricMapScopedPtr ptr;
+        if (_metric_map.Read(&ptr) != 0) {
+            return;
+        }
+        for (typename MetricMap::const_iterator it = ptr->begin();
+             it != ptr->end(); ++it) {
+            all_stats.push_back(it->second.stats);
+        }
+    }
+    _metric_map.Modify(clear_map);
+    for (size_t i = 0; i < all_stats.size(); ++i) {
+        delete all_stats[i];
+    }
+}
+
+template <typename T>
+bool MultiDimension<T>::has_stats(const key_type& label_values) {
+    return find_stats(label_values) != NULL;
+}
+
+template <typename T>
+size_t MultiDimension<T>::count_stats() {
+    MetricMapScopedPtr ptr;
+    if (_metric_map.Read(&ptr) != 0) {
+        return 0;
+    }
+    return ptr->size();
+}
+
+template <typename T>
+void MultiDimension<T>::list_stats(std::vector<key_type>* names) {
+    if (names == NULL) {
+        return;
+    }
+    names->clear();
+    MetricMapScopedPtr ptr;
+    if (_metric_map.Read(&ptr) != 0) {
+        return;
+    }
+    names->reserve(ptr->size());
+    for (typename MetricMap::const_iterator it = ptr->begin();
+         it != ptr->end(); ++it) {
+        names->push_back(it->first);
+    }
+}
+
+template <typename T>
+int MultiDimension<T>::dump(Dumper* dumper, const DumpOptions* options) {
+    const bool quote_string = options ? options->quote_string : false;
+    // The map is not modified during dumping with the lock held, so that
+    // stats can be dumped inside the read.
+    BAIDU_SCOPED_LOCK(_modify_mutex);
+    MetricMapScopedPtr ptr;
+    if (_metric_map.Read(&ptr) != 0) {
+        return 0;
+    }
+    std::ostringstream os;
+    std::string full_name;
+    int n = 0;
+    for (typename MetricMap::const_iterator it = ptr->begin();
+         it != ptr->end(); ++it) {
+        full_name.assign(name());
+        full_name.append(it->second.rendered_labels);
+        os.str("");
+        it->second.stats->describe(os, quote_string);
+        if (!dumper->dump_mvar(full_name, os.str())) {
+            return -1;
+        }
+        ++n;
+    }
+    return n;
+}
+
+}  // namespace bvar
+
+#endif  // BVAR_MULTI_DIMENSION_H
@@ -0,0 +1,196 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+#include <pthread.h>
+#include <algorithm>                    // std::sort
+#include <map>
+#include <gflags/gflags.h>
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "bvar/mvariable.h"
+#include "bvar/multi_dimension.h"
+
+namespace bvar {
+
+// Defined in variable.cpp
+bool match_dump_options(const std::string& name, const DumpOptions& opt);
+
+DEFINE_int32(bvar_max_multi_dimension_stats_count, 20000,
+             "Max number of stats in a MultiDimension, get_stats() of new "
+             "label values fails when the number is reached");
+
+namespace detail {
+void append_escaped_label_value(std::string* out, const std::string& value) {
+    for (size_t i = 0; i < value.size(); ++i) {
+        switch (value[i]) {
+        case '\\':
+            out->append("\\\\");
+            break;
+        case '"':
+            out->append("\\\"");
+            break;
+        case '\n':
+            out->append("\\n");
+            break;
+        default:
+            out->push_back(value[i]);
+            break;
+        }
+    }
+}
+}  // namespace detail
+
+// Multi-dimensional variables are much fewer than variables, a single map
+// is enough.
+struct MVarMapWithLock {
+    pthread_mutex_t mutex;
+    std::map<std::string, MVariable*> vars;
+
+    MVarMapWithLock() { pthread_mutex_init(&mutex, NULL); }
+};
+
+// Initialized on need because bvar is possibly used before main().
+static pthread_once_t s_mvar_map_once = PTHREAD_ONCE_INIT;
+static MVarMapWithLock* s_mvar_map = NULL;
+
+static void init_mvar_map() {
+    s_mvar_map = new MVarMapWithLock;
+}
+
+inline MVarMapWithLock& get_mvar_map() {
+    pthread_once(&s_mvar_map_once, init_mvar_map);
+    return *s_mvar_map;
+}
+
+MVariable::MVariable(const std::list<std::string>& labels)
+    : _labels(labels) {
+}
+
+MVariable::~MVariable() {
+    CHECK(!hide()) << "Subclass of MVariable MUST call hide() manually in"
+        " their dtors to avoid displaying a variable that is just destructing";
+}
+
+void MVariable::describe(std::ostream& os) {
+    os << "{\"name\":\"" << _name << "\",\"labels\":[";
+    for (std::list<std::string>::const_iterator it = _labels.begin();
+         it != _labels.end(); ++it) {
+        if (it != _labels.begin()) {
+            os << ',';
+        }
+        os << '"' << *it << '"';
+    }
+    os << "],\"stats_count\":" << count_stats() << '}';
+}
+
+std::string MVariable::get_description() {
+    std::ostringstream os;
+    describe(os);
+    return os.str();
+}
+
+int MVariable::expose_impl(const butil::StringPiece& prefix,
+                           const butil::StringPiece& name) {
+    if (name.empty()) {
+        LOG(ERROR) << "Parameter[name] is empty";
+        return -1;
+    }
+    hide();
+
+    _name.clear();
+    if (!prefix.empty()) {
+        to_underscored_name(&_name, prefix);
+        if (!_name.empty() && butil::back_char(_name) != '_') {
+            _name.push_back('_');
+        }
+    }
+    to_underscored_name(&_name, name);
+
+    MVarMapWithLock& m = get_mvar_map();
+    {
+        BAIDU_SCOPED_LOCK(m.mutex);
+        if (m.vars.insert(std::make_pair(_name, this)).second) {
+            return 0;
+        }
+    }
+    LOG(ERROR) << "Already exposed `" << _name << "'";
+    _name.clear();
+    return -1;
+}
+
+bool MVariable::hide() {
+    if (_name.empty()) {
+        return false;
+    }
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    CHECK_EQ(1UL, m.vars.erase(_name)) << "`" << _name << "' must exist";
+    _name.clear();
+    return true;
+}
+
+void MVariable::list_exposed(std::vector<std::string>* names) {
+    if (names == NULL) {
+        return;
+    }
+    names->clear();
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    names->reserve(m.vars.size());
+    for (std::map<std::string, MVariable*>::const_iterator
+             it = m.vars.begin(); it != m.vars.end(); ++it) {
+        names->push_back(it->first);
+    }
+}
+
+size_t MVariable::count_exposed() {
+    MVarMapWithLock& m = get_mvar_map();
+    BAIDU_SCOPED_LOCK(m.mutex);
+    return m.vars.size();
+}
+
+int MVariable::dump_exposed(Dumper* dumper, const DumpOptions* options) {
+    if (NULL == dumper) {
+        LOG(ERROR) << "Parameter[dumper] is NULL";
+        return -1;
+    }
+    DumpOptions opt;
+    if (options) {
+        opt = *options;
+    }
+    MVarMapWithLock& m = get_mvar_map();
+    // Holding the lock so that variables are not destructed during dumping,
+    // names are already sorted.
+    BAIDU_SCOPED_LOCK(m.mutex);
+    int count = 0;
+    for (std::map<std::string, MVariable*>::const_iterator
+             it = m.vars.begin(); it != m.vars.end(); ++it) {
+        if (!match_dump_options(it->first, opt)) {
+            continue;
+        }
+        const int rc = it->second->dump(dumper, &opt);
+        if (rc < 0) {
+            return -1;
+        }
+        count += rc;
+    }
+    return count;
+}
+
+}  // namespace bvar
@@ -0,0 +1,104 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+#ifndef  BVAR_MVARIABLE_H
+#define  BVAR_MVARIABLE_H
+
+#include <ostream>                      // std::ostream
+#include <sstream>                      // std::ostringstream
+#include <list>                         // std::list
+#include <string>                       // std::string
+#include <vector>                       // std::vector
+#include "butil/macros.h"               // DISALLOW_COPY_AND_ASSIGN
+#include "butil/strings/string_piece.h" // butil::StringPiece
+#include "bvar/variable.h"              // Dumper, DumpOptions
+
+namespace bvar {
+
+// Base class of multi-dimensional variables, namely a family of stats
+// distinguished by values of labels, e.g. latencies of every
+// (method, peer, status). Stats are not exposed as Variable but dumped
+// by dump_exposed() with names like `name{label1="v1",label2="v2"}'.
+class MVariable {
+public:
+    explicit MVariable(const std::list<std::string>& labels);
+    virtual ~MVariable();
+
+    // Print the variable (not the stats) into ostream.
+    virtual void describe(std::ostream& os);
+
+    // string form of describe().
+    std::string get_description();
+
+    // Number of stats of different label values.
+    virtual size_t count_stats() = 0;
+
+    // Call dumper->dump_mvar() on each stats.
+    // Returns number of dumped stats, -1 if the dumper returns false.
+    virtual int dump(Dumper* dumper, const DumpOptions* options) = 0;
+
+    // Expose this variable globally so that it's counted in following
+    // functions: list_exposed, count_exposed, dump_exposed.
+    // Returns 0 on success, -1 otherwise.
+    int expose(const butil::StringPiece& name) {
+        return expose_impl(butil::StringPiece(), name);
+    }
+    int expose_as(const butil::StringPiece& prefix,
+                  const butil::StringPiece& name) {
+        return expose_impl(prefix, name);
+    }
+
+    // Hide this variable so that it's not counted in *_exposed functions.
+    // Returns false if this variable is already hidden.
+    // CAUTION!! Subclasses must call hide() manually to avoid displaying
+    // a variable that is just destructing.
+    bool hide();
+
+    // Get exposed name. If this variable is not exposed, the name is empty.
+    const std::string& name() const { return _name; }
+
+    const std::list<std::string>& labels() const { return _labels; }
+    size_t count_labels() const { return _labels.size(); }
+
+    // Put names of all exposed multi-dimensional variables into `names'.
+    static void list_exposed(std::vector<std::string>* names);
+
+    // Number of exposed multi-dimensional variables.
+    static size_t count_exposed();
+
+    // Find all exposed multi-dimensional variables and dump their stats.
+    // Variables are filtered by names with wildcards in `options'.
+    // Returns number of dumped stats, -1 on error.
+    static int dump_exposed(Dumper* dumper, const DumpOptions* options);
+
+protected:
+    int expose_impl(const butil::StringPiece& prefix,
+                    const butil::StringPiece& name);
+
+    const std::list<std::string> _labels;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MVariable);
+
+    std::string _name;
+};
+
+}  // namespace bvar
+
+#endif  // BVAR_MVARIABLE_H
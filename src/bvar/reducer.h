@@ -76,7 +76,16 @@ public:
         SeriesSampler(Reducer* owner, const Op& op)
             : _owner(owner), _series(op) {}
         ~SeriesSampler() {}
-        void take_sample() override { _series.append(_owner->get_value()); }
+        void take_sample() override {
+            // Reuse the latest sample of windows if any, instead of walking
+            // through all threads again.
+            T value;
+            if (_owner->_sampler == NULL ||
+                !_owner->_sampler->get_latest(&value)) {
+                value = _owner->get_value();
+            }
+            _series.append(value);
+        }
         void describe(std::ostream& os) { _series.describe(os, NULL); }
     private:
         Reducer* _owner;
@@ -97,14 +106,15 @@ public:
     ~Reducer() {
         // Calling hide() manually is a MUST required by Variable.
         hide();
-        if (_sampler) {
-            _sampler->destroy();
-            _sampler = NULL;
-        }
+        // Destroy _series_sampler first which may read _sampler.
         if (_series_sampler) {
             _series_sampler->destroy();
             _series_sampler = NULL;
         }
+        if (_sampler) {
+            _sampler->destroy();
+            _sampler = NULL;
+        }
     }
 
     // Add a value.
@@ -0,0 +1,276 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <ctype.h>
+#include <fcntl.h>                               // open
+#include <pthread.h>
+#include <sched.h>                               // sched_yield
+#include <stdlib.h>                              // strtod
+#include <string.h>
+#include <sys/mman.h>                            // mmap
+#include <sys/stat.h>                            // fstat
+#include <unistd.h>                              // ftruncate
+#include <algorithm>                             // std::min
+#include <gflags/gflags.h>
+#include "butil/macros.h"                        // BAIDU_CASSERT
+#include "butil/atomicops.h"                     // butil::atomic
+#include "butil/fd_guard.h"                      // butil::fd_guard
+#include "butil/logging.h"
+#include "butil/time.h"                          // gettimeofday_us
+#include "bvar/variable.h"
+#include "bvar/detail/sampler.h"
+#include "bvar/shm_exporter.h"
+
+namespace bvar {
+
+DEFINE_string(bvar_shm_export_path, "",
+              "Write values of numeric bvar matching -bvar_shm_export_include "
+              "into this file every second for agents reading it by mmap, "
+              "<app> is replaced with the program name. Better be in tmpfs, "
+              "e.g. /dev/shm/bvar.<app>. Empty means disabled");
+DEFINE_string(bvar_shm_export_include, "",
+              "Export bvar matching these wildcards into "
+              "-bvar_shm_export_path, separated by semicolon(;), empty means "
+              "including all");
+DEFINE_int32(bvar_shm_export_capacity, 1024,
+             "Max number of bvar exported into -bvar_shm_export_path, read "
+             "when the file is created");
+
+// Defined in variable.cpp
+std::string read_command_name();
+
+BAIDU_CASSERT(sizeof(butil::atomic<uint64_t>) == sizeof(uint64_t),
+              atomic_uint64_must_be_as_large_as_uint64);
+
+static const char SHM_EXPORT_MAGIC[8] = "BVARSHM";
+
+inline butil::atomic<uint64_t>* seq_of(ShmExportHeader* h) {
+    return reinterpret_cast<butil::atomic<uint64_t>*>(&h->seq);
+}
+
+// Collect values of numeric variables.
+class NumericDumper : public Dumper {
+public:
+    bool dump(const std::string& name,
+              const butil::StringPiece& description) override {
+        _buf.assign(description.data(), description.size());
+        char* endptr = NULL;
+        const double value = strtod(_buf.c_str(), &endptr);
+        if (endptr == _buf.c_str()) {
+            return true;
+        }
+        for (; isspace(*endptr); ++endptr) {}
+        if (*endptr == '\0') {
+            vars.push_back(std::make_pair(name, value));
+        }
+        return true;
+    }
+
+    std::vector<std::pair<std::string, double> > vars;
+
+private:
+    std::string _buf;
+};
+
+class ShmExporter : public detail::Sampler {
+public:
+    ShmExporter() : _header(NULL), _map_size(0) {}
+
+    void take_sample() override {
+        // We can't access string flags directly because it's thread-unsafe.
+        std::string path;
+        DumpOptions options;
+        if (!GFLAGS_NS::GetCommandLineOption("bvar_shm_export_path", &path) ||
+            !GFLAGS_NS::GetCommandLineOption("bvar_shm_export_include",
+                                             &options.white_wildcards)) {
+            return;
+        }
+        const size_t pos = path.find("<app>");
+        if (pos != std::string::npos) {
+            path.replace(pos, 5/*<app>*/, read_command_name());
+        }
+        if (path != _path) {
+            unmap();
+            _path = path;
+            if (!path.empty() && map(path) == 0) {
+                LOG(INFO) << "Export bvar into " << path << " every second";
+            }
+        }
+        if (_header == NULL) {
+            return;
+        }
+        NumericDumper dumper;
+        if (Variable::dump_exposed(&dumper, &options) < 0) {
+            return;
+        }
+        publish(dumper.vars);
+    }
+
+private:
+    int map(const std::string& path) {
+        // Readers holding the mapping of a previous file (e.g. of last run)
+        // are not affected by the new file.
+        unlink(path.c_str());
+        butil::fd_guard fd(open(path.c_str(),
+                                O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+        if (fd < 0) {
+            PLOG(ERROR) << "Fail to create " << path;
+            return -1;
+        }
+        const uint32_t capacity =
+            std::max(FLAGS_bvar_shm_export_capacity, 1);
+        const size_t map_size =
+            sizeof(ShmExportHeader) + capacity * sizeof(ShmExportEntry);
+        if (ftruncate(fd, map_size) != 0) {
+            PLOG(ERROR) << "Fail to resize " << path;
+            return -1;
+        }
+        void* mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            PLOG(ERROR) << "Fail to mmap " << path;
+            return -1;
+        }
+        ShmExportHeader* h = static_cast<ShmExportHeader*>(mem);
+        memcpy(h->magic, SHM_EXPORT_MAGIC, sizeof(h->magic));
+        h->version = SHM_EXPORT_VERSION;
+        h->header_size = sizeof(ShmExportHeader);
+        h->entry_size = sizeof(ShmExportEntry);
+        h->capacity = capacity;
+        _header = h;
+        _map_size = map_size;
+        return 0;
+    }
+
+    void unmap() {
+        if (_header != NULL) {
+            munmap(_header, _map_size);
+            _header = NULL;
+            _map_size = 0;
+        }
+    }
+
+    void publish(const std::vector<std::pair<std::string, double> >& vars) {
+        butil::atomic<uint64_t>* seq = seq_of(_header);
+        const uint64_t s = seq->load(butil::memory_order_relaxed);
+        seq->store(s + 1, butil::memory_order_relaxed);
+        // Entries are written after readers can see the odd seq.
+        butil::atomic_thread_fence(butil::memory_order_release);
+        ShmExportEntry* entries = reinterpret_cast<ShmExportEntry*>(_header + 1);
+        const size_t n = std::min(vars.size(), (size_t)_header->capacity);
+        for (size_t i = 0; i < n; ++i) {
+            const std::string& name = vars[i].first;
+            const size_t len = std::min(name.size(), SHM_EXPORT_NAME_SIZE - 1);
+            memcpy(entries[i].name, name.data(), len);
+            memset(entries[i].name + len, 0, SHM_EXPORT_NAME_SIZE - len);
+            entries[i].value = vars[i].second;
+        }
+        _header->nentry = n;
+        _header->update_time_us = butil::gettimeofday_us();
+        seq->store(s + 2, butil::memory_order_release);
+    }
+
+    std::string _path;
+    ShmExportHeader* _header;
+    size_t _map_size;
+};
+
+int read_shm_export(const std::string& path,
+                    std::vector<std::pair<std::string, double> >* vars,
+                    int64_t* update_time_us) {
+    butil::fd_guard fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmExportHeader)) {
+        return -1;
+    }
+    const size_t map_size = st.st_size;
+    void* mem = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    ShmExportHeader* h = static_cast<ShmExportHeader*>(mem);
+    const ShmExportEntry* entries =
+        reinterpret_cast<const ShmExportEntry*>(h + 1);
+    int rc = -1;
+    if (memcmp(h->magic, SHM_EXPORT_MAGIC, sizeof(h->magic)) == 0 &&
+        h->version == SHM_EXPORT_VERSION &&
+        h->header_size == sizeof(ShmExportHeader) &&
+        h->entry_size == sizeof(ShmExportEntry) &&
+        map_size >= sizeof(ShmExportHeader) +
+                    h->capacity * sizeof(ShmExportEntry)) {
+        butil::atomic<uint64_t>* seq = seq_of(h);
+        std::vector<ShmExportEntry> copied;
+        int64_t time_us = 0;
+        for (int i = 0; i < 1000 && rc != 0; ++i) {
+            const uint64_t s = seq->load(butil::memory_order_acquire);
+            if (s & 1) {
+                sched_yield();
+                continue;
+            }
+            const uint32_t n = std::min(h->nentry, h->capacity);
+            copied.assign(entries, entries + n);
+            time_us = h->update_time_us;
+            butil::atomic_thread_fence(butil::memory_order_acquire);
+            if (seq->load(butil::memory_order_relaxed) == s) {
+                rc = 0;
+            }
+        }
+        if (rc == 0) {
+            vars->clear();
+            for (size_t i = 0; i < copied.size(); ++i) {
+                copied[i].name[SHM_EXPORT_NAME_SIZE - 1] = '\0';
+                vars->push_back(std::make_pair(std::string(copied[i].name),
+                                               copied[i].value));
+            }
+            if (update_time_us) {
+                *update_time_us = time_us;
+            }
+        }
+    }
+    munmap(mem, map_size);
+    return rc;
+}
+
+static pthread_once_t g_shm_exporter_once = PTHREAD_ONCE_INIT;
+
+static void create_shm_exporter() {
+    // Never destroyed.
+    (new ShmExporter)->schedule();
+}
+
+static bool validate_bvar_shm_export_path(const char*,
+                                          const std::string& path) {
+    if (!path.empty()) {
+        pthread_once(&g_shm_exporter_once, create_shm_exporter);
+    }
+    return true;
+}
+const bool ALLOW_UNUSED dummy_bvar_shm_export_path =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_shm_export_path,
+                                       validate_bvar_shm_export_path);
+
+static bool validate_bvar_shm_export_include(const char*, const std::string&) {
+    return true;
+}
+const bool ALLOW_UNUSED dummy_bvar_shm_export_include =
+    ::GFLAGS_NS::RegisterFlagValidator(&FLAGS_bvar_shm_export_include,
+                                       validate_bvar_shm_export_include);
+
+}  // namespace bvar
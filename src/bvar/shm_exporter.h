@@ -0,0 +1,70 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BVAR_SHM_EXPORTER_H
+#define BVAR_SHM_EXPORTER_H
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bvar {
+
+// When -bvar_shm_export_path is set (preferably a file in tmpfs, e.g.
+// /dev/shm/bvar.<app>), values of numeric bvars matching
+// -bvar_shm_export_include are written into the file by the sampler thread
+// every second. Agents on the same machine mmap() the file once and read
+// the values at any frequency, without RPC or syscalls.
+//
+// The file is a ShmExportHeader followed by `capacity' ShmExportEntry, in
+// the byte order of the machine. The layout is changed only with `version'.
+// `seq' works as a seqlock: load it (retry when it's odd), copy the
+// entries, load it again after an acquire fence and retry if it changed.
+// The file is re-created when the path changes or the process restarts,
+// readers holding the old mapping see `update_time_us' not moving.
+const uint32_t SHM_EXPORT_VERSION = 1;
+const size_t SHM_EXPORT_NAME_SIZE = 120;
+
+struct ShmExportHeader {
+    char magic[8];              // "BVARSHM" ending with '\0'
+    uint32_t version;           // SHM_EXPORT_VERSION
+    uint32_t header_size;       // sizeof(ShmExportHeader)
+    uint32_t entry_size;        // sizeof(ShmExportEntry)
+    uint32_t capacity;          // Max number of entries
+    uint64_t seq;               // Odd while the entries are being updated
+    uint32_t nentry;            // Number of valid entries
+    uint32_t reserved;
+    int64_t update_time_us;     // gettimeofday_us() of the last update
+};
+
+struct ShmExportEntry {
+    // Ending with '\0', longer names are truncated.
+    char name[SHM_EXPORT_NAME_SIZE];
+    double value;
+};
+
+// Read a consistent snapshot of the file at `path' written by the exporter
+// of this or another process.
+// Returns 0 on success, -1 otherwise.
+int read_shm_export(const std::string& path,
+                    std::vector<std::pair<std::string, double> >* vars,
+                    int64_t* update_time_us = NULL);
+
+}  // namespace bvar
+
+#endif  // BVAR_SHM_EXPORTER_H
@@ -19,6 +19,7 @@
 
 #include <pthread.h>
 #include <set>                                  // std::set
+#include <memory>                               // std::shared_ptr
 #include <fstream>                              // std::ifstream
 #include <sstream>                              // std::ostringstream
 #include <gflags/gflags.h>
@@ -29,6 +30,7 @@
 #include "butil/errno.h"                         // berror
 #include "butil/time.h"                          // milliseconds_from_now
 #include "butil/file_util.h"                     // butil::FilePath
+#include "butil/atomicops.h"                     // butil::atomic
 #include "bvar/gflag.h"
 #include "bvar/variable.h"
 
@@ -111,6 +113,10 @@ inline size_t sub_map_index(const std::string& str) {
     return h & (SUB_MAP_COUNT - 1);
 }
 
+// Changed whenever a variable is exposed or hidden, so that sorted names
+// can be reused by dump_exposed() when nothing changed.
+static butil::atomic<uint64_t> s_var_maps_version(0);
+
 inline VarMapWithLock* get_var_maps() {
     pthread_once(&s_var_maps_once, init_var_maps);
     return s_var_maps;
@@ -162,6 +168,7 @@ int Variable::expose_impl(const butil::StringPiece& prefix,
             entry = &m[_name];
             entry->var = this;
             entry->display_filter = display_filter;
+            s_var_maps_version.fetch_add(1, butil::memory_order_release);
             return 0;
         }
     }
@@ -190,6 +197,7 @@ bool Variable::hide() {
     VarEntry* entry = m.seek(_name);
     if (entry) {
         CHECK_EQ(1UL, m.erase(_name));
+        s_var_maps_version.fetch_add(1, butil::memory_order_release);
     } else {
         CHECK(false) << "`" << _name << "' must exist";
     }
@@ -458,6 +466,52 @@ DumpOptions::DumpOptions()
     , display_filter(DISPLAY_ON_PLAIN_TEXT)
 {}
 
+// Used by MVariable::dump_exposed() which filters much fewer names.
+bool match_dump_options(const std::string& name, const DumpOptions& opt) {
+    return WildcardMatcher(opt.white_wildcards, opt.question_mark, true)
+        .match(name) &&
+        !WildcardMatcher(opt.black_wildcards, opt.question_mark, false)
+        .match(name);
+}
+
+// Sorted names of exposed variables, rebuilt only when variables were
+// exposed or hidden since last call. Listing and sorting tens of thousands
+// of names dominates frequent dumps otherwise.
+typedef std::shared_ptr<const std::vector<std::string> > SortedNamesPtr;
+struct SortedNamesCache {
+    SortedNamesCache() : version(0) {
+        pthread_mutex_init(&mutex, NULL);
+    }
+    pthread_mutex_t mutex;
+    uint64_t version;
+    SortedNamesPtr names;
+};
+
+static SortedNamesPtr get_sorted_exposed_names(DisplayFilter display_filter) {
+    // Indexed by display_filter.
+    static SortedNamesCache* caches = new SortedNamesCache[DISPLAY_ON_ALL + 1];
+    SortedNamesCache& c = caches[display_filter & DISPLAY_ON_ALL];
+    const uint64_t version =
+        s_var_maps_version.load(butil::memory_order_acquire);
+    {
+        BAIDU_SCOPED_LOCK(c.mutex);
+        if (c.names != NULL && c.version == version) {
+            return c.names;
+        }
+    }
+    std::vector<std::string>* names = new std::vector<std::string>;
+    Variable::list_exposed(names, display_filter);
+    // Sort the names to make them more readable.
+    std::sort(names->begin(), names->end());
+    SortedNamesPtr ptr(names);
+    BAIDU_SCOPED_LOCK(c.mutex);
+    // Names changed during listing are seen in next call since `version'
+    // was loaded before.
+    c.version = version;
+    c.names = ptr;
+    return ptr;
+}
+
 int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
     if (NULL == dumper) {
         LOG(ERROR) << "Parameter[dumper] is NULL";
@@ -503,12 +557,10 @@ int Variable::dump_exposed(Dumper* dumper, const DumpOptions* poptions) {
         }
     } else {
         // Have to iterate all variables.
-        std::vector<std::string> varnames;
-        bvar::Variable::list_exposed(&varnames, opt.display_filter);
-        // Sort the names to make them more readable.
-        std::sort(varnames.begin(), varnames.end());
+        const SortedNamesPtr varnames =
+            get_sorted_exposed_names(opt.display_filter);
         for (std::vector<std::string>::const_iterator
-                 it = varnames.begin(); it != varnames.end(); ++it) {
+                 it = varnames->begin(); it != varnames->end(); ++it) {
             const std::string& name = *it;
             if (white_matcher.match(name) && !black_matcher.match(name)) {
                 if (bvar::Variable::describe_exposed(
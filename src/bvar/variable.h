@@ -53,6 +53,12 @@ public:
     virtual ~Dumper() { }
     virtual bool dump(const std::string& name,
                       const butil::StringPiece& description) = 0;
+    // Called by MVariable::dump_exposed() on each stats of multi-dimensional
+    // variables, `name' is like `foo{label1="v1",label2="v2"}'.
+    virtual bool dump_mvar(const std::string& name,
+                           const butil::StringPiece& description) {
+        return dump(name, description);
+    }
 };
 
 // Options for Variable::dump_exposed().
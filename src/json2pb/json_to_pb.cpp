@@ -15,6 +15,7 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <memory>
 #include <vector>
 #include <map>
 #include <string>
@@ -30,7 +31,9 @@
 #include "encode_decode.h"
 #include "butil/base64.h"
 #include "butil/string_printf.h"
+#include "butil/macros.h"                   // arraysize
 #include "protobuf_map.h"
+#include "message_plan.h"
 #include "rapidjson.h"
 
 #define J2PERROR(perr, fmt, ...)                                        \
@@ -290,137 +293,48 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
         })
 
 
-static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
-                                  const google::protobuf::FieldDescriptor* field,
-                                  google::protobuf::Message* message,
-                                  const Json2PbOptions& options,
-                                  std::string* err) {
-    if (value.IsNull()) {
-        if (field->is_required()) {
-            J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
-            return false;
-        }
-        return true;
-    }
-        
-    if (field->is_repeated()) {
-        if (!value.IsArray()) {
-            J2PERROR(err, "Invalid value for repeated field: %s",
-                     field->full_name().c_str());
-            return false;
-        }
-    } 
-
+// Convert `item' into `field' of `message', which is an element of the
+// repeated field if `repeated' is true. Objects for message fields are
+// converted by callers, only mismatched values of them reach here.
+static bool JsonItemToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& item,
+                                 bool repeated,
+                                 const google::protobuf::FieldDescriptor* field,
+                                 google::protobuf::Message* message,
+                                 const Json2PbOptions& options,
+                                 std::string* err) {
     const google::protobuf::Reflection* reflection = message->GetReflection();
     switch (field->cpp_type()) {
 #define CASE_FIELD_TYPE(cpptype, method, jsontype)                      \
-        case google::protobuf::FieldDescriptor::CPPTYPE_##cpptype: {                      \
-            if (field->is_repeated()) {                                 \
-                const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();          \
-                for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) { \
-                    const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];       \
-                    if (TYPE_MATCH == J2PCHECKTYPE(item, cpptype, jsontype)) { \
-                        reflection->Add##method(message, field, item.Get##jsontype()); \
-                    }                                                   \
-                }                                                       \
-            } else if (TYPE_MATCH == J2PCHECKTYPE(value, cpptype, jsontype)) { \
-                reflection->Set##method(message, field, value.Get##jsontype()); \
+    case google::protobuf::FieldDescriptor::CPPTYPE_##cpptype:          \
+        if (TYPE_MATCH == J2PCHECKTYPE(item, cpptype, jsontype)) {      \
+            if (repeated) {                                             \
+                reflection->Add##method(message, field, item.Get##jsontype()); \
+            } else {                                                    \
+                reflection->Set##method(message, field, item.Get##jsontype()); \
             }                                                           \
-            break;                                                      \
         }                                                               \
-          
-        CASE_FIELD_TYPE(INT32,  Int32,  Int);
-        CASE_FIELD_TYPE(UINT32, UInt32, Uint);
-        CASE_FIELD_TYPE(BOOL,   Bool,   Bool);
+        break;                                                          \
+
+    CASE_FIELD_TYPE(INT32,  Int32,  Int);
+    CASE_FIELD_TYPE(UINT32, UInt32, Uint);
+    CASE_FIELD_TYPE(BOOL,   Bool,   Bool);
 #undef CASE_FIELD_TYPE
 
     case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size;
-                 ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (!convert_int64_type(item, true, message, field, reflection,
-                                        err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_int64_type(value, false, message, field, reflection,
-                                       err)) {
-            return false;
-        }
-        break;
+        return convert_int64_type(item, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size;
-                 ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (!convert_uint64_type(item, true, message, field, reflection,
-                                         err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_uint64_type(value, false, message, field, reflection,
-                                       err)) {
-            return false;
-        }
-        break;
+        return convert_uint64_type(item, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_float_type(item, true, message, field,
-                                        reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_float_type(value, false, message, field,
-                                       reflection, err)) {
-            return false;
-        }
-        break;
+        return convert_float_type(item, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: 
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_double_type(item, true, message, field,
-                                         reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_double_type(value, false, message, field,
-                                        reflection, err)) {
-            return false;
-        }
-        break;
+        return convert_double_type(item, repeated, message, field, reflection, err);
         
     case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (TYPE_MATCH == J2PCHECKTYPE(item, string, String)) { 
-                    std::string str(item.GetString(), item.GetStringLength());
-                    if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
-                        options.base64_to_bytes) {
-                        std::string str_decoded;
-                        if (!butil::Base64Decode(str, &str_decoded)) {
-                            J2PERROR(err, "Fail to decode base64 string=%s", str.c_str());
-                            return false;
-                        }
-                        str = str_decoded;
-                    }
-                    reflection->AddString(message, field, str);
-                }  
-            }
-        } else if (TYPE_MATCH == J2PCHECKTYPE(value, string, String)) {
-            std::string str(value.GetString(), value.GetStringLength());
+        if (TYPE_MATCH == J2PCHECKTYPE(item, string, String)) { 
+            std::string str(item.GetString(), item.GetStringLength());
             if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
                 options.base64_to_bytes) {
                 std::string str_decoded;
@@ -430,27 +344,53 @@ static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
                 }
                 str = str_decoded;
             }
-            reflection->SetString(message, field, str);
+            if (repeated) {
+                reflection->AddString(message, field, str);
+            } else {
+                reflection->SetString(message, field, str);
+            }
         }
         break;
 
     case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_enum_type(item, true, message, field,
-                                       reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_enum_type(value, false, message, field,
-                                      reflection, err)) {
+        return convert_enum_type(item, repeated, message, field, reflection, err);
+        
+    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
+        if (repeated) {
+            J2PCHECKTYPE(item, message, Object);
+        } else if (!item.IsObject()) {
+            J2PERROR(err, "`json_value' is not a json object. %s",
+                     field->message_type()->name().c_str());
             return false;
         }
         break;
+    }
+    return true;
+}
+
+static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
+                                  const google::protobuf::FieldDescriptor* field,
+                                  google::protobuf::Message* message,
+                                  const Json2PbOptions& options,
+                                  std::string* err) {
+    if (value.IsNull()) {
+        if (field->is_required()) {
+            J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
+            return false;
+        }
+        return true;
+    }
         
-    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
+    if (field->is_repeated()) {
+        if (!value.IsArray()) {
+            J2PERROR(err, "Invalid value for repeated field: %s",
+                     field->full_name().c_str());
+            return false;
+        }
+    } 
+
+    const google::protobuf::Reflection* reflection = message->GetReflection();
+    if (field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
         if (field->is_repeated()) {
             const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
             for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
@@ -466,16 +406,26 @@ static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
             value, reflection->MutableMessage(message, field), options, err)) {
             return false;
         }
-        break;
+    } else if (field->is_repeated()) {
+        const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
+        for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
+            if (!JsonItemToProtoField(value[index], true, field, message,
+                                      options, err)) {
+                return false;
+            }
+        }
+    } else if (!JsonItemToProtoField(value, false, field, message, options, err)) {
+        return false;
     }
     return true;
 }
 
-bool JsonMapToProtoMap(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
-                       const google::protobuf::FieldDescriptor* map_desc,
-                       google::protobuf::Message* message,
-                       const Json2PbOptions& options,
-                       std::string* err) {
+static bool JsonMapToProtoMap(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
+                              const FieldPlan& map_plan,
+                              google::protobuf::Message* message,
+                              const Json2PbOptions& options,
+                              std::string* err) {
+    const google::protobuf::FieldDescriptor* map_desc = map_plan.field;
     if (!value.IsObject()) {
         J2PERROR(err, "Non-object value for map field: %s",
                  map_desc->full_name().c_str());
@@ -483,10 +433,8 @@ bool JsonMapToProtoMap(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
     }
 
     const google::protobuf::Reflection* reflection = message->GetReflection();
-    const google::protobuf::FieldDescriptor* key_desc =
-            map_desc->message_type()->FindFieldByName(KEY_NAME);
-    const google::protobuf::FieldDescriptor* value_desc =
-            map_desc->message_type()->FindFieldByName(VALUE_NAME);
+    const google::protobuf::FieldDescriptor* key_desc = map_plan.map_key;
+    const google::protobuf::FieldDescriptor* value_desc = map_plan.map_value;
 
     for (BUTIL_RAPIDJSON_NAMESPACE::Value::ConstMemberIterator it =
                  value.MemberBegin(); it != value.MemberEnd(); ++it) {
@@ -512,73 +460,608 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
         return false;
     }
 
-    const google::protobuf::Reflection* reflection = message->GetReflection();
-    
-    std::vector<const google::protobuf::FieldDescriptor*> fields;
-    fields.reserve(64);
-    for (int i = 0; i < descriptor->extension_range_count(); ++i) {
-        const google::protobuf::Descriptor::ExtensionRange*
-            ext_range = descriptor->extension_range(i);
-        for (int tag_number = ext_range->start; tag_number < ext_range->end;
-             ++tag_number) {
-            const google::protobuf::FieldDescriptor* field =
-                reflection->FindKnownExtensionByNumber(tag_number);
-            if (field) {
-                fields.push_back(field);
+    std::unique_ptr<MessagePlan> plan_holder;
+    const MessagePlan* plan = GetMessagePlan(*message, &plan_holder);
+
+    // Find values of all fields by walking through members of the json
+    // object once rather than searching each field in the object. The
+    // first member wins if names are duplicated, same with FindMember().
+    const size_t field_count = plan->field_count();
+    const BUTIL_RAPIDJSON_NAMESPACE::Value* stack_values[32];
+    std::vector<const BUTIL_RAPIDJSON_NAMESPACE::Value*> heap_values;
+    const BUTIL_RAPIDJSON_NAMESPACE::Value** values = stack_values;
+    if (field_count > arraysize(stack_values)) {
+        heap_values.resize(field_count);
+        values = &heap_values[0];
+    }
+    for (size_t i = 0; i < field_count; ++i) {
+        values[i] = NULL;
+    }
+    if (field_count != 0) {
+        for (BUTIL_RAPIDJSON_NAMESPACE::Value::ConstMemberIterator it =
+                 json_value.MemberBegin(); it != json_value.MemberEnd(); ++it) {
+            const int index = plan->FindField(it->name.GetString(),
+                                              it->name.GetStringLength());
+            if (index >= 0 && values[index] == NULL) {
+                values[index] = &it->value;
             }
         }
     }
-    for (int i = 0; i < descriptor->field_count(); ++i) {
-        fields.push_back(descriptor->field(i));
+    for (size_t i = 0; i < field_count; ++i) {
+        const int same_name_index = plan->field(i).same_name_index;
+        if (same_name_index >= 0) {
+            values[i] = values[same_name_index];
+        }
     }
 
-    std::string field_name_str_temp; 
-    const BUTIL_RAPIDJSON_NAMESPACE::Value* value_ptr = NULL;
-    for (size_t i = 0; i < fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* field = fields[i];
-        
-        const std::string& orig_name = field->name();
-        bool res = decode_name(orig_name, field_name_str_temp); 
-        const std::string& field_name_str = (res ? field_name_str_temp : orig_name);
-
-#ifndef RAPIDJSON_VERSION_0_1
-        BUTIL_RAPIDJSON_NAMESPACE::Value::ConstMemberIterator member =
-                json_value.FindMember(field_name_str.data());
-        if (member == json_value.MemberEnd()) {
-            if (field->is_required()) {
-                J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
+    for (size_t i = 0; i < field_count; ++i) {
+        const FieldPlan& fp = plan->field(i);
+        const BUTIL_RAPIDJSON_NAMESPACE::Value* value_ptr = values[i];
+        if (value_ptr == NULL) {
+            if (fp.field->is_required()) {
+                J2PERROR(err, "Missing required field: %s",
+                         fp.field->full_name().c_str());
                 return false;
             }
             continue; 
         }
-        value_ptr = &(member->value);
-#else 
-        const BUTIL_RAPIDJSON_NAMESPACE::Value::Member* member =
-                json_value.FindMember(field_name_str.data());
-        if (member == NULL) {
-            if (field->is_required()) {
-                J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
+        if (fp.is_map && value_ptr->IsObject()) {
+            // Try to parse json like {"key":value, ...} into protobuf map
+            if (!JsonMapToProtoMap(*value_ptr, fp, message, options, err)) {
+                return false;
+            }
+        } else {
+            if (!JsonValueToProtoField(*value_ptr, fp.field, message, options, err)) {
                 return false;
             }
-            continue; 
         }
-        value_ptr = &(member->value);
-#endif
+    }
+    return true;
+}
 
-        if (IsProtobufMap(field) && value_ptr->IsObject()) {
-            // Try to parse json like {"key":value, ...} into protobuf map
-            if (!JsonMapToProtoMap(*value_ptr, field, message, options, err)) {
+// Receives the only value of a json containing a scalar.
+class ScalarHandler : public BUTIL_RAPIDJSON_NAMESPACE::BaseReaderHandler<
+    BUTIL_RAPIDJSON_NAMESPACE::UTF8<>, ScalarHandler> {
+public:
+    ScalarHandler(BUTIL_RAPIDJSON_NAMESPACE::Value* value, std::string* str)
+        : _value(value), _str(str) {}
+
+    // Objects and arrays are not scalars.
+    bool Default() { return false; }
+    bool Null() { _value->SetNull(); return true; }
+    bool Bool(bool b) { _value->SetBool(b); return true; }
+    bool AddInt(int i) { _value->SetInt(i); return true; }
+    bool AddUint(unsigned u) { _value->SetUint(u); return true; }
+    bool AddInt64(int64_t i) { _value->SetInt64(i); return true; }
+    bool AddUint64(uint64_t u) { _value->SetUint64(u); return true; }
+    bool Double(double d) { _value->SetDouble(d); return true; }
+    bool String(const char* s, BUTIL_RAPIDJSON_NAMESPACE::SizeType len, bool) {
+        _str->assign(s, len);
+        _value->SetString(BUTIL_RAPIDJSON_NAMESPACE::StringRef(_str->c_str(), len));
+        return true;
+    }
+
+private:
+    BUTIL_RAPIDJSON_NAMESPACE::Value* _value;
+    std::string* _str;
+};
+
+class JsonToProtoParser::Impl {
+public:
+    Impl(google::protobuf::Message* message, const Json2PbOptions& options,
+         std::string* err)
+        : _root(message), _options(options), _err(err)
+        , _token_type(TOKEN_NONE), _escaped(false), _has_escape(false)
+        , _done(false), _failed(false) {}
+
+    bool Parse(const char* data, size_t size);
+    bool Finish();
+
+private:
+    enum TokenType {
+        TOKEN_NONE,
+        TOKEN_STRING,
+        TOKEN_NUMBER,
+        TOKEN_LITERAL,
+    };
+    enum FrameType {
+        FRAME_OBJECT,       // fields of a message
+        FRAME_MAP,          // entries of a map field
+        FRAME_ARRAY,        // elements of a repeated field
+        FRAME_SKIP_OBJECT,  // object not converted
+        FRAME_SKIP_ARRAY,   // array not converted
+    };
+    enum FrameState {
+        EXPECT_KEY_OR_END,
+        EXPECT_KEY,
+        EXPECT_COLON,
+        EXPECT_VALUE_OR_END,
+        EXPECT_VALUE,
+        EXPECT_COMMA_OR_END,
+    };
+    enum ValueKind {
+        VALUE_SCALAR,
+        VALUE_OBJECT,
+        VALUE_ARRAY,
+    };
+    struct Frame {
+        FrameType type;
+        FrameState state;
+        google::protobuf::Message* message;
+        // FRAME_OBJECT: plan of `message' and index of the field whose
+        // value is being parsed, -1 to skip the value.
+        const MessagePlan* plan;
+        std::unique_ptr<MessagePlan> plan_holder;
+        int current;
+        // FRAME_OBJECT: whether fields were seen, namely set by the first
+        // member with the same name.
+        uint64_t seen_bits;
+        std::vector<bool> seen_more;
+        // FRAME_ARRAY: the repeated field. FRAME_MAP: the map field and
+        // the entry whose value is being parsed.
+        const google::protobuf::FieldDescriptor* field;
+        const FieldPlan* map_plan;
+        google::protobuf::Message* entry;
+
+        bool seen(int i) const {
+            return i < 64 ? (seen_bits & (1ULL << i)) : seen_more[i - 64];
+        }
+        void set_seen(int i) {
+            if (i < 64) {
+                seen_bits |= (1ULL << i);
+            } else {
+                seen_more[i - 64] = true;
+            }
+        }
+    };
+
+    bool InvalidJson() {
+        J2PERROR(_err, "Invalid json format");
+        return false;
+    }
+    Frame* PushFrame(FrameType type, google::protobuf::Message* message);
+    bool OnToken();
+    bool OnKey(const std::string& key);
+    bool OnValue(ValueKind kind, const BUTIL_RAPIDJSON_NAMESPACE::Value* scalar);
+    bool OnFieldValue(google::protobuf::Message* message,
+                      const google::protobuf::FieldDescriptor* field,
+                      const FieldPlan* map_plan, ValueKind kind,
+                      const BUTIL_RAPIDJSON_NAMESPACE::Value* scalar);
+    bool OnElementValue(google::protobuf::Message* message,
+                        const google::protobuf::FieldDescriptor* field,
+                        ValueKind kind,
+                        const BUTIL_RAPIDJSON_NAMESPACE::Value* scalar);
+    bool SkipValue(ValueKind kind);
+    bool OnEnd(bool object);
+    bool OnComma();
+    bool OnColon();
+
+    google::protobuf::Message* _root;
+    Json2PbOptions _options;
+    std::string* _err;
+    std::vector<Frame> _frames;
+    // The token being parsed, which may be cut by ends of data.
+    TokenType _token_type;
+    std::string _token;
+    bool _escaped;
+    bool _has_escape;
+    // Decoded strings.
+    std::string _str;
+    BUTIL_RAPIDJSON_NAMESPACE::Reader _reader;
+    bool _done;
+    bool _failed;
+};
+
+JsonToProtoParser::Impl::Frame*
+JsonToProtoParser::Impl::PushFrame(FrameType type,
+                                   google::protobuf::Message* message) {
+    _frames.push_back(Frame());
+    Frame* f = &_frames.back();
+    f->type = type;
+    f->state = ((type == FRAME_ARRAY || type == FRAME_SKIP_ARRAY)
+                ? EXPECT_VALUE_OR_END : EXPECT_KEY_OR_END);
+    f->message = message;
+    f->plan = NULL;
+    f->current = -1;
+    f->seen_bits = 0;
+    f->field = NULL;
+    f->map_plan = NULL;
+    f->entry = NULL;
+    if (type == FRAME_OBJECT) {
+        f->plan = GetMessagePlan(*message, &f->plan_holder);
+        if (f->plan->field_count() > 64) {
+            f->seen_more.resize(f->plan->field_count() - 64);
+        }
+    }
+    return f;
+}
+
+bool JsonToProtoParser::Impl::Parse(const char* data, size_t size) {
+    if (_failed) {
+        return false;
+    }
+    const char* p = data;
+    const char* const end = data + size;
+    while (p != end) {
+        if (_token_type == TOKEN_STRING) {
+            const char* const begin = p;
+            for (; p != end; ++p) {
+                if (_escaped) {
+                    _escaped = false;
+                } else if (*p == '\\') {
+                    _escaped = true;
+                    _has_escape = true;
+                } else if (*p == '"') {
+                    break;
+                }
+            }
+            _token.append(begin, p - begin);
+            if (p == end) {
+                break;
+            }
+            ++p;  // skip the closing quote
+            if (!OnToken()) {
+                _failed = true;
                 return false;
             }
-        } else {
-            if (!JsonValueToProtoField(*value_ptr, field, message, options, err)) {
+            continue;
+        }
+        if (_token_type != TOKEN_NONE) {
+            const char* const begin = p;
+            if (_token_type == TOKEN_NUMBER) {
+                while (p != end && ((*p >= '0' && *p <= '9') || *p == '-' ||
+                                    *p == '+' || *p == '.' || *p == 'e' ||
+                                    *p == 'E')) {
+                    ++p;
+                }
+            } else {
+                while (p != end && *p >= 'a' && *p <= 'z') {
+                    ++p;
+                }
+            }
+            _token.append(begin, p - begin);
+            if (p == end) {
+                break;
+            }
+            if (!OnToken()) {
+                _failed = true;
                 return false;
             }
+            continue;
+        }
+        const char c = *p;
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+            ++p;
+            continue;
+        }
+        if (_done) {
+            _failed = true;
+            return InvalidJson();
+        }
+        bool ok = true;
+        switch (c) {
+        case '{':
+            ok = OnValue(VALUE_OBJECT, NULL);
+            ++p;
+            break;
+        case '[':
+            ok = OnValue(VALUE_ARRAY, NULL);
+            ++p;
+            break;
+        case '}':
+        case ']':
+            ok = OnEnd(c == '}');
+            ++p;
+            break;
+        case ',':
+            ok = OnComma();
+            ++p;
+            break;
+        case ':':
+            ok = OnColon();
+            ++p;
+            break;
+        case '"':
+            _token_type = TOKEN_STRING;
+            _escaped = false;
+            _has_escape = false;
+            ++p;
+            break;
+        default:
+            if (_frames.empty()) {
+                J2PERROR(_err, "`json_value' is not a json object. %s",
+                         _root->GetDescriptor()->name().c_str());
+                ok = false;
+            } else if (c == '-' || (c >= '0' && c <= '9')) {
+                _token_type = TOKEN_NUMBER;
+            } else if (c >= 'a' && c <= 'z') {
+                _token_type = TOKEN_LITERAL;
+            } else {
+                ok = InvalidJson();
+            }
+            break;
+        }
+        if (!ok) {
+            _failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool JsonToProtoParser::Impl::Finish() {
+    if (_failed) {
+        return false;
+    }
+    if (_token_type == TOKEN_NUMBER || _token_type == TOKEN_LITERAL) {
+        // Numbers and literals end with other characters, which may not
+        // come for scalars at the end of json.
+        if (!OnToken()) {
+            _failed = true;
+            return false;
         }
     }
+    if (!_done || _token_type != TOKEN_NONE) {
+        // Incomplete json
+        _failed = true;
+        return InvalidJson();
+    }
     return true;
 }
 
+bool JsonToProtoParser::Impl::OnToken() {
+    const TokenType type = _token_type;
+    _token_type = TOKEN_NONE;
+    BUTIL_RAPIDJSON_NAMESPACE::Value value;
+    ScalarHandler handler(&value, &_str);
+    if (type == TOKEN_STRING) {
+        if (_has_escape) {
+            _token.insert(_token.begin(), '"');
+            _token.push_back('"');
+        } else {
+            _str.swap(_token);
+            value.SetString(BUTIL_RAPIDJSON_NAMESPACE::StringRef(
+                                _str.c_str(), _str.size()));
+        }
+    }
+    if (type != TOKEN_STRING || _has_escape) {
+        // Decode by rapidjson to be consistent with JsonToProtoMessage.
+        BUTIL_RAPIDJSON_NAMESPACE::StringStream ss(_token.c_str());
+        if (!_reader.Parse<0>(ss, handler) || ss.Tell() != _token.size()) {
+            _token.clear();
+            return InvalidJson();
+        }
+    }
+    _token.clear();
+    if (!_frames.empty() && value.IsString()) {
+        const FrameState state = _frames.back().state;
+        if (state == EXPECT_KEY_OR_END || state == EXPECT_KEY) {
+            return OnKey(_str);
+        }
+    }
+    return OnValue(VALUE_SCALAR, &value);
+}
+
+bool JsonToProtoParser::Impl::OnKey(const std::string& key) {
+    Frame& f = _frames.back();
+    f.state = EXPECT_COLON;
+    if (f.type == FRAME_OBJECT) {
+        const int index = f.plan->FindField(key.data(), key.size());
+        if (index >= 0 && !f.seen(index)) {
+            // The first member wins, same with FindMember().
+            f.set_seen(index);
+            f.current = index;
+        } else {
+            f.current = -1;
+        }
+    } else if (f.type == FRAME_MAP) {
+        f.entry = f.message->GetReflection()->AddMessage(f.message, f.field);
+        f.entry->GetReflection()->SetString(f.entry, f.map_plan->map_key, key);
+    }
+    return true;
+}
+
+bool JsonToProtoParser::Impl::OnColon() {
+    if (_frames.empty() || _frames.back().state != EXPECT_COLON) {
+        return InvalidJson();
+    }
+    _frames.back().state = EXPECT_VALUE;
+    return true;
+}
+
+bool JsonToProtoParser::Impl::OnComma() {
+    if (_frames.empty() || _frames.back().state != EXPECT_COMMA_OR_END) {
+        return InvalidJson();
+    }
+    Frame& f = _frames.back();
+    f.state = ((f.type == FRAME_ARRAY || f.type == FRAME_SKIP_ARRAY)
+               ? EXPECT_VALUE : EXPECT_KEY);
+    return true;
+}
+
+bool JsonToProtoParser::Impl::OnEnd(bool object) {
+    if (_frames.empty()) {
+        return InvalidJson();
+    }
+    Frame& f = _frames.back();
+    if (object) {
+        if ((f.type != FRAME_OBJECT && f.type != FRAME_MAP &&
+             f.type != FRAME_SKIP_OBJECT) ||
+            (f.state != EXPECT_KEY_OR_END && f.state != EXPECT_COMMA_OR_END)) {
+            return InvalidJson();
+        }
+        if (f.type == FRAME_OBJECT) {
+            for (size_t i = 0; i < f.plan->field_count(); ++i) {
+                const google::protobuf::FieldDescriptor* field =
+                    f.plan->field(i).field;
+                if (field->is_required() && !f.seen(i)) {
+                    J2PERROR(_err, "Missing required field: %s",
+                             field->full_name().c_str());
+                    return false;
+                }
+            }
+        }
+    } else {
+        if ((f.type != FRAME_ARRAY && f.type != FRAME_SKIP_ARRAY) ||
+            (f.state != EXPECT_VALUE_OR_END && f.state != EXPECT_COMMA_OR_END)) {
+            return InvalidJson();
+        }
+    }
+    _frames.pop_back();
+    if (_frames.empty()) {
+        _done = true;
+    }
+    return true;
+}
+
+bool JsonToProtoParser::Impl::OnValue(
+    ValueKind kind, const BUTIL_RAPIDJSON_NAMESPACE::Value* scalar) {
+    if (_frames.empty()) {
+        if (_done) {
+            return InvalidJson();
+        }
+        if (kind != VALUE_OBJECT) {
+            J2PERROR(_err, "`json_value' is not a json object. %s",
+                     _root->GetDescriptor()->name().c_str());
+            return false;
+        }
+        PushFrame(FRAME_OBJECT, _root);
+        return true;
+    }
+    Frame& f = _frames.back();
+    if (f.state != EXPECT_VALUE && f.state != EXPECT_VALUE_OR_END) {
+        return InvalidJson();
+    }
+    // Frames may be pushed below, don't touch `f' after that.
+    f.state = EXPECT_COMMA_OR_END;
+    switch (f.type) {
+    case FRAME_OBJECT:
+        if (f.current < 0) {
+            return SkipValue(kind);
+        } else {
+            const FieldPlan& fp = f.plan->field(f.current);
+            return OnFieldValue(f.message, fp.field, (fp.is_map ? &fp : NULL),
+                                kind, scalar);
+        }
+    case FRAME_MAP:
+        return OnFieldValue(f.entry, f.map_plan->map_value, NULL, kind, scalar);
+    case FRAME_ARRAY:
+        return OnElementValue(f.message, f.field, kind, scalar);
+    case FRAME_SKIP_OBJECT:
+    case FRAME_SKIP_ARRAY:
+        return SkipValue(kind);
+    }
+    return true;
+}
+
+bool JsonToProtoParser::Impl::SkipValue(ValueKind kind) {
+    if (kind == VALUE_OBJECT) {
+        PushFrame(FRAME_SKIP_OBJECT, NULL);
+    } else if (kind == VALUE_ARRAY) {
+        PushFrame(FRAME_SKIP_ARRAY, NULL);
+    }
+    return true;
+}
+
+// Same with JsonValueToProtoField() except that objects and arrays are
+// converted by following tokens.
+bool JsonToProtoParser::Impl::OnFieldValue(
+    google::protobuf::Message* message,
+    const google::protobuf::FieldDescriptor* field,
+    const FieldPlan* map_plan, ValueKind kind,
+    const BUTIL_RAPIDJSON_NAMESPACE::Value* scalar) {
+    std::string* const err = _err;
+    if (kind == VALUE_SCALAR) {
+        return JsonValueToProtoField(*scalar, field, message, _options, err);
+    }
+    if (kind == VALUE_OBJECT && map_plan != NULL) {
+        // Try to parse json like {"key":value, ...} into protobuf map
+        Frame* f = PushFrame(FRAME_MAP, message);
+        f->field = field;
+        f->map_plan = map_plan;
+        return true;
+    }
+    if (field->is_repeated()) {
+        if (kind != VALUE_ARRAY) {
+            J2PERROR(err, "Invalid value for repeated field: %s",
+                     field->full_name().c_str());
+            return false;
+        }
+        Frame* f = PushFrame(FRAME_ARRAY, message);
+        f->field = field;
+        return true;
+    }
+    if (kind == VALUE_OBJECT &&
+        field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+        PushFrame(FRAME_OBJECT,
+                  message->GetReflection()->MutableMessage(message, field));
+        return true;
+    }
+    // Report the mismatched type and skip the value if the field is optional.
+    const BUTIL_RAPIDJSON_NAMESPACE::Value placeholder(
+        kind == VALUE_OBJECT ? BUTIL_RAPIDJSON_NAMESPACE::kObjectType
+        : BUTIL_RAPIDJSON_NAMESPACE::kArrayType);
+    if (!JsonItemToProtoField(placeholder, false, field, message, _options, err)) {
+        return false;
+    }
+    return SkipValue(kind);
+}
+
+bool JsonToProtoParser::Impl::OnElementValue(
+    google::protobuf::Message* message,
+    const google::protobuf::FieldDescriptor* field,
+    ValueKind kind,
+    const BUTIL_RAPIDJSON_NAMESPACE::Value* scalar) {
+    if (kind == VALUE_SCALAR) {
+        return JsonItemToProtoField(*scalar, true, field, message, _options, _err);
+    }
+    if (kind == VALUE_OBJECT &&
+        field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+        PushFrame(FRAME_OBJECT,
+                  message->GetReflection()->AddMessage(message, field));
+        return true;
+    }
+    const BUTIL_RAPIDJSON_NAMESPACE::Value placeholder(
+        kind == VALUE_OBJECT ? BUTIL_RAPIDJSON_NAMESPACE::kObjectType
+        : BUTIL_RAPIDJSON_NAMESPACE::kArrayType);
+    if (!JsonItemToProtoField(placeholder, true, field, message, _options, _err)) {
+        return false;
+    }
+    return SkipValue(kind);
+}
+
+JsonToProtoParser::JsonToProtoParser(google::protobuf::Message* message)
+    : _impl(new Impl(message, Json2PbOptions(), &_error)) {
+}
+
+JsonToProtoParser::JsonToProtoParser(google::protobuf::Message* message,
+                                     const Json2PbOptions& options)
+    : _impl(new Impl(message, options, &_error)) {
+}
+
+JsonToProtoParser::~JsonToProtoParser() {
+    delete _impl;
+}
+
+bool JsonToProtoParser::Parse(const char* data, size_t size) {
+    return _impl->Parse(data, size);
+}
+
+bool JsonToProtoParser::Parse(google::protobuf::io::ZeroCopyInputStream* stream) {
+    const void* data = NULL;
+    int size = 0;
+    while (stream->Next(&data, &size)) {
+        if (!_impl->Parse(static_cast<const char*>(data), size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool JsonToProtoParser::Finish() {
+    return _impl->Finish();
+}
+
 bool ZeroCopyStreamToJson(BUTIL_RAPIDJSON_NAMESPACE::Document *dest, 
                           google::protobuf::io::ZeroCopyInputStream *stream) {
     ZeroCopyStreamReader stream_reader(stream);
@@ -20,6 +20,7 @@
 #ifndef BRPC_JSON2PB_JSON_TO_PB_H
 #define BRPC_JSON2PB_JSON_TO_PB_H
 
+#include <string>
 #include <google/protobuf/message.h>
 #include <google/protobuf/io/zero_copy_stream.h>    // ZeroCopyInputStream
 
@@ -56,6 +57,50 @@ bool JsonToProtoMessage(const std::string& json,
 bool JsonToProtoMessage(google::protobuf::io::ZeroCopyInputStream* stream,
                         google::protobuf::Message* message,
                         std::string* error = NULL);
+
+// Convert json to protobuf `message' SAX-style without building the DOM of
+// the whole json first, which doubles memory for large json. Json can be
+// parsed piece by piece as it arrives:
+//   json2pb::JsonToProtoParser parser(&message, options);
+//   while (more data) {
+//       if (!parser.Parse(&stream)) { /* parser.error() */ }
+//   }
+//   if (!parser.Finish()) { /* parser.error() */ }
+// Unlike JsonToProtoMessage(), fields are set during parsing thus `message'
+// may be partially filled on errors, and errors are reported in the order
+// of json rather than fields.
+class JsonToProtoParser {
+public:
+    explicit JsonToProtoParser(google::protobuf::Message* message);
+    JsonToProtoParser(google::protobuf::Message* message,
+                      const Json2PbOptions& options);
+    ~JsonToProtoParser();
+
+    // Parse all data available in `stream', namely until Next() fails, or
+    // `size' bytes starting from `data'. A token cut at the end of data is
+    // continued by next calls.
+    // Returns false on error.
+    bool Parse(google::protobuf::io::ZeroCopyInputStream* stream);
+    bool Parse(const char* data, size_t size);
+
+    // Call this after all json is parsed.
+    // Returns true if the json is a complete object, false otherwise.
+    bool Finish();
+
+    // Errors of failed calls, or conversion errors of optional fields that
+    // are not regarded as failures, same with `error' of JsonToProtoMessage.
+    const std::string& error() const { return _error; }
+
+private:
+    // Non-copyable
+    JsonToProtoParser(const JsonToProtoParser&);
+    void operator=(const JsonToProtoParser&);
+
+    class Impl;
+    Impl* _impl;
+    std::string _error;
+};
+
 } // namespace json2pb
 
 #endif // BRPC_JSON2PB_JSON_TO_PB_H
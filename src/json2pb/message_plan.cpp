@@ -0,0 +1,149 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <algorithm>                        // std::max
+#include "butil/scoped_lock.h"              // BAIDU_SCOPED_LOCK
+#include "butil/thread_local.h"             // thread_atexit
+#include "encode_decode.h"
+#include "protobuf_map.h"
+#include "message_plan.h"
+
+namespace json2pb {
+
+static void InitFieldPlan(const google::protobuf::FieldDescriptor* field,
+                          bool is_extension, FieldPlan* fp) {
+    fp->field = field;
+    if (!decode_name(field->name(), fp->json_name)) {
+        fp->json_name = field->name();
+    }
+    fp->same_name_index = -1;
+    fp->is_extension = is_extension;
+    fp->is_map = IsProtobufMap(field);
+    fp->map_key = NULL;
+    fp->map_value = NULL;
+    if (fp->is_map) {
+        fp->map_key = field->message_type()->field(KEY_INDEX);
+        fp->map_value = field->message_type()->field(VALUE_INDEX);
+    }
+}
+
+MessagePlan::MessagePlan(const google::protobuf::Descriptor* descriptor,
+                         const google::protobuf::Reflection* reflection) {
+    // Probing all numbers in extension ranges is slow, which is the major
+    // reason to cache plans.
+    for (int i = 0; i < descriptor->extension_range_count(); ++i) {
+        const google::protobuf::Descriptor::ExtensionRange*
+            ext_range = descriptor->extension_range(i);
+        for (int tag_number = ext_range->start;
+             tag_number < ext_range->end; ++tag_number) {
+            const google::protobuf::FieldDescriptor* field =
+                reflection->FindKnownExtensionByNumber(tag_number);
+            if (field) {
+                _fields.push_back(FieldPlan());
+                InitFieldPlan(field, true, &_fields.back());
+            }
+        }
+    }
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        _fields.push_back(FieldPlan());
+        InitFieldPlan(descriptor->field(i), false, &_fields.back());
+    }
+    _index_by_name.init(std::max(_fields.size() * 2, (size_t)8));
+    for (size_t i = 0; i < _fields.size(); ++i) {
+        FieldPlan& fp = _fields[i];
+        const int* index = _index_by_name.seek(fp.json_name);
+        if (index != NULL) {
+            fp.same_name_index = *index;
+        } else {
+            _index_by_name[fp.json_name] = (int)i;
+        }
+    }
+}
+
+typedef butil::FlatMap<const google::protobuf::Descriptor*,
+                       const MessagePlan*> PlanMap;
+
+// Owns all cached plans which are never deleted.
+static pthread_mutex_t s_plan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static PlanMap* s_plans = NULL;
+
+// Lookups are served by the thread-local copy without locking.
+static __thread PlanMap* tls_plans = NULL;
+
+static void delete_tls_plans(void* arg) {
+    delete static_cast<PlanMap*>(arg);
+}
+
+static PlanMap* CreatePlanMap() {
+    PlanMap* m = new PlanMap;
+    if (m->init(64) != 0) {
+        delete m;
+        return NULL;
+    }
+    return m;
+}
+
+const MessagePlan* GetMessagePlan(const google::protobuf::Message& message,
+                                  std::unique_ptr<MessagePlan>* holder) {
+    const google::protobuf::Descriptor* descriptor = message.GetDescriptor();
+    const google::protobuf::Reflection* reflection = message.GetReflection();
+    PlanMap* tls = tls_plans;
+    if (tls != NULL) {
+        const MessagePlan* const* p = tls->seek(descriptor);
+        if (p != NULL) {
+            return *p;
+        }
+    }
+    if (descriptor->file()->pool() !=
+        google::protobuf::DescriptorPool::generated_pool()) {
+        holder->reset(new MessagePlan(descriptor, reflection));
+        return holder->get();
+    }
+    if (tls == NULL) {
+        tls = CreatePlanMap();
+        if (tls == NULL) {
+            holder->reset(new MessagePlan(descriptor, reflection));
+            return holder->get();
+        }
+        tls_plans = tls;
+        butil::thread_atexit(delete_tls_plans, tls);
+    }
+    const MessagePlan* plan = NULL;
+    {
+        BAIDU_SCOPED_LOCK(s_plan_mutex);
+        if (s_plans == NULL) {
+            s_plans = CreatePlanMap();
+        }
+        const MessagePlan* const* p =
+            (s_plans ? s_plans->seek(descriptor) : NULL);
+        if (p != NULL) {
+            plan = *p;
+        } else if (s_plans != NULL) {
+            plan = new MessagePlan(descriptor, reflection);
+            (*s_plans)[descriptor] = plan;
+        }
+    }
+    if (plan == NULL) {
+        holder->reset(new MessagePlan(descriptor, reflection));
+        return holder->get();
+    }
+    (*tls)[descriptor] = plan;
+    return plan;
+}
+
+} // namespace json2pb
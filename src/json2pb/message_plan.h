@@ -0,0 +1,76 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BRPC_JSON2PB_MESSAGE_PLAN_H
+#define BRPC_JSON2PB_MESSAGE_PLAN_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <google/protobuf/message.h>
+#include "butil/containers/flat_map.h"
+
+namespace json2pb {
+
+// What the conversions need to know about a field, computed from the
+// descriptor once instead of in every conversion.
+struct FieldPlan {
+    const google::protobuf::FieldDescriptor* field;
+    // Name of the field in json, namely decoded by decode_name().
+    std::string json_name;
+    // Index of the former field with the same json_name, -1 if none.
+    int same_name_index;
+    // True if the field is an extension known to the reflection.
+    bool is_extension;
+    // True if the field is an emulated map, see protobuf_map.h
+    bool is_map;
+    // Key and value fields of the map entry, NULL if is_map is false.
+    const google::protobuf::FieldDescriptor* map_key;
+    const google::protobuf::FieldDescriptor* map_value;
+};
+
+// Known extensions followed by fields of a message type in the order of
+// declaration, with a table to find fields by their names in json.
+class MessagePlan {
+public:
+    MessagePlan(const google::protobuf::Descriptor* descriptor,
+                const google::protobuf::Reflection* reflection);
+
+    size_t field_count() const { return _fields.size(); }
+    const FieldPlan& field(size_t i) const { return _fields[i]; }
+
+    // Returns index of the field named `name' in json, -1 if not found.
+    int FindField(const char* name, size_t length) const {
+        const int* index = _index_by_name.seek(butil::StringPiece(name, length));
+        return index ? *index : -1;
+    }
+
+private:
+    std::vector<FieldPlan> _fields;
+    butil::FlatMap<std::string, int> _index_by_name;
+};
+
+// Returns the plan of `message'. Plans of message types in the generated
+// pool are built at the first time and cached forever, messages of other
+// pools (which may be destroyed) get a plan built in `holder' each time.
+// NOTE: extensions registered after the plan is cached are not converted.
+const MessagePlan* GetMessagePlan(const google::protobuf::Message& message,
+                                  std::unique_ptr<MessagePlan>* holder);
+
+} // namespace json2pb
+
+#endif // BRPC_JSON2PB_MESSAGE_PLAN_H
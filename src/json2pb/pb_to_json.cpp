@@ -16,6 +16,7 @@
 // under the License.
 
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <string>
 #include <sstream>
@@ -26,6 +27,7 @@
 #include "zero_copy_stream_writer.h"
 #include "encode_decode.h"
 #include "protobuf_map.h"
+#include "message_plan.h"
 #include "rapidjson.h"
 #include "pb_to_json.h"
 
@@ -53,6 +55,11 @@ public:
     const std::string& ErrorText() const { return _error; }
 
 private:
+    // Extensions are never converted as maps.
+    bool _IsMap(const FieldPlan& fp) const {
+        return _option.enable_protobuf_map && fp.is_map && !fp.is_extension;
+    }
+
     template <typename Handler>
     bool _PbFieldToJson(const google::protobuf::Message& message,
                         const google::protobuf::FieldDescriptor* field,
@@ -66,38 +73,17 @@ template <typename Handler>
 bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handler& handler) {
     handler.StartObject();
     const google::protobuf::Reflection* reflection = message.GetReflection();
-    const google::protobuf::Descriptor* descriptor = message.GetDescriptor();
-    
-    int ext_range_count = descriptor->extension_range_count();
-    int field_count = descriptor->field_count();
-    std::vector<const google::protobuf::FieldDescriptor*> fields;
-    fields.reserve(64);
-    for (int i = 0; i < ext_range_count; ++i) {
-        const google::protobuf::Descriptor::ExtensionRange*
-            ext_range = descriptor->extension_range(i);
-        for (int tag_number = ext_range->start;
-             tag_number < ext_range->end; ++tag_number) {
-            const google::protobuf::FieldDescriptor* field =
-                    reflection->FindKnownExtensionByNumber(tag_number);
-            if (field) {
-                fields.push_back(field);
-            }
-        }
-    }
-    std::vector<const google::protobuf::FieldDescriptor*> map_fields;
-    for (int i = 0; i < field_count; ++i) {
-        const google::protobuf::FieldDescriptor* field = descriptor->field(i);
-        if (_option.enable_protobuf_map && json2pb::IsProtobufMap(field)) {
-            map_fields.push_back(field);
-        } else {
-            fields.push_back(field);
-        }
-    }
+    std::unique_ptr<MessagePlan> plan_holder;
+    const MessagePlan* plan = GetMessagePlan(message, &plan_holder);
 
     // Fill in non-map fields
-    std::string field_name_str;
-    for (size_t i = 0; i < fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* field = fields[i];
+    const size_t field_count = plan->field_count();
+    for (size_t i = 0; i < field_count; ++i) {
+        const FieldPlan& fp = plan->field(i);
+        if (_IsMap(fp)) {
+            continue;
+        }
+        const google::protobuf::FieldDescriptor* field = fp.field;
         if (!field->is_repeated() && !reflection->HasField(message, field)) {
             // Field that has not been set
             if (field->is_required()) {
@@ -115,46 +101,41 @@ bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handle
             continue;
         }
 
-        const std::string& orig_name = field->name();
-        bool decoded = decode_name(orig_name, field_name_str); 
-        const std::string& name = decoded ? field_name_str : orig_name;
-        handler.Key(name.data(), name.size(), false);
+        handler.Key(fp.json_name.data(), fp.json_name.size(), false);
         if (!_PbFieldToJson(message, field, handler)) {
             return false;
         }
     }
 
     // Fill in map fields
-    for (size_t i = 0; i < map_fields.size(); ++i) {
-        const google::protobuf::FieldDescriptor* map_desc = map_fields[i];
-        const google::protobuf::FieldDescriptor* key_desc =
-                map_desc->message_type()->field(json2pb::KEY_INDEX);
-        const google::protobuf::FieldDescriptor* value_desc =
-                map_desc->message_type()->field(json2pb::VALUE_INDEX);
-
-        // Write a json object corresponding to hold protobuf map
-        // such as {"key": value, ...}
-        const std::string& orig_name = map_desc->name();
-        bool decoded = decode_name(orig_name, field_name_str);
-        const std::string& name = decoded ? field_name_str : orig_name;
-        handler.Key(name.data(), name.size(), false);
-        handler.StartObject();
+    if (_option.enable_protobuf_map) {
         std::string entry_name;
-        for (int j = 0; j < reflection->FieldSize(message, map_desc); ++j) {
-            const google::protobuf::Message& entry =
-                    reflection->GetRepeatedMessage(message, map_desc, j);
-            const google::protobuf::Reflection* entry_reflection = entry.GetReflection();
-            entry_name = entry_reflection->GetStringReference(
-                entry, key_desc, &entry_name);
-            handler.Key(entry_name.data(), entry_name.size(), false);
+        for (size_t i = 0; i < field_count; ++i) {
+            const FieldPlan& fp = plan->field(i);
+            if (!_IsMap(fp)) {
+                continue;
+            }
+            // Write a json object corresponding to hold protobuf map
+            // such as {"key": value, ...}
+            handler.Key(fp.json_name.data(), fp.json_name.size(), false);
+            handler.StartObject();
+            const int map_size = reflection->FieldSize(message, fp.field);
+            for (int j = 0; j < map_size; ++j) {
+                const google::protobuf::Message& entry =
+                        reflection->GetRepeatedMessage(message, fp.field, j);
+                const google::protobuf::Reflection* entry_reflection = entry.GetReflection();
+                entry_name = entry_reflection->GetStringReference(
+                    entry, fp.map_key, &entry_name);
+                handler.Key(entry_name.data(), entry_name.size(), false);
 
-            // Fill in entries into this json object
-            if (!_PbFieldToJson(entry, value_desc, handler)) {
-                return false;
+                // Fill in entries into this json object
+                if (!_PbFieldToJson(entry, fp.map_value, handler)) {
+                    return false;
+                }
             }
+            // Hack: Pass 0 as parameter since Writer doesn't care this
+            handler.EndObject(0);
         }
-        // Hack: Pass 0 as parameter since Writer doesn't care this
-        handler.EndObject(0);
     }
     // Hack: Pass 0 as parameter since Writer doesn't care this
     handler.EndObject(0);
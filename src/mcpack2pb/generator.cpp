@@ -19,7 +19,9 @@
 
 // Date: Mon Oct 19 17:17:36 CST 2015
 
+#include <map>
 #include <set>
+#include <vector>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/io/printer.h>
 #include <google/protobuf/compiler/code_generator.h>
@@ -192,7 +194,8 @@ bool generate_declarations(const std::set<std::string>& ref_msgs,
             "    const ::google::protobuf::Message& msg,\n"
             "    ::mcpack2pb::Serializer& serializer,\n"
             "    ::mcpack2pb::SerializationFormat format);\n"
-            "extern ::mcpack2pb::FieldMap* g_$vmsg$_fields;\n"
+            "extern ::mcpack2pb::SetFieldFn find_$vmsg$_field(\n"
+            "    const ::butil::StringPiece& name);\n"
             , "vmsg", *it);
     }
     for (std::set<std::string>::const_iterator
@@ -225,10 +228,11 @@ bool generate_declarations(const std::set<std::string>& ref_msgs,
     "  $msg$* const msg = static_cast<$msg$*>(msg_base);\n"             \
     "  if (value.type() == ::mcpack2pb::FIELD_ISOARRAY) {\n"               \
     "    ::mcpack2pb::ISOArrayIterator it(value);\n"                       \
-    "    msg->mutable_$lcfield$()->Reserve(it.item_count());\n"         \
-    "    for (; it != NULL; ++it) {\n"                                  \
-    "      msg->add_$lcfield$(it.as_"#fntype "());\n"                   \
-    "    }\n"                                                           \
+    "    const int old_size = msg->$lcfield$_size();\n"                 \
+    "    msg->mutable_$lcfield$()->Resize(old_size + it.item_count(), 0);\n" \
+    "    const uint32_t n = it.cut_all(\n"                               \
+    "        msg->mutable_$lcfield$()->mutable_data() + old_size);\n"    \
+    "    msg->mutable_$lcfield$()->Truncate(old_size + n);\n"           \
     "    return value.stream()->good();\n"                              \
     "  } else if (value.type() == ::mcpack2pb::FIELD_ARRAY) {\n"           \
     "    ::mcpack2pb::ArrayIterator it(value);\n"                          \
@@ -265,6 +269,123 @@ static bool is_map_entry(const google::protobuf::Descriptor* d) {
     return true;
 }
 
+// Escape `str' to be a C string literal.
+static std::string to_c_literal(const std::string& str) {
+    std::string result = "\"";
+    for (size_t i = 0; i < str.size(); ++i) {
+        const unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            result.push_back('\\');
+            result.push_back(c);
+        } else if (isprint(c) && c != '?') {
+            result.push_back(c);
+        } else {
+            butil::string_appendf(&result, "\\%03o", (int)c);
+        }
+    }
+    result.push_back('"');
+    return result;
+}
+
+// Find the position where characters of `names' (of the same length) are
+// most different from each other.
+// Returns -1 when characters at all positions are the same.
+static int find_dispatching_position(const std::vector<std::string>& names) {
+    int best_pos = -1;
+    size_t best_count = 1;
+    const size_t len = names[0].size();
+    for (size_t pos = 0; pos < len && best_count < names.size(); ++pos) {
+        std::set<char> chars;
+        for (size_t i = 0; i < names.size(); ++i) {
+            chars.insert(names[i][pos]);
+        }
+        if (chars.size() > best_count) {
+            best_count = chars.size();
+            best_pos = (int)pos;
+        }
+    }
+    return best_pos;
+}
+
+// Print comparisons between `name' and `names' which are of the same length.
+static void print_name_comparisons(const std::vector<std::string>& names,
+                                   const std::map<std::string, std::string>& lcfields,
+                                   const std::string& var_name,
+                                   const std::string& indent,
+                                   google::protobuf::io::Printer& impl) {
+    for (size_t i = 0; i < names.size(); ++i) {
+        const std::string cond = (names[i].empty() ? std::string("true") :
+            butil::string_printf("memcmp(name.data(), %s, %lu) == 0",
+                                 to_c_literal(names[i]).c_str(),
+                                 (unsigned long)names[i].size()));
+        impl.Print("$indent$if ($cond$) {\n"
+                   "$indent$  return ::set_$vmsg$_$lcfield$;\n"
+                   "$indent$}\n"
+                   , "indent", indent
+                   , "cond", cond
+                   , "vmsg", var_name
+                   , "lcfield", lcfields.find(names[i])->second);
+    }
+    impl.Print("$indent$return NULL;\n", "indent", indent);
+}
+
+// Generate find_<vmsg>_field() mapping names of fields in mcpack to their
+// setting functions. Instead of hashing names into a hashmap, names are
+// switched by length and then by the character telling most names of the
+// same length apart, so that one memcmp is enough in most cases.
+static bool generate_field_dispatch(const google::protobuf::Descriptor* d,
+                                    const std::string& var_name,
+                                    google::protobuf::io::Printer& impl) {
+    // length -> (name -> lcfield). Latter fields with the same name
+    // override former ones.
+    std::map<size_t, std::map<std::string, std::string> > groups;
+    for (int i = 0; i < d->field_count(); ++i) {
+        const google::protobuf::FieldDescriptor* f = d->field(i);
+        const std::string& name = get_idl_name(f);
+        groups[name.size()][name] = f->lowercase_name();
+    }
+    impl.Print(
+        "::mcpack2pb::SetFieldFn find_$vmsg$_field(\n"
+        "    const ::butil::StringPiece& name) {\n"
+        "  switch (name.size()) {\n"
+        , "vmsg", var_name);
+    for (std::map<size_t, std::map<std::string, std::string> >::const_iterator
+             it = groups.begin(); it != groups.end(); ++it) {
+        const std::map<std::string, std::string>& lcfields = it->second;
+        std::vector<std::string> names;
+        for (std::map<std::string, std::string>::const_iterator
+                 it2 = lcfields.begin(); it2 != lcfields.end(); ++it2) {
+            names.push_back(it2->first);
+        }
+        impl.Print("  case $len$:\n"
+                   , "len", butil::string_printf("%lu", (unsigned long)it->first));
+        const int pos = find_dispatching_position(names);
+        if (pos < 0) {
+            print_name_comparisons(names, lcfields, var_name, "    ", impl);
+            continue;
+        }
+        // char -> names having the char at `pos'
+        std::map<unsigned char, std::vector<std::string> > buckets;
+        for (size_t i = 0; i < names.size(); ++i) {
+            buckets[(unsigned char)names[i][pos]].push_back(names[i]);
+        }
+        impl.Print("    switch ((unsigned char)name[$pos$]) {\n"
+                   , "pos", butil::string_printf("%d", pos));
+        for (std::map<unsigned char, std::vector<std::string> >::const_iterator
+                 it2 = buckets.begin(); it2 != buckets.end(); ++it2) {
+            impl.Print("    case $ch$:\n"
+                       , "ch", butil::string_printf("%d", (int)it2->first));
+            print_name_comparisons(it2->second, lcfields, var_name, "      ", impl);
+        }
+        impl.Print("    }\n"
+                   "    return NULL;\n");
+    }
+    impl.Print("  }\n"
+               "  return NULL;\n"
+               "}\n");
+    return !impl.failed();
+}
+
 static bool generate_parsing(const google::protobuf::Descriptor* d,
                              std::set<std::string> & ref_msgs,
                              std::set<std::string> & ref_maps,
@@ -417,7 +538,7 @@ static bool generate_parsing(const google::protobuf::Descriptor* d,
                     "  if (value.type() == ::mcpack2pb::FIELD_OBJECTISOARRAY) {\n"
                     "    ::mcpack2pb::ObjectIterator it(value);\n"
                     "    for (; it != NULL; ++it) {\n"
-                    "      ::mcpack2pb::SetFieldFn* fn = g_$vmsg2$_fields->seek(it->name);\n"
+                    "      ::mcpack2pb::SetFieldFn fn = find_$vmsg2$_field(it->name);\n"
                     "      if (!fn) {\n"
                     "        if (!FLAGS_mcpack2pb_absent_field_is_error) {\n"
                     "          continue;\n"
@@ -438,7 +559,7 @@ static bool generate_parsing(const google::protobuf::Descriptor* d,
                     "            sub_msg = msg->add_$lcfield$();\n"
                     "          }\n"
                     "          if (it2->type() != ::mcpack2pb::FIELD_NULL) {\n"
-                    "            if (!(*fn)(sub_msg, *it2)) {\n"
+                    "            if (!fn(sub_msg, *it2)) {\n"
                     "              LOG(ERROR) << \"Fail to set item of \" << it->name;\n"
                     "              return false;\n"
                     "            }\n"
@@ -587,13 +708,16 @@ static bool generate_parsing(const google::protobuf::Descriptor* d,
         } // else
     }
 
+    if (!generate_field_dispatch(d, var_name, impl)) {
+        return false;
+    }
     impl.Print(
         "bool parse_$vmsg$_body_internal(\n"
         "    ::google::protobuf::Message* msg,\n"
         "    ::mcpack2pb::UnparsedValue& value) {\n"
         "  ::mcpack2pb::ObjectIterator it(value);\n"
         "  for (; it != NULL; ++it) {\n"
-        "    ::mcpack2pb::SetFieldFn* fn = g_$vmsg$_fields->seek(it->name);\n"
+        "    ::mcpack2pb::SetFieldFn fn = find_$vmsg$_field(it->name);\n"
         "    if (!fn) {\n"
         "      if (!FLAGS_mcpack2pb_absent_field_is_error) {\n"
         "        continue;\n"
@@ -603,7 +727,7 @@ static bool generate_parsing(const google::protobuf::Descriptor* d,
         "        return false;\n"
         "      }\n"
         "    }\n"
-        "    if (!(*fn)(msg, it->value)) {\n"
+        "    if (!fn(msg, it->value)) {\n"
         "      return false;\n"
         "    }\n"
         "  }\n"
@@ -1313,18 +1437,6 @@ static bool generate_registration(
 
         impl.Print(
             "\n"
-            "g_$vmsg$_fields = new ::mcpack2pb::FieldMap;\n"
-            "CHECK_EQ(0, g_$vmsg$_fields->init(std::max($field_count$, 1), 30));\n"
-            , "vmsg", var_name
-            , "field_count", ::butil::string_printf("%d", d->field_count())); 
-        for (int i = 0; i < d->field_count(); ++i) {
-            const google::protobuf::FieldDescriptor* f = d->field(i);
-            impl.Print("(*g_$vmsg$_fields)[\"$field$\"] = ::set_$vmsg$_$lcfield$;\n"
-                       , "vmsg", var_name
-                       , "field", get_idl_name(f)
-                       , "lcfield", f->lowercase_name());
-        }
-        impl.Print(
             "::mcpack2pb::MessageHandler $vmsg$_handler = {\n"
             "  parse_$vmsg$,\n"
             "  parse_$vmsg$_body,\n"
@@ -1400,10 +1512,6 @@ bool McpackToProtobuf::Generate(const google::protobuf::FileDescriptor* file,
                 d->full_name().c_str());
             return false;
         }
-        std::string var_name = mcpack2pb::to_var_name(d->full_name());
-        gdecl_printer.Print(
-            "::mcpack2pb::FieldMap* g_$vmsg$_fields = NULL;\n"
-            , "vmsg", var_name);
     }
     if (!generate_declarations(ref_msgs, ref_maps, gdecl_printer)) {
         ::butil::string_printf(
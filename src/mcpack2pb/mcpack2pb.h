@@ -34,9 +34,6 @@ namespace mcpack2pb {
 typedef bool (*SetFieldFn)(::google::protobuf::Message* msg,
                            UnparsedValue& value);
 
-// Mapping from filed name to its parsing&setting function.
-typedef butil::FlatMap<butil::StringPiece, SetFieldFn> FieldMap;
-
 enum SerializationFormat {
     FORMAT_COMPACK,
     FORMAT_MCPACK_V2
@@ -251,6 +251,59 @@ inline T ISOArrayIterator::as_integer() const {
     return 0;
 }
 
+// Primitive type whose items in isomorphic arrays can be copied into T[]
+// directly. Both mcpack and hosts supported by brpc are little-endian.
+template <typename T> struct PrimitiveTypeOf {
+    static const PrimitiveFieldType value = PRIMITIVE_FIELD_UNKNOWN;
+};
+template <> struct PrimitiveTypeOf<int32_t> {
+    static const PrimitiveFieldType value = PRIMITIVE_FIELD_INT32;
+};
+template <> struct PrimitiveTypeOf<int64_t> {
+    static const PrimitiveFieldType value = PRIMITIVE_FIELD_INT64;
+};
+template <> struct PrimitiveTypeOf<uint32_t> {
+    static const PrimitiveFieldType value = PRIMITIVE_FIELD_UINT32;
+};
+template <> struct PrimitiveTypeOf<uint64_t> {
+    static const PrimitiveFieldType value = PRIMITIVE_FIELD_UINT64;
+};
+template <> struct PrimitiveTypeOf<float> {
+    static const PrimitiveFieldType value = PRIMITIVE_FIELD_FLOAT;
+};
+template <> struct PrimitiveTypeOf<double> {
+    static const PrimitiveFieldType value = PRIMITIVE_FIELD_DOUBLE;
+};
+
+template <typename T>
+inline uint32_t ISOArrayIterator::cut_all(T* out) {
+    uint32_t n = 0;
+    if (_item_type == PRIMITIVE_FIELD_UNKNOWN) {
+        return n;
+    }
+    if (_item_type != PrimitiveTypeOf<T>::value) {
+        for (; _item_type != PRIMITIVE_FIELD_UNKNOWN; operator++()) {
+            out[n++] = (std::numeric_limits<T>::is_integer ?
+                        as_integer<T>() : as_fp<T>());
+        }
+        return n;
+    }
+    n = _buf_count - _buf_index;
+    memcpy(out, _item_buf + _buf_index * _item_size, n * sizeof(T));
+    if (_left_item_count) {
+        const size_t left_size = _left_item_count * sizeof(T);
+        if (_stream->cutn(out + n, left_size) != left_size) {
+            CHECK(false) << "Not enough data";
+            set_bad();
+            return n;
+        }
+        n += _left_item_count;
+        _left_item_count = 0;
+    }
+    set_end();
+    return n;
+}
+
 template <typename T>
 inline T ISOArrayIterator::as_fp() const {
     const void* ptr = (_item_buf + _buf_index * _item_size);
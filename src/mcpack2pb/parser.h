@@ -243,6 +243,13 @@ public:
     float as_float() const { return as_fp<float>(); }
     double as_double() const { return as_fp<double>(); }
 
+    // Store the current item and all items after it into `out' and end the
+    // iteration. `out' should be able to hold item_count() items. Items are
+    // copied in batch when their type is exactly T, otherwise converted one
+    // by one like as_integer<T>() or as_fp<T>().
+    // Returns number of items stored.
+    template <typename T> uint32_t cut_all(T* out);
+
     PrimitiveFieldType item_type() const { return _item_type; }
 
     // Number of items in the array.
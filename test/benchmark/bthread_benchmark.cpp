@@ -0,0 +1,202 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdint.h>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "butil/atomicops.h"
+#include "bthread/bthread.h"
+#include "bthread/butex.h"
+#include "bthread/execution_queue.h"
+#include "bthread/id.h"
+
+namespace {
+
+void* do_nothing(void*) {
+    return NULL;
+}
+
+void BM_BthreadCreateJoin(benchmark::State& state) {
+    for (auto _ : state) {
+        bthread_t th;
+        if (bthread_start_background(&th, NULL, do_nothing, NULL) != 0) {
+            state.SkipWithError("Fail to create bthread");
+            break;
+        }
+        bthread_join(th, NULL);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BthreadCreateJoin)->UseRealTime()->ThreadRange(1, 8);
+
+void BM_BthreadCreateUrgentJoin(benchmark::State& state) {
+    for (auto _ : state) {
+        bthread_t th;
+        if (bthread_start_urgent(&th, NULL, do_nothing, NULL) != 0) {
+            state.SkipWithError("Fail to create bthread");
+            break;
+        }
+        bthread_join(th, NULL);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BthreadCreateUrgentJoin)->UseRealTime();
+
+struct YieldArgs {
+    int64_t times;
+};
+
+void* yield_loop(void* arg) {
+    const int64_t times = static_cast<YieldArgs*>(arg)->times;
+    for (int64_t i = 0; i < times; ++i) {
+        bthread_yield();
+    }
+    return NULL;
+}
+
+// Switches between `range(0)' bthreads that yield to each other.
+void BM_BthreadYield(benchmark::State& state) {
+    const int nthread = state.range(0);
+    YieldArgs args = { 1000 };
+    std::vector<bthread_t> th(nthread);
+    for (auto _ : state) {
+        for (int i = 0; i < nthread; ++i) {
+            bthread_start_background(&th[i], NULL, yield_loop, &args);
+        }
+        for (int i = 0; i < nthread; ++i) {
+            bthread_join(th[i], NULL);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * nthread * args.times);
+}
+BENCHMARK(BM_BthreadYield)->UseRealTime()->Arg(1)->Arg(4)->Arg(16);
+
+struct PingPong {
+    butil::atomic<int>* ping;
+    butil::atomic<int>* pong;
+    int64_t rounds;
+};
+
+// Wait for `ping' to become odd, then flip `pong', repeat.
+void* pong_thread(void* arg) {
+    PingPong* pp = static_cast<PingPong*>(arg);
+    for (int64_t i = 0; i < pp->rounds; ++i) {
+        const int expected = 2 * i;
+        while (pp->ping->load(butil::memory_order_acquire) == expected) {
+            bthread::butex_wait(pp->ping, expected, NULL);
+        }
+        pp->pong->fetch_add(1, butil::memory_order_release);
+        bthread::butex_wake(pp->pong);
+        while (pp->ping->load(butil::memory_order_acquire) == expected + 1) {
+            bthread::butex_wait(pp->ping, expected + 1, NULL);
+        }
+        pp->pong->fetch_add(1, butil::memory_order_release);
+        bthread::butex_wake(pp->pong);
+    }
+    return NULL;
+}
+
+void BM_ButexPingPong(benchmark::State& state) {
+    butil::atomic<int>* ping = bthread::butex_create_checked<butil::atomic<int> >();
+    butil::atomic<int>* pong = bthread::butex_create_checked<butil::atomic<int> >();
+    const int64_t rounds = 1000;
+    for (auto _ : state) {
+        ping->store(0, butil::memory_order_relaxed);
+        pong->store(0, butil::memory_order_relaxed);
+        PingPong pp = { ping, pong, rounds };
+        bthread_t th;
+        bthread_start_background(&th, NULL, pong_thread, &pp);
+        for (int i = 0; i < rounds * 2; ++i) {
+            ping->fetch_add(1, butil::memory_order_release);
+            bthread::butex_wake(ping);
+            while (pong->load(butil::memory_order_acquire) == i) {
+                bthread::butex_wait(pong, i, NULL);
+            }
+        }
+        bthread_join(th, NULL);
+    }
+    state.SetItemsProcessed(state.iterations() * rounds * 2);
+    bthread::butex_destroy(ping);
+    bthread::butex_destroy(pong);
+}
+BENCHMARK(BM_ButexPingPong)->UseRealTime();
+
+int consume_tasks(void* meta, bthread::TaskIterator<int64_t>& iter) {
+    int64_t* sum = static_cast<int64_t*>(meta);
+    for (; iter; ++iter) {
+        *sum += *iter;
+    }
+    return 0;
+}
+
+void BM_ExecutionQueueExecute(benchmark::State& state) {
+    static bthread::ExecutionQueueId<int64_t> queue_id = { 0 };
+    static int64_t sum = 0;
+    if (state.thread_index() == 0) {
+        sum = 0;
+        if (bthread::execution_queue_start(&queue_id, NULL, consume_tasks,
+                                           &sum) != 0) {
+            state.SkipWithError("Fail to start execution queue");
+        }
+    }
+    for (auto _ : state) {
+        bthread::execution_queue_execute(queue_id, (int64_t)1);
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        bthread::execution_queue_stop(queue_id);
+        bthread::execution_queue_join(queue_id);
+    }
+}
+BENCHMARK(BM_ExecutionQueueExecute)->UseRealTime()->ThreadRange(1, 8);
+
+// Every RPC creates a bthread_id as correlation id and locks it at least
+// once when the response arrives, measure the uncontended cost.
+void BM_BthreadIdLockUnlock(benchmark::State& state) {
+    bthread_id_t id;
+    if (bthread_id_create(&id, NULL, NULL) != 0) {
+        state.SkipWithError("Fail to create bthread_id");
+        return;
+    }
+    for (auto _ : state) {
+        bthread_id_lock(id, NULL);
+        bthread_id_unlock(id);
+    }
+    state.SetItemsProcessed(state.iterations());
+    bthread_id_lock(id, NULL);
+    bthread_id_unlock_and_destroy(id);
+}
+BENCHMARK(BM_BthreadIdLockUnlock);
+
+// Life cycle of a correlation id in a call without retries.
+void BM_BthreadIdLifeCycle(benchmark::State& state) {
+    for (auto _ : state) {
+        bthread_id_t id;
+        if (bthread_id_create_ranged(&id, NULL, NULL, 2) != 0) {
+            state.SkipWithError("Fail to create bthread_id");
+            break;
+        }
+        bthread_id_lock(id, NULL);
+        bthread_id_unlock(id);
+        bthread_id_lock(id, NULL);
+        bthread_id_unlock_and_destroy(id);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BthreadIdLifeCycle)->ThreadRange(1, 8);
+
+}  // namespace
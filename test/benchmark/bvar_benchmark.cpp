@@ -0,0 +1,77 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdint.h>
+#include <benchmark/benchmark.h>
+#include "bvar/bvar.h"
+
+namespace {
+
+// Writes of bvar are thread-local and should scale linearly with threads,
+// regressions here usually mean false sharing or contended combiners.
+void BM_AdderScaling(benchmark::State& state) {
+    static bvar::Adder<int64_t>* adder = NULL;
+    if (state.thread_index() == 0) {
+        adder = new bvar::Adder<int64_t>;
+    }
+    for (auto _ : state) {
+        *adder << 1;
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        benchmark::DoNotOptimize(adder->get_value());
+        delete adder;
+        adder = NULL;
+    }
+}
+BENCHMARK(BM_AdderScaling)->ThreadRange(1, 32);
+
+void BM_MaxerScaling(benchmark::State& state) {
+    static bvar::Maxer<int64_t>* maxer = NULL;
+    if (state.thread_index() == 0) {
+        maxer = new bvar::Maxer<int64_t>;
+    }
+    int64_t v = 0;
+    for (auto _ : state) {
+        *maxer << ++v;
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        delete maxer;
+        maxer = NULL;
+    }
+}
+BENCHMARK(BM_MaxerScaling)->ThreadRange(1, 32);
+
+void BM_LatencyRecorderScaling(benchmark::State& state) {
+    static bvar::LatencyRecorder* recorder = NULL;
+    if (state.thread_index() == 0) {
+        recorder = new bvar::LatencyRecorder;
+    }
+    int64_t latency = state.thread_index();
+    for (auto _ : state) {
+        *recorder << (latency++ & 1023);
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        delete recorder;
+        recorder = NULL;
+    }
+}
+BENCHMARK(BM_LatencyRecorderScaling)->ThreadRange(1, 32);
+
+}  // namespace
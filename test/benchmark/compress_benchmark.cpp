@@ -0,0 +1,115 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdlib.h>
+#include <string>
+#include <benchmark/benchmark.h>
+#include "butil/iobuf.h"
+#include "brpc/policy/snappy_compress.h"
+#include "brpc/policy/gzip_compress.h"
+#ifdef BRPC_WITH_LZ4
+#include "brpc/policy/lz4_compress.h"
+#endif
+#ifdef BRPC_WITH_ZSTD
+#include "brpc/policy/zstd_compress.h"
+#endif
+
+namespace {
+
+// Text-like data which compresses to roughly 1/3, close to typical
+// json/protobuf payloads.
+void MakeInput(size_t size, butil::IOBuf* out) {
+    static const char* const words[] = {
+        "request", "response", "user_id", "timestamp", "status",
+        "brpc", "channel", "server", "\"value\":", "12345", ", ", "\n"
+    };
+    const size_t nword = sizeof(words) / sizeof(words[0]);
+    std::string s;
+    s.reserve(size + 16);
+    unsigned int seed = 1;
+    while (s.size() < size) {
+        s.append(words[rand_r(&seed) % nword]);
+    }
+    s.resize(size);
+    out->append(s);
+}
+
+bool GzipCompressIOBuf(const butil::IOBuf& in, butil::IOBuf* out) {
+    return brpc::policy::GzipCompress(in, out, NULL);
+}
+
+#ifdef BRPC_WITH_ZSTD
+bool ZstdCompressIOBuf(const butil::IOBuf& in, butil::IOBuf* out) {
+    return brpc::policy::ZstdCompress(in, out, 1);
+}
+#endif
+
+typedef bool (*CodecFn)(const butil::IOBuf& in, butil::IOBuf* out);
+
+void BM_Compress(benchmark::State& state, CodecFn compress) {
+    butil::IOBuf in;
+    MakeInput(state.range(0), &in);
+    size_t compressed_size = 0;
+    for (auto _ : state) {
+        butil::IOBuf out;
+        if (!compress(in, &out)) {
+            state.SkipWithError("Fail to compress");
+            break;
+        }
+        compressed_size = out.size();
+    }
+    state.SetBytesProcessed(state.iterations() * in.size());
+    state.counters["ratio"] = in.empty() ? 0 : (double)compressed_size / in.size();
+}
+
+void BM_Decompress(benchmark::State& state, CodecFn compress,
+                   CodecFn decompress) {
+    butil::IOBuf in;
+    MakeInput(state.range(0), &in);
+    butil::IOBuf compressed;
+    if (!compress(in, &compressed)) {
+        state.SkipWithError("Fail to compress");
+        return;
+    }
+    for (auto _ : state) {
+        butil::IOBuf out;
+        if (!decompress(compressed, &out)) {
+            state.SkipWithError("Fail to decompress");
+            break;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * in.size());
+}
+
+#define BRPC_BENCHMARK_CODEC(name, compress, decompress)                \
+    BENCHMARK_CAPTURE(BM_Compress, name, compress)                      \
+        ->Range(1024, 1024 * 1024);                                     \
+    BENCHMARK_CAPTURE(BM_Decompress, name, compress, decompress)        \
+        ->Range(1024, 1024 * 1024)
+
+BRPC_BENCHMARK_CODEC(snappy, brpc::policy::SnappyCompress,
+                     brpc::policy::SnappyDecompress);
+BRPC_BENCHMARK_CODEC(gzip, GzipCompressIOBuf, brpc::policy::GzipDecompress);
+#ifdef BRPC_WITH_LZ4
+BRPC_BENCHMARK_CODEC(lz4, brpc::policy::Lz4Compress,
+                     brpc::policy::Lz4Decompress);
+#endif
+#ifdef BRPC_WITH_ZSTD
+BRPC_BENCHMARK_CODEC(zstd, ZstdCompressIOBuf, brpc::policy::ZstdDecompress);
+#endif
+
+}  // namespace
@@ -0,0 +1,79 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdint.h>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "butil/containers/flat_map.h"
+#include "butil/resource_pool.h"
+
+namespace {
+
+void BM_FlatMapInsert(benchmark::State& state) {
+    const int64_t n = state.range(0);
+    for (auto _ : state) {
+        butil::FlatMap<uint64_t, uint64_t> m;
+        m.init(n * 2);
+        for (int64_t i = 0; i < n; ++i) {
+            m[i] = i;
+        }
+        benchmark::DoNotOptimize(m.size());
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_FlatMapInsert)->Range(64, 64 * 1024);
+
+void BM_FlatMapSeek(benchmark::State& state) {
+    const uint64_t n = state.range(0);
+    butil::FlatMap<uint64_t, uint64_t> m;
+    m.init(n * 2);
+    for (uint64_t i = 0; i < n; ++i) {
+        m[i * 7] = i;
+    }
+    uint64_t key = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(m.seek(key));
+        key += 7;
+        if (key >= n * 7 * 2) {  // half of the seeks miss
+            key = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FlatMapSeek)->Range(64, 1024 * 1024);
+
+struct PooledObject {
+    char data[64];
+};
+
+void BM_ResourcePoolGetReturn(benchmark::State& state) {
+    // Return in batches so that the thread-local free chunks are exercised
+    // as well as the fast path.
+    std::vector<butil::ResourceId<PooledObject> > ids(state.range(0));
+    for (auto _ : state) {
+        for (size_t i = 0; i < ids.size(); ++i) {
+            benchmark::DoNotOptimize(butil::get_resource(&ids[i]));
+        }
+        for (size_t i = 0; i < ids.size(); ++i) {
+            butil::return_resource(ids[i]);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * ids.size());
+}
+BENCHMARK(BM_ResourcePoolGetReturn)->Range(1, 4096)->ThreadRange(1, 8);
+
+}  // namespace
@@ -0,0 +1,99 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <benchmark/benchmark.h>
+#include "butil/iobuf.h"
+
+namespace {
+
+void BM_IOBufAppend(benchmark::State& state) {
+    const std::string data(state.range(0), 'a');
+    butil::IOBuf buf;
+    for (auto _ : state) {
+        buf.append(data);
+        if (buf.size() >= 1024 * 1024) {
+            buf.clear();
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_IOBufAppend)->Range(16, 64 * 1024);
+
+void BM_IOBufAppendIOBuf(benchmark::State& state) {
+    butil::IOBuf src;
+    src.append(std::string(state.range(0), 'a'));
+    butil::IOBuf buf;
+    for (auto _ : state) {
+        buf.append(src);
+        if (buf.backing_block_num() >= 1024) {
+            buf.clear();
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * src.size());
+}
+BENCHMARK(BM_IOBufAppendIOBuf)->Range(16, 64 * 1024);
+
+void BM_IOBufCutn(benchmark::State& state) {
+    const size_t n = state.range(0);
+    const std::string data(1024 * 1024, 'a');
+    butil::IOBuf src;
+    butil::IOBuf piece;
+    for (auto _ : state) {
+        if (src.size() < n) {
+            state.PauseTiming();
+            src.append(data);
+            state.ResumeTiming();
+        }
+        src.cutn(&piece, n);
+        piece.clear();
+    }
+    state.SetBytesProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_IOBufCutn)->Range(16, 64 * 1024);
+
+void BM_IOBufCutIntoFd(benchmark::State& state) {
+    const int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0) {
+        state.SkipWithError("Fail to open /dev/null");
+        return;
+    }
+    // Many small blocks to exercise the iovec building of writev.
+    butil::IOBuf piece;
+    piece.append(std::string(state.range(0), 'a'));
+    butil::IOBuf buf;
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (int i = 0; i < 64; ++i) {
+            buf.append(piece);
+        }
+        state.ResumeTiming();
+        while (!buf.empty()) {
+            if (buf.cut_into_file_descriptor(fd) < 0) {
+                state.SkipWithError("Fail to writev");
+                break;
+            }
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * 64 * piece.size());
+    close(fd);
+}
+BENCHMARK(BM_IOBufCutIntoFd)->Range(64, 64 * 1024);
+
+}  // namespace
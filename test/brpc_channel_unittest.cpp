@@ -36,23 +36,29 @@
 #include "brpc/policy/most_common_message.h"
 #include "brpc/channel.h"
 #include "brpc/details/load_balancer_with_naming.h"
+#include "brpc/details/adaptive_backup_request.h"
+#include "brpc/details/retry_budget.h"
+#include "brpc/details/client_concurrency_limiter.h"
 #include "brpc/parallel_channel.h"
 #include "brpc/selective_channel.h"
 #include "brpc/socket_map.h"
 #include "brpc/controller.h"
+#include "brpc/global.h"
 #include "echo.pb.h"
 #include "brpc/options.pb.h"
 
 namespace brpc {
 DECLARE_int32(idle_timeout_second);
 DECLARE_int32(max_connection_pool_size);
+DECLARE_double(backup_request_max_ratio);
 class Server;
 class MethodStatus;
 namespace policy {
 void SendRpcResponse(int64_t correlation_id, Controller* cntl, 
                      const google::protobuf::Message* req,
                      const google::protobuf::Message* res,
-                     const Server* server_raw, MethodStatus *, int64_t);
+                     const Server* server_raw, MethodStatus *, int64_t,
+                     uint32_t);
 } // policy
 } // brpc
 
@@ -131,6 +137,9 @@ static bool VerifyMyRequest(const brpc::InputMessageBase* msg_base) {
     return true;
 }
 
+// Number of calls to MyEchoService::Echo
+butil::atomic<int> g_echo_count(0);
+
 class MyEchoService : public ::test::EchoService {
     void Echo(google::protobuf::RpcController* cntl_base,
               const ::test::EchoRequest* req,
@@ -139,6 +148,7 @@ class MyEchoService : public ::test::EchoService {
         brpc::Controller* cntl =
             static_cast<brpc::Controller*>(cntl_base);
         brpc::ClosureGuard done_guard(done);
+        g_echo_count.fetch_add(1);
         if (req->server_fail()) {
             cntl->SetFailed(req->server_fail(), "Server fail1");
             cntl->SetFailed(req->server_fail(), "Server fail2");
@@ -247,10 +257,10 @@ protected:
             const google::protobuf::Message*,
             const google::protobuf::Message*,
             const brpc::Server*,
-            brpc::MethodStatus*, int64_t>(
+            brpc::MethodStatus*, int64_t, uint32_t>(
                 &brpc::policy::SendRpcResponse,
                 meta.correlation_id(), cntl, NULL, res,
-                &ts->_dummy, NULL, -1);
+                &ts->_dummy, NULL, -1, 0);
         ts->_svc.CallMethod(method, cntl, req, res, done);
     }
 
@@ -1275,6 +1285,50 @@ protected:
         StopAndJoin();
     }
 
+    void TestSuccessLimitParallel(
+        bool single_server, bool async, bool short_connection) {
+        std::cout << " *** single=" << single_server
+                  << " async=" << async
+                  << " short=" << short_connection << std::endl;
+        ASSERT_EQ(0, StartAccept(_ep));
+        
+        const size_t NCHANS = 8;
+        brpc::Channel subchans[NCHANS];
+        brpc::ParallelChannel channel;
+        brpc::ParallelChannelOptions opt;
+        opt.success_limit = NCHANS / 2;
+        // Canceled sub calls do not fail the RPC.
+        opt.fail_limit = 1;
+        ASSERT_EQ(0, channel.Init(&opt));
+        for (size_t i = 0; i < NCHANS; ++i) {
+            SetUpChannel(&subchans[i], single_server, short_connection);
+            ASSERT_EQ(0, channel.AddChannel(
+                          &subchans[i], brpc::DOESNT_OWN_CHANNEL,
+                          ((i % 2) ? new MakeTheRequestTimeout : NULL), NULL));
+        }
+                
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(__FUNCTION__);
+        butil::Timer tm;
+        tm.start();
+        CallMethod(&channel, &cntl, &req, &res, async);
+        tm.stop();
+        EXPECT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+        EXPECT_EQ(NCHANS, (size_t)cntl.sub_count());
+        for (int i = 0; i < cntl.sub_count(); ++i) {
+            if (i % 2) {
+                EXPECT_EQ(ECANCELED, cntl.sub(i)->ErrorCode());
+            } else {
+                EXPECT_EQ(0, cntl.sub(i)->ErrorCode());
+            }
+        }
+        // Slow sub calls are not waited.
+        EXPECT_LT(tm.m_elapsed(), 50);
+        StopAndJoin();
+    }
+
     void TestRPCTimeoutSelective(
         bool single_server, bool async, bool short_connection) {
         std::cout << " *** single=" << single_server
@@ -1991,6 +2045,77 @@ TEST_F(ChannelTest, empty_selective_channel) {
     EXPECT_EQ(ENODATA, cntl.ErrorCode()) << cntl.ErrorText();
 }
 
+struct DelayedDone {
+    int64_t delay_us;
+    google::protobuf::Closure* done;
+};
+
+static void* RunDelayedDone(void* arg) {
+    DelayedDone* d = static_cast<DelayedDone*>(arg);
+    bthread_usleep(d->delay_us);
+    d->done->Run();
+    delete d;
+    return NULL;
+}
+
+// A sub channel replying after `delay_us' without servers.
+class DelayedEchoChannel : public brpc::ChannelBase {
+public:
+    explicit DelayedEchoChannel(int64_t delay_us)
+        : ncall(0), _delay_us(delay_us) {}
+
+    void CallMethod(const google::protobuf::MethodDescriptor*,
+                    google::protobuf::RpcController*,
+                    const google::protobuf::Message*,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done) override {
+        ncall.fetch_add(1, butil::memory_order_relaxed);
+        static_cast<test::EchoResponse*>(response)->set_message("received");
+        // Run `done' in another bthread because schan locks the call
+        // while calling sub channels.
+        DelayedDone* d = new DelayedDone;
+        d->delay_us = _delay_us;
+        d->done = done;
+        bthread_t th;
+        CHECK_EQ(0, bthread_start_background(&th, NULL, RunDelayedDone, d));
+    }
+
+    int CheckHealth() override { return 0; }
+
+    butil::atomic<int> ncall;
+
+private:
+    int64_t _delay_us;
+};
+
+TEST_F(ChannelTest, latency_aware_selective_channel) {
+    const char* const lb_names[] = { "la", "p2c" };
+    for (size_t i = 0; i < arraysize(lb_names); ++i) {
+        brpc::SelectiveChannel channel;
+        brpc::ChannelOptions options;
+        options.timeout_ms = 1000;
+        ASSERT_EQ(0, channel.Init(lb_names[i], &options));
+        // Owned by `channel'.
+        DelayedEchoChannel* fast = new DelayedEchoChannel(1000);
+        DelayedEchoChannel* slow = new DelayedEchoChannel(20000);
+        ASSERT_EQ(0, channel.AddChannel(fast, NULL));
+        ASSERT_EQ(0, channel.AddChannel(slow, NULL));
+        for (int j = 0; j < 300; ++j) {
+            brpc::Controller cntl;
+            test::EchoRequest req;
+            test::EchoResponse res;
+            req.set_message(__FUNCTION__);
+            CallMethod(&channel, &cntl, &req, &res, false);
+            ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        }
+        const int nfast = fast->ncall.load(butil::memory_order_relaxed);
+        const int nslow = slow->ncall.load(butil::memory_order_relaxed);
+        LOG(INFO) << lb_names[i] << ": fast=" << nfast << " slow=" << nslow;
+        // Sub channels are selected by their latencies.
+        ASSERT_GT(nfast, nslow * 2);
+    }
+}
+
 class BadCall : public brpc::CallMapper {
     brpc::SubCall Map(int,
                      const google::protobuf::MethodDescriptor*,
@@ -2270,6 +2395,16 @@ TEST_F(ChannelTest, timeout_still_checks_sub_channels_parallel) {
     }
 }
 
+TEST_F(ChannelTest, success_limit_parallel) {
+    for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
+        for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
+            for (int k = 0; k <=1; ++k) { // Flag ShortConnection
+                TestSuccessLimitParallel(i, j, k);
+            }
+        }
+    }
+}
+
 TEST_F(ChannelTest, timeout_selective) {
     for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
         for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
@@ -2493,6 +2628,226 @@ TEST_F(ChannelTest, destroy_channel_selective) {
     }
 }
 
+TEST_F(ChannelTest, coalesce_identical_calls) {
+    ASSERT_EQ(0, StartAccept(_ep));
+    brpc::ChannelOptions opt;
+    opt.max_retry = 0;
+    opt.coalesce_identical_calls = true;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(_ep, &opt));
+
+    const int N = 10;
+    brpc::Controller cntl[N + 1];
+    test::EchoRequest req[N + 1];
+    test::EchoResponse res[N + 1];
+    const int count_before = g_echo_count.load();
+    for (int i = 0; i <= N; ++i) {
+        // The last request is different from others.
+        req[i].set_message(i == N ? "different" : "same");
+        req[i].set_sleep_us(50000);
+        ::test::EchoService::Stub(&channel).Echo(
+            &cntl[i], &req[i], &res[i], brpc::DoNothing());
+    }
+    for (int i = 0; i <= N; ++i) {
+        brpc::Join(cntl[i].call_id());
+        ASSERT_FALSE(cntl[i].Failed()) << cntl[i].ErrorText();
+        ASSERT_EQ("received " + req[i].message(), res[i].message());
+    }
+    ASSERT_EQ(2, g_echo_count.load() - count_before);
+
+    // Calls after the leader ends are sent again.
+    brpc::Controller cntl2;
+    test::EchoResponse res2;
+    ::test::EchoService::Stub(&channel).Echo(&cntl2, &req[0], &res2, NULL);
+    ASSERT_FALSE(cntl2.Failed()) << cntl2.ErrorText();
+    ASSERT_EQ(3, g_echo_count.load() - count_before);
+
+    // Waiters end with the error of the leader.
+    test::EchoRequest fail_req;
+    fail_req.set_message("fail");
+    fail_req.set_sleep_us(50000);
+    fail_req.set_server_fail(brpc::EINTERNAL);
+    brpc::Controller fail_cntl[2];
+    test::EchoResponse fail_res[2];
+    for (int i = 0; i < 2; ++i) {
+        ::test::EchoService::Stub(&channel).Echo(
+            &fail_cntl[i], &fail_req, &fail_res[i], brpc::DoNothing());
+    }
+    for (int i = 0; i < 2; ++i) {
+        brpc::Join(fail_cntl[i].call_id());
+        ASSERT_EQ(brpc::EINTERNAL, fail_cntl[i].ErrorCode());
+    }
+    StopAndJoin();
+}
+
+TEST_F(ChannelTest, response_cache) {
+    ASSERT_EQ(0, StartAccept(_ep));
+    brpc::ChannelOptions opt;
+    opt.max_retry = 0;
+    brpc::ResponseCachePolicy& policy =
+        opt.mutable_response_cache_options()->method_policies[
+            test::EchoService::descriptor()->FindMethodByName("Echo")->full_name()];
+    policy.ttl_ms = 100;
+    policy.stale_while_revalidate_ms = 1000;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(_ep, &opt));
+
+    test::EchoRequest req;
+    req.set_message("cached");
+    const int count_before = g_echo_count.load();
+    for (int i = 0; i < 3; ++i) {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        ::test::EchoService::Stub(&channel).Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("received cached", res.message());
+    }
+    ASSERT_EQ(1, g_echo_count.load() - count_before);
+
+    // Asynchronous calls are ended with the cached response as well.
+    {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        ::test::EchoService::Stub(&channel).Echo(
+            &cntl, &req, &res, brpc::DoNothing());
+        brpc::Join(cntl.call_id());
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("received cached", res.message());
+        ASSERT_EQ(1, g_echo_count.load() - count_before);
+    }
+
+    // Forced to be sent.
+    {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        cntl.set_refresh_response_cache(true);
+        ::test::EchoService::Stub(&channel).Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(2, g_echo_count.load() - count_before);
+    }
+
+    // The stale response is returned and refreshed in background.
+    bthread_usleep(150000);
+    {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        ::test::EchoService::Stub(&channel).Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("received cached", res.message());
+    }
+    for (int i = 0; i < 100 && g_echo_count.load() - count_before < 3; ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_EQ(3, g_echo_count.load() - count_before);
+
+    // Failed calls are not cached.
+    test::EchoRequest fail_req;
+    fail_req.set_message("fail");
+    fail_req.set_server_fail(brpc::EINTERNAL);
+    for (int i = 0; i < 2; ++i) {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        ::test::EchoService::Stub(&channel).Echo(&cntl, &fail_req, &res, NULL);
+        ASSERT_EQ(brpc::EINTERNAL, cntl.ErrorCode());
+    }
+    ASSERT_EQ(5, g_echo_count.load() - count_before);
+    StopAndJoin();
+}
+
+TEST_F(ChannelTest, adaptive_backup_request) {
+    brpc::AdaptiveBackupRequest abr(90);
+    const google::protobuf::MethodDescriptor* method =
+        test::EchoService::descriptor()->FindMethodByName("Echo");
+    butil::intrusive_ptr<brpc::MethodLatency> latency =
+        abr.GetMethodLatency(method);
+    ASSERT_TRUE(latency != NULL);
+    ASSERT_EQ(latency.get(), abr.GetMethodLatency(method).get());
+    ASSERT_EQ(-1, latency->backup_request_ms());
+
+    for (int i = 0; i < 200; ++i) {
+        latency->Record(5000);
+    }
+    int64_t ms = -1;
+    // Percentiles are sampled every second.
+    for (int i = 0; i < 40 && ms < 0; ++i) {
+        bthread_usleep(100000);
+        ms = latency->backup_request_ms();
+    }
+    ASSERT_GE(ms, 5);
+    ASSERT_LE(ms, 6);
+
+    // Unlimited by default.
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_TRUE(brpc::ConsumeBackupRequestBudget());
+    }
+    // Backup requests in recent seconds exceed the budget.
+    bthread_usleep(1100000);
+    brpc::FLAGS_backup_request_max_ratio = 0.000001;
+    ASSERT_FALSE(brpc::ConsumeBackupRequestBudget());
+    brpc::FLAGS_backup_request_max_ratio = 0;
+}
+
+TEST_F(ChannelTest, retry_budget) {
+    butil::intrusive_ptr<brpc::RetryBudget> budget(
+        new brpc::RetryBudget(0.1, 0));
+    // The bucket is full initially.
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(budget->TryRetry());
+    }
+    ASSERT_FALSE(budget->TryRetry());
+    // 10 calls allow one retry.
+    for (int i = 0; i < 10; ++i) {
+        budget->OnCall();
+    }
+    ASSERT_TRUE(budget->TryRetry());
+    ASSERT_FALSE(budget->TryRetry());
+
+    // Refilled at the minimum rate without calls.
+    budget.reset(new brpc::RetryBudget(0.1, 100));
+    while (budget->TryRetry()) {}
+    bthread_usleep(100000);
+    ASSERT_TRUE(budget->TryRetry());
+}
+
+void* RespondLater(void* arg) {
+    bthread_usleep(50000);
+    static_cast<brpc::ClientConcurrencyLimiter*>(arg)->OnResponded(1, 0, 1000);
+    return NULL;
+}
+
+TEST_F(ChannelTest, client_concurrency_limiter) {
+    brpc::GlobalInitializeOrDie();
+    butil::intrusive_ptr<brpc::ClientConcurrencyLimiter> cl;
+    ASSERT_EQ(0, brpc::ClientConcurrencyLimiter::Create(
+                  brpc::AdaptiveMaxConcurrency(), 0, &cl));
+    ASSERT_TRUE(cl == NULL);
+    ASSERT_EQ(-1, brpc::ClientConcurrencyLimiter::Create(
+                  brpc::AdaptiveMaxConcurrency("blah"), 0, &cl));
+    ASSERT_EQ(0, brpc::ClientConcurrencyLimiter::Create(
+                  brpc::AdaptiveMaxConcurrency(2), 100, &cl));
+    ASSERT_TRUE(cl != NULL);
+    ASSERT_EQ(100, cl->wait_ms());
+
+    // Servers are limited separately.
+    ASSERT_TRUE(cl->OnRequested(1));
+    ASSERT_TRUE(cl->OnRequested(1));
+    ASSERT_FALSE(cl->OnRequested(1));
+    ASSERT_TRUE(cl->OnRequested(2));
+    ASSERT_EQ(2, cl->MaxConcurrencyOf(1));
+    ASSERT_EQ(0, cl->MaxConcurrencyOf(3));
+
+    int64_t nresponded = cl->nresponded();
+    ASSERT_FALSE(cl->WaitForResponded(
+                     nresponded, butil::gettimeofday_us() + 10000));
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, RespondLater, cl.get()));
+    ASSERT_TRUE(cl->WaitForResponded(
+                    nresponded, butil::gettimeofday_us() + 1000000));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_TRUE(cl->OnRequested(1));
+    ASSERT_FALSE(cl->OnRequested(1));
+}
+
 TEST_F(ChannelTest, sizeof) {
     LOG(INFO) << "Size of Channel is " << sizeof(brpc::Channel)
                << ", Size of ParallelChannel is " << sizeof(brpc::ParallelChannel)
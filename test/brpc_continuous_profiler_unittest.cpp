@@ -0,0 +1,98 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/build_config.h"
+#include "butil/time.h"
+#include "brpc/details/running_method.h"
+#include "brpc/details/continuous_profiler.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_bool(continuous_cpu_profiling);
+}
+
+namespace {
+
+// Keep the compiler from optimizing the loop away.
+volatile uint64_t g_sink = 0;
+
+void BurnCpu(int64_t duration_us) {
+    const int64_t end_us = butil::cpuwide_time_us() + duration_us;
+    while (butil::cpuwide_time_us() < end_us) {
+        for (int i = 0; i < 10000; ++i) {
+            g_sink = g_sink * 31 + i;
+        }
+    }
+}
+
+TEST(ContinuousProfilerTest, running_method) {
+    const google::protobuf::MethodDescriptor* md =
+        test::EchoService::descriptor()->FindMethodByName("Echo");
+    ASSERT_TRUE(md);
+    ASSERT_TRUE(brpc::TlsRunningMethod::get() == NULL);
+    {
+        brpc::ScopedRunningMethod guard(md);
+        ASSERT_EQ(md, brpc::TlsRunningMethod::get());
+        {
+            brpc::ScopedRunningMethod guard2(NULL);
+            ASSERT_TRUE(brpc::TlsRunningMethod::get() == NULL);
+        }
+        ASSERT_EQ(md, brpc::TlsRunningMethod::get());
+    }
+    ASSERT_TRUE(brpc::TlsRunningMethod::get() == NULL);
+}
+
+#if defined(OS_LINUX)
+TEST(ContinuousProfilerTest, samples_are_tagged_with_method) {
+    const google::protobuf::MethodDescriptor* md =
+        test::EchoService::descriptor()->FindMethodByName("Echo");
+    brpc::FLAGS_continuous_cpu_profiling = true;
+    brpc::EnableContinuousCpuProfiler();
+    ASSERT_TRUE(brpc::IsContinuousCpuProfilerRunning());
+    {
+        brpc::ScopedRunningMethod guard(md);
+        BurnCpu(1500000);
+    }
+    // Wait for the collecting thread.
+    usleep(500000);
+    std::vector<brpc::ProfiledStack> stacks;
+    int nminutes = 0;
+    brpc::GetContinuousCpuProfile(2, 0, &stacks, &nminutes);
+    ASSERT_GE(nminutes, 1);
+    int64_t nsamples = 0;
+    for (size_t i = 0; i < stacks.size(); ++i) {
+        if (stacks[i].method == md) {
+            ASSERT_FALSE(stacks[i].frames.empty());
+            nsamples += stacks[i].count;
+        }
+    }
+    // 19 samples per cpu second by default.
+    ASSERT_GT(nsamples, 5);
+
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "continuous_cpu_profiling", "false").empty());
+    ASSERT_FALSE(brpc::IsContinuousCpuProfilerRunning());
+    // Samples are still viewable after stopping.
+    brpc::GetContinuousCpuProfile(2, 0, &stacks, &nminutes);
+    ASSERT_FALSE(stacks.empty());
+}
+#endif // OS_LINUX
+
+} // namespace
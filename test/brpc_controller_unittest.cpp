@@ -19,15 +19,19 @@
 
 // Date: Sun Jul 13 15:04:18 CST 2014
 
+#include <vector>
 #include <gtest/gtest.h>
 #include <google/protobuf/stubs/common.h>
 #include "butil/logging.h"
 #include "butil/time.h"
 #include "butil/macros.h"
+#include "butil/arena.h"
 #include "brpc/socket.h"
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
+#include "brpc/pooled_call.h"
+#include "echo.pb.h"
 
 class ControllerTest : public ::testing::Test{
 protected:
@@ -136,3 +140,78 @@ TEST_F(ControllerTest, SessionKV) {
     logging::SetLogSink(oldSink);
 }
 #endif
+
+TEST_F(ControllerTest, reset_reuses_http_header) {
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/foo?a=b";
+    cntl.http_request().SetHeader("key", "value");
+    cntl.set_timeout_ms(123);
+    const brpc::HttpHeader* header = &cntl.http_request();
+    cntl.Reset();
+    ASSERT_FALSE(cntl.has_http_request());
+    ASSERT_NE(123, cntl.timeout_ms());
+    // The header is cached and handed out cleared.
+    ASSERT_EQ(header, &cntl.http_request());
+    ASSERT_TRUE(cntl.http_request().GetHeader("key") == NULL);
+    ASSERT_TRUE(cntl.http_request().uri().path().empty());
+}
+
+static void IncreaseCounter(void* arg) {
+    ++*static_cast<int*>(arg);
+}
+
+TEST_F(ControllerTest, scratch_arena) {
+    brpc::Controller cntl;
+    butil::Arena* arena = cntl.scratch_arena();
+    ASSERT_TRUE(arena != NULL);
+    ASSERT_EQ(arena, cntl.scratch_arena());
+    {
+        std::vector<int, butil::ArenaAllocator<int> > v(
+            (butil::ArenaAllocator<int>(arena)));
+        for (int i = 0; i < 1000; ++i) {
+            v.push_back(i);
+        }
+        ASSERT_EQ(999, v.back());
+    }
+    int ncleanup = 0;
+    ASSERT_EQ(0, arena->add_cleanup(IncreaseCounter, &ncleanup));
+    cntl.Reset();
+    // Cleanups run when the session ends.
+    ASSERT_EQ(1, ncleanup);
+    ASSERT_TRUE(cntl.scratch_arena() != NULL);
+}
+
+static void OnPooledCallDone(brpc::PooledCall<test::EchoResponse>* call,
+                             void* arg) {
+    ASSERT_EQ("hello", call->response()->message());
+    ASSERT_EQ(12345u, call->cntl()->log_id());
+    ++*static_cast<int*>(arg);
+}
+
+TEST_F(ControllerTest, pooled_call) {
+    int ncalled = 0;
+    brpc::PooledCall<test::EchoResponse>* call =
+        brpc::PooledCall<test::EchoResponse>::New(OnPooledCallDone, &ncalled);
+    ASSERT_TRUE(call != NULL);
+    call->cntl()->set_log_id(12345);
+    call->response()->set_message("hello");
+    call->Run();
+    ASSERT_EQ(1, ncalled);
+
+    // Reused from the thread-local free list with cleared states.
+    brpc::PooledCall<test::EchoResponse>* call2 =
+        brpc::PooledCall<test::EchoResponse>::New(OnPooledCallDone, &ncalled);
+    ASSERT_EQ(call, call2);
+    ASSERT_FALSE(call2->response()->has_message());
+    ASSERT_FALSE(call2->cntl()->has_log_id());
+    call2->Recycle();
+    ASSERT_EQ(1, ncalled);
+
+    brpc::Controller* cntl = brpc::GetPooledController();
+    cntl->set_log_id(1);
+    brpc::ReturnPooledController(cntl);
+    brpc::Controller* cntl2 = brpc::GetPooledController();
+    ASSERT_EQ(cntl, cntl2);
+    ASSERT_FALSE(cntl2->has_log_id());
+    brpc::ReturnPooledController(cntl2);
+}
@@ -0,0 +1,149 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include "brpc/coroutine.h"
+
+#ifdef BTHREAD_HAS_COROUTINE
+
+#include "butil/atomicops.h"
+#include "butil/time.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/server.h"
+#include "echo.pb.h"
+
+namespace {
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController*,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        if (request->sleep_us() > 0) {
+            bthread_usleep(request->sleep_us());
+        }
+        response->set_message(request->message());
+    }
+};
+
+class CoroutineTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ASSERT_EQ(0, _server.AddService(&_service,
+                                        brpc::SERVER_DOESNT_OWN_SERVICE));
+        ASSERT_EQ(0, _server.Start("127.0.0.1:0", NULL));
+        brpc::ChannelOptions options;
+        options.timeout_ms = 2000;
+        ASSERT_EQ(0, _channel.Init(butil::endpoint2str(
+            _server.listen_address()).c_str(), &options));
+    }
+    void TearDown() override {
+        _server.Stop(0);
+        _server.Join();
+    }
+
+    EchoServiceImpl _service;
+    brpc::Server _server;
+    brpc::Channel _channel;
+};
+
+bthread::Awaitable<std::string> echo(brpc::Channel* channel,
+                                     const std::string& message,
+                                     int sleep_us) {
+    test::EchoService_Stub stub(channel);
+    brpc::Controller cntl;
+    test::EchoRequest request;
+    test::EchoResponse response;
+    request.set_message(message);
+    request.set_sleep_us(sleep_us);
+    co_await brpc::co_call([&](google::protobuf::Closure* done) {
+        stub.Echo(&cntl, &request, &response, done);
+    });
+    EXPECT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    co_return response.message();
+}
+
+TEST_F(CoroutineTest, call_with_stub) {
+    ASSERT_EQ("hello", bthread::sync_wait(echo(&_channel, "hello", 0)));
+}
+
+bthread::Awaitable<bool> call_method(brpc::Channel* channel) {
+    brpc::Controller cntl;
+    test::EchoRequest request;
+    test::EchoResponse response;
+    request.set_message("world");
+    co_await brpc::co_call_method(
+        channel, test::EchoService::descriptor()->FindMethodByName("Echo"),
+        &cntl, &request, &response);
+    co_return !cntl.Failed() && response.message() == "world";
+}
+
+TEST_F(CoroutineTest, call_method) {
+    ASSERT_TRUE(bthread::sync_wait(call_method(&_channel)));
+}
+
+bthread::Awaitable<int> done_in_place() {
+    int n = 0;
+    co_await brpc::co_call([&](google::protobuf::Closure* done) {
+        ++n;
+        done->Run();
+    });
+    co_return n;
+}
+
+TEST_F(CoroutineTest, done_before_suspension) {
+    ASSERT_EQ(1, bthread::sync_wait(done_in_place()));
+}
+
+bthread::Awaitable<void> echo_and_signal(brpc::Channel* channel, int i,
+                                         butil::atomic<int>* nsucc,
+                                         bthread::CountdownEvent* event) {
+    const std::string message = std::to_string(i);
+    if (co_await echo(channel, message, 100000) == message) {
+        nsucc->fetch_add(1);
+    }
+    event->signal();
+}
+
+bthread::Awaitable<int> fan_out(brpc::Channel* channel, int n,
+                                butil::atomic<int>* nsucc) {
+    bthread::CountdownEvent event(n);
+    for (int i = 0; i < n; ++i) {
+        bthread::start_coroutine(echo_and_signal(channel, i, nsucc, &event));
+    }
+    co_return co_await bthread::co_wait(event);
+}
+
+TEST_F(CoroutineTest, fan_out) {
+    // All RPCs are in flight at the same time without blocking bthreads on
+    // the client side.
+    const int N = 100;
+    butil::atomic<int> nsucc(0);
+    butil::Timer tm;
+    tm.start();
+    ASSERT_EQ(0, bthread::sync_wait(fan_out(&_channel, N, &nsucc)));
+    tm.stop();
+    ASSERT_EQ(N, nsucc.load());
+    ASSERT_LT(tm.m_elapsed(), N * 100);
+}
+
+} // namespace
+
+#endif  // BTHREAD_HAS_COROUTINE
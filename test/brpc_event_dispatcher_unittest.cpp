@@ -27,8 +27,11 @@
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "butil/fd_utility.h"
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"
 #include "brpc/event_dispatcher.h"
 #include "brpc/details/has_epollrdhup.h"
+#include "brpc/details/io_uring_poller.h"
 
 class EventDispatcherTest : public ::testing::Test{
 protected:
@@ -52,6 +55,101 @@ TEST_F(EventDispatcherTest, versioned_ref) {
     ASSERT_EQ(brpc::MakeVRef(1, 1), versioned_ref);
 }
 
+#if defined(OS_LINUX)
+TEST_F(EventDispatcherTest, io_uring_poller) {
+    brpc::IoUringPoller poller;
+    if (poller.Init(64, false) != 0) {
+        PLOG(WARNING) << "io_uring is not supported, skip this test";
+        return;
+    }
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    brpc::IoUringPoller::Event e[8];
+    ASSERT_EQ(0, poller.AddPoll(fds[0], EPOLLIN, 42));
+    // Edge-triggered: every write generates an event.
+    for (int i = 0; i < 2; ++i) {
+        ASSERT_EQ(1, write(fds[1], "x", 1));
+        ASSERT_EQ(1, poller.Wait(e, ARRAY_SIZE(e)));
+        ASSERT_EQ(42u, e[0].data);
+        ASSERT_TRUE(e[0].events & EPOLLIN);
+        ASSERT_FALSE(e[0].stopped);
+    }
+    // Watching EPOLLOUT as well reports writable at once.
+    ASSERT_EQ(0, poller.UpdatePoll(42, EPOLLIN | EPOLLOUT));
+    int n = 0;
+    while ((n = poller.Wait(e, ARRAY_SIZE(e))) == 0) {}
+    ASSERT_EQ(1, n);
+    ASSERT_EQ(42u, e[0].data);
+    ASSERT_TRUE(e[0].events & EPOLLOUT);
+    // Removed polls do not generate events.
+    ASSERT_EQ(0, poller.RemovePoll(42));
+    ASSERT_EQ(0, poller.AddPoll(fds[1], EPOLLOUT, 43));
+    ASSERT_EQ(1, write(fds[1], "x", 1));
+    while ((n = poller.Wait(e, ARRAY_SIZE(e))) == 0) {}
+    ASSERT_EQ(1, n);
+    ASSERT_EQ(43u, e[0].data);
+    ASSERT_EQ(0, poller.RemovePoll(43));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_F(EventDispatcherTest, io_uring_rearm_after_cq_overflow) {
+    brpc::IoUringPoller poller;
+    // The CQ of one SQE has two entries only.
+    if (poller.Init(1, false) != 0) {
+        PLOG(WARNING) << "io_uring is not supported, skip this test";
+        return;
+    }
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    brpc::IoUringPoller::Event e[8];
+    ASSERT_EQ(0, poller.AddPoll(fds[0], EPOLLIN, 42));
+    // Watch EPOLLOUT as a socket with pending writes does, and consume the
+    // writable event.
+    ASSERT_EQ(0, poller.UpdatePoll(42, EPOLLIN | EPOLLOUT));
+    int n = 0;
+    while ((n = poller.Wait(e, ARRAY_SIZE(e))) == 0) {}
+    ASSERT_EQ(1, n);
+    ASSERT_TRUE(e[0].events & EPOLLOUT);
+    ASSERT_FALSE(e[0].stopped);
+
+    // Overflow the CQ without waiting, the kernel stops the multishot poll.
+    for (int i = 0; i < 8; ++i) {
+        ASSERT_EQ(1, write(fds[1], "x", 1));
+    }
+    bool stopped = false;
+    while (!stopped) {
+        n = poller.Wait(e, ARRAY_SIZE(e));
+        ASSERT_GE(n, 0);
+        for (int i = 0; i < n; ++i) {
+            ASSERT_EQ(42u, e[i].data);
+            stopped = e[i].stopped;
+        }
+    }
+
+    // Rearming watches EPOLLOUT as well, which is reported at once.
+    ASSERT_EQ(0, poller.RearmPoll(42));
+    while ((n = poller.Wait(e, ARRAY_SIZE(e))) == 0) {}
+    ASSERT_EQ(1, n);
+    ASSERT_EQ(42u, e[0].data);
+    ASSERT_TRUE(e[0].events & EPOLLOUT);
+    ASSERT_FALSE(e[0].stopped);
+    // Still multishot.
+    ASSERT_EQ(1, write(fds[1], "x", 1));
+    while ((n = poller.Wait(e, ARRAY_SIZE(e))) == 0) {}
+    ASSERT_EQ(1, n);
+    ASSERT_TRUE(e[0].events & EPOLLIN);
+
+    // Removed polls are not rearmed.
+    ASSERT_EQ(0, poller.RemovePoll(42));
+    errno = 0;
+    ASSERT_EQ(-1, poller.RearmPoll(42));
+    ASSERT_EQ(ENOENT, errno);
+    close(fds[0]);
+    close(fds[1]);
+}
+#endif
+
 std::vector<int> err_fd;
 pthread_mutex_t err_fd_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -267,3 +365,32 @@ TEST_F(EventDispatcherTest, dispatch_tasks) {
     ASSERT_EQ(NCLIENT, info.free_item_num - old_info.free_item_num);
 #endif
 }
+
+#if defined(OS_LINUX)
+static void* WaitReadable(void* arg) {
+    const int fd = *static_cast<int*>(arg);
+    const timespec abstime = butil::seconds_from_now(5);
+    return (void*)(intptr_t)bthread_fd_timedwait(fd, EPOLLIN, &abstime);
+}
+
+TEST_F(EventDispatcherTest, bthread_fd_wait_in_dispatcher) {
+    ASSERT_EQ(0, brpc::UseGlobalEventDispatchersForFdWait());
+    // Can be set only once.
+    ASSERT_EQ(-1, brpc::UseGlobalEventDispatchersForFdWait());
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    for (int i = 0; i < 3; ++i) {
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, NULL, WaitReadable, &fds[0]));
+        bthread_usleep(10000);
+        ASSERT_EQ(1, write(fds[1], "x", 1));
+        void* rc = NULL;
+        ASSERT_EQ(0, bthread_join(th, &rc));
+        ASSERT_EQ(0, (intptr_t)rc);
+        char c = 0;
+        ASSERT_EQ(1, read(fds[0], &c, 1));
+    }
+    ASSERT_EQ(0, bthread_close(fds[0]));
+    ASSERT_EQ(0, close(fds[1]));
+}
+#endif
@@ -22,6 +22,8 @@
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/grpc.h"
+#include "brpc/stream.h"
+#include "brpc/policy/grpc_compress.h"
 #include "butil/time.h"
 #include "grpc.pb.h"
 
@@ -32,6 +34,10 @@ int main(int argc, char* argv[]) {
         std::cerr << "Fail to set -crash_on_fatal_log" << std::endl;
         return -1;
     }
+    if (GFLAGS_NS::SetCommandLineOption("grpc_compress_min_bytes", "0").empty()) {
+        std::cerr << "Fail to set -grpc_compress_min_bytes" << std::endl;
+        return -1;
+    }
     if (GFLAGS_NS::SetCommandLineOption("crash_on_fatal_log", "true").empty()) {
         std::cerr << "Fail to set -crash_on_fatal_log" << std::endl;
         return -1;
@@ -47,8 +53,64 @@ const std::string g_req = "wyt";
 const int64_t g_timeout_ms = 1000;
 const std::string g_protocol = "h2:grpc";
 
+const int g_nstream_message = 3;
+
+// Collect messages of a stream, echo them back if `echo' is true.
+class StreamCollector : public brpc::StreamInputHandler {
+public:
+    explicit StreamCollector(bool echo = false)
+        : _echo(echo), _half_closed(false), _closed(false) {}
+
+    int on_received_messages(brpc::StreamId id,
+                             butil::IOBuf *const messages[],
+                             size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            if (_echo) {
+                butil::IOBuf out;
+                out.append(g_prefix);
+                out.append(*messages[i]);
+                EXPECT_EQ(0, brpc::StreamWrite(id, out));
+            }
+            std::unique_lock<butil::Mutex> mu(_mutex);
+            _messages.push_back(messages[i]->to_string());
+        }
+        return 0;
+    }
+    void on_idle_timeout(brpc::StreamId) {}
+    void on_remote_half_closed(brpc::StreamId id) {
+        _half_closed = true;
+        brpc::StreamClose(id);
+    }
+    void on_closed(brpc::StreamId) { _closed = true; }
+
+    std::vector<std::string> messages() {
+        std::unique_lock<butil::Mutex> mu(_mutex);
+        return _messages;
+    }
+    bool WaitForMessages(size_t n) {
+        for (int i = 0; i < 1000 && messages().size() < n; ++i) {
+            bthread_usleep(1000);
+        }
+        return messages().size() == n;
+    }
+    bool WaitForClosed() {
+        for (int i = 0; i < 1000 && !_closed; ++i) {
+            bthread_usleep(1000);
+        }
+        return _closed;
+    }
+
+    bool _echo;
+    butil::atomic<bool> _half_closed;
+    butil::atomic<bool> _closed;
+    butil::Mutex _mutex;
+    std::vector<std::string> _messages;
+};
+
 class MyGrpcService : public ::test::GrpcService {
 public:
+    MyGrpcService() : echo_handler(true) {}
+
     void Method(::google::protobuf::RpcController* cntl_base,
                 const ::test::GrpcRequest* req,
                 ::test::GrpcResponse* res,
@@ -86,6 +148,39 @@ public:
         res->set_message(g_prefix + req->message());
         return;
     }
+
+    void ServerStream(::google::protobuf::RpcController* cntl_base,
+                      const ::test::GrpcRequest* req,
+                      ::test::GrpcResponse*,
+                      ::google::protobuf::Closure* done) {
+        brpc::Controller* cntl =
+                static_cast<brpc::Controller*>(cntl_base);
+        brpc::ClosureGuard done_guard(done);
+        brpc::StreamId sid;
+        ASSERT_EQ(0, brpc::StreamAccept(&sid, *cntl, NULL));
+        // Written before the response headers, sent after them.
+        for (int i = 0; i < g_nstream_message; ++i) {
+            butil::IOBuf out;
+            out.append(g_prefix + req->message());
+            EXPECT_EQ(0, brpc::StreamWrite(sid, out));
+        }
+        brpc::StreamClose(sid);
+    }
+
+    void BidiStream(::google::protobuf::RpcController* cntl_base,
+                    const ::test::GrpcRequest*,
+                    ::test::GrpcResponse*,
+                    ::google::protobuf::Closure* done) {
+        brpc::Controller* cntl =
+                static_cast<brpc::Controller*>(cntl_base);
+        brpc::ClosureGuard done_guard(done);
+        brpc::StreamOptions opt;
+        opt.handler = &echo_handler;
+        brpc::StreamId sid;
+        ASSERT_EQ(0, brpc::StreamAccept(&sid, *cntl, &opt));
+    }
+
+    StreamCollector echo_handler;
 };
 
 class GrpcTest : public ::testing::Test {
@@ -161,6 +256,42 @@ TEST_F(GrpcTest, sanity) {
     }
 }
 
+TEST_F(GrpcTest, negotiate_encoding) {
+    EXPECT_EQ(0u, brpc::policy::GrpcAcceptEncoding().find("identity,gzip,snappy"));
+    brpc::CompressType type = brpc::COMPRESS_TYPE_NONE;
+    ASSERT_TRUE(brpc::policy::ParseGrpcEncoding("Snappy", &type));
+    EXPECT_EQ(brpc::COMPRESS_TYPE_SNAPPY, type);
+    ASSERT_TRUE(brpc::policy::ParseGrpcEncoding("identity", &type));
+    EXPECT_EQ(brpc::COMPRESS_TYPE_NONE, type);
+    EXPECT_FALSE(brpc::policy::ParseGrpcEncoding("deflate", &type));
+    EXPECT_TRUE(brpc::policy::GrpcEncodingOf(brpc::COMPRESS_TYPE_ZLIB) == NULL);
+
+    const std::string accept = "identity, snappy";
+    EXPECT_EQ(brpc::COMPRESS_TYPE_SNAPPY, brpc::policy::NegotiateGrpcEncoding(
+                  brpc::COMPRESS_TYPE_SNAPPY, &accept));
+    EXPECT_EQ(brpc::COMPRESS_TYPE_NONE, brpc::policy::NegotiateGrpcEncoding(
+                  brpc::COMPRESS_TYPE_GZIP, &accept));
+    // Peers without grpc-accept-encoding only get gzip.
+    EXPECT_EQ(brpc::COMPRESS_TYPE_GZIP, brpc::policy::NegotiateGrpcEncoding(
+                  brpc::COMPRESS_TYPE_GZIP, NULL));
+    EXPECT_EQ(brpc::COMPRESS_TYPE_NONE, brpc::policy::NegotiateGrpcEncoding(
+                  brpc::COMPRESS_TYPE_SNAPPY, NULL));
+}
+
+TEST_F(GrpcTest, snappy_request) {
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    brpc::Controller cntl;
+    cntl.set_request_compress_type(brpc::COMPRESS_TYPE_SNAPPY);
+    req.set_message(g_req);
+    req.set_gzip(false);
+    req.set_return_error(false);
+    test::GrpcService_Stub stub(&_channel);
+    stub.Method(&cntl, &req, &res, NULL);
+    EXPECT_FALSE(cntl.Failed()) << cntl.ErrorCode() << ": " << cntl.ErrorText();
+    EXPECT_EQ(g_prefix + g_req, res.message());
+}
+
 TEST_F(GrpcTest, return_error) {
     test::GrpcRequest req;
     test::GrpcResponse res;
@@ -208,6 +339,61 @@ TEST_F(GrpcTest, MethodNotExist) {
     ASSERT_TRUE(butil::StringPiece(cntl.ErrorText()).ends_with("Method MethodNotExist() not implemented."));
 }
 
+TEST_F(GrpcTest, server_streaming) {
+    StreamCollector collector;
+    brpc::StreamOptions opt;
+    opt.handler = &collector;
+    brpc::Controller cntl;
+    brpc::StreamId sid;
+    ASSERT_EQ(0, brpc::StreamCreate(&sid, cntl, &opt));
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    req.set_message(g_req);
+    req.set_gzip(false);
+    req.set_return_error(false);
+    test::GrpcService_Stub stub(&_channel);
+    stub.ServerStream(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_TRUE(collector.WaitForMessages(g_nstream_message));
+    for (int i = 0; i < g_nstream_message; ++i) {
+        EXPECT_EQ(g_prefix + g_req, collector.messages()[i]);
+    }
+    // Closed by trailers of the call.
+    ASSERT_TRUE(collector.WaitForClosed());
+}
+
+TEST_F(GrpcTest, bidi_streaming) {
+    StreamCollector collector;
+    brpc::StreamOptions opt;
+    opt.handler = &collector;
+    brpc::Controller cntl;
+    brpc::StreamId sid;
+    ASSERT_EQ(0, brpc::StreamCreate(&sid, cntl, &opt));
+    // The request is not sent, requests are written into the stream.
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    req.set_message(g_req);
+    req.set_gzip(false);
+    req.set_return_error(false);
+    test::GrpcService_Stub stub(&_channel);
+    stub.BidiStream(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    for (int i = 0; i < g_nstream_message; ++i) {
+        butil::IOBuf out;
+        out.append(g_req);
+        ASSERT_EQ(0, brpc::StreamWrite(sid, out));
+        ASSERT_TRUE(collector.WaitForMessages(i + 1));
+        EXPECT_EQ(g_prefix + g_req, collector.messages()[i]);
+    }
+    // Half-close the call, which makes the server end it.
+    brpc::StreamClose(sid);
+    for (int i = 0; i < 1000 && !_svc.echo_handler._closed; ++i) {
+        bthread_usleep(1000);
+    }
+    EXPECT_TRUE(_svc.echo_handler._half_closed);
+    EXPECT_TRUE(_svc.echo_handler._closed);
+}
+
 TEST_F(GrpcTest, GrpcTimeOut) {
     const char* timeouts[] = {
         // valid case
@@ -17,6 +17,7 @@
 
 #include <gtest/gtest.h>
 #include <iostream>
+#include <vector>
 
 #include "butil/time.h"
 #include "butil/logging.h"
@@ -169,3 +170,82 @@ TEST_F(HttpParserTest, append_filename) {
     brpc::AppendFileName(&dir, "..");
     ASSERT_EQ("/", dir);
 }
+
+struct CollectedHeaders {
+    std::string field;
+    std::string value;
+    std::vector<std::pair<std::string, std::string> > headers;
+    bool complete;
+};
+
+static int collect_header_field(http_parser* p, const char* at, const size_t length) {
+    CollectedHeaders* c = static_cast<CollectedHeaders*>(p->data);
+    if (!c->value.empty()) {
+        c->headers.push_back(std::make_pair(c->field, c->value));
+        c->field.clear();
+        c->value.clear();
+    }
+    c->field.append(at, length);
+    return 0;
+}
+
+static int collect_header_value(http_parser* p, const char* at, const size_t length) {
+    static_cast<CollectedHeaders*>(p->data)->value.append(at, length);
+    return 0;
+}
+
+static int collect_headers_complete(http_parser* p) {
+    CollectedHeaders* c = static_cast<CollectedHeaders*>(p->data);
+    c->headers.push_back(std::make_pair(c->field, c->value));
+    c->complete = true;
+    return 0;
+}
+
+TEST_F(HttpParserTest, parse_headers_in_pieces) {
+    const std::string long_value(100, 'v');
+    const std::string http_request =
+        "GET /path HTTP/1.1\r\n"
+        "X-A-Rather-Long-Header-Name-For-Scanning: " + long_value + "\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: 0\r\n"
+        "User-Agent: tabs\tand spaces  \r\n"
+        "X-Folded: first\r\n second\r\n"
+        "\r\n";
+    http_parser_settings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.on_header_field = collect_header_field;
+    settings.on_header_value = collect_header_value;
+    settings.on_headers_complete = collect_headers_complete;
+    // Split the request at every position to check that fast paths of
+    // header fields and values stop at the end of each piece correctly.
+    for (size_t i = 1; i < http_request.size(); ++i) {
+        CollectedHeaders c;
+        c.complete = false;
+        http_parser parser;
+        http_parser_init(&parser, brpc::HTTP_REQUEST);
+        parser.data = &c;
+        ASSERT_EQ(i, http_parser_execute(&parser, &settings, http_request.data(), i));
+        ASSERT_EQ(http_request.size() - i,
+                  http_parser_execute(&parser, &settings, http_request.data() + i,
+                                      http_request.size() - i));
+        ASSERT_TRUE(c.complete);
+        ASSERT_EQ(5u, c.headers.size());
+        ASSERT_EQ("X-A-Rather-Long-Header-Name-For-Scanning", c.headers[0].first);
+        ASSERT_EQ(long_value, c.headers[0].second);
+        ASSERT_EQ("Connection", c.headers[1].first);
+        ASSERT_EQ("keep-alive", c.headers[1].second);
+        ASSERT_EQ("tabs\tand spaces  ", c.headers[3].second);
+        ASSERT_EQ("X-Folded", c.headers[4].first);
+        ASSERT_TRUE(brpc::http_should_keep_alive(&parser));
+    }
+
+    // Invalid bytes in header fields are still rejected.
+    const std::string bad_request =
+        "GET /path HTTP/1.1\r\n"
+        "X-A-Rather-Long-Header-Name\x01: value\r\n"
+        "\r\n";
+    http_parser parser;
+    http_parser_init(&parser, brpc::HTTP_REQUEST);
+    http_parser_execute(&parser, &settings, bad_request.data(), bad_request.size());
+    ASSERT_EQ(brpc::HPE_INVALID_HEADER_TOKEN, (brpc::http_errno)parser.http_errno);
+}
@@ -38,6 +38,7 @@
 #include "echo.pb.h"
 #include "brpc/policy/http_rpc_protocol.h"
 #include "brpc/policy/http2_rpc_protocol.h"
+#include "brpc/policy/http_compress.h"
 #include "json2pb/pb_to_json.h"
 #include "json2pb/json_to_pb.h"
 #include "brpc/details/method_status.h"
@@ -329,7 +330,7 @@ TEST_F(HttpTest, reject_get_to_pb_services_with_required_fields) {
         _server.FindMethodPropertyByFullName("test.EchoService.Echo");
     ASSERT_TRUE(mp);
     ASSERT_TRUE(mp->status);
-    ASSERT_EQ(1ll, mp->status->_nerror_bvar.get_value());
+    ASSERT_EQ(1ll, mp->status->traffic_stats()->nerror.get_value());
     CheckResponseCode(false, brpc::HTTP_STATUS_BAD_REQUEST);
 }
 
@@ -983,6 +984,49 @@ TEST_F(HttpTest, broken_socket_stops_progressive_reading) {
     ASSERT_EQ(ECONNRESET, reader->destroying_status().error_code());
 }
 
+TEST_F(HttpTest, pipelined_requests_over_single_connection) {
+    const int port = 8923;
+    brpc::Server server;
+    EXPECT_EQ(0, server.AddService(&_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    EXPECT_EQ(0, server.Start(port, NULL));
+
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_HTTP;
+    options.connection_type = brpc::CONNECTION_TYPE_SINGLE;
+    {
+        brpc::Channel channel;
+        ASSERT_EQ(-1, channel.Init(butil::EndPoint(butil::my_ip(), port), &options));
+    }
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "http_client_pipelining", "true").empty());
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(butil::EndPoint(butil::my_ip(), port), &options));
+    test::EchoRequest req;
+    req.set_message(EXP_REQUEST);
+    butil::EndPoint local_side;
+    for (int i = 0; i < 10; ++i) {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        cntl.http_request().uri() = "/EchoService/Echo";
+        channel.CallMethod(NULL, &cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(EXP_RESPONSE, res.message());
+        // All requests are sent over the main socket.
+        if (i == 0) {
+            local_side = cntl.local_side();
+        } else {
+            ASSERT_EQ(local_side, cntl.local_side());
+        }
+    }
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/EchoService/Echo";
+    cntl.response_will_be_read_progressively();
+    channel.CallMethod(NULL, &cntl, &req, NULL, NULL);
+    ASSERT_EQ(brpc::EREQUEST, cntl.ErrorCode());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "http_client_pipelining", "false").empty());
+}
+
 TEST_F(HttpTest, http2_sanity) {
     const int port = 8923;
     brpc::Server server;
@@ -1480,4 +1524,55 @@ TEST_F(HttpTest, spring_protobuf_content_type) {
     ASSERT_EQ("application/x-protobuf", cntl.http_response().content_type());
 }
 
+TEST_F(HttpTest, negotiate_content_encoding) {
+    using namespace brpc::policy;
+    ASSERT_EQ(HTTP_CONTENT_ENCODING_IDENTITY, NegotiateHttpContentEncoding(NULL));
+    std::string ae = "deflate";
+    ASSERT_EQ(HTTP_CONTENT_ENCODING_IDENTITY, NegotiateHttpContentEncoding(&ae));
+    ae = "deflate, GZIP";
+    ASSERT_EQ(HTTP_CONTENT_ENCODING_GZIP, NegotiateHttpContentEncoding(&ae));
+    ae = "gzip;q=0";
+    ASSERT_EQ(HTTP_CONTENT_ENCODING_IDENTITY, NegotiateHttpContentEncoding(&ae));
+    ae = "*;q=0.5, gzip;q=0";
+    ASSERT_NE(HTTP_CONTENT_ENCODING_GZIP, NegotiateHttpContentEncoding(&ae));
+#ifdef BRPC_WITH_ZSTD
+    ae = "gzip, zstd";
+    ASSERT_EQ(HTTP_CONTENT_ENCODING_ZSTD, NegotiateHttpContentEncoding(&ae));
+    ae = "gzip, zstd;q=0.8";
+    ASSERT_EQ(HTTP_CONTENT_ENCODING_GZIP, NegotiateHttpContentEncoding(&ae));
+#endif
+    ASSERT_TRUE(GFLAGS_NS::SetCommandLineOption(
+                    "http_response_encodings", "snappy").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "http_response_encodings", "gzip").empty());
+    ae = "zstd, br, gzip;q=0.1";
+    ASSERT_EQ(HTTP_CONTENT_ENCODING_GZIP, NegotiateHttpContentEncoding(&ae));
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "http_response_encodings", "zstd,br,gzip").empty());
+}
+
+TEST_F(HttpTest, cache_compressed_body) {
+    using namespace brpc::policy;
+    butil::IOBuf body;
+    for (int i = 0; i < 1000; ++i) {
+        body.append("compressible http body ");
+    }
+    butil::IOBuf c1;
+    butil::IOBuf c2;
+    ASSERT_TRUE(HttpCompressCached(HTTP_CONTENT_ENCODING_GZIP, body, &c1));
+    ASSERT_TRUE(HttpCompressCached(HTTP_CONTENT_ENCODING_GZIP, body, &c2));
+    ASSERT_EQ(c1, c2);
+    ASSERT_LT(c1.size(), body.size());
+    butil::IOBuf uncompressed;
+    ASSERT_TRUE(HttpDecompress(HTTP_CONTENT_ENCODING_GZIP, c2, &uncompressed));
+    ASSERT_EQ(body, uncompressed);
+    // Cached by content, a different body must not hit.
+    body.append("!");
+    butil::IOBuf c3;
+    ASSERT_TRUE(HttpCompressCached(HTTP_CONTENT_ENCODING_GZIP, body, &c3));
+    uncompressed.clear();
+    ASSERT_TRUE(HttpDecompress(HTTP_CONTENT_ENCODING_GZIP, c3, &uncompressed));
+    ASSERT_EQ(body, uncompressed);
+}
+
 } //namespace
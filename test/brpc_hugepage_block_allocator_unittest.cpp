@@ -0,0 +1,109 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdlib.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/iobuf.h"
+#include "bvar/variable.h"
+#include "brpc/hugepage_block_allocator.h"
+
+namespace brpc {
+DECLARE_int32(iobuf_hugepage_max_arenas);
+}
+
+namespace {
+
+int64_t get_int64_var(const std::string& name) {
+    const std::string value = bvar::Variable::describe_exposed(name);
+    if (value.empty()) {
+        return -1;
+    }
+    return atoll(value.c_str());
+}
+
+const size_t ARENA_SIZE = 2 * 1024 * 1024;
+const int MAX_ARENAS = 4;
+
+TEST(HugepageBlockAllocatorTest, carve_blocks_from_arenas) {
+    brpc::FLAGS_iobuf_hugepage_max_arenas = MAX_ARENAS;
+    ASSERT_EQ(0, brpc::InitHugepageBlockAllocator());
+    ASSERT_EQ(-1, brpc::InitHugepageBlockAllocator());
+    ASSERT_TRUE(butil::iobuf::get_block_allocator().allocate ==
+                brpc::AllocHugepageBlock);
+    ASSERT_EQ(0, get_int64_var("iobuf_hugepage_arena_count"));
+
+    // One arena is filled with blocks of DEFAULT_BLOCK_SIZE.
+    const size_t nblock = ARENA_SIZE / butil::IOBuf::DEFAULT_BLOCK_SIZE;
+    std::vector<char*> blocks;
+    for (size_t i = 0; i < nblock; ++i) {
+        char* p = (char*)brpc::AllocHugepageBlock(
+                butil::IOBuf::DEFAULT_BLOCK_SIZE);
+        ASSERT_TRUE(p != NULL);
+        memset(p, 'x', butil::IOBuf::DEFAULT_BLOCK_SIZE);
+        blocks.push_back(p);
+    }
+    ASSERT_EQ(1, get_int64_var("iobuf_hugepage_arena_count"));
+    ASSERT_EQ((int64_t)ARENA_SIZE, get_int64_var("iobuf_hugepage_used_bytes"));
+    const char* arena_start = blocks[0];
+    ASSERT_EQ(0u, (uintptr_t)arena_start % ARENA_SIZE);
+    for (size_t i = 1; i < nblock; ++i) {
+        ASSERT_EQ(arena_start + i * butil::IOBuf::DEFAULT_BLOCK_SIZE, blocks[i]);
+    }
+
+    // Blocks of other classes come from other arenas until all arenas are
+    // created, after which blocks are allocated by malloc.
+    std::vector<char*> huge_blocks;
+    for (int i = 0; i < (MAX_ARENAS - 1) * 2; ++i) {
+        char* p = (char*)brpc::AllocHugepageBlock(butil::IOBuf::HUGE_BLOCK_SIZE);
+        ASSERT_TRUE(p != NULL);
+        ASSERT_GE(p, arena_start + ARENA_SIZE);
+        ASSERT_LT(p, arena_start + MAX_ARENAS * ARENA_SIZE);
+        huge_blocks.push_back(p);
+    }
+    ASSERT_EQ(MAX_ARENAS, get_int64_var("iobuf_hugepage_arena_count"));
+    char* p = (char*)brpc::AllocHugepageBlock(butil::IOBuf::HUGE_BLOCK_SIZE);
+    ASSERT_TRUE(p < arena_start || p >= arena_start + MAX_ARENAS * ARENA_SIZE);
+    brpc::DeallocHugepageBlock(p);
+    p = (char*)brpc::AllocHugepageBlock(100);
+    ASSERT_TRUE(p < arena_start || p >= arena_start + MAX_ARENAS * ARENA_SIZE);
+    brpc::DeallocHugepageBlock(p);
+
+    // Freed blocks are reused.
+    brpc::DeallocHugepageBlock(huge_blocks.back());
+    ASSERT_EQ(huge_blocks.back(),
+              brpc::AllocHugepageBlock(butil::IOBuf::HUGE_BLOCK_SIZE));
+    for (size_t i = 0; i < huge_blocks.size(); ++i) {
+        brpc::DeallocHugepageBlock(huge_blocks[i]);
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        brpc::DeallocHugepageBlock(blocks[i]);
+    }
+    ASSERT_EQ(0, get_int64_var("iobuf_hugepage_used_bytes"));
+    std::cout << bvar::Variable::describe_exposed("iobuf_hugepage_arenas")
+              << std::endl;
+
+    // IOBuf works with the allocator.
+    std::string data(3 * 1024 * 1024, 'y');
+    butil::IOBuf buf;
+    buf.append(data);
+    ASSERT_EQ(data, buf.to_string());
+    ASSERT_GT(get_int64_var("iobuf_hugepage_used_bytes"), 0);
+}
+
+} // namespace
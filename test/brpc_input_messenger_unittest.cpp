@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>                   //
+#include <algorithm>
 #include <gtest/gtest.h>
 #include "butil/gperftools_profiler.h"
 #include "butil/time.h"
@@ -29,8 +30,17 @@
 #include "butil/fd_utility.h"
 #include "butil/fd_guard.h"
 #include "butil/unix_socket.h"
+#include "bvar/variable.h"
 #include "brpc/acceptor.h"
+#include "brpc/nshead.h"
 #include "brpc/policy/hulu_pbrpc_protocol.h"
+#include "brpc/policy/most_common_message.h"
+
+namespace brpc {
+DECLARE_int64(socket_input_bytes_budget);
+DECLARE_int32(socket_input_messages_budget);
+DECLARE_bool(guess_protocol_by_signature);
+}
 
 void EmptyProcessHuluRequest(brpc::InputMessageBase* msg_base) {
     brpc::DestroyingPtr<brpc::InputMessageBase> a(msg_base);
@@ -218,3 +228,278 @@ TEST_F(MessengerTest, dispatch_tasks) {
     sleep(1);
     LOG(WARNING) << "begin to exit!!!!";
 }
+
+// Payload of messages sent to the budget test. Flooding messages are zeros.
+struct ProbePayload {
+    uint64_t is_probe;
+    int64_t sent_us;
+};
+
+butil::atomic<int> nprobe_received(0);
+butil::atomic<int64_t> max_probe_latency_us(0);
+
+void ProcessProbe(brpc::InputMessageBase* msg_base) {
+    brpc::DestroyingPtr<brpc::policy::MostCommonMessage> msg(
+        static_cast<brpc::policy::MostCommonMessage*>(msg_base));
+    ProbePayload probe;
+    if (msg->payload.copy_to(&probe, sizeof(probe)) != sizeof(probe) ||
+        !probe.is_probe) {
+        return;
+    }
+    const int64_t latency_us = butil::gettimeofday_us() - probe.sent_us;
+    int64_t cur = max_probe_latency_us.load();
+    while (latency_us > cur &&
+           !max_probe_latency_us.compare_exchange_weak(cur, latency_us)) {}
+    nprobe_received.fetch_add(1);
+}
+
+const size_t PROBE_MESSAGE_SIZE = 12 + 4 + sizeof(ProbePayload);
+
+void FillHuluMessage(char* buf, const ProbePayload& payload) {
+    memcpy(buf, "HULU", 4);
+    *(uint32_t*)(buf + 4) = PROBE_MESSAGE_SIZE - 12;
+    *(uint32_t*)(buf + 8) = 4;
+    memset(buf + 12, 0, 4);
+    memcpy(buf + 16, &payload, sizeof(payload));
+}
+
+void* flood_thread(void* arg) {
+    const char* socket_name = (const char*)arg;
+    const size_t buf_cap = NMESSAGE * PROBE_MESSAGE_SIZE;
+    char* buf = (char*)malloc(buf_cap);
+    const ProbePayload flood = { 0, 0 };
+    for (size_t i = 0; i < NMESSAGE; ++i) {
+        FillHuluMessage(buf + i * PROBE_MESSAGE_SIZE, flood);
+    }
+    butil::fd_guard fd(butil::unix_socket_connect(socket_name));
+    if (fd < 0) {
+        PLOG(FATAL) << "Fail to connect to " << socket_name;
+        free(buf);
+        return NULL;
+    }
+    // Messages are pipelined without waiting for anything, the whole
+    // buffer is always written so that messages are never split.
+    while (!client_stop) {
+        size_t offset = 0;
+        while (offset < buf_cap && !client_stop) {
+            const ssize_t n = write(fd, buf + offset, buf_cap - offset);
+            if (n < 0) {
+                if (errno != EINTR) {
+                    PLOG(FATAL) << "Fail to write fd=" << fd;
+                    free(buf);
+                    return NULL;
+                }
+            } else {
+                offset += n;
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int64_t GetBudgetExhaustedCount() {
+    return strtoll(bvar::Variable::describe_exposed(
+                       "rpc_socket_input_budget_exhausted_count").c_str(),
+                   NULL, 10);
+}
+
+TEST_F(MessengerTest, input_budget_bounds_latency_of_other_sockets) {
+    const int64_t saved_bytes_budget = brpc::FLAGS_socket_input_bytes_budget;
+    const int32_t saved_msgs_budget = brpc::FLAGS_socket_input_messages_budget;
+    brpc::FLAGS_socket_input_bytes_budget = 64 * 1024;
+    brpc::FLAGS_socket_input_messages_budget = 64;
+    client_stop = false;
+    nprobe_received.store(0);
+    max_probe_latency_us.store(0);
+
+    const char* socket_name = "input_messenger.budget_socket";
+    brpc::Acceptor messenger;
+    const brpc::InputMessageHandler handler =
+        { brpc::policy::ParseHuluMessage, ProcessProbe, NULL, NULL,
+          "dummy_hulu" };
+    int listening_fd = butil::unix_socket_listen(socket_name);
+    ASSERT_TRUE(listening_fd > 0);
+    butil::make_non_blocking(listening_fd);
+    ASSERT_EQ(0, messenger.AddHandler(handler));
+    ASSERT_EQ(0, messenger.StartAccept(listening_fd, -1, NULL));
+
+    const int64_t exhausted_before = GetBudgetExhaustedCount();
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, flood_thread, (void*)socket_name));
+    usleep(200000);
+
+    // Messages of another connection are processed timely while the
+    // flooding connection keeps its reading bthread busy.
+    const int NPROBE = 50;
+    butil::fd_guard fd(butil::unix_socket_connect(socket_name));
+    ASSERT_GE(fd, 0);
+    for (int i = 0; i < NPROBE; ++i) {
+        char buf[PROBE_MESSAGE_SIZE];
+        const ProbePayload probe = { 1, butil::gettimeofday_us() };
+        FillHuluMessage(buf, probe);
+        ASSERT_EQ((ssize_t)sizeof(buf), write(fd, buf, sizeof(buf)));
+        usleep(10000);
+    }
+    for (int i = 0; i < 500 && nprobe_received.load() < NPROBE; ++i) {
+        usleep(10000);
+    }
+    client_stop = true;
+    pthread_join(th, NULL);
+    messenger.StopAccept(0);
+    brpc::FLAGS_socket_input_bytes_budget = saved_bytes_budget;
+    brpc::FLAGS_socket_input_messages_budget = saved_msgs_budget;
+
+    ASSERT_EQ(NPROBE, nprobe_received.load());
+    LOG(INFO) << "max_probe_latency_us=" << max_probe_latency_us.load();
+    ASSERT_LT(max_probe_latency_us.load(), 1000000);
+    ASSERT_GT(GetBudgetExhaustedCount(), exhausted_before);
+}
+
+// Parsers of fake protocols record the order in which they're tried.
+struct FakeProtocol {
+    brpc::ProtocolType type;
+    bool accept;
+};
+
+std::vector<int> g_tried;
+
+brpc::ParseResult ParseFakeMessage(butil::IOBuf*, brpc::Socket*, bool,
+                                   const void* arg) {
+    const FakeProtocol* p = static_cast<const FakeProtocol*>(arg);
+    g_tried.push_back(p->type);
+    return brpc::MakeParseError(p->accept ? brpc::PARSE_ERROR_NOT_ENOUGH_DATA
+                                          : brpc::PARSE_ERROR_TRY_OTHERS);
+}
+
+class GuessProtocolTest : public ::testing::Test {
+protected:
+    GuessProtocolTest() {
+        const FakeProtocol protocols[] = {
+            { brpc::PROTOCOL_BAIDU_STD, false },
+            { brpc::PROTOCOL_HTTP, false },
+            { brpc::PROTOCOL_REDIS, false },
+            { brpc::PROTOCOL_NSHEAD, false },
+            { brpc::PROTOCOL_H2, false },
+        };
+        _protocols.assign(protocols, protocols + ARRAY_SIZE(protocols));
+    }
+
+    void SetUp() override {
+        _saved_guess = brpc::FLAGS_guess_protocol_by_signature;
+    }
+
+    void TearDown() override {
+        brpc::FLAGS_guess_protocol_by_signature = _saved_guess;
+    }
+
+    void Accept(brpc::ProtocolType type) {
+        for (size_t i = 0; i < _protocols.size(); ++i) {
+            if (_protocols[i].type == type) {
+                _protocols[i].accept = true;
+            }
+        }
+    }
+
+    // Cut `data' as the first bytes of a new connection, returning index
+    // of the handler which took it or -1 if no handler did.
+    int Cut(const void* data, size_t size) {
+        // AddHandler() only takes parsers of registered protocols, put the
+        // fake ones at indexes of their protocols directly.
+        brpc::InputMessenger messenger;
+        messenger._handlers = new brpc::InputMessageHandler[messenger._capacity];
+        memset(messenger._handlers, 0,
+               sizeof(*messenger._handlers) * messenger._capacity);
+        int max_index = -1;
+        for (size_t i = 0; i < _protocols.size(); ++i) {
+            const brpc::InputMessageHandler h =
+                { ParseFakeMessage, NULL, NULL, &_protocols[i], "fake" };
+            messenger._handlers[_protocols[i].type] = h;
+            max_index = std::max(max_index, (int)_protocols[i].type);
+        }
+        messenger._max_index.store(max_index);
+
+        brpc::SocketOptions options;
+        brpc::SocketId id;
+        EXPECT_EQ(0, brpc::Socket::Create(options, &id));
+        brpc::SocketUniquePtr s;
+        EXPECT_EQ(0, brpc::Socket::Address(id, &s));
+        s->_read_buf.append(data, size);
+        g_tried.clear();
+        size_t index = (size_t)-1;
+        const brpc::ParseResult result =
+            messenger.CutInputMessage(s.get(), &index, false);
+        s->SetFailed();
+        if (result.error() == brpc::PARSE_ERROR_TRY_OTHERS) {
+            return -1;
+        }
+        EXPECT_EQ(brpc::PARSE_ERROR_NOT_ENOUGH_DATA, result.error());
+        return (int)index;
+    }
+
+    std::vector<FakeProtocol> _protocols;
+    bool _saved_guess;
+};
+
+TEST_F(GuessProtocolTest, guessed_protocol_is_tried_first) {
+    const struct {
+        const char* data;
+        brpc::ProtocolType guessed;
+    } cases[] = {
+        { "PRPC", brpc::PROTOCOL_BAIDU_STD },
+        { "GET / HTTP/1.1\r\n\r\n", brpc::PROTOCOL_HTTP },
+        { "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", brpc::PROTOCOL_H2 },
+        { "*1\r\n$4\r\nPING\r\n", brpc::PROTOCOL_REDIS },
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(cases); ++i) {
+        // Every protocol would take it, the guessed one is tried only.
+        for (size_t j = 0; j < _protocols.size(); ++j) {
+            _protocols[j].accept = true;
+        }
+        ASSERT_EQ(cases[i].guessed, Cut(cases[i].data, strlen(cases[i].data)))
+            << cases[i].data;
+        ASSERT_EQ(1u, g_tried.size());
+        ASSERT_EQ(cases[i].guessed, g_tried[0]);
+    }
+}
+
+TEST_F(GuessProtocolTest, try_others_if_guessed_protocol_does_not_match) {
+    // nshead does not have a leading magic, an id of '*' looks like redis.
+    brpc::nshead_t head;
+    memset(&head, 0, sizeof(head));
+    head.id = '*';
+    head.magic_num = brpc::NSHEAD_MAGICNUM;
+    Accept(brpc::PROTOCOL_NSHEAD);
+    ASSERT_EQ(brpc::PROTOCOL_NSHEAD, Cut(&head, sizeof(head)));
+    const int expected[] = { brpc::PROTOCOL_REDIS, brpc::PROTOCOL_BAIDU_STD,
+                             brpc::PROTOCOL_HTTP, brpc::PROTOCOL_NSHEAD };
+    ASSERT_EQ(std::vector<int>(expected, expected + ARRAY_SIZE(expected)),
+              g_tried);
+
+    // No protocol takes it.
+    ASSERT_EQ(-1, Cut("*junk", 5));
+    const int all[] = { brpc::PROTOCOL_REDIS, brpc::PROTOCOL_BAIDU_STD,
+                        brpc::PROTOCOL_HTTP, brpc::PROTOCOL_NSHEAD,
+                        brpc::PROTOCOL_H2 };
+    ASSERT_EQ(std::vector<int>(all, all + ARRAY_SIZE(all)), g_tried);
+}
+
+TEST_F(GuessProtocolTest, try_in_order_without_guess) {
+    const int in_order[] = { brpc::PROTOCOL_BAIDU_STD, brpc::PROTOCOL_HTTP,
+                             brpc::PROTOCOL_REDIS, brpc::PROTOCOL_NSHEAD,
+                             brpc::PROTOCOL_H2 };
+    const std::vector<int> expected(in_order, in_order + ARRAY_SIZE(in_order));
+    // Unknown signatures and too short inputs are not guessed.
+    ASSERT_EQ(-1, Cut("\x01\x02\x03\x04", 4));
+    ASSERT_EQ(expected, g_tried);
+    ASSERT_EQ(-1, Cut("GE", 2));
+    ASSERT_EQ(expected, g_tried);
+
+    brpc::FLAGS_guess_protocol_by_signature = false;
+    ASSERT_EQ(-1, Cut("*1\r\n$4\r\nPING\r\n", 14));
+    ASSERT_EQ(expected, g_tried);
+    Accept(brpc::PROTOCOL_HTTP);
+    Accept(brpc::PROTOCOL_H2);
+    ASSERT_EQ(brpc::PROTOCOL_HTTP, Cut("PRI * HTTP/2.0\r\n", 16));
+    ASSERT_EQ(std::vector<int>(in_order, in_order + 2), g_tried);
+}
@@ -0,0 +1,173 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include "butil/iobuf.h"
+#include "brpc/iobuf_fields.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/server.h"
+#include "echo.pb.h"
+
+namespace {
+
+static void AppendBlob(butil::IOBuf* buf, char c, size_t n) {
+    std::string s(n, c);
+    buf->append(s);
+}
+
+TEST(IOBufFieldsTest, parse_and_serialize) {
+    test::BlobRequest req;
+    req.set_key("k");
+    req.set_version(7);
+    brpc::IOBufFields fields;
+    butil::IOBuf value;
+    AppendBlob(&value, 'v', 100000);
+    butil::IOBuf chunk1;
+    AppendBlob(&chunk1, 'a', 10);
+    butil::IOBuf chunk2;
+    fields.add(3, chunk1);
+    fields.add(2, value);
+    fields.add(3, chunk2);
+    butil::IOBuf buf;
+    ASSERT_TRUE(brpc::SerializePbWithIOBufFields(req, fields, &buf));
+
+    // Parsed by ordinary protobuf, payloads go into the message.
+    test::BlobRequest req2;
+    butil::IOBufAsZeroCopyInputStream wrapper(buf);
+    ASSERT_TRUE(req2.ParseFromZeroCopyStream(&wrapper));
+    ASSERT_EQ("k", req2.key());
+    ASSERT_EQ(7, req2.version());
+    ASSERT_EQ(value.to_string(), req2.value());
+    ASSERT_EQ(2, req2.chunks_size());
+    ASSERT_EQ(chunk1.to_string(), req2.chunks(0));
+    ASSERT_EQ("", req2.chunks(1));
+
+    // Parsed with iobuf fields, payloads reference blocks of `buf'.
+    test::BlobRequest req3;
+    brpc::IOBufFields fields3;
+    ASSERT_TRUE(brpc::ParsePbWithIOBufFields(buf, &req3, &fields3));
+    ASSERT_EQ("k", req3.key());
+    ASSERT_EQ(7, req3.version());
+    ASSERT_FALSE(req3.has_value());
+    ASSERT_EQ(0, req3.chunks_size());
+    ASSERT_EQ(3UL, fields3.size());
+    ASSERT_EQ(2UL, fields3.count(3));
+    ASSERT_EQ(1UL, fields3.count(2));
+    ASSERT_EQ(chunk1, *fields3.get(3));
+    ASSERT_TRUE(fields3.get(3, 1)->empty());
+    ASSERT_TRUE(fields3.get(3, 2) == NULL);
+    const butil::IOBuf* value3 = fields3.get(2);
+    ASSERT_EQ(value, *value3);
+    const butil::StringPiece first_block = value3->backing_block(0);
+    bool found = false;
+    for (size_t i = 0; i < buf.backing_block_num(); ++i) {
+        const butil::StringPiece b = buf.backing_block(i);
+        if (first_block.data() >= b.data() &&
+            first_block.data() < b.data() + b.size()) {
+            found = true;
+        }
+    }
+    ASSERT_TRUE(found) << "payload was copied";
+}
+
+TEST(IOBufFieldsTest, unmarked_message) {
+    test::EchoRequest req;
+    req.set_message("hello");
+    ASSERT_FALSE(brpc::HasIOBufFields(test::EchoRequest::descriptor()));
+    ASSERT_TRUE(brpc::HasIOBufFields(test::BlobRequest::descriptor()));
+    butil::IOBuf buf;
+    {
+        butil::IOBufAsZeroCopyOutputStream wrapper(&buf);
+        ASSERT_TRUE(req.SerializeToZeroCopyStream(&wrapper));
+    }
+    test::EchoRequest req2;
+    brpc::IOBufFields fields;
+    ASSERT_TRUE(brpc::ParsePbWithIOBufFields(buf, &req2, &fields));
+    ASSERT_EQ("hello", req2.message());
+    ASSERT_TRUE(fields.empty());
+}
+
+TEST(IOBufFieldsTest, malformed) {
+    test::BlobRequest req;
+    req.set_key("k");
+    brpc::IOBufFields fields;
+    butil::IOBuf value;
+    AppendBlob(&value, 'v', 100);
+    fields.add(2, value);
+    butil::IOBuf buf;
+    ASSERT_TRUE(brpc::SerializePbWithIOBufFields(req, fields, &buf));
+    buf.pop_back(1);
+    test::BlobRequest req2;
+    brpc::IOBufFields fields2;
+    ASSERT_FALSE(brpc::ParsePbWithIOBufFields(buf, &req2, &fields2));
+}
+
+class BlobServiceImpl : public test::BlobService {
+public:
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::BlobRequest* request,
+              test::BlobResponse* response,
+              google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        EXPECT_FALSE(request->has_value());
+        const butil::IOBuf* value = cntl->request_iobuf_fields().get(2);
+        if (value) {
+            cntl->response_iobuf_fields().add(1, *value);
+        }
+        response->set_version(request->version() + 1);
+    }
+};
+
+TEST(IOBufFieldsTest, rpc) {
+    BlobServiceImpl svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8631, NULL));
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("127.0.0.1:8631", NULL));
+    test::BlobService_Stub stub(&chan);
+
+    butil::IOBuf value;
+    AppendBlob(&value, 'x', 1024 * 1024);
+    brpc::Controller cntl;
+    test::BlobRequest req;
+    test::BlobResponse res;
+    req.set_key("k");
+    req.set_version(1);
+    cntl.request_iobuf_fields().add(2, value);
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(2, res.version());
+    ASSERT_FALSE(res.has_value());
+    ASSERT_EQ(1UL, cntl.response_iobuf_fields().size());
+    ASSERT_EQ(value, *cntl.response_iobuf_fields().get(1));
+
+    // Compressed requests can't carry iobuf fields.
+    brpc::Controller cntl2;
+    cntl2.set_request_compress_type(brpc::COMPRESS_TYPE_GZIP);
+    cntl2.request_iobuf_fields().add(2, value);
+    stub.Echo(&cntl2, &req, &res, NULL);
+    ASSERT_TRUE(cntl2.Failed());
+    ASSERT_EQ(brpc::EREQUEST, cntl2.ErrorCode());
+
+    server.Stop(0);
+    server.Join();
+}
+
+} // namespace
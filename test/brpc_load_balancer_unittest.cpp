@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <map>
+#include <set>
 #include <gtest/gtest.h>
 #include "bthread/bthread.h"
 #include "butil/gperftools_profiler.h"
@@ -31,19 +32,26 @@
 #include "brpc/describable.h"
 #include "brpc/socket.h"
 #include "butil/strings/string_number_conversions.h"
+#include "butil/strings/stringprintf.h"
 #include "brpc/excluded_servers.h" 
 #include "brpc/policy/weighted_round_robin_load_balancer.h"
 #include "brpc/policy/round_robin_load_balancer.h"
 #include "brpc/policy/weighted_randomized_load_balancer.h"
 #include "brpc/policy/randomized_load_balancer.h"
 #include "brpc/policy/locality_aware_load_balancer.h"
+#include "brpc/policy/p2c_load_balancer.h"
+#include "brpc/policy/zone_aware_load_balancer.h"
 #include "brpc/policy/consistent_hashing_load_balancer.h"
+#include "brpc/policy/maglev_load_balancer.h"
+#include "brpc/policy/jump_hash_load_balancer.h"
 #include "brpc/policy/hasher.h"
 #include "brpc/errno.pb.h"
 #include "echo.pb.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
 #include "brpc/server.h"
+#include "brpc/global.h"
+#include "brpc/details/load_balancer_with_naming.h"
 
 namespace brpc {
 DECLARE_int32(health_check_interval);
@@ -125,6 +133,71 @@ TEST_F(LoadBalancerTest, doubly_buffered_data) {
     }
 }
 
+struct Pair {
+    Pair() : x(0), y(0) {}
+    int x;
+    int y;
+};
+
+bool AddToPair(Pair& p, int n) {
+    p.x += n;
+    p.y += n;
+    return true;
+}
+
+struct ReadArg {
+    butil::DoublyBufferedData<Pair>* d;
+    butil::atomic<bool> stop;
+    butil::atomic<int64_t> nread;
+};
+
+static void* read_doubly_buffered_data(void* void_arg) {
+    ReadArg* arg = (ReadArg*)void_arg;
+    int last = 0;
+    while (!arg->stop.load(butil::memory_order_relaxed)) {
+        butil::DoublyBufferedData<Pair>::ScopedPtr ptr;
+        EXPECT_EQ(0, arg->d->Read(&ptr));
+        const int x = ptr->x;
+        for (int i = 0; i < 100; ++i) {
+            butil::subtle::NoBarrier_Load((butil::subtle::Atomic32*)&ptr->x);
+        }
+        // The instance being read is never modified.
+        EXPECT_EQ(x, ptr->y);
+        EXPECT_LE(last, x);
+        last = x;
+        arg->nread.fetch_add(1, butil::memory_order_relaxed);
+    }
+    return NULL;
+}
+
+TEST_F(LoadBalancerTest, wait_free_doubly_buffered_data) {
+    butil::DoublyBufferedData<Pair> d(butil::DOUBLY_BUFFERED_READ_WAIT_FREE);
+    ReadArg arg;
+    arg.d = &d;
+    arg.stop.store(false);
+    arg.nread.store(0);
+    pthread_t th[4];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, read_doubly_buffered_data, &arg));
+    }
+    while (arg.nread.load() < (int64_t)ARRAY_SIZE(th)) {
+        usleep(1000);
+    }
+    const int N = 1000;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(1u, d.Modify(AddToPair, 1));
+    }
+    arg.stop.store(true);
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        pthread_join(th[i], NULL);
+    }
+    butil::DoublyBufferedData<Pair>::ScopedPtr ptr;
+    ASSERT_EQ(0, d.Read(&ptr));
+    ASSERT_EQ(N, ptr->x);
+    ASSERT_EQ(N, ptr->y);
+    LOG(INFO) << "nread=" << arg.nread.load();
+}
+
 typedef brpc::policy::LocalityAwareLoadBalancer LALB;
 
 static void ValidateWeightTree(
@@ -617,6 +690,230 @@ TEST_F(LoadBalancerTest, consistent_hashing) {
     }
 }
 
+TEST_F(LoadBalancerTest, consistent_hashing_incremental) {
+    std::vector<brpc::ServerId> ids;
+    for (int i = 0; i < 10; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "192.168.1.%d:8080", i);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        options.user = new SaveRecycle;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    brpc::policy::ConsistentHashingLoadBalancer full(
+        brpc::policy::CONS_HASH_LB_MURMUR3);
+    ASSERT_EQ(ids.size(), full.AddServersInBatch(ids));
+
+    // Rings changed incrementally are same with the one built at once.
+    brpc::policy::ConsistentHashingLoadBalancer incr(
+        brpc::policy::CONS_HASH_LB_MURMUR3);
+    std::vector<brpc::ServerId> first(ids.begin(), ids.begin() + 5);
+    std::vector<brpc::ServerId> second(ids.begin() + 5, ids.end());
+    std::vector<brpc::ServerId> some(ids.begin() + 3, ids.begin() + 7);
+    ASSERT_EQ(first.size(), incr.AddServersInBatch(first));
+    ASSERT_EQ(second.size(), incr.AddServersInBatch(second));
+    ASSERT_EQ(0u, incr.AddServersInBatch(some));
+    ASSERT_EQ(some.size(), incr.RemoveServersInBatch(some));
+    ASSERT_TRUE(incr.RemoveServer(ids[0]));
+    ASSERT_FALSE(incr.RemoveServer(ids[0]));
+    ASSERT_TRUE(incr.AddServer(ids[0]));
+    ASSERT_EQ(some.size(), incr.AddServersInBatch(some));
+    // Modify both buffers of the ring to compare them.
+    for (int i = 0; i < 2; ++i) {
+        ASSERT_TRUE(incr.RemoveServer(ids[9]));
+        ASSERT_TRUE(incr.AddServer(ids[9]));
+        butil::DoublyBufferedData<std::vector<
+            brpc::policy::ConsistentHashingLoadBalancer::Node> >::ScopedPtr r1, r2;
+        ASSERT_EQ(0, full._db_hash_ring.Read(&r1));
+        ASSERT_EQ(0, incr._db_hash_ring.Read(&r2));
+        ASSERT_EQ(r1->size(), r2->size());
+        for (size_t j = 0; j < r1->size(); ++j) {
+            ASSERT_EQ((*r1)[j].hash, (*r2)[j].hash);
+            ASSERT_EQ((*r1)[j].server_sock, (*r2)[j].server_sock);
+        }
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
+TEST_F(LoadBalancerTest, consistent_hashing_with_bounded_load) {
+    const char* servers[] = {
+            "10.92.115.19:8833",
+            "10.42.108.25:8833",
+            "10.36.150.32:8833",
+            "10.92.149.48:8833",
+            "10.42.122.201:8833",
+    };
+    brpc::policy::ConsistentHashingLoadBalancer proto(
+        brpc::policy::CONS_HASH_LB_MURMUR3);
+    ASSERT_TRUE(proto.New("load_factor=0.5") == NULL);
+    brpc::LoadBalancer* lb = proto.New("load_factor=1.25");
+    ASSERT_TRUE(lb != NULL);
+    std::vector<brpc::ServerId> ids;
+    for (size_t i = 0; i < ARRAY_SIZE(servers); ++i) {
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(servers[i], &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        options.user = new SaveRecycle;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+    }
+    ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+
+    // Calls of a hot key spill over to next servers on the ring once the
+    // server of the key has 1.25 times average inflight calls.
+    const int NCALL = 100;
+    std::map<brpc::SocketId, int> inflights;
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, true, 12345u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    ASSERT_EQ(0, lb->SelectServer(in, &out));
+    ASSERT_TRUE(out.need_feedback);
+    const brpc::SocketId hot_server = ptr->id();
+    ++inflights[hot_server];
+    for (int i = 1; i < NCALL; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        ++inflights[ptr->id()];
+        ASSERT_LE(inflights[ptr->id()],
+                  std::ceil(1.25 * (i + 1) / ARRAY_SIZE(servers)));
+    }
+    ASSERT_LT(1u, inflights.size());
+    ASSERT_EQ((int)std::ceil(1.25 * NCALL / ARRAY_SIZE(servers)),
+              inflights[hot_server]);
+
+    // The key goes back to its server after calls end.
+    for (std::map<brpc::SocketId, int>::iterator
+             it = inflights.begin(); it != inflights.end(); ++it) {
+        for (int i = 0; i < it->second; ++i) {
+            brpc::LoadBalancer::CallInfo info;
+            info.begin_time_us = 0;
+            info.server_id = it->first;
+            info.error_code = 0;
+            info.controller = NULL;
+            lb->Feedback(info);
+        }
+    }
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_EQ(hot_server, ptr->id());
+    }
+    lb->Destroy();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
+// Returns ratio of the keys moved after removing `removed' from `lb'.
+static double RemoveAndCountMovedKeys(brpc::LoadBalancer* lb,
+                                      const brpc::ServerId& removed,
+                                      size_t nkey) {
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, true, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    std::vector<brpc::SocketId> before(nkey);
+    for (size_t i = 0; i < nkey; ++i) {
+        in.request_code = brpc::policy::MurmurHash32(&i, sizeof(i));
+        EXPECT_EQ(0, lb->SelectServer(in, &out));
+        before[i] = ptr->id();
+    }
+    butil::Timer tm;
+    tm.start();
+    EXPECT_TRUE(lb->RemoveServer(removed));
+    tm.stop();
+    size_t nmoved = 0;
+    for (size_t i = 0; i < nkey; ++i) {
+        in.request_code = brpc::policy::MurmurHash32(&i, sizeof(i));
+        EXPECT_EQ(0, lb->SelectServer(in, &out));
+        EXPECT_NE(removed.id, ptr->id());
+        nmoved += (before[i] != ptr->id());
+    }
+    const double ratio = (double)nmoved / nkey;
+    std::cout << "Removed one server in " << tm.u_elapsed()
+              << "us, moved_ratio=" << ratio << std::endl;
+    return ratio;
+}
+
+TEST_F(LoadBalancerTest, maglev_and_jump_hashing) {
+    const size_t NSERVER = 1000;
+    std::vector<brpc::ServerId> ids;
+    std::vector<butil::EndPoint> addrs;
+    for (size_t i = 0; i < NSERVER; ++i) {
+        char addr[32];
+        snprintf(addr, sizeof(addr), "10.%lu.%lu.%lu:8833",
+                 i / 65536, i / 256 % 256, i % 256);
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(addr, &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        options.user = new SaveRecycle;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+        addrs.push_back(dummy);
+    }
+    const size_t last = std::max_element(addrs.begin(), addrs.end()) - addrs.begin();
+    brpc::policy::MaglevLoadBalancer maglev;
+    brpc::policy::JumpHashLoadBalancer jump;
+    brpc::LoadBalancer* lbs[] = { &maglev, &jump };
+    const char* names[] = { "c_maglev", "c_jump" };
+    for (size_t round = 0; round < ARRAY_SIZE(lbs); ++round) {
+        brpc::LoadBalancer* lb = lbs[round];
+        butil::Timer tm;
+        tm.start();
+        ASSERT_EQ(NSERVER, lb->AddServersInBatch(ids));
+        tm.stop();
+        ASSERT_FALSE(lb->AddServer(ids[0]));
+
+        const size_t SELECT_TIMES = 1000000;
+        std::map<brpc::SocketId, size_t> times;
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        ASSERT_EQ(EINVAL, lb->SelectServer(in, &out));
+        in.has_request_code = true;
+        butil::Timer tm2;
+        tm2.start();
+        for (size_t i = 0; i < SELECT_TIMES; ++i) {
+            in.request_code = brpc::policy::MurmurHash32(&i, sizeof(i));
+            ASSERT_EQ(0, lb->SelectServer(in, &out));
+            ++times[ptr->id()];
+        }
+        tm2.stop();
+        size_t max_times = 0;
+        for (std::map<brpc::SocketId, size_t>::iterator
+                 it = times.begin(); it != times.end(); ++it) {
+            max_times = std::max(max_times, it->second);
+        }
+        std::cout << names[round] << ": built " << NSERVER << " servers in "
+                  << tm.u_elapsed() << "us, select="
+                  << tm2.n_elapsed() / SELECT_TIMES << "ns, max_load="
+                  << (double)max_times * NSERVER / SELECT_TIMES << std::endl;
+        ASSERT_EQ(NSERVER, times.size());
+        ASSERT_LT(max_times, SELECT_TIMES / NSERVER * 2);
+
+        // Keys of the removed server move to others and few other keys
+        // move. Jump hashing moves keys of servers after the removed one,
+        // so remove the last one in the order of addresses.
+        const brpc::ServerId& removed =
+            (round == 0 ? ids[NSERVER / 2] : ids[last]);
+        const double ratio = RemoveAndCountMovedKeys(lb, removed, 100000);
+        ASSERT_LT(ratio, 20.0 / NSERVER);
+        ASSERT_EQ(NSERVER - 1, lb->RemoveServersInBatch(ids));
+        ASSERT_EQ(ENODATA, lb->SelectServer(in, &out));
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
 TEST_F(LoadBalancerTest, weighted_round_robin) {
     const char* servers[] = { 
             "10.92.115.19:8831", 
@@ -804,6 +1101,140 @@ TEST_F(LoadBalancerTest, weighted_randomized) {
     }
 }
 
+TEST_F(LoadBalancerTest, p2c) {
+    const char* servers[] = {
+        "10.92.115.19:8831",
+        "10.42.108.25:8832",
+        "10.36.150.31:8833",
+    };
+    brpc::policy::P2CLoadBalancer p2clb;
+    std::vector<brpc::ServerId> ids;
+    for (size_t i = 0; i < ARRAY_SIZE(servers); ++i) {
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(servers[i], &dummy));
+        brpc::ServerId id(8888);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        options.user = new SaveRecycle;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+        EXPECT_TRUE(p2clb.AddServer(id));
+    }
+    EXPECT_FALSE(p2clb.AddServer(ids[0]));
+
+    // The first server is 100 times slower than others.
+    std::map<butil::EndPoint, size_t> select_result;
+    brpc::SocketUniquePtr ptr;
+    const int run_times = 3000;
+    for (int i = 0; i < run_times; ++i) {
+        brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        ASSERT_EQ(0, p2clb.SelectServer(in, &out));
+        ASSERT_TRUE(out.need_feedback);
+        ++select_result[ptr->remote_side()];
+        const bool slow = (ptr->id() == ids[0].id);
+        brpc::LoadBalancer::CallInfo info;
+        info.begin_time_us = butil::gettimeofday_us() - (slow ? 100000 : 1000);
+        info.server_id = ptr->id();
+        info.error_code = 0;
+        info.controller = NULL;
+        p2clb.Feedback(info);
+    }
+    butil::EndPoint slow_point;
+    ASSERT_EQ(0, str2endpoint(servers[0], &slow_point));
+    std::cout << "slow server is selected " << select_result[slow_point]
+              << " times out of " << run_times << std::endl;
+    ASSERT_LT(select_result[slow_point], (size_t)run_times / 10);
+    ASSERT_EQ(ARRAY_SIZE(servers), select_result.size());
+
+    // Servers are still selectable after others are removed.
+    EXPECT_TRUE(p2clb.RemoveServer(ids[1]));
+    EXPECT_FALSE(p2clb.RemoveServer(ids[1]));
+    EXPECT_EQ(1u, p2clb.RemoveServersInBatch(
+                  std::vector<brpc::ServerId>(1, ids[2])));
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    ASSERT_EQ(0, p2clb.SelectServer(in, &out));
+    ASSERT_EQ(ids[0].id, ptr->id());
+    EXPECT_TRUE(p2clb.RemoveServer(ids[0]));
+    ASSERT_EQ(ENODATA, p2clb.SelectServer(in, &out));
+}
+
+TEST_F(LoadBalancerTest, zone_aware) {
+    ASSERT_EQ("z1", brpc::policy::GetZoneFromTag("zone=z1"));
+    ASSERT_EQ("z2", brpc::policy::GetZoneFromTag("group=a zone=z2"));
+    ASSERT_EQ("", brpc::policy::GetZoneFromTag("10"));
+
+    brpc::GlobalInitializeOrDie();
+    brpc::policy::ZoneAwareLoadBalancer proto;
+    ASSERT_TRUE(proto.New("inner=not_exist") == NULL);
+    ASSERT_TRUE(proto.New("min_healthy_ratio=2") == NULL);
+    brpc::policy::ZoneAwareLoadBalancer* lb = proto.New("local_zone=z1");
+    ASSERT_TRUE(lb != NULL);
+    const char* servers[] = {
+        "10.92.115.19:8831",
+        "10.42.108.25:8832",
+        "10.36.150.31:8833",
+        "10.36.150.32:8899",
+    };
+    const char* tags[] = { "zone=z1", "zone=z1", "zone=z2", "zone=z3" };
+    std::vector<brpc::ServerId> ids;
+    std::set<brpc::SocketId> local_ids;
+    for (size_t i = 0; i < ARRAY_SIZE(servers); ++i) {
+        butil::EndPoint dummy;
+        ASSERT_EQ(0, str2endpoint(servers[i], &dummy));
+        brpc::ServerId id(8888, tags[i]);
+        brpc::SocketOptions options;
+        options.remote_side = dummy;
+        options.user = new SaveRecycle;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &id.id));
+        ids.push_back(id);
+        if (i < 2) {
+            local_ids.insert(id.id);
+        }
+    }
+    ASSERT_EQ(ids.size(), lb->AddServersInBatch(ids));
+    ASSERT_FALSE(lb->AddServer(ids[0]));
+
+    const int run_times = 1000;
+    brpc::SocketUniquePtr ptr;
+    brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+    brpc::LoadBalancer::SelectOut out(&ptr);
+    for (int i = 0; i < run_times; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_TRUE(local_ids.count(ptr->id())) << ptr->remote_side();
+    }
+    ASSERT_EQ(1000, lb->local_share());
+
+    // Half of local servers are healthy, which is less than the default
+    // min_healthy_ratio=0.7, some calls spill to other zones.
+    ASSERT_EQ(0, brpc::Socket::SetFailed(ids[0].id));
+    usleep(200000);
+    int nlocal = 0;
+    for (int i = 0; i < run_times; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        nlocal += local_ids.count(ptr->id());
+    }
+    ASSERT_EQ(714, lb->local_share());
+    std::cout << "local=" << nlocal << " remote=" << run_times - nlocal << std::endl;
+    ASSERT_GT(nlocal, run_times / 2);
+    ASSERT_LT(nlocal, run_times * 9 / 10);
+
+    // All calls go to other zones when no local server is available.
+    ASSERT_EQ(0, brpc::Socket::SetFailed(ids[1].id));
+    usleep(200000);
+    for (int i = 0; i < run_times; ++i) {
+        ASSERT_EQ(0, lb->SelectServer(in, &out));
+        ASSERT_FALSE(local_ids.count(ptr->id()));
+    }
+    ASSERT_EQ(0, lb->local_share());
+    std::cout << *lb << std::endl;
+    lb->Destroy();
+    for (size_t i = 2; i < ids.size(); ++i) {
+        ASSERT_EQ(0, brpc::Socket::SetFailed(ids[i].id));
+    }
+}
+
 TEST_F(LoadBalancerTest, health_check_no_valid_server) {
     const char* servers[] = { 
             "10.92.115.19:8832", 
@@ -995,6 +1426,78 @@ public:
     test::EchoResponse res;
 };
 
+TEST_F(LoadBalancerTest, subset) {
+    const int NSERVER = 20;
+    const int SUBSET_SIZE = 5;
+    std::string url = "list://";
+    for (int i = 0; i < NSERVER; ++i) {
+        butil::string_appendf(&url, "127.0.0.1:%d,", 9500 + i);
+    }
+    brpc::GetNamingServiceThreadOptions ns_opt;
+    brpc::LoadBalancerWithNaming lb1;
+    brpc::LoadBalancerWithNaming lb2;
+    brpc::LoadBalancerWithNaming lb3;
+    lb1.set_subset(SUBSET_SIZE, "client1");
+    lb2.set_subset(SUBSET_SIZE, "client1");
+    lb3.set_subset(SUBSET_SIZE, "client2");
+    ASSERT_EQ(0, lb1.Init(url.c_str(), "rr", NULL, &ns_opt));
+    ASSERT_EQ(0, lb2.Init(url.c_str(), "rr", NULL, &ns_opt));
+    ASSERT_EQ(0, lb3.Init(url.c_str(), "rr", NULL, &ns_opt));
+    ASSERT_EQ((size_t)NSERVER, lb1._all_servers.size());
+    ASSERT_EQ((size_t)SUBSET_SIZE, lb1._subset.size());
+    // Deterministic for the same key.
+    ASSERT_EQ(lb1._subset, lb2._subset);
+    ASSERT_NE(lb1._subset, lb3._subset);
+
+    // Only servers in the subset are selected.
+    for (int i = 0; i < 100; ++i) {
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = { 0, false, false, 0u, NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        ASSERT_EQ(0, lb1.SelectServer(in, &out));
+        ASSERT_EQ(1u, lb1._subset.count(brpc::ServerId(ptr->id())));
+    }
+
+    // Removing a server in the subset only replaces that server, adding
+    // it back restores the subset.
+    const std::set<brpc::ServerId> old_subset = lb1._subset;
+    const brpc::ServerId victim = *old_subset.begin();
+    lb1.OnRemovedServers(std::vector<brpc::ServerId>(1, victim));
+    ASSERT_EQ((size_t)SUBSET_SIZE, lb1._subset.size());
+    ASSERT_EQ(0u, lb1._subset.count(victim));
+    size_t nkept = 0;
+    for (std::set<brpc::ServerId>::const_iterator it = old_subset.begin();
+         it != old_subset.end(); ++it) {
+        nkept += lb1._subset.count(*it);
+    }
+    ASSERT_EQ((size_t)SUBSET_SIZE - 1, nkept);
+    lb1.OnAddedServers(std::vector<brpc::ServerId>(1, victim));
+    ASSERT_EQ(old_subset, lb1._subset);
+
+    // Subsets of different keys spread over all servers evenly.
+    const int NCLIENT = 400;
+    std::map<brpc::SocketId, int> nchosen;
+    for (int i = 0; i < NCLIENT; ++i) {
+        lb1.set_subset(SUBSET_SIZE, "client" + std::to_string(i));
+        for (std::map<brpc::ServerId, uint64_t>::iterator
+                 it = lb1._all_servers.begin(); it != lb1._all_servers.end(); ++it) {
+            it->second = lb1.SubsetScore(it->first);
+        }
+        lb1.UpdateSubset();
+        for (std::set<brpc::ServerId>::const_iterator
+                 it = lb1._subset.begin(); it != lb1._subset.end(); ++it) {
+            ++nchosen[it->id];
+        }
+    }
+    ASSERT_EQ((size_t)NSERVER, nchosen.size());
+    const int expected = NCLIENT * SUBSET_SIZE / NSERVER;
+    for (std::map<brpc::SocketId, int>::const_iterator
+             it = nchosen.begin(); it != nchosen.end(); ++it) {
+        ASSERT_GT(it->second, expected / 2);
+        ASSERT_LT(it->second, expected * 3 / 2);
+    }
+}
+
 TEST_F(LoadBalancerTest, invalid_lb_params) {
     const char* lb_algo[] = { "random:mi_working_instances=2 hold_seconds=2",
                               "rr:min_working_instances=2 hold_secon=2" };
@@ -18,8 +18,10 @@
 #include <iostream>
 #include "butil/time.h"
 #include "butil/logging.h"
+#include "butil/sys_byteorder.h"
 #include <brpc/memcache.h>
 #include <brpc/channel.h>
+#include <brpc/policy/memcache_binary_header.h>
 #include <gtest/gtest.h>
 
 namespace brpc {
@@ -222,4 +224,76 @@ TEST_F(MemcacheTest, version) {
     ASSERT_TRUE(response.PopVersion(&version)) << response.LastError();
     std::cout << "version=" << version << std::endl;
 }
+TEST_F(MemcacheTest, multi_get) {
+    if (g_mc_pid < 0) {
+        puts("Skipped due to absence of memcached");
+        return;
+    }
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_MEMCACHE;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0:" MEMCACHED_PORT, &options));
+    brpc::MemcacheRequest request;
+    brpc::MemcacheResponse response;
+    brpc::Controller cntl;
+    std::vector<std::string> keys;
+    for (int i = 0; i < 10; ++i) {
+        keys.push_back("multi_get_" + std::to_string(i));
+        if (i % 2 == 0) {
+            request.Set(keys.back(), "value_" + std::to_string(i), i, 10, 0);
+        } else {
+            request.Delete(keys.back());
+        }
+    }
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+
+    cntl.Reset();
+    request.Clear();
+    ASSERT_TRUE(request.MultiGet(keys));
+    ASSERT_EQ(1, request.pipelined_count());
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    std::map<std::string, brpc::MemcacheValue> values;
+    ASSERT_TRUE(response.PopMultiGet(&values)) << response.LastError();
+    ASSERT_EQ(5u, values.size());
+    for (int i = 0; i < 10; i += 2) {
+        const brpc::MemcacheValue& v = values[keys[i]];
+        ASSERT_EQ("value_" + std::to_string(i), v.value.to_string());
+        ASSERT_EQ((uint32_t)i, v.flags);
+    }
+
+    cntl.Reset();
+    values.clear();
+    brpc::MemcacheMultiGet(&channel, keys, &values, &cntl);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(5u, values.size());
+}
+
+TEST_F(MemcacheTest, pop_multi_get) {
+    // Compose the response to MultiGet({"k1", "k2"}) where k1 is missing.
+    brpc::MemcacheResponse response;
+    brpc::policy::MemcacheResponseHeader header = {
+        brpc::policy::MC_MAGIC_RESPONSE, brpc::policy::MC_BINARY_GETKQ,
+        2, 4, brpc::policy::MC_BINARY_RAW_BYTES, 0, 2 + 4 + 5, 0, 100 };
+    const uint32_t raw_flags = butil::HostToNet32(7);
+    response.raw_buffer().append(&header, sizeof(header));
+    response.raw_buffer().append(&raw_flags, sizeof(raw_flags));
+    response.raw_buffer().append("k2");
+    response.raw_buffer().append("hello");
+    header.command = brpc::policy::MC_BINARY_NOOP;
+    header.key_length = 0;
+    header.extras_length = 0;
+    header.total_body_length = 0;
+    header.cas_value = 0;
+    response.raw_buffer().append(&header, sizeof(header));
+
+    std::map<std::string, brpc::MemcacheValue> values;
+    ASSERT_TRUE(response.PopMultiGet(&values)) << response.LastError();
+    ASSERT_TRUE(response.raw_buffer().empty());
+    ASSERT_EQ(1u, values.size());
+    ASSERT_EQ("hello", values["k2"].value.to_string());
+    ASSERT_EQ(7u, values["k2"].flags);
+    ASSERT_EQ(100u, values["k2"].cas_value);
+}
 } //namespace
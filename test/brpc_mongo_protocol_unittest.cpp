@@ -27,6 +27,7 @@
 #include <google/protobuf/descriptor.h>
 #include "butil/time.h"
 #include "butil/macros.h"
+#include "butil/crc32c.h"
 #include "brpc/socket.h"
 #include "brpc/acceptor.h"
 #include "brpc/server.h"
@@ -49,12 +50,22 @@ static const std::string EXP_REQUEST = "hello";
 static const std::string EXP_RESPONSE = "world";
 
 class MyEchoService : public ::brpc::policy::MongoService {
-    void default_method(::google::protobuf::RpcController*,
+    void default_method(::google::protobuf::RpcController* cntl_base,
                         const ::brpc::policy::MongoRequest* req,
                         ::brpc::policy::MongoResponse* res,
                         ::google::protobuf::Closure* done) {
         brpc::ClosureGuard done_guard(done);
 
+        if (req->header().op_code() == brpc::policy::OP_MSG) {
+            // Echo sections back in two batches.
+            brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+            res->set_flag_bits(req->flag_bits());
+            res->mutable_sections()->CopyFrom(req->sections());
+            EXPECT_EQ(0, brpc::WriteMongoMsgBatch(cntl, res));
+            EXPECT_EQ(0, res->sections_size());
+            res->mutable_sections()->CopyFrom(req->sections());
+            return;
+        }
         EXPECT_EQ(EXP_REQUEST, req->message());
 
         res->mutable_header()->set_message_length(
@@ -232,4 +243,96 @@ TEST_F(MongoTest, complete_flow) {
     ASSERT_FALSE(cntl.Failed());
     ASSERT_STREQ(EXP_RESPONSE.c_str(), msg_buf);
 }
+
+// An empty bson document.
+static const std::string EMPTY_DOC("\x05\x00\x00\x00\x00", 5);
+
+static void AppendMongoMsgSections(butil::IOBuf* buf) {
+    // Body section.
+    buf->push_back(0);
+    buf->append(EMPTY_DOC);
+    // Document sequence with two documents.
+    buf->push_back(1);
+    const int32_t size = 4 + 10 + 2 * EMPTY_DOC.size();
+    buf->append(&size, sizeof(size));
+    buf->append("documents", 10);
+    buf->append(EMPTY_DOC);
+    buf->append(EMPTY_DOC);
+}
+
+static uint32_t Crc32c(const butil::IOBuf& buf) {
+    const std::string str = buf.to_string();
+    return butil::crc32c::Value(str.data(), str.size());
+}
+
+TEST_F(MongoTest, op_msg_with_checksum) {
+    butil::IOBuf body;
+    const uint32_t flag_bits = brpc::MONGO_MSG_CHECKSUM_PRESENT;
+    body.append(&flag_bits, sizeof(flag_bits));
+    AppendMongoMsgSections(&body);
+    brpc::mongo_head_t header = {
+        (int32_t)(sizeof(header) + body.size() + 4), 7, 0,
+        brpc::MONGO_OPCODE_OP_MSG };
+    butil::IOBuf total_buf;
+    total_buf.append(&header, sizeof(header));
+    total_buf.append(body);
+    const uint32_t crc = Crc32c(total_buf);
+    total_buf.append(&crc, sizeof(crc));
+
+    brpc::ParseResult req_pr =
+        brpc::policy::ParseMongoMessage(&total_buf, _socket.get(), false, &_server);
+    ASSERT_EQ(brpc::PARSE_OK, req_pr.error());
+    ProcessMessage(brpc::policy::ProcessMongoRequest, req_pr.message(), false);
+
+    // The batch with moreToCome followed by the last batch.
+    butil::IOPortal response_buf;
+    response_buf.append_from_file_descriptor(_pipe_fds[0], 1024);
+    int32_t last_request_id = 0;
+    for (int i = 0; i < 2; ++i) {
+        ASSERT_LE(sizeof(header), response_buf.size());
+        response_buf.copy_to(&header, sizeof(header));
+        ASSERT_EQ(brpc::MONGO_OPCODE_OP_MSG, header.op_code);
+        ASSERT_LE((size_t)header.message_length, response_buf.size());
+        ASSERT_EQ(i == 0 ? 7 : last_request_id, header.response_to);
+        last_request_id = header.request_id;
+        butil::IOBuf msg;
+        response_buf.cutn(&msg, header.message_length - 4);
+        uint32_t res_crc = 0;
+        response_buf.cutn(&res_crc, sizeof(res_crc));
+        ASSERT_EQ(Crc32c(msg), res_crc);
+        msg.pop_front(sizeof(header));
+        uint32_t res_flag_bits = 0;
+        msg.cutn(&res_flag_bits, sizeof(res_flag_bits));
+        ASSERT_EQ(i == 0, !!(res_flag_bits & brpc::MONGO_MSG_MORE_TO_COME));
+        ASSERT_TRUE(res_flag_bits & brpc::MONGO_MSG_CHECKSUM_PRESENT);
+        butil::IOBuf sections;
+        AppendMongoMsgSections(&sections);
+        ASSERT_EQ(sections.to_string(), msg.to_string());
+    }
+    ASSERT_TRUE(response_buf.empty());
+}
+
+TEST_F(MongoTest, op_msg_with_wrong_checksum) {
+    butil::IOBuf total_buf;
+    const uint32_t flag_bits = brpc::MONGO_MSG_CHECKSUM_PRESENT;
+    brpc::mongo_head_t header = {
+        (int32_t)(sizeof(header) + 4 + 1 + EMPTY_DOC.size() + 4), 7, 0,
+        brpc::MONGO_OPCODE_OP_MSG };
+    total_buf.append(&header, sizeof(header));
+    total_buf.append(&flag_bits, sizeof(flag_bits));
+    total_buf.push_back(0);
+    total_buf.append(EMPTY_DOC);
+    const uint32_t crc = Crc32c(total_buf) + 1;
+    total_buf.append(&crc, sizeof(crc));
+
+    brpc::ParseResult req_pr =
+        brpc::policy::ParseMongoMessage(&total_buf, _socket.get(), false, &_server);
+    ASSERT_EQ(brpc::PARSE_OK, req_pr.error());
+    ProcessMessage(brpc::policy::ProcessMongoRequest, req_pr.message(), false);
+    // Replied by MongoServiceAdaptor::SerializeError().
+    butil::IOPortal response_buf;
+    response_buf.append_from_file_descriptor(_pipe_fds[0], 1024);
+    response_buf.cutn(&header, sizeof(header));
+    ASSERT_EQ(0, header.op_code);
+}
 } //namespace
@@ -30,6 +30,7 @@
 #include "brpc/policy/list_naming_service.h"
 #include "brpc/policy/remote_file_naming_service.h"
 #include "brpc/policy/discovery_naming_service.h"
+#include "brpc/details/naming_service_thread.h"
 #include "echo.pb.h"
 #include "brpc/server.h"
 
@@ -45,6 +46,7 @@ DECLARE_string(consul_service_discovery_url);
 DECLARE_string(discovery_api_addr);
 DECLARE_string(discovery_env);
 DECLARE_int32(discovery_renew_interval_s);
+DECLARE_bool(discovery_long_poll);
 
 } // policy
 } // brpc
@@ -137,6 +139,25 @@ TEST(NamingServiceTest, sanity) {
     }
 }
 
+TEST(NamingServiceTest, dns_cache) {
+    std::vector<brpc::ServerNode> servers;
+    brpc::policy::DomainNamingService dns;
+    ASSERT_EQ(0, dns.GetServers("localhost:1234", &servers));
+    ASSERT_FALSE(servers.empty());
+    ASSERT_EQ(1234, servers[0].addr.port);
+    const int64_t nhit = atoll(bvar::Variable::describe_exposed(
+            "rpc_dns_cache_hit_count").c_str());
+    // Another service to the same host shares the resolution.
+    brpc::policy::DomainNamingService dns2;
+    std::vector<brpc::ServerNode> servers2;
+    ASSERT_EQ(0, dns2.GetServers("localhost:5678", &servers2));
+    ASSERT_EQ(servers.size(), servers2.size());
+    ASSERT_EQ(servers[0].addr.ip, servers2[0].addr.ip);
+    ASSERT_EQ(5678, servers2[0].addr.port);
+    ASSERT_EQ(nhit + 1, atoll(bvar::Variable::describe_exposed(
+                "rpc_dns_cache_hit_count").c_str()));
+}
+
 TEST(NamingServiceTest, invalid_port) {
     std::vector<brpc::ServerNode> servers;
 
@@ -552,7 +573,8 @@ class DiscoveryNamingServiceImpl : public test::DiscoveryNamingService {
 public:
     DiscoveryNamingServiceImpl()
         : _renew_count(0)
-        , _cancel_count(0) {}
+        , _cancel_count(0)
+        , _polls_count(0) {}
     virtual ~DiscoveryNamingServiceImpl() {}
 
     void Nodes(google::protobuf::RpcController* cntl_base,
@@ -573,6 +595,21 @@ public:
         cntl->response_attachment().append(s_fetchs_result);
     }
 
+    void Polls(google::protobuf::RpcController* cntl_base,
+               const test::HttpRequest*,
+               test::HttpResponse*,
+               google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        // Hold the request for a while as if nothing changed.
+        bthread_usleep(50000);
+        cntl->response_attachment().append(R"({
+            "code": -304,
+            "message": "-304"
+        })");
+        _polls_count++;
+    }
+
     void Register(google::protobuf::RpcController* cntl_base,
                  const test::HttpRequest*,
                  test::HttpResponse*,
@@ -623,6 +660,7 @@ public:
 
     int RenewCount() const { return _renew_count; }
     int CancelCount() const { return _cancel_count; }
+    int PollsCount() const { return _polls_count; }
 
     bool HasAddr(const std::string& addr) const {
         return _addrs.find(addr) != _addrs.end();
@@ -632,6 +670,7 @@ public:
 private:
     int _renew_count;
     int _cancel_count;
+    butil::atomic<int> _polls_count;
 
     std::set<std::string> _addrs;
 };
@@ -644,6 +683,7 @@ TEST(NamingServiceTest, discovery_sanity) {
     std::string rest_mapping =
         "/discovery/nodes => Nodes, "
         "/discovery/fetchs => Fetchs, "
+        "/discovery/polls => Polls, "
         "/discovery/register => Register, "
         "/discovery/renew => Renew, "
         "/discovery/cancel => Cancel";
@@ -695,6 +735,152 @@ TEST(NamingServiceTest, discovery_sanity) {
         ASSERT_FALSE(svc.HasAddr(std::string()));
         ASSERT_EQ(2, svc.AddrCount());
     }
+
+    // Changes are long polled after the first fetch.
+    brpc::policy::FLAGS_discovery_long_poll = true;
+    {
+        brpc::Channel channel;
+        ASSERT_EQ(0, channel.Init("discovery://admin.test", "rr", NULL));
+        bthread_usleep(300000);
+        ASSERT_LT(0, svc.PollsCount());
+    }
+    brpc::policy::FLAGS_discovery_long_poll = false;
+}
+
+// Sends servers in steps with AddServers() and RemoveServers().
+butil::atomic<int> g_diff_step(0);
+butil::atomic<int> g_diff_done(0);
+
+class DiffNamingService : public brpc::NamingService {
+public:
+    int RunNamingService(const char*, brpc::NamingServiceActions* actions) {
+        std::vector<brpc::ServerNode> servers;
+        servers.push_back(Node("127.0.0.1:9901"));
+        servers.push_back(Node("127.0.0.1:9902"));
+        actions->ResetServers(servers);
+        int done = 0;
+        while (bthread_usleep(1000) == 0) {
+            const int step = g_diff_step.load();
+            if (step <= done) {
+                continue;
+            }
+            servers.clear();
+            if (step == 1) {
+                // Existing servers are ignored.
+                servers.push_back(Node("127.0.0.1:9903"));
+                servers.push_back(Node("127.0.0.1:9901"));
+                actions->AddServers(servers);
+            } else if (step == 2) {
+                // Servers not added are ignored.
+                servers.push_back(Node("127.0.0.1:9902"));
+                servers.push_back(Node("127.0.0.1:9904"));
+                actions->RemoveServers(servers);
+            } else {
+                // Nothing is changed.
+                servers.push_back(Node("127.0.0.1:9903"));
+                servers.push_back(Node("127.0.0.1:9901"));
+                actions->ResetServers(servers);
+            }
+            done = step;
+            g_diff_done.store(done);
+        }
+        return 0;
+    }
+    brpc::NamingService* New() const { return new DiffNamingService; }
+    void Destroy() { delete this; }
+
+private:
+    static brpc::ServerNode Node(const char* addr) {
+        brpc::ServerNode node;
+        EXPECT_EQ(0, butil::str2endpoint(addr, &node.addr));
+        return node;
+    }
+};
+
+class CountingWatcher : public brpc::NamingServiceWatcher {
+public:
+    CountingWatcher() : nadded(0), nremoved(0) {}
+    void OnAddedServers(const std::vector<brpc::ServerId>& servers) {
+        nadded += servers.size();
+    }
+    void OnRemovedServers(const std::vector<brpc::ServerId>& servers) {
+        nremoved += servers.size();
+    }
+    butil::atomic<size_t> nadded;
+    butil::atomic<size_t> nremoved;
+};
+
+static void WaitDiffStep(int step) {
+    g_diff_step.store(step);
+    while (g_diff_done.load() < step) {
+        bthread_usleep(1000);
+    }
+}
+
+TEST(NamingServiceTest, add_and_remove_servers) {
+    brpc::NamingServiceExtension()->RegisterOrDie("diff", new DiffNamingService);
+    butil::intrusive_ptr<brpc::NamingServiceThread> nsthread;
+    ASSERT_EQ(0, brpc::GetNamingServiceThread(&nsthread, "diff://foo", NULL));
+    CountingWatcher watcher;
+    ASSERT_EQ(0, nsthread->AddWatcher(&watcher));
+    ASSERT_EQ(2u, watcher.nadded.load());
+
+    WaitDiffStep(1);
+    ASSERT_EQ(3u, watcher.nadded.load());
+    ASSERT_EQ(0u, watcher.nremoved.load());
+
+    WaitDiffStep(2);
+    ASSERT_EQ(3u, watcher.nadded.load());
+    ASSERT_EQ(1u, watcher.nremoved.load());
+
+    WaitDiffStep(3);
+    ASSERT_EQ(3u, watcher.nadded.load());
+    ASSERT_EQ(1u, watcher.nremoved.load());
+    ASSERT_EQ(0, nsthread->RemoveWatcher(&watcher));
+}
+
+// Returns servers after a while.
+class SlowNamingService : public brpc::NamingService {
+public:
+    int RunNamingService(const char*, brpc::NamingServiceActions* actions) {
+        if (bthread_usleep(300000) != 0) {
+            return 0;
+        }
+        std::vector<brpc::ServerNode> servers(1);
+        EXPECT_EQ(0, butil::str2endpoint("127.0.0.1:9911", &servers[0].addr));
+        actions->ResetServers(servers);
+        while (bthread_usleep(1000000) == 0) {}
+        return 0;
+    }
+    brpc::NamingService* New() const { return new SlowNamingService; }
+    void Destroy() { delete this; }
+};
+
+TEST(NamingServiceTest, not_wait_for_first_batch) {
+    brpc::NamingServiceExtension()->RegisterOrDie("slow", new SlowNamingService);
+    brpc::GetNamingServiceThreadOptions opt;
+    opt.wait_for_first_batch = false;
+    butil::Timer tm;
+    tm.start();
+    butil::intrusive_ptr<brpc::NamingServiceThread> nsthread;
+    ASSERT_EQ(0, brpc::GetNamingServiceThread(&nsthread, "slow://foo", &opt));
+    // Shared by the same url.
+    butil::intrusive_ptr<brpc::NamingServiceThread> nsthread2;
+    ASSERT_EQ(0, brpc::GetNamingServiceThread(&nsthread2, "slow://foo", &opt));
+    tm.stop();
+    ASSERT_LT(tm.m_elapsed(), 200);
+    ASSERT_EQ(nsthread.get(), nsthread2.get());
+    CountingWatcher watcher;
+    ASSERT_EQ(0, nsthread->AddWatcher(&watcher));
+    ASSERT_EQ(0u, watcher.nadded.load());
+
+    ASSERT_EQ(-1, nsthread->TimedWaitForFirstBatchOfServers(
+                  butil::gettimeofday_us() + 10000));
+    ASSERT_EQ(0, nsthread->TimedWaitForFirstBatchOfServers(-1));
+    ASSERT_EQ(1u, watcher.nadded.load());
+    ASSERT_EQ(0, nsthread->TimedWaitForFirstBatchOfServers(
+                  butil::gettimeofday_us()));
+    ASSERT_EQ(0, nsthread->RemoveWatcher(&watcher));
 }
 
 } //namespace
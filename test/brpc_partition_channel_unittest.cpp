@@ -0,0 +1,168 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdio.h>                          // sscanf
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "butil/string_printf.h"
+#include "bthread/bthread.h"
+#include "brpc/server.h"
+#include "brpc/controller.h"
+#include "brpc/partition_channel.h"
+#include "echo.pb.h"
+
+namespace {
+
+// Replicas of slow partitions sleep longer than the RPC timeout.
+const int SLOW_REPLICA_MS = 1000;
+const int TIMEOUT_MS = 500;
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    explicit EchoServiceImpl(int sleep_ms) : _sleep_ms(sleep_ms) {}
+
+    void Echo(google::protobuf::RpcController*,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        if (_sleep_ms > 0) {
+            bthread_usleep(_sleep_ms * 1000L);
+        }
+        response->set_message(request->message());
+    }
+
+private:
+    int _sleep_ms;
+};
+
+// "N/M" : #N partition of M partitions.
+class MyPartitionParser : public brpc::PartitionParser {
+public:
+    bool ParseFromTag(const std::string& tag, brpc::Partition* out) override {
+        return sscanf(tag.c_str(), "%d/%d", &out->index,
+                      &out->num_partition_kinds) == 2;
+    }
+};
+
+class PartitionChannelTest : public ::testing::Test {
+protected:
+    // Start a replica of partition `index' and add it to the naming
+    // service list.
+    void AddReplica(int index, int sleep_ms) {
+        EchoServiceImpl* service = new EchoServiceImpl(sleep_ms);
+        brpc::Server* server = new brpc::Server;
+        ASSERT_EQ(0, server->AddService(service,
+                                        brpc::SERVER_OWNS_SERVICE));
+        ASSERT_EQ(0, server->Start("127.0.0.1:0", NULL));
+        _servers.push_back(server);
+        if (!_ns_url.empty()) {
+            _ns_url.push_back(',');
+        }
+        butil::string_appendf(&_ns_url, "%s %d/2",
+                              butil::endpoint2str(server->listen_address()).c_str(),
+                              index);
+    }
+
+    void TearDown() override {
+        for (size_t i = 0; i < _servers.size(); ++i) {
+            _servers[i]->Stop(0);
+        }
+        for (size_t i = 0; i < _servers.size(); ++i) {
+            _servers[i]->Join();
+            delete _servers[i];
+        }
+    }
+
+    std::string ns_url() const { return "list://" + _ns_url; }
+
+    // Every call succeeds in time although some hit the slow replica.
+    void CallFast(brpc::ChannelBase* channel) {
+        test::EchoService_Stub stub(channel);
+        for (int i = 0; i < 10; ++i) {
+            brpc::Controller cntl;
+            test::EchoRequest req;
+            test::EchoResponse res;
+            req.set_message("hello");
+            butil::Timer tm;
+            tm.start();
+            stub.Echo(&cntl, &req, &res, NULL);
+            tm.stop();
+            ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+            ASSERT_EQ("hello", res.message());
+            ASSERT_LT(tm.m_elapsed(), TIMEOUT_MS);
+        }
+    }
+
+    std::vector<brpc::Server*> _servers;
+    std::string _ns_url;
+};
+
+TEST_F(PartitionChannelTest, backup_request_skips_slow_replica) {
+    // The first replica of partition 0 stalls, the other one does not.
+    AddReplica(0, SLOW_REPLICA_MS);
+    AddReplica(0, 0);
+    AddReplica(1, 0);
+    brpc::PartitionChannelOptions options;
+    options.timeout_ms = TIMEOUT_MS;
+    options.backup_request_ms = 50;
+    brpc::PartitionChannel channel;
+    ASSERT_EQ(0, channel.Init(2, new MyPartitionParser, ns_url().c_str(),
+                              "rr", &options));
+    CallFast(&channel);
+}
+
+TEST_F(PartitionChannelTest, success_limit_skips_slow_partition) {
+    AddReplica(0, 0);
+    // All replicas of partition 1 stall.
+    AddReplica(1, SLOW_REPLICA_MS);
+    brpc::PartitionChannelOptions options;
+    options.timeout_ms = TIMEOUT_MS;
+    options.success_limit = 1;
+    brpc::PartitionChannel channel;
+    ASSERT_EQ(0, channel.Init(2, new MyPartitionParser, ns_url().c_str(),
+                              "rr", &options));
+    CallFast(&channel);
+}
+
+TEST_F(PartitionChannelTest, dynamic_partition_channel_skips_slow_replica) {
+    AddReplica(0, SLOW_REPLICA_MS);
+    AddReplica(0, 0);
+    AddReplica(1, 0);
+    brpc::PartitionChannelOptions options;
+    options.timeout_ms = TIMEOUT_MS;
+    options.backup_request_ms = 50;
+    brpc::DynamicPartitionChannel channel;
+    ASSERT_EQ(0, channel.Init(new MyPartitionParser, ns_url().c_str(),
+                              "rr", &options));
+    CallFast(&channel);
+}
+
+TEST_F(PartitionChannelTest, dynamic_partition_channel_skips_slow_partition) {
+    AddReplica(0, 0);
+    AddReplica(1, SLOW_REPLICA_MS);
+    brpc::PartitionChannelOptions options;
+    options.timeout_ms = TIMEOUT_MS;
+    options.success_limit = 1;
+    brpc::DynamicPartitionChannel channel;
+    ASSERT_EQ(0, channel.Init(new MyPartitionParser, ns_url().c_str(),
+                              "rr", &options));
+    CallFast(&channel);
+}
+
+} // namespace
@@ -17,13 +17,20 @@
 
 // brpc - A framework to host and access services throughout Baidu.
 
+#include <inttypes.h>
 #include <gtest/gtest.h>
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/controller.h"
 #include "butil/strings/string_piece.h"
+#include "bvar/latency_histogram.h"
+#include "brpc/builtin/prometheus_metrics_service.h"
 #include "echo.pb.h"
 
+namespace brpc {
+DECLARE_int32(prometheus_metrics_cache_ms);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -45,7 +52,8 @@ enum STATE {
     HELP = 0,
     TYPE,
     GAUGE,
-    SUMMARY
+    SUMMARY,
+    HISTOGRAM
 };
 
 TEST(PrometheusMetrics, sanity) {
@@ -59,6 +67,9 @@ TEST(PrometheusMetrics, sanity) {
     ASSERT_EQ(0, server2.AddService(&echo_svc2, brpc::SERVER_DOESNT_OWN_SERVICE));
     ASSERT_EQ(0, server2.Start("127.0.0.1:8615", NULL));
 
+    bvar::LatencyHistogram histogram("prometheus_test_histogram");
+    histogram << 1 << 100 << 10000;
+
     brpc::Channel channel;
     brpc::ChannelOptions channel_opts;
     channel_opts.protocol = "http";
@@ -81,6 +92,9 @@ TEST(PrometheusMetrics, sanity) {
     bool summary_count_gathered = false;
     bool has_ever_summary = false;
     bool has_ever_gauge = false;
+    bool has_ever_histogram = false;
+    int64_t last_bucket_count = 0;
+    int64_t bucket_count = 0;
 
     while ((end_pos = res.find('\n', start_pos)) != butil::StringPiece::npos) {
         res[end_pos] = '\0';       // safe;
@@ -98,6 +112,9 @@ TEST(PrometheusMetrics, sanity) {
                     state = GAUGE;
                 } else if (strcmp(type, "summary") == 0) {
                     state = SUMMARY;
+                } else if (strcmp(type, "histogram") == 0) {
+                    state = HISTOGRAM;
+                    last_bucket_count = 0;
                 } else {
                     ASSERT_TRUE(false);
                 }
@@ -132,13 +149,67 @@ TEST(PrometheusMetrics, sanity) {
                     }
                 } // else find "quantile=", just break to next line
                 break;
+            case HISTOGRAM:
+                ASSERT_STREQ("prometheus_test_histogram", name_help);
+                if (butil::StringPiece(res.data() + start_pos, end_pos - start_pos).find("_bucket{le=")
+                        != butil::StringPiece::npos) {
+                    matched = sscanf(res.data() + start_pos, "%*s %" SCNd64, &bucket_count);
+                    ASSERT_EQ(1, matched);
+                    // Buckets are cumulative.
+                    ASSERT_LE(last_bucket_count, bucket_count);
+                    last_bucket_count = bucket_count;
+                } else {
+                    matched = sscanf(res.data() + start_pos, "%s %" SCNd64, name_type, &bucket_count);
+                    ASSERT_EQ(2, matched);
+                    if (butil::StringPiece(name_type).ends_with("_sum")) {
+                        ASSERT_EQ(10101, bucket_count);
+                    } else if (butil::StringPiece(name_type).ends_with("_count")) {
+                        ASSERT_EQ(3, bucket_count);
+                        ASSERT_EQ(3, last_bucket_count);
+                        state = HELP;
+                        has_ever_histogram = true;
+                    } else {
+                        ASSERT_TRUE(false);
+                    }
+                }
+                break;
             default:
                 ASSERT_TRUE(false);
                 break;
         }
         start_pos = end_pos + 1;
     }
-    ASSERT_TRUE(has_ever_gauge && has_ever_summary);
+    ASSERT_TRUE(has_ever_gauge && has_ever_summary && has_ever_histogram);
     ASSERT_EQ(0, server.Stop(0));
     ASSERT_EQ(0, server.Join());
 }
+
+TEST(PrometheusMetrics, filter_and_cache) {
+    bvar::Adder<int> a("prometheus_filter_test_a");
+    bvar::Adder<int> b("prometheus_filter_test_b");
+    a << 1;
+    bvar::DumpOptions options;
+    options.white_wildcards = "prometheus_filter_test_*";
+    options.black_wildcards = "*_b";
+    butil::IOBuf buf;
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf, &options));
+    ASSERT_EQ("# HELP prometheus_filter_test_a\n"
+              "# TYPE prometheus_filter_test_a gauge\n"
+              "prometheus_filter_test_a 1\n", buf.to_string());
+
+    brpc::FLAGS_prometheus_metrics_cache_ms = 60000;
+    buf.clear();
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf, &options));
+    const std::string cached = buf.to_string();
+    a << 1;
+    buf.clear();
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf, &options));
+    ASSERT_EQ(cached, buf.to_string());
+    // Different filters are rendered again.
+    options.black_wildcards.clear();
+    buf.clear();
+    ASSERT_EQ(0, brpc::DumpPrometheusMetricsToIOBuf(&buf, &options));
+    ASSERT_NE(std::string::npos, buf.to_string().find("prometheus_filter_test_a 2\n"));
+    ASSERT_NE(std::string::npos, buf.to_string().find("prometheus_filter_test_b 0\n"));
+    brpc::FLAGS_prometheus_metrics_cache_ms = 0;
+}
@@ -21,6 +21,8 @@
 #include <fstream>
 #include <string>
 #include <google/protobuf/text_format.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/dynamic_message.h>
 #include "butil/iobuf.h"
 #include "butil/third_party/rapidjson/rapidjson.h"
 #include "butil/time.h"
@@ -1471,4 +1473,199 @@ TEST_F(ProtobufJsonTest, string_to_int64) {
     ASSERT_EQ(person.data(), 1234567);
 }
 
+
+TEST_F(ProtobufJsonTest, duplicated_member_case) {
+    // The first member wins, same with searching members one by one.
+    std::string json = R"({"name":"first","id":9,"datadouble":2.2,"datafloat":1.0,"name":"second"})";
+    Person person;
+    std::string err;
+    ASSERT_TRUE(json2pb::JsonToProtoMessage(json, &person, &err)) << err;
+    ASSERT_EQ("first", person.name());
+
+    json = R"({"name":"hello","datadouble":2.2,"datafloat":1.0})";
+    ASSERT_FALSE(json2pb::JsonToProtoMessage(json, &person, &err));
+    ASSERT_EQ("Missing required field: addressbook.Person.id", err);
+}
+
+TEST_F(ProtobufJsonTest, dynamic_message_case) {
+    // Messages not in the generated pool are converted without cached plans.
+    google::protobuf::FileDescriptorProto file_proto;
+    Person::descriptor()->file()->CopyTo(&file_proto);
+    google::protobuf::DescriptorPool pool;
+    ASSERT_TRUE(pool.BuildFile(file_proto) != NULL);
+    const google::protobuf::Descriptor* desc =
+        pool.FindMessageTypeByName("addressbook.Person");
+    ASSERT_TRUE(desc != NULL);
+    google::protobuf::DynamicMessageFactory factory(&pool);
+    std::unique_ptr<google::protobuf::Message> msg(
+        factory.GetPrototype(desc)->New());
+    const std::string json =
+        "{\"name\":\"hello\",\"id\":9,\"datadouble\":2.2,\"datafloat\":1.0}";
+    std::string err;
+    ASSERT_TRUE(json2pb::JsonToProtoMessage(json, msg.get(), &err)) << err;
+    std::string output;
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(*msg, &output, &err)) << err;
+    ASSERT_EQ(json, output);
+}
+
+TEST_F(ProtobufJsonTest, iobuf_perf_case) {
+    AddressBook book;
+    for (int i = 0; i < 10; ++i) {
+        Person* p = book.add_person();
+        p->set_name("person_" + std::to_string(i));
+        p->set_id(i);
+        p->set_email("someone@apache.org");
+        p->set_datadouble(i * 1.5);
+        p->set_datafloat(i * 0.5f);
+        p->set_data(i * 100000000L);
+        Person::PhoneNumber* number = p->add_phone();
+        number->set_number("123456789");
+        number->set_type(Person::WORK);
+    }
+    const int times = 20000;
+    butil::Timer timer;
+    butil::IOBuf json;
+    std::string err;
+    timer.start();
+    for (int i = 0; i < times; ++i) {
+        json.clear();
+        butil::IOBufAsZeroCopyOutputStream wrapper(&json);
+        ASSERT_TRUE(json2pb::ProtoMessageToJson(book, &wrapper, &err)) << err;
+    }
+    timer.stop();
+    const int64_t pb2json_ns = timer.n_elapsed() / times;
+
+    timer.start();
+    for (int i = 0; i < times; ++i) {
+        AddressBook book2;
+        butil::IOBufAsZeroCopyInputStream wrapper(json);
+        ASSERT_TRUE(json2pb::JsonToProtoMessage(&wrapper, &book2, &err)) << err;
+        ASSERT_EQ(10, book2.person_size());
+    }
+    timer.stop();
+    const int64_t json2pb_ns = timer.n_elapsed() / times;
+
+    timer.start();
+    for (int i = 0; i < times; ++i) {
+        AddressBook book2;
+        butil::IOBufAsZeroCopyInputStream wrapper(json);
+        json2pb::JsonToProtoParser parser(&book2);
+        ASSERT_TRUE(parser.Parse(&wrapper) && parser.Finish()) << parser.error();
+        ASSERT_EQ(10, book2.person_size());
+    }
+    timer.stop();
+    const int64_t sax_json2pb_ns = timer.n_elapsed() / times;
+    printf("json of %zu bytes, pb to json: %" PRId64 "ns, json to pb: %" PRId64
+           "ns, json to pb by JsonToProtoParser: %" PRId64 "ns\n",
+           json.size(), pb2json_ns, json2pb_ns, sax_json2pb_ns);
+}
+
+
+// Parse `json' by JsonToProtoParser with data cut into pieces of `piece'
+// bytes, and check the result against JsonToProtoMessage().
+template <typename T>
+void CheckParserWithDom(const std::string& json, size_t piece) {
+    T dom_msg;
+    std::string dom_error;
+    const bool dom_ret = json2pb::JsonToProtoMessage(json, &dom_msg, &dom_error);
+
+    T sax_msg;
+    json2pb::JsonToProtoParser parser(&sax_msg);
+    bool sax_ret = true;
+    for (size_t i = 0; sax_ret && i < json.size(); i += piece) {
+        sax_ret = parser.Parse(json.data() + i, std::min(piece, json.size() - i));
+    }
+    sax_ret = sax_ret && parser.Finish();
+    ASSERT_EQ(dom_ret, sax_ret) << json << " error=" << parser.error();
+    ASSERT_EQ(dom_error, parser.error()) << json;
+    if (dom_ret) {
+        ASSERT_EQ(dom_msg.ShortDebugString(), sax_msg.ShortDebugString());
+    }
+}
+
+template <typename T>
+void CheckParserWithDom(const std::string& json) {
+    CheckParserWithDom<T>(json, json.size() + 1);
+    CheckParserWithDom<T>(json, 7);
+    CheckParserWithDom<T>(json, 1);
+}
+
+TEST_F(ProtobufJsonTest, json_to_pb_parser_case) {
+    const std::string context = "{\"content\":[{\"distance\":1,\"unknown_member\":2,\"ext\":"
+        "{\"age\":1666666666, \"databyte\":\"d2VsY29tZQ==\", \"enumtype\":1},"
+        "\"uid\":\"some\\\"one\\u4e2d\"},{\"distance\":10.5,\"unknown_member\":[{\"x\":[1]}],"
+        "\"ext\":{\"age\":1666666660, \"databyte\":\"d2VsY29tZTA=\","
+        "\"enumtype\":2},\"uid\":\"someone0\"}], \"judge\":false,"
+        " \"spur\":2, \"data\":[1,2,3,4,5,6,7,8,9,10]} ";
+    CheckParserWithDom<JsonContextBody>(context);
+
+    const std::string map_json = "{\"addr\":\"baidu.com\","
+        "\"numbers\":{\"tel\":123456,\"cell\":654321},"
+        "\"contacts\":{\"email\":\"frank@baidu.com\","
+        "               \"office\":\"Shanghai\"},"
+        "\"friends\":{\"John\":[{\"school\":\"SJTU\",\"year\":2007}]}}";
+    CheckParserWithDom<AddressNoMap>(map_json);
+    CheckParserWithDom<AddressIntMap>(map_json);
+    CheckParserWithDom<AddressStringMap>(map_json);
+    CheckParserWithDom<AddressComplex>(map_json);
+    CheckParserWithDom<AddressIntMap>("{\"addr\":\"baidu.com\","
+        "\"numbers\":[{\"key\":\"tel\",\"value\":123456},"
+        "             {\"key\":\"cell\",\"value\":654321}]}");
+
+    CheckParserWithDom<Person>(
+        "{\"name\":\"hello\",\"id\":9,\"data\":\"-123456789012\",\"datau64\":18446744073709551615,"
+        "\"datadouble\":-2.2e-3,\"datafloat\":\"Infinity\",\"hobby\":\"coding\",\"name\":\"x\"}");
+    // Errors of single fields.
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"datadouble\":2.2,\"datafloat\":1.0}");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":null,\"datadouble\":2.2,\"datafloat\":1}");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":[1],\"datadouble\":2.2,\"datafloat\":1}");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":1,\"datadouble\":2.2,\"datafloat\":1,"
+                               "\"email\":{\"a\":[1,{}]}}");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":1,\"datadouble\":2.2,\"datafloat\":1,"
+                               "\"phone\":{\"number\":\"123\"}}");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":1,\"datadouble\":2.2,\"datafloat\":1,"
+                               "\"phone\":[{\"number\":\"123\",\"type\":\"WORK\"}, 1]}");
+    // Invalid json
+    CheckParserWithDom<Person>("");
+    CheckParserWithDom<Person>("[1, 2]");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":1,\"datadouble\":2.2,\"datafloat\":1");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":1,\"datadouble\":2.2,\"datafloat\":1}}");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":1,\"datadouble\":2.2,\"datafloat\":1,}");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":1 \"datadouble\":2.2,\"datafloat\":1}");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":1,\"datadouble\":2.2,\"datafloat\":1e}");
+    CheckParserWithDom<Person>("{\"name\":\"hello\",\"id\":1,\"datadouble\":2.2,\"datafloat\":1,"
+                               "\"databool\":ture}");
+}
+
+TEST_F(ProtobufJsonTest, json_to_pb_parser_stream_case) {
+    AddressBook book;
+    for (int i = 0; i < 1000; ++i) {
+        Person* p = book.add_person();
+        p->set_name("person_" + std::to_string(i));
+        p->set_id(i);
+        p->set_datadouble(i * 1.5);
+        p->set_datafloat(i * 0.5f);
+        p->set_databyte(std::string(i, 'x'));
+    }
+    butil::IOBuf json;
+    {
+        butil::IOBufAsZeroCopyOutputStream wrapper(&json);
+        ASSERT_TRUE(json2pb::ProtoMessageToJson(book, &wrapper));
+    }
+    ASSERT_GT(json.backing_block_num(), 1u);
+
+    // Parse the json as it arrives piece by piece.
+    AddressBook book2;
+    json2pb::JsonToProtoParser parser(&book2);
+    butil::IOBuf arrived;
+    while (!json.empty()) {
+        json.cutn(&arrived, 1000);
+        butil::IOBufAsZeroCopyInputStream wrapper(arrived);
+        ASSERT_TRUE(parser.Parse(&wrapper)) << parser.error();
+        arrived.clear();
+    }
+    ASSERT_TRUE(parser.Finish()) << parser.error();
+    ASSERT_EQ(book.SerializeAsString(), book2.SerializeAsString());
+}
+
 }
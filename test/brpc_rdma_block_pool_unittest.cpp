@@ -0,0 +1,80 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/iobuf.h"
+#include "brpc/rdma/block_pool.h"
+
+namespace brpc {
+namespace rdma {
+DECLARE_int32(rdma_memory_region_size_mb);
+DECLARE_int32(rdma_max_memory_regions);
+}
+}
+
+namespace {
+
+int g_nregistered = 0;
+
+uint32_t DummyRegisterMemory(void*, size_t) {
+    return ++g_nregistered + 100;
+}
+
+TEST(RdmaBlockPoolTest, allocate_from_regions) {
+    brpc::rdma::FLAGS_rdma_memory_region_size_mb = 1;
+    brpc::rdma::FLAGS_rdma_max_memory_regions = 2;
+    const size_t nblock_per_region = (1 << 20) / butil::IOBuf::DEFAULT_BLOCK_SIZE;
+    void* malloced = malloc(16);
+    ASSERT_EQ(-1, brpc::rdma::InitBlockPool(NULL));
+    ASSERT_EQ(0, brpc::rdma::InitBlockPool(DummyRegisterMemory));
+    ASSERT_EQ(-1, brpc::rdma::InitBlockPool(DummyRegisterMemory));
+    ASSERT_EQ(1, g_nregistered);
+    ASSERT_EQ(nblock_per_region, brpc::rdma::GetFreeBlockCount());
+    ASSERT_EQ(0u, brpc::rdma::GetRegionId(malloced));
+    free(malloced);
+
+    // Blocks of IOBuf come from the regions now.
+    {
+        butil::IOBuf buf;
+        buf.append(std::string(4 * butil::IOBuf::DEFAULT_BLOCK_SIZE, 'a'));
+        ASSERT_LT(1u, buf.backing_block_num());
+        for (size_t i = 0; i < buf.backing_block_num(); ++i) {
+            ASSERT_EQ(101u, brpc::rdma::GetRegionId(buf.backing_block(i).data()));
+        }
+    }
+
+    // Use up all regions, then fall back to malloc.
+    std::vector<void*> blocks;
+    for (size_t i = 0; i < 2 * nblock_per_region + 1; ++i) {
+        blocks.push_back(brpc::rdma::AllocBlock(butil::IOBuf::DEFAULT_BLOCK_SIZE));
+    }
+    ASSERT_EQ(2, g_nregistered);
+    ASSERT_EQ(0u, brpc::rdma::GetFreeBlockCount());
+    ASSERT_EQ(0u, brpc::rdma::GetRegionId(blocks.back()));
+    ASSERT_EQ(102u, brpc::rdma::GetRegionId(blocks[blocks.size() - 2]));
+    void* other_size = brpc::rdma::AllocBlock(100);
+    ASSERT_EQ(0u, brpc::rdma::GetRegionId(other_size));
+    brpc::rdma::DeallocBlock(other_size);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        brpc::rdma::DeallocBlock(blocks[i]);
+    }
+    // Some blocks are cached by IOBuf in TLS.
+    ASSERT_LE(2 * nblock_per_region - 8, brpc::rdma::GetFreeBlockCount());
+}
+
+} // namespace
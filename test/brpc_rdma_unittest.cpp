@@ -0,0 +1,178 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <gtest/gtest.h>
+#include "bvar/variable.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/rdma/rdma_endpoint.h"
+#include "brpc/rdma/rdma_helper.h"
+#include "echo.pb.h"
+
+namespace {
+
+// Layout of RdmaHello: magic, then fields in network byte order.
+const size_t RDMA_HELLO_SIZE = 44;
+
+TEST(RdmaTest, read_hello) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    // Bytes of other protocols are read as usual.
+    ASSERT_EQ(8, write(fds[0], "PRPC1234", 8));
+    butil::IOBuf buf;
+    bool is_hello = true;
+    brpc::rdma::RdmaEndpoint* ep = NULL;
+    ASSERT_EQ(8, brpc::rdma::RdmaEndpoint::ReadHello(
+                  fds[1], &buf, true, &is_hello, &ep));
+    ASSERT_FALSE(is_hello);
+    ASSERT_TRUE(ep == NULL);
+    ASSERT_EQ("PRPC1234", buf.to_string());
+
+    // An incomplete hello is left in the socket.
+    char hello[RDMA_HELLO_SIZE];
+    memset(hello, 0, sizeof(hello));
+    memcpy(hello, "BRPCRDMH", 8);
+    ASSERT_EQ(10, write(fds[0], hello, 10));
+    buf.clear();
+    errno = 0;
+    ASSERT_EQ(-1, brpc::rdma::RdmaEndpoint::ReadHello(
+                  fds[1], &buf, false, &is_hello, &ep));
+    ASSERT_EQ(EAGAIN, errno);
+    ASSERT_TRUE(buf.empty());
+
+    // The hello is declined without an endpoint.
+    ASSERT_EQ((ssize_t)sizeof(hello) - 10,
+              write(fds[0], hello + 10, sizeof(hello) - 10));
+    ASSERT_EQ((ssize_t)sizeof(hello), brpc::rdma::RdmaEndpoint::ReadHello(
+                  fds[1], &buf, false, &is_hello, &ep));
+    ASSERT_TRUE(is_hello);
+    ASSERT_TRUE(ep == NULL);
+    ASSERT_TRUE(buf.empty());
+    ASSERT_EQ(0, brpc::rdma::RdmaEndpoint::SendReply(fds[1], NULL));
+    char reply[RDMA_HELLO_SIZE];
+    ASSERT_EQ((ssize_t)sizeof(reply), read(fds[0], reply, sizeof(reply)));
+    ASSERT_EQ(0, memcmp(reply, "BRPCRDMD", 8));
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        response->set_message(request->message());
+        cntl->response_attachment().append(cntl->request_attachment());
+    }
+};
+
+int64_t RdmaConnectionCount() {
+    const std::string value =
+        bvar::Variable::describe_exposed("rpc_rdma_connection_count");
+    return value.empty() ? 0 : atoll(value.c_str());
+}
+
+void EchoThroughChannel(brpc::Channel* channel) {
+    test::EchoService_Stub stub(channel);
+    for (int i = 0; i < 10; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("hello");
+        // Spans many receive buffers.
+        const std::string attachment(100000 + i, 'a' + i);
+        cntl.request_attachment().append(attachment);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("hello", res.message());
+        ASSERT_EQ(attachment, cntl.response_attachment().to_string());
+    }
+}
+
+class RdmaEchoTest : public ::testing::Test {
+protected:
+    void StartServer(bool use_rdma) {
+        ASSERT_EQ(0, _server.AddService(&_service,
+                                        brpc::SERVER_DOESNT_OWN_SERVICE));
+        brpc::ServerOptions options;
+        options.use_rdma = use_rdma;
+        ASSERT_EQ(0, _server.Start("127.0.0.1:0", &options));
+    }
+
+    void TearDown() override {
+        _server.Stop(0);
+        _server.Join();
+    }
+
+    EchoServiceImpl _service;
+    brpc::Server _server;
+};
+
+TEST_F(RdmaEchoTest, echo_with_rdma) {
+    StartServer(true);
+    const int64_t count0 = RdmaConnectionCount();
+    brpc::ChannelOptions options;
+    options.use_rdma = true;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(_server.listen_address(), &options));
+    EchoThroughChannel(&channel);
+    if (brpc::rdma::InitRdma()) {
+        // Both sides of the connection.
+        ASSERT_EQ(count0 + 2, RdmaConnectionCount());
+    } else {
+        // Fell back to TCP.
+        ASSERT_EQ(count0, RdmaConnectionCount());
+    }
+}
+
+TEST_F(RdmaEchoTest, declined_without_server_option) {
+    StartServer(false);
+    const int64_t count0 = RdmaConnectionCount();
+    // The connection works as an ordinary TCP connection.
+    brpc::ChannelOptions options;
+    options.use_rdma = true;
+    options.connection_group = "declined";
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(_server.listen_address(), &options));
+    EchoThroughChannel(&channel);
+    ASSERT_EQ(count0, RdmaConnectionCount());
+}
+
+TEST_F(RdmaEchoTest, plain_client) {
+    StartServer(true);
+    const int64_t count0 = RdmaConnectionCount();
+    // Clients without the option talk to the server as usual.
+    brpc::ChannelOptions options;
+    options.connection_group = "plain";
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(_server.listen_address(), &options));
+    EchoThroughChannel(&channel);
+    ASSERT_EQ(count0, RdmaConnectionCount());
+}
+
+} // namespace
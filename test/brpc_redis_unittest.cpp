@@ -25,10 +25,12 @@
 #include <brpc/policy/redis_authenticator.h>
 #include <brpc/server.h>
 #include <brpc/redis_command.h>
+#include <brpc/redis_cluster_channel.h>
 #include <gtest/gtest.h>
 
 namespace brpc {
 DECLARE_int32(idle_timeout_second);
+DECLARE_int32(redis_reply_iobuf_threshold);
 }
 
 int main(int argc, char* argv[]) {
@@ -113,6 +115,8 @@ void AssertReplyEqual(const brpc::RedisReply& reply1,
     CHECK_EQ(reply1.type(), reply2.type());
     switch (reply1.type()) {
     case brpc::REDIS_REPLY_ARRAY:
+        // fall through
+    case brpc::REDIS_REPLY_PUSH:
         ASSERT_EQ(reply1.size(), reply2.size());
         for (size_t j = 0; j < reply1.size(); ++j) {
             ASSERT_NE(&reply1[j], &reply2[j]); // from different arena
@@ -635,6 +639,108 @@ TEST_F(RedisTest, command_parser) {
     }
 }
 
+TEST_F(RedisTest, cluster_hash_slot) {
+    // Values from https://redis.io/docs/reference/cluster-spec/
+    ASSERT_EQ(0x31C3, brpc::RedisClusterChannel::GetHashSlot("123456789"));
+    ASSERT_EQ(12182, brpc::RedisClusterChannel::GetHashSlot("foo"));
+    ASSERT_EQ(brpc::RedisClusterChannel::GetHashSlot("user1000"),
+              brpc::RedisClusterChannel::GetHashSlot("{user1000}.following"));
+    ASSERT_EQ(brpc::RedisClusterChannel::GetHashSlot("{user1000}.followers"),
+              brpc::RedisClusterChannel::GetHashSlot("{user1000}.following"));
+    ASSERT_EQ(brpc::RedisClusterChannel::GetHashSlot("bar"),
+              brpc::RedisClusterChannel::GetHashSlot("foo{bar}{zap}"));
+    ASSERT_EQ(brpc::RedisClusterChannel::GetHashSlot("{bar"),
+              brpc::RedisClusterChannel::GetHashSlot("foo{{bar}}zap"));
+    // Empty tags are not hash tags.
+    ASSERT_NE(brpc::RedisClusterChannel::GetHashSlot("bar"),
+              brpc::RedisClusterChannel::GetHashSlot("{}bar"));
+}
+
+TEST_F(RedisTest, merge_replies) {
+    brpc::RedisResponse r1;
+    brpc::RedisResponse r2;
+    butil::IOBuf buf;
+    buf.append(":1\r\n:2\r\n");
+    ASSERT_EQ(brpc::PARSE_OK, r1.ConsumePartialIOBuf(buf, 2));
+    buf.append("+OK\r\n$3\r\nabc\r\n");
+    ASSERT_EQ(brpc::PARSE_OK, r2.ConsumePartialIOBuf(buf, 2));
+    const brpc::RedisReply* replies[] = {
+        &r2.reply(1), &r1.reply(0), &r2.reply(0), &r1.reply(1) };
+    brpc::RedisResponse merged;
+    merged.MergeReplies(replies, 4);
+    ASSERT_EQ(4, merged.reply_size());
+    ASSERT_EQ("abc", merged.reply(0).data());
+    ASSERT_EQ(1, merged.reply(1).integer());
+    ASSERT_EQ("OK", merged.reply(2).data());
+    ASSERT_EQ(2, merged.reply(3).integer());
+}
+
+TEST_F(RedisTest, resp3_and_push) {
+    butil::Arena arena;
+    butil::IOBuf buf;
+    buf.append("_\r\n#t\r\n,3.14\r\n(12345678901234567890\r\n"
+               "=15\r\ntxt:Some string\r\n!3\r\nERR\r\n"
+               "%1\r\n+k\r\n:1\r\n~2\r\n:1\r\n:2\r\n");
+    brpc::RedisReply r(&arena);
+    ASSERT_EQ(brpc::PARSE_OK, r.ConsumePartialIOBuf(buf));
+    ASSERT_TRUE(r.is_nil());
+    r.Reset();
+    ASSERT_EQ(brpc::PARSE_OK, r.ConsumePartialIOBuf(buf));
+    ASSERT_EQ(1, r.integer());
+    r.Reset();
+    ASSERT_EQ(brpc::PARSE_OK, r.ConsumePartialIOBuf(buf));
+    ASSERT_EQ("3.14", r.data());
+    r.Reset();
+    ASSERT_EQ(brpc::PARSE_OK, r.ConsumePartialIOBuf(buf));
+    ASSERT_EQ("12345678901234567890", r.data());
+    r.Reset();
+    ASSERT_EQ(brpc::PARSE_OK, r.ConsumePartialIOBuf(buf));
+    ASSERT_EQ("Some string", r.data());
+    r.Reset();
+    ASSERT_EQ(brpc::PARSE_OK, r.ConsumePartialIOBuf(buf));
+    ASSERT_TRUE(r.is_error());
+    ASSERT_STREQ("ERR", r.error_message());
+    r.Reset();
+    ASSERT_EQ(brpc::PARSE_OK, r.ConsumePartialIOBuf(buf));
+    ASSERT_TRUE(r.is_array());
+    ASSERT_EQ(2u, r.size());
+    ASSERT_EQ("k", r[0].data());
+    r.Reset();
+    ASSERT_EQ(brpc::PARSE_OK, r.ConsumePartialIOBuf(buf));
+    ASSERT_TRUE(r.is_array());
+    ASSERT_EQ(2, r[1].integer());
+    ASSERT_TRUE(buf.empty());
+
+    // Push messages before and between replies are moved aside, partial
+    // ones included.
+    const std::string input =
+        ">2\r\n$10\r\ninvalidate\r\n*1\r\n$1\r\na\r\n"
+        "+OK\r\n>2\r\n$10\r\ninvalidate\r\n_\r\n$1\r\nb\r\n";
+    brpc::RedisResponse response;
+    for (size_t i = 0; i < input.size(); ++i) {
+        buf.push_back(input[i]);
+        brpc::ParseError err = response.ConsumePartialIOBuf(buf, 2);
+        ASSERT_EQ(i + 1 == input.size() ? brpc::PARSE_OK
+                  : brpc::PARSE_ERROR_NOT_ENOUGH_DATA, err);
+    }
+    ASSERT_EQ(2, response.reply_size());
+    ASSERT_EQ("OK", response.reply(0).data());
+    ASSERT_EQ("b", response.reply(1).data());
+    ASSERT_EQ(2, response.push_size());
+    ASSERT_TRUE(response.push(0).is_push());
+    ASSERT_EQ("invalidate", response.push(0)[0].data());
+    ASSERT_EQ("a", response.push(0)[1][0].data());
+    ASSERT_TRUE(response.push(1)[1].is_nil());
+
+    // Only pushes are consumed without replies expected.
+    brpc::RedisResponse pushes;
+    buf.append(">1\r\n+x\r\n:1\r\n");
+    ASSERT_EQ(brpc::PARSE_OK, pushes.ConsumePartialIOBuf(buf, 0));
+    ASSERT_EQ(0, pushes.reply_size());
+    ASSERT_EQ(1, pushes.push_size());
+    ASSERT_EQ(":1\r\n", buf.to_string());
+}
+
 TEST_F(RedisTest, redis_reply_codec) {
     butil::Arena arena;
     // status
@@ -807,6 +913,67 @@ TEST_F(RedisTest, redis_reply_codec) {
     }
 }
 
+TEST_F(RedisTest, redis_reply_referencing_iobuf) {
+    const int saved_threshold = brpc::FLAGS_redis_reply_iobuf_threshold;
+    brpc::FLAGS_redis_reply_iobuf_threshold = 32;
+    const std::string large(100 * 1024, 'x');
+    const std::string medium(20, 'y');
+    butil::IOBuf buf;
+    buf.append("*3\r\n$");
+    buf.append(std::to_string(large.size()));
+    buf.append("\r\n");
+    buf.append(large);
+    buf.append("\r\n$20\r\n");
+    buf.append(medium);
+    buf.append("\r\n:1\r\n");
+    {
+        butil::Arena arena;
+        brpc::RedisReply r(&arena);
+        // Feed the bytes in pieces to exercise the suspended parsing.
+        butil::IOBuf partial;
+        butil::IOBuf left = buf;
+        brpc::ParseError err = brpc::PARSE_ERROR_NOT_ENOUGH_DATA;
+        while (err == brpc::PARSE_ERROR_NOT_ENOUGH_DATA && !left.empty()) {
+            left.cutn(&partial, 4096);
+            err = r.ConsumePartialIOBuf(partial);
+        }
+        ASSERT_EQ(brpc::PARSE_OK, err);
+        ASSERT_TRUE(partial.empty());
+        ASSERT_TRUE(left.empty());
+        ASSERT_TRUE(r.is_array());
+        ASSERT_EQ(3ul, r.size());
+
+        const butil::IOBuf* data = r[0].iobuf_data();
+        ASSERT_TRUE(data != NULL);
+        ASSERT_EQ(large, data->to_string());
+        butil::IOBuf out;
+        ASSERT_TRUE(r[0].AppendDataTo(&out));
+        ASSERT_EQ(large, out.to_string());
+        // Flattened on demand.
+        ASSERT_EQ(large, r[0].data().as_string());
+        ASSERT_EQ(large.size(), strlen(r[0].c_str()));
+
+        // Shorter than the threshold, copied.
+        ASSERT_TRUE(r[1].iobuf_data() == NULL);
+        ASSERT_EQ(medium, r[1].data().as_string());
+        ASSERT_EQ(1, r[2].integer());
+
+        // Serialize back to the same bytes.
+        butil::IOBufAppender appender;
+        ASSERT_TRUE(r.SerializeTo(&appender));
+        butil::IOBuf serialized;
+        appender.move_to(serialized);
+        ASSERT_EQ(buf.to_string(), serialized.to_string());
+
+        butil::Arena arena2;
+        brpc::RedisReply r2(&arena2);
+        r2.CopyFromDifferentArena(r);
+        ASSERT_TRUE(r2[0].iobuf_data() == NULL);
+        ASSERT_EQ(large, r2[0].data().as_string());
+    }
+    brpc::FLAGS_redis_reply_iobuf_threshold = saved_threshold;
+}
+
 butil::Mutex s_mutex;
 std::unordered_map<std::string, std::string> m;
 std::unordered_map<std::string, int64_t> int_map;
@@ -1238,4 +1405,55 @@ TEST_F(RedisTest, server_handle_pipeline) {
     ASSERT_STREQ(response.reply(7).c_str(), "world");
 }
 
+
+class SlowIncrCommandHandler : public IncrCommandHandler {
+public:
+    brpc::RedisCommandHandlerResult Run(const std::vector<butil::StringPiece>& args,
+                                        brpc::RedisReply* output,
+                                        bool flush_batched) override {
+        bthread_usleep(100000);
+        return IncrCommandHandler::Run(args, output, flush_batched);
+    }
+
+    bool AllowConcurrentRun() const override { return true; }
+};
+
+TEST_F(RedisTest, server_concurrent_commands) {
+    brpc::Server server;
+    brpc::ServerOptions server_options;
+    RedisServiceImpl* rsimpl = new RedisServiceImpl;
+    rsimpl->AddCommandHandler("incr", new SlowIncrCommandHandler);
+    server_options.redis_service = rsimpl;
+    brpc::PortRange pr(8081, 8900);
+    ASSERT_EQ(0, server.Start("127.0.0.1", pr, &server_options));
+
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_REDIS;
+    options.timeout_ms = 5000;
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1", server.listen_address().port, &options));
+
+    brpc::RedisRequest request;
+    brpc::RedisResponse response;
+    brpc::Controller cntl;
+    const int N = 8;
+    for (int i = 0; i < N; ++i) {
+        ASSERT_TRUE(request.AddCommand("incr concurrent_key%d", i));
+    }
+    // Commands with a same key are not run concurrently.
+    ASSERT_TRUE(request.AddCommand("incr concurrent_key0"));
+    butil::Timer timer;
+    timer.start();
+    channel.CallMethod(NULL, &cntl, &request, &response, NULL);
+    timer.stop();
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(N + 1, response.reply_size());
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(1, response.reply(i).integer());
+    }
+    ASSERT_EQ(2, response.reply(N).integer());
+    // Running sequentially takes 900ms.
+    ASSERT_LT(timer.m_elapsed(), 500);
+}
+
 } //namespace
@@ -863,3 +863,142 @@ TEST(RtmpTest, retrying_stream) {
     }
     LOG(INFO) << "Quiting program...";
 }
+
+class FanoutPlayingStream : public brpc::RtmpServerStream {
+public:
+    explicit FanoutPlayingStream(brpc::RtmpFanout* fanout) : _fanout(fanout) {}
+    void OnPlay(const brpc::RtmpPlayOptions&,
+                butil::Status* status,
+                google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        if (_fanout->AddPlayer(this) != 0) {
+            status->set_error(EINVAL, "Fail to add player");
+        }
+    }
+    void OnStop() {
+        _fanout->RemovePlayer(this);
+    }
+private:
+    brpc::RtmpFanout* _fanout;
+};
+
+class FanoutService : public brpc::RtmpService {
+public:
+    brpc::RtmpFanout fanout;
+private:
+    virtual brpc::RtmpServerStream* NewStream(
+        const brpc::RtmpConnectRequest&) {
+        return new FanoutPlayingStream(&fanout);
+    }
+};
+
+class FanoutClientStream : public brpc::RtmpClientStream {
+public:
+    FanoutClientStream() : nvideo(0), naudio(0), nbad(0) {}
+    void OnVideoMessage(brpc::RtmpVideoMessage* msg) {
+        if (msg->data.to_string() != std::string(msg->data.size(), 'v')) {
+            ++nbad;
+        }
+        ++nvideo;
+    }
+    void OnAudioMessage(brpc::RtmpAudioMessage* msg) {
+        if (msg->data.to_string() != std::string(msg->data.size(), 'a')) {
+            ++nbad;
+        }
+        ++naudio;
+    }
+    butil::atomic<int> nvideo;
+    butil::atomic<int> naudio;
+    butil::atomic<int> nbad;
+};
+
+static void SendFanoutFrame(brpc::RtmpFanout* fanout, uint32_t timestamp,
+                            bool keyframe) {
+    brpc::RtmpVideoMessage vmsg;
+    vmsg.timestamp = timestamp;
+    vmsg.frame_type = (keyframe ? brpc::FLV_VIDEO_FRAME_KEYFRAME :
+                       brpc::FLV_VIDEO_FRAME_INTERFRAME);
+    vmsg.codec = brpc::FLV_VIDEO_SORENSON_H263;
+    // Longer than the chunk size.
+    vmsg.data.append(std::string(10000, 'v'));
+    ASSERT_EQ(0, fanout->SendVideoMessage(vmsg));
+    brpc::RtmpAudioMessage amsg;
+    amsg.timestamp = timestamp;
+    amsg.codec = brpc::FLV_AUDIO_MP3;
+    amsg.rate = brpc::FLV_SOUND_RATE_44100HZ;
+    amsg.bits = brpc::FLV_SOUND_16BIT;
+    amsg.type = brpc::FLV_SOUND_STEREO;
+    amsg.data.append("aaaa");
+    ASSERT_EQ(0, fanout->SendAudioMessage(amsg));
+}
+
+static void WaitForMessages(FanoutClientStream* stream, int n) {
+    for (int i = 0; i < 500 && (stream->nvideo.load() < n ||
+                                stream->naudio.load() < n); ++i) {
+        usleep(10000);
+    }
+}
+
+TEST(RtmpTest, fanout_with_gop_cache) {
+    FanoutService rtmp_service;
+    brpc::Server server;
+    brpc::ServerOptions server_opt;
+    server_opt.rtmp_service = &rtmp_service;
+    ASSERT_EQ(0, server.Start(8577, &server_opt));
+
+    brpc::RtmpClientOptions rtmp_opt;
+    rtmp_opt.app = "hello";
+    rtmp_opt.swfUrl = "anything";
+    rtmp_opt.tcUrl = "rtmp://heheda";
+    brpc::RtmpClient rtmp_client;
+    ASSERT_EQ(0, rtmp_client.Init("localhost:8577", rtmp_opt));
+
+    // Frames before the first keyframe are not cached.
+    SendFanoutFrame(&rtmp_service.fanout, 1000, false);
+    SendFanoutFrame(&rtmp_service.fanout, 1020, true);
+
+    const int NSTREAM = 2;
+    brpc::DestroyingPtr<FanoutClientStream> cstreams[NSTREAM];
+    cstreams[0].reset(new FanoutClientStream);
+    brpc::RtmpClientStreamOptions opt;
+    opt.play_name = "fanout";
+    opt.wait_until_play_or_publish_is_sent = true;
+    cstreams[0]->Init(&rtmp_client, opt);
+    WaitForMessages(cstreams[0].get(), 1);
+    ASSERT_EQ(1, cstreams[0]->nvideo.load());
+    ASSERT_EQ(1, cstreams[0]->naudio.load());
+
+    SendFanoutFrame(&rtmp_service.fanout, 1040, false);
+    WaitForMessages(cstreams[0].get(), 2);
+    ASSERT_EQ(2, cstreams[0]->nvideo.load());
+
+    // The new player gets the cached GOP.
+    cstreams[1].reset(new FanoutClientStream);
+    cstreams[1]->Init(&rtmp_client, opt);
+    WaitForMessages(cstreams[1].get(), 2);
+    ASSERT_EQ(2, cstreams[1]->nvideo.load());
+    ASSERT_EQ(2, cstreams[1]->naudio.load());
+
+    SendFanoutFrame(&rtmp_service.fanout, 1060, false);
+    for (int i = 0; i < NSTREAM; ++i) {
+        WaitForMessages(cstreams[i].get(), 3);
+        ASSERT_EQ(3, cstreams[i]->nvideo.load());
+        ASSERT_EQ(3, cstreams[i]->naudio.load());
+        ASSERT_EQ(0, cstreams[i]->nbad.load());
+    }
+    std::vector<brpc::RtmpFanoutPlayerStats> stats;
+    rtmp_service.fanout.GetPlayerStats(&stats);
+    ASSERT_EQ(2u, stats.size());
+    for (size_t i = 0; i < stats.size(); ++i) {
+        ASSERT_EQ(6, stats[i].sent_messages);
+        ASSERT_EQ(0, stats[i].dropped_messages);
+        ASSERT_EQ(0, stats[i].lag_ms);
+    }
+    for (int i = 0; i < NSTREAM; ++i) {
+        cstreams[i]->Destroy();
+    }
+    for (int i = 0; i < 500 && rtmp_service.fanout.player_count() != 0; ++i) {
+        usleep(10000);
+    }
+    ASSERT_EQ(0u, rtmp_service.fanout.player_count());
+}
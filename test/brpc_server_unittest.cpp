@@ -21,14 +21,19 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <algorithm>
 #include <fstream>
+#include <map>
 #include <gtest/gtest.h>
 #include <google/protobuf/descriptor.h>
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "butil/fd_guard.h"
 #include "butil/files/scoped_file.h"
+#include "bthread/countdown_event.h"
+#include "bthread/unstable.h"
 #include "brpc/socket.h"
+#include "brpc/acceptor.h"
 #include "brpc/builtin/version_service.h"
 #include "brpc/builtin/health_service.h"
 #include "brpc/builtin/list_service.h"
@@ -47,16 +52,34 @@
 #include "brpc/builtin/sockets_service.h"      // SocketsService
 #include "brpc/builtin/bad_method_service.h"
 #include "brpc/server.h"
+#include "brpc/baidu_master_service.h"
+#include "brpc/raw_service.h"
 #include "brpc/restful.h"
 #include "brpc/channel.h"
 #include "brpc/socket_map.h"
 #include "brpc/controller.h"
+#include "brpc/progressive_reader.h"
+#include "brpc/request_batcher.h"
+#include "brpc/details/rpc_deadline.h"
+#include "brpc/details/method_executor.h"
+#include "brpc/policy/auto_concurrency_limiter.h"
+#include "brpc/policy/gradient_concurrency_limiter.h"
 #include "echo.pb.h"
 #include "v1.pb.h"
 #include "v2.pb.h"
 
+DECLARE_int32(task_group_ntags);
+
+namespace brpc {
+DECLARE_int32(event_dispatcher_num);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
+    // Two shards of the shared-nothing server run on tags 1 and 2. Must be
+    // set before any bthread or dispatcher is created.
+    FLAGS_task_group_ntags = 3;
+    brpc::FLAGS_event_dispatcher_num = 2;
     GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
     return RUN_ALL_TESTS();
 }
@@ -64,6 +87,7 @@ int main(int argc, char* argv[]) {
 namespace brpc {
 DECLARE_bool(enable_threads_service);
 DECLARE_bool(enable_dir_service);
+DECLARE_bool(rpc_server_phase_latency);
 }
 
 namespace {
@@ -436,6 +460,288 @@ TEST_F(ServerTest, services_in_different_ns) {
 #endif
 }
 
+TEST_F(ServerTest, response_cache) {
+    const int port = 9201;
+    brpc::Server server;
+    EchoServiceV1 service_v1;
+    ASSERT_EQ(0, server.AddService(&service_v1, brpc::SERVER_DOESNT_OWN_SERVICE));
+    brpc::ServerOptions options;
+    options.mutable_response_cache_options()->method_policies[
+        "v1.EchoService.Echo"].ttl_ms = 100000;
+    ASSERT_EQ(0, server.Start(port, &options));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    v1::EchoService_Stub stub(&channel);
+    for (int i = 0; i < 3; ++i) {
+        brpc::Controller cntl;
+        v1::EchoRequest req;
+        v1::EchoResponse res;
+        req.set_message("foo");
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("foo_v1", res.message());
+    }
+    ASSERT_EQ(1, service_v1.ncalled.load());
+    {
+        // Different requests are not answered with the cached response.
+        brpc::Controller cntl;
+        v1::EchoRequest req;
+        v1::EchoResponse res;
+        req.set_message("bar");
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("bar_v1", res.message());
+        ASSERT_EQ(2, service_v1.ncalled.load());
+    }
+    {
+        // Other methods are not cached.
+        brpc::Controller cntl;
+        v1::EchoRequest req;
+        v1::EchoResponse res;
+        req.set_message("foo");
+        stub.Echo2(&cntl, &req, &res, NULL);
+        stub.Echo2(&cntl, &req, &res, NULL);
+        ASSERT_EQ(2, service_v1.ncalled_echo2.load());
+    }
+
+    brpc::Channel http_channel;
+    brpc::ChannelOptions chan_options;
+    chan_options.protocol = "http";
+    ASSERT_EQ(0, http_channel.Init("0.0.0.0", port, &chan_options));
+    for (int i = 0; i < 3; ++i) {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = "/v1.EchoService/Echo";
+        cntl.http_request().set_method(brpc::HTTP_METHOD_POST);
+        cntl.request_attachment().append("{\"message\":\"foo\"}");
+        http_channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("{\"message\":\"foo_v1\"}",
+                  cntl.response_attachment().to_string());
+    }
+    ASSERT_EQ(3, service_v1.ncalled.load());
+    server.Stop(0);
+    server.Join();
+}
+
+// Relays requests to `channel' without parsing them.
+class RelayMasterService : public brpc::BaiduMasterService {
+public:
+    explicit RelayMasterService(brpc::Channel* channel)
+        : _channel(channel), ncalled(0) {}
+
+    void ProcessRpcRequest(brpc::Controller* cntl,
+                           const std::string& service_name,
+                           const std::string& method_name,
+                           const brpc::SerializedRequest* request,
+                           brpc::SerializedResponse* response,
+                           google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        ncalled.fetch_add(1, butil::memory_order_relaxed);
+        brpc::Controller backend_cntl;
+        brpc::SetRawBaiduStdMethod(&backend_cntl, service_name, method_name,
+                                   cntl->request_compress_type());
+        backend_cntl.request_attachment().swap(cntl->request_attachment());
+        _channel->CallMethod(NULL, &backend_cntl, request, response, NULL);
+        if (backend_cntl.Failed()) {
+            cntl->SetFailed(backend_cntl.ErrorCode(), "%s",
+                            backend_cntl.ErrorText().c_str());
+            return;
+        }
+        cntl->response_attachment().swap(backend_cntl.response_attachment());
+    }
+
+private:
+    brpc::Channel* _channel;
+public:
+    butil::atomic<int> ncalled;
+};
+
+TEST_F(ServerTest, baidu_master_service) {
+    const int backend_port = 9202;
+    const int proxy_port = 9203;
+    brpc::Server backend;
+    EchoServiceV1 service_v1;
+    ASSERT_EQ(0, backend.AddService(&service_v1, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, backend.Start(backend_port, NULL));
+
+    brpc::Channel backend_channel;
+    ASSERT_EQ(0, backend_channel.Init("0.0.0.0", backend_port, NULL));
+    RelayMasterService* master = new RelayMasterService(&backend_channel);
+    brpc::Server proxy;
+    brpc::ServerOptions options;
+    options.baidu_master_service = master;
+    ASSERT_EQ(0, proxy.Start(proxy_port, &options));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", proxy_port, NULL));
+    v1::EchoService_Stub stub(&channel);
+    for (int i = 0; i < 2; ++i) {
+        brpc::Controller cntl;
+        v1::EchoRequest req;
+        v1::EchoResponse res;
+        req.set_message("foo");
+        if (i == 1) {
+            cntl.set_request_compress_type(brpc::COMPRESS_TYPE_GZIP);
+        }
+        cntl.request_attachment().append("att");
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("foo_v1", res.message());
+    }
+    ASSERT_EQ(2, master->ncalled.load());
+    ASSERT_EQ(2, service_v1.ncalled.load());
+    {
+        // Errors of backends are relayed as well.
+        v2::EchoService_Stub stub_v2(&channel);
+        brpc::Controller cntl;
+        v2::EchoRequest req;
+        v2::EchoResponse res;
+        req.set_value(1);
+        stub_v2.Echo(&cntl, &req, &res, NULL);
+        ASSERT_EQ(brpc::ENOMETHOD, cntl.ErrorCode()) << cntl.ErrorText();
+        ASSERT_EQ(3, master->ncalled.load());
+    }
+    proxy.Stop(0);
+    proxy.Join();
+    backend.Stop(0);
+    backend.Join();
+}
+
+class ReverseRawService : public brpc::RawService {
+public:
+    ReverseRawService()
+        : brpc::RawService("test.RawService", {"Reverse", "Echo"}) {}
+
+    void ProcessRawRequest(brpc::Controller* cntl,
+                           const butil::IOBuf& request,
+                           butil::IOBuf* response,
+                           google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        std::string s = request.to_string();
+        if (cntl->method()->name() == "Reverse") {
+            std::reverse(s.begin(), s.end());
+        }
+        response->append(s);
+    }
+};
+
+TEST_F(ServerTest, raw_service) {
+    const int port = 9204;
+    brpc::Server server;
+    ReverseRawService raw_svc;
+    ASSERT_EQ(0, server.AddService(&raw_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    {
+        brpc::Controller cntl;
+        brpc::SetRawBaiduStdMethod(&cntl, "test.RawService", "Reverse",
+                                   brpc::COMPRESS_TYPE_NONE);
+        brpc::SerializedRequest req;
+        brpc::SerializedResponse res;
+        req.serialized_data().append("abc");
+        channel.CallMethod(NULL, &cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("cba", res.serialized_data().to_string());
+    }
+    {
+        brpc::Controller cntl;
+        brpc::SetRawBaiduStdMethod(&cntl, "test.RawService", "Unknown",
+                                   brpc::COMPRESS_TYPE_NONE);
+        brpc::SerializedRequest req;
+        brpc::SerializedResponse res;
+        channel.CallMethod(NULL, &cntl, &req, &res, NULL);
+        ASSERT_EQ(brpc::ENOMETHOD, cntl.ErrorCode());
+    }
+
+    brpc::Channel http_channel;
+    brpc::ChannelOptions chan_options;
+    chan_options.protocol = "http";
+    ASSERT_EQ(0, http_channel.Init("0.0.0.0", port, &chan_options));
+    {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = "/test.RawService/Echo";
+        cntl.http_request().set_method(brpc::HTTP_METHOD_POST);
+        cntl.http_request().set_content_type("application/octet-stream");
+        cntl.request_attachment().append("xyz");
+        http_channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("xyz", cntl.response_attachment().to_string());
+    }
+    server.Stop(0);
+    server.Join();
+}
+
+// Count bytes of the attachment and respond when it's read completely.
+class CountingReader : public brpc::ProgressiveReader {
+public:
+    CountingReader(v1::EchoResponse* res, google::protobuf::Closure* done)
+        : _nbytes(0), _res(res), _done(done) {}
+
+    butil::Status OnReadOnePart(const void* /*data*/, size_t length) override {
+        _nbytes += length;
+        return butil::Status::OK();
+    }
+
+    void OnEndOfMessage(const butil::Status& st) override {
+        _res->set_message(st.ok() ? std::to_string(_nbytes) : st.error_str());
+        _done->Run();
+        delete this;
+    }
+
+private:
+    size_t _nbytes;
+    v1::EchoResponse* _res;
+    google::protobuf::Closure* _done;
+};
+
+class UploadService : public v1::EchoService {
+public:
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const v1::EchoRequest* request,
+              v1::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        CHECK(cntl->request_attachment().empty());
+        cntl->ReadProgressiveAttachmentBy(new CountingReader(response, done));
+    }
+};
+
+TEST_F(ServerTest, progressive_read_request_attachment) {
+    const int port = 9205;
+    brpc::Server server;
+    UploadService svc;
+    brpc::ServiceOptions svc_opt;
+    svc_opt.ownership = brpc::SERVER_DOESNT_OWN_SERVICE;
+    svc_opt.enable_progressive_read = true;
+    ASSERT_EQ(0, server.AddService(&svc, svc_opt));
+    ASSERT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    v1::EchoService_Stub stub(&channel);
+    const size_t sizes[] = { 0, 3, 16 * 1024 * 1024 };
+    for (size_t i = 0; i < arraysize(sizes); ++i) {
+        brpc::Controller cntl;
+        v1::EchoRequest req;
+        v1::EchoResponse res;
+        req.set_message("upload");
+        const std::string part(64 * 1024, 'x');
+        while (cntl.request_attachment().size() < sizes[i]) {
+            cntl.request_attachment().append(
+                part.data(), std::min(part.size(),
+                    sizes[i] - cntl.request_attachment().size()));
+        }
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(std::to_string(sizes[i]), res.message());
+    }
+    server.Stop(0);
+    server.Join();
+}
+
 TEST_F(ServerTest, various_forms_of_uri_paths) {
     const int port = 9200;
     brpc::Server server1;
@@ -1206,6 +1512,47 @@ TEST_F(ServerTest, serving_requests) {
     ASSERT_EQ(0, server.Join());
 }
 
+TEST_F(ServerTest, accept_from_reuse_port_fds) {
+    butil::EndPoint ep;
+    ASSERT_EQ(0, str2endpoint("127.0.0.1:8614", &ep));
+    std::vector<int> fds;
+    for (int i = 0; i < 2; ++i) {
+        const int fd = butil::tcp_listen(ep, true);
+        ASSERT_GE(fd, 0) << berror();
+        fds.push_back(fd);
+    }
+    brpc::Acceptor am;
+    ASSERT_EQ(0, am.StartAccept(fds, -1, std::shared_ptr<brpc::SocketSSLContext>()));
+    ASSERT_EQ(fds[0], am.listened_fd());
+
+    const size_t NCLIENT = 8;
+    butil::fd_guard clients[NCLIENT];
+    for (size_t i = 0; i < NCLIENT; ++i) {
+        clients[i].reset(butil::tcp_connect(ep, NULL));
+        ASSERT_GE(clients[i], 0);
+    }
+    for (int i = 0; i < 100 && am.ConnectionCount() != NCLIENT; ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_EQ(NCLIENT, am.ConnectionCount());
+    std::vector<brpc::SocketId> conns;
+    am.ListConnections(&conns);
+    for (size_t i = 0; i < conns.size(); ++i) {
+        brpc::SocketUniquePtr s;
+        ASSERT_EQ(0, brpc::Socket::Address(conns[i], &s));
+        // Pinned to the dispatcher of the listening fd.
+        ASSERT_GE(s->event_dispatcher_index(), 0);
+        ASSERT_LT(s->event_dispatcher_index(), 2);
+    }
+    am.StopAccept(0);
+    for (size_t i = 0; i < NCLIENT; ++i) {
+        clients[i].reset(-1);
+    }
+    am.Join();
+    ASSERT_EQ(-1, am.listened_fd());
+    ASSERT_EQ(0u, am.ConnectionCount());
+}
+
 TEST_F(ServerTest, create_pid_file) {
     {
         brpc::Server server;
@@ -1334,6 +1681,523 @@ TEST_F(ServerTest, too_big_message) {
     server.Join();
 }
 
+class ArenaEchoService : public test::EchoService {
+public:
+    ArenaEchoService() : nmismatch(0) {}
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = (brpc::Controller*)cntl_base;
+        if (cntl->arena() == NULL ||
+            request->GetArena() != cntl->arena() ||
+            response->GetArena() != cntl->arena()) {
+            nmismatch.fetch_add(1, butil::memory_order_relaxed);
+        }
+        response->set_message(request->message());
+    }
+
+    butil::atomic<int> nmismatch;
+};
+
+TEST_F(ServerTest, use_pb_arena) {
+    ArenaEchoService echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    brpc::ServerOptions opt;
+    opt.use_pb_arena = true;
+    ASSERT_EQ(0, server.Start(8613, &opt));
+
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("localhost:8613", NULL));
+    test::EchoService_Stub stub(&chan);
+    for (int i = 0; i < 10; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(EXP_REQUEST, res.message());
+        ASSERT_TRUE(cntl.arena() == NULL);
+    }
+    ASSERT_EQ(0, echo_svc.nmismatch.load());
+    server.Stop(0);
+    server.Join();
+}
+
+class DeadlineEchoService : public test::EchoService {
+public:
+    DeadlineEchoService()
+        : channel(NULL), deadline_us(-1), tls_deadline_us(-1)
+        , child_timeout_ms(-1) {}
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = (brpc::Controller*)cntl_base;
+        response->set_message(request->message());
+        if (request->message() == "child") {
+            return;
+        }
+        deadline_us = cntl->deadline_us();
+        tls_deadline_us = brpc::TlsRpcDeadline::get();
+        brpc::Controller child_cntl;
+        test::EchoRequest child_req;
+        test::EchoResponse child_res;
+        child_req.set_message("child");
+        test::EchoService_Stub stub(channel);
+        stub.Echo(&child_cntl, &child_req, &child_res, NULL);
+        child_timeout_ms = child_cntl.timeout_ms();
+    }
+
+    brpc::Channel* channel;
+    int64_t deadline_us;
+    int64_t tls_deadline_us;
+    int64_t child_timeout_ms;
+};
+
+TEST_F(ServerTest, deadline_propagation) {
+    DeadlineEchoService echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8613, NULL));
+
+    brpc::ChannelOptions child_opt;
+    child_opt.timeout_ms = 10000;
+    brpc::Channel child_chan;
+    ASSERT_EQ(0, child_chan.Init("localhost:8613", &child_opt));
+    echo_svc.channel = &child_chan;
+
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("localhost:8613", NULL));
+    test::EchoService_Stub stub(&chan);
+    brpc::Controller cntl;
+    cntl.set_timeout_ms(300);
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(EXP_REQUEST);
+    const int64_t start_us = butil::gettimeofday_us();
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_LT(start_us, echo_svc.deadline_us);
+    ASSERT_LE(echo_svc.deadline_us, butil::gettimeofday_us() + 300000);
+    ASSERT_EQ(echo_svc.deadline_us, echo_svc.tls_deadline_us);
+    // The child call inherits the time left rather than 10 seconds.
+    ASSERT_LE(echo_svc.child_timeout_ms, 300);
+    ASSERT_EQ(-1, brpc::TlsRpcDeadline::get());
+    server.Stop(0);
+    server.Join();
+}
+
+class PriorityEchoService : public test::EchoService {
+public:
+    PriorityEchoService() : priority(brpc::REQUEST_PRIORITY_NORMAL) {}
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = (brpc::Controller*)cntl_base;
+        priority = cntl->request_priority();
+        response->set_message(request->message());
+    }
+
+    brpc::RequestPriority priority;
+};
+
+TEST_F(ServerTest, request_priority) {
+    PriorityEchoService echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8613, NULL));
+    const char* protocols[] = { "baidu_std", "http" };
+    for (size_t i = 0; i < arraysize(protocols); ++i) {
+        brpc::ChannelOptions opt;
+        opt.protocol = protocols[i];
+        brpc::Channel chan;
+        ASSERT_EQ(0, chan.Init("localhost:8613", &opt));
+        test::EchoService_Stub stub(&chan);
+        const brpc::RequestPriority priorities[] = {
+            brpc::REQUEST_PRIORITY_LOW, brpc::REQUEST_PRIORITY_HIGH,
+            brpc::REQUEST_PRIORITY_NORMAL };
+        for (size_t j = 0; j < arraysize(priorities); ++j) {
+            brpc::Controller cntl;
+            cntl.set_request_priority(priorities[j]);
+            test::EchoRequest req;
+            test::EchoResponse res;
+            req.set_message(EXP_REQUEST);
+            stub.Echo(&cntl, &req, &res, NULL);
+            ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+            ASSERT_EQ(priorities[j], echo_svc.priority) << protocols[i];
+        }
+    }
+    server.Stop(0);
+    server.Join();
+}
+
+TEST_F(ServerTest, baidu_std_compact_meta) {
+    PriorityEchoService echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8613, NULL));
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "baidu_protocol_compact_meta", "true").empty());
+    brpc::ChannelOptions opt;
+    opt.connection_type = brpc::CONNECTION_TYPE_SINGLE;
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("localhost:8613", &opt));
+    test::EchoService_Stub stub(&chan);
+    // The first call negotiates, following ones without log_id are sent
+    // with compact meta.
+    for (int i = 0; i < 4; ++i) {
+        brpc::Controller cntl;
+        cntl.set_request_priority(i % 2 ? brpc::REQUEST_PRIORITY_HIGH
+                                        : brpc::REQUEST_PRIORITY_NORMAL);
+        if (i == 3) {
+            cntl.set_log_id(123);
+        }
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(EXP_REQUEST, res.message());
+        ASSERT_EQ(cntl.request_priority(), echo_svc.priority);
+    }
+    GFLAGS_NS::SetCommandLineOption("baidu_protocol_compact_meta", "false");
+    server.Stop(0);
+    server.Join();
+}
+
+TEST_F(ServerTest, baidu_std_load_report) {
+    PriorityEchoService echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    server.MaxConcurrencyOf("test.EchoService.Echo") = 10;
+    ASSERT_EQ(0, server.Start(8613, NULL));
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("localhost:8613", NULL));
+    test::EchoService_Stub stub(&chan);
+    for (int i = 0; i < 2; ++i) {
+        const bool report = (i == 1);
+        ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                         "baidu_protocol_load_report",
+                         report ? "true" : "false").empty());
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(report, cntl.server_load().reported());
+        if (report) {
+            const brpc::ServerLoad& load = cntl.server_load();
+            ASSERT_LE(0, load.cpu_permille);
+            ASSERT_GE(1000, load.cpu_permille);
+            // This call itself is being processed.
+            ASSERT_EQ(1, load.concurrency);
+            ASSERT_EQ(10, load.max_concurrency);
+            ASSERT_LE(100, load.utilization_permille());
+        }
+    }
+    GFLAGS_NS::SetCommandLineOption("baidu_protocol_load_report", "false");
+    server.Stop(0);
+    server.Join();
+}
+
+TEST_F(ServerTest, priority_aware_auto_concurrency_limiter) {
+    brpc::policy::AutoConcurrencyLimiter cl;
+    const int max_cc = cl.MaxConcurrency();
+    ASSERT_TRUE(cl.OnRequested(max_cc, brpc::REQUEST_PRIORITY_NORMAL));
+    ASSERT_FALSE(cl.OnRequested(max_cc + 1, brpc::REQUEST_PRIORITY_NORMAL));
+    // Low-priority requests are shed before normal ones.
+    ASSERT_FALSE(cl.OnRequested(max_cc, brpc::REQUEST_PRIORITY_LOW));
+    ASSERT_TRUE(cl.OnRequested(max_cc / 2, brpc::REQUEST_PRIORITY_LOW));
+    // High-priority requests are accepted after normal ones are rejected.
+    ASSERT_TRUE(cl.OnRequested(max_cc + 1, brpc::REQUEST_PRIORITY_HIGH));
+    ASSERT_FALSE(cl.OnRequested(max_cc * 2, brpc::REQUEST_PRIORITY_HIGH));
+}
+
+TEST_F(ServerTest, gradient_concurrency_limiter) {
+    brpc::AdaptiveMaxConcurrency amc("gradient:20");
+    ASSERT_EQ("gradient", amc.type());
+    ASSERT_EQ("20", amc.params());
+    ASSERT_EQ("gradient:20", amc.value());
+
+    brpc::policy::GradientConcurrencyLimiter cl(20000);
+    const int max_cc = cl.MaxConcurrency();
+    ASSERT_TRUE(cl.OnRequested(max_cc));
+    ASSERT_FALSE(cl.OnRequested(max_cc + 1));
+    // Latencies above the target shrink max_concurrency.
+    for (int i = 0; i < 1000; ++i) {
+        cl._latency << 50000;
+    }
+    bthread_usleep(1100000);
+    cl.UpdateMaxConcurrency();
+    const int shrunk_max_cc = cl.MaxConcurrency();
+    ASSERT_LT(shrunk_max_cc, max_cc);
+
+    // Latencies below the target grow max_concurrency if the limit is used.
+    brpc::policy::GradientConcurrencyLimiter cl2(20000);
+    for (int i = 0; i < 1000; ++i) {
+        cl2._latency << 1000;
+    }
+    bthread_usleep(1100000);
+    cl2.UpdateMaxConcurrency();
+    ASSERT_EQ(max_cc, cl2.MaxConcurrency());
+    ASSERT_TRUE(cl2.OnRequested(max_cc));
+    cl2.UpdateMaxConcurrency();
+    ASSERT_GT(cl2.MaxConcurrency(), max_cc);
+
+    EchoServiceImpl service;
+    brpc::Server bad_server;
+    ASSERT_EQ(0, bad_server.AddService(&service,
+                                       brpc::SERVER_DOESNT_OWN_SERVICE));
+    bad_server.MaxConcurrencyOf("test.EchoService.Echo") = "gradient:abc";
+    ASSERT_EQ(-1, bad_server.Start(8613, NULL));
+
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    server.MaxConcurrencyOf("test.EchoService.Echo") = "gradient:20";
+    ASSERT_EQ(0, server.Start(8613, NULL));
+    server.Stop(0);
+    server.Join();
+}
+
+class BatchEchoService : public test::EchoService, public brpc::BatchHandler {
+public:
+    explicit BatchEchoService(const brpc::RequestBatcherOptions& options) {
+        EXPECT_EQ(0, _batcher.Init(options, this));
+    }
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        _batcher.Submit(cntl_base, request, response, done);
+    }
+    void RunBatch(const std::vector<brpc::BatchedCall>& calls) {
+        for (size_t i = 0; i < calls.size(); ++i) {
+            const test::EchoRequest* req =
+                static_cast<const test::EchoRequest*>(calls[i].request);
+            test::EchoResponse* res =
+                static_cast<test::EchoResponse*>(calls[i].response);
+            res->set_message(req->message());
+        }
+        BAIDU_SCOPED_LOCK(mutex);
+        batch_sizes.push_back(calls.size());
+    }
+
+    butil::Mutex mutex;
+    std::vector<size_t> batch_sizes;
+
+private:
+    brpc::RequestBatcher _batcher;
+};
+
+TEST_F(ServerTest, request_batcher) {
+    brpc::RequestBatcherOptions batch_opt;
+    batch_opt.max_batch_size = 4;
+    batch_opt.max_wait_us = 20000;
+    BatchEchoService echo_svc(batch_opt);
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8613, NULL));
+
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("localhost:8613", NULL));
+    test::EchoService_Stub stub(&chan);
+    // A single call is run after max_wait_us.
+    {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message(EXP_REQUEST);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(EXP_REQUEST, res.message());
+        ASSERT_LE(batch_opt.max_wait_us, cntl.latency_us());
+    }
+    // Concurrent calls are run in batches of at most 4.
+    const int N = 8;
+    brpc::Controller cntl[N];
+    test::EchoRequest req[N];
+    test::EchoResponse res[N];
+    for (int i = 0; i < N; ++i) {
+        req[i].set_message(butil::string_printf("hello%d", i));
+        stub.Echo(&cntl[i], &req[i], &res[i], brpc::DoNothing());
+    }
+    for (int i = 0; i < N; ++i) {
+        brpc::Join(cntl[i].call_id());
+        ASSERT_FALSE(cntl[i].Failed()) << cntl[i].ErrorText();
+        ASSERT_EQ(req[i].message(), res[i].message());
+    }
+    size_t total = 0;
+    BAIDU_SCOPED_LOCK(echo_svc.mutex);
+    ASSERT_LT(echo_svc.batch_sizes.size(), (size_t)(N + 1));
+    for (size_t i = 0; i < echo_svc.batch_sizes.size(); ++i) {
+        ASSERT_LE(echo_svc.batch_sizes[i], (size_t)batch_opt.max_batch_size);
+        total += echo_svc.batch_sizes[i];
+    }
+    ASSERT_EQ((size_t)(N + 1), total);
+    server.Stop(0);
+    server.Join();
+}
+
+TEST_F(ServerTest, listen_fd_handover) {
+    const std::string path = "./listen_fd_handover.sock";
+    EchoServiceImpl echo_svc;
+    brpc::ServerOptions opt;
+    opt.listen_fd_handover_path = path;
+    brpc::Server server1;
+    ASSERT_EQ(0, server1.AddService(&echo_svc,
+                                    brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server1.Start(8615, &opt));
+
+    brpc::ChannelOptions copt;
+    copt.connection_type = brpc::CONNECTION_TYPE_SHORT;
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("127.0.0.1:8615", &copt));
+    test::EchoService_Stub stub(&chan);
+    test::EchoRequest req;
+    req.set_message(EXP_REQUEST);
+    {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    }
+
+    // The port is occupied by server1 and taken over by server2.
+    brpc::Server server2;
+    ASSERT_EQ(0, server2.AddService(&echo_svc,
+                                    brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server2.Start(8615, &opt));
+    ASSERT_EQ(8615, server2.listen_address().port);
+    for (int i = 0; i < 100 && server1.IsRunning(); ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_FALSE(server1.IsRunning());
+    server1.Join();
+    {
+        brpc::Controller cntl;
+        test::EchoResponse res;
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(EXP_REQUEST, res.message());
+    }
+    server2.Stop(0);
+    server2.Join();
+    unlink(path.c_str());
+}
+
+TEST_F(ServerTest, nonblocking_methods) {
+    EchoServiceImpl echo_svc;
+    brpc::Server server;
+    brpc::ServiceOptions svc_opt;
+    svc_opt.ownership = brpc::SERVER_DOESNT_OWN_SERVICE;
+    svc_opt.nonblocking_methods.insert("NoSuchMethod");
+    ASSERT_EQ(-1, server.AddService(&echo_svc, svc_opt));
+    ASSERT_FALSE(server.has_nonblocking_methods());
+    svc_opt.nonblocking_methods.clear();
+    svc_opt.nonblocking_methods.insert("Echo");
+    ASSERT_EQ(0, server.AddService(&echo_svc, svc_opt));
+    ASSERT_TRUE(server.has_nonblocking_methods());
+    const brpc::Server::MethodProperty* mp =
+        server.FindMethodPropertyByFullName("test.EchoService.Echo");
+    ASSERT_TRUE(mp != NULL);
+    ASSERT_TRUE(mp->params.run_inline);
+    ASSERT_EQ(0, server.Start(8619, NULL));
+
+    // Requests sent together are likely to be read at once.
+    brpc::ChannelOptions opt;
+    opt.connection_type = brpc::CONNECTION_TYPE_SINGLE;
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("127.0.0.1:8619", &opt));
+    test::EchoService_Stub stub(&chan);
+    const int N = 16;
+    brpc::Controller cntl[N];
+    test::EchoRequest req[N];
+    test::EchoResponse res[N];
+    for (int i = 0; i < N; ++i) {
+        req[i].set_message(EXP_REQUEST);
+        stub.Echo(&cntl[i], &req[i], &res[i], brpc::DoNothing());
+    }
+    for (int i = 0; i < N; ++i) {
+        brpc::Join(cntl[i].call_id());
+        ASSERT_FALSE(cntl[i].Failed()) << cntl[i].ErrorText();
+        ASSERT_EQ(EXP_RESPONSE, res[i].message());
+    }
+    ASSERT_EQ(N, echo_svc.count.load());
+    server.Stop(0);
+    server.Join();
+}
+
+TEST_F(ServerTest, method_executor) {
+    EchoServiceImpl echo_svc;
+    brpc::Server server;
+    brpc::MethodExecutorOptions exec_opt;
+    exec_opt.num_pthreads = 1;
+    exec_opt.max_queue_size = 1;
+    ASSERT_EQ(0, server.AddMethodExecutor("slow", exec_opt));
+    ASSERT_EQ(-1, server.AddMethodExecutor("slow", exec_opt));
+    brpc::ServiceOptions svc_opt;
+    svc_opt.ownership = brpc::SERVER_DOESNT_OWN_SERVICE;
+    svc_opt.method_executors["Echo"] = "unknown";
+    ASSERT_EQ(-1, server.AddService(&echo_svc, svc_opt));
+    svc_opt.method_executors["Echo"] = "slow";
+    ASSERT_EQ(0, server.AddService(&echo_svc, svc_opt));
+    ASSERT_EQ(0, server.Start(8616, NULL));
+    brpc::MethodExecutor* executor = server._method_executors["slow"];
+    ASSERT_TRUE(executor != NULL);
+    ASSERT_TRUE(bvar::Variable::describe_exposed(
+                    "rpc_executor_slow_queue_size") != "");
+
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("127.0.0.1:8616", NULL));
+    test::EchoService_Stub stub(&chan);
+    const int N = 3;
+    brpc::Controller cntl[N];
+    test::EchoRequest req[N];
+    test::EchoResponse res[N];
+    for (int i = 0; i < N; ++i) {
+        req[i].set_message(EXP_REQUEST);
+        req[i].set_sleep_us(100000);
+    }
+    stub.Echo(&cntl[0], &req[0], &res[0], brpc::DoNothing());
+    // Wait until the first call is running in the only pthread.
+    for (int i = 0; i < 100 && echo_svc.count.load() != 1; ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_EQ(1, echo_svc.count.load());
+    ASSERT_EQ(0, executor->queue_size());
+    // One of the calls waits in the queue, the other is rejected.
+    stub.Echo(&cntl[1], &req[1], &res[1], brpc::DoNothing());
+    stub.Echo(&cntl[2], &req[2], &res[2], brpc::DoNothing());
+    int nlimited = 0;
+    for (int i = 0; i < N; ++i) {
+        brpc::Join(cntl[i].call_id());
+        if (cntl[i].Failed()) {
+            ASSERT_EQ(brpc::ELIMIT, cntl[i].ErrorCode()) << cntl[i].ErrorText();
+            ++nlimited;
+        } else {
+            ASSERT_EQ(EXP_RESPONSE, res[i].message());
+        }
+    }
+    ASSERT_EQ(1, nlimited);
+    ASSERT_EQ(2, echo_svc.count.load());
+    server.Stop(0);
+    server.Join();
+}
+
 TEST_F(ServerTest, max_concurrency) {
     const int port = 9200;
     brpc::Server server1;
@@ -1401,4 +2265,244 @@ TEST_F(ServerTest, max_concurrency) {
     stub.Echo(&cntl4, &req, NULL, NULL);
     ASSERT_FALSE(cntl4.Failed()) << cntl4.ErrorText();
 }
+
+class PhaseEchoService : public test::EchoService {
+public:
+    PhaseEchoService() {
+        memset(phase_begin_us, 0, sizeof(phase_begin_us));
+    }
+    virtual void Echo(google::protobuf::RpcController* cntl_base,
+                      const test::EchoRequest* request,
+                      test::EchoResponse* response,
+                      google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = (brpc::Controller*)cntl_base;
+        for (int i = 0; i < brpc::RPC_PHASE_COUNT; ++i) {
+            phase_begin_us[i] = cntl->phase_begin_us((brpc::RpcPhase)i);
+        }
+        response->set_message(request->message());
+    }
+
+    int64_t phase_begin_us[brpc::RPC_PHASE_COUNT];
+};
+
+TEST_F(ServerTest, rpc_phases) {
+    const bool saved_phase_latency = brpc::FLAGS_rpc_server_phase_latency;
+    brpc::FLAGS_rpc_server_phase_latency = true;
+    PhaseEchoService echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8617, NULL));
+
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("127.0.0.1:8617", NULL));
+    test::EchoService_Stub stub(&chan);
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(EXP_REQUEST);
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+
+    // Phases reached by the method are recorded in order.
+    const int64_t* server_us = echo_svc.phase_begin_us;
+    ASSERT_LT(0, server_us[brpc::RPC_PHASE_SERVER_READ]);
+    for (int i = brpc::RPC_PHASE_SERVER_PARSE;
+         i <= brpc::RPC_PHASE_SERVER_USERCODE; ++i) {
+        ASSERT_LE(server_us[i - 1], server_us[i]) << i;
+    }
+    ASSERT_EQ(0, server_us[brpc::RPC_PHASE_SERVER_SERIALIZE]);
+    const int64_t client_begin_us =
+        cntl.phase_begin_us(brpc::RPC_PHASE_CLIENT_ISSUE);
+    ASSERT_LT(0, client_begin_us);
+    for (int i = brpc::RPC_PHASE_CLIENT_CONNECT;
+         i <= brpc::RPC_PHASE_CLIENT_PARSE; ++i) {
+        ASSERT_LE(cntl.phase_begin_us((brpc::RpcPhase)(i - 1)),
+                  cntl.phase_begin_us((brpc::RpcPhase)i)) << i;
+    }
+    ASSERT_LE(client_begin_us, server_us[brpc::RPC_PHASE_SERVER_READ]);
+    ASSERT_LE(server_us[brpc::RPC_PHASE_SERVER_USERCODE],
+              cntl.phase_begin_us(brpc::RPC_PHASE_CLIENT_PARSE));
+
+    // Phase latencies of the method are exposed.
+    const std::string name =
+        "rpc_server_8617_test_echo_service_echo_phase_usercode_count";
+    for (int i = 0; i < 100 && bvar::Variable::describe_exposed(name).empty();
+         ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_NE("", bvar::Variable::describe_exposed(name));
+    server.Stop(0);
+    server.Join();
+    brpc::FLAGS_rpc_server_phase_latency = saved_phase_latency;
+}
+
+TEST_F(ServerTest, method_vars_created_on_first_response) {
+    EchoServiceImpl echo_svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(8618, NULL));
+    const std::string prefix = "rpc_server_8618_test_echo_service_";
+    for (int i = 0; i < 100 && bvar::Variable::describe_exposed(
+             prefix + "echo_concurrency").empty(); ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_NE("", bvar::Variable::describe_exposed(prefix + "echo_concurrency"));
+    // Methods never called don't have latency recorders.
+    ASSERT_EQ("", bvar::Variable::describe_exposed(prefix + "echo_count"));
+    ASSERT_EQ("", bvar::Variable::describe_exposed(
+                  prefix + "combo_echo_count"));
+
+    brpc::Channel chan;
+    ASSERT_EQ(0, chan.Init("127.0.0.1:8618", NULL));
+    test::EchoService_Stub stub(&chan);
+    brpc::Controller cntl;
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(EXP_REQUEST);
+    stub.Echo(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    // The response may arrive before the server counts it.
+    for (int i = 0; i < 100 && bvar::Variable::describe_exposed(
+             prefix + "echo_count").empty(); ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_NE("", bvar::Variable::describe_exposed(prefix + "echo_count"));
+    ASSERT_NE("", bvar::Variable::describe_exposed(prefix + "echo_error"));
+    ASSERT_EQ("", bvar::Variable::describe_exposed(
+                  prefix + "combo_echo_count"));
+    server.Stop(0);
+    server.Join();
+}
+
+// Records where requests are processed.
+class ShardEchoService : public test::EchoService {
+public:
+    struct Request {
+        butil::EndPoint remote_side;
+        int shard;
+        bthread_tag_t tag;
+    };
+
+    explicit ShardEchoService(brpc::Server* server) : _server(server) {}
+
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        Request r = { cntl->remote_side(), _server->current_shard(),
+                      bthread_self_tag() };
+        BAIDU_SCOPED_LOCK(_mutex);
+        _requests.push_back(r);
+        response->set_message(request->message());
+    }
+
+    std::vector<Request> requests() {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _requests;
+    }
+
+private:
+    brpc::Server* _server;
+    butil::Mutex _mutex;
+    std::vector<Request> _requests;
+};
+
+struct ShardRun {
+    brpc::Server* server;
+    int shard;
+    bthread_tag_t tag;
+    bthread::CountdownEvent* done;
+};
+
+void* RecordShard(void* arg) {
+    ShardRun* run = static_cast<ShardRun*>(arg);
+    run->shard = run->server->current_shard();
+    run->tag = bthread_self_tag();
+    run->done->signal();
+    return NULL;
+}
+
+TEST_F(ServerTest, shared_nothing) {
+    const bthread_tag_t BASE_TAG = 1;
+    const int NSHARD = brpc::FLAGS_event_dispatcher_num;
+    ASSERT_EQ(2, NSHARD);
+    brpc::Server server;
+    ShardEchoService echo_svc(&server);
+    ASSERT_EQ(0, server.AddService(&echo_svc,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    brpc::ServerOptions opt;
+    opt.bthread_tag = BASE_TAG;
+    opt.shared_nothing = true;
+    ASSERT_EQ(0, server.Start(8619, &opt));
+    ASSERT_EQ(NSHARD, server.shard_count());
+    // Not called from a bthread of the server.
+    ASSERT_EQ(-1, server.current_shard());
+
+    // Connections are spread to shards by the kernel.
+    const int NCHAN = 8;
+    brpc::Channel chans[NCHAN];
+    for (int i = 0; i < NCHAN; ++i) {
+        brpc::ChannelOptions copt;
+        copt.connection_group = butil::string_printf("shard%d", i);
+        ASSERT_EQ(0, chans[i].Init("127.0.0.1:8619", &copt));
+        test::EchoService_Stub stub(&chans[i]);
+        for (int j = 0; j < 5; ++j) {
+            brpc::Controller cntl;
+            test::EchoRequest req;
+            test::EchoResponse res;
+            req.set_message(EXP_REQUEST);
+            stub.Echo(&cntl, &req, &res, NULL);
+            ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        }
+    }
+
+    // Each connection stays on workers of the shard of its dispatcher.
+    std::vector<brpc::SocketId> conns;
+    server._am->ListConnections(&conns);
+    ASSERT_EQ((size_t)NCHAN, conns.size());
+    std::map<butil::EndPoint, int> shard_of_client;
+    for (size_t i = 0; i < conns.size(); ++i) {
+        brpc::SocketUniquePtr s;
+        ASSERT_EQ(0, brpc::Socket::Address(conns[i], &s));
+        const int shard = s->event_dispatcher_index();
+        ASSERT_GE(shard, 0);
+        ASSERT_LT(shard, NSHARD);
+        ASSERT_EQ(BASE_TAG + shard, s->bthread_tag());
+        shard_of_client[s->remote_side()] = shard;
+    }
+    // So do bthreads processing requests from the connection.
+    const std::vector<ShardEchoService::Request> reqs = echo_svc.requests();
+    ASSERT_EQ((size_t)NCHAN * 5, reqs.size());
+    for (size_t i = 0; i < reqs.size(); ++i) {
+        std::map<butil::EndPoint, int>::const_iterator it =
+            shard_of_client.find(reqs[i].remote_side);
+        ASSERT_TRUE(it != shard_of_client.end()) << reqs[i].remote_side;
+        ASSERT_EQ(it->second, reqs[i].shard);
+        ASSERT_EQ(BASE_TAG + it->second, reqs[i].tag);
+    }
+
+    // Work is passed to the given shard.
+    bthread::CountdownEvent done(NSHARD);
+    std::vector<ShardRun> runs(NSHARD);
+    for (int i = 0; i < NSHARD; ++i) {
+        ShardRun r = { &server, -1, BTHREAD_TAG_INVALID, &done };
+        runs[i] = r;
+        ASSERT_EQ(0, server.RunInShard(i, RecordShard, &runs[i]));
+    }
+    ASSERT_EQ(EINVAL, server.RunInShard(NSHARD, RecordShard, &runs[0]));
+    ASSERT_EQ(EINVAL, server.RunInShard(-1, RecordShard, &runs[0]));
+    ASSERT_EQ(0, done.wait());
+    for (int i = 0; i < NSHARD; ++i) {
+        ASSERT_EQ(i, runs[i].shard);
+        ASSERT_EQ(BASE_TAG + i, runs[i].tag);
+    }
+
+    server.Stop(0);
+    server.Join();
+}
 } //namespace
@@ -0,0 +1,270 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bvar/variable.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/details/shm_ring.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_bool(shm_transport);
+DECLARE_int32(shm_transport_ring_size);
+} // namespace brpc
+
+namespace {
+
+TEST(ShmRingTest, read_write) {
+    brpc::ShmRing producer;
+    ASSERT_EQ(0, producer.Init(1000));
+    ASSERT_EQ(4096u, producer.capacity());
+    brpc::ShmRing consumer;
+    ASSERT_EQ(0, consumer.Attach(producer.shm_fd(), producer.readable_fd(),
+                                 producer.writable_fd()));
+    ASSERT_EQ(4096u, consumer.capacity());
+
+    butil::IOBuf out;
+    ASSERT_EQ(-1, consumer.Read(&out, 100));
+    ASSERT_EQ(EAGAIN, errno);
+
+    // Fill up the ring and wrap around.
+    butil::IOBuf data;
+    data.append(std::string(3000, 'a'));
+    ASSERT_EQ(3000, producer.Write(&data));
+    ASSERT_TRUE(data.empty());
+    ASSERT_EQ(2000, consumer.Read(&out, 2000));
+    data.append(std::string(4000, 'b'));
+    ASSERT_EQ(3096, producer.Write(&data));
+    ASSERT_EQ(904u, data.size());
+    ASSERT_EQ(-1, producer.Write(&data));
+    ASSERT_EQ(EAGAIN, errno);
+    ASSERT_EQ(4096, consumer.Read(&out, 10000));
+    ASSERT_EQ(std::string(3000, 'a') + std::string(3096, 'b'), out.to_string());
+}
+
+TEST(ShmRingTest, attach_invalid) {
+    brpc::ShmRing ring;
+    ASSERT_EQ(-1, ring.Attach(-1, -1, -1));
+    brpc::ShmRing producer;
+    ASSERT_EQ(0, producer.Init(4096));
+    ASSERT_EQ(-1, ring.Attach(producer.readable_fd(), producer.readable_fd(),
+                              producer.writable_fd()));
+
+    // Memory which can be resized by the peer.
+    const int memfd = syscall(__NR_memfd_create, "brpc_shm_ring_unittest", 0);
+    ASSERT_LE(0, memfd);
+    ASSERT_EQ(0, ftruncate(memfd, 8192));
+    ASSERT_EQ(-1, ring.Attach(memfd, producer.readable_fd(),
+                              producer.writable_fd()));
+    ASSERT_EQ(EPERM, errno);
+    close(memfd);
+}
+
+TEST(ShmRingTest, corrupted_positions) {
+    brpc::ShmRing producer;
+    ASSERT_EQ(0, producer.Init(4096));
+    brpc::ShmRing consumer;
+    ASSERT_EQ(0, consumer.Attach(producer.shm_fd(), producer.readable_fd(),
+                                 producer.writable_fd()));
+    // A malicious peer writes positions directly.
+    char* mem = (char*)mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            producer.shm_fd(), 0);
+    ASSERT_NE(MAP_FAILED, (void*)mem);
+    butil::atomic<uint64_t>* write_pos =
+        (butil::atomic<uint64_t>*)(mem + BAIDU_CACHELINE_SIZE);
+    butil::atomic<uint64_t>* read_pos =
+        (butil::atomic<uint64_t>*)(mem + 2 * BAIDU_CACHELINE_SIZE);
+
+    write_pos->store(100000);
+    butil::IOBuf out;
+    ASSERT_EQ(-1, consumer.Read(&out, 100000));
+    ASSERT_EQ(EPROTO, errno);
+    ASSERT_TRUE(out.empty());
+
+    read_pos->store(100000);
+    butil::IOBuf data;
+    data.append("hello");
+    ASSERT_EQ(-1, producer.Write(&data));
+    ASSERT_EQ(EPROTO, errno);
+    ASSERT_EQ(5u, data.size());
+    munmap(mem, 4096);
+}
+
+struct StreamArg {
+    brpc::ShmRing* ring;
+    size_t total;
+};
+
+void* produce(void* void_arg) {
+    StreamArg* arg = static_cast<StreamArg*>(void_arg);
+    size_t written = 0;
+    while (written < arg->total) {
+        butil::IOBuf data;
+        const size_t n = std::min((size_t)1000, arg->total - written);
+        for (size_t i = 0; i < n; ++i) {
+            data.push_back((char)((written + i) % 251));
+        }
+        while (!data.empty()) {
+            if (arg->ring->Write(&data) < 0) {
+                EXPECT_EQ(EAGAIN, errno);
+                EXPECT_EQ(0, arg->ring->WaitWritable(NULL));
+            }
+        }
+        written += n;
+    }
+    return NULL;
+}
+
+TEST(ShmRingTest, wait_and_wakeup) {
+    brpc::ShmRing producer;
+    ASSERT_EQ(0, producer.Init(4096));
+    brpc::ShmRing consumer;
+    ASSERT_EQ(0, consumer.Attach(producer.shm_fd(), producer.readable_fd(),
+                                 producer.writable_fd()));
+
+    timespec abstime = butil::milliseconds_from_now(50);
+    butil::Timer tm;
+    tm.start();
+    ASSERT_EQ(-1, consumer.WaitReadable(&abstime));
+    ASSERT_EQ(ETIMEDOUT, errno);
+    tm.stop();
+    ASSERT_LE(40, tm.m_elapsed());
+
+    StreamArg arg = { &producer, 1024 * 1024 };
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, produce, &arg));
+    butil::IOBuf out;
+    while (out.size() < arg.total) {
+        if (consumer.Read(&out, 3000) < 0) {
+            ASSERT_EQ(EAGAIN, errno);
+            ASSERT_EQ(0, consumer.WaitReadable(NULL));
+        }
+    }
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(arg.total, out.size());
+    const std::string s = out.to_string();
+    for (size_t i = 0; i < s.size(); ++i) {
+        ASSERT_EQ((char)(i % 251), s[i]) << i;
+    }
+}
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest* request,
+              test::EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        response->set_message(request->message());
+        cntl->response_attachment().append(cntl->request_attachment());
+    }
+};
+
+int64_t ShmConnectionCount() {
+    const std::string value =
+        bvar::Variable::describe_exposed("rpc_shm_transport_connection_count");
+    return value.empty() ? 0 : atoll(value.c_str());
+}
+
+void EchoThroughChannel(brpc::Channel* channel) {
+    test::EchoService_Stub stub(channel);
+    for (int i = 0; i < 10; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("hello");
+        // Larger than the rings.
+        const std::string attachment(100000 + i, 'a' + i);
+        cntl.request_attachment().append(attachment);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("hello", res.message());
+        ASSERT_EQ(attachment, cntl.response_attachment().to_string());
+    }
+}
+
+TEST(ShmRingTest, echo_through_shm_transport) {
+    const char* const addr = "unix:/tmp/brpc_shm_ring_unittest.sock";
+    unlink(addr + 5);
+    EchoServiceImpl service;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&service,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    brpc::ServerOptions server_options;
+    server_options.shm_transport = true;
+    ASSERT_EQ(0, server.Start(addr, &server_options));
+    const int64_t count0 = ShmConnectionCount();
+
+    // Clients without the flag talk to the server as usual.
+    brpc::ChannelOptions options;
+    options.connection_group = "plain";
+    brpc::Channel plain_channel;
+    ASSERT_EQ(0, plain_channel.Init(addr, &options));
+    EchoThroughChannel(&plain_channel);
+    ASSERT_EQ(count0, ShmConnectionCount());
+
+    const int32_t saved_ring_size = brpc::FLAGS_shm_transport_ring_size;
+    brpc::FLAGS_shm_transport = true;
+    brpc::FLAGS_shm_transport_ring_size = 4096;
+    options.connection_group = "shm";
+    brpc::Channel shm_channel;
+    ASSERT_EQ(0, shm_channel.Init(addr, &options));
+    EchoThroughChannel(&shm_channel);
+    brpc::FLAGS_shm_transport = false;
+    brpc::FLAGS_shm_transport_ring_size = saved_ring_size;
+    // Both sides of the connection.
+    ASSERT_EQ(count0 + 2, ShmConnectionCount());
+
+    server.Stop(0);
+    server.Join();
+}
+
+TEST(ShmRingTest, declined_without_server_option) {
+    const char* const addr = "unix:/tmp/brpc_shm_ring_unittest2.sock";
+    unlink(addr + 5);
+    EchoServiceImpl service;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&service,
+                                   brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(addr, NULL));
+    const int64_t count0 = ShmConnectionCount();
+
+    // The connection works as an ordinary unix domain socket.
+    brpc::FLAGS_shm_transport = true;
+    brpc::ChannelOptions options;
+    options.connection_group = "declined";
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init(addr, &options));
+    EchoThroughChannel(&channel);
+    brpc::FLAGS_shm_transport = false;
+    ASSERT_EQ(count0, ShmConnectionCount());
+
+    server.Stop(0);
+    server.Join();
+}
+
+} // namespace
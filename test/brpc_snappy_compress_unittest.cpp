@@ -20,14 +20,24 @@
 // Date: 2015/01/20 19:01:06
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include "butil/gperftools_profiler.h"
 #include "butil/third_party/snappy/snappy.h"
 #include "butil/macros.h"
 #include "butil/iobuf.h"
 #include "butil/time.h"
 #include "snappy_message.pb.h"
+#include "echo.pb.h"
 #include "brpc/policy/snappy_compress.h"
 #include "brpc/policy/gzip_compress.h"
+#include "brpc/policy/lz4_compress.h"
+#include "brpc/policy/zstd_compress.h"
+
+namespace brpc {
+namespace policy {
+DECLARE_int32(zstd_dict_max_samples);
+}
+}
 
 typedef bool (*Compress)(const google::protobuf::Message&, butil::IOBuf*);
 typedef bool (*Decompress)(const butil::IOBuf&, google::protobuf::Message*);
@@ -103,6 +113,162 @@ TEST_F(test_compress_method, snappy_iobuf) {
     ASSERT_STREQ(check_buf.to_string().c_str(), test);
 }
 
+static void MakeFragmentedText(butil::IOBuf* buf, int len) {
+    // Append in small pieces so that input spans many blocks, some of
+    // which are only partially filled.
+    for (int j = 0; j < len;) {
+        char piece[37];
+        const int n = std::min((int)sizeof(piece), len - j);
+        for (int i = 0; i < n; ++i, ++j) {
+            piece[i] = (j % 7 == 0 ? 'A' + j % 26 : 'a' + i % 26);
+        }
+        butil::IOBuf tmp;
+        tmp.append(piece, n);
+        buf->append(tmp);
+    }
+}
+
+#ifdef BRPC_WITH_LZ4
+TEST_F(test_compress_method, lz4) {
+    snappy_message::SnappyMessageProto old_msg;
+    old_msg.set_text("Hello World!");
+    old_msg.add_numbers(2);
+    old_msg.add_numbers(7);
+    old_msg.add_numbers(45);
+    butil::IOBuf buf;
+    ASSERT_TRUE(brpc::policy::Lz4Compress(old_msg, &buf));
+    snappy_message::SnappyMessageProto new_msg;
+    ASSERT_TRUE(brpc::policy::Lz4Decompress(buf, &new_msg));
+    ASSERT_EQ("Hello World!", new_msg.text());
+    ASSERT_EQ(3, new_msg.numbers_size());
+    ASSERT_EQ(45, new_msg.numbers(2));
+}
+
+TEST_F(test_compress_method, lz4_iobuf) {
+    const int lens[] = { 0, 1, 100, 8192, 65536, 1000003 };
+    for (size_t k = 0; k < ARRAY_SIZE(lens); ++k) {
+        butil::IOBuf buf, output_buf, check_buf;
+        MakeFragmentedText(&buf, lens[k]);
+        ASSERT_TRUE(brpc::policy::Lz4Compress(buf, &output_buf));
+        ASSERT_TRUE(brpc::policy::Lz4Decompress(output_buf, &check_buf));
+        ASSERT_EQ(buf, check_buf) << "len=" << lens[k];
+
+        // Truncated or corrupted input must be rejected.
+        if (lens[k] > 0) {
+            butil::IOBuf truncated;
+            output_buf.cutn(&truncated, output_buf.size() - 1);
+            check_buf.clear();
+            ASSERT_FALSE(brpc::policy::Lz4Decompress(truncated, &check_buf));
+        }
+    }
+}
+#endif  // BRPC_WITH_LZ4
+
+#ifdef BRPC_WITH_ZSTD
+TEST_F(test_compress_method, zstd) {
+    snappy_message::SnappyMessageProto old_msg;
+    old_msg.set_text("Hello World!");
+    old_msg.add_numbers(2);
+    old_msg.add_numbers(7);
+    old_msg.add_numbers(45);
+    butil::IOBuf buf;
+    ASSERT_TRUE(brpc::policy::ZstdCompress(old_msg, &buf));
+    snappy_message::SnappyMessageProto new_msg;
+    ASSERT_TRUE(brpc::policy::ZstdDecompress(buf, &new_msg));
+    ASSERT_EQ("Hello World!", new_msg.text());
+    ASSERT_EQ(3, new_msg.numbers_size());
+    ASSERT_EQ(45, new_msg.numbers(2));
+}
+
+TEST_F(test_compress_method, zstd_iobuf) {
+    const int lens[] = { 0, 1, 100, 8192, 65536, 1000003 };
+    const int levels[] = { -5, 1, 3, 19 };
+    for (size_t k = 0; k < ARRAY_SIZE(lens); ++k) {
+        butil::IOBuf buf;
+        MakeFragmentedText(&buf, lens[k]);
+        size_t sizes[ARRAY_SIZE(levels)];
+        for (size_t l = 0; l < ARRAY_SIZE(levels); ++l) {
+            butil::IOBuf output_buf, check_buf;
+            ASSERT_TRUE(brpc::policy::ZstdCompress(buf, &output_buf, levels[l]));
+            ASSERT_TRUE(brpc::policy::ZstdDecompress(output_buf, &check_buf));
+            ASSERT_EQ(buf, check_buf) << "len=" << lens[k];
+            sizes[l] = output_buf.size();
+            if (lens[k] > 0) {
+                butil::IOBuf truncated;
+                output_buf.cutn(&truncated, output_buf.size() - 1);
+                check_buf.clear();
+                ASSERT_FALSE(brpc::policy::ZstdDecompress(truncated, &check_buf));
+            }
+        }
+        if (lens[k] >= 65536) {
+            // The highest level compresses better than the fastest one.
+            ASSERT_LT(sizes[ARRAY_SIZE(levels) - 1], sizes[0]);
+        }
+    }
+}
+
+static void MakeEchoRequest(int i, test::EchoRequest* req) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "{\"user_id\":%d,\"name\":\"user%d\","
+             "\"region\":\"region-%d\",\"status\":\"active\"}",
+             i * 7919, i, i % 13);
+    req->set_message(buf);
+    req->set_code(i);
+}
+
+TEST_F(test_compress_method, zstd_dictionary) {
+    const google::protobuf::MethodDescriptor* method =
+        test::EchoService::descriptor()->FindMethodByName("Echo");
+    ASSERT_TRUE(method != NULL);
+    ASSERT_EQ(0u, brpc::policy::GetZstdDictionaryId(method));
+    butil::IOBuf dict;
+    std::string error;
+    ASSERT_FALSE(brpc::policy::TrainZstdDictionary(
+                     method->full_name(), 4096, &dict, &error));
+
+    brpc::policy::FLAGS_zstd_dict_max_samples = 500;
+    for (int i = 0; i < 2000; ++i) {
+        test::EchoRequest req;
+        MakeEchoRequest(i, &req);
+        brpc::policy::AddZstdDictionarySample(method, req);
+    }
+    brpc::policy::FLAGS_zstd_dict_max_samples = 0;
+    std::ostringstream os;
+    brpc::policy::DescribeZstdDictionaries(os);
+    ASSERT_NE(std::string::npos, os.str().find(
+                  "test.EchoService.Echo : 500 samples")) << os.str();
+
+    ASSERT_TRUE(brpc::policy::TrainZstdDictionary(
+                    method->full_name(), 4096, &dict, &error)) << error;
+    ASSERT_LE(dict.size(), 4096u);
+    const uint32_t dict_id = brpc::policy::RegisterZstdDictionary(
+        method->full_name(), dict.to_string());
+    ASSERT_NE(0u, dict_id);
+    ASSERT_EQ(dict_id, brpc::policy::GetZstdDictionaryId(method));
+    // Only one dictionary for each method.
+    ASSERT_EQ(0u, brpc::policy::RegisterZstdDictionary(
+                  method->full_name(), dict.to_string()));
+    ASSERT_EQ(0u, brpc::policy::RegisterZstdDictionary(
+                  "test.EchoService.NotExist", dict.to_string()));
+
+    test::EchoRequest req;
+    MakeEchoRequest(12345, &req);
+    butil::IOBuf with_dict;
+    butil::IOBuf without_dict;
+    ASSERT_TRUE(brpc::policy::ZstdCompress(req, &with_dict, dict_id));
+    ASSERT_TRUE(brpc::policy::ZstdCompress(req, &without_dict));
+    ASSERT_LT(with_dict.size(), without_dict.size());
+
+    test::EchoRequest req2;
+    ASSERT_TRUE(brpc::policy::ZstdDecompress(with_dict, &req2, dict_id));
+    ASSERT_EQ(req.message(), req2.message());
+    ASSERT_EQ(req.code(), req2.code());
+    // The dictionary is required.
+    ASSERT_FALSE(brpc::policy::ZstdDecompress(with_dict, &req2));
+    ASSERT_FALSE(brpc::policy::ZstdDecompress(with_dict, &req2, dict_id + 1));
+}
+#endif  // BRPC_WITH_ZSTD
+
 TEST_F(test_compress_method, mass_snappy) {
     snappy_message::SnappyMessageProto old_msg;
     int len = 12435; 
@@ -194,6 +360,16 @@ TEST_F(test_compress_method, throughput_compare) {
         CompressMessage("Zlib", k, old_msg, len, 
                          brpc::policy::ZlibCompress, 
                          brpc::policy::ZlibDecompress);
+#ifdef BRPC_WITH_LZ4
+        CompressMessage("Lz4", k, old_msg, len,
+                         brpc::policy::Lz4Compress,
+                         brpc::policy::Lz4Decompress);
+#endif
+#ifdef BRPC_WITH_ZSTD
+        CompressMessage("Zstd", k, old_msg, len,
+                         brpc::policy::ZstdCompress,
+                         brpc::policy::ZstdDecompress);
+#endif
         printf("\n");
         delete [] text;
     }
@@ -228,6 +404,16 @@ TEST_F(test_compress_method, throughput_compare_complete_random) {
         CompressMessage("Zlib", k, old_msg, len, 
                          brpc::policy::ZlibCompress, 
                          brpc::policy::ZlibDecompress);
+#ifdef BRPC_WITH_LZ4
+        CompressMessage("Lz4", k, old_msg, len,
+                         brpc::policy::Lz4Compress,
+                         brpc::policy::Lz4Decompress);
+#endif
+#ifdef BRPC_WITH_ZSTD
+        CompressMessage("Zstd", k, old_msg, len,
+                         brpc::policy::ZstdCompress,
+                         brpc::policy::ZstdDecompress);
+#endif
         printf("\n");
         delete [] text;
     }
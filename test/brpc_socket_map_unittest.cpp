@@ -19,16 +19,19 @@
 
 // Date: Sun Jul 13 15:04:18 CST 2014
 
+#include <set>
 #include <gtest/gtest.h>
 #include <gflags/gflags.h>
 #include "brpc/socket.h"
 #include "brpc/socket_map.h"
+#include "butil/fd_guard.h"
 #include "brpc/reloadable_flags.h"
 
 namespace brpc {
 DECLARE_int32(idle_timeout_second);
 DECLARE_int32(defer_close_second);
 DECLARE_int32(max_connection_pool_size);
+DECLARE_int32(min_connection_pool_size);
 } // namespace brpc
 
 namespace {
@@ -111,6 +114,36 @@ TEST_F(SocketMapTest, idle_timeout) {
     brpc::SocketMapRemove(g_key);
 }
 
+TEST_F(SocketMapTest, many_keys) {
+    const int NKEY = 200;
+    std::vector<brpc::SocketMapKey> keys;
+    std::set<brpc::SocketId> ids;
+    for (int i = 0; i < NKEY; ++i) {
+        butil::EndPoint ep(butil::my_ip(), 20000 + i);
+        keys.push_back(brpc::SocketMapKey(ep));
+        brpc::SocketId id;
+        ASSERT_EQ(0, brpc::SocketMapInsert(keys.back(), &id));
+        brpc::SocketId id2;
+        ASSERT_EQ(0, brpc::SocketMapInsert(keys.back(), &id2));
+        ASSERT_EQ(id, id2);
+        ids.insert(id);
+    }
+    ASSERT_EQ((size_t)NKEY, ids.size());
+    std::vector<brpc::SocketId> listed;
+    brpc::SocketMapList(&listed);
+    for (size_t i = 0; i < listed.size(); ++i) {
+        ids.erase(listed[i]);
+    }
+    ASSERT_TRUE(ids.empty());
+    for (int i = 0; i < NKEY; ++i) {
+        brpc::SocketId id;
+        brpc::SocketMapRemove(keys[i]);
+        ASSERT_EQ(0, brpc::SocketMapFind(keys[i], &id));
+        brpc::SocketMapRemove(keys[i]);
+        ASSERT_EQ(-1, brpc::SocketMapFind(keys[i], &id));
+    }
+}
+
 TEST_F(SocketMapTest, max_pool_size) {
     const int MAXSIZE = 5;
     const int TOTALSIZE = MAXSIZE + 5;
@@ -140,6 +173,106 @@ TEST_F(SocketMapTest, max_pool_size) {
         EXPECT_TRUE(ptrs[i]->Failed());
     }
 }
+
+TEST_F(SocketMapTest, warm_up_pool) {
+    brpc::FLAGS_max_connection_pool_size = 100;
+    // Keep warmed sockets from being closed by SocketMap in background.
+    brpc::FLAGS_min_connection_pool_size = 3;
+    butil::EndPoint ep;
+    ASSERT_EQ(0, butil::str2endpoint("127.0.0.1:0", &ep));
+    // Connections are accepted by the kernel without calling accept().
+    butil::fd_guard listen_fd(butil::tcp_listen(ep));
+    ASSERT_GE(listen_fd, 0);
+    ASSERT_EQ(0, butil::get_local_side(listen_fd, &ep));
+    const brpc::SocketMapKey key(ep);
+    brpc::SocketId main_id;
+    ASSERT_EQ(0, brpc::SocketMapInsert(key, &main_id));
+    brpc::SocketUniquePtr main_ptr;
+    ASSERT_EQ(0, brpc::Socket::Address(main_id, &main_ptr));
+
+    main_ptr->WarmUpSocketPool(3);
+    std::vector<brpc::SocketId> ids;
+    for (int i = 0; i < 200 && ids.size() < 3; ++i) {
+        usleep(10000);
+        main_ptr->ListPooledSockets(&ids);
+    }
+    ASSERT_EQ(3u, ids.size());
+    // Pooled sockets are connected.
+    brpc::SocketUniquePtr ptr;
+    ASSERT_EQ(0, main_ptr->GetPooledSocket(&ptr));
+    ASSERT_EQ(ids.back(), ptr->id());
+    ASSERT_GE(ptr->fd(), 0);
+    int numfree = 0;
+    int numinflight = 0;
+    ASSERT_TRUE(main_ptr->GetPooledSocketStats(&numfree, &numinflight));
+    ASSERT_EQ(2, numfree);
+    ASSERT_EQ(1, numinflight);
+    ASSERT_EQ(0, ptr->ReturnToPool());
+    ptr.reset();
+
+    // Unused sockets are closed one by one.
+    brpc::FLAGS_min_connection_pool_size = 1;
+    for (int i = 0; i < 200 && ids.size() > 1; ++i) {
+        main_ptr->ResizeSocketPool();
+        main_ptr->ListPooledSockets(&ids);
+    }
+    ASSERT_EQ(1u, ids.size());
+
+    // Grow to -min_connection_pool_size.
+    brpc::FLAGS_min_connection_pool_size = 2;
+    main_ptr->ResizeSocketPool();
+    for (int i = 0; i < 200 && ids.size() < 2; ++i) {
+        usleep(10000);
+        main_ptr->ListPooledSockets(&ids);
+    }
+    ASSERT_EQ(2u, ids.size());
+    brpc::FLAGS_min_connection_pool_size = 0;
+    main_ptr.reset();
+    brpc::SocketMapRemove(key);
+}
+
+TEST_F(SocketMapTest, multiplexed_sockets) {
+    butil::EndPoint ep;
+    ASSERT_EQ(0, butil::str2endpoint("127.0.0.1:12346", &ep));
+    const brpc::SocketMapKey key(ep);
+    brpc::SocketId main_id;
+    ASSERT_EQ(0, brpc::SocketMapInsert(key, &main_id));
+    brpc::SocketUniquePtr main_ptr;
+    ASSERT_EQ(0, brpc::Socket::Address(main_id, &main_ptr));
+
+    // Idle connections are used in turn.
+    std::set<brpc::SocketId> ids;
+    for (int i = 0; i < 3; ++i) {
+        brpc::SocketUniquePtr ptr;
+        ASSERT_EQ(0, main_ptr->GetMultiplexedSocket(3, &ptr));
+        ASSERT_EQ(ep, ptr->remote_side());
+        ids.insert(ptr->id());
+    }
+    ASSERT_EQ(3u, ids.size());
+    ASSERT_EQ(1u, ids.count(main_id));
+
+    // Failed connections are replaced.
+    ids.erase(main_id);
+    const brpc::SocketId failed_id = *ids.begin();
+    ASSERT_EQ(0, brpc::Socket::SetFailed(failed_id));
+    std::set<brpc::SocketId> ids2;
+    for (int i = 0; i < 3; ++i) {
+        brpc::SocketUniquePtr ptr;
+        ASSERT_EQ(0, main_ptr->GetMultiplexedSocket(3, &ptr));
+        ids2.insert(ptr->id());
+    }
+    ASSERT_EQ(3u, ids2.size());
+    ASSERT_EQ(0u, ids2.count(failed_id));
+
+    // Multiplexed connections are recycled along with the main socket.
+    main_ptr.reset();
+    brpc::SocketMapRemove(key);
+    for (std::set<brpc::SocketId>::iterator it = ids2.begin();
+         it != ids2.end(); ++it) {
+        brpc::SocketUniquePtr ptr;
+        ASSERT_NE(0, brpc::Socket::Address(*it, &ptr));
+    }
+}
 } //namespace
 
 int main(int argc, char* argv[]) {
@@ -28,6 +28,7 @@
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "butil/fd_utility.h"
+#include "butil/fd_guard.h"
 #include "bthread/unstable.h"
 #include "bthread/task_control.h"
 #include "brpc/socket.h"
@@ -53,6 +54,11 @@ extern TaskControl* g_task_control;
 
 namespace brpc {
 DECLARE_int32(health_check_interval);
+DECLARE_bool(socket_zerocopy);
+DECLARE_int64(socket_zerocopy_min_bytes);
+DECLARE_int32(socket_write_coalescing_us);
+DECLARE_bool(socket_write_cork);
+DECLARE_bool(socket_keep_epollout);
 }
 
 void EchoProcessHuluRequest(brpc::InputMessageBase* msg_base);
@@ -108,6 +114,32 @@ class CheckRecycle : public brpc::SocketUser {
     }
 };
 
+static size_t CachelineOf(const brpc::Socket* s, const void* field) {
+    return ((const char*)field - (const char*)s) / BAIDU_CACHELINE_SIZE;
+}
+
+TEST_F(SocketTest, hot_fields_in_separate_cachelines) {
+    brpc::SocketOptions options;
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    ASSERT_EQ(0u, (uintptr_t)s.get() % BAIDU_CACHELINE_SIZE);
+    const size_t ref_line = CachelineOf(s.get(), &s->_versioned_ref);
+    const size_t shared_line = CachelineOf(s.get(), &s->_shared_part);
+    const size_t read_line = CachelineOf(s.get(), &s->_nevent);
+    const size_t write_line = CachelineOf(s.get(), &s->_write_head);
+    const size_t cold_line = CachelineOf(s.get(), &s->_tos);
+    ASSERT_LT(ref_line, shared_line);
+    ASSERT_LT(shared_line, read_line);
+    ASSERT_LT(read_line, write_line);
+    ASSERT_LT(write_line, cold_line);
+    // Fields of the reading side don't share cachelines with the writing side.
+    ASSERT_LT(CachelineOf(s.get(), &s->_ninprocess), write_line);
+    ASSERT_LT(CachelineOf(s.get(), &s->_epollout_kept), cold_line);
+    s->SetFailed();
+}
+
 TEST_F(SocketTest, not_recycle_until_zero_nref) {
     std::cout << "sizeof(Socket)=" << sizeof(brpc::Socket) << std::endl;
     int fds[2];
@@ -287,6 +319,252 @@ TEST_F(SocketTest, single_threaded_write) {
     close(fds[0]);
 }
 
+TEST_F(SocketTest, coalesced_write) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    brpc::SocketOptions options;
+    options.fd = fds[1];
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    s->set_write_coalescing_us(100000);
+    std::string expected;
+    for (int i = 0; i < 10; ++i) {
+        char buf[32];
+        const int len = snprintf(buf, sizeof(buf), "command %d\r\n", i);
+        expected.append(buf, len);
+        butil::IOBuf src;
+        src.append(buf, len);
+        ASSERT_EQ(0, s->Write(&src));
+    }
+    // Nothing is written within the window.
+    bthread_usleep(20000);
+    butil::make_non_blocking(fds[0]);
+    char dest[256];
+    ASSERT_EQ(-1, read(fds[0], dest, sizeof(dest)));
+    ASSERT_EQ(EAGAIN, errno);
+    // All requests are written together in order after the window.
+    butil::make_blocking(fds[0]);
+    std::string received;
+    while (received.size() < expected.size()) {
+        const ssize_t nr = read(fds[0], dest, sizeof(dest));
+        ASSERT_GT(nr, 0);
+        received.append(dest, nr);
+    }
+    ASSERT_EQ(expected, received);
+    ASSERT_EQ(0, s->SetFailed());
+    s.reset();
+    close(fds[0]);
+}
+
+TEST_F(SocketTest, coalesced_and_corked_write) {
+    const int32_t saved_coalescing_us = brpc::FLAGS_socket_write_coalescing_us;
+    const bool saved_cork = brpc::FLAGS_socket_write_cork;
+    brpc::FLAGS_socket_write_coalescing_us = 50000;
+    brpc::FLAGS_socket_write_cork = true;
+
+    butil::EndPoint point(butil::IP_ANY, 7880);
+    butil::fd_guard listening_fd(tcp_listen(point));
+    ASSERT_GT(listening_fd, 0);
+    butil::EndPoint server_point(butil::my_ip(), 7880);
+    butil::fd_guard client_fd(butil::tcp_connect(server_point, NULL));
+    ASSERT_GT(client_fd, 0);
+    const int server_fd = accept(listening_fd, NULL, NULL);
+    ASSERT_GT(server_fd, 0);
+    brpc::SocketOptions options;
+    options.fd = server_fd;
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    std::string expected;
+    for (int i = 0; i < 100; ++i) {
+        char buf[32];
+        const int len = snprintf(buf, sizeof(buf), "response %d\r\n", i);
+        expected.append(buf, len);
+        butil::IOBuf src;
+        src.append(buf, len);
+        ASSERT_EQ(0, s->Write(&src));
+    }
+    // Written in order and TCP_CORK is cleared after all data is written,
+    // otherwise the tail of the data would be delayed for 200ms.
+    const int64_t start_us = butil::gettimeofday_us();
+    std::string received;
+    char dest[1024];
+    while (received.size() < expected.size()) {
+        const ssize_t nr = read(client_fd, dest, sizeof(dest));
+        ASSERT_GT(nr, 0);
+        received.append(dest, nr);
+    }
+    ASSERT_LT(butil::gettimeofday_us() - start_us, 150000);
+    ASSERT_EQ(expected, received);
+    ASSERT_EQ(0, s->SetFailed());
+    s.reset();
+    brpc::FLAGS_socket_write_coalescing_us = saved_coalescing_us;
+    brpc::FLAGS_socket_write_cork = saved_cork;
+}
+
+static void IgnoreEdgeTriggeredEvents(brpc::Socket*) {}
+
+static int64_t ExposedCount(const char* name) {
+    return strtoll(bvar::Variable::describe_exposed(name).c_str(), NULL, 10);
+}
+
+TEST_F(SocketTest, write_with_kept_epollout) {
+    const bool saved_keep = brpc::FLAGS_socket_keep_epollout;
+    brpc::FLAGS_socket_keep_epollout = true;
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    butil::fd_guard reader_fd(fds[0]);
+    brpc::SocketOptions options;
+    options.fd = fds[1];
+    options.on_edge_triggered_events = IgnoreEdgeTriggeredEvents;
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    const int64_t nwait0 = ExposedCount("rpc_waitepollout_count");
+    const int64_t nctl0 = ExposedCount("rpc_epoll_ctl_count");
+    // Much more than the buffer of the socket, the KeepWrite bthread has
+    // to wait for EPOLLOUT many times while the data is read slowly.
+    const size_t N = 8 * 1024 * 1024;
+    std::string expected(N, 0);
+    for (size_t i = 0; i < N; ++i) {
+        expected[i] = (char)i;
+    }
+    butil::IOBuf src;
+    src.append(expected);
+    ASSERT_EQ(0, s->Write(&src));
+    std::string received;
+    char dest[16384];
+    while (received.size() < N) {
+        const ssize_t nr = read(reader_fd, dest, sizeof(dest));
+        ASSERT_GT(nr, 0);
+        received.append(dest, nr);
+    }
+    ASSERT_TRUE(expected == received);
+    const int64_t nwait = ExposedCount("rpc_waitepollout_count") - nwait0;
+    const int64_t nctl = ExposedCount("rpc_epoll_ctl_count") - nctl0;
+    ASSERT_GT(nwait, 4);
+    // EPOLLOUT is added once instead of being added and removed per wait.
+    ASSERT_LT(nctl, nwait);
+    ASSERT_TRUE(s->_epollout_kept);
+    ASSERT_EQ(0, s->SetFailed());
+    s.reset();
+    brpc::FLAGS_socket_keep_epollout = saved_keep;
+}
+
+TEST_F(SocketTest, zerocopy_write) {
+    const bool saved_zerocopy = brpc::FLAGS_socket_zerocopy;
+    const int64_t saved_min_bytes = brpc::FLAGS_socket_zerocopy_min_bytes;
+    brpc::FLAGS_socket_zerocopy = true;
+    brpc::FLAGS_socket_zerocopy_min_bytes = 4096;
+
+    butil::EndPoint point(butil::IP_ANY, 7879);
+    butil::fd_guard listening_fd(tcp_listen(point));
+    ASSERT_GT(listening_fd, 0);
+    butil::EndPoint server_point(butil::my_ip(), 7879);
+    const int client_fd = butil::tcp_connect(server_point, NULL);
+    ASSERT_GT(client_fd, 0);
+    butil::fd_guard server_fd(accept(listening_fd, NULL, NULL));
+    ASSERT_GT(server_fd, 0);
+
+    brpc::SocketId id = 8888;
+    brpc::SocketOptions options;
+    options.fd = client_fd;
+    options.remote_side = server_point;
+    options.user = new CheckRecycle;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    {
+        brpc::SocketUniquePtr s;
+        ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+        global_sock = s.get();
+        // Mix small writes which are copied with large zero-copy ones.
+        std::string expected;
+        for (size_t i = 0; i < 8; ++i) {
+            const size_t len = (i % 2 == 0 ? 100 : 1024 * 1024 + i);
+            std::string str(len, 'a' + i);
+            butil::IOBuf src;
+            src.append(str);
+            ASSERT_EQ(0, s->Write(&src));
+            expected.append(str);
+        }
+        std::string received;
+        char buf[65536];
+        while (received.size() < expected.size()) {
+            const ssize_t nr = read(server_fd, buf, sizeof(buf));
+            ASSERT_GT(nr, 0);
+            received.append(buf, nr);
+        }
+        ASSERT_EQ(expected, received);
+        ASSERT_EQ(0, s->SetFailed());
+    }
+    ASSERT_EQ((brpc::Socket*)NULL, global_sock);
+
+    brpc::FLAGS_socket_zerocopy = saved_zerocopy;
+    brpc::FLAGS_socket_zerocopy_min_bytes = saved_min_bytes;
+}
+
+TEST_F(SocketTest, write_file) {
+    char filename[] = "/tmp/brpc_socket_write_file_XXXXXX";
+    butil::fd_guard file_fd(mkstemp(filename));
+    ASSERT_GT(file_fd, 0);
+    unlink(filename);
+    std::string content;
+    for (int i = 0; i < 100000; ++i) {
+        content.push_back('a' + i % 26);
+    }
+    ASSERT_EQ((ssize_t)content.size(),
+              write(file_fd, content.data(), content.size()));
+
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    brpc::SocketOptions options;
+    options.fd = fds[1];
+    brpc::SocketId id;
+    ASSERT_EQ(0, brpc::Socket::Create(options, &id));
+    brpc::SocketUniquePtr s;
+    ASSERT_EQ(0, brpc::Socket::Address(id, &s));
+    std::string expected;
+    for (int i = 0; i < 3; ++i) {
+        butil::IOBuf prefix;
+        prefix.append("prefix");
+        butil::IOBuf suffix;
+        suffix.append("suffix");
+        const off_t offset = i * 1000;
+        const size_t length = content.size() - offset;
+        ASSERT_EQ(0, s->WriteFile(&prefix, file_fd, offset, length, &suffix));
+        expected.append("prefix");
+        expected.append(content, offset, length);
+        expected.append("suffix");
+    }
+    // Requests written after file regions are not reordered.
+    butil::IOBuf src;
+    src.append("end");
+    ASSERT_EQ(0, s->Write(&src));
+    expected.append("end");
+
+    std::string received;
+    char buf[65536];
+    while (received.size() < expected.size()) {
+        const ssize_t nr = read(fds[0], buf, sizeof(buf));
+        ASSERT_GT(nr, 0);
+        received.append(buf, nr);
+    }
+    ASSERT_EQ(expected, received);
+
+    // Regions beyond the file fail the socket.
+    butil::IOBuf prefix;
+    ASSERT_EQ(0, s->WriteFile(&prefix, file_fd, content.size() - 10, 100, NULL));
+    for (int i = 0; i < 100 && !s->Failed(); ++i) {
+        bthread_usleep(10000);
+    }
+    ASSERT_TRUE(s->Failed());
+    s.reset();
+    close(fds[0]);
+}
+
 void EchoProcessHuluRequest(brpc::InputMessageBase* msg_base) {
     brpc::DestroyingPtr<brpc::policy::MostCommonMessage> msg(
         static_cast<brpc::policy::MostCommonMessage*>(msg_base));
@@ -777,6 +1055,57 @@ TEST_F(SocketTest, health_check) {
     ASSERT_EQ(-1, brpc::Socket::Address(id, &ptr));
 }
 
+TEST_F(SocketTest, health_check_shared_by_endpoint) {
+    // Messenger has to be new otherwise quitting may crash.
+    brpc::Acceptor* messenger = new brpc::Acceptor;
+    butil::EndPoint point(butil::IP_ANY, 7879);
+    // Sockets connecting to the same endpoint share the checking.
+    const int N = 3;
+    brpc::SocketId ids[N];
+    for (int i = 0; i < N; ++i) {
+        brpc::SocketOptions options;
+        options.remote_side = point;
+        options.health_check_interval_s = 1/*s*/;
+        ASSERT_EQ(0, brpc::Socket::Create(options, &ids[i]));
+        brpc::SocketUniquePtr s;
+        ASSERT_EQ(0, brpc::Socket::Address(ids[i], &s));
+        ASSERT_EQ(0, s->SetFailed());
+    }
+    // Let the sockets fail checks before the server is up.
+    bthread_usleep(1500000);
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(1, brpc::Socket::Status(ids[i]));
+    }
+
+    const brpc::InputMessageHandler pairs[] = {
+        { brpc::policy::ParseHuluMessage, 
+          EchoProcessHuluRequest, NULL, NULL, "dummy_hulu" }
+    };
+    int listening_fd = tcp_listen(point);
+    ASSERT_TRUE(listening_fd > 0);
+    butil::make_non_blocking(listening_fd);
+    ASSERT_EQ(0, messenger->AddHandler(pairs[0]));
+    ASSERT_EQ(0, messenger->StartAccept(listening_fd, -1, NULL));
+
+    // All sockets are revived after the socket checking the endpoint
+    // succeeds.
+    const int64_t start_time = butil::gettimeofday_us();
+    for (int i = 0; i < N; ++i) {
+        while (brpc::Socket::Status(ids[i]) != 0) {
+            bthread_usleep(1000);
+            ASSERT_LT(butil::gettimeofday_us(), start_time + 3000000L);
+        }
+    }
+
+    messenger->StopAccept(0);
+    for (int i = 0; i < N; ++i) {
+        brpc::SocketUniquePtr s;
+        ASSERT_EQ(0, brpc::Socket::Address(ids[i], &s));
+        s->ReleaseAdditionalReference();
+        ASSERT_EQ(0, s->SetFailed());
+    }
+}
+
 void* Writer(void* void_arg) {
     WriterArg* arg = static_cast<WriterArg*>(void_arg);
     brpc::SocketUniquePtr sock;
@@ -0,0 +1,91 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <gtest/gtest.h>
+#include "butil/third_party/rapidjson/document.h"
+#include "brpc/details/span_exporter.h"
+
+namespace {
+
+void MakeSpans(std::vector<brpc::RpczSpan>* spans) {
+    brpc::RpczSpan server;
+    server.set_trace_id(0x1234);
+    server.set_span_id(0x10);
+    server.set_parent_span_id(0);
+    server.set_type(brpc::SPAN_TYPE_SERVER);
+    server.set_received_real_us(1000);
+    server.set_sent_real_us(3000);
+    server.set_full_method_name("test.EchoService.Echo");
+    server.set_info("\1" "2000 say \"hi\"");
+    brpc::RpczSpan* client = server.add_client_spans();
+    client->set_trace_id(0x1234);
+    client->set_span_id(0x11);
+    client->set_parent_span_id(0x10);
+    client->set_type(brpc::SPAN_TYPE_CLIENT);
+    client->set_start_send_real_us(1500);
+    client->set_received_real_us(2500);
+    client->set_error_code(1008);
+    client->set_full_method_name("test.EchoService.Echo");
+    spans->push_back(server);
+}
+
+TEST(SpanExporterTest, otlp) {
+    std::vector<brpc::RpczSpan> spans;
+    MakeSpans(&spans);
+    std::string body;
+    ASSERT_TRUE(brpc::SerializeSpansForExport(spans, "otlp", "echo_server", &body));
+    BUTIL_RAPIDJSON_NAMESPACE::Document d;
+    d.Parse(body.c_str());
+    ASSERT_FALSE(d.HasParseError()) << body;
+    const BUTIL_RAPIDJSON_NAMESPACE::Value& scope_spans =
+        d["resourceSpans"][0]["scopeSpans"][0]["spans"];
+    ASSERT_EQ(2u, scope_spans.Size());
+    ASSERT_STREQ("00000000000000000000000000001234",
+                 scope_spans[0]["traceId"].GetString());
+    ASSERT_STREQ("0000000000000010", scope_spans[0]["spanId"].GetString());
+    ASSERT_FALSE(scope_spans[0].HasMember("parentSpanId"));
+    ASSERT_EQ(2, scope_spans[0]["kind"].GetInt());
+    ASSERT_STREQ("1000000", scope_spans[0]["startTimeUnixNano"].GetString());
+    ASSERT_STREQ("3000000", scope_spans[0]["endTimeUnixNano"].GetString());
+    ASSERT_STREQ("say \"hi\"", scope_spans[0]["events"][0]["name"].GetString());
+    ASSERT_STREQ("0000000000000010", scope_spans[1]["parentSpanId"].GetString());
+    ASSERT_EQ(3, scope_spans[1]["kind"].GetInt());
+    ASSERT_EQ(2, scope_spans[1]["status"]["code"].GetInt());
+}
+
+TEST(SpanExporterTest, zipkin) {
+    std::vector<brpc::RpczSpan> spans;
+    MakeSpans(&spans);
+    std::string body;
+    ASSERT_TRUE(brpc::SerializeSpansForExport(spans, "zipkin", "echo_server", &body));
+    BUTIL_RAPIDJSON_NAMESPACE::Document d;
+    d.Parse(body.c_str());
+    ASSERT_FALSE(d.HasParseError()) << body;
+    ASSERT_EQ(2u, d.Size());
+    ASSERT_STREQ("0000000000001234", d[0]["traceId"].GetString());
+    ASSERT_STREQ("SERVER", d[0]["kind"].GetString());
+    ASSERT_EQ(1000, d[0]["timestamp"].GetInt64());
+    ASSERT_EQ(2000, d[0]["duration"].GetInt64());
+    ASSERT_STREQ("echo_server", d[0]["localEndpoint"]["serviceName"].GetString());
+    ASSERT_STREQ("CLIENT", d[1]["kind"].GetString());
+    ASSERT_STREQ("1008", d[1]["tags"]["error"].GetString());
+
+    ASSERT_FALSE(brpc::SerializeSpansForExport(spans, "jaeger", "echo_server", &body));
+}
+
+} // namespace
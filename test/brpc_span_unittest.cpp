@@ -0,0 +1,63 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "bvar/variable.h"
+#include "brpc/span.h"
+
+namespace brpc {
+DECLARE_int64(rpcz_tail_sampling_latency_us);
+DECLARE_int32(rpcz_tail_sampling_percentile);
+}
+
+namespace {
+
+brpc::Span* MakeServerSpan(int64_t latency_us, int error_code) {
+    brpc::Span* span = brpc::Span::CreateServerSpan(0, 0, 0, 1000000);
+    span->set_received_us(0);
+    span->set_sent_us(latency_us);
+    span->set_error_code(error_code);
+    return span;
+}
+
+TEST(SpanTest, tail_sampling_keeps_failed_and_slow_spans) {
+    const int64_t saved_latency_us = brpc::FLAGS_rpcz_tail_sampling_latency_us;
+    const int32_t saved_percentile = brpc::FLAGS_rpcz_tail_sampling_percentile;
+    brpc::FLAGS_rpcz_tail_sampling_latency_us = 100000;
+    brpc::FLAGS_rpcz_tail_sampling_percentile = 0;
+
+    brpc::Span* failed = MakeServerSpan(10, 1008);
+    ASSERT_TRUE(brpc::IsTailSampled(failed));
+    failed->destroy();
+
+    brpc::Span* slow = MakeServerSpan(200000, 0);
+    ASSERT_TRUE(brpc::IsTailSampled(slow));
+    slow->destroy();
+
+    // Whether fast and successful spans are kept depends on the speed
+    // limit of rpcz, they're counted either way.
+    brpc::Span* fast = MakeServerSpan(10, 0);
+    brpc::IsTailSampled(fast);
+    fast->destroy();
+    ASSERT_EQ("3", bvar::Variable::describe_exposed("rpcz_tail_sampling_count"));
+
+    brpc::FLAGS_rpcz_tail_sampling_latency_us = saved_latency_us;
+    brpc::FLAGS_rpcz_tail_sampling_percentile = saved_percentile;
+}
+
+}  // namespace
@@ -26,6 +26,7 @@
 #include <butil/macros.h>
 #include <butil/fd_guard.h>
 #include <butil/files/scoped_file.h>
+#include "bvar/variable.h"
 #include "brpc/global.h"
 #include "brpc/socket.h"
 #include "brpc/server.h"
@@ -35,6 +36,8 @@
 #include "echo.pb.h"
 
 namespace brpc {
+DECLARE_bool(ssl_ktls);
+DECLARE_int32(ssl_handshake_threads);
 void ExtractHostnames(X509* x, std::vector<std::string>* hostnames);
 } // namespace brpc
 
@@ -175,6 +178,133 @@ TEST_F(SSLTest, sanity) {
     ASSERT_EQ(0, server.Join());
 }
 
+TEST_F(SSLTest, ktls) {
+    // Whether kTLS is actually used depends on OpenSSL and the kernel,
+    // results must be the same either way.
+    brpc::FLAGS_ssl_ktls = true;
+    const int port = 8613;
+    brpc::Server server;
+    brpc::ServerOptions options;
+    brpc::CertInfo cert;
+    cert.certificate = "cert1.crt";
+    cert.private_key = "cert1.key";
+    options.mutable_ssl_options()->default_cert = cert;
+    EchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(
+        &echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, &options));
+    {
+        brpc::Channel channel;
+        brpc::ChannelOptions coptions;
+        coptions.mutable_ssl_options()->sni_name = "localhost";
+        ASSERT_EQ(0, channel.Init("127.0.0.1", port, &coptions));
+        test::EchoService_Stub stub(&channel);
+        for (int i = 0; i < 10; ++i) {
+            brpc::Controller cntl;
+            test::EchoRequest req;
+            test::EchoResponse res;
+            req.set_message(EXP_REQUEST);
+            // Spans multiple TLS records.
+            cntl.request_attachment().append(std::string(256 * 1024, 'a' + i));
+            stub.Echo(&cntl, &req, &res, NULL);
+            ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+            EXPECT_EQ(EXP_RESPONSE, res.message());
+        }
+        std::vector<brpc::SocketId> ids;
+        brpc::SocketMapList(&ids);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            brpc::SocketUniquePtr sock;
+            if (brpc::Socket::Address(ids[i], &sock) == 0) {
+                LOG(INFO) << "kTLS send of " << *sock << " is "
+                          << (sock->_ktls_send ? "on" : "off");
+            }
+        }
+    }
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+    brpc::FLAGS_ssl_ktls = false;
+}
+
+static int64_t GetExposedCount(const char* name);
+
+TEST_F(SSLTest, handshake_pool) {
+    brpc::FLAGS_ssl_handshake_threads = 2;
+    const int port = 8613;
+    brpc::Server server;
+    brpc::ServerOptions options;
+    brpc::CertInfo cert;
+    cert.certificate = "cert1.crt";
+    cert.private_key = "cert1.key";
+    options.mutable_ssl_options()->default_cert = cert;
+    EchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(
+        &echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, &options));
+    {
+        // Channels of different groups don't share connections.
+        const int NCHANNEL = 8;
+        brpc::Channel channels[NCHANNEL];
+        for (int i = 0; i < NCHANNEL; ++i) {
+            brpc::ChannelOptions coptions;
+            coptions.mutable_ssl_options()->sni_name = "localhost";
+            coptions.connection_group = "handshake_pool" + std::to_string(i);
+            ASSERT_EQ(0, channels[i].Init("127.0.0.1", port, &coptions));
+        }
+        for (int i = 0; i < NCHANNEL; ++i) {
+            brpc::Controller cntl;
+            test::EchoRequest req;
+            test::EchoResponse res;
+            req.set_message(EXP_REQUEST);
+            test::EchoService_Stub stub(&channels[i]);
+            stub.Echo(&cntl, &req, &res, NULL);
+            ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+            EXPECT_EQ(EXP_RESPONSE, res.message());
+        }
+    }
+    // Handshakes of both sides ran in the pool.
+    ASSERT_GE(GetExposedCount("rpc_ssl_handshake_queue_count"), 16);
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+    brpc::FLAGS_ssl_handshake_threads = 0;
+}
+
+static int64_t GetExposedCount(const char* name) {
+    const std::string value = bvar::Variable::describe_exposed(name);
+    return value.empty() ? -1 : strtoll(value.c_str(), NULL, 10);
+}
+
+TEST_F(SSLTest, client_session_resumption) {
+    const int port = 8613;
+    brpc::Server server;
+    brpc::ServerOptions options;
+    brpc::CertInfo cert;
+    cert.certificate = "cert1.crt";
+    cert.private_key = "cert1.key";
+    options.mutable_ssl_options()->default_cert = cert;
+    EchoServiceImpl echo_svc;
+    ASSERT_EQ(0, server.AddService(
+        &echo_svc, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, &options));
+
+    const int64_t hit0 = GetExposedCount("rpc_client_ssl_session_hit_count");
+    const int64_t miss0 = GetExposedCount("rpc_client_ssl_session_miss_count");
+    {
+        brpc::Channel channel;
+        brpc::ChannelOptions coptions;
+        coptions.connection_type = "short";
+        coptions.mutable_ssl_options()->sni_name = "localhost";
+        ASSERT_EQ(0, channel.Init("127.0.0.1", port, &coptions));
+        // Every RPC creates a new connection, all but the first one
+        // resume the session.
+        SendMultipleRPC(&channel, 5);
+    }
+    EXPECT_EQ(miss0 + 1, GetExposedCount("rpc_client_ssl_session_miss_count"));
+    EXPECT_EQ(hit0 + 4, GetExposedCount("rpc_client_ssl_session_hit_count"));
+
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
 void CheckCert(const char* cname, const char* cert) {
     const int port = 8613;
     brpc::Channel channel;
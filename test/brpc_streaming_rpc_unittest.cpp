@@ -20,13 +20,22 @@
 // Date: 2015/10/22 16:28:44
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 
 #include "brpc/server.h"
 #include "brpc/controller.h"
 #include "brpc/channel.h"
 #include "brpc/stream_impl.h"
+#include "brpc/policy/streaming_rpc_protocol.h"
 #include "echo.pb.h"
 
+namespace brpc {
+namespace policy {
+DECLARE_int64(stream_connection_buffer_budget);
+DECLARE_int64(stream_process_buffer_budget);
+}
+}
+
 class AfterAcceptStream {
 public:
     virtual void action(brpc::StreamId) = 0;
@@ -187,6 +196,110 @@ TEST_F(StreamingRpcTest, received_in_order) {
     ASSERT_EQ(N, handler._expected_next_value);
 }
 
+TEST_F(StreamingRpcTest, batched_write_received_in_order) {
+    OrderedInputHandler handler;
+    brpc::StreamOptions opt;
+    opt.handler = &handler;
+    opt.messages_in_batch = 100;
+    brpc::Server server;
+    MyServiceWithStream service(opt);
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(9007, NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:9007", NULL));
+    brpc::Controller cntl;
+    brpc::StreamId request_stream;
+    brpc::StreamOptions request_stream_options;
+    request_stream_options.write_coalescing_us = 1000;
+    ASSERT_EQ(0, StreamCreate(&request_stream, cntl, &request_stream_options));
+    brpc::ScopedStream stream_guard(request_stream);
+    test::EchoService_Stub stub(&channel);
+    stub.Echo(&cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText() << " request_stream=" << request_stream;
+    const int N = 10000;
+    const int BATCH = 10;
+    for (int i = 0; i < N; i += BATCH) {
+        butil::IOBuf out[BATCH];
+        for (int j = 0; j < BATCH; ++j) {
+            int network = htonl(i + j);
+            out[j].append(&network, sizeof(network));
+        }
+        int rc = 0;
+        while ((rc = brpc::StreamWrite(request_stream, out, BATCH)) == EAGAIN) {
+            ASSERT_EQ(0, brpc::StreamWait(request_stream, NULL));
+        }
+        ASSERT_EQ(0, rc) << "i=" << i;
+    }
+    // Single messages are mixed with batched ones in frames.
+    int network = htonl(N);
+    butil::IOBuf out;
+    out.append(&network, sizeof(network));
+    ASSERT_EQ(0, brpc::StreamWrite(request_stream, out));
+    ASSERT_EQ(0, brpc::StreamClose(request_stream));
+    server.Stop(0);
+    server.Join();
+    while (!handler.stopped()) {
+        usleep(100);
+    }
+    ASSERT_FALSE(handler.failed());
+    ASSERT_EQ(0, handler.idle_times());
+    ASSERT_EQ(N + 1, handler._expected_next_value);
+}
+
+#ifdef BRPC_WITH_ZSTD
+TEST_F(StreamingRpcTest, compressed_received_in_order) {
+    OrderedInputHandler handler;
+    brpc::StreamOptions opt;
+    opt.handler = &handler;
+    opt.messages_in_batch = 100;
+    brpc::Server server;
+    MyServiceWithStream service(opt);
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(9007, NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:9007", NULL));
+    brpc::Controller cntl;
+    brpc::StreamId request_stream;
+    brpc::StreamOptions request_stream_options;
+    request_stream_options.compress_type = brpc::COMPRESS_TYPE_ZSTD;
+    request_stream_options.write_coalescing_us = 1000;
+    ASSERT_EQ(0, StreamCreate(&request_stream, cntl, &request_stream_options));
+    brpc::ScopedStream stream_guard(request_stream);
+    test::EchoService_Stub stub(&channel);
+    stub.Echo(&cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText() << " request_stream=" << request_stream;
+    // Messages are decompressed with the history of former ones, in both
+    // batched and single frames.
+    const int N = 10000;
+    const int BATCH = 10;
+    for (int i = 0; i < N; i += BATCH) {
+        butil::IOBuf out[BATCH];
+        for (int j = 0; j < BATCH; ++j) {
+            int network = htonl(i + j);
+            out[j].append(&network, sizeof(network));
+        }
+        int rc = 0;
+        while ((rc = brpc::StreamWrite(request_stream, out, BATCH)) == EAGAIN) {
+            ASSERT_EQ(0, brpc::StreamWait(request_stream, NULL));
+        }
+        ASSERT_EQ(0, rc) << "i=" << i;
+    }
+    int network = htonl(N);
+    butil::IOBuf out;
+    out.append(&network, sizeof(network));
+    ASSERT_EQ(0, brpc::StreamWait(request_stream, NULL));
+    ASSERT_EQ(0, brpc::StreamWrite(request_stream, out));
+    ASSERT_EQ(0, brpc::StreamClose(request_stream));
+    server.Stop(0);
+    server.Join();
+    while (!handler.stopped()) {
+        usleep(100);
+    }
+    ASSERT_FALSE(handler.failed());
+    ASSERT_EQ(N + 1, handler._expected_next_value);
+}
+#endif  // BRPC_WITH_ZSTD
+
 void on_writable(brpc::StreamId, void* arg, int error_code) {
     std::pair<bool, int>* p = (std::pair<bool, int>*)arg;
     p->first = true;
@@ -293,6 +406,66 @@ TEST_F(StreamingRpcTest, block) {
     ASSERT_EQ(N + N + N, handler._expected_next_value);
 }
 
+TEST_F(StreamingRpcTest, stream_window) {
+    ASSERT_EQ(0, brpc::policy::GetStreamWindow(10));
+    brpc::policy::FLAGS_stream_connection_buffer_budget = 1000;
+    ASSERT_EQ(100, brpc::policy::GetStreamWindow(10));
+    ASSERT_EQ(1000, brpc::policy::GetStreamWindow(0));
+    ASSERT_EQ(1, brpc::policy::GetStreamWindow(2000));
+    brpc::policy::AddReceivingStreamCount(4);
+    brpc::policy::FLAGS_stream_process_buffer_budget = 200;
+    ASSERT_EQ(50, brpc::policy::GetStreamWindow(10));
+    brpc::policy::FLAGS_stream_connection_buffer_budget = 0;
+    ASSERT_EQ(50, brpc::policy::GetStreamWindow(1));
+    brpc::policy::AddReceivingStreamCount(-4);
+    brpc::policy::FLAGS_stream_process_buffer_budget = 0;
+}
+
+TEST_F(StreamingRpcTest, limited_by_connection_buffer_budget) {
+    const int64_t WINDOW = 100 * sizeof(int);
+    brpc::policy::FLAGS_stream_connection_buffer_budget = WINDOW;
+    HandlerControl hc;
+    OrderedInputHandler handler(&hc);
+    hc.block = true;
+    brpc::StreamOptions opt;
+    opt.handler = &handler;
+    brpc::Server server;
+    MyServiceWithStream service(opt);
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(9007, NULL));
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("127.0.0.1:9007", NULL));
+    brpc::Controller cntl;
+    brpc::StreamId request_stream;
+    ASSERT_EQ(0, StreamCreate(&request_stream, cntl, NULL));
+    brpc::ScopedStream stream_guard(request_stream);
+    test::EchoService_Stub stub(&channel);
+    stub.Echo(&cntl, &request, &response, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    // The window granted by the server is much smaller than max_buf_size.
+    int i = 0;
+    for (; i < 1000; ++i) {
+        int network = htonl(i);
+        butil::IOBuf out;
+        out.append(&network, sizeof(network));
+        if (brpc::StreamWrite(request_stream, out) != 0) {
+            break;
+        }
+    }
+    ASSERT_EQ(WINDOW / (int)sizeof(int), i);
+    brpc::policy::FLAGS_stream_connection_buffer_budget = 0;
+    hc.block = false;
+    ASSERT_EQ(0, brpc::StreamWait(request_stream, NULL));
+    while (handler._expected_next_value != i) {
+        usleep(100);
+    }
+    ASSERT_EQ(0, brpc::StreamClose(request_stream));
+    while (!handler.stopped()) {
+        usleep(100);
+    }
+    ASSERT_FALSE(handler.failed());
+}
+
 TEST_F(StreamingRpcTest, auto_close_if_host_socket_closed) {
     HandlerControl hc;
     OrderedInputHandler handler(&hc);
@@ -0,0 +1,73 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include "butil/iobuf.h"
+#include "brpc/rtmp.h"
+#include "brpc/ts.h"
+
+namespace {
+
+// Same with ts.cpp
+const size_t TS_PACKET_SIZE = 188;
+const int TS_PID_AUDIO_MP3 = 0x102;
+
+// Concatenate payloads of PES packets on `pid' in `ts'.
+std::string GetPESPayload(const butil::IOBuf& ts, int pid) {
+    std::string result;
+    const std::string data = ts.to_string();
+    for (size_t off = 0; off + TS_PACKET_SIZE <= data.size();
+         off += TS_PACKET_SIZE) {
+        const unsigned char* p = (const unsigned char*)data.data() + off;
+        EXPECT_EQ(0x47, p[0]);
+        if ((((p[1] & 0x1F) << 8) | p[2]) != pid) {
+            continue;
+        }
+        size_t pos = 4;
+        if (p[3] & 0x20) { // adaptation field
+            pos += 1 + p[4];
+        }
+        if (p[1] & 0x40) { // start of a PES packet
+            pos += 9 + p[pos + 8];
+        }
+        result.append((const char*)p + pos, TS_PACKET_SIZE - pos);
+    }
+    return result;
+}
+
+TEST(TsTest, pes_payload_is_intact) {
+    butil::IOBuf out;
+    brpc::TsWriter writer(&out);
+    std::string expected;
+    for (int i = 0; i < 3; ++i) {
+        brpc::RtmpAudioMessage msg;
+        msg.timestamp = 1000 + i * 20;
+        msg.codec = brpc::FLV_AUDIO_MP3;
+        msg.rate = brpc::FLV_SOUND_RATE_44100HZ;
+        msg.bits = brpc::FLV_SOUND_16BIT;
+        msg.type = brpc::FLV_SOUND_STEREO;
+        // Not aligned with size of TS packets.
+        const std::string data(1000 + i * 77, 'a' + i);
+        msg.data.append(data);
+        expected.append(data);
+        ASSERT_TRUE(writer.Write(msg).ok());
+    }
+    ASSERT_EQ(0u, out.size() % TS_PACKET_SIZE);
+    ASSERT_EQ(expected, GetPESPayload(out, TS_PID_AUDIO_MP3));
+}
+
+} // namespace
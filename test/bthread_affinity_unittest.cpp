@@ -0,0 +1,132 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <unistd.h>
+#include <set>
+#include <gtest/gtest.h>
+#include "butil/atomicops.h"
+#include "butil/logging.h"
+#include "bthread/task_group.h"
+#include "bthread/task_control.h"
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"
+
+namespace bthread {
+extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
+}
+
+namespace {
+
+void* get_control(void* arg) {
+    *static_cast<bthread::TaskControl**>(arg) =
+        bthread::tls_task_group->control();
+    return NULL;
+}
+
+// Wait until all workers are added into the tag so that the mapping from
+// affinity to groups is stable.
+bthread::TaskControl* get_control_after_workers_added() {
+    bthread::TaskControl* c = NULL;
+    bthread_t th;
+    EXPECT_EQ(0, bthread_start_background(&th, NULL, get_control, &c));
+    EXPECT_EQ(0, bthread_join(th, NULL));
+    const int n = c->concurrency(BTHREAD_TAG_DEFAULT);
+    while (true) {
+        std::set<bthread::TaskGroup*> groups;
+        for (int i = 0; i < n; ++i) {
+            groups.insert(c->choose_group_by_affinity(BTHREAD_TAG_DEFAULT, i));
+        }
+        if ((int)groups.size() == n) {
+            return c;
+        }
+        usleep(1000);
+    }
+}
+
+TEST(AffinityTest, same_affinity_same_group) {
+    bthread::TaskControl* c = get_control_after_workers_added();
+    const int n = c->concurrency(BTHREAD_TAG_DEFAULT);
+    ASSERT_GT(n, 0);
+    for (uint64_t i = 0; i < 100; ++i) {
+        bthread::TaskGroup* g =
+            c->choose_group_by_affinity(BTHREAD_TAG_DEFAULT, i);
+        ASSERT_TRUE(g != NULL);
+        ASSERT_EQ(g, c->choose_group_by_affinity(BTHREAD_TAG_DEFAULT, i + n));
+        if (i > 0 && i < (uint64_t)n) {
+            ASSERT_NE(g, c->choose_group_by_affinity(BTHREAD_TAG_DEFAULT, 0));
+        }
+    }
+    ASSERT_TRUE(c->choose_group_by_affinity(-2, 0) == NULL);
+}
+
+struct AffinityArg {
+    bthread::TaskGroup* target;
+    butil::atomic<int> nrun;
+    butil::atomic<int> non_target;
+};
+
+void* record_group(void* void_arg) {
+    AffinityArg* arg = static_cast<AffinityArg*>(void_arg);
+    if (bthread::tls_task_group != arg->target) {
+        arg->non_target.fetch_add(1);
+    }
+    arg->nrun.fetch_add(1);
+    return NULL;
+}
+
+const uint64_t AFFINITY = 1;
+
+void* spawn_with_affinity(void* void_arg) {
+    AffinityArg* arg = static_cast<AffinityArg*>(void_arg);
+    const int N = 32;
+    bthread_t th[N];
+    for (int i = 0; i < N; ++i) {
+        EXPECT_EQ(0, bthread_start_background_with_affinity(
+                      &th[i], &BTHREAD_ATTR_NORMAL, record_group, arg,
+                      AFFINITY));
+    }
+    for (int i = 0; i < N; ++i) {
+        EXPECT_EQ(0, bthread_join(th[i], NULL));
+    }
+    return NULL;
+}
+
+TEST(AffinityTest, run_on_chosen_worker) {
+    bthread::TaskControl* c = get_control_after_workers_added();
+    bthread_t th;
+    AffinityArg arg;
+    arg.target = c->choose_group_by_affinity(BTHREAD_TAG_DEFAULT, AFFINITY);
+    arg.nrun.store(0);
+    arg.non_target.store(0);
+    // Spawned from a non-worker and a worker respectively.
+    ASSERT_EQ(0, bthread_start_background_with_affinity(
+                  &th, NULL, spawn_with_affinity, &arg, AFFINITY));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    spawn_with_affinity(&arg);
+    ASSERT_EQ(64, arg.nrun.load());
+    // Idle workers may steal them, the ratio depends on load of the machine.
+    LOG(INFO) << arg.non_target.load() << " of " << arg.nrun.load()
+              << " bthreads ran on workers other than the chosen one";
+
+
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = 100;
+    ASSERT_EQ(EINVAL, bthread_start_background_with_affinity(
+                  &th, &attr, record_group, &arg, AFFINITY));
+}
+
+} // namespace
@@ -0,0 +1,106 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bvar/bvar.h"
+
+DECLARE_bool(bthread_autoscale);
+DECLARE_int32(bthread_autoscale_interval_ms);
+
+namespace {
+
+class AutoscaleTest : public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        // Must be set before bthread is initialized.
+        FLAGS_bthread_autoscale = true;
+        FLAGS_bthread_autoscale_interval_ms = 20;
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, NULL, nothing, NULL));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+    }
+    static void* nothing(void*) { return NULL; }
+};
+
+int retired_workers() {
+    const std::string value =
+        bvar::Variable::describe_exposed("bthread_retired_worker_count");
+    return value.empty() ? -1 : atoi(value.c_str());
+}
+
+bool wait_retired(bool more_than_zero, int timeout_ms) {
+    for (int i = 0; i < timeout_ms; i += 10) {
+        if ((retired_workers() > 0) == more_than_zero) {
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+butil::atomic<int> g_nrun(0);
+butil::atomic<bool> g_stop(false);
+
+void* count_run(void*) {
+    g_nrun.fetch_add(1);
+    return NULL;
+}
+
+void* keep_busy(void*) {
+    while (!g_stop.load(butil::memory_order_relaxed)) {
+        // Switch now and then so that cputime of workers are updated.
+        const int64_t end_us = butil::gettimeofday_us() + 5000;
+        while (butil::gettimeofday_us() < end_us) {}
+        bthread_yield();
+    }
+    return NULL;
+}
+
+TEST_F(AutoscaleTest, retire_idle_workers_and_bring_back) {
+    ASSERT_GE(retired_workers(), 0);
+    ASSERT_TRUE(wait_retired(true, 5000));
+    // At least one worker is kept.
+    ASSERT_LT(retired_workers(), bthread_getconcurrency());
+
+    // Tasks still run with retired workers.
+    for (int i = 0; i < 100; ++i) {
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, NULL, count_run, NULL));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+    }
+    ASSERT_EQ(100, g_nrun.load());
+
+    // Busy workers bring retired ones back.
+    const int N = bthread_getconcurrency() * 2;
+    std::vector<bthread_t> busy(N);
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&busy[i], NULL, keep_busy, NULL));
+    }
+    ASSERT_TRUE(wait_retired(false, 10000));
+    g_stop.store(true);
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(busy[i], NULL));
+    }
+}
+
+} // namespace
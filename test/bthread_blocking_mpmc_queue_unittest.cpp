@@ -0,0 +1,129 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include "butil/atomicops.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/blocking_mpmc_queue.h"
+
+namespace {
+
+TEST(BlockingMPMCQueueTest, timeout) {
+    bthread::BlockingMPMCQueue<int> q;
+    ASSERT_EQ(0, q.init(2));
+    int v = 0;
+    ASSERT_FALSE(q.try_pop(&v));
+    timespec abstime = butil::milliseconds_from_now(20);
+    butil::Timer tm;
+    tm.start();
+    ASSERT_EQ(-1, q.pop(&v, &abstime));
+    tm.stop();
+    ASSERT_EQ(ETIMEDOUT, errno);
+    ASSERT_GE(tm.m_elapsed(), 15);
+
+    ASSERT_EQ(0, q.push(1));
+    ASSERT_TRUE(q.try_push(2));
+    ASSERT_FALSE(q.try_push(3));
+    abstime = butil::milliseconds_from_now(20);
+    ASSERT_EQ(-1, q.push(3, &abstime));
+    ASSERT_EQ(ETIMEDOUT, errno);
+    ASSERT_EQ(0, q.pop(&v));
+    ASSERT_EQ(1, v);
+    ASSERT_EQ(0, q.pop(&v));
+    ASSERT_EQ(2, v);
+}
+
+const int NPRODUCER = 4;
+const int NCONSUMER = 4;
+const int NPUSH = 100000;
+
+struct QueueArg {
+    bthread::BlockingMPMCQueue<int>* q;
+    butil::atomic<int64_t> npopped;
+    butil::atomic<int64_t> sum;
+};
+
+void* producer(void* void_arg) {
+    QueueArg* arg = (QueueArg*)void_arg;
+    for (int i = 1; i <= NPUSH; ++i) {
+        EXPECT_EQ(0, arg->q->push(i));
+    }
+    return NULL;
+}
+
+void* consumer(void* void_arg) {
+    QueueArg* arg = (QueueArg*)void_arg;
+    int64_t sum = 0;
+    int v = 0;
+    // 0 is the stop sign.
+    while (arg->q->pop(&v) == 0 && v != 0) {
+        sum += v;
+        arg->npopped.fetch_add(1, butil::memory_order_relaxed);
+    }
+    arg->sum.fetch_add(sum);
+    return NULL;
+}
+
+void run_producers_and_consumers(bool use_bthread) {
+    // A small queue makes both producers and consumers block frequently.
+    bthread::BlockingMPMCQueue<int> q;
+    ASSERT_EQ(0, q.init(16));
+    QueueArg arg;
+    arg.q = &q;
+    arg.npopped.store(0);
+    arg.sum.store(0);
+    bthread_t bth[NPRODUCER + NCONSUMER];
+    pthread_t pth[NPRODUCER + NCONSUMER];
+    for (int i = 0; i < NPRODUCER + NCONSUMER; ++i) {
+        void* (*fn)(void*) = (i < NPRODUCER ? producer : consumer);
+        if (use_bthread) {
+            ASSERT_EQ(0, bthread_start_background(&bth[i], NULL, fn, &arg));
+        } else {
+            ASSERT_EQ(0, pthread_create(&pth[i], NULL, fn, &arg));
+        }
+    }
+    for (int i = 0; i < NPRODUCER; ++i) {
+        if (use_bthread) {
+            bthread_join(bth[i], NULL);
+        } else {
+            pthread_join(pth[i], NULL);
+        }
+    }
+    for (int i = 0; i < NCONSUMER; ++i) {
+        ASSERT_EQ(0, q.push(0));
+    }
+    for (int i = NPRODUCER; i < NPRODUCER + NCONSUMER; ++i) {
+        if (use_bthread) {
+            bthread_join(bth[i], NULL);
+        } else {
+            pthread_join(pth[i], NULL);
+        }
+    }
+    ASSERT_EQ((int64_t)NPRODUCER * NPUSH, arg.npopped.load());
+    ASSERT_EQ((int64_t)NPRODUCER * NPUSH * (NPUSH + 1) / 2, arg.sum.load());
+}
+
+TEST(BlockingMPMCQueueTest, pthreads) {
+    run_producers_and_consumers(false);
+}
+
+TEST(BlockingMPMCQueueTest, bthreads) {
+    run_producers_and_consumers(true);
+}
+
+} // namespace
@@ -0,0 +1,189 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+#include <mutex>
+#include <gtest/gtest.h>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/brlock.h"
+
+namespace {
+
+TEST(BRLockTest, sanity) {
+    bthread::BRLock lock;
+    lock.lock_shared();
+    ASSERT_TRUE(lock.try_lock_shared());
+    ASSERT_FALSE(lock.try_lock());
+    lock.unlock_shared();
+    lock.unlock_shared();
+    ASSERT_TRUE(lock.try_lock());
+    ASSERT_FALSE(lock.try_lock_shared());
+    ASSERT_FALSE(lock.try_lock());
+    lock.unlock();
+    {
+        std::unique_lock<bthread::BRLock> mu(lock);
+        ASSERT_FALSE(lock.try_lock_shared());
+    }
+    ASSERT_TRUE(lock.try_lock_shared());
+    lock.unlock_shared();
+}
+
+struct WriterArg {
+    bthread::BRLock* lock;
+    butil::atomic<bool> locked;
+};
+
+void* write_locker(void* void_arg) {
+    WriterArg* arg = (WriterArg*)void_arg;
+    arg->lock->lock();
+    arg->locked.store(true);
+    bthread_usleep(10000);
+    arg->locked.store(false);
+    arg->lock->unlock();
+    return NULL;
+}
+
+TEST(BRLockTest, writer_waits_for_readers) {
+    bthread::BRLock lock;
+    WriterArg arg;
+    arg.lock = &lock;
+    arg.locked.store(false);
+    lock.lock_shared();
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, write_locker, &arg));
+    bthread_usleep(20000);
+    ASSERT_FALSE(arg.locked.load());
+    // The pending writer blocks new readers.
+    ASSERT_FALSE(lock.try_lock_shared());
+    lock.unlock_shared();
+    // Blocked until the writer finishes.
+    lock.lock_shared();
+    ASSERT_FALSE(arg.locked.load());
+    lock.unlock_shared();
+    ASSERT_EQ(0, bthread_join(th, NULL));
+}
+
+// Writers keep `a' and `b' equal inside the write lock, readers check it.
+struct StressArg {
+    bthread::BRLock lock;
+    int64_t a;
+    int64_t b;
+    butil::atomic<int64_t> nread;
+    butil::atomic<bool> stop;
+    butil::atomic<bool> fail;
+};
+
+void* reader(void* void_arg) {
+    StressArg* arg = (StressArg*)void_arg;
+    while (!arg->stop.load(butil::memory_order_relaxed)) {
+        arg->lock.lock_shared();
+        if (arg->a != arg->b) {
+            arg->fail.store(true);
+        }
+        arg->lock.unlock_shared();
+        arg->nread.fetch_add(1, butil::memory_order_relaxed);
+        // Don't occupy the worker forever, otherwise writers put into
+        // runqueues by wakeups may never be scheduled.
+        bthread_yield();
+    }
+    return NULL;
+}
+
+void* writer(void* void_arg) {
+    StressArg* arg = (StressArg*)void_arg;
+    for (int i = 0; i < 1000; ++i) {
+        arg->lock.lock();
+        ++arg->a;
+        bthread_yield();
+        ++arg->b;
+        arg->lock.unlock();
+    }
+    return NULL;
+}
+
+TEST(BRLockTest, mix_readers_and_writers) {
+    StressArg arg;
+    arg.a = 0;
+    arg.b = 0;
+    arg.nread.store(0);
+    arg.stop.store(false);
+    arg.fail.store(false);
+    pthread_t rpth[4];
+    bthread_t rbth[8];
+    bthread_t wth[2];
+    for (size_t i = 0; i < arraysize(rpth); ++i) {
+        ASSERT_EQ(0, pthread_create(&rpth[i], NULL, reader, &arg));
+    }
+    for (size_t i = 0; i < arraysize(rbth); ++i) {
+        ASSERT_EQ(0, bthread_start_background(&rbth[i], NULL, reader, &arg));
+    }
+    for (size_t i = 0; i < arraysize(wth); ++i) {
+        ASSERT_EQ(0, bthread_start_background(&wth[i], NULL, writer, &arg));
+    }
+    for (size_t i = 0; i < arraysize(wth); ++i) {
+        ASSERT_EQ(0, bthread_join(wth[i], NULL));
+    }
+    arg.stop.store(true);
+    for (size_t i = 0; i < arraysize(rpth); ++i) {
+        pthread_join(rpth[i], NULL);
+    }
+    for (size_t i = 0; i < arraysize(rbth); ++i) {
+        bthread_join(rbth[i], NULL);
+    }
+    ASSERT_FALSE(arg.fail.load());
+    ASSERT_EQ(2000, arg.a);
+    ASSERT_EQ(2000, arg.b);
+    ASSERT_GT(arg.nread.load(), 0);
+    ASSERT_TRUE(arg.lock.try_lock());
+    arg.lock.unlock();
+}
+
+struct PerfArg {
+    bthread::BRLock* lock;
+    int64_t avg_ns;
+};
+
+void* read_in_loop(void* void_arg) {
+    PerfArg* arg = (PerfArg*)void_arg;
+    const int N = 100000;
+    const int64_t t1 = butil::cpuwide_time_ns();
+    for (int i = 0; i < N; ++i) {
+        arg->lock->lock_shared();
+        arg->lock->unlock_shared();
+    }
+    const int64_t t2 = butil::cpuwide_time_ns();
+    arg->avg_ns = (t2 - t1) / N;
+    return NULL;
+}
+
+TEST(BRLockTest, rdlock_performance) {
+    bthread::BRLock lock;
+    bthread_t th[16];
+    PerfArg args[arraysize(th)];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        args[i].lock = &lock;
+        args[i].avg_ns = 0;
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, read_in_loop, &args[i]));
+    }
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+        LOG(INFO) << "reader " << i << " = " << args[i].avg_ns << "ns";
+    }
+}
+
+} // namespace
@@ -0,0 +1,77 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+#include <stdlib.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/time.h"
+#include "bvar/bvar.h"
+#include "bthread/bthread.h"
+
+namespace bthread {
+DECLARE_int32(bthread_busy_poll_workers);
+DECLARE_int32(bthread_busy_poll_us);
+}
+
+namespace {
+
+butil::atomic<int> g_nrun(0);
+
+void* mark_run(void*) {
+    g_nrun.fetch_add(1);
+    return NULL;
+}
+
+int64_t get_int64_var(const char* name) {
+    const std::string value = bvar::Variable::describe_exposed(name);
+    if (value.empty()) {
+        return -1;
+    }
+    return atoll(value.c_str());
+}
+
+TEST(BusyPollTest, run_tasks_while_polling) {
+    bthread::FLAGS_bthread_busy_poll_workers = 2;
+    bthread::FLAGS_bthread_busy_poll_us = 2000;
+    const int N = 100;
+    for (int i = 0; i < N; ++i) {
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, NULL, mark_run, NULL));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+        // Let workers go idle and poll.
+        usleep(500);
+    }
+    ASSERT_EQ(N, g_nrun.load());
+    ASSERT_GT(get_int64_var("bthread_worker_busy_poll_us"), 0);
+    ASSERT_GT(get_int64_var("bthread_worker_wakeup_count"), 0);
+
+    // Workers park normally after polling is disabled.
+    bthread::FLAGS_bthread_busy_poll_workers = 0;
+    usleep(10000);
+    const int64_t polled_us = get_int64_var("bthread_worker_busy_poll_us");
+    for (int i = 0; i < N; ++i) {
+        bthread_t th;
+        ASSERT_EQ(0, bthread_start_background(&th, NULL, mark_run, NULL));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+    }
+    ASSERT_EQ(2 * N, g_nrun.load());
+    ASSERT_EQ(polled_us, get_int64_var("bthread_worker_busy_poll_us"));
+    bthread::FLAGS_bthread_busy_poll_us = 50;
+}
+
+} // namespace
@@ -0,0 +1,116 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include "bthread/coroutine.h"
+
+#ifdef BTHREAD_HAS_COROUTINE
+
+#include <vector>
+#include "butil/atomicops.h"
+#include "butil/time.h"
+
+namespace {
+
+bthread::Awaitable<int> add_slowly(int a, int b) {
+    co_await bthread::co_usleep(1000);
+    co_return a + b;
+}
+
+bthread::Awaitable<int> sum(int n) {
+    int s = 0;
+    for (int i = 0; i < n; ++i) {
+        s += co_await add_slowly(i, 0);
+    }
+    co_return s;
+}
+
+TEST(CoroutineTest, sync_wait_nested) {
+    ASSERT_EQ(3, bthread::sync_wait(add_slowly(1, 2)));
+    butil::Timer tm;
+    tm.start();
+    ASSERT_EQ(45, bthread::sync_wait(sum(10)));
+    tm.stop();
+    ASSERT_GE(tm.u_elapsed(), 10 * 1000);
+}
+
+bthread::Awaitable<void> sleep_and_signal(int64_t us,
+                                          bthread::CountdownEvent* event,
+                                          butil::atomic<int>* nrun) {
+    EXPECT_EQ(0, co_await bthread::co_usleep(us));
+    // Resumed on a bthread worker rather than the TimerThread.
+    EXPECT_NE(INVALID_BTHREAD, bthread_self());
+    nrun->fetch_add(1);
+    event->signal();
+}
+
+bthread::Awaitable<int> fan_out(int n, butil::atomic<int>* nrun) {
+    bthread::CountdownEvent event(n);
+    for (int i = 0; i < n; ++i) {
+        bthread::start_coroutine(sleep_and_signal(10000, &event, nrun));
+    }
+    co_return co_await bthread::co_wait(event);
+}
+
+TEST(CoroutineTest, fan_out_and_wait) {
+    // Sleeping coroutines don't hold bthreads, many of them can be
+    // in flight at the same time.
+    const int N = 10000;
+    butil::atomic<int> nrun(0);
+    butil::Timer tm;
+    tm.start();
+    ASSERT_EQ(0, bthread::sync_wait(fan_out(N, &nrun)));
+    tm.stop();
+    ASSERT_EQ(N, nrun.load());
+    LOG(INFO) << N << " sleeping coroutines done in " << tm.m_elapsed() << "ms";
+}
+
+bthread::Awaitable<void> add_with_lock(bthread::Mutex* mutex, int* counter,
+                                       int n) {
+    for (int i = 0; i < n; ++i) {
+        co_await bthread::co_lock(*mutex);
+        const int c = *counter;
+        if (i % 16 == 0) {
+            // Make the lock contended.
+            co_await bthread::co_usleep(10);
+        }
+        *counter = c + 1;
+        mutex->unlock();
+    }
+}
+
+bthread::Awaitable<void> add_and_signal(bthread::Mutex* mutex, int* counter,
+                                        int n, bthread::CountdownEvent* event) {
+    co_await add_with_lock(mutex, counter, n);
+    event->signal();
+}
+
+TEST(CoroutineTest, lock_mutex) {
+    bthread::Mutex mutex;
+    int counter = 0;
+    const int M = 8;
+    bthread::CountdownEvent event(M);
+    for (int i = 0; i < M; ++i) {
+        bthread::start_coroutine(add_and_signal(&mutex, &counter, 100, &event));
+    }
+    ASSERT_EQ(0, event.wait());
+    ASSERT_EQ(M * 100, counter);
+}
+
+} // namespace
+
+#endif  // BTHREAD_HAS_COROUTINE
@@ -708,4 +708,44 @@ TEST_F(ExecutionQueueTest, cancel_unexecuted_high_priority_task) {
 
     ASSERT_EQ(12345, result);
 }
+
+struct BatchStat {
+    int64_t sum;
+    int nbatch;
+    int max_batch_size;
+};
+
+int add_and_count_batch(void* meta, bthread::TaskIterator<LongIntTask>& iter) {
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    BatchStat* stat = (BatchStat*)meta;
+    int n = 0;
+    for (; iter; ++iter, ++n) {
+        stat->sum += iter->value;
+    }
+    ++stat->nbatch;
+    stat->max_batch_size = std::max(stat->max_batch_size, n);
+    return 0;
+}
+
+TEST_F(ExecutionQueueTest, max_tasks_per_batch) {
+    BatchStat stat = { 0, 0, 0 };
+    bthread::ExecutionQueueId<LongIntTask> queue_id;
+    bthread::ExecutionQueueOptions options;
+    options.max_tasks_per_batch = 4;
+    options.time_slice_us = 10;
+    ASSERT_EQ(0, bthread::execution_queue_start(&queue_id, &options,
+                                                add_and_count_batch, &stat));
+    int64_t expected_sum = 0;
+    for (int i = 0; i < 1000; ++i) {
+        expected_sum += i;
+        ASSERT_EQ(0, bthread::execution_queue_execute(queue_id, i));
+    }
+    ASSERT_EQ(0, bthread::execution_queue_stop(queue_id));
+    ASSERT_EQ(0, bthread::execution_queue_join(queue_id));
+    ASSERT_EQ(expected_sum, stat.sum);
+    ASSERT_LE(stat.max_batch_size, 4);
+    ASSERT_GE(stat.nbatch, 1000 / 4);
+}
 } // namespace
@@ -594,4 +594,44 @@ TEST(BthreadIdTest, error_with_descriptions) {
     ASSERT_EQ(0, bthread_id_unlock(id1));
     ASSERT_EQ(branch_counter, branch_tags[0]);
 }
+
+struct FightArg {
+    bthread_id_t id;
+    int64_t* counter;
+    int times;
+};
+
+void* lock_and_increase(void* void_arg) {
+    FightArg* arg = (FightArg*)void_arg;
+    for (int i = 0; i < arg->times; ++i) {
+        void* data = NULL;
+        EXPECT_EQ(0, bthread_id_lock(arg->id, &data));
+        EXPECT_EQ(arg->counter, data);
+        ++*arg->counter;
+        EXPECT_EQ(0, bthread_id_unlock(arg->id));
+    }
+    return NULL;
+}
+
+TEST(BthreadIdTest, mixed_fast_and_contended_locking) {
+    int64_t counter = 0;
+    bthread_id_t id;
+    ASSERT_EQ(0, bthread_id_create(&id, &counter, NULL));
+    FightArg arg = { id, &counter, 100000 };
+    bthread_t th[8];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL,
+                                              lock_and_increase, &arg));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    ASSERT_EQ((int64_t)ARRAY_SIZE(th) * arg.times, counter);
+    // Uncontended lock/unlock still interact with pending errors.
+    ASSERT_EQ(0, bthread_id_lock(id, NULL));
+    ASSERT_EQ(EBUSY, bthread_id_trylock(id, NULL));
+    ASSERT_EQ(0, bthread_id_error(id, ESTOP));
+    ASSERT_EQ(0, bthread_id_unlock(id));
+    ASSERT_EQ(EINVAL, bthread_id_lock(id, NULL));
+}
 } // namespace
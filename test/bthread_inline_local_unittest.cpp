@@ -0,0 +1,126 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "bthread/bthread.h"
+#include "bthread/inline_local.h"
+
+namespace {
+
+struct Context {
+    int value;
+};
+
+typedef bthread::InlineLocal<Context, bthread::INLINE_LOCAL_SLOT_USER_BEGIN>
+    TlsContext;
+
+struct SwitchArg {
+    int value;
+    bool inherited;
+    bool preserved;
+};
+
+void* set_and_switch(void* void_arg) {
+    SwitchArg* arg = static_cast<SwitchArg*>(void_arg);
+    arg->inherited = (TlsContext::get() != NULL);
+    Context ctx = { arg->value };
+    TlsContext::set(&ctx);
+    bool preserved = true;
+    for (int i = 0; i < 10; ++i) {
+        if (i % 2) {
+            bthread_yield();
+        } else {
+            bthread_usleep(1000);
+        }
+        preserved = preserved && TlsContext::get() == &ctx &&
+            TlsContext::get()->value == arg->value;
+    }
+    arg->preserved = preserved;
+    TlsContext::set(NULL);
+    return NULL;
+}
+
+TEST(InlineLocalTest, local_to_bthread) {
+    Context main_ctx = { -1 };
+    TlsContext::set(&main_ctx);
+
+    const int N = 16;
+    bthread_t tids[N];
+    SwitchArg args[N];
+    for (int i = 0; i < N; ++i) {
+        args[i].value = i;
+        args[i].inherited = true;
+        args[i].preserved = false;
+        ASSERT_EQ(0, bthread_start_background(
+                      &tids[i], NULL, set_and_switch, &args[i]));
+    }
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+        ASSERT_FALSE(args[i].inherited) << i;
+        ASSERT_TRUE(args[i].preserved) << i;
+    }
+    ASSERT_EQ(&main_ctx, TlsContext::get());
+    TlsContext::set(NULL);
+}
+
+struct PerfArg {
+    bthread_key_t key;
+    int64_t getspecific_ns;
+    int64_t inline_ns;
+};
+
+void* compare_with_getspecific(void* void_arg) {
+    PerfArg* arg = static_cast<PerfArg*>(void_arg);
+    Context ctx = { 1 };
+    const int N = 1000000;
+    EXPECT_EQ(0, bthread_setspecific(arg->key, &ctx));
+    TlsContext::set(&ctx);
+    int64_t sum = 0;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        sum += static_cast<Context*>(bthread_getspecific(arg->key))->value;
+    }
+    tm.stop();
+    arg->getspecific_ns = tm.n_elapsed() / N;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        sum += TlsContext::get()->value;
+        asm volatile("" ::: "memory");
+    }
+    tm.stop();
+    arg->inline_ns = tm.n_elapsed() / N;
+    EXPECT_EQ(2 * N, sum);
+    TlsContext::set(NULL);
+    return NULL;
+}
+
+TEST(InlineLocalTest, perf) {
+    PerfArg arg;
+    ASSERT_EQ(0, bthread_key_create(&arg.key, NULL));
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_urgent(&th, NULL,
+                                      compare_with_getspecific, &arg));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    LOG(INFO) << "bthread_getspecific takes " << arg.getspecific_ns
+              << "ns, InlineLocal::get takes " << arg.inline_ns << "ns";
+    ASSERT_EQ(0, bthread_key_delete(arg.key));
+}
+
+} // namespace
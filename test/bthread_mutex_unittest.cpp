@@ -26,6 +26,9 @@
 #include "bthread/task_control.h"
 #include "bthread/mutex.h"
 #include "butil/gperftools_profiler.h"
+#include <gflags/gflags.h>
+
+DECLARE_int32(bthread_mutex_max_spin);
 
 namespace {
 inline unsigned* get_butex(bthread_mutex_t & m) {
@@ -229,6 +232,48 @@ TEST(MutexTest, performance) {
     PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
 }
 
+struct SpinArg {
+    bthread_mutex_t* m;
+    int64_t* counter;
+};
+
+void* add_with_short_holding(void* void_arg) {
+    SpinArg* arg = (SpinArg*)void_arg;
+    for (int i = 0; i < 100000; ++i) {
+        bthread_mutex_lock(arg->m);
+        ++*arg->counter;
+        bthread_mutex_unlock(arg->m);
+    }
+    return NULL;
+}
+
+TEST(MutexTest, spin_before_parking) {
+    const int saved_max_spin = FLAGS_bthread_mutex_max_spin;
+    const int max_spins[] = { 0, 1, 100, 10000 };
+    for (size_t k = 0; k < arraysize(max_spins); ++k) {
+        FLAGS_bthread_mutex_max_spin = max_spins[k];
+        bthread_mutex_t m;
+        ASSERT_EQ(0, bthread_mutex_init(&m, NULL));
+        int64_t counter = 0;
+        SpinArg arg = { &m, &counter };
+        pthread_t pth[4];
+        bthread_t bth[4];
+        for (size_t i = 0; i < arraysize(pth); ++i) {
+            ASSERT_EQ(0, pthread_create(&pth[i], NULL, add_with_short_holding, &arg));
+            ASSERT_EQ(0, bthread_start_background(&bth[i], NULL, add_with_short_holding, &arg));
+        }
+        for (size_t i = 0; i < arraysize(pth); ++i) {
+            pthread_join(pth[i], NULL);
+            bthread_join(bth[i], NULL);
+        }
+        ASSERT_EQ(100000 * 8, counter);
+        ASSERT_LE(m.spin_avg, std::max(max_spins[k], 0));
+        ASSERT_EQ(0, *get_butex(m));
+        bthread_mutex_destroy(&m);
+    }
+    FLAGS_bthread_mutex_max_spin = saved_max_spin;
+}
+
 void* loop_until_stopped(void* arg) {
     bthread::Mutex *m = (bthread::Mutex*)arg;
     while (!g_stopped) {
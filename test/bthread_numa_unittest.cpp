@@ -0,0 +1,68 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include "butil/build_config.h"
+#include "bthread/numa.h"
+
+namespace {
+
+TEST(NumaTest, parse_cpu_list) {
+    std::vector<int> cpus;
+    ASSERT_EQ(0, bthread::parse_cpu_list("0", &cpus));
+    ASSERT_EQ(1u, cpus.size());
+    ASSERT_EQ(0, cpus[0]);
+
+    cpus.clear();
+    ASSERT_EQ(0, bthread::parse_cpu_list("0-3,8,10-11\n", &cpus));
+    const int expected[] = { 0, 1, 2, 3, 8, 10, 11 };
+    ASSERT_EQ(sizeof(expected) / sizeof(expected[0]), cpus.size());
+    for (size_t i = 0; i < cpus.size(); ++i) {
+        ASSERT_EQ(expected[i], cpus[i]);
+    }
+
+    cpus.clear();
+    ASSERT_EQ(0, bthread::parse_cpu_list("\n", &cpus));
+    ASSERT_TRUE(cpus.empty());
+
+    ASSERT_EQ(-1, bthread::parse_cpu_list("3-1", &cpus));
+    ASSERT_EQ(-1, bthread::parse_cpu_list("a", &cpus));
+    ASSERT_EQ(-1, bthread::parse_cpu_list("1,,2", &cpus));
+    ASSERT_EQ(-1, bthread::parse_cpu_list("1-", &cpus));
+}
+
+TEST(NumaTest, get_numa_nodes) {
+    std::vector<std::vector<int> > nodes;
+#if defined(OS_LINUX)
+    if (access("/sys/devices/system/node/online", R_OK) != 0) {
+        return;
+    }
+    ASSERT_EQ(0, bthread::get_numa_nodes(&nodes));
+    ASSERT_FALSE(nodes.empty());
+    size_t ncpu = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        ASSERT_FALSE(nodes[i].empty());
+        ncpu += nodes[i].size();
+    }
+    ASSERT_LE(ncpu, (size_t)sysconf(_SC_NPROCESSORS_CONF));
+#else
+    ASSERT_EQ(-1, bthread::get_numa_nodes(&nodes));
+#endif
+}
+
+} // namespace
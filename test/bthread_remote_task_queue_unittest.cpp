@@ -0,0 +1,120 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+#include <pthread.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "bthread/remote_task_queue.h"
+
+namespace {
+
+TEST(RemoteTaskQueueTest, sanity) {
+    bthread::RemoteTaskQueue q;
+    ASSERT_EQ(-1, q.init(0));
+    ASSERT_EQ(0, q.init(6));
+    ASSERT_EQ(-1, q.init(6));
+    ASSERT_EQ(8u, q.capacity());
+    bthread_t t = 0;
+    ASSERT_FALSE(q.pop(&t));
+    // Go around the ring several times.
+    for (int round = 0; round < 3; ++round) {
+        for (bthread_t i = 1; i <= 8; ++i) {
+            ASSERT_TRUE(q.push(i));
+        }
+        ASSERT_FALSE(q.push(9));
+        for (bthread_t i = 1; i <= 8; ++i) {
+            ASSERT_TRUE(q.pop(&t));
+            ASSERT_EQ(i, t);
+        }
+        ASSERT_FALSE(q.pop(&t));
+    }
+}
+
+const int NPRODUCER = 4;
+const int NCONSUMER = 3;
+const bthread_t NPUSH = 200000;
+
+struct QueueArg {
+    bthread::RemoteTaskQueue q;
+    butil::atomic<int> nproducing;
+    butil::atomic<int64_t> npopped;
+    butil::atomic<uint64_t> sum;
+};
+
+void* producer(void* void_arg) {
+    QueueArg* arg = (QueueArg*)void_arg;
+    for (bthread_t i = 1; i <= NPUSH; ++i) {
+        while (!arg->q.push(i)) {
+            sched_yield();
+        }
+    }
+    arg->nproducing.fetch_sub(1);
+    return NULL;
+}
+
+void* consumer(void* void_arg) {
+    QueueArg* arg = (QueueArg*)void_arg;
+    uint64_t sum = 0;
+    int64_t n = 0;
+    bthread_t t = 0;
+    while (true) {
+        if (arg->q.pop(&t)) {
+            sum += t;
+            ++n;
+        } else if (arg->nproducing.load() == 0) {
+            // Producers are done, drain what's left.
+            while (arg->q.pop(&t)) {
+                sum += t;
+                ++n;
+            }
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    arg->sum.fetch_add(sum);
+    arg->npopped.fetch_add(n);
+    return NULL;
+}
+
+TEST(RemoteTaskQueueTest, multiple_producers_and_consumers) {
+    QueueArg arg;
+    ASSERT_EQ(0, arg.q.init(1024));
+    arg.nproducing.store(NPRODUCER);
+    arg.npopped.store(0);
+    arg.sum.store(0);
+    pthread_t pth[NPRODUCER];
+    pthread_t cth[NCONSUMER];
+    for (int i = 0; i < NCONSUMER; ++i) {
+        ASSERT_EQ(0, pthread_create(&cth[i], NULL, consumer, &arg));
+    }
+    for (int i = 0; i < NPRODUCER; ++i) {
+        ASSERT_EQ(0, pthread_create(&pth[i], NULL, producer, &arg));
+    }
+    for (int i = 0; i < NPRODUCER; ++i) {
+        pthread_join(pth[i], NULL);
+    }
+    for (int i = 0; i < NCONSUMER; ++i) {
+        pthread_join(cth[i], NULL);
+    }
+    // Nothing is lost or duplicated.
+    ASSERT_EQ((int64_t)NPUSH * NPRODUCER, arg.npopped.load());
+    ASSERT_EQ((uint64_t)NPUSH * (NPUSH + 1) / 2 * NPRODUCER, arg.sum.load());
+}
+
+} // namespace
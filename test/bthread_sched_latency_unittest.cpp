@@ -0,0 +1,90 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+#include <stdlib.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "bvar/bvar.h"
+#include "bthread/bthread.h"
+
+namespace bthread {
+DECLARE_bool(show_bthread_sched_latency_in_vars);
+}
+
+namespace {
+
+butil::atomic<int> g_nrun(0);
+
+void* yield_and_mark_run(void*) {
+    bthread_yield();
+    g_nrun.fetch_add(1);
+    return NULL;
+}
+
+int64_t get_int64_var(const char* name) {
+    const std::string value = bvar::Variable::describe_exposed(name);
+    if (value.empty()) {
+        return -1;
+    }
+    return atoll(value.c_str());
+}
+
+TEST(SchedLatencyTest, record_latency_from_ready_to_running) {
+    ASSERT_EQ(-1, get_int64_var("bthread_sched_count"));
+    bthread::FLAGS_show_bthread_sched_latency_in_vars = true;
+    const int N = 100;
+    bthread_t th[N];
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL,
+                                              yield_and_mark_run, NULL));
+    }
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    ASSERT_EQ(N, g_nrun.load());
+    // Every bthread was pushed into a runqueue once when being created and
+    // once when yielding.
+    ASSERT_GE(get_int64_var("bthread_sched_count"), 2 * N);
+
+    bthread::FLAGS_show_bthread_sched_latency_in_vars = false;
+    const int64_t count = get_int64_var("bthread_sched_count");
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL,
+                                              yield_and_mark_run, NULL));
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    ASSERT_EQ(2 * N, g_nrun.load());
+    ASSERT_EQ(count, get_int64_var("bthread_sched_count"));
+}
+
+TEST(SchedLatencyTest, steal_vars) {
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, yield_and_mark_run, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    // Idle workers try stealing before parking.
+    ASSERT_GT(get_int64_var("bthread_steal_count"), 0);
+    ASSERT_GE(get_int64_var("bthread_steal_success_count"), 0);
+    ASSERT_LE(get_int64_var("bthread_steal_success_count"),
+              get_int64_var("bthread_steal_count"));
+    const std::string ratio =
+        bvar::Variable::describe_exposed("bthread_steal_success_ratio");
+    ASSERT_FALSE(ratio.empty());
+    ASSERT_LE(atof(ratio.c_str()), 1.0);
+}
+
+} // namespace
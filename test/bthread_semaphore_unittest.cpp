@@ -0,0 +1,114 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include "butil/atomicops.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bthread/semaphore.h"
+#include "bthread/rate_limiter.h"
+
+namespace {
+
+struct SemaphoreArg {
+    bthread::Semaphore* sem;
+    butil::atomic<int> concurrency;
+    butil::atomic<int> max_concurrency;
+};
+
+void* hold_permit(void* arg) {
+    SemaphoreArg* a = static_cast<SemaphoreArg*>(arg);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(0, a->sem->acquire());
+        const int c = a->concurrency.fetch_add(1) + 1;
+        int max_c = a->max_concurrency.load();
+        while (c > max_c && !a->max_concurrency.compare_exchange_weak(max_c, c)) {}
+        bthread_usleep(100);
+        a->concurrency.fetch_sub(1);
+        a->sem->release();
+    }
+    return NULL;
+}
+
+TEST(SemaphoreTest, sanity) {
+    bthread::Semaphore sem(2);
+    ASSERT_EQ(2, sem.available());
+    ASSERT_TRUE(sem.try_acquire());
+    ASSERT_FALSE(sem.try_acquire(2));
+    ASSERT_TRUE(sem.try_acquire());
+    ASSERT_FALSE(sem.try_acquire());
+    ASSERT_EQ(ETIMEDOUT, sem.timed_acquire(butil::milliseconds_from_now(10)));
+    sem.release(2);
+    ASSERT_EQ(0, sem.timed_acquire(butil::milliseconds_from_now(10), 2));
+    ASSERT_EQ(EINVAL, sem.acquire(0));
+}
+
+TEST(SemaphoreTest, limit_concurrency) {
+    bthread::Semaphore sem(4);
+    ASSERT_EQ(0, sem.expose("semaphore_unittest"));
+    SemaphoreArg a;
+    a.sem = &sem;
+    a.concurrency.store(0);
+    a.max_concurrency.store(0);
+    bthread_t th[16];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, hold_permit, &a));
+    }
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    ASSERT_EQ(4, a.max_concurrency.load());
+    ASSERT_EQ(4, sem.available());
+}
+
+void* acquire_batch(void* arg) {
+    bthread::Semaphore* sem = static_cast<bthread::Semaphore*>(arg);
+    EXPECT_EQ(0, sem->acquire(3));
+    return NULL;
+}
+
+TEST(SemaphoreTest, wake_batch_waiter) {
+    bthread::Semaphore sem(0);
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, acquire_batch, &sem));
+    bthread_usleep(10000);
+    sem.release();
+    sem.release();
+    sem.release();
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(0, sem.available());
+}
+
+TEST(RateLimiterTest, burst_and_rate) {
+    bthread::RateLimiter limiter(1000, 10);
+    ASSERT_EQ(0, limiter.expose("rate_limiter_unittest"));
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_TRUE(limiter.try_acquire()) << i;
+    }
+    ASSERT_FALSE(limiter.try_acquire());
+    // One token per millisecond.
+    ASSERT_EQ(ETIMEDOUT, limiter.timed_acquire(butil::microseconds_from_now(100), 5));
+    const int64_t start_us = butil::gettimeofday_us();
+    for (int i = 0; i < 50; ++i) {
+        ASSERT_EQ(0, limiter.acquire());
+    }
+    const int64_t elapsed_us = butil::gettimeofday_us() - start_us;
+    ASSERT_GE(elapsed_us, 45000);
+    ASSERT_LT(elapsed_us, 200000);
+}
+
+} // namespace
@@ -0,0 +1,142 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include <string>
+#include "butil/atomicops.h"
+#include "bvar/variable.h"
+#include "bthread/sharded_execution_queue.h"
+
+namespace {
+
+const int NKEY = 64;
+
+struct KeyedTask {
+    int key;
+    int seq;
+};
+
+struct ExecuteArg {
+    // Only accessed by the shard of the key.
+    int last_seq[NKEY];
+    butil::atomic<int> nexecuted;
+    butil::atomic<int> nstopped;
+    butil::atomic<int> max_batch_size;
+};
+
+int execute_keyed(void* meta, bthread::TaskIterator<KeyedTask>& iter) {
+    ExecuteArg* arg = (ExecuteArg*)meta;
+    if (iter.is_queue_stopped()) {
+        arg->nstopped.fetch_add(1);
+        return 0;
+    }
+    int n = 0;
+    for (; iter; ++iter, ++n) {
+        EXPECT_EQ(arg->last_seq[iter->key] + 1, iter->seq);
+        arg->last_seq[iter->key] = iter->seq;
+        arg->nexecuted.fetch_add(1);
+    }
+    int max = arg->max_batch_size.load();
+    while (n > max && !arg->max_batch_size.compare_exchange_weak(max, n)) {}
+    return 0;
+}
+
+struct ProducerArg {
+    bthread::ShardedExecutionQueue<KeyedTask, int>* queue;
+    int first_key;
+    int nkey;
+    int ntask_per_key;
+};
+
+void* produce(void* void_arg) {
+    ProducerArg* arg = (ProducerArg*)void_arg;
+    for (int seq = 1; seq <= arg->ntask_per_key; ++seq) {
+        for (int k = arg->first_key; k < arg->first_key + arg->nkey; ++k) {
+            KeyedTask t = { k, seq };
+            EXPECT_EQ(0, arg->queue->execute(k, t));
+        }
+    }
+    return NULL;
+}
+
+TEST(ShardedExecutionQueueTest, keep_order_of_each_key) {
+    ExecuteArg arg;
+    for (int i = 0; i < NKEY; ++i) {
+        arg.last_seq[i] = 0;
+    }
+    arg.nexecuted = 0;
+    arg.nstopped = 0;
+    arg.max_batch_size = 0;
+    bthread::ShardedExecutionQueueOptions options;
+    options.num_shards = 8;
+    options.queue_options.max_tasks_per_batch = 16;
+    options.queue_options.time_slice_us = 100;
+    options.bvar_prefix = "sharded_execq_test";
+    bthread::ShardedExecutionQueue<KeyedTask, int> q;
+    ASSERT_EQ(0, q.start(&options, execute_keyed, &arg));
+    ASSERT_EQ(8u, q.shard_count());
+    ASSERT_LT(q.shard_of(12345), 8u);
+    ASSERT_EQ(q.shard_of(12345), q.shard_of(12345));
+
+    // Keys are disjoint among producers so that tasks of a key are pushed
+    // in order.
+    const int NPRODUCER = 4;
+    const int NTASK = 1000;
+    ProducerArg pargs[NPRODUCER];
+    bthread_t th[NPRODUCER];
+    for (int i = 0; i < NPRODUCER; ++i) {
+        pargs[i].queue = &q;
+        pargs[i].first_key = i * (NKEY / NPRODUCER);
+        pargs[i].nkey = NKEY / NPRODUCER;
+        pargs[i].ntask_per_key = NTASK;
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, produce, &pargs[i]));
+    }
+    for (int i = 0; i < NPRODUCER; ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    q.stop();
+    KeyedTask t = { 0, 0 };
+    ASSERT_NE(0, q.execute(0, t));
+    q.join();
+    ASSERT_EQ(NKEY * NTASK, arg.nexecuted.load());
+    ASSERT_EQ(1, arg.nstopped.load());
+    ASSERT_LE(arg.max_batch_size.load(), 16);
+    for (int i = 0; i < NKEY; ++i) {
+        ASSERT_EQ(NTASK, arg.last_seq[i]);
+    }
+
+    int64_t nbatch = 0;
+    for (int i = 0; i < 8; ++i) {
+        const std::string name = "sharded_execq_test_" + std::to_string(i) +
+            "_batch_size_count";
+        const std::string value = bvar::Variable::describe_exposed(name);
+        ASSERT_FALSE(value.empty()) << name;
+        nbatch += atoll(value.c_str());
+    }
+    ASSERT_GE(nbatch, NKEY * NTASK / 16);
+}
+
+TEST(ShardedExecutionQueueTest, invalid_options) {
+    bthread::ShardedExecutionQueueOptions options;
+    options.num_shards = 0;
+    bthread::ShardedExecutionQueue<KeyedTask> q;
+    ASSERT_EQ(EINVAL, q.start(&options, execute_keyed, NULL));
+    KeyedTask t = { 0, 0 };
+    ASSERT_EQ(EINVAL, q.execute(0, t));
+}
+
+} // namespace
@@ -0,0 +1,83 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdlib.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "bvar/variable.h"
+#include "bthread/bthread.h"
+
+DECLARE_int32(stack_size_small);
+DECLARE_int32(max_idle_stack_small);
+DECLARE_bool(stack_madvise_free);
+
+namespace {
+
+int64_t get_int64_var(const std::string& name) {
+    const std::string value = bvar::Variable::describe_exposed(name);
+    if (value.empty()) {
+        return -1;
+    }
+    return atoll(value.c_str());
+}
+
+void* touch_stack_and_sleep(void*) {
+    char buf[8192];
+    for (size_t i = 0; i < sizeof(buf); i += 1024) {
+        ((volatile char*)buf)[i] = (char)i;
+    }
+    bthread_usleep(10000);
+    return NULL;
+}
+
+void run_burst(int n) {
+    std::vector<bthread_t> tids(n);
+    for (int i = 0; i < n; ++i) {
+        ASSERT_EQ(0, bthread_start_background(
+                      &tids[i], &BTHREAD_ATTR_SMALL, touch_stack_and_sleep, NULL));
+    }
+    for (int i = 0; i < n; ++i) {
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+    }
+}
+
+TEST(StackTest, trim_idle_stacks_after_burst) {
+    const int N = 200;
+    FLAGS_max_idle_stack_small = 8;
+    FLAGS_stack_madvise_free = true;
+    run_burst(N);
+    ASSERT_LE(get_int64_var("bthread_stack_small_idle_count"), 8);
+    // Stacks being used by bthreads are not idle.
+    ASSERT_LE(get_int64_var("bthread_stack_small_count"),
+              8 + bthread_getconcurrency());
+
+    // Stacks of which the memory was released are allocated again.
+    run_burst(N);
+    ASSERT_LE(get_int64_var("bthread_stack_small_idle_count"), 8);
+
+    // All stacks of the burst are cached without the limit.
+    FLAGS_max_idle_stack_small = 0;
+    FLAGS_stack_madvise_free = false;
+    run_burst(N);
+    ASSERT_GE(get_int64_var("bthread_stack_small_count"), N);
+    ASSERT_GE(get_int64_var("bthread_stack_small_idle_count"), N - 8);
+    ASSERT_GE(get_int64_var("bthread_stack_small_bytes"),
+              N * FLAGS_stack_size_small);
+}
+
+} // namespace
@@ -0,0 +1,225 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/time.h"
+#include "bthread/butex.h"
+#include "bthread/task_group.h"
+#include "bthread/bthread.h"
+#include "bthread/unstable.h"
+
+DECLARE_int32(task_group_ntags);
+
+namespace bthread {
+extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
+}
+
+namespace {
+
+const int NTAGS = 3;
+
+bthread_tag_t current_tag() {
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    return g ? g->tag() : BTHREAD_TAG_INVALID;
+}
+
+bthread_attr_t attr_with_tag(bthread_tag_t tag) {
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
+    attr.tag = tag;
+    return attr;
+}
+
+void* get_tag(void* arg) {
+    *static_cast<bthread_tag_t*>(arg) = current_tag();
+    return NULL;
+}
+
+class TagTest : public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        // Must be set before any bthread is created.
+        FLAGS_task_group_ntags = NTAGS;
+    }
+};
+
+TEST_F(TagTest, concurrency_by_tag) {
+    bthread_t th;
+    bthread_tag_t tag = BTHREAD_TAG_INVALID;
+    bthread_attr_t attr = attr_with_tag(1);
+    ASSERT_EQ(0, bthread_start_background(&th, &attr, get_tag, &tag));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_EQ(1, tag);
+
+    // Workers are counted after they start running, wait for all of them.
+    int total = 0;
+    for (int retry = 0; retry < 1000; ++retry) {
+        total = 0;
+        for (int i = 0; i < NTAGS; ++i) {
+            const int n = bthread_getconcurrency_by_tag(i);
+            ASSERT_GT(n, 0) << "tag=" << i;
+            total += n;
+        }
+        if (total == bthread_getconcurrency()) {
+            break;
+        }
+        usleep(1000);
+    }
+    ASSERT_EQ(bthread_getconcurrency(), total);
+    ASSERT_EQ(-1, bthread_getconcurrency_by_tag(NTAGS));
+    ASSERT_EQ(-1, bthread_getconcurrency_by_tag(-2));
+
+    attr = attr_with_tag(NTAGS);
+    ASSERT_EQ(EINVAL, bthread_start_background(&th, &attr, get_tag, &tag));
+}
+
+struct SpawnArgs {
+    bthread_tag_t child_tag;
+    bthread_tag_t inherited;
+    bthread_tag_t explicit_tag;
+};
+
+void* spawner(void* arg) {
+    SpawnArgs* a = static_cast<SpawnArgs*>(arg);
+    bthread_t th;
+    // Started without tag: stays in the tag of the creator.
+    EXPECT_EQ(0, bthread_start_background(&th, NULL, get_tag, &a->inherited));
+    EXPECT_EQ(0, bthread_join(th, NULL));
+    bthread_attr_t attr = attr_with_tag(a->child_tag);
+    EXPECT_EQ(0, bthread_start_urgent(&th, &attr, get_tag, &a->explicit_tag));
+    EXPECT_EQ(0, bthread_join(th, NULL));
+    return NULL;
+}
+
+TEST_F(TagTest, start_from_worker) {
+    for (int i = 0; i < NTAGS; ++i) {
+        SpawnArgs a = { (i + 1) % NTAGS, BTHREAD_TAG_INVALID, BTHREAD_TAG_INVALID };
+        bthread_t th;
+        bthread_attr_t attr = attr_with_tag(i);
+        ASSERT_EQ(0, bthread_start_background(&th, &attr, spawner, &a));
+        ASSERT_EQ(0, bthread_join(th, NULL));
+        ASSERT_EQ(i, a.inherited);
+        ASSERT_EQ((i + 1) % NTAGS, a.explicit_tag);
+    }
+}
+
+butil::atomic<int> nwrong_tag(0);
+
+void* check_tag(void* arg) {
+    const bthread_tag_t expected = (bthread_tag_t)(intptr_t)arg;
+    for (int i = 0; i < 10; ++i) {
+        if (current_tag() != expected) {
+            nwrong_tag.fetch_add(1);
+        }
+        bthread_yield();
+    }
+    return NULL;
+}
+
+TEST_F(TagTest, never_run_in_other_tags) {
+    std::vector<bthread_t> tids;
+    for (int i = 0; i < 300; ++i) {
+        bthread_t th;
+        bthread_attr_t attr = attr_with_tag(i % NTAGS);
+        if (i % 2) {
+            attr = attr | BTHREAD_NOSIGNAL;
+        }
+        ASSERT_EQ(0, bthread_start_background(
+                      &th, &attr, check_tag, (void*)(intptr_t)(i % NTAGS)));
+        tids.push_back(th);
+    }
+    bthread_flush();
+    for (size_t i = 0; i < tids.size(); ++i) {
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+    }
+    ASSERT_EQ(0, nwrong_tag.load());
+}
+
+struct WaitArgs {
+    int* butex;
+    bthread_tag_t tag_after_wait;
+};
+
+void* waiter(void* arg) {
+    WaitArgs* a = static_cast<WaitArgs*>(arg);
+    while (*a->butex == 0) {
+        bthread::butex_wait(a->butex, 0, NULL);
+    }
+    a->tag_after_wait = current_tag();
+    return NULL;
+}
+
+void* waker(void* arg) {
+    WaitArgs* a = static_cast<WaitArgs*>(arg);
+    bthread_usleep(10000);
+    *a->butex = 1;
+    bthread::butex_wake(a->butex);
+    return NULL;
+}
+
+TEST_F(TagTest, wake_up_in_own_tag) {
+    WaitArgs a;
+    a.butex = bthread::butex_create_checked<int>();
+    *a.butex = 0;
+    a.tag_after_wait = BTHREAD_TAG_INVALID;
+    bthread_t th1;
+    bthread_t th2;
+    bthread_attr_t attr1 = attr_with_tag(1);
+    bthread_attr_t attr2 = attr_with_tag(2);
+    ASSERT_EQ(0, bthread_start_background(&th1, &attr1, waiter, &a));
+    ASSERT_EQ(0, bthread_start_background(&th2, &attr2, waker, &a));
+    ASSERT_EQ(0, bthread_join(th1, NULL));
+    ASSERT_EQ(0, bthread_join(th2, NULL));
+    ASSERT_EQ(1, a.tag_after_wait);
+    bthread::butex_destroy(a.butex);
+}
+
+void* sleep_and_get_tag(void* arg) {
+    bthread_usleep(10 * 1000000L);
+    *static_cast<bthread_tag_t*>(arg) = current_tag();
+    return NULL;
+}
+
+struct InterruptArgs {
+    bthread_t target;
+};
+
+void* interrupter(void* arg) {
+    bthread_usleep(10000);
+    bthread_interrupt(static_cast<InterruptArgs*>(arg)->target);
+    return NULL;
+}
+
+TEST_F(TagTest, interrupt_sleep_in_other_tag) {
+    bthread_tag_t tag = BTHREAD_TAG_INVALID;
+    InterruptArgs a;
+    bthread_attr_t attr1 = attr_with_tag(1);
+    bthread_attr_t attr2 = attr_with_tag(2);
+    const int64_t start_us = butil::gettimeofday_us();
+    ASSERT_EQ(0, bthread_start_background(&a.target, &attr1,
+                                          sleep_and_get_tag, &tag));
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, &attr2, interrupter, &a));
+    ASSERT_EQ(0, bthread_join(a.target, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_LT(butil::gettimeofday_us() - start_us, 5 * 1000000L);
+    ASSERT_EQ(1, tag);
+}
+
+} // namespace
@@ -254,4 +254,59 @@ TEST(TimerThreadTest, schedule_and_unschedule_in_task) {
     keeper5.expect_first_run();
 }
 
+struct RunTimeRecorder {
+    int64_t expected_us;
+    int64_t run_us;
+    bthread::TimerThread::TaskId task_id;
+};
+
+static void record_run_time(void* arg) {
+    static_cast<RunTimeRecorder*>(arg)->run_us = butil::gettimeofday_us();
+}
+
+// Tasks spread over different levels of the timing wheel.
+TEST(TimerThreadTest, tasks_in_different_levels) {
+    bthread::TimerThread timer_thread;
+    ASSERT_EQ(0, timer_thread.start(NULL));
+
+    const int N = 300;
+    std::vector<RunTimeRecorder> tasks(N);
+    const int64_t start_us = butil::gettimeofday_us();
+    for (int i = 0; i < N; ++i) {
+        // Up to 1.5s which crosses the lowest level several times.
+        tasks[i].expected_us = start_us + (i * 7919 % 1500) * 1000L + i;
+        tasks[i].run_us = 0;
+        tasks[i].task_id = timer_thread.schedule(
+            record_run_time, &tasks[i],
+            butil::microseconds_to_timespec(tasks[i].expected_us));
+        ASSERT_NE(bthread::TimerThread::INVALID_TASK_ID, tasks[i].task_id);
+    }
+    for (int i = 0; i < N; i += 4) {
+        ASSERT_EQ(0, timer_thread.unschedule(tasks[i].task_id));
+    }
+    // Tasks in upper levels and beyond the range of the wheel.
+    RunTimeRecorder far_tasks[2];
+    far_tasks[0].run_us = 0;
+    far_tasks[0].task_id = timer_thread.schedule(
+        record_run_time, &far_tasks[0], butil::seconds_from_now(100));
+    far_tasks[1].run_us = 0;
+    far_tasks[1].task_id = timer_thread.schedule(
+        record_run_time, &far_tasks[1], butil::seconds_from_now(100 * 86400));
+
+    usleep(1700000);
+    for (int i = 0; i < N; ++i) {
+        if (i % 4 == 0) {
+            ASSERT_EQ(0, tasks[i].run_us) << "i=" << i;
+            continue;
+        }
+        ASSERT_GE(tasks[i].run_us, tasks[i].expected_us) << "i=" << i;
+        EXPECT_LE(tasks[i].run_us - tasks[i].expected_us, 50000) << "i=" << i;
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(far_tasks); ++i) {
+        ASSERT_EQ(0, far_tasks[i].run_us);
+        ASSERT_EQ(0, timer_thread.unschedule(far_tasks[i].task_id));
+    }
+    timer_thread.stop_and_join();
+}
+
 } // end namespace
@@ -17,7 +17,11 @@
 
 #include <execinfo.h>
 #include <gtest/gtest.h>
+#include <vector>
+#include "butil/atomicops.h"
 #include "butil/time.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
 #include "butil/macros.h"
 #include "butil/logging.h"
 #include "butil/logging.h"
@@ -520,6 +524,35 @@ TEST_F(BthreadTest, too_many_nosignal_threads) {
     }
 }
 
+static void* add_one(void* arg) {
+    static_cast<butil::atomic<int>*>(arg)->fetch_add(1);
+    return NULL;
+}
+
+static void* fan_out(void* arg) {
+    // More bthreads than the capacity of the runqueue, the creator should
+    // not be blocked.
+    const size_t N = 20000;
+    std::vector<bthread_t> tids(N);
+    bthread_attr_t attr = BTHREAD_ATTR_NORMAL | BTHREAD_NOSIGNAL;
+    for (size_t i = 0; i < N; ++i) {
+        EXPECT_EQ(0, bthread_start_background(&tids[i], &attr, add_one, arg));
+    }
+    bthread_flush();
+    for (size_t i = 0; i < N; ++i) {
+        EXPECT_EQ(0, bthread_join(tids[i], NULL));
+    }
+    return NULL;
+}
+
+TEST_F(BthreadTest, fan_out_beyond_runqueue_capacity) {
+    butil::atomic<int> counter(0);
+    bthread_t tid;
+    ASSERT_EQ(0, bthread_start_background(&tid, NULL, fan_out, &counter));
+    ASSERT_EQ(0, bthread_join(tid, NULL));
+    ASSERT_EQ(20000, counter.load());
+}
+
 static void* yield_thread(void*) {
     bthread_yield();
     return NULL;
@@ -531,4 +564,85 @@ TEST_F(BthreadTest, yield_single_thread) {
     ASSERT_EQ(0, bthread_join(tid, NULL));
 }
 
+struct DeadlineOrder {
+    butil::Mutex mutex;
+    std::vector<int> order;
+};
+
+struct DeadlineArg {
+    DeadlineOrder* order;
+    int id;
+};
+
+static void* record_order(void* arg) {
+    DeadlineArg* a = static_cast<DeadlineArg*>(arg);
+    BAIDU_SCOPED_LOCK(a->order->mutex);
+    a->order->order.push_back(a->id);
+    return NULL;
+}
+
+static void* start_tasks_with_deadlines(void* arg) {
+    DeadlineOrder* order = static_cast<DeadlineOrder*>(arg);
+    // 0 has no deadline, others' deadlines are in reverse order of ids.
+    DeadlineArg args[4];
+    bthread_t th[4];
+    const int64_t now_us = butil::gettimeofday_us();
+    for (int i = 0; i < 4; ++i) {
+        args[i].order = order;
+        args[i].id = (i == 0 ? 0 : 4 - i);
+        bthread_attr_t attr = BTHREAD_ATTR_NORMAL | BTHREAD_NOSIGNAL;
+        attr.deadline_us = (i == 0 ? 0 : now_us + 1000000L * args[i].id);
+        EXPECT_EQ(0, bthread_start_background(&th[i], &attr,
+                                              record_order, &args[i]));
+    }
+    // Not signaled, run by this worker after yielding.
+    bthread_yield();
+    {
+        BAIDU_SCOPED_LOCK(order->mutex);
+        EXPECT_EQ(3u, order->order.size());
+        for (size_t i = 0; i < order->order.size(); ++i) {
+            EXPECT_EQ((int)i + 1, order->order[i]);
+        }
+    }
+    bthread_flush();
+    for (int i = 0; i < 4; ++i) {
+        bthread_join(th[i], NULL);
+    }
+    return NULL;
+}
+
+TEST_F(BthreadTest, earliest_deadline_first) {
+    DeadlineOrder order;
+    bthread_t tid;
+    ASSERT_EQ(0, bthread_start_background(&tid, NULL,
+                                          start_tasks_with_deadlines, &order));
+    ASSERT_EQ(0, bthread_join(tid, NULL));
+    ASSERT_EQ(4u, order.order.size());
+    ASSERT_EQ(0, order.order[3]);
+}
+
+static void* busy_loop_with_maybe_yield(void* arg) {
+    int* nyield = static_cast<int*>(arg);
+    // Not yield in a fresh run.
+    EXPECT_EQ(0, bthread_maybe_yield());
+    const int64_t end_us = butil::gettimeofday_us() + 20000;
+    while (butil::gettimeofday_us() < end_us) {
+        *nyield += bthread_maybe_yield();
+    }
+    return NULL;
+}
+
+TEST_F(BthreadTest, maybe_yield) {
+    // Not in bthread.
+    ASSERT_EQ(0, bthread_maybe_yield());
+    int nyield = 0;
+    bthread_t tid;
+    ASSERT_EQ(0, bthread_start_background(&tid, NULL,
+                                          busy_loop_with_maybe_yield, &nyield));
+    ASSERT_EQ(0, bthread_join(tid, NULL));
+    // Yield about every 1ms by default.
+    ASSERT_GE(nyield, 5);
+    ASSERT_LE(nyield, 25);
+}
+
 } // namespace
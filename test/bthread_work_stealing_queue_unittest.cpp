@@ -15,6 +15,7 @@
 // specific language governing permissions and limitations
 // under the License.
 
+#include <sched.h>                          // sched_yield
 #include <algorithm>                        // std::sort
 #include <gtest/gtest.h>
 #include "butil/time.h"
@@ -127,4 +128,176 @@ TEST(WSQTest, sanity) {
               << " popped=" << npopped
               << " left=" << (N - nstolen - npopped)  << std::endl;
 }
+
+struct BatchArg {
+    bthread::WorkStealingQueue<value_type>* q;
+    size_t batch;
+    volatile bool stop;
+};
+
+void* steal_batch_thread(void* void_arg) {
+    BatchArg* arg = (BatchArg*)void_arg;
+    std::vector<value_type>* stolen = new std::vector<value_type>;
+    value_type vals[bthread::WorkStealingQueue<value_type>::MAX_STEAL_BATCH];
+    while (true) {
+        // Read `stop' before stealing to not miss items pushed before it.
+        const bool stop = arg->stop;
+        const size_t n = arg->q->steal_batch(vals, arg->batch);
+        stolen->insert(stolen->end(), vals, vals + n);
+        if (n == 0) {
+            if (stop) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    return stolen;
+}
+
+// The owner pushes items and pops some of them, every item must be taken
+// exactly once.
+TEST(WSQTest, steal_batch_takes_each_item_once) {
+    const size_t M = 200000;
+    bthread::WorkStealingQueue<value_type> q;
+    ASSERT_EQ(0, q.init(256));
+    BatchArg arg = { &q, 16, false };
+    pthread_t th[4];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, steal_batch_thread, &arg));
+    }
+    std::vector<value_type> values;
+    values.reserve(M);
+    value_type val;
+    for (value_type i = 0; i < M; ) {
+        if (q.push(i)) {
+            ++i;
+        } else {
+            sched_yield();
+        }
+        if (i % 3 == 0 && q.pop(&val)) {
+            values.push_back(val);
+        }
+    }
+    arg.stop = true;
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        std::vector<value_type>* res = NULL;
+        pthread_join(th[i], (void**)&res);
+        values.insert(values.end(), res->begin(), res->end());
+        delete res;
+    }
+    while (q.pop(&val)) {
+        values.push_back(val);
+    }
+    ASSERT_EQ(M, values.size());
+    std::sort(values.begin(), values.end());
+    for (size_t i = 0; i < M; ++i) {
+        ASSERT_EQ(i, values[i]);
+    }
+}
+
+// The owner pops down to empty while thieves steal batches, every item
+// must be taken exactly once.
+TEST(WSQTest, pop_races_with_steal_batch) {
+    const size_t M = 200000;
+    bthread::WorkStealingQueue<value_type> q;
+    ASSERT_EQ(0, q.init(256));
+    BatchArg arg = { &q, 16, false };
+    pthread_t th[4];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, steal_batch_thread, &arg));
+    }
+    std::vector<value_type> values;
+    values.reserve(M);
+    value_type val;
+    for (value_type i = 0; i < M; ) {
+        for (int j = 0; j < 64 && i < M; ++j, ++i) {
+            ASSERT_TRUE(q.push(i));
+        }
+        while (q.pop(&val)) {
+            values.push_back(val);
+        }
+    }
+    arg.stop = true;
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        std::vector<value_type>* res = NULL;
+        pthread_join(th[i], (void**)&res);
+        values.insert(values.end(), res->begin(), res->end());
+        delete res;
+    }
+    ASSERT_EQ(M, values.size());
+    std::sort(values.begin(), values.end());
+    for (size_t i = 0; i < M; ++i) {
+        ASSERT_EQ(i, values[i]);
+    }
+}
+
+TEST(WSQTest, steal_batch_only_from_deep_queue) {
+    const size_t MAX = bthread::WorkStealingQueue<value_type>::MAX_STEAL_BATCH;
+    bthread::WorkStealingQueue<value_type> q;
+    ASSERT_EQ(0, q.init(64));
+    value_type vals[MAX];
+    ASSERT_EQ(0u, q.steal_batch(vals, 16));
+    ASSERT_TRUE(q.push(0));
+    ASSERT_EQ(1u, q.steal_batch(vals, 16));
+    ASSERT_EQ(0u, vals[0]);
+    // Not more than 2 * MAX_STEAL_BATCH items, stolen one by one.
+    for (value_type i = 1; i <= 2 * MAX; ++i) {
+        ASSERT_TRUE(q.push(i));
+    }
+    ASSERT_EQ(1u, q.steal_batch(vals, 16));
+    ASSERT_EQ(1u, vals[0]);
+    for (value_type i = 2 * MAX + 1; i <= 2 * MAX + 8; ++i) {
+        ASSERT_TRUE(q.push(i));
+    }
+    ASSERT_EQ(2 * MAX + 7, q.volatile_size());
+    ASSERT_EQ(2u, q.steal_batch(vals, 2));
+    ASSERT_EQ(2u, vals[0]);
+    ASSERT_EQ(3u, vals[1]);
+    ASSERT_EQ(MAX, q.steal_batch(vals, 100));
+    for (size_t i = 0; i < MAX; ++i) {
+        ASSERT_EQ(i + 4, vals[i]);
+    }
+    ASSERT_EQ(1u, q.steal_batch(vals, 100));
+    ASSERT_EQ(MAX + 4, vals[0]);
+    // The owner still pops the newest item.
+    value_type val = 0;
+    ASSERT_TRUE(q.pop(&val));
+    ASSERT_EQ(2 * MAX + 8, val);
+}
+
+// A burst of items lands on one queue and is drained by thieves.
+TEST(WSQTest, fan_out_burst_perf) {
+    const size_t M = 4096;
+    for (size_t batch = 1;
+         batch <= bthread::WorkStealingQueue<value_type>::MAX_STEAL_BATCH;
+         batch *= 4) {
+        bthread::WorkStealingQueue<value_type> q;
+        ASSERT_EQ(0, q.init(M));
+        size_t nstolen = 0;
+        butil::Timer tm;
+        tm.start();
+        for (int round = 0; round < 100; ++round) {
+            for (value_type i = 0; i < M; ++i) {
+                ASSERT_TRUE(q.push(i));
+            }
+            BatchArg arg = { &q, batch, true };
+            pthread_t th[4];
+            for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+                ASSERT_EQ(0, pthread_create(&th[i], NULL,
+                                            steal_batch_thread, &arg));
+            }
+            for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+                std::vector<value_type>* res = NULL;
+                pthread_join(th[i], (void**)&res);
+                nstolen += res->size();
+                delete res;
+            }
+        }
+        tm.stop();
+        ASSERT_EQ(100 * M, nstolen);
+        std::cout << "batch=" << batch << " drained " << nstolen
+                  << " items in " << tm.m_elapsed() << "ms" << std::endl;
+    }
+}
+
 } // namespace
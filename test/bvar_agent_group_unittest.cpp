@@ -81,6 +81,29 @@ TEST_F(AgentGroupTest, test_sanity) {
     AgentGroup<agent_type>::destroy_agent(id);
 }
 
+TEST_F(AgentGroupTest, reuse_smallest_id_first) {
+    // Use another agent type to have ids not touched by other tests.
+    typedef butil::atomic<int32_t> type;
+    int ids[8];
+    for (size_t i = 0; i < ARRAY_SIZE(ids); ++i) {
+        ids[i] = AgentGroup<type>::create_new_agent();
+        ASSERT_EQ((int)i, ids[i]);
+    }
+    ASSERT_EQ(0, AgentGroup<type>::destroy_agent(ids[6]));
+    ASSERT_EQ(0, AgentGroup<type>::destroy_agent(ids[2]));
+    ASSERT_EQ(0, AgentGroup<type>::destroy_agent(ids[4]));
+    ASSERT_EQ(2, AgentGroup<type>::create_new_agent());
+    ASSERT_EQ(4, AgentGroup<type>::create_new_agent());
+    ASSERT_EQ(6, AgentGroup<type>::create_new_agent());
+    ASSERT_EQ(8, AgentGroup<type>::create_new_agent());
+
+    const int64_t memory_before =
+        g_agent_block_memory.load(butil::memory_order_relaxed);
+    ASSERT_TRUE(AgentGroup<type>::get_or_create_tls_agent(0) != NULL);
+    ASSERT_LT(memory_before,
+              g_agent_block_memory.load(butil::memory_order_relaxed));
+}
+
 butil::atomic<uint64_t> g_counter(0);
 
 void *global_add(void *) {
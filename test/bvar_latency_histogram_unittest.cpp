@@ -0,0 +1,138 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+#include <pthread.h>
+#include <sstream>
+#include <gtest/gtest.h>
+#include "butil/time.h"
+#include "bvar/latency_histogram.h"
+
+namespace {
+
+typedef bvar::detail::HistogramBuckets Buckets;
+
+TEST(LatencyHistogramTest, bucket_bounds) {
+    for (size_t i = 0; i + 1 < Buckets::NBUCKET; ++i) {
+        ASSERT_LE(Buckets::lower_bound(i), Buckets::upper_bound(i));
+        ASSERT_EQ(Buckets::upper_bound(i) + 1, Buckets::lower_bound(i + 1));
+        ASSERT_EQ(i, Buckets::index_of(Buckets::lower_bound(i)));
+        ASSERT_EQ(i, Buckets::index_of(Buckets::upper_bound(i)));
+    }
+    ASSERT_EQ(Buckets::NBUCKET - 1,
+              Buckets::index_of((int64_t)1 << Buckets::MAX_BITS));
+    // Relative width of buckets is bounded.
+    for (size_t i = Buckets::SUB_BUCKET_COUNT; i < Buckets::NBUCKET; ++i) {
+        const int64_t lb = Buckets::lower_bound(i);
+        ASSERT_LE((Buckets::upper_bound(i) - lb + 1) * Buckets::SUB_BUCKET_COUNT,
+                  lb);
+    }
+}
+
+TEST(LatencyHistogramTest, percentile) {
+    Buckets b;
+    ASSERT_EQ(0, b.get_percentile(0.99));
+    for (int i = 1; i <= 100000; ++i) {
+        b.add(i);
+    }
+    ASSERT_EQ(100000, b.count());
+    ASSERT_EQ(100000L * 100001 / 2, b.sum());
+    for (int k = 1; k <= 10000; k *= 10) {
+        const double ratio = 1 - 1.0 / (k * 10);
+        const int64_t expected = (int64_t)(100000 * ratio);
+        const int64_t actual = b.get_percentile(ratio);
+        ASSERT_GE(actual, expected);
+        ASSERT_LE(actual, expected + expected / Buckets::SUB_BUCKET_COUNT)
+            << "ratio=" << ratio;
+    }
+    ASSERT_LE(100000, b.get_percentile(1));
+
+    // A single spike is always seen.
+    Buckets b2;
+    for (int i = 0; i < 99999; ++i) {
+        b2.add(10);
+    }
+    b2.add(1000000);
+    ASSERT_EQ(10, b2.get_percentile(0.9999));
+    ASSERT_LE(1000000, b2.get_percentile(1));
+}
+
+TEST(LatencyHistogramTest, merge_and_subtract) {
+    Buckets b1;
+    Buckets b2;
+    for (int i = 0; i < 1000; ++i) {
+        b1.add(i);
+        b2.add(i * 1000);
+    }
+    Buckets merged = b1;
+    merged.merge(b2);
+    ASSERT_EQ(2000, merged.count());
+    ASSERT_EQ(b1.sum() + b2.sum(), merged.sum());
+    merged.subtract(b1);
+    ASSERT_EQ(b2.count(), merged.count());
+    ASSERT_EQ(b2.sum(), merged.sum());
+    for (size_t i = 0; i < Buckets::NBUCKET; ++i) {
+        ASSERT_EQ(b2.bucket(i), merged.bucket(i));
+    }
+}
+
+TEST(LatencyHistogramTest, describe) {
+    Buckets b;
+    std::ostringstream oss;
+    oss << b;
+    ASSERT_EQ("{\"count\":0,\"sum\":0,\"buckets\":[[0,0]]}", oss.str());
+    b.add(0);
+    b.add(3);
+    b.add(4);
+    oss.str("");
+    oss << b;
+    ASSERT_EQ("{\"count\":3,\"sum\":7,\"buckets\":[[0,1],[1,1],[3,2],[7,3]]}",
+              oss.str());
+}
+
+static void* add_latencies(void* arg) {
+    bvar::LatencyHistogram* h = (bvar::LatencyHistogram*)arg;
+    for (int i = 1; i <= 10000; ++i) {
+        *h << i;
+    }
+    return NULL;
+}
+
+TEST(LatencyHistogramTest, multiple_threads) {
+    bvar::LatencyHistogram h("latency_histogram_test");
+    pthread_t th[8];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, add_latencies, &h));
+    }
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        pthread_join(th[i], NULL);
+    }
+    const Buckets b = h.get_value();
+    ASSERT_EQ(80000, b.count());
+    ASSERT_EQ(8 * 10000L * 10001 / 2, b.sum());
+    ASSERT_LE(10000, b.get_percentile(1));
+    ASSERT_EQ(h.get_description(),
+              bvar::Variable::describe_exposed("latency_histogram_test"));
+
+    // The window contains all latencies after being sampled.
+    usleep(1500000);
+    ASSERT_EQ(80000, h.get_window_buckets().count());
+    ASSERT_EQ(b.get_percentile(0.999), h.get_percentile(0.999));
+}
+
+} // namespace
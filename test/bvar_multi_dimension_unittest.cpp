@@ -0,0 +1,137 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+
+#include <pthread.h>
+#include <map>
+#include <gtest/gtest.h>
+#include "bvar/bvar.h"
+#include "bvar/multi_dimension.h"
+
+namespace {
+
+typedef bvar::MultiDimension<bvar::Adder<int> > MAdder;
+
+static std::list<std::string> make_key(const std::string& a,
+                                       const std::string& b) {
+    std::list<std::string> key;
+    key.push_back(a);
+    key.push_back(b);
+    return key;
+}
+
+TEST(MultiDimensionTest, get_and_delete_stats) {
+    MAdder m(make_key("method", "status"));
+    ASSERT_EQ(2UL, m.count_labels());
+    ASSERT_TRUE(m.name().empty());
+    ASSERT_EQ(0UL, m.count_stats());
+
+    std::list<std::string> bad_key;
+    bad_key.push_back("Echo");
+    ASSERT_TRUE(m.get_stats(bad_key) == NULL);
+
+    bvar::Adder<int>* s1 = m.get_stats(make_key("Echo", "OK"));
+    ASSERT_TRUE(s1 != NULL);
+    ASSERT_EQ(s1, m.get_stats(make_key("Echo", "OK")));
+    bvar::Adder<int>* s2 = m.get_stats(make_key("Echo", "ETIMEDOUT"));
+    ASSERT_TRUE(s2 != NULL);
+    ASSERT_NE(s1, s2);
+    ASSERT_EQ(2UL, m.count_stats());
+    ASSERT_TRUE(m.has_stats(make_key("Echo", "OK")));
+    // Stats are not exposed individually.
+    ASSERT_TRUE(s1->name().empty());
+
+    std::vector<std::list<std::string> > names;
+    m.list_stats(&names);
+    ASSERT_EQ(2UL, names.size());
+
+    m.delete_stats(make_key("Echo", "OK"));
+    ASSERT_FALSE(m.has_stats(make_key("Echo", "OK")));
+    ASSERT_EQ(1UL, m.count_stats());
+    m.clear_stats();
+    ASSERT_EQ(0UL, m.count_stats());
+}
+
+TEST(MultiDimensionTest, expose) {
+    const size_t nexposed = bvar::MVariable::count_exposed();
+    {
+        MAdder m("multi_dimension_test_expose", make_key("a", "b"));
+        ASSERT_EQ("multi_dimension_test_expose", m.name());
+        ASSERT_EQ(nexposed + 1, bvar::MVariable::count_exposed());
+        MAdder m2("multi_dimension_test_expose", make_key("a", "b"));
+        ASSERT_TRUE(m2.name().empty());
+        ASSERT_EQ("{\"name\":\"multi_dimension_test_expose\","
+                  "\"labels\":[\"a\",\"b\"],\"stats_count\":0}",
+                  m.get_description());
+    }
+    ASSERT_EQ(nexposed, bvar::MVariable::count_exposed());
+}
+
+class MapDumper : public bvar::Dumper {
+public:
+    bool dump(const std::string&, const butil::StringPiece&) override {
+        return true;
+    }
+    bool dump_mvar(const std::string& name,
+                   const butil::StringPiece& desc) override {
+        values[name] = desc.as_string();
+        return true;
+    }
+    std::map<std::string, std::string> values;
+};
+
+TEST(MultiDimensionTest, dump) {
+    MAdder m("multi_dimension_test_dump", make_key("method", "peer"));
+    *m.get_stats(make_key("Echo", "127.0.0.1")) << 1 << 2;
+    *m.get_stats(make_key("Ec\"ho", "a\\b")) << 3;
+    MapDumper dumper;
+    ASSERT_LE(2, bvar::MVariable::dump_exposed(&dumper, NULL));
+    ASSERT_EQ("3", dumper.values[
+                  "multi_dimension_test_dump{method=\"Echo\",peer=\"127.0.0.1\"}"]);
+    ASSERT_EQ("3", dumper.values[
+                  "multi_dimension_test_dump{method=\"Ec\\\"ho\",peer=\"a\\\\b\"}"]);
+}
+
+static void* add_stats(void* arg) {
+    MAdder* m = (MAdder*)arg;
+    for (int i = 0; i < 10000; ++i) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%d", i % 10);
+        *m->get_stats(make_key("Echo", buf)) << 1;
+    }
+    return NULL;
+}
+
+TEST(MultiDimensionTest, multiple_threads) {
+    MAdder m(make_key("method", "shard"));
+    pthread_t th[8];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, add_stats, &m));
+    }
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        pthread_join(th[i], NULL);
+    }
+    ASSERT_EQ(10UL, m.count_stats());
+    for (int i = 0; i < 10; ++i) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%d", i);
+        ASSERT_EQ(8000, m.get_stats(make_key("Echo", buf))->get_value());
+    }
+}
+
+} // namespace
@@ -16,11 +16,16 @@
 // under the License.
 
 #include <limits>                           //std::numeric_limits
+#include <gflags/gflags.h>
 #include "bvar/detail/sampler.h"
 #include "butil/time.h"
 #include "butil/logging.h"
 #include <gtest/gtest.h>
 
+namespace bvar {
+DECLARE_int32(bvar_sampler_thread_num);
+}
+
 namespace {
 
 TEST(SamplerTest, linked_list) {
@@ -136,4 +141,25 @@ TEST(SamplerTest, multi_threaded) {
     }
 #endif
 }
+
+TEST(SamplerTest, sharded) {
+    bvar::FLAGS_bvar_sampler_thread_num = 4;
+    DebugSampler::_s_ndestroy = 0;
+    const int N = 100;
+    DebugSampler* s[N];
+    for (int i = 0; i < N; ++i) {
+        s[i] = new DebugSampler;
+        s[i]->schedule();
+    }
+    // Shards are added in next pass, then samplers are distributed.
+    usleep(2100000);
+    for (int i = 0; i < N; ++i) {
+        ASSERT_LE(1, s[i]->called_count()) << "i=" << i;
+    }
+    for (int i = 0; i < N; ++i) {
+        s[i]->destroy();
+    }
+    usleep(1100000);
+    EXPECT_EQ(N, DebugSampler::_s_ndestroy);
+}
 } // namespace
@@ -0,0 +1,85 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "bvar/reducer.h"
+#include "bvar/passive_status.h"
+#include "bvar/shm_exporter.h"
+
+namespace {
+
+static const char* const EXPORT_PATH = "./bvar_shm_exporter_unittest.data";
+
+static void get_text(std::ostream& os, void*) {
+    os << "not a number";
+}
+
+// Returns -1 if `name' is not found in `vars'.
+static double find_value(
+    const std::vector<std::pair<std::string, double> >& vars,
+    const std::string& name) {
+    for (size_t i = 0; i < vars.size(); ++i) {
+        if (vars[i].first == name) {
+            return vars[i].second;
+        }
+    }
+    return -1;
+}
+
+TEST(ShmExporterTest, export_numeric_vars) {
+    bvar::Adder<int> counter("shm_exporter_test_counter");
+    bvar::Adder<int> excluded("shm_exporter_excluded");
+    bvar::PassiveStatus<std::string> text("shm_exporter_test_text",
+                                          get_text, NULL);
+    counter << 42;
+    excluded << 1;
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bvar_shm_export_include", "shm_exporter_test_*").empty());
+    ASSERT_FALSE(GFLAGS_NS::SetCommandLineOption(
+                     "bvar_shm_export_path", EXPORT_PATH).empty());
+    std::vector<std::pair<std::string, double> > vars;
+    int64_t update_time_us = 0;
+    for (int i = 0; i < 50; ++i) {
+        if (bvar::read_shm_export(EXPORT_PATH, &vars, &update_time_us) == 0 &&
+            !vars.empty()) {
+            break;
+        }
+        usleep(100000);
+    }
+    ASSERT_EQ(1u, vars.size());
+    ASSERT_EQ(42, find_value(vars, "shm_exporter_test_counter"));
+    ASSERT_GT(update_time_us, 0);
+
+    // Values are updated in place.
+    counter << 8;
+    for (int i = 0; i < 50; ++i) {
+        ASSERT_EQ(0, bvar::read_shm_export(EXPORT_PATH, &vars));
+        if (find_value(vars, "shm_exporter_test_counter") == 50) {
+            break;
+        }
+        usleep(100000);
+    }
+    ASSERT_EQ(50, find_value(vars, "shm_exporter_test_counter"));
+
+    GFLAGS_NS::SetCommandLineOption("bvar_shm_export_path", "");
+    GFLAGS_NS::SetCommandLineOption("bvar_shm_export_include", "");
+    unlink(EXPORT_PATH);
+}
+
+}  // namespace
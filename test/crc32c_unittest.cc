@@ -8,6 +8,7 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
 #include <gtest/gtest.h>
+#include <string>
 #include "butil/crc32c.h"
 
 namespace butil {
@@ -61,6 +62,38 @@ TEST_F(CRC, Extend) {
             Extend(Value("hello ", 6), "world", 5));
 }
 
+// Bitwise crc32c as the reference.
+static uint32_t ReferenceValue(const char* data, size_t n) {
+  uint32_t crc = 0xffffffffu;
+  for (size_t i = 0; i < n; ++i) {
+    crc ^= static_cast<uint8_t>(data[i]);
+    for (int k = 0; k < 8; ++k) {
+      crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+TEST_F(CRC, LargeBuffers) {
+  // Large buffers are processed in interleaved strides with hardware
+  // instructions, test various lengths and alignments around strides.
+  std::string data(70000, '\0');
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<char>(i * 131 + (i >> 7));
+  }
+  const size_t lens[] = { 3071, 3072, 3073, 6144, 6151, 65536, 69990 };
+  for (size_t off = 0; off < 8; ++off) {
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i) {
+      const char* p = data.data() + off;
+      const uint32_t expected = ReferenceValue(p, lens[i]);
+      ASSERT_EQ(expected, Value(p, lens[i])) << off << ' ' << lens[i];
+      const size_t half = lens[i] / 2;
+      ASSERT_EQ(expected, Extend(Value(p, half), p + half, lens[i] - half))
+          << off << ' ' << lens[i];
+    }
+  }
+}
+
 TEST_F(CRC, Mask) {
   uint32_t crc = Value("foo", 3);
   ASSERT_NE(crc, Mask(crc));
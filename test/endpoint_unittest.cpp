@@ -16,10 +16,13 @@
 // under the License.
 
 #include <gtest/gtest.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "butil/errno.h"
 #include "butil/endpoint.h"
 #include "butil/logging.h"
 #include "butil/containers/flat_map.h"
+#include "butil/fd_guard.h"
 
 namespace {
 
@@ -102,6 +105,94 @@ TEST(EndPointTest, endpoint) {
 #endif
 }
 
+TEST(EndPointTest, extended_endpoint) {
+    butil::EndPoint p1;
+    ASSERT_EQ(0, butil::str2endpoint("[::1]:8000", &p1));
+    ASSERT_TRUE(butil::is_endpoint_extended(p1));
+    ASSERT_EQ(AF_INET6, butil::get_endpoint_type(p1));
+    ASSERT_STREQ("[::1]:8000", butil::endpoint2str(p1).c_str());
+    ASSERT_EQ(-1, butil::str2endpoint("[::1]:65536", &p1));
+    ASSERT_EQ(-1, butil::str2endpoint("[::1:8000", &p1));
+    ASSERT_EQ(-1, butil::str2endpoint("[1.2.3.4]:8000", &p1));
+
+    // Equal addresses share the same id.
+    butil::EndPoint p2;
+    ASSERT_EQ(0, butil::str2endpoint("::1", 8000, &p2));
+    ASSERT_EQ(p1, p2);
+    butil::EndPoint p3;
+    ASSERT_EQ(0, butil::hostname2endpoint("[::1]:8001", &p3));
+    ASSERT_NE(p1, p3);
+    std::ostringstream oss;
+    oss << p3;
+    ASSERT_EQ("[::1]:8001", oss.str());
+
+    butil::EndPoint p4;
+    ASSERT_EQ(0, butil::str2endpoint("unix:/tmp/endpoint_unittest.sock", &p4));
+    ASSERT_EQ(AF_UNIX, butil::get_endpoint_type(p4));
+    ASSERT_STREQ("unix:/tmp/endpoint_unittest.sock", butil::endpoint2str(p4).c_str());
+    ASSERT_EQ(-1, butil::str2endpoint("unix:", &p4));
+    ASSERT_EQ(-1, butil::str2endpoint(("unix:" + std::string(200, 'a')).c_str(), &p4));
+
+    // Copying and destructing keep the address alive, assigning IPv4
+    // releases it.
+    {
+        butil::EndPoint copied = p4;
+        butil::EndPoint assigned;
+        assigned = copied;
+        ASSERT_EQ(p4, assigned);
+    }
+    ASSERT_STREQ("unix:/tmp/endpoint_unittest.sock", butil::endpoint2str(p4).c_str());
+    p4 = butil::EndPoint(butil::IP_ANY, 80);
+    ASSERT_FALSE(butil::is_endpoint_extended(p4));
+    ASSERT_EQ(AF_INET, butil::get_endpoint_type(p4));
+
+    butil::hash_map<butil::EndPoint, int> m;
+    m[p1] = 1;
+    m[p3] = 3;
+    ASSERT_EQ(1, m[p2]);
+    ASSERT_EQ(2u, m.size());
+}
+
+TEST(EndPointTest, listen_and_connect_extended) {
+    const char* const paths[] = { "unix:/tmp/endpoint_unittest_listen.sock",
+                                  "[::1]:0" };
+    for (size_t i = 0; i < arraysize(paths); ++i) {
+        butil::EndPoint point;
+        ASSERT_EQ(0, butil::str2endpoint(paths[i], &point));
+        if (i == 0) {
+            unlink(paths[i] + 5);
+        }
+        butil::fd_guard listen_fd(butil::tcp_listen(point));
+        if (listen_fd < 0 && i == 1) {
+            LOG(WARNING) << "IPv6 is not supported: " << berror();
+            continue;
+        }
+        ASSERT_GE(listen_fd, 0) << berror();
+        butil::EndPoint listened;
+        ASSERT_EQ(0, butil::get_local_side(listen_fd, &listened));
+        ASSERT_EQ(butil::get_endpoint_type(point),
+                  butil::get_endpoint_type(listened));
+        if (i == 0) {
+            ASSERT_EQ(point, listened);
+        }
+        int self_port = -1;
+        butil::fd_guard fd(butil::tcp_connect(listened, &self_port));
+        ASSERT_GE(fd, 0) << berror();
+        ASSERT_EQ(i == 0, self_port == 0);
+        butil::fd_guard accepted(accept(listen_fd, NULL, NULL));
+        ASSERT_GE(accepted, 0);
+        butil::EndPoint remote;
+        ASSERT_EQ(0, butil::get_remote_side(fd, &remote));
+        ASSERT_EQ(listened, remote);
+        ASSERT_EQ(0, butil::get_remote_side(accepted, &remote));
+        ASSERT_EQ(butil::get_endpoint_type(point),
+                  butil::get_endpoint_type(remote));
+        if (i == 0) {
+            unlink(paths[i] + 5);
+        }
+    }
+}
+
 TEST(EndPointTest, hash_table) {
     butil::hash_map<butil::EndPoint, int> m;
     butil::EndPoint ep1(butil::IP_ANY, 123);
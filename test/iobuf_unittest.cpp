@@ -16,6 +16,7 @@
 // under the License.
 
 #include <gtest/gtest.h>
+#include <gflags/gflags.h>
 #include <sys/types.h>
 #include <sys/socket.h>                // socketpair
 #include <errno.h>                     // errno
@@ -36,6 +37,9 @@
 #include "iobuf.pb.h"
 #endif   // BAZEL_TEST
 
+DECLARE_int32(iobuf_max_block_size);
+DECLARE_bool(iobuf_track_block_owners);
+
 namespace butil {
 namespace iobuf {
 extern void* (*blockmem_allocate)(size_t);
@@ -45,6 +49,8 @@ extern int32_t block_shared_count(butil::IOBuf::Block const* b);
 extern uint32_t block_cap(butil::IOBuf::Block const* b);
 extern IOBuf::Block* get_tls_block_head();
 extern int get_tls_block_count();
+extern IOBuf::Block* get_tls_block_head(int cls);
+extern int get_tls_block_count(int cls);
 extern void remove_tls_block_chain();
 extern IOBuf::Block* acquire_tls_block();
 extern IOBuf::Block* share_tls_block();
@@ -108,15 +114,19 @@ void show_prof_and_rm(const char* bin_name, const char* filename, size_t topn) {
 
 static void check_memory_leak() {
     if (is_debug_allocator_enabled()) {
-        butil::IOBuf::Block* p = butil::iobuf::get_tls_block_head();
         size_t n = 0;
-        while (p) {
-            ASSERT_TRUE(s_set.seek(p)) << "Memory leak: " << p;
-            p = butil::iobuf::get_portal_next(p);
-            ++n;
+        size_t count = 0;
+        for (int i = 0; i < butil::IOBuf::BLOCK_CLASS_NUM; ++i) {
+            butil::IOBuf::Block* p = butil::iobuf::get_tls_block_head(i);
+            while (p) {
+                ASSERT_TRUE(s_set.seek(p)) << "Memory leak: " << p;
+                p = butil::iobuf::get_portal_next(p);
+                ++n;
+            }
+            count += butil::iobuf::get_tls_block_count(i);
         }
         ASSERT_EQ(n, s_set.size());
-        ASSERT_EQ(n, (size_t)butil::iobuf::get_tls_block_count());
+        ASSERT_EQ(n, count);
     }
 }
 
@@ -347,6 +357,52 @@ TEST_F(IOBufTest, reserve) {
     ASSERT_EQ("orang" + s2 + s1, b.to_string());
 }
 
+TEST_F(IOBufTest, reserve_contiguous) {
+    butil::iobuf::remove_tls_block_chain();
+    butil::IOBuf b;
+    ASSERT_TRUE(b.reserve_contiguous(0) == NULL);
+    b.append("hello");
+    char* p1 = (char*)b.reserve_contiguous(100);
+    ASSERT_TRUE(p1 != NULL);
+    memset(p1, 'a', 100);
+    ASSERT_EQ((size_t)105, b.size());
+    // Small reservations share the block with former data.
+    ASSERT_EQ(1u, b.backing_block_num());
+
+    // Not enough space left in the TLS block, a new one is used.
+    const size_t n2 = butil::IOBuf::DEFAULT_BLOCK_SIZE / 2;
+    b.append(std::string(DEFAULT_PAYLOAD - b.size() - 10, 'x'));
+    char* p2 = (char*)b.reserve_contiguous(n2);
+    ASSERT_TRUE(p2 != NULL);
+    memset(p2, 'b', n2);
+    ASSERT_EQ(2u, b.backing_block_num());
+    // Rest of the new block is used by later appending.
+    b.append("world");
+    ASSERT_EQ(2u, b.backing_block_num());
+
+    // Larger than DEFAULT_BLOCK_SIZE.
+    const size_t n3 = butil::IOBuf::DEFAULT_BLOCK_SIZE * 3;
+    char* p3 = (char*)b.reserve_contiguous(n3);
+    ASSERT_TRUE(p3 != NULL);
+    memset(p3, 'c', n3);
+    ASSERT_EQ(3u, b.backing_block_num());
+    ASSERT_EQ(n3, b.backing_block(2).size());
+
+    const std::string s = b.to_string();
+    ASSERT_EQ(std::string(100, 'a'), s.substr(5, 100));
+    ASSERT_EQ(std::string(n2, 'b') + "world" + std::string(n3, 'c'),
+              s.substr(DEFAULT_PAYLOAD - 10));
+
+    // Larger than the largest block allowed.
+    const int saved_max_block_size = FLAGS_iobuf_max_block_size;
+    FLAGS_iobuf_max_block_size = butil::IOBuf::DEFAULT_BLOCK_SIZE;
+    ASSERT_TRUE(b.reserve_contiguous(n3) == NULL);
+    FLAGS_iobuf_max_block_size = saved_max_block_size;
+    ASSERT_TRUE(b.reserve_contiguous(butil::IOBuf::HUGE_BLOCK_SIZE) == NULL);
+    b.clear();
+    butil::iobuf::remove_tls_block_chain();
+}
+
 struct FakeBlock {
     int nshared;
     FakeBlock() : nshared(1) {}
@@ -698,6 +754,46 @@ TEST_F(IOBufTest, cut_by_multiple_text_delim) {
     ASSERT_EQ("", to_str(b));
 }
 
+static void noop_deleter(void*) {}
+
+TEST_F(IOBufTest, find_across_blocks) {
+    // Every piece is an individual block.
+    const char* pieces[] = { "GET / HTTP/1.1\r", "\nHost: x", "\r", "\n",
+                             "\r\n0123456789abcdefghijklmnopqrstuvwxyz" };
+    butil::IOBuf b;
+    std::string s;
+    for (size_t i = 0; i < ARRAY_SIZE(pieces); ++i) {
+        b.append_user_data((void*)pieces[i], strlen(pieces[i]), noop_deleter);
+        s.append(pieces[i]);
+    }
+    ASSERT_EQ(ARRAY_SIZE(pieces), b.backing_block_num());
+    const char* patterns[] = { "\r\n", "\r\n\r\n", "Host", "\n", "z", "yz",
+                               "xyz0", "HTTP/1.1\r\nHost", "", "\n\r\n" };
+    for (size_t i = 0; i < ARRAY_SIZE(patterns); ++i) {
+        for (size_t pos = 0; pos <= s.size() + 1; ++pos) {
+            const size_t expected = s.find(patterns[i], pos);
+            ASSERT_EQ(expected == std::string::npos ? butil::IOBuf::npos : expected,
+                      b.find(patterns[i], pos)) << i << " " << pos;
+        }
+    }
+    for (size_t pos = 0; pos <= s.size(); ++pos) {
+        ASSERT_EQ(s.find('\n', pos), b.find('\n', pos));
+        ASSERT_EQ(s.find_first_of("\r\n", pos), b.find_first_of("\r\n", pos));
+        ASSERT_EQ(s.find_first_of(":/zq", pos), b.find_first_of(":/zq", pos));
+        ASSERT_EQ(s.find_first_of("0123456789abcdefgh$", pos),
+                  b.find_first_of("0123456789abcdefgh$", pos));
+    }
+    ASSERT_EQ(butil::IOBuf::npos, b.find_first_of("!", 0));
+    ASSERT_EQ(butil::IOBuf::npos, b.find_first_of("", 0));
+
+    // Delimiters longer than 8 bytes are supported.
+    butil::IOBuf p;
+    ASSERT_EQ(0, b.cut_until(&p, "\r\nHost: x\r\n"));
+    ASSERT_EQ("GET / HTTP/1.1", to_str(p));
+    ASSERT_EQ(0, b.cut_until(&p, "\r\n"));
+    ASSERT_EQ(-1, b.cut_until(&p, "\r\n"));
+}
+
 TEST_F(IOBufTest, append_a_lot_and_cut_them_all) {
     install_debug_allocator();
     
@@ -1657,6 +1753,127 @@ TEST_F(IOBufTest, append_user_data_and_share) {
     ASSERT_EQ(data, my_free_params);
 }
 
+static void* my_free_arg = NULL;
+static void my_free_with_arg(void* m, void* arg) {
+    free(m);
+    my_free_params = m;
+    my_free_arg = arg;
+}
+
+TEST_F(IOBufTest, append_user_data_with_arg) {
+    char* data = (char*)malloc(64);
+    memset(data, 'a', 64);
+    int owner = 0;
+    my_free_params = NULL;
+    my_free_arg = NULL;
+    {
+        butil::IOBuf b0;
+        ASSERT_EQ(0, b0.append_user_data(data, 64, my_free_with_arg, &owner));
+        butil::IOBuf b1;
+        b0.cutn(&b1, 32);
+        b0.clear();
+        ASSERT_EQ(NULL, my_free_params);
+        ASSERT_EQ(std::string(32, 'a'), b1.to_string());
+    }
+    ASSERT_EQ(data, my_free_params);
+    ASSERT_EQ(&owner, my_free_arg);
+}
+
+TEST_F(IOBufTest, append_file_region) {
+    std::string content;
+    for (int i = 0; i < 10000; ++i) {
+        content.push_back('a' + i % 26);
+    }
+    butil::TempFile file;
+    ASSERT_EQ(0, file.save(content.c_str()));
+    butil::fd_guard fd(open(file.fname(), O_RDONLY));
+    ASSERT_TRUE(fd >= 0) << file.fname() << ' ' << berror();
+    const size_t offsets[] = { 0, 1, 4095, 4096, 5000 };
+    for (size_t i = 0; i < ARRAY_SIZE(offsets); ++i) {
+        butil::IOBuf buf;
+        buf.append("head");
+        const size_t count = content.size() - offsets[i];
+        ASSERT_EQ(0, buf.append_file_region(fd, offsets[i], count));
+        ASSERT_EQ("head" + content.substr(offsets[i]), buf.to_string());
+        // Shared blocks keep the mapping after the source is destroyed.
+        butil::IOBuf part;
+        buf.cutn(&part, 4 + count / 2);
+        buf.clear();
+        ASSERT_EQ("head" + content.substr(offsets[i], count / 2),
+                  part.to_string());
+    }
+    butil::IOBuf buf;
+    ASSERT_EQ(0, buf.append_file_region(fd, 0, 0));
+    ASSERT_TRUE(buf.empty());
+    ASSERT_EQ(-1, buf.append_file_region(-1, 0, 10));
+    ASSERT_TRUE(buf.empty());
+}
+
+TEST_F(IOBufTest, large_data_uses_large_blocks) {
+    const size_t N = 4 * 1024 * 1024;
+    std::string data(N, 'x');
+    butil::IOBuf buf;
+    ASSERT_EQ(0, buf.append(data));
+    // 4 blocks of 1M (a bit less than 1M of payload in each) and 1 of 64K.
+    ASSERT_LE(buf.backing_block_num(), 6u);
+    ASSERT_EQ(data, buf.to_string());
+
+    butil::TempFile file;
+    ASSERT_EQ(0, file.save_bin(data.data(), data.size()));
+    butil::fd_guard fd(open(file.fname(), O_RDONLY));
+    ASSERT_GE(fd, 0);
+    butil::IOPortal portal;
+    ASSERT_EQ(512 * 1024, portal.append_from_file_descriptor(fd, 512 * 1024));
+    ASSERT_LE(portal.backing_block_num(), 9u);
+    ASSERT_EQ(data.substr(0, 512 * 1024), portal.to_string());
+
+    const int saved_max_block_size = FLAGS_iobuf_max_block_size;
+    FLAGS_iobuf_max_block_size = butil::IOBuf::DEFAULT_BLOCK_SIZE;
+    butil::IOBuf buf2;
+    ASSERT_EQ(0, buf2.append(data));
+    ASSERT_GE(buf2.backing_block_num(), N / DEFAULT_PAYLOAD);
+    FLAGS_iobuf_max_block_size = saved_max_block_size;
+    ASSERT_EQ(buf, buf2);
+}
+
+static int64_t get_owner_bytes(const std::string& name) {
+    std::vector<butil::iobuf::BlockOwnerStat> stats;
+    butil::iobuf::list_block_owners(&stats);
+    for (size_t i = 0; i < stats.size(); ++i) {
+        if (stats[i].name == name) {
+            return stats[i].nbytes;
+        }
+    }
+    return -1;
+}
+
+TEST_F(IOBufTest, block_owner) {
+    const int owner = butil::iobuf::register_block_owner("iobuf_test");
+    ASSERT_GT(owner, 0);
+    ASSERT_EQ(owner, butil::iobuf::register_block_owner("iobuf_test"));
+    ASSERT_EQ(0, get_owner_bytes("iobuf_test"));
+
+    butil::iobuf::remove_tls_block_chain();
+    FLAGS_iobuf_track_block_owners = true;
+    butil::IOBuf buf;
+    {
+        butil::iobuf::ScopedBlockOwner scoped_owner(owner);
+        buf.resize(100 * 1024, 'x');
+    }
+    // Not charged out of the scope.
+    butil::IOBuf buf2;
+    buf2.resize(100 * 1024, 'x');
+    FLAGS_iobuf_track_block_owners = false;
+    const int64_t nbytes = get_owner_bytes("iobuf_test");
+    ASSERT_GE(nbytes, 100 * 1024);
+    ASSERT_LT(nbytes, 100 * 1024 + 2 * (int64_t)butil::IOBuf::LARGE_BLOCK_SIZE);
+
+    buf.clear();
+    buf2.clear();
+    butil::iobuf::remove_tls_block_chain();
+    ASSERT_EQ(0, get_owner_bytes("iobuf_test"));
+}
+
 TEST_F(IOBufTest, share_tls_block) {
     butil::iobuf::remove_tls_block_chain();
     butil::IOBuf::Block* b = butil::iobuf::acquire_tls_block();
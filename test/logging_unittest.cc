@@ -4,6 +4,7 @@
 
 #include "butil/basictypes.h"
 #include "butil/logging.h"
+#include "butil/async_log_sink.h"
 
 #include <gtest/gtest.h>
 #include <gflags/gflags.h>
@@ -204,6 +205,39 @@ TEST_F(LoggingTest, log_at) {
     ::logging::SetLogSink(old_sink);
 }
 
+TEST_F(LoggingTest, async_log_sink) {
+    ::logging::StringSink log_str;
+    ::logging::AsyncLogSinkOptions options;
+    options.target = &log_str;
+    options.thread_buffer_size = 4096;
+    // Flushed manually.
+    options.flush_interval_ms = 1000000;
+    ::logging::AsyncLogSink* sink = new ::logging::AsyncLogSink;
+    ASSERT_EQ(0, sink->Start(&options));
+    ::logging::LogSink* old_sink = ::logging::SetLogSink(sink);
+    LOG(WARNING) << "first async log";
+    LOG(WARNING) << "second async log";
+    ASSERT_EQ(std::string::npos, log_str.find("first async log"));
+    sink->Flush();
+    const size_t pos1 = log_str.find("first async log");
+    const size_t pos2 = log_str.find("second async log");
+    ASSERT_NE(std::string::npos, pos1);
+    ASSERT_NE(std::string::npos, pos2);
+    ASSERT_LT(pos1, pos2);
+    ASSERT_EQ(0, sink->dropped_count());
+
+    // Overflow the buffer.
+    const std::string long_log(1000, 'x');
+    for (int i = 0; i < 10; ++i) {
+        LOG(WARNING) << long_log;
+    }
+    ASSERT_GT(sink->dropped_count(), 0);
+    sink->Flush();
+    ASSERT_NE(std::string::npos, log_str.find("since buffers of logging threads were full"));
+    ::logging::SetLogSink(old_sink);
+    delete sink;
+}
+
 #define VLOG_NE(verbose_level) VLOG(verbose_level) << noflush
 
 #define VLOG2_NE(virtual_path, verbose_level)           \
@@ -0,0 +1,188 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <string>
+#include <gtest/gtest.h>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "butil/scoped_lock.h"
+#include "butil/containers/bounded_queue.h"
+#include "butil/containers/mpmc_bounded_queue.h"
+
+namespace {
+
+int g_nalive = 0;
+struct Counted {
+    Counted() { ++g_nalive; }
+    Counted(const Counted&) { ++g_nalive; }
+    ~Counted() { --g_nalive; }
+};
+
+TEST(MPMCBoundedQueueTest, sanity) {
+    butil::MPMCBoundedQueue<std::string> q;
+    ASSERT_FALSE(q.initialized());
+    ASSERT_EQ(-1, q.init(0));
+    ASSERT_EQ(0, q.init(3));
+    ASSERT_EQ(-1, q.init(3));
+    ASSERT_EQ(4u, q.capacity());
+    std::string s;
+    ASSERT_FALSE(q.pop(&s));
+    for (int round = 0; round < 3; ++round) {
+        ASSERT_TRUE(q.push("a"));
+        ASSERT_TRUE(q.push("b"));
+        ASSERT_TRUE(q.push("c"));
+        ASSERT_TRUE(q.push("d"));
+        ASSERT_FALSE(q.push("e"));
+        ASSERT_EQ(4u, q.size());
+        ASSERT_TRUE(q.pop(&s));
+        ASSERT_EQ("a", s);
+        ASSERT_TRUE(q.pop(&s));
+        ASSERT_EQ("b", s);
+        ASSERT_TRUE(q.pop(&s));
+        ASSERT_EQ("c", s);
+        ASSERT_TRUE(q.pop(&s));
+        ASSERT_EQ("d", s);
+        ASSERT_FALSE(q.pop(&s));
+        ASSERT_TRUE(q.empty());
+    }
+}
+
+TEST(MPMCBoundedQueueTest, destroy_remaining_items) {
+    {
+        butil::MPMCBoundedQueue<Counted> q;
+        ASSERT_EQ(0, q.init(8));
+        for (int i = 0; i < 3; ++i) {
+            ASSERT_TRUE(q.push(Counted()));
+        }
+        Counted c;
+        ASSERT_TRUE(q.pop(&c));
+        ASSERT_EQ(3, g_nalive);
+    }
+    ASSERT_EQ(0, g_nalive);
+}
+
+const int NPRODUCER = 4;
+const int NCONSUMER = 4;
+const int NPUSH = 500000;
+
+// The baseline: BoundedQueue protected by a mutex.
+class MutexQueue {
+public:
+    explicit MutexQueue(size_t cap) : _q(cap) {
+        pthread_mutex_init(&_mutex, NULL);
+    }
+    ~MutexQueue() { pthread_mutex_destroy(&_mutex); }
+    bool push(uint64_t v) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _q.push(v);
+    }
+    bool pop(uint64_t* v) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _q.pop(v);
+    }
+private:
+    pthread_mutex_t _mutex;
+    butil::BoundedQueue<uint64_t> _q;
+};
+
+template <typename Q>
+struct QueueArg {
+    Q* q;
+    butil::atomic<int> nproducing;
+    butil::atomic<int64_t> npopped;
+    butil::atomic<uint64_t> sum;
+};
+
+template <typename Q>
+void* producer(void* void_arg) {
+    QueueArg<Q>* arg = (QueueArg<Q>*)void_arg;
+    for (uint64_t i = 1; i <= (uint64_t)NPUSH; ++i) {
+        while (!arg->q->push(i)) {
+            sched_yield();
+        }
+    }
+    arg->nproducing.fetch_sub(1);
+    return NULL;
+}
+
+template <typename Q>
+void* consumer(void* void_arg) {
+    QueueArg<Q>* arg = (QueueArg<Q>*)void_arg;
+    uint64_t sum = 0;
+    int64_t n = 0;
+    uint64_t v = 0;
+    while (true) {
+        if (arg->q->pop(&v)) {
+            sum += v;
+            ++n;
+        } else if (arg->nproducing.load() == 0) {
+            if (!arg->q->pop(&v)) {
+                break;
+            }
+            sum += v;
+            ++n;
+        } else {
+            sched_yield();
+        }
+    }
+    arg->sum.fetch_add(sum);
+    arg->npopped.fetch_add(n);
+    return NULL;
+}
+
+// Returns nanoseconds per item.
+template <typename Q>
+int64_t run_producers_and_consumers(Q* q) {
+    QueueArg<Q> arg;
+    arg.q = q;
+    arg.nproducing.store(NPRODUCER);
+    arg.npopped.store(0);
+    arg.sum.store(0);
+    pthread_t th[NPRODUCER + NCONSUMER];
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < NPRODUCER; ++i) {
+        EXPECT_EQ(0, pthread_create(&th[i], NULL, producer<Q>, &arg));
+    }
+    for (int i = 0; i < NCONSUMER; ++i) {
+        EXPECT_EQ(0, pthread_create(&th[NPRODUCER + i], NULL, consumer<Q>, &arg));
+    }
+    for (int i = 0; i < NPRODUCER + NCONSUMER; ++i) {
+        pthread_join(th[i], NULL);
+    }
+    tm.stop();
+    EXPECT_EQ((int64_t)NPRODUCER * NPUSH, arg.npopped.load());
+    EXPECT_EQ((uint64_t)NPRODUCER * NPUSH * (NPUSH + 1) / 2, arg.sum.load());
+    return tm.n_elapsed() / ((int64_t)NPRODUCER * NPUSH);
+}
+
+TEST(MPMCBoundedQueueTest, multiple_producers_and_consumers) {
+    MutexQueue mq(1024);
+    butil::MPMCBoundedQueue<uint64_t> q;
+    ASSERT_EQ(0, q.init(1024));
+    const int64_t mutex_ns = run_producers_and_consumers(&mq);
+    const int64_t lockfree_ns = run_producers_and_consumers(&q);
+    LOG(INFO) << "Passing an item through " << NPRODUCER << " producers and "
+              << NCONSUMER << " consumers takes " << mutex_ns
+              << "ns with mutex+BoundedQueue, " << lockfree_ns
+              << "ns with MPMCBoundedQueue";
+}
+
+} // namespace
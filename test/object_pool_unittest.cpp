@@ -21,6 +21,7 @@
 
 #define BAIDU_CLEAR_OBJECT_POOL_AFTER_ALL_THREADS_QUIT
 #include "butil/object_pool.h"
+#include "butil/pool_registry.h"
 
 namespace {
 struct MyObject {};
@@ -35,6 +36,14 @@ struct Foo {
     }
     int x;
 };
+
+int ntrim_obj_dtor = 0;
+struct TrimObj {
+    ~TrimObj() {
+        ++ntrim_obj_dtor;
+    }
+    int x;
+};
 }
 
 namespace butil {
@@ -55,6 +64,18 @@ template <> struct ObjectPoolValidator<Foo> {
         return foo->x != 0;
     }
 };
+
+template <> struct ObjectPoolBlockMaxItem<TrimObj> {
+    static const size_t value = 4;
+};
+
+template <> struct ObjectPoolFreeChunkMaxItem<TrimObj> {
+    static size_t value() { return 2; }
+};
+
+template <> struct ObjectPoolAllowTrim<TrimObj> {
+    static const bool value = true;
+};
 }
 
 namespace {
@@ -94,7 +115,7 @@ TEST_F(ObjectPoolTest, change_config) {
     printf("%lu\n", ARRAY_SIZE(a));
     
     ObjectPoolInfo info = describe_objects<MyObject>();
-    ObjectPoolInfo zero_info = { 0, 0, 0, 0, 3, 3, 0 };
+    ObjectPoolInfo zero_info = { 0, 0, 0, 0, 3, 3, 0, 0, 0 };
     ASSERT_EQ(0, memcmp(&info, &zero_info, sizeof(info)));
 
     MyObject* p = get_object<MyObject>();
@@ -350,10 +371,63 @@ TEST_F(ObjectPoolTest, get_and_return_int_multiple_threads) {
     clear_objects<D>();
     ObjectPoolInfo info = describe_objects<D>();
     ObjectPoolInfo zero_info = { 0, 0, 0, 0, ObjectPoolBlockMaxItem<D>::value,
-                                 ObjectPoolBlockMaxItem<D>::value, 0 };
+                                 ObjectPoolBlockMaxItem<D>::value, 0, 0, 0 };
     ASSERT_EQ(0, memcmp(&info, &zero_info, sizeof(info)));
 }
 
+TEST_F(ObjectPoolTest, trim) {
+    ASSERT_EQ(4UL, (size_t)ObjectPool<TrimObj>::BLOCK_NITEM);
+    std::vector<TrimObj*> v;
+    for (int i = 0; i < 8; ++i) {
+        v.push_back(get_object<TrimObj>());
+    }
+    for (size_t i = 0; i < v.size(); ++i) {
+        ASSERT_EQ(0, return_object(v[i]));
+    }
+    // v[0..5] were pushed to the global free list in chunks of 2, v[6]
+    // and v[7] are still cached by this thread.
+    ObjectPoolInfo info = describe_objects<TrimObj>();
+    ASSERT_EQ(2UL, info.block_num);
+    ASSERT_EQ(6UL, info.global_free_item_num);
+
+    // Not trimmable.
+    int* pi = get_object<int>();
+    return_object(pi);
+    ASSERT_EQ(0UL, ObjectPool<int>::singleton()->trim());
+
+    // Only the first block is fully free.
+    ntrim_obj_dtor = 0;
+    ASSERT_EQ(sizeof(ObjectPool<TrimObj>::Block), trim_object_pools());
+    ASSERT_EQ(4, ntrim_obj_dtor);
+    info = describe_objects<TrimObj>();
+    ASSERT_EQ(1UL, info.block_num);
+    ASSERT_EQ(1UL, info.released_block_num);
+    ASSERT_EQ(2UL, info.global_free_item_num);
+    ASSERT_EQ(0UL, ObjectPool<TrimObj>::singleton()->trim());
+
+    std::set<TrimObj*> remain(v.begin() + 4, v.end());
+    for (int i = 0; i < 4; ++i) {
+        TrimObj* p = get_object<TrimObj>();
+        ASSERT_EQ(1UL, remain.erase(p));
+    }
+    ASSERT_EQ(0UL, describe_objects<TrimObj>().global_free_item_num);
+
+    std::vector<PoolStat> stats;
+    list_pools(&stats);
+    bool found = false;
+    for (size_t i = 0; i < stats.size(); ++i) {
+        if (stats[i].name.find("TrimObj") != std::string::npos) {
+            found = true;
+            ASSERT_STREQ("object", stats[i].kind);
+            ASSERT_TRUE(stats[i].trimmable);
+            ASSERT_EQ(1UL, stats[i].block_num);
+            ASSERT_EQ(1UL, stats[i].released_block_num);
+            ASSERT_EQ(sizeof(TrimObj), stats[i].item_size);
+        }
+    }
+    ASSERT_TRUE(found);
+}
+
 TEST_F(ObjectPoolTest, verify_get) {
     clear_objects<int>();
     std::cout << describe_objects<int>() << std::endl;
@@ -0,0 +1,158 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string>
+#include "butil/iobuf.h"
+#include "butil/string_printf.h"
+#include "butil/containers/sharded_cache.h"
+
+namespace {
+
+typedef butil::ShardedCache<int, int> IntCache;
+typedef butil::ShardedCache<std::string, butil::IOBuf> BufCache;
+
+struct AddOne {
+    void operator()(int* v) const { ++*v; }
+};
+
+TEST(ShardedCacheTest, put_get_erase) {
+    butil::ShardedCacheOptions options;
+    IntCache cache(options);
+    int v = 0;
+    ASSERT_FALSE(cache.Get(1, &v));
+    cache.Put(1, 10);
+    cache.Put(2, 20);
+    ASSERT_EQ(2u, cache.size());
+    ASSERT_TRUE(cache.Get(1, &v));
+    ASSERT_EQ(10, v);
+    cache.Put(1, 11);
+    ASSERT_EQ(2u, cache.size());
+    ASSERT_TRUE(cache.Get(1, &v));
+    ASSERT_EQ(11, v);
+
+    AddOne add_one;
+    ASSERT_TRUE(cache.Visit(2, add_one));
+    ASSERT_TRUE(cache.Get(2, &v));
+    ASSERT_EQ(21, v);
+
+    ASSERT_TRUE(cache.Erase(1));
+    ASSERT_FALSE(cache.Erase(1));
+    ASSERT_FALSE(cache.Get(1, &v));
+    ASSERT_EQ(4u, cache.hit_count());
+    ASSERT_EQ(2u, cache.miss_count());
+
+    cache.Clear();
+    ASSERT_EQ(0u, cache.size());
+    ASSERT_EQ(0u, cache.bytes());
+}
+
+TEST(ShardedCacheTest, evict_by_entries) {
+    butil::ShardedCacheOptions options;
+    options.nshard = 1;
+    options.max_entries = 4;
+    IntCache cache(options);
+    for (int i = 0; i < 4; ++i) {
+        cache.Put(i, i);
+    }
+    int v = 0;
+    // Referenced entries survive one round of the clock.
+    ASSERT_TRUE(cache.Get(0, &v));
+    ASSERT_TRUE(cache.Get(2, &v));
+    cache.Put(4, 4);
+    ASSERT_EQ(4u, cache.size());
+    ASSERT_TRUE(cache.Get(0, &v));
+    ASSERT_FALSE(cache.Get(1, &v));
+    ASSERT_TRUE(cache.Get(2, &v));
+    ASSERT_TRUE(cache.Get(4, &v));
+    cache.Put(5, 5);
+    ASSERT_FALSE(cache.Get(3, &v));
+    ASSERT_EQ(4u, cache.size());
+}
+
+TEST(ShardedCacheTest, evict_by_bytes) {
+    butil::ShardedCacheOptions options;
+    options.nshard = 1;
+    options.max_bytes = 100;
+    BufCache cache(options);
+    butil::IOBuf buf;
+    buf.resize(30);
+    for (int i = 0; i < 5; ++i) {
+        cache.Put(butil::string_printf("k%d", i), buf);
+    }
+    // 32 bytes each, 3 of them fit.
+    ASSERT_EQ(3u, cache.size());
+    ASSERT_EQ(96u, cache.bytes());
+
+    butil::IOBuf big;
+    big.resize(200);
+    cache.Put("big", big);
+    butil::IOBuf out;
+    ASSERT_FALSE(cache.Get("big", &out));
+    ASSERT_EQ(3u, cache.size());
+    ASSERT_TRUE(cache.Get("k4", &out));
+    ASSERT_EQ(30u, out.size());
+}
+
+TEST(ShardedCacheTest, ttl) {
+    butil::ShardedCacheOptions options;
+    options.ttl_ms = 50;
+    IntCache cache(options);
+    cache.Put(1, 1);
+    cache.Put(2, 2, 0);
+    cache.Put(3, 3, 1000);
+    int v = 0;
+    ASSERT_TRUE(cache.Get(1, &v));
+    usleep(80000);
+    ASSERT_FALSE(cache.Get(1, &v));
+    ASSERT_TRUE(cache.Get(2, &v));
+    ASSERT_TRUE(cache.Get(3, &v));
+    ASSERT_EQ(2u, cache.size());
+}
+
+void* PutAndGet(void* arg) {
+    IntCache* cache = static_cast<IntCache*>(arg);
+    for (int i = 0; i < 100000; ++i) {
+        const int key = i % 1000;
+        int v = 0;
+        if (cache->Get(key, &v)) {
+            EXPECT_EQ(key * 2, v);
+        } else {
+            cache->Put(key, key * 2);
+        }
+    }
+    return NULL;
+}
+
+TEST(ShardedCacheTest, multi_threaded) {
+    butil::ShardedCacheOptions options;
+    options.max_entries = 512;
+    IntCache cache(options);
+    pthread_t th[8];
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        ASSERT_EQ(0, pthread_create(&th[i], NULL, PutAndGet, &cache));
+    }
+    for (size_t i = 0; i < arraysize(th); ++i) {
+        pthread_join(th[i], NULL);
+    }
+    ASSERT_LE(cache.size(), 512u);
+    ASSERT_EQ(800000u, cache.hit_count() + cache.miss_count());
+}
+
+} // namespace
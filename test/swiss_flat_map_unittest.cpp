@@ -0,0 +1,308 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include "butil/time.h"
+#include "butil/macros.h"
+#include "butil/logging.h"
+#include "butil/string_printf.h"
+#include "butil/containers/flat_map.h"
+#include "butil/containers/swiss_flat_map.h"
+
+namespace {
+class SwissFlatMapTest : public ::testing::Test{
+protected:
+    SwissFlatMapTest(){};
+    virtual ~SwissFlatMapTest(){};
+    virtual void SetUp() {
+    };
+    virtual void TearDown() {
+    };
+};
+
+int g_nalive = 0;
+struct Counted {
+    Counted() : x(0) { ++g_nalive; }
+    Counted(int x2) : x(x2) { ++g_nalive; }
+    Counted(const Counted& rhs) : x(rhs.x) { ++g_nalive; }
+    ~Counted() { --g_nalive; }
+    int x;
+};
+
+TEST_F(SwissFlatMapTest, manipulate_uninitialized_map) {
+    butil::SwissFlatMap<int, int> m;
+    ASSERT_FALSE(m.initialized());
+    for (butil::SwissFlatMap<int, int>::iterator it = m.begin(); it != m.end(); ++it) {
+        ASSERT_TRUE(false);
+    }
+    ASSERT_EQ(NULL, m.seek(1));
+    ASSERT_EQ(0u, m.erase(1));
+    ASSERT_EQ(0, m.init(32));
+    ASSERT_EQ(-1, m.init(32));
+    butil::SwissFlatMap<int, int> m2;
+    ASSERT_EQ(-1, m2.init(32, 100));
+}
+
+TEST_F(SwissFlatMapTest, sanity) {
+    typedef butil::SwissFlatMap<uint64_t, long> Map;
+    Map m;
+    ASSERT_EQ(0, m.init(1));
+    ASSERT_EQ(16u, m.bucket_count());
+    ASSERT_EQ(87u, m.load_factor());
+    ASSERT_TRUE(m.empty());
+
+    const uint64_t k1 = 1;
+    *m.insert(k1, 10) += 1;
+    ASSERT_EQ(11, *m.seek(k1));
+    ASSERT_EQ(1u, m.size());
+    m[k1] = 12;
+    ASSERT_EQ(12, *m.seek(k1));
+    ASSERT_EQ(1u, m.size());
+    ASSERT_EQ(NULL, m.seek(2));
+
+    long old_value = 0;
+    ASSERT_EQ(1u, m.erase(k1, &old_value));
+    ASSERT_EQ(12, old_value);
+    ASSERT_EQ(0u, m.erase(k1));
+    ASSERT_TRUE(m.empty());
+
+    // Grow.
+    for (uint64_t i = 0; i < 1000; ++i) {
+        m[i] = i * 2;
+    }
+    ASSERT_EQ(1000u, m.size());
+    ASSERT_LE(m.size() * 100, m.bucket_count() * m.load_factor());
+    for (uint64_t i = 0; i < 1000; ++i) {
+        ASSERT_EQ((long)i * 2, *m.seek(i));
+    }
+    size_t n = 0;
+    for (Map::const_iterator it = m.begin(); it != m.end(); ++it, ++n) {
+        ASSERT_EQ((long)it->first * 2, it->second);
+    }
+    ASSERT_EQ(1000u, n);
+    ASSERT_FALSE(m.resize(16));
+    ASSERT_TRUE(m.resize(4096));
+    ASSERT_EQ(4096u, m.bucket_count());
+    ASSERT_EQ(1000u, m.size());
+    ASSERT_EQ(20, *m.seek(10));
+    m.clear();
+    ASSERT_TRUE(m.empty());
+    ASSERT_EQ(m.begin(), m.end());
+    ASSERT_EQ(4096u, m.bucket_count());
+}
+
+TEST_F(SwissFlatMapTest, seek_by_string_piece) {
+    butil::SwissFlatMap<std::string, int> m;
+    ASSERT_EQ(0, m.init(16));
+    m["hello"] = 1;
+    m["world"] = 2;
+    butil::StringPiece k1("hello");
+    ASSERT_TRUE(m.seek(k1));
+    ASSERT_EQ(1, *m.seek(k1));
+    ASSERT_EQ(2, *m.seek("world"));
+    ASSERT_FALSE(m.seek("foo"));
+    ASSERT_EQ(1u, m.erase(butil::StringPiece("world")));
+    ASSERT_FALSE(m.seek("world"));
+}
+
+TEST_F(SwissFlatMapTest, set) {
+    butil::SwissFlatSet<int> s;
+    ASSERT_EQ(0, s.init(16));
+    ASSERT_TRUE(s.insert(1));
+    ASSERT_TRUE(s.insert(2));
+    ASSERT_TRUE(s.insert(1));
+    ASSERT_EQ(2u, s.size());
+    ASSERT_TRUE(s.seek(1));
+    ASSERT_FALSE(s.seek(3));
+    ASSERT_EQ(1u, s.erase(1));
+    ASSERT_FALSE(s.seek(1));
+}
+
+TEST_F(SwissFlatMapTest, copy_and_swap) {
+    butil::SwissFlatMap<int, std::string> m1;
+    ASSERT_EQ(0, m1.init(32));
+    m1[1] = "a";
+    m1[2] = "b";
+    butil::SwissFlatMap<int, std::string> m2(m1);
+    ASSERT_EQ(2u, m2.size());
+    ASSERT_EQ("a", *m2.seek(1));
+    m2[3] = "c";
+    butil::SwissFlatMap<int, std::string> m3;
+    m3 = m2;
+    ASSERT_EQ(3u, m3.size());
+    ASSERT_EQ("c", *m3.seek(3));
+    ASSERT_FALSE(m1.seek(3));
+    m1.swap(m3);
+    ASSERT_EQ(3u, m1.size());
+    ASSERT_EQ(2u, m3.size());
+}
+
+TEST_F(SwissFlatMapTest, deleted_slots_are_reclaimed) {
+    butil::SwissFlatMap<int, int> m;
+    ASSERT_EQ(0, m.init(64));
+    // Keep the map small while inserting and erasing a lot of different
+    // keys, which leave deleted slots behind.
+    for (int i = 0; i < 100000; ++i) {
+        m[i] = i;
+        if (i >= 8) {
+            ASSERT_EQ(1u, m.erase(i - 8));
+        }
+    }
+    ASSERT_EQ(8u, m.size());
+    ASSERT_EQ(64u, m.bucket_count());
+    for (int i = 100000 - 8; i < 100000; ++i) {
+        ASSERT_EQ(i, *m.seek(i));
+    }
+}
+
+TEST_F(SwissFlatMapTest, random_insert_erase) {
+    srand(0);
+    {
+        typedef butil::SwissFlatMap<uint64_t, Counted> Map;
+        std::map<uint64_t, int> ref[2];
+        Map ht[2];
+        ASSERT_EQ(0, ht[0].init(40));
+        for (int j = 0; j < 10; ++j) {
+            // Make snapshot
+            ht[1] = ht[0];
+            ref[1] = ref[0];
+            for (int i = 0; i < 100000; ++i) {
+                const int k = rand() % 0xFFFF;
+                const int p = rand() % 1000;
+                if (p < 600) {
+                    ht[0].insert(k, Counted(i));
+                    ref[0][k] = i;
+                } else if (p < 999) {
+                    ASSERT_EQ(ref[0].erase(k), ht[0].erase(k));
+                } else {
+                    ht[0].clear();
+                    ref[0].clear();
+                }
+            }
+            for (int i = 0; i < 2; ++i) {
+                ASSERT_EQ(ref[i].size(), ht[i].size());
+                for (Map::iterator it = ht[i].begin(); it != ht[i].end(); ++it) {
+                    std::map<uint64_t, int>::iterator it2 = ref[i].find(it->first);
+                    ASSERT_TRUE(it2 != ref[i].end());
+                    ASSERT_EQ(it2->second, it->second.x);
+                }
+                for (std::map<uint64_t, int>::iterator it = ref[i].begin();
+                     it != ref[i].end(); ++it) {
+                    Counted* p_value = ht[i].seek(it->first);
+                    ASSERT_TRUE(p_value != NULL);
+                    ASSERT_EQ(it->second, p_value->x);
+                }
+            }
+        }
+    }
+    ASSERT_EQ(0, g_nalive);
+}
+
+// Memory of FlatMap: the bucket array plus nodes for collided keys.
+template <typename Map>
+size_t flat_map_memory(const Map& m) {
+    if (m.empty()) {
+        return m.bucket_count() * sizeof(typename Map::Bucket);
+    }
+    const size_t nonempty = (size_t)(m.size() / m.bucket_info().average_length + 0.5);
+    return (m.bucket_count() + m.size() - nonempty) * sizeof(typename Map::Bucket);
+}
+
+struct Value32 {
+    long data[4];
+};
+
+template <typename T> void perf_cmp_with_flat_map(const T& value) {
+    const size_t nkeys[] = { 100, 1000, 10000, 100000 };
+    LOG(INFO) << "[ value = " << sizeof(T) << " bytes ]";
+    for (size_t pass = 0; pass < ARRAY_SIZE(nkeys); ++pass) {
+        std::vector<uint64_t> keys;
+        const uint64_t start = rand();
+        for (size_t i = 0; i < nkeys[pass]; ++i) {
+            // Not sequential, which is too friendly to FlatMap.
+            keys.push_back((start + i) * 2654435761UL);
+        }
+        std::random_shuffle(keys.begin(), keys.end());
+
+        butil::FlatMap<uint64_t, T> flat_map;
+        butil::SwissFlatMap<uint64_t, T> swiss_map;
+        ASSERT_EQ(0, flat_map.init(16));
+        ASSERT_EQ(0, swiss_map.init(16));
+        butil::Timer flat_tm, swiss_tm;
+        flat_tm.start();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            flat_map[keys[i]] = value;
+        }
+        flat_tm.stop();
+        swiss_tm.start();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            swiss_map[keys[i]] = value;
+        }
+        swiss_tm.stop();
+        LOG(INFO) << "Inserting " << keys.size()
+                  << " into FlatMap/SwissFlatMap takes "
+                  << flat_tm.n_elapsed() / keys.size() << "/"
+                  << swiss_tm.n_elapsed() / keys.size();
+
+        std::random_shuffle(keys.begin(), keys.end());
+        long sum = 0;
+        flat_tm.start();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            sum += *(long*)flat_map.seek(keys[i]);
+        }
+        flat_tm.stop();
+        swiss_tm.start();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            sum += *(long*)swiss_map.seek(keys[i]);
+        }
+        swiss_tm.stop();
+        // Missing keys.
+        butil::Timer flat_miss_tm, swiss_miss_tm;
+        flat_miss_tm.start();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            sum += (flat_map.seek(keys[i] + 1) != NULL);
+        }
+        flat_miss_tm.stop();
+        swiss_miss_tm.start();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            sum += (swiss_map.seek(keys[i] + 1) != NULL);
+        }
+        swiss_miss_tm.stop();
+        LOG(INFO) << "Seeking " << keys.size()
+                  << " existing/missing keys from FlatMap/SwissFlatMap takes "
+                  << flat_tm.n_elapsed() / keys.size() << "/"
+                  << swiss_tm.n_elapsed() / keys.size() << " "
+                  << flat_miss_tm.n_elapsed() / keys.size() << "/"
+                  << swiss_miss_tm.n_elapsed() / keys.size()
+                  << " sum=" << sum;
+        LOG(INFO) << "Memory per entry of FlatMap/SwissFlatMap with "
+                  << keys.size() << " keys: "
+                  << flat_map_memory(flat_map) / keys.size() << "/"
+                  << swiss_map.memory_usage() / keys.size();
+    }
+}
+
+TEST_F(SwissFlatMapTest, perf_cmp_with_flat_map) {
+    perf_cmp_with_flat_map<long>(100);
+    perf_cmp_with_flat_map<Value32>(Value32());
+}
+
+} // namespace
@@ -0,0 +1,636 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// Drive real LoadBalancers through SelectServer()/Feedback() against
+// simulated backends, and report load imbalance, tail latency and how long
+// the traffic takes to converge after backends change. No network is
+// involved: backends are sockets which are never connected, "calling" a
+// backend sleeps for a latency drawn from its distribution.
+//
+//   ./lb_sim -lb=la,wrr,c_murmurhash
+//            -backends="8:exp:mean=2000;2:exp:mean=8000,capacity=8"
+//            -events="10:0:latency_x=10" -duration_s=30
+
+#include <math.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <gflags/gflags.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <butil/fast_rand.h>
+#include <butil/string_splitter.h>
+#include <butil/string_printf.h>
+#include <butil/strings/string_number_conversions.h>
+#include <bthread/bthread.h>
+#include <bthread/condition_variable.h>
+#include <brpc/controller.h>
+#include <brpc/load_balancer.h>
+#include <brpc/socket.h>
+#include <brpc/global.h>
+
+DEFINE_string(lb, "rr,random,wrr,la,c_murmurhash", "Load balancers to "
+              "simulate one after another, separated by comma. Parameters "
+              "can be appended as in ChannelOptions, e.g. "
+              "c_murmurhash:load_factor=1.25 (quote the whole flag)");
+DEFINE_string(backends, "10:exp:mean=2000", "Groups of backends separated by "
+              "semicolon, in form of <count>:<distribution>:<key=value,...>. "
+              "Distributions(keys): fixed(mean), uniform(min,max), exp(mean), "
+              "normal(mean,stddev), lognormal(median,sigma), pareto(min,alpha)"
+              ", values are in microseconds. Other keys: capacity(max "
+              "concurrent calls, more calls are queued, 0 for unlimited), "
+              "fail(ratio of failed calls), weight(tag for wrr/wr, 1 by "
+              "default)");
+DEFINE_string(events, "", "Changes of backends during the simulation, "
+              "separated by semicolon, in form of <second>:<backend index>:"
+              "<key=value,...>. Keys: latency_x(multiply latencies), "
+              "fail(ratio of failed calls)");
+DEFINE_int32(concurrency, 64, "Number of concurrent callers");
+DEFINE_int32(qps, 0, "Limit total QPS if this flag is positive, otherwise "
+             "callers call as fast as possible");
+DEFINE_int32(duration_s, 30, "Simulate each load balancer for so many seconds");
+DEFINE_int32(timeout_ms, 100, "Calls longer than this are ended as timedout");
+DEFINE_int32(key_space, 10000, "Request codes are drawn uniformly from "
+             "[0, key_space), used by consistent hashing");
+DEFINE_double(converge_tolerance, 0.1, "Traffic is converged once the L1 "
+              "distance between traffic shares of every later second and "
+              "the final shares is within this value");
+DEFINE_bool(timeline, false, "Print traffic shares of backends per second");
+
+namespace lb_sim {
+
+struct LatencyModel {
+    enum Type { FIXED, UNIFORM, EXP, NORMAL, LOGNORMAL, PARETO };
+    Type type;
+    double a;
+    double b;
+
+    int64_t sample() const {
+        double v = 0;
+        switch (type) {
+        case FIXED:
+            v = a;
+            break;
+        case UNIFORM:
+            v = a + (b - a) * butil::fast_rand_double();
+            break;
+        case EXP:
+            v = -a * log(1.0 - butil::fast_rand_double());
+            break;
+        case NORMAL:
+            v = a + b * std_normal();
+            break;
+        case LOGNORMAL:
+            v = a * exp(b * std_normal());
+            break;
+        case PARETO:
+            v = a / pow(1.0 - butil::fast_rand_double(), 1.0 / b);
+            break;
+        }
+        return v < 0 ? 0 : (int64_t)v;
+    }
+
+private:
+    static double std_normal() {
+        // Box-Muller
+        const double u1 = 1.0 - butil::fast_rand_double();
+        const double u2 = butil::fast_rand_double();
+        return sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+    }
+};
+
+struct Backend {
+    int index;
+    brpc::ServerId server_id;
+    LatencyModel model;
+    int capacity;
+    double fail_ratio;
+
+    // Changed by events, in thousandths and millionths.
+    butil::atomic<int64_t> latency_x1000;
+    butil::atomic<int64_t> fail_x1000000;
+
+    bthread::Mutex mutex;
+    bthread::ConditionVariable cond;
+    int inflight;
+
+    Backend() : index(0), capacity(0), fail_ratio(0)
+              , latency_x1000(1000), fail_x1000000(0), inflight(0) {}
+
+    void reset() {
+        latency_x1000.store(1000, butil::memory_order_relaxed);
+        fail_x1000000.store((int64_t)(fail_ratio * 1000000),
+                            butil::memory_order_relaxed);
+        inflight = 0;
+    }
+
+    // Simulate a call. Returns the error code of the call.
+    int serve() {
+        const int64_t deadline_us =
+            butil::gettimeofday_us() + FLAGS_timeout_ms * 1000L;
+        if (capacity > 0) {
+            std::unique_lock<bthread::Mutex> mu(mutex);
+            while (inflight >= capacity) {
+                const int64_t left_us = deadline_us - butil::gettimeofday_us();
+                if (left_us <= 0 || cond.wait_for(mu, left_us) == ETIMEDOUT) {
+                    if (inflight >= capacity) {
+                        return brpc::ERPCTIMEDOUT;
+                    }
+                }
+            }
+            ++inflight;
+        }
+        const int64_t latency_us = model.sample() *
+            latency_x1000.load(butil::memory_order_relaxed) / 1000;
+        const int64_t left_us = deadline_us - butil::gettimeofday_us();
+        int error_code = 0;
+        if (latency_us >= left_us) {
+            bthread_usleep(std::max(left_us, (int64_t)0));
+            error_code = brpc::ERPCTIMEDOUT;
+        } else {
+            bthread_usleep(latency_us);
+            if ((int64_t)butil::fast_rand_less_than(1000000) <
+                fail_x1000000.load(butil::memory_order_relaxed)) {
+                error_code = brpc::EINTERNAL;
+            }
+        }
+        if (capacity > 0) {
+            std::unique_lock<bthread::Mutex> mu(mutex);
+            --inflight;
+            cond.notify_one();
+        }
+        return error_code;
+    }
+};
+
+struct Event {
+    int second;
+    int backend;
+    double latency_x;  // <= 0 means unchanged
+    double fail;       // < 0 means unchanged
+};
+
+struct Sample {
+    int32_t backend;   // -1 when no server was selected
+    int32_t second;
+    int32_t error_code;
+    int64_t latency_us;
+};
+
+struct Simulation {
+    brpc::LoadBalancer* lb;
+    std::vector<Backend*>* backends;
+    const std::map<brpc::SocketId, Backend*>* backend_of;
+    int64_t start_us;
+    butil::atomic<bool> stopped;
+};
+
+struct CallerContext {
+    Simulation* sim;
+    std::vector<Sample> samples;
+};
+
+static void* caller(void* arg) {
+    CallerContext* ctx = static_cast<CallerContext*>(arg);
+    Simulation* sim = ctx->sim;
+    const int64_t interval_us = (FLAGS_qps > 0 ?
+        FLAGS_concurrency * 1000000L / FLAGS_qps : 0);
+    int64_t next_us = butil::gettimeofday_us();
+    while (!sim->stopped.load(butil::memory_order_relaxed)) {
+        if (interval_us > 0) {
+            next_us += interval_us;
+        }
+        const int64_t begin_us = butil::gettimeofday_us();
+        Sample s;
+        s.second = (begin_us - sim->start_us) / 1000000L;
+        brpc::SocketUniquePtr ptr;
+        brpc::LoadBalancer::SelectIn in = {
+            begin_us, true, true,
+            butil::fast_rand_less_than(FLAGS_key_space), NULL };
+        brpc::LoadBalancer::SelectOut out(&ptr);
+        const int rc = sim->lb->SelectServer(in, &out);
+        if (rc != 0) {
+            s.backend = -1;
+            s.error_code = rc;
+            s.latency_us = 0;
+            ctx->samples.push_back(s);
+            bthread_usleep(1000);
+            continue;
+        }
+        Backend* b = sim->backend_of->find(ptr->id())->second;
+        s.backend = b->index;
+        s.error_code = b->serve();
+        const int64_t end_us = butil::gettimeofday_us();
+        s.latency_us = end_us - begin_us;
+        if (out.need_feedback) {
+            brpc::Controller cntl;
+            cntl.set_timeout_ms(FLAGS_timeout_ms);
+            cntl.set_max_retry(0);
+            brpc::LoadBalancer::CallInfo info;
+            info.begin_time_us = begin_us;
+            info.server_id = ptr->id();
+            info.error_code = s.error_code;
+            info.controller = &cntl;
+            sim->lb->Feedback(info);
+        }
+        ctx->samples.push_back(s);
+        if (interval_us > 0 && next_us > end_us) {
+            bthread_usleep(next_us - end_us);
+        }
+    }
+    return NULL;
+}
+
+static int64_t percentile(const std::vector<int64_t>& sorted, double ratio) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, (size_t)(ratio * sorted.size()))];
+}
+
+static void report(const std::string& lb_name,
+                   const std::vector<Backend*>& backends,
+                   const std::vector<Sample>& samples,
+                   int last_event_second) {
+    const size_t nb = backends.size();
+    const int nsec = FLAGS_duration_s;
+    std::vector<std::vector<int64_t> > latencies(nb);
+    std::vector<int64_t> all_latencies;
+    std::vector<int64_t> nerror(nb, 0);
+    // traffic[second][backend]
+    std::vector<std::vector<int64_t> > traffic(nsec, std::vector<int64_t>(nb, 0));
+    int64_t nnoserver = 0;
+    int64_t nerror_total = 0;
+    for (size_t i = 0; i < samples.size(); ++i) {
+        const Sample& s = samples[i];
+        if (s.backend < 0) {
+            ++nnoserver;
+            continue;
+        }
+        latencies[s.backend].push_back(s.latency_us);
+        all_latencies.push_back(s.latency_us);
+        if (s.error_code != 0) {
+            ++nerror[s.backend];
+            ++nerror_total;
+        }
+        if (s.second >= 0 && s.second < nsec) {
+            ++traffic[s.second][s.backend];
+        }
+    }
+    std::sort(all_latencies.begin(), all_latencies.end());
+
+    // Load imbalance over the whole simulation.
+    double mean = all_latencies.size() / (double)nb;
+    double var = 0;
+    int64_t max_calls = 0;
+    for (size_t i = 0; i < nb; ++i) {
+        const double d = latencies[i].size() - mean;
+        var += d * d;
+        max_calls = std::max(max_calls, (int64_t)latencies[i].size());
+    }
+    const double cv = (mean > 0 ? sqrt(var / nb) / mean : 0);
+
+    // Shares of each second, final shares are averaged over the last 3
+    // seconds.
+    std::vector<std::vector<double> > shares(nsec, std::vector<double>(nb, 0));
+    for (int t = 0; t < nsec; ++t) {
+        int64_t sum = 0;
+        for (size_t i = 0; i < nb; ++i) {
+            sum += traffic[t][i];
+        }
+        for (size_t i = 0; i < nb && sum > 0; ++i) {
+            shares[t][i] = traffic[t][i] / (double)sum;
+        }
+    }
+    const int nfinal = std::min(3, nsec);
+    std::vector<double> final_share(nb, 0);
+    for (int t = nsec - nfinal; t < nsec; ++t) {
+        for (size_t i = 0; i < nb; ++i) {
+            final_share[i] += shares[t][i] / nfinal;
+        }
+    }
+    int converged_second = -1;
+    for (int t = nsec - 1; t >= std::max(last_event_second, 0); --t) {
+        double dist = 0;
+        for (size_t i = 0; i < nb; ++i) {
+            dist += fabs(shares[t][i] - final_share[i]);
+        }
+        if (dist > FLAGS_converge_tolerance) {
+            break;
+        }
+        converged_second = t;
+    }
+
+    printf("==== lb=%s ====\n", lb_name.c_str());
+    printf("calls=%zu qps=%.0f errors=%" PRId64 " no_server=%" PRId64 "\n",
+           all_latencies.size(), all_latencies.size() / (double)nsec,
+           nerror_total, nnoserver);
+    printf("latency_us avg=%" PRId64 " p50=%" PRId64 " p99=%" PRId64
+           " p999=%" PRId64 " max=%" PRId64 "\n",
+           all_latencies.empty() ? 0 : (int64_t)(std::accumulate(
+               all_latencies.begin(), all_latencies.end(), (int64_t)0)
+               / (int64_t)all_latencies.size()),
+           percentile(all_latencies, 0.5), percentile(all_latencies, 0.99),
+           percentile(all_latencies, 0.999),
+           all_latencies.empty() ? 0 : all_latencies.back());
+    printf("imbalance max/mean=%.3f cv=%.3f\n",
+           mean > 0 ? max_calls / mean : 0, cv);
+    const int since = std::max(last_event_second, 0);
+    if (converged_second < 0 || converged_second >= nsec - nfinal) {
+        printf("convergence: not converged in %d seconds since second %d\n",
+               nsec - since, since);
+    } else {
+        printf("convergence: %d seconds since second %d\n",
+               converged_second - since, since);
+    }
+    printf("%-8s %8s %8s %8s %8s %8s\n",
+           "backend", "share", "final", "errors", "avg_us", "p99_us");
+    for (size_t i = 0; i < nb; ++i) {
+        std::vector<int64_t>& lat = latencies[i];
+        std::sort(lat.begin(), lat.end());
+        int64_t sum = 0;
+        for (size_t j = 0; j < lat.size(); ++j) {
+            sum += lat[j];
+        }
+        printf("%-8zu %7.2f%% %7.2f%% %8" PRId64 " %8" PRId64 " %8" PRId64 "\n",
+               i, all_latencies.empty() ? 0 :
+               lat.size() * 100.0 / all_latencies.size(),
+               final_share[i] * 100, nerror[i],
+               lat.empty() ? 0 : sum / (int64_t)lat.size(),
+               percentile(lat, 0.99));
+    }
+    if (FLAGS_timeline) {
+        printf("timeline(%% of calls per second):\n");
+        for (int t = 0; t < nsec; ++t) {
+            printf("%4d:", t);
+            for (size_t i = 0; i < nb; ++i) {
+                printf(" %5.1f", shares[t][i] * 100);
+            }
+            printf("\n");
+        }
+    }
+    fflush(stdout);
+}
+
+static int simulate(const std::string& lb_spec,
+                    std::vector<Backend*>& backends,
+                    const std::vector<Event>& events) {
+    // Same as ChannelOptions: "<name>" or "<name>:<params>"
+    const size_t colon = lb_spec.find(':');
+    const std::string lb_name = lb_spec.substr(0, colon);
+    const butil::StringPiece lb_params = (colon == std::string::npos ?
+        butil::StringPiece() : butil::StringPiece(lb_spec).substr(colon + 1));
+    const brpc::LoadBalancer* proto =
+        brpc::LoadBalancerExtension()->Find(lb_name.c_str());
+    if (proto == NULL) {
+        LOG(ERROR) << "Unknown load balancer `" << lb_name << "'";
+        return -1;
+    }
+    brpc::LoadBalancer* lb = proto->New(lb_params);
+    if (lb == NULL) {
+        LOG(ERROR) << "Fail to create load balancer `" << lb_spec << "'";
+        return -1;
+    }
+    std::map<brpc::SocketId, Backend*> backend_of;
+    std::vector<brpc::ServerId> ids;
+    for (size_t i = 0; i < backends.size(); ++i) {
+        backends[i]->reset();
+        backend_of[backends[i]->server_id.id] = backends[i];
+        ids.push_back(backends[i]->server_id);
+    }
+    lb->AddServersInBatch(ids);
+
+    Simulation sim;
+    sim.lb = lb;
+    sim.backends = &backends;
+    sim.backend_of = &backend_of;
+    sim.start_us = butil::gettimeofday_us();
+    sim.stopped.store(false, butil::memory_order_relaxed);
+    std::vector<CallerContext> ctxs(FLAGS_concurrency);
+    std::vector<bthread_t> tids(FLAGS_concurrency);
+    for (int i = 0; i < FLAGS_concurrency; ++i) {
+        ctxs[i].sim = &sim;
+        if (bthread_start_background(&tids[i], NULL, caller, &ctxs[i]) != 0) {
+            LOG(ERROR) << "Fail to create bthread";
+            return -1;
+        }
+    }
+    int last_event_second = 0;
+    for (int t = 0; t < FLAGS_duration_s; ++t) {
+        for (size_t i = 0; i < events.size(); ++i) {
+            const Event& e = events[i];
+            if (e.second != t) {
+                continue;
+            }
+            Backend* b = backends[e.backend];
+            if (e.latency_x > 0) {
+                b->latency_x1000.store((int64_t)(e.latency_x * 1000),
+                                       butil::memory_order_relaxed);
+            }
+            if (e.fail >= 0) {
+                b->fail_x1000000.store((int64_t)(e.fail * 1000000),
+                                       butil::memory_order_relaxed);
+            }
+            last_event_second = t;
+        }
+        const int64_t wake_us = sim.start_us + (t + 1) * 1000000L;
+        const int64_t now_us = butil::gettimeofday_us();
+        if (wake_us > now_us) {
+            bthread_usleep(wake_us - now_us);
+        }
+    }
+    sim.stopped.store(true, butil::memory_order_relaxed);
+    std::vector<Sample> samples;
+    for (int i = 0; i < FLAGS_concurrency; ++i) {
+        bthread_join(tids[i], NULL);
+        samples.insert(samples.end(), ctxs[i].samples.begin(),
+                       ctxs[i].samples.end());
+    }
+    lb->Destroy();
+    report(lb_spec, backends, samples, last_event_second);
+    return 0;
+}
+
+static bool parse_latency_model(const butil::StringPiece& dist,
+                                const std::map<std::string, double>& kv,
+                                LatencyModel* m) {
+    struct ModelDesc {
+        const char* name;
+        LatencyModel::Type type;
+        const char* a;
+        const char* b;
+    };
+    static const ModelDesc descs[] = {
+        { "fixed", LatencyModel::FIXED, "mean", NULL },
+        { "uniform", LatencyModel::UNIFORM, "min", "max" },
+        { "exp", LatencyModel::EXP, "mean", NULL },
+        { "normal", LatencyModel::NORMAL, "mean", "stddev" },
+        { "lognormal", LatencyModel::LOGNORMAL, "median", "sigma" },
+        { "pareto", LatencyModel::PARETO, "min", "alpha" },
+    };
+    for (size_t i = 0; i < arraysize(descs); ++i) {
+        if (dist != descs[i].name) {
+            continue;
+        }
+        m->type = descs[i].type;
+        m->a = 0;
+        m->b = 0;
+        std::map<std::string, double>::const_iterator it = kv.find(descs[i].a);
+        if (it == kv.end()) {
+            LOG(ERROR) << "`" << descs[i].a << "' is required by " << dist;
+            return false;
+        }
+        m->a = it->second;
+        if (descs[i].b != NULL) {
+            it = kv.find(descs[i].b);
+            if (it == kv.end()) {
+                LOG(ERROR) << "`" << descs[i].b << "' is required by " << dist;
+                return false;
+            }
+            m->b = it->second;
+        }
+        return true;
+    }
+    LOG(ERROR) << "Unknown latency distribution `" << dist << "'";
+    return false;
+}
+
+static bool parse_key_values(const butil::StringPiece& s,
+                             std::map<std::string, double>* kv) {
+    for (butil::KeyValuePairsSplitter sp(s, ',', '='); sp; ++sp) {
+        double v = 0;
+        if (!butil::StringToDouble(sp.value().as_string(), &v)) {
+            LOG(ERROR) << "Invalid value in `" << sp.key_and_value() << "'";
+            return false;
+        }
+        (*kv)[sp.key().as_string()] = v;
+    }
+    return true;
+}
+
+// Split "a:b:c" into at most `n' fields.
+static size_t split_fields(const butil::StringPiece& s, size_t n,
+                           butil::StringPiece* fields) {
+    size_t nfield = 0;
+    size_t pos = 0;
+    while (nfield + 1 < n) {
+        const size_t colon = s.find(':', pos);
+        if (colon == butil::StringPiece::npos) {
+            break;
+        }
+        fields[nfield++] = s.substr(pos, colon - pos);
+        pos = colon + 1;
+    }
+    fields[nfield++] = s.substr(pos);
+    return nfield;
+}
+
+static int create_backends(std::vector<Backend*>* backends) {
+    for (butil::StringSplitter sp(FLAGS_backends.c_str(), ';'); sp; ++sp) {
+        butil::StringPiece group(sp.field(), sp.length());
+        butil::StringPiece fields[3];
+        std::map<std::string, double> kv;
+        int count = 0;
+        LatencyModel model;
+        if (split_fields(group, 3, fields) != 3 ||
+            !butil::StringToInt(fields[0], &count) || count <= 0 ||
+            !parse_key_values(fields[2], &kv) ||
+            !parse_latency_model(fields[1], kv, &model)) {
+            LOG(ERROR) << "Invalid group of backends `" << group << "'";
+            return -1;
+        }
+        for (int i = 0; i < count; ++i) {
+            Backend* b = new Backend;
+            b->index = backends->size();
+            b->model = model;
+            b->capacity = (int)kv["capacity"];
+            b->fail_ratio = kv["fail"];
+            b->server_id.tag = butil::string_printf(
+                "%d", kv.count("weight") ? (int)kv["weight"] : 1);
+            // Sockets are never connected, the addresses are only for
+            // hashing and describing.
+            brpc::SocketOptions options;
+            butil::ip_t ip;
+            butil::str2ip("10.0.0.0", &ip);
+            options.remote_side = butil::EndPoint(
+                butil::int2ip(butil::ip2int(ip) + b->index + 1), 8000);
+            if (brpc::Socket::Create(options, &b->server_id.id) != 0) {
+                LOG(ERROR) << "Fail to create socket";
+                return -1;
+            }
+            backends->push_back(b);
+        }
+    }
+    if (backends->empty()) {
+        LOG(ERROR) << "-backends is empty";
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_events(size_t nbackend, std::vector<Event>* events) {
+    for (butil::StringSplitter sp(FLAGS_events.c_str(), ';'); sp; ++sp) {
+        butil::StringPiece s(sp.field(), sp.length());
+        butil::StringPiece fields[3];
+        std::map<std::string, double> kv;
+        Event e;
+        if (split_fields(s, 3, fields) != 3 ||
+            !butil::StringToInt(fields[0], &e.second) ||
+            !butil::StringToInt(fields[1], &e.backend) ||
+            e.backend < 0 || (size_t)e.backend >= nbackend ||
+            !parse_key_values(fields[2], &kv)) {
+            LOG(ERROR) << "Invalid event `" << s << "'";
+            return -1;
+        }
+        e.latency_x = (kv.count("latency_x") ? kv["latency_x"] : 0);
+        e.fail = (kv.count("fail") ? kv["fail"] : -1);
+        events->push_back(e);
+    }
+    return 0;
+}
+
+} // namespace lb_sim
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_concurrency <= 0 || FLAGS_duration_s <= 0) {
+        LOG(ERROR) << "-concurrency and -duration_s must be positive";
+        return -1;
+    }
+    // Register builtin load balancers.
+    brpc::GlobalInitializeOrDie();
+
+    std::vector<lb_sim::Backend*> backends;
+    std::vector<lb_sim::Event> events;
+    if (lb_sim::create_backends(&backends) != 0 ||
+        lb_sim::parse_events(backends.size(), &events) != 0) {
+        return -1;
+    }
+    for (butil::StringSplitter sp(FLAGS_lb.c_str(), ','); sp; ++sp) {
+        if (lb_sim::simulate(std::string(sp.field(), sp.length()),
+                             backends, events) != 0) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < backends.size(); ++i) {
+        brpc::Socket::SetFailed(backends[i]->server_id.id);
+        delete backends[i];
+    }
+    return 0;
+}
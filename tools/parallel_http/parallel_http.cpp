@@ -19,9 +19,14 @@
 // Access many http servers in parallel, much faster than curl (even called in batch)
 
 #include <gflags/gflags.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <algorithm>
 #include <deque>
 #include <bthread/bthread.h>
 #include <butil/logging.h>
+#include <butil/time.h>
+#include <butil/string_printf.h>
 #include <butil/files/scoped_file.h>
 #include <brpc/channel.h>
 
@@ -33,6 +38,48 @@ DEFINE_int32(thread_num, 8, "Number of threads to access urls");
 DEFINE_int32(concurrency, 1000, "Max number of http calls in parallel");
 DEFINE_bool(one_line_mode, false, "Output as `URL HTTP-RESPONSE' on true");
 DEFINE_bool(only_show_host, false, "Print host name only");
+DEFINE_string(protocol, "http", "http or h2. h2 multiplexes concurrent "
+              "requests to a host as streams over one connection");
+DEFINE_bool(pipelining, false, "Pipeline HTTP/1.1 requests to a host over "
+            "one connection, see -http_client_pipelining");
+DEFINE_int32(duration_s, 0, "If this flag is positive, keep sending requests "
+             "to all urls for so many seconds and report latencies and "
+             "throughputs instead of printing responses");
+DEFINE_int32(connections_per_url, 1, "[-duration_s] Number of connections "
+             "to each url");
+DEFINE_int32(streams_per_connection, 16, "[-duration_s] Number of "
+             "concurrent requests over each connection. Without h2 or "
+             "-pipelining, concurrent requests use different pooled "
+             "connections");
+
+// Connections are shared by requests when the protocol multiplexes or
+// pipelines requests.
+static bool use_single_connection() {
+    return FLAGS_protocol == "h2" || FLAGS_pipelining;
+}
+
+static int init_channel_options(brpc::ChannelOptions* options) {
+    if (FLAGS_protocol == "h2") {
+        options->protocol = brpc::PROTOCOL_H2;
+    } else if (FLAGS_protocol == "http") {
+        options->protocol = brpc::PROTOCOL_HTTP;
+    } else {
+        LOG(ERROR) << "Unknown -protocol=" << FLAGS_protocol;
+        return -1;
+    }
+    if (FLAGS_pipelining) {
+        if (FLAGS_protocol != "http") {
+            LOG(ERROR) << "-pipelining only works with -protocol=http";
+            return -1;
+        }
+        GFLAGS_NS::SetCommandLineOption("http_client_pipelining", "true");
+    }
+    options->connection_type = (use_single_connection() ? "single" : "pooled");
+    options->connect_timeout_ms = FLAGS_timeout_ms / 2;
+    options->timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
+    options->max_retry = FLAGS_max_retry;
+    return 0;
+}
 
 struct AccessThreadArgs {
     const std::deque<std::string>* url_list;
@@ -68,10 +115,7 @@ void OnHttpCallEnd::Run() {
 void* access_thread(void* void_args) {
     AccessThreadArgs* args = (AccessThreadArgs*)void_args;
     brpc::ChannelOptions options;
-    options.protocol = brpc::PROTOCOL_HTTP;
-    options.connect_timeout_ms = FLAGS_timeout_ms / 2;
-    options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
-    options.max_retry = FLAGS_max_retry;
+    init_channel_options(&options);
     const int concurrency_for_this_thread = FLAGS_concurrency / FLAGS_thread_num;
 
     for (size_t i = args->offset; i < args->url_list->size(); i += FLAGS_thread_num) {
@@ -97,6 +141,139 @@ void* access_thread(void* void_args) {
     return NULL;
 }
 
+// ====== -duration_s mode ======
+
+struct ConnectionStats {
+    std::string url;
+    int index;
+    int64_t nrequest;
+    int64_t nerror;
+    int64_t nbytes;
+};
+
+struct StreamArgs {
+    brpc::Channel* channel;
+    const std::string* url;
+    const butil::atomic<bool>* stopped;
+    int64_t nrequest;
+    int64_t nerror;
+    int64_t nbytes;
+    std::vector<int64_t> latencies;
+};
+
+static void* stream_thread(void* void_args) {
+    StreamArgs* args = (StreamArgs*)void_args;
+    while (!args->stopped->load(butil::memory_order_relaxed)) {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = *args->url;
+        args->channel->CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        if (cntl.Failed()) {
+            ++args->nerror;
+            // Don't spin on unreachable servers.
+            bthread_usleep(10000);
+            continue;
+        }
+        ++args->nrequest;
+        args->nbytes += cntl.response_attachment().size();
+        args->latencies.push_back(cntl.latency_us());
+    }
+    return NULL;
+}
+
+static int64_t percentile(const std::vector<int64_t>& sorted, double ratio) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, (size_t)(ratio * sorted.size()))];
+}
+
+static int run_load_test(const std::deque<std::string>& url_list) {
+    brpc::ChannelOptions options;
+    if (init_channel_options(&options) != 0) {
+        return -1;
+    }
+    const int nstream = std::max(FLAGS_streams_per_connection, 1);
+    const int nconn = std::max(FLAGS_connections_per_url, 1);
+    butil::atomic<bool> stopped(false);
+    std::vector<brpc::Channel*> channels;
+    std::vector<ConnectionStats> conns;
+    std::deque<StreamArgs> streams;
+    for (size_t i = 0; i < url_list.size(); ++i) {
+        for (int j = 0; j < nconn; ++j) {
+            // Channels of different groups don't share connections.
+            options.connection_group = butil::string_printf("parallel_http_%d", j);
+            brpc::Channel* channel = new brpc::Channel;
+            if (channel->Init(url_list[i].c_str(), &options) != 0) {
+                LOG(ERROR) << "Fail to create channel to url=" << url_list[i];
+                delete channel;
+                continue;
+            }
+            channels.push_back(channel);
+            ConnectionStats cs = { url_list[i], j, 0, 0, 0 };
+            conns.push_back(cs);
+            for (int k = 0; k < nstream; ++k) {
+                StreamArgs sa;
+                sa.channel = channel;
+                sa.url = &url_list[i];
+                sa.stopped = &stopped;
+                sa.nrequest = 0;
+                sa.nerror = 0;
+                sa.nbytes = 0;
+                streams.push_back(sa);
+            }
+        }
+    }
+    std::vector<bthread_t> tids(streams.size());
+    const int64_t start_us = butil::gettimeofday_us();
+    for (size_t i = 0; i < streams.size(); ++i) {
+        CHECK_EQ(0, bthread_start_background(&tids[i], NULL, stream_thread,
+                                             &streams[i]));
+    }
+    bthread_usleep(FLAGS_duration_s * 1000000L);
+    stopped.store(true, butil::memory_order_relaxed);
+    std::vector<int64_t> latencies;
+    for (size_t i = 0; i < streams.size(); ++i) {
+        bthread_join(tids[i], NULL);
+        ConnectionStats& cs = conns[i / nstream];
+        cs.nrequest += streams[i].nrequest;
+        cs.nerror += streams[i].nerror;
+        cs.nbytes += streams[i].nbytes;
+        latencies.insert(latencies.end(), streams[i].latencies.begin(),
+                         streams[i].latencies.end());
+    }
+    const double elapsed_s = (butil::gettimeofday_us() - start_us) / 1000000.0;
+    for (size_t i = 0; i < channels.size(); ++i) {
+        delete channels[i];
+    }
+
+    std::cout << "protocol=" << FLAGS_protocol
+              << (FLAGS_pipelining ? " (pipelined)" : "")
+              << " connections_per_url=" << nconn
+              << " streams_per_connection=" << nstream << '\n';
+    printf("%-40s %4s %10s %10s %8s %10s\n",
+           "url", "conn", "requests", "qps", "errors", "MB/s");
+    int64_t nrequest = 0;
+    int64_t nerror = 0;
+    for (size_t i = 0; i < conns.size(); ++i) {
+        const ConnectionStats& cs = conns[i];
+        printf("%-40s %4d %10" PRId64 " %10.0f %8" PRId64 " %10.2f\n",
+               cs.url.c_str(), cs.index, cs.nrequest,
+               cs.nrequest / elapsed_s, cs.nerror,
+               cs.nbytes / elapsed_s / 1048576);
+        nrequest += cs.nrequest;
+        nerror += cs.nerror;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    printf("total: requests=%" PRId64 " qps=%.0f errors=%" PRId64 "\n",
+           nrequest, nrequest / elapsed_s, nerror);
+    printf("latency_us: p50=%" PRId64 " p90=%" PRId64 " p99=%" PRId64
+           " p999=%" PRId64 " max=%" PRId64 "\n",
+           percentile(latencies, 0.5), percentile(latencies, 0.9),
+           percentile(latencies, 0.99), percentile(latencies, 0.999),
+           latencies.empty() ? (int64_t)0 : latencies.back());
+    return 0;
+}
+
 int main(int argc, char** argv) {
     // Parse gflags. We recommend you to use gflags as well.
     GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
@@ -135,6 +312,9 @@ int main(int argc, char** argv) {
     if (url_list.empty()) {
         return 0;
     }
+    if (FLAGS_duration_s > 0) {
+        return run_load_test(url_list);
+    }
     AccessThreadArgs* args = new AccessThreadArgs[FLAGS_thread_num];
     for (int i = 0; i < FLAGS_thread_num; ++i) {
         args[i].url_list = &url_list;
@@ -0,0 +1,587 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// Run echo benchmarks over a matrix of protocol x connection type x payload
+// size x concurrency, and report QPS, CPU per request and latency
+// percentiles of each combination.
+//   - In one process over loopback:  ./rpc_bench
+//   - Between two hosts:  ./rpc_bench -role=server          (on host A)
+//                         ./rpc_bench -role=client -server=A:8010 (on host B)
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <sstream>
+#include <gflags/gflags.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <butil/macros.h>
+#include <butil/string_splitter.h>
+#include <butil/string_printf.h>
+#include <butil/files/file_path.h>
+#include <butil/file_util.h>
+#include <bvar/bvar.h>
+#include <bthread/bthread.h>
+#include <bthread/condition_variable.h>
+#include <brpc/channel.h>
+#include <brpc/server.h>
+#include <brpc/stream.h>
+#include "bench.pb.h"
+
+DEFINE_string(role, "both", "server: only serve; client: only run the "
+              "benchmarks against -server; both: serve on -port and run "
+              "the benchmarks against it over loopback");
+DEFINE_int32(port, 8010, "Port of the server");
+DEFINE_string(server, "", "Address of the server, 127.0.0.1:<port> by "
+              "default");
+DEFINE_string(protocols, "baidu_std,h2:grpc,http,streaming", "Protocols to "
+              "benchmark, separated by comma. `streaming' echoes messages "
+              "over streaming rpc, others call BenchService.Echo");
+DEFINE_string(connection_types, "single,pooled,short", "Connection types to "
+              "benchmark, separated by comma. Combinations not supported by "
+              "a protocol are skipped");
+DEFINE_string(payload_sizes, "16,1024,16384,262144", "Sizes of payloads in "
+              "bytes, separated by comma");
+DEFINE_string(concurrencies, "1,16,128", "Numbers of concurrent callers, "
+              "separated by comma");
+DEFINE_int32(warmup_s, 1, "Run each combination for so many seconds "
+             "before measuring");
+DEFINE_int32(duration_s, 5, "Measure each combination for so many seconds");
+DEFINE_int32(timeout_ms, 1000, "RPC timeout in milliseconds");
+DEFINE_string(output, "", "Write results as json array into this file "
+              "besides printing them");
+
+namespace rpc_bench {
+
+static int64_t process_cpu_us() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return butil::timeval_to_microseconds(usage.ru_utime) +
+        butil::timeval_to_microseconds(usage.ru_stime);
+}
+
+// ====== server side ======
+
+static bvar::Adder<int64_t> g_server_nrequest("rpc_bench_server_request_count");
+
+class EchoStreamHandler : public brpc::StreamInputHandler {
+public:
+    int on_received_messages(brpc::StreamId id,
+                             butil::IOBuf *const messages[],
+                             size_t size) override {
+        for (size_t i = 0; i < size; ++i) {
+            if (brpc::StreamWrite(id, *messages[i]) == EAGAIN) {
+                if (brpc::StreamWait(id, NULL) == 0) {
+                    brpc::StreamWrite(id, *messages[i]);
+                }
+            }
+        }
+        g_server_nrequest << size;
+        return 0;
+    }
+    void on_idle_timeout(brpc::StreamId) override {}
+    void on_closed(brpc::StreamId) override {}
+};
+
+class BenchServiceImpl : public BenchService {
+public:
+    void Echo(google::protobuf::RpcController*,
+              const EchoRequest* request,
+              EchoResponse* response,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        response->set_payload(request->payload());
+        g_server_nrequest << 1;
+    }
+
+    void OpenStream(google::protobuf::RpcController* cntl_base,
+                    const EchoRequest*,
+                    EchoResponse*,
+                    google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        brpc::StreamOptions options;
+        options.handler = &_stream_handler;
+        brpc::StreamId sd;
+        if (brpc::StreamAccept(&sd, *cntl, &options) != 0) {
+            cntl->SetFailed("Fail to accept stream");
+        }
+    }
+
+    void Stats(google::protobuf::RpcController*,
+               const StatsRequest*,
+               StatsResponse* response,
+               google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        response->set_cpu_us(process_cpu_us());
+        response->set_nrequest(g_server_nrequest.get_value());
+    }
+
+private:
+    EchoStreamHandler _stream_handler;
+};
+
+// ====== client side ======
+
+struct Case {
+    std::string protocol;
+    std::string connection_type;
+    int payload_size;
+    int concurrency;
+};
+
+struct Result {
+    Case c;
+    bool skipped;
+    std::string skip_reason;
+    int64_t nrequest;
+    int64_t nerror;
+    double qps;
+    // CPU per request. In -role=both, client and server share the process
+    // and only `client_cpu_us' (of the whole process) is reported.
+    double client_cpu_us;
+    double server_cpu_us;
+    int64_t latency_us[5];  // avg, p50, p99, p999, max
+};
+
+static const double PERCENTILES[] = { 0.5, 0.99, 0.999 };
+
+struct CallerContext {
+    const Case* c;
+    brpc::Channel* channel;
+    const std::string* payload;
+    butil::atomic<bool>* measuring;
+    butil::atomic<bool>* stopped;
+    // Filled by the caller
+    std::vector<int64_t> latencies;
+    int64_t nerror;
+};
+
+static void* unary_caller(void* arg) {
+    CallerContext* ctx = static_cast<CallerContext*>(arg);
+    BenchService_Stub stub(ctx->channel);
+    EchoRequest request;
+    request.set_payload(*ctx->payload);
+    const bool is_http = (ctx->c->protocol == "http");
+    while (!ctx->stopped->load(butil::memory_order_relaxed)) {
+        brpc::Controller cntl;
+        if (is_http) {
+            // Don't measure pb<->json conversions.
+            cntl.http_request().set_content_type("application/proto");
+        }
+        EchoResponse response;
+        const int64_t start_us = butil::cpuwide_time_us();
+        stub.Echo(&cntl, &request, &response, NULL);
+        const int64_t latency_us = butil::cpuwide_time_us() - start_us;
+        const bool measuring = ctx->measuring->load(butil::memory_order_relaxed);
+        if (cntl.Failed()) {
+            ctx->nerror += measuring;
+            // Don't spin when the server is unreachable.
+            bthread_usleep(10000);
+        } else if (measuring) {
+            ctx->latencies.push_back(latency_us);
+        }
+    }
+    return NULL;
+}
+
+// Counts echoed messages of a stream.
+class StreamWaiter : public brpc::StreamInputHandler {
+public:
+    StreamWaiter() : _nreceived(0), _closed(false) {}
+
+    int on_received_messages(brpc::StreamId,
+                             butil::IOBuf *const[],
+                             size_t size) override {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        _nreceived += size;
+        _cond.notify_one();
+        return 0;
+    }
+    void on_idle_timeout(brpc::StreamId) override {}
+    void on_closed(brpc::StreamId) override {
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        _closed = true;
+        _cond.notify_one();
+    }
+
+    // Wait until `n' messages are received in total. Returns false on
+    // timeout or when the stream is closed.
+    bool wait(int64_t n, int64_t timeout_us) {
+        const int64_t deadline_us = butil::gettimeofday_us() + timeout_us;
+        std::unique_lock<bthread::Mutex> mu(_mutex);
+        while (_nreceived < n && !_closed) {
+            const int64_t left_us = deadline_us - butil::gettimeofday_us();
+            if (left_us <= 0 || _cond.wait_for(mu, left_us) == ETIMEDOUT) {
+                break;
+            }
+        }
+        return _nreceived >= n;
+    }
+
+private:
+    bthread::Mutex _mutex;
+    bthread::ConditionVariable _cond;
+    int64_t _nreceived;
+    bool _closed;
+};
+
+static void* stream_caller(void* arg) {
+    CallerContext* ctx = static_cast<CallerContext*>(arg);
+    StreamWaiter waiter;
+    brpc::StreamOptions options;
+    options.handler = &waiter;
+    brpc::StreamId sd;
+    brpc::Controller cntl;
+    if (brpc::StreamCreate(&sd, cntl, &options) != 0) {
+        LOG(ERROR) << "Fail to create stream";
+        ++ctx->nerror;
+        return NULL;
+    }
+    BenchService_Stub stub(ctx->channel);
+    EchoRequest request;
+    EchoResponse response;
+    stub.OpenStream(&cntl, &request, &response, NULL);
+    if (cntl.Failed()) {
+        LOG(ERROR) << "Fail to open stream: " << cntl.ErrorText();
+        ++ctx->nerror;
+        brpc::StreamClose(sd);
+        return NULL;
+    }
+    butil::IOBuf payload;
+    payload.append(*ctx->payload);
+    int64_t nsent = 0;
+    while (!ctx->stopped->load(butil::memory_order_relaxed)) {
+        const int64_t start_us = butil::cpuwide_time_us();
+        int rc = brpc::StreamWrite(sd, payload);
+        while (rc == EAGAIN) {
+            if (brpc::StreamWait(sd, NULL) != 0) {
+                break;
+            }
+            rc = brpc::StreamWrite(sd, payload);
+        }
+        if (rc != 0 ||
+            !waiter.wait(++nsent, FLAGS_timeout_ms * 1000L)) {
+            ++ctx->nerror;
+            break;
+        }
+        const int64_t latency_us = butil::cpuwide_time_us() - start_us;
+        if (ctx->measuring->load(butil::memory_order_relaxed)) {
+            ctx->latencies.push_back(latency_us);
+        }
+    }
+    brpc::StreamClose(sd);
+    // Wait for on_closed so that `waiter' is not referenced after return.
+    waiter.wait(INT64_MAX, FLAGS_timeout_ms * 1000L);
+    return NULL;
+}
+
+static bool get_server_stats(brpc::Channel* stats_channel, StatsResponse* res) {
+    brpc::Controller cntl;
+    StatsRequest req;
+    BenchService_Stub(stats_channel).Stats(&cntl, &req, res, NULL);
+    if (cntl.Failed()) {
+        LOG(WARNING) << "Fail to get stats of server: " << cntl.ErrorText();
+        return false;
+    }
+    return true;
+}
+
+static void run_case(const Case& c, const std::string& server,
+                     brpc::Channel* stats_channel, Result* r) {
+    r->c = c;
+    r->skipped = false;
+    r->nrequest = 0;
+    r->nerror = 0;
+    r->qps = 0;
+    r->client_cpu_us = 0;
+    r->server_cpu_us = -1;
+    memset(r->latency_us, 0, sizeof(r->latency_us));
+
+    const bool streaming = (c.protocol == "streaming");
+    if (streaming && c.connection_type != "single") {
+        // All streams are multiplexed on the connection of the creating RPC.
+        r->skipped = true;
+        r->skip_reason = "streams are always over single connection";
+        return;
+    }
+    brpc::ChannelOptions options;
+    options.protocol = (streaming ? "baidu_std" : c.protocol);
+    options.connection_type = c.connection_type;
+    options.timeout_ms = FLAGS_timeout_ms;
+    options.max_retry = 0;
+    brpc::Channel channel;
+    if (channel.Init(server.c_str(), &options) != 0) {
+        r->skipped = true;
+        r->skip_reason = "channel does not support this combination";
+        return;
+    }
+
+    const std::string payload(c.payload_size, 'x');
+    butil::atomic<bool> measuring(false);
+    butil::atomic<bool> stopped(false);
+    std::vector<CallerContext> ctxs(c.concurrency);
+    std::vector<bthread_t> tids(c.concurrency);
+    for (int i = 0; i < c.concurrency; ++i) {
+        CallerContext& ctx = ctxs[i];
+        ctx.c = &c;
+        ctx.channel = &channel;
+        ctx.payload = &payload;
+        ctx.measuring = &measuring;
+        ctx.stopped = &stopped;
+        ctx.nerror = 0;
+        if (bthread_start_background(&tids[i], NULL,
+                                     streaming ? stream_caller : unary_caller,
+                                     &ctx) != 0) {
+            LOG(FATAL) << "Fail to create bthread";
+            return;
+        }
+    }
+    bthread_usleep(FLAGS_warmup_s * 1000000L);
+
+    StatsResponse server_begin;
+    const bool has_server_stats = (FLAGS_role == "client") &&
+        get_server_stats(stats_channel, &server_begin);
+    const int64_t cpu_begin = process_cpu_us();
+    const int64_t start_us = butil::gettimeofday_us();
+    measuring.store(true, butil::memory_order_relaxed);
+    bthread_usleep(FLAGS_duration_s * 1000000L);
+    measuring.store(false, butil::memory_order_relaxed);
+    const int64_t elapsed_us = butil::gettimeofday_us() - start_us;
+    const int64_t cpu_end = process_cpu_us();
+    StatsResponse server_end;
+    const bool has_server_end = has_server_stats &&
+        get_server_stats(stats_channel, &server_end);
+
+    stopped.store(true, butil::memory_order_relaxed);
+    for (int i = 0; i < c.concurrency; ++i) {
+        bthread_join(tids[i], NULL);
+    }
+
+    std::vector<int64_t> latencies;
+    for (size_t i = 0; i < ctxs.size(); ++i) {
+        latencies.insert(latencies.end(), ctxs[i].latencies.begin(),
+                         ctxs[i].latencies.end());
+        r->nerror += ctxs[i].nerror;
+    }
+    r->nrequest = latencies.size();
+    if (latencies.empty()) {
+        return;
+    }
+    r->qps = r->nrequest * 1000000.0 / elapsed_us;
+    r->client_cpu_us = (cpu_end - cpu_begin) / (double)r->nrequest;
+    if (has_server_end) {
+        const int64_t n = server_end.nrequest() - server_begin.nrequest();
+        if (n > 0) {
+            r->server_cpu_us =
+                (server_end.cpu_us() - server_begin.cpu_us()) / (double)n;
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+    int64_t sum = 0;
+    for (size_t i = 0; i < latencies.size(); ++i) {
+        sum += latencies[i];
+    }
+    r->latency_us[0] = sum / (int64_t)latencies.size();
+    for (size_t i = 0; i < arraysize(PERCENTILES); ++i) {
+        const size_t index = std::min(latencies.size() - 1,
+            (size_t)(PERCENTILES[i] * latencies.size()));
+        r->latency_us[i + 1] = latencies[index];
+    }
+    r->latency_us[4] = latencies.back();
+}
+
+static void print_header() {
+    printf("%-10s %-7s %8s %5s %10s %8s %12s %12s %8s %8s %8s %8s %8s\n",
+           "protocol", "conn", "payload", "conc", "qps", "error",
+           "cli_cpu_us", "srv_cpu_us", "avg_us", "p50_us", "p99_us",
+           "p999_us", "max_us");
+}
+
+static void print_result(const Result& r) {
+    if (r.skipped) {
+        printf("%-10s %-7s %8d %5d skipped: %s\n", r.c.protocol.c_str(),
+               r.c.connection_type.c_str(), r.c.payload_size,
+               r.c.concurrency, r.skip_reason.c_str());
+    } else {
+        printf("%-10s %-7s %8d %5d %10.0f %8" PRId64 " %12.2f %12.2f"
+               " %8" PRId64 " %8" PRId64 " %8" PRId64 " %8" PRId64
+               " %8" PRId64 "\n",
+               r.c.protocol.c_str(), r.c.connection_type.c_str(),
+               r.c.payload_size, r.c.concurrency, r.qps, r.nerror,
+               r.client_cpu_us, r.server_cpu_us, r.latency_us[0],
+               r.latency_us[1], r.latency_us[2], r.latency_us[3],
+               r.latency_us[4]);
+    }
+    fflush(stdout);
+}
+
+static std::string results_to_json(const std::vector<Result>& results) {
+    std::ostringstream os;
+    os << "[\n";
+    bool first = true;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        if (r.skipped) {
+            continue;
+        }
+        if (!first) {
+            os << ",\n";
+        }
+        first = false;
+        os << "  {\"protocol\":\"" << r.c.protocol
+           << "\",\"connection_type\":\"" << r.c.connection_type
+           << "\",\"payload_size\":" << r.c.payload_size
+           << ",\"concurrency\":" << r.c.concurrency
+           << ",\"role\":\"" << FLAGS_role
+           << "\",\"requests\":" << r.nrequest
+           << ",\"errors\":" << r.nerror
+           << ",\"qps\":" << (int64_t)r.qps
+           << ",\"client_cpu_us_per_request\":" << r.client_cpu_us;
+        if (r.server_cpu_us >= 0) {
+            os << ",\"server_cpu_us_per_request\":" << r.server_cpu_us;
+        }
+        os << ",\"latency_avg_us\":" << r.latency_us[0]
+           << ",\"latency_p50_us\":" << r.latency_us[1]
+           << ",\"latency_p99_us\":" << r.latency_us[2]
+           << ",\"latency_p999_us\":" << r.latency_us[3]
+           << ",\"latency_max_us\":" << r.latency_us[4] << "}";
+    }
+    os << "\n]\n";
+    return os.str();
+}
+
+static bool parse_list(const char* flag_name, const std::string& value,
+                       std::vector<std::string>* out) {
+    for (butil::StringSplitter sp(value.c_str(), ','); sp; ++sp) {
+        std::string item(sp.field(), sp.length());
+        if (!item.empty()) {
+            out->push_back(item);
+        }
+    }
+    if (out->empty()) {
+        LOG(ERROR) << "-" << flag_name << " is empty";
+        return false;
+    }
+    return true;
+}
+
+static bool parse_list(const char* flag_name, const std::string& value,
+                       std::vector<int>* out) {
+    std::vector<std::string> items;
+    if (!parse_list(flag_name, value, &items)) {
+        return false;
+    }
+    for (size_t i = 0; i < items.size(); ++i) {
+        char* endptr = NULL;
+        const long v = strtol(items[i].c_str(), &endptr, 10);
+        if (*endptr != '\0' || v <= 0) {
+            LOG(ERROR) << "Invalid item `" << items[i] << "' in -"
+                       << flag_name;
+            return false;
+        }
+        out->push_back((int)v);
+    }
+    return true;
+}
+
+static int run_benchmarks(const std::string& server) {
+    std::vector<std::string> protocols;
+    std::vector<std::string> connection_types;
+    std::vector<int> payload_sizes;
+    std::vector<int> concurrencies;
+    if (!parse_list("protocols", FLAGS_protocols, &protocols) ||
+        !parse_list("connection_types", FLAGS_connection_types,
+                    &connection_types) ||
+        !parse_list("payload_sizes", FLAGS_payload_sizes, &payload_sizes) ||
+        !parse_list("concurrencies", FLAGS_concurrencies, &concurrencies)) {
+        return -1;
+    }
+    brpc::Channel stats_channel;
+    if (stats_channel.Init(server.c_str(), NULL) != 0) {
+        LOG(ERROR) << "Fail to init channel to " << server;
+        return -1;
+    }
+
+    std::vector<Result> results;
+    print_header();
+    for (size_t i = 0; i < protocols.size(); ++i) {
+        for (size_t j = 0; j < connection_types.size(); ++j) {
+            for (size_t k = 0; k < payload_sizes.size(); ++k) {
+                for (size_t l = 0; l < concurrencies.size(); ++l) {
+                    Case c;
+                    c.protocol = protocols[i];
+                    c.connection_type = connection_types[j];
+                    c.payload_size = payload_sizes[k];
+                    c.concurrency = concurrencies[l];
+                    results.push_back(Result());
+                    run_case(c, server, &stats_channel, &results.back());
+                    print_result(results.back());
+                }
+            }
+        }
+    }
+    if (!FLAGS_output.empty()) {
+        const std::string json = results_to_json(results);
+        if (butil::WriteFile(butil::FilePath(FLAGS_output), json.data(),
+                             json.size()) != (int)json.size()) {
+            PLOG(ERROR) << "Fail to write " << FLAGS_output;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+} // namespace rpc_bench
+
+int main(int argc, char* argv[]) {
+    GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
+
+    if (FLAGS_role != "server" && FLAGS_role != "client" &&
+        FLAGS_role != "both") {
+        LOG(ERROR) << "Unknown -role=" << FLAGS_role;
+        return -1;
+    }
+    rpc_bench::BenchServiceImpl service;
+    brpc::Server server;
+    if (FLAGS_role != "client") {
+        if (server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
+            LOG(ERROR) << "Fail to add service";
+            return -1;
+        }
+        if (server.Start(FLAGS_port, NULL) != 0) {
+            LOG(ERROR) << "Fail to start server on port=" << FLAGS_port;
+            return -1;
+        }
+    }
+    if (FLAGS_role == "server") {
+        server.RunUntilAskedToQuit();
+        return 0;
+    }
+    std::string server_addr = FLAGS_server;
+    if (server_addr.empty()) {
+        server_addr = butil::string_printf("127.0.0.1:%d", FLAGS_port);
+    }
+    const int rc = rpc_bench::run_benchmarks(server_addr);
+    server.Stop(0);
+    server.Join();
+    return rc;
+}
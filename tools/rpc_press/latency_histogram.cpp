@@ -0,0 +1,103 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "latency_histogram.h"
+
+namespace pbrpcframework {
+
+LatencyHistogram::LatencyHistogram() : _sum(0), _max(0) {
+    for (int i = 0; i < NBUCKET; ++i) {
+        _buckets[i].store(0, butil::memory_order_relaxed);
+    }
+}
+
+int LatencyHistogram::bucket_of(int64_t value) {
+    if (value < 128) {
+        return value < 0 ? 0 : (int)value;
+    }
+    const int highest_bit = 63 - __builtin_clzll((uint64_t)value);
+    const int shift = highest_bit - SUB_BUCKET_BITS;
+    const int sub_bucket = (int)(value >> shift) - (1 << SUB_BUCKET_BITS);
+    return 128 + (highest_bit - 7) * (1 << SUB_BUCKET_BITS) + sub_bucket;
+}
+
+int64_t LatencyHistogram::value_of(int index) {
+    if (index < 128) {
+        return index;
+    }
+    const int highest_bit = (index - 128) / (1 << SUB_BUCKET_BITS) + 7;
+    const int sub_bucket = (index - 128) % (1 << SUB_BUCKET_BITS);
+    const int shift = highest_bit - SUB_BUCKET_BITS;
+    return ((int64_t)(sub_bucket + (1 << SUB_BUCKET_BITS) + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(int64_t latency_us) {
+    if (latency_us < 0) {
+        latency_us = 0;
+    }
+    _buckets[bucket_of(latency_us)].fetch_add(1, butil::memory_order_relaxed);
+    _sum.fetch_add(latency_us, butil::memory_order_relaxed);
+    int64_t cur_max = _max.load(butil::memory_order_relaxed);
+    while (latency_us > cur_max &&
+           !_max.compare_exchange_weak(cur_max, latency_us,
+                                       butil::memory_order_relaxed)) {}
+}
+
+int64_t LatencyHistogram::count() const {
+    int64_t n = 0;
+    for (int i = 0; i < NBUCKET; ++i) {
+        n += _buckets[i].load(butil::memory_order_relaxed);
+    }
+    return n;
+}
+
+int64_t LatencyHistogram::mean() const {
+    const int64_t n = count();
+    return n ? _sum.load(butil::memory_order_relaxed) / n : 0;
+}
+
+int64_t LatencyHistogram::percentile(double ratio) const {
+    const int64_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    int64_t rank = (int64_t)(ratio * n + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    int64_t seen = 0;
+    for (int i = 0; i < NBUCKET; ++i) {
+        seen += _buckets[i].load(butil::memory_order_relaxed);
+        if (seen >= rank) {
+            // The bucket may cover values above the real max.
+            const int64_t v = value_of(i);
+            return v < max() ? v : max();
+        }
+    }
+    return max();
+}
+
+void LatencyHistogram::describe(const char* name, FILE* fp) const {
+    fprintf(fp, "%s count=%lld avg=%lld 50%%=%lld 90%%=%lld 99%%=%lld"
+            " 99.9%%=%lld 99.99%%=%lld max=%lld (us)\n",
+            name, (long long)count(), (long long)mean(),
+            (long long)percentile(0.5), (long long)percentile(0.9),
+            (long long)percentile(0.99), (long long)percentile(0.999),
+            (long long)percentile(0.9999), (long long)max());
+}
+
+} // namespace pbrpcframework
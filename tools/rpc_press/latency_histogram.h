@@ -0,0 +1,68 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef PBRPCPRESS_LATENCY_HISTOGRAM_H
+#define PBRPCPRESS_LATENCY_HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <butil/atomicops.h>
+#include <butil/macros.h>
+
+namespace pbrpcframework {
+
+// Records all latencies without sampling in log-linear buckets whose
+// relative error is less than 1/64, like HdrHistogram with 2 significant
+// digits. Unlike bvar::LatencyRecorder, percentiles are computed over
+// the whole run rather than recent samples, so rare outliers are kept.
+// Thread-safe.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void record(int64_t latency_us);
+
+    int64_t count() const;
+    int64_t max() const { return _max.load(butil::memory_order_relaxed); }
+    // Mean of all recorded latencies.
+    int64_t mean() const;
+    // Latency that `ratio' of all recorded latencies are not greater than.
+    int64_t percentile(double ratio) const;
+
+    // Print count, mean, percentiles and max in one line.
+    void describe(const char* name, FILE* fp) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LatencyHistogram);
+
+    // Values less than 128 have their own buckets, others are grouped by
+    // the highest bit and 6 bits below it.
+    static const int SUB_BUCKET_BITS = 6;
+    static const int NBUCKET = 128 + (64 - 7) * (1 << SUB_BUCKET_BITS);
+
+    static int bucket_of(int64_t value);
+    // Highest value that falls into bucket `index'.
+    static int64_t value_of(int index);
+
+    butil::atomic<int64_t> _buckets[NBUCKET];
+    butil::atomic<int64_t> _sum;
+    butil::atomic<int64_t> _max;
+};
+
+} // namespace pbrpcframework
+
+#endif // PBRPCPRESS_LATENCY_HISTOGRAM_H
@@ -44,6 +44,30 @@ DEFINE_int32(attachment_size, 0, "Carry so many byte attachment along with reque
 DEFINE_int32(duration, 0, "how many seconds the press keep");
 DEFINE_int32(qps, 100 , "how many calls  per seconds");
 DEFINE_bool(pretty, true, "output pretty jsons");
+DEFINE_bool(open_loop, false, "Send requests at intended times regardless of"
+            " pending responses and measure latencies from the intended times,"
+            " which is not affected by coordinated omission");
+DEFINE_string(arrival, "uniform", "Intervals between requests of -open_loop:"
+              " uniform or poisson");
+DEFINE_string(qps_schedule, "", "Ramp the load of -open_loop in steps, in form"
+              " of qps1:seconds1,qps2:seconds2,... -qps and -duration are"
+              " ignored when this is set");
+
+static bool parse_qps_schedule(const std::string& str,
+                               std::vector<pbrpcframework::QpsStep>* steps) {
+    for (butil::StringSplitter sp(str.c_str(), ','); sp; ++sp) {
+        const std::string item(sp.field(), sp.length());
+        pbrpcframework::QpsStep step;
+        char extra;
+        if (sscanf(item.c_str(), "%lf:%d%c", &step.qps, &step.duration_s,
+                   &extra) != 2 || step.qps <= 0 || step.duration_s <= 0) {
+            LOG(ERROR) << "Invalid step=`" << item << "' in -qps_schedule";
+            return false;
+        }
+        steps->push_back(step);
+    }
+    return true;
+}
 
 bool set_press_options(pbrpcframework::PressOptions* options){
     size_t dot_pos = FLAGS_method.find_last_of('.');
@@ -55,13 +79,40 @@ bool set_press_options(pbrpcframework::PressOptions* options){
     options->method = FLAGS_method.substr(dot_pos + 1);
     options->lb_policy = FLAGS_lb_policy;
     options->test_req_rate = FLAGS_qps;
+    options->open_loop = FLAGS_open_loop;
+    if (FLAGS_arrival == "poisson") {
+        options->poisson_arrival = true;
+    } else if (FLAGS_arrival != "uniform") {
+        LOG(ERROR) << "-arrival must be uniform or poisson";
+        return false;
+    }
+    if (!FLAGS_qps_schedule.empty()) {
+        if (!FLAGS_open_loop) {
+            LOG(ERROR) << "-qps_schedule requires -open_loop";
+            return false;
+        }
+        if (!parse_qps_schedule(FLAGS_qps_schedule, &options->qps_schedule)) {
+            return false;
+        }
+    }
+    if (FLAGS_open_loop && FLAGS_qps <= 0 && options->qps_schedule.empty()) {
+        LOG(ERROR) << "-open_loop requires positive -qps or -qps_schedule";
+        return false;
+    }
+    // Choose threads for the highest qps in the schedule.
+    double max_qps = FLAGS_qps;
+    for (size_t i = 0; i < options->qps_schedule.size(); ++i) {
+        if (i == 0 || options->qps_schedule[i].qps > max_qps) {
+            max_qps = options->qps_schedule[i].qps;
+        }
+    }
     if (FLAGS_thread_num > 0) {
         options->test_thread_num = FLAGS_thread_num;
     } else {
-        if (FLAGS_qps <= 0) { // unlimited qps
+        if (max_qps <= 0) { // unlimited qps
             options->test_thread_num = 50;
         } else {
-            options->test_thread_num = FLAGS_qps / 10000;
+            options->test_thread_num = (int)(max_qps / 10000);
             if (options->test_thread_num < 1) {
                 options->test_thread_num = 1;
             }
@@ -107,12 +158,19 @@ int main(int argc, char* argv[]) {
     }
 
     rpc_press->start();
-    if (FLAGS_duration <= 0) {
+    int duration = FLAGS_duration;
+    if (!options.qps_schedule.empty()) {
+        duration = 0;
+        for (size_t i = 0; i < options.qps_schedule.size(); ++i) {
+            duration += options.qps_schedule[i].duration_s;
+        }
+    }
+    if (duration <= 0) {
         while (!brpc::IsAskedToQuit()) {
             sleep(1);
         }
     } else {
-        sleep(FLAGS_duration);
+        sleep(duration);
     }
     rpc_press->stop();
     // NOTE(gejun): Can't delete rpc_press on exit. It's probably
@@ -16,14 +16,18 @@
 // under the License.
 
 #include <stdio.h>
+#include <math.h>
 #include <pthread.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <algorithm>
+#include <limits>
 #include <bthread/bthread.h>
 #include <butil/file_util.h>                     // butil::FilePath
+#include <butil/fast_rand.h>
 #include <butil/time.h>
 #include <brpc/channel.h>
 #include <brpc/controller.h>
@@ -88,7 +92,8 @@ RpcPress::RpcPress()
     : _pbrpc_client(NULL)
     , _started(false)
     , _stop(false)
-    , _output_json(NULL) {
+    , _output_json(NULL)
+    , _begin_us(0) {
 }
 
 RpcPress::~RpcPress() {
@@ -97,6 +102,8 @@ RpcPress::~RpcPress() {
         _output_json = NULL;
     }
     delete _importer;
+    // Histograms are not deleted for the same reason as RpcPress, see
+    // comments in main().
 }
 
 int RpcPress::init(const PressOptions* options) {
@@ -173,6 +180,20 @@ int RpcPress::init(const PressOptions* options) {
         return -1;
     }
     LOG(INFO) << "Loaded " << _msgs.size() << " requests";
+    if (_options.open_loop) {
+        _steps = _options.qps_schedule;
+        if (_steps.empty()) {
+            QpsStep step = { _options.test_req_rate, 0 };
+            _steps.push_back(step);
+        }
+        for (size_t i = 0; i < _steps.size(); ++i) {
+            if (_steps[i].qps <= 0) {
+                LOG(ERROR) << "qps must be positive in open-loop presses";
+                return -1;
+            }
+            _step_latencies.push_back(new LatencyHistogram);
+        }
+    }
     _latency_recorder.expose("rpc_press");
     _error_count.expose("rpc_press_error_count");
     return 0;
@@ -186,10 +207,14 @@ void* RpcPress::sync_call_thread(void* arg) {
 void RpcPress::handle_response(brpc::Controller* cntl, 
                                Message* request,
                                Message* response, 
-                               int64_t start_time){
+                               int64_t start_time,
+                               LatencyHistogram* histogram){
     if (!cntl->Failed()){
-        int64_t rpc_call_time_us = butil::gettimeofday_us() - start_time;
+        int64_t rpc_call_time_us = butil::cpuwide_time_us() - start_time;
         _latency_recorder << rpc_call_time_us;
+        if (histogram) {
+            histogram->record(rpc_call_time_us);
+        }
 
         if (_output_json) {
             std::string response_json;
@@ -232,14 +257,15 @@ void RpcPress::sync_client() {
         msg_index = (msg_index + _options.test_thread_num) % _msgs.size();
         Message* request = _msgs[msg_index];
         Message* response = _pbrpc_client->get_output_message();
-        const int64_t start_time = butil::gettimeofday_us();
+        const int64_t start_time = butil::cpuwide_time_us();
         google::protobuf::Closure* done = brpc::NewCallback<
             RpcPress, 
             RpcPress*, 
             brpc::Controller*, 
             Message*, 
-            Message*, int64_t>
-            (this, &RpcPress::handle_response, cntl, request, response, start_time);
+            Message*, int64_t, LatencyHistogram*>
+            (this, &RpcPress::handle_response, cntl, request, response,
+             start_time, (LatencyHistogram*)NULL);
         const brpc::CallId cid1 = cntl->call_id();
         _pbrpc_client->call_method(cntl, request, response, done);
         _sent_count << 1;
@@ -266,11 +292,88 @@ void RpcPress::sync_client() {
     }
 }
 
+void* RpcPress::open_loop_thread(void* arg) {
+    ((RpcPress*)arg)->open_loop_client();
+    return NULL;
+}
+
+void RpcPress::open_loop_client() {
+    const int thread_num = _options.test_thread_num;
+    const int thread_index = g_thread_count.fetch_add(1, butil::memory_order_relaxed);
+    int msg_index = thread_index;
+    size_t step = 0;
+    int64_t step_end_us = (_steps[0].duration_s > 0 ?
+                           _begin_us + _steps[0].duration_s * 1000000L :
+                           std::numeric_limits<int64_t>::max());
+    // Each thread sends 1/thread_num of the load. Superposition of poisson
+    // processes is still a poisson process, constant intervals are
+    // staggered between threads.
+    int64_t intended_us = _begin_us;
+    bool first = true;
+    if (!_options.poisson_arrival) {
+        intended_us += (int64_t)(1000000.0 * thread_index / _steps[0].qps);
+    }
+    while (!_stop) {
+        const double interval_us = 1000000.0 * thread_num / _steps[step].qps;
+        if (_options.poisson_arrival) {
+            intended_us += (int64_t)(-log(1 - butil::fast_rand_double()) * interval_us);
+        } else if (!first) {
+            intended_us += (int64_t)interval_us;
+        }
+        first = false;
+        while (intended_us >= step_end_us) {
+            if (++step >= _steps.size()) {
+                return;
+            }
+            step_end_us = (_steps[step].duration_s > 0 ?
+                           step_end_us + _steps[step].duration_s * 1000000L :
+                           std::numeric_limits<int64_t>::max());
+        }
+        // Sleep in pieces to notice _stop in time. Never skip requests when
+        // running late, the delays are part of latencies.
+        int64_t now_us;
+        while (!_stop && (now_us = butil::cpuwide_time_us()) < intended_us) {
+            usleep(std::min(intended_us - now_us, (int64_t)100000));
+        }
+        if (_stop) {
+            break;
+        }
+        brpc::Controller* cntl = new brpc::Controller;
+        msg_index = (msg_index + thread_num) % _msgs.size();
+        Message* request = _msgs[msg_index];
+        Message* response = _pbrpc_client->get_output_message();
+        google::protobuf::Closure* done = brpc::NewCallback<
+            RpcPress, 
+            RpcPress*, 
+            brpc::Controller*, 
+            Message*, 
+            Message*, int64_t, LatencyHistogram*>
+            (this, &RpcPress::handle_response, cntl, request, response,
+             intended_us, _step_latencies[step]);
+        _pbrpc_client->call_method(cntl, request, response, done);
+        _sent_count << 1;
+    }
+}
+
+void RpcPress::print_open_loop_result() {
+    // Wait for pending responses, which are probably the slowest ones.
+    usleep(std::min(_options.timeout_ms, 10000) * 1000L);
+    printf("[Open-loop latencies measured from intended send times]\n");
+    for (size_t i = 0; i < _steps.size(); ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "  qps=%-10.0f", _steps[i].qps);
+        _step_latencies[i]->describe(name, stdout);
+    }
+}
+
 int RpcPress::start() {
     _ttid.resize(_options.test_thread_num);
+    _begin_us = butil::cpuwide_time_us();
     int ret = 0;
     for (int i = 0; i < _options.test_thread_num; i++) {
-        if ((ret = pthread_create(&_ttid[i], NULL, sync_call_thread, this)) != 0) {
+        if ((ret = pthread_create(&_ttid[i], NULL,
+                                  (_options.open_loop ? open_loop_thread :
+                                   sync_call_thread), this)) != 0) {
             LOG(ERROR) << "Fail to create sending threads";
             return -1;
         }
@@ -295,6 +398,9 @@ int RpcPress::stop() {
         pthread_join(_ttid[i], NULL);
     }
     _info_thr.stop();
+    if (_options.open_loop) {
+        print_open_loop_result();
+    }
     return 0;
 }
 } //namespace
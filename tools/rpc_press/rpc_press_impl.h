@@ -25,11 +25,18 @@
 #include <bvar/bvar.h>
 #include <brpc/channel.h>
 #include "info_thread.h"
+#include "latency_histogram.h"
 #include "pb_util.h"
 
 namespace pbrpcframework {
 class JsonUtil;
 
+// Send at `qps' for `duration_s' seconds.
+struct QpsStep {
+    double qps;
+    int duration_s;
+};
+
 struct PressOptions {
     std::string service;         //service name (packet.rpcservice)
     std::string method;          //method name (rpc service method)
@@ -56,6 +63,16 @@ struct PressOptions {
     std::string lb_policy; // "rr", "Policy of load balance rr ||random"
     std::string proto_file;
     std::string proto_includes;
+    // Send requests at intended times regardless of previous responses and
+    // measure latencies from the intended times, so that a slow server
+    // does not slow down the press and hide its latencies.
+    bool open_loop;
+    // Intervals between intended times are exponentially distributed
+    // instead of being constant. Only for open_loop.
+    bool poisson_arrival;
+    // Steps of qps to ramp the load, only for open_loop. test_req_rate is
+    // used when this is empty.
+    std::vector<QpsStep> qps_schedule;
     
     PressOptions() :
         server_type(0),
@@ -67,7 +84,9 @@ struct PressOptions {
         request_compress_type(0),
         response_compress_type(0),
         attachment_size(0),
-        auth(false)
+        auth(false),
+        open_loop(false),
+        poisson_arrival(false)
     {}
 };
 
@@ -117,11 +136,17 @@ private:
     
     bool new_pbrpc_press_client_by_client_type(int client_type);
     void sync_client();
+    void open_loop_client();
+    // `histogram' is the one of the qps step that the request was sent in,
+    // NULL for closed-loop presses.
     void handle_response(brpc::Controller* cntl,
                          google::protobuf::Message* request,
                          google::protobuf::Message* response,
-                         int64_t start_time_ns);
+                         int64_t start_time_us,
+                         LatencyHistogram* histogram);
     static void* sync_call_thread(void* arg);
+    static void* open_loop_thread(void* arg);
+    void print_open_loop_result();
 
     bvar::LatencyRecorder _latency_recorder;
     bvar::Adder<int64_t> _error_count;
@@ -136,6 +161,10 @@ private:
     google::protobuf::DynamicMessageFactory _factory;
     std::vector<pthread_t> _ttid;
     brpc::InfoThread _info_thr;
+    // Steps of the open-loop press and latencies of requests sent in them.
+    std::vector<QpsStep> _steps;
+    std::vector<LatencyHistogram*> _step_latencies;
+    int64_t _begin_us;
 };
 }
 #endif // PBRPCPRESS_PBRPC_PRESS_H
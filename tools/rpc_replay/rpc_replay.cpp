@@ -16,20 +16,26 @@
 // under the License.
 
 
+#include <algorithm>
+#include <sstream>
 #include <gflags/gflags.h>
 #include <butil/logging.h>
 #include <butil/time.h>
 #include <butil/macros.h>
 #include <butil/file_util.h>
+#include <butil/string_splitter.h>
 #include <bvar/bvar.h>
 #include <bthread/bthread.h>
 #include <brpc/channel.h>
 #include <brpc/server.h>
 #include <brpc/rpc_dump.h>
 #include <brpc/serialized_request.h>
+#include <brpc/serialized_response.h>
 #include "info_thread.h"
 
-DEFINE_string(dir, "", "The directory of dumped requests");
+DEFINE_string(dir, "", "The directories of dumped requests, separated by "
+              "comma. With -timed, directories are replayed in parallel and "
+              "aligned to start at the same time");
 DEFINE_int32(times, 1, "Repeat replaying for so many times");
 DEFINE_int32(qps, 0, "Limit QPS if this flag is positive");
 DEFINE_int32(thread_num, 0, "Number of threads for replaying");
@@ -41,10 +47,52 @@ DEFINE_string(load_balancer, "", "The algorithm for load balancing");
 DEFINE_int32(timeout_ms, 100, "RPC timeout in milliseconds");
 DEFINE_int32(max_retry, 3, "Maximum retry times");
 DEFINE_int32(dummy_port, 8899, "Port of dummy server(to monitor replaying)");
+DEFINE_bool(timed, false, "Send requests with the original intervals between "
+            "them. -qps is ignored and -thread_num threads are used for each "
+            "directory");
+DEFINE_double(speed, 1.0, "Divide original intervals by this value when "
+              "-timed is on, e.g. 2 replays twice as fast");
+DEFINE_string(methods, "", "Only replay these methods, separated by comma. "
+              "A method can be `service.method' or just `method'");
+DEFINE_bool(diff_response, false, "Compare responses with the ones dumped "
+            "along with the requests (-rpc_dump_response of the server)");
+DEFINE_int32(max_logged_diffs, 10, "Log at most so many different responses");
 
 bvar::LatencyRecorder g_latency_recorder("rpc_replay");
 bvar::Adder<int64_t> g_error_count("rpc_replay_error_count");
 bvar::Adder<int64_t> g_sent_count;
+bvar::Adder<int64_t> g_compared_count("rpc_replay_compared_count");
+bvar::Adder<int64_t> g_diff_count("rpc_replay_diff_count");
+static butil::atomic<int> g_logged_diffs(0);
+
+static std::vector<std::string> g_dirs;
+static std::vector<std::string> g_methods;
+
+// Name of the method that `meta' was sent to.
+static std::string method_name_of(const brpc::RpcDumpMeta& meta) {
+    if (meta.service_name().empty()) {
+        return meta.method_name();
+    }
+    if (meta.has_method_name()) {
+        return meta.service_name() + "." + meta.method_name();
+    }
+    std::ostringstream os;
+    os << meta.service_name() << '#' << meta.method_index();
+    return os.str();
+}
+
+static bool should_replay(const brpc::RpcDumpMeta& meta) {
+    if (g_methods.empty()) {
+        return true;
+    }
+    const std::string full_name = method_name_of(meta);
+    for (size_t i = 0; i < g_methods.size(); ++i) {
+        if (g_methods[i] == full_name || g_methods[i] == meta.method_name()) {
+            return true;
+        }
+    }
+    return false;
+}
 
 // Include channels for all protocols that support both client and server.
 class ChannelGroup {
@@ -106,13 +154,46 @@ ChannelGroup::~ChannelGroup() {
     _chans.clear();
 }
 
-static void handle_response(brpc::Controller* cntl, int64_t start_time,
+// Compare the response with the dumped one if there's.
+static void compare_response(brpc::Controller* cntl,
+                             const brpc::SerializedResponse* res) {
+    const brpc::SampledRequest* sample = cntl->sampled_request();
+    if (res == NULL || sample == NULL || !sample->meta.has_error_code()) {
+        return;
+    }
+    g_compared_count << 1;
+    const char* diff = NULL;
+    if (sample->meta.error_code() != cntl->ErrorCode()) {
+        diff = "error_code";
+    } else if (!cntl->Failed() &&
+               !res->serialized_data().equals(sample->meta.response())) {
+        diff = "response";
+    } else {
+        return;
+    }
+    g_diff_count << 1;
+    if (g_logged_diffs.fetch_add(1, butil::memory_order_relaxed) <
+        FLAGS_max_logged_diffs) {
+        LOG(WARNING) << "Different " << diff << " of "
+                     << method_name_of(sample->meta)
+                     << ": dumped error_code=" << sample->meta.error_code()
+                     << " size=" << sample->meta.response().size()
+                     << ", replayed error_code=" << cntl->ErrorCode()
+                     << " size=" << res->serialized_data().size();
+    }
+}
+
+static void handle_response(brpc::Controller* cntl,
+                            brpc::SerializedResponse* res,
+                            int64_t start_time,
                             bool sleep_on_error/*note*/) {
     // TODO(gejun): some bthreads are starved when new bthreads are created 
     // continuously, which happens when server is down and RPC keeps failing.
     // Sleep a while on error to avoid that now.
-    const int64_t end_time = butil::gettimeofday_us();
+    const int64_t end_time = butil::cpuwide_time_us();
     const int64_t elp = end_time - start_time;
+    compare_response(cntl, res);
+    delete res;
     if (!cntl->Failed()) {
         g_latency_recorder << elp;
     } else {
@@ -140,26 +221,143 @@ static void* replay_thread(void* arg) {
     }
     timeq.push_back(butil::gettimeofday_us());
     for (int i = 0; !brpc::IsAskedToQuit() && i < FLAGS_times; ++i) {
-        brpc::SampleIterator it(FLAGS_dir);
-        int j = 0;
-        for (brpc::SampledRequest* sample = it.Next();
-             !brpc::IsAskedToQuit() && sample != NULL; sample = it.Next(), ++j) {
-            std::unique_ptr<brpc::SampledRequest> sample_guard(sample);
-            if ((j % FLAGS_thread_num) != thread_offset) {
-                continue;
+        for (size_t d = 0; !brpc::IsAskedToQuit() && d < g_dirs.size(); ++d) {
+            brpc::SampleIterator it(g_dirs[d]);
+            int j = 0;
+            for (brpc::SampledRequest* sample = it.Next();
+                 !brpc::IsAskedToQuit() && sample != NULL; sample = it.Next(), ++j) {
+                std::unique_ptr<brpc::SampledRequest> sample_guard(sample);
+                if ((j % FLAGS_thread_num) != thread_offset ||
+                    !should_replay(sample->meta)) {
+                    continue;
+                }
+                brpc::Channel* chan =
+                    chan_group->channel(sample->meta.protocol_type());
+                if (chan == NULL) {
+                    LOG(ERROR) << "No channel on protocol="
+                               << sample->meta.protocol_type();
+                    continue;
+                }
+                
+                brpc::Controller* cntl = new brpc::Controller;
+                req.Clear();
+                
+                cntl->reset_sampled_request(sample_guard.release());
+                if (sample->meta.attachment_size() > 0) {
+                    sample->request.cutn(
+                        &req.serialized_data(),
+                        sample->request.size() - sample->meta.attachment_size());
+                    cntl->request_attachment() = sample->request.movable();
+                } else {
+                    req.serialized_data() = sample->request.movable();
+                }
+                g_sent_count << 1;
+                brpc::SerializedResponse* res =
+                    (FLAGS_diff_response ? new brpc::SerializedResponse : NULL);
+                const int64_t start_time = butil::cpuwide_time_us();
+                if (FLAGS_qps <= 0) {
+                    chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
+                            cntl, &req, res, NULL);
+                    handle_response(cntl, res, start_time, true);
+                } else {
+                    google::protobuf::Closure* done = brpc::NewCallback(
+                        handle_response, cntl, res, start_time, false);
+                    chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
+                            cntl, &req, res, done);
+                    const int64_t end_time = butil::gettimeofday_us();
+                    int64_t expected_elp = 0;
+                    int64_t actual_elp = 0;
+                    timeq.push_back(end_time);
+                    if (timeq.size() > MAX_QUEUE_SIZE) {
+                        actual_elp = end_time - timeq.front();
+                        timeq.pop_front();
+                        expected_elp = (size_t)(1000000 * timeq.size() / req_rate);
+                    } else {
+                        actual_elp = end_time - timeq.front();
+                        expected_elp = (size_t)(1000000 * (timeq.size() - 1) / req_rate);
+                    }
+                    if (actual_elp < expected_elp) {
+                        bthread_usleep(expected_elp - actual_elp);
+                    }
+                }
             }
+        }
+    }
+    return NULL;
+}
+
+// Requests of a directory sorted by received time, for -timed.
+struct TimedReplay {
+    ChannelGroup* chan_group;
+    std::vector<brpc::SampledRequest*> samples;
+    int thread_offset;
+    // When the replaying starts, in cpuwide time.
+    int64_t begin_us;
+};
+
+static bool received_earlier(const brpc::SampledRequest* a,
+                             const brpc::SampledRequest* b) {
+    return a->meta.received_us() < b->meta.received_us();
+}
+
+static int load_samples(const std::string& dir,
+                        std::vector<brpc::SampledRequest*>* samples) {
+    brpc::SampleIterator it(dir);
+    for (brpc::SampledRequest* sample = it.Next(); sample != NULL;
+         sample = it.Next()) {
+        if (!sample->meta.has_received_us()) {
+            LOG(ERROR) << "Requests in " << dir << " don't have received "
+                "time, they're dumped by an older version";
+            delete sample;
+            return -1;
+        }
+        if (should_replay(sample->meta)) {
+            samples->push_back(sample);
+        } else {
+            delete sample;
+        }
+    }
+    // Samples are not read in the order of being dumped.
+    std::stable_sort(samples->begin(), samples->end(), received_earlier);
+    return 0;
+}
+
+static void* timed_replay_thread(void* arg) {
+    TimedReplay* replay = static_cast<TimedReplay*>(arg);
+    const std::vector<brpc::SampledRequest*>& samples = replay->samples;
+    if (samples.empty()) {
+        return NULL;
+    }
+    const int64_t first_us = samples.front()->meta.received_us();
+    // Rounds are played one after another.
+    const int64_t round_us = (int64_t)(
+        (samples.back()->meta.received_us() - first_us + 1) / FLAGS_speed);
+    brpc::SerializedRequest req;
+    for (int i = 0; !brpc::IsAskedToQuit() && i < FLAGS_times; ++i) {
+        for (size_t j = replay->thread_offset;
+             !brpc::IsAskedToQuit() && j < samples.size();
+             j += FLAGS_thread_num) {
+            const brpc::SampledRequest* orig = samples[j];
             brpc::Channel* chan =
-                chan_group->channel(sample->meta.protocol_type());
+                replay->chan_group->channel(orig->meta.protocol_type());
             if (chan == NULL) {
                 LOG(ERROR) << "No channel on protocol="
-                           << sample->meta.protocol_type();
+                           << orig->meta.protocol_type();
                 continue;
             }
-            
+            const int64_t intended_us = replay->begin_us + i * round_us +
+                (int64_t)((orig->meta.received_us() - first_us) / FLAGS_speed);
+            const int64_t now_us = butil::cpuwide_time_us();
+            if (intended_us > now_us) {
+                bthread_usleep(intended_us - now_us);
+            }
+            // The sample is owned by cntl, copy it for later rounds.
+            brpc::SampledRequest* sample = new brpc::SampledRequest;
+            sample->meta = orig->meta;
+            sample->request = orig->request;
             brpc::Controller* cntl = new brpc::Controller;
+            cntl->reset_sampled_request(sample);
             req.Clear();
-            
-            cntl->reset_sampled_request(sample_guard.release());
             if (sample->meta.attachment_size() > 0) {
                 sample->request.cutn(
                     &req.serialized_data(),
@@ -169,32 +367,14 @@ static void* replay_thread(void* arg) {
                 req.serialized_data() = sample->request.movable();
             }
             g_sent_count << 1;
-            const int64_t start_time = butil::gettimeofday_us();
-            if (FLAGS_qps <= 0) {
-                chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
-                        cntl, &req, NULL/*ignore response*/, NULL);
-                handle_response(cntl, start_time, true);
-            } else {
-                google::protobuf::Closure* done =
-                    brpc::NewCallback(handle_response, cntl, start_time, false);
-                chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
-                        cntl, &req, NULL/*ignore response*/, done);
-                const int64_t end_time = butil::gettimeofday_us();
-                int64_t expected_elp = 0;
-                int64_t actual_elp = 0;
-                timeq.push_back(end_time);
-                if (timeq.size() > MAX_QUEUE_SIZE) {
-                    actual_elp = end_time - timeq.front();
-                    timeq.pop_front();
-                    expected_elp = (size_t)(1000000 * timeq.size() / req_rate);
-                } else {
-                    actual_elp = end_time - timeq.front();
-                    expected_elp = (size_t)(1000000 * (timeq.size() - 1) / req_rate);
-                }
-                if (actual_elp < expected_elp) {
-                    bthread_usleep(expected_elp - actual_elp);
-                }
-            }
+            brpc::SerializedResponse* res =
+                (FLAGS_diff_response ? new brpc::SerializedResponse : NULL);
+            // Latencies are measured from the intended time so that delays
+            // of sending are counted.
+            google::protobuf::Closure* done = brpc::NewCallback(
+                handle_response, cntl, res, intended_us, false);
+            chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
+                             cntl, &req, res, done);
         }
     }
     return NULL;
@@ -204,11 +384,24 @@ int main(int argc, char* argv[]) {
     // Parse gflags. We recommend you to use gflags as well.
     GFLAGS_NS::ParseCommandLineFlags(&argc, &argv, true);
 
-    if (FLAGS_dir.empty() ||
-        !butil::DirectoryExists(butil::FilePath(FLAGS_dir))) {
+    for (butil::StringSplitter sp(FLAGS_dir.c_str(), ','); sp; ++sp) {
+        g_dirs.push_back(std::string(sp.field(), sp.length()));
+        if (!butil::DirectoryExists(butil::FilePath(g_dirs.back()))) {
+            LOG(ERROR) << "Fail to find directory=" << g_dirs.back();
+            return -1;
+        }
+    }
+    if (g_dirs.empty()) {
         LOG(ERROR) << "--dir=<dir-of-dumped-files> is required";
         return -1;
     }
+    for (butil::StringSplitter sp(FLAGS_methods.c_str(), ','); sp; ++sp) {
+        g_methods.push_back(std::string(sp.field(), sp.length()));
+    }
+    if (FLAGS_timed && FLAGS_speed <= 0) {
+        LOG(ERROR) << "-speed must be positive";
+        return -1;
+    }
 
     if (FLAGS_dummy_port >= 0) {
         brpc::StartDummyServerAt(FLAGS_dummy_port);
@@ -221,7 +414,9 @@ int main(int argc, char* argv[]) {
     }
 
     if (FLAGS_thread_num <= 0) {
-        if (FLAGS_qps <= 0) { // unlimited qps
+        if (FLAGS_timed) {
+            FLAGS_thread_num = 1;
+        } else if (FLAGS_qps <= 0) { // unlimited qps
             FLAGS_thread_num = 50;
         } else {
             FLAGS_thread_num = FLAGS_qps / 10000;
@@ -234,21 +429,49 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // Arguments of threads.
+    std::vector<void*> args;
+    std::vector<TimedReplay> timed_replays;
+    void* (*thread_fn)(void*) = replay_thread;
+    if (FLAGS_timed) {
+        std::vector<std::vector<brpc::SampledRequest*> > samples(g_dirs.size());
+        for (size_t d = 0; d < g_dirs.size(); ++d) {
+            if (load_samples(g_dirs[d], &samples[d]) != 0) {
+                return -1;
+            }
+            LOG(INFO) << "Loaded " << samples[d].size() << " requests from "
+                      << g_dirs[d];
+        }
+        // Leave some time for creating threads.
+        const int64_t begin_us = butil::cpuwide_time_us() + 100000L;
+        timed_replays.resize(g_dirs.size() * FLAGS_thread_num);
+        for (size_t i = 0; i < timed_replays.size(); ++i) {
+            timed_replays[i].chan_group = &chan_group;
+            timed_replays[i].samples = samples[i / FLAGS_thread_num];
+            timed_replays[i].thread_offset = i % FLAGS_thread_num;
+            timed_replays[i].begin_us = begin_us;
+            args.push_back(&timed_replays[i]);
+        }
+        thread_fn = timed_replay_thread;
+    } else {
+        args.assign(FLAGS_thread_num, &chan_group);
+    }
+
     std::vector<bthread_t> bids;
     std::vector<pthread_t> pids;
     if (!FLAGS_use_bthread) {
-        pids.resize(FLAGS_thread_num);
-        for (int i = 0; i < FLAGS_thread_num; ++i) {
-            if (pthread_create(&pids[i], NULL, replay_thread, &chan_group) != 0) {
+        pids.resize(args.size());
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (pthread_create(&pids[i], NULL, thread_fn, args[i]) != 0) {
                 LOG(ERROR) << "Fail to create pthread";
                 return -1;
             }
         }
     } else {
-        bids.resize(FLAGS_thread_num);
-        for (int i = 0; i < FLAGS_thread_num; ++i) {
+        bids.resize(args.size());
+        for (size_t i = 0; i < args.size(); ++i) {
             if (bthread_start_background(
-                    &bids[i], NULL, replay_thread, &chan_group) != 0) {
+                    &bids[i], NULL, thread_fn, args[i]) != 0) {
                 LOG(ERROR) << "Fail to create bthread";
                 return -1;
             }
@@ -265,7 +488,7 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    for (int i = 0; i < FLAGS_thread_num; ++i) {
+    for (size_t i = 0; i < args.size(); ++i) {
         if (!FLAGS_use_bthread) {
             pthread_join(pids[i], NULL);
         } else {